@@ -27,53 +27,195 @@
 #include "core/sleep.hh"
 #include "core/align.hh"
 #include "core/timer.hh"
+#include "util/conversions.hh"
+#include "util/latency_histogram.hh"
 #include <chrono>
 #include <boost/range/irange.hpp>
 #include <boost/algorithm/string.hpp>
 #include <iomanip>
 #include <random>
 
+// Runs classes of reads against a file and reports how the I/O scheduler
+// shared the disk between them. Each class is described by --class, as
+// comma-separated key=value pairs:
+//
+//   shares=N          the class' shares (required)
+//   sizes=4k/128k     request sizes, picked at random ...
+//   mix=9/1           ... with these weights (default: equal)
+//   parallelism=N     requests kept in flight (default: --parallelism)
+//   start=S, stop=S   seconds into the run the class joins and leaves
+//   burst=ON/OFF      milliseconds of issuing then of idling, repeated
+//   p99=MS            latency objective for the 99th percentile
+//
+// Classes that issue continuously are expected to get the disk in
+// proportion to their shares while all of them run. The disk time a request
+// takes is estimated as the reactor does, from --io-read-bandwidth and
+// --io-read-iops when given. A class that strays from its expected share
+// by more than --share-tolerance, or misses its p99 objective, fails the
+// run, which then exits with a non-zero status.
+
 using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
 
 static auto random_seed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 static std::default_random_engine random_generator(random_seed);
 
+static size_t parse_size(const std::string& s) {
+    if (!s.empty() && isdigit(s.back())) {
+        return boost::lexical_cast<size_t>(s);
+    }
+    return parse_memory_size(s);
+}
+
+struct class_spec {
+    uint32_t shares = 0;
+    std::vector<size_t> sizes;
+    std::vector<double> mix;
+    unsigned parallelism = 0;
+    std::chrono::milliseconds start{0};
+    // Zero for the end of the run
+    std::chrono::milliseconds stop{0};
+    std::chrono::milliseconds burst_on{0};
+    std::chrono::milliseconds burst_off{0};
+    std::chrono::microseconds p99_goal{0};
+
+    bool continuous() const {
+        return !burst_on.count();
+    }
+
+    static class_spec parse(const std::string& desc) {
+        class_spec spec;
+        std::vector<std::string> pairs;
+        boost::split(pairs, desc, boost::is_any_of(","));
+        for (auto& pair : pairs) {
+            auto eq = pair.find('=');
+            if (eq == std::string::npos) {
+                throw std::invalid_argument(sprint("bad class description \"%s\": expected key=value", desc));
+            }
+            auto key = pair.substr(0, eq);
+            auto value = pair.substr(eq + 1);
+            std::vector<std::string> values;
+            boost::split(values, value, boost::is_any_of("/"));
+            if (key == "shares") {
+                spec.shares = boost::lexical_cast<uint32_t>(value);
+            } else if (key == "sizes") {
+                for (auto& v : values) {
+                    spec.sizes.push_back(align_up(parse_size(v), size_t(4096)));
+                }
+            } else if (key == "mix") {
+                for (auto& v : values) {
+                    spec.mix.push_back(boost::lexical_cast<double>(v));
+                }
+            } else if (key == "parallelism") {
+                spec.parallelism = boost::lexical_cast<unsigned>(value);
+            } else if (key == "start") {
+                spec.start = std::chrono::milliseconds(unsigned(boost::lexical_cast<double>(value) * 1000));
+            } else if (key == "stop") {
+                spec.stop = std::chrono::milliseconds(unsigned(boost::lexical_cast<double>(value) * 1000));
+            } else if (key == "burst" && values.size() == 2) {
+                spec.burst_on = std::chrono::milliseconds(boost::lexical_cast<unsigned>(values[0]));
+                spec.burst_off = std::chrono::milliseconds(boost::lexical_cast<unsigned>(values[1]));
+            } else if (key == "p99") {
+                spec.p99_goal = std::chrono::microseconds(unsigned(boost::lexical_cast<double>(value) * 1000));
+            } else {
+                throw std::invalid_argument(sprint("bad class description \"%s\": unknown key %s", desc, key));
+            }
+        }
+        if (!spec.shares) {
+            throw std::invalid_argument(sprint("bad class description \"%s\": shares missing", desc));
+        }
+        if (!spec.mix.empty() && spec.mix.size() != spec.sizes.size()) {
+            throw std::invalid_argument(sprint("bad class description \"%s\": mix needs a weight per size", desc));
+        }
+        return spec;
+    }
+};
+
+struct test_config {
+    unsigned parallelism;
+    std::chrono::seconds duration;
+    size_t reqsize;
+    double share_tolerance;
+    // Disk rates the cost of a request is estimated from; 0 if unknown
+    double read_bytes_rate;
+    double read_ops_rate;
+};
+
 class context {
     struct class_data {
         static int idgen();
 
-        uint32_t _shares;
+        class_spec _spec;
         io_priority_class _iop;
-        unsigned _final = 0;
+        std::discrete_distribution<unsigned> _size_distribution;
+        clock_type::time_point _start;
+        clock_type::time_point _stop;
 
         size_t _bytes = 0;
-        std::chrono::steady_clock::time_point _start = {};
+        uint64_t _ops = 0;
+        // Estimated disk time of the requests completed while all the
+        // continuous classes ran
+        double _window_cost = 0;
+        latency_histogram _latency;
 
-        class_data(uint32_t shares)
-            : _shares(shares)
-            , _iop(engine().register_one_priority_class(sprint("test-class-%d", idgen()), shares))
+        class_data(class_spec spec)
+            : _spec(std::move(spec))
+            , _iop(engine().register_one_priority_class(sprint("test-class-%d", idgen()), _spec.shares))
+            , _size_distribution(_spec.mix.begin(), _spec.mix.end())
         {}
     };
     std::vector<class_data> _cl;
 
     sstring _dir;
-    unsigned _parallelism;
-    std::chrono::seconds _duration;
-    size_t _reqsize;
+    test_config _config;
+    size_t _max_reqsize;
+    clock_type::time_point _window_start;
+    clock_type::time_point _window_end;
+    unsigned _failures = 0;
 
-    semaphore _finished;
     file _fq;
     std::uniform_int_distribution<uint32_t> _pos_distribution;
+private:
+    double request_cost(size_t len) const {
+        if (!_config.read_bytes_rate || !_config.read_ops_rate) {
+            return 1 + len / (16 << 10);
+        }
+        return 1 / _config.read_ops_rate + len / _config.read_bytes_rate;
+    }
+
+    // Whether the class is in the idle part of a burst cycle, and if so
+    // how long until it issues again
+    clock_type::duration idle_for(class_data& cl, clock_type::time_point now) const {
+        if (cl._spec.continuous()) {
+            return clock_type::duration(0);
+        }
+        auto cycle = cl._spec.burst_on + cl._spec.burst_off;
+        auto phase = (now - cl._start) % cycle;
+        return phase < cl._spec.burst_on ? clock_type::duration(0) : cycle - phase;
+    }
 public:
-    context(sstring dir, std::vector<uint32_t> shares, unsigned parallelism, unsigned duration, size_t reqsize)
-            : _cl(shares.begin(), shares.end())
-            , _dir(dir)
-            , _parallelism(parallelism)
-            , _duration(duration)
-            , _reqsize(align_up(reqsize, 4096ul))
-            , _finished(0)
-            , _pos_distribution(0, parallelism * shares.size() - 1)
+    context(sstring dir, std::vector<class_spec> classes, test_config config, unsigned positions)
+            : _dir(dir)
+            , _config(config)
+            , _pos_distribution(0, positions - 1)
     {
+        _max_reqsize = 0;
+        for (auto& spec : classes) {
+            if (spec.sizes.empty()) {
+                spec.sizes.push_back(_config.reqsize);
+            }
+            if (spec.mix.empty()) {
+                spec.mix.assign(spec.sizes.size(), 1);
+            }
+            if (!spec.parallelism) {
+                spec.parallelism = _config.parallelism;
+            }
+            if (!spec.stop.count()) {
+                spec.stop = _config.duration;
+            }
+            _max_reqsize = std::max(_max_reqsize, *std::max_element(spec.sizes.begin(), spec.sizes.end()));
+            _cl.emplace_back(std::move(spec));
+        }
     }
 
     future<> stop() { return make_ready_future<>(); }
@@ -84,45 +226,97 @@ class context {
     }
 
     future<> read_class(class_data& cl) {
-        auto bufptr = allocate_aligned_buffer<char>(_reqsize, 4096);
+        auto size = cl._spec.sizes[cl._size_distribution(random_generator)];
+        auto bufptr = allocate_aligned_buffer<char>(size, 4096);
         auto buf = bufptr.get();
-        auto pos = _pos_distribution(random_generator) * _reqsize;
-        return _fq.dma_read(pos, buf, _reqsize, cl._iop).then([bufptr = std::move(bufptr), &cl, this] (size_t size) {
+        auto pos = uint64_t(_pos_distribution(random_generator)) * _max_reqsize;
+        auto issued = clock_type::now();
+        return _fq.dma_read(pos, buf, size, cl._iop).then([bufptr = std::move(bufptr), &cl, issued, this] (size_t size) {
+            auto now = clock_type::now();
             cl._bytes += size;
-            if ((std::chrono::steady_clock::now() - cl._start) < _duration) {
-                return this->read_class(cl);
-            } else {
-                return make_ready_future<>();
+            cl._ops++;
+            cl._latency.add(now - issued);
+            if (now >= _window_start && now < _window_end) {
+                cl._window_cost += request_cost(size);
             }
         });
     }
 
+    future<> run_class(class_data& cl) {
+        auto parallelism = boost::irange(0u, cl._spec.parallelism);
+        return parallel_for_each(parallelism.begin(), parallelism.end(), [this, &cl] (auto dummy) {
+            return do_until([&cl] { return clock_type::now() >= cl._stop; }, [this, &cl] {
+                auto now = clock_type::now();
+                auto idle = idle_for(cl, now);
+                if (idle.count()) {
+                    return sleep(std::min(idle, clock_type::duration(cl._stop - now)));
+                }
+                return this->read_class(cl);
+            });
+        });
+    }
+
     future<> issue_reads() {
+        auto start = clock_type::now();
+        _window_start = start;
+        _window_end = start + _config.duration;
+        for (auto& cl : _cl) {
+            cl._start = start + cl._spec.start;
+            cl._stop = start + cl._spec.stop;
+            if (cl._spec.continuous()) {
+                _window_start = std::max(_window_start, cl._start);
+                _window_end = std::min(_window_end, cl._stop);
+            }
+        }
         return parallel_for_each(_cl.begin(), _cl.end(), [this] (class_data& cl) {
-            auto parallelism = boost::irange(0u, _parallelism);
-            cl._start = std::chrono::steady_clock::now();
-            return parallel_for_each(parallelism.begin(), parallelism.end(), [this, &cl] (auto dummy) {
-                return this->read_class(cl);
-            }).then([&cl, this] {
-                auto duration = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - cl._start).count();
-                cl._final = (cl._bytes / duration) >> 10;
-                _finished.signal(1);
+            return sleep(cl._start - clock_type::now()).then([this, &cl] {
+                return run_class(cl);
             });
         });
     }
 
     future<> print_stats() {
-        return _finished.wait(_cl.size()).then([this] {
-            std::stringstream ss;
-            ss << "Shard " << std::setw(2) << engine().cpu_id() << ":";
-            auto idx = 0;
-            for (auto& cl: _cl) {
-                ss << " Class " << idx++ << "(" << std::setw(2) << cl._shares << " shares): " << std::setw(8) << cl._final << " KB/s";
+        std::stringstream ss;
+        ss << "Shard " << std::setw(2) << engine().cpu_id() << ":\n";
+        double total_cost = 0;
+        uint32_t total_shares = 0;
+        unsigned continuous = 0;
+        for (auto& cl : _cl) {
+            if (cl._spec.continuous()) {
+                total_cost += cl._window_cost;
+                total_shares += cl._spec.shares;
+                continuous++;
             }
-            ss << std::endl;
-            std::cout << ss.str();
-            return make_ready_future<>();
-        });
+        }
+        bool check_shares = continuous > 1 && _window_end > _window_start && total_cost > 0;
+        auto idx = 0;
+        for (auto& cl : _cl) {
+            auto secs = std::chrono::duration<double>(cl._stop - cl._start).count();
+            auto& h = cl._latency;
+            ss << "  Class " << idx++ << " (" << std::setw(4) << cl._spec.shares << " shares): "
+               << std::setw(8) << uint64_t(cl._bytes / secs) / 1024 << " KB/s "
+               << std::setw(8) << uint64_t(cl._ops / secs) << " IOPS, latency (us) p50 " << h.quantile(0.5)
+               << " p99 " << h.quantile(0.99) << " p999 " << h.quantile(0.999);
+            if (check_shares && cl._spec.continuous()) {
+                auto share = cl._window_cost / total_cost;
+                auto expected = double(cl._spec.shares) / total_shares;
+                bool ok = std::abs(share / expected - 1) <= _config.share_tolerance;
+                ss << ", share " << std::setprecision(3) << share << " of " << expected << (ok ? " PASS" : " FAIL");
+                _failures += !ok;
+            }
+            if (cl._spec.p99_goal.count()) {
+                bool ok = h.quantile(0.99) <= uint64_t(cl._spec.p99_goal.count());
+                ss << ", p99 goal " << cl._spec.p99_goal.count() << " us" << (ok ? " PASS" : " FAIL");
+                _failures += !ok;
+            }
+            ss << "\n";
+        }
+        std::cout << ss.str();
+        return make_ready_future<>();
+    }
+
+    future<unsigned> failures() {
+        return make_ready_future<unsigned>(_failures);
     }
 };
 
@@ -141,12 +335,14 @@ int main(int ac, char** av) {
         ("parallelism", bpo::value<unsigned>()->default_value(10), "number of parallel requests per class")
         ("duration", bpo::value<unsigned>()->default_value(10), "for how long (in seconds) to run the test")
         ("reqsize", bpo::value<size_t>()->default_value(4096), "size of each read request")
-        ("shares", bpo::value<sstring>()->default_value("10,10"), "comma-separated list of shares per each class (default: 10,10)")
+        ("shares", bpo::value<sstring>()->default_value("10,10"), "comma-separated list of shares per each class (default: 10,10); ignored if --class is given")
+        ("class", bpo::value<std::vector<std::string>>()->composing(), "a class, as key=value pairs (see the top of fair_queue_tester.cc); may be repeated")
+        ("share-tolerance", bpo::value<double>()->default_value(0.1), "how far, relative to its expected share, the share of a continuous class may be")
     ;
 
 
     distributed<context> ctx;
-    return app.run(ac, av, [&] {
+    return app.run(ac, av, [&] () -> future<int> {
         auto& opts = app.configuration();
         auto& directory = opts["directory"].as<sstring>();
         return file_system_at(directory).then([directory] (auto fs) {
@@ -154,19 +350,41 @@ int main(int ac, char** av) {
                 throw std::runtime_error(sprint("This is a performance test. %s is not on XFS", directory));
             }
         }).then([&] {
-            auto& parallelism = opts["parallelism"].as<unsigned>();
-            auto& share_list = opts["shares"].as<sstring>();
-            auto& duration = opts["duration"].as<unsigned>();
-            auto& reqsize = opts["reqsize"].as<size_t>();
+            test_config config;
+            config.parallelism = opts["parallelism"].as<unsigned>();
+            config.duration = std::chrono::seconds(opts["duration"].as<unsigned>());
+            config.reqsize = align_up(opts["reqsize"].as<size_t>(), 4096ul);
+            config.share_tolerance = opts["share-tolerance"].as<double>();
+            config.read_bytes_rate = opts.count("io-read-bandwidth") ? double(parse_memory_size(opts["io-read-bandwidth"].as<std::string>())) : 0;
+            config.read_ops_rate = opts.count("io-read-iops") ? opts["io-read-iops"].as<double>() : 0;
 
-            std::vector<sstring> strs;
-            boost::split(strs, share_list, boost::is_any_of(","));
-            std::vector<uint32_t> shares(strs.size(), 0);
-            std::transform(strs.begin(), strs.end(), shares.begin(), [] (sstring s) { return boost::lexical_cast<uint32_t>(s); });
+            std::vector<class_spec> classes;
+            if (opts.count("class")) {
+                for (auto& desc : opts["class"].as<std::vector<std::string>>()) {
+                    classes.push_back(class_spec::parse(desc));
+                }
+            } else {
+                auto& share_list = opts["shares"].as<sstring>();
+                std::vector<sstring> strs;
+                boost::split(strs, share_list, boost::is_any_of(","));
+                for (auto& s : strs) {
+                    class_spec spec;
+                    spec.shares = boost::lexical_cast<uint32_t>(s);
+                    classes.push_back(spec);
+                }
+            }
+            size_t max_reqsize = config.reqsize;
+            unsigned positions = 0;
+            for (auto& spec : classes) {
+                for (auto size : spec.sizes) {
+                    max_reqsize = std::max(max_reqsize, size);
+                }
+                positions += spec.parallelism ? spec.parallelism : config.parallelism;
+            }
 
             // Create the file, it is the same file so do it from one shard only.
             auto name = sprint("%s/test-queue", directory);
-            auto size = reqsize * parallelism * shares.size();
+            auto size = max_reqsize * positions;
             return open_file_dma(name, open_flags::rw | open_flags::create | open_flags::truncate).then([name, size] (auto f) {
                 auto bufptr = allocate_aligned_buffer<char>(size, 4096);
                 auto buf = bufptr.get();
@@ -176,8 +394,8 @@ int main(int ac, char** av) {
                     assert(s == size);
                     return make_ready_future<>();
                 });
-            }).then([directory, shares, parallelism, duration, reqsize, name, &ctx] {
-                return ctx.start(directory, std::move(shares), parallelism, duration, reqsize).then([&ctx, name = std::move(name)] {
+            }).then([directory, classes = std::move(classes), config, positions, name, &ctx] {
+                return ctx.start(directory, std::move(classes), config, positions).then([&ctx, name = std::move(name)] {
                     engine().at_exit([&ctx] {
                         return ctx.stop();
                     });
@@ -190,6 +408,13 @@ int main(int ac, char** av) {
                     }).or_terminate();
                 });
             });
+        }).then([&ctx] {
+            return ctx.map_reduce(adder<unsigned>(), &context::failures);
+        }).then([] (unsigned failures) {
+            if (failures) {
+                std::cout << failures << " check(s) failed\n";
+            }
+            return failures ? 1 : 0;
         });
     });
 }
@@ -66,12 +66,17 @@ int main(int ac, char** av) {
     app_template app;
     app.add_options()("port", bpo::value<uint16_t>()->default_value(10000),
             "HTTP Server port");
+    app.add_options()("pipeline-depth", bpo::value<size_t>()->default_value(10),
+            "Requests of a connection handled ahead of the reply being sent");
     return app.run_deprecated(ac, av, [&] {
         auto&& config = app.configuration();
         uint16_t port = config["port"].as<uint16_t>();
+        auto depth = config["pipeline-depth"].as<size_t>();
         auto server = new http_server_control();
         auto rb = make_shared<api_registry_builder>("apps/httpd/");
-        server->start().then([server] {
+        server->start().then([server, depth] {
+            return server->set_pipeline_depth(depth);
+        }).then([server] {
             return server->set_routes(set_routes);
         }).then([server, rb]{
             return server->set_routes([rb](routes& r){rb->set_api_doc(r);});
@@ -19,10 +19,11 @@
  * under the License.
  */
 
-#include "core/sstring.hh"
+#include "fsqual.hh"
 #include "core/posix.hh"
 #include "util/defer.hh"
 #include <libaio.h>
+#include <linux/falloc.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <fcntl.h>
@@ -30,6 +31,8 @@
 #include <unistd.h>
 #include <cstdlib>
 #include <type_traits>
+#include <chrono>
+#include <vector>
 
 // Runs func(), and also adds the number of context switches
 // that happened during func() to counter.
@@ -92,3 +95,113 @@ bool filesystem_has_good_aio_support(sstring directory, bool verbose) {
     }
     return ok;
 }
+
+// Opens a scratch file in directory, which is gone once closed
+static file_desc open_scratch_file(sstring directory, int flags) {
+    auto fname = directory + "/fsqual.tmp";
+    auto fd = file_desc::open(fname, O_CREAT|O_EXCL|O_RDWR|O_DIRECT|flags, 0600);
+    unlink(fname.c_str());
+    return fd;
+}
+
+struct write_run {
+    // context switches per io_submit()
+    float ctxsw_rate;
+    std::chrono::duration<double> elapsed;
+};
+
+// Writes nr batches of batch 4k writes, each batch at the following
+// offsets from the end of the last one, and waits for each batch before
+// submitting the next; after_each runs once a batch is complete
+template <typename AfterEach>
+static write_run run_writes(const file_desc& fd, unsigned nr, unsigned batch, AfterEach&& after_each) {
+    io_context_t ioctx = {};
+    auto r = io_setup(batch, &ioctx);
+    throw_kernel_error(r);
+    auto cleanup = defer([&] { io_destroy(ioctx); });
+    constexpr int bufsize = 4096;
+    auto buf = aligned_alloc(4096, bufsize);
+    auto free_buf = defer([&] { ::free(buf); });
+    std::vector<struct iocb> cmds(batch);
+    std::vector<struct iocb*> cmd_ptrs(batch);
+    std::vector<struct io_event> ioevs(batch);
+    auto ctxsw = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < nr; ++i) {
+        for (unsigned j = 0; j < batch; ++j) {
+            io_prep_pwrite(&cmds[j], fd.get(), buf, bufsize, bufsize * (i * batch + j));
+            cmd_ptrs[j] = &cmds[j];
+        }
+        with_ctxsw_counting(ctxsw, [&] {
+            auto r = io_submit(ioctx, batch, cmd_ptrs.data());
+            throw_kernel_error(r);
+            assert(r == int(batch));
+        });
+        auto n = io_getevents(ioctx, batch, batch, ioevs.data(), nullptr);
+        throw_kernel_error(n);
+        assert(n == int(batch));
+        for (auto& ioev : ioevs) {
+            throw_kernel_error(long(ioev.res));
+            assert(long(ioev.res) == bufsize);
+        }
+        after_each();
+    }
+    return write_run{float(ctxsw) / nr, std::chrono::steady_clock::now() - start};
+}
+
+static write_run run_writes(const file_desc& fd, unsigned nr, unsigned batch) {
+    return run_writes(fd, nr, batch, [] {});
+}
+
+filesystem_qualification qualify_filesystem(sstring directory, bool verbose) {
+    filesystem_qualification q;
+    constexpr unsigned nr = 1000;
+
+    // Concurrent appends: batches of non-overlapping writes past the end of
+    // the file, doubling the batch while none of them blocks
+    for (unsigned c = 1; c <= 32; c *= 2) {
+        auto fd = open_scratch_file(directory, 0);
+        auto run = run_writes(fd, std::max(nr / c, 100u), c);
+        bool ok = run.ctxsw_rate < 0.1;
+        if (verbose) {
+            std::cout << "context switch per " << c << " concurrent appending ios: " << run.ctxsw_rate
+                      << " (" << (ok ? "GOOD" : "BAD") << ")\n";
+        }
+        if (!ok) {
+            break;
+        }
+        q.append_concurrency = c;
+    }
+
+    // Appending into unallocated space, against space allocated ahead the
+    // way append_file does it, without changing the file size
+    auto extending = run_writes(open_scratch_file(directory, 0), nr, 1);
+    auto prealloc_fd = open_scratch_file(directory, 0);
+    throw_system_error_on(::fallocate(prealloc_fd.get(), FALLOC_FL_KEEP_SIZE, 0, nr * 4096) == -1, "fallocate");
+    auto preallocated = run_writes(prealloc_fd, nr, 1);
+    q.preallocation_helps = extending.elapsed > preallocated.elapsed * 1.25;
+    if (verbose) {
+        std::cout << "appending io: " << extending.elapsed.count() * 1e6 / nr << " us extending, "
+                  << preallocated.elapsed.count() * 1e6 / nr << " us preallocated ("
+                  << (q.preallocation_helps ? "preallocate" : "don't preallocate") << ")\n";
+    }
+
+    // O_DSYNC writes, against the same writes each followed by fdatasync(),
+    // into an allocated file so that only the sync is measured
+    constexpr unsigned nr_sync = 200;
+    auto dsync_fd = open_scratch_file(directory, O_DSYNC);
+    dsync_fd.truncate(nr_sync * 4096);
+    auto dsync = run_writes(dsync_fd, nr_sync, 1);
+    auto plain_fd = open_scratch_file(directory, 0);
+    plain_fd.truncate(nr_sync * 4096);
+    auto synced = run_writes(plain_fd, nr_sync, 1, [&] {
+        throw_system_error_on(::fdatasync(plain_fd.get()) == -1, "fdatasync");
+    });
+    q.dsync_writes = dsync.ctxsw_rate < 0.1 && dsync.elapsed <= synced.elapsed;
+    if (verbose) {
+        std::cout << "O_DSYNC io: " << dsync.elapsed.count() * 1e6 / nr_sync << " us, context switch per io "
+                  << dsync.ctxsw_rate << "; write and fdatasync: " << synced.elapsed.count() * 1e6 / nr_sync
+                  << " us (" << (q.dsync_writes ? "GOOD" : "BAD") << ")\n";
+    }
+    return q;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+
+// How a filesystem handles the appending and synchronous writes seastar
+// issues; passed to it as --fs-properties
+struct filesystem_qualification {
+    // Appending writes that can be submitted together without io_submit()
+    // blocking; 0 if not even one can
+    unsigned append_concurrency = 0;
+    // Whether appending into space allocated ahead is clearly cheaper than
+    // appending into unallocated space
+    bool preallocation_helps = true;
+    // Whether O_DSYNC writes submit without blocking and cost no more than
+    // a write followed by fdatasync()
+    bool dsync_writes = false;
+};
+
+bool filesystem_has_good_aio_support(sstring directory, bool verbose);
+filesystem_qualification qualify_filesystem(sstring directory, bool verbose);
@@ -21,6 +21,7 @@
  * The goal of this program is to allow a user to properly configure the Seastar I/O
  * scheduler.
  */
+#include <algorithm>
 #include <chrono>
 #include <random>
 #include <memory>
@@ -38,17 +39,38 @@
 #include <queue>
 #include <fstream>
 #include <future>
+#include <numeric>
+#include <sstream>
+#include <thread>
 #include "core/sstring.hh"
 #include "core/posix.hh"
 #include "core/resource.hh"
+#include "core/align.hh"
 #include "core/aligned_buffer.hh"
 #include "util/defer.hh"
+#include "fsqual.hh"
 
 using namespace std::chrono_literals;
 
-bool filesystem_has_good_aio_support(sstring directory, bool verbose);
 class iotune_manager;
 
+// Devices may be evaluated in parallel, so progress is reported a line at
+// a time, labelled with the device's directory.
+static thread_local sstring device_label;
+static std::mutex report_mutex;
+
+template <typename... Args>
+static void report(std::ostream& os, Args&&... args) {
+    std::ostringstream line;
+    if (!device_label.empty()) {
+        line << "[" << device_label << "] ";
+    }
+    using expand = int[];
+    (void)expand{0, ((line << std::forward<Args>(args)), 0)...};
+    std::lock_guard<std::mutex> guard(report_mutex);
+    os << line.str() << std::endl;
+}
+
 class iotune_timeout_exception : public std::exception {
     sstring _msg;
 public:
@@ -238,7 +260,7 @@ class iotune_manager {
         // Now try to explore the region around the maximum to see
         // if we find anything higher than the current seen maximum
         if (_concurrency_queue.empty()) {
-            std::cout << "Refining search for maximum. So far, " << _best_result.IOPS <<  " IOPS" << std::endl;
+            report(std::cout, "Refining search for maximum. So far, ", _best_result.IOPS, " IOPS");
             _phase_timing = 500ms;
             auto it = _all_results.find(_best_result.concurrency);
 
@@ -252,7 +274,7 @@ class iotune_manager {
             _best_result = result;
         }
         if (_concurrency_queue.empty()) {
-            std::cout << "Maximum throughput: " << _best_result.IOPS <<  " IOPS" << std::endl;
+            report(std::cout, "Maximum throughput: ", _best_result.IOPS, " IOPS");
             _phase_timing = 2000ms;
             _current_test_phase = test_phase::find_percentile;
 
@@ -311,7 +333,7 @@ class iotune_manager {
             }
             std::queue<unsigned> _empty_queue;
             _concurrency_queue.swap(_empty_queue);
-            std::cerr << "IOtune timed out before it could finish. An estimate will be provided but accuracy may suffer" << std::endl;
+            report(std::cerr, "IOtune timed out before it could finish. An estimate will be provided but accuracy may suffer");
             return;
         }
 
@@ -352,6 +374,10 @@ class iotune_manager {
             _concurrency_queue.push(initial);
         }
     }
+    const file_desc& file() const {
+        return _test_file.file;
+    }
+
     template <typename Func>
     void spawn_new(Func&& func) {
         std::packaged_task<void()> task(std::forward<Func>(func));
@@ -418,15 +444,15 @@ class iotune_manager {
 
     uint32_t finish_estimate() {
         if (_best_critical_concurrency == 0) {
-            std::cerr << "============= Cut here ===============" << std::endl;
-            std::cerr << "Something is not right! Results found:" << std::endl;
+            report(std::cerr, "============= Cut here ===============");
+            report(std::cerr, "Something is not right! Results found:");
             for (auto& r: _all_results) {
-                std::cerr << r.first << ", " << r.second << std::endl;
+                report(std::cerr, r.first, ", ", r.second);
             }
 
-            std::cerr << "Target critical IOPS: " << _desired_percentile * _best_result.IOPS << std::endl;
-            std::cerr << "best concurrency: " << _best_critical_concurrency << std::endl;
-            std::cerr << "best delta: " << _best_critical_delta << std::endl;
+            report(std::cerr, "Target critical IOPS: ", _desired_percentile * _best_result.IOPS);
+            report(std::cerr, "best concurrency: ", _best_critical_concurrency);
+            report(std::cerr, "best delta: ", _best_critical_delta);
             auto msg = "iotune encountered an error and could not calculate proper I/O Scheduler configuration. Please report the status above";
             throw std::runtime_error(msg);
         }
@@ -570,7 +596,7 @@ void test_file::generate(iotune_manager& iotune_manager, std::chrono::seconds ti
         return float(b) / (1ull << 30);
     };
 
-    std::cout << "Generating evaluation file sized " << to_gb(iotune_manager.file_size) << "GB..." << std::flush;
+    report(std::cout, "Generating evaluation file sized ", to_gb(iotune_manager.file_size), "GB...");
 
     auto start_time = iotune_manager::clock::now();
     auto latest_tstamp = start_time;
@@ -626,7 +652,7 @@ void test_file::generate(iotune_manager& iotune_manager, std::chrono::seconds ti
                 } else if ((long(ev[i].res) == -ENOSPC) || (ev[i].res < iotune_manager::wbuffer_size)) {
                     // FIXME: The buffer size can be cut short due to other conditions that are unrelated
                     // to ENOSPC. We should be testing it separately.
-                    std::cout << " stopped early due to disk space issues. Will continue but accuracy may suffer." << std::endl;
+                    report(std::cout, "Stopped early due to disk space issues. Will continue but accuracy may suffer.");
                     iotune_manager.file_size = bytes_written;
                     stopped_on_error = true;
                     break;
@@ -638,7 +664,7 @@ void test_file::generate(iotune_manager& iotune_manager, std::chrono::seconds ti
         }
         latest_tstamp = iotune_manager::clock::now();
         if ((latest_tstamp - start_time) > timeout) {
-            std::cout << " timed out before we could write the entire file. Will continue but accuracy may suffer." << std::endl;
+            report(std::cout, "Timed out before we could write the entire file. Will continue but accuracy may suffer.");
             aio_outstanding = 0;
             iotune_manager.file_size = bytes_written;
             if (bytes_written < (1ul << 30)) {
@@ -649,12 +675,195 @@ void test_file::generate(iotune_manager& iotune_manager, std::chrono::seconds ti
 
     }
     iotune_manager.file_size = bytes_written;
-    std::cout << to_gb(iotune_manager.file_size) << "GB written in "
-              << std::chrono::duration_cast<std::chrono::seconds>(latest_tstamp - start_time).count()
-              << " seconds" << std::endl;
+    report(std::cout, to_gb(iotune_manager.file_size), "GB written in ",
+           std::chrono::duration_cast<std::chrono::seconds>(latest_tstamp - start_time).count(), " seconds");
+}
+
+// Once the maximum useful concurrency is known, the disk is measured at
+// it: sequential read and write bandwidth, and random read and write IOPS,
+// which the I/O scheduler uses to weigh requests by their cost. Random read
+// latency is measured at increasing concurrencies too, up to the maximum,
+// for the user to judge the latency the chosen concurrency costs.
+struct io_pattern {
+    const char* name;
+    bool write;
+    bool sequential;
+    uint64_t request_size;
+    unsigned concurrency;
+};
+
+struct io_result {
+    double bytes_per_second = 0;
+    double iops = 0;
+    std::chrono::microseconds mean_latency{0};
+    std::chrono::microseconds p99_latency{0};
+};
+
+static constexpr uint64_t sequential_request_size = 128ul << 10;
+static constexpr uint64_t random_request_size = 4ul << 10;
+static constexpr auto measurement_time = 2s;
+
+struct io_thread_result {
+    uint64_t requests = 0;
+    // Of each request counted, in microseconds
+    std::vector<uint32_t> latencies;
+};
+
+// Keeps @concurrency requests of the pattern in flight on a region of the
+// file until @end, counting those that complete after @start
+static io_thread_result run_io_pattern(const file_desc& f, const io_pattern& pattern, unsigned concurrency,
+        uint64_t region_start, uint64_t region_size,
+        iotune_manager::clock::time_point start, iotune_manager::clock::time_point end) {
+    using clock = iotune_manager::clock;
+    struct slot {
+        struct iocb iocb;
+        std::unique_ptr<char[], free_deleter> buf;
+        clock::time_point issued;
+    };
+    io_context_t io_context = {0};
+    auto r = ::io_setup(concurrency, &io_context);
+    throw_kernel_error(r);
+    auto destroyer = defer([&io_context] { ::io_destroy(io_context); });
+
+    auto blocks = region_size / pattern.request_size;
+    std::uniform_int_distribution<uint64_t> block_distribution(0, blocks - 1);
+    uint64_t next_block = 0;
+    auto next_pos = [&] {
+        auto block = pattern.sequential ? next_block++ % blocks : block_distribution(random_generator);
+        return region_start + block * pattern.request_size;
+    };
+
+    std::vector<slot> slots(concurrency);
+    std::vector<iocb*> iocb_vecptr;
+    iocb_vecptr.reserve(concurrency);
+    auto issue = [&] (slot& s) {
+        if (pattern.write) {
+            io_prep_pwrite(&s.iocb, f.get(), s.buf.get(), pattern.request_size, next_pos());
+        } else {
+            io_prep_pread(&s.iocb, f.get(), s.buf.get(), pattern.request_size, next_pos());
+        }
+        s.iocb.data = &s;
+        s.issued = clock::now();
+        iocb_vecptr.push_back(&s.iocb);
+    };
+    for (auto& s : slots) {
+        s.buf = allocate_aligned_buffer<char>(pattern.request_size, 4096);
+        memset(s.buf.get(), 0, pattern.request_size);
+        issue(s);
+    }
+
+    io_thread_result result;
+    std::vector<io_event> ev(concurrency);
+    unsigned in_flight = 0;
+    struct timespec timeout = {0, 0};
+    while (in_flight || !iocb_vecptr.empty()) {
+        if (!iocb_vecptr.empty()) {
+            r = ::io_submit(io_context, iocb_vecptr.size(), iocb_vecptr.data());
+            throw_kernel_error(r);
+            in_flight += r;
+            iocb_vecptr.clear();
+        }
+        int n = ::io_getevents(io_context, 1, ev.size(), ev.data(), &timeout);
+        throw_kernel_error(n);
+        in_flight -= n;
+        auto now = clock::now();
+        for (auto i = 0ul; i < size_t(n); ++i) {
+            sanity_check_ev(ev[i], pattern.request_size);
+            auto& s = *reinterpret_cast<slot*>(ev[i].data);
+            if (now > start && now < end) {
+                result.requests++;
+                result.latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(now - s.issued).count());
+            }
+            if (now < end) {
+                issue(s);
+            }
+        }
+    }
+    return result;
 }
 
-uint32_t io_queue_discovery(sstring dir, std::vector<unsigned> cpus, std::chrono::seconds timeout) {
+// Runs the pattern from all threads, each on a region of the file of its
+// own and with its share of the concurrency
+static io_result measure(const file_desc& f, uint64_t file_size, const std::vector<unsigned>& cpus, const io_pattern& pattern) {
+    auto threads = std::min<size_t>(cpus.size(), pattern.concurrency);
+    auto region_size = align_down(file_size / threads, pattern.request_size);
+    auto start = iotune_manager::clock::now() + 100ms;
+    auto end = start + measurement_time;
+    std::vector<io_thread_result> results(threads);
+    std::vector<std::thread> workers;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    for (auto i = 0ul; i < threads; ++i) {
+        auto concurrency = pattern.concurrency / threads + (i < pattern.concurrency % threads);
+        workers.emplace_back([&, i, concurrency] {
+            try {
+                pin_this_thread(cpus[i]);
+                results[i] = run_io_pattern(f, pattern, concurrency, i * region_size, region_size, start, end);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_mutex);
+                error = std::current_exception();
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    io_result result;
+    std::vector<uint32_t> latencies;
+    for (auto& r : results) {
+        latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+    }
+    auto seconds = std::chrono::duration_cast<std::chrono::duration<double>>(measurement_time).count();
+    result.iops = latencies.size() / seconds;
+    result.bytes_per_second = result.iops * pattern.request_size;
+    if (!latencies.empty()) {
+        auto sum = std::accumulate(latencies.begin(), latencies.end(), uint64_t(0));
+        result.mean_latency = std::chrono::microseconds(sum / latencies.size());
+        auto p99 = latencies.begin() + latencies.size() * 99 / 100;
+        std::nth_element(latencies.begin(), p99, latencies.end());
+        result.p99_latency = std::chrono::microseconds(*p99);
+    }
+    report(std::cout, "  ", pattern.name, " at concurrency ", pattern.concurrency, ": ",
+           uint64_t(result.bytes_per_second / (1 << 20)), " MB/s, ", uint64_t(result.iops), " IOPS, latency mean ",
+           result.mean_latency.count(), "us, p99 ", result.p99_latency.count(), "us");
+    return result;
+}
+
+struct io_properties {
+    unsigned max_io_requests;
+    uint64_t read_bandwidth;
+    uint64_t read_iops;
+    uint64_t write_bandwidth;
+    uint64_t write_iops;
+    // Random reads, by concurrency
+    std::map<unsigned, io_result> read_latency;
+};
+
+static void measure_io_properties(io_properties& props, const file_desc& f, uint64_t file_size, const std::vector<unsigned>& cpus) {
+    auto concurrency = props.max_io_requests;
+    report(std::cout, "Measuring throughput at concurrency ", concurrency, ":");
+    props.read_bandwidth = measure(f, file_size, cpus,
+            io_pattern{"sequential read", false, true, sequential_request_size, concurrency}).bytes_per_second;
+    props.write_bandwidth = measure(f, file_size, cpus,
+            io_pattern{"sequential write", true, true, sequential_request_size, concurrency}).bytes_per_second;
+    props.read_iops = measure(f, file_size, cpus,
+            io_pattern{"random read", false, false, random_request_size, concurrency}).iops;
+    props.write_iops = measure(f, file_size, cpus,
+            io_pattern{"random write", true, false, random_request_size, concurrency}).iops;
+
+    report(std::cout, "Measuring random read latency:");
+    for (unsigned c = 1; c < concurrency; c *= 4) {
+        props.read_latency[c] = measure(f, file_size, cpus, io_pattern{"random read", false, false, random_request_size, c});
+    }
+    props.read_latency[concurrency] = measure(f, file_size, cpus,
+            io_pattern{"random read", false, false, random_request_size, concurrency});
+}
+
+io_properties io_queue_discovery(sstring dir, std::vector<unsigned> cpus, std::chrono::seconds timeout) {
     iotune_manager iotune_manager(cpus.size(), dir, timeout);
 
     do {
@@ -668,11 +877,89 @@ uint32_t io_queue_discovery(sstring dir, std::vector<unsigned> cpus, std::chrono
         iotune_manager.wait_for_threads();
     } while (iotune_manager.analyze_results() == iotune_manager::test_done::no);
 
-    return iotune_manager.finish_estimate();
+    io_properties props;
+    props.max_io_requests = iotune_manager.finish_estimate();
+    measure_io_properties(props, iotune_manager.file(), iotune_manager.file_size, cpus);
+    return props;
 }
 
-int write_configuration_file(std::string conf_file, std::string format, unsigned max_io_requests, std::experimental::optional<unsigned> num_io_queues = {}) {
-    std::cout << "Recommended --max-io-requests: " << max_io_requests << std::endl;
+// The evaluation of a device, through the first of the directories on it
+struct device_evaluation {
+    std::vector<sstring> directories;
+    std::vector<unsigned> cpus;
+    io_properties props;
+    filesystem_qualification fs;
+    bool done = false;
+};
+
+static constexpr char latency_comment_header[] = "# random 4k read latency by concurrency (IOPS, mean us, p99 us), from iotune on ";
+
+// Lines of an existing configuration file, but for the io-device and
+// fs-properties entries of the evaluated directories, and their latency
+// comments, which are being replaced
+static std::vector<std::string> other_device_entries(const boost::filesystem::path& conf_path,
+        const std::vector<device_evaluation>& devices) {
+    auto is_line_of = [&devices] (const std::string& line, const std::string& prefix, const std::string& suffix) {
+        return std::any_of(devices.begin(), devices.end(), [&] (const device_evaluation& d) {
+            auto own = prefix + std::string(d.directories.front()) + suffix;
+            return line.compare(0, own.size(), own) == 0;
+        });
+    };
+    std::vector<std::string> lines;
+    std::ifstream ifs(conf_path.string());
+    std::string line;
+    bool in_replaced_comment = false;
+    while (std::getline(ifs, line)) {
+        if (in_replaced_comment && line.compare(0, 4, "#   ") == 0) {
+            continue;
+        }
+        in_replaced_comment = is_line_of(line, latency_comment_header, "");
+        if (!in_replaced_comment && !is_line_of(line, "io-device=", ":") && !is_line_of(line, "fs-properties=", ":")) {
+            lines.push_back(line);
+        }
+    }
+    return lines;
+}
+
+// The random read latency curve goes in comments, for reference
+static sstring latency_comment(const device_evaluation& d) {
+    std::ostringstream latency;
+    latency << latency_comment_header << d.directories.front();
+    for (auto i = std::next(d.directories.begin()); i != d.directories.end(); ++i) {
+        latency << ", the device of " << *i;
+    }
+    latency << "\n";
+    for (auto& l : d.props.read_latency) {
+        latency << "#   " << l.first << ": " << uint64_t(l.second.iops) << ", " << l.second.mean_latency.count()
+                << ", " << l.second.p99_latency.count() << "\n";
+    }
+    return latency.str();
+}
+
+static sstring device_entry(const device_evaluation& d) {
+    auto& props = d.props;
+    return sprint("%s:%u:%u:%u:%u:%u", d.directories.front(), props.max_io_requests,
+            props.read_bandwidth, props.read_iops, props.write_bandwidth, props.write_iops);
+}
+
+static sstring fs_properties_entry(const device_evaluation& d) {
+    auto& fs = d.fs;
+    return sprint("%s:%u:%u:%u", d.directories.front(), fs.append_concurrency, unsigned(fs.preallocation_helps),
+            unsigned(fs.dsync_writes));
+}
+
+// Writes the properties of a single device as the default I/O options or,
+// with @per_device, those of each device evaluated as its io-device entry
+int write_configuration_file(std::string conf_file, std::string format, const std::vector<device_evaluation>& devices,
+        bool per_device, std::experimental::optional<unsigned> num_io_queues = {}) {
+    for (auto& d : devices) {
+        auto& props = d.props;
+        auto prefix = per_device ? sprint("%s: ", d.directories.front()) : std::string();
+        std::cout << prefix << "Recommended --max-io-requests: " << props.max_io_requests << std::endl;
+        std::cout << prefix << "Measured --io-read-bandwidth=" << props.read_bandwidth << " --io-read-iops=" << props.read_iops
+                  << " --io-write-bandwidth=" << props.write_bandwidth << " --io-write-iops=" << props.write_iops << std::endl;
+        std::cout << prefix << "Qualified --fs-properties=" << fs_properties_entry(d) << std::endl;
+    }
     if (num_io_queues) {
         std::cout << "Recommended --num-io-queues: " << *num_io_queues << std::endl;
     }
@@ -688,19 +975,56 @@ int write_configuration_file(std::string conf_file, std::string format, unsigned
     auto error_msg = " when writing configuration file. Please add them to your seastar command line";
     try {
         boost::filesystem::create_directories(conf_path.parent_path());
+        // Entries of other devices are kept
+        std::vector<std::string> kept;
+        if (per_device && format == "seastar") {
+            kept = other_device_entries(conf_path, devices);
+        }
         std::ofstream ofs_io;
         ofs_io.exceptions(std::ofstream::failbit | std::ofstream::badbit);
         ofs_io.open(conf_path.string(), std::ofstream::trunc);
         if (ofs_io) {
+            for (auto& line : kept) {
+                ofs_io << line << std::endl;
+            }
+            for (auto& d : devices) {
+                ofs_io << latency_comment(d);
+            }
+            auto& props = devices.front().props;
             if (format == "seastar") {
-                ofs_io << "max-io-requests=" << max_io_requests << std::endl;
-                if (num_io_queues) {
-                    ofs_io << "num-io-queues=" << *num_io_queues << std::endl;
+                if (per_device) {
+                    for (auto& d : devices) {
+                        ofs_io << "io-device=" << device_entry(d) << std::endl;
+                    }
+                } else {
+                    ofs_io << "max-io-requests=" << props.max_io_requests << std::endl;
+                    if (num_io_queues) {
+                        ofs_io << "num-io-queues=" << *num_io_queues << std::endl;
+                    }
+                    ofs_io << "io-read-bandwidth=" << props.read_bandwidth << std::endl;
+                    ofs_io << "io-read-iops=" << props.read_iops << std::endl;
+                    ofs_io << "io-write-bandwidth=" << props.write_bandwidth << std::endl;
+                    ofs_io << "io-write-iops=" << props.write_iops << std::endl;
+                }
+                for (auto& d : devices) {
+                    ofs_io << "fs-properties=" << fs_properties_entry(d) << std::endl;
                 }
             } else {
-                ofs_io << "SEASTAR_IO=\"--max-io-requests=" << max_io_requests;
-                if (num_io_queues) {
-                    ofs_io << " --num-io-queues=" << *num_io_queues;
+                ofs_io << "SEASTAR_IO=\"";
+                if (per_device) {
+                    for (auto& d : devices) {
+                        ofs_io << (&d == &devices.front() ? "" : " ") << "--io-device=" << device_entry(d);
+                    }
+                } else {
+                    ofs_io << "--max-io-requests=" << props.max_io_requests;
+                    if (num_io_queues) {
+                        ofs_io << " --num-io-queues=" << *num_io_queues;
+                    }
+                    ofs_io << " --io-read-bandwidth=" << props.read_bandwidth << " --io-read-iops=" << props.read_iops
+                           << " --io-write-bandwidth=" << props.write_bandwidth << " --io-write-iops=" << props.write_iops;
+                }
+                for (auto& d : devices) {
+                    ofs_io << " --fs-properties=" << fs_properties_entry(d);
                 }
                 ofs_io << "\"" << std::endl;
             }
@@ -717,20 +1041,54 @@ int write_configuration_file(std::string conf_file, std::string format, unsigned
     return 0;
 }
 
+// Evaluates the devices in parallel, each with its own share of the CPUs
+// and the whole timeout. Returns whether all evaluations completed.
+static bool evaluate_devices(std::vector<device_evaluation>& devices, const std::vector<unsigned>& cpus,
+        std::chrono::seconds timeout) {
+    for (auto i = 0ul; i < std::max(cpus.size(), devices.size()); ++i) {
+        devices[i % devices.size()].cpus.push_back(cpus[i % cpus.size()]);
+    }
+    std::vector<std::thread> threads;
+    for (auto& d : devices) {
+        threads.emplace_back([&d, timeout, labelled = devices.size() > 1] {
+            if (labelled) {
+                device_label = d.directories.front();
+            }
+            try {
+                d.props = io_queue_discovery(d.directories.front(), d.cpus, timeout);
+                d.done = true;
+            } catch (iotune_timeout_exception& e) {
+                report(std::cerr, "Timed out: ", e.what());
+            } catch (std::exception& e) {
+                report(std::cerr, "Failed: ", e.what());
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return std::all_of(devices.begin(), devices.end(), [] (const device_evaluation& d) { return d.done; });
+}
+
 int main(int ac, char** av) {
     namespace bpo = boost::program_options;
     bool fs_check = false;
+    bool per_device = false;
 
     bpo::options_description desc("Parameters for evaluation. This is intended to be ran with parameters that will match the desired use.");
     desc.add_options()
         ("help,h", "show help message")
-        ("evaluation-directory", bpo::value<sstring>()->required(), "directory where to execute the evaluation")
+        ("evaluation-directory", bpo::value<std::vector<sstring>>()->required()->composing(),
+                "directory where to execute the evaluation; may be repeated, to evaluate the devices of several "
+                "directories in parallel, writing an io-device entry for each")
         ("smp,c", bpo::value<unsigned>(), "number of threads (default: one per CPU)")
         ("cpuset", bpo::value<cpuset_bpo_wrapper>(), "CPUs to use (in cpuset(7) format; default: all))")
         ("options-file", bpo::value<sstring>()->default_value("~/.config/seastar/io.conf"), "Output configuration file")
         ("format", bpo::value<sstring>()->default_value("seastar"), "Configuration file format (seastar | envfile)")
         ("timeout", bpo::value<uint64_t>()->default_value(60 * 6), "Maximum time to wait for iotune to finish (seconds)")
         ("fs-check", bpo::bool_switch(&fs_check), "perform FS check only")
+        ("per-device", bpo::bool_switch(&per_device), "write the results as an io-device entry for each evaluation "
+                "directory, replacing earlier ones for them and keeping those of other devices")
     ;
 
     bpo::variables_map configuration;
@@ -754,7 +1112,6 @@ int main(int ac, char** av) {
     auto conf_file = configuration["options-file"].as<sstring>();
 
     std::vector<unsigned> cpuvec;
-    sstring directory;
     auto nr_cpus = resource::nr_processing_units();
     resource::cpuset cpu_set;
     std::copy(boost::counting_iterator<unsigned>(0), boost::counting_iterator<unsigned>(nr_cpus),
@@ -779,20 +1136,51 @@ int main(int ac, char** av) {
         }
     }
 
-    directory = configuration["evaluation-directory"].as<sstring>();
-
-    if (!filesystem_has_good_aio_support(directory, false)) {
-        std::cerr << "File system on " << directory << " is not qualified for seastar AIO;"
-                " see http://docs.scylladb.com/kb/kb-fs-not-qualified-aio/ for details\n";
-        return 1;
+    // Directories on the same device are evaluated once, through the first
+    std::vector<device_evaluation> devices;
+    std::vector<dev_t> device_ids;
+    for (auto& directory : configuration["evaluation-directory"].as<std::vector<sstring>>()) {
+        if (!filesystem_has_good_aio_support(directory, false)) {
+            std::cerr << "File system on " << directory << " is not qualified for seastar AIO;"
+                    " see http://docs.scylladb.com/kb/kb-fs-not-qualified-aio/ for details\n";
+            return 1;
+        }
+        struct stat st;
+        if (::stat(directory.c_str(), &st) == -1) {
+            std::cerr << "Cannot stat " << directory << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        auto i = std::find(device_ids.begin(), device_ids.end(), st.st_dev);
+        if (i != device_ids.end()) {
+            auto& d = devices[i - device_ids.begin()];
+            std::cout << directory << " is on the same device as " << d.directories.front() << std::endl;
+            d.directories.push_back(directory);
+        } else {
+            device_ids.push_back(st.st_dev);
+            devices.push_back(device_evaluation{{directory}});
+            devices.back().fs = qualify_filesystem(directory, fs_check);
+        }
     }
     if (fs_check) {
         return 0;
     }
     auto timeout = std::chrono::seconds(configuration["timeout"].as<uint64_t>());
 
-    try {
-        auto iodepth = io_queue_discovery(directory, cpuvec, timeout);
+    bool all_done = evaluate_devices(devices, cpuvec, timeout);
+    if (!all_done) {
+        devices.erase(std::remove_if(devices.begin(), devices.end(), [] (const device_evaluation& d) {
+            return !d.done;
+        }), devices.end());
+        if (devices.empty()) {
+            return 1;
+        }
+    }
+    int ret;
+    if (devices.size() > 1 || per_device) {
+        // A device's entry only sets its request limit; queues are shared
+        ret = write_configuration_file(conf_file, format, devices, true);
+    } else {
+        auto& iodepth = devices.front().props.max_io_requests;
         auto num_io_queues = cpuvec.size();
         if (iodepth / num_io_queues < 4) {
             num_io_queues = iodepth / 4;
@@ -800,14 +1188,10 @@ int main(int ac, char** av) {
 
         if (num_io_queues != cpuvec.size()) {
             iodepth = (iodepth / num_io_queues) * num_io_queues;
-            return write_configuration_file(conf_file, format, iodepth, num_io_queues);
+            ret = write_configuration_file(conf_file, format, devices, false, num_io_queues);
         } else {
-            return write_configuration_file(conf_file, format, iodepth);
+            ret = write_configuration_file(conf_file, format, devices, false);
         }
-    } catch (iotune_timeout_exception &e) {
-        // Otherwise we'll coredump on the exception, but this can happen
-        std::cerr << "Timed out: " << e.what() << std::endl;
-        return 1;
     }
-    return 0;
+    return all_done ? ret : 1;
 }
@@ -52,14 +52,22 @@ action advance_blob {
     p--;
 }
 
+# Skips the rest of a key to just before the next delimiter (or the end
+# of the buffer), staying in the same state.
+action skip_key {
+    if (*p != '\r') {
+        p = find_either(p + 1, pe, ' ', '\r') - 1;
+    }
+}
+
 crlf = '\r\n';
 sp = ' ';
 u32 = digit+ >{ _u32 = 0; } ${ _u32 *= 10; _u32 += fc - '0'; };
 u64 = digit+ >{ _u64 = 0; } ${ _u64 *= 10; _u64 += fc - '0'; };
-key = [^ ]+ >mark %{ _key = memcache::item_key(str()); };
-flags = digit+ >mark %{ _flags_str = str(); };
+key = [^ ]+ >mark $skip_key %{ _key = memcache::item_key(str()); };
+flags = u32 %{ _flags = _u32; };
 expiration = u32 %{ _expiration = _u32; };
-size = u32 >mark %{ _size = _u32; _size_str = str(); };
+size = u32 %{ _size = _u32; };
 blob := any+ >start_blob $advance_blob;
 maybe_noreply = (sp "noreply" @{ _noreply = true; })? >{ _noreply = false; };
 maybe_expiration = (sp expiration)? >{ _expiration = 0; };
@@ -116,10 +124,9 @@ public:
     uint32_t _u32;
     uint64_t _u64;
     memcache::item_key _key;
-    sstring _flags_str;
+    uint32_t _flags;
     uint32_t _expiration;
     uint32_t _size;
-    sstring _size_str;
     uint32_t _size_left;
     uint64_t _version;
     sstring _blob;
@@ -24,11 +24,14 @@
 #include <boost/intrusive_ptr.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/optional.hpp>
+#include <boost/range/irange.hpp>
+#include <array>
+#include <deque>
 #include <iomanip>
 #include <sstream>
+#include <unordered_map>
 #include "core/app-template.hh"
 #include "core/future-util.hh"
-#include "core/timer-set.hh"
 #include "core/shared_ptr.hh"
 #include "core/stream.hh"
 #include "core/memory.hh"
@@ -38,10 +41,15 @@
 #include "core/bitops.hh"
 #include "core/slab.hh"
 #include "core/align.hh"
+#include "core/fstream.hh"
+#include "core/seastar.hh"
+#include "core/semaphore.hh"
+#include "core/shared_future.hh"
 #include "net/api.hh"
 #include "net/packet-data-source.hh"
 #include "apps/memcached/ascii.hh"
 #include "memcached.hh"
+#include "util/log.hh"
 #include <unistd.h>
 
 #define PLATFORM "seastar"
@@ -59,6 +67,8 @@ static constexpr uint64_t default_slab_page_size = 1UL*MB;
 static constexpr uint64_t default_per_cpu_slab_size = 0UL; // zero means reclaimer is enabled.
 static __thread slab_allocator<item>* slab;
 
+static seastar::logger memcache_logger("memcached");
+
 template<typename T>
 using optional = boost::optional<T>;
 
@@ -113,64 +123,148 @@ struct expiration {
         }
     }
 
-    bool ever_expires() {
+    bool ever_expires() const {
         return _time != never_expire_timepoint;
     }
 
-    time_point to_time_point() {
+    time_point to_time_point() const {
         return _time;
     }
+
+    // The expiry as items keep it: in whole seconds of clock_type, rounded
+    // up, and at least 1; 0 means never.
+    uint32_t to_coarse() const {
+        using namespace std::chrono;
+        if (!ever_expires()) {
+            return 0;
+        }
+        auto s = duration_cast<seconds>(_time.time_since_epoch() + seconds(1) - duration(1)).count();
+        return std::max<int64_t>(1, std::min<int64_t>(s, std::numeric_limits<uint32_t>::max()));
+    }
+
+    static expiration from_coarse(uint32_t s) {
+        expiration e;
+        if (s) {
+            e._time = time_point(std::chrono::seconds(s));
+        }
+        return e;
+    }
 };
 
+// What a chunk of a chunked item's value holds before its part of it
+struct chunk_header {
+    item* owner;
+    bi::list_member_hook<> link;
+};
+
+// Items are laid out to keep the overhead of small ones low: fields are
+// packed (the first ones into the tail padding of slab_item_base), the
+// key hash is truncated to 32 bits, the ascii protocol's " flags bytes"
+// prefix is formatted when replying rather than stored, and the expiry is
+// kept in whole seconds, with no timer link; expired items are dropped
+// when looked up, or by the cache's sweep.
 class item : public slab_item_base {
 public:
     using version_type = uint64_t;
     using time_point = expiration::time_point;
     using duration = expiration::duration;
-    static constexpr uint8_t field_alignment = alignof(void*);
 private:
     using hook_type = bi::unordered_set_member_hook<>;
-    // TODO: align shared data to cache line boundary
-    version_type _version;
+    uint8_t _key_size;
+    // A read-only copy of another shard's hot key, not in the cache's table
+    bool _replica = false;
+    uint16_t _ref_count;
+    uint32_t _key_hash;
     hook_type _cache_link;
-    bi::list_member_hook<> _timer_link;
-    size_t _key_hash;
-    expiration _expiry;
+    version_type _version;
+    // From expiration::to_coarse(); 0 means never
+    uint32_t _expiry;
+    uint32_t _flags;
     uint32_t _value_size;
     uint32_t _slab_page_index;
-    uint16_t _ref_count;
-    uint8_t _key_size;
-    uint8_t _ascii_prefix_size;
-    char _data[]; // layout: data=key, (data+key_size)=ascii_prefix, (data+key_size+ascii_prefix_size)=value.
+    // Number of chunks the value is split into; 0 if it is stored inline
+    uint16_t _chunk_count;
+    // layout: data=key, (data+key_size)=value, or for a chunked item,
+    // pointers to its chunks. A chunk has no key; its data is a
+    // chunk_header, then its part of the value.
+    alignas(alignof(void*)) char _data[];
     friend class cache;
+private:
+    item* chunk(unsigned i) const {
+        item* c;
+        memcpy(&c, _data + _key_size + i * sizeof(item*), sizeof(item*));
+        return c;
+    }
 public:
-    item(uint32_t slab_page_index, item_key&& key, sstring&& ascii_prefix,
+    item(uint32_t slab_page_index, item_key&& key, uint32_t flags,
          sstring&& value, expiration expiry, version_type version = 1)
-        : _version(version)
+        : _key_size(key.key().size())
+        , _ref_count(0U)
         , _key_hash(key.hash())
-        , _expiry(expiry)
+        , _version(version)
+        , _expiry(expiry.to_coarse())
+        , _flags(flags)
         , _value_size(value.size())
         , _slab_page_index(slab_page_index)
+        , _chunk_count(0)
+    {
+        assert(key.key().size() <= std::numeric_limits<uint8_t>::max());
+        memcpy(_data, key.key().c_str(), _key_size);
+        memcpy(_data + _key_size, value.c_str(), _value_size);
+    }
+
+    // An item whose value of value_size bytes is held by chunks
+    item(uint32_t slab_page_index, item_key&& key, uint32_t flags,
+         const std::vector<item*>& chunks, uint32_t value_size, expiration expiry, version_type version = 1)
+        : _key_size(key.key().size())
         , _ref_count(0U)
-        , _key_size(key.key().size())
-        , _ascii_prefix_size(ascii_prefix.size())
+        , _key_hash(key.hash())
+        , _version(version)
+        , _expiry(expiry.to_coarse())
+        , _flags(flags)
+        , _value_size(value_size)
+        , _slab_page_index(slab_page_index)
+        , _chunk_count(chunks.size())
     {
-        assert(_key_size <= std::numeric_limits<uint8_t>::max());
-        assert(_ascii_prefix_size <= std::numeric_limits<uint8_t>::max());
-        // storing key
+        assert(key.key().size() <= std::numeric_limits<uint8_t>::max());
         memcpy(_data, key.key().c_str(), _key_size);
-        // storing ascii_prefix
-        memcpy(_data + align_up(_key_size, field_alignment), ascii_prefix.c_str(), _ascii_prefix_size);
-        // storing value
-        memcpy(_data + align_up(_key_size, field_alignment) + align_up(_ascii_prefix_size, field_alignment),
-               value.c_str(), _value_size);
+        memcpy(_data + _key_size, chunks.data(), chunks.size() * sizeof(item*));
+        for (auto c : chunks) {
+            c->header_of_chunk().owner = this;
+        }
+    }
+
+    // A chunk of the value of a chunked item. Chunks are locked in the slab
+    // for as long as they live, so that they are only ever evicted along
+    // with their item.
+    item(uint32_t slab_page_index, const char* value, uint32_t value_size)
+        : _key_size(0)
+        , _ref_count(2U)
+        , _key_hash(0)
+        , _version(0)
+        , _expiry(0)
+        , _flags(0)
+        , _value_size(value_size)
+        , _slab_page_index(slab_page_index)
+        , _chunk_count(0)
+    {
+        new (_data) chunk_header{nullptr, {}};
+        memcpy(_data + sizeof(chunk_header), value, _value_size);
     }
 
     item(const item&) = delete;
     item(item&&) = delete;
 
-    clock_type::time_point get_timeout() {
-        return _expiry.to_time_point();
+    expiration expiry() const {
+        return expiration::from_coarse(_expiry);
+    }
+
+    bool ever_expires() const {
+        return _expiry;
+    }
+
+    bool expired(clock_type::time_point now) const {
+        return _expiry && expiration::from_coarse(_expiry).to_time_point() <= now;
     }
 
     version_type version() {
@@ -181,23 +275,72 @@ class item : public slab_item_base {
         return std::experimental::string_view(_data, _key_size);
     }
 
-    const std::experimental::string_view ascii_prefix() const {
-        const char *p = _data + align_up(_key_size, field_alignment);
-        return std::experimental::string_view(p, _ascii_prefix_size);
+    uint32_t flags() const {
+        return _flags;
+    }
+
+    // The " flags bytes" that follows the key on the ascii protocol's
+    // VALUE line
+    sstring ascii_prefix() const {
+        char buf[2 * std::numeric_limits<uint32_t>::digits10 + 4];
+        auto end = buf + sizeof(buf);
+        auto p = end;
+        auto prepend_number = [&p] (uint32_t n) {
+            do {
+                *--p = '0' + n % 10;
+                n /= 10;
+            } while (n);
+            *--p = ' ';
+        };
+        prepend_number(_value_size);
+        prepend_number(_flags);
+        return sstring(p, end - p);
     }
 
+    // The value of an item that isn't chunked
     const std::experimental::string_view value() const {
-        const char *p = _data + align_up(_key_size, field_alignment) +
-            align_up(_ascii_prefix_size, field_alignment);
-        return std::experimental::string_view(p, _value_size);
+        assert(!_chunk_count);
+        return std::experimental::string_view(_data + _key_size, _value_size);
     }
 
-    size_t key_size() const {
-        return _key_size;
+    // Calls func with each fragment of the value, in order: the value, or
+    // the contents of each of its chunks.
+    template <typename Func>
+    void for_each_value_fragment(Func&& func) const {
+        if (!_chunk_count) {
+            func(value());
+            return;
+        }
+        for (unsigned i = 0; i < _chunk_count; i++) {
+            auto c = chunk(i);
+            func(std::experimental::string_view(c->_data + sizeof(chunk_header), c->_value_size));
+        }
+    }
+
+    size_t chunk_count() const {
+        return _chunk_count;
+    }
+
+    item& first_chunk() const {
+        return *chunk(0);
     }
 
-    size_t ascii_prefix_size() const {
-        return _ascii_prefix_size;
+    chunk_header& header_of_chunk() {
+        return *reinterpret_cast<chunk_header*>(_data);
+    }
+
+    // Returns the chunks of the value to the slab
+    void free_chunks() {
+        for (unsigned i = 0; i < _chunk_count; i++) {
+            auto c = chunk(i);
+            slab->unlock_item(c);
+            slab->free(c);
+        }
+        _chunk_count = 0;
+    }
+
+    size_t key_size() const {
+        return _key_size;
     }
 
     size_t value_size() const {
@@ -205,6 +348,9 @@ class item : public slab_item_base {
     }
 
     optional<uint64_t> data_as_integral() {
+        if (_chunk_count) {
+            return {};
+        }
         auto str = value().data();
         if (str[0] == '-') {
             return {};
@@ -224,11 +370,6 @@ class item : public slab_item_base {
         }
     }
 
-    // needed by timer_set
-    bool cancel() {
-        return false;
-    }
-
     // Methods required by slab allocator.
     uint32_t get_slab_page_index() const {
         return _slab_page_index;
@@ -260,6 +401,7 @@ class item : public slab_item_base {
         if (it->_ref_count == 1) {
             slab->unlock_item(it);
         } else if (it->_ref_count == 0) {
+            it->free_chunks();
             slab->free(it);
         }
         assert(it->_ref_count >= 0);
@@ -268,11 +410,18 @@ class item : public slab_item_base {
     friend class item_key_cmp;
 };
 
+// Hashes keys as items keep their hash, truncated to 32 bits
+struct item_key_hash {
+    size_t operator()(const item_key& key) const {
+        return uint32_t(key.hash());
+    }
+};
+
 struct item_key_cmp
 {
 private:
     bool compare(const item_key& key, const item& it) const {
-        return (it._key_hash == key.hash()) &&
+        return (it._key_hash == uint32_t(key.hash())) &&
             (it._key_size == key.key().size()) &&
             (memcmp(it._data, key.key().c_str(), it._key_size) == 0);
     }
@@ -308,6 +457,14 @@ struct cache_stats {
     size_t _resize_failure {};
     size_t _size {};
     size_t _reclaims{};
+    // Requests received on this shard for keys it owns, and for keys of
+    // other shards
+    size_t _local_requests {};
+    size_t _remote_requests {};
+    // Gets served by replicas of other shards' hot keys, and keys of this
+    // shard that are replicated
+    size_t _replica_hits {};
+    size_t _hot_keys {};
 
     void operator+=(const cache_stats& o) {
         _get_hits += o._get_hits;
@@ -329,9 +486,37 @@ struct cache_stats {
         _resize_failure += o._resize_failure;
         _size += o._size;
         _reclaims += o._reclaims;
+        _local_requests += o._local_requests;
+        _remote_requests += o._remote_requests;
+        _replica_hits += o._replica_hits;
+        _hot_keys += o._hot_keys;
     }
 };
 
+// Snapshots of a shard's items, so that a restarted server comes back warm.
+// A snapshot file is the magic string followed by the items, each a
+// snapshot_record_header in native byte order and the key and value it
+// sizes, and ends with a header whose key_size is 0.
+static constexpr char snapshot_magic[] = "SSMCSNP2";
+static constexpr size_t snapshot_chunk_size = 64 * 1024;
+
+struct snapshot_record_header {
+    uint8_t key_size;
+    uint32_t flags;
+    uint32_t value_size;
+    // Wall clock seconds since the epoch; 0 means never
+    uint32_t expiry;
+} __attribute__((packed));
+
+static const io_priority_class& snapshot_priority_class() {
+    static auto pc = engine().register_one_priority_class("memcached_snapshot", 20);
+    return pc;
+}
+
+static sstring snapshot_path(const sstring& dir, unsigned shard) {
+    return dir + "/shard-" + to_sstring(shard) + ".snapshot";
+}
+
 enum class cas_result {
     not_found, stored, bad_version
 };
@@ -354,44 +539,147 @@ struct local_origin_tag {
 
 struct item_insertion_data {
     item_key key;
-    sstring ascii_prefix;
+    uint32_t flags;
     sstring data;
     expiration expiry;
 };
 
+// Estimates how often keys are requested, in little memory: a count-min
+// sketch of the requests it is shown, whose counts are halved by age() so
+// that they follow recent traffic. Collisions can make an estimate too
+// high, but never too low.
+class hot_key_sketch {
+    static constexpr unsigned depth = 4;
+    static constexpr unsigned width_bits = 11;
+    static constexpr size_t width = size_t(1) << width_bits;
+    std::array<std::array<uint16_t, width>, depth> _counts{};
+private:
+    // Each row takes its own bits of the multiplicatively mixed hash
+    static size_t index(uint32_t hash, unsigned row) {
+        uint64_t mixed = hash * 0x9e3779b97f4a7c15ULL;
+        return (mixed >> (64 - width_bits * (row + 1))) & (width - 1);
+    }
+public:
+    // Counts a request for the key with @hash, and returns the estimate of
+    // its count
+    unsigned add(uint32_t hash) {
+        unsigned estimate = std::numeric_limits<uint16_t>::max();
+        for (unsigned row = 0; row < depth; ++row) {
+            auto& count = _counts[row][index(hash, row)];
+            if (count < std::numeric_limits<uint16_t>::max()) {
+                ++count;
+            }
+            estimate = std::min<unsigned>(estimate, count);
+        }
+        return estimate;
+    }
+
+    void age() {
+        for (auto& row : _counts) {
+            for (auto& count : row) {
+                count >>= 1;
+            }
+        }
+    }
+};
+
 class cache {
 private:
     using cache_type = bi::unordered_set<item,
         bi::member_hook<item, item::hook_type, &item::_cache_link>,
         bi::power_2_buckets<true>,
         bi::constant_time_size<true>>;
-    using cache_iterator = typename cache_type::iterator;
     static constexpr size_t initial_bucket_count = 1 << 10;
     static constexpr float load_factor = 0.75f;
+    // Buckets of the old table moved to the new one per lookup, while growing
+    static constexpr size_t rehash_buckets_per_lookup = 8;
     size_t _resize_up_threshold = load_factor * initial_bucket_count;
     cache_type::bucket_type* _buckets;
     cache_type _cache;
-    seastar::timer_set<item, &item::_timer_link> _alive;
+    // The table is grown incrementally, so that no single operation
+    // rehashes all items. While the old table is being migrated, buckets of
+    // it below _migrated_buckets have been moved to _cache; a key whose old
+    // bucket has not been moved yet is still looked up and inserted there.
+    std::unique_ptr<cache_type> _old_cache;
+    cache_type::bucket_type* _old_buckets = nullptr;
+    size_t _migrated_buckets = 0;
+    sstring _snapshot_path;
+    timer<clock_type> _snapshot_timer;
+    semaphore _snapshot_sem{1};
+    // Sweeps the table for expired items
     timer<clock_type> _timer;
+    static constexpr auto sweep_period = std::chrono::milliseconds(100);
+    // Every bucket is swept about once per this many periods
+    static constexpr size_t sweep_periods_per_table = 100;
+    static constexpr size_t min_buckets_per_sweep = 256;
+    // Where the sweep has got to: a bucket of _cache, or of _old_cache
+    bool _sweeping_old = false;
+    size_t _sweep_bucket = 0;
+    // Items that have an expiry, so that there is something to sweep for
+    size_t _expiring_items = 0;
     // delta in seconds between the current values of a wall clock and a clock_type clock
     clock_type::duration _wc_to_clock_type_delta;
     cache_stats _stats;
     timer<clock_type> _flush_timer;
+    // Items larger than this have their value split into chunks of this
+    // size, the last one taking only what it needs, so that they neither
+    // waste most of a slab page nor are limited to one.
+    size_t _max_unchunked_item_size;
+    // The first chunks of chunked items, oldest first. Chunks can't be
+    // evicted by the slab, so when there is no room for a chunk, items
+    // are evicted from here instead.
+    bi::list<chunk_header, bi::member_hook<chunk_header, bi::list_member_hook<>, &chunk_header::link>,
+        bi::constant_time_size<false>> _chunked_items;
+    // Keys requested often enough to saturate the shard owning them are
+    // replicated, read-only, to the other shards, which then serve gets of
+    // them locally. The owner drops the replicas of a hot key when it is
+    // written, removed or evicted, before the write is acknowledged.
+    distributed<cache>& _peers;
+    bool _replicate_hot_keys = false;
+    hot_key_sketch _hot_key_sketch;
+    // One get in this many is shown to the sketch
+    static constexpr unsigned hot_key_sample_interval = 8;
+    unsigned _hot_key_sample_countdown = hot_key_sample_interval;
+    // Sampled gets of a key, within about an aging period, that make it hot
+    static constexpr unsigned hot_key_threshold = 64;
+    static constexpr auto hot_key_aging_period = std::chrono::seconds(1);
+    timer<clock_type> _hot_key_aging_timer;
+    static constexpr size_t max_hot_keys = 64;
+    // This shard's keys that are replicated, oldest first
+    std::deque<sstring> _hot_keys;
+    // Hot keys whose replicas are to be dropped
+    std::vector<sstring> _invalidated_hot_keys;
+    // Resolves once the replicas of the keys invalidated so far are gone
+    shared_future<> _replicas_dropped{make_ready_future<>()};
+    unsigned _replica_drops_in_flight = 0;
+    // Replicas of other shards' hot keys. Each holds two references to its
+    // item, which keeps it locked in the slab.
+    std::unordered_map<item_key, item*, item_key_hash> _replicas;
 private:
+    size_t chunk_capacity() const {
+        return _max_unchunked_item_size - sizeof(item) - sizeof(chunk_header);
+    }
+
+    // Memory taken by an item: itself, and its chunks if it has any
+    static size_t item_footprint(size_t key_size, size_t value_size, size_t chunks) {
+        auto size = sizeof(item) + key_size + value_size;
+        return size + chunks * (sizeof(item*) + sizeof(item) + sizeof(chunk_header));
+    }
+
+    size_t chunk_count(item_insertion_data& insertion) {
+        auto size = item_footprint(insertion.key.key().size(), insertion.data.size(), 0);
+        if (size <= _max_unchunked_item_size) {
+            return 0;
+        }
+        return (insertion.data.size() + chunk_capacity() - 1) / chunk_capacity();
+    }
+
     size_t item_size(item& item_ref) {
-        constexpr size_t field_alignment = alignof(void*);
-        return sizeof(item) +
-            align_up(item_ref.key_size(), field_alignment) +
-            align_up(item_ref.ascii_prefix_size(), field_alignment) +
-            item_ref.value_size();
+        return item_footprint(item_ref.key_size(), item_ref.value_size(), item_ref.chunk_count());
     }
 
     size_t item_size(item_insertion_data& insertion) {
-        constexpr size_t field_alignment = alignof(void*);
-        auto size = sizeof(item) +
-            align_up(insertion.key.key().size(), field_alignment) +
-            align_up(insertion.ascii_prefix.size(), field_alignment) +
-            insertion.data.size();
+        auto size = item_footprint(insertion.key.key().size(), insertion.data.size(), chunk_count(insertion));
 #ifdef __DEBUG__
         static bool print_item_footprint = true;
         if (print_item_footprint) {
@@ -400,30 +688,199 @@ class cache {
             std::cout << "sizeof(item)      " << sizeof(item) << "\n";
             std::cout << "key.size          " << insertion.key.key().size() << "\n";
             std::cout << "value.size        " << insertion.data.size() << "\n";
-            std::cout << "ascii_prefix.size " << insertion.ascii_prefix.size() << "\n";
         }
 #endif
         return size;
     }
 
-    template <bool IsInCache = true, bool IsInTimerList = true, bool Release = true>
+    cache_type& table_of(const item& item_ref) {
+        if (_old_cache && _old_cache->bucket(item_ref) >= _migrated_buckets) {
+            return *_old_cache;
+        }
+        return _cache;
+    }
+
+    cache_type& table_of(const item_key& key) {
+        if (_old_cache && _old_cache->bucket(key, item_key_hash()) >= _migrated_buckets) {
+            return *_old_cache;
+        }
+        return _cache;
+    }
+
+    template <bool IsInCache = true, bool Release = true>
     void erase(item& item_ref) {
         if (IsInCache) {
-            _cache.erase(_cache.iterator_to(item_ref));
+            auto& table = table_of(item_ref);
+            table.erase(table.iterator_to(item_ref));
         }
-        if (IsInTimerList) {
-            if (item_ref._expiry.ever_expires()) {
-                _alive.remove(item_ref);
-            }
+        if (!_hot_keys.empty()) {
+            invalidate_hot_key(item_ref);
+        }
+        if (item_ref.ever_expires()) {
+            _expiring_items--;
+        }
+        if (item_ref.chunk_count()) {
+            _chunked_items.erase(_chunked_items.iterator_to(item_ref.first_chunk().header_of_chunk()));
         }
         _stats._bytes -= item_size(item_ref);
         if (Release) {
             // memory used by item shouldn't be freed when slab is replacing it with another item.
             intrusive_ptr_release(&item_ref);
+        } else {
+            item_ref.free_chunks();
+        }
+    }
+
+    std::deque<sstring>::iterator find_hot_key(const item& item_ref) {
+        auto key = item_ref.key();
+        return std::find_if(_hot_keys.begin(), _hot_keys.end(), [key] (const sstring& hot_key) {
+            return hot_key.size() == key.size() && !memcmp(hot_key.data(), key.data(), key.size());
+        });
+    }
+
+    void invalidate_hot_key(const item& item_ref) {
+        auto i = find_hot_key(item_ref);
+        if (i != _hot_keys.end()) {
+            _invalidated_hot_keys.push_back(std::move(*i));
+            _hot_keys.erase(i);
+        }
+    }
+
+    // Shows a get of an item to the sketch, once every sample interval,
+    // and replicates the item if that makes its key hot
+    void sample_get(item& item_ref) {
+        if (--_hot_key_sample_countdown) {
+            return;
+        }
+        _hot_key_sample_countdown = hot_key_sample_interval;
+        if (_hot_key_sketch.add(item_ref._key_hash) < hot_key_threshold
+                || item_ref.chunk_count() || find_hot_key(item_ref) != _hot_keys.end()) {
+            return;
+        }
+        if (_hot_keys.size() == max_hot_keys) {
+            _invalidated_hot_keys.push_back(std::move(_hot_keys.front()));
+            _hot_keys.pop_front();
         }
+        _hot_keys.emplace_back(item_ref.key().data(), item_ref.key().size());
+        replicate(item_ref);
+    }
+
+    // Copies the item to the other shards. Drops of replicas are sent
+    // after this, so that they reach each shard after the copy.
+    void replicate(item& item_ref) {
+        auto owner = engine().cpu_id();
+        auto hold = boost::intrusive_ptr<item>(&item_ref);
+        _peers.invoke_on_all([owner, &item_ref] (cache& c) {
+            if (engine().cpu_id() != owner) {
+                c.add_replica(item_ref);
+            }
+        }).finally([hold = std::move(hold)] {});
+    }
+
+    // Stores a copy of another shard's item, which stays live and
+    // unchanged until this returns
+    void add_replica(const item& original) {
+        auto key = item_key(sstring(original.key().data(), original.key().size()));
+        auto i = _replicas.find(key);
+        if (i != _replicas.end()) {
+            release_replica(i->second);
+            _replicas.erase(i);
+        }
+        auto value = original.value();
+        item* replica;
+        try {
+            replica = slab->create(item_footprint(key.key().size(), value.size(), 0), item_key(key.key()),
+                original.flags(), sstring(value.data(), value.size()), original.expiry(), original._version);
+        } catch (const std::bad_alloc&) {
+            // The key is served by its owner instead
+            return;
+        }
+        replica->_replica = true;
+        intrusive_ptr_add_ref(replica);
+        intrusive_ptr_add_ref(replica);
+        _replicas.emplace(std::move(key), replica);
     }
 
-    void expire() {
+    static void release_replica(item* replica) {
+        intrusive_ptr_release(replica);
+        intrusive_ptr_release(replica);
+    }
+
+    void drop_replicas(const std::vector<sstring>& keys) {
+        for (auto& key : keys) {
+            auto i = _replicas.find(item_key(key));
+            if (i != _replicas.end()) {
+                release_replica(i->second);
+                _replicas.erase(i);
+            }
+        }
+    }
+
+    // Evicts the oldest chunked item not in use, returning its chunks to
+    // the slab.
+    bool evict_chunked_item() {
+        for (auto& c : _chunked_items) {
+            auto& owner = *c.owner;
+            if (owner.is_unlocked()) {
+                erase(owner);
+                _stats._evicted++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    item* create_chunk(const char* value, uint32_t size) {
+        while (true) {
+            try {
+                auto chunk = slab->create(sizeof(item) + sizeof(chunk_header) + size, value, size);
+                slab->lock_item(chunk);
+                return chunk;
+            } catch (const std::bad_alloc&) {
+                if (!evict_chunked_item()) {
+                    throw;
+                }
+            }
+        }
+    }
+
+    // Allocates an item for the insertion, and the chunks of its value if
+    // it is too large to be stored inline.
+    template <typename Origin>
+    item* create_item(item_insertion_data& insertion, item::version_type version) {
+        auto chunks = chunk_count(insertion);
+        if (!chunks) {
+            return slab->create(item_size(insertion), Origin::move_if_local(insertion.key),
+                insertion.flags, Origin::move_if_local(insertion.data), insertion.expiry, version);
+        }
+        if (chunks > std::numeric_limits<uint16_t>::max()) {
+            throw std::bad_alloc();
+        }
+        std::vector<item*> chunk_items;
+        chunk_items.reserve(chunks);
+        auto& data = insertion.data;
+        try {
+            for (size_t offset = 0; offset < data.size(); offset += chunk_capacity()) {
+                auto size = std::min(chunk_capacity(), data.size() - offset);
+                chunk_items.push_back(create_chunk(data.begin() + offset, size));
+            }
+            size_t header_size = item_footprint(insertion.key.key().size(), chunks * sizeof(item*), 0);
+            auto new_item = slab->create(header_size, Origin::move_if_local(insertion.key),
+                insertion.flags, chunk_items, uint32_t(data.size()), insertion.expiry, version);
+            _chunked_items.push_back(chunk_items.front()->header_of_chunk());
+            return new_item;
+        } catch (...) {
+            for (auto chunk : chunk_items) {
+                slab->unlock_item(chunk);
+                slab->free(chunk);
+            }
+            throw;
+        }
+    }
+
+    // Erases the expired items of the next buckets, enough of them that
+    // the whole table is swept every sweep_periods_per_table periods
+    void sweep() {
         using namespace std::chrono;
 
         //
@@ -433,90 +890,241 @@ class cache {
         _wc_to_clock_type_delta =
             duration_cast<clock_type::duration>(clock_type::now().time_since_epoch() - system_clock::now().time_since_epoch());
 
-        auto exp = _alive.expire(clock_type::now());
-        while (!exp.empty()) {
-            auto item = &*exp.begin();
-            exp.pop_front();
-            erase<true, false>(*item);
-            _stats._expired++;
+        if (!_expiring_items) {
+            return;
+        }
+        auto now = clock_type::now();
+        auto n = std::max(min_buckets_per_sweep, _cache.bucket_count() / sweep_periods_per_table);
+        for (; n; n--) {
+            auto table = _sweeping_old ? _old_cache.get() : &_cache;
+            if (!table || _sweep_bucket >= table->bucket_count()) {
+                _sweeping_old = !_sweeping_old;
+                _sweep_bucket = 0;
+                continue;
+            }
+            for (auto i = table->begin(_sweep_bucket); i != table->end(_sweep_bucket);) {
+                auto& item_ref = *i++;
+                if (item_ref.expired(now)) {
+                    erase(item_ref);
+                    _stats._expired++;
+                }
+            }
+            _sweep_bucket++;
         }
-        _timer.arm(_alive.get_next_timeout());
     }
 
+    // Returns the item with the key, or null
     inline
-    cache_iterator find(const item_key& key) {
-        return _cache.find(key, std::hash<item_key>(), item_key_cmp());
+    item* find(const item_key& key) {
+        if (_old_cache) {
+            migrate_buckets(rehash_buckets_per_lookup);
+        }
+        auto& table = table_of(key);
+        auto i = table.find(key, item_key_hash(), item_key_cmp());
+        if (i == table.end()) {
+            return nullptr;
+        }
+        if (i->expired(clock_type::now())) {
+            erase(*i);
+            _stats._expired++;
+            return nullptr;
+        }
+        return &*i;
     }
 
     template <typename Origin>
     inline
-    cache_iterator add_overriding(cache_iterator i, item_insertion_data& insertion) {
-        auto& old_item = *i;
+    item& add_overriding(item& old_item, item_insertion_data& insertion) {
         uint64_t old_item_version = old_item._version;
 
         erase(old_item);
 
         size_t size = item_size(insertion);
-        auto new_item = slab->create(size, Origin::move_if_local(insertion.key), Origin::move_if_local(insertion.ascii_prefix),
-            Origin::move_if_local(insertion.data), insertion.expiry, old_item_version + 1);
+        auto new_item = create_item<Origin>(insertion, old_item_version + 1);
         intrusive_ptr_add_ref(new_item);
 
-        auto insert_result = _cache.insert(*new_item);
+        auto insert_result = table_of(*new_item).insert(*new_item);
         assert(insert_result.second);
-        if (insertion.expiry.ever_expires() && _alive.insert(*new_item)) {
-            _timer.rearm(new_item->get_timeout());
+        if (new_item->ever_expires()) {
+            _expiring_items++;
         }
         _stats._bytes += size;
-        return insert_result.first;
+        return *new_item;
     }
 
     template <typename Origin>
     inline
     void add_new(item_insertion_data& insertion) {
         size_t size = item_size(insertion);
-        auto new_item = slab->create(size, Origin::move_if_local(insertion.key), Origin::move_if_local(insertion.ascii_prefix),
-            Origin::move_if_local(insertion.data), insertion.expiry);
+        auto new_item = create_item<Origin>(insertion, 1);
         intrusive_ptr_add_ref(new_item);
         auto& item_ref = *new_item;
-        _cache.insert(item_ref);
-        if (insertion.expiry.ever_expires() && _alive.insert(item_ref)) {
-            _timer.rearm(item_ref.get_timeout());
+        table_of(item_ref).insert(item_ref);
+        if (item_ref.ever_expires()) {
+            _expiring_items++;
         }
         _stats._bytes += size;
         maybe_rehash();
     }
 
     void maybe_rehash() {
+        if (_old_cache) {
+            migrate_buckets(rehash_buckets_per_lookup);
+            return;
+        }
         if (_cache.size() >= _resize_up_threshold) {
             auto new_size = _cache.bucket_count() * 2;
-            auto old_buckets = _buckets;
+            cache_type::bucket_type* new_buckets = nullptr;
             try {
-                _buckets = new cache_type::bucket_type[new_size];
+                new_buckets = new cache_type::bucket_type[new_size];
+                _old_cache = std::make_unique<cache_type>(typename cache_type::bucket_traits(new_buckets, new_size));
             } catch (const std::bad_alloc& e) {
+                delete[] new_buckets;
                 _stats._resize_failure++;
                 return;
             }
-            _cache.rehash(typename cache_type::bucket_traits(_buckets, new_size));
-            delete[] old_buckets;
-            _resize_up_threshold = _cache.bucket_count() * load_factor;
+            // The new, empty table becomes _cache
+            _cache.swap(*_old_cache);
+            _old_buckets = std::exchange(_buckets, new_buckets);
+            _migrated_buckets = 0;
+            _resize_up_threshold = new_size * load_factor;
+        }
+    }
+
+    void migrate_buckets(size_t n) {
+        auto count = _old_cache->bucket_count();
+        for (; n && _migrated_buckets < count; n--, _migrated_buckets++) {
+            while (_old_cache->begin(_migrated_buckets) != _old_cache->end(_migrated_buckets)) {
+                auto& item_ref = *_old_cache->begin(_migrated_buckets);
+                _old_cache->erase(_old_cache->iterator_to(item_ref));
+                _cache.insert(item_ref);
+            }
+        }
+        if (_migrated_buckets == count) {
+            finish_rehash();
+        }
+    }
+
+    void finish_rehash() {
+        _old_cache.reset();
+        delete[] _old_buckets;
+        _old_buckets = nullptr;
+    }
+
+    // Where a snapshot being written has got to: a bucket of _cache, or
+    // once past those, of _old_cache
+    struct snapshot_cursor {
+        bool old = false;
+        size_t bucket = 0;
+    };
+
+    void append_snapshot_record(std::string& buf, item& item_ref) {
+        using namespace std::chrono;
+        snapshot_record_header hdr;
+        hdr.key_size = item_ref.key_size();
+        hdr.flags = item_ref.flags();
+        hdr.value_size = item_ref.value_size();
+        hdr.expiry = 0;
+        if (item_ref.ever_expires()) {
+            auto wall = item_ref.expiry().to_time_point().time_since_epoch() - _wc_to_clock_type_delta;
+            hdr.expiry = std::max<int64_t>(1, duration_cast<seconds>(wall).count());
+        }
+        buf.append(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        buf.append(item_ref.key().data(), item_ref.key_size());
+        item_ref.for_each_value_fragment([&buf] (auto fragment) {
+            buf.append(fragment.data(), fragment.size());
+        });
+    }
+
+    // Serializes the items of whole buckets, up to about snapshot_chunk_size
+    // bytes, without yielding. Buckets are revisited by index across
+    // chunks, so items stored, moved by a rehash, or removed meanwhile may
+    // be missed or written twice; a snapshot is a best effort.
+    std::string snapshot_chunk(snapshot_cursor& cursor) {
+        std::string buf;
+        while (buf.size() < snapshot_chunk_size) {
+            auto table = cursor.old ? _old_cache.get() : &_cache;
+            if (!table || cursor.bucket >= table->bucket_count()) {
+                if (cursor.old) {
+                    break;
+                }
+                cursor = snapshot_cursor{true, 0};
+                continue;
+            }
+            for (auto i = table->begin(cursor.bucket); i != table->end(cursor.bucket); ++i) {
+                append_snapshot_record(buf, *i);
+            }
+            cursor.bucket++;
         }
+        return buf;
+    }
+
+    // Writes the shard's items to a temporary file, which then replaces the
+    // previous snapshot
+    future<> write_snapshot() {
+        auto tmp = _snapshot_path + ".tmp";
+        return open_file_dma(tmp, open_flags::wo | open_flags::create | open_flags::truncate).then([this] (file f) {
+            file_output_stream_options options;
+            options.buffer_size = 128 * 1024;
+            options.io_priority_class = snapshot_priority_class();
+            auto out = make_lw_shared<output_stream<char>>(make_file_output_stream(std::move(f), options));
+            auto cursor = make_lw_shared<snapshot_cursor>();
+            return out->write(snapshot_magic, sizeof(snapshot_magic) - 1).then([this, out, cursor] {
+                return repeat([this, out, cursor] {
+                    auto chunk = snapshot_chunk(*cursor);
+                    if (chunk.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return out->write(chunk).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).then([out] {
+                snapshot_record_header end = {};
+                return out->write(reinterpret_cast<const char*>(&end), sizeof(end));
+            }).then([out] {
+                return out->flush();
+            }).finally([out] {
+                return out->close();
+            });
+        }).then([this, tmp] {
+            return rename_file(tmp, _snapshot_path);
+        });
+    }
+
+    future<> snapshot() {
+        return with_semaphore(_snapshot_sem, 1, [this] {
+            return write_snapshot();
+        }).handle_exception([this] (std::exception_ptr ep) {
+            memcache_logger.warn("Failed to write snapshot {}: {}", _snapshot_path, ep);
+        });
     }
 public:
-    cache(uint64_t per_cpu_slab_size, uint64_t slab_page_size)
+    cache(distributed<cache>& peers, uint64_t per_cpu_slab_size, uint64_t slab_page_size,
+          slab_eviction_policy eviction_policy)
         : _buckets(new cache_type::bucket_type[initial_bucket_count])
         , _cache(cache_type::bucket_traits(_buckets, initial_bucket_count))
+        , _peers(peers)
     {
         using namespace std::chrono;
 
         _wc_to_clock_type_delta =
             duration_cast<clock_type::duration>(clock_type::now().time_since_epoch() - system_clock::now().time_since_epoch());
 
-        _timer.set_callback([this] { expire(); });
+        _timer.set_callback([this] { sweep(); });
+        _timer.arm_periodic(sweep_period);
         _flush_timer.set_callback([this] { flush_all(); });
 
         // initialize per-thread slab allocator.
         slab = new slab_allocator<item>(default_slab_growth_factor, per_cpu_slab_size, slab_page_size,
-                [this](item& item_ref) { erase<true, true, false>(item_ref); _stats._evicted++; });
+                [this](item& item_ref) {
+                    // A dropped replica is only evictable once nothing else references it
+                    if (!item_ref._replica) {
+                        erase<true, false>(item_ref);
+                        _stats._evicted++;
+                    }
+                }, eviction_policy);
+        _max_unchunked_item_size = slab->max_shared_object_size();
 #ifdef __DEBUG__
         static bool print_slab_classes = true;
         if (print_slab_classes) {
@@ -532,9 +1140,22 @@ class cache {
 
     void flush_all() {
         _flush_timer.cancel();
+        // Every shard flushes, dropping its replicas
+        _hot_keys.clear();
+        _invalidated_hot_keys.clear();
+        for (auto& r : _replicas) {
+            release_replica(r.second);
+        }
+        _replicas.clear();
         _cache.erase_and_dispose(_cache.begin(), _cache.end(), [this] (item* it) {
-            erase<false, true>(*it);
+            erase<false>(*it);
         });
+        if (_old_cache) {
+            _old_cache->erase_and_dispose(_old_cache->begin(), _old_cache->end(), [this] (item* it) {
+                erase<false>(*it);
+            });
+            finish_rehash();
+        }
     }
 
     void flush_at(uint32_t time) {
@@ -545,8 +1166,8 @@ class cache {
     template <typename Origin = local_origin_tag>
     bool set(item_insertion_data& insertion) {
         auto i = find(insertion.key);
-        if (i != _cache.end()) {
-            add_overriding<Origin>(i, insertion);
+        if (i) {
+            add_overriding<Origin>(*i, insertion);
             _stats._set_replaces++;
             return true;
         } else {
@@ -558,8 +1179,7 @@ class cache {
 
     template <typename Origin = local_origin_tag>
     bool add(item_insertion_data& insertion) {
-        auto i = find(insertion.key);
-        if (i != _cache.end()) {
+        if (find(insertion.key)) {
             return false;
         }
 
@@ -571,18 +1191,18 @@ class cache {
     template <typename Origin = local_origin_tag>
     bool replace(item_insertion_data& insertion) {
         auto i = find(insertion.key);
-        if (i == _cache.end()) {
+        if (!i) {
             return false;
         }
 
         _stats._set_replaces++;
-        add_overriding<Origin>(i, insertion);
+        add_overriding<Origin>(*i, insertion);
         return true;
     }
 
     bool remove(const item_key& key) {
         auto i = find(key);
-        if (i == _cache.end()) {
+        if (!i) {
             _stats._delete_misses++;
             return false;
         }
@@ -594,19 +1214,22 @@ class cache {
 
     item_ptr get(const item_key& key) {
         auto i = find(key);
-        if (i == _cache.end()) {
+        if (!i) {
             _stats._get_misses++;
             return nullptr;
         }
         _stats._get_hits++;
         auto& item_ref = *i;
+        if (_replicate_hot_keys) {
+            sample_get(item_ref);
+        }
         return item_ptr(&item_ref);
     }
 
     template <typename Origin = local_origin_tag>
     cas_result cas(item_insertion_data& insertion, item::version_type version) {
         auto i = find(insertion.key);
-        if (i == _cache.end()) {
+        if (!i) {
             _stats._cas_misses++;
             return cas_result::not_found;
         }
@@ -616,12 +1239,12 @@ class cache {
             return cas_result::bad_version;
         }
         _stats._cas_hits++;
-        add_overriding<Origin>(i, insertion);
+        add_overriding<Origin>(*i, insertion);
         return cas_result::stored;
     }
 
     size_t size() {
-        return _cache.size();
+        return _cache.size() + (_old_cache ? _old_cache->size() : 0);
     }
 
     size_t bucket_count() {
@@ -630,13 +1253,72 @@ class cache {
 
     cache_stats stats() {
         _stats._size = size();
+        _stats._hot_keys = _hot_keys.size();
         return _stats;
     }
 
+    // Has keys of this shard that become hot replicated to the others
+    void enable_hot_key_replication() {
+        _replicate_hot_keys = true;
+        _hot_key_aging_timer.set_callback([this] {
+            _hot_key_sketch.age();
+            // Hot keys evicted or displaced since the last write
+            drop_invalidated_replicas();
+        });
+        _hot_key_aging_timer.arm_periodic(hot_key_aging_period);
+    }
+
+    // Returns this shard's replica of another shard's hot key, or null
+    item_ptr get_replica(const item_key& key) {
+        if (_replicas.empty()) {
+            return nullptr;
+        }
+        auto i = _replicas.find(key);
+        if (i == _replicas.end() || i->second->expired(clock_type::now())) {
+            return nullptr;
+        }
+        _stats._get_hits++;
+        _stats._replica_hits++;
+        return item_ptr(i->second);
+    }
+
+    // Drops the replicas of the hot keys written, removed or evicted here
+    // since the last call. Resolves once they, and those dropped before,
+    // are gone.
+    future<> drop_invalidated_replicas() {
+        if (!_invalidated_hot_keys.empty()) {
+            auto keys = std::make_unique<std::vector<sstring>>(std::exchange(_invalidated_hot_keys, {}));
+            auto& keys_ref = *keys;
+            auto owner = engine().cpu_id();
+            _replica_drops_in_flight++;
+            _replicas_dropped = _replicas_dropped.get_future().then([this, owner, &keys_ref] {
+                return _peers.invoke_on_all([owner, &keys_ref] (cache& c) {
+                    if (engine().cpu_id() != owner) {
+                        c.drop_replicas(keys_ref);
+                    }
+                });
+            }).finally([this, keys = std::move(keys)] {
+                _replica_drops_in_flight--;
+            });
+        }
+        if (!_replica_drops_in_flight) {
+            return make_ready_future<>();
+        }
+        return _replicas_dropped.get_future();
+    }
+
+    void count_request(bool local) {
+        if (local) {
+            _stats._local_requests++;
+        } else {
+            _stats._remote_requests++;
+        }
+    }
+
     template <typename Origin = local_origin_tag>
     std::pair<item_ptr, bool> incr(item_key& key, uint64_t delta) {
         auto i = find(key);
-        if (i == _cache.end()) {
+        if (!i) {
             _stats._incr_misses++;
             return {item_ptr{}, false};
         }
@@ -648,18 +1330,18 @@ class cache {
         }
         item_insertion_data insertion {
             .key = Origin::move_if_local(key),
-            .ascii_prefix = sstring(item_ref.ascii_prefix().data(), item_ref.ascii_prefix_size()),
+            .flags = item_ref.flags(),
             .data = to_sstring(*value + delta),
-            .expiry = item_ref._expiry
+            .expiry = item_ref.expiry()
         };
-        i = add_overriding<local_origin_tag>(i, insertion);
-        return {boost::intrusive_ptr<item>(&*i), true};
+        auto& new_item = add_overriding<local_origin_tag>(*i, insertion);
+        return {boost::intrusive_ptr<item>(&new_item), true};
     }
 
     template <typename Origin = local_origin_tag>
     std::pair<item_ptr, bool> decr(item_key& key, uint64_t delta) {
         auto i = find(key);
-        if (i == _cache.end()) {
+        if (!i) {
             _stats._decr_misses++;
             return {item_ptr{}, false};
         }
@@ -671,12 +1353,12 @@ class cache {
         }
         item_insertion_data insertion {
             .key = Origin::move_if_local(key),
-            .ascii_prefix = sstring(item_ref.ascii_prefix().data(), item_ref.ascii_prefix_size()),
+            .flags = item_ref.flags(),
             .data = to_sstring(*value - std::min(*value, delta)),
-            .expiry = item_ref._expiry
+            .expiry = item_ref.expiry()
         };
-        i = add_overriding<local_origin_tag>(i, insertion);
-        return {boost::intrusive_ptr<item>(&*i), true};
+        auto& new_item = add_overriding<local_origin_tag>(*i, insertion);
+        return {boost::intrusive_ptr<item>(&new_item), true};
     }
 
     std::pair<unsigned, foreign_ptr<lw_shared_ptr<std::string>>> print_hash_stats() {
@@ -704,6 +1386,10 @@ class cache {
         ss << "buckets: " << _cache.bucket_count() << "\n";
         ss << "load: " << sprint("%.2lf", (double)_cache.size() / _cache.bucket_count()) << "\n";
         ss << "max bucket occupancy: " << max_size << "\n";
+        if (_old_cache) {
+            ss << "growing from " << _old_cache->bucket_count() << " buckets, "
+               << _migrated_buckets << " migrated, " << _old_cache->size() << " items left\n";
+        }
         ss << "bucket occupancy histogram:\n";
 
         for (unsigned i = 0; i < (max_bucket + 2); i++) {
@@ -720,26 +1406,129 @@ class cache {
         return {engine().cpu_id(), make_foreign(make_lw_shared<std::string>(ss.str()))};
     }
 
-    future<> stop() { return make_ready_future<>(); }
+    // Snapshots the shard's items to @path every @period, and when stopped.
+    void enable_snapshots(sstring path, clock_type::duration period) {
+        _snapshot_path = std::move(path);
+        _snapshot_timer.set_callback([this] {
+            // A snapshot that is still being written makes this one moot
+            if (_snapshot_sem.available_units()) {
+                snapshot();
+            }
+        });
+        _snapshot_timer.arm_periodic(period);
+    }
+
+    future<> stop() {
+        if (_snapshot_path.empty()) {
+            return make_ready_future<>();
+        }
+        _snapshot_timer.cancel();
+        return snapshot();
+    }
     clock_type::duration get_wc_to_clock_type_delta() { return _wc_to_clock_type_delta; }
 };
 
 class sharded_cache {
 private:
     distributed<cache>& _peers;
+    bool _shard_local = false;
+    // Snapshots of shards up to this id are looked for at startup
+    static constexpr unsigned max_snapshot_shards = 256;
+
+    // Reads an item of a snapshot and stores it, unless expired. Resolves
+    // to false at the end of the snapshot.
+    future<bool> load_snapshot_record(input_stream<char>& in, item_insertion_data& insertion) {
+        return in.read_exactly(sizeof(snapshot_record_header)).then([this, &in, &insertion] (temporary_buffer<char> buf) {
+            if (buf.size() < sizeof(snapshot_record_header)) {
+                throw std::runtime_error("truncated snapshot");
+            }
+            auto hdr = *reinterpret_cast<const snapshot_record_header*>(buf.get());
+            if (!hdr.key_size) {
+                return make_ready_future<bool>(false);
+            }
+            auto size = size_t(hdr.key_size) + hdr.value_size;
+            return in.read_exactly(size).then([this, &insertion, hdr, size] (temporary_buffer<char> body) {
+                using namespace std::chrono;
+                if (body.size() < size) {
+                    throw std::runtime_error("truncated snapshot");
+                }
+                auto now = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+                if (hdr.expiry && hdr.expiry <= now) {
+                    return make_ready_future<bool>(true);
+                }
+                auto p = body.get();
+                insertion = item_insertion_data{
+                    .key = item_key(sstring(p, hdr.key_size)),
+                    .flags = hdr.flags,
+                    .data = sstring(p + hdr.key_size, hdr.value_size),
+                    .expiry = expiration(_peers.local().get_wc_to_clock_type_delta(), hdr.expiry)
+                };
+                return set(insertion).then([] (bool) {
+                    return true;
+                });
+            });
+        });
+    }
 
+    // Picks the shard owning @key, counting whether it is this one
     inline
     unsigned get_cpu(const item_key& key) {
-        return std::hash<item_key>()(key) % smp::count;
+        auto cpu = _shard_local ? engine().cpu_id() : std::hash<item_key>()(key) % smp::count;
+        _peers.local().count_request(cpu == engine().cpu_id());
+        return cpu;
+    }
+
+    // This shard's replica of @key, if it is another shard's hot key
+    item_ptr get_replica(const item_key& key) {
+        auto replica = _peers.local().get_replica(key);
+        if (replica) {
+            _peers.local().count_request(true);
+        }
+        return replica;
+    }
+
+    // Calls func(cache, origin) on @cpu, the shard owning the key written,
+    // and resolves to its result once the replicas of the hot keys it
+    // overwrote or removed are dropped
+    template <typename Func>
+    futurize_t<std::result_of_t<Func(cache&, local_origin_tag)>> write_on(unsigned cpu, Func func) {
+        auto drop_replicas = [] (cache& c, auto result) {
+            return c.drop_invalidated_replicas().then([result = std::move(result)] () mutable {
+                return std::move(result);
+            });
+        };
+        if (engine().cpu_id() == cpu) {
+            auto& c = _peers.local();
+            return drop_replicas(c, func(c, local_origin_tag()));
+        }
+        return _peers.invoke_on(cpu, [func = std::move(func), drop_replicas] (cache& c) mutable {
+            return drop_replicas(c, func(c, remote_origin_tag()));
+        });
     }
 public:
     sharded_cache(distributed<cache>& peers) : _peers(peers) {}
 
+    // Keeps every key on the shard it was requested on, instead of hashing
+    // keys to shards. Each shard is then a server of its own, which clients
+    // address through a port of its own and distribute keys over, like
+    // they do over servers.
+    void set_shard_local(bool shard_local) {
+        _shard_local = shard_local;
+    }
+
     future<> flush_all() {
+        if (_shard_local) {
+            _peers.local().flush_all();
+            return make_ready_future<>();
+        }
         return _peers.invoke_on_all(&cache::flush_all);
     }
 
     future<> flush_at(uint32_t time) {
+        if (_shard_local) {
+            _peers.local().flush_at(time);
+            return make_ready_future<>();
+        }
         return _peers.invoke_on_all(&cache::flush_at, time);
     }
 
@@ -747,50 +1536,88 @@ class sharded_cache {
 
     // The caller must keep @insertion live until the resulting future resolves.
     future<bool> set(item_insertion_data& insertion) {
-        auto cpu = get_cpu(insertion.key);
-        if (engine().cpu_id() == cpu) {
-            return make_ready_future<bool>(_peers.local().set(insertion));
-        }
-        return _peers.invoke_on(cpu, &cache::set<remote_origin_tag>, std::ref(insertion));
+        return write_on(get_cpu(insertion.key), [&insertion] (cache& c, auto origin) {
+            return c.set<decltype(origin)>(insertion);
+        });
     }
 
     // The caller must keep @insertion live until the resulting future resolves.
     future<bool> add(item_insertion_data& insertion) {
-        auto cpu = get_cpu(insertion.key);
-        if (engine().cpu_id() == cpu) {
-            return make_ready_future<bool>(_peers.local().add(insertion));
-        }
-        return _peers.invoke_on(cpu, &cache::add<remote_origin_tag>, std::ref(insertion));
+        return write_on(get_cpu(insertion.key), [&insertion] (cache& c, auto origin) {
+            return c.add<decltype(origin)>(insertion);
+        });
     }
 
     // The caller must keep @insertion live until the resulting future resolves.
     future<bool> replace(item_insertion_data& insertion) {
-        auto cpu = get_cpu(insertion.key);
-        if (engine().cpu_id() == cpu) {
-            return make_ready_future<bool>(_peers.local().replace(insertion));
-        }
-        return _peers.invoke_on(cpu, &cache::replace<remote_origin_tag>, std::ref(insertion));
+        return write_on(get_cpu(insertion.key), [&insertion] (cache& c, auto origin) {
+            return c.replace<decltype(origin)>(insertion);
+        });
     }
 
     // The caller must keep @key live until the resulting future resolves.
     future<bool> remove(const item_key& key) {
-        auto cpu = get_cpu(key);
-        return _peers.invoke_on(cpu, &cache::remove, std::ref(key));
+        return write_on(get_cpu(key), [&key] (cache& c, auto) {
+            return c.remove(key);
+        });
     }
 
     // The caller must keep @key live until the resulting future resolves.
     future<item_ptr> get(const item_key& key) {
+        if (auto replica = get_replica(key)) {
+            return make_ready_future<item_ptr>(std::move(replica));
+        }
         auto cpu = get_cpu(key);
         return _peers.invoke_on(cpu, &cache::get, std::ref(key));
     }
 
+    // Looks up all of @keys with one call to each shard owning any of
+    // them. The items, null where missing, are returned in key order.
+    // The caller must keep @keys live until the resulting future resolves.
+    future<std::vector<item_ptr>> get_multi(const std::vector<item_key>& keys) {
+        // Indexes into keys not replicated here, by owning shard
+        auto by_cpu = make_lw_shared<std::vector<std::vector<unsigned>>>(smp::count);
+        auto items = make_lw_shared<std::vector<item_ptr>>(keys.size());
+        for (unsigned i = 0; i < keys.size(); ++i) {
+            if (auto replica = get_replica(keys[i])) {
+                (*items)[i] = std::move(replica);
+            } else {
+                (*by_cpu)[get_cpu(keys[i])].push_back(i);
+            }
+        }
+        return parallel_for_each(boost::irange(0u, smp::count), [this, &keys, by_cpu, items] (unsigned cpu) {
+            auto& indexes = (*by_cpu)[cpu];
+            if (indexes.empty()) {
+                return make_ready_future<>();
+            }
+            if (cpu == engine().cpu_id()) {
+                for (auto i : indexes) {
+                    (*items)[i] = _peers.local().get(keys[i]);
+                }
+                return make_ready_future<>();
+            }
+            return _peers.invoke_on(cpu, [&keys, &indexes] (cache& c) {
+                std::vector<item_ptr> found;
+                found.reserve(indexes.size());
+                for (auto i : indexes) {
+                    found.push_back(c.get(keys[i]));
+                }
+                return found;
+            }).then([&indexes, items] (std::vector<item_ptr> found) {
+                for (unsigned j = 0; j < found.size(); ++j) {
+                    (*items)[indexes[j]] = std::move(found[j]);
+                }
+            });
+        }).then([by_cpu, items] {
+            return std::move(*items);
+        });
+    }
+
     // The caller must keep @insertion live until the resulting future resolves.
     future<cas_result> cas(item_insertion_data& insertion, item::version_type version) {
-        auto cpu = get_cpu(insertion.key);
-        if (engine().cpu_id() == cpu) {
-            return make_ready_future<cas_result>(_peers.local().cas(insertion, version));
-        }
-        return _peers.invoke_on(cpu, &cache::cas<remote_origin_tag>, std::ref(insertion), std::move(version));
+        return write_on(get_cpu(insertion.key), [&insertion, version] (cache& c, auto origin) {
+            return c.cas<decltype(origin)>(insertion, version);
+        });
     }
 
     future<cache_stats> stats() {
@@ -799,22 +1626,67 @@ class sharded_cache {
 
     // The caller must keep @key live until the resulting future resolves.
     future<std::pair<item_ptr, bool>> incr(item_key& key, uint64_t delta) {
-        auto cpu = get_cpu(key);
-        if (engine().cpu_id() == cpu) {
-            return make_ready_future<std::pair<item_ptr, bool>>(
-                _peers.local().incr<local_origin_tag>(key, delta));
-        }
-        return _peers.invoke_on(cpu, &cache::incr<remote_origin_tag>, std::ref(key), std::move(delta));
+        return write_on(get_cpu(key), [&key, delta] (cache& c, auto origin) {
+            return c.incr<decltype(origin)>(key, delta);
+        });
     }
 
     // The caller must keep @key live until the resulting future resolves.
     future<std::pair<item_ptr, bool>> decr(item_key& key, uint64_t delta) {
-        auto cpu = get_cpu(key);
-        if (engine().cpu_id() == cpu) {
-            return make_ready_future<std::pair<item_ptr, bool>>(
-                _peers.local().decr(key, delta));
-        }
-        return _peers.invoke_on(cpu, &cache::decr<remote_origin_tag>, std::ref(key), std::move(delta));
+        return write_on(get_cpu(key), [&key, delta] (cache& c, auto origin) {
+            return c.decr<decltype(origin)>(key, delta);
+        });
+    }
+
+    // Stores the items of a snapshot file, if there is one, through this
+    // shard. Keys are routed as if requested here, so snapshots taken with
+    // another number of shards load too.
+    future<> load_snapshot(sstring path) {
+        return file_exists(path).then([this, path] (bool exists) {
+            if (!exists) {
+                return make_ready_future<>();
+            }
+            return open_file_dma(path, open_flags::ro).then([this, path] (file f) {
+                file_input_stream_options options;
+                options.buffer_size = 128 * 1024;
+                options.read_ahead = 1;
+                options.io_priority_class = snapshot_priority_class();
+                auto in = make_lw_shared<input_stream<char>>(make_file_input_stream(std::move(f), options));
+                auto insertion = make_lw_shared<item_insertion_data>();
+                auto loaded = make_lw_shared<size_t>(0);
+                auto magic_size = sizeof(snapshot_magic) - 1;
+                return in->read_exactly(magic_size).then([this, in, insertion, loaded, magic_size] (temporary_buffer<char> magic) {
+                    if (magic.size() != magic_size || memcmp(magic.get(), snapshot_magic, magic_size)) {
+                        throw std::runtime_error("not a snapshot");
+                    }
+                    return repeat([this, in, insertion, loaded] {
+                        return load_snapshot_record(*in, *insertion).then([loaded] (bool more) {
+                            *loaded += more;
+                            return more ? stop_iteration::no : stop_iteration::yes;
+                        });
+                    });
+                }).then([path, loaded] {
+                    memcache_logger.info("Loaded {} items from {}", *loaded, path);
+                }).finally([in] {
+                    return in->close();
+                });
+            });
+        }).handle_exception([path] (std::exception_ptr ep) {
+            memcache_logger.warn("Failed to load snapshot {}: {}", path, ep);
+        });
+    }
+
+    // Loads the snapshots of the shards that map to this one: all of them
+    // if there were more shards when they were taken.
+    future<> load_snapshots(sstring dir) {
+        return do_for_each(boost::counting_iterator<unsigned>(0), boost::counting_iterator<unsigned>(max_snapshot_shards),
+                [this, dir] (unsigned i) {
+            auto shard = engine().cpu_id() + i * smp::count;
+            if (shard >= max_snapshot_shards) {
+                return make_ready_future<>();
+            }
+            return load_snapshot(snapshot_path(dir, shard));
+        });
     }
 
     future<> print_hash_stats(output_stream<char>& out) {
@@ -863,7 +1735,6 @@ class ascii_protocol {
     memcache_ascii_parser _parser;
     item_key _item_key;
     item_insertion_data _insertion;
-    std::vector<item_ptr> _items;
 private:
     static constexpr const char *msg_crlf = "\r\n";
     static constexpr const char *msg_error = "ERROR\r\n";
@@ -888,7 +1759,7 @@ class ascii_protocol {
 
         msg.append_static("VALUE ");
         msg.append_static(item->key());
-        msg.append_static(item->ascii_prefix());
+        msg.append(item->ascii_prefix());
 
         if (WithVersion) {
              msg.append_static(" ");
@@ -896,11 +1767,25 @@ class ascii_protocol {
         }
 
         msg.append_static(msg_crlf);
-        msg.append_static(item->value());
+        item->for_each_value_fragment([&msg] (auto fragment) {
+            msg.append_static(fragment);
+        });
         msg.append_static(msg_crlf);
         msg.on_delete([item = std::move(item)] {});
     }
 
+public:
+    // Appends the reply to a get, or a gets if WithVersion, of items, null
+    // where missed
+    template <bool WithVersion>
+    static void append_get_reply(scattered_message<char>& msg, std::vector<item_ptr>::iterator first,
+            std::vector<item_ptr>::iterator last) {
+        for (; first != last; ++first) {
+            append_item<WithVersion>(msg, std::move(*first));
+        }
+        msg.append_static(msg_end);
+    }
+private:
     template <bool WithVersion>
     future<> handle_get(output_stream<char>& out) {
         _system_stats.local()._cmd_get++;
@@ -912,17 +1797,9 @@ class ascii_protocol {
                 return out.write(std::move(msg));
             });
         } else {
-            _items.clear();
-            return parallel_for_each(_parser._keys.begin(), _parser._keys.end(), [this] (const auto& key) {
-                return _cache.get(key).then([this] (auto item) {
-                    _items.emplace_back(std::move(item));
-                });
-            }).then([this, &out] () {
+            return _cache.get_multi(_parser._keys).then([&out] (std::vector<item_ptr> items) {
                 scattered_message<char> msg;
-                for (auto& item : _items) {
-                    append_item<WithVersion>(msg, std::move(item));
-                }
-                msg.append_static(msg_end);
+                append_get_reply<WithVersion>(msg, items.begin(), items.end());
                 return out.write(std::move(msg));
             });
         }
@@ -1013,6 +1890,14 @@ class ascii_protocol {
                             return print_stat(out, "evictions", v);
                         }).then([this, &out, v = all_cache_stats._bytes] {
                             return print_stat(out, "bytes", v);
+                        }).then([this, &out, v = all_cache_stats._local_requests] {
+                            return print_stat(out, "seastar.local_requests", v);
+                        }).then([this, &out, v = all_cache_stats._remote_requests] {
+                            return print_stat(out, "seastar.remote_requests", v);
+                        }).then([this, &out, v = all_cache_stats._replica_hits] {
+                            return print_stat(out, "seastar.replica_hits", v);
+                        }).then([this, &out, v = all_cache_stats._hot_keys] {
+                            return print_stat(out, "seastar.hot_keys", v);
                         }).then([&out] {
                             return out.write(msg_end);
                         });
@@ -1028,7 +1913,7 @@ class ascii_protocol {
     void prepare_insertion() {
         _insertion = item_insertion_data{
             .key = std::move(_parser._key),
-            .ascii_prefix = make_sstring(" ", _parser._flags_str, " ", _parser._size_str),
+            .flags = _parser._flags,
             .data = std::move(_parser._blob),
             .expiry = expiration(_cache.get_wc_to_clock_type_delta(), _parser._expiration)
         };
@@ -1212,9 +2097,395 @@ class ascii_protocol {
     };
 };
 
+// The memcached binary protocol. Requests and responses are a fixed
+// 24-byte header followed by extras, key and value, so nothing is parsed
+// or formatted as text. Quiet gets (getq, getkq) are only answered on a
+// hit; they are batched and looked up together, with one call to each
+// shard, when a request that must be answered (typically a noop) arrives.
+class binary_protocol {
+public:
+    static constexpr uint8_t request_magic = 0x80;
+private:
+    static constexpr uint8_t response_magic = 0x81;
+    // A value of at most 1MB, plus its key and extras
+    static constexpr uint32_t max_body_length = (1 << 20) + 512;
+    static constexpr size_t max_pending_gets = 256;
+
+    enum opcode : uint8_t {
+        op_get = 0x00,
+        op_set = 0x01,
+        op_add = 0x02,
+        op_replace = 0x03,
+        op_delete = 0x04,
+        op_increment = 0x05,
+        op_decrement = 0x06,
+        op_quit = 0x07,
+        op_flush = 0x08,
+        op_getq = 0x09,
+        op_noop = 0x0a,
+        op_version = 0x0b,
+        op_getk = 0x0c,
+        op_getkq = 0x0d,
+        // setq to flushq are their plain counterparts plus this
+        op_quiet = 0x10,
+    };
+
+    enum status : uint16_t {
+        status_ok = 0x0000,
+        status_key_not_found = 0x0001,
+        status_key_exists = 0x0002,
+        status_value_too_large = 0x0003,
+        status_invalid_arguments = 0x0004,
+        status_not_stored = 0x0005,
+        status_non_numeric_value = 0x0006,
+        status_unknown_command = 0x0081,
+        status_out_of_memory = 0x0082,
+    };
+
+    struct header {
+        uint8_t _magic;
+        uint8_t _opcode;
+        packed<uint16_t> _key_length;
+        uint8_t _extras_length;
+        uint8_t _data_type;
+        // vbucket id in requests, status in responses
+        packed<uint16_t> _status;
+        packed<uint32_t> _body_length;
+        packed<uint32_t> _opaque;
+        packed<uint64_t> _cas;
+
+        template<typename Adjuster>
+        auto adjust_endianness(Adjuster a) {
+            return a(_key_length, _status, _body_length, _opaque, _cas);
+        }
+    } __attribute__((packed));
+
+    struct pending_get {
+        uint8_t opcode;
+        uint32_t opaque;
+    };
+
+    sharded_cache& _cache;
+    distributed<system_stats>& _system_stats;
+    item_key _item_key;
+    item_insertion_data _insertion;
+    std::vector<item_key> _pending_keys;
+    std::vector<pending_get> _pending;
+    bool _quit = false;
+private:
+    template <typename T>
+    static T read_be(const char* p) {
+        return ntoh(*unaligned_cast<const T*>(p));
+    }
+
+    template <typename T>
+    static void write_be(char* p, T v) {
+        *unaligned_cast<T*>(p) = hton(v);
+    }
+
+    // Room is left after the header for the extras of the response
+    static sstring make_header(uint8_t opcode, uint16_t status, uint32_t opaque, uint64_t cas,
+            uint8_t extras_length, size_t key_length, size_t value_length) {
+        sstring s(sstring::initialized_later(), sizeof(header) + extras_length);
+        header hdr;
+        hdr._magic = response_magic;
+        hdr._opcode = opcode;
+        hdr._key_length = key_length;
+        hdr._extras_length = extras_length;
+        hdr._data_type = 0;
+        hdr._status = status;
+        hdr._body_length = extras_length + key_length + value_length;
+        hdr._opaque = opaque;
+        hdr._cas = cas;
+        hdr = hton(hdr);
+        memcpy(s.begin(), &hdr, sizeof(hdr));
+        return s;
+    }
+
+    static uint64_t parse_u64(std::experimental::string_view s) {
+        uint64_t v = 0;
+        for (auto c : s) {
+            if (c < '0' || c > '9') {
+                break;
+            }
+            v = v * 10 + (c - '0');
+        }
+        return v;
+    }
+
+    static void append_value(scattered_message<char>& msg, const pending_get& get, item_ptr item) {
+        bool with_key = get.opcode == op_getk || get.opcode == op_getkq;
+        size_t key_length = with_key ? item->key_size() : 0;
+        auto hdr = make_header(get.opcode, status_ok, get.opaque, item->version(), 4, key_length, item->value_size());
+        write_be<uint32_t>(hdr.begin() + sizeof(header), item->flags());
+        msg.append(std::move(hdr));
+        if (with_key) {
+            msg.append_static(item->key());
+        }
+        item->for_each_value_fragment([&msg] (auto fragment) {
+            msg.append_static(fragment);
+        });
+        msg.on_delete([item = std::move(item)] {});
+    }
+
+    future<> flush_gets(output_stream<char>& out) {
+        if (_pending_keys.empty()) {
+            return make_ready_future<>();
+        }
+        return _cache.get_multi(_pending_keys).then([this, &out] (std::vector<item_ptr> items) {
+            scattered_message<char> msg;
+            for (unsigned i = 0; i < items.size(); ++i) {
+                auto& get = _pending[i];
+                if (items[i]) {
+                    append_value(msg, get, std::move(items[i]));
+                } else if (get.opcode == op_get || get.opcode == op_getk) {
+                    msg.append(make_header(get.opcode, status_key_not_found, get.opaque, 0, 0, 0, 0));
+                }
+            }
+            _pending_keys.clear();
+            _pending.clear();
+            if (!msg) {
+                return make_ready_future<>();
+            }
+            return out.write(std::move(msg));
+        });
+    }
+
+    static future<> reply(output_stream<char>& out, const header& req, bool quiet, uint16_t status, uint64_t cas = 0) {
+        if (quiet && status == status_ok) {
+            return make_ready_future<>();
+        }
+        return out.write(make_header(req._opcode, status, req._opaque, cas, 0, 0, 0));
+    }
+
+    static future<> reply_u64(output_stream<char>& out, const header& req, bool quiet, uint64_t value, uint64_t cas) {
+        if (quiet) {
+            return make_ready_future<>();
+        }
+        auto msg = make_header(req._opcode, status_ok, req._opaque, cas, 0, 0, sizeof(value));
+        char v[sizeof(value)];
+        write_be<uint64_t>(v, value);
+        msg += sstring(v, sizeof(v));
+        return out.write(std::move(msg));
+    }
+
+    future<> handle_store(output_stream<char>& out, header req, bool quiet, uint8_t op, uint32_t flags, uint32_t exptime,
+            sstring key, sstring value) {
+        _system_stats.local()._cmd_set++;
+        _insertion = item_insertion_data{
+            .key = item_key(std::move(key)),
+            .flags = flags,
+            .data = std::move(value),
+            .expiry = expiration(_cache.get_wc_to_clock_type_delta(), exptime)
+        };
+        switch (op) {
+        case op_set:
+            if (req._cas) {
+                return _cache.cas(_insertion, req._cas).then([&out, req, quiet] (cas_result result) {
+                    switch (result) {
+                    case cas_result::stored:
+                        return reply(out, req, quiet, status_ok);
+                    case cas_result::not_found:
+                        return reply(out, req, quiet, status_key_not_found);
+                    case cas_result::bad_version:
+                        return reply(out, req, quiet, status_key_exists);
+                    default:
+                        std::abort();
+                    }
+                });
+            }
+            return _cache.set(_insertion).then([&out, req, quiet] (bool) {
+                return reply(out, req, quiet, status_ok);
+            });
+        case op_add:
+            return _cache.add(_insertion).then([&out, req, quiet] (bool added) {
+                return reply(out, req, quiet, added ? status_ok : status_key_exists);
+            });
+        case op_replace:
+            return _cache.replace(_insertion).then([&out, req, quiet] (bool replaced) {
+                return reply(out, req, quiet, replaced ? status_ok : status_key_not_found);
+            });
+        default:
+            std::abort();
+        }
+    }
+
+    future<> handle_arith(output_stream<char>& out, header req, bool quiet, uint8_t op, uint64_t delta, uint64_t initial,
+            uint32_t exptime, sstring key) {
+        _item_key = item_key(std::move(key));
+        auto f = op == op_increment ? _cache.incr(_item_key, delta) : _cache.decr(_item_key, delta);
+        return f.then([this, &out, req, quiet, initial, exptime] (std::pair<item_ptr, bool> result) {
+            auto& item = result.first;
+            if (!item) {
+                // An expiration of all ones asks not to create the item
+                if (exptime == std::numeric_limits<uint32_t>::max()) {
+                    return reply(out, req, quiet, status_key_not_found);
+                }
+                auto value = to_sstring(initial);
+                _insertion = item_insertion_data{
+                    .key = std::move(_item_key),
+                    .flags = 0,
+                    .data = std::move(value),
+                    .expiry = expiration(_cache.get_wc_to_clock_type_delta(), exptime)
+                };
+                return _cache.add(_insertion).then([&out, req, quiet, initial] (bool added) {
+                    if (!added) {
+                        return reply(out, req, quiet, status_not_stored);
+                    }
+                    return reply_u64(out, req, quiet, initial, 0);
+                });
+            }
+            if (!result.second) {
+                return reply(out, req, quiet, status_non_numeric_value);
+            }
+            return reply_u64(out, req, quiet, parse_u64(item->value()), item->version());
+        });
+    }
+
+    future<> handle_command(output_stream<char>& out, const header& req, temporary_buffer<char> body) {
+        bool quiet = req._opcode > op_quiet && req._opcode <= op_quiet + op_flush;
+        uint8_t op = quiet ? req._opcode - op_quiet : req._opcode;
+        auto extras = body.get();
+        size_t extras_length = req._extras_length;
+        auto key = sstring(body.get() + extras_length, req._key_length);
+        auto value = sstring(body.get() + extras_length + req._key_length,
+                body.size() - extras_length - req._key_length);
+        switch (op) {
+        case op_set:
+        case op_add:
+        case op_replace:
+            if (extras_length != 8 || key.empty()) {
+                return reply(out, req, false, status_invalid_arguments);
+            }
+            return handle_store(out, req, quiet, op, read_be<uint32_t>(extras), read_be<uint32_t>(extras + 4),
+                    std::move(key), std::move(value));
+
+        case op_delete:
+            if (extras_length || key.empty() || !value.empty()) {
+                return reply(out, req, false, status_invalid_arguments);
+            }
+            _item_key = item_key(std::move(key));
+            return _cache.remove(_item_key).then([&out, req, quiet] (bool removed) {
+                return reply(out, req, quiet, removed ? status_ok : status_key_not_found);
+            });
+
+        case op_increment:
+        case op_decrement:
+            if (extras_length != 20 || key.empty() || !value.empty()) {
+                return reply(out, req, false, status_invalid_arguments);
+            }
+            return handle_arith(out, req, quiet, op, read_be<uint64_t>(extras), read_be<uint64_t>(extras + 8),
+                    read_be<uint32_t>(extras + 16), std::move(key));
+
+        case op_quit:
+            _quit = true;
+            return reply(out, req, quiet, status_ok);
+
+        case op_flush:
+        {
+            _system_stats.local()._cmd_flush++;
+            auto exptime = extras_length == 4 ? read_be<uint32_t>(extras) : 0;
+            auto f = exptime ? _cache.flush_at(exptime) : _cache.flush_all();
+            return f.then([&out, req, quiet] {
+                return reply(out, req, quiet, status_ok);
+            });
+        }
+
+        case op_noop:
+            return reply(out, req, false, status_ok);
+
+        case op_version:
+        {
+            static constexpr const char *version = VERSION_STRING;
+            auto msg = make_header(req._opcode, status_ok, req._opaque, 0, 0, 0, strlen(version));
+            msg += version;
+            return out.write(std::move(msg));
+        }
+
+        default:
+            return reply(out, req, false, status_unknown_command);
+        }
+    }
+public:
+    binary_protocol(sharded_cache& cache, distributed<system_stats>& system_stats)
+        : _cache(cache)
+        , _system_stats(system_stats)
+    {}
+
+    // Set once the client quit, or sent something that is not a request.
+    bool quit() const {
+        return _quit;
+    }
+
+    // Handles one request. Answers to quiet gets may be deferred to a later
+    // call; they are flushed when the input ends.
+    future<> handle(input_stream<char>& in, output_stream<char>& out) {
+        return in.read_exactly(sizeof(header)).then([this, &in, &out] (temporary_buffer<char> buf) {
+            if (buf.size() < sizeof(header)) {
+                return flush_gets(out);
+            }
+            auto req = ntoh(*reinterpret_cast<const header*>(buf.get()));
+            if (req._magic != request_magic) {
+                _quit = true;
+                return flush_gets(out);
+            }
+            if (req._body_length > max_body_length) {
+                return flush_gets(out).then([this, &in, &out, req] {
+                    return reply(out, req, false, status_value_too_large);
+                }).then([&in, req] {
+                    return in.skip(req._body_length);
+                });
+            }
+            return in.read_exactly(req._body_length).then([this, &out, req] (temporary_buffer<char> body) {
+                if (body.size() < req._body_length) {
+                    return flush_gets(out);
+                }
+                if (req._extras_length + req._key_length > body.size()) {
+                    return flush_gets(out).then([&out, req] {
+                        return reply(out, req, false, status_invalid_arguments);
+                    });
+                }
+                switch (req._opcode) {
+                case op_get:
+                case op_getk:
+                case op_getq:
+                case op_getkq:
+                {
+                    if (req._key_length == 0) {
+                        return flush_gets(out).then([&out, req] {
+                            return reply(out, req, false, status_invalid_arguments);
+                        });
+                    }
+                    _system_stats.local()._cmd_get++;
+                    _pending_keys.emplace_back(sstring(body.get() + req._extras_length, req._key_length));
+                    _pending.push_back(pending_get{req._opcode, req._opaque});
+                    bool quiet = req._opcode == op_getq || req._opcode == op_getkq;
+                    if (quiet && _pending.size() < max_pending_gets) {
+                        return make_ready_future<>();
+                    }
+                    return flush_gets(out);
+                }
+                default:
+                    return flush_gets(out).then([this, &out, req, body = std::move(body)] () mutable {
+                        return handle_command(out, req, std::move(body));
+                    });
+                }
+            }).then_wrapped([&out, req] (auto&& f) {
+                try {
+                    f.get();
+                } catch (std::bad_alloc& e) {
+                    return reply(out, req, false, status_out_of_memory);
+                }
+                return make_ready_future<>();
+            });
+        });
+    }
+};
+
 class udp_server {
 public:
     static const size_t default_max_datagram_size = 1400;
+    static constexpr size_t max_batch_datagrams = 64;
 private:
     sharded_cache& _cache;
     distributed<system_stats>& _system_stats;
@@ -1241,6 +2512,7 @@ class udp_server {
         output_stream<char> _out;
         std::vector<packet> _out_bufs;
         ascii_protocol _proto;
+        binary_protocol _binary_proto;
 
         connection(ipv4_addr src, uint16_t request_id, input_stream<char>&& in, size_t out_size,
                 sharded_cache& c, distributed<system_stats>& system_stats)
@@ -1249,26 +2521,177 @@ class udp_server {
             , _in(std::move(in))
             , _out(output_stream<char>(data_sink(std::make_unique<vector_data_sink>(_out_bufs)), out_size, true))
             , _proto(c, system_stats)
+            , _binary_proto(c, system_stats)
         {}
 
-        future<> respond(udp_channel& chan) {
-            int i = 0;
-            return do_for_each(_out_bufs.begin(), _out_bufs.end(), [this, i, &chan] (packet& p) mutable {
-                header* out_hdr = p.prepend_header<header>(0);
-                out_hdr->_request_id = _request_id;
-                out_hdr->_sequence_number = i++;
-                out_hdr->_n = _out_bufs.size();
-                *out_hdr = hton(*out_hdr);
-                return chan.send(_src, std::move(p));
+        // A datagram may carry several binary requests, such as a batch
+        // of getkq ended by a noop
+        future<> handle_binary() {
+            return do_until([this] { return _in.eof() || _binary_proto.quit(); }, [this] {
+                return _binary_proto.handle(_in, _out);
+            });
+        }
+
+        // Flushes the reply and adds its datagrams to replies
+        future<> respond(std::vector<std::pair<ipv4_addr, packet>>& replies) {
+            return _out.flush().then([this, &replies] {
+                uint16_t i = 0;
+                for (auto& p : _out_bufs) {
+                    header* out_hdr = p.prepend_header<header>(0);
+                    out_hdr->_request_id = _request_id;
+                    out_hdr->_sequence_number = i++;
+                    out_hdr->_n = _out_bufs.size();
+                    *out_hdr = hton(*out_hdr);
+                    replies.emplace_back(_src, std::move(p));
+                }
             });
         }
     };
 
+    // A request that is a single get, or gets, of keys, answered from
+    // one lookup of all such requests of a batch
+    struct batched_get {
+        lw_shared_ptr<connection> conn;
+        bool with_version;
+        size_t first_key;
+        size_t key_count;
+    };
+
+    // The datagrams received in one poll, and their replies
+    struct batch {
+        std::vector<udp_datagram> datagrams;
+        // The keys of pending gets, in order
+        std::vector<item_key> keys;
+        std::vector<batched_get> gets;
+        std::vector<std::pair<ipv4_addr, packet>> replies;
+    };
+
+    // Appends the keys of a request that is a single get or gets; returns
+    // false, leaving keys alone, for anything else, which goes through
+    // the parser.
+    static bool parse_get(packet& p, bool& with_version, std::vector<item_key>& keys) {
+        if (p.nr_frags() != 1) {
+            return false;
+        }
+        std::experimental::string_view req(p.frag(0).base, p.frag(0).size);
+        if (req.size() < 2 || req.substr(req.size() - 2) != "\r\n") {
+            return false;
+        }
+        req.remove_suffix(2);
+        if (req.substr(0, 5) == "gets ") {
+            with_version = true;
+            req.remove_prefix(5);
+        } else if (req.substr(0, 4) == "get ") {
+            with_version = false;
+            req.remove_prefix(4);
+        } else {
+            return false;
+        }
+        auto first = keys.size();
+        while (true) {
+            auto key = req.substr(0, req.find(' '));
+            if (key.empty() || key.size() > std::numeric_limits<uint8_t>::max()
+                    || key.find_first_of("\r\n") != key.npos) {
+                keys.resize(first);
+                return false;
+            }
+            keys.emplace_back(sstring(key.data(), key.size()));
+            if (key.size() == req.size()) {
+                return true;
+            }
+            req.remove_prefix(key.size() + 1);
+        }
+    }
+
+    // Looks up the keys of the pending gets, with one request to each
+    // shard owning any, and replies to them
+    future<> lookup_gets(batch& b) {
+        if (b.gets.empty()) {
+            return make_ready_future<>();
+        }
+        return _cache.get_multi(b.keys).then([&b] (std::vector<item_ptr> items) {
+            return do_with(std::move(items), [&b] (std::vector<item_ptr>& items) {
+                return do_for_each(b.gets, [&b, &items] (batched_get& get) {
+                    scattered_message<char> msg;
+                    auto first = items.begin() + get.first_key;
+                    if (get.with_version) {
+                        ascii_protocol::append_get_reply<true>(msg, first, first + get.key_count);
+                    } else {
+                        ascii_protocol::append_get_reply<false>(msg, first, first + get.key_count);
+                    }
+                    return get.conn->_out.write(std::move(msg)).then([&b, conn = get.conn] {
+                        return conn->respond(b.replies);
+                    });
+                });
+            });
+        }).then([&b] {
+            b.keys.clear();
+            b.gets.clear();
+        });
+    }
+
+    future<> handle_datagram(batch& b, udp_datagram& dgram) {
+        packet& p = dgram.get_data();
+        if (p.len() < sizeof(header)) {
+            // dropping invalid packet
+            return make_ready_future<>();
+        }
+
+        header hdr = ntoh(*p.get_header<header>());
+        p.trim_front(sizeof(hdr));
+        bool binary = p.len() && uint8_t(p.frag(0).base[0]) == binary_protocol::request_magic;
+        bool single = hdr._n == 1 && hdr._sequence_number == 0;
+        bool with_version = false;
+        auto first_key = b.keys.size();
+        bool plain_get = single && !binary && parse_get(p, with_version, b.keys);
+
+        auto request_id = hdr._request_id;
+        auto in = as_input_stream(std::move(p));
+        auto conn = make_lw_shared<connection>(dgram.get_src(), request_id, std::move(in),
+            _max_datagram_size - sizeof(header), _cache, _system_stats);
+
+        if (plain_get) {
+            _system_stats.local()._cmd_get++;
+            b.gets.push_back(batched_get{conn, with_version, first_key, b.keys.size() - first_key});
+            return make_ready_future<>();
+        }
+
+        // Other requests may depend on the gets before them
+        return lookup_gets(b).then([&b, conn, single, binary] {
+            if (!single) {
+                return conn->_out.write("CLIENT_ERROR only single-datagram requests supported\r\n").then([&b, conn] {
+                    return conn->respond(b.replies);
+                });
+            }
+            auto f = binary ? conn->handle_binary() : conn->_proto.handle(conn->_in, conn->_out);
+            return f.then([&b, conn] {
+                return conn->respond(b.replies);
+            });
+        });
+    }
+
+    // Handles the datagrams of a poll in order, except that runs of gets
+    // are looked up together, then sends all the replies at once
+    future<> handle_batch(std::vector<udp_datagram> datagrams) {
+        auto b = make_lw_shared<batch>();
+        b->datagrams = std::move(datagrams);
+        return do_for_each(b->datagrams, [this, b] (udp_datagram& dgram) {
+            return handle_datagram(*b, dgram);
+        }).then([this, b] {
+            return lookup_gets(*b);
+        }).then([this, b] {
+            if (b->replies.empty()) {
+                return make_ready_future<>();
+            }
+            return _chan.send(std::move(b->replies));
+        });
+    }
+
 public:
-    udp_server(sharded_cache& c, distributed<system_stats>& system_stats, uint16_t port = 11211)
+    udp_server(sharded_cache& c, distributed<system_stats>& system_stats, uint16_t port = 11211, bool port_per_shard = false)
          : _cache(c)
          , _system_stats(system_stats)
-         , _port(port)
+         , _port(port_per_shard ? port + engine().cpu_id() : port)
     {}
 
     void set_max_datagram_size(size_t max_datagram_size) {
@@ -1278,34 +2701,8 @@ class udp_server {
     void start() {
         _chan = engine().net().make_udp_channel({_port});
         keep_doing([this] {
-            return _chan.receive().then([this](udp_datagram dgram) {
-                packet& p = dgram.get_data();
-                if (p.len() < sizeof(header)) {
-                    // dropping invalid packet
-                    return make_ready_future<>();
-                }
-
-                header hdr = ntoh(*p.get_header<header>());
-                p.trim_front(sizeof(hdr));
-
-                auto request_id = hdr._request_id;
-                auto in = as_input_stream(std::move(p));
-                auto conn = make_lw_shared<connection>(dgram.get_src(), request_id, std::move(in),
-                    _max_datagram_size - sizeof(header), _cache, _system_stats);
-
-                if (hdr._n != 1 || hdr._sequence_number != 0) {
-                    return conn->_out.write("CLIENT_ERROR only single-datagram requests supported\r\n").then([this, conn] {
-                        return conn->_out.flush().then([this, conn] {
-                            return conn->respond(_chan).then([conn] {});
-                        });
-                    });
-                }
-
-                return conn->_proto.handle(conn->_in, conn->_out).then([this, conn]() mutable {
-                    return conn->_out.flush().then([this, conn] {
-                        return conn->respond(_chan).then([conn] {});
-                    });
-                });
+            return _chan.receive_batch(max_batch_datagrams).then([this] (std::vector<udp_datagram> datagrams) {
+                return handle_batch(std::move(datagrams));
             });
         }).or_terminate();
     };
@@ -1313,6 +2710,23 @@ class udp_server {
     future<> stop() { return make_ready_future<>(); }
 };
 
+// Returns a buffer already read off a stream, then the rest of the stream.
+class replay_data_source : public data_source_impl {
+    temporary_buffer<char> _first;
+    input_stream<char>& _in;
+public:
+    replay_data_source(temporary_buffer<char> first, input_stream<char>& in)
+        : _first(std::move(first))
+        , _in(in)
+    {}
+    virtual future<temporary_buffer<char>> get() override {
+        if (_first) {
+            return make_ready_future<temporary_buffer<char>>(std::move(_first));
+        }
+        return _in.read();
+    }
+};
+
 class tcp_server {
 private:
     lw_shared_ptr<server_socket> _listener;
@@ -1322,16 +2736,21 @@ class tcp_server {
     struct connection {
         connected_socket _socket;
         socket_address _addr;
+        input_stream<char> _socket_in;
+        // The socket's input, including the first buffer, which was read
+        // to tell the protocol
         input_stream<char> _in;
         output_stream<char> _out;
         ascii_protocol _proto;
+        binary_protocol _binary_proto;
         distributed<system_stats>& _system_stats;
         connection(connected_socket&& socket, socket_address addr, sharded_cache& c, distributed<system_stats>& system_stats)
             : _socket(std::move(socket))
             , _addr(addr)
-            , _in(_socket.input())
+            , _socket_in(_socket.input())
             , _out(_socket.output())
             , _proto(c, system_stats)
+            , _binary_proto(c, system_stats)
             , _system_stats(system_stats)
         {
             _system_stats.local()._curr_connections++;
@@ -1342,10 +2761,10 @@ class tcp_server {
         }
     };
 public:
-    tcp_server(sharded_cache& cache, distributed<system_stats>& system_stats, uint16_t port = 11211)
+    tcp_server(sharded_cache& cache, distributed<system_stats>& system_stats, uint16_t port = 11211, bool port_per_shard = false)
         : _cache(cache)
         , _system_stats(system_stats)
-        , _port(port)
+        , _port(port_per_shard ? port + engine().cpu_id() : port)
     {}
 
     void start() {
@@ -1355,9 +2774,20 @@ class tcp_server {
         keep_doing([this] {
             return _listener->accept().then([this] (connected_socket fd, socket_address addr) mutable {
                 auto conn = make_lw_shared<connection>(std::move(fd), addr, _cache, _system_stats);
-                do_until([conn] { return conn->_in.eof(); }, [this, conn] {
-                    return conn->_proto.handle(conn->_in, conn->_out).then([conn] {
-                        return conn->_out.flush();
+                // Binary requests start with a magic byte no ascii command does
+                conn->_socket_in.read().then([conn] (temporary_buffer<char> first) {
+                    if (!first) {
+                        return make_ready_future<>();
+                    }
+                    bool binary = uint8_t(first[0]) == binary_protocol::request_magic;
+                    conn->_in = input_stream<char>(data_source(
+                            std::make_unique<replay_data_source>(std::move(first), conn->_socket_in)));
+                    return do_until([conn] { return conn->_in.eof() || conn->_binary_proto.quit(); }, [conn, binary] {
+                        auto f = binary ? conn->_binary_proto.handle(conn->_in, conn->_out)
+                                        : conn->_proto.handle(conn->_in, conn->_out);
+                        return f.then([conn] {
+                            return conn->_out.flush();
+                        });
                     });
                 }).finally([conn] {
                     return conn->_out.close().finally([conn]{});
@@ -1384,10 +2814,13 @@ class stats_printer {
                 auto get_hit_rate = gets_total ? ((double)stats._get_hits * 100 / gets_total) : 0;
                 auto sets_total = stats._set_adds + stats._set_replaces;
                 auto set_replace_rate = sets_total ? ((double)stats._set_replaces * 100/ sets_total) : 0;
+                auto requests_total = stats._local_requests + stats._remote_requests;
+                auto local_rate = requests_total ? ((double)stats._local_requests * 100 / requests_total) : 0;
                 std::cout << "items: " << stats._size << " "
                     << std::setprecision(2) << std::fixed
                     << "get: " << stats._get_hits << "/" << gets_total << " (" << get_hit_rate << "%) "
-                    << "set: " << stats._set_replaces << "/" << sets_total << " (" <<  set_replace_rate << "%)";
+                    << "set: " << stats._set_replaces << "/" << sets_total << " (" <<  set_replace_rate << "%) "
+                    << "local: " << stats._local_requests << "/" << requests_total << " (" << local_rate << "%)";
                 std::cout << std::endl;
             });
         });
@@ -1416,10 +2849,20 @@ int main(int ac, char** av) {
              "Maximum memory to be used for items (value in megabytes) (reclaimer is disabled if set)")
         ("slab-page-size", bpo::value<uint64_t>()->default_value(memcache::default_slab_page_size/MB),
              "Size of slab page (value in megabytes)")
+        ("eviction-policy", bpo::value<std::string>()->default_value("lru"),
+             "How items are chosen for eviction: lru, or clock, where hits only mark items")
         ("stats",
              "Print basic statistics periodically (every second)")
         ("port", bpo::value<uint16_t>()->default_value(11211),
              "Specify UDP and TCP ports for memcached server to listen on")
+        ("snapshot-dir", bpo::value<std::string>(),
+             "Directory to snapshot the items of each shard to, periodically and at exit, "
+             "and to load them from at startup")
+        ("snapshot-period", bpo::value<unsigned>()->default_value(300),
+             "Seconds between snapshots")
+        ("port-per-shard",
+             "Serve each shard as a server of its own, on port + shard id, keeping the keys requested "
+             "there on that shard; for clients that distribute keys over servers")
         ;
 
     return app.run_deprecated(ac, av, [&] {
@@ -1430,22 +2873,59 @@ int main(int ac, char** av) {
 
         auto&& config = app.configuration();
         uint16_t port = config["port"].as<uint16_t>();
+        bool port_per_shard = config.count("port-per-shard");
+        if (port_per_shard && !engine().net().has_per_core_namespace()) {
+            std::cerr << "--port-per-shard needs a network stack where each shard listens on its own\n";
+            engine().exit(1);
+            return make_ready_future<>();
+        }
+        cache.set_shard_local(port_per_shard);
         uint64_t per_cpu_slab_size = config["max-slab-size"].as<uint64_t>() * MB;
         uint64_t slab_page_size = config["slab-page-size"].as<uint64_t>() * MB;
-        return cache_peers.start(std::move(per_cpu_slab_size), std::move(slab_page_size)).then([&system_stats] {
+        auto eviction_policy_name = config["eviction-policy"].as<std::string>();
+        if (eviction_policy_name != "lru" && eviction_policy_name != "clock") {
+            std::cerr << "Unknown eviction policy: " << eviction_policy_name << "\n";
+            engine().exit(1);
+            return make_ready_future<>();
+        }
+        auto eviction_policy = eviction_policy_name == "clock" ? slab_eviction_policy::clock : slab_eviction_policy::lru;
+        return cache_peers.start(std::ref(cache_peers), std::move(per_cpu_slab_size), std::move(slab_page_size),
+                std::move(eviction_policy)).then([&system_stats] {
             return system_stats.start(memcache::clock_type::now());
+        }).then([&, port_per_shard] {
+            // With a port per shard, each shard only serves its own keys
+            if (port_per_shard || smp::count == 1) {
+                return make_ready_future<>();
+            }
+            return cache_peers.invoke_on_all(&memcache::cache::enable_hot_key_replication);
+        }).then([&] {
+            if (!config.count("snapshot-dir")) {
+                return make_ready_future<>();
+            }
+            auto dir = sstring(config["snapshot-dir"].as<std::string>());
+            auto period = std::chrono::seconds(config["snapshot-period"].as<unsigned>());
+            // Shards load their snapshots in parallel, before serving
+            return recursive_touch_directory(dir).then([&, dir] {
+                return cache_peers.invoke_on_all([&cache, dir] (memcache::cache&) {
+                    return cache.load_snapshots(dir);
+                });
+            }).then([&, dir, period] {
+                return cache_peers.invoke_on_all([dir, period] (memcache::cache& c) {
+                    c.enable_snapshots(memcache::snapshot_path(dir, engine().cpu_id()), period);
+                });
+            });
         }).then([&] {
             std::cout << PLATFORM << " memcached " << VERSION << "\n";
             return make_ready_future<>();
-        }).then([&, port] {
-            return tcp_server.start(std::ref(cache), std::ref(system_stats), port);
+        }).then([&, port, port_per_shard] {
+            return tcp_server.start(std::ref(cache), std::ref(system_stats), port, port_per_shard);
         }).then([&tcp_server] {
             return tcp_server.invoke_on_all(&memcache::tcp_server::start);
-        }).then([&, port] {
+        }).then([&, port, port_per_shard] {
             if (engine().net().has_per_core_namespace()) {
-                return udp_server.start(std::ref(cache), std::ref(system_stats), port);
+                return udp_server.start(std::ref(cache), std::ref(system_stats), port, port_per_shard);
             } else {
-                return udp_server.start_single(std::ref(cache), std::ref(system_stats), port);
+                return udp_server.start_single(std::ref(cache), std::ref(system_stats), port, port_per_shard);
             }
         }).then([&] {
             return udp_server.invoke_on_all(&memcache::udp_server::set_max_datagram_size,
@@ -19,6 +19,7 @@
 #define _MEMCACHED_HH
 
 #include "core/sstring.hh"
+#include "core/fast_hash.hh"
 
 namespace memcache {
 
@@ -34,7 +35,7 @@ class item_key {
     item_key(item_key&) = default;
     item_key(sstring key)
         : _key(key)
-        , _hash(std::hash<sstring>()(key))
+        , _hash(sstring_fast_hash()(key))
     {}
     item_key(item_key&& other)
         : _key(std::move(other._key))
@@ -49,7 +50,7 @@ class item_key {
         return _key;
     }
     bool operator==(const item_key& other) const {
-        return other._hash == _hash && other._key == _key;
+        return other._hash == _hash && sstring_fast_equal()(other._key, _key);
     }
     void operator=(item_key&& other) {
         _key = std::move(other._key);
@@ -0,0 +1,849 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+// A memcached load generator: connections on every cpu send a mix of gets
+// and sets, over TCP or UDP, in the ascii or binary protocol, and the
+// latencies of the replies are merged across cpus.
+
+#include "core/print.hh"
+#include "core/reactor.hh"
+#include "core/app-template.hh"
+#include "core/future-util.hh"
+#include "core/distributed.hh"
+#include "core/sleep.hh"
+#include "net/api.hh"
+#include "net/packet-data-source.hh"
+#include "util/latency_histogram.hh"
+#include <boost/range/irange.hpp>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace net;
+using clock_type = std::chrono::steady_clock;
+
+// Reads the replies off a stream: lines, and data of a known length
+class reply_reader {
+    input_stream<char>& _in;
+    temporary_buffer<char> _buf;
+private:
+    future<> fill() {
+        return _in.read().then([this] (temporary_buffer<char> buf) {
+            if (buf.empty()) {
+                throw std::runtime_error("reply ended early");
+            }
+            _buf = std::move(buf);
+        });
+    }
+public:
+    explicit reply_reader(input_stream<char>& in) : _in(in) {}
+
+    // A line, without its "\r\n"
+    future<std::string> read_line() {
+        return do_with(std::string(), [this] (std::string& line) {
+            return repeat([this, &line] {
+                auto nl = std::find(_buf.begin(), _buf.end(), '\n');
+                line.append(_buf.begin(), nl);
+                if (nl != _buf.end()) {
+                    _buf.trim_front(nl - _buf.begin() + 1);
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                _buf = {};
+                return fill().then([] {
+                    return stop_iteration::no;
+                });
+            }).then([&line] {
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                return std::move(line);
+            });
+        });
+    }
+
+    future<std::string> read_exactly(size_t n) {
+        return do_with(std::string(), [this, n] (std::string& data) {
+            return repeat([this, &data, n] {
+                auto len = std::min(n - data.size(), _buf.size());
+                data.append(_buf.begin(), _buf.begin() + len);
+                _buf.trim_front(len);
+                if (data.size() == n) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return fill().then([] {
+                    return stop_iteration::no;
+                });
+            }).then([&data] {
+                return std::move(data);
+            });
+        });
+    }
+
+    future<> skip(size_t n) {
+        return do_with(size_t(n), [this] (size_t& left) {
+            return repeat([this, &left] {
+                auto len = std::min(left, _buf.size());
+                _buf.trim_front(len);
+                left -= len;
+                if (!left) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return fill().then([] {
+                    return stop_iteration::no;
+                });
+            });
+        });
+    }
+};
+
+// Zipfian ranks in [0, n), 0 being the most frequent, by the method of Gray
+// et al., "Quickly Generating Billion-Record Synthetic Databases". The
+// normalization constant takes O(n) to compute, so it is computed once and
+// passed to each cpu's generator.
+class zipf_distribution {
+    uint64_t _n;
+    double _theta;
+    double _zetan;
+    double _alpha;
+    double _eta;
+    std::uniform_real_distribution<double> _uniform{0, 1};
+public:
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow(double(i), theta);
+        }
+        return sum;
+    }
+
+    zipf_distribution(uint64_t n, double theta, double zetan)
+        : _n(n)
+        , _theta(theta)
+        , _zetan(zetan)
+        , _alpha(1 / (1 - theta))
+        , _eta((1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zetan)) {
+    }
+
+    template <typename Engine>
+    uint64_t operator()(Engine& e) {
+        auto u = _uniform(e);
+        auto uz = u * _zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, _theta)) {
+            return 1;
+        }
+        return std::min<uint64_t>(_n - 1, _n * std::pow(_eta * u - _eta + 1, _alpha));
+    }
+};
+
+struct load_config {
+    bool binary;
+    bool udp;
+    unsigned total_conn;
+    unsigned duration;
+    // Open loop when non-zero: total requests per second
+    double rate;
+    uint64_t keys;
+    unsigned key_size;
+    bool zipfian;
+    double zipf_theta;
+    double zipf_zetan;
+    double get_ratio;
+    unsigned multiget;
+    unsigned value_size_min;
+    unsigned value_size_max;
+    clock_type::duration udp_timeout;
+};
+
+struct load_stats {
+    uint64_t gets = 0;
+    uint64_t get_keys = 0;
+    uint64_t get_hits = 0;
+    uint64_t sets = 0;
+    uint64_t not_stored = 0;
+    // Requests sent over UDP that got no reply in time
+    uint64_t lost = 0;
+    latency_histogram get_latency;
+    latency_histogram set_latency;
+    // From the time requests were meant to start, in open loop runs
+    latency_histogram intended;
+
+    load_stats& operator+=(const load_stats& o) {
+        gets += o.gets;
+        get_keys += o.get_keys;
+        get_hits += o.get_hits;
+        sets += o.sets;
+        not_stored += o.not_stored;
+        lost += o.lost;
+        get_latency += o.get_latency;
+        set_latency += o.set_latency;
+        intended += o.intended;
+        return *this;
+    }
+};
+
+class protocol {
+public:
+    virtual ~protocol() {}
+    virtual std::string get_request(const std::vector<std::string>& keys) = 0;
+    virtual std::string set_request(const std::string& key, const char* value, size_t size) = 0;
+    // Resolves to the number of keys found
+    virtual future<unsigned> read_get_reply(reply_reader& in, unsigned nr_keys) = 0;
+    // Resolves to whether the value was stored
+    virtual future<bool> read_set_reply(reply_reader& in) = 0;
+};
+
+class ascii_protocol : public protocol {
+public:
+    virtual std::string get_request(const std::vector<std::string>& keys) override {
+        std::string req = "get";
+        for (auto& key : keys) {
+            req += ' ';
+            req += key;
+        }
+        req += "\r\n";
+        return req;
+    }
+
+    virtual std::string set_request(const std::string& key, const char* value, size_t size) override {
+        auto req = "set " + key + " 0 0 " + std::to_string(size) + "\r\n";
+        req.append(value, size);
+        req += "\r\n";
+        return req;
+    }
+
+    virtual future<unsigned> read_get_reply(reply_reader& in, unsigned nr_keys) override {
+        return do_with(0u, [&in] (unsigned& hits) {
+            return repeat([&in, &hits] {
+                return in.read_line().then([&in, &hits] (std::string line) {
+                    if (line == "END") {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    // VALUE <key> <flags> <bytes>
+                    if (line.compare(0, 6, "VALUE ") != 0) {
+                        throw std::runtime_error("unexpected reply to get: " + line);
+                    }
+                    auto bytes = std::stoul(line.substr(line.rfind(' ') + 1));
+                    ++hits;
+                    return in.skip(bytes + 2).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).then([&hits] {
+                return hits;
+            });
+        });
+    }
+
+    virtual future<bool> read_set_reply(reply_reader& in) override {
+        return in.read_line().then([] (std::string line) {
+            if (line == "STORED") {
+                return true;
+            }
+            if (line == "NOT_STORED" || line.compare(0, 12, "SERVER_ERROR") == 0) {
+                return false;
+            }
+            throw std::runtime_error("unexpected reply to set: " + line);
+        });
+    }
+};
+
+class binary_protocol : public protocol {
+    static constexpr uint8_t request_magic = 0x80;
+    static constexpr uint8_t response_magic = 0x81;
+    static constexpr size_t header_size = 24;
+
+    enum opcode : uint8_t {
+        op_get = 0x00,
+        op_set = 0x01,
+        op_noop = 0x0a,
+        op_getkq = 0x0d,
+    };
+
+    struct response_header {
+        uint8_t opcode;
+        uint16_t status;
+        uint32_t body_length;
+    };
+private:
+    template <typename T>
+    static void append_be(std::string& s, T v) {
+        for (int shift = (sizeof(T) - 1) * 8; shift >= 0; shift -= 8) {
+            s += char(v >> shift);
+        }
+    }
+
+    static void append_header(std::string& s, uint8_t opcode, uint16_t key_length, uint8_t extras_length,
+            uint32_t body_length) {
+        s += char(request_magic);
+        s += char(opcode);
+        append_be<uint16_t>(s, key_length);
+        s += char(extras_length);
+        // data type and vbucket id
+        s.append(3, '\0');
+        append_be<uint32_t>(s, body_length);
+        // opaque and cas
+        s.append(12, '\0');
+    }
+
+    static future<response_header> read_response(reply_reader& in) {
+        return in.read_exactly(header_size).then([&in] (std::string h) {
+            auto p = reinterpret_cast<const uint8_t*>(h.data());
+            if (p[0] != response_magic) {
+                throw std::runtime_error("bad magic in binary reply");
+            }
+            response_header hdr;
+            hdr.opcode = p[1];
+            hdr.status = p[6] << 8 | p[7];
+            hdr.body_length = uint32_t(p[8]) << 24 | p[9] << 16 | p[10] << 8 | p[11];
+            return in.skip(hdr.body_length).then([hdr] {
+                return hdr;
+            });
+        });
+    }
+public:
+    // A single key is a plain get; several are quiet gets, answered only
+    // on a hit, ended by a noop
+    virtual std::string get_request(const std::vector<std::string>& keys) override {
+        std::string req;
+        if (keys.size() == 1) {
+            append_header(req, op_get, keys[0].size(), 0, keys[0].size());
+            req += keys[0];
+            return req;
+        }
+        for (auto& key : keys) {
+            append_header(req, op_getkq, key.size(), 0, key.size());
+            req += key;
+        }
+        append_header(req, op_noop, 0, 0, 0);
+        return req;
+    }
+
+    virtual std::string set_request(const std::string& key, const char* value, size_t size) override {
+        std::string req;
+        append_header(req, op_set, key.size(), 8, 8 + key.size() + size);
+        // flags and expiration
+        req.append(8, '\0');
+        req += key;
+        req.append(value, size);
+        return req;
+    }
+
+    virtual future<unsigned> read_get_reply(reply_reader& in, unsigned nr_keys) override {
+        if (nr_keys == 1) {
+            return read_response(in).then([] (response_header hdr) {
+                return unsigned(hdr.status == 0);
+            });
+        }
+        return do_with(0u, [&in] (unsigned& hits) {
+            return repeat([&in, &hits] {
+                return read_response(in).then([&hits] (response_header hdr) {
+                    if (hdr.opcode == op_noop) {
+                        return stop_iteration::yes;
+                    }
+                    hits += hdr.status == 0;
+                    return stop_iteration::no;
+                });
+            }).then([&hits] {
+                return hits;
+            });
+        });
+    }
+
+    virtual future<bool> read_set_reply(reply_reader& in) override {
+        return read_response(in).then([] (response_header hdr) {
+            return hdr.status == 0;
+        });
+    }
+};
+
+class connection {
+public:
+    using parser = std::function<future<> (reply_reader&)>;
+    virtual ~connection() {}
+    // Sends a request and reads its reply with @parse; resolves to false
+    // if the reply was lost
+    virtual future<bool> exchange(std::string req, parser parse) = 0;
+    virtual future<> close() = 0;
+};
+
+class tcp_connection : public connection {
+    connected_socket _fd;
+    input_stream<char> _in;
+    output_stream<char> _out;
+    reply_reader _reader;
+public:
+    explicit tcp_connection(connected_socket fd)
+        : _fd(std::move(fd))
+        , _in(_fd.input())
+        , _out(_fd.output())
+        , _reader(_in) {
+        _fd.set_nodelay(true);
+    }
+
+    virtual future<bool> exchange(std::string req, parser parse) override {
+        return _out.write(temporary_buffer<char>(req.data(), req.size())).then([this] {
+            return _out.flush();
+        }).then([this, parse = std::move(parse)] {
+            return parse(_reader);
+        }).then([] {
+            return true;
+        });
+    }
+
+    virtual future<> close() override {
+        return _out.close();
+    }
+};
+
+// Each request is a datagram, after the memcached UDP frame header, and
+// its reply may span several datagrams. Replies that don't all arrive
+// within the timeout are counted as lost; late ones are dropped by their
+// request id.
+class udp_connection : public connection {
+    struct frame_header {
+        uint16_t request_id;
+        uint16_t sequence_number;
+        uint16_t total;
+        uint16_t reserved;
+    } __attribute__((packed));
+
+    udp_channel _chan;
+    ipv4_addr _server;
+    clock_type::duration _timeout;
+    uint16_t _request_id = 0;
+    bool _waiting = false;
+    std::vector<packet> _parts;
+    std::vector<bool> _received;
+    unsigned _missing = 0;
+    promise<packet> _reply;
+    future<> _receiver = make_ready_future<>();
+private:
+    void deliver(udp_datagram dgram) {
+        auto& p = dgram.get_data();
+        if (p.len() < sizeof(frame_header)) {
+            return;
+        }
+        auto hdr = *p.get_header<frame_header>();
+        p.trim_front(sizeof(frame_header));
+        auto id = ntohs(hdr.request_id);
+        auto seq = ntohs(hdr.sequence_number);
+        auto total = ntohs(hdr.total);
+        if (!_waiting || id != _request_id || !total) {
+            return;
+        }
+        if (_parts.empty()) {
+            _parts.resize(total);
+            _received.resize(total);
+            _missing = total;
+        }
+        if (seq >= _parts.size() || _received[seq]) {
+            return;
+        }
+        _parts[seq] = std::move(p);
+        _received[seq] = true;
+        if (--_missing) {
+            return;
+        }
+        packet reply;
+        for (auto& part : _parts) {
+            for (auto& buf : part.release()) {
+                reply = packet(std::move(reply), std::move(buf));
+            }
+        }
+        _waiting = false;
+        _reply.set_value(std::move(reply));
+    }
+public:
+    udp_connection(ipv4_addr server, clock_type::duration timeout)
+        : _chan(engine().net().make_udp_channel())
+        , _server(server)
+        , _timeout(timeout) {
+        _receiver = keep_doing([this] {
+            return _chan.receive().then([this] (udp_datagram dgram) {
+                deliver(std::move(dgram));
+            });
+        }).handle_exception([] (auto ep) {
+            // The channel was closed
+        });
+    }
+
+    virtual future<bool> exchange(std::string req, parser parse) override {
+        frame_header hdr;
+        hdr.request_id = htons(++_request_id);
+        hdr.sequence_number = 0;
+        hdr.total = htons(1);
+        hdr.reserved = 0;
+        req.insert(0, reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        _waiting = true;
+        _parts.clear();
+        _received.clear();
+        _reply = promise<packet>();
+        return _chan.send(_server, packet(req.data(), req.size())).then([this] {
+            return with_timeout(clock_type::now() + _timeout, _reply.get_future());
+        }).then_wrapped([this, parse = std::move(parse)] (future<packet> f) {
+            try {
+                auto reply = f.get0();
+                return do_with(as_input_stream(std::move(reply)), [parse = std::move(parse)] (input_stream<char>& in) {
+                    return do_with(reply_reader(in), [parse = std::move(parse)] (reply_reader& reader) {
+                        return parse(reader);
+                    });
+                }).then([] {
+                    return true;
+                });
+            } catch (timed_out_error&) {
+                _waiting = false;
+                return make_ready_future<bool>(false);
+            }
+        });
+    }
+
+    virtual future<> close() override {
+        _chan.close();
+        return std::move(_receiver);
+    }
+};
+
+class load_generator {
+    load_config _config;
+    unsigned _conn_per_core;
+    std::unique_ptr<protocol> _proto;
+    std::vector<std::unique_ptr<connection>> _conns;
+    std::default_random_engine _random;
+    std::uniform_int_distribution<uint64_t> _uniform_key;
+    std::experimental::optional<zipf_distribution> _zipf_key;
+    std::uniform_int_distribution<unsigned> _value_size;
+    std::bernoulli_distribution _is_get;
+    std::string _value;
+    // Open loop: requests are meant to start every _interval from the
+    // start of the run, whether or not earlier ones completed; each idle
+    // connection takes the next start time.
+    clock_type::duration _interval;
+    clock_type::time_point _next_start;
+    clock_type::time_point _end;
+    load_stats _stats;
+private:
+    std::string make_key(uint64_t n) const {
+        auto key = std::to_string(n);
+        return std::string(_config.key_size - key.size(), '0') + key;
+    }
+
+    std::string pick_key() {
+        return make_key(_zipf_key ? (*_zipf_key)(_random) : _uniform_key(_random));
+    }
+
+    // The time the next request is meant to start, or none once the run is
+    // over. Closed-loop requests start right away.
+    std::experimental::optional<clock_type::time_point> next_start() {
+        auto now = clock_type::now();
+        if (!_config.rate) {
+            if (now >= _end) {
+                return {};
+            }
+            return now;
+        }
+        if (_next_start >= _end) {
+            return {};
+        }
+        auto t = _next_start;
+        _next_start += _interval;
+        return t;
+    }
+
+    future<> set(connection& conn, std::string key, clock_type::time_point intended) {
+        auto size = _value_size(_random);
+        auto sent = clock_type::now();
+        return conn.exchange(_proto->set_request(key, _value.data(), size), [this] (reply_reader& in) {
+            return _proto->read_set_reply(in).then([this] (bool stored) {
+                _stats.not_stored += !stored;
+            });
+        }).then([this, intended, sent] (bool replied) {
+            if (!replied) {
+                _stats.lost++;
+                return;
+            }
+            auto now = clock_type::now();
+            _stats.sets++;
+            _stats.set_latency.add(now - sent);
+            _stats.intended.add(now - intended);
+        });
+    }
+
+    future<> get(connection& conn, clock_type::time_point intended) {
+        std::vector<std::string> keys;
+        for (unsigned i = 0; i < _config.multiget; ++i) {
+            keys.push_back(pick_key());
+        }
+        auto nr_keys = keys.size();
+        auto sent = clock_type::now();
+        return conn.exchange(_proto->get_request(keys), [this, nr_keys] (reply_reader& in) {
+            return _proto->read_get_reply(in, nr_keys).then([this] (unsigned hits) {
+                _stats.get_hits += hits;
+            });
+        }).then([this, intended, sent, nr_keys] (bool replied) {
+            if (!replied) {
+                _stats.lost++;
+                return;
+            }
+            auto now = clock_type::now();
+            _stats.gets++;
+            _stats.get_keys += nr_keys;
+            _stats.get_latency.add(now - sent);
+            _stats.intended.add(now - intended);
+        });
+    }
+
+    future<> run_connection(connection& conn) {
+        return repeat([this, &conn] {
+            auto intended = next_start();
+            if (!intended) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto now = clock_type::now();
+            auto wait = *intended > now ? sleep(*intended - now) : make_ready_future<>();
+            return wait.then([this, &conn, intended = *intended] {
+                return _is_get(_random) ? get(conn, intended) : set(conn, pick_key(), intended);
+            }).then([] {
+                return stop_iteration::no;
+            });
+        });
+    }
+public:
+    explicit load_generator(load_config config)
+        : _config(config)
+        , _conn_per_core(config.total_conn / smp::count)
+        , _random(std::random_device()())
+        , _uniform_key(0, config.keys - 1)
+        , _value_size(config.value_size_min, config.value_size_max)
+        , _is_get(config.get_ratio)
+        , _value(config.value_size_max, 'x')
+        , _interval(config.rate ? std::chrono::duration_cast<clock_type::duration>(
+                std::chrono::duration<double>(smp::count / config.rate)) : clock_type::duration()) {
+        if (config.binary) {
+            _proto = std::make_unique<binary_protocol>();
+        } else {
+            _proto = std::make_unique<ascii_protocol>();
+        }
+        if (config.zipfian) {
+            _zipf_key.emplace(config.keys, config.zipf_theta, config.zipf_zetan);
+        }
+    }
+
+    future<> connect(ipv4_addr server) {
+        return parallel_for_each(boost::irange(0u, _conn_per_core), [this, server] (unsigned) {
+            if (_config.udp) {
+                _conns.push_back(std::make_unique<udp_connection>(server, _config.udp_timeout));
+                return make_ready_future<>();
+            }
+            return engine().net().connect(make_ipv4_address(server)).then([this] (connected_socket fd) {
+                _conns.push_back(std::make_unique<tcp_connection>(std::move(fd)));
+            });
+        });
+    }
+
+    // Sets every key once, so that gets hit; the keys are dealt out to all
+    // the connections of all the cpus
+    future<> prefill() {
+        return parallel_for_each(boost::irange(0u, _conn_per_core), [this] (unsigned i) {
+            auto first = engine().cpu_id() * _conn_per_core + i;
+            return do_with(uint64_t(first), [this, &conn = *_conns[i]] (uint64_t& n) {
+                return do_until([this, &n] { return n >= _config.keys; }, [this, &conn, &n] {
+                    auto key = make_key(n);
+                    n += _config.total_conn;
+                    return set(conn, std::move(key), clock_type::now());
+                });
+            });
+        }).then([this] {
+            _stats = load_stats();
+        });
+    }
+
+    future<> run() {
+        _next_start = clock_type::now();
+        _end = _next_start + std::chrono::seconds(_config.duration);
+        return parallel_for_each(_conns, [this] (std::unique_ptr<connection>& conn) {
+            return run_connection(*conn);
+        });
+    }
+
+    future<load_stats> stats() {
+        return make_ready_future<load_stats>(_stats);
+    }
+
+    future<> stop() {
+        return parallel_for_each(_conns, [] (std::unique_ptr<connection>& conn) {
+            return conn->close();
+        });
+    }
+};
+
+namespace bpo = boost::program_options;
+
+int main(int ac, char** av) {
+    app_template app;
+    app.add_options()
+        ("server,s", bpo::value<std::string>()->default_value("127.0.0.1:11211"), "Server address")
+        ("protocol", bpo::value<std::string>()->default_value("ascii"), "ascii or binary")
+        ("udp", "send requests over UDP instead of TCP")
+        ("conn,c", bpo::value<unsigned>()->default_value(16), "total connections (UDP sockets with --udp), "
+                "a multiple of the number of cpus")
+        ("duration,d", bpo::value<unsigned>()->default_value(10), "duration of the test in seconds")
+        ("rate", bpo::value<double>()->default_value(0), "open loop: total requests per second, split evenly between "
+                "the cpus, started on schedule whether or not earlier ones completed (0: closed loop)")
+        ("keys", bpo::value<uint64_t>()->default_value(100000), "number of distinct keys")
+        ("key-size", bpo::value<unsigned>()->default_value(16), "length of the keys")
+        ("distribution", bpo::value<std::string>()->default_value("uniform"), "how keys are picked: uniform or zipfian")
+        ("zipf-theta", bpo::value<double>()->default_value(0.99), "skew of the zipfian distribution, between 0 and 1")
+        ("get-ratio", bpo::value<double>()->default_value(0.9), "fraction of the requests that are gets; "
+                "the rest are sets")
+        ("multiget", bpo::value<unsigned>()->default_value(1), "keys in each get")
+        ("value-size", bpo::value<unsigned>()->default_value(100), "length of the values set")
+        ("value-size-max", bpo::value<unsigned>(), "if given, the length of each value set is picked uniformly "
+                "between --value-size and this")
+        ("prefill", "set every key before the run, so that gets hit")
+        ("udp-timeout", bpo::value<unsigned>()->default_value(1000), "milliseconds after which a UDP request "
+                "with no reply is counted as lost");
+
+    return app.run(ac, av, [&app] () -> future<int> {
+        auto& config = app.configuration();
+        auto server = config["server"].as<std::string>();
+        auto protocol = config["protocol"].as<std::string>();
+        auto distribution = config["distribution"].as<std::string>();
+
+        load_config lc;
+        lc.binary = protocol == "binary";
+        lc.udp = config.count("udp");
+        lc.total_conn = config["conn"].as<unsigned>();
+        lc.duration = config["duration"].as<unsigned>();
+        lc.rate = config["rate"].as<double>();
+        lc.keys = config["keys"].as<uint64_t>();
+        lc.key_size = config["key-size"].as<unsigned>();
+        lc.zipfian = distribution == "zipfian";
+        lc.zipf_theta = config["zipf-theta"].as<double>();
+        lc.get_ratio = config["get-ratio"].as<double>();
+        lc.multiget = config["multiget"].as<unsigned>();
+        lc.value_size_min = config["value-size"].as<unsigned>();
+        lc.value_size_max = config.count("value-size-max") ? config["value-size-max"].as<unsigned>() : lc.value_size_min;
+        lc.udp_timeout = std::chrono::milliseconds(config["udp-timeout"].as<unsigned>());
+        auto prefill = bool(config.count("prefill"));
+
+        auto error = [] (const char* msg) {
+            print("Error: %s\n", msg);
+            return make_ready_future<int>(-1);
+        };
+        if (protocol != "ascii" && protocol != "binary") {
+            return error("protocol needs to be ascii or binary");
+        }
+        if (distribution != "uniform" && distribution != "zipfian") {
+            return error("distribution needs to be uniform or zipfian");
+        }
+        if (lc.total_conn == 0 || lc.total_conn % smp::count != 0) {
+            return error("conn needs to be n * cpu_nr");
+        }
+        if (lc.keys < 2) {
+            return error("keys needs to be at least 2");
+        }
+        if (lc.key_size < std::to_string(lc.keys - 1).size() || lc.key_size > 250) {
+            return error("key-size needs to fit the largest key number, and be at most 250");
+        }
+        if (lc.zipfian && (lc.zipf_theta <= 0 || lc.zipf_theta >= 1)) {
+            return error("zipf-theta needs to be between 0 and 1");
+        }
+        if (lc.get_ratio < 0 || lc.get_ratio > 1) {
+            return error("get-ratio needs to be between 0 and 1");
+        }
+        if (lc.multiget == 0) {
+            return error("multiget needs to be at least 1");
+        }
+        if (lc.value_size_max < lc.value_size_min) {
+            return error("value-size-max needs to be at least value-size");
+        }
+        // Requests go in one datagram, which the server takes up to 1400 bytes
+        if (lc.udp && ((lc.get_ratio < 1 || prefill) && lc.value_size_max + lc.key_size + 64 > 1400
+                || lc.multiget * (lc.key_size + 24) + 64 > 1400)) {
+            return error("with --udp, requests need to fit in a datagram of 1400 bytes");
+        }
+        if (lc.zipfian) {
+            lc.zipf_zetan = zipf_distribution::zeta(lc.keys, lc.zipf_theta);
+        }
+
+        print("========== memwreck ============\n");
+        print("Server: %s (%s over %s)\n", server, protocol, lc.udp ? "UDP" : "TCP");
+        print("Connections: %u\n", lc.total_conn);
+        if (lc.rate) {
+            print("Open loop: %f requests/sec, %f per cpu\n", lc.rate, lc.rate / smp::count);
+        }
+        print("Keys: %u, %s\n", lc.keys, lc.zipfian ? sprint("zipfian (theta %f)", lc.zipf_theta) : std::string("uniform"));
+        print("Gets: %f of requests, %u keys each\n", lc.get_ratio, lc.multiget);
+        print("Values: %u to %u bytes\n", lc.value_size_min, lc.value_size_max);
+
+        auto generators = new distributed<load_generator>;
+        return generators->start(lc).then([generators, server] {
+            return generators->invoke_on_all(&load_generator::connect, ipv4_addr{server});
+        }).then([generators, prefill, keys = lc.keys] {
+            if (!prefill) {
+                return make_ready_future<>();
+            }
+            print("Prefilling %u keys\n", keys);
+            return generators->invoke_on_all(&load_generator::prefill);
+        }).then([generators] {
+            return generators->invoke_on_all(&load_generator::run);
+        }).then([generators] {
+            return generators->map_reduce(adder<load_stats>(), &load_generator::stats);
+        }).then([generators, lc] (load_stats stats) {
+            auto secs = double(lc.duration);
+            print("Total cpus: %u\n", smp::count);
+            print("Gets/sec: %f\n", stats.gets / secs);
+            print("Sets/sec: %f\n", stats.sets / secs);
+            if (stats.get_keys) {
+                print("Get hit ratio: %f\n", double(stats.get_hits) / stats.get_keys);
+            }
+            if (stats.not_stored) {
+                print("Sets not stored: %u\n", stats.not_stored);
+            }
+            if (lc.udp) {
+                print("Lost: %u\n", stats.lost);
+            }
+            auto print_latencies = [] (const char* what, const latency_histogram& h) {
+                if (h.count()) {
+                    print("%s (us): p50 %u, p99 %u, p999 %u, max %u\n", what,
+                          h.quantile(0.5), h.quantile(0.99), h.quantile(0.999), h.max());
+                }
+            };
+            if (lc.rate) {
+                print_latencies("Latency from intended start", stats.intended);
+            }
+            print_latencies("Get latency from send", stats.get_latency);
+            print_latencies("Set latency from send", stats.set_latency);
+            print("==========     done     ============\n");
+            return generators->stop().then([generators] {
+                delete generators;
+                return make_ready_future<int>(0);
+            });
+        });
+    });
+}
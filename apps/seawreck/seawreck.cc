@@ -27,7 +27,14 @@
 #include "core/distributed.hh"
 #include "core/semaphore.hh"
 #include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "net/tls.hh"
+#include "util/latency_histogram.hh"
 #include <chrono>
+#include <vector>
+#include <deque>
+#include <random>
+#include <sstream>
 
 template <typename... Args>
 void http_debug(const char* fmt, Args&&... args) {
@@ -36,8 +43,43 @@ void http_debug(const char* fmt, Args&&... args) {
 #endif
 }
 
+// Latencies of a run: from the time each request was meant to start, which
+// counts the time it waited for a connection (so the open-loop results are
+// corrected for coordinated omission), and from the time it was sent.
+struct latency_stats {
+    latency_histogram intended;
+    latency_histogram service;
+
+    latency_stats& operator+=(const latency_stats& o) {
+        intended += o.intended;
+        service += o.service;
+        return *this;
+    }
+};
+
+// A kind of request in the mix sent, as it goes on the wire
+struct request_kind {
+    sstring text;
+    unsigned weight;
+};
+
+struct client_config {
+    unsigned duration;
+    unsigned total_conn;
+    unsigned reqs_per_conn;
+    double rate;
+    // Requests sent on a connection before the first reply arrives
+    unsigned pipeline;
+    std::vector<request_kind> requests;
+    bool tls;
+    sstring tls_trust_file;
+    sstring tls_server_name;
+};
+
 class http_client {
 private:
+    using clock = tsc_clock;
+    client_config _config;
     unsigned _duration;
     unsigned _conn_per_core;
     unsigned _reqs_per_conn;
@@ -48,15 +90,39 @@ class http_client {
     bool _timer_based;
     bool _timer_done{false};
     uint64_t _total_reqs{0};
+    // Open loop: requests are meant to start every _interval from the
+    // start of the run, whether or not earlier ones completed; each
+    // connection with room in its pipeline takes the next start time.
+    double _rate;
+    clock::duration _interval;
+    clock::time_point _next_start;
+    clock::time_point _end;
+    latency_stats _latencies;
+    std::default_random_engine _random;
+    std::discrete_distribution<unsigned> _request_distribution;
+    ::shared_ptr<seastar::tls::certificate_credentials> _creds;
+    unsigned _tls_session_cache_size = 256;
 public:
-    http_client(unsigned duration, unsigned total_conn, unsigned reqs_per_conn)
-        : _duration(duration)
-        , _conn_per_core(total_conn / smp::count)
-        , _reqs_per_conn(reqs_per_conn)
+    http_client(client_config config)
+        : _config(std::move(config))
+        , _duration(_config.duration)
+        , _conn_per_core(_config.total_conn / smp::count)
+        , _reqs_per_conn(_config.reqs_per_conn)
         , _run_timer([this] { _timer_done = true; })
-        , _timer_based(reqs_per_conn == 0) {
+        , _timer_based(_reqs_per_conn == 0)
+        , _rate(_config.rate / smp::count)
+        , _interval(_rate ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1 / _rate)) : clock::duration())
+        , _random(engine().cpu_id())
+    {
+        std::vector<unsigned> weights;
+        for (auto& r : _config.requests) {
+            weights.push_back(r.weight);
+        }
+        _request_distribution = std::discrete_distribution<unsigned>(weights.begin(), weights.end());
     }
 
+    // Requests go out as soon as there is room in the pipeline, and a
+    // reader matches replies to them in order.
     class connection {
     private:
         connected_socket _fd;
@@ -64,50 +130,110 @@ class http_client {
         output_stream<char> _write_buf;
         http_response_parser _parser;
         http_client* _http_client;
+        uint64_t _nr_sent{0};
         uint64_t _nr_done{0};
+        semaphore _pipeline;
+        // Signalled for each request sent, and once more when no more will be
+        semaphore _sent{0};
+        // Times the requests awaiting replies were meant to start and were sent
+        std::deque<std::pair<clock::time_point, clock::time_point>> _in_flight;
     public:
         connection(connected_socket&& fd, http_client* client)
             : _fd(std::move(fd))
             , _read_buf(_fd.input())
             , _write_buf(_fd.output())
-            , _http_client(client){
+            , _http_client(client)
+            , _pipeline(client->_config.pipeline) {
         }
 
         uint64_t nr_done() {
             return _nr_done;
         }
 
-        future<> do_req() {
-            return _write_buf.write("GET / HTTP/1.1\r\nHost: 127.0.0.1:10000\r\n\r\n").then([this] {
-                return _write_buf.flush();
-            }).then([this] {
-                _parser.init();
-                return _read_buf.consume(_parser).then([this] {
-                    // Read HTTP response header first
-                    if (_parser.eof()) {
-                        return make_ready_future<>();
+        future<> run() {
+            auto written = send_reqs();
+            auto read = read_replies().finally([this] {
+                // Stops the sender if the server stopped replying
+                _pipeline.broken();
+            });
+            return when_all(std::move(written), std::move(read)).then([] (std::tuple<future<>, future<>> done) {
+                // A sender stopped by the reader fails with broken_semaphore
+                std::get<0>(done).ignore_ready_future();
+                std::get<1>(done).get();
+            });
+        }
+
+    private:
+        future<> send_reqs() {
+            return repeat([this] {
+                return _pipeline.wait().then([this] {
+                    auto intended = _http_client->next_start(_nr_sent);
+                    if (!intended) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
                     }
-                    auto _rsp = _parser.get_parsed_response();
-                    auto it = _rsp->_headers.find("Content-Length");
-                    if (it == _rsp->_headers.end()) {
-                        print("Error: HTTP response does not contain: Content-Length\n");
-                        return make_ready_future<>();
+                    auto now = clock::now();
+                    auto wait = *intended > now ? sleep(*intended - now) : make_ready_future<>();
+                    return wait.then([this, intended = *intended] {
+                        auto& req = _http_client->pick_request();
+                        _in_flight.emplace_back(intended, clock::now());
+                        _nr_sent++;
+                        return _write_buf.write(req.text.begin(), req.text.size()).then([this] {
+                            return _write_buf.flush();
+                        }).then([this] {
+                            _sent.signal();
+                            return stop_iteration::no;
+                        });
+                    });
+                });
+            }).finally([this] {
+                _sent.signal();
+            });
+        }
+
+        future<> read_replies() {
+            return repeat([this] {
+                return _sent.wait().then([this] {
+                    if (_in_flight.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
                     }
-                    auto content_len = std::stoi(it->second);
-                    http_debug("Content-Length = %d\n", content_len);
-                    // Read HTTP response body
-                    return _read_buf.read_exactly(content_len).then([this] (temporary_buffer<char> buf) {
-                        _nr_done++;
-                        http_debug("%s\n", buf.get());
-                        if (_http_client->done(_nr_done)) {
-                            return make_ready_future();
-                        } else {
-                            return do_req();
+                    return read_reply().then([this] (bool replied) {
+                        if (!replied) {
+                            return stop_iteration::yes;
                         }
+                        auto times = _in_flight.front();
+                        _in_flight.pop_front();
+                        _http_client->record(times.first, times.second);
+                        _pipeline.signal();
+                        return stop_iteration::no;
                     });
                 });
             });
         }
+
+        // Resolves to whether a reply was read
+        future<bool> read_reply() {
+            _parser.init();
+            return _read_buf.consume(_parser).then([this] {
+                // Read HTTP response header first
+                if (_parser.eof()) {
+                    return make_ready_future<bool>(false);
+                }
+                auto _rsp = _parser.get_parsed_response();
+                auto it = _rsp->_headers.find("Content-Length");
+                if (it == _rsp->_headers.end()) {
+                    print("Error: HTTP response does not contain: Content-Length\n");
+                    return make_ready_future<bool>(false);
+                }
+                auto content_len = std::stoi(it->second);
+                http_debug("Content-Length = %d\n", content_len);
+                // Read HTTP response body
+                return _read_buf.read_exactly(content_len).then([this] (temporary_buffer<char> buf) {
+                    _nr_done++;
+                    http_debug("%s\n", buf.get());
+                    return true;
+                });
+            });
+        }
     };
 
     future<uint64_t> total_reqs() {
@@ -115,35 +241,105 @@ class http_client {
         return make_ready_future<uint64_t>(_total_reqs);
     }
 
-    bool done(uint64_t nr_done) {
+    future<latency_stats> latencies() {
+        return make_ready_future<latency_stats>(_latencies);
+    }
+
+    // The time the next request of a connection that sent @nr_sent is
+    // meant to start, or none once the run is over. Closed-loop requests
+    // start right away.
+    std::experimental::optional<clock::time_point> next_start(uint64_t nr_sent) {
+        if (!_rate) {
+            if (done(nr_sent)) {
+                return {};
+            }
+            return clock::now();
+        }
+        if (_next_start >= _end) {
+            return {};
+        }
+        auto t = _next_start;
+        _next_start += _interval;
+        return t;
+    }
+
+    const request_kind& pick_request() {
+        return _config.requests[_request_distribution(_random)];
+    }
+
+    void record(clock::time_point intended, clock::time_point sent) {
+        auto now = clock::now();
+        _latencies.intended.add(now - intended);
+        _latencies.service.add(now - sent);
+    }
+
+    bool done(uint64_t nr_sent) {
         if (_timer_based) {
             return _timer_done;
         } else {
-            return nr_done >= _reqs_per_conn;
+            return nr_sent >= _reqs_per_conn;
         }
     }
 
+    future<connected_socket> connect_one(ipv4_addr server_addr) {
+        if (_creds) {
+            return seastar::tls::connect(_creds, make_ipv4_address(server_addr), _config.tls_server_name);
+        }
+        return engine().net().connect(make_ipv4_address(server_addr));
+    }
+
+    void set_tls_session_cache_size(unsigned size) {
+        _tls_session_cache_size = size;
+    }
+
+    future<> setup_tls() {
+        if (!_config.tls) {
+            return make_ready_future<>();
+        }
+        _creds = ::make_shared<seastar::tls::certificate_credentials>();
+        _creds->set_session_cache_size(_tls_session_cache_size);
+        if (_config.tls_trust_file.empty()) {
+            return _creds->set_system_trust();
+        }
+        return _creds->set_x509_trust_file(_config.tls_trust_file, seastar::tls::x509_crt_format::PEM);
+    }
+
     future<> connect(ipv4_addr server_addr) {
-        // Establish all the TCP connections first
-        for (unsigned i = 0; i < _conn_per_core; i++) {
-            engine().net().connect(make_ipv4_address(server_addr)).then([this] (connected_socket fd) {
+        // With TLS, the first connection's full handshake leaves a session
+        // that the others resume
+        return setup_tls().then([this, server_addr] {
+            if (!_creds || !_conn_per_core) {
+                return make_ready_future<>();
+            }
+            return connect_one(server_addr).then([this] (connected_socket fd) {
                 _sockets.push_back(std::move(fd));
-                http_debug("Established connection %6d on cpu %3d\n", _conn_connected.current(), engine().cpu_id());
                 _conn_connected.signal();
-            }).or_terminate();
-        }
-        return _conn_connected.wait(_conn_per_core);
+            });
+        }).then([this, server_addr] {
+            // Establish all the TCP connections first
+            for (unsigned i = _sockets.size(); i < _conn_per_core; i++) {
+                connect_one(server_addr).then([this] (connected_socket fd) {
+                    _sockets.push_back(std::move(fd));
+                    http_debug("Established connection %6d on cpu %3d\n", _conn_connected.current(), engine().cpu_id());
+                    _conn_connected.signal();
+                }).or_terminate();
+            }
+            return _conn_connected.wait(_conn_per_core);
+        });
     }
 
     future<> run() {
         // All connected, start HTTP request
         http_debug("Established all %6d tcp connections on cpu %3d\n", _conn_per_core, engine().cpu_id());
-        if (_timer_based) {
+        if (_rate) {
+            _next_start = clock::now();
+            _end = _next_start + std::chrono::seconds(_duration);
+        } else if (_timer_based) {
             _run_timer.arm(std::chrono::seconds(_duration));
         }
         for (auto&& fd : _sockets) {
             auto conn = new connection(std::move(fd), this);
-            conn->do_req().then_wrapped([this, conn] (auto&& f) {
+            conn->run().then_wrapped([this, conn] (auto&& f) {
                 http_debug("Finished connection %6d on cpu %3d\n", _conn_finished.current(), engine().cpu_id());
                 _total_reqs += conn->nr_done();
                 _conn_finished.signal();
@@ -164,6 +360,26 @@ class http_client {
     }
 };
 
+// Parses "METHOD PATH [WEIGHT [BODY]]" into the request sent
+static request_kind parse_request(const std::string& spec, const std::string& host) {
+    std::istringstream in(spec);
+    std::string method, path, body;
+    unsigned weight = 1;
+    if (!(in >> method >> path)) {
+        throw std::invalid_argument(sprint("bad --request \"%s\", expected METHOD PATH [WEIGHT [BODY]]", spec));
+    }
+    if (in >> std::ws && !in.eof() && !(in >> weight)) {
+        throw std::invalid_argument(sprint("bad weight in --request \"%s\"", spec));
+    }
+    std::getline(in >> std::ws, body);
+    auto text = sprint("%s %s HTTP/1.1\r\nHost: %s\r\n", method, path, host);
+    if (!body.empty() || method == "POST" || method == "PUT") {
+        text += sprint("Content-Length: %d\r\n", body.size());
+    }
+    text += "\r\n" + body;
+    return request_kind{text, weight};
+}
+
 namespace bpo = boost::program_options;
 
 int main(int ac, char** av) {
@@ -172,7 +388,18 @@ int main(int ac, char** av) {
         ("server,s", bpo::value<std::string>()->default_value("192.168.66.100:10000"), "Server address")
         ("conn,c", bpo::value<unsigned>()->default_value(100), "total connections")
         ("reqs,r", bpo::value<unsigned>()->default_value(0), "reqs per connection")
-        ("duration,d", bpo::value<unsigned>()->default_value(10), "duration of the test in seconds)");
+        ("duration,d", bpo::value<unsigned>()->default_value(10), "duration of the test in seconds)")
+        ("rate", bpo::value<double>()->default_value(0), "open loop: total requests per second, split evenly between "
+                "the cpus, started on schedule whether or not earlier ones completed (0: closed loop)")
+        ("pipeline", bpo::value<unsigned>()->default_value(1), "requests sent on a connection before waiting for a reply")
+        ("request", bpo::value<std::vector<std::string>>()->composing(), "a request in the mix, as \"METHOD PATH [WEIGHT [BODY]]\"; "
+                "may be repeated, and requests are picked at random in proportion to their weight (default: \"GET /\")")
+        ("tls", "connect with TLS")
+        ("tls-trust-file", bpo::value<std::string>()->default_value(""), "PEM file of the CAs trusted to sign the server's "
+                "certificate (default: the system's)")
+        ("tls-server-name", bpo::value<std::string>(), "name the server certificate is verified against, and sessions are "
+                "resumed under (default: the host of --server)")
+        ("tls-session-cache", bpo::value<unsigned>()->default_value(256), "TLS sessions kept for resumption, per cpu");
 
     return app.run(ac, av, [&app] () -> future<int> {
         auto& config = app.configuration();
@@ -180,11 +407,46 @@ int main(int ac, char** av) {
         auto reqs_per_conn = config["reqs"].as<unsigned>();
         auto total_conn= config["conn"].as<unsigned>();
         auto duration = config["duration"].as<unsigned>();
+        auto rate = config["rate"].as<double>();
+        auto pipeline = config["pipeline"].as<unsigned>();
+        auto host = server.substr(0, server.rfind(':'));
 
         if (total_conn % smp::count != 0) {
             print("Error: conn needs to be n * cpu_nr\n");
             return make_ready_future<int>(-1);
         }
+        if (rate && reqs_per_conn) {
+            print("Error: an open loop run (--rate) lasts --duration, so it can't take --reqs\n");
+            return make_ready_future<int>(-1);
+        }
+
+        if (!pipeline) {
+            print("Error: pipeline needs to be at least 1\n");
+            return make_ready_future<int>(-1);
+        }
+
+        client_config cc;
+        cc.duration = duration;
+        cc.total_conn = total_conn;
+        cc.reqs_per_conn = reqs_per_conn;
+        cc.rate = rate;
+        cc.pipeline = pipeline;
+        std::vector<std::string> requests{"GET /"};
+        if (config.count("request")) {
+            requests = config["request"].as<std::vector<std::string>>();
+        }
+        try {
+            for (auto& r : requests) {
+                cc.requests.push_back(parse_request(r, server));
+            }
+        } catch (std::invalid_argument& e) {
+            print("Error: %s\n", e.what());
+            return make_ready_future<int>(-1);
+        }
+        cc.tls = config.count("tls");
+        cc.tls_trust_file = config["tls-trust-file"].as<std::string>();
+        cc.tls_server_name = config.count("tls-server-name") ? config["tls-server-name"].as<std::string>() : host;
+        auto tls_session_cache = config["tls-session-cache"].as<unsigned>();
 
         auto http_clients = new distributed<http_client>;
 
@@ -193,15 +455,32 @@ int main(int ac, char** av) {
         print("========== http_client ============\n");
         print("Server: %s\n", server);
         print("Connections: %u\n", total_conn);
-        print("Requests/connection: %s\n", reqs_per_conn == 0 ? "dynamic (timer based)" : std::to_string(reqs_per_conn));
-        return http_clients->start(std::move(duration), std::move(total_conn), std::move(reqs_per_conn)).then([http_clients, started, server] {
+        if (rate) {
+            print("Open loop: %f requests/sec, %f per cpu\n", rate, rate / smp::count);
+        } else {
+            print("Requests/connection: %s\n", reqs_per_conn == 0 ? "dynamic (timer based)" : std::to_string(reqs_per_conn));
+        }
+        print("Pipeline depth: %u\n", pipeline);
+        if (cc.tls) {
+            print("TLS: server name %s\n", cc.tls_server_name);
+        }
+        return http_clients->start(std::move(cc)).then([http_clients, tls_session_cache] {
+            return http_clients->invoke_on_all([tls_session_cache] (http_client& c) {
+                c.set_tls_session_cache_size(tls_session_cache);
+            });
+        }).then([http_clients, started, server] {
             return http_clients->invoke_on_all(&http_client::connect, ipv4_addr{server});
         }).then([http_clients] {
             return http_clients->invoke_on_all(&http_client::run);
         }).then([http_clients] {
             return http_clients->map_reduce(adder<uint64_t>(), &http_client::total_reqs);
-        }).then([http_clients, started] (auto total_reqs) {
+        }).then([http_clients] (auto total_reqs) {
+            return http_clients->map_reduce(adder<latency_stats>(), &http_client::latencies).then([total_reqs] (latency_stats latencies) {
+                return std::make_pair(total_reqs, std::move(latencies));
+            });
+        }).then([http_clients, started, rate] (auto results) {
            // All the http requests are finished
+           auto total_reqs = results.first;
            auto finished = steady_clock_type::now();
            auto elapsed = finished - started;
            auto secs = static_cast<double>(elapsed.count() / 1000000000.0);
@@ -209,6 +488,14 @@ int main(int ac, char** av) {
            print("Total requests: %u\n", total_reqs);
            print("Total time: %f\n", secs);
            print("Requests/sec: %f\n", static_cast<double>(total_reqs) / secs);
+           auto print_latencies = [] (const char* what, const latency_histogram& h) {
+               print("%s (us): p50 %u, p99 %u, p999 %u, max %u\n", what,
+                     h.quantile(0.5), h.quantile(0.99), h.quantile(0.999), h.max());
+           };
+           if (rate) {
+               print_latencies("Latency from intended start", results.second.intended);
+           }
+           print_latencies("Latency from send", results.second.service);
            print("==========     done     ============\n");
            return http_clients->stop().then([http_clients] {
                // FIXME: If we call engine().exit(0) here to exit when
@@ -178,11 +178,16 @@ tests = [
     'tests/foreign_ptr_test',
     'tests/smp_test',
     'tests/thread_test',
+    'tests/alien_test',
+    'tests/replicated_test',
+    'tests/shard_channel_test',
+    'tests/object_pool_test',
     'tests/thread_context_switch',
     'tests/udp_server',
     'tests/udp_client',
     'tests/blkdiscard_test',
     'tests/sstring_test',
+    'tests/checksum_test',
     'tests/unwind_test',
     'tests/defer_test',
     'tests/httpd',
@@ -191,6 +196,7 @@ tests = [
     'tests/tcp_sctp_client',
     'tests/allocator_test',
     'tests/output_stream_test',
+    'tests/input_stream_test',
     'tests/udp_zero_copy',
     'tests/shared_ptr_test',
     'tests/weak_ptr_test',
@@ -201,14 +207,36 @@ tests = [
     'tests/semaphore_test',
     'tests/expiring_fifo_test',
     'tests/packet_test',
+    'tests/tcp_option_test',
+    'tests/tcp_congestion_test',
     'tests/tls_test',
     'tests/fair_queue_test',
     'tests/rpc_test',
     'tests/connect_test',
     'tests/chunked_fifo_test',
+    'tests/small_circular_buffer_test',
+    'tests/connection_table_test',
+    'tests/arena_test',
+    'tests/log_region_test',
     'tests/scollectd_test',
     'tests/perf/perf_fstream',
+    'tests/perf/perf_timer_set',
+    'tests/perf/perf_connection_table',
+    'tests/perf/perf_coroutine',
+    'tests/perf/perf_parsers',
+    'tests/perf/perf_semaphore',
+    'tests/perf/perf_future',
+    'tests/perf/perf_json_formatter',
+    'tests/perf/perf_core',
+    'tests/perf/perf_net',
+    'tests/perf/perf_allocator',
     'tests/json_formatter_test',
+    'tests/tracing_test',
+    'tests/cpu_profile_test',
+    'tests/simulation_test',
+    'tests/loopback_stack_test',
+    'tests/json_parser_test',
+    'tests/fragmented_ostream_test',
     ]
 
 apps = [
@@ -216,6 +244,7 @@ apps = [
     'apps/seawreck/seawreck',
     'apps/fair_queue_tester/fair_queue_tester',
     'apps/memcached/memcached',
+    'apps/memwreck/memwreck',
     'apps/iotune/iotune',
     ]
 
@@ -253,19 +282,28 @@ arg_parser.add_argument('--static-boost', dest = 'staticboost', action = 'store_
                         help = 'Link with boost statically')
 add_tristate(arg_parser, name = 'hwloc', dest = 'hwloc', help = 'hwloc support')
 add_tristate(arg_parser, name = 'xen', dest = 'xen', help = 'Xen support')
+add_tristate(arg_parser, name = 'io-uring', dest = 'io_uring', help = 'io_uring reactor backend')
+add_tristate(arg_parser, name = 'af-xdp', dest = 'af_xdp', help = 'AF_XDP native network backend')
+add_tristate(arg_parser, name = 'zstd', dest = 'zstd', help = 'zstd RPC compressor')
+arg_parser.add_argument('--enable-coroutines', dest = 'coroutines', action = 'store_true', default = False,
+                        help = 'Enable C++ coroutines support (co_await on future<>)')
 args = arg_parser.parse_args()
 
 libnet = [
     'net/proxy.cc',
+    'net/bond.cc',
     'net/virtio.cc',
     'net/dpdk.cc',
+    'net/xdp.cc',
     'net/ip.cc',
+    'net/ipv6.cc',
     'net/ethernet.cc',
     'net/arp.cc',
     'net/native-stack.cc',
     'net/ip_checksum.cc',
     'net/udp.cc',
     'net/tcp.cc',
+    'net/tcp-congestion.cc',
     'net/dhcp.cc',
     'net/tls.cc',
     ]
@@ -274,11 +312,18 @@ core = [
     'core/reactor.cc',
     'core/systemwide_memory_barrier.cc',
     'core/fstream.cc',
+    'core/cached-file.cc',
+    'core/append-file.cc',
+    'core/mapped-file.cc',
+    'core/log-region.cc',
+    'core/alien.cc',
+    'core/checksum.cc',
     'core/posix.cc',
     'core/memory.cc',
     'core/resource.cc',
     'core/scollectd.cc',
     'core/metrics.cc',
+    'core/tracing.cc',
     'core/app-template.cc',
     'core/thread.cc',
     'core/dpdk_rte.cc',
@@ -286,10 +331,13 @@ core = [
     'util/log.cc',
     'net/packet.cc',
     'net/posix-stack.cc',
+    'net/shm-socket.cc',
+    'net/loopback-stack.cc',
     'net/net.cc',
     'net/stack.cc',
     'rpc/rpc.cc',
     'rpc/lz4_compressor.cc',
+    'rpc/zstd_compressor.cc',
     ]
 
 protobuf = [
@@ -305,14 +353,24 @@ http = ['http/transformers.cc',
         'http/file_handler.cc',
         'http/common.cc',
         'http/routes.cc',
+        'http/body_stream.cc',
+        'http/compress.cc',
+        'http/hpack.cc',
+        'http/http2.cc',
+        'http/client.cc',
         'json/json_elements.cc',
         'json/formatter.cc',
+        'json/json_parser.cc',
         'http/matcher.cc',
+        'http/route_tree.cc',
         'http/mime_types.cc',
         'http/httpd.cc',
         'http/reply.cc',
         'http/request_parser.rl',
+        'http/http_response_parser.rl',
         'http/api_docs.cc',
+        'http/heap_profile.cc',
+        'http/cpu_profile.cc',
         ]
 
 boost_test_lib = [
@@ -333,7 +391,7 @@ libs = ' '.join(['-laio',
                               '-lboost_program_options -lboost_system -lboost_filesystem'),
                  '-lstdc++ -lm',
                  maybe_static(args.staticboost, '-lboost_thread'),
-                 '-lcryptopp -lrt -lgnutls -lgnutlsxx -llz4 -lprotobuf -ldl -lgcc_s -lunwind',
+                 '-lcryptopp -lrt -lgnutls -lgnutlsxx -llz4 -lz -lprotobuf -ldl -lgcc_s -lunwind',
                  ])
 
 boost_unit_test_lib = maybe_static(args.staticboost, '-lboost_unit_test_framework')
@@ -399,6 +457,10 @@ deps = {
     'tests/expiring_fifo_test': ['tests/expiring_fifo_test.cc'] + core,
     'tests/smp_test': ['tests/smp_test.cc'] + core,
     'tests/thread_test': ['tests/thread_test.cc'] + core,
+    'tests/alien_test': ['tests/alien_test.cc'] + core,
+    'tests/replicated_test': ['tests/replicated_test.cc'] + core,
+    'tests/shard_channel_test': ['tests/shard_channel_test.cc'] + core,
+    'tests/object_pool_test': ['tests/object_pool_test.cc'] + core,
     'tests/thread_context_switch': ['tests/thread_context_switch.cc'] + core,
     'tests/udp_server': ['tests/udp_server.cc'] + core + libnet,
     'tests/udp_client': ['tests/udp_client.cc'] + core + libnet,
@@ -407,15 +469,18 @@ deps = {
     'tests/tls_test': ['tests/tls_test.cc'] + core + libnet,
     'tests/fair_queue_test': ['tests/fair_queue_test.cc'] + core,
     'apps/seawreck/seawreck': ['apps/seawreck/seawreck.cc', 'http/http_response_parser.rl'] + core + libnet,
+    'apps/memwreck/memwreck': ['apps/memwreck/memwreck.cc'] + core + libnet,
     'apps/fair_queue_tester/fair_queue_tester': ['apps/fair_queue_tester/fair_queue_tester.cc'] + core,
     'apps/iotune/iotune': ['apps/iotune/iotune.cc', 'apps/iotune/fsqual.cc'] + ['core/resource.cc'],
     'tests/blkdiscard_test': ['tests/blkdiscard_test.cc'] + core,
     'tests/sstring_test': ['tests/sstring_test.cc'] + core,
+    'tests/checksum_test': ['tests/checksum_test.cc'] + libnet + core,
     'tests/unwind_test': ['tests/unwind_test.cc'] + core,
     'tests/defer_test': ['tests/defer_test.cc'] + core,
     'tests/httpd': ['tests/httpd.cc'] + http + core,
     'tests/allocator_test': ['tests/allocator_test.cc'] + core,
     'tests/output_stream_test': ['tests/output_stream_test.cc'] + core + libnet,
+    'tests/input_stream_test': ['tests/input_stream_test.cc'] + core + libnet,
     'tests/udp_zero_copy': ['tests/udp_zero_copy.cc'] + core + libnet,
     'tests/shared_ptr_test': ['tests/shared_ptr_test.cc'] + core,
     'tests/weak_ptr_test': ['tests/weak_ptr_test.cc'] + core,
@@ -425,11 +490,33 @@ deps = {
     'tests/rpc': ['tests/rpc.cc'] + core + libnet,
     'tests/rpc_test': ['tests/rpc_test.cc'] + core + libnet,
     'tests/packet_test': ['tests/packet_test.cc'] + core + libnet,
+    'tests/tcp_option_test': ['tests/tcp_option_test.cc'] + core + libnet,
+    'tests/tcp_congestion_test': ['tests/tcp_congestion_test.cc'] + core + libnet,
     'tests/connect_test': ['tests/connect_test.cc'] + core + libnet,
     'tests/chunked_fifo_test': ['tests/chunked_fifo_test.cc'] + core,
+    'tests/small_circular_buffer_test': ['tests/small_circular_buffer_test.cc'] + core,
+    'tests/connection_table_test': ['tests/connection_table_test.cc'] + core,
+    'tests/arena_test': ['tests/arena_test.cc'] + core,
+    'tests/log_region_test': ['tests/log_region_test.cc'] + core,
     'tests/scollectd_test': ['tests/scollectd_test.cc'] + core,
     'tests/perf/perf_fstream': ['tests/perf/perf_fstream.cc'] + core,
+    'tests/perf/perf_timer_set': ['tests/perf/perf_timer_set.cc'] + core,
+    'tests/perf/perf_connection_table': ['tests/perf/perf_connection_table.cc'] + core,
+    'tests/perf/perf_coroutine': ['tests/perf/perf_coroutine.cc'] + core,
+    'tests/perf/perf_parsers': ['tests/perf/perf_parsers.cc'] + http + memcache_base,
+    'tests/perf/perf_semaphore': ['tests/perf/perf_semaphore.cc'] + core,
+    'tests/perf/perf_future': ['tests/perf/perf_future.cc'] + core,
+    'tests/perf/perf_json_formatter': ['tests/perf/perf_json_formatter.cc'] + core + http,
+    'tests/perf/perf_core': ['tests/perf/perf_core.cc', 'tests/perf/perf_tests.cc'] + core,
+    'tests/perf/perf_net': ['tests/perf/perf_net.cc'] + core + libnet,
+    'tests/perf/perf_allocator': ['tests/perf/perf_allocator.cc'] + core,
     'tests/json_formatter_test': ['tests/json_formatter_test.cc'] + core + http,
+    'tests/tracing_test': ['tests/tracing_test.cc'] + core,
+    'tests/cpu_profile_test': ['tests/cpu_profile_test.cc'] + core,
+    'tests/simulation_test': ['tests/simulation_test.cc'] + core,
+    'tests/loopback_stack_test': ['tests/loopback_stack_test.cc'] + core,
+    'tests/json_parser_test': ['tests/json_parser_test.cc', 'tests/json_parser_test.json'] + core + http,
+    'tests/fragmented_ostream_test': ['tests/fragmented_ostream_test.cc'] + core,
 }
 
 boost_tests = [
@@ -439,17 +526,29 @@ boost_tests = [
     'tests/alloc_test',
     'tests/foreign_ptr_test',
     'tests/semaphore_test',
+    'tests/log_region_test',
     'tests/expiring_fifo_test',
     'tests/thread_test',
+    'tests/alien_test',
+    'tests/replicated_test',
+    'tests/shard_channel_test',
+    'tests/object_pool_test',
     'tests/tls_test',
     'tests/fair_queue_test',
     'tests/httpd',
     'tests/output_stream_test',
+    'tests/input_stream_test',
     'tests/fstream_test',
     'tests/rpc_test',
     'tests/connect_test',
     'tests/scollectd_test',
     'tests/json_formatter_test',
+    'tests/tracing_test',
+    'tests/cpu_profile_test',
+    'tests/simulation_test',
+    'tests/loopback_stack_test',
+    'tests/json_parser_test',
+    'tests/fragmented_ostream_test',
     ]
 
 for bt in boost_tests:
@@ -595,6 +694,80 @@ if try_compile(args.cxx, source = textwrap.dedent('''\
         ''')):
     defines.append("HAVE_LZ4_COMPRESS_DEFAULT")
 
+if try_compile(args.cxx, source = textwrap.dedent('''\
+        #include <linux/tls.h>
+        #include <gnutls/gnutls.h>
+
+        int x = TLS_TX | TLS_SET_RECORD_TYPE | TLS_CIPHER_AES_GCM_128 | TLS_CIPHER_AES_GCM_256;
+
+        int f(gnutls_session_t s, unsigned char* seq) {
+            return gnutls_record_get_state(s, 0, nullptr, nullptr, nullptr, seq);
+        }
+        ''')):
+    defines.append("HAVE_KTLS")
+
+def have_io_uring():
+    return try_compile(args.cxx, source = textwrap.dedent('''\
+        #include <linux/io_uring.h>
+
+        int x = IORING_OP_READ | IORING_FEAT_NODROP | IORING_FEAT_SINGLE_MMAP;
+        '''))
+
+if apply_tristate(args.io_uring, test = have_io_uring,
+                  note = 'Note: linux/io_uring.h not found.  No io_uring reactor backend.',
+                  missing = 'Error: linux/io_uring.h (kernel headers 5.6+) not found.'):
+    defines.append("HAVE_IO_URING")
+
+def have_af_xdp():
+    return try_compile(args.cxx, source = textwrap.dedent('''\
+        #include <linux/if_xdp.h>
+        #include <linux/bpf.h>
+
+        int x = XDP_USE_NEED_WAKEUP | XDP_RING_NEED_WAKEUP | BPF_MAP_TYPE_XSKMAP;
+        '''))
+
+if apply_tristate(args.af_xdp, test = have_af_xdp,
+                  note = 'Note: linux/if_xdp.h not found.  No AF_XDP network backend.',
+                  missing = 'Error: linux/if_xdp.h (kernel headers 5.4+) not found.'):
+    defines.append("HAVE_AF_XDP")
+
+def have_zstd():
+    return try_compile(args.cxx, source = textwrap.dedent('''\
+        #include <zstd.h>
+
+        void m() {
+            ZSTD_getDictID_fromDict(nullptr, 0);
+            ZSTD_decompress_usingDDict(nullptr, nullptr, 0, nullptr, 0, nullptr);
+        }
+        '''))
+
+if apply_tristate(args.zstd, test = have_zstd,
+                  note = 'Note: zstd.h not found.  No zstd RPC compressor.',
+                  missing = 'Error: zstd.h (libzstd-dev) not found.'):
+    defines.append("HAVE_ZSTD")
+    libs += ' -lzstd'
+
+def coroutines_flag():
+    source = textwrap.dedent('''\
+        #if __has_include(<coroutine>)
+        #include <coroutine>
+        #else
+        #include <experimental/coroutine>
+        #endif
+        ''')
+    for flag in ['-fcoroutines', '-fcoroutines-ts']:
+        if try_compile(args.cxx, source = source, flags = ['-std=gnu++1y', flag]):
+            return flag
+    return None
+
+if args.coroutines:
+    flag = coroutines_flag()
+    if not flag:
+        print('Error: compiler does not support coroutines (-fcoroutines or -fcoroutines-ts).')
+        sys.exit(1)
+    args.user_cflags += ' ' + flag
+    defines.append('SEASTAR_COROUTINES_ENABLED')
+
 if args.so:
     args.pie = '-shared'
     args.fpie = '-fpic'
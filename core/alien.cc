@@ -0,0 +1,105 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "alien.hh"
+#include "report_exception.hh"
+#include <thread>
+
+namespace seastar {
+
+namespace alien {
+
+message_queue::message_queue(reactor* r)
+        : _reactor(r) {
+}
+
+message_queue::~message_queue() {
+    work_item* wi;
+    while (_pending.pop(wi)) {
+        delete wi;
+    }
+}
+
+message_queue& message_queue::of(unsigned shard) {
+    return *smp::_reactors[shard]->_alien_queue;
+}
+
+void message_queue::register_metrics() {
+    namespace sm = seastar::metrics;
+    _metrics.add_group("alien", {
+        sm::make_derive("received_messages", [this] { return _received; },
+                sm::description("Counts messages from non-seastar threads processed by this shard")),
+        sm::make_derive("full_queue_waits", [this] { return _full_waits.load(std::memory_order_relaxed); },
+                sm::description("Counts the times a non-seastar thread found this shard's queue full")),
+        sm::make_gauge("pending_messages", [this] { return _sent.load(std::memory_order_relaxed) - _received; },
+                sm::description("Messages from non-seastar threads waiting to be processed")),
+    });
+}
+
+// Pairs with the fence in reactor::alien_pollfn::try_enter_interrupt_mode():
+// either the reactor sees the pushed item when it checks the queue before
+// sleeping, or we see it sleeping and wake it.
+void message_queue::maybe_wakeup() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_reactor->_sleeping.load(std::memory_order_relaxed)) {
+        _reactor->_sleeping.store(false, std::memory_order_relaxed);
+        _reactor->wakeup();
+    }
+}
+
+void message_queue::push(std::unique_ptr<work_item> item) {
+    _sent.fetch_add(1, std::memory_order_relaxed);
+    auto wi = item.release();
+    if (!_pending.bounded_push(wi)) {
+        _full_waits.fetch_add(1, std::memory_order_relaxed);
+        do {
+            maybe_wakeup();
+            std::this_thread::yield();
+        } while (!_pending.bounded_push(wi));
+    }
+    maybe_wakeup();
+}
+
+size_t message_queue::process_incoming() {
+    work_item* items[batch_size];
+    size_t n = 0;
+    while (n < batch_size && _pending.pop(items[n])) {
+        ++n;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        std::unique_ptr<work_item> wi(items[i]);
+        try {
+            wi->process();
+        } catch (...) {
+            report_exception("Exception while processing a message from a non-seastar thread", std::current_exception());
+        }
+    }
+    _received += n;
+    return n;
+}
+
+bool message_queue::pure_poll() const {
+    return !const_cast<decltype(_pending)&>(_pending).empty();
+}
+
+}
+
+}
@@ -0,0 +1,158 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+///
+/// Submitting work to reactors from threads that are not seastar threads.
+
+#include "reactor.hh"
+#include <boost/lockfree/queue.hpp>
+#include <atomic>
+#include <future>
+
+namespace seastar {
+
+/// \brief Entry points for non-seastar threads.
+///
+/// A thread started outside seastar (for example by a JVM or an RPC
+/// framework embedding seastar) cannot use \ref smp::submit_to(), which
+/// must be called on a shard.  It can call \ref run_on() or \ref submit_to()
+/// here instead; the work is pushed onto a lock-free queue owned by the
+/// target shard and picked up by a poller, in batches, with no system call
+/// unless the reactor is sleeping.
+///
+/// These functions may only be called after the reactors have started and
+/// before they are stopped.
+namespace alien {
+
+/// A bounded multi-producer, single-consumer queue of work for one shard.
+class message_queue {
+public:
+    struct work_item {
+        virtual ~work_item() {}
+        virtual void process() = 0;
+    };
+private:
+    static constexpr size_t queue_length = 1024;
+    static constexpr size_t batch_size = 128;
+    boost::lockfree::queue<work_item*, boost::lockfree::capacity<queue_length>> _pending;
+    reactor* _reactor;
+    std::atomic<uint64_t> _sent = { 0 };
+    uint64_t _received = 0;
+    std::atomic<uint64_t> _full_waits = { 0 };
+    seastar::metrics::metric_groups _metrics;
+private:
+    void maybe_wakeup();
+public:
+    explicit message_queue(reactor* r);
+    ~message_queue();
+    /// The queue of \c shard.
+    static message_queue& of(unsigned shard);
+    /// Queues \c item, which is deleted on the shard once processed.  May be
+    /// called from any thread.  If the queue is full, waits for the shard to
+    /// make room.
+    void push(std::unique_ptr<work_item> item);
+    /// Runs a batch of queued items; returns the number run.  Called on the
+    /// owning shard.
+    size_t process_incoming();
+    bool pure_poll() const;
+    void register_metrics();
+};
+
+template <typename Func>
+struct run_on_work_item : message_queue::work_item {
+    Func _func;
+    explicit run_on_work_item(Func&& func) : _func(std::move(func)) {}
+    virtual void process() override {
+        _func();
+    }
+};
+
+/// Runs \c func on \c shard and returns immediately.
+///
+/// \c func runs in the reactor's context and must not block.  If it
+/// returns a future, the result is discarded.  May be called from any
+/// thread, including seastar threads.
+template <typename Func>
+void run_on(unsigned shard, Func func) {
+    message_queue::of(shard).push(std::make_unique<run_on_work_item<Func>>(std::move(func)));
+}
+
+namespace internal {
+
+template <typename T>
+struct result_of_apply {
+    using type = T;
+};
+
+template <typename... T>
+struct result_of_apply<future<T...>> : result_of_apply<T...> {};
+
+template <>
+struct result_of_apply<future<>> {
+    using type = void;
+};
+
+template <typename T>
+struct result_of_apply<T&&> : result_of_apply<T> {};
+
+template <typename Func>
+using return_type_t = typename result_of_apply<std::result_of_t<Func()>>::type;
+
+template <typename T>
+void set_result(std::promise<T>& pr, future<T>&& f) {
+    pr.set_value(f.get0());
+}
+
+inline
+void set_result(std::promise<void>& pr, future<>&& f) {
+    f.get();
+    pr.set_value();
+}
+
+}
+
+/// Runs \c func on \c shard, returning a \c std::future for its result.
+///
+/// \c func runs in the reactor's context and may return a value or a
+/// seastar future; the \c std::future becomes ready when that completes.
+/// The caller must not wait on the \c std::future from a seastar thread.
+template <typename Func, typename T = internal::return_type_t<Func>>
+std::future<T> submit_to(unsigned shard, Func func) {
+    std::promise<T> pr;
+    auto fut = pr.get_future();
+    run_on(shard, [pr = std::move(pr), func = std::move(func)] () mutable {
+        futurize<std::result_of_t<Func()>>::apply(std::move(func)).then_wrapped([pr = std::move(pr)] (auto&& f) mutable {
+            try {
+                internal::set_result(pr, std::move(f));
+            } catch (...) {
+                pr.set_exception(std::current_exception());
+            }
+        });
+    });
+    return fut;
+}
+
+}
+
+}
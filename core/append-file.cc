@@ -0,0 +1,170 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "append-file.hh"
+#include "align.hh"
+#include <string.h>
+
+// On a filesystem iotune has qualified, more appends in flight than it
+// takes at once only wait in the file's queue, and preallocating space
+// that doesn't make appends cheaper costs a syscall for nothing.
+static append_file_options fit_to_filesystem(const file& f, append_file_options options) {
+    auto& fs = f.fs_properties();
+    if (fs.qualified) {
+        options.write_behind = std::min(options.write_behind, std::max(fs.append_concurrency, 1u));
+        if (!fs.preallocation_helps) {
+            options.preallocation_size = 0;
+        }
+    }
+    return options;
+}
+
+append_file::append_file(file f, append_file_options options)
+        : _file(std::move(f))
+        , _options(fit_to_filesystem(_file, options))
+        , _alignment(_file.disk_write_dma_alignment())
+        , _write_behind(std::max(_options.write_behind, 1u)) {
+    _options.buffer_size = align_up(_options.buffer_size, _alignment);
+    _buf = allocate_buffer();
+    _write_behind.ensure_space_for_waiters(1);
+}
+
+temporary_buffer<char> append_file::allocate_buffer() {
+    return temporary_buffer<char>::aligned(_file.memory_dma_alignment(), _options.buffer_size);
+}
+
+future<> append_file::append(const char* data, size_t len) {
+    if (_ex) {
+        return make_exception_future<>(_ex);
+    }
+    while (len) {
+        auto n = std::min(len, _buf.size() - _fill);
+        ::memcpy(_buf.get_write() + _fill, data, n);
+        _fill += n;
+        _size += n;
+        data += n;
+        len -= n;
+        if (_fill == _buf.size()) {
+            auto f = write_buffer();
+            if (!f.available() || f.failed()) {
+                return f.then([this, data, len] {
+                    return append(data, len);
+                });
+            }
+        }
+    }
+    return make_ready_future<>();
+}
+
+// Issues the write of the full tail buffer in the background, once a
+// write-behind slot is free.
+future<> append_file::write_buffer() {
+    return _write_behind.wait().then([this] {
+        auto buf = std::exchange(_buf, allocate_buffer());
+        auto pos = _buf_pos;
+        _buf_pos += buf.size();
+        _fill = 0;
+        maybe_preallocate();
+        auto p = buf.get();
+        auto len = buf.size();
+        _file.dma_write(pos, p, len, _options.io_priority_class).then_wrapped(
+                [this, len, buf = std::move(buf)] (future<size_t> f) {
+            try {
+                if (f.get0() != len) {
+                    throw std::system_error(EIO, std::system_category());
+                }
+            } catch (...) {
+                if (!_ex) {
+                    _ex = std::current_exception();
+                }
+            }
+            _write_behind.signal();
+        });
+    });
+}
+
+future<> append_file::wait_for_writes() {
+    auto n = std::max(_options.write_behind, 1u);
+    return _write_behind.wait(n).then([this, n] {
+        _write_behind.signal(n);
+        if (_ex) {
+            return make_exception_future<>(_ex);
+        }
+        return make_ready_future<>();
+    });
+}
+
+// Writes the partial tail buffer, padded with zeroes to the write
+// alignment.  The tail stays in the buffer, so the same block is written
+// again once more data arrives.
+future<> append_file::write_tail() {
+    return wait_for_writes().then([this] {
+        if (!_fill) {
+            return make_ready_future<>();
+        }
+        auto len = align_up(_fill, _alignment);
+        ::memset(_buf.get_write() + _fill, 0, len - _fill);
+        return _file.dma_write(_buf_pos, _buf.get(), len, _options.io_priority_class).then([len] (size_t r) {
+            if (r != len) {
+                throw std::system_error(EIO, std::system_category());
+            }
+        });
+    });
+}
+
+void append_file::maybe_preallocate() {
+    if (!_options.preallocation_size || _allocating) {
+        return;
+    }
+    // Stay at least half a preallocation ahead of the writes in flight.
+    auto horizon = _buf_pos + _options.buffer_size * _options.write_behind;
+    if (horizon + _options.preallocation_size / 2 <= _allocated) {
+        return;
+    }
+    _allocating = true;
+    auto pos = std::max(_allocated, _buf_pos);
+    auto len = _options.preallocation_size;
+    _allocation_done = _file.allocate(pos, len).then_wrapped([this, pos, len] (future<> f) {
+        // Preallocation is only an optimization; writes extend the file
+        // without it.
+        f.ignore_ready_future();
+        _allocating = false;
+        _allocated = pos + len;
+    });
+}
+
+future<> append_file::flush() {
+    return write_tail().then([this] {
+        return _file.flush();
+    });
+}
+
+future<> append_file::close() {
+    return write_tail().then([this] {
+        return std::exchange(_allocation_done, make_ready_future<>());
+    }).then([this] {
+        return _file.truncate(_size);
+    }).then([this] {
+        return _file.flush();
+    }).finally([this] {
+        return _file.close();
+    });
+}
@@ -0,0 +1,95 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+///
+/// An append-only view of a \ref file, for logs.
+
+#include "file.hh"
+#include "semaphore.hh"
+#include "reactor.hh"
+
+/// Options for \ref append_file.
+struct append_file_options {
+    /// Size of each DMA write; a multiple of the file's write alignment.
+    size_t buffer_size = 128 * 1024;
+    /// Number of buffers written in parallel.
+    unsigned write_behind = 4;
+    /// Space allocated ahead of the write pointer at a time; 0 disables
+    /// preallocation.
+    uint64_t preallocation_size = 32 << 20;
+    ::io_priority_class io_priority_class = default_priority_class();
+};
+
+/// Appends data to a file with large, concurrent, aligned DMA writes.
+///
+/// Appended data is collected in an aligned tail buffer; each full buffer
+/// is written in the background, up to \ref append_file_options::write_behind
+/// writes at a time.  Space is allocated (without changing the file size)
+/// ahead of the write pointer in the background, so that writes do not have
+/// to extend the file's extents, which XFS serializes.  If iotune qualified
+/// the filesystem (see \ref file::fs_properties()), write-behind is limited
+/// to the appends it takes at once, and preallocation is skipped where it
+/// was measured not to help.
+///
+/// \ref flush() pads the partial tail to the write alignment and writes it,
+/// so until \ref close() truncates the file to the appended size, the file
+/// may have up to one alignment unit of zeroes past the data.
+///
+/// Writing starts at offset 0.  Calls to \ref append() must not overlap;
+/// the object must be kept alive, and not moved, until \ref close() resolves.
+class append_file {
+    file _file;
+    append_file_options _options;
+    size_t _alignment;
+    temporary_buffer<char> _buf;
+    // Bytes used in _buf, and the file offset it will be written at.
+    size_t _fill = 0;
+    uint64_t _buf_pos = 0;
+    uint64_t _size = 0;
+    uint64_t _allocated = 0;
+    bool _allocating = false;
+    future<> _allocation_done = make_ready_future<>();
+    semaphore _write_behind;
+    std::exception_ptr _ex;
+private:
+    temporary_buffer<char> allocate_buffer();
+    future<> write_buffer();
+    future<> wait_for_writes();
+    future<> write_tail();
+    void maybe_preallocate();
+public:
+    explicit append_file(file f, append_file_options options = {});
+    append_file(const append_file&) = delete;
+    append_file(append_file&&) = delete;
+
+    /// Appends \c len bytes at \c data, which must stay valid until the
+    /// returned future resolves.
+    future<> append(const char* data, size_t len);
+    /// Writes everything appended so far and makes it durable.
+    future<> flush();
+    /// Flushes, truncates the file to \ref size(), and closes it.
+    future<> close();
+    /// Number of bytes appended.
+    uint64_t size() const { return _size; }
+};
@@ -0,0 +1,193 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+// A bump-pointer arena for request-scoped allocations.
+//
+// A request typically allocates many small objects that all die together
+// when it completes.  Allocating them from an arena costs a pointer bump,
+// and they are freed all at once when the arena is destroyed or reset(),
+// instead of one by one.  Attach an arena to a request or fiber by keeping
+// it alive for its duration, e.g. with do_with(arena(), ...), and pass
+// arena_allocator<T> to containers that should use it.
+//
+// Memory given back to the arena (deallocate(), a container growing) is
+// only reclaimed when the whole arena is; so arenas suit bounded lifetimes,
+// not long-lived growing containers.
+//
+// An arena is not thread-safe and must be used on a single shard.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "align.hh"
+
+class arena {
+    struct chunk {
+        chunk* next;
+        size_t size;
+    };
+    // Destructors of non-trivially destructible objects created with make()
+    struct destructor {
+        destructor* next;
+        void (*destroy)(void*);
+        void* object;
+    };
+    static constexpr size_t max_chunk_size = 1 << 20;
+    chunk* _chunks = nullptr;
+    destructor* _destructors = nullptr;
+    char* _pos = nullptr;
+    char* _end = nullptr;
+    size_t _next_chunk_size;
+    size_t _initial_chunk_size;
+    size_t _allocated = 0;
+private:
+    void* allocate_slow(size_t size, size_t align) {
+        auto needed = sizeof(chunk) + size + align;
+        auto chunk_size = std::max(_next_chunk_size, needed);
+        auto c = static_cast<chunk*>(::malloc(chunk_size));
+        if (!c) {
+            throw std::bad_alloc();
+        }
+        c->next = _chunks;
+        c->size = chunk_size;
+        _chunks = c;
+        _pos = reinterpret_cast<char*>(c + 1);
+        _end = reinterpret_cast<char*>(c) + chunk_size;
+        _next_chunk_size = std::min(_next_chunk_size * 2, size_t(max_chunk_size));
+        return allocate(size, align);
+    }
+    void run_destructors() noexcept {
+        while (_destructors) {
+            auto d = _destructors;
+            _destructors = d->next;
+            d->destroy(d->object);
+        }
+    }
+    void free_chunks() noexcept {
+        while (_chunks) {
+            auto c = _chunks;
+            _chunks = c->next;
+            ::free(c);
+        }
+    }
+public:
+    explicit arena(size_t initial_chunk_size = 4096)
+            : _next_chunk_size(initial_chunk_size)
+            , _initial_chunk_size(initial_chunk_size) {}
+    arena(arena&& x) noexcept
+            : _chunks(std::exchange(x._chunks, nullptr))
+            , _destructors(std::exchange(x._destructors, nullptr))
+            , _pos(std::exchange(x._pos, nullptr))
+            , _end(std::exchange(x._end, nullptr))
+            , _next_chunk_size(x._next_chunk_size)
+            , _initial_chunk_size(x._initial_chunk_size)
+            , _allocated(std::exchange(x._allocated, 0)) {}
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    ~arena() {
+        run_destructors();
+        free_chunks();
+    }
+
+    // Returns size bytes aligned to align (a power of two).
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        auto p = align_up(_pos, align);
+        if (!_pos || size > size_t(_end - p)) {
+            return allocate_slow(size, align);
+        }
+        _pos = p + size;
+        _allocated += size;
+        return p;
+    }
+
+    // Constructs a T in the arena.  Its destructor, if it has a nontrivial
+    // one, runs when the arena is reset or destroyed, in reverse order of
+    // construction.
+    template <typename T, typename... A>
+    T* make(A&&... args) {
+        auto p = new (allocate(sizeof(T), alignof(T))) T(std::forward<A>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            auto d = static_cast<destructor*>(allocate(sizeof(destructor), alignof(destructor)));
+            d->next = _destructors;
+            d->destroy = [] (void* obj) { static_cast<T*>(obj)->~T(); };
+            d->object = p;
+            _destructors = d;
+        }
+        return p;
+    }
+
+    // Destroys everything made in the arena and frees its memory, except
+    // for one chunk which is kept for reuse.
+    void reset() noexcept {
+        run_destructors();
+        if (_chunks) {
+            // Keep the newest, largest chunk.
+            auto keep = _chunks;
+            _chunks = keep->next;
+            free_chunks();
+            keep->next = nullptr;
+            _chunks = keep;
+            _pos = reinterpret_cast<char*>(keep + 1);
+            _end = reinterpret_cast<char*>(keep) + keep->size;
+        }
+        _next_chunk_size = _initial_chunk_size;
+        _allocated = 0;
+    }
+
+    // Bytes handed out since construction or the last reset().
+    size_t allocated_bytes() const { return _allocated; }
+};
+
+// A standard allocator that allocates from an arena, and never frees.
+template <typename T>
+class arena_allocator {
+    arena* _arena;
+    template <typename U>
+    friend class arena_allocator;
+public:
+    using value_type = T;
+    explicit arena_allocator(arena& a) noexcept : _arena(&a) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& x) noexcept : _arena(x._arena) {}
+    T* allocate(size_t n) {
+        return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) noexcept {}
+    // circular_buffer constructs and destroys through its allocator.
+    template <typename U, typename... A>
+    void construct(U* p, A&&... args) {
+        new (p) U(std::forward<A>(args)...);
+    }
+    template <typename U>
+    void destroy(U* p) {
+        p->~U();
+    }
+    template <typename U>
+    bool operator==(const arena_allocator<U>& x) const { return _arena == x._arena; }
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& x) const { return _arena != x._arena; }
+};
@@ -0,0 +1,352 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "cached-file.hh"
+#include "metrics.hh"
+#include "align.hh"
+#include <string.h>
+
+class cached_file_impl : public file_impl {
+    using entry = block_cache::entry;
+    // Reads larger than this bypass the cache, so that scans do not
+    // evict the hot blocks.
+    static constexpr size_t max_cached_read = 128 * 1024;
+    file _file;
+    std::unordered_map<uint64_t, std::unique_ptr<entry>> _blocks;
+    // Bumped by every operation that changes the file's contents, so that
+    // a read that raced with one does not populate the cache.
+    uint64_t _generation = 0;
+private:
+    file_impl& underlying() { return *get_file_impl(_file); }
+    void invalidate(uint64_t pos, uint64_t len);
+    void invalidate_all();
+    size_t copy_cached(uint64_t pos, char* buffer, size_t len, bool& complete);
+public:
+    explicit cached_file_impl(file f);
+    ~cached_file_impl() override;
+    future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len, const io_priority_class& pc) override;
+    future<size_t> write_dma(uint64_t pos, std::vector<iovec> iov, const io_priority_class& pc) override;
+    future<size_t> read_dma(uint64_t pos, void* buffer, size_t len, const io_priority_class& pc) override;
+    future<size_t> read_dma(uint64_t pos, std::vector<iovec> iov, const io_priority_class& pc) override;
+    future<> flush() override;
+    future<struct stat> stat() override;
+    future<> truncate(uint64_t length) override;
+    future<> discard(uint64_t offset, uint64_t length) override;
+    future<> allocate(uint64_t position, uint64_t length) override;
+    future<uint64_t> size() override;
+    future<> close() override;
+    subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) override;
+    subscription<directory_entry_stat> list_directory_stat(std::function<future<> (directory_entry_stat de)> next) override;
+
+    friend class block_cache;
+};
+
+block_cache::block_cache()
+        : _capacity(memory::stats().total_memory() / 16)
+        , _reclaimer([this] { return reclaim(); }, memory::reclaimer_scope::async, 0) {
+    namespace sm = seastar::metrics;
+    _metrics.add_group("block_cache", {
+        sm::make_derive("hits", _hits,
+                sm::description("Counts reads of cached files served entirely from memory")),
+        sm::make_derive("misses", _misses,
+                sm::description("Counts reads of cached files that had to go to disk")),
+        sm::make_derive("evictions", _evictions,
+                sm::description("Counts blocks evicted to make room or to free memory")),
+        sm::make_gauge("bytes", [this] { return _used; },
+                sm::description("Bytes of file data held by the cache")),
+        sm::make_derive("reclaims", [this] { return _reclaimer.successes(); },
+                sm::description("Counts the times the cache gave memory back to the allocator")),
+    });
+}
+
+block_cache::~block_cache() {
+    // Files outliving the shard's cache drop their entries themselves.
+    _lru.clear();
+}
+
+block_cache& block_cache::local() {
+    static thread_local block_cache cache;
+    return cache;
+}
+
+void block_cache::set_capacity(size_t bytes) {
+    _capacity = bytes;
+    shrink(_capacity);
+}
+
+block_cache::entry* block_cache::find(cached_file_impl& owner, uint64_t block) {
+    auto i = owner._blocks.find(block);
+    if (i == owner._blocks.end()) {
+        return nullptr;
+    }
+    auto& e = *i->second;
+    _lru.erase(_lru.iterator_to(e));
+    _lru.push_back(e);
+    return &e;
+}
+
+void block_cache::insert(cached_file_impl& owner, uint64_t block, temporary_buffer<char> data) {
+    auto i = owner._blocks.find(block);
+    if (i != owner._blocks.end()) {
+        erase(*i->second);
+    }
+    auto e = std::make_unique<entry>();
+    e->_owner = &owner;
+    e->_block = block;
+    e->_data = std::move(data);
+    _used += e->_data.size();
+    _lru.push_back(*e);
+    owner._blocks.emplace(block, std::move(e));
+    shrink(_capacity);
+}
+
+void block_cache::erase(entry& e) {
+    _lru.erase(_lru.iterator_to(e));
+    _used -= e._data.size();
+    e._owner->_blocks.erase(e._block);
+}
+
+void block_cache::evict_one() {
+    ++_evictions;
+    erase(_lru.front());
+}
+
+void block_cache::shrink(size_t target) {
+    while (_used > target && !_lru.empty()) {
+        evict_one();
+    }
+}
+
+memory::reclaiming_result block_cache::reclaim() {
+    if (_lru.empty()) {
+        return memory::reclaiming_result::reclaimed_nothing;
+    }
+    // Give back an eighth of the cache, but at least one block.
+    auto target = _used - std::max(_used / 8, block_size);
+    shrink(_used > block_size ? target : 0);
+    return memory::reclaiming_result::reclaimed_something;
+}
+
+cached_file_impl::cached_file_impl(file f)
+        : _file(std::move(f)) {
+    auto& u = underlying();
+    _memory_dma_alignment = u._memory_dma_alignment;
+    _disk_read_dma_alignment = u._disk_read_dma_alignment;
+    _disk_write_dma_alignment = u._disk_write_dma_alignment;
+}
+
+cached_file_impl::~cached_file_impl() {
+    invalidate_all();
+}
+
+void cached_file_impl::invalidate(uint64_t pos, uint64_t len) {
+    ++_generation;
+    auto& cache = block_cache::local();
+    auto first = pos / block_cache::block_size;
+    auto last = (pos + len + block_cache::block_size - 1) / block_cache::block_size;
+    if (last - first > _blocks.size()) {
+        for (auto i = _blocks.begin(); i != _blocks.end(); ) {
+            auto& e = *i++->second;
+            if (e._block >= first && e._block < last) {
+                cache.erase(e);
+            }
+        }
+        return;
+    }
+    for (auto b = first; b < last; ++b) {
+        auto i = _blocks.find(b);
+        if (i != _blocks.end()) {
+            cache.erase(*i->second);
+        }
+    }
+}
+
+void cached_file_impl::invalidate_all() {
+    ++_generation;
+    auto& cache = block_cache::local();
+    while (!_blocks.empty()) {
+        cache.erase(*_blocks.begin()->second);
+    }
+}
+
+// Copies what the cache holds of [pos, pos + len) into buffer.  Sets
+// complete if the whole range (or everything up to end of file) was
+// cached.
+size_t cached_file_impl::copy_cached(uint64_t pos, char* buffer, size_t len, bool& complete) {
+    auto& cache = block_cache::local();
+    size_t copied = 0;
+    complete = true;
+    while (copied < len) {
+        auto cur = pos + copied;
+        auto e = cache.find(*this, cur / block_cache::block_size);
+        if (!e) {
+            complete = false;
+            break;
+        }
+        auto from = cur % block_cache::block_size;
+        if (from >= e->_data.size()) {
+            break;
+        }
+        auto n = std::min(len - copied, e->_data.size() - from);
+        memcpy(buffer + copied, e->_data.get() + from, n);
+        copied += n;
+        if (e->_data.size() < block_cache::block_size) {
+            break;
+        }
+    }
+    return copied;
+}
+
+future<size_t>
+cached_file_impl::read_dma(uint64_t pos, void* buffer, size_t len, const io_priority_class& pc) {
+    if (len > max_cached_read) {
+        return underlying().read_dma(pos, buffer, len, pc);
+    }
+    auto& cache = block_cache::local();
+    bool complete;
+    auto copied = copy_cached(pos, static_cast<char*>(buffer), len, complete);
+    if (complete) {
+        ++cache._hits;
+        return make_ready_future<size_t>(copied);
+    }
+    ++cache._misses;
+    // Read the whole blocks covering the request, each into its own
+    // buffer so that they can be evicted independently.
+    auto first = pos / block_cache::block_size;
+    auto last = (pos + len + block_cache::block_size - 1) / block_cache::block_size;
+    std::vector<temporary_buffer<char>> blocks;
+    std::vector<iovec> iov;
+    for (auto b = first; b < last; ++b) {
+        blocks.push_back(temporary_buffer<char>::aligned(_memory_dma_alignment, block_cache::block_size));
+        iov.push_back(iovec{blocks.back().get_write(), block_cache::block_size});
+    }
+    auto start = first * block_cache::block_size;
+    auto generation = _generation;
+    return underlying().read_dma(start, std::move(iov), pc).then(
+            [this, pos, buffer, len, first, start, generation, blocks = std::move(blocks)] (size_t r) mutable {
+        auto skip = pos - start;
+        size_t copied = 0;
+        if (r > skip) {
+            copied = std::min(len, r - skip);
+            auto dst = static_cast<char*>(buffer);
+            for (size_t done = 0; done < copied; ) {
+                auto cur = skip + done;
+                auto& b = blocks[cur / block_cache::block_size];
+                auto from = cur % block_cache::block_size;
+                auto n = std::min(copied - done, block_cache::block_size - from);
+                memcpy(dst + done, b.get() + from, n);
+                done += n;
+            }
+        }
+        if (generation == _generation) {
+            auto& cache = block_cache::local();
+            for (size_t i = 0; i < blocks.size() && i * block_cache::block_size < r; ++i) {
+                auto& b = blocks[i];
+                b.trim(std::min(block_cache::block_size, r - i * block_cache::block_size));
+                cache.insert(*this, first + i, std::move(b));
+            }
+        }
+        return copied;
+    });
+}
+
+future<size_t>
+cached_file_impl::read_dma(uint64_t pos, std::vector<iovec> iov, const io_priority_class& pc) {
+    return underlying().read_dma(pos, std::move(iov), pc);
+}
+
+future<size_t>
+cached_file_impl::write_dma(uint64_t pos, const void* buffer, size_t len, const io_priority_class& pc) {
+    invalidate(pos, len);
+    return underlying().write_dma(pos, buffer, len, pc).then_wrapped([this, pos, len] (future<size_t> f) {
+        invalidate(pos, len);
+        return std::move(f);
+    });
+}
+
+future<size_t>
+cached_file_impl::write_dma(uint64_t pos, std::vector<iovec> iov, const io_priority_class& pc) {
+    size_t len = 0;
+    for (auto&& v : iov) {
+        len += v.iov_len;
+    }
+    invalidate(pos, len);
+    return underlying().write_dma(pos, std::move(iov), pc).then_wrapped([this, pos, len] (future<size_t> f) {
+        invalidate(pos, len);
+        return std::move(f);
+    });
+}
+
+future<>
+cached_file_impl::flush() {
+    return underlying().flush();
+}
+
+future<struct stat>
+cached_file_impl::stat() {
+    return underlying().stat();
+}
+
+future<>
+cached_file_impl::truncate(uint64_t length) {
+    invalidate_all();
+    return underlying().truncate(length).finally([this] {
+        invalidate_all();
+    });
+}
+
+future<>
+cached_file_impl::discard(uint64_t offset, uint64_t length) {
+    invalidate(offset, length);
+    return underlying().discard(offset, length).finally([this, offset, length] {
+        invalidate(offset, length);
+    });
+}
+
+future<>
+cached_file_impl::allocate(uint64_t position, uint64_t length) {
+    return underlying().allocate(position, length);
+}
+
+future<uint64_t>
+cached_file_impl::size() {
+    return underlying().size();
+}
+
+future<>
+cached_file_impl::close() {
+    invalidate_all();
+    return underlying().close();
+}
+
+subscription<directory_entry>
+cached_file_impl::list_directory(std::function<future<> (directory_entry de)> next) {
+    return underlying().list_directory(std::move(next));
+}
+
+subscription<directory_entry_stat>
+cached_file_impl::list_directory_stat(std::function<future<> (directory_entry_stat de)> next) {
+    return underlying().list_directory_stat(std::move(next));
+}
+
+file make_cached_file(file f) {
+    return file(make_shared<cached_file_impl>(std::move(f)));
+}
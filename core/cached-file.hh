@@ -0,0 +1,99 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+///
+/// A per-shard block cache for DMA files.
+///
+/// \ref file objects are uncached: every \ref file::dma_read() goes to the
+/// device.  \ref make_cached_file() wraps a file so that reads are served
+/// from a shard-local cache of 4k blocks when possible.  The cache is
+/// write-through; writes, truncates and discards invalidate the blocks they
+/// touch.  Blocks are evicted in LRU order when the cache exceeds its
+/// capacity, and also when the memory allocator asks for memory back.
+///
+/// The cache is shared-nothing: each shard caches only the reads it issued
+/// itself, so the same file should not be written from one shard while it
+/// is read through a cache on another.
+
+#include "file.hh"
+#include "memory.hh"
+#include "metrics_registration.hh"
+#include <boost/intrusive/list.hpp>
+#include <unordered_map>
+
+class cached_file_impl;
+
+/// The shard-local cache shared by all files created with
+/// \ref make_cached_file().
+class block_cache {
+public:
+    static constexpr size_t block_size = 4096;
+private:
+    struct entry {
+        boost::intrusive::list_member_hook<> _lru_link;
+        cached_file_impl* _owner;
+        uint64_t _block;
+        // Shorter than block_size for the block containing the end of file.
+        temporary_buffer<char> _data;
+    };
+    using lru_list = boost::intrusive::list<entry,
+            boost::intrusive::member_hook<entry, boost::intrusive::list_member_hook<>, &entry::_lru_link>>;
+    lru_list _lru;
+    size_t _capacity;
+    size_t _used = 0;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _evictions = 0;
+    memory::reclaimer _reclaimer;
+    seastar::metrics::metric_groups _metrics;
+private:
+    block_cache();
+    entry* find(cached_file_impl& owner, uint64_t block);
+    void insert(cached_file_impl& owner, uint64_t block, temporary_buffer<char> data);
+    void erase(entry& e);
+    void evict_one();
+    void shrink(size_t target);
+    memory::reclaiming_result reclaim();
+public:
+    block_cache(const block_cache&) = delete;
+    ~block_cache();
+    /// The cache of the current shard.
+    static block_cache& local();
+    /// Sets the number of bytes the cache may hold; defaults to 1/16th of
+    /// the shard's memory.
+    void set_capacity(size_t bytes);
+    size_t capacity() const { return _capacity; }
+    size_t used_bytes() const { return _used; }
+    uint64_t hits() const { return _hits; }
+    uint64_t misses() const { return _misses; }
+    uint64_t evictions() const { return _evictions; }
+
+    friend class cached_file_impl;
+};
+
+/// Returns a file that reads \c f through the shard's \ref block_cache.
+///
+/// Only reads into a single buffer are cached; vectored reads go straight
+/// to \c f.
+file make_cached_file(file f);
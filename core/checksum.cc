@@ -0,0 +1,241 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "checksum.hh"
+#include "net/packet.hh"
+#include <array>
+#include <string.h>
+#ifdef __x86_64__
+#include <smmintrin.h>
+#endif
+
+namespace seastar {
+
+namespace {
+
+// Reflected CRC32C polynomial.
+constexpr uint32_t crc32c_poly = 0x82f63b78;
+
+struct crc32c_table {
+    std::array<uint32_t, 256> t;
+    crc32c_table() {
+        for (unsigned i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (unsigned k = 0; k < 8; ++k) {
+                c = (c >> 1) ^ (-(c & 1) & crc32c_poly);
+            }
+            t[i] = c;
+        }
+    }
+};
+
+uint32_t crc32c_sw(uint32_t crc, const char* data, size_t len) {
+    static const crc32c_table table;
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    while (len--) {
+        crc = table.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef __x86_64__
+
+[[gnu::target("sse4.2")]]
+uint32_t crc32c_hw(uint32_t crc, const char* data, size_t len) {
+    uint64_t c = crc;
+    while (len && (reinterpret_cast<uintptr_t>(data) & 7)) {
+        c = _mm_crc32_u8(c, *data++);
+        --len;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        c = _mm_crc32_u64(c, v);
+        data += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = _mm_crc32_u8(c, *data++);
+    }
+    return c;
+}
+
+bool have_sse42() {
+    static const bool have = __builtin_cpu_supports("sse4.2");
+    return have;
+}
+
+#endif
+
+}
+
+uint32_t crc32c(uint32_t crc, const char* data, size_t len) {
+    crc = ~crc;
+#ifdef __x86_64__
+    if (have_sse42()) {
+        return ~crc32c_hw(crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
+
+void crc32c_checksummer::process(const net::packet& p) {
+    for (auto&& f : p.fragments()) {
+        process(f.base, f.size);
+    }
+}
+
+namespace {
+
+constexpr uint64_t xxh_p1 = 11400714785074694791ULL;
+constexpr uint64_t xxh_p2 = 14029467366897019727ULL;
+constexpr uint64_t xxh_p3 = 1609587929392839161ULL;
+constexpr uint64_t xxh_p4 = 9650029242287828579ULL;
+constexpr uint64_t xxh_p5 = 2870177450012600261ULL;
+
+inline uint64_t rotl(uint64_t x, unsigned r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint32_t read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * xxh_p2;
+    acc = rotl(acc, 31);
+    return acc * xxh_p1;
+}
+
+inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * xxh_p1 + xxh_p4;
+}
+
+// Consumes whole 32-byte stripes; returns the number of bytes consumed.
+size_t xxh_stripes(uint64_t* v, const char* p, size_t len) {
+    auto start = p;
+    auto end = p + (len & ~size_t(31));
+    while (p < end) {
+        v[0] = xxh_round(v[0], read64(p));
+        v[1] = xxh_round(v[1], read64(p + 8));
+        v[2] = xxh_round(v[2], read64(p + 16));
+        v[3] = xxh_round(v[3], read64(p + 24));
+        p += 32;
+    }
+    return p - start;
+}
+
+uint64_t xxh_finish(uint64_t h, const char* p, size_t len) {
+    while (len >= 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl(h, 27) * xxh_p1 + xxh_p4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= uint64_t(read32(p)) * xxh_p1;
+        h = rotl(h, 23) * xxh_p2 + xxh_p3;
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        h ^= uint8_t(*p++) * xxh_p5;
+        h = rotl(h, 11) * xxh_p1;
+    }
+    h ^= h >> 33;
+    h *= xxh_p2;
+    h ^= h >> 29;
+    h *= xxh_p3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh_converge(const uint64_t* v) {
+    uint64_t h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+    for (unsigned i = 0; i < 4; ++i) {
+        h = xxh_merge_round(h, v[i]);
+    }
+    return h;
+}
+
+}
+
+xxhash64_checksummer::xxhash64_checksummer(uint64_t seed)
+        : _v{seed + xxh_p1 + xxh_p2, seed + xxh_p2, seed, seed - xxh_p1}
+        , _seed(seed) {
+}
+
+void xxhash64_checksummer::process(const char* data, size_t len) {
+    _total_len += len;
+    if (_mem_size + len < 32) {
+        memcpy(_mem + _mem_size, data, len);
+        _mem_size += len;
+        return;
+    }
+    if (_mem_size) {
+        auto n = 32 - _mem_size;
+        memcpy(_mem + _mem_size, data, n);
+        xxh_stripes(_v, _mem, 32);
+        data += n;
+        len -= n;
+        _mem_size = 0;
+    }
+    auto done = xxh_stripes(_v, data, len);
+    memcpy(_mem, data + done, len - done);
+    _mem_size = len - done;
+}
+
+void xxhash64_checksummer::process(const net::packet& p) {
+    for (auto&& f : p.fragments()) {
+        process(f.base, f.size);
+    }
+}
+
+uint64_t xxhash64_checksummer::get() const {
+    uint64_t h = _total_len >= 32 ? xxh_converge(_v) : _seed + xxh_p5;
+    h += _total_len;
+    return xxh_finish(h, _mem, _mem_size);
+}
+
+uint64_t xxhash64(const char* data, size_t len, uint64_t seed) {
+    uint64_t h;
+    size_t done = 0;
+    if (len >= 32) {
+        uint64_t v[4] = { seed + xxh_p1 + xxh_p2, seed + xxh_p2, seed, seed - xxh_p1 };
+        done = xxh_stripes(v, data, len);
+        h = xxh_converge(v);
+    } else {
+        h = seed + xxh_p5;
+    }
+    h += len;
+    return xxh_finish(h, data + done, len - done);
+}
+
+}
@@ -0,0 +1,82 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+///
+/// Checksums and hashes for data integrity checks.
+
+#include "temporary_buffer.hh"
+#include <cstdint>
+#include <cstddef>
+
+namespace net {
+class packet;
+}
+
+namespace seastar {
+
+/// Extends the CRC32C (Castagnoli) checksum \c crc with \c len bytes at
+/// \c data; start with a \c crc of 0.
+///
+/// Uses the SSE4.2 crc32 instruction when the processor has it, and a
+/// table otherwise.
+uint32_t crc32c(uint32_t crc, const char* data, size_t len);
+
+/// Computes the 64-bit xxHash (XXH64) of \c len bytes at \c data.
+uint64_t xxhash64(const char* data, size_t len, uint64_t seed = 0);
+
+/// Computes the CRC32C of a sequence of fragments.
+class crc32c_checksummer {
+    uint32_t _crc = 0;
+public:
+    void process(const char* data, size_t len) {
+        _crc = crc32c(_crc, data, len);
+    }
+    void process(const temporary_buffer<char>& buf) {
+        process(buf.get(), buf.size());
+    }
+    void process(const net::packet& p);
+    /// The checksum of everything processed so far.
+    uint32_t get() const { return _crc; }
+};
+
+/// Computes the XXH64 hash of a sequence of fragments; gives the same
+/// result as \ref xxhash64() over their concatenation.
+class xxhash64_checksummer {
+    uint64_t _v[4];
+    uint64_t _seed;
+    uint64_t _total_len = 0;
+    char _mem[32];
+    unsigned _mem_size = 0;
+public:
+    explicit xxhash64_checksummer(uint64_t seed = 0);
+    void process(const char* data, size_t len);
+    void process(const temporary_buffer<char>& buf) {
+        process(buf.get(), buf.size());
+    }
+    void process(const net::packet& p);
+    /// The hash of everything processed so far.
+    uint64_t get() const;
+};
+
+}
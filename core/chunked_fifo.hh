@@ -138,6 +138,10 @@ class chunked_fifo {
     inline bool empty() const noexcept;
     inline size_t size() const noexcept;
     void clear() noexcept;
+    // Calls func on the items, front to back, until it returns false.
+    // func must not push or pop.
+    template <typename Func>
+    void for_each_while(Func&& func);
     // reserve(n) ensures that at least (n - size()) further push() calls can
     // be served without needing new memory allocation.
     // Calling pop()s between these push()es is also allowed and does not
@@ -210,6 +214,21 @@ chunked_fifo<T, items_per_chunk>::size() const noexcept{
     }
 }
 
+template <typename T, size_t items_per_chunk>
+template <typename Func>
+void chunked_fifo<T, items_per_chunk>::for_each_while(Func&& func) {
+    for (auto c = _front_chunk; c; c = c->next) {
+        for (auto i = c->begin; i != c->end; ++i) {
+            if (!func(c->items[mask(i)].data)) {
+                return;
+            }
+        }
+        if (c == _back_chunk) {
+            return;
+        }
+    }
+}
+
 template <typename T, size_t items_per_chunk>
 void chunked_fifo<T, items_per_chunk>::clear() noexcept {
 #if 1
@@ -45,6 +45,8 @@ class circular_buffer {
         size_t begin = 0;
         size_t end = 0;
         size_t capacity = 0;
+        impl() = default;
+        explicit impl(Alloc a) : Alloc(std::move(a)) {}
     };
     impl _impl;
 public:
@@ -56,6 +58,7 @@ class circular_buffer {
     using const_pointer = const T*;
 public:
     circular_buffer() = default;
+    explicit circular_buffer(Alloc alloc) : _impl(std::move(alloc)) {}
     circular_buffer(circular_buffer&& X);
     circular_buffer(const circular_buffer& X) = delete;
     ~circular_buffer();
@@ -226,7 +229,10 @@ template <typename T, typename Alloc>
 inline
 circular_buffer<T, Alloc>::circular_buffer(circular_buffer&& x)
     : _impl(std::move(x._impl)) {
-    x._impl = {};
+    x._impl.storage = nullptr;
+    x._impl.begin = 0;
+    x._impl.end = 0;
+    x._impl.capacity = 0;
 }
 
 template <typename T, typename Alloc>
@@ -0,0 +1,168 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+///
+/// Coroutine support: a function returning \c future<> or \c future<T>
+/// may be written as a coroutine, and may \c co_await any future.
+///
+/// \code
+///   future<int> read_and_sum(input_stream<char>& in) {
+///       int sum = 0;
+///       while (true) {
+///           auto buf = co_await in.read();
+///           if (!buf) {
+///               co_return sum;
+///           }
+///           sum += buf.size();
+///       }
+///   }
+/// \endcode
+///
+/// The coroutine frame itself serves as the reactor task that resumes the
+/// coroutine, so suspending on an unavailable future does not allocate.
+///
+/// Requires a compiler with coroutine support; configure with
+/// --enable-coroutines.
+
+#include "future.hh"
+
+#ifndef SEASTAR_COROUTINES_ENABLED
+#error Coroutines support disabled; configure with --enable-coroutines
+#endif
+
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define SEASTAR_INTERNAL_COROUTINE_NAMESPACE std
+#else
+#include <experimental/coroutine>
+#define SEASTAR_INTERNAL_COROUTINE_NAMESPACE std::experimental
+#endif
+
+namespace seastar {
+namespace internal {
+
+namespace coro = SEASTAR_INTERNAL_COROUTINE_NAMESPACE;
+
+template <typename Promise, typename... T>
+class coroutine_promise_base : public task {
+protected:
+    promise<T...> _promise;
+public:
+    coroutine_promise_base() = default;
+    coroutine_promise_base(coroutine_promise_base&&) = delete;
+    coroutine_promise_base(const coroutine_promise_base&) = delete;
+
+    future<T...> get_return_object() noexcept {
+        return _promise.get_future();
+    }
+    coro::suspend_never initial_suspend() noexcept { return {}; }
+    coro::suspend_never final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept {
+        _promise.set_exception(std::current_exception());
+    }
+
+    virtual void run() noexcept override {
+        coro::coroutine_handle<Promise>::from_promise(static_cast<Promise&>(*this)).resume();
+    }
+    // The frame is freed by the coroutine itself when it completes.
+    virtual void run_and_dispose() noexcept override {
+        run();
+    }
+    virtual void dispose() noexcept override {
+        coro::coroutine_handle<Promise>::from_promise(static_cast<Promise&>(*this)).destroy();
+    }
+};
+
+template <typename... T>
+class coroutine_promise;
+
+template <typename... T>
+class coroutine_promise final : public coroutine_promise_base<coroutine_promise<T...>, T...> {
+public:
+    template <typename... U>
+    void return_value(U&&... value) {
+        this->_promise.set_value(std::forward<U>(value)...);
+    }
+};
+
+template <>
+class coroutine_promise<> final : public coroutine_promise_base<coroutine_promise<>> {
+public:
+    void return_void() noexcept {
+        _promise.set_value();
+    }
+};
+
+template <typename... T>
+class coroutine_awaiter {
+    future<T...> _future;
+public:
+    explicit coroutine_awaiter(future<T...>&& f) noexcept : _future(std::move(f)) {}
+
+    bool await_ready() noexcept {
+        return _future.available() && !need_preempt();
+    }
+
+    template <typename U>
+    void await_suspend(coro::coroutine_handle<U> h) noexcept {
+        if (!_future.available()) {
+            _future.set_coroutine(h.promise());
+        } else {
+            ::schedule(task_ptr(&h.promise()));
+        }
+    }
+
+    auto await_resume() {
+        return resume_value(std::integral_constant<size_t, sizeof...(T)>());
+    }
+private:
+    void resume_value(std::integral_constant<size_t, 0>) {
+        _future.get();
+    }
+    auto resume_value(std::integral_constant<size_t, 1>) {
+        return _future.get0();
+    }
+    template <size_t N>
+    std::tuple<T...> resume_value(std::integral_constant<size_t, N>) {
+        return _future.get();
+    }
+};
+
+}
+}
+
+template <typename... T>
+inline
+seastar::internal::coroutine_awaiter<T...> operator co_await(future<T...> f) noexcept {
+    return seastar::internal::coroutine_awaiter<T...>(std::move(f));
+}
+
+namespace SEASTAR_INTERNAL_COROUTINE_NAMESPACE {
+
+template <typename... T, typename... Args>
+struct coroutine_traits<future<T...>, Args...> {
+    using promise_type = seastar::internal::coroutine_promise<T...>;
+};
+
+}
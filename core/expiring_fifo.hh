@@ -41,6 +41,20 @@ struct promise_expiry {
     };
 };
 
+/// How an \ref expiring_fifo times out its elements
+enum class expiry_timers {
+    /// Each element with a timeout has its own timer, armed when it is
+    /// pushed and cancelled when it is popped.
+    per_element,
+    /// The container has one timer, armed for the earliest deadline of
+    /// its elements. When it fires, all the elements due by then expire
+    /// together, and it is armed again for the next deadline. Elements
+    /// pushed with deadlines in order (such as with one timeout for all),
+    /// don't touch the timer unless the container was empty; if their
+    /// deadlines are out of order, each expiry scans the whole container.
+    shared,
+};
+
 /// Container for elements with support for expiration of entries.
 ///
 /// OnExpiry is a functor which will be called with a reference to T right before it expires.
@@ -49,18 +63,19 @@ struct promise_expiry {
 ///
 /// The container can only be moved before any elements are pushed.
 ///
-template <typename T, typename OnExpiry = dummy_expiry<T>, typename Clock = lowres_clock>
+template <typename T, typename OnExpiry = dummy_expiry<T>, typename Clock = lowres_clock,
+          expiry_timers Timers = expiry_timers::per_element>
 class expiring_fifo {
 public:
     using clock = Clock;
     using time_point = typename Clock::time_point;
 private:
-    struct entry {
+    struct timed_entry {
         std::experimental::optional<T> payload; // disengaged means that it's expired
         timer<Clock> tr;
-        entry(T&& payload_) : payload(std::move(payload_)) {}
-        entry(const T& payload_) : payload(payload_) {}
-        entry(T payload_, expiring_fifo& ef, time_point timeout)
+        timed_entry(T&& payload_) : payload(std::move(payload_)) {}
+        timed_entry(const T& payload_) : payload(payload_) {}
+        timed_entry(T payload_, expiring_fifo& ef, time_point timeout)
                 : payload(std::move(payload_))
                 , tr([this, &ef] {
                     ef._on_expiry(*payload);
@@ -71,20 +86,80 @@ class expiring_fifo {
         {
             tr.arm(timeout);
         }
-        entry(entry&& x) = delete;
-        entry(const entry& x) = delete;
+        timed_entry(timed_entry&& x) = delete;
+        timed_entry(const timed_entry& x) = delete;
     };
+    struct deadline_entry {
+        std::experimental::optional<T> payload; // disengaged means that it's expired
+        time_point deadline = time_point::max();
+        deadline_entry(T&& payload_) : payload(std::move(payload_)) {}
+        deadline_entry(const T& payload_) : payload(payload_) {}
+        deadline_entry(T payload_, expiring_fifo& ef, time_point timeout)
+                : payload(std::move(payload_)), deadline(timeout) {
+            ef.note_deadline(timeout);
+        }
+        deadline_entry(deadline_entry&& x) = delete;
+        deadline_entry(const deadline_entry& x) = delete;
+    };
+    using entry = std::conditional_t<Timers == expiry_timers::shared, deadline_entry, timed_entry>;
 
     // There is an invariant that the front element is never expired.
     chunked_fifo<entry> _list;
     OnExpiry _on_expiry;
     size_t _size = 0;
+    // With shared timers: the timer, whether the deadlines have been
+    // pushed in order since the container was last empty, and the latest
+    // of them
+    timer<Clock> _timer;
+    bool _deadlines_in_order = true;
+    time_point _last_deadline = time_point::min();
 
     // Ensures that front() is not expired by dropping expired elements from the front.
     void drop_expired_front() {
         while (!_list.empty() && !_list.front().payload) {
             _list.pop_front();
         }
+        if (_list.empty()) {
+            _deadlines_in_order = true;
+            _last_deadline = time_point::min();
+        }
+    }
+    void note_deadline(time_point timeout) {
+        if (timeout < _last_deadline) {
+            _deadlines_in_order = false;
+        } else {
+            _last_deadline = timeout;
+        }
+        if (!_timer.armed()) {
+            _timer.set_callback([this] { expire(); });
+            _timer.arm(timeout);
+        } else if (timeout < _timer.get_timeout()) {
+            _timer.rearm(timeout);
+        }
+    }
+    // The shared timer fired
+    void expire() {
+        auto now = Clock::now();
+        auto next = time_point::max();
+        _list.for_each_while([&] (entry& e) {
+            if (!e.payload || e.deadline == time_point::max()) {
+                return true;
+            }
+            if (e.deadline <= now) {
+                _on_expiry(*e.payload);
+                e.payload = std::experimental::nullopt;
+                --_size;
+                return true;
+            }
+            // With deadlines in order, this is the next one due, and
+            // nothing further back expires before it
+            next = std::min(next, e.deadline);
+            return !_deadlines_in_order;
+        });
+        drop_expired_front();
+        if (next != time_point::max()) {
+            _timer.arm(next);
+        }
     }
 public:
     expiring_fifo() = default;
@@ -160,6 +235,9 @@ class expiring_fifo {
     /// Removes the element at the front.
     /// Can be called only if !empty().
     void pop_front() {
+        // With shared timers, the timer stays armed for the popped
+        // element's deadline; when it fires, it is armed again for the
+        // next one due.
         _list.pop_front();
         --_size;
         drop_expired_front();
@@ -25,31 +25,86 @@
 #include "semaphore.hh"
 #include "shared_ptr.hh"
 #include "print.hh"
-#include "circular_buffer.hh"
+#include "small_circular_buffer.hh"
+#include "timer.hh"
+#include "manual_clock.hh"
+#include "tsc_clock.hh"
 #include <queue>
 #include <type_traits>
 #include <experimental/optional>
 #include <chrono>
 #include <unordered_set>
 #include <cmath>
+#include <algorithm>
 
 /// \addtogroup io-module
 /// @{
 
 /// \cond internal
+// The time fair queues go by: tsc_clock, which is read for every request
+// queued and dispatched, or, under simulated time (see
+// manual_clock::simulated()), the manual clock's, so that scheduling
+// decisions depend only on how the simulation advanced it.
+struct fair_queue_clock {
+    using duration = std::chrono::steady_clock::duration;
+    using time_point = std::chrono::steady_clock::time_point;
+    static time_point now() {
+        if (__builtin_expect(manual_clock::simulated(), false)) {
+            return time_point(std::chrono::duration_cast<duration>(manual_clock::now().time_since_epoch()));
+        }
+        return time_point(std::chrono::duration_cast<duration>(tsc_clock::now().time_since_epoch()));
+    }
+};
+
 class priority_class {
+    using clock_type = fair_queue_clock;
     struct request {
         promise<> pr;
-        unsigned weight;
+        float weight;
+        size_t size;
+        clock_type::time_point queued_at;
     };
     friend class fair_queue;
     uint32_t _shares = 0;
     float _accumulated = 0;
-    circular_buffer<request> _queue;
+    // Usually holds a few requests, if any
+    small_circular_buffer<request, 4> _queue;
     bool _queued = false;
+    // Bandwidth cap, as a token bucket in bytes that may go into debt by
+    // one request; 0 means no cap.
+    double _bytes_rate = 0;
+    double _tokens = 0;
+    clock_type::time_point _refilled = clock_type::now();
+    // Requests waiting longer than this are served ahead of fair order.
+    std::chrono::microseconds _latency_goal{0};
+    uint64_t _throttled = 0;
+    uint64_t _latency_goal_misses = 0;
 
     friend struct shared_ptr_no_esft<priority_class>;
     explicit priority_class(uint32_t shares) : _shares(shares) {}
+
+    bool has_tokens(clock_type::time_point now) {
+        if (!_bytes_rate) {
+            return true;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(now - _refilled).count();
+        // Never bank more than 10ms worth of bandwidth.
+        _tokens = std::min(_tokens + elapsed * _bytes_rate, _bytes_rate / 100);
+        _refilled = now;
+        return _tokens > 0;
+    }
+    clock_type::time_point refill_time() const {
+        return _refilled + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(-_tokens / _bytes_rate));
+    }
+public:
+    /// Number of times a request of this class was held back by its bandwidth cap.
+    uint64_t throttled() const {
+        return _throttled;
+    }
+    /// Number of requests dispatched later than the class' latency goal.
+    uint64_t latency_goal_misses() const {
+        return _latency_goal_misses;
+    }
 };
 /// \endcond
 
@@ -70,7 +125,9 @@ using priority_class_ptr = lw_shared_ptr<priority_class>;
 ///
 /// To each request, a weight can also be associated. A request of weight 1 will consume
 /// 1 share. Higher weights for a request will consume a proportionally higher amount of
-/// shares.
+/// shares.  Weights need not be integers: callers that can estimate how long a request
+/// keeps the device busy may pass that as the weight, so that classes are balanced by
+/// device time rather than by request count.
 ///
 /// The user of this interface is expected to register multiple \ref priority_class
 /// objects, which will each have a shares attribute.
@@ -99,6 +156,12 @@ class fair_queue {
     using prioq = std::priority_queue<priority_class_ptr, std::vector<priority_class_ptr>, class_compare>;
     prioq _handles;
     std::unordered_set<priority_class_ptr> _all_classes;
+    std::vector<priority_class_ptr> _latency_classes;
+    // Semaphore units held while every waiting class is over its bandwidth cap.
+    unsigned _deferred = 0;
+    timer<> _throttle_timer;
+    // Used instead of _throttle_timer under simulated time
+    timer<manual_clock> _simulated_throttle_timer;
 
     void push_priority_class(priority_class_ptr pc) {
         if (!pc->_queued) {
@@ -118,33 +181,119 @@ class fair_queue {
 
     void execute_one() {
         _sem.wait().then([this] {
-            priority_class_ptr h;
-            do {
-                h = pop_priority_class();
-            } while (h->_queue.empty());
-
-            auto req = std::move(h->_queue.front());
-            h->_queue.pop_front();
-
-            req.pr.set_value();
-            auto delta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _base);
-            auto req_cost  = float(req.weight) / h->_shares;
-            auto cost  = expf(1.0f/_tau.count() * delta.count()) * req_cost;
-            float next_accumulated = h->_accumulated + cost;
-            while (std::isinf(next_accumulated)) {
-                normalize_stats();
-                // If we have renormalized, our time base will have changed. This should happen very infrequently
-                delta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _base);
-                cost  = expf(1.0f/_tau.count() * delta.count()) * req_cost;
-                next_accumulated = h->_accumulated + cost;
+            if (!dispatch_one()) {
+                // Every class with requests is over its bandwidth cap; keep
+                // the unit and dispatch once one of them refills.
+                ++_deferred;
+                arm_throttle_timer();
             }
-            h->_accumulated = next_accumulated;
+        });
+    }
 
-            if (!h->_queue.empty()) {
-                push_priority_class(h);
+    // Picks the class to serve next: a latency-goal class whose oldest
+    // request is late, otherwise the class with the least accumulated
+    // cost, skipping classes that are over their bandwidth cap.
+    priority_class_ptr pick_class(priority_class::clock_type::time_point now) {
+        priority_class_ptr late;
+        for (auto&& pc : _latency_classes) {
+            if (!pc->_queue.empty() && now - pc->_queue.front().queued_at >= pc->_latency_goal && pc->has_tokens(now)
+                    && (!late || pc->_queue.front().queued_at < late->_queue.front().queued_at)) {
+                late = pc;
             }
-            return make_ready_future<>();
-        });
+        }
+        if (late) {
+            return late;
+        }
+        priority_class_ptr h;
+        std::vector<priority_class_ptr> throttled;
+        while (!_handles.empty()) {
+            auto c = pop_priority_class();
+            if (c->_queue.empty()) {
+                continue;
+            }
+            if (!c->has_tokens(now)) {
+                c->_throttled++;
+                throttled.push_back(std::move(c));
+                continue;
+            }
+            h = std::move(c);
+            break;
+        }
+        for (auto&& c : throttled) {
+            push_priority_class(c);
+        }
+        return h;
+    }
+
+    void arm_throttle_timer() {
+        auto next = priority_class::clock_type::time_point::max();
+        for (auto&& pc : _all_classes) {
+            if (pc->_bytes_rate && !pc->_queue.empty()) {
+                next = std::min(next, pc->refill_time());
+            }
+        }
+        if (next == priority_class::clock_type::time_point::max()) {
+            return;
+        }
+        if (manual_clock::simulated()) {
+            auto t = manual_clock::time_point(std::chrono::duration_cast<manual_clock::duration>(next.time_since_epoch()));
+            if (!_simulated_throttle_timer.armed() || t < _simulated_throttle_timer.get_timeout()) {
+                _simulated_throttle_timer.rearm(t);
+            }
+        } else {
+            // tsc_clock may read a few microseconds off the steady clock
+            // that timers go by
+            auto t = std::chrono::steady_clock::now() + (next - fair_queue_clock::now());
+            if (!_throttle_timer.armed() || t < _throttle_timer.get_timeout()) {
+                _throttle_timer.rearm(t);
+            }
+        }
+    }
+
+    void dispatch_deferred() {
+        while (_deferred && dispatch_one()) {
+            --_deferred;
+        }
+        if (_deferred) {
+            arm_throttle_timer();
+        }
+    }
+
+    // Dispatches one request, returning false if no class may send one now.
+    bool dispatch_one() {
+        auto now = priority_class::clock_type::now();
+        priority_class_ptr h = pick_class(now);
+        if (!h) {
+            return false;
+        }
+
+        auto req = std::move(h->_queue.front());
+        h->_queue.pop_front();
+
+        if (h->_latency_goal.count() && now - req.queued_at > h->_latency_goal) {
+            h->_latency_goal_misses++;
+        }
+        if (h->_bytes_rate) {
+            h->_tokens -= req.size;
+        }
+        req.pr.set_value();
+        auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - _base);
+        auto req_cost  = req.weight / h->_shares;
+        auto cost  = expf(1.0f/_tau.count() * delta.count()) * req_cost;
+        float next_accumulated = h->_accumulated + cost;
+        while (std::isinf(next_accumulated)) {
+            normalize_stats();
+            // If we have renormalized, our time base will have changed. This should happen very infrequently
+            delta = std::chrono::duration_cast<std::chrono::microseconds>(fair_queue_clock::now() - _base);
+            cost  = expf(1.0f/_tau.count() * delta.count()) * req_cost;
+            next_accumulated = h->_accumulated + cost;
+        }
+        h->_accumulated = next_accumulated;
+
+        if (!h->_queue.empty()) {
+            push_priority_class(h);
+        }
+        return true;
     }
 
     float normalize_factor() const {
@@ -167,8 +316,10 @@ class fair_queue {
     explicit fair_queue(unsigned capacity, std::chrono::microseconds tau = std::chrono::milliseconds(100))
                                            : _sem(capacity)
                                            , _capacity(capacity)
-                                           , _base(std::chrono::steady_clock::now())
+                                           , _base(fair_queue_clock::now())
                                            , _tau(tau) {
+        _throttle_timer.set_callback([this] { dispatch_deferred(); });
+        _simulated_throttle_timer.set_callback([this] { dispatch_deferred(); });
     }
 
     /// Registers a priority class against this fair queue.
@@ -186,18 +337,60 @@ class fair_queue {
     void unregister_priority_class(priority_class_ptr pclass) {
         assert(pclass->_queue.empty());
         _all_classes.erase(pclass);
+        _latency_classes.erase(std::remove(_latency_classes.begin(), _latency_classes.end(), pclass), _latency_classes.end());
+    }
+
+    /// Limits a priority class' bandwidth, and sets its latency goal.
+    ///
+    /// \param bytes_rate the class may not dispatch more than this many
+    ///        bytes per second (as given to queue()), even if the queue is
+    ///        otherwise idle; 0 removes the cap.
+    /// \param latency_goal requests of the class that have waited longer
+    ///        than this are dispatched ahead of fair order; 0 disables it.
+    void set_limits(priority_class_ptr pc, double bytes_rate, std::chrono::microseconds latency_goal) {
+        pc->_bytes_rate = bytes_rate;
+        pc->_tokens = bytes_rate / 100;
+        pc->_refilled = priority_class::clock_type::now();
+        pc->_latency_goal = latency_goal;
+        auto i = std::find(_latency_classes.begin(), _latency_classes.end(), pc);
+        if (latency_goal.count() && i == _latency_classes.end()) {
+            _latency_classes.push_back(pc);
+        } else if (!latency_goal.count() && i != _latency_classes.end()) {
+            _latency_classes.erase(i);
+        }
+        dispatch_deferred();
+    }
+
+    /// Changes how many concurrent requests are allowed in this queue.
+    ///
+    /// When lowering the capacity, requests already executing are not
+    /// affected; new ones wait until enough of them complete.
+    void set_capacity(unsigned capacity) {
+        if (capacity > _capacity) {
+            _sem.signal(capacity - _capacity);
+        } else {
+            _sem.consume(_capacity - capacity);
+        }
+        _capacity = capacity;
     }
 
     /// \return how many waiters are currently queued for all classes.
     size_t waiters() const {
-        return _sem.waiters();
+        return _sem.waiters() + _deferred;
     }
 
     /// Executes the function \c func through this class' \ref fair_queue, with weight \c weight
     ///
     /// \return \c func's return value, if \c func returns a future, or future<T> if \c func returns a non-future of type T.
     template <typename Func>
-    futurize_t<std::result_of_t<Func()>> queue(priority_class_ptr pc, unsigned weight, Func func) {
+    futurize_t<std::result_of_t<Func()>> queue(priority_class_ptr pc, float weight, Func func) {
+        return queue(pc, weight, 0, std::move(func));
+    }
+
+    /// Like queue(priority_class_ptr, float, Func), for a request that
+    /// moves \c size bytes (counted against the class' bandwidth cap).
+    template <typename Func>
+    futurize_t<std::result_of_t<Func()>> queue(priority_class_ptr pc, float weight, size_t size, Func func) {
         // We need to return a future in this function on which the caller can wait.
         // Since we don't know which queue we will use to execute the next request - if ours or
         // someone else's, we need a separate promise at this point.
@@ -205,8 +398,12 @@ class fair_queue {
         auto fut = pr.get_future();
 
         push_priority_class(pc);
-        pc->_queue.push_back(priority_class::request{std::move(pr), weight});
+        pc->_queue.push_back(priority_class::request{std::move(pr), weight, size, priority_class::clock_type::now()});
         try {
+            // A unit held back for throttled classes can serve this one.
+            if (_deferred && dispatch_one()) {
+                --_deferred;
+            }
             execute_one();
         } catch (...) {
             pc->_queue.pop_back();
@@ -0,0 +1,110 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+// Hashing and comparison of short byte strings, such as cache keys and
+// URLs, using SSE4.2 CRC32 and SSE2 compares where the build targets them.
+//
+// fast_hash() is not the same function as std::hash, and differs between
+// builds with and without SSE4.2, so it must not be persisted or sent to
+// other processes.
+
+#include "sstring.hh"
+#include <cstring>
+#include <cstdint>
+#include <experimental/string_view>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+inline
+size_t fast_hash(const char* p, size_t n) noexcept {
+#ifdef __SSE4_2__
+    // Two independent CRC lanes, so that consecutive words don't wait for
+    // each other, and so that the result has 64 bits.
+    uint64_t h1 = n;
+    uint64_t h2 = 0x9e3779b9;
+    while (n >= 16) {
+        uint64_t a, b;
+        std::memcpy(&a, p, 8);
+        std::memcpy(&b, p + 8, 8);
+        h1 = _mm_crc32_u64(h1, a);
+        h2 = _mm_crc32_u64(h2, b);
+        p += 16;
+        n -= 16;
+    }
+    if (n >= 8) {
+        uint64_t a;
+        std::memcpy(&a, p, 8);
+        h1 = _mm_crc32_u64(h1, a);
+        p += 8;
+        n -= 8;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p, n);
+    h2 = _mm_crc32_u64(h2, tail);
+    return (h1 << 32) | h2;
+#else
+    return std::hash<std::experimental::string_view>()(std::experimental::string_view(p, n));
+#endif
+}
+
+inline
+bool fast_equal(const char* a, const char* b, size_t n) noexcept {
+#ifdef __SSE2__
+    while (n >= 16) {
+        auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+        auto y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) {
+            return false;
+        }
+        a += 16;
+        b += 16;
+        n -= 16;
+    }
+#endif
+    return std::memcmp(a, b, n) == 0;
+}
+
+// Hash and equality functors for sstrings of any inline capacity, e.g.
+// std::unordered_map<sstring, T, sstring_fast_hash, sstring_fast_equal>.
+// Keys that are usually longer than sstring's 15 inline bytes can use a
+// basic_sstring with a larger capacity (up to 127), such as
+// basic_sstring<char, uint32_t, 47>, to stay off the heap.
+struct sstring_fast_hash {
+    template <typename char_type, typename size_type, size_type max_size>
+    size_t operator()(const basic_sstring<char_type, size_type, max_size>& s) const noexcept {
+        return fast_hash(reinterpret_cast<const char*>(s.data()), s.size());
+    }
+};
+
+struct sstring_fast_equal {
+    template <typename char_type, typename size_type, size_type max_size>
+    bool operator()(const basic_sstring<char_type, size_type, max_size>& a,
+            const basic_sstring<char_type, size_type, max_size>& b) const noexcept {
+        return a.size() == b.size()
+                && fast_equal(reinterpret_cast<const char*>(a.data()), reinterpret_cast<const char*>(b.data()), a.size());
+    }
+};
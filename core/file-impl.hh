@@ -27,6 +27,10 @@
 class posix_file_impl : public file_impl {
 public:
     int _fd;
+    // The I/O device whose queue serves this file.
+    unsigned _io_device = 0;
+    // Opened with O_DSYNC, so that completed writes are already durable
+    bool _dsync = false;
     posix_file_impl(int fd, file_open_options options);
     virtual ~posix_file_impl() override;
     future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len, const io_priority_class& pc);
@@ -41,6 +45,7 @@ class posix_file_impl : public file_impl {
     future<uint64_t> size();
     virtual future<> close() noexcept override;
     virtual subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) override;
+    virtual subscription<directory_entry_stat> list_directory_stat(std::function<future<> (directory_entry_stat de)> next) override;
 private:
     void query_dma_alignment();
 };
@@ -77,6 +82,8 @@ class append_challenged_posix_file_impl : public posix_file_impl {
     unsigned _max_size_changing_ops = 0;
     unsigned _current_non_size_changing_ops = 0;
     unsigned _current_size_changing_ops = 0;
+    // Of the above, writes past the committed size
+    unsigned _current_appending_writes = 0;
     // Set when the user closes the file
     bool _done = false;
     bool _sloppy_size = false;
@@ -85,6 +92,7 @@ class append_challenged_posix_file_impl : public posix_file_impl {
 private:
     void commit_size(uint64_t size);
     bool size_changing(const op& candidate) const;
+    bool appending_write(const op& candidate) const;
     bool may_dispatch(const op& candidate) const;
     void dispatch(op& candidate);
     void optimize_queue();
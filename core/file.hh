@@ -29,6 +29,9 @@
 #include "core/future-util.hh"
 #include "core/fair_queue.hh"
 #include <experimental/optional>
+#include <boost/range/irange.hpp>
+#include <algorithm>
+#include <numeric>
 #include <system_error>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -72,6 +75,20 @@ struct directory_entry {
     std::experimental::optional<directory_entry_type> type;
 };
 
+/// A directory entry being listed, together with its metadata.
+///
+/// \see file::list_directory_stat()
+struct directory_entry_stat {
+    /// Name of the file in a directory entry.  Will never be "." or "..".  Only the last component is included.
+    sstring name;
+    /// Type of the directory entry, if known.
+    std::experimental::optional<directory_entry_type> type;
+    /// Result of lstat() on the entry; only valid if \c stat_error is 0.
+    struct stat st;
+    /// errno from lstat(), or 0.
+    int stat_error;
+};
+
 /// File open options
 ///
 /// Options used to configure an open file.
@@ -83,6 +100,23 @@ struct file_open_options {
     uint64_t sloppy_size_hint = 1 << 20; ///< Hint as to what the eventual file size will be
 };
 
+/// How the filesystem holding a file behaves under appending writes, as
+/// qualified by iotune and passed in with --fs-properties.
+struct filesystem_properties {
+    /// Appending writes that may be in flight at once without blocking in
+    /// io_submit(); 0 if even one blocks, unless the file is extended first
+    unsigned append_concurrency = 0;
+    /// Whether writes into space allocated ahead (fallocate()) are much
+    /// cheaper than writes that also allocate it
+    bool preallocation_helps = true;
+    /// Whether O_DSYNC writes neither block io_submit() nor cost more than
+    /// a write followed by fdatasync(), so that files opened with
+    /// open_flags::dsync make a good log
+    bool dsync_writes = false;
+    /// Whether iotune measured the above; otherwise they are guesses
+    bool qualified = false;
+};
+
 /// \cond internal
 class io_queue;
 class io_priority_class {
@@ -105,6 +139,10 @@ class file_impl {
     unsigned _memory_dma_alignment = 4096;
     unsigned _disk_read_dma_alignment = 4096;
     unsigned _disk_write_dma_alignment = 4096;
+    unsigned _disk_logical_block_size = 4096;
+    unsigned _disk_physical_block_size = 4096;
+    uint64_t _disk_max_io_size = 128 * 1024;
+    filesystem_properties _fs_properties;
 public:
     virtual ~file_impl() {}
 
@@ -120,6 +158,7 @@ class file_impl {
     virtual future<uint64_t> size(void) = 0;
     virtual future<> close() = 0;
     virtual subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) = 0;
+    virtual subscription<directory_entry_stat> list_directory_stat(std::function<future<> (directory_entry_stat de)> next) = 0;
 
     friend class reactor;
 };
@@ -177,12 +216,9 @@ class file {
     file& operator=(file&& x) noexcept = default;
 
     // O_DIRECT reading requires that buffer, offset, and read length, are
-    // all aligned. Alignment of 4096 was necessary in the past, but no longer
-    // is - 512 is usually enough; But we'll need to use BLKSSZGET ioctl to
-    // be sure it is really enough on this filesystem. 4096 is always safe.
-    // In addition, if we start reading in things outside page boundaries,
-    // we will end up with various pages around, some of them with
-    // overlapping ranges. Those would be very challenging to cache.
+    // all aligned. The alignments are found when the file is opened, from
+    // the filesystem and the device under it; where neither says, 4096 is
+    // assumed, which is always safe.
 
     /// Alignment requirement for file offsets (for reads)
     uint64_t disk_read_dma_alignment() const {
@@ -199,6 +235,28 @@ class file {
         return _file_impl->_memory_dma_alignment;
     }
 
+    /// Smallest unit the device under the file can be accessed in
+    uint64_t disk_logical_block_size() const {
+        return _file_impl->_disk_logical_block_size;
+    }
+
+    /// Unit the device under the file writes in; smaller writes make it
+    /// read, modify and write back a whole block
+    uint64_t disk_physical_block_size() const {
+        return _file_impl->_disk_physical_block_size;
+    }
+
+    /// Largest request the device under the file takes; the kernel splits
+    /// larger ones
+    uint64_t disk_max_io_size() const {
+        return _file_impl->_disk_max_io_size;
+    }
+
+    /// How the filesystem holding the file handles appends and syncs
+    const filesystem_properties& fs_properties() const {
+        return _file_impl->_fs_properties;
+    }
+
 
     /**
      * Perform a single DMA read operation.
@@ -354,6 +412,11 @@ class file {
     ///
     /// The discard operation tells the file system that a range of offsets
     /// (which be aligned) is no longer needed and can be reused.
+    ///
+    /// Discards are queued per I/O device and issued in the background, a
+    /// chunk at a time in the "discard" I/O priority class, at most at the
+    /// rate given by --discard-rate; the future resolves once the whole
+    /// range has been discarded.
     future<> discard(uint64_t offset, uint64_t length) {
         return _file_impl->discard(offset, length);
     }
@@ -380,6 +443,16 @@ class file {
         return _file_impl->list_directory(std::move(next));
     }
 
+    /// Returns a directory listing with each entry's metadata, given that
+    /// this file object is a directory.
+    ///
+    /// Entries are read with large getdents64() calls and stat'ed in the
+    /// same trip to the syscall thread, so listing a large directory takes
+    /// a few round trips rather than one per entry.
+    subscription<directory_entry_stat> list_directory_stat(std::function<future<> (directory_entry_stat de)> next) {
+        return _file_impl->list_directory_stat(std::move(next));
+    }
+
     /**
      * Read a data bulk containing the provided addresses range that starts at
      * the given offset and ends at either the address aligned to
@@ -397,6 +470,34 @@ class file {
     future<temporary_buffer<CharType>>
     dma_read_bulk(uint64_t offset, size_t range_size, const io_priority_class& pc = default_priority_class());
 
+    /// A byte range of a file, for \ref dma_read_bulk_ranges().
+    struct read_range {
+        uint64_t offset;
+        size_t size;
+    };
+
+    /// Reads several ranges of the file at once.
+    ///
+    /// Ranges whose aligned extents touch or overlap are merged into a single
+    /// read (up to \c max_merged_read bytes, or \ref disk_max_io_size() if
+    /// smaller), and all reads are queued
+    /// together, so that they reach the disk in one io_submit() batch rather
+    /// than one at a time.  Ranges need not be aligned nor sorted.
+    ///
+    /// @param ranges the ranges to read
+    /// @param pc the IO priority class under which to queue the reads
+    ///
+    /// @return a buffer for each range, in the order of \c ranges.  As with
+    ///         \ref dma_read(), a buffer is shorter than its range if the
+    ///         range extends beyond EOF.
+    /// @throw system_error exception in case of I/O error
+    template <typename CharType>
+    future<std::vector<temporary_buffer<CharType>>>
+    dma_read_bulk_ranges(std::vector<read_range> ranges, const io_priority_class& pc = default_priority_class());
+
+    /// Largest read dma_read_bulk_ranges() creates by merging ranges.
+    static constexpr size_t max_merged_read = 128 * 1024;
+
 private:
     template <typename CharType>
     struct read_state;
@@ -557,6 +658,63 @@ file::dma_read_bulk(uint64_t offset, size_t range_size, const io_priority_class&
     });
 }
 
+template <typename CharType>
+future<std::vector<temporary_buffer<CharType>>>
+file::dma_read_bulk_ranges(std::vector<read_range> ranges, const io_priority_class& pc) {
+    struct extent {
+        uint64_t offset;
+        uint64_t end;
+        temporary_buffer<CharType> buf;
+    };
+    struct state {
+        std::vector<read_range> ranges;
+        std::vector<unsigned> order;
+        std::vector<unsigned> extent_of;
+        std::vector<extent> extents;
+    };
+    auto st = make_lw_shared<state>();
+    st->ranges = std::move(ranges);
+    auto align = disk_read_dma_alignment();
+    auto max_read = std::min<uint64_t>(max_merged_read, disk_max_io_size());
+    auto& rs = st->ranges;
+
+    st->order.resize(rs.size());
+    std::iota(st->order.begin(), st->order.end(), 0);
+    std::sort(st->order.begin(), st->order.end(), [&rs] (unsigned a, unsigned b) {
+        return rs[a].offset < rs[b].offset;
+    });
+    st->extent_of.resize(rs.size());
+    for (auto i : st->order) {
+        auto begin = align_down<uint64_t>(rs[i].offset, align);
+        auto end = align_up<uint64_t>(rs[i].offset + rs[i].size, align);
+        auto& exts = st->extents;
+        if (!exts.empty() && begin <= exts.back().end && std::max(end, exts.back().end) - exts.back().offset <= max_read) {
+            exts.back().end = std::max(end, exts.back().end);
+        } else {
+            exts.push_back(extent{begin, end, {}});
+        }
+        st->extent_of[i] = exts.size() - 1;
+    }
+
+    return parallel_for_each(boost::irange<size_t>(0, st->extents.size()), [this, st, &pc] (size_t e) {
+        auto& ext = st->extents[e];
+        return dma_read_bulk<CharType>(ext.offset, ext.end - ext.offset, pc).then([st, e] (temporary_buffer<CharType> buf) {
+            st->extents[e].buf = std::move(buf);
+        });
+    }).then([st] {
+        std::vector<temporary_buffer<CharType>> result;
+        result.reserve(st->ranges.size());
+        for (unsigned i = 0; i < st->ranges.size(); ++i) {
+            auto& r = st->ranges[i];
+            auto& ext = st->extents[st->extent_of[i]];
+            auto start = std::min<uint64_t>(r.offset - ext.offset, ext.buf.size());
+            auto len = std::min<uint64_t>(r.size, ext.buf.size() - start);
+            result.push_back(ext.buf.share(start, len));
+        }
+        return result;
+    });
+}
+
 template <typename CharType>
 future<temporary_buffer<CharType>>
 file::read_maybe_eof(uint64_t pos, size_t len, const io_priority_class& pc) {
@@ -0,0 +1,165 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include <experimental/string_view>
+#include "core/temporary_buffer.hh"
+#include "core/scattered_message.hh"
+#include "core/sstring.hh"
+#include "core/print.hh"
+#include "net/packet.hh"
+
+/// \brief A growable output buffer made of fixed-size chunks.
+///
+/// Building a large response by appending to an \c sstring reallocates and
+/// copies it as it grows; appending to a fragmented_ostream copies each byte
+/// once, into the last chunk, and starts a new chunk when it is full. The
+/// result is handed to the network as a \ref net::packet or
+/// \ref scattered_message whose fragments are the chunks themselves.
+///
+/// It has the \c write(const char*, size_t) of the \ref simple-stream.hh
+/// output streams, so the serializers written against those can write
+/// into it directly.
+class fragmented_ostream {
+public:
+    static constexpr size_t default_chunk_size = 16 * 1024;
+    using has_with_stream = std::false_type;
+private:
+    std::vector<temporary_buffer<char>> _chunks;
+    // Bytes used in the last chunk
+    size_t _pos = 0;
+    size_t _chunk_size;
+    size_t _size = 0;
+public:
+    explicit fragmented_ostream(size_t chunk_size = default_chunk_size) : _chunk_size(chunk_size) {}
+    fragmented_ostream(fragmented_ostream&&) noexcept = default;
+    fragmented_ostream& operator=(fragmented_ostream&&) noexcept = default;
+
+    void write(const char* p, size_t size) {
+        _size += size;
+        while (size) {
+            if (_chunks.empty() || _pos == _chunks.back().size()) {
+                _chunks.emplace_back(_chunk_size);
+                _pos = 0;
+            }
+            auto n = std::min(size, _chunks.back().size() - _pos);
+            std::memcpy(_chunks.back().get_write() + _pos, p, n);
+            _pos += n;
+            p += n;
+            size -= n;
+        }
+    }
+    void write(char c) {
+        write(&c, 1);
+    }
+    void write(std::experimental::string_view s) {
+        write(s.data(), s.size());
+    }
+    /// Formats with \ref sprint() into the stream
+    template <typename... Args>
+    void print(const char* fmt, Args&&... args) {
+        write(sprint(fmt, std::forward<Args>(args)...));
+    }
+
+    fragmented_ostream& operator<<(std::experimental::string_view s) {
+        write(s);
+        return *this;
+    }
+    fragmented_ostream& operator<<(const sstring& s) {
+        write(s.data(), s.size());
+        return *this;
+    }
+    fragmented_ostream& operator<<(const std::string& s) {
+        write(s.data(), s.size());
+        return *this;
+    }
+    fragmented_ostream& operator<<(const char* s) {
+        write(s, std::strlen(s));
+        return *this;
+    }
+    fragmented_ostream& operator<<(char c) {
+        write(c);
+        return *this;
+    }
+    template <typename T>
+    std::enable_if_t<std::is_arithmetic<T>::value, fragmented_ostream&>
+    operator<<(T v) {
+        auto s = to_sstring(v);
+        write(s.data(), s.size());
+        return *this;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+    bool empty() const {
+        return !_size;
+    }
+
+    /// Calls \c func with a \c std::experimental::string_view of each
+    /// fragment, in order
+    template <typename Func>
+    void for_each_fragment(Func&& func) const {
+        for (auto& c : _chunks) {
+            func(std::experimental::string_view(c.get(), &c == &_chunks.back() ? _pos : c.size()));
+        }
+    }
+
+    /// Copies the contents out into one contiguous string; for tests and
+    /// small outputs
+    sstring linearize() const {
+        sstring ret(sstring::initialized_later(), _size);
+        auto p = ret.begin();
+        for_each_fragment([&p] (std::experimental::string_view f) {
+            p = std::copy(f.begin(), f.end(), p);
+        });
+        return ret;
+    }
+
+    /// The chunks, the last one trimmed to what was written
+    std::vector<temporary_buffer<char>> release() && {
+        if (!_chunks.empty()) {
+            _chunks.back().trim(_pos);
+        }
+        _size = _pos = 0;
+        return std::move(_chunks);
+    }
+
+    /// A packet whose fragments are the chunks, which it owns; nothing is
+    /// copied
+    net::packet release_packet() && {
+        auto chunks = std::move(*this).release();
+        std::vector<net::fragment> frags;
+        frags.reserve(chunks.size());
+        for (auto& c : chunks) {
+            frags.push_back(net::fragment{c.get_write(), c.size()});
+        }
+        return net::packet(std::move(frags), make_object_deleter(std::move(chunks)));
+    }
+
+    scattered_message<char> release_scattered_message() && {
+        return scattered_message<char>(std::move(*this).release_packet());
+    }
+};
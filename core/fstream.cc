@@ -24,9 +24,87 @@
 #include "circular_buffer.hh"
 #include "semaphore.hh"
 #include "reactor.hh"
+#include "metrics.hh"
+#include "print.hh"
 #include <malloc.h>
 #include <string.h>
 
+file_access_tracker::file_access_tracker(size_t read_ahead_budget, sstring name)
+        : _budget(read_ahead_budget) {
+    if (name.empty()) {
+        return;
+    }
+    namespace sm = seastar::metrics;
+    auto instance = sprint("%s-%d", name, engine().cpu_id());
+    _metrics.add_group("file_read_ahead", {
+        sm::make_gauge("read_ahead_bytes", [this] { return _read_ahead; },
+                sm::description("Current read-ahead of streams on this file, in bytes"), true, instance),
+        sm::make_gauge("efficiency", [this] { return efficiency(); },
+                sm::description("Fraction of bytes read by streams on this file that were consumed rather than dropped"), true, instance),
+        sm::make_derive("sequential_reads", _sequential_reads,
+                sm::description("Counts reads continuing an earlier read of this file"), true, instance),
+        sm::make_derive("random_reads", _random_reads,
+                sm::description("Counts reads not continuing an earlier read of this file"), true, instance),
+        sm::make_derive("unused_bytes", _unused_read,
+                sm::description("Counts bytes read ahead from this file and then dropped"), true, instance),
+    });
+}
+
+void file_access_tracker::note_read(uint64_t pos, uint64_t len) {
+    bool seq = false;
+    for (auto& e : _expected) {
+        if (e && e == pos) {
+            e = pos + len;
+            seq = true;
+            break;
+        }
+    }
+    if (seq) {
+        ++_sequential_reads;
+    } else {
+        ++_random_reads;
+        _expected[_next_slot] = pos + len;
+        _next_slot = (_next_slot + 1) % max_streams;
+    }
+    _sequential = _sequential * 7 / 8 + (seq ? 1.0f / 8 : 0);
+    if (!sequential()) {
+        _read_ahead = 0;
+    }
+}
+
+void file_access_tracker::note_waited(size_t buffer_size) {
+    if (sequential()) {
+        _read_ahead = std::min(_budget, std::max(_read_ahead * 2, buffer_size));
+    }
+}
+
+void file_access_tracker::note_consumed(uint64_t bytes) {
+    _total_read += bytes;
+    _window_total += bytes;
+    end_window_if_full();
+}
+
+void file_access_tracker::note_unused(uint64_t bytes) {
+    if (!bytes) {
+        return;
+    }
+    _total_read += bytes;
+    _unused_read += bytes;
+    _window_total += bytes;
+    _window_unused += bytes;
+    if (_window_unused * 4 > _window_total) {
+        _read_ahead /= 2;
+    }
+    end_window_if_full();
+}
+
+void file_access_tracker::end_window_if_full() {
+    if (_window_total >= window_size) {
+        _window_total = 0;
+        _window_unused = 0;
+    }
+}
+
 class file_data_source_impl : public data_source_impl {
     struct issued_read {
         uint64_t _pos;
@@ -55,7 +133,15 @@ class file_data_source_impl : public data_source_impl {
         return std::min(std::max(_options.buffer_size / 4, size_t(8192)), _options.buffer_size);
     }
 
+    unsigned tracked_read_ahead() const {
+        return _options.access_tracker->read_ahead_bytes() / _current_buffer_size;
+    }
+
     void try_increase_read_ahead() {
+        if (_options.access_tracker) {
+            _options.access_tracker->note_waited(_current_buffer_size);
+            return;
+        }
         // Read-ahead can be increased up to user-specified limit if the
         // consumer has to wait for a buffer and we are not in a slow start
         // phase.
@@ -68,6 +154,9 @@ class file_data_source_impl : public data_source_impl {
         }
     }
     unsigned get_initial_read_ahead() const {
+        if (_options.access_tracker) {
+            return tracked_read_ahead();
+        }
         return _options.dynamic_adjustments
                ? std::min(_options.dynamic_adjustments->read_ahead, _options.read_ahead)
                : !!_options.read_ahead;
@@ -87,6 +176,9 @@ class file_data_source_impl : public data_source_impl {
         }
     }
     void update_history_consumed(uint64_t bytes) {
+        if (_options.access_tracker) {
+            _options.access_tracker->note_consumed(bytes);
+        }
         if (!_options.dynamic_adjustments) {
             return;
         }
@@ -128,6 +220,9 @@ class file_data_source_impl : public data_source_impl {
         _current_buffer_size = new_size;
     }
     void update_history_unused(uint64_t bytes) {
+        if (_options.access_tracker) {
+            _options.access_tracker->note_unused(bytes);
+        }
         if (!_options.dynamic_adjustments) {
             return;
         }
@@ -146,6 +241,9 @@ class file_data_source_impl : public data_source_impl {
         if (!_read_buffers.empty() && !_read_buffers.front()._ready.available()) {
             try_increase_read_ahead();
         }
+        if (_options.access_tracker) {
+            _current_read_ahead = tracked_read_ahead();
+        }
         issue_read_aheads(1);
         auto ret = std::move(_read_buffers.front());
         _read_buffers.pop_front();
@@ -156,6 +254,12 @@ class file_data_source_impl : public data_source_impl {
             _reactor._fstream_reads_blocked += 1;
             _reactor._fstream_read_bytes_blocked += ret._size;
         }
+        if (_options.checksum) {
+            return ret._ready.then([checksum = _options.checksum] (temporary_buffer<char> buf) {
+                checksum->process(buf);
+                return buf;
+            });
+        }
         return std::move(ret._ready);
     }
     virtual future<temporary_buffer<char>> skip(uint64_t n) override {
@@ -229,6 +333,9 @@ class file_data_source_impl : public data_source_impl {
             auto end = align_up(std::min(start + _current_buffer_size, _pos + _remain), align);
             auto len = end - start;
             auto actual_size = std::min(end - _pos, _remain);
+            if (_options.access_tracker) {
+                _options.access_tracker->note_read(_pos, end - _pos);
+            }
             _read_buffers.emplace_back(_pos, actual_size, futurize<future<temporary_buffer<char>>>::apply([&] {
                     return _file.dma_read_bulk<char>(start, len, _options.io_priority_class);
             }).then_wrapped(
@@ -287,6 +394,16 @@ input_stream<char> make_file_input_stream(
 }
 
 
+// More writes behind than the filesystem takes appends at once only queue
+// up in the file; measured by iotune, when it has qualified the filesystem.
+static file_output_stream_options fit_to_filesystem(const file& f, file_output_stream_options options) {
+    auto& fs = f.fs_properties();
+    if (fs.qualified && options.write_behind) {
+        options.write_behind = std::min(options.write_behind, std::max(fs.append_concurrency, 1u));
+    }
+    return options;
+}
+
 class file_data_sink_impl : public data_sink_impl {
     file _file;
     file_output_stream_options _options;
@@ -296,7 +413,7 @@ class file_data_sink_impl : public data_sink_impl {
     bool _failed = false;
 public:
     file_data_sink_impl(file f, file_output_stream_options options)
-            : _file(std::move(f)), _options(options) {
+            : _file(std::move(f)), _options(fit_to_filesystem(_file, options)) {
         _write_behind_sem.ensure_space_for_waiters(1); // So that wait() doesn't throw
     }
     future<> put(net::packet data) { abort(); }
@@ -304,6 +421,9 @@ class file_data_sink_impl : public data_sink_impl {
         return temporary_buffer<char>::aligned(_file.memory_dma_alignment(), size);
     }
     virtual future<> put(temporary_buffer<char> buf) override {
+        if (_options.checksum) {
+            _options.checksum->process(buf);
+        }
         uint64_t pos = _pos;
         _pos += buf.size();
         if (!_options.write_behind) {
@@ -387,6 +507,9 @@ class file_data_sink_impl : public data_sink_impl {
 public:
     virtual future<> flush() override {
         return wait().then([this] {
+            if (_options.flush_coalescer) {
+                return _options.flush_coalescer->flush();
+            }
             return _file.flush();
         });
     }
@@ -397,6 +520,67 @@ class file_data_sink_impl : public data_sink_impl {
     }
 };
 
+future<> transmit_file(file f, output_stream<char>& out, uint64_t offset, uint64_t len,
+        file_input_stream_options options) {
+    return do_with(make_file_input_stream(std::move(f), offset, len, std::move(options)),
+            [&out] (input_stream<char>& in) {
+        return repeat([&in, &out] {
+            return in.read().then([&out] (temporary_buffer<char> buf) {
+                if (buf.empty()) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return out.write(std::move(buf)).then([] {
+                    return stop_iteration::no;
+                });
+            });
+        }).finally([&in] {
+            return in.close();
+        });
+    });
+}
+
+file_flush_coalescer::file_flush_coalescer(file f, std::chrono::microseconds window)
+        : _file(std::move(f)), _window(window) {
+    _timer.set_callback([this] { start(); });
+}
+
+future<> file_flush_coalescer::flush() {
+    ++_requests;
+    if (!_next) {
+        _next.emplace();
+        if (!_in_flight) {
+            schedule();
+        }
+    }
+    return _next->get_shared_future();
+}
+
+void file_flush_coalescer::schedule() {
+    if (_window.count()) {
+        _timer.arm(_window);
+    } else {
+        start();
+    }
+}
+
+void file_flush_coalescer::start() {
+    _in_flight = true;
+    ++_syncs;
+    auto pr = std::move(*_next);
+    _next = std::experimental::nullopt;
+    _file.flush().then_wrapped([this, pr = std::move(pr)] (future<> f) mutable {
+        if (f.failed()) {
+            pr.set_exception(f.get_exception());
+        } else {
+            pr.set_value();
+        }
+        _in_flight = false;
+        if (_next) {
+            schedule();
+        }
+    });
+}
+
 class file_data_sink : public data_sink {
 public:
     file_data_sink(file f, file_output_stream_options options)
@@ -411,6 +595,9 @@ output_stream<char> make_file_output_stream(file f, size_t buffer_size) {
 }
 
 output_stream<char> make_file_output_stream(file f, file_output_stream_options options) {
+    // Whole buffers must be written aligned, and a device with large
+    // physical blocks may want more than the default
+    options.buffer_size = align_up<uint64_t>(options.buffer_size, f.disk_write_dma_alignment());
     return output_stream<char>(file_data_sink(std::move(f), options), options.buffer_size, true);
 }
 
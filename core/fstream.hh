@@ -33,6 +33,11 @@
 #include "file.hh"
 #include "iostream.hh"
 #include "shared_ptr.hh"
+#include "metrics_registration.hh"
+#include "shared_future.hh"
+#include "timer.hh"
+#include "checksum.hh"
+#include <array>
 
 class file_input_stream_history {
     static constexpr uint64_t window_size = 4 * 1024 * 1024;
@@ -47,12 +52,67 @@ class file_input_stream_history {
     friend class file_data_source_impl;
 };
 
+/// Tracks how a file is read by all the input streams opened on it, and
+/// sizes their read-ahead accordingly.
+///
+/// Reads that continue where an earlier read of some stream ended count as
+/// sequential, others as random.  While most recent reads are sequential
+/// and consumers find themselves waiting for data, read-ahead doubles, up
+/// to the byte budget given at construction.  It halves whenever more than
+/// a quarter of the data read in the last window was dropped unused, and
+/// is disabled while access is mostly random.
+///
+/// Pass the same tracker to every stream reading the file through
+/// \ref file_input_stream_options::access_tracker.
+class file_access_tracker {
+    static constexpr uint64_t window_size = 4 * 1024 * 1024;
+    // Number of concurrent sequential streams recognized.
+    static constexpr unsigned max_streams = 8;
+    size_t _budget;
+    size_t _read_ahead = 0;
+    // Exponentially decaying fraction of sequential reads.
+    float _sequential = 0;
+    std::array<uint64_t, max_streams> _expected = {};
+    unsigned _next_slot = 0;
+    uint64_t _window_total = 0;
+    uint64_t _window_unused = 0;
+    uint64_t _sequential_reads = 0;
+    uint64_t _random_reads = 0;
+    uint64_t _total_read = 0;
+    uint64_t _unused_read = 0;
+    seastar::metrics::metric_groups _metrics;
+public:
+    /// \param read_ahead_budget maximum number of bytes each stream may
+    ///        read ahead of its consumer
+    /// \param name if not empty, the tracker's counters are exported as
+    ///        metrics under this instance name
+    explicit file_access_tracker(size_t read_ahead_budget, sstring name = {});
+    /// Current read-ahead, in bytes.
+    size_t read_ahead_bytes() const { return _read_ahead; }
+    /// Whether recent reads were mostly sequential.
+    bool sequential() const { return _sequential >= 0.5; }
+    /// Fraction of the bytes read by streams that were not dropped unused.
+    float efficiency() const {
+        return _total_read ? 1 - float(_unused_read) / _total_read : 1;
+    }
+private:
+    void note_read(uint64_t pos, uint64_t len);
+    void note_waited(size_t buffer_size);
+    void note_consumed(uint64_t bytes);
+    void note_unused(uint64_t bytes);
+    void end_window_if_full();
+
+    friend class file_data_source_impl;
+};
+
 /// Data structure describing options for opening a file input stream
 struct file_input_stream_options {
     size_t buffer_size = 8192;    ///< I/O buffer size
     unsigned read_ahead = 0;      ///< Maximum number of extra read-ahead operations
     ::io_priority_class io_priority_class = default_priority_class();
     lw_shared_ptr<file_input_stream_history> dynamic_adjustments = { }; ///< Input stream history, if null dynamic adjustments are disabled
+    lw_shared_ptr<file_access_tracker> access_tracker = { }; ///< File access pattern shared by streams on the file; if set, it sizes read-ahead instead of \c read_ahead
+    lw_shared_ptr<seastar::crc32c_checksummer> checksum = { }; ///< If set, accumulates the CRC32C of the bytes the stream returns (skipped bytes excluded)
 };
 
 /// \brief Creates an input_stream to read a portion of a file.
@@ -79,11 +139,59 @@ input_stream<char> make_file_input_stream(
 input_stream<char> make_file_input_stream(
         file file, file_input_stream_options = {});
 
+/// Coalesces concurrent flushes of one file into a shared fdatasync
+/// (group commit).
+///
+/// A flush requested while no sync is running starts one after \c window
+/// has passed, and every flush requested in the meantime is resolved by
+/// it.  A flush requested while a sync is running waits for the next one,
+/// since the running sync may not cover writes that completed after it
+/// started.
+class file_flush_coalescer {
+    file _file;
+    std::chrono::microseconds _window;
+    timer<> _timer;
+    std::experimental::optional<shared_promise<>> _next;
+    bool _in_flight = false;
+    uint64_t _requests = 0;
+    uint64_t _syncs = 0;
+private:
+    void schedule();
+    void start();
+public:
+    /// \param f the file to flush
+    /// \param window how long to wait for more flush requests before
+    ///        starting a sync; zero starts one immediately
+    explicit file_flush_coalescer(file f, std::chrono::microseconds window = std::chrono::microseconds(0));
+    /// Flushes all writes to the file completed before the call.
+    future<> flush();
+    /// Number of flushes requested.
+    uint64_t requests() const { return _requests; }
+    /// Number of syncs issued to the file.
+    uint64_t syncs() const { return _syncs; }
+};
+
+/// Writes a portion of a file to an output stream without copying it.
+///
+/// The DMA buffers read from the file are handed to \c out as packet
+/// fragments, so the native stack transmits them directly and the posix
+/// stack passes them to the kernel in a single writev().
+///
+/// \param f file to read
+/// \param out stream to write to; earlier buffered writes are sent first
+/// \param offset starting offset in the file
+/// \param len number of bytes to send; stops early at end of file
+/// \param options controls the reads from \c f
+future<> transmit_file(file f, output_stream<char>& out, uint64_t offset, uint64_t len,
+        file_input_stream_options options = {});
+
 struct file_output_stream_options {
     unsigned buffer_size = 8192;
     unsigned preallocation_size = 1024*1024; // 1MB
     unsigned write_behind = 1; ///< Number of buffers to write in parallel
     ::io_priority_class io_priority_class = default_priority_class();
+    lw_shared_ptr<file_flush_coalescer> flush_coalescer = { }; ///< If set, flush() syncs the file through it, sharing syncs with other streams
+    lw_shared_ptr<seastar::crc32c_checksummer> checksum = { }; ///< If set, accumulates the CRC32C of the bytes written to the stream
 };
 
 // Create an output_stream for writing starting at the position zero of a
@@ -389,6 +389,92 @@ future<> do_for_each(Container& c, AsyncAction&& action) {
     return do_for_each(std::begin(c), std::end(c), std::forward<AsyncAction>(action));
 }
 
+/// Run tasks in parallel, a bounded number at a time (iterator version).
+///
+/// Like \ref parallel_for_each(), but with at most \c max_concurrent
+/// invocations of \c func in flight: a new one starts as soon as one
+/// completes.  Memory use stays flat over large ranges, where
+/// \ref parallel_for_each() would hold a continuation for every element
+/// at once.  Elements are taken from the range in order, as they are
+/// needed, so \c begin can be an input iterator producing them lazily.
+///
+/// \param begin an \c InputIterator designating the beginning of the range
+/// \param end an \c InputIterator designating the end of the range
+/// \param max_concurrent maximum number of invocations in flight; must be
+///                       positive
+/// \param func Function to apply to each element in the range (returning
+///             a \c future<>)
+/// \return a \c future<> that resolves when all the function invocations
+///         complete.  After an invocation fails no more are started, and
+///         the return value contains the first exception once those in
+///         flight are done.
+template <typename Iterator, typename Func>
+inline
+future<>
+max_concurrent_for_each(Iterator begin, Iterator end, size_t max_concurrent, Func&& func) {
+    assert(max_concurrent > 0);
+    struct state {
+        Iterator begin;
+        Iterator end;
+        std::decay_t<Func> func;
+        size_t running = 0;
+        std::exception_ptr ex;
+        promise<> done;
+    };
+    auto s = make_lw_shared(state{std::move(begin), std::move(end), std::forward<Func>(func)});
+    using futurator = futurize<decltype(s->func(*s->begin))>;
+    auto f = s->done.get_future();
+    // Each worker takes the next element when done with the previous one,
+    // so there are never more than max_concurrent in flight
+    s->running = max_concurrent;
+    for (size_t i = 0; i < max_concurrent; ++i) {
+        repeat([s] {
+            if (s->begin == s->end || s->ex) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return futurator::apply(s->func, *s->begin++).then_wrapped([s] (future<> f) {
+                if (f.failed()) {
+                    if (!s->ex) {
+                        s->ex = f.get_exception();
+                    } else {
+                        f.ignore_ready_future();
+                    }
+                }
+                return stop_iteration::no;
+            });
+        }).then([s] {
+            if (--s->running == 0) {
+                if (s->ex) {
+                    s->done.set_exception(std::move(s->ex));
+                } else {
+                    s->done.set_value();
+                }
+            }
+        });
+    }
+    return f;
+}
+
+/// Run tasks in parallel, a bounded number at a time (range version).
+///
+/// Given a \c range of objects, apply \c func to each object in the
+/// range, with at most \c max_concurrent invocations in flight.
+/// See the iterator version for details.
+///
+/// \param range A range of objects to iterate run \c func on
+/// \param max_concurrent maximum number of invocations in flight
+/// \param func  A callable, accepting reference to the range's
+///              \c value_type, and returning a \c future<>.
+/// \return a \c future<> that becomes ready when the entire range
+///         was processed, or holds the first failure.
+template <typename Range, typename Func>
+inline
+future<>
+max_concurrent_for_each(Range&& range, size_t max_concurrent, Func&& func) {
+    return max_concurrent_for_each(std::begin(range), std::end(range), max_concurrent,
+            std::forward<Func>(func));
+}
+
 /// \cond internal
 template<typename... Futures>
 class when_all_state : public enable_lw_shared_from_this<when_all_state<Futures...>> {
@@ -676,6 +762,61 @@ map_reduce(Range&& range, Mapper&& mapper, Initial initial, Reduce reduce) {
             std::move(initial), std::move(reduce));
 }
 
+/// Asynchronous map/reduce transformation, a bounded number at a time.
+///
+/// Like \ref map_reduce(), but with at most \c max_concurrent invocations
+/// of \c mapper in flight; each result is reduced into the accumulator as
+/// it arrives and then dropped, so neither the pending mappers nor their
+/// results grow with the range.  Results are reduced in the order they
+/// complete, so \c reduce should be associative and commutative.
+///
+/// \param begin beginning of object range to operate on
+/// \param end end of object range to operate on
+/// \param max_concurrent maximum number of \c mapper invocations in flight
+/// \param mapper map function to call on each object, returning a future
+/// \param initial initial input value to reduce function
+/// \param reduce binary function for merging two result values from \c mapper
+///
+/// \return equivalent to \c reduce(reduce(initial, mapper(obj0)), mapper(obj1)) ...
+///         or, if \c mapper or \c reduce fail, the first failure
+template <typename Iterator, typename Mapper, typename Initial, typename Reduce>
+inline
+future<Initial>
+max_concurrent_map_reduce(Iterator begin, Iterator end, size_t max_concurrent, Mapper&& mapper, Initial initial, Reduce reduce) {
+    struct state {
+        std::decay_t<Mapper> mapper;
+        Initial result;
+        Reduce reduce;
+    };
+    auto s = make_lw_shared(state{std::forward<Mapper>(mapper), std::move(initial), std::move(reduce)});
+    using futurator = futurize<decltype(mapper(*begin))>;
+    return max_concurrent_for_each(std::move(begin), std::move(end), max_concurrent, [s] (auto&& value) {
+        return futurator::apply(s->mapper, std::forward<decltype(value)>(value)).then([s] (auto&& r) {
+            s->result = s->reduce(std::move(s->result), std::move(r));
+        });
+    }).then([s] {
+        return make_ready_future<Initial>(std::move(s->result));
+    });
+}
+
+/// Asynchronous map/reduce transformation, a bounded number at a time
+/// (range version).
+///
+/// \param range object range to operate on
+/// \param max_concurrent maximum number of \c mapper invocations in flight
+/// \param mapper map function to call on each object, returning a future
+/// \param initial initial input value to reduce function
+/// \param reduce binary function for merging two result values from \c mapper
+///
+/// \return equivalent to \c reduce(reduce(initial, mapper(obj0)), mapper(obj1)) ...
+template <typename Range, typename Mapper, typename Initial, typename Reduce>
+inline
+future<Initial>
+max_concurrent_map_reduce(Range&& range, size_t max_concurrent, Mapper&& mapper, Initial initial, Reduce reduce) {
+    return max_concurrent_map_reduce(std::begin(range), std::end(range), max_concurrent,
+            std::forward<Mapper>(mapper), std::move(initial), std::move(reduce));
+}
+
 // Implements @Reducer concept. Calculates the result by
 // adding elements to the accumulator.
 template <typename Result, typename Addend = Result>
@@ -32,8 +32,18 @@
 #include <type_traits>
 #include <assert.h>
 #include <cstdlib>
+#include <cstring>
 #include "function_traits.hh"
 
+namespace seastar {
+namespace internal {
+
+template <typename... T>
+class coroutine_awaiter;
+
+}
+}
+
 
 /// \defgroup future-module Futures and Promises
 ///
@@ -96,6 +106,9 @@ future<T...> make_exception_future(std::exception_ptr value) noexcept;
 void engine_exit(std::exception_ptr eptr = {});
 
 void report_failed_future(std::exception_ptr ex);
+
+template <typename ExceptionFactory>
+class basic_semaphore;
 /// \endcond
 
 //
@@ -117,9 +130,27 @@ void report_failed_future(std::exception_ptr ex);
 //
 
 /// \cond internal
+template <typename... T>
+struct all_trivially_relocatable;
+
+template <>
+struct all_trivially_relocatable<> : std::true_type {};
+
+template <typename T, typename... Rest>
+struct all_trivially_relocatable<T, Rest...> : std::integral_constant<bool,
+        std::is_trivially_copy_constructible<T>::value
+        && std::is_trivially_destructible<T>::value
+        && all_trivially_relocatable<Rest...>::value> {};
+
 template <typename... T>
 struct future_state {
     static constexpr bool copy_noexcept = std::is_nothrow_copy_constructible<std::tuple<T...>>::value;
+    // When the values are trivially copyable, a state is moved by copying
+    // its bytes, whatever it holds: std::exception_ptr is a single
+    // reference-counted pointer, so copying it and forgetting the source
+    // is a valid move.
+    static constexpr bool trivially_relocatable = all_trivially_relocatable<T...>::value;
+    static_assert(sizeof(std::exception_ptr) == sizeof(void*), "exception_ptr not a pointer");
     static_assert(std::is_nothrow_move_constructible<std::tuple<T...>>::value,
                   "Types must be no-throw move constructible");
     static_assert(std::is_nothrow_destructible<std::tuple<T...>>::value,
@@ -144,6 +175,11 @@ struct future_state {
     [[gnu::always_inline]]
     future_state(future_state&& x) noexcept
             : _state(x._state) {
+        if (trivially_relocatable) {
+            std::memcpy(static_cast<void*>(&_u), static_cast<const void*>(&x._u), sizeof(_u));
+            x._state = state::invalid;
+            return;
+        }
         switch (_state) {
         case state::future:
             break;
@@ -283,6 +319,7 @@ struct future_state<> {
     static_assert(std::is_nothrow_move_constructible<std::exception_ptr>::value,
                   "std::exception_ptr's move constructor must not throw");
     static constexpr bool copy_noexcept = true;
+    static constexpr bool trivially_relocatable = true;
     enum class state : uintptr_t {
          invalid = 0,
          future = 1,
@@ -298,14 +335,9 @@ struct future_state<> {
     future_state() noexcept {}
     [[gnu::always_inline]]
     future_state(future_state&& x) noexcept {
-        if (x._u.st < state::exception_min) {
-            _u.st = x._u.st;
-        } else {
-            // Move ex out so future::~future() knows we've handled it
-            // Moving it will reset us to invalid state
-            new (&_u.ex) std::exception_ptr(std::move(x._u.ex));
-            x._u.ex.~exception_ptr();
-        }
+        // Whether x holds a state or an exception, moving it is copying
+        // the word and resetting x to invalid (see future_state<T...>).
+        _u.st = x._u.st;
         x._u.st = state::invalid;
     }
     [[gnu::always_inline]]
@@ -404,7 +436,7 @@ class promise {
     future<T...>* _future = nullptr;
     future_state<T...> _local_state;
     future_state<T...>* _state;
-    std::unique_ptr<task> _task;
+    task_ptr _task;
     static constexpr bool copy_noexcept = future_state<T...>::copy_noexcept;
 public:
     /// \brief Constructs an empty \c promise.
@@ -530,6 +562,8 @@ class promise {
     friend class future;
 
     friend class future_state<T...>;
+    template <typename ExceptionFactory>
+    friend class basic_semaphore; // for set_urgent_value()
 };
 
 /// \brief Specialization of \c promise<void>
@@ -692,6 +726,17 @@ class future {
     future_state<T...>* state() noexcept {
         return _promise ? _promise->_state : &_local_state;
     }
+    // Arranges for the coroutine to be resumed when the value arrives; the
+    // value is delivered into _local_state, which lives in the coroutine
+    // frame along with this future.
+    void set_coroutine(task& coroutine) noexcept {
+        assert(!state()->available());
+        assert(_promise);
+        _promise->_state = &_local_state;
+        _promise->_task = task_ptr(&coroutine);
+        _promise->_future = nullptr;
+        _promise = nullptr;
+    }
     template <typename Func>
     void schedule(Func&& func) {
         if (state()->available()) {
@@ -1098,6 +1143,8 @@ class future {
     friend future<U...> make_exception_future(std::exception_ptr ex) noexcept;
     template <typename... U, typename Exception>
     friend future<U...> make_exception_future(Exception&& ex) noexcept;
+    template <typename... U>
+    friend class seastar::internal::coroutine_awaiter;
     /// \endcond
 };
 
@@ -70,6 +70,9 @@ future<> output_stream<CharType>::write(scattered_message<CharType> msg) {
 template<typename CharType>
 future<>
 output_stream<CharType>::zero_copy_put(net::packet p) {
+    if (_corked) {
+        return cork_put(std::move(p));
+    }
     // if flush is scheduled, disable it, so it will not try to write in parallel
     _flush = false;
     if (_flushing) {
@@ -82,6 +85,79 @@ output_stream<CharType>::zero_copy_put(net::packet p) {
     }
 }
 
+template <typename CharType>
+void
+output_stream<CharType>::cork() {
+    static_assert(std::is_same<CharType, char>::value, "packet works on char");
+    if (!_trim_to_size) {
+        _corked = true;
+    }
+}
+
+template <typename CharType>
+void
+output_stream<CharType>::append_corked(net::packet p) {
+    if (_corked_bufs) {
+        _corked_bufs.append(std::move(p));
+    } else {
+        _corked_bufs = std::move(p);
+    }
+}
+
+// Holds p back until uncork(), unless that makes the corked packet too big.
+template <typename CharType>
+future<>
+output_stream<CharType>::cork_put(net::packet p) {
+    append_corked(std::move(p));
+    if (_corked_bufs.nr_frags() >= max_corked_fragments || _corked_bufs.len() >= max_corked_bytes) {
+        return put_corked();
+    }
+    return make_ready_future<>();
+}
+
+template <typename CharType>
+future<>
+output_stream<CharType>::put_corked() {
+    if (!_corked_bufs) {
+        return make_ready_future<>();
+    }
+    auto p = std::exchange(_corked_bufs, net::packet::make_null_packet());
+    _flush = false;
+    if (_flushing) {
+        return _in_batch.value().get_future().then([this, p = std::move(p)] () mutable {
+            return _fd.put(std::move(p));
+        });
+    } else {
+        return _fd.put(std::move(p));
+    }
+}
+
+template <typename CharType>
+future<>
+output_stream<CharType>::uncork() {
+    if (!_corked) {
+        return make_ready_future<>();
+    }
+    _corked = false;
+    auto flush = std::exchange(_flush_on_uncork, false);
+    if (flush) {
+        // Send the buffered tail in the same packet, rather than after it.
+        if (_end) {
+            _buf.trim(_end);
+            _end = 0;
+            append_corked(net::packet(std::move(_buf)));
+        } else if (_zc_bufs) {
+            append_corked(std::exchange(_zc_bufs, net::packet::make_null_packet()));
+        }
+    }
+    return put_corked().then([this, flush] {
+        if (!flush) {
+            return make_ready_future<>();
+        }
+        return _batch_flushes ? this->flush() : _fd.flush();
+    });
+}
+
 // Writes @p in chunks of _size length. The last chunk is buffered if smaller.
 template <typename CharType>
 future<>
@@ -108,7 +184,14 @@ future<> output_stream<CharType>::write(net::packet p) {
     static_assert(std::is_same<CharType, char>::value, "packet works on char");
 
     if (p.len() != 0) {
-        assert(!_end && "Mixing buffered writes and zero-copy writes not supported yet");
+        if (_end) {
+            // Whatever was buffered goes out ahead of the zero-copy data.
+            _buf.trim(_end);
+            _end = 0;
+            net::packet head(std::move(_buf));
+            head.append(std::move(p));
+            p = std::move(head);
+        }
 
         if (_zc_bufs) {
             _zc_bufs.append(std::move(p));
@@ -132,8 +215,6 @@ future<> output_stream<CharType>::write(temporary_buffer<CharType> p) {
     if (p.empty()) {
         return make_ready_future<>();
     }
-    assert(!_end && "Mixing buffered writes and zero-copy writes not supported yet");
-
     return write(net::packet(std::move(p)));
 }
 
@@ -189,6 +270,51 @@ input_stream<CharType>::read_exactly(size_t n) {
     }
 }
 
+template <typename CharType>
+template <typename Func>
+future<size_t>
+input_stream<CharType>::consume_fragments(size_t n, Func func) {
+    return do_with(std::move(func), size_t(0), [this, n] (Func& func, size_t& done) {
+        return repeat([this, n, &func, &done] {
+            if (done == n) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return this->read_up_to(n - done).then([&func, &done] (tmp_buf buf) {
+                if (buf.empty()) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                done += buf.size();
+                return futurize<std::result_of_t<Func(tmp_buf&&)>>::apply(func, std::move(buf)).then([] {
+                    return stop_iteration::no;
+                });
+            });
+        }).then([&done] {
+            return done;
+        });
+    });
+}
+
+template <typename CharType>
+future<std::vector<temporary_buffer<CharType>>>
+input_stream<CharType>::read_exactly_scattered(size_t n) {
+    using fragments = std::vector<tmp_buf>;
+    if (_buf.size() >= n) {
+        fragments v;
+        if (n) {
+            v.push_back(_buf.share(0, n));
+            _buf.trim_front(n);
+        }
+        return make_ready_future<fragments>(std::move(v));
+    }
+    return do_with(fragments(), [this, n] (fragments& v) {
+        return this->consume_fragments(n, [&v] (tmp_buf buf) {
+            v.push_back(std::move(buf));
+        }).then([&v] (size_t) {
+            return std::move(v);
+        });
+    });
+}
+
 template <typename CharType>
 template <typename Consumer>
 future<>
@@ -206,7 +332,7 @@ input_stream<CharType>::consume(Consumer& consumer) {
             unconsumed_remainder u = std::get<0>(unconsumed.get());
             if (u) {
                 // consumer is done
-                _buf = std::move(u.value());
+                keep_remainder(std::move(u.value()));
                 return make_ready_future<stop_iteration>(stop_iteration::yes);
             }
             if (_eof) {
@@ -224,7 +350,7 @@ input_stream<CharType>::consume(Consumer& consumer) {
             return unconsumed.then([this, &consumer] (unconsumed_remainder u) {
                 if (u) {
                     // consumer is done
-                    _buf = std::move(u.value());
+                    keep_remainder(std::move(u.value()));
                     return make_ready_future<stop_iteration>(stop_iteration::yes);
                 } else {
                     // consumer consumed entire buffer, and is ready for more
@@ -317,7 +443,10 @@ output_stream<CharType>::split_and_put(temporary_buffer<CharType> buf) {
 template <typename CharType>
 future<>
 output_stream<CharType>::write(const char_type* buf, size_t n) {
-    assert(!_zc_bufs && "Mixing buffered writes and zero-copy writes not supported yet");
+    if (_zc_bufs) {
+        // Zero-copy buffers are queued; copy behind them to keep the order.
+        return write(net::packet(buf, n));
+    }
     auto bulk_threshold = _end ? (2 * _size - _end) : _size;
     if (n >= bulk_threshold) {
         if (_end) {
@@ -367,6 +496,10 @@ output_stream<CharType>::write(const char_type* buf, size_t n) {
 template <typename CharType>
 future<>
 output_stream<CharType>::flush() {
+    if (_corked) {
+        _flush_on_uncork = true;
+        return make_ready_future<>();
+    }
     if (!_batch_flushes) {
         if (_end) {
             _buf.trim(_end);
@@ -394,11 +527,35 @@ output_stream<CharType>::flush() {
     return make_ready_future<>();
 }
 
+template <typename CharType>
+future<>
+output_stream<CharType>::sendfile(int fd, uint64_t offset, uint64_t len) {
+    assert(!_corked);
+    auto f = make_ready_future<>();
+    if (_end) {
+        _buf.trim(_end);
+        _end = 0;
+        f = put(std::move(_buf));
+    } else if (_zc_bufs) {
+        f = zero_copy_put(std::move(_zc_bufs));
+    } else if (_flushing) {
+        // A batched flush is putting earlier writes
+        _flush = false;
+        f = _in_batch.value().get_future();
+    }
+    return f.then([this, fd, offset, len] {
+        return _fd.sendfile(fd, offset, len);
+    });
+}
+
 void add_to_flush_poller(output_stream<char>* x);
 
 template <typename CharType>
 future<>
 output_stream<CharType>::put(temporary_buffer<CharType> buf) {
+    if (_corked) {
+        return cork_put(net::packet(std::move(buf)));
+    }
     // if flush is scheduled, disable it, so it will not try to write in parallel
     _flush = false;
     if (_flushing) {
@@ -451,7 +608,12 @@ output_stream<CharType>::poll_flush() {
 template <typename CharType>
 future<>
 output_stream<CharType>::close() {
-    return flush().finally([this] {
+    if (_corked) {
+        _flush_on_uncork = true;
+    }
+    return uncork().then([this] {
+        return flush();
+    }).finally([this] {
         if (_in_batch) {
             return _in_batch.value().get_future();
         } else {
@@ -38,6 +38,8 @@
 #include "future.hh"
 #include "temporary_buffer.hh"
 #include "scattered_message.hh"
+#include <climits>
+#include <stdexcept>
 
 namespace net { class packet; }
 
@@ -85,6 +87,14 @@ class data_sink_impl {
         return make_ready_future<>();
     }
     virtual future<> close() = 0;
+    // Sinks writing to a kernel socket can pass file contents straight
+    // from the page cache with sendfile(2)
+    virtual bool can_sendfile() const {
+        return false;
+    }
+    virtual future<> sendfile(int fd, uint64_t offset, uint64_t len) {
+        return make_exception_future<>(std::logic_error("data sink does not support sendfile"));
+    }
 };
 
 class data_sink {
@@ -110,6 +120,12 @@ class data_sink {
         return _dsi->flush();
     }
     future<> close() { return _dsi->close(); }
+    bool can_sendfile() const {
+        return _dsi->can_sendfile();
+    }
+    future<> sendfile(int fd, uint64_t offset, uint64_t len) {
+        return _dsi->sendfile(fd, offset, len);
+    }
 };
 
 template <typename CharType>
@@ -142,6 +158,17 @@ class input_stream final {
     input_stream(input_stream&&) = default;
     input_stream& operator=(input_stream&&) = default;
     future<temporary_buffer<CharType>> read_exactly(size_t n);
+    /// Returns the next \c n bytes as the buffers they arrived in, without
+    /// copying them into one contiguous buffer.  On end of stream, returns
+    /// what was read, which may be less than \c n bytes.
+    future<std::vector<tmp_buf>> read_exactly_scattered(size_t n);
+    /// Calls \c func on each fragment of the next \c n bytes, as they
+    /// arrive, without copying them.  \c func takes a \c tmp_buf and may
+    /// return a future, which is waited for before the next fragment.
+    /// Resolves to the number of bytes consumed, which is less than \c n
+    /// only on end of stream.
+    template <typename Func>
+    future<size_t> consume_fragments(size_t n, Func func);
     template <typename Consumer>
     future<> consume(Consumer& c);
     bool eof() { return _eof; }
@@ -167,6 +194,11 @@ class input_stream final {
     future<> skip(uint64_t n);
 private:
     future<temporary_buffer<CharType>> read_exactly_part(size_t n, tmp_buf buf, size_t completed);
+    void keep_remainder(tmp_buf remainder) {
+        // An empty remainder would still hold the buffer it was cut from,
+        // for as long as the stream waits for more data
+        _buf = remainder.empty() ? tmp_buf() : std::move(remainder);
+    }
 };
 
 // Facilitates data buffering before it's handed over to data_sink.
@@ -177,9 +209,17 @@ class input_stream final {
 //
 // The data sink will not receive empty chunks.
 //
+// While corked (see cork()), chunks and flushes are held back and handed to
+// the data sink as one packet, so that many small replies go out in a
+// single writev()/sendmsg().
+//
 template <typename CharType>
 class output_stream final {
     static_assert(sizeof(CharType) == 1, "must buffer stream of bytes");
+    // Corked data is put early once it reaches either limit; the first is
+    // the kernel's limit on iovecs per sendmsg().
+    static constexpr size_t max_corked_fragments = IOV_MAX;
+    static constexpr size_t max_corked_bytes = 1 << 20;
     data_sink _fd;
     temporary_buffer<CharType> _buf;
     net::packet _zc_bufs = net::packet::make_null_packet(); //zero copy buffers
@@ -191,6 +231,9 @@ class output_stream final {
     std::experimental::optional<promise<>> _in_batch;
     bool _flush = false;
     bool _flushing = false;
+    bool _corked = false;
+    bool _flush_on_uncork = false;
+    net::packet _corked_bufs = net::packet::make_null_packet();
     std::exception_ptr _ex;
 private:
     size_t available() const { return _end - _begin; }
@@ -200,6 +243,9 @@ class output_stream final {
     void poll_flush();
     future<> zero_copy_put(net::packet p);
     future<> zero_copy_split_and_put(net::packet p);
+    void append_corked(net::packet p);
+    future<> cork_put(net::packet p);
+    future<> put_corked();
 public:
     using char_type = CharType;
     output_stream() = default;
@@ -220,6 +266,22 @@ class output_stream final {
     future<> write(temporary_buffer<char_type>);
     future<> flush();
     future<> close();
+    /// Holds back writes and flushes until uncork(), then hands everything
+    /// to the data sink at once, with a single flush if any was requested.
+    /// Has no effect on streams created with \c trim_to_size.
+    void cork();
+    /// Writes out what was held back since cork().
+    future<> uncork();
+    bool corked() const { return _corked; }
+    /// Whether \ref sendfile() can be used: the data sink writes to a
+    /// kernel socket, and the stream is not corked.
+    bool can_sendfile() const { return _fd.can_sendfile() && !_corked; }
+    /// Sends \c len bytes at \c offset of the file open as \c fd with
+    /// sendfile(2), after everything written before.  The file is read by
+    /// a syscall thread, so a page cache miss does not stall the reactor.
+    /// \c fd must stay open until the returned future resolves, and must
+    /// not be open with O_DIRECT.
+    future<> sendfile(int fd, uint64_t offset, uint64_t len);
 private:
     friend class reactor;
 };
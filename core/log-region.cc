@@ -0,0 +1,220 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "log-region.hh"
+#include "future-util.hh"
+#include "align.hh"
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include "util/defer.hh"
+
+struct log_region::segment {
+    log_region* region;
+    // Position in log_region::_segments
+    size_t index;
+    // Bytes of the segment filled so far, from its start
+    uint32_t used;
+    // Bytes in live objects, headers included
+    uint32_t live;
+};
+
+struct log_region::object_header {
+    // Null once the object is freed
+    const log_region_migrator* migrator;
+    // Including the header, a multiple of object_alignment
+    uint32_t size;
+    uint32_t padding;
+};
+
+log_region::log_region(unsigned reclaimer_priority)
+        : _reclaimer([this] { return reclaim(); }, memory::reclaimer_scope::async, reclaimer_priority) {
+    static_assert(sizeof(segment) <= segment_header_size, "segment descriptor too large");
+    static_assert(sizeof(object_header) == object_header_size, "unexpected object header size");
+}
+
+log_region::~log_region() {
+    assert(!_background_running);
+    for (auto seg : _segments) {
+        ::free(seg);
+    }
+}
+
+log_region::segment* log_region::new_segment() {
+    auto p = ::aligned_alloc(segment_size, segment_size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    _segments.reserve(_segments.size() + 1);
+    auto seg = new (p) segment;
+    seg->region = this;
+    seg->index = _segments.size();
+    seg->used = segment_header_size;
+    seg->live = 0;
+    _segments.push_back(seg);
+    return seg;
+}
+
+void log_region::free_segment(segment* seg) {
+    auto last = _segments.back();
+    _segments[seg->index] = last;
+    last->index = seg->index;
+    _segments.pop_back();
+    if (seg == _head) {
+        _head = nullptr;
+    }
+    ::free(seg);
+}
+
+void* log_region::allocate_in_head(const log_region_migrator& m, size_t size) {
+    if (!_head || _head->used + size > segment_size) {
+        auto old = _head;
+        _head = new_segment();
+        if (old && !old->live) {
+            free_segment(old);
+        }
+    }
+    auto hdr = reinterpret_cast<object_header*>(reinterpret_cast<char*>(_head) + _head->used);
+    hdr->migrator = &m;
+    hdr->size = size;
+    _head->used += size;
+    _head->live += size;
+    _live_bytes += size;
+    return hdr + 1;
+}
+
+void* log_region::alloc(const log_region_migrator& m, size_t size) {
+    if (size > max_object_size) {
+        throw std::bad_alloc();
+    }
+    return allocate_in_head(m, align_up(size + object_header_size, object_alignment));
+}
+
+void log_region::free(void* obj) noexcept {
+    auto hdr = static_cast<object_header*>(obj) - 1;
+    auto seg = reinterpret_cast<segment*>(align_down(reinterpret_cast<uintptr_t>(hdr), uintptr_t(segment_size)));
+    hdr->migrator = nullptr;
+    seg->live -= hdr->size;
+    _live_bytes -= hdr->size;
+    if (!seg->live && seg != _head) {
+        free_segment(seg);
+    } else {
+        maybe_start_background_compaction();
+    }
+}
+
+log_region::segment* log_region::sparsest() {
+    segment* victim = nullptr;
+    for (auto seg : _segments) {
+        if (seg != _head && (!victim || seg->live < victim->live)) {
+            victim = seg;
+        }
+    }
+    return victim;
+}
+
+bool log_region::compact_one() {
+    auto victim = sparsest();
+    if (!victim || _compacting) {
+        return false;
+    }
+    _compacting = true;
+    auto done = defer([this] { _compacting = false; });
+    auto base = reinterpret_cast<char*>(victim);
+    for (auto pos = segment_header_size; pos < victim->used; ) {
+        auto hdr = reinterpret_cast<object_header*>(base + pos);
+        auto size = hdr->size;
+        if (hdr->migrator) {
+            // May throw bad_alloc opening a new head; the objects moved
+            // so far are already dead here, so the victim stays consistent.
+            auto dst = allocate_in_head(*hdr->migrator, size);
+            hdr->migrator->migrate(hdr + 1, dst, size - object_header_size);
+            hdr->migrator = nullptr;
+            victim->live -= size;
+            _live_bytes -= size;
+            ++_objects_migrated;
+        }
+        pos += size;
+    }
+    free_segment(victim);
+    ++_segments_compacted;
+    return true;
+}
+
+memory::reclaiming_result log_region::reclaim() {
+    if (_compacting) {
+        return memory::reclaiming_result::reclaimed_nothing;
+    }
+    // Compacting frees a segment once the dead space it gathers adds up to
+    // one; give up if it doesn't within a pass over the segments.
+    auto before = _segments.size();
+    try {
+        for (size_t i = 0; i < before && _segments.size() >= before
+                && occupancy() - _live_bytes >= 2 * segment_size; ++i) {
+            if (!compact_one()) {
+                break;
+            }
+        }
+    } catch (std::bad_alloc&) {
+        // Fall through to eviction
+    }
+    if (_segments.size() < before) {
+        return memory::reclaiming_result::reclaimed_something;
+    }
+    return _evictor ? _evictor() : memory::reclaiming_result::reclaimed_nothing;
+}
+
+void log_region::enable_background_compaction(float threshold) {
+    _background_threshold = threshold;
+    maybe_start_background_compaction();
+}
+
+void log_region::maybe_start_background_compaction() {
+    auto needs_compaction = [this] {
+        return !_stopped && _segments.size() > 1
+                && occupancy() - _live_bytes > _background_threshold * occupancy();
+    };
+    if (_background_running || !needs_compaction()) {
+        return;
+    }
+    _background_running = true;
+    try {
+        _background = repeat([this, needs_compaction] {
+            if (!needs_compaction() || !compact_one()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return later().then([] {
+                return stop_iteration::no;
+            });
+        }).handle_exception([] (std::exception_ptr) {
+            // Out of memory; the reclaimer takes over.
+        }).finally([this] {
+            _background_running = false;
+        });
+    } catch (...) {
+        _background_running = false;
+    }
+}
+
+future<> log_region::stop() {
+    _stopped = true;
+    return std::exchange(_background, make_ready_future<>());
+}
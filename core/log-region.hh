@@ -0,0 +1,156 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+///
+/// A log-structured, compacting allocator for long-lived objects.
+
+#include "future.hh"
+#include "memory.hh"
+#include <vector>
+#include <new>
+#include <utility>
+
+/// Moves an object allocated in a \ref log_region to a new address.
+///
+/// \c migrate() must move the object from \c src to \c dst, which do not
+/// overlap, and update every reference to it.  It must not allocate in,
+/// or free from, the region.
+class log_region_migrator {
+public:
+    virtual ~log_region_migrator() {}
+    virtual void migrate(void* src, void* dst, size_t size) const noexcept = 0;
+};
+
+/// Migrates a T by move-constructing it, for objects that are only referred
+/// to through owners that fix up their pointers in T's move constructor.
+template <typename T>
+class log_region_standard_migrator final : public log_region_migrator {
+public:
+    void migrate(void* src, void* dst, size_t size) const noexcept override {
+        auto s = static_cast<T*>(src);
+        new (dst) T(std::move(*s));
+        s->~T();
+    }
+    static const log_region_standard_migrator& get() {
+        static thread_local log_region_standard_migrator m;
+        return m;
+    }
+};
+
+/// Allocates variable-size objects sequentially into fixed-size segments
+/// taken from the shard allocator, and compacts them.
+///
+/// As objects die, segments become sparse; compaction moves the live objects
+/// of the sparsest segments to the head of the log (notifying their
+/// migrators) and returns the emptied segments, so a long-lived churning
+/// population does not fragment the shard's memory.
+///
+/// Compaction runs:
+///   - from a memory reclaimer, which frees whole segments when the shard
+///     is low on memory, evicting (through the function set with
+///     \ref set_evictor()) when compaction cannot help;
+///   - in the background, as a fiber that compacts one segment per task,
+///     when enabled with \ref enable_background_compaction();
+///   - on demand, with \ref compact_one().
+///
+/// The region must be stopped with \ref stop() before it is destroyed;
+/// destroying it frees the memory of the remaining objects without
+/// running their destructors.
+class log_region {
+public:
+    static constexpr size_t segment_size = 128 * 1024;
+    static constexpr size_t object_alignment = 16;
+    // Space reserved at the start of each segment for its descriptor.
+    static constexpr size_t segment_header_size = 64;
+    static constexpr size_t object_header_size = 16;
+    /// Largest object that can be allocated.
+    static constexpr size_t max_object_size = segment_size - segment_header_size - object_header_size;
+private:
+    struct object_header;
+    struct segment;
+    std::vector<segment*> _segments;
+    segment* _head = nullptr;
+    size_t _live_bytes = 0;
+    bool _compacting = false;
+    bool _stopped = false;
+    std::function<memory::reclaiming_result ()> _evictor;
+    float _background_threshold = 1.0f;
+    bool _background_running = false;
+    future<> _background = make_ready_future<>();
+    uint64_t _segments_compacted = 0;
+    uint64_t _objects_migrated = 0;
+    memory::reclaimer _reclaimer;
+private:
+    segment* new_segment();
+    void free_segment(segment* seg);
+    void* allocate_in_head(const log_region_migrator& m, size_t size);
+    segment* sparsest();
+    memory::reclaiming_result reclaim();
+    void maybe_start_background_compaction();
+public:
+    explicit log_region(unsigned reclaimer_priority = 0);
+    log_region(const log_region&) = delete;
+    ~log_region();
+
+    /// Allocates \c size bytes, aligned to \ref object_alignment, which
+    /// compaction may move with \c m.
+    void* alloc(const log_region_migrator& m, size_t size);
+    /// Frees an object returned by \ref alloc().
+    void free(void* obj) noexcept;
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        auto p = alloc(log_region_standard_migrator<T>::get(), sizeof(T));
+        return new (p) T(std::forward<Args>(args)...);
+    }
+    template <typename T>
+    void destroy(T* obj) noexcept {
+        obj->~T();
+        free(obj);
+    }
+
+    /// Compacts the sparsest segment other than the head; returns false if
+    /// there was nothing to compact.
+    bool compact_one();
+
+    /// Compacts segments in the background while the fraction of memory
+    /// held by the region that is not live exceeds \c threshold.
+    void enable_background_compaction(float threshold);
+
+    /// Called by the reclaimer when compaction cannot free a segment; it
+    /// should free objects (e.g. evict from a cache) and report whether it did.
+    void set_evictor(std::function<memory::reclaiming_result ()> evictor) {
+        _evictor = std::move(evictor);
+    }
+
+    /// Waits for background compaction to stop.
+    future<> stop();
+
+    /// Bytes held by the region's segments.
+    size_t occupancy() const { return _segments.size() * segment_size; }
+    /// Bytes in live objects, including their headers.
+    size_t live_bytes() const { return _live_bytes; }
+    uint64_t segments_compacted() const { return _segments_compacted; }
+    uint64_t objects_migrated() const { return _objects_migrated; }
+};
@@ -0,0 +1,104 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB.
+ */
+
+#pragma once
+
+#include <array>
+#include <limits>
+#include <algorithm>
+#include "bitops.hh"
+#include "metrics.hh"
+
+namespace seastar {
+
+/// \brief A cheap histogram with power-of-two buckets.
+///
+/// Recording a sample costs a count-leading-zeros and two increments, so it
+/// can be used on hot paths. Bucket \c i holds samples \c v with
+/// <tt>v >> MinShift < 2^i</tt>; the last bucket also absorbs everything
+/// larger.
+///
+/// \tparam Buckets number of buckets
+/// \tparam MinShift log2 of the upper bound of the first bucket
+template <unsigned Buckets = 24, unsigned MinShift = 0>
+class log_histogram {
+    static_assert(Buckets > 1 && Buckets + MinShift <= 64, "bad log_histogram geometry");
+    std::array<uint64_t, Buckets> _counts = {};
+    uint64_t _sample_count = 0;
+    uint64_t _sample_sum = 0;
+public:
+    void add(uint64_t v) {
+        auto b = v >> MinShift;
+        unsigned idx = b ? std::min<unsigned>(64 - count_leading_zeros(static_cast<unsigned long long>(b)), Buckets - 1) : 0;
+        ++_counts[idx];
+        ++_sample_count;
+        _sample_sum += v;
+    }
+    uint64_t sample_count() const {
+        return _sample_count;
+    }
+    uint64_t sample_sum() const {
+        return _sample_sum;
+    }
+    /// Estimates the value below which a fraction \c q of the samples lie,
+    /// interpolating within the bucket it falls in. Samples in the last
+    /// bucket are taken to be at its lower bound.
+    uint64_t quantile(double q) const {
+        if (!_sample_count) {
+            return 0;
+        }
+        double rank = std::min(std::max(q, 0.0), 1.0) * _sample_count;
+        uint64_t cumulative = 0;
+        for (unsigned i = 0; i < Buckets; ++i) {
+            if (!_counts[i] || cumulative + _counts[i] < rank) {
+                cumulative += _counts[i];
+                continue;
+            }
+            uint64_t lo = i ? uint64_t(1) << (i - 1 + MinShift) : 0;
+            if (i == Buckets - 1) {
+                return lo;
+            }
+            uint64_t hi = uint64_t(1) << (i + MinShift);
+            return lo + uint64_t((hi - lo) * ((rank - cumulative) / _counts[i]));
+        }
+        return 0;
+    }
+    /// Converts to the metrics layer representation; bucket bounds and the
+    /// sum are multiplied by \c scale (e.g. 1e-3 to report nanosecond
+    /// samples in microseconds).
+    metrics::histogram to_metrics_histogram(double scale = 1) const {
+        metrics::histogram h;
+        h.sample_count = _sample_count;
+        h.sample_sum = _sample_sum * scale;
+        h.buckets.resize(Buckets);
+        uint64_t cumulative = 0;
+        for (unsigned i = 0; i < Buckets; ++i) {
+            cumulative += _counts[i];
+            h.buckets[i].count = cumulative;
+            h.buckets[i].upper_bound = i == Buckets - 1
+                    ? std::numeric_limits<double>::infinity()
+                    : double((uint64_t(1) << (i + MinShift)) - 1) * scale;
+        }
+        return h;
+    }
+};
+
+}
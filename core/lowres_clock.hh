@@ -41,6 +41,9 @@ class lowres_clock {
     }
 private:
     static void update();
+    // Steady clock time, in ticks, when simulated time started; lowres_clock
+    // then reads it plus the manual clock.
+    static rep _simulated_base;
     // _now is updated by cpu0 and read by other cpus. Make _now on its own
     // cache line to avoid false sharing.
     static std::atomic<rep> _now [[gnu::aligned(64)]];
@@ -48,4 +51,6 @@ class lowres_clock {
     timer<> _timer [[gnu::aligned(64)]];
     // High resolution timer expires every 10 milliseconds
     static constexpr std::chrono::milliseconds _granularity{10};
+
+    friend class manual_clock;
 };
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <chrono>
+#include <atomic>
 
 class manual_clock {
 public:
@@ -31,6 +32,7 @@ class manual_clock {
     using time_point = std::chrono::time_point<manual_clock, duration>;
 private:
     static std::atomic<rep> _now;
+    static std::atomic<bool> _simulated;
     static void expire_timers();
 public:
     manual_clock();
@@ -38,4 +40,11 @@ class manual_clock {
         return time_point(duration(_now.load(std::memory_order_relaxed)));
     }
     static void advance(duration d);
+    // Under simulated time (--simulated-time), lowres_clock and fair queues
+    // follow this clock instead of the steady clock, so that only advance()
+    // moves them.
+    static bool simulated() {
+        return _simulated.load(std::memory_order_relaxed);
+    }
+    static void set_simulated(bool simulated);
 };
@@ -0,0 +1,118 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "mapped-file.hh"
+#include "reactor.hh"
+#include "align.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+struct map_result {
+    void* addr;
+    size_t size;
+    int error;
+};
+
+}
+
+mapped_file::mapping::~mapping() {
+    if (size) {
+        ::munmap(const_cast<char*>(addr), size);
+    }
+}
+
+future<mapped_file> mapped_file::open(sstring name, mapped_file_options options) {
+    return engine()._thread_pool.submit<map_result>([name, options] {
+        map_result res = { nullptr, 0, 0 };
+        int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            res.error = errno;
+            return res;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == -1) {
+            res.error = errno;
+            ::close(fd);
+            return res;
+        }
+        res.size = st.st_size;
+        if (res.size) {
+            auto flags = MAP_SHARED | (options.populate ? MAP_POPULATE : 0);
+            auto addr = ::mmap(nullptr, res.size, PROT_READ, flags, fd, 0);
+            if (addr == MAP_FAILED) {
+                res.error = errno;
+            } else {
+                res.addr = addr;
+                int advice = MADV_NORMAL;
+                switch (options.pattern) {
+                case mapped_file_options::access::normal: advice = MADV_NORMAL; break;
+                case mapped_file_options::access::random: advice = MADV_RANDOM; break;
+                case mapped_file_options::access::sequential: advice = MADV_SEQUENTIAL; break;
+                }
+                ::madvise(addr, res.size, advice);
+            }
+        }
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
+        return res;
+    }).then([] (map_result res) {
+        if (res.error) {
+            throw std::system_error(res.error, std::system_category());
+        }
+        auto m = make_lw_shared<mapping>();
+        m->addr = static_cast<const char*>(res.addr);
+        m->size = res.size;
+        return mapped_file(std::move(m));
+    });
+}
+
+temporary_buffer<char> mapped_file::share(uint64_t offset, size_t len) const {
+    if (offset >= _m->size) {
+        return temporary_buffer<char>();
+    }
+    len = std::min<uint64_t>(len, _m->size - offset);
+    return temporary_buffer<char>(const_cast<char*>(_m->addr) + offset, len, make_deleter([m = _m] {}));
+}
+
+future<> mapped_file::prefetch(uint64_t offset, size_t len) const {
+    if (offset >= _m->size) {
+        return make_ready_future<>();
+    }
+    len = std::min<uint64_t>(len, _m->size - offset);
+    static const size_t page_size = ::sysconf(_SC_PAGESIZE);
+    auto start = align_down(reinterpret_cast<uintptr_t>(_m->addr) + offset, uintptr_t(page_size));
+    auto end = reinterpret_cast<uintptr_t>(_m->addr) + offset + len;
+    // The copy of _m keeps the mapping alive while the thread touches it.
+    return engine()._thread_pool.submit<int>([m = _m, start, end] {
+        ::madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED);
+        // WILLNEED only starts readahead; reading a byte of each page waits
+        // for it here rather than on the reactor.
+        unsigned char sum = 0;
+        for (auto p = start; p < end; p += page_size) {
+            sum += *reinterpret_cast<volatile const char*>(p);
+        }
+        return int(sum);
+    }).discard_result();
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+///
+/// Read-only memory-mapped files.
+
+#include "sstring.hh"
+#include "future.hh"
+#include "shared_ptr.hh"
+#include "temporary_buffer.hh"
+
+/// Options for \ref mapped_file::open().
+struct mapped_file_options {
+    /// Access pattern hint, passed to madvise().
+    enum class access {
+        normal,
+        random,
+        sequential,
+    };
+    access pattern = access::random;
+    /// Fault the whole file in when mapping it (MAP_POPULATE).  The mapping
+    /// is created on a syscall thread, so this does not block the reactor.
+    bool populate = false;
+};
+
+/// A read-only memory mapping of a whole file.
+///
+/// Suited to large immutable files that are probed randomly and fit in
+/// memory, where a memory load is much cheaper than a \ref file::dma_read().
+/// Touching a page that is not resident blocks the reactor on a major
+/// fault; use \ref populate or \ref prefetch() to fault pages in on a
+/// syscall thread first.
+///
+/// Copies share the mapping, which is unmapped when the last copy and the
+/// last buffer returned by \ref share() are gone.
+class mapped_file {
+    struct mapping {
+        const char* addr = nullptr;
+        size_t size = 0;
+        ~mapping();
+    };
+    lw_shared_ptr<mapping> _m;
+private:
+    explicit mapped_file(lw_shared_ptr<mapping> m) : _m(std::move(m)) {}
+public:
+    mapped_file() = default;
+    /// Maps the file \c name.
+    static future<mapped_file> open(sstring name, mapped_file_options options = {});
+    explicit operator bool() const { return bool(_m); }
+    const char* data() const { return _m->addr; }
+    size_t size() const { return _m->size; }
+    /// Returns a buffer referring to [offset, offset + len) of the mapping,
+    /// which keeps the mapping alive.  \c len is clamped to the file size.
+    temporary_buffer<char> share(uint64_t offset, size_t len) const;
+    /// Faults [offset, offset + len) in on a syscall thread, so that later
+    /// accesses do not block the reactor.
+    future<> prefetch(uint64_t offset, size_t len) const;
+};
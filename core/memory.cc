@@ -83,6 +83,8 @@ disable_abort_on_alloc_failure_temporarily::~disable_abort_on_alloc_failure_temp
 #include <experimental/optional>
 #include <functional>
 #include <cstring>
+#include <cmath>
+#include <ostream>
 #include <boost/intrusive/list.hpp>
 #include <sys/mman.h>
 #include "util/defer.hh"
@@ -95,6 +97,8 @@ disable_abort_on_alloc_failure_temporarily::~disable_abort_on_alloc_failure_temp
 struct allocation_site {
     mutable size_t count = 0; // number of live objects allocated at backtrace.
     mutable size_t size = 0; // amount of bytes in live objects allocated at backtrace.
+    mutable size_t total_count = 0; // number of objects ever allocated at backtrace.
+    mutable size_t total_size = 0; // amount of bytes ever allocated at backtrace.
     mutable const allocation_site* next = nullptr;
     std::vector<uintptr_t> backtrace;
 
@@ -126,7 +130,7 @@ using allocation_site_ptr = const allocation_site*;
 
 namespace memory {
 
-static allocation_site_ptr get_allocation_site() __attribute__((unused));
+static allocation_site_ptr get_allocation_site(size_t size) __attribute__((unused));
 
 static std::atomic<bool> abort_on_allocation_failure{false};
 
@@ -153,9 +157,17 @@ class page_list;
 
 static std::atomic<bool> live_cpus[max_cpus];
 
+// Lcores lend each other memory in units of this many bytes. What was
+// donated and not yet borrowed, and what lcores under pressure have asked
+// for, are shared by all lcores; see memory::rebalance().
+static constexpr size_t rebalance_unit = 16 * huge_page_size;
+static std::atomic<size_t> rebalance_pool_bytes{0};
+static std::atomic<size_t> rebalance_demand_bytes{0};
+
 static thread_local uint64_t g_allocs;
 static thread_local uint64_t g_frees;
 static thread_local uint64_t g_cross_cpu_frees;
+static thread_local uint64_t g_cross_cpu_free_flushes;
 static thread_local uint64_t g_reclaims;
 
 using std::experimental::optional;
@@ -262,6 +274,12 @@ class page_list {
         }
         _front = ary[_front].link._next;
     }
+    template <typename Func>
+    void for_each(page* ary, Func func) const {
+        for (auto n = _front; n; n = ary[n].link._next) {
+            func(ary[n]);
+        }
+    }
     page* find(uint32_t n_pages, page* ary) {
         auto n = _front;
         while (n && ary[n].span_size < n_pages) {
@@ -279,6 +297,7 @@ class small_pool {
     unsigned _span_size;
     free_object* _free = nullptr;
     size_t _free_count = 0;
+    size_t _use_count = 0;
     unsigned _min_free;
     unsigned _max_free;
     unsigned _spans_in_use = 0;
@@ -296,6 +315,7 @@ class small_pool {
     static constexpr unsigned size_to_idx(unsigned size);
     static constexpr unsigned idx_to_size(unsigned idx);
     allocation_site_ptr& alloc_site_holder(void* ptr);
+    memory::small_pool_statistics statistics();
 private:
     void add_more_objects();
     void trim_free_list();
@@ -369,6 +389,24 @@ struct cross_cpu_free_item {
     cross_cpu_free_item* next;
 };
 
+// Objects this cpu freed that belong to other cpus, kept back so that they
+// are handed to each owner with a single atomic operation.
+struct cross_cpu_free_batches {
+    // Flush a destination's batch once it holds this many objects, so that
+    // its owner is not kept waiting for memory.
+    static constexpr unsigned max_batch = 64;
+    struct batch {
+        cross_cpu_free_item* head = nullptr;
+        cross_cpu_free_item* tail = nullptr;
+        unsigned count = 0;
+    };
+    bool enabled = false;
+    batch batches[max_cpus];
+    // Destinations with a nonempty batch
+    unsigned pending[max_cpus];
+    unsigned nr_pending = 0;
+};
+
 struct cpu_pages {
     static constexpr unsigned min_free_pages = 20000000 / page_size;
     char* memory;
@@ -393,7 +431,10 @@ struct cpu_pages {
     } fsu;
     small_pool_array small_pools;
     alignas(cache_line_size) std::atomic<cross_cpu_free_item*> xcpu_freelist;
+    cross_cpu_free_batches xcpu_batches;
     alignas(cache_line_size) std::vector<physical_address> virt_to_phys_map;
+    // The hugetlbfs file the memory is mapped from, if any
+    lw_shared_ptr<file_desc> backing_file;
     static std::atomic<unsigned> cpu_id_gen;
     static cpu_pages* all_cpus[max_cpus];
     union asu {
@@ -406,6 +447,36 @@ struct cpu_pages {
     } asu;
     allocation_site_ptr alloc_site_list_head = nullptr; // For easy traversal of asu.alloc_sites from scylla-gdb.py
     bool collect_backtrace = false;
+    // With sampling, only the allocation that brings the bytes allocated
+    // since the last sample past a random (exponential) distance with mean
+    // heapprof_sample_interval records its backtrace.
+    size_t heapprof_sample_interval = 0;
+    int64_t heapprof_bytes_until_sample = 0;
+    uint64_t heapprof_rng = 0x9e3779b97f4a7c15;
+    // Start spans of a huge page or more on a huge page boundary; off when
+    // memory is backed by hugetlbfs anyway.
+    bool align_huge_spans = true;
+    unsigned home_node = 0;
+    // Elastic memory: the pages behind lent spans are given back to the
+    // system, and the spans stay allocated until borrowed back.
+    struct rebalancing {
+        static constexpr unsigned unit_pages = rebalance_unit / page_size;
+        bool enabled = false;
+        // The lcore's own share, in pages
+        uint32_t own_pages = 0;
+        // Watermarks on free pages
+        uint32_t borrow_below = 0;
+        uint32_t donate_above = std::numeric_limits<uint32_t>::max();
+        // Heads of the lent spans, of unit_pages each
+        std::vector<pageidx> lent;
+        // What this lcore added to rebalance_demand_bytes
+        size_t demand = 0;
+        uint64_t donations = 0;
+        uint64_t borrows = 0;
+        uint32_t capacity(uint32_t nr_pages) const {
+            return nr_pages - lent.size() * unit_pages;
+        }
+    } rb;
     char* mem() { return memory; }
 
     void link(page_list& list, page* span);
@@ -415,7 +486,7 @@ struct cpu_pages {
         unsigned nr_pages;
     };
     template <typename Trimmer>
-    void* allocate_large_and_trim(unsigned nr_pages, Trimmer trimmer);
+    void* allocate_large_and_trim(unsigned nr_pages, Trimmer trimmer, bool may_reclaim = true);
     void* allocate_large(unsigned nr_pages);
     void* allocate_large_aligned(unsigned align_pages, unsigned nr_pages);
     page* find_and_unlink_span(unsigned nr_pages);
@@ -429,6 +500,9 @@ struct cpu_pages {
     bool try_cross_cpu_free(void* ptr);
     void shrink(void* ptr, size_t new_size);
     void free_cross_cpu(unsigned cpu_id, void* ptr);
+    void push_cross_cpu(unsigned cpu_id, cross_cpu_free_item* head, cross_cpu_free_item* tail);
+    void flush_cross_cpu_batch(unsigned cpu_id);
+    bool flush_cross_cpu_frees();
     bool drain_cross_cpu_freelist();
     size_t object_size(void* ptr);
     page* to_page(void* p) {
@@ -438,12 +512,19 @@ struct cpu_pages {
     bool is_initialized() const;
     bool initialize();
     reclaiming_result run_reclaimers(reclaimer_scope);
+    bool reclaim_once(reclaimer_scope scope);
     void schedule_reclaim();
     void set_reclaim_hook(std::function<void (std::function<void ()>)> hook);
     void resize(size_t new_size, allocate_system_memory_fn alloc_sys_mem);
     void do_resize(size_t new_size, allocate_system_memory_fn alloc_sys_mem);
     void replace_memory_backing(allocate_system_memory_fn alloc_sys_mem);
+    void enable_rebalancing(size_t own_size);
+    bool lend();
+    bool borrow(unsigned n_pages);
+    void set_demand(size_t bytes);
+    bool rebalance();
     void init_virt_to_phys_map();
+    size_t huge_page_backed_memory();
     memory::memory_layout memory_layout();
     translation translate(const void* addr, size_t size);
     ~cpu_pages();
@@ -468,6 +549,15 @@ void set_heap_profiling_enabled(bool enable) {
     cpu_mem.collect_backtrace = enable;
 }
 
+void set_heap_profiling_sample_interval(size_t bytes) {
+    cpu_mem.heapprof_sample_interval = bytes;
+    cpu_mem.heapprof_bytes_until_sample = 0;
+}
+
+size_t heap_profiling_sample_interval() {
+    return cpu_mem.heapprof_sample_interval;
+}
+
 // Free spans are store in the largest index i such that nr_pages >= 1 << i.
 static inline
 unsigned index_of(unsigned pages) {
@@ -561,6 +651,9 @@ cpu_pages::find_and_unlink_span_reclaiming(unsigned n_pages) {
         if (span) {
             return span;
         }
+        if (borrow(n_pages)) {
+            continue;
+        }
         if (run_reclaimers(reclaimer_scope::sync) == reclaiming_result::reclaimed_nothing) {
             return nullptr;
         }
@@ -569,13 +662,13 @@ cpu_pages::find_and_unlink_span_reclaiming(unsigned n_pages) {
 
 template <typename Trimmer>
 void*
-cpu_pages::allocate_large_and_trim(unsigned n_pages, Trimmer trimmer) {
+cpu_pages::allocate_large_and_trim(unsigned n_pages, Trimmer trimmer, bool may_reclaim) {
     // Avoid exercising the reclaimers for requests we'll not be able to satisfy
     // nr_pages might be zero during startup, so check for that too
     if (nr_pages && n_pages >= nr_pages) {
         return nullptr;
     }
-    page* span = find_and_unlink_span_reclaiming(n_pages);
+    page* span = may_reclaim ? find_and_unlink_span_reclaiming(n_pages) : find_and_unlink_span(n_pages);
     if (!span) {
         return nullptr;
     }
@@ -599,13 +692,18 @@ cpu_pages::allocate_large_and_trim(unsigned n_pages, Trimmer trimmer) {
     span->span_size = span_end->span_size = t.nr_pages;
     span->pool = nullptr;
 #ifdef SEASTAR_HEAPPROF
-    auto alloc_site = get_allocation_site();
+    auto alloc_site = get_allocation_site(span->span_size * page_size);
     span->alloc_site = alloc_site;
     if (alloc_site) {
         ++alloc_site->count;
         alloc_site->size += span->span_size * page_size;
+        ++alloc_site->total_count;
+        alloc_site->total_size += span->span_size * page_size;
     }
 #endif
+    if (nr_free_pages < rb.borrow_below) {
+        borrow(0);
+    }
     if (nr_free_pages < current_min_free_pages) {
         drain_cross_cpu_freelist();
         run_reclaimers(reclaimer_scope::sync);
@@ -618,6 +716,18 @@ cpu_pages::allocate_large_and_trim(unsigned n_pages, Trimmer trimmer) {
 
 void*
 cpu_pages::allocate_large(unsigned n_pages) {
+    // Transparent huge pages can only back whole, aligned huge pages of a
+    // span, so large spans start on a huge page boundary if one is free
+    // without reclaiming; otherwise they fall back to any span.
+    static constexpr unsigned huge_page_pages = huge_page_size / page_size;
+    if (align_huge_spans && n_pages >= huge_page_pages) {
+        auto p = allocate_large_and_trim(n_pages + huge_page_pages - 1, [=] (unsigned idx, unsigned n) {
+            return trim{align_up(idx, huge_page_pages) - idx, n_pages};
+        }, false);
+        if (p) {
+            return p;
+        }
+    }
     return allocate_large_and_trim(n_pages, [n_pages] (unsigned idx, unsigned n) {
         return trim{0, std::min(n, n_pages)};
     });
@@ -662,11 +772,31 @@ std::vector<uintptr_t> get_backtrace() noexcept {
     return result;
 }
 
+// Distance to the next sample, exponentially distributed so that samples
+// form a Poisson process over the bytes allocated.
 static
-allocation_site_ptr get_allocation_site() {
+int64_t next_heapprof_sample_distance() {
+    auto& x = cpu_mem.heapprof_rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    // uniform in (0, 1]
+    double u = ((x >> 11) + 1) * (1.0 / (uint64_t(1) << 53));
+    return int64_t(-std::log(u) * cpu_mem.heapprof_sample_interval) + 1;
+}
+
+static
+allocation_site_ptr get_allocation_site(size_t size) {
     if (!cpu_mem.is_initialized() || !cpu_mem.collect_backtrace) {
         return nullptr;
     }
+    if (cpu_mem.heapprof_sample_interval) {
+        cpu_mem.heapprof_bytes_until_sample -= size;
+        if (cpu_mem.heapprof_bytes_until_sample > 0) {
+            return nullptr;
+        }
+        cpu_mem.heapprof_bytes_until_sample = next_heapprof_sample_distance();
+    }
     disable_backtrace_temporarily dbt;
     allocation_site new_alloc_site;
     new_alloc_site.backtrace = get_backtrace();
@@ -702,10 +832,12 @@ cpu_pages::allocate_small(unsigned size) {
     if (!ptr) {
         return nullptr;
     }
-    allocation_site_ptr alloc_site = get_allocation_site();
+    allocation_site_ptr alloc_site = get_allocation_site(pool.object_size());
     if (alloc_site) {
         ++alloc_site->count;
         alloc_site->size += pool.object_size();
+        ++alloc_site->total_count;
+        alloc_site->total_size += pool.object_size();
     }
     new (&pool.alloc_site_holder(ptr)) allocation_site_ptr{alloc_site};
 #endif
@@ -749,12 +881,54 @@ void cpu_pages::free_cross_cpu(unsigned cpu_id, void* ptr) {
         return;
     }
     auto p = reinterpret_cast<cross_cpu_free_item*>(ptr);
+    ++g_cross_cpu_frees;
+    if (!xcpu_batches.enabled) {
+        push_cross_cpu(cpu_id, p, p);
+        return;
+    }
+    auto& b = xcpu_batches.batches[cpu_id];
+    p->next = b.head;
+    b.head = p;
+    if (!b.count++) {
+        b.tail = p;
+        xcpu_batches.pending[xcpu_batches.nr_pending++] = cpu_id;
+    } else if (b.count == cross_cpu_free_batches::max_batch) {
+        flush_cross_cpu_batch(cpu_id);
+    }
+}
+
+// Splices the chain head..tail onto cpu_id's freelist.
+void cpu_pages::push_cross_cpu(unsigned cpu_id, cross_cpu_free_item* head, cross_cpu_free_item* tail) {
     auto& list = all_cpus[cpu_id]->xcpu_freelist;
     auto old = list.load(std::memory_order_relaxed);
     do {
-        p->next = old;
-    } while (!list.compare_exchange_weak(old, p, std::memory_order_release, std::memory_order_relaxed));
-    ++g_cross_cpu_frees;
+        tail->next = old;
+    } while (!list.compare_exchange_weak(old, head, std::memory_order_release, std::memory_order_relaxed));
+    ++g_cross_cpu_free_flushes;
+}
+
+// Hands a batch over; it stays in the pending list, and is skipped there
+// once empty.
+void cpu_pages::flush_cross_cpu_batch(unsigned cpu_id) {
+    auto& b = xcpu_batches.batches[cpu_id];
+    if (live_cpus[cpu_id].load(std::memory_order_relaxed)) {
+        push_cross_cpu(cpu_id, b.head, b.tail);
+    }
+    b = cross_cpu_free_batches::batch();
+}
+
+bool cpu_pages::flush_cross_cpu_frees() {
+    if (!xcpu_batches.nr_pending) {
+        return false;
+    }
+    for (unsigned i = 0; i < xcpu_batches.nr_pending; ++i) {
+        auto cpu_id = xcpu_batches.pending[i];
+        if (xcpu_batches.batches[cpu_id].count) {
+            flush_cross_cpu_batch(cpu_id);
+        }
+    }
+    xcpu_batches.nr_pending = 0;
+    return true;
 }
 
 bool cpu_pages::drain_cross_cpu_freelist() {
@@ -936,6 +1110,29 @@ void cpu_pages::init_virt_to_phys_map() {
     }
 }
 
+// Sums AnonHugePages over the mappings of this shard's memory.
+size_t cpu_pages::huge_page_backed_memory() {
+    auto start = reinterpret_cast<uintptr_t>(mem());
+    auto end = start + size_t(nr_pages) * page_size;
+    auto f = ::fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return 0;
+    }
+    size_t total = 0;
+    bool ours = false;
+    char line[512];
+    while (::fgets(line, sizeof(line), f)) {
+        unsigned long lo, hi, kb;
+        if (::sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            ours = lo < end && hi > start;
+        } else if (ours && ::sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            total += kb * 1024;
+        }
+    }
+    ::fclose(f);
+    return total;
+}
+
 translation
 cpu_pages::translate(const void* addr, size_t size) {
     auto a = reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(mem());
@@ -999,18 +1196,95 @@ void cpu_pages::resize(size_t new_size, allocate_system_memory_fn alloc_memory)
     }
 }
 
+// Reserves the address space past own_size, already mapped by resize(),
+// for borrowing: all of it is lent, without counting as a donation.
+void cpu_pages::enable_rebalancing(size_t own_size) {
+    auto own_pages = align_down(own_size, huge_page_size) / page_size;
+    rb.lent.reserve(nr_pages / rebalancing::unit_pages + 1);
+    while (rb.capacity(nr_pages) > own_pages && lend()) {
+    }
+    rb.own_pages = rb.capacity(nr_pages);
+    rb.borrow_below = std::max<uint32_t>(2 * min_free_pages, rb.own_pages / 20);
+    rb.donate_above = std::max<uint32_t>(rb.borrow_below + 2 * rebalancing::unit_pages, rb.own_pages / 4);
+    rb.enabled = true;
+}
+
+// Takes a huge page aligned unit off the free lists and gives its pages
+// back to the system.
+bool cpu_pages::lend() {
+    static constexpr unsigned huge_page_pages = huge_page_size / page_size;
+    disable_backtrace_temporarily dbt;
+    auto p = allocate_large_and_trim(rebalancing::unit_pages + huge_page_pages - 1, [=] (unsigned idx, unsigned n) {
+        return trim{align_up(idx, huge_page_pages) - idx, rebalancing::unit_pages};
+    }, false);
+    if (!p) {
+        return false;
+    }
+    ::madvise(p, rebalance_unit, MADV_DONTNEED);
+    rb.lent.push_back(to_page(p) - pages);
+    return true;
+}
+
+void cpu_pages::set_demand(size_t bytes) {
+    if (bytes > rb.demand) {
+        rebalance_demand_bytes.fetch_add(bytes - rb.demand, std::memory_order_relaxed);
+    } else if (bytes < rb.demand) {
+        rebalance_demand_bytes.fetch_sub(rb.demand - bytes, std::memory_order_relaxed);
+    }
+    rb.demand = bytes;
+}
+
+// Puts lent spans back on the free lists, for as much as has been donated,
+// until n_pages more than the borrow watermark are free; asks the other
+// lcores for what is missing.  Returns whether anything was borrowed.
+bool cpu_pages::borrow(unsigned n_pages) {
+    if (!rb.enabled) {
+        return false;
+    }
+    auto target = size_t(rb.borrow_below) + n_pages;
+    bool borrowed = false;
+    while (nr_free_pages < target && !rb.lent.empty()) {
+        auto pool = rebalance_pool_bytes.load(std::memory_order_relaxed);
+        do {
+            if (pool < rebalance_unit) {
+                set_demand(align_up((target - nr_free_pages) * page_size, rebalance_unit));
+                return borrowed;
+            }
+        } while (!rebalance_pool_bytes.compare_exchange_weak(pool, pool - rebalance_unit, std::memory_order_relaxed));
+        auto span = rb.lent.back();
+        rb.lent.pop_back();
+        free_span(span, rebalancing::unit_pages);
+        ++rb.borrows;
+        borrowed = true;
+    }
+    set_demand(0);
+    return borrowed;
+}
+
+bool cpu_pages::rebalance() {
+    if (!rb.enabled) {
+        return false;
+    }
+    if (rb.demand && rebalance_pool_bytes.load(std::memory_order_relaxed) >= rebalance_unit) {
+        return borrow(0);
+    }
+    // A unit at a time, so that a poll stays short
+    if (nr_free_pages >= rb.donate_above + rebalancing::unit_pages
+            && rebalance_pool_bytes.load(std::memory_order_relaxed) < rebalance_demand_bytes.load(std::memory_order_relaxed)
+            && lend()) {
+        rebalance_pool_bytes.fetch_add(rebalance_unit, std::memory_order_relaxed);
+        ++rb.donations;
+        return true;
+    }
+    return false;
+}
+
 reclaiming_result cpu_pages::run_reclaimers(reclaimer_scope scope) {
     auto target = std::max(nr_free_pages + 1, min_free_pages);
     reclaiming_result result = reclaiming_result::reclaimed_nothing;
     while (nr_free_pages < target) {
-        bool made_progress = false;
         ++g_reclaims;
-        for (auto&& r : reclaimers) {
-            if (r->scope() >= scope) {
-                made_progress |= r->do_reclaim() == reclaiming_result::reclaimed_something;
-            }
-        }
-        if (!made_progress) {
+        if (!reclaim_once(scope)) {
             return result;
         }
         result = reclaiming_result::reclaimed_something;
@@ -1033,6 +1307,37 @@ void cpu_pages::schedule_reclaim() {
     });
 }
 
+// Asks reclaimers in order until some priority level of them makes
+// progress: first those over their soft limit, then those without one,
+// then those under their soft limit, each group by priority (reclaimers
+// is kept sorted by priority).
+bool cpu_pages::reclaim_once(reclaimer_scope scope) {
+    enum class tier { over_limit, unlimited, under_limit };
+    auto tier_of = [] (reclaimer* r) {
+        if (!r->has_soft_limit()) {
+            return tier::unlimited;
+        }
+        return r->usage() > r->soft_limit() ? tier::over_limit : tier::under_limit;
+    };
+    for (auto t : { tier::over_limit, tier::unlimited, tier::under_limit }) {
+        // Index based, since a reclaimer may install another one.
+        for (size_t i = 0; i < reclaimers.size(); ) {
+            auto priority = reclaimers[i]->priority();
+            bool made_progress = false;
+            for (; i < reclaimers.size() && reclaimers[i]->priority() == priority; ++i) {
+                auto r = reclaimers[i];
+                if (r->scope() >= scope && tier_of(r) == t) {
+                    made_progress |= r->do_reclaim() == reclaiming_result::reclaimed_something;
+                }
+            }
+            if (made_progress) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 memory::memory_layout cpu_pages::memory_layout() {
     assert(is_initialized());
     return {
@@ -1076,6 +1381,7 @@ small_pool::allocate() {
     auto* obj = _free;
     _free = _free->next;
     --_free_count;
+    ++_use_count;
     return obj;
 }
 
@@ -1085,6 +1391,7 @@ small_pool::deallocate(void* object) {
     o->next = _free;
     _free = o;
     ++_free_count;
+    --_use_count;
     if (_free_count >= _max_free) {
         trim_free_list();
     }
@@ -1156,6 +1463,17 @@ float small_pool::waste() {
     return (span_bytes() % _object_size) / (1.0 * span_bytes());
 }
 
+memory::small_pool_statistics small_pool::statistics() {
+    memory::small_pool_statistics s;
+    s.object_size = _object_size;
+    s.span_size = span_bytes();
+    s.use_count = _use_count;
+    s.free_count = _free_count;
+    s.spans_in_use = _spans_in_use;
+    s.waste = waste();
+    return s;
+}
+
 void
 abort_on_underflow(size_t size) {
     if (std::make_signed_t<size_t>(size) < 0) {
@@ -1254,10 +1572,15 @@ void set_reclaim_hook(std::function<void (std::function<void ()>)> hook) {
     cpu_mem.set_reclaim_hook(hook);
 }
 
-reclaimer::reclaimer(reclaim_fn reclaim, reclaimer_scope scope)
+reclaimer::reclaimer(reclaim_fn reclaim, reclaimer_scope scope, unsigned priority)
     : _reclaim(std::move(reclaim))
-    , _scope(scope) {
-    cpu_mem.reclaimers.push_back(this);
+    , _scope(scope)
+    , _priority(priority) {
+    auto& r = cpu_mem.reclaimers;
+    auto i = std::upper_bound(r.begin(), r.end(), this, [] (reclaimer* a, reclaimer* b) {
+        return a->priority() < b->priority();
+    });
+    r.insert(i, this);
 }
 
 reclaimer::~reclaimer() {
@@ -1265,11 +1588,125 @@ reclaimer::~reclaimer() {
     r.erase(std::find(r.begin(), r.end(), this));
 }
 
+#ifdef HAVE_NUMA
+
+// Nodes the process may allocate from
+static unsigned long allowed_nodes() {
+    static unsigned long mask = [] {
+        unsigned long m = 0;
+        if (::get_mempolicy(nullptr, &m, std::numeric_limits<unsigned long>::digits, nullptr, MPOL_F_MEMS_ALLOWED) == -1) {
+            m = 1;
+        }
+        return m;
+    }();
+    return mask;
+}
+
+static bool numa_mode(numa_policy policy, unsigned node, int& mode, unsigned long& nodemask) {
+    switch (policy) {
+    case numa_policy::none:
+        return false;
+    case numa_policy::preferred:
+        mode = MPOL_PREFERRED;
+        nodemask = 1UL << node;
+        return true;
+    case numa_policy::bind:
+        mode = MPOL_BIND;
+        nodemask = 1UL << node;
+        return true;
+    case numa_policy::interleave:
+        mode = MPOL_INTERLEAVE;
+        nodemask = allowed_nodes();
+        return true;
+    }
+    return false;
+}
+
+#endif
+
+bool set_numa_policy(void* start, size_t len, numa_policy policy, unsigned node) {
+#ifdef HAVE_NUMA
+    int mode;
+    unsigned long nodemask;
+    if (!numa_mode(policy, node, mode, nodemask)) {
+        return true;
+    }
+    auto r = ::mbind(start, len, mode, &nodemask, std::numeric_limits<unsigned long>::digits, MPOL_MF_MOVE);
+    if (r == -1) {
+        char err[1000] = {};
+        strerror_r(errno, err, sizeof(err));
+        std::cerr << "WARNING: unable to mbind memory; performance may suffer: "
+                << err << std::endl;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool set_thread_numa_policy(numa_policy policy, unsigned node) {
+#ifdef HAVE_NUMA
+    int mode = MPOL_DEFAULT;
+    unsigned long nodemask = 0;
+    numa_mode(policy, node, mode, nodemask);
+    return ::set_mempolicy(mode, mode == MPOL_DEFAULT ? nullptr : &nodemask,
+            std::numeric_limits<unsigned long>::digits) == 0;
+#else
+    return false;
+#endif
+}
+
+unsigned home_numa_node() {
+    return cpu_mem.home_node;
+}
+
+size_t numa_placement::remote_bytes() const {
+    size_t total = 0;
+    for (unsigned i = 0; i < bytes_per_node.size(); ++i) {
+        if (i != home_node) {
+            total += bytes_per_node[i];
+        }
+    }
+    return total;
+}
+
+numa_placement get_numa_placement() {
+    numa_placement p;
+    p.home_node = cpu_mem.home_node;
+#ifdef HAVE_NUMA
+    auto n = cpu_mem.nr_pages * page_size / huge_page_size;
+    std::vector<void*> addrs(n);
+    std::vector<int> status(n);
+    for (size_t i = 0; i < n; ++i) {
+        addrs[i] = cpu_mem.mem() + i * huge_page_size;
+    }
+    if (n && ::move_pages(0, n, addrs.data(), nullptr, status.data(), 0) == 0) {
+        for (auto s : status) {
+            if (s < 0) {
+                p.not_present += huge_page_size;
+                continue;
+            }
+            if (size_t(s) >= p.bytes_per_node.size()) {
+                p.bytes_per_node.resize(s + 1);
+            }
+            p.bytes_per_node[s] += huge_page_size;
+        }
+    }
+#endif
+    return p;
+}
+
 void configure(std::vector<resource::memory> m,
-        optional<std::string> hugetlbfs_path) {
+        optional<std::string> hugetlbfs_path, numa_policy shard_policy, size_t rebalance_headroom) {
     size_t total = 0;
+    size_t most = 0;
     for (auto&& x : m) {
         total += x.bytes;
+        if (x.bytes > most) {
+            most = x.bytes;
+            cpu_mem.home_node = x.nodeid;
+        }
     }
     allocate_system_memory_fn sys_alloc = allocate_anonymous_memory;
     if (hugetlbfs_path) {
@@ -1280,40 +1717,153 @@ void configure(std::vector<resource::memory> m,
             return allocate_hugetlbfs_memory(*fdp, where, how_much);
         };
         cpu_mem.replace_memory_backing(sys_alloc);
+        cpu_mem.align_huge_spans = false;
+        cpu_mem.backing_file = fdp;
+    }
+    if (hugetlbfs_path) {
+        // Huge pages can't be given back to the system page by page
+        rebalance_headroom = 0;
     }
-    cpu_mem.resize(total, sys_alloc);
+    // The headroom must stay within this lcore's range of addresses
+    auto address_range = size_t(1) << cpu_id_shift;
+    rebalance_headroom = std::min(rebalance_headroom, address_range - std::min(total, address_range));
+    cpu_mem.resize(total + rebalance_headroom, sys_alloc);
     size_t pos = 0;
     for (auto&& x : m) {
-#ifdef HAVE_NUMA
-        unsigned long nodemask = 1UL << x.nodeid;
-        auto r = ::mbind(cpu_mem.mem() + pos, x.bytes,
-                        MPOL_PREFERRED,
-                        &nodemask, std::numeric_limits<unsigned long>::digits,
-                        MPOL_MF_MOVE);
-
-        if (r == -1) {
-            char err[1000] = {};
-            strerror_r(errno, err, sizeof(err));
-            std::cerr << "WARNING: unable to mbind shard memory; performance may suffer: "
-                    << err << std::endl;
-        }
-#endif
+        set_numa_policy(cpu_mem.mem() + pos, x.bytes, shard_policy, x.nodeid);
         pos += x.bytes;
     }
+    if (rebalance_headroom) {
+        set_numa_policy(cpu_mem.mem() + pos, cpu_mem.nr_pages * page_size - pos, shard_policy, cpu_mem.home_node);
+        cpu_mem.enable_rebalancing(total);
+    }
     if (hugetlbfs_path) {
         cpu_mem.init_virt_to_phys_map();
     }
 }
 
+void set_rebalancing_watermarks(size_t borrow_below, size_t donate_above) {
+    auto& rb = cpu_mem.rb;
+    if (!rb.enabled) {
+        return;
+    }
+    rb.borrow_below = std::max<size_t>(borrow_below / page_size, cpu_pages::min_free_pages);
+    // Far enough apart that a donation can't push the donor below the
+    // borrow watermark
+    rb.donate_above = std::max<size_t>(donate_above / page_size, rb.borrow_below + 2 * cpu_pages::rebalancing::unit_pages);
+}
+
+bool rebalance() {
+    return cpu_mem.rebalance();
+}
+
+rebalancing_statistics rebalancing_stats() {
+    auto& rb = cpu_mem.rb;
+    rebalancing_statistics s;
+    if (!rb.enabled) {
+        return s;
+    }
+    auto capacity = rb.capacity(cpu_mem.nr_pages);
+    s.donated_bytes = size_t(rb.own_pages - std::min(rb.own_pages, capacity)) * page_size;
+    s.borrowed_bytes = size_t(capacity - std::min(rb.own_pages, capacity)) * page_size;
+    s.donations = rb.donations;
+    s.borrows = rb.borrows;
+    s.pool_bytes = rebalance_pool_bytes.load(std::memory_order_relaxed);
+    s.demand_bytes = rebalance_demand_bytes.load(std::memory_order_relaxed);
+    return s;
+}
+
 statistics stats() {
-    return statistics{g_allocs, g_frees, g_cross_cpu_frees,
-        cpu_mem.nr_pages * page_size, cpu_mem.nr_free_pages * page_size, g_reclaims};
+    // Lent spans are neither this lcore's memory nor allocated
+    return statistics{g_allocs, g_frees, g_cross_cpu_frees, g_cross_cpu_free_flushes,
+        size_t(cpu_mem.rb.capacity(cpu_mem.nr_pages)) * page_size, cpu_mem.nr_free_pages * page_size, g_reclaims};
 }
 
 bool drain_cross_cpu_freelist() {
     return cpu_mem.drain_cross_cpu_freelist();
 }
 
+void set_cross_cpu_free_batching(bool enable) {
+    if (!enable) {
+        cpu_mem.flush_cross_cpu_frees();
+    }
+    cpu_mem.xcpu_batches.enabled = enable;
+}
+
+bool flush_cross_cpu_frees() {
+    return cpu_mem.flush_cross_cpu_frees();
+}
+
+unsigned small_pool_count() {
+    return small_pool_array::nr_small_pools;
+}
+
+std::vector<heap_profile_site> get_heap_profile() {
+    // Don't sample our own allocations, or modify the set we walk.
+    auto old = std::exchange(cpu_mem.collect_backtrace, false);
+    auto restore = defer([old] { cpu_mem.collect_backtrace = old; });
+    std::vector<heap_profile_site> ret;
+    ret.reserve(cpu_mem.asu.alloc_sites.size());
+    for (auto&& s : cpu_mem.asu.alloc_sites) {
+        ret.push_back(heap_profile_site{s.count, s.size, s.total_count, s.total_size, s.backtrace});
+    }
+    return ret;
+}
+
+small_pool_statistics small_pool_stats(unsigned idx) {
+    return cpu_mem.small_pools[idx].statistics();
+}
+
+free_span_statistics free_span_stats() {
+    static_assert(free_span_statistics::nr_lists == cpu_pages::nr_span_lists, "free span list count mismatch");
+    free_span_statistics s;
+    for (unsigned i = 0; i < cpu_pages::nr_span_lists; ++i) {
+        cpu_mem.fsu.free_spans[i].for_each(cpu_mem.pages, [&] (page& span) {
+            s.spans[i] += 1;
+            s.pages[i] += span.span_size;
+        });
+    }
+    return s;
+}
+
+void dump_statistics(std::ostream& os) {
+    auto st = stats();
+    os << "total " << st.total_memory() << " free " << st.free_memory()
+       << " mallocs " << st.mallocs() << " frees " << st.frees()
+       << " cross_cpu_frees " << st.cross_cpu_frees() << " reclaims " << st.reclaims() << "\n";
+    os << "small pools: object_size use_count free_count unused_in_spans spans_in_use span_size memory waste\n";
+    for (unsigned i = 0; i < small_pool_count(); ++i) {
+        auto s = small_pool_stats(i);
+        if (!s.spans_in_use) {
+            continue;
+        }
+        os << "  " << s.object_size << " " << s.use_count << " " << s.free_count << " " << s.unused_in_spans()
+           << " " << s.spans_in_use << " " << s.span_size << " " << s.memory() << " " << s.waste << "\n";
+    }
+    auto f = free_span_stats();
+    os << "free spans: min_pages spans pages\n";
+    for (unsigned i = 0; i < free_span_statistics::nr_lists; ++i) {
+        if (f.spans[i]) {
+            os << "  " << (size_t(1) << i) << " " << f.spans[i] << " " << f.pages[i] << "\n";
+        }
+    }
+    auto numa = get_numa_placement();
+    os << "numa: home node " << numa.home_node << " not present " << numa.not_present << "\n";
+    for (unsigned i = 0; i < numa.bytes_per_node.size(); ++i) {
+        os << "  node " << i << " " << numa.bytes_per_node[i] << "\n";
+    }
+    os << "reclaimers: priority usage soft_limit calls successes\n";
+    for (auto r : cpu_mem.reclaimers) {
+        os << "  " << r->priority() << " " << r->usage() << " ";
+        if (r->has_soft_limit()) {
+            os << r->soft_limit();
+        } else {
+            os << "-";
+        }
+        os << " " << r->calls() << " " << r->successes() << "\n";
+    }
+}
+
 translation
 translate(const void* addr, size_t size) {
     auto cpu_id = object_cpu_id(addr);
@@ -1331,6 +1881,17 @@ memory_layout get_memory_layout() {
     return cpu_mem.memory_layout();
 }
 
+std::experimental::optional<int> memory_backing_fd() {
+    if (!cpu_mem.backing_file) {
+        return {};
+    }
+    return cpu_mem.backing_file->get();
+}
+
+size_t huge_page_backed_memory() {
+    return cpu_mem.huge_page_backed_memory();
+}
+
 }
 
 using namespace memory;
@@ -1618,7 +2179,8 @@ void enable_abort_on_allocation_failure() {
     seastar_logger.warn("Seastar compiled with default allocator, will not abort on bad_alloc");
 }
 
-reclaimer::reclaimer(reclaim_fn reclaim, reclaimer_scope) {
+reclaimer::reclaimer(reclaim_fn reclaim, reclaimer_scope, unsigned priority)
+    : _priority(priority) {
 }
 
 reclaimer::~reclaimer() {
@@ -1627,17 +2189,56 @@ reclaimer::~reclaimer() {
 void set_reclaim_hook(std::function<void (std::function<void ()>)> hook) {
 }
 
-void configure(std::vector<resource::memory> m, std::experimental::optional<std::string> hugepages_path) {
+void configure(std::vector<resource::memory> m, std::experimental::optional<std::string> hugepages_path,
+        numa_policy shard_policy, size_t rebalance_headroom) {
+}
+
+void set_rebalancing_watermarks(size_t borrow_below, size_t donate_above) {
+}
+
+bool rebalance() {
+    return false;
+}
+
+rebalancing_statistics rebalancing_stats() {
+    return {};
+}
+
+bool set_numa_policy(void* start, size_t len, numa_policy policy, unsigned node) {
+    return false;
+}
+
+bool set_thread_numa_policy(numa_policy policy, unsigned node) {
+    return false;
+}
+
+unsigned home_numa_node() {
+    return 0;
+}
+
+size_t numa_placement::remote_bytes() const {
+    return 0;
+}
+
+numa_placement get_numa_placement() {
+    return {};
 }
 
 statistics stats() {
-    return statistics{0, 0, 0, 1 << 30, 1 << 30, 0};
+    return statistics{0, 0, 0, 0, 1 << 30, 1 << 30, 0};
 }
 
 bool drain_cross_cpu_freelist() {
     return false;
 }
 
+void set_cross_cpu_free_batching(bool enable) {
+}
+
+bool flush_cross_cpu_frees() {
+    return false;
+}
+
 translation
 translate(const void* addr, size_t size) {
     return {};
@@ -1647,6 +2248,41 @@ memory_layout get_memory_layout() {
     throw std::runtime_error("get_memory_layout() not supported");
 }
 
+std::experimental::optional<int> memory_backing_fd() {
+    return {};
+}
+
+size_t huge_page_backed_memory() {
+    return 0;
+}
+
+unsigned small_pool_count() {
+    return 0;
+}
+
+void set_heap_profiling_sample_interval(size_t bytes) {
+}
+
+size_t heap_profiling_sample_interval() {
+    return 0;
+}
+
+std::vector<heap_profile_site> get_heap_profile() {
+    return {};
+}
+
+small_pool_statistics small_pool_stats(unsigned idx) {
+    throw std::runtime_error("small_pool_stats() not supported");
+}
+
+free_span_statistics free_span_stats() {
+    return {};
+}
+
+void dump_statistics(std::ostream& os) {
+    os << "memory statistics not supported with the default allocator\n";
+}
+
 }
 
 void* operator new(size_t size, with_alignment wa) {
@@ -26,6 +26,9 @@
 #include <new>
 #include <functional>
 #include <vector>
+#include <iosfwd>
+#include <limits>
+#include <experimental/optional>
 
 
 /// \defgroup memory-module Memory management
@@ -57,8 +60,33 @@ static constexpr size_t page_bits = 12;
 static constexpr size_t page_size = 1 << page_bits;       // 4K
 static constexpr size_t huge_page_size = 512 * page_size; // 2M
 
+/// NUMA placement policy for a category of memory.
+enum class numa_policy {
+    none,        ///< leave placement to the kernel (the node of first touch)
+    preferred,   ///< prefer the home node, fall back to other nodes
+    bind,        ///< only the home node
+    interleave,  ///< interleave pages over all nodes the process may use
+};
+
+/// \param rebalance_headroom memory this lcore may borrow from the others
+///        beyond its own share, see \ref rebalance(); 0 disables borrowing
+///        and donating
 void configure(std::vector<resource::memory> m,
-        std::experimental::optional<std::string> hugetlbfs_path = {});
+        std::experimental::optional<std::string> hugetlbfs_path = {},
+        numa_policy shard_policy = numa_policy::preferred,
+        size_t rebalance_headroom = 0);
+
+/// Applies \c policy, relative to home node \c node, to [start, start +
+/// len), moving pages already faulted in.  Returns false if NUMA policies
+/// are not supported; logs and returns false if the kernel refused.
+bool set_numa_policy(void* start, size_t len, numa_policy policy, unsigned node);
+
+/// Applies \c policy to future page faults of the calling thread, such as
+/// on its stack.
+bool set_thread_numa_policy(numa_policy policy, unsigned node);
+
+/// NUMA node from which most of this shard's memory was allocated.
+unsigned home_numa_node();
 
 void enable_abort_on_allocation_failure();
 
@@ -70,6 +98,28 @@ class disable_abort_on_alloc_failure_temporarily {
 
 void set_heap_profiling_enabled(bool);
 
+/// Samples the heap profile instead of recording every allocation: on
+/// average one allocation per \c bytes allocated records its backtrace,
+/// with the samples spaced like a Poisson process, so large objects are
+/// sampled more often than small ones.  0 records every allocation.
+/// Profiling must still be enabled with \ref set_heap_profiling_enabled(),
+/// and allocation sites are only recorded in SEASTAR_HEAPPROF builds.
+void set_heap_profiling_sample_interval(size_t bytes);
+size_t heap_profiling_sample_interval();
+
+/// A call site in the heap profile of this lcore.  With sampling, the
+/// counts are those of the sampled allocations only.
+struct heap_profile_site {
+    size_t live_count;
+    size_t live_size;
+    size_t total_count;
+    size_t total_size;
+    std::vector<uintptr_t> backtrace;
+};
+
+/// Copies the heap profile of this lcore.
+std::vector<heap_profile_site> get_heap_profile();
+
 void* allocate_reclaimable(size_t size);
 
 enum class reclaiming_result {
@@ -99,16 +149,49 @@ enum class reclaimer_scope {
 class reclaimer {
 public:
     using reclaim_fn = std::function<reclaiming_result ()>;
+    using usage_fn = std::function<size_t ()>;
 private:
     reclaim_fn _reclaim;
     reclaimer_scope _scope;
+    unsigned _priority;
+    usage_fn _usage;
+    size_t _soft_limit = std::numeric_limits<size_t>::max();
+    uint64_t _calls = 0;
+    uint64_t _successes = 0;
 public:
     // Installs new reclaimer which will be invoked when system is falling
     // low on memory. 'scope' determines when reclaimer can be executed.
-    reclaimer(reclaim_fn reclaim, reclaimer_scope scope = reclaimer_scope::async);
+    //
+    // Reclaimers are asked for memory in increasing 'priority' order;
+    // those of a higher priority are only asked once all reclaimers of
+    // lower priorities failed to reclaim anything.
+    reclaimer(reclaim_fn reclaim, reclaimer_scope scope = reclaimer_scope::async, unsigned priority = 0);
     ~reclaimer();
-    reclaiming_result do_reclaim() { return _reclaim(); }
+    reclaiming_result do_reclaim() {
+        ++_calls;
+        auto r = _reclaim();
+        if (r == reclaiming_result::reclaimed_something) {
+            ++_successes;
+        }
+        return r;
+    }
     reclaimer_scope scope() const { return _scope; }
+    unsigned priority() const { return _priority; }
+    // Accounts the memory of the reclaimer's subsystem, as reported by
+    // 'usage', against a soft limit.  Above the limit the reclaimer is asked
+    // before any other, regardless of priority; below it, only after all
+    // reclaimers without a soft limit failed, so that a burst elsewhere
+    // does not evict the subsystem's working set.
+    void set_soft_limit(size_t soft_limit, usage_fn usage) {
+        _soft_limit = soft_limit;
+        _usage = std::move(usage);
+    }
+    bool has_soft_limit() const { return bool(_usage); }
+    size_t soft_limit() const { return _soft_limit; }
+    size_t usage() const { return _usage ? _usage() : 0; }
+    // Number of times the reclaimer was asked for memory, and gave some.
+    uint64_t calls() const { return _calls; }
+    uint64_t successes() const { return _successes; }
 };
 
 // Call periodically to recycle objects that were freed
@@ -117,6 +200,16 @@ class reclaimer {
 // Returns @true if any work was actually performed.
 bool drain_cross_cpu_freelist();
 
+// While enabled, objects freed on this cpu that belong to other cpus are
+// collected per owner and handed over in batches by flush_cross_cpu_frees(),
+// which must then be called periodically; disabling flushes them.
+void set_cross_cpu_free_batching(bool enable);
+
+// Hands the batched cross-cpu frees to their owners.
+//
+// Returns @true if any work was actually performed.
+bool flush_cross_cpu_frees();
+
 
 // We don't want the memory code calling back into the rest of
 // the system, so allow the rest of the system to tell the memory
@@ -155,13 +248,15 @@ class statistics {
     uint64_t _mallocs;
     uint64_t _frees;
     uint64_t _cross_cpu_frees;
+    uint64_t _cross_cpu_free_flushes;
     size_t _total_memory;
     size_t _free_memory;
     uint64_t _reclaims;
 private:
-    statistics(uint64_t mallocs, uint64_t frees, uint64_t cross_cpu_frees,
+    statistics(uint64_t mallocs, uint64_t frees, uint64_t cross_cpu_frees, uint64_t cross_cpu_free_flushes,
             uint64_t total_memory, uint64_t free_memory, uint64_t reclaims)
         : _mallocs(mallocs), _frees(frees), _cross_cpu_frees(cross_cpu_frees)
+        , _cross_cpu_free_flushes(cross_cpu_free_flushes)
         , _total_memory(total_memory), _free_memory(free_memory), _reclaims(reclaims) {}
 public:
     /// Total number of memory allocations calls since the system was started.
@@ -171,6 +266,9 @@ class statistics {
     /// Total number of memory deallocations that occured on a different lcore
     /// than the one on which they were allocated.
     uint64_t cross_cpu_frees() const { return _cross_cpu_frees; }
+    /// Number of atomic hand-overs of cross-cpu frees to their owners; each
+    /// carries one or more objects when frees are batched.
+    uint64_t cross_cpu_free_flushes() const { return _cross_cpu_free_flushes; }
     /// Total number of objects which were allocated but not freed.
     size_t live_objects() const { return mallocs() - frees(); }
     /// Total free memory (in bytes)
@@ -184,6 +282,102 @@ class statistics {
     friend statistics stats();
 };
 
+/// Statistics of one small-object pool (size class) of this lcore.
+struct small_pool_statistics {
+    /// Size of each object, in bytes.
+    size_t object_size;
+    /// Size of each span the pool carves objects from, in bytes.
+    size_t span_size;
+    /// Number of objects allocated and not freed.
+    size_t use_count;
+    /// Number of objects on the pool's own free list.
+    size_t free_count;
+    /// Number of spans the pool holds.
+    size_t spans_in_use;
+    /// Fraction of each span lost to rounding to the object size.
+    float waste;
+    /// Memory held by the pool, in bytes.
+    size_t memory() const { return spans_in_use * span_size; }
+    /// Free objects left in partly used spans; a high count relative to
+    /// \ref use_count means the pool is fragmented.
+    size_t unused_in_spans() const {
+        return spans_in_use * (span_size / object_size) - use_count - free_count;
+    }
+};
+
+/// Number of small-object pools; zero with the default allocator.
+unsigned small_pool_count();
+/// Statistics of small-object pool \c idx, which is below \ref small_pool_count().
+small_pool_statistics small_pool_stats(unsigned idx);
+
+/// Free large spans of this lcore, by size.  List \c i holds spans of at
+/// least 2^i and less than 2^(i+1) pages.
+struct free_span_statistics {
+    static constexpr unsigned nr_lists = 32;
+    size_t spans[nr_lists] = {};
+    size_t pages[nr_lists] = {};
+};
+
+/// Walks the free span lists; takes time proportional to the number of
+/// free spans.
+free_span_statistics free_span_stats();
+
+/// Free memory below which this lcore borrows memory donated by the
+/// others, and above which it donates what they ask for; see
+/// \ref rebalance().
+void set_rebalancing_watermarks(size_t borrow_below, size_t donate_above);
+
+/// Lets memory follow load between lcores.  Every lcore owns a fixed
+/// range of addresses, from which \ref object_cpu_id() is computed, so what
+/// moves between them is the physical memory behind whole free spans, not
+/// the spans themselves: an lcore donates a span by keeping it allocated
+/// and returning its pages to the system, and one that runs low on free
+/// memory borrows by putting an equal amount of its reserved address space
+/// (see \ref configure()) on its free lists.  Borrowing happens in the
+/// allocator; donating is cooperative, and happens here, when other lcores
+/// have asked for memory and this one has more free than the donate
+/// watermark.  Called by the reactor on every poll; cheap when there is
+/// nothing to do.  Returns whether it did anything.
+bool rebalance();
+
+struct rebalancing_statistics {
+    /// Memory of this lcore's own share given to others, and borrowed
+    /// beyond it
+    size_t donated_bytes = 0;
+    size_t borrowed_bytes = 0;
+    /// Spans donated and borrowed since startup
+    uint64_t donations = 0;
+    uint64_t borrows = 0;
+    /// Donated memory not yet borrowed, and memory asked for by lcores
+    /// under pressure; both shared by all lcores
+    size_t pool_bytes = 0;
+    size_t demand_bytes = 0;
+};
+
+rebalancing_statistics rebalancing_stats();
+
+/// Writes \ref stats(), the pools in use and the free span lists of this
+/// lcore to \c os in human-readable form.
+void dump_statistics(std::ostream& os);
+
+/// Where the pages of this lcore's memory live, estimated by looking up
+/// one page per huge page of memory.
+struct numa_placement {
+    unsigned home_node = 0;
+    /// Indexed by node.
+    std::vector<size_t> bytes_per_node;
+    /// Memory not yet faulted in.
+    size_t not_present = 0;
+    size_t local_bytes() const {
+        return home_node < bytes_per_node.size() ? bytes_per_node[home_node] : 0;
+    }
+    size_t remote_bytes() const;
+};
+
+/// Samples the placement of this lcore's memory; costs a system call
+/// proportional to its size.  Empty if NUMA is not supported.
+numa_placement get_numa_placement();
+
 struct memory_layout {
     uintptr_t start;
     uintptr_t end;
@@ -193,6 +387,18 @@ struct memory_layout {
 // Supported only when seastar allocator is enabled.
 memory::memory_layout get_memory_layout();
 
+// The descriptor of the hugetlbfs file backing this shard's memory, if it
+// was configured with one: get_memory_layout()'s range maps the file from
+// offset 0, shared, so that another process mapping it sees the same
+// memory (a vhost-user network backend does, to reach packet buffers).
+// The shard owns the descriptor.  Empty for anonymous memory.
+std::experimental::optional<int> memory_backing_fd();
+
+// Bytes of this shard's memory backed by transparent huge pages, read from
+// /proc/self/smaps; don't call it on a hot path.  Returns 0 with the
+// default allocator, and for hugetlbfs backed memory.
+size_t huge_page_backed_memory();
+
 }
 
 class with_alignment {
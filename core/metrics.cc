@@ -21,6 +21,10 @@
 
 #include "metrics.hh"
 #include "metrics_api.hh"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <mutex>
 
 namespace seastar {
 namespace metrics {
@@ -39,10 +43,80 @@ metric_definition::metric_definition(impl::metric_definition_impl const& m) :
     _impl(std::make_unique<impl::metric_definition_impl>(m)) {
 }
 
+histogram& histogram::operator+=(const histogram& c) {
+    if (buckets.empty()) {
+        buckets = c.buckets;
+    } else {
+        assert(buckets.size() == c.buckets.size());
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            buckets[i].count += c.buckets[i].count;
+        }
+    }
+    sample_count += c.sample_count;
+    sample_sum += c.sample_sum;
+    return *this;
+}
+
+histogram histogram::operator+(const histogram& c) const {
+    histogram res = *this;
+    res += c;
+    return res;
+}
+
+namespace {
+
+// The values of a shard's counters, in pages of their own. Freed slots
+// are reused, and pages are kept until the shard exits.
+class counter_arena {
+    static constexpr size_t page_size = 4096;
+    std::vector<uint64_t*> _free;
+public:
+    uint64_t* allocate() {
+        if (_free.empty()) {
+            void* page = ::aligned_alloc(page_size, page_size);
+            if (!page) {
+                throw std::bad_alloc();
+            }
+            auto slots = static_cast<uint64_t*>(page);
+            auto n = page_size / sizeof(uint64_t);
+            _free.reserve(_free.size() + n);
+            // Hand out the page's slots in address order
+            for (size_t i = n; i > 0; --i) {
+                _free.push_back(&slots[i - 1]);
+            }
+        }
+        auto slot = _free.back();
+        _free.pop_back();
+        *slot = 0;
+        return slot;
+    }
+    void free(uint64_t* slot) {
+        _free.push_back(slot);
+    }
+    // Never destroyed, as counters of thread_local objects may outlive it
+    static counter_arena& local() {
+        static thread_local counter_arena* arena = new counter_arena;
+        return *arena;
+    }
+};
+
+}
+
+counter::counter() : _value(counter_arena::local().allocate()) {
+}
+
+counter::~counter() {
+    if (_value) {
+        counter_arena::local().free(_value);
+    }
+}
+
 namespace impl {
 
-registered_metric::registered_metric(data_type type, metric_function f, description d, bool enabled) :
-        _type(type), _d(d), _enabled(enabled), _f(f), _impl(get_local_impl()) {
+registered_metric::registered_metric(data_type type, metric_function f, description d, bool enabled,
+        aggregation a, const uint64_t* counter_value) :
+        _type(type), _d(d), _enabled(enabled), _f(f), _impl(get_local_impl()), _aggregation(a),
+        _counter_value(counter_value) {
 }
 
 metric_value metric_value::operator+(const metric_value& c) {
@@ -54,6 +128,9 @@ metric_value metric_value::operator+(const metric_value& c) {
     case data_type::DERIVE:
         res.u._i += c.u._i;
         break;
+    case data_type::HISTOGRAM:
+        res._hist += c._hist;
+        break;
     default:
         res.u._ui += c.u._ui;
         break;
@@ -71,35 +148,80 @@ std::unique_ptr<metric_id> get_id(group_name_type group, instance_id_type instan
     return std::make_unique<metric_id>(group, instance, name, iht);
 }
 
+// Never destroyed, as ids of thread_local objects may outlive it
+static std::mutex& interned_strings_mutex() {
+    static auto mutex = new std::mutex;
+    return *mutex;
+}
+
+static std::unordered_map<sstring, std::atomic<size_t>>& interned_strings() {
+    static auto table = new std::unordered_map<sstring, std::atomic<size_t>>;
+    return *table;
+}
+
+interned_string::entry* interned_string::intern(const sstring& s) {
+    std::lock_guard<std::mutex> g(interned_strings_mutex());
+    auto& e = *interned_strings().emplace(std::piecewise_construct, std::forward_as_tuple(s), std::forward_as_tuple(0)).first;
+    e.second.fetch_add(1, std::memory_order_relaxed);
+    return &e;
+}
+
+void interned_string::release(entry* e) noexcept {
+    auto refs = e->second.load(std::memory_order_relaxed);
+    while (refs > 1) {
+        if (e->second.compare_exchange_weak(refs, refs - 1, std::memory_order_relaxed)) {
+            return;
+        }
+    }
+    // Possibly the last reference; dropping it under the lock keeps
+    // intern() from finding the entry as it is erased
+    std::lock_guard<std::mutex> g(interned_strings_mutex());
+    if (e->second.fetch_sub(1, std::memory_order_relaxed) == 1) {
+        interned_strings().erase(e->first);
+    }
+}
+
 metric_groups_impl::~metric_groups_impl() {
-    for (auto i : _registration) {
+    for (auto& i : _registration) {
         unregister_metric(i);
     }
 }
 
-metric_groups_impl& metric_groups_impl::add_metric(group_name_type name, const metric_definition& md)  {
-
-    metric_id id(name, md._impl->id, md._impl->name, md._impl->type.type_name);
+void metric_groups_impl::add_metric(const interned_string& group, const metric_definition_impl& md) {
+    metric_id id(group, md.id, md.name, md.type.type_name);
 
     shared_ptr<registered_metric> rm =
-            ::make_shared<registered_metric>(md._impl->type.base_type, md._impl->f, md._impl->d, md._impl->enabled);
+            ::make_shared<registered_metric>(md.type.base_type, md.f, md.d, md.enabled,
+                    md.aggregate_by, md.counter_value);
 
     get_local_impl()->add_registration(id, rm);
 
-    _registration.push_back(id);
+    _registration.push_back(std::move(id));
+}
+
+metric_groups_impl& metric_groups_impl::add_metric(group_name_type name, const metric_definition& md)  {
+    add_metric(interned_string(name), *md._impl);
     return *this;
 }
 
+// Registers the metrics of a group in bulk: its name is interned once,
+// and room is made for all of them up front
 metric_groups_impl& metric_groups_impl::add_group(group_name_type name, const std::vector<metric_definition>& l) {
+    interned_string group(name);
+    get_local_impl()->reserve(l.size());
+    _registration.reserve(_registration.size() + l.size());
     for (auto i = l.begin(); i != l.end(); ++i) {
-        add_metric(name, *(i->_impl.get()));
+        add_metric(group, *(i->_impl.get()));
     }
     return *this;
 }
 
 metric_groups_impl& metric_groups_impl::add_group(group_name_type name, const std::initializer_list<metric_definition>& l) {
+    interned_string group(name);
+    get_local_impl()->reserve(l.size());
+    _registration.reserve(_registration.size() + l.size());
     for (auto i = l.begin(); i != l.end(); ++i) {
-        add_metric(name, *i);
+        add_metric(group, *i->_impl);
     }
     return *this;
 }
@@ -113,15 +235,6 @@ bool metric_id::operator<(
                     id2.inherit_type());
 }
 
-bool metric_id::operator==(
-        const metric_id & id2) const {
-    auto& id1 = *this;
-    return std::tie(id1.group_name(), id1.instance_id(), id1.name(),
-            id1.inherit_type())
-            == std::tie(id2.group_name(), id2.instance_id(), id2.name(),
-                    id2.inherit_type());
-}
-
 // Unfortunately, metrics_impl can not be shared because it
 // need to be available before the first users (reactor) will call it
 
@@ -131,11 +244,7 @@ shared_ptr<impl>  get_local_impl() {
 }
 
 void unregister_metric(const metric_id & id) {
-    value_map& map = get_local_impl()->get_value_map();
-    auto i = map.find(id);
-    if (i != map.end()) {
-        i->second = nullptr;
-    }
+    get_local_impl()->remove_registration(id);
 }
 
 const value_map& get_value_map() {
@@ -145,7 +254,7 @@ const value_map& get_value_map() {
 values_copy get_values() {
     values_copy res;
 
-    for (auto i : get_local_impl()->get_value_map()) {
+    for (auto& i : get_local_impl()->get_value_map()) {
         if (i.second.get() && i.second->is_enabled()) {
             res[i.first] = (*(i.second))();
         }
@@ -158,8 +267,71 @@ instance_id_type shard() {
     return to_sstring(engine().cpu_id());
 }
 
+// Prometheus names match [a-zA-Z_:][a-zA-Z0-9_:]*; dashes and spaces
+// become underscores and "+()" is dropped, as the exporter always did,
+// and anything else invalid becomes an underscore
+static sstring export_name(const sstring& name) {
+    std::string res;
+    for (auto c : name) {
+        if (c == '+' || c == '(' || c == ')') {
+            continue;
+        }
+        res += isalnum(static_cast<unsigned char>(c)) || c == ':' ? c : '_';
+    }
+    return sstring(res.data(), res.size());
+}
+
+static sstring escape_label_value(const sstring& value) {
+    std::string res;
+    for (auto c : value) {
+        if (c == '\\' || c == '"') {
+            res += '\\';
+            res += c;
+        } else if (c == '\n') {
+            res += "\\n";
+        } else {
+            res += c;
+        }
+    }
+    return sstring(res.data(), res.size());
+}
+
+static void remove_from_family(metric_family_map& families, const registered_metric& rm) {
+    auto f = families.find(rm.export_name());
+    if (f == families.end()) {
+        return;
+    }
+    auto& members = f->second;
+    members.erase(std::remove_if(members.begin(), members.end(), [&rm] (auto& m) {
+        return m.get() == &rm;
+    }), members.end());
+    if (members.empty()) {
+        families.erase(f);
+    }
+}
+
 void impl::add_registration(const metric_id& id, shared_ptr<registered_metric> rm) {
-    _value_map[id] = rm;
+    rm->_id = id;
+    rm->_export_name = export_name(id.group_name() + "_" + id.name());
+    rm->_export_labels = "type=\"" + escape_label_value(id.inherit_type()) + "\"";
+    auto& slot = _value_map[id];
+    if (slot) {
+        remove_from_family(_families, *slot);
+    }
+    _families[rm->_export_name].push_back(rm);
+    slot = std::move(rm);
+}
+
+void impl::remove_registration(const metric_id& id) {
+    auto i = _value_map.find(id);
+    if (i != _value_map.end()) {
+        if (i->second) {
+            remove_from_family(_families, *i->second);
+        }
+        // Dropped rather than nulled, so that metrics of short-lived
+        // objects do not pile up
+        _value_map.erase(i);
+    }
 }
 
 
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <functional>
+#include <vector>
 #include "sstring.hh"
 #include "core/shared_ptr.hh"
 #include "core/metrics_registration.hh"
@@ -127,6 +128,89 @@ class description {
  * The metrics layer define a thin API for adding metrics.
  * Some of the implementation details need to be in the header file, they should not be use directly.
  */
+/*!
+ * \brief A single histogram bucket.
+ *
+ * count is cumulative: it holds the number of samples that are less than
+ * or equal to upper_bound, including those of all preceding buckets.
+ */
+struct histogram_bucket {
+    uint64_t count = 0; /*!< number of samples <= upper_bound */
+    double upper_bound = 0;
+};
+
+/*!
+ * \brief Histogram values, as returned by a histogram metric.
+ *
+ * Buckets are ordered by increasing upper_bound; samples above the last
+ * bound are only accounted for in sample_count.
+ */
+struct histogram {
+    uint64_t sample_count = 0;
+    double sample_sum = 0;
+    std::vector<histogram_bucket> buckets;
+
+    /*!
+     * \brief Adds another histogram with the same bucket bounds.
+     */
+    histogram& operator+=(const histogram& h);
+    histogram operator+(const histogram& h) const;
+};
+
+/*!
+ * \brief How exporters combine the values a metric has on each shard.
+ *
+ * By default every shard's value is its own series, labeled by shard. An
+ * aggregated metric is exported as a single series instead, holding the
+ * combination of the values of the metric with the same name and labels
+ * on all shards.
+ */
+enum class aggregation : uint8_t {
+    none, /*!< a series per shard */
+    sum, /*!< the sum of all shards; histograms are merged bucket by bucket */
+    max, /*!< the largest value of any shard; histograms are merged as by sum */
+};
+
+/*!
+ * \brief A counter for hot paths, that metrics read directly.
+ *
+ * Its value is kept in a per-shard arena of counters rather than in the
+ * object that owns it, so updates do not dirty (or share a cache line
+ * with) the owner's hot data, and the counters a scrape reads are packed
+ * together. A metric made from a counter reads the value through a
+ * pointer, without calling a std::function.
+ *
+ * A counter belongs to the shard that created it: it is updated and
+ * destroyed there, and must outlive the metrics made from it.
+ */
+class counter {
+    uint64_t* _value;
+public:
+    counter();
+    counter(counter&& c) noexcept : _value(c._value) {
+        c._value = nullptr;
+    }
+    counter& operator=(counter&& c) noexcept {
+        std::swap(_value, c._value);
+        return *this;
+    }
+    ~counter();
+    counter& operator++() {
+        ++*_value;
+        return *this;
+    }
+    counter& operator+=(uint64_t n) {
+        *_value += n;
+        return *this;
+    }
+    uint64_t value() const {
+        return *_value;
+    }
+    const uint64_t* value_ptr() const {
+        return _value;
+    }
+};
+
 namespace impl {
 
 // The value binding data types
@@ -135,6 +219,7 @@ enum class data_type : uint8_t {
     GAUGE, // double
     DERIVE, // signed int 64
     ABSOLUTE, // unsigned int 64
+    HISTOGRAM, // metrics::histogram
 };
 
 /*!
@@ -149,6 +234,7 @@ struct metric_value {
         int64_t _i;
     } u;
     data_type _type;
+    histogram _hist; // only used by data_type::HISTOGRAM
 
     data_type type() const {
         return _type;
@@ -166,11 +252,20 @@ struct metric_value {
         return u._i;
     }
 
+    const histogram& get_histogram() const {
+        return _hist;
+    }
+
     metric_value()
             : _type(data_type::GAUGE) {
     }
 
-    template<typename T>
+    metric_value(histogram h, data_type t)
+            : _type(t), _hist(std::move(h)) {
+        u._ui = 0;
+    }
+
+    template<typename T, typename = std::enable_if_t<std::is_arithmetic<T>::value>>
     metric_value(T i, data_type t)
             : _type(t) {
         switch (_type) {
@@ -210,6 +305,18 @@ struct metric_definition_impl {
     metric_function f;
     description d;
     bool enabled = true;
+    aggregation aggregate_by = aggregation::none;
+    // Set, instead of f, for a metric of a counter
+    const uint64_t* counter_value = nullptr;
+
+    /*!
+     * \brief Exports the metric combined over shards, e.g.
+     * make_derive("requests", _requests).aggregate(aggregation::sum)
+     */
+    metric_definition_impl& aggregate(aggregation a) {
+        aggregate_by = a;
+        return *this;
+    }
 };
 
 class metric_groups_def {
@@ -252,6 +359,19 @@ metric_function make_function(T& val, data_type dt) {
         return metric_value(val, dt);
     };
 }
+
+template<typename T, typename = std::enable_if_t<!std::is_same<std::decay_t<T>, counter>::value>>
+metric_definition_impl make_definition(metric_name_type name, instance_id_type instance, metric_type type,
+        T&& val, description d, bool enabled) {
+    return {name, instance, type, make_function(std::forward<T>(val), type.base_type), d, enabled};
+}
+
+inline metric_definition_impl make_definition(metric_name_type name, instance_id_type instance, metric_type type,
+        const counter& c, description d, bool enabled) {
+    metric_definition_impl md{name, instance, type, metric_function(), d, enabled};
+    md.counter_value = c.value_ptr();
+    return md;
+}
 }
 /*
  * The metrics definition are defined to be compatible with collectd metrics defintion.
@@ -266,9 +386,9 @@ metric_function make_function(T& val, data_type dt) {
  */
 template<typename T>
 impl::metric_definition_impl make_gauge(metric_name_type name,
-        T val, description d=description(), bool enabled=true,
+        T&& val, description d=description(), bool enabled=true,
         instance_id_type instance = impl::shard(), metric_type_def iht = "gauge") {
-    return {name, instance, {impl::data_type::GAUGE, iht}, make_function(val, impl::data_type::GAUGE), d, enabled};
+    return impl::make_definition(name, instance, {impl::data_type::GAUGE, iht}, std::forward<T>(val), d, enabled);
 }
 
 /*!
@@ -281,9 +401,9 @@ impl::metric_definition_impl make_gauge(metric_name_type name,
  */
 template<typename T>
 impl::metric_definition_impl make_derive(metric_name_type name,
-        T val, description d=description(), bool enabled=true,
+        T&& val, description d=description(), bool enabled=true,
         instance_id_type instance = impl::shard(), metric_type_def iht = "derive") {
-    return {name, instance, {impl::data_type::DERIVE, iht}, make_function(val, impl::data_type::DERIVE), d, enabled};
+    return impl::make_definition(name, instance, {impl::data_type::DERIVE, iht}, std::forward<T>(val), d, enabled);
 }
 
 /*!
@@ -295,9 +415,9 @@ impl::metric_definition_impl make_derive(metric_name_type name,
  */
 template<typename T>
 impl::metric_definition_impl make_counter(metric_name_type name,
-        T val, description d=description(), bool enabled=true,
+        T&& val, description d=description(), bool enabled=true,
         instance_id_type instance = impl::shard(), metric_type_def iht = "counter") {
-    return {name, instance, {impl::data_type::COUNTER, iht}, make_function(val, impl::data_type::COUNTER), d, enabled};
+    return impl::make_definition(name, instance, {impl::data_type::COUNTER, iht}, std::forward<T>(val), d, enabled);
 }
 
 /*!
@@ -308,9 +428,23 @@ impl::metric_definition_impl make_counter(metric_name_type name,
  */
 template<typename T>
 impl::metric_definition_impl make_absolute(metric_name_type name,
-        T val, description d=description(), bool enabled=true,
+        T&& val, description d=description(), bool enabled=true,
         instance_id_type instance = impl::shard(), metric_type_def iht = "absolute") {
-    return {name, instance, {impl::data_type::ABSOLUTE, iht}, make_function(val, impl::data_type::ABSOLUTE), d, enabled};
+    return impl::make_definition(name, instance, {impl::data_type::ABSOLUTE, iht}, std::forward<T>(val), d, enabled);
+}
+
+/*!
+ * \brief create a histogram metric.
+ *
+ * Histograms are used to report distributions, such as latencies.
+ * val is a function returning a metrics::histogram.
+ * Protocols that cannot represent a histogram (collectd) skip it.
+ */
+template<typename T>
+impl::metric_definition_impl make_histogram(metric_name_type name,
+        T&& val, description d=description(), bool enabled=true,
+        instance_id_type instance = impl::shard()) {
+    return impl::make_definition(name, instance, {impl::data_type::HISTOGRAM, "histogram"}, std::forward<T>(val), d, enabled);
 }
 
 /*!
@@ -322,9 +456,9 @@ impl::metric_definition_impl make_absolute(metric_name_type name,
 
 template<typename T>
 impl::metric_definition_impl make_total_bytes(metric_name_type name,
-        T val, description d=description(), bool enabled=true,
+        T&& val, description d=description(), bool enabled=true,
         instance_id_type instance = impl::shard()) {
-    return make_derive(name, val, d, enabled, instance, "total_bytes");
+    return make_derive(name, std::forward<T>(val), d, enabled, instance, "total_bytes");
 }
 
 /*!
@@ -336,9 +470,9 @@ impl::metric_definition_impl make_total_bytes(metric_name_type name,
 
 template<typename T>
 impl::metric_definition_impl make_current_bytes(metric_name_type name,
-        T val, description d=description(), bool enabled=true,
+        T&& val, description d=description(), bool enabled=true,
         instance_id_type instance = impl::shard()) {
-    return make_derive(name, val, d, enabled, instance, "bytes");
+    return make_derive(name, std::forward<T>(val), d, enabled, instance, "bytes");
 }
 
 
@@ -350,9 +484,9 @@ impl::metric_definition_impl make_current_bytes(metric_name_type name,
 
 template<typename T>
 impl::metric_definition_impl make_queue_length(metric_name_type name,
-        T val, description d=description(), bool enabled=true,
+        T&& val, description d=description(), bool enabled=true,
         instance_id_type instance = impl::shard()) {
-    return make_gauge(name, val, d, enabled, instance, "queue_length");
+    return make_gauge(name, std::forward<T>(val), d, enabled, instance, "queue_length");
 }
 
 
@@ -364,9 +498,9 @@ impl::metric_definition_impl make_queue_length(metric_name_type name,
 
 template<typename T>
 impl::metric_definition_impl make_total_operations(metric_name_type name,
-        T val, description d=description(), bool enabled=true,
+        T&& val, description d=description(), bool enabled=true,
         instance_id_type instance = impl::shard()) {
-    return make_derive(name, val, d, enabled, instance, "total_operations");
+    return make_derive(name, std::forward<T>(val), d, enabled, instance, "total_operations");
 }
 
 /*! @} */
@@ -22,6 +22,8 @@
 #pragma once
 
 #include "metrics.hh"
+#include <atomic>
+#include <map>
 #include <unordered_map>
 #include "sharded.hh"
 /*!
@@ -34,6 +36,53 @@
 namespace seastar {
 namespace metrics {
 namespace impl {
+
+/*!
+ * A string kept once in a table shared by all shards, with the number of
+ * its holders: the group names, metric names and types of a metric
+ * registered on every shard, or of its many instances, are stored once.
+ * Copying one takes a reference, and equality compares pointers. Only
+ * creating one, and dropping the last reference, take the table's lock.
+ */
+class interned_string {
+    using entry = std::pair<const sstring, std::atomic<size_t>>;
+    // Null for the empty string
+    entry* _e = nullptr;
+private:
+    static entry* intern(const sstring& s);
+    static void release(entry* e) noexcept;
+public:
+    interned_string() = default;
+    interned_string(const sstring& s) : _e(s.empty() ? nullptr : intern(s)) {}
+    interned_string(const interned_string& x) noexcept : _e(x._e) {
+        if (_e) {
+            _e->second.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    interned_string(interned_string&& x) noexcept : _e(x._e) {
+        x._e = nullptr;
+    }
+    interned_string& operator=(interned_string x) noexcept {
+        std::swap(_e, x._e);
+        return *this;
+    }
+    ~interned_string() {
+        if (_e) {
+            release(_e);
+        }
+    }
+    const sstring& str() const {
+        static const sstring empty;
+        return _e ? _e->first : empty;
+    }
+    bool operator==(const interned_string& x) const {
+        return _e == x._e;
+    }
+    size_t hash() const {
+        return std::hash<const void*>()(_e);
+    }
+};
+
 /**
  * Metrics are collected in groups that belongs to some logical entity.
  * For example, different measurements of the cpu, will belong to group "cpu".
@@ -50,10 +99,13 @@ namespace impl {
 class metric_id {
 public:
     metric_id() = default;
-    metric_id(group_name_type group, instance_id_type instance, metric_name_type name,
-                    metrics::metric_type_def iht = std::string())
-                    : _group(std::move(group)), _instance_id(std::move(instance)), _name(
-                                    std::move(name)), _inherit_type(std::move(iht)) {
+    metric_id(const group_name_type& group, const instance_id_type& instance, const metric_name_type& name,
+                    const metrics::metric_type_def& iht = metrics::metric_type_def())
+                    : _group(group), _instance_id(instance), _name(name), _inherit_type(iht) {
+    }
+    metric_id(interned_string group, const instance_id_type& instance, const metric_name_type& name,
+                    const metrics::metric_type_def& iht)
+                    : _group(std::move(group)), _instance_id(instance), _name(name), _inherit_type(iht) {
     }
     metric_id(metric_id &&) = default;
     metric_id(const metric_id &) = default;
@@ -62,27 +114,37 @@ class metric_id {
     metric_id & operator=(const metric_id &) = default;
 
     const group_name_type & group_name() const {
-        return _group;
+        return _group.str();
     }
     void group_name(const group_name_type & name) {
         _group = name;
     }
     const instance_id_type & instance_id() const {
-        return _instance_id;
+        return _instance_id.str();
     }
     const metric_name_type & name() const {
-        return _name;
+        return _name.str();
     }
     const metrics::metric_type_def & inherit_type() const {
-        return _inherit_type;
+        return _inherit_type.str();
     }
     bool operator<(const metric_id&) const;
-    bool operator==(const metric_id&) const;
+    bool operator==(const metric_id& id) const {
+        return _group == id._group && _instance_id == id._instance_id && _name == id._name
+                && _inherit_type == id._inherit_type;
+    }
+    size_t hash() const {
+        size_t h = _group.hash();
+        for (auto& s : {&_instance_id, &_name, &_inherit_type}) {
+            h = h * 31 + s->hash();
+        }
+        return h;
+    }
 private:
-    group_name_type _group;
-    instance_id_type _instance_id;
-    metric_name_type _name;
-    metric_type_def _inherit_type;
+    interned_string _group;
+    interned_string _instance_id;
+    interned_string _name;
+    interned_string _inherit_type;
 };
 }
 }
@@ -97,9 +159,7 @@ struct hash<seastar::metrics::impl::metric_id>
     typedef ::std::size_t result_type;
     result_type operator()(argument_type const& s) const
     {
-        result_type const h1 ( std::hash<sstring>{}(s.group_name()) );
-        result_type const h2 ( std::hash<sstring>{}(s.instance_id()) );
-        return h1 ^ (h2 << 1); // or use boost::hash_combine
+        return s.hash();
     }
 };
 
@@ -113,6 +173,8 @@ using metrics_registration = std::vector<metric_id>;
 
 class metric_groups_impl : public metric_groups_def {
     metrics_registration _registration;
+private:
+    void add_metric(const interned_string& group, const metric_definition_impl& md);
 public:
     metric_groups_impl() = default;
     ~metric_groups_impl();
@@ -131,10 +193,24 @@ class registered_metric {
     bool _enabled;
     metric_function _f;
     shared_ptr<impl> _impl;
+    aggregation _aggregation;
+    // Read instead of calling _f, for a metric of a counter
+    const uint64_t* _counter_value;
+    // Set when the metric is registered, with what exporters name and
+    // label it by, derived from the id once: the group and metric names
+    // joined and made valid as a Prometheus name, and its type label,
+    // escaped
+    metric_id _id;
+    sstring _export_name;
+    sstring _export_labels;
 public:
-    registered_metric(data_type type, metric_function f, description d = description(), bool enabled=true);
+    registered_metric(data_type type, metric_function f, description d = description(), bool enabled=true,
+            aggregation a = aggregation::none, const uint64_t* counter_value = nullptr);
     virtual ~registered_metric() {}
     virtual metric_value operator()() const {
+        if (_counter_value) {
+            return metric_value(*_counter_value, _type);
+        }
         return _f();
     }
     data_type get_type() const {
@@ -152,13 +228,39 @@ class registered_metric {
     const description& get_description() const {
         return _d;
     }
+
+    aggregation get_aggregation() const {
+        return _aggregation;
+    }
+
+    const metric_id& id() const {
+        return _id;
+    }
+
+    const sstring& export_name() const {
+        return _export_name;
+    }
+
+    const sstring& export_labels() const {
+        return _export_labels;
+    }
+
+    friend class impl;
 };
 
 typedef std::unordered_map<metric_id, shared_ptr<registered_metric> > value_map;
 typedef std::unordered_map<metric_id, metric_value> values_copy;
 
+/*!
+ * Registered metrics by export name, in name order. Metrics that share
+ * a name, such as the same metric of different instances, form a family
+ * that exporters write together.
+ */
+typedef std::map<sstring, std::vector<shared_ptr<registered_metric>>> metric_family_map;
+
 class impl {
     value_map _value_map;
+    metric_family_map _families;
 public:
     value_map& get_value_map() {
         return _value_map;
@@ -168,7 +270,16 @@ class impl {
         return _value_map;
     }
 
+    const metric_family_map& get_families() const {
+        return _families;
+    }
+
     void add_registration(const metric_id& id, shared_ptr<registered_metric> rm);
+    void remove_registration(const metric_id& id);
+    // Makes room for n more registrations
+    void reserve(size_t n) {
+        _value_map.reserve(_value_map.size() + n);
+    }
 
     future<> stop() {
         return make_ready_future<>();
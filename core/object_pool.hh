@@ -0,0 +1,162 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "sstring.hh"
+#include "memory.hh"
+#include "metrics_registration.hh"
+#include "metrics.hh"
+#include <new>
+#include <algorithm>
+
+/// \file
+///
+/// Shard-local free lists for frequently allocated objects.
+
+namespace seastar {
+
+/// A shard-local cache of storage for objects of type \c T.
+///
+/// Freed storage is kept on a free list, up to \c max_free objects, and
+/// handed out again by the next \ref allocate(), saving a trip through the
+/// allocator for objects that are created and destroyed per operation.
+/// The cached storage is given back to the allocator when memory runs low.
+///
+/// The pool registers metrics named after it in the "object_pool" group.
+/// Usually used through \ref pooled.
+template <typename T>
+class object_pool {
+    struct free_object {
+        free_object* next;
+    };
+    static constexpr size_t object_size = std::max(sizeof(T), sizeof(free_object));
+    free_object* _free = nullptr;
+    size_t _nr_free = 0;
+    size_t _max_free;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    memory::reclaimer _reclaimer;
+    seastar::metrics::metric_groups _metrics;
+private:
+    memory::reclaiming_result reclaim() {
+        if (!_free) {
+            return memory::reclaiming_result::reclaimed_nothing;
+        }
+        // Give back half the cache, but at least one object.
+        auto keep = _nr_free / 2;
+        while (_nr_free > keep) {
+            pop_and_free();
+        }
+        return memory::reclaiming_result::reclaimed_something;
+    }
+    void pop_and_free() {
+        auto p = _free;
+        _free = p->next;
+        --_nr_free;
+        ::operator delete(p);
+    }
+public:
+    object_pool(const sstring& name, size_t max_free)
+            : _max_free(max_free)
+            , _reclaimer([this] { return reclaim(); }, memory::reclaimer_scope::async, 0) {
+        namespace sm = seastar::metrics;
+        _metrics.add_group("object_pool", {
+            sm::make_derive(name + "_hits", _hits,
+                    sm::description("Counts allocations served from the pool's free list")),
+            sm::make_derive(name + "_misses", _misses,
+                    sm::description("Counts allocations that went to the allocator")),
+            sm::make_gauge(name + "_cached", [this] { return _nr_free; },
+                    sm::description("Objects' worth of storage on the pool's free list")),
+        });
+    }
+    object_pool(const object_pool&) = delete;
+    ~object_pool() {
+        clear();
+    }
+    /// Returns uninitialized storage for a \c T.
+    void* allocate() {
+        if (_free) {
+            ++_hits;
+            auto p = _free;
+            _free = p->next;
+            --_nr_free;
+            return p;
+        }
+        ++_misses;
+        return ::operator new(object_size);
+    }
+    /// Returns storage obtained from any shard's \ref allocate().
+    void deallocate(void* p) noexcept {
+        if (_nr_free >= _max_free) {
+            ::operator delete(p);
+            return;
+        }
+        auto f = new (p) free_object;
+        f->next = _free;
+        _free = f;
+        ++_nr_free;
+    }
+    /// Frees all cached storage.
+    void clear() {
+        while (_free) {
+            pop_and_free();
+        }
+    }
+    size_t cached() const { return _nr_free; }
+    uint64_t hits() const { return _hits; }
+    uint64_t misses() const { return _misses; }
+};
+
+/// Makes \c new and \c delete of \c T go through a shard-local \ref object_pool.
+///
+/// \c T derives from \c pooled<T> and provides a static
+/// `const char* object_pool_name()` naming the pool's metrics.  Objects
+/// allocated by std::make_unique(), \c new, or \ref make_lw_shared() (when
+/// \c T derives from \ref enable_lw_shared_from_this) then reuse storage
+/// freed on the same shard.  Classes derived from \c T fall back to the
+/// global allocator.
+template <typename T>
+class pooled {
+public:
+    /// Maximum number of free objects each shard's pool keeps.
+    static constexpr size_t max_free = 1024;
+
+    static object_pool<T>& local_pool() {
+        static thread_local object_pool<T> pool(T::object_pool_name(), max_free);
+        return pool;
+    }
+    static void* operator new(size_t size) {
+        if (size != sizeof(T)) {
+            return ::operator new(size);
+        }
+        return local_pool().allocate();
+    }
+    static void operator delete(void* p, size_t size) noexcept {
+        if (size != sizeof(T)) {
+            ::operator delete(p);
+            return;
+        }
+        local_pool().deallocate(p);
+    }
+};
+
+}
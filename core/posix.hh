@@ -107,6 +107,11 @@ class file_desc {
         return file_desc(fd);
     }
     static file_desc temporary(sstring directory);
+    // Takes ownership of a descriptor returned by a system call that has
+    // no dedicated factory here (e.g. io_uring_setup()).
+    static file_desc from_fd(int fd) {
+        return file_desc(fd);
+    }
     file_desc dup() const {
         int fd = ::dup(get());
         throw_system_error_on(fd == -1, "dup");
@@ -117,6 +122,14 @@ class file_desc {
         throw_system_error_on(ret == -1, "accept4");
         return file_desc(ret);
     }
+    boost::optional<file_desc> try_accept(sockaddr& sa, socklen_t& sl, int flags = 0) {
+        auto ret = ::accept4(_fd, &sa, &sl, flags);
+        if (ret == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(ret == -1, "accept4");
+        return file_desc(ret);
+    }
     void shutdown(int how) {
         auto ret = ::shutdown(_fd, how);
         if (ret == -1 && errno != ENOTCONN) {
@@ -207,6 +220,15 @@ class file_desc {
         throw_system_error_on(r == -1, "recvmsg");
         return { size_t(r) };
     }
+    // Number of messages received
+    boost::optional<size_t> recvmmsg(mmsghdr* msgs, unsigned vlen, int flags) {
+        auto r = ::recvmmsg(_fd, msgs, vlen, flags, nullptr);
+        if (r == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(r == -1, "recvmmsg");
+        return { size_t(r) };
+    }
     boost::optional<size_t> send(const void* buffer, size_t len, int flags) {
         auto r = ::send(_fd, buffer, len, flags);
         if (r == -1 && errno == EAGAIN) {
@@ -231,6 +253,15 @@ class file_desc {
         throw_system_error_on(r == -1, "sendmsg");
         return { size_t(r) };
     }
+    // Number of messages sent
+    boost::optional<size_t> sendmmsg(mmsghdr* msgs, unsigned vlen, int flags) {
+        auto r = ::sendmmsg(_fd, msgs, vlen, flags);
+        if (r == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(r == -1, "sendmmsg");
+        return { size_t(r) };
+    }
     void bind(sockaddr& sa, socklen_t sl) {
         auto r = ::bind(_fd, &sa, sl);
         throw_system_error_on(r == -1, "bind");
@@ -22,13 +22,16 @@
 #pragma once
 #include <atomic>
 
-extern __thread bool g_need_preempt;
+// Set when the running task should yield.  Written by the task quota
+// signal handler, or with --preempt-source=thread by the preemption timer
+// thread, so it is atomic (and cache-line aligned where it is defined).
+extern __thread std::atomic<bool> g_need_preempt;
 
 inline bool need_preempt() {
 #ifndef DEBUG
     // prevent compiler from eliminating loads in a loop
     std::atomic_signal_fence(std::memory_order_seq_cst);
-    return g_need_preempt;
+    return g_need_preempt.load(std::memory_order_relaxed);
 #else
     return true;
 #endif
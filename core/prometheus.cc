@@ -27,10 +27,12 @@
 #include "scollectd_api.hh"
 #include "scollectd-impl.hh"
 #include "metrics_api.hh"
-#include "http/function_handlers.hh"
-#include <boost/algorithm/string/replace.hpp>
-#include <boost/range/algorithm_ext/erase.hpp>
-#include <boost/algorithm/string.hpp>
+#include "http/handlers.hh"
+#include "json/formatter.hh"
+#include "core/future-util.hh"
+#include <boost/range/irange.hpp>
+#include <algorithm>
+#include <cmath>
 
 using namespace seastar;
 
@@ -61,24 +63,301 @@ static bool write_delimited_to(const google::protobuf::MessageLite& message,
     return true;
 }
 
-static std::string safe_name(const sstring& name) {
-    auto rep = boost::replace_all_copy(boost::replace_all_copy(name, "-", "_"), " ", "_");
-    boost::remove_erase_if(rep, boost::is_any_of("+()"));
-    return rep;
+// A shard's metric families with their values, read on that shard
+struct shard_snapshot {
+    struct sample {
+        // Keeps the metric's names alive while they are written
+        shared_ptr<metrics::impl::registered_metric> metric;
+        metrics::impl::metric_value value;
+    };
+    // The families in name order, each with at least one sample
+    std::vector<std::vector<sample>> families;
+};
+
+using family_samples = std::vector<shard_snapshot::sample>;
+
+// Reads the values of the shard's metrics, grouped by family as they were
+// when registered, so nothing is named or sorted per scrape
+static std::unique_ptr<shard_snapshot> take_snapshot() {
+    auto snapshot = std::make_unique<shard_snapshot>();
+    auto& families = metrics::impl::get_local_impl()->get_families();
+    snapshot->families.reserve(families.size());
+    for (auto& f : families) {
+        family_samples samples;
+        for (auto& m : f.second) {
+            if (m->is_enabled()) {
+                samples.push_back({m, (*m)()});
+            }
+        }
+        if (!samples.empty()) {
+            snapshot->families.push_back(std::move(samples));
+        }
+    }
+    return snapshot;
+}
+
+/**
+ * The snapshots of all shards, walked family by family: the families of
+ * each shard are sorted by name, so the same family on every shard is
+ * found by merging them.
+ */
+class scrape {
+    std::vector<foreign_ptr<std::unique_ptr<shard_snapshot>>> _shards;
+    std::vector<size_t> _next;
+public:
+    // A family's samples on one shard
+    struct part {
+        unsigned shard;
+        const family_samples* samples;
+    };
+
+    explicit scrape(std::vector<foreign_ptr<std::unique_ptr<shard_snapshot>>> shards)
+        : _shards(std::move(shards)), _next(_shards.size()) {}
+
+    static future<scrape> take() {
+        return map_reduce(boost::irange(0u, smp::count), [] (unsigned cpu) {
+            return smp::submit_to(cpu, [] {
+                return make_foreign(take_snapshot());
+            }).then([cpu] (foreign_ptr<std::unique_ptr<shard_snapshot>> s) {
+                return std::make_pair(cpu, std::move(s));
+            });
+        }, std::vector<foreign_ptr<std::unique_ptr<shard_snapshot>>>(smp::count),
+        [] (auto shards, auto s) {
+            shards[s.first] = std::move(s.second);
+            return shards;
+        }).then([] (auto shards) {
+            return scrape(std::move(shards));
+        });
+    }
+
+    // Fills parts with the next family's samples on each shard that has
+    // it, in shard order; false once all families were returned
+    bool next(std::vector<part>& parts) {
+        parts.clear();
+        const sstring* name = nullptr;
+        for (unsigned i = 0; i < _shards.size(); ++i) {
+            auto& families = _shards[i]->families;
+            if (_next[i] == families.size()) {
+                continue;
+            }
+            auto& n = families[_next[i]].front().metric->export_name();
+            if (!name || n < *name) {
+                name = &n;
+                parts.clear();
+            }
+            if (n == *name) {
+                parts.push_back({i, &families[_next[i]]});
+            }
+        }
+        for (auto& p : parts) {
+            ++_next[p.shard];
+        }
+        return !parts.empty();
+    }
+};
+
+/**
+ * A series of a family as exported: a shard's sample, or, for a metric
+ * aggregated over shards, the combination of the samples with the same
+ * labels on all shards.
+ */
+struct series {
+    // Names and labels the series; the first sample, when combined
+    const shard_snapshot::sample* sample;
+    // Labels the series, unless it is combined
+    int shard;
+    metrics::impl::metric_value combined;
+
+    const metrics::impl::metric_value& value() const {
+        return shard < 0 ? combined : sample->value;
+    }
+};
+
+static void combine(metrics::impl::metric_value& into, const metrics::impl::metric_value& v, metrics::aggregation a) {
+    using metrics::impl::data_type;
+    if (a == metrics::aggregation::sum || v.type() == data_type::HISTOGRAM) {
+        into += v;
+        return;
+    }
+    bool larger;
+    switch (v.type()) {
+    case data_type::GAUGE:
+        larger = v.d() > into.d();
+        break;
+    case data_type::DERIVE:
+        larger = v.i() > into.i();
+        break;
+    default:
+        larger = v.ui() > into.ui();
+        break;
+    }
+    if (larger) {
+        into = v;
+    }
+}
+
+// Lists the series of a family, in shard order, with those of aggregated
+// metrics combined where each first appears, unless per_shard asks for
+// every shard's samples
+static void family_series(std::vector<series>& out, const std::vector<scrape::part>& parts, bool per_shard) {
+    out.clear();
+    for (auto& p : parts) {
+        for (auto& s : *p.samples) {
+            auto a = s.metric->get_aggregation();
+            if (per_shard || a == metrics::aggregation::none) {
+                out.push_back({&s, int(p.shard), {}});
+                continue;
+            }
+            // Families have few label sets, so a search beats a map
+            auto it = std::find_if(out.begin(), out.end(), [&s] (const series& e) {
+                return e.shard < 0 && e.sample->metric->export_labels() == s.metric->export_labels();
+            });
+            if (it == out.end()) {
+                out.push_back({&s, -1, s.value});
+            } else {
+                combine(it->combined, s.value, a);
+            }
+        }
+    }
+}
+
+static void append(std::string& out, const sstring& s) {
+    out.append(s.c_str(), s.size());
+}
+
+static void append_value(std::string& out, double d) {
+    if (std::isnan(d)) {
+        out += "NaN";
+    } else if (std::isinf(d)) {
+        out += d > 0 ? "+Inf" : "-Inf";
+    } else {
+        append(out, json::formatter::to_json(d));
+    }
+}
+
+static void append_value(std::string& out, uint64_t n) {
+    append(out, json::formatter::to_json(static_cast<unsigned long>(n)));
 }
 
+static void append_value(std::string& out, int64_t n) {
+    append(out, json::formatter::to_json(static_cast<long>(n)));
+}
 
-static sstring collectd_name(const metrics::impl::metric_id & id, uint32_t cpu) {
-    return safe_name(id.group_name() + "_" + safe_name(id.name()));
+static void append_help(std::string& out, const sstring& help) {
+    for (auto c : help) {
+        if (c == '\\') {
+            out += "\\\\";
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
 }
 
-static pm::Metric* add_label(pm::Metric* mt, const metrics::impl::metric_id & id, uint32_t cpu) {
-    auto label = mt->add_label();
-    label->set_name("shard");
-    label->set_value(std::to_string(cpu));
+/**
+ * Writes a family in the text exposition format, version 0.0.4:
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
+ */
+static void write_text_family(std::string& out, const config& ctx, const sstring& instance_label,
+        const std::vector<series>& family) {
+    auto& first = *family.front().sample;
+    std::string name = ctx.prefix + "_";
+    append(name, first.metric->export_name());
+    auto& help = first.metric->get_description().str();
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    append_help(out, help.empty() ? ctx.metric_help : help);
+    out += "\n# TYPE ";
+    out += name;
+    switch (first.value.type()) {
+    case scollectd::data_type::GAUGE:
+        out += " gauge\n";
+        break;
+    case scollectd::data_type::HISTOGRAM:
+        out += " histogram\n";
+        break;
+    default:
+        out += " counter\n";
+        break;
+    }
+    for (auto& e : family) {
+        // The labels, without the closing brace, for more to follow
+        std::string labels = "{";
+        if (e.shard >= 0) {
+            labels += "shard=\"";
+            append(labels, to_sstring(e.shard));
+            labels += "\",";
+        }
+        append(labels, e.sample->metric->export_labels());
+        append(labels, instance_label);
+        auto& v = e.value();
+        switch (v.type()) {
+        case scollectd::data_type::DERIVE:
+            out += name;
+            out += labels;
+            out += "} ";
+            append_value(out, v.i());
+            break;
+        case scollectd::data_type::GAUGE:
+            out += name;
+            out += labels;
+            out += "} ";
+            append_value(out, v.d());
+            break;
+        case scollectd::data_type::HISTOGRAM: {
+            auto& h = v.get_histogram();
+            for (auto& b : h.buckets) {
+                out += name;
+                out += "_bucket";
+                out += labels;
+                out += ",le=\"";
+                append_value(out, b.upper_bound);
+                out += "\"} ";
+                append_value(out, b.count);
+                out += '\n';
+            }
+            out += name;
+            out += "_bucket";
+            out += labels;
+            out += ",le=\"+Inf\"} ";
+            append_value(out, h.sample_count);
+            out += '\n';
+            out += name;
+            out += "_sum";
+            out += labels;
+            out += "} ";
+            append_value(out, h.sample_sum);
+            out += '\n';
+            out += name;
+            out += "_count";
+            out += labels;
+            out += "} ";
+            append_value(out, h.sample_count);
+            break;
+        }
+        default:
+            out += name;
+            out += labels;
+            out += "} ";
+            append_value(out, v.ui());
+            break;
+        }
+        out += '\n';
+    }
+}
+
+static pm::Metric* add_label(pm::Metric* mt, const series& e) {
+    pm::LabelPair* label;
+    if (e.shard >= 0) {
+        label = mt->add_label();
+        label->set_name("shard");
+        label->set_value(std::to_string(e.shard));
+    }
     label = mt->add_label();
     label->set_name("type");
-    label->set_value(id.inherit_type());
+    label->set_value(e.sample->metric->id().inherit_type());
 
     const sstring& host = scollectd::get_impl().host();
     if (host != "") {
@@ -89,60 +368,116 @@ static pm::Metric* add_label(pm::Metric* mt, const metrics::impl::metric_id & id
     return mt;
 }
 
-static void fill_metric(pm::MetricFamily& mf, const metrics::impl::metric_value& c,
-        const metrics::impl::metric_id & id, uint32_t cpu) {
+static void fill_metric(pm::MetricFamily& mf, const series& e) {
+    auto& c = e.value();
     switch (c.type()) {
     case scollectd::data_type::DERIVE:
-        add_label(mf.add_metric(), id, cpu)->mutable_counter()->set_value(c.i());
+        add_label(mf.add_metric(), e)->mutable_counter()->set_value(c.i());
         mf.set_type(pm::MetricType::COUNTER);
         break;
     case scollectd::data_type::GAUGE:
-        add_label(mf.add_metric(), id, cpu)->mutable_gauge()->set_value(c.d());
+        add_label(mf.add_metric(), e)->mutable_gauge()->set_value(c.d());
         mf.set_type(pm::MetricType::GAUGE);
         break;
+    case scollectd::data_type::HISTOGRAM: {
+        auto& h = c.get_histogram();
+        auto mh = add_label(mf.add_metric(), e)->mutable_histogram();
+        mh->set_sample_count(h.sample_count);
+        mh->set_sample_sum(h.sample_sum);
+        for (auto&& b : h.buckets) {
+            auto bucket = mh->add_bucket();
+            bucket->set_cumulative_count(b.count);
+            bucket->set_upper_bound(b.upper_bound);
+        }
+        mf.set_type(pm::MetricType::HISTOGRAM);
+        break;
+    }
     default:
-        add_label(mf.add_metric(), id, cpu)->mutable_counter()->set_value(c.ui());
+        add_label(mf.add_metric(), e)->mutable_counter()->set_value(c.ui());
         mf.set_type(pm::MetricType::COUNTER);
         break;
     }
 }
 
-future<> start(httpd::http_server_control& http_server, const config& ctx) {
-    return http_server.set_routes([&ctx](httpd::routes& r) {
-        httpd::future_handler_function f = [&ctx](std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
-            return do_with(std::vector<metrics::impl::values_copy>(), [rep = std::move(rep), &ctx] (auto& vec) mutable {
-                vec.resize(smp::count);
-                return parallel_for_each(boost::irange(0u, smp::count), [&vec] (auto cpu) {
-                    return smp::submit_to(cpu, [] {
-                        return metrics::impl::get_values();
-                    }).then([&vec, cpu] (auto res) {
-                        vec[cpu] = res;
-                    });
-                }).then([rep = std::move(rep), &vec, &ctx]() mutable {
-                    uint32_t cpu = 0;
-                    for (auto value: vec) {
-                        for (auto i : value) {
-                            pm::MetricFamily mtf;
-                            std::string s;
-                            google::protobuf::io::StringOutputStream os(&s);
-                            mtf.set_name(ctx.prefix + "_" + collectd_name(i.first, cpu));
-                            mtf.set_help(ctx.metric_help);
-                            fill_metric(mtf, i.second, i.first, cpu);
-                            if (mtf.metric_size() > 0) {
-                                std::stringstream ss;
-                                if (!write_delimited_to(mtf, &os)) {
-                                    seastar_logger.warn("Failed to write protobuf metrics");
-                                }
-                                rep->_content += s;
-                            }
+static void write_protobuf_family(std::string& out, const config& ctx, const std::vector<series>& family) {
+    pm::MetricFamily mtf;
+    mtf.set_name(ctx.prefix + "_" + family.front().sample->metric->export_name());
+    mtf.set_help(ctx.metric_help);
+    for (auto& e : family) {
+        fill_metric(mtf, e);
+    }
+    google::protobuf::io::StringOutputStream os(&out);
+    if (!write_delimited_to(mtf, &os)) {
+        seastar_logger.warn("Failed to write protobuf metrics");
+    }
+}
+
+// Prometheus before 2.0 asks for the protobuf format in Accept; later
+// versions only take the text format
+static bool wants_protobuf(const httpd::request& req) {
+    return req.get_header("Accept").find("application/vnd.google.protobuf") != sstring::npos;
+}
+
+/**
+ * Serves the metrics of all shards, streamed into the reply a family at
+ * a time, yielding between families when the reactor needs to run other
+ * work, so that a scrape of many series does not stall it.
+ *
+ * Metrics registered with an aggregation are combined over the shards;
+ * a per_shard=true query parameter lists every shard's series instead,
+ * for debugging.
+ */
+class metrics_handler : public httpd::handler_base {
+    const config& _ctx;
+public:
+    explicit metrics_handler(const config& ctx) : _ctx(ctx) {}
+
+    future<std::unique_ptr<httpd::reply>> handle(const sstring& path,
+            std::unique_ptr<httpd::request> req, std::unique_ptr<httpd::reply> rep) override {
+        bool protobuf = wants_protobuf(*req);
+        bool per_shard = req->get_query_param("per_shard") == "true";
+        return scrape::take().then([this, protobuf, per_shard, rep = std::move(rep)] (scrape sc) mutable {
+            auto& ctx = _ctx;
+            auto instance = scollectd::get_impl().host();
+            sstring instance_label;
+            if (instance != "") {
+                instance_label = ",instance=\"" + instance + "\"";
+            }
+            rep->write_body(protobuf ? "proto" : "txt",
+                    [&ctx, protobuf, per_shard, instance_label, sc = make_lw_shared<scrape>(std::move(sc))] (output_stream<char>&& s) {
+                return do_with(std::move(s), std::vector<scrape::part>(), std::vector<series>(),
+                        [&ctx, protobuf, per_shard, instance_label, sc] (output_stream<char>& out, auto& parts, auto& family) {
+                    return repeat([&ctx, protobuf, per_shard, &instance_label, sc, &out, &parts, &family] {
+                        if (!sc->next(parts)) {
+                            return make_ready_future<stop_iteration>(stop_iteration::yes);
+                        }
+                        family_series(family, parts, per_shard);
+                        std::string buf;
+                        if (protobuf) {
+                            write_protobuf_family(buf, ctx, family);
+                        } else {
+                            write_text_family(buf, ctx, instance_label, family);
                         }
-                        cpu++;
-                    }
-                    return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+                        return out.write(buf.data(), buf.size()).then([] {
+                            return stop_iteration::no;
+                        });
+                    }).finally([&out] {
+                        return out.close();
+                    });
                 });
             });
-        };
-        r.put(GET, "/metrics", new httpd::function_handler(f, "proto"));
+            if (!protobuf) {
+                rep->set_mime_type("text/plain; version=0.0.4");
+            }
+            rep->done();
+            return make_ready_future<std::unique_ptr<httpd::reply>>(std::move(rep));
+        });
+    }
+};
+
+future<> start(httpd::http_server_control& http_server, const config& ctx) {
+    return http_server.set_routes([&ctx](httpd::routes& r) {
+        r.put(httpd::GET, "/metrics", new metrics_handler(ctx));
     });
 }
 
@@ -48,6 +48,9 @@ class queue {
     // pops an item.
     T pop();
 
+    // The item pop() would return; the queue must not be empty.
+    T& front() { return _q.front(); }
+
     // Consumes items from the queue, passing them to @func, until @func
     // returns false or the queue it empty
     //
@@ -26,6 +26,7 @@
 #include <sys/statfs.h>
 #include "task.hh"
 #include "reactor.hh"
+#include "semaphore-metrics.hh"
 #include "memory.hh"
 #include "core/posix.hh"
 #include "net/packet.hh"
@@ -41,19 +42,26 @@
 #include "report_exception.hh"
 #include "util/log.hh"
 #include "file-impl.hh"
+#include "alien.hh"
+#include "tracing.hh"
+#include "bitops.hh"
 #include <cassert>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/eventfd.h>
+#include <linux/filter.h>
 #include <boost/filesystem.hpp>
 #include <boost/thread/barrier.hpp>
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/iterator/counting_iterator.hpp>
 #include <boost/range/numeric.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/range/adaptor/transformed.hpp>
 #include <boost/version.hpp>
 #include <atomic>
+#include <deque>
+#include <mutex>
 #include <dirent.h>
 #include <linux/types.h> // for xfs, below
 #include <sys/ioctl.h>
@@ -71,13 +79,16 @@
 #include <regex>
 #ifdef __GNUC__
 #include <iostream>
+#include <fstream>
 #include <system_error>
 #include <cxxabi.h>
 #endif
 
 #include <sys/mman.h>
 #include <sys/utsname.h>
+#include <sys/sysmacros.h>
 #include <linux/falloc.h>
+#include <linux/fs.h>
 #include <linux/magic.h>
 #include "util/backtrace.hh"
 #include "util/spinlock.hh"
@@ -88,7 +99,14 @@
 #include <osv/newpoll.hh>
 #endif
 
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
 #include <xmmintrin.h>
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
 #include "util/defer.hh"
 
 using namespace std::chrono_literals;
@@ -100,6 +118,8 @@ seastar::logger seastar_logger("seastar");
 
 std::atomic<lowres_clock::rep> lowres_clock::_now;
 std::atomic<manual_clock::rep> manual_clock::_now;
+std::atomic<bool> manual_clock::_simulated;
+lowres_clock::rep lowres_clock::_simulated_base;
 constexpr std::chrono::milliseconds lowres_clock::_granularity;
 
 timespec to_timespec(steady_clock_type::time_point t) {
@@ -116,11 +136,86 @@ lowres_clock::lowres_clock() {
 
 void lowres_clock::update() {
     using namespace std::chrono;
+    if (manual_clock::simulated()) {
+        // Offset from the real time so that it never reads as the
+        // unset time_point() timers use as a sentinel
+        auto ticks = duration_cast<milliseconds>(manual_clock::now().time_since_epoch()).count();
+        _now.store(_simulated_base + ticks, std::memory_order_relaxed);
+        return;
+    }
     auto now = steady_clock_type::now();
     auto ticks = duration_cast<milliseconds>(now.time_since_epoch()).count();
     _now.store(ticks, std::memory_order_relaxed);
 }
 
+thread_local tsc_clock::scale tsc_clock::_scale;
+
+// An invariant TSC ticks at a constant rate in every power state (CPUID
+// leaf 0x80000007, EDX bit 8); otherwise it can't stand for time.
+static bool tsc_is_invariant() {
+#ifdef __x86_64__
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1u << 8);
+#else
+    return false;
+#endif
+}
+
+void tsc_clock::calibrate() {
+    _scale = scale();
+#ifdef __x86_64__
+    if (!tsc_is_invariant()) {
+        return;
+    }
+    uint64_t tsc0 = __rdtsc();
+    auto ns0 = steady_now_ns();
+    uint64_t tsc1;
+    rep ns1;
+    do {
+        tsc1 = __rdtsc();
+        ns1 = steady_now_ns();
+    } while (ns1 - ns0 < 1000000);
+    if (tsc1 <= tsc0) {
+        return;
+    }
+    _scale.first_tsc = tsc0;
+    _scale.first_ns = ns0;
+    _scale.base_tsc = tsc1;
+    _scale.base_ns = ns1;
+    _scale.mult = (static_cast<unsigned __int128>(ns1 - ns0) << scale_shift) / (tsc1 - tsc0);
+#endif
+}
+
+void tsc_clock::refine() {
+#ifdef __x86_64__
+    if (!_scale.mult) {
+        return;
+    }
+    auto reading = now().time_since_epoch().count();
+    uint64_t tsc = __rdtsc();
+    auto ns = steady_now_ns();
+    if (tsc <= _scale.first_tsc) {
+        return;
+    }
+    uint64_t mult = (static_cast<unsigned __int128>(ns - _scale.first_ns) << scale_shift) / (tsc - _scale.first_tsc);
+    auto ahead = reading - ns;
+    _scale.base_tsc = tsc;
+    if (ahead <= 0) {
+        _scale.base_ns = ns;
+    } else {
+        // Stepping back would make intervals negative; run slower until
+        // the steady clock catches up, about a second from now
+        _scale.base_ns = reading;
+        mult -= static_cast<unsigned __int128>(mult) * std::min<rep>(ahead, 100000000) / 1000000000;
+    }
+    _scale.mult = mult;
+#endif
+}
+
 template <typename T>
 struct syscall_result {
     T result;
@@ -234,6 +329,10 @@ inline int task_quota_signal() {
     return SIGRTMIN + 1;
 }
 
+inline int cpu_profile_signal() {
+    return SIGRTMIN + 2;
+}
+
 // Installs signal handler stack for current thread.
 // The stack remains installed as long as the returned object is kept alive.
 // When it goes out of scope the previous handler is restored.
@@ -258,21 +357,120 @@ static decltype(auto) install_signal_handler_stack() {
     });
 }
 
+// Discards waiting for their turn on one I/O device. Ranges of a file
+// that touch are merged, and each is issued a chunk at a time through the
+// device's queue in the discard priority class, so that a large delete
+// trickles out at the class' rate instead of stalling the disk.
+class discard_queue {
+    struct range {
+        int fd;
+        bool blockdev;
+        // offset moves forward as chunks are issued
+        uint64_t offset;
+        uint64_t end;
+        std::vector<promise<>> waiters;
+    };
+    unsigned _device;
+    io_priority_class _pc;
+    uint64_t _chunk;
+    std::deque<range> _ranges;
+    bool _running = false;
+    uint64_t _discarded_bytes = 0;
+    uint64_t _discards = 0;
+public:
+    discard_queue(unsigned device, io_priority_class pc, uint64_t chunk)
+        : _device(device), _pc(pc), _chunk(chunk) {}
+    future<> queue(int fd, bool blockdev, uint64_t offset, uint64_t length);
+    uint64_t backlog_bytes() const {
+        uint64_t bytes = 0;
+        for (auto&& r : _ranges) {
+            bytes += r.end - r.offset;
+        }
+        return bytes;
+    }
+    size_t backlog_ranges() const {
+        return _ranges.size();
+    }
+    uint64_t discarded_bytes() const {
+        return _discarded_bytes;
+    }
+    uint64_t discards() const {
+        return _discards;
+    }
+private:
+    void run();
+};
+
+// The completion ring the kernel maps at a linux-aio context's address;
+// struct aio_ring in fs/aio.c. The kernel advances tail as requests
+// complete, and io_getevents() advances head as it consumes them, which
+// userspace may do as well.
+struct linux_aio_ring {
+    static constexpr uint32_t magic_value = 0xa10a10a1;
+    uint32_t id;
+    uint32_t nr;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t magic;
+    uint32_t compat_features;
+    uint32_t incompat_features;
+    uint32_t header_length;
+    // followed by nr io_events
+};
+
+// Whether completions can be read from the context's ring, rather than
+// with io_getevents(); false for ring layouts we don't know
+static bool aio_ring_usable(io_context_t ctx) {
+    auto ring = reinterpret_cast<const linux_aio_ring*>(ctx);
+    return ring && ring->magic == linux_aio_ring::magic_value
+            && !ring->incompat_features
+            && ring->header_length == sizeof(linux_aio_ring);
+}
+
+// Reaps up to max completions from the context's ring without entering
+// the kernel; returns -1 if the ring looks inconsistent, so that the
+// caller can fall back to io_getevents().
+static int reap_aio_ring(io_context_t ctx, io_event* ev, size_t max) {
+    auto ring = reinterpret_cast<linux_aio_ring*>(ctx);
+    auto events = reinterpret_cast<const io_event*>(ring + 1);
+    auto nr = ring->nr;
+    auto head = ring->head;
+    auto tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head >= nr || tail >= nr) {
+        return -1;
+    }
+    size_t n = 0;
+    while (head != tail && n < max) {
+        ev[n++] = events[head];
+        head = head + 1 == nr ? 0 : head + 1;
+    }
+    if (n) {
+        // Frees the slots: the kernel counts ring space, and so admits new
+        // requests, from head
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
 reactor::reactor()
-    : _backend()
 #ifdef HAVE_OSV
+    : _backend()
     , _timer_thread(
         [&] { timer_thread_func(); }, sched::thread::attr().stack(4096).name("timer_thread").pin(sched::cpu::current()))
     , _engine_thread(sched::thread::current())
+#else
+    : _backend(std::make_unique<reactor_backend_epoll>())
 #endif
     , _cpu_started(0)
     , _io_context(0)
-    , _io_context_available(max_aio)
-    , _reuseport(posix_reuseport_detect()) {
+    , _io_context_available(max_aio) {
 
     seastar::thread_impl::init();
+    tsc_clock::calibrate();
+    _task_queues[0] = std::make_unique<task_queue>(0, "main", 1000);
     auto r = ::io_setup(max_aio, &_io_context);
     assert(r >= 0);
+    _aio_ring_reaping = aio_ring_usable(_io_context);
 #ifdef HAVE_OSV
     _timer_thread.start();
 #else
@@ -295,6 +493,9 @@ reactor::reactor()
     r = ::pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
     assert(r == 0);
 #endif
+    _alien_queue = std::make_unique<seastar::alien::message_queue>(this);
+    _smp_ready.resize(smp::count);
+    _smp_unflushed.resize(_smp_ready.nr_words());
     memory::set_reclaim_hook([this] (std::function<void ()> reclaim_fn) {
         add_high_priority_task(make_task([fn = std::move(reclaim_fn)] {
             fn();
@@ -303,6 +504,9 @@ reactor::reactor()
 }
 
 reactor::~reactor() {
+    if (_cpu_profile_timer_created) {
+        timer_delete(_cpu_profile_timer);
+    }
     timer_delete(_task_quota_timer);
     timer_delete(_steady_clock_timer);
     auto eraser = [](auto& list) {
@@ -318,9 +522,110 @@ reactor::~reactor() {
 
 void
 reactor::clear_task_quota(int) {
-    g_need_preempt = true;
+    if (local_engine) {
+        local_engine->check_for_stall();
+    }
+    g_need_preempt.store(true, std::memory_order_relaxed);
 }
 
+// Called from the task quota signal handler. run_some_tasks() clears
+// g_need_preempt every time the reactor gets back to its poll loop, so
+// finding it still set means nothing has looked at it for a whole quota.
+void reactor::check_for_stall() noexcept {
+    if (!g_need_preempt.load(std::memory_order_relaxed)) {
+        _stall_ticks = 0;
+        return;
+    }
+    if (++_stall_ticks == _stall_report_ticks) {
+        ++_stalls;
+        report_stall();
+    }
+}
+
+void
+reactor::report_stall_on_signal(int) {
+    if (local_engine) {
+        ++local_engine->_stalls;
+        local_engine->report_stall();
+    }
+}
+
+// With --preempt-source=thread, one thread per process sets the preemption
+// flag of every registered reactor once per task quota, so reactors do not
+// take a timer signal every quota.  It also does stall detection, and only
+// signals a reactor when it has to collect a backtrace from it.
+class preempt_timer_thread {
+    struct entry {
+        reactor* r;
+        std::atomic<bool>* flag;
+        pthread_t thread;
+        unsigned stall_ticks;
+    };
+    std::mutex _mutex;
+    std::vector<entry> _entries;
+    std::chrono::nanoseconds _period;
+    std::atomic<bool> _stopped = { false };
+    std::unique_ptr<posix_thread> _thread;
+public:
+    void add(reactor& r, std::chrono::nanoseconds period) {
+        std::lock_guard<std::mutex> g(_mutex);
+        _entries.push_back(entry{&r, &g_need_preempt, pthread_self(), 0});
+        if (!_thread) {
+            _period = period;
+            _stopped.store(false, std::memory_order_relaxed);
+            _thread = std::make_unique<posix_thread>([this] { run(); });
+        }
+    }
+    void remove(reactor& r) {
+        std::unique_ptr<posix_thread> to_join;
+        {
+            std::lock_guard<std::mutex> g(_mutex);
+            _entries.erase(std::remove_if(_entries.begin(), _entries.end(),
+                    [&r] (const entry& e) { return e.r == &r; }), _entries.end());
+            if (_entries.empty() && _thread) {
+                _stopped.store(true, std::memory_order_relaxed);
+                to_join = std::move(_thread);
+            }
+        }
+        if (to_join) {
+            to_join->join();
+        }
+    }
+private:
+    void run() {
+        sigset_t mask;
+        sigfillset(&mask);
+        auto r = ::pthread_sigmask(SIG_BLOCK, &mask, NULL);
+        throw_pthread_error(r);
+        auto next = std::chrono::steady_clock::now();
+        while (!_stopped.load(std::memory_order_relaxed)) {
+            next += _period;
+            std::this_thread::sleep_until(next);
+            std::lock_guard<std::mutex> g(_mutex);
+            for (auto& e : _entries) {
+                tick(e);
+            }
+        }
+    }
+    void tick(entry& e) {
+        if (e.r->_preempt_paused.load(std::memory_order_relaxed)) {
+            e.stall_ticks = 0;
+            return;
+        }
+        // The reactor clears the flag each time it gets back to its poll
+        // loop; finding it still set means it has not for a whole quota.
+        if (e.flag->exchange(true, std::memory_order_relaxed)) {
+            if (++e.stall_ticks == e.r->_stall_report_ticks) {
+                pthread_kill(e.thread, task_quota_signal());
+            }
+        } else {
+            e.stall_ticks = 0;
+        }
+    }
+};
+
+static preempt_timer_thread g_preempt_timer_thread;
+
 template <typename T, typename E, typename EnableFunc>
 void reactor::complete_timers(T& timers, E& expired_timers, EnableFunc&& enable_fn) {
     expired_timers = timers.expire(timers.now());
@@ -359,7 +664,7 @@ void reactor::timer_thread_func() {
                 if (tmr.expired()) {
                     _timer_due = 0;
                     _engine_thread->unsafe_stop();
-                    _pending_tasks.push_front(make_task([this] {
+                    add_urgent_task(make_task([this] {
                         complete_timers(_timers, _expired_timers, [this] {
                             if (!_timers.empty()) {
                                 enable_timer(_timers.get_next_timeout());
@@ -412,7 +717,54 @@ class network_stack_registry {
     static future<std::unique_ptr<network_stack>> create(sstring name, options opts);
 };
 
+#ifndef HAVE_OSV
+void reactor::select_backend(const sstring& name) {
+    if (name == "epoll") {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (name == "io_uring") {
+        if (reactor_backend_uring::available()) {
+            _backend = std::make_unique<reactor_backend_uring>();
+        } else if (_id == 0) {
+            seastar_logger.warn("io_uring is not supported by this kernel, falling back to epoll");
+        }
+        return;
+    }
+#endif
+    throw std::runtime_error(sprint("unknown reactor backend: %s", name));
+}
+#endif
+
+static memory::numa_policy parse_numa_policy(const std::string& s) {
+    static const std::unordered_map<std::string, memory::numa_policy> policies = {
+        { "none", memory::numa_policy::none },
+        { "preferred", memory::numa_policy::preferred },
+        { "bind", memory::numa_policy::bind },
+        { "interleave", memory::numa_policy::interleave },
+    };
+    auto i = policies.find(s);
+    if (i == policies.end()) {
+        throw std::runtime_error(sprint("unknown NUMA policy '%s'; expected none, preferred, bind or interleave", s));
+    }
+    return i->second;
+}
+
 void reactor::configure(boost::program_options::variables_map vm) {
+#ifndef HAVE_OSV
+    // Must happen before anything registers a file descriptor with the backend.
+    select_backend(vm["reactor-backend"].as<std::string>());
+#endif
+    // Must be known before the network stack is created
+    auto reuseport = vm["posix-reuseport"].as<std::string>();
+    if (reuseport != "off" && reuseport != "hash" && reuseport != "cpu") {
+        throw std::runtime_error(sprint("unknown --posix-reuseport mode: %s", reuseport));
+    }
+    _reuseport = reuseport != "off" && posix_reuseport_detect();
+    _reuseport_cpu_steering = _reuseport && reuseport == "cpu" && posix_reuseport_cpu_steering_detect();
+    if (reuseport == "cpu" && !_reuseport_cpu_steering && _id == 0) {
+        seastar_logger.warn("SO_ATTACH_REUSEPORT_CBPF is not supported, connections are spread by hash");
+    }
     auto network_stack_ready = vm.count("network-stack")
         ? network_stack_registry::create(sstring(vm["network-stack"].as<std::string>()), vm)
         : network_stack_registry::create(vm);
@@ -422,37 +774,83 @@ void reactor::configure(boost::program_options::variables_map vm) {
 
     _handle_sigint = !vm.count("no-handle-interrupt");
     _task_quota = vm["task-quota-ms"].as<double>() * 1ms;
+    auto blocked_ms = vm["blocked-reactor-notify-ms"].as<unsigned>();
+    _stall_report_ticks = blocked_ms
+            ? std::max<unsigned>(1, std::ceil(std::chrono::duration<double>(blocked_ms * 1ms) / _task_quota))
+            : 0;
     _max_task_backlog = vm["max-task-backlog"].as<unsigned>();
+    if (vm.count("elastic-memory")) {
+        auto own = memory::stats().total_memory();
+        memory::set_rebalancing_watermarks(own * vm["memory-borrow-watermark"].as<double>(),
+                own * vm["memory-donate-watermark"].as<double>());
+        _rebalance_memory = true;
+    }
+    if (vm.count("discard-rate")) {
+        _discard_rate = double(parse_memory_size(vm["discard-rate"].as<std::string>())) / smp::count;
+    }
+    _work_stealing = vm["work-stealing"].as<bool>();
+    auto preempt_source = vm["preempt-source"].as<std::string>();
+    if (preempt_source != "signal" && preempt_source != "thread") {
+        throw std::runtime_error(sprint("unknown preemption source: %s", preempt_source));
+    }
+    _preempt_from_thread = preempt_source == "thread";
+#ifndef HAVE_OSV
+    _thread_pool.set_thread_count(std::max(1u, vm["syscall-threads"].as<unsigned>()));
+    _thread_pool.set_numa_policy(parse_numa_policy(vm["numa-syscall-threads"].as<std::string>()),
+            memory::home_numa_node());
+#endif
     _max_poll_time = vm["idle-poll-time-us"].as<unsigned>() * 1us;
     if (vm.count("poll-mode")) {
         _max_poll_time = std::chrono::nanoseconds::max();
     }
+    if (vm.count("simulated-time")) {
+        manual_clock::set_simulated(true);
+    }
     if (vm.count("overprovisioned")
            && vm["idle-poll-time-us"].defaulted()
            && !vm.count("poll-mode")) {
         _max_poll_time = 0us;
     }
+    auto idle_poll_mode = vm["idle-poll-mode"].as<std::string>();
+    if (idle_poll_mode == "adaptive") {
+        _adaptive_idle_poll = !vm.count("poll-mode");
+        _learned_poll_time = _max_poll_time;
+    } else if (idle_poll_mode != "fixed") {
+        throw std::runtime_error(sprint("unknown idle poll mode: %s", idle_poll_mode));
+    }
     set_strict_dma(!vm.count("relaxed-dma"));
-    if (!vm["poll-aio"].as<bool>()
-            || (vm["poll-aio"].defaulted() && vm.count("overprovisioned"))) {
+    _aio_merge = vm["aio-merge"].as<bool>();
+    _epoll_edge_triggered = vm["epoll-edge-triggered"].as<bool>();
+    if ((!vm["poll-aio"].as<bool>()
+            || (vm["poll-aio"].defaulted() && vm.count("overprovisioned")))
+            && !backend().handles_disk_io()) {
         _aio_eventfd = pollable_fd(file_desc::eventfd(0, 0));
     }
 }
 
+int reactor_backend_epoll::epoll_ctl(int op, pollable_fd_state& pfd) {
+    ++engine()._epoll_ctl_calls;
+    ::epoll_event eevt;
+    eevt.events = pfd.events_epoll | (pfd.edge_triggered ? EPOLLET : 0);
+    eevt.data.ptr = &pfd;
+    return ::epoll_ctl(_epollfd.get(), op, pfd.fd.get(), &eevt);
+}
+
 future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
         promise<> pollable_fd_state::*pr, int event) {
     if (pfd.events_known & event) {
-        pfd.events_known &= ~event;
+        // Edge-triggered readiness lasts until the caller sees EAGAIN
+        if (!pfd.edge_triggered) {
+            pfd.events_known &= ~event;
+        }
         return make_ready_future();
     }
     pfd.events_requested |= event;
     if (!(pfd.events_epoll & event)) {
         auto ctl = pfd.events_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-        pfd.events_epoll |= event;
-        ::epoll_event eevt;
-        eevt.events = pfd.events_epoll;
-        eevt.data.ptr = &pfd;
-        int r = ::epoll_ctl(_epollfd.get(), ctl, pfd.fd.get(), &eevt);
+        // Edge-triggered fds are installed once, for both directions
+        pfd.events_epoll |= pfd.edge_triggered ? EPOLLIN | EPOLLOUT : event;
+        int r = epoll_ctl(ctl, pfd);
         assert(r == 0);
         engine().start_epoll();
     }
@@ -462,13 +860,10 @@ future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
 
 void reactor_backend_epoll::abort_fd(pollable_fd_state& pfd, std::exception_ptr ex,
                                      promise<> pollable_fd_state::* pr, int event) {
-    if (pfd.events_epoll & event) {
+    if ((pfd.events_epoll & event) && !pfd.edge_triggered) {
         pfd.events_epoll &= ~event;
         auto ctl = pfd.events_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        ::epoll_event eevt;
-        eevt.events = pfd.events_epoll;
-        eevt.data.ptr = &pfd;
-        int r = ::epoll_ctl(_epollfd.get(), ctl, pfd.fd.get(), &eevt);
+        int r = epoll_ctl(ctl, pfd);
         assert(r == 0);
     }
     if (pfd.events_requested & event) {
@@ -496,7 +891,7 @@ void reactor_backend_epoll::abort_writer(pollable_fd_state& fd, std::exception_p
 
 void reactor_backend_epoll::forget(pollable_fd_state& fd) {
     if (fd.events_epoll) {
-        ::epoll_ctl(_epollfd.get(), EPOLL_CTL_DEL, fd.fd.get(), nullptr);
+        epoll_ctl(EPOLL_CTL_DEL, fd);
     }
 }
 
@@ -508,25 +903,470 @@ future<> reactor_backend_epoll::notified(reactor_notifier *n) {
     abort();
 }
 
+#ifdef HAVE_IO_URING
+
+// There is no liburing in our build dependencies; the interface is small
+// enough to drive with raw system calls.
+static int sys_io_uring_setup(unsigned entries, ::io_uring_params* p) {
+    return ::syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const sigset_t* sig) {
+    return ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, sig, _NSIG / 8);
+}
+
+// user_data of every sqe we submit carries a tag in its low bits; the rest
+// is a pointer (all of which are at least 8-byte aligned).
+enum : uintptr_t {
+    uring_tag_disk = 0,     // promise<io_event>*
+    uring_tag_pollin = 1,   // fd_state*
+    uring_tag_pollout = 2,  // fd_state*
+    uring_tag_ignore = 3,   // completions we don't care about (POLL_REMOVE)
+    uring_tag_mask = 3,
+};
+
+// Per-fd state, hung off pollable_fd_state::backend_data. It is separate
+// from the pollable_fd_state because the kernel may still complete a
+// POLL_ADD after the pollable_fd_state is gone; we keep it alive until all
+// polls we submitted for it have completed.
+struct reactor_backend_uring::fd_state {
+    pollable_fd_state* pfd;
+    unsigned inflight = 0;
+    explicit fd_state(pollable_fd_state* pfd) : pfd(pfd) {}
+};
+
+bool reactor_backend_uring::available() {
+    ::io_uring_params p = {};
+    int fd = sys_io_uring_setup(1, &p);
+    if (fd == -1) {
+        return false;
+    }
+    ::close(fd);
+    // IORING_FEAT_NODROP guarantees that we don't lose completions if the
+    // completion ring overflows; without it a burst of readiness events could
+    // silently drop a disk I/O completion. IORING_FEAT_RW_CUR_POS marks
+    // kernels (5.6+) that also have IORING_OP_READ/WRITE, which
+    // submit_disk_io() uses for non-vectored requests.
+    return (p.features & IORING_FEAT_NODROP) && (p.features & IORING_FEAT_RW_CUR_POS);
+}
+
+static file_desc create_uring(unsigned entries, ::io_uring_params& p) {
+    p = {};
+    // Readiness events may outnumber submissions, so ask for a larger
+    // completion ring if the kernel lets us.
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd == -1 && errno == EINVAL) {
+        p = {};
+        fd = sys_io_uring_setup(entries, &p);
+    }
+    throw_system_error_on(fd == -1, "io_uring_setup");
+    return file_desc::from_fd(fd);
+}
+
+reactor_backend_uring::reactor_backend_uring()
+        : reactor_backend_uring(::io_uring_params()) {
+}
+
+reactor_backend_uring::reactor_backend_uring(::io_uring_params p)
+        : _ring_fd(create_uring(ring_entries, p)) {
+    auto sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    auto cq_size = p.cq_off.cqes + p.cq_entries * sizeof(::io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        _sq_ring = _ring_fd.map_shared_rw(std::max(sq_size, cq_size), IORING_OFF_SQ_RING);
+    } else {
+        _sq_ring = _ring_fd.map_shared_rw(sq_size, IORING_OFF_SQ_RING);
+        _cq_ring = _ring_fd.map_shared_rw(cq_size, IORING_OFF_CQ_RING);
+    }
+    _sqe_area = _ring_fd.map_shared_rw(p.sq_entries * sizeof(::io_uring_sqe), IORING_OFF_SQES);
+    auto sq = _sq_ring.get();
+    auto cq = _cq_ring ? _cq_ring.get() : sq;
+    _sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    _sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    _sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    _sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    _sq_entries = p.sq_entries;
+    _cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    _cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    _sqes = reinterpret_cast<::io_uring_sqe*>(_sqe_area.get());
+    _cqes = reinterpret_cast<::io_uring_cqe*>(cq + p.cq_off.cqes);
+    _sq_local_tail = *_sq_tail;
+}
+
+::io_uring_sqe* reactor_backend_uring::get_sqe() {
+    auto head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    if (_sq_local_tail - head == _sq_entries) {
+        // Ring is full; hand what we have to the kernel to make room.
+        publish_sqes();
+        enter(0, nullptr);
+        head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+        if (_sq_local_tail - head == _sq_entries) {
+            return nullptr;
+        }
+    }
+    auto idx = _sq_local_tail & _sq_mask;
+    auto sqe = &_sqes[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    _sq_array[idx] = idx;
+    ++_sq_local_tail;
+    return sqe;
+}
+
+void reactor_backend_uring::publish_sqes() {
+    auto tail = *_sq_tail;
+    if (tail != _sq_local_tail) {
+        _unsubmitted += _sq_local_tail - tail;
+        __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+    }
+}
+
+int reactor_backend_uring::enter(unsigned min_complete, const sigset_t* active_sigmask) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    if (!_unsubmitted && !flags) {
+        return 0;
+    }
+    auto r = sys_io_uring_enter(_ring_fd.get(), _unsubmitted, min_complete, flags, active_sigmask);
+    if (r == -1) {
+        // EINTR: a signal woke us up (which is how the reactor is woken);
+        // EAGAIN/EBUSY: the kernel is short on resources or the completion
+        // ring is full; either way reaping and retrying later is correct.
+        assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        return 0;
+    }
+    _unsubmitted -= r;
+    return r;
+}
+
+unsigned reactor_backend_uring::reap_completions() {
+    auto head = *_cq_head;
+    auto tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    unsigned nr = 0;
+    unsigned disk = 0;
+    while (head != tail) {
+        auto& cqe = _cqes[head & _cq_mask];
+        auto data = uintptr_t(cqe.user_data);
+        auto res = cqe.res;
+        ++head;
+        ++nr;
+        switch (data & uring_tag_mask) {
+        case uring_tag_disk: {
+            auto pr = reinterpret_cast<promise<io_event>*>(data);
+            io_event ev = {};
+            ev.data = pr;
+            ev.res = res;
+            pr->set_value(ev);
+            delete pr;
+            ++disk;
+            break;
+        }
+        case uring_tag_pollin:
+            complete_poll(reinterpret_cast<fd_state*>(data & ~uring_tag_mask), EPOLLIN, res);
+            break;
+        case uring_tag_pollout:
+            complete_poll(reinterpret_cast<fd_state*>(data & ~uring_tag_mask), EPOLLOUT, res);
+            break;
+        default:
+            break;
+        }
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    if (disk) {
+        engine()._io_context_available.signal(disk);
+    }
+    return nr;
+}
+
+reactor_backend_uring::fd_state& reactor_backend_uring::state_of(pollable_fd_state& fd) {
+    if (!fd.backend_data) {
+        fd.backend_data = new fd_state(&fd);
+    }
+    return *reinterpret_cast<fd_state*>(fd.backend_data);
+}
+
+void reactor_backend_uring::put_state(fd_state* st) {
+    if (!st->pfd && !st->inflight) {
+        delete st;
+    }
+}
+
+void reactor_backend_uring::poll_add(pollable_fd_state& fd, int event) {
+    auto& st = state_of(fd);
+    auto sqe = get_sqe();
+    assert(sqe); // get_sqe() only fails if the kernel refuses to consume sqes
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd.fd.get();
+    sqe->poll_events = event;
+    sqe->user_data = uintptr_t(&st) | (event == EPOLLIN ? uring_tag_pollin : uring_tag_pollout);
+    ++st.inflight;
+    fd.events_epoll |= event;
+}
+
+void reactor_backend_uring::poll_remove(pollable_fd_state& fd, int event) {
+    auto& st = state_of(fd);
+    auto sqe = get_sqe();
+    assert(sqe);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uintptr_t(&st) | (event == EPOLLIN ? uring_tag_pollin : uring_tag_pollout);
+    sqe->user_data = uring_tag_ignore;
+    fd.events_epoll &= ~event;
+}
+
+void reactor_backend_uring::complete_poll(fd_state* st, int event, int res) {
+    --st->inflight;
+    auto pfd = st->pfd;
+    if (!pfd) {
+        put_state(st);
+        return;
+    }
+    if (res < 0) {
+        // Cancelled by poll_remove(), which already updated events_epoll;
+        // a newer poll may be in flight, so leave the state alone.
+        return;
+    }
+    pfd->events_epoll &= ~event;
+    auto pr = event == EPOLLIN ? &pollable_fd_state::pollin : &pollable_fd_state::pollout;
+    // Errors and hangups are delivered regardless of the mask we asked for
+    // and make the fd ready for both directions, as with epoll.
+    if (pfd->events_requested & event) {
+        pfd->events_requested &= ~event;
+        pfd->events_known &= ~event;
+        (pfd->*pr).set_value();
+        pfd->*pr = promise<>();
+    }
+}
+
+future<> reactor_backend_uring::get_poll_future(pollable_fd_state& pfd,
+        promise<> pollable_fd_state::*pr, int event) {
+    if (pfd.events_known & event) {
+        pfd.events_known &= ~event;
+        return make_ready_future();
+    }
+    pfd.events_requested |= event;
+    if (!(pfd.events_epoll & event)) {
+        poll_add(pfd, event);
+        engine().start_epoll();
+    }
+    pfd.*pr = promise<>();
+    return (pfd.*pr).get_future();
+}
+
+void reactor_backend_uring::abort_fd(pollable_fd_state& pfd, std::exception_ptr ex,
+                                     promise<> pollable_fd_state::* pr, int event) {
+    if (pfd.events_epoll & event) {
+        poll_remove(pfd, event);
+    }
+    if (pfd.events_requested & event) {
+        pfd.events_requested &= ~event;
+        (pfd.*pr).set_exception(std::move(ex));
+    }
+    pfd.events_known &= ~event;
+}
+
+future<> reactor_backend_uring::readable(pollable_fd_state& fd) {
+    return get_poll_future(fd, &pollable_fd_state::pollin, EPOLLIN);
+}
+
+future<> reactor_backend_uring::writeable(pollable_fd_state& fd) {
+    return get_poll_future(fd, &pollable_fd_state::pollout, EPOLLOUT);
+}
+
+void reactor_backend_uring::abort_reader(pollable_fd_state& fd, std::exception_ptr ex) {
+    abort_fd(fd, std::move(ex), &pollable_fd_state::pollin, EPOLLIN);
+}
+
+void reactor_backend_uring::abort_writer(pollable_fd_state& fd, std::exception_ptr ex) {
+    abort_fd(fd, std::move(ex), &pollable_fd_state::pollout, EPOLLOUT);
+}
+
+void reactor_backend_uring::forget(pollable_fd_state& fd) {
+    if (!fd.backend_data) {
+        return;
+    }
+    if (fd.events_epoll & EPOLLIN) {
+        poll_remove(fd, EPOLLIN);
+    }
+    if (fd.events_epoll & EPOLLOUT) {
+        poll_remove(fd, EPOLLOUT);
+    }
+    // The fd is about to be closed; make sure the kernel sees the removals
+    // before a new fd with the same number can be polled.
+    publish_sqes();
+    enter(0, nullptr);
+    auto st = reinterpret_cast<fd_state*>(fd.backend_data);
+    fd.backend_data = nullptr;
+    st->pfd = nullptr;
+    put_state(st);
+}
+
+size_t reactor_backend_uring::submit_disk_io(::iocb** iocbs, size_t nr) {
+    size_t i = 0;
+    for (; i < nr; ++i) {
+        auto& io = *iocbs[i];
+        auto sqe = get_sqe();
+        if (!sqe) {
+            break;
+        }
+        sqe->fd = io.aio_fildes;
+        sqe->off = io.u.c.offset;
+        sqe->addr = uintptr_t(io.u.c.buf);
+        sqe->len = io.u.c.nbytes;
+        sqe->user_data = uintptr_t(io.data) | uring_tag_disk;
+        switch (io.aio_lio_opcode) {
+        case IO_CMD_PREAD:
+            sqe->opcode = IORING_OP_READ;
+            break;
+        case IO_CMD_PWRITE:
+            sqe->opcode = IORING_OP_WRITE;
+            break;
+        case IO_CMD_PREADV:
+            sqe->opcode = IORING_OP_READV;
+            break;
+        case IO_CMD_PWRITEV:
+            sqe->opcode = IORING_OP_WRITEV;
+            break;
+        case IO_CMD_FDSYNC:
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            // fall through
+        case IO_CMD_FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->addr = 0;
+            sqe->len = 0;
+            break;
+        default:
+            abort();
+        }
+    }
+    publish_sqes();
+    enter(0, nullptr);
+    return i;
+}
+
+bool reactor_backend_uring::reap_disk_io() {
+    // Completion order is shared with poll events, so reap everything.
+    return reap_completions();
+}
+
+bool
+reactor_backend_uring::wait_and_process(int timeout, const sigset_t* active_sigmask) {
+    publish_sqes();
+    enter(0, nullptr);
+    auto nr = reap_completions();
+    if (nr || timeout == 0) {
+        return nr;
+    }
+    // Sleeping (timeout == -1): the reactor's timers and cross-cpu wakeups
+    // arrive as signals, which interrupt io_uring_enter() with EINTR.
+    enter(1, active_sigmask);
+    return reap_completions();
+}
+
+future<> reactor_backend_uring::notified(reactor_notifier *n) {
+    std::cout << "reactor_backend_uring does not yet support notifiers!\n";
+    abort();
+}
+
+#endif /* HAVE_IO_URING */
+
+
+// The kernel selects the socket of a reuseport group by its index in the
+// group: the order in which the sockets joined it, except that closing
+// one moves the last into its place. We mirror that for each address
+// listened on with CPU steering, as the CPU of each socket's shard.
+static std::mutex reuseport_groups_mutex;
+static std::unordered_map<socket_address, std::vector<unsigned>> reuseport_groups;
+
+// A classic BPF program that selects the socket of the shard running on
+// the CPU the packet was received on. Packets received on other CPUs
+// get an index past the end, and the kernel falls back to its hash.
+static std::vector<sock_filter> reuseport_cpu_steering_program(const std::vector<unsigned>& cpus) {
+    std::vector<sock_filter> prog;
+    prog.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, uint32_t(SKF_AD_OFF + SKF_AD_CPU)));
+    for (unsigned i = 0; i < cpus.size(); ++i) {
+        prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1));
+        prog.push_back(BPF_STMT(BPF_RET | BPF_K, i));
+    }
+    prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+    return prog;
+}
+
+static void attach_reuseport_program(file_desc& fd, std::vector<sock_filter> prog) {
+    // Too many sockets for one program; the group keeps the previous one
+    if (prog.size() > BPF_MAXINSNS) {
+        return;
+    }
+    sock_fprog fprog;
+    fprog.len = prog.size();
+    fprog.filter = prog.data();
+    fd.setsockopt(SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, fprog);
+}
+
+// Sockets bound to port 0 each get a port, and a group, of their own
+static bool reuseport_steerable(const socket_address& sa) {
+    switch (sa.u.sa.sa_family) {
+    case AF_INET: return sa.u.in.sin_port != 0;
+    case AF_INET6: return sa.u.in6.sin6_port != 0;
+    default: return false;
+    }
+}
 
 pollable_fd
 reactor::posix_listen(socket_address sa, listen_options opts) {
-    file_desc fd = file_desc::socket(sa.u.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, int(opts.proto));
+    auto proto = sa.is_unix_domain() ? 0 : int(opts.proto);
+    file_desc fd = file_desc::socket(sa.u.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, proto);
     if (opts.reuse_address) {
         fd.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1);
     }
     if (_reuseport)
         fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
 
-    fd.bind(sa.u.sa, sizeof(sa.u.sas));
+    if (_reuseport_cpu_steering && reuseport_steerable(sa)) {
+        // Joining the group and attaching the program that knows about it
+        // must not interleave with other shards doing the same
+        std::lock_guard<std::mutex> g(reuseport_groups_mutex);
+        fd.bind(sa.u.sa, sa.length());
+        auto& cpus = reuseport_groups[sa];
+        cpus.push_back(::sched_getcpu());
+        attach_reuseport_program(fd, reuseport_cpu_steering_program(cpus));
+    } else {
+        fd.bind(sa.u.sa, sa.length());
+    }
     fd.listen(100);
-    return pollable_fd(std::move(fd));
+    pollable_fd pfd(std::move(fd));
+    pfd.enable_edge_triggered();
+    return pfd;
+}
+
+void
+reactor::posix_reuseport_close(socket_address sa, pollable_fd& lfd) {
+    if (!_reuseport_cpu_steering || !reuseport_steerable(sa)) {
+        return;
+    }
+    std::lock_guard<std::mutex> g(reuseport_groups_mutex);
+    auto i = reuseport_groups.find(sa);
+    if (i == reuseport_groups.end()) {
+        return;
+    }
+    auto& cpus = i->second;
+    auto me = std::find(cpus.begin(), cpus.end(), unsigned(::sched_getcpu()));
+    if (me == cpus.end()) {
+        return;
+    }
+    *me = cpus.back();
+    cpus.pop_back();
+    if (cpus.empty()) {
+        reuseport_groups.erase(i);
+    } else {
+        // Still in the group, so the program replaces the group's
+        attach_reuseport_program(lfd.get_file_desc(), reuseport_cpu_steering_program(cpus));
+    }
+    lfd.close();
 }
 
 bool
 reactor::posix_reuseport_detect() {
-    return false; // FIXME: reuseport currently leads to heavy load imbalance. Until we fix that, just
-                  // disable it unconditionally.
     try {
         file_desc fd = file_desc::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
@@ -536,16 +1376,35 @@ reactor::posix_reuseport_detect() {
     }
 }
 
+bool
+reactor::posix_reuseport_cpu_steering_detect() {
+    try {
+        file_desc fd = file_desc::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+        attach_reuseport_program(fd, reuseport_cpu_steering_program({}));
+        return true;
+    } catch(std::system_error& e) {
+        return false;
+    }
+}
+
 lw_shared_ptr<pollable_fd>
 reactor::make_pollable_fd(socket_address sa, transport proto) {
-    file_desc fd = file_desc::socket(sa.u.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, int(proto));
-    return make_lw_shared<pollable_fd>(pollable_fd(std::move(fd)));
+    file_desc fd = file_desc::socket(sa.u.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            sa.is_unix_domain() ? 0 : int(proto));
+    auto pfd = make_lw_shared<pollable_fd>(pollable_fd(std::move(fd)));
+    pfd->enable_edge_triggered();
+    return pfd;
 }
 
 future<>
 reactor::posix_connect(lw_shared_ptr<pollable_fd> pfd, socket_address sa, socket_address local) {
-    pfd->get_file_desc().bind(local.u.sa, sizeof(sa.u.sas));
-    pfd->get_file_desc().connect(sa.u.sa, sizeof(sa.u.sas));
+    // The default local address is an IPv4 wildcard, meaningless for Unix
+    // domain sockets; those stay unnamed unless given a name of their own
+    if (!sa.is_unix_domain() || local.is_unix_domain()) {
+        pfd->get_file_desc().bind(local.u.sa, local.length());
+    }
+    pfd->get_file_desc().connect(sa.u.sa, sa.length());
     return pfd->writeable().then([pfd]() mutable {
         auto err = pfd->get_file_desc().getsockopt<int>(SOL_SOCKET, SO_ERROR);
         if (err != 0) {
@@ -574,7 +1433,9 @@ void reactor_backend_epoll::complete_epoll_event(pollable_fd_state& pfd, promise
         int events, int event) {
     if (pfd.events_requested & events & event) {
         pfd.events_requested &= ~event;
-        pfd.events_known &= ~event;
+        if (!pfd.edge_triggered) {
+            pfd.events_known &= ~event;
+        }
         (pfd.*pr).set_value();
         pfd.*pr = promise<>();
     }
@@ -583,7 +1444,13 @@ void reactor_backend_epoll::complete_epoll_event(pollable_fd_state& pfd, promise
 template <typename Func>
 future<io_event>
 reactor::submit_io(Func prepare_io) {
-    return _io_context_available.wait(1).then([this, prepare_io = std::move(prepare_io)] () mutable {
+    return submit_io(*_io_queue, std::move(prepare_io));
+}
+
+template <typename Func>
+future<io_event>
+reactor::submit_io(const io_queue& queue, Func prepare_io) {
+    return _io_context_available.wait(1).then([this, &queue, prepare_io = std::move(prepare_io)] () mutable {
         auto pr = std::make_unique<promise<io_event>>();
         iocb io;
         prepare_io(io);
@@ -594,24 +1461,145 @@ reactor::submit_io(Func prepare_io) {
         io.data = pr.get();
         _pending_aio.push_back(io);
         pr.release();
-        if ((_io_queue->queued_requests() > 0) ||
-            (_pending_aio.size() >= std::min(max_aio / 4, _io_queue->_capacity / 2))) {
+        if ((queue.queued_requests() > 0) ||
+            (_pending_aio.size() >= std::min(max_aio / 4, queue._capacity / 2))) {
             flush_pending_aio();
         }
         return f;
     });
 }
 
+// Coalesces reads of adjacent extents of the same file, queued in the same
+// poll cycle, into one preadv.  The merged request completes each original
+// request's promise with its share of the result, so callers cannot tell
+// the difference, except for one less I/O operation on the device.
+void
+reactor::merge_pending_aio() {
+    static constexpr size_t max_merged_bytes = 128 * 1024;
+    static constexpr size_t max_merged_iov = 32;
+    if (!_aio_merge || _pending_aio.size() < 2) {
+        return;
+    }
+    std::vector<size_t> reads;
+    for (size_t i = 0; i < _pending_aio.size(); ++i) {
+        if (_pending_aio[i].aio_lio_opcode == IO_CMD_PREAD) {
+            reads.push_back(i);
+        }
+    }
+    if (reads.size() < 2) {
+        return;
+    }
+    std::sort(reads.begin(), reads.end(), [this] (size_t a, size_t b) {
+        auto& x = _pending_aio[a];
+        auto& y = _pending_aio[b];
+        return std::make_pair(x.aio_fildes, x.u.c.offset) < std::make_pair(y.aio_fildes, y.u.c.offset);
+    });
+    struct merged_read {
+        std::vector<iovec> iov;
+        std::vector<std::pair<promise<io_event>*, size_t>> parts;
+    };
+    std::vector<bool> consumed(_pending_aio.size());
+    bool merged_any = false;
+    for (size_t first = 0; first < reads.size(); ) {
+        auto& head = _pending_aio[reads[first]];
+        auto end = head.u.c.offset + head.u.c.nbytes;
+        auto bytes = size_t(head.u.c.nbytes);
+        auto last = first + 1;
+        while (last < reads.size() && last - first < max_merged_iov) {
+            auto& next = _pending_aio[reads[last]];
+            if (next.aio_fildes != head.aio_fildes || next.u.c.offset != end
+                    || bytes + next.u.c.nbytes > max_merged_bytes) {
+                break;
+            }
+            end += next.u.c.nbytes;
+            bytes += next.u.c.nbytes;
+            ++last;
+        }
+        if (last - first < 2) {
+            first = last;
+            continue;
+        }
+        auto m = std::make_unique<merged_read>();
+        for (auto k = first; k < last; ++k) {
+            auto& io = _pending_aio[reads[k]];
+            m->iov.push_back(iovec{io.u.c.buf, size_t(io.u.c.nbytes)});
+            m->parts.emplace_back(reinterpret_cast<promise<io_event>*>(io.data), size_t(io.u.c.nbytes));
+            consumed[reads[k]] = true;
+        }
+        auto pr = std::make_unique<promise<io_event>>();
+        iocb io;
+        io_prep_preadv(&io, head.aio_fildes, m->iov.data(), m->iov.size(), head.u.c.offset);
+        if (_aio_eventfd) {
+            io_set_eventfd(&io, _aio_eventfd->get_fd());
+        }
+        io.data = pr.get();
+        // The merged reads each took an aio context slot in submit_io();
+        // only one is needed now.
+        _io_context_available.signal(m->parts.size() - 1);
+        _aio_merged += m->parts.size() - 1;
+        pr->get_future().then_wrapped([m = std::move(m)] (future<io_event> f) {
+            std::exception_ptr ex;
+            io_event ev;
+            try {
+                ev = std::get<0>(f.get());
+            } catch (...) {
+                ex = std::current_exception();
+            }
+            long remaining = ex ? 0 : long(ev.res);
+            for (auto&& part : m->parts) {
+                auto pr = part.first;
+                if (ex) {
+                    pr->set_exception(ex);
+                } else {
+                    io_event pev = ev;
+                    pev.data = pr;
+                    if (remaining < 0) {
+                        pev.res = remaining;
+                    } else {
+                        auto n = std::min<long>(remaining, part.second);
+                        pev.res = n;
+                        remaining -= n;
+                    }
+                    pr->set_value(pev);
+                }
+                delete pr;
+            }
+        });
+        pr.release();
+        _pending_aio.push_back(io);
+        merged_any = true;
+        first = last;
+    }
+    if (merged_any) {
+        size_t out = 0;
+        for (size_t i = 0; i < _pending_aio.size(); ++i) {
+            if (i >= consumed.size() || !consumed[i]) {
+                _pending_aio[out++] = _pending_aio[i];
+            }
+        }
+        _pending_aio.resize(out);
+    }
+}
+
 bool
 reactor::flush_pending_aio() {
     bool did_work = false;
+    merge_pending_aio();
     while (!_pending_aio.empty()) {
         auto nr = _pending_aio.size();
         struct iocb* iocbs[max_aio];
         for (size_t i = 0; i < nr; ++i) {
             iocbs[i] = &_pending_aio[i];
         }
-        auto r = ::io_submit(_io_context, nr, iocbs);
+        long r;
+        if (backend().handles_disk_io()) {
+            r = backend().submit_disk_io(iocbs, nr);
+            if (r == 0) {
+                return did_work;
+            }
+        } else {
+            r = ::io_submit(_io_context, nr, iocbs);
+        }
         size_t nr_consumed;
         if (r < 0) {
             auto ec = -r;
@@ -659,25 +1647,76 @@ const io_priority_class& default_priority_class() {
 
 template <typename Func>
 future<io_event>
-reactor::submit_io_read(const io_priority_class& pc, size_t len, Func prepare_io) {
+reactor::submit_io_read(const io_priority_class& pc, size_t len, Func prepare_io, unsigned device) {
     ++_aio_reads;
     _aio_read_bytes += len;
-    return io_queue::queue_request(_io_coordinator, pc, len, std::move(prepare_io));
+    return io_queue::queue_request(_io_coordinator, device, pc, io_queue::request_type::read, len, std::move(prepare_io));
 }
 
 template <typename Func>
 future<io_event>
-reactor::submit_io_write(const io_priority_class& pc, size_t len, Func prepare_io) {
+reactor::submit_io_write(const io_priority_class& pc, size_t len, Func prepare_io, unsigned device) {
     ++_aio_writes;
     _aio_write_bytes += len;
-    return io_queue::queue_request(_io_coordinator, pc, len, std::move(prepare_io));
+    return io_queue::queue_request(_io_coordinator, device, pc, io_queue::request_type::write, len, std::move(prepare_io));
+}
+
+future<unsigned>
+reactor::io_device_of(sstring path) {
+    return _thread_pool.submit<syscall_result_extra<struct stat>>([path] {
+        struct stat st;
+        auto ret = stat(path.c_str(), &st);
+        return wrap_syscall(ret, st);
+    }).then([] (syscall_result_extra<struct stat> sr) {
+        sr.throw_if_error();
+        return io_queue::device_of(sr.extra.st_dev);
+    });
+}
+
+future<>
+reactor::set_io_device_capacity(unsigned device, unsigned max_io_requests) {
+    if (device >= _io_queues.size()) {
+        return make_exception_future<>(std::out_of_range(sprint("no I/O device %d", device)));
+    }
+    if (_io_queues[device]->_budget) {
+        // Local dispatch: the budget is the device's limit, and each
+        // shard's queue may use all of it.
+        auto budget = _io_queues[device]->_budget;
+        budget->available.fetch_add(int64_t(max_io_requests) - budget->total, std::memory_order_relaxed);
+        budget->total = max_io_requests;
+        return smp::invoke_on_all([device, max_io_requests] {
+            engine()._io_queues[device]->set_capacity(max_io_requests);
+        });
+    }
+    auto& topology = _io_queue->_io_topology;
+    auto coordinators = std::set<shard_id>(topology.begin(), topology.end()).size();
+    auto capacity = std::max<size_t>(max_io_requests / coordinators, 1);
+    return smp::invoke_on_all([device, capacity] {
+        auto queue = engine()._io_queues[device];
+        if (queue->coordinator() == engine().cpu_id()) {
+            queue->set_capacity(capacity);
+        }
+    });
 }
 
 bool reactor::process_io()
 {
+    if (backend().handles_disk_io()) {
+        return backend().reap_disk_io();
+    }
     io_event ev[max_aio];
-    struct timespec timeout = {0, 0};
-    auto n = ::io_getevents(_io_context, 1, max_aio, ev, &timeout);
+    int n = -1;
+    if (_aio_ring_reaping) {
+        n = reap_aio_ring(_io_context, ev, max_aio);
+        if (n < 0) {
+            seastar_logger.warn("linux-aio completion ring is inconsistent, reaping completions with io_getevents()");
+            _aio_ring_reaping = false;
+        }
+    }
+    if (n < 0) {
+        struct timespec timeout = {0, 0};
+        n = ::io_getevents(_io_context, 1, max_aio, ev, &timeout);
+    }
     assert(n >= 0);
     for (size_t i = 0; i < size_t(n); ++i) {
         auto pr = reinterpret_cast<promise<io_event>*>(ev[i].data);
@@ -688,14 +1727,31 @@ bool reactor::process_io()
     return n;
 }
 
-io_queue::io_queue(shard_id coordinator, size_t capacity, std::vector<shard_id> topology)
+io_queue::io_queue(shard_id coordinator, size_t capacity, std::vector<shard_id> topology, cost_model costs)
         : _coordinator(coordinator)
         , _capacity(capacity)
         , _io_topology(std::move(topology))
+        , _cost_model(costs)
         , _priority_classes()
         , _fq(capacity) {
 }
 
+float io_queue::request_weight(request_type type, size_t len) const {
+    if (type == request_type::discard) {
+        // A discard's cost is mostly per command, whatever its length
+        return request_weight(request_type::write, 0);
+    }
+    auto bytes_rate = type == request_type::read ? _cost_model.read_bytes_rate : _cost_model.write_bytes_rate;
+    auto ops_rate = type == request_type::read ? _cost_model.read_ops_rate : _cost_model.write_ops_rate;
+    if (!bytes_rate || !ops_rate) {
+        return 1 + len/(16 << 10);
+    }
+    // In units of the time an ideal 4k read takes on a device doing 100k
+    // IOPS, which keeps weights of typical requests near the legacy ones.
+    constexpr double unit = 10e-6;
+    return (1 / ops_rate + len / bytes_rate) / unit;
+}
+
 io_queue::~io_queue() {
     // It is illegal to stop the I/O queue with pending requests.
     // Technically we would use a gate to guarantee that. But here, it is not
@@ -708,6 +1764,53 @@ io_queue::~io_queue() {
     }
 }
 
+std::unordered_map<dev_t, unsigned> io_queue::_devices;
+std::vector<std::unique_ptr<io_queue::shared_budget>> io_queue::_shared_budgets;
+
+future<> io_queue::take_budget() {
+    if (_budget_waiters.empty() && try_take_budget()) {
+        return make_ready_future<>();
+    }
+    _budget_waiters.emplace_back();
+    return _budget_waiters.back().get_future();
+}
+
+void io_queue::return_budget() {
+    _budget->available.fetch_add(1, std::memory_order_release);
+    poll_budget();
+}
+
+bool io_queue::poll_budget() {
+    bool did_work = false;
+    while (!_budget_waiters.empty() && try_take_budget()) {
+        _budget_waiters.front().set_value();
+        _budget_waiters.pop_front();
+        did_work = true;
+    }
+    return did_work;
+}
+
+unsigned io_queue::device_of(dev_t dev) {
+    auto i = _devices.find(dev);
+    return i == _devices.end() ? 0 : i->second;
+}
+
+unsigned io_queue::device_of_fd(int fd) {
+    if (_devices.empty()) {
+        return 0;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == -1) {
+        return 0;
+    }
+    return device_of(st.st_dev);
+}
+
+void io_queue::set_capacity(size_t capacity) {
+    _capacity = capacity;
+    _fq.set_capacity(capacity);
+}
+
 std::array<std::atomic<uint32_t>, io_queue::_max_classes> io_queue::_registered_shares;
 // We could very well just add the name to the io_priority_class. However, because that
 // structure is passed along all the time - and sometimes we can't help but copy it, better keep
@@ -720,13 +1823,16 @@ void io_queue::fill_shares_array() {
     }
 }
 
-io_priority_class io_queue::register_one_priority_class(sstring name, uint32_t shares) {
+std::array<io_priority_class_limits, io_queue::_max_classes> io_queue::_registered_limits;
+
+io_priority_class io_queue::register_one_priority_class(sstring name, uint32_t shares, io_priority_class_limits limits) {
     for (unsigned i = 0; i < _max_classes; ++i) {
         uint32_t unused = 0;
         auto s = _registered_shares[i].compare_exchange_strong(unused, shares, std::memory_order_acq_rel);
         if (s) {
             io_priority_class p;
             _registered_names[i] = name;
+            _registered_limits[i] = limits;
             p.val = i;
             return std::move(p);
         };
@@ -771,6 +1877,22 @@ io_queue::priority_class_data::priority_class_data(sstring name, priority_class_
             , scollectd::make_typed(scollectd::data_type::GAUGE, [this] {
                 return queue_time.count();
             })
+        ),
+        // How often the class' bandwidth cap held it back, and how many of
+        // its requests waited longer than its latency goal.
+        scollectd::add_polled_metric(scollectd::type_instance_id("io_queue"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", name + "-throttled")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, [this] {
+                return this->ptr->throttled();
+            })
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id("io_queue"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", name + "-latency-goal-misses")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, [this] {
+                return this->ptr->latency_goal_misses();
+            })
         )
     }))
 {
@@ -794,33 +1916,169 @@ io_queue::priority_class_data& io_queue::find_or_create_class(const io_priority_
         //
         // This conveys all the information we need and allows one to easily group all classes from
         // the same I/O queue (by filtering by instance ID)
-        auto ret = _priority_classes.emplace(pc.id(), make_lw_shared<priority_class_data>(sprint("%s-%d", name, owner), _fq.register_priority_class(shares)));
+        auto fq_class = _fq.register_priority_class(shares);
+        auto& limits = _registered_limits.at(pc.id());
+        _fq.set_limits(fq_class, limits.max_bytes_per_second, limits.latency_goal);
+        auto ret = _priority_classes.emplace(pc.id(), make_lw_shared<priority_class_data>(sprint("%s-%d", name, owner), fq_class));
         it_pclass = ret.first;
     }
     return *(it_pclass->second);
 }
 
+template <typename Run>
+futurize_t<std::result_of_t<Run(io_queue&)>>
+io_queue::queue_and_run(shard_id coordinator, unsigned device, const io_priority_class& pc, request_type type, size_t len, Run run) {
+    static const char* span_names[] = { "io_read", "io_write", "io_discard" };
+    auto start = std::chrono::steady_clock::now();
+    auto span = seastar::tracing::span::child(span_names[unsigned(type)]);
+    if (span.sampled()) {
+        span.set_detail(sprint("%d bytes, class %d, device %d", len, pc.id(), device));
+    }
+    return seastar::tracing::with_span(std::move(span), [&] {
+        return smp::submit_to(coordinator, [start, device, &pc, type, len, run = std::move(run), owner = engine().cpu_id()] {
+            auto& queue = *(engine()._io_queues[device]);
+            auto weight = queue.request_weight(type, len);
+            // First time will hit here, and then we create the class. It is important
+            // that we create the shared pointer in the same shard it will be used at later.
+            auto& pclass = queue.find_or_create_class(pc, owner);
+            pclass.bytes += len;
+            pclass.ops++;
+            pclass.nr_queued++;
+            return queue._fq.queue(pclass.ptr, weight, len, [&queue, &pclass, start, run = std::move(run)] {
+                pclass.nr_queued--;
+                pclass.queue_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start);
+                if (!queue._budget) {
+                    return run(queue);
+                }
+                return queue.take_budget().then([&queue, run = std::move(run)] () mutable {
+                    return run(queue).finally([&queue] {
+                        queue.return_budget();
+                    });
+                });
+            });
+        });
+    });
+}
+
 template <typename Func>
 future<io_event>
-io_queue::queue_request(shard_id coordinator, const io_priority_class& pc, size_t len, Func prepare_io) {
-    auto start = std::chrono::steady_clock::now();
-    return smp::submit_to(coordinator, [start, &pc, len, prepare_io = std::move(prepare_io), owner = engine().cpu_id()] {
-        auto& queue = *(engine()._io_queue);
-        unsigned weight = 1 + len/(16 << 10);
-        // First time will hit here, and then we create the class. It is important
-        // that we create the shared pointer in the same shard it will be used at later.
-        auto& pclass = queue.find_or_create_class(pc, owner);
-        pclass.bytes += len;
-        pclass.ops++;
-        pclass.nr_queued++;
-        return queue._fq.queue(pclass.ptr, weight, [&pclass, start, prepare_io = std::move(prepare_io)] {
-            pclass.nr_queued--;
-            pclass.queue_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start);
-            return engine().submit_io(std::move(prepare_io));
+io_queue::queue_request(shard_id coordinator, unsigned device, const io_priority_class& pc, request_type type, size_t len, Func prepare_io) {
+    return queue_and_run(coordinator, device, pc, type, len, [prepare_io = std::move(prepare_io)] (io_queue& queue) {
+        return engine().submit_io(queue, std::move(prepare_io));
+    });
+}
+
+future<>
+io_queue::queue_discard(shard_id coordinator, unsigned device, const io_priority_class& pc, int fd, bool blockdev, uint64_t offset, uint64_t length) {
+    // The coordinator's syscall threads may use fd, which is open in the
+    // whole process
+    return queue_and_run(coordinator, device, pc, request_type::discard, length, [fd, blockdev, offset, length] (io_queue&) {
+        return engine()._thread_pool.submit<syscall_result<int>>([fd, blockdev, offset, length] {
+            if (blockdev) {
+                uint64_t range[2] { offset, length };
+                return wrap_syscall<int>(::ioctl(fd, BLKDISCARD, &range));
+            }
+            return wrap_syscall<int>(::fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, length));
+        }).then([] (syscall_result<int> sr) {
+            sr.throw_if_error();
         });
     });
 }
 
+future<>
+discard_queue::queue(int fd, bool blockdev, uint64_t offset, uint64_t length) {
+    auto end = offset + length;
+    for (auto&& r : _ranges) {
+        if (r.fd != fd) {
+            continue;
+        }
+        // The front range may be partly issued already, so only ranges
+        // that haven't started can grow backwards
+        bool started = _running && &r == &_ranges.front();
+        if (offset >= r.offset && offset <= r.end) {
+            r.end = std::max(r.end, end);
+        } else if (!started && end >= r.offset && end <= r.end) {
+            r.offset = offset;
+        } else {
+            continue;
+        }
+        r.waiters.emplace_back();
+        return r.waiters.back().get_future();
+    }
+    _ranges.push_back(range{fd, blockdev, offset, end, {}});
+    _ranges.back().waiters.emplace_back();
+    auto f = _ranges.back().waiters.back().get_future();
+    run();
+    return f;
+}
+
+void
+discard_queue::run() {
+    if (_running || _ranges.empty()) {
+        return;
+    }
+    auto& r = _ranges.front();
+    if (r.offset == r.end) {
+        for (auto&& w : r.waiters) {
+            w.set_value();
+        }
+        _ranges.pop_front();
+        return run();
+    }
+    _running = true;
+    auto len = std::min(r.end - r.offset, _chunk);
+    io_queue::queue_discard(engine()._io_coordinator, _device, _pc, r.fd, r.blockdev, r.offset, len).then_wrapped([this, len] (future<> f) {
+        _running = false;
+        auto& r = _ranges.front();
+        if (f.failed()) {
+            auto ep = f.get_exception();
+            for (auto&& w : r.waiters) {
+                w.set_exception(ep);
+            }
+            _ranges.pop_front();
+        } else {
+            _discards++;
+            _discarded_bytes += len;
+            r.offset += len;
+        }
+        run();
+    });
+}
+
+template <typename T>
+uint64_t reactor::sum_discard_queues(T (discard_queue::*stat)() const) const {
+    uint64_t sum = 0;
+    for (auto&& q : _discard_queues) {
+        if (q) {
+            sum += ((*q).*stat)();
+        }
+    }
+    return sum;
+}
+
+future<>
+reactor::submit_discard(int fd, bool blockdev, uint64_t offset, uint64_t length, unsigned device) {
+    if (!_discard_class) {
+        io_priority_class_limits limits;
+        limits.max_bytes_per_second = _discard_rate;
+        _discard_class = register_one_priority_class("discard", 1, limits);
+    }
+    if (_discard_queues.size() <= device) {
+        _discard_queues.resize(device + 1);
+    }
+    auto& q = _discard_queues[device];
+    if (!q) {
+        // A tenth of a second's worth at a time, in whole megabytes
+        constexpr uint64_t mb = 1 << 20;
+        uint64_t chunk = 64 * mb;
+        if (_discard_rate) {
+            chunk = std::min(std::max(align_down<uint64_t>(_discard_rate / 10, mb), mb), chunk);
+        }
+        q = std::make_unique<discard_queue>(device, *_discard_class, chunk);
+    }
+    return q->queue(fd, blockdev, offset, length);
+}
+
 file_impl* file_impl::get_file_impl(file& f) {
     return f._file_impl.get();
 }
@@ -828,6 +2086,7 @@ file_impl* file_impl::get_file_impl(file& f) {
 posix_file_impl::posix_file_impl(int fd, file_open_options options)
         : _fd(fd) {
     query_dma_alignment();
+    _io_device = io_queue::device_of_fd(fd);
 }
 
 posix_file_impl::~posix_file_impl() {
@@ -837,24 +2096,110 @@ posix_file_impl::~posix_file_impl() {
     }
 }
 
+namespace {
+
+struct block_device_limits {
+    unsigned logical_block_size = 0;
+    unsigned physical_block_size = 0;
+    uint64_t max_io_size = 0;
+};
+
+uint64_t read_sysfs_number(const sstring& path) {
+    std::ifstream f(path);
+    uint64_t v = 0;
+    f >> v;
+    return f ? v : 0;
+}
+
+// The queue limits of the block device dev, from sysfs, where a partition
+// has no queue of its own and goes by its disk's. Files on filesystems
+// without a block device (tmpfs, nfs) get zeroes.
+const block_device_limits& device_limits(dev_t dev) {
+    static thread_local std::unordered_map<dev_t, block_device_limits> cache;
+    auto i = cache.find(dev);
+    if (i != cache.end()) {
+        return i->second;
+    }
+    auto base = sprint("/sys/dev/block/%d:%d/", major(dev), minor(dev));
+    auto queue = base + "queue/";
+    if (::access(queue.c_str(), F_OK) != 0) {
+        queue = base + "../queue/";
+    }
+    block_device_limits l;
+    l.logical_block_size = read_sysfs_number(queue + "logical_block_size");
+    l.physical_block_size = read_sysfs_number(queue + "physical_block_size");
+    l.max_io_size = read_sysfs_number(queue + "max_sectors_kb") * 1024;
+    return cache.emplace(dev, l).first->second;
+}
+
+}
+
+// Reads may be as small and as aligned as the device's logical blocks, so
+// a 512e disk isn't read 4K at a time; writes keep to its physical blocks,
+// which the device would otherwise read, modify and write back. What the
+// filesystem says (statx() where the kernel has STATX_DIOALIGN, the XFS
+// ioctl otherwise) comes first, since it may be stricter than the device.
 void
 posix_file_impl::query_dma_alignment() {
-    dioattr da;
-    auto r = ioctl(_fd, XFS_IOC_DIOINFO, &da);
-    if (r == 0) {
-        _memory_dma_alignment = da.d_mem;
-        _disk_read_dma_alignment = da.d_miniosz;
-        // xfs wants at least the block size for writes
-        // FIXME: really read the block size
-        _disk_write_dma_alignment = std::max<unsigned>(da.d_miniosz, 4096);
+    struct stat st;
+    if (::fstat(_fd, &st) == -1) {
+        return;
+    }
+    bool blockdev = S_ISBLK(st.st_mode);
+    auto& limits = device_limits(blockdev ? st.st_rdev : st.st_dev);
+    if (limits.logical_block_size) {
+        _disk_logical_block_size = limits.logical_block_size;
+    }
+    if (limits.physical_block_size) {
+        _disk_physical_block_size = limits.physical_block_size;
+    }
+    if (limits.max_io_size) {
+        _disk_max_io_size = limits.max_io_size;
     }
+    unsigned fs_block_size = 0;
+    if (blockdev) {
+        int logical;
+        unsigned physical;
+        if (ioctl(_fd, BLKSSZGET, &logical) == 0) {
+            _disk_logical_block_size = logical;
+        }
+        if (ioctl(_fd, BLKPBSZGET, &physical) == 0) {
+            _disk_physical_block_size = physical;
+        }
+        _memory_dma_alignment = _disk_logical_block_size;
+        _disk_read_dma_alignment = _disk_logical_block_size;
+    } else {
+        bool found = false;
+#ifdef STATX_DIOALIGN
+        struct statx stx;
+        if (::statx(_fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+                && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+            _memory_dma_alignment = stx.stx_dio_mem_align;
+            _disk_read_dma_alignment = stx.stx_dio_offset_align;
+            found = true;
+        }
+#endif
+        dioattr da;
+        if (ioctl(_fd, XFS_IOC_DIOINFO, &da) == 0) {
+            if (!found) {
+                _memory_dma_alignment = da.d_mem;
+                _disk_read_dma_alignment = da.d_miniosz;
+            }
+            // xfs wants at least the block size for writes
+            struct statfs sfs;
+            if (::fstatfs(_fd, &sfs) == 0) {
+                fs_block_size = sfs.f_bsize;
+            }
+        }
+    }
+    _disk_write_dma_alignment = std::max({_disk_read_dma_alignment, _disk_physical_block_size, fs_block_size});
 }
 
 future<size_t>
 posix_file_impl::write_dma(uint64_t pos, const void* buffer, size_t len, const io_priority_class& io_priority_class) {
     return engine().submit_io_write(io_priority_class, len, [fd = _fd, pos, buffer, len] (iocb& io) {
         io_prep_pwrite(&io, fd, const_cast<void*>(buffer), len, pos);
-    }).then([] (io_event ev) {
+    }, _io_device).then([] (io_event ev) {
         throw_kernel_error(long(ev.res));
         return make_ready_future<size_t>(size_t(ev.res));
     });
@@ -868,7 +2213,7 @@ posix_file_impl::write_dma(uint64_t pos, std::vector<iovec> iov, const io_priori
     auto data = iov_ptr->data();
     return engine().submit_io_write(io_priority_class, len, [fd = _fd, pos, data, size] (iocb& io) {
         io_prep_pwritev(&io, fd, data, size, pos);
-    }).then([iov_ptr = std::move(iov_ptr)] (io_event ev) {
+    }, _io_device).then([iov_ptr = std::move(iov_ptr)] (io_event ev) {
         throw_kernel_error(long(ev.res));
         return make_ready_future<size_t>(size_t(ev.res));
     });
@@ -878,7 +2223,7 @@ future<size_t>
 posix_file_impl::read_dma(uint64_t pos, void* buffer, size_t len, const io_priority_class& io_priority_class) {
     return engine().submit_io_read(io_priority_class, len, [fd = _fd, pos, buffer, len] (iocb& io) {
         io_prep_pread(&io, fd, buffer, len, pos);
-    }).then([] (io_event ev) {
+    }, _io_device).then([] (io_event ev) {
         throw_kernel_error(long(ev.res));
         return make_ready_future<size_t>(size_t(ev.res));
     });
@@ -892,7 +2237,7 @@ posix_file_impl::read_dma(uint64_t pos, std::vector<iovec> iov, const io_priorit
     auto data = iov_ptr->data();
     return engine().submit_io_read(io_priority_class, len, [fd = _fd, pos, data, size] (iocb& io) {
         io_prep_preadv(&io, fd, data, size, pos);
-    }).then([iov_ptr = std::move(iov_ptr)] (io_event ev) {
+    }, _io_device).then([iov_ptr = std::move(iov_ptr)] (io_event ev) {
         throw_kernel_error(long(ev.res));
         return make_ready_future<size_t>(size_t(ev.res));
     });
@@ -925,9 +2270,20 @@ append_challenged_posix_file_impl::size_changing(const op& candidate) const {
             || (_sloppy_size && candidate.type == opcode::flush);
 }
 
+bool
+append_challenged_posix_file_impl::appending_write(const op& candidate) const {
+    return candidate.type == opcode::write && candidate.pos + candidate.len > _committed_size;
+}
+
 bool
 append_challenged_posix_file_impl::may_dispatch(const op& candidate) const {
-    if (size_changing(candidate)) {
+    if (appending_write(candidate)) {
+        // Filesystems qualified for it take several appends at once, but
+        // never alongside a truncate or a flush that truncates
+        return !_current_non_size_changing_ops
+                && _current_size_changing_ops == _current_appending_writes
+                && _current_appending_writes < std::max(_max_size_changing_ops, 1u);
+    } else if (size_changing(candidate)) {
         return !_current_size_changing_ops && !_current_non_size_changing_ops;
     } else {
         return !_current_size_changing_ops;
@@ -938,9 +2294,12 @@ void
 append_challenged_posix_file_impl::dispatch(op& candidate) {
     unsigned* op_counter = size_changing(candidate)
             ? &_current_size_changing_ops : &_current_non_size_changing_ops;
+    bool appending = appending_write(candidate);
     ++*op_counter;
-    candidate.run().then([this, op_counter] {
+    _current_appending_writes += appending;
+    candidate.run().then([this, op_counter, appending] {
         --*op_counter;
+        _current_appending_writes -= appending;
         process_queue();
     });
 }
@@ -1237,6 +2596,10 @@ xfs_concurrency_from_kernel_version() {
     return 0;
 }
 
+// Filesystems qualified by iotune, given with --fs-properties; filled in
+// before the reactors start and only read afterwards.
+static std::unordered_map<dev_t, filesystem_properties> s_qualified_filesystems;
+
 inline
 shared_ptr<file_impl>
 make_file_impl(int fd, file_open_options options) {
@@ -1256,6 +2619,16 @@ make_file_impl(int fd, file_open_options options) {
         if (S_ISDIR(st.st_mode)) {
             return make_shared<posix_file_impl>(fd, options);
         }
+        auto with_fs_properties = [&] (shared_ptr<posix_file_impl> impl, unsigned append_concurrency) -> shared_ptr<file_impl> {
+            auto q = s_qualified_filesystems.find(st.st_dev);
+            if (q != s_qualified_filesystems.end()) {
+                impl->_fs_properties = q->second;
+            } else {
+                impl->_fs_properties.append_concurrency = append_concurrency;
+            }
+            impl->_dsync = (flags & O_DSYNC) == O_DSYNC;
+            return impl;
+        };
         struct append_support {
             bool append_challenged;
             unsigned append_concurrency;
@@ -1280,65 +2653,119 @@ make_file_impl(int fd, file_open_options options) {
                 as.append_challenged = true;
                 as.append_concurrency = 0;
             }
+            auto q = s_qualified_filesystems.find(st.st_dev);
+            if (q != s_qualified_filesystems.end()) {
+                // Measured beats guessed from the kernel version
+                as.append_concurrency = q->second.append_concurrency;
+            }
             s_fstype[st.st_dev] = as;
         }
         auto as = s_fstype[st.st_dev];
         if (!as.append_challenged) {
-            return make_shared<posix_file_impl>(fd, options);
+            return with_fs_properties(make_shared<posix_file_impl>(fd, options), std::numeric_limits<unsigned>::max());
+        }
+        return with_fs_properties(make_shared<append_challenged_posix_file_impl>(fd, options, as.append_concurrency),
+                as.append_concurrency);
+    }
+}
+
+file::file(int fd, file_open_options options)
+        : _file_impl(make_file_impl(fd, options)) {
+}
+
+// Runs on a syscall thread.
+static syscall_result<int>
+open_dma_fd(const char* name, open_flags flags, const file_open_options& options, bool strict_o_direct) {
+    static constexpr mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH; // 0644
+    // We want O_DIRECT, except in two cases:
+    //   - tmpfs (which doesn't support it, but works fine anyway)
+    //   - strict_o_direct == false (where we forgive it being not supported)
+    // Because open() with O_DIRECT will fail, we open it without O_DIRECT, try
+    // to update it to O_DIRECT with fcntl(), and if that fails, see if we
+    // can forgive it.
+    auto is_tmpfs = [] (int fd) {
+        struct ::statfs buf;
+        auto r = ::fstatfs(fd, &buf);
+        if (r == -1) {
+            return false;
+        }
+        return buf.f_type == 0x01021994; // TMPFS_MAGIC
+    };
+    auto open_flags = O_CLOEXEC | static_cast<int>(flags);
+    int fd = ::open(name, open_flags, mode);
+    if (fd == -1) {
+        return wrap_syscall<int>(fd);
+    }
+    int r = ::fcntl(fd, F_SETFL, open_flags | O_DIRECT);
+    auto maybe_ret = wrap_syscall<int>(r);  // capture errno (should be EINVAL)
+    if (r == -1  && strict_o_direct && !is_tmpfs(fd)) {
+        ::close(fd);
+        return maybe_ret;
+    }
+    if (fd != -1) {
+        fsxattr attr = {};
+        if (options.extent_allocation_size_hint) {
+            attr.fsx_xflags |= XFS_XFLAG_EXTSIZE;
+            attr.fsx_extsize = options.extent_allocation_size_hint;
         }
-        return make_shared<append_challenged_posix_file_impl>(fd, options, as.append_concurrency);
+        // Ignore error; may be !xfs, and just a hint anyway
+        ::ioctl(fd, XFS_IOC_FSSETXATTR, &attr);
     }
-}
-
-file::file(int fd, file_open_options options)
-        : _file_impl(make_file_impl(fd, options)) {
+    return wrap_syscall<int>(fd);
 }
 
 future<file>
 reactor::open_file_dma(sstring name, open_flags flags, file_open_options options) {
-    static constexpr mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH; // 0644
     return _thread_pool.submit<syscall_result<int>>([name, flags, options, strict_o_direct = _strict_o_direct] {
-        // We want O_DIRECT, except in two cases:
-        //   - tmpfs (which doesn't support it, but works fine anyway)
-        //   - strict_o_direct == false (where we forgive it being not supported)
-        // Because open() with O_DIRECT will fail, we open it without O_DIRECT, try
-        // to update it to O_DIRECT with fcntl(), and if that fails, see if we
-        // can forgive it.
-        auto is_tmpfs = [] (int fd) {
-            struct ::statfs buf;
-            auto r = ::fstatfs(fd, &buf);
-            if (r == -1) {
-                return false;
-            }
-            return buf.f_type == 0x01021994; // TMPFS_MAGIC
-        };
-        auto open_flags = O_CLOEXEC | static_cast<int>(flags);
-        int fd = ::open(name.c_str(), open_flags, mode);
-        if (fd == -1) {
-            return wrap_syscall<int>(fd);
-        }
-        int r = ::fcntl(fd, F_SETFL, open_flags | O_DIRECT);
-        auto maybe_ret = wrap_syscall<int>(r);  // capture errno (should be EINVAL)
-        if (r == -1  && strict_o_direct && !is_tmpfs(fd)) {
-            ::close(fd);
-            return maybe_ret;
-        }
-        if (fd != -1) {
-            fsxattr attr = {};
-            if (options.extent_allocation_size_hint) {
-                attr.fsx_xflags |= XFS_XFLAG_EXTSIZE;
-                attr.fsx_extsize = options.extent_allocation_size_hint;
-            }
-            // Ignore error; may be !xfs, and just a hint anyway
-            ::ioctl(fd, XFS_IOC_FSSETXATTR, &attr);
-        }
-        return wrap_syscall<int>(fd);
+        return open_dma_fd(name.c_str(), flags, options, strict_o_direct);
     }).then([options] (syscall_result<int> sr) {
         sr.throw_if_error();
         return make_ready_future<file>(file(sr.result, options));
     });
 }
 
+future<std::vector<file>>
+reactor::open_files_dma(std::vector<sstring> names, open_flags flags, file_open_options options) {
+    // Files opened per trip to a syscall thread; batches run in parallel
+    // on all of the shard's syscall threads.
+    static constexpr size_t batch_size = 64;
+    struct state {
+        std::vector<sstring> names;
+        std::vector<syscall_result<int>> results;
+    };
+    auto st = make_lw_shared<state>();
+    st->results.resize(names.size());
+    st->names = std::move(names);
+    auto nr_batches = (st->names.size() + batch_size - 1) / batch_size;
+    return parallel_for_each(boost::irange<size_t>(0, nr_batches), [this, st, flags, options] (size_t b) {
+        return _thread_pool.submit<int>([st, b, flags, options, strict_o_direct = _strict_o_direct] {
+            auto end = std::min(st->names.size(), (b + 1) * batch_size);
+            for (auto i = b * batch_size; i < end; ++i) {
+                st->results[i] = open_dma_fd(st->names[i].c_str(), flags, options, strict_o_direct);
+            }
+            return 0;
+        }).discard_result();
+    }).then([st, options] {
+        std::vector<file> files;
+        files.reserve(st->names.size());
+        std::exception_ptr ex;
+        for (auto&& sr : st->results) {
+            if (sr.result == -1) {
+                if (!ex) {
+                    ex = std::make_exception_ptr(std::system_error(sr.error, std::system_category()));
+                }
+                continue;
+            }
+            files.push_back(file(sr.result, options));
+        }
+        if (ex) {
+            // Dropping the files that did open closes them.
+            return make_exception_future<std::vector<file>>(std::move(ex));
+        }
+        return make_ready_future<std::vector<file>>(std::move(files));
+    });
+}
+
 future<>
 reactor::remove_file(sstring pathname) {
     return engine()._thread_pool.submit<syscall_result<int>>([this, pathname] {
@@ -1494,6 +2921,10 @@ reactor::touch_directory(sstring name) {
 
 future<>
 posix_file_impl::flush(void) {
+    if (_dsync) {
+        // Every completed write is already on stable storage
+        return make_ready_future<>();
+    }
     ++engine()._fsyncs;
     return engine()._thread_pool.submit<syscall_result<int>>([this] {
         return wrap_syscall<int>(::fdatasync(_fd));
@@ -1536,13 +2967,7 @@ blockdev_file_impl::truncate(uint64_t length) {
 
 future<>
 posix_file_impl::discard(uint64_t offset, uint64_t length) {
-    return engine()._thread_pool.submit<syscall_result<int>>([this, offset, length] () mutable {
-        return wrap_syscall<int>(::fallocate(_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
-            offset, length));
-    }).then([] (syscall_result<int> sr) {
-        sr.throw_if_error();
-        return make_ready_future<>();
-    });
+    return engine().submit_discard(_fd, false, offset, length, _io_device);
 }
 
 future<>
@@ -1571,13 +2996,7 @@ posix_file_impl::allocate(uint64_t position, uint64_t length) {
 
 future<>
 blockdev_file_impl::discard(uint64_t offset, uint64_t length) {
-    return engine()._thread_pool.submit<syscall_result<int>>([this, offset, length] () mutable {
-        uint64_t range[2] { offset, length };
-        return wrap_syscall<int>(::ioctl(_fd, BLKDISCARD, &range));
-    }).then([] (syscall_result<int> sr) {
-        sr.throw_if_error();
-        return make_ready_future<>();
-    });
+    return engine().submit_discard(_fd, true, offset, length, _io_device);
 }
 
 future<>
@@ -1630,6 +3049,29 @@ blockdev_file_impl::size(void) {
     });
 }
 
+static std::experimental::optional<directory_entry_type>
+dirent_type(unsigned char d_type) {
+    switch (d_type) {
+    case DT_BLK:
+        return directory_entry_type::block_device;
+    case DT_CHR:
+        return directory_entry_type::char_device;
+    case DT_DIR:
+        return directory_entry_type::directory;
+    case DT_FIFO:
+        return directory_entry_type::fifo;
+    case DT_LNK:
+        return directory_entry_type::link;
+    case DT_REG:
+        return directory_entry_type::regular;
+    case DT_SOCK:
+        return directory_entry_type::socket;
+    default:
+        // unknown, ignore
+        return {};
+    }
+}
+
 subscription<directory_entry>
 posix_file_impl::list_directory(std::function<future<> (directory_entry de)> next) {
     struct work {
@@ -1682,30 +3124,7 @@ posix_file_impl::list_directory(std::function<future<> (directory_entry de)> nex
             }
             auto start = w->buffer + w->current;
             auto de = reinterpret_cast<linux_dirent*>(start);
-            std::experimental::optional<directory_entry_type> type;
-            switch (start[de->d_reclen - 1]) {
-            case DT_BLK:
-                type = directory_entry_type::block_device;
-                break;
-            case DT_CHR:
-                type = directory_entry_type::char_device;
-                break;
-            case DT_DIR:
-                type = directory_entry_type::directory;
-                break;
-            case DT_FIFO:
-                type = directory_entry_type::fifo;
-                break;
-            case DT_REG:
-                type = directory_entry_type::regular;
-                break;
-            case DT_SOCK:
-                type = directory_entry_type::socket;
-                break;
-            default:
-                // unknown, ignore
-                ;
-            }
+            auto type = dirent_type(start[de->d_reclen - 1]);
             w->current += de->d_reclen;
             sstring name = de->d_name;
             if (name == "." || name == "..") {
@@ -1719,6 +3138,78 @@ posix_file_impl::list_directory(std::function<future<> (directory_entry de)> nex
     return ret;
 }
 
+subscription<directory_entry_stat>
+posix_file_impl::list_directory_stat(std::function<future<> (directory_entry_stat de)> next) {
+    // From getdents64(2):
+    struct linux_dirent64 {
+        ino64_t        d_ino;
+        off64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+    };
+    static constexpr size_t buffer_size = 64 * 1024;
+    // The shortest record has a one-character name, padded to 8 bytes.
+    static constexpr size_t max_entries = buffer_size / ((offsetof(linux_dirent64, d_name) + 2 + 7) / 8 * 8);
+    // Everything the syscall thread touches is allocated up front, since it
+    // cannot call malloc().
+    struct work {
+        stream<directory_entry_stat> s;
+        std::unique_ptr<char[]> buffer{new char[buffer_size]};
+        std::vector<struct stat> stats = std::vector<struct stat>(max_entries);
+        std::vector<int> errors = std::vector<int>(max_entries);
+        size_t current = 0;
+        size_t total = 0;
+        unsigned entry = 0;
+        bool eof = false;
+    };
+
+    auto w = make_lw_shared<work>();
+    auto ret = w->s.listen(std::move(next));
+    w->s.started().then([w, this] {
+        auto eofcond = [w] { return w->eof; };
+        return do_until(eofcond, [w, this] {
+            if (w->current == w->total) {
+                return engine()._thread_pool.submit<syscall_result<long>>([w, this] () {
+                    auto ret = ::syscall(__NR_getdents64, _fd, w->buffer.get(), buffer_size);
+                    auto sr = wrap_syscall(ret);
+                    unsigned n = 0;
+                    for (long pos = 0; pos < ret; ++n) {
+                        auto de = reinterpret_cast<linux_dirent64*>(w->buffer.get() + pos);
+                        pos += de->d_reclen;
+                        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+                            continue;
+                        }
+                        auto r = ::fstatat(_fd, de->d_name, &w->stats[n], AT_SYMLINK_NOFOLLOW);
+                        w->errors[n] = r == -1 ? errno : 0;
+                    }
+                    return sr;
+                }).then([w] (syscall_result<long> ret) {
+                    ret.throw_if_error();
+                    if (ret.result == 0) {
+                        w->eof = true;
+                    } else {
+                        w->current = 0;
+                        w->total = ret.result;
+                        w->entry = 0;
+                    }
+                });
+            }
+            auto de = reinterpret_cast<linux_dirent64*>(w->buffer.get() + w->current);
+            auto n = w->entry++;
+            w->current += de->d_reclen;
+            sstring name = de->d_name;
+            if (name == "." || name == "..") {
+                return make_ready_future<>();
+            }
+            return w->s.produce({std::move(name), dirent_type(de->d_type), w->stats[n], w->errors[n]});
+        });
+    }).then([w] {
+        w->s.close();
+    });
+    return ret;
+}
+
 void reactor::enable_timer(steady_clock_type::time_point when)
 {
 #ifndef HAVE_OSV
@@ -1839,7 +3330,7 @@ void reactor::register_collectd_metrics() {
                     , scollectd::per_cpu_plugin_instance
                     , "queue_length", "tasks-pending")
                     , scollectd::make_typed(scollectd::data_type::GAUGE
-                            , std::bind(&decltype(_pending_tasks)::size, &_pending_tasks))
+                            , [this] { return pending_task_count(); })
             ));
     _collectd_regs.push_back(
             // total_operations value:DERIVE:0:U
@@ -1884,6 +3375,12 @@ void reactor::register_collectd_metrics() {
                     , "derive", "aio-read-bytes")
                     , scollectd::make_typed(scollectd::data_type::DERIVE, _aio_read_bytes)
             ));
+    _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "aio-merged-reads")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _aio_merged)
+            ));
             // total_operations value:DERIVE:0:U
     _collectd_regs.push_back(scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
                     , scollectd::per_cpu_plugin_instance
@@ -1929,6 +3426,13 @@ void reactor::register_collectd_metrics() {
                 scollectd::make_typed(scollectd::data_type::DERIVE,
                         [] { return memory::stats().cross_cpu_frees(); })
             ));
+    _collectd_regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "total_operations", "cross_cpu_free_flush"),
+                scollectd::make_typed(scollectd::data_type::DERIVE,
+                        [] { return memory::stats().cross_cpu_free_flushes(); })
+            ));
     _collectd_regs.push_back(scollectd::add_polled_metric(
                 scollectd::type_instance_id("memory",
                     scollectd::per_cpu_plugin_instance,
@@ -1950,6 +3454,13 @@ void reactor::register_collectd_metrics() {
                 scollectd::make_typed(scollectd::data_type::GAUGE,
                         [] { return memory::stats().total_memory(); })
             ));
+    _collectd_regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "memory", "transparent_huge_page_memory"),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [] { return memory::huge_page_backed_memory(); })
+            ));
     _collectd_regs.push_back(scollectd::add_polled_metric(
                 scollectd::type_instance_id("memory",
                     scollectd::per_cpu_plugin_instance,
@@ -1978,26 +3489,64 @@ void reactor::register_collectd_metrics() {
                     , scollectd::make_typed(scollectd::data_type::DERIVE, _cxx_exceptions)
             ));
 
-    if (my_io_queue) {
+    if (!my_io_queues.empty()) {
         _collectd_regs.push_back(scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
             , scollectd::per_cpu_plugin_instance
             , "gauge", "queued-io-requests")
             , scollectd::make_typed(scollectd::data_type::GAUGE,
-                [this] { return my_io_queue->queued_requests(); } )
+                [this] {
+                    size_t queued = 0;
+                    for (auto&& q : my_io_queues) {
+                        queued += q->queued_requests();
+                    }
+                    return queued;
+                })
         ));
     }
 
+    _alien_queue->register_metrics();
+    add_semaphore_metrics(_metric_groups, "reactor", "aio_slots", _io_context_available);
+
     using namespace seastar::metrics;
     _metric_groups.add_group("reactor", {
+        make_derive("idle_spin_ms", [this] { return std::chrono::duration_cast<std::chrono::milliseconds>(_idle_state_time[unsigned(idle_state::spin)]).count(); },
+                description("Total time spent busy-polling for work while idle, in milliseconds")),
+        make_derive("idle_backoff_ms", [this] { return std::chrono::duration_cast<std::chrono::milliseconds>(_idle_state_time[unsigned(idle_state::backoff)]).count(); },
+                description("Total time spent polling with pause-instruction backoff while idle (adaptive idle polling only), in milliseconds")),
+        make_derive("idle_sleep_ms", [this] { return std::chrono::duration_cast<std::chrono::milliseconds>(_idle_state_time[unsigned(idle_state::sleep)]).count(); },
+                description("Total time spent sleeping in the kernel while idle, in milliseconds")),
+        make_gauge("idle_poll_time_us", [this] { return std::chrono::duration_cast<std::chrono::microseconds>(_adaptive_idle_poll ? _learned_poll_time : _max_poll_time).count(); },
+                description("Current limit on polling before going to sleep when idle, in microseconds")),
+        make_derive("stealable_tasks", [this] { return _steal_queue.submitted(); },
+                description("Counts work items submitted by this shard with smp::submit_stealable()")),
+        make_derive("stolen_tasks", [this] { return _steal_queue.stolen(); },
+                description("Counts work items submitted by this shard that ran on another shard")),
+        make_derive("epoll_ctl_calls", _epoll_ctl_calls,
+                description("Counts epoll_ctl() system calls made to add, change or remove file descriptor registrations")),
+        make_derive("stalls", _stalls,
+                description("Counts the times the reactor was blocked for longer than --blocked-reactor-notify-ms; "
+                        "each one is also logged with a backtrace (rate-limited).")),
+        make_derive("foreign_ptr_destructions", _foreign_destructions_queued,
+                description("Counts objects released by foreign_ptrs on this shard and sent back to their shards to be destroyed")),
+        make_derive("foreign_ptr_destruction_batches", _foreign_destruction_batches,
+                description("Counts cross-shard messages that carried objects released by foreign_ptrs back to their shards")),
+        make_derive("tasks_allocated", [] { return g_task_arena.allocations; },
+                description("Counts task objects (continuations and scheduled lambdas) allocated on this shard")),
+        make_derive("tasks_recycled", [] { return g_task_arena.recycled; },
+                description("Counts task allocations served from the per-shard task cache instead of the allocator")),
+        make_histogram("task_runtime_us", [this] { return _task_runtime_hist.to_metrics_histogram(1e-3); },
+                description("Run time of a sample of tasks (continuations), in microseconds")),
+        make_histogram("poll_iteration_us", [this] { return _poll_iteration_hist.to_metrics_histogram(1e-3); },
+                description("Duration of reactor poll-loop iterations that found work, in microseconds")),
         make_counter("fstream_reads", _fstream_reads,
                 description(
                         "Counts reads from disk file streams.  A high rate indicates high disk activity."
                         " Contrast with other fstream_read* counters to locate bottlenecks.")),
-        make_derive("fstream_read_bytes", _fstream_reads,
+        make_derive("fstream_read_bytes", _fstream_read_bytes,
                 description(
                         "Counts bytes read from disk file streams.  A high rate indicates high disk activity."
                         " Divide by fstream_reads to determine average read size.")),
-        make_counter("fstream_reads_blocked", _fstream_read_bytes,
+        make_counter("fstream_reads_blocked", _fstream_reads_blocked,
                 description(
                         "Counts the number of times a disk read could not be satisfied from read-ahead buffers, and had to block."
                         " Indicates short streams, or incorrect read ahead configuration.")),
@@ -2013,18 +3562,83 @@ void reactor::register_collectd_metrics() {
                 description(
                         "Counts the number of buffered bytes that were read ahead of time and were discarded because they were not needed, wasting disk bandwidth."
                         " Indicates over-eager read ahead configuration.")),
+        make_gauge("discard_backlog_bytes", [this] { return sum_discard_queues(&discard_queue::backlog_bytes); },
+                description("Bytes waiting to be discarded (trimmed) in the background")),
+        make_gauge("discard_backlog_ranges", [this] { return sum_discard_queues(&discard_queue::backlog_ranges); },
+                description("File ranges waiting to be discarded; touching ranges of a file count once")),
+        make_derive("discarded_bytes", [this] { return sum_discard_queues(&discard_queue::discarded_bytes); },
+                description("Counts bytes discarded by the background discard queues")),
+        make_derive("discards", [this] { return sum_discard_queues(&discard_queue::discards); },
+                description("Counts discard requests issued to the disk; large ranges are split into several")),
+    });
+
+    _metric_groups.add_group("memory", {
+        make_histogram("free_span_pages", [] {
+            auto f = memory::free_span_stats();
+            histogram h;
+            h.buckets.resize(f.nr_lists);
+            for (unsigned i = 0; i < f.nr_lists; ++i) {
+                h.sample_count += f.spans[i];
+                h.sample_sum += f.pages[i];
+                h.buckets[i].count = h.sample_count;
+                h.buckets[i].upper_bound = double((uint64_t(2) << i) - 1);
+            }
+            return h;
+        }, description("Sizes of the free large spans, in pages; many small spans and few large ones indicate fragmentation")),
+        make_gauge("numa_local_bytes", [] { return memory::get_numa_placement().local_bytes(); },
+                description("Estimated bytes of this shard's memory on its own NUMA node")),
+        make_gauge("numa_remote_bytes", [] { return memory::get_numa_placement().remote_bytes(); },
+                description("Estimated bytes of this shard's memory on other NUMA nodes, which are slower to access")),
+        make_gauge("donated_bytes", [] { return memory::rebalancing_stats().donated_bytes; },
+                description("Bytes of this shard's share of memory it has donated to other shards (--elastic-memory)")),
+        make_gauge("borrowed_bytes", [] { return memory::rebalancing_stats().borrowed_bytes; },
+                description("Bytes this shard has borrowed beyond its share of memory (--elastic-memory)")),
+        make_derive("donations", [] { return memory::rebalancing_stats().donations; },
+                description("Spans of memory this shard has donated to other shards")),
+        make_derive("borrows", [] { return memory::rebalancing_stats().borrows; },
+                description("Spans of memory donated by other shards that this shard has borrowed")),
+        make_gauge("rebalance_pool_bytes", [] { return memory::rebalancing_stats().pool_bytes; },
+                description("Bytes donated by all shards and not yet borrowed")),
+        make_gauge("rebalance_demand_bytes", [] { return memory::rebalancing_stats().demand_bytes; },
+                description("Bytes asked for by all shards under memory pressure")),
     });
+    // One instance per small-object pool (size class), named <object size>-<shard>.
+    for (unsigned i = 0; i < memory::small_pool_count(); ++i) {
+        auto instance = sprint("%d-%d", memory::small_pool_stats(i).object_size, engine().cpu_id());
+        _metric_groups.add_group("memory_pool", {
+            make_gauge("objects", [i] { return memory::small_pool_stats(i).use_count; },
+                    description("Number of live objects in this size class"), true, instance),
+            make_gauge("free_objects", [i] { return memory::small_pool_stats(i).free_count; },
+                    description("Number of objects on this size class's free list"), true, instance),
+            make_gauge("unused_objects", [i] { return memory::small_pool_stats(i).unused_in_spans(); },
+                    description("Number of unallocated objects stranded in partly used spans of this size class"), true, instance),
+            make_gauge("bytes", [i] { return memory::small_pool_stats(i).memory(); },
+                    description("Memory held by this size class's spans, in bytes"), true, instance),
+        });
+    }
 }
 
-void reactor::run_tasks(circular_buffer<std::unique_ptr<task>>& tasks) {
+void reactor::run_tasks(circular_buffer<task_ptr>& tasks) {
     STAP_PROBE(seastar, reactor_run_tasks_start);
-    g_need_preempt = false;
     while (!tasks.empty()) {
         auto tsk = std::move(tasks.front());
         tasks.pop_front();
         STAP_PROBE(seastar, reactor_run_tasks_single_start);
-        tsk->run();
-        tsk.reset();
+        seastar::tracing::impl::g_current_span = tsk->trace_span();
+        // Taken before the task runs, since it may be gone by the time
+        // the profiler looks
+        _running_task_type = &typeid(*tsk);
+        if (__builtin_expect(++_task_runtime_sample_counter == task_runtime_sample_period, false)) {
+            _task_runtime_sample_counter = 0;
+            auto start = tsc_clock::now();
+            tsk.release()->run_and_dispose();
+            _task_runtime_hist.add((tsc_clock::now() - start).count());
+        } else {
+            tsk.release()->run_and_dispose();
+        }
+        // The task may have released the last reference to its span
+        seastar::tracing::impl::g_current_span = nullptr;
+        _running_task_type = nullptr;
         STAP_PROBE(seastar, reactor_run_tasks_single_end);
         ++_tasks_processed;
         // check at end of loop, to allow at least one task to run
@@ -2035,8 +3649,118 @@ void reactor::run_tasks(circular_buffer<std::unique_ptr<task>>& tasks) {
     STAP_PROBE(seastar, reactor_run_tasks_end);
 }
 
+std::array<std::atomic<float>, scheduling_group::max_groups> reactor::_registered_sg_shares;
+std::array<sstring, scheduling_group::max_groups> reactor::_registered_sg_names;
+
+scheduling_group reactor::register_scheduling_group(sstring name, float shares) {
+    assert(shares > 0);
+    // Group 0 is the default group, created by each reactor on its own.
+    for (unsigned i = 1; i < scheduling_group::max_groups; ++i) {
+        float unused = 0;
+        auto s = _registered_sg_shares[i].compare_exchange_strong(unused, shares, std::memory_order_acq_rel);
+        if (s) {
+            _registered_sg_names[i] = name;
+            return scheduling_group(i);
+        }
+    }
+    throw std::runtime_error("No more room for new scheduling groups");
+}
+
+reactor::task_queue::task_queue(unsigned id, sstring name, float shares)
+        : _reciprocal_shares(1 / shares)
+        , _id(id)
+        , _name(std::move(name)) {
+    _collectd_regs = scollectd::registrations({
+        scollectd::add_polled_metric(scollectd::type_instance_id("scheduler"
+            , scollectd::per_cpu_plugin_instance
+            , "queue_length", _name)
+            , scollectd::make_typed(scollectd::data_type::GAUGE, [this] { return _q.size(); })
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id("scheduler"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", _name)
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _tasks_processed)
+        ),
+        // runtime in milliseconds; its rate is the fraction of a cpu the group got
+        scollectd::add_polled_metric(scollectd::type_instance_id("scheduler"
+            , scollectd::per_cpu_plugin_instance
+            , "derive", _name + "-runtime-ms")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, [this] {
+                return std::chrono::duration_cast<std::chrono::milliseconds>(_runtime).count();
+            })
+        ),
+    });
+    namespace sm = seastar::metrics;
+    _metrics.add_group("scheduler", {
+        sm::make_histogram(_name + "_queue_delay_us", [this] { return _delay_hist.to_metrics_histogram(1e-3); },
+                sm::description("Time tasks of this scheduling group waited for the cpu after becoming runnable, in microseconds")),
+    });
+}
+
+void reactor::task_queue::account_runtime(std::chrono::nanoseconds runtime) {
+    _runtime += runtime;
+    _vruntime += runtime.count() * _reciprocal_shares;
+}
+
+void reactor::create_task_queue(scheduling_group sg) {
+    auto shares = _registered_sg_shares.at(sg._id).load(std::memory_order_acquire);
+    assert(shares > 0);
+    _task_queues[sg._id] = std::make_unique<task_queue>(sg._id, _registered_sg_names[sg._id], shares);
+}
+
+void reactor::activate(task_queue& tq) {
+    tq._active = true;
+    tq._waiting_since = steady_clock_type::now();
+    tq._vruntime = std::max(tq._vruntime, _last_vruntime);
+    _active_task_queues.push_back(&tq);
+}
+
+size_t reactor::pending_task_count() const {
+    size_t ret = 0;
+    for (auto&& tq : _task_queues) {
+        if (tq) {
+            ret += tq->_q.size();
+        }
+    }
+    return ret;
+}
+
+// Runs tasks until we need to poll again. Each time around, the active queue
+// with the lowest virtual runtime (runtime divided by shares) is run until it
+// is empty or its quota expires, so over time every group receives CPU in
+// proportion to its shares.
+void reactor::run_some_tasks() {
+    g_need_preempt.store(false, std::memory_order_relaxed);
+    while (!_active_task_queues.empty()) {
+        auto it = std::min_element(_active_task_queues.begin(), _active_task_queues.end(),
+                [] (task_queue* a, task_queue* b) { return a->_vruntime < b->_vruntime; });
+        auto& tq = **it;
+        _last_vruntime = std::max(_last_vruntime, tq._vruntime);
+        auto tasks_before = _tasks_processed;
+        auto start = steady_clock_type::now();
+        tq._delay_hist.add(std::chrono::duration_cast<std::chrono::nanoseconds>(start - tq._waiting_since).count());
+        g_current_scheduling_group = tq._id;
+        run_tasks(tq._q);
+        g_current_scheduling_group = 0;
+        auto end = steady_clock_type::now();
+        tq.account_runtime(end - start);
+        tq._tasks_processed += _tasks_processed - tasks_before;
+        tq._waiting_since = end;
+        if (tq._q.empty()) {
+            tq._active = false;
+            // _active_task_queues may have grown while the tasks ran
+            it = std::find(_active_task_queues.begin(), _active_task_queues.end(), &tq);
+            *it = _active_task_queues.back();
+            _active_task_queues.pop_back();
+        }
+        if (need_preempt()) {
+            break;
+        }
+    }
+}
+
 void reactor::force_poll() {
-    g_need_preempt = true;
+    g_need_preempt.store(true, std::memory_order_relaxed);
 }
 
 bool
@@ -2050,6 +3774,44 @@ reactor::flush_tcp_batches() {
     return work;
 }
 
+void reactor::destroy_on(unsigned cpu, std::unique_ptr<foreign_destructible> obj) {
+    ++_foreign_destructions_queued;
+    if (!_foreign_destruction_batching) {
+        // Nothing polls to send a batch
+        ++_foreign_destruction_batches;
+        smp::submit_to(cpu, [obj = std::move(obj)] () mutable {
+            obj.reset();
+        });
+        return;
+    }
+    if (_foreign_destructions.empty()) {
+        _foreign_destructions.resize(smp::count);
+    }
+    _foreign_destructions[cpu].push_back(std::move(obj));
+    _foreign_destructions_pending = true;
+}
+
+bool
+reactor::flush_foreign_destructions() {
+    if (!_foreign_destructions_pending) {
+        return false;
+    }
+    _foreign_destructions_pending = false;
+    for (unsigned cpu = 0; cpu < _foreign_destructions.size(); ++cpu) {
+        auto& objs = _foreign_destructions[cpu];
+        if (objs.empty()) {
+            continue;
+        }
+        ++_foreign_destruction_batches;
+        // The message is destroyed back here; the objects must not be
+        smp::submit_to(cpu, [objs = std::move(objs)] () mutable {
+            objs.clear();
+        });
+        objs.clear();
+    }
+    return true;
+}
+
 bool
 reactor::do_expire_lowres_timers() {
     if (_lowres_next_timeout == lowres_clock::time_point()) {
@@ -2079,9 +3841,21 @@ manual_clock::expire_timers() {
     local_engine->expire_manual_timers();
 }
 
+void
+manual_clock::set_simulated(bool simulated) {
+    using namespace std::chrono;
+    lowres_clock::_simulated_base = lowres_clock::now().time_since_epoch().count()
+            - duration_cast<milliseconds>(now().time_since_epoch()).count();
+    _simulated.store(simulated, std::memory_order_relaxed);
+    lowres_clock::update();
+}
+
 void
 manual_clock::advance(manual_clock::duration d) {
     _now.fetch_add(d.count());
+    if (simulated()) {
+        lowres_clock::update();
+    }
     if (local_engine) {
         schedule_urgent(make_task(&manual_clock::expire_timers));
         smp::invoke_on_all(&manual_clock::expire_timers);
@@ -2110,9 +3884,11 @@ class reactor::io_pollfn final : public reactor::pollfn {
     }
     virtual bool try_enter_interrupt_mode() override {
         // aio cannot generate events if there are no inflight aios;
-        // but if we enabled _aio_eventfd, we can always enter
+        // but if we enabled _aio_eventfd, we can always enter. A backend
+        // that handles disk I/O itself wakes up on its completions.
         return _r._io_context_available.current() == reactor::max_aio
-                || _r._aio_eventfd;
+                || _r._aio_eventfd
+                || _r.backend().handles_disk_io();
     }
     virtual void exit_interrupt_mode() override {
         // nothing to do
@@ -2169,6 +3945,31 @@ class reactor::batch_flush_pollfn final : public reactor::pollfn {
     }
 };
 
+class reactor::foreign_destruction_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    foreign_destruction_pollfn(reactor& r) : _r(r) {
+        _r._foreign_destruction_batching = true;
+    }
+    ~foreign_destruction_pollfn() {
+        _r.flush_foreign_destructions();
+        _r._foreign_destruction_batching = false;
+    }
+    virtual bool poll() final override {
+        return _r.flush_foreign_destructions();
+    }
+    virtual bool pure_poll() override final {
+        return poll(); // actually performs work, but triggers no user continuations, so okay
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // This is a passive poller, so if a previous poll
+        // returned false (idle), there's no more work to do.
+        return true;
+    }
+    virtual void exit_interrupt_mode() override final {
+    }
+};
+
 class reactor::aio_batch_submit_pollfn final : public reactor::pollfn {
     reactor& _r;
 public:
@@ -2190,8 +3991,16 @@ class reactor::aio_batch_submit_pollfn final : public reactor::pollfn {
 
 class reactor::drain_cross_cpu_freelist_pollfn final : public reactor::pollfn {
 public:
+    // Remote frees can be batched while something polls to flush them.
+    drain_cross_cpu_freelist_pollfn() {
+        memory::set_cross_cpu_free_batching(true);
+    }
+    ~drain_cross_cpu_freelist_pollfn() {
+        memory::set_cross_cpu_free_batching(false);
+    }
     virtual bool poll() final override {
-        return memory::drain_cross_cpu_freelist();
+        auto flushed = memory::flush_cross_cpu_frees();
+        return memory::drain_cross_cpu_freelist() || flushed;
     }
     virtual bool pure_poll() override final {
         return poll(); // actually performs work, but triggers no user continuations, so okay
@@ -2202,6 +4011,26 @@ class reactor::drain_cross_cpu_freelist_pollfn final : public reactor::pollfn {
         // doesn't have any side effects.
         //
         // We'll take care of those items when we wake up for another reason.
+        // Our own batches must not wait for that, though.
+        memory::flush_cross_cpu_frees();
+        return true;
+    }
+    virtual void exit_interrupt_mode() override final {
+    }
+};
+
+// Donates memory to other shards that asked for it, and collects what was
+// donated to this one.  An idle shard asleep in the kernel donates when
+// its next timer wakes it.
+class reactor::memory_rebalance_pollfn final : public reactor::pollfn {
+public:
+    virtual bool poll() final override {
+        return memory::rebalance();
+    }
+    virtual bool pure_poll() override final {
+        return poll(); // performs work, but triggers no user continuations, so okay
+    }
+    virtual bool try_enter_interrupt_mode() override {
         return true;
     }
     virtual void exit_interrupt_mode() override final {
@@ -2275,7 +4104,7 @@ class reactor::smp_pollfn final : public reactor::pollfn {
             return false;
         }
         _r._sleeping.store(true, std::memory_order_relaxed);
-        systemwide_memory_barrier();
+        asymmetric_fence_heavy();
         _membarrier_lock.unlock();
         if (poll()) {
             // raced
@@ -2285,35 +4114,113 @@ class reactor::smp_pollfn final : public reactor::pollfn {
         return true;
     }
     virtual void exit_interrupt_mode() override final {
-        _r._sleeping.store(false, std::memory_order_relaxed);
+        _r._sleeping.store(false, std::memory_order_relaxed);
+    }
+};
+
+// Polls the queue of work from non-seastar threads.  Those threads cannot
+// take part in systemwide_memory_barrier(), so this uses a full fence on
+// both sides instead (see alien::message_queue::maybe_wakeup()).
+class reactor::alien_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    alien_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll() final override {
+        return _r._alien_queue->process_incoming();
+    }
+    virtual bool pure_poll() final override {
+        return _r._alien_queue->pure_poll();
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        _r._sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (pure_poll()) {
+            _r._sleeping.store(false, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+    virtual void exit_interrupt_mode() override final {
+        _r._sleeping.store(false, std::memory_order_relaxed);
+    }
+};
+
+class reactor::syscall_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    syscall_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll() final override {
+        auto flushed = _r._thread_pool.flush();
+        return _r._thread_pool.complete() || flushed;
+    }
+    virtual bool pure_poll() override final {
+        return poll(); // actually performs work, but triggers no user continuations, so okay
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        _r._thread_pool.enter_interrupt_mode();
+        if (poll()) {
+            // raced
+            _r._thread_pool.exit_interrupt_mode();
+            return false;
+        }
+        return true;
+    }
+    virtual void exit_interrupt_mode() override final {
+        _r._thread_pool.exit_interrupt_mode();
+    }
+};
+
+
+// Only registered with --io-dispatch=local.
+class reactor::io_budget_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    io_budget_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll() override final {
+        bool did_work = false;
+        for (auto&& q : _r.my_io_queues) {
+            did_work |= q->poll_budget();
+        }
+        return did_work;
+    }
+    virtual bool pure_poll() override final {
+        for (auto&& q : _r.my_io_queues) {
+            if (q->budget_waiters() && q->_budget->available.load(std::memory_order_relaxed) > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // Other shards returning budget do not wake us up.
+        for (auto&& q : _r.my_io_queues) {
+            if (q->budget_waiters()) {
+                return false;
+            }
+        }
+        return true;
+    }
+    virtual void exit_interrupt_mode() override final {
     }
 };
 
-class reactor::syscall_pollfn final : public reactor::pollfn {
-    reactor& _r;
+class reactor::steal_pollfn final : public reactor::pollfn {
 public:
-    syscall_pollfn(reactor& r) : _r(r) {}
     virtual bool poll() final override {
-        return _r._thread_pool.complete();
+        return smp::poll_steal_queues();
     }
     virtual bool pure_poll() override final {
-        return poll(); // actually performs work, but triggers no user continuations, so okay
+        return smp::pure_poll_steal_queues();
     }
     virtual bool try_enter_interrupt_mode() override {
-        _r._thread_pool.enter_interrupt_mode();
-        if (poll()) {
-            // raced
-            _r._thread_pool.exit_interrupt_mode();
-            return false;
-        }
-        return true;
+        // Nobody wakes us up for stealable work, so we just stop looking
+        // while asleep.
+        return engine()._steal_queue.empty();
     }
     virtual void exit_interrupt_mode() override final {
-        _r._thread_pool.exit_interrupt_mode();
     }
 };
 
-
 alignas(64) reactor::smp_pollfn::aligned_flag reactor::smp_pollfn::_membarrier_lock;
 
 class reactor::epoll_pollfn final : public reactor::pollfn {
@@ -2375,6 +4282,152 @@ static void print_backtrace_safe() noexcept {
     });
 }
 
+// With the default fixed policy we spin for up to --idle-poll-time-us and then
+// sleep. The adaptive policy replaces that limit with one learned from recent
+// idle periods (never above --idle-poll-time-us), and spends the second half
+// of it in exponentially growing runs of pause instructions, which are
+// cheaper in power and hyperthread contention than polling.
+reactor::idle_state reactor::idle_state_for(std::chrono::nanoseconds idle_time) const {
+    if (!_adaptive_idle_poll) {
+        return idle_time > _max_poll_time ? idle_state::sleep : idle_state::spin;
+    }
+    if (idle_time > _learned_poll_time) {
+        return idle_state::sleep;
+    }
+    if (idle_time > _learned_poll_time / 2) {
+        return idle_state::backoff;
+    }
+    return idle_state::spin;
+}
+
+void reactor::learn_idle_period(std::chrono::nanoseconds idle_time) {
+    if (!_adaptive_idle_poll) {
+        return;
+    }
+    // An idle period that ended within _max_poll_time would have been worth
+    // polling through, whether or not we actually went to sleep.
+    bool hit = idle_time <= _max_poll_time;
+    _idle_hit_rate = _idle_hit_rate * 0.875 + (hit ? 0.125 : 0);
+    if (hit) {
+        _idle_gap_ewma_ns = _idle_gap_ewma_ns * 0.875 + idle_time.count() * 0.125;
+    }
+    if (_idle_hit_rate >= 0.5) {
+        // Work usually shows up soon: poll for twice the typical gap.
+        auto t = std::chrono::nanoseconds(int64_t(2 * _idle_gap_ewma_ns));
+        _learned_poll_time = std::min(t, _max_poll_time);
+    } else {
+        // Mostly long idle periods: polling just burns power.
+        _learned_poll_time = 0ns;
+    }
+}
+
+// Async-signal safe.
+void reactor::report_stall() noexcept {
+    // Don't flood the log if something keeps stalling; one report every
+    // few seconds is enough to find the culprit.
+    static constexpr auto min_report_interval = std::chrono::seconds(5);
+    // steady_clock::now() is clock_gettime(CLOCK_MONOTONIC), which is
+    // async-signal safe.
+    auto now = std::chrono::steady_clock::now();
+    if (now - _last_stall_report < min_report_interval && _last_stall_report.time_since_epoch().count()) {
+        ++_stall_reports_suppressed;
+        return;
+    }
+    _last_stall_report = now;
+    auto stalled_ms = std::chrono::duration_cast<std::chrono::milliseconds>(_stall_ticks * _task_quota).count();
+    print_safe("Reactor stalled for ");
+    print_decimal_safe(uint64_t(stalled_ms));
+    print_safe(" ms on shard ");
+    print_decimal_safe(_id);
+    if (_stall_reports_suppressed) {
+        print_safe(" (");
+        print_decimal_safe(_stall_reports_suppressed);
+        print_safe(" similar reports suppressed)");
+        _stall_reports_suppressed = 0;
+    }
+    print_safe(".\nBacktrace:\n");
+    print_backtrace_safe();
+}
+
+// Async-signal safe.
+void reactor::take_cpu_profile_sample(int) {
+    auto r = local_engine;
+    if (!r || r->_cpu_profile_busy || !r->_cpu_profile) {
+        return;
+    }
+    auto& s = r->_cpu_profile[r->_cpu_profile_samples % r->_cpu_profile_capacity];
+    s.task_type = r->_running_task_type;
+    s.nr_frames = 0;
+    // The first frame returns into the kernel's signal trampoline
+    bool trampoline = true;
+    backtrace([&] (uintptr_t addr) {
+        if (trampoline) {
+            trampoline = false;
+        } else if (s.nr_frames < cpu_profile_slot::max_frames) {
+            s.frames[s.nr_frames++] = addr;
+        }
+    });
+    ++r->_cpu_profile_samples;
+}
+
+void reactor::set_cpu_profiling(std::chrono::microseconds period, size_t max_samples) {
+    if (!_cpu_profile_timer_created) {
+        struct sigaction sa = {};
+        sa.sa_handler = &reactor::take_cpu_profile_sample;
+        sa.sa_flags = SA_RESTART;
+        auto r = sigaction(cpu_profile_signal(), &sa, nullptr);
+        throw_system_error_on(r == -1);
+        // Counts the CPU time of this thread only, so that samples are
+        // taken in proportion to the time spent running
+        struct sigevent sev = {};
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev._sigev_un._tid = syscall(SYS_gettid);
+        sev.sigev_signo = cpu_profile_signal();
+        r = timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &_cpu_profile_timer);
+        throw_system_error_on(r == -1);
+        _cpu_profile_timer_created = true;
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, cpu_profile_signal());
+        r = ::pthread_sigmask(SIG_UNBLOCK, &mask, nullptr);
+        throw_pthread_error(r);
+    }
+    itimerspec its = {};
+    if (period.count()) {
+        max_samples = std::max<size_t>(max_samples, 1);
+        if (max_samples != _cpu_profile_capacity) {
+            auto profile = std::make_unique<cpu_profile_slot[]>(max_samples);
+            _cpu_profile_busy = 1;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            _cpu_profile = std::move(profile);
+            _cpu_profile_capacity = max_samples;
+            _cpu_profile_samples = 0;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            _cpu_profile_busy = 0;
+        }
+        its.it_value.tv_sec = period.count() / 1000000;
+        its.it_value.tv_nsec = period.count() % 1000000 * 1000;
+        its.it_interval = its.it_value;
+    }
+    auto r = timer_settime(_cpu_profile_timer, 0, &its, nullptr);
+    throw_system_error_on(r == -1);
+}
+
+std::vector<cpu_profile_sample> reactor::get_cpu_profile() {
+    std::vector<cpu_profile_sample> ret;
+    _cpu_profile_busy = 1;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    auto n = std::min<uint64_t>(_cpu_profile_samples, _cpu_profile_capacity);
+    ret.reserve(n);
+    for (auto i = _cpu_profile_samples - n; i != _cpu_profile_samples; ++i) {
+        auto& s = _cpu_profile[i % _cpu_profile_capacity];
+        ret.push_back(cpu_profile_sample{s.task_type, std::vector<uintptr_t>(s.frames, s.frames + s.nr_frames)});
+    }
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    _cpu_profile_busy = 0;
+    return ret;
+}
+
 int reactor::run() {
     auto signal_stack = install_signal_handler_stack();
 
@@ -2413,11 +4466,19 @@ int reactor::run() {
 
     // Register smp queues poller
     std::experimental::optional<poller> smp_poller;
+    std::experimental::optional<poller> foreign_destruction_poller;
     if (smp::count > 1) {
         smp_poller = poller(std::make_unique<smp_pollfn>(*this));
+        foreign_destruction_poller = poller(std::make_unique<foreign_destruction_pollfn>(*this));
     }
 
+    poller alien_poller(std::make_unique<alien_pollfn>(*this));
     poller syscall_poller(std::make_unique<syscall_pollfn>(*this));
+    poller steal_poller(std::make_unique<steal_pollfn>());
+    std::experimental::optional<poller> io_budget_poller;
+    if (!my_io_queues.empty() && my_io_queues[0]->_budget) {
+        io_budget_poller = poller(std::make_unique<io_budget_pollfn>(*this));
+    }
 #ifndef HAVE_OSV
     _signals.handle_signal(alarm_signal(), [this] {
         complete_timers(_timers, _expired_timers, [this] {
@@ -2430,6 +4491,11 @@ int reactor::run() {
 
     poller drain_cross_cpu_freelist(std::make_unique<drain_cross_cpu_freelist_pollfn>());
 
+    std::experimental::optional<poller> memory_rebalance_poller;
+    if (_rebalance_memory) {
+        memory_rebalance_poller = poller(std::make_unique<memory_rebalance_pollfn>());
+    }
+
     poller expire_lowres_timers(std::make_unique<lowres_timer_pollfn>(*this));
 
     using namespace std::chrono_literals;
@@ -2452,6 +4518,9 @@ int reactor::run() {
     });
     load_timer.arm_periodic(1s);
 
+    timer<lowres_clock> tsc_refine_timer([] { tsc_clock::refine(); });
+    tsc_refine_timer.arm_periodic(1s);
+
     itimerspec its = {};
     auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(_task_quota).count();
     auto tv_nsec = nsec % 1'000'000'000;
@@ -2459,33 +4528,44 @@ int reactor::run() {
     its.it_value.tv_nsec = tv_nsec;
     its.it_value.tv_sec = tv_sec;
     its.it_interval = its.it_value;
-    auto r = timer_settime(_task_quota_timer, 0, &its, nullptr);
-    assert(r == 0);
     auto& task_quote_itimerspec = its;
 
     struct sigaction sa_task_quota = {};
-    sa_task_quota.sa_handler = &reactor::clear_task_quota;
+    sa_task_quota.sa_handler = _preempt_from_thread ? &reactor::report_stall_on_signal : &reactor::clear_task_quota;
     sa_task_quota.sa_flags = SA_RESTART;
-    r = sigaction(task_quota_signal(), &sa_task_quota, nullptr);
+    auto r = sigaction(task_quota_signal(), &sa_task_quota, nullptr);
     assert(r == 0);
+    if (_preempt_from_thread) {
+        g_preempt_timer_thread.add(*this, std::chrono::duration_cast<std::chrono::nanoseconds>(_task_quota));
+    } else {
+        r = timer_settime(_task_quota_timer, 0, &its, nullptr);
+        assert(r == 0);
+    }
+    auto stop_preempt_timer = defer([this] {
+        if (_preempt_from_thread) {
+            g_preempt_timer_thread.remove(*this);
+        }
+    });
 
     bool idle = false;
 
     std::function<bool()> check_for_work = [this] () {
-        return poll_once() || !_pending_tasks.empty() || seastar::thread::try_run_one_yielded_thread();
+        return poll_once() || have_more_tasks() || seastar::thread::try_run_one_yielded_thread();
     };
     std::function<bool()> pure_check_for_work = [this] () {
-        return pure_poll_once() || !_pending_tasks.empty() || seastar::thread::try_run_one_yielded_thread();
+        return pure_poll_once() || have_more_tasks() || seastar::thread::try_run_one_yielded_thread();
     };
     while (true) {
-        run_tasks(_pending_tasks);
+        auto iteration_start = steady_clock_type::now();
+        run_some_tasks();
         if (_stopped) {
             load_timer.cancel();
             // Final tasks may include sending the last response to cpu 0, so run them
-            while (!_pending_tasks.empty()) {
-                run_tasks(_pending_tasks);
+            while (have_more_tasks()) {
+                run_some_tasks();
             }
             while (!_at_destroy_tasks.empty()) {
+                g_need_preempt.store(false, std::memory_order_relaxed);
                 run_tasks(_at_destroy_tasks);
             }
             smp::arrive_at_event_loop_end();
@@ -2496,7 +4576,9 @@ int reactor::run() {
         }
 
         if (check_for_work()) {
+            _poll_iteration_hist.add(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock_type::now() - iteration_start).count());
             if (idle) {
+                learn_idle_period(idle_end - idle_start);
                 _total_idle += idle_end - idle_start;
                 idle_start = idle_end;
                 idle = false;
@@ -2506,6 +4588,7 @@ int reactor::run() {
             if (!idle) {
                 idle_start = idle_end;
                 idle = true;
+                _idle_backoff_pauses = 1;
             }
             bool go_to_sleep = true;
             try {
@@ -2518,16 +4601,39 @@ int reactor::run() {
                 report_exception("Exception while running idle cpu handler", std::current_exception());
             }
             if (go_to_sleep) {
-                _mm_pause();
-                if (idle_end - idle_start > _max_poll_time) {
+                auto state = idle_state_for(idle_end - idle_start);
+                switch (state) {
+                case idle_state::spin:
+                    _mm_pause();
+                    break;
+                case idle_state::backoff:
+                    for (unsigned i = 0; i < _idle_backoff_pauses; ++i) {
+                        _mm_pause();
+                    }
+                    _idle_backoff_pauses = std::min(_idle_backoff_pauses * 2, max_idle_backoff_pauses);
+                    break;
+                default: {
                     // Turn off the task quota timer to avoid spurious wakeiups
                     struct itimerspec zero_itimerspec = {};
-                    timer_settime(_task_quota_timer, 0, &zero_itimerspec, nullptr);
+                    if (_preempt_from_thread) {
+                        _preempt_paused.store(true, std::memory_order_relaxed);
+                    } else {
+                        timer_settime(_task_quota_timer, 0, &zero_itimerspec, nullptr);
+                    }
                     sleep();
+                    if (_preempt_from_thread) {
+                        _preempt_paused.store(false, std::memory_order_relaxed);
+                    } else {
+                        timer_settime(_task_quota_timer, 0, &task_quote_itimerspec, nullptr);
+                    }
                     // We may have slept for a while, so freshen idle_end
-                    idle_end = steady_clock_type::now();
-                    timer_settime(_task_quota_timer, 0, &task_quote_itimerspec, nullptr);
+                    auto now = steady_clock_type::now();
+                    _idle_state_time[unsigned(state)] += now - idle_end;
+                    idle_end = now;
+                    continue;
+                }
                 }
+                _idle_state_time[unsigned(state)] += steady_clock_type::now() - idle_end;
             } else {
                 // We previously ran pure_check_for_work(), might not actually have performed
                 // any work.
@@ -2535,11 +4641,11 @@ int reactor::run() {
             }
         }
     }
-    // To prevent ordering issues from rising, destroy the I/O queue explicitly at this point.
+    // To prevent ordering issues from rising, destroy the I/O queues explicitly at this point.
     // This is needed because the reactor is destroyed from the thread_local destructors. If
     // the I/O queue happens to use any other infrastructure that is also kept this way (for
     // instance, collectd), we will not have any way to guarantee who is destroyed first.
-    my_io_queue.reset(nullptr);
+    my_io_queues.clear();
     return _return;
 }
 
@@ -2690,15 +4796,23 @@ reactor_backend_epoll::wait_and_process(int timeout, const sigset_t* active_sigm
     for (int i = 0; i < nr; ++i) {
         auto& evt = eevt[i];
         auto pfd = reinterpret_cast<pollable_fd_state*>(evt.data.ptr);
+        if (pfd->edge_triggered) {
+            // The edge is not reported again, so remember it. An error or
+            // hangup is reported once too; let both directions discover it.
+            auto events = evt.events & (EPOLLERR | EPOLLHUP) ? EPOLLIN | EPOLLOUT : evt.events & (EPOLLIN | EPOLLOUT);
+            pfd->events_known |= events;
+            complete_epoll_event(*pfd, &pollable_fd_state::pollin, events, EPOLLIN);
+            complete_epoll_event(*pfd, &pollable_fd_state::pollout, events, EPOLLOUT);
+            continue;
+        }
         auto events = evt.events & (EPOLLIN | EPOLLOUT);
         auto events_to_remove = events & ~pfd->events_requested;
         complete_epoll_event(*pfd, &pollable_fd_state::pollin, events, EPOLLIN);
         complete_epoll_event(*pfd, &pollable_fd_state::pollout, events, EPOLLOUT);
         if (events_to_remove) {
             pfd->events_epoll &= ~events_to_remove;
-            evt.events = pfd->events_epoll;
-            auto op = evt.events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            ::epoll_ctl(_epollfd.get(), op, pfd->fd.get(), &evt);
+            auto op = pfd->events_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+            epoll_ctl(op, *pfd);
         }
     }
     return nr;
@@ -2711,10 +4825,22 @@ syscall_work_queue::syscall_work_queue()
 }
 
 void syscall_work_queue::submit_item(syscall_work_queue::work_item* item) {
-    _queue_has_room.wait().then([this, item] {
-        _pending.push(item);
-        _start_eventfd.signal(1);
-    });
+    item->_queue = this;
+    _queue_has_room.wait(*item);
+}
+
+void syscall_work_queue::enqueue(syscall_work_queue::work_item* item) {
+    _pending.push(item);
+    ++_unsignalled;
+}
+
+bool syscall_work_queue::flush() {
+    if (!_unsignalled) {
+        return false;
+    }
+    _unsignalled = 0;
+    _start_eventfd.signal(1);
+    return true;
 }
 
 unsigned syscall_work_queue::complete() {
@@ -2733,14 +4859,20 @@ unsigned syscall_work_queue::complete() {
 }
 
 smp_message_queue::smp_message_queue(reactor* from, reactor* to)
-    : _pending(to)
-    , _completed(from)
+    : _pending(to, from->_id)
+    , _completed(from, to->_id)
 {
 }
 
 void smp_message_queue::move_pending() {
+    if (_current_queue_length >= _max_in_flight) {
+        return;
+    }
     auto begin = _tx.a.pending_fifo.cbegin();
     auto end = _tx.a.pending_fifo.cend();
+    if (size_t(end - begin) > _max_in_flight - _current_queue_length) {
+        end = begin + (_max_in_flight - _current_queue_length);
+    }
     end = _pending.push(begin, end);
     if (begin == end) {
         return;
@@ -2761,16 +4893,27 @@ bool smp_message_queue::pure_poll_tx() const {
 
 void smp_message_queue::submit_item(smp_message_queue::work_item* item) {
     _tx.a.pending_fifo.push_back(item);
-    if (_tx.a.pending_fifo.size() >= batch_size) {
+    if (_tx.a.pending_fifo.size() >= _batch_size) {
         move_pending();
     }
+    if (!_tx.a.pending_fifo.empty()) {
+        smp::mark_unflushed(_completed.pusher);
+    }
+}
+
+void smp_message_queue::set_limits(size_t max_in_flight, size_t batch_size) {
+    _max_in_flight = std::max<size_t>(1, std::min(max_in_flight, queue_length));
+    _batch_size = std::max<size_t>(1, batch_size);
 }
 
 void smp_message_queue::respond(work_item* item) {
     _completed_fifo.push_back(item);
-    if (_completed_fifo.size() >= batch_size || engine()._stopped) {
+    if (_completed_fifo.size() >= _batch_size || engine()._stopped) {
         flush_response_batch();
     }
+    if (!_completed_fifo.empty()) {
+        smp::mark_unflushed(_pending.pusher);
+    }
 }
 
 void smp_message_queue::flush_response_batch() {
@@ -2790,6 +4933,10 @@ bool smp_message_queue::has_unflushed_responses() const {
     return !_completed_fifo.empty();
 }
 
+bool smp_message_queue::has_unflushed_requests() const {
+    return !_tx.a.pending_fifo.empty();
+}
+
 bool smp_message_queue::pure_poll_rx() const {
     // can't use read_available(), not available on older boost
     // empty() is not const, so need const_cast.
@@ -2801,11 +4948,10 @@ smp_message_queue::lf_queue::maybe_wakeup() {
     // Called after lf_queue_base::push().
     //
     // This is read-after-write, which wants memory_order_seq_cst,
-    // but we insert that barrier using systemwide_memory_barrier()
-    // because seq_cst is so expensive.
-    //
-    // However, we do need a compiler barrier:
-    std::atomic_signal_fence(std::memory_order_seq_cst);
+    // but seq_cst is so expensive that the sleeping side takes the
+    // other half of an asymmetric fence instead.
+    asymmetric_fence_light();
+    remote->_smp_ready.add(pusher);
     if (remote->_sleeping.load(std::memory_order_relaxed)) {
         // We are free to clear it, because we're sending a signal now
         remote->_sleeping.store(false, std::memory_order_relaxed);
@@ -2915,11 +5061,63 @@ void smp_message_queue::start(unsigned cpuid) {
 
 /* not yet implemented for OSv. TODO: do the notification like we do class smp. */
 #ifndef HAVE_OSV
-thread_pool::thread_pool() : _worker_thread([this] { work(); }), _notify(pthread_self()) {
-    engine()._signals.handle_signal(SIGUSR1, [this] { inter_thread_wq.complete(); });
+thread_pool::thread_pool() : _notify(pthread_self()) {
+    set_thread_count(1);
+    engine()._signals.handle_signal(SIGUSR1, [this] { complete(); });
 }
 
-void thread_pool::work() {
+void thread_pool::set_thread_count(unsigned nr) {
+    while (_workers.size() < nr) {
+        _workers.push_back(std::make_unique<worker>(*this));
+        apply_numa_policy(*_workers.back());
+    }
+}
+
+void thread_pool::set_numa_policy(memory::numa_policy policy, unsigned node) {
+    _numa_policy = policy;
+    _numa_node = node;
+    for (auto& w : _workers) {
+        apply_numa_policy(*w);
+    }
+}
+
+// The policy has to be set by the thread itself, so it is sent as work.
+void thread_pool::apply_numa_policy(worker& w) {
+    if (_numa_policy == memory::numa_policy::none) {
+        return;
+    }
+    w.wq.submit<int>([policy = _numa_policy, node = _numa_node] {
+        return int(memory::set_thread_numa_policy(policy, node));
+    }).discard_result();
+}
+
+syscall_work_queue& thread_pool::pick_queue() {
+    auto best = &_workers.front()->wq;
+    for (auto& w : _workers) {
+        if (w->wq.room() > best->room()) {
+            best = &w->wq;
+        }
+    }
+    return *best;
+}
+
+unsigned thread_pool::complete() {
+    unsigned nr = 0;
+    for (auto& w : _workers) {
+        nr += w->wq.complete();
+    }
+    return nr;
+}
+
+bool thread_pool::flush() {
+    bool flushed = false;
+    for (auto& w : _workers) {
+        flushed |= w->wq.flush();
+    }
+    return flushed;
+}
+
+void thread_pool::work(syscall_work_queue& wq) {
     sigset_t mask;
     sigfillset(&mask);
     auto r = ::pthread_sigmask(SIG_BLOCK, &mask, NULL);
@@ -2927,19 +5125,19 @@ void thread_pool::work() {
     std::array<syscall_work_queue::work_item*, syscall_work_queue::queue_length> tmp_buf;
     while (true) {
         uint64_t count;
-        auto r = ::read(inter_thread_wq._start_eventfd.get_read_fd(), &count, sizeof(count));
+        auto r = ::read(wq._start_eventfd.get_read_fd(), &count, sizeof(count));
         assert(r == sizeof(count));
         if (_stopped.load(std::memory_order_relaxed)) {
             break;
         }
         auto end = tmp_buf.data();
-        inter_thread_wq._pending.consume_all([&] (syscall_work_queue::work_item* wi) {
+        wq._pending.consume_all([&] (syscall_work_queue::work_item* wi) {
             *end++ = wi;
         });
         for (auto p = tmp_buf.data(); p != end; ++p) {
             auto wi = *p;
             wi->process();
-            inter_thread_wq._completed.push(wi);
+            wq._completed.push(wi);
         }
         if (_main_thread_idle.load(std::memory_order_seq_cst)) {
             pthread_kill(_notify, SIGUSR1);
@@ -2949,8 +5147,12 @@ void thread_pool::work() {
 
 thread_pool::~thread_pool() {
     _stopped.store(true, std::memory_order_relaxed);
-    inter_thread_wq._start_eventfd.signal(1);
-    _worker_thread.join();
+    for (auto& w : _workers) {
+        w->wq._start_eventfd.signal(1);
+    }
+    for (auto& w : _workers) {
+        w->thread.join();
+    }
 }
 #endif
 
@@ -2987,11 +5189,11 @@ future<size_t> readable_eventfd::wait() {
     });
 }
 
-void schedule(std::unique_ptr<task> t) {
+void schedule(task_ptr t) {
     engine().add_task(std::move(t));
 }
 
-void schedule_urgent(std::unique_ptr<task> t) {
+void schedule_urgent(task_ptr t) {
     engine().add_urgent_task(std::move(t));
 }
 
@@ -3052,17 +5254,66 @@ reactor::get_options_description() {
                         format_separated(net_stack_names.begin(), net_stack_names.end(), ", ")).c_str())
         ("no-handle-interrupt", "ignore SIGINT (for gdb)")
         ("poll-mode", "poll continuously (100% cpu use)")
+        ("posix-reuseport", bpo::value<std::string>()->default_value("off"),
+                "how the posix stack spreads connections to shards: \"off\" accepts on shard 0 and hands them out "
+                "round robin, \"hash\" gives each shard a SO_REUSEPORT listener and lets the kernel's hash choose, "
+                "\"cpu\" does too but chooses the shard running on the CPU the connection's packets arrive on")
+        ("simulated-time", "drive lowres_clock and the I/O fair queues from manual_clock, for deterministic tests")
         ("idle-poll-time-us", bpo::value<unsigned>()->default_value(calculate_poll_time() / 1us),
                 "idle polling time in microseconds (reduce for overprovisioned environments or laptops)")
+        ("idle-poll-mode", bpo::value<std::string>()->default_value("fixed"),
+                "how long to poll before sleeping when idle: fixed (--idle-poll-time-us), or adaptive (learned from "
+                "recent idle periods, at most --idle-poll-time-us)")
         ("poll-aio", bpo::value<bool>()->default_value(true),
                 "busy-poll for disk I/O (reduces latency and increases throughput)")
+        ("aio-merge", bpo::value<bool>()->default_value(true),
+                "merge reads of adjacent file extents queued in the same poll cycle into a single request")
+        ("epoll-edge-triggered", bpo::value<bool>()->default_value(true),
+                "register posix stack sockets with epoll once, edge-triggered, instead of re-arming them as waits come and go")
+        ("reactor-backend", bpo::value<std::string>()->default_value("epoll"),
+#ifdef HAVE_IO_URING
+                "internal reactor implementation (epoll, io_uring)")
+#else
+                "internal reactor implementation (epoll)")
+#endif
         ("task-quota-ms", bpo::value<double>()->default_value(2.0), "Max time (ms) between polls")
+        ("preempt-source", bpo::value<std::string>()->default_value("signal"),
+                "what tells tasks their quota is up: signal (a timer signal per quota), or thread (a shared timer "
+                "thread sets a flag, and only signals to report stalls)")
+        ("blocked-reactor-notify-ms", bpo::value<unsigned>()->default_value(200),
+                "log a backtrace when the reactor does not reach its poll loop for this long (ms); 0 disables")
+        ("async-log", "hand log records to a writer thread, so that blocking writes to stdout or syslog do not stall the reactor")
+        ("async-log-file", bpo::value<std::string>(), "with --async-log, also append log records to this file")
+        ("async-log-ring-size", bpo::value<size_t>()->default_value(1 << 20),
+                "with --async-log, bytes of log records each shard may have pending before records are dropped")
+        ("binary-log", "record debug and trace messages unformatted, in a ring per shard that is dumped to "
+                "--binary-log-dump-file when the process crashes; read it with scripts/binlog_decode.py")
+        ("binary-log-dump-file", bpo::value<std::string>()->default_value("seastar.binlog"),
+                "with --binary-log, where the records are dumped")
+        ("binary-log-ring-size", bpo::value<size_t>()->default_value(1 << 20),
+                "with --binary-log, bytes of the latest records each shard keeps")
         ("max-task-backlog", bpo::value<unsigned>()->default_value(1000), "Maximum number of task backlog to allow; above this we ignore I/O")
+        ("work-stealing", bpo::value<bool>()->default_value(false),
+                "when idle, run work submitted with smp::submit_stealable() by other shards")
+        ("syscall-threads", bpo::value<unsigned>()->default_value(1),
+                "number of threads per shard running blocking syscalls (open, fsync, stat, ...) on its behalf")
+        ("discard-rate", bpo::value<std::string>(),
+                "bytes per second file::discard() may trim on each I/O device (ex: 200M), shared evenly by the shards; "
+                "discards are queued in the background and unlimited by default")
         ("relaxed-dma", "allow using buffered I/O if DMA is not available (reduces performance)")
         ("overprovisioned", "run in an overprovisioned environment (such as docker or a laptop); equivalent to --idle-poll-time-us 0 --thread-affinity 0 --poll-aio 0")
         ("abort-on-seastar-bad-alloc", "abort when seastar allocator cannot allocate memory")
+        ("numa-shard-memory", bpo::value<std::string>()->default_value("preferred"),
+                "NUMA policy for each shard's memory, relative to its node: none, preferred, bind or interleave")
+        ("numa-smp-queues", bpo::value<std::string>()->default_value("none"),
+                "NUMA policy for the cross-shard message queues, relative to the receiving shard's node; "
+                "none allocates them from the receiving shard's memory")
+        ("numa-syscall-threads", bpo::value<std::string>()->default_value("none"),
+                "NUMA policy for memory faulted in by each shard's syscall threads, such as their stacks")
 #ifdef SEASTAR_HEAPPROF
         ("heapprof", "enable seastar heap profiling")
+        ("heapprof-sample-interval", bpo::value<size_t>(),
+                "with --heapprof, record the backtrace of one allocation per this many bytes allocated on average, instead of every allocation")
 #endif
         ;
     opts.add(network_stack_registry::options_description());
@@ -3077,17 +5328,52 @@ smp::get_options_description()
     opts.add_options()
         ("smp,c", bpo::value<unsigned>(), "number of threads (default: one per CPU)")
         ("cpuset", bpo::value<cpuset_bpo_wrapper>(), "CPUs to use (in cpuset(7) format; default: all))")
+        ("shard-placement", bpo::value<std::string>()->default_value("spread"),
+                "how shards are placed on the CPUs: \"spread\" across the topology, or \"cores\", one per physical core "
+                "before any SMT sibling is used")
+        ("irq-cpus", bpo::value<std::string>(),
+                "CPUs left to the kernel for interrupt handling (in cpuset(7) format), or \"auto\" for those the network "
+                "interface interrupts are pinned to; kept only if enough CPUs remain for the shards")
+        ("numa-device", bpo::value<std::string>(),
+                "network interface or block device whose NUMA node the shards are placed on, if they fit in it")
         ("memory,m", bpo::value<std::string>(), "memory to use, in bytes (ex: 4G) (default: all)")
         ("reserve-memory", bpo::value<std::string>(), "memory reserved to OS (if --memory not specified)")
         ("hugepages", bpo::value<std::string>(), "path to accessible hugetlbfs mount (typically /dev/hugepages/something)")
         ("lock-memory", bpo::value<bool>(), "lock all memory (prevents swapping)")
+        ("elastic-memory", bpo::value<std::string>(), "memory (ex: 4G) each shard may borrow beyond its share from shards "
+                "that have more free memory than they need, as they donate it; costs about 1% of it in page "
+                "structures up front. Not available with --hugepages or --lock-memory")
+        ("memory-borrow-watermark", bpo::value<double>()->default_value(0.05), "with --elastic-memory, fraction of a "
+                "shard's memory below which its free memory makes it borrow")
+        ("memory-donate-watermark", bpo::value<double>()->default_value(0.25), "with --elastic-memory, fraction of a "
+                "shard's memory above which its free memory is donated to shards that asked for it")
         ("thread-affinity", bpo::value<bool>()->default_value(true), "pin threads to their cpus (disable for overprovisioning)")
+        ("smp-queue-length", bpo::value<unsigned>()->default_value(128),
+                "maximum number of cross-cpu requests in flight between each pair of cpus (at most 128)")
+        ("smp-batch-size", bpo::value<unsigned>()->default_value(16),
+                "number of cross-cpu requests or responses accumulated before they are sent without waiting for a poll")
 #ifdef HAVE_HWLOC
         ("num-io-queues", bpo::value<unsigned>(), "Number of IO queues. Each IO unit will be responsible for a fraction of the IO requests. Defaults to the number of threads")
         ("max-io-requests", bpo::value<unsigned>(), "Maximum amount of concurrent requests to be sent to the disk. Defaults to 128 times the number of IO queues")
 #else
         ("max-io-requests", bpo::value<unsigned>(), "Maximum amount of concurrent requests to be sent to the disk. Defaults to 128 times the number of processors")
 #endif
+        ("io-dispatch", bpo::value<std::string>()->default_value("coordinator"),
+                "how shards without an I/O queue of their own send requests: \"coordinator\" forwards them to the shard "
+                "owning the queue; \"local\" gives every shard a queue, sharing the disk's --max-io-requests between them "
+                "through an atomic budget instead of cross-core messages")
+        ("io-read-bandwidth", bpo::value<std::string>(), "sequential read bandwidth of the disk, in bytes/s (ex: 2G), as measured by iotune")
+        ("io-read-iops", bpo::value<double>(), "random 4k read operations per second the disk sustains")
+        ("io-write-bandwidth", bpo::value<std::string>(), "sequential write bandwidth of the disk, in bytes/s")
+        ("io-write-iops", bpo::value<double>(), "random 4k write operations per second the disk sustains")
+        ("io-device", bpo::value<std::vector<sstring>>()->composing(),
+                "PATH:MAX-IO-REQUESTS[:READ-BW:READ-IOPS:WRITE-BW:WRITE-IOPS]; queue files on the device holding PATH "
+                "separately, allowing MAX-IO-REQUESTS concurrent requests to it and weighing requests by the given "
+                "throughput (as measured by iotune on PATH). May be repeated")
+        ("fs-properties", bpo::value<std::vector<sstring>>()->composing(),
+                "PATH:APPEND-CONCURRENCY:PREALLOCATE:DSYNC; how the filesystem holding PATH handles appending writes, "
+                "as qualified by iotune: how many may be in flight at once, whether preallocating space for them pays "
+                "off (0/1) and whether O_DSYNC writes are cheap (0/1). May be repeated")
         ;
     return opts;
 }
@@ -3113,8 +5399,37 @@ std::experimental::optional<boost::barrier> smp::_all_event_loops_done;
 std::vector<reactor*> smp::_reactors;
 smp_message_queue** smp::_qs;
 std::thread::id smp::_tmain;
+std::vector<unsigned> smp::_shard_node = {0};
+std::vector<std::vector<unsigned>> smp::_node_shards = {{0}};
 unsigned smp::count = 1;
 bool smp::_using_dpdk;
+memory::numa_policy smp::_queue_numa_policy = memory::numa_policy::none;
+
+void smp::record_numa_nodes(const std::vector<resource::cpu>& allocations)
+{
+    // A shard belongs to the node most of its memory was allocated from.
+    _shard_node.clear();
+    std::vector<unsigned> node_ids;
+    for (auto&& a : allocations) {
+        unsigned node = 0;
+        size_t most = 0;
+        for (auto&& m : a.mem) {
+            if (m.bytes > most) {
+                most = m.bytes;
+                node = m.nodeid;
+            }
+        }
+        auto it = std::find(node_ids.begin(), node_ids.end(), node);
+        _shard_node.push_back(it - node_ids.begin());
+        if (it == node_ids.end()) {
+            node_ids.push_back(node);
+        }
+    }
+    _node_shards.assign(node_ids.size(), {});
+    for (unsigned c = 0; c < _shard_node.size(); ++c) {
+        _node_shards[_shard_node[c]].push_back(c);
+    }
+}
 
 void smp::start_all_queues()
 {
@@ -3225,14 +5540,46 @@ static void print_with_backtrace(const char* cause) noexcept {
 
 static void sigsegv_action() noexcept {
     print_with_backtrace("Segmentation fault");
+    logger::dump_binary_log();
 }
 
 static void sigabrt_action() noexcept {
     print_with_backtrace("Aborting");
-}
+    logger::dump_binary_log();
+}
+
+// Records how long each phase of a shard's startup takes, so that slow
+// startups can be attributed.  Fixed-size, since some phases run before
+// the shard's memory is configured.
+class startup_phase_timer {
+    using clock = std::chrono::steady_clock;
+    static constexpr unsigned max_phases = 8;
+    clock::time_point _start = clock::now();
+    clock::time_point _last = _start;
+    std::array<std::pair<const char*, clock::duration>, max_phases> _phases;
+    unsigned _nr_phases = 0;
+public:
+    void mark(const char* phase) {
+        auto now = clock::now();
+        assert(_nr_phases < max_phases);
+        _phases[_nr_phases++] = std::make_pair(phase, now - _last);
+        _last = now;
+    }
+    void log(unsigned shard) const {
+        auto ms = [] (clock::duration d) {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+        };
+        sstring phases;
+        for (unsigned i = 0; i < _nr_phases; ++i) {
+            phases += sprint(" %s=%dms", _phases[i].first, ms(_phases[i].second));
+        }
+        seastar_logger.debug("shard {} started in {}ms:{}", shard, ms(_last - _start), phases);
+    }
+};
 
 void smp::configure(boost::program_options::variables_map configuration)
 {
+    startup_phase_timer startup_timer;
     // Mask most, to prevent threads (esp. dpdk helper threads)
     // from servicing a signal.  Individual reactors will unmask signals
     // as they become prepared to handle them.
@@ -3249,6 +5596,21 @@ void smp::configure(boost::program_options::variables_map configuration)
     install_oneshot_signal_handler<SIGSEGV, sigsegv_action>();
     install_oneshot_signal_handler<SIGABRT, sigabrt_action>();
 
+    if (configuration.count("async-log")) {
+        async_log_options opts;
+        opts.ring_size = configuration["async-log-ring-size"].as<size_t>();
+        if (configuration.count("async-log-file")) {
+            opts.file = configuration["async-log-file"].as<std::string>();
+        }
+        logger::set_async_enabled(true, opts);
+    }
+    if (configuration.count("binary-log")) {
+        binary_log_options opts;
+        opts.ring_size = configuration["binary-log-ring-size"].as<size_t>();
+        opts.dump_file = configuration["binary-log-dump-file"].as<std::string>();
+        logger::set_binary_enabled(true, opts);
+    }
+
 #ifdef HAVE_DPDK
     _using_dpdk = configuration.count("dpdk-pmd");
 #endif
@@ -3270,6 +5632,36 @@ void smp::configure(boost::program_options::variables_map configuration)
     if (configuration.count("cpuset")) {
         cpu_set = configuration["cpuset"].as<cpuset_bpo_wrapper>().value;
     }
+    // Narrows cpu_set to the CPUs also in (or, with exclude, not in) cpus,
+    // unless that leaves too few for the shards asked for
+    auto narrow_cpu_set = [&] (const resource::cpuset& cpus, bool exclude, const char* what) {
+        resource::cpuset narrowed;
+        for (auto c : cpu_set) {
+            if (bool(cpus.count(c)) != exclude) {
+                narrowed.insert(c);
+            }
+        }
+        auto needed = configuration.count("smp") ? configuration["smp"].as<unsigned>() : 1u;
+        if (narrowed.size() < needed) {
+            seastar_logger.warn("not enough CPUs left after {}, ignoring it", what);
+            return;
+        }
+        cpu_set = std::move(narrowed);
+    };
+    if (configuration.count("irq-cpus")) {
+        auto spec = configuration["irq-cpus"].as<std::string>();
+        auto irq_cpus = spec == "auto" ? resource::nic_irq_cpus() : resource::parse_cpuset(spec).value_or(resource::cpuset());
+        if (spec != "auto" && irq_cpus.empty()) {
+            throw std::runtime_error(sprint("bad --irq-cpus: %s", spec));
+        }
+        narrow_cpu_set(irq_cpus, true, "reserving the interrupt CPUs");
+    }
+    if (configuration.count("numa-device")) {
+        auto device_cpus = resource::device_cpus(configuration["numa-device"].as<std::string>());
+        if (!device_cpus.empty()) {
+            narrow_cpu_set(device_cpus, false, "restricting to the device's NUMA node");
+        }
+    }
     if (configuration.count("smp")) {
         nr_cpus = configuration["smp"].as<unsigned>();
     } else {
@@ -3304,6 +5696,8 @@ void smp::configure(boost::program_options::variables_map configuration)
     if (configuration.count("reserve-memory")) {
         rc.reserve_memory = parse_memory_size(configuration["reserve-memory"].as<std::string>());
     }
+    auto shard_numa_policy = parse_numa_policy(configuration["numa-shard-memory"].as<std::string>());
+    _queue_numa_policy = parse_numa_policy(configuration["numa-smp-queues"].as<std::string>());
     std::experimental::optional<std::string> hugepages_path;
     if (configuration.count("hugepages")) {
         hugepages_path = configuration["hugepages"].as<std::string>();
@@ -3319,9 +5713,23 @@ void smp::configure(boost::program_options::variables_map configuration)
             print("warning: failed to mlockall: %s\n", strerror(errno));
         }
     }
+    size_t rebalance_headroom = 0;
+    if (configuration.count("elastic-memory")) {
+        if (hugepages_path || mlock) {
+            // Donated memory must go back to the system page by page
+            throw std::runtime_error("--elastic-memory cannot be used with --hugepages or --lock-memory");
+        }
+        rebalance_headroom = parse_memory_size(configuration["elastic-memory"].as<std::string>());
+    }
 
     rc.cpus = smp::count;
     rc.cpu_set = std::move(cpu_set);
+    auto placement = configuration["shard-placement"].as<std::string>();
+    if (placement == "cores") {
+        rc.cpu_placement = resource::placement::cores;
+    } else if (placement != "spread") {
+        throw std::runtime_error(sprint("unknown --shard-placement: %s", placement));
+    }
     if (configuration.count("max-io-requests")) {
         rc.max_io_requests = configuration["max-io-requests"].as<unsigned>();
     }
@@ -3335,24 +5743,18 @@ void smp::configure(boost::program_options::variables_map configuration)
     if (thread_affinity) {
         smp::pin(allocations[0].cpu_id);
     }
-    memory::configure(allocations[0].mem, hugepages_path);
-
-    if (configuration.count("abort-on-seastar-bad-alloc")) {
-        memory::enable_abort_on_allocation_failure();
+    startup_timer.mark("resources");
+    record_numa_nodes(allocations);
+    for (unsigned i = 0; i < allocations.size(); ++i) {
+        seastar_logger.info("shard {}: cpu {}, core {}, node {}", i, allocations[i].cpu_id, allocations[i].core_id, _shard_node[i]);
     }
 
+    auto smp_queue_length = configuration["smp-queue-length"].as<unsigned>();
+    auto smp_batch_size = configuration["smp-batch-size"].as<unsigned>();
+    bool abort_on_bad_alloc = configuration.count("abort-on-seastar-bad-alloc");
     bool heapprof_enabled = configuration.count("heapprof");
-    memory::set_heap_profiling_enabled(heapprof_enabled);
-
-#ifdef HAVE_DPDK
-    if (smp::_using_dpdk) {
-        dpdk::eal::cpuset cpus;
-        for (auto&& a : allocations) {
-            cpus[a.cpu_id] = true;
-        }
-        dpdk::eal::init(cpus, configuration);
-    }
-#endif
+    size_t heapprof_sample_interval = configuration.count("heapprof-sample-interval")
+            ? configuration["heapprof-sample-interval"].as<size_t>() : 0;
 
     // Better to put it into the smp class, but at smp construction time
     // correct smp::count is not known.
@@ -3361,12 +5763,95 @@ void smp::configure(boost::program_options::variables_map configuration)
     static boost::barrier inited(smp::count);
 
     auto io_info = std::move(resources.io_queues);
+    // With --io-dispatch=local every shard coordinates its own requests;
+    // the queues of a device share the device's whole capacity.
+    bool local_io_dispatch = configuration["io-dispatch"].as<std::string>() == "local";
+    if (local_io_dispatch) {
+        unsigned total_capacity = 0;
+        for (auto&& c : io_info.coordinators) {
+            total_capacity += c.capacity;
+        }
+        io_info.coordinators.clear();
+        for (unsigned c = 0; c < smp::count; ++c) {
+            io_info.shard_to_coordinator[c] = c;
+            io_info.coordinators.push_back(resource::io_queue{c, total_capacity});
+        }
+    } else if (configuration["io-dispatch"].as<std::string>() != "coordinator") {
+        throw std::runtime_error("--io-dispatch must be \"coordinator\" or \"local\"");
+    }
+
+    // Each device given with --io-device gets its own set of queues, with
+    // the same coordinators as the default one.
+    std::vector<unsigned> device_capacity = { 0 };
+    io_queue::cost_model default_costs;
+    auto bandwidth_option = [&configuration] (const char* name) {
+        return configuration.count(name) ? double(parse_memory_size(configuration[name].as<std::string>())) : 0.0;
+    };
+    auto iops_option = [&configuration] (const char* name) {
+        return configuration.count(name) ? configuration[name].as<double>() : 0.0;
+    };
+    default_costs.read_bytes_rate = bandwidth_option("io-read-bandwidth");
+    default_costs.read_ops_rate = iops_option("io-read-iops");
+    default_costs.write_bytes_rate = bandwidth_option("io-write-bandwidth");
+    default_costs.write_ops_rate = iops_option("io-write-iops");
+    std::vector<io_queue::cost_model> device_costs = { default_costs };
+    if (configuration.count("io-device")) {
+        for (auto&& spec : configuration["io-device"].as<std::vector<sstring>>()) {
+            std::vector<std::string> fields;
+            boost::split(fields, spec, boost::is_any_of(":"));
+            if (fields.size() != 2 && fields.size() != 6) {
+                throw std::runtime_error(sprint("bad --io-device \"%s\", expected PATH:MAX-IO-REQUESTS[:READ-BW:READ-IOPS:WRITE-BW:WRITE-IOPS]", spec));
+            }
+            auto& path = fields[0];
+            auto max_io_requests = boost::lexical_cast<unsigned>(fields[1]);
+            io_queue::cost_model costs;
+            if (fields.size() == 6) {
+                costs.read_bytes_rate = parse_memory_size(fields[2]);
+                costs.read_ops_rate = boost::lexical_cast<double>(fields[3]);
+                costs.write_bytes_rate = parse_memory_size(fields[4]);
+                costs.write_ops_rate = boost::lexical_cast<double>(fields[5]);
+            }
+            struct stat st;
+            throw_system_error_on(::stat(path.c_str(), &st) == -1, "stat");
+            auto ins = io_queue::_devices.emplace(st.st_dev, device_capacity.size());
+            if (!ins.second) {
+                throw std::runtime_error(sprint("--io-device \"%s\": device already configured", spec));
+            }
+            device_capacity.push_back(local_io_dispatch ? max_io_requests : std::max<unsigned>(max_io_requests / io_info.coordinators.size(), 1));
+            device_costs.push_back(costs);
+        }
+    }
+    if (configuration.count("fs-properties")) {
+        for (auto&& spec : configuration["fs-properties"].as<std::vector<sstring>>()) {
+            std::vector<std::string> fields;
+            boost::split(fields, spec, boost::is_any_of(":"));
+            if (fields.size() != 4) {
+                throw std::runtime_error(sprint("bad --fs-properties \"%s\", expected PATH:APPEND-CONCURRENCY:PREALLOCATE:DSYNC", spec));
+            }
+            filesystem_properties props;
+            props.append_concurrency = boost::lexical_cast<unsigned>(fields[1]);
+            props.preallocation_helps = boost::lexical_cast<unsigned>(fields[2]);
+            props.dsync_writes = boost::lexical_cast<unsigned>(fields[3]);
+            props.qualified = true;
+            struct stat st;
+            throw_system_error_on(::stat(fields[0].c_str(), &st) == -1, "stat");
+            s_qualified_filesystems[st.st_dev] = props;
+        }
+    }
+    if (local_io_dispatch) {
+        io_queue::_shared_budgets.push_back(std::make_unique<io_queue::shared_budget>(io_info.coordinators[0].capacity));
+        for (unsigned dev = 1; dev < device_capacity.size(); ++dev) {
+            io_queue::_shared_budgets.push_back(std::make_unique<io_queue::shared_budget>(device_capacity[dev]));
+        }
+    }
 
-    std::vector<io_queue*> all_io_queues;
-    all_io_queues.resize(io_info.coordinators.size());
+    std::vector<std::vector<io_queue*>> all_io_queues(device_capacity.size());
+    for (auto&& queues : all_io_queues) {
+        queues.resize(io_info.coordinators.size());
+    }
     io_queue::fill_shares_array();
 
-    auto alloc_io_queue = [io_info, &all_io_queues] (unsigned shard) {
+    auto alloc_io_queue = [io_info, device_capacity, device_costs, &all_io_queues] (unsigned shard) {
         auto cid = io_info.shard_to_coordinator[shard];
         int vec_idx = 0;
         for (auto& coordinator: io_info.coordinators) {
@@ -3375,7 +5860,13 @@ void smp::configure(boost::program_options::variables_map configuration)
                 continue;
             }
             if (shard == cid) {
-                all_io_queues[vec_idx] = new io_queue(coordinator.id, coordinator.capacity, io_info.shard_to_coordinator);
+                for (unsigned dev = 0; dev < device_capacity.size(); ++dev) {
+                    auto capacity = dev ? device_capacity[dev] : coordinator.capacity;
+                    all_io_queues[dev][vec_idx] = new io_queue(coordinator.id, capacity, io_info.shard_to_coordinator, device_costs[dev]);
+                    if (!io_queue::_shared_budgets.empty()) {
+                        all_io_queues[dev][vec_idx]->_budget = io_queue::_shared_budgets[dev].get();
+                    }
+                }
             }
             return vec_idx;
         }
@@ -3383,24 +5874,39 @@ void smp::configure(boost::program_options::variables_map configuration)
     };
 
     auto assign_io_queue = [&all_io_queues] (shard_id id, int queue_idx) {
-        if (all_io_queues[queue_idx]->coordinator() == id) {
-            engine().my_io_queue.reset(all_io_queues[queue_idx]);
+        for (auto&& queues : all_io_queues) {
+            auto queue = queues[queue_idx];
+            if (queue->coordinator() == id) {
+                engine().my_io_queues.emplace_back(queue);
+            }
+            engine()._io_queues.push_back(queue);
         }
-        engine()._io_queue = all_io_queues[queue_idx];
-        engine()._io_coordinator = all_io_queues[queue_idx]->coordinator();
+        engine()._io_queue = engine()._io_queues[0];
+        engine()._io_coordinator = engine()._io_queue->coordinator();
     };
 
     _all_event_loops_done.emplace(smp::count);
+    smp::_qs = new smp_message_queue* [smp::count];
 
     unsigned i;
     for (i = 1; i < smp::count; i++) {
         auto allocation = allocations[i];
-        create_thread([configuration, hugepages_path, i, allocation, assign_io_queue, alloc_io_queue, thread_affinity, heapprof_enabled] {
+        create_thread([configuration, hugepages_path, shard_numa_policy, rebalance_headroom, i, allocation, assign_io_queue, alloc_io_queue, thread_affinity,
+                       abort_on_bad_alloc, heapprof_enabled, heapprof_sample_interval, smp_queue_length, smp_batch_size] {
+            startup_phase_timer startup_timer;
             if (thread_affinity) {
                 smp::pin(allocation.cpu_id);
             }
-            memory::configure(allocation.mem, hugepages_path);
+            // Runs on the shard's own (pinned) thread, so with --lock-memory
+            // or hugepages its memory is faulted in NUMA-locally and in
+            // parallel with the other shards.
+            memory::configure(allocation.mem, hugepages_path, shard_numa_policy, rebalance_headroom);
+            if (abort_on_bad_alloc) {
+                memory::enable_abort_on_allocation_failure();
+            }
+            memory::set_heap_profiling_sample_interval(heapprof_sample_interval);
             memory::set_heap_profiling_enabled(heapprof_enabled);
+            startup_timer.mark("memory");
             sigset_t mask;
             sigfillset(&mask);
             for (auto sig : { SIGSEGV }) {
@@ -3412,16 +5918,41 @@ void smp::configure(boost::program_options::variables_map configuration)
             engine()._id = i;
             _reactors[i] = &engine();
             auto queue_idx = alloc_io_queue(i);
+            startup_timer.mark("reactor");
             reactors_registered.wait();
+            construct_queues(i, smp_queue_length, smp_batch_size);
             smp_queues_constructed.wait();
             start_all_queues();
             assign_io_queue(i, queue_idx);
+            startup_timer.mark("queues");
             inited.wait();
             engine().configure(configuration);
+            startup_timer.mark("configure");
+            startup_timer.log(i);
             engine().run();
         });
     }
 
+    // Only now configure our own memory, so that the other shards fault
+    // theirs in at the same time.
+    memory::configure(allocations[0].mem, hugepages_path, shard_numa_policy, rebalance_headroom);
+    if (abort_on_bad_alloc) {
+        memory::enable_abort_on_allocation_failure();
+    }
+    memory::set_heap_profiling_sample_interval(heapprof_sample_interval);
+    memory::set_heap_profiling_enabled(heapprof_enabled);
+    startup_timer.mark("memory");
+
+#ifdef HAVE_DPDK
+    if (smp::_using_dpdk) {
+        dpdk::eal::cpuset cpus;
+        for (auto&& a : allocations) {
+            cpus[a.cpu_id] = true;
+        }
+        dpdk::eal::init(cpus, configuration);
+    }
+#endif
+
     allocate_reactor();
     _reactors[0] = &engine();
     auto queue_idx = alloc_io_queue(0);
@@ -3435,55 +5966,159 @@ void smp::configure(boost::program_options::variables_map configuration)
     }
 #endif
 
+    startup_timer.mark("reactor");
     reactors_registered.wait();
-    smp::_qs = new smp_message_queue* [smp::count];
-    for(unsigned i = 0; i < smp::count; i++) {
-        smp::_qs[i] = reinterpret_cast<smp_message_queue*>(operator new[] (sizeof(smp_message_queue) * smp::count));
-        for (unsigned j = 0; j < smp::count; ++j) {
-            new (&smp::_qs[i][j]) smp_message_queue(_reactors[j], _reactors[i]);
-        }
-    }
+    construct_queues(0, smp_queue_length, smp_batch_size);
     smp_queues_constructed.wait();
     start_all_queues();
     assign_io_queue(0, queue_idx);
+    startup_timer.mark("queues");
     inited.wait();
 
     engine().configure(configuration);
     engine()._lowres_clock = std::make_unique<lowres_clock>();
+    startup_timer.mark("configure");
+    startup_timer.log(0);
+}
+
+// Each shard constructs the queues that deliver requests to it, in its own
+// memory, instead of shard 0 constructing all smp::count^2 of them.
+void smp::construct_queues(unsigned to, size_t max_in_flight, size_t batch_size) {
+    auto size = sizeof(smp_message_queue) * smp::count;
+    if (_queue_numa_policy == memory::numa_policy::none) {
+        _qs[to] = reinterpret_cast<smp_message_queue*>(operator new[] (size));
+    } else {
+        // Outside the shard allocator, so that it can be placed on its own;
+        // the queues live as long as the process.
+        auto area = mmap_anonymous(nullptr, align_up(size, memory::page_size), PROT_READ | PROT_WRITE, MAP_PRIVATE);
+        memory::set_numa_policy(area.get(), align_up(size, memory::page_size), _queue_numa_policy, memory::home_numa_node());
+        _qs[to] = reinterpret_cast<smp_message_queue*>(area.release());
+    }
+    for (unsigned from = 0; from < smp::count; ++from) {
+        new (&_qs[to][from]) smp_message_queue(_reactors[from], _reactors[to]);
+        _qs[to][from].set_limits(max_in_flight, batch_size);
+    }
 }
 
+void smp::set_queue_limits(unsigned from, unsigned to, size_t max_in_flight, size_t batch_size) {
+    _qs[to][from].set_limits(max_in_flight, batch_size);
+}
+
+void smp::mark_unflushed(unsigned peer) {
+    engine()._smp_unflushed[peer / shard_set::shards_per_word] |= uint64_t(1) << (peer % shard_set::shards_per_word);
+}
+
+// Calls func(peer) for each shard in bits, the shards of word w of a
+// shard_set.
+template <typename Func>
+static inline void for_each_shard(unsigned w, uint64_t bits, Func func) {
+    while (bits) {
+        auto bit = count_trailing_zeros(bits);
+        bits &= bits - 1;
+        func(w * shard_set::shards_per_word + bit);
+    }
+}
+
+// Only the queues of peers that pushed something to this shard (which
+// they flag in _smp_ready) or that this shard has unflushed batches for
+// are visited, rather than all smp::count of them: a shard talking to few
+// peers polls at the same cost however many shards there are.
 bool smp::poll_queues() {
+    auto& r = engine();
+    auto me = r.cpu_id();
     size_t got = 0;
-    for (unsigned i = 0; i < count; i++) {
-        if (engine().cpu_id() != i) {
-            auto& rxq = _qs[engine().cpu_id()][i];
+    for (unsigned w = 0; w < r._smp_ready.nr_words(); ++w) {
+        auto bits = r._smp_ready.take(w) | r._smp_unflushed[w];
+        if (!bits) {
+            continue;
+        }
+        for_each_shard(w, bits, [&] (unsigned i) {
+            auto& rxq = _qs[me][i];
             rxq.flush_response_batch();
             got += rxq.has_unflushed_responses();
             got += rxq.process_incoming();
-            auto& txq = _qs[i][engine()._id];
+            auto& txq = _qs[i][me];
             txq.flush_request_batch();
             got += txq.process_completions();
-        }
+            // Work processed later in the loop may mark it again
+            if (!rxq.has_unflushed_responses() && !txq.has_unflushed_requests()) {
+                r._smp_unflushed[w] &= ~(uint64_t(1) << (i % shard_set::shards_per_word));
+            }
+        });
     }
     return got != 0;
 }
 
 bool smp::pure_poll_queues() {
-    for (unsigned i = 0; i < count; i++) {
-        if (engine().cpu_id() != i) {
-            auto& rxq = _qs[engine().cpu_id()][i];
+    auto& r = engine();
+    auto me = r.cpu_id();
+    for (unsigned w = 0; w < r._smp_ready.nr_words(); ++w) {
+        if (r._smp_ready.peek(w)) {
+            return true;
+        }
+        bool pending = false;
+        for_each_shard(w, r._smp_unflushed[w], [&] (unsigned i) {
+            auto& rxq = _qs[me][i];
             rxq.flush_response_batch();
-            auto& txq = _qs[i][engine()._id];
+            auto& txq = _qs[i][me];
             txq.flush_request_batch();
-            if (rxq.pure_poll_rx() || txq.pure_poll_tx() || rxq.has_unflushed_responses()) {
-                return true;
-            }
+            pending |= rxq.has_unflushed_responses();
+        });
+        if (pending || r._smp_ready.peek(w)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool smp::poll_steal_queues() {
+    auto& r = engine();
+    static constexpr unsigned batch = 4;
+    // Keep our own backlog moving even when busy, but only a little at a
+    // time so that it does not displace normal tasks.
+    unsigned budget = r.have_more_tasks() ? 1 : batch;
+    unsigned got = 0;
+    while (got < budget) {
+        auto wi = r._steal_queue.pop();
+        if (!wi) {
+            break;
+        }
+        schedule(make_task([wi] { wi->process(); }));
+        ++got;
+    }
+    if (got || !r._work_stealing || r.have_more_tasks()) {
+        return got;
+    }
+    for (unsigned i = 1; i < count; ++i) {
+        auto cpu = (r._id + i) % count;
+        if (auto wi = _reactors[cpu]->_steal_queue.pop()) {
+            schedule(make_task([wi] { wi->process(); }));
+            return true;
+        }
+    }
+    return false;
+}
+
+bool smp::pure_poll_steal_queues() {
+    auto& r = engine();
+    if (!r._steal_queue.empty()) {
+        return true;
+    }
+    if (!r._work_stealing) {
+        return false;
+    }
+    for (unsigned i = 1; i < count; ++i) {
+        if (!_reactors[(r._id + i) % count]->_steal_queue.empty()) {
+            return true;
         }
     }
     return false;
 }
 
-__thread bool g_need_preempt;
+alignas(64) __thread std::atomic<bool> g_need_preempt;
+
+__thread unsigned g_current_scheduling_group;
+__thread task_arena g_task_arena;
 
 __thread reactor* local_engine;
 
@@ -3511,6 +6146,15 @@ reactor_backend_epoll::make_reactor_notifier() {
     return std::make_unique<reactor_notifier_epoll>();
 }
 
+#ifdef HAVE_IO_URING
+// reactor_notifier_epoll only relies on the eventfd being pollable, which
+// works equally well through IORING_OP_POLL_ADD.
+std::unique_ptr<reactor_notifier>
+reactor_backend_uring::make_reactor_notifier() {
+    return std::make_unique<reactor_notifier_epoll>();
+}
+#endif
+
 #ifdef HAVE_OSV
 class reactor_notifier_osv :
         public reactor_notifier, private osv::newpoll::pollable {
@@ -3691,6 +6335,14 @@ future<file> open_file_dma(sstring name, open_flags flags, file_open_options opt
     return engine().open_file_dma(std::move(name), flags, options);
 }
 
+future<std::vector<file>> open_files_dma(std::vector<sstring> names, open_flags flags, file_open_options options) {
+    return engine().open_files_dma(std::move(names), flags, options);
+}
+
+future<std::vector<file>> open_files_dma(std::vector<sstring> names, open_flags flags) {
+    return engine().open_files_dma(std::move(names), flags, file_open_options());
+}
+
 future<file> open_directory(sstring name) {
     return engine().open_directory(std::move(name));
 }
@@ -3789,10 +6441,10 @@ future<connected_socket> connect(socket_address sa, socket_address local, transp
     return engine().connect(sa, local, proto);
 }
 
-void reactor::add_high_priority_task(std::unique_ptr<task>&& t) {
-    _pending_tasks.push_front(std::move(t));
+void reactor::add_high_priority_task(task_ptr&& t) {
+    add_urgent_task(std::move(t));
     // break .then() chains
-    g_need_preempt = true;
+    g_need_preempt.store(true, std::memory_order_relaxed);
 }
 
 static
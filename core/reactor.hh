@@ -30,7 +30,9 @@
 #include <libaio.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
+#include <climits>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <unordered_map>
 #include <netinet/ip.h>
 #include <cstring>
@@ -48,6 +50,7 @@
 #include <atomic>
 #include <experimental/optional>
 #include <boost/lockfree/spsc_queue.hpp>
+#include <boost/lockfree/queue.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
 #include <boost/thread/barrier.hpp>
@@ -73,7 +76,10 @@
 #include "util/log.hh"
 #include "lowres_clock.hh"
 #include "manual_clock.hh"
+#include "tsc_clock.hh"
 #include "metrics.hh"
+#include "log_histogram.hh"
+#include <typeinfo>
 
 #ifdef HAVE_OSV
 #include <osv/sched.hh>
@@ -104,10 +110,17 @@ class pollable_fd_state {
     pollable_fd_state(const pollable_fd_state&) = delete;
     void operator=(const pollable_fd_state&) = delete;
     void speculate_epoll(int events) { events_known |= events; }
+    // An operation hit EAGAIN: whatever we knew about these events is stale
+    void not_ready(int events) { events_known &= ~events; }
     file_desc fd;
     int events_requested = 0; // wanted by pollin/pollout promises
     int events_epoll = 0;     // installed in epoll
     int events_known = 0;     // returned from epoll
+    // Registered once with EPOLLET for both directions; readiness then stays
+    // known until an operation reports EAGAIN, instead of being consumed by
+    // every wait. Only for fds whose every operation calls not_ready() on EAGAIN.
+    bool edge_triggered = false;
+    void* backend_data = nullptr; // private to the reactor_backend in use
     promise<> pollin;
     promise<> pollout;
     friend class reactor;
@@ -135,6 +148,10 @@ class pollable_fd {
     future<size_t> read_some(char* buffer, size_t size);
     future<size_t> read_some(uint8_t* buffer, size_t size);
     future<size_t> read_some(const std::vector<iovec>& iov);
+    // Reads up to max_size bytes into a buffer that is only allocated once
+    // the fd is readable, so that a reader waiting on an idle fd holds no
+    // memory
+    future<temporary_buffer<char>> read_some(size_t max_size);
     future<> write_all(const char* buffer, size_t size);
     future<> write_all(const uint8_t* buffer, size_t size);
     future<size_t> write_some(net::packet& p);
@@ -144,9 +161,19 @@ class pollable_fd {
     void abort_reader(std::exception_ptr ex);
     void abort_writer(std::exception_ptr ex);
     future<pollable_fd, socket_address> accept();
-    future<size_t> sendmsg(struct msghdr *msg);
-    future<size_t> recvmsg(struct msghdr *msg);
+    future<size_t> sendmsg(struct msghdr *msg, int flags = 0);
+    future<size_t> recvmsg(struct msghdr *msg, int flags = 0);
+    // Resolve to the number of messages transferred, at least one
+    future<size_t> sendmmsg(struct mmsghdr *msgs, unsigned vlen);
+    future<size_t> recvmmsg(struct mmsghdr *msgs, unsigned vlen);
     future<size_t> sendto(socket_address addr, const void* buf, size_t len);
+    // Sends up to len bytes at offset of the file open as in_fd with
+    // sendfile(2); resolves to the number sent, which is 0 at end of file
+    future<size_t> sendfile(int in_fd, uint64_t offset, size_t len);
+    // Use a persistent edge-triggered epoll registration (unless disabled with
+    // --epoll-edge-triggered=0). Must be called before the first wait, and only
+    // if the fd is read and written exclusively through the methods above.
+    void enable_edge_triggered();
     file_desc& get_file_desc() const { return _s->fd; }
     void shutdown(int how) { _s->fd.shutdown(how); }
     void close() { _s.reset(); }
@@ -229,6 +256,21 @@ class reactor_notifier {
 class thread_pool;
 class smp;
 
+/// \cond internal
+// An object to be destroyed on the shard that created it; see foreign_ptr
+struct foreign_destructible {
+    virtual ~foreign_destructible() {}
+};
+/// \endcond
+
+namespace seastar { namespace alien { class message_queue; } }
+
+namespace resource {
+
+struct cpu;
+
+}
+
 class syscall_work_queue {
     static constexpr size_t queue_length = 128;
     struct work_item;
@@ -238,10 +280,18 @@ class syscall_work_queue {
     lf_queue _completed;
     writeable_eventfd _start_eventfd;
     semaphore _queue_has_room = { queue_length };
-    struct work_item {
+    // Items pushed to _pending since _start_eventfd was last signalled.
+    unsigned _unsignalled = 0;
+    // Waits for room in the queue as a semaphore_waiter, so that a full
+    // queue does not cost a continuation per item.
+    struct work_item : semaphore_waiter {
+        syscall_work_queue* _queue = nullptr;
         virtual ~work_item() {}
         virtual void process() = 0;
         virtual void complete() = 0;
+        virtual void wake() noexcept override { _queue->enqueue(this); }
+        // _queue_has_room is never broken.
+        virtual void fail(std::exception_ptr) noexcept override { abort(); }
     };
     template <typename T, typename Func>
     struct work_item_returning :  work_item {
@@ -272,23 +322,112 @@ class syscall_work_queue {
     // Returns the number of requests handled.
     unsigned complete();
     void submit_item(work_item* wi);
+    void enqueue(work_item* wi);
+    // Wakes the syscall thread if items were submitted since the last
+    // call.  The reactor calls this once per poll, so all items submitted
+    // while running tasks share a single eventfd write.
+    bool flush();
+    // Number of items that can be submitted before the queue is full.
+    size_t room() const { return _queue_has_room.current(); }
 
     friend class thread_pool;
 };
 
+// Bounded queue of CPU-bound work submitted by one shard, which the owner
+// and (with --work-stealing) idle shards pull from; see
+// smp::submit_stealable().
+class steal_queue {
+public:
+    static constexpr size_t queue_length = 128;
+    struct work_item : semaphore_waiter {
+        steal_queue* _queue = nullptr;
+        virtual ~work_item() {}
+        // Runs the work on the current shard and arranges for the result
+        // to reach the submitting shard.
+        virtual void process() = 0;
+        // Called on the owning shard once the queue has room for the item.
+        virtual void wake() noexcept override { _queue->_q.push(this); }
+        // _queue_has_room is never broken.
+        virtual void fail(std::exception_ptr) noexcept override { abort(); }
+    };
+private:
+    boost::lockfree::queue<work_item*, boost::lockfree::capacity<queue_length>> _q;
+    // Only touched by the owning shard.
+    semaphore _queue_has_room = { queue_length };
+    uint64_t _submitted = 0;
+    // Updated by whichever shard runs an item.
+    std::atomic<uint64_t> _stolen = { 0 };
+public:
+    void submit_item(work_item* wi) {
+        ++_submitted;
+        wi->_queue = this;
+        _queue_has_room.wait(*wi);
+    }
+    // Called on the owning shard when an item has completed, wherever it ran.
+    void release() { _queue_has_room.signal(); }
+    work_item* pop() {
+        work_item* wi;
+        return _q.pop(wi) ? wi : nullptr;
+    }
+    void count_stolen() { _stolen.fetch_add(1, std::memory_order_relaxed); }
+    bool empty() const { return _q.empty(); }
+    uint64_t submitted() const { return _submitted; }
+    uint64_t stolen() const { return _stolen.load(std::memory_order_relaxed); }
+};
+
+// A set of shards, one bit each, that any shard may add to and the owning
+// shard takes out of. Each word of 64 shards sits on its own cache line.
+class shard_set {
+    static constexpr unsigned word_size = 64;
+    std::unique_ptr<char[], free_deleter> _area;
+    unsigned _nr_words = 0;
+    std::atomic<uint64_t>& word(unsigned w) const {
+        return *reinterpret_cast<std::atomic<uint64_t>*>(_area.get() + w * word_size);
+    }
+public:
+    static constexpr unsigned shards_per_word = 64;
+    void resize(unsigned nr_shards) {
+        _nr_words = (nr_shards + shards_per_word - 1) / shards_per_word;
+        _area = allocate_aligned_buffer<char>(_nr_words * word_size, word_size);
+        for (unsigned w = 0; w < _nr_words; ++w) {
+            new (&word(w)) std::atomic<uint64_t>(0);
+        }
+    }
+    unsigned nr_words() const {
+        return _nr_words;
+    }
+    // Whatever the adding shard wrote before is visible to the shard that
+    // takes the bit out.
+    void add(unsigned shard) {
+        word(shard / shards_per_word).fetch_or(uint64_t(1) << (shard % shards_per_word), std::memory_order_release);
+    }
+    // Empties word w, returning the shards that were in it
+    uint64_t take(unsigned w) {
+        auto& bits = word(w);
+        return bits.load(std::memory_order_relaxed) ? bits.exchange(0, std::memory_order_acquire) : 0;
+    }
+    uint64_t peek(unsigned w) const {
+        return word(w).load(std::memory_order_relaxed);
+    }
+};
+
 class smp_message_queue {
+    // Capacity of the underlying ring; set_limits() may lower the
+    // effective queue length below it.
     static constexpr size_t queue_length = 128;
-    static constexpr size_t batch_size = 16;
+    static constexpr size_t default_batch_size = 16;
     static constexpr size_t prefetch_cnt = 2;
     struct work_item;
     struct lf_queue_remote {
         reactor* remote;
+        // The shard that pushes into the queue
+        unsigned pusher;
     };
     using lf_queue_base = boost::lockfree::spsc_queue<work_item*,
                             boost::lockfree::capacity<queue_length>>;
     // use inheritence to control placement order
     struct lf_queue : lf_queue_remote, lf_queue_base {
-        lf_queue(reactor* remote) : lf_queue_remote{remote} {}
+        lf_queue(reactor* remote, unsigned pusher) : lf_queue_remote{remote, pusher} {}
         void maybe_wakeup();
     };
     lf_queue _pending;
@@ -358,6 +497,8 @@ class smp_message_queue {
         } a;
     } _tx;
     std::vector<work_item*> _completed_fifo;
+    size_t _max_in_flight = queue_length;
+    size_t _batch_size = default_batch_size;
 public:
     smp_message_queue(reactor* from, reactor* to);
     template <typename Func>
@@ -367,6 +508,11 @@ class smp_message_queue {
         submit_item(wi);
         return fut;
     }
+    // Limits the number of requests in flight on this queue to
+    // max_in_flight (at most queue_length), and sets how many requests or
+    // responses are accumulated before they are pushed to the other side
+    // without waiting for the next poll.
+    void set_limits(size_t max_in_flight, size_t batch_size);
     void start(unsigned cpuid);
     template<size_t PrefetchCnt, typename Func>
     size_t process_queue(lf_queue& q, Func process);
@@ -380,6 +526,7 @@ class smp_message_queue {
     void flush_request_batch();
     void flush_response_batch();
     bool has_unflushed_responses() const;
+    bool has_unflushed_requests() const;
     bool pure_poll_rx() const;
     bool pure_poll_tx() const;
 
@@ -390,25 +537,43 @@ class thread_pool {
     uint64_t _aio_threaded_fallbacks = 0;
 #ifndef HAVE_OSV
     // FIXME: implement using reactor_notifier abstraction we used for SMP
-    syscall_work_queue inter_thread_wq;
-    posix_thread _worker_thread;
+    struct worker {
+        syscall_work_queue wq;
+        posix_thread thread;
+        explicit worker(thread_pool& pool) : thread([this, &pool] { pool.work(wq); }) {}
+    };
     std::atomic<bool> _stopped = { false };
     std::atomic<bool> _main_thread_idle = { false };
     pthread_t _notify;
+    std::vector<std::unique_ptr<worker>> _workers;
+    memory::numa_policy _numa_policy = memory::numa_policy::none;
+    unsigned _numa_node = 0;
+private:
+    void apply_numa_policy(worker& w);
 public:
     thread_pool();
     ~thread_pool();
+    // Starts syscall threads until there are at least nr, so that blocking
+    // syscalls submitted by this shard can run in parallel.
+    void set_thread_count(unsigned nr);
+    // Places memory the syscall threads fault in (their stacks, buffers
+    // they allocate outside the shard allocator) according to policy,
+    // relative to the shard's home node.
+    void set_numa_policy(memory::numa_policy policy, unsigned node);
+    unsigned thread_count() const { return _workers.size(); }
     template <typename T, typename Func>
     future<T> submit(Func func) {
         ++_aio_threaded_fallbacks;
-        return inter_thread_wq.submit<T>(std::move(func));
+        return pick_queue().submit<T>(std::move(func));
     }
     uint64_t operation_count() const { return _aio_threaded_fallbacks; }
 
-    unsigned complete() { return inter_thread_wq.complete(); }
+    unsigned complete();
+    // See syscall_work_queue::flush().
+    bool flush();
     // Before we enter interrupt mode, we must make sure that the syscall thread will properly
     // generate signals to wake us up. This means we need to make sure that all modifications to
-    // the pending and completed fields in the inter_thread_wq are visible to all threads.
+    // the pending and completed fields in the work queues are visible to all threads.
     //
     // Simple release-acquire won't do because we also need to serialize all writes that happens
     // before the syscall thread loads this value, so we'll need full seq_cst.
@@ -417,19 +582,21 @@ class thread_pool {
     // takes place, we'll get an extra signal and complete will be called one extra time, which is
     // harmless.
     void exit_interrupt_mode() { _main_thread_idle.store(false, std::memory_order_relaxed); }
-
+private:
+    // The queue with the most room, so that work spreads over all threads.
+    syscall_work_queue& pick_queue();
+    void work(syscall_work_queue& wq);
 #else
 public:
     template <typename T, typename Func>
     future<T> submit(Func func) { std::cout << "thread_pool not yet implemented on osv\n"; abort(); }
 #endif
-private:
-    void work();
 };
 
 // The "reactor_backend" interface provides a method of waiting for various
 // basic events on one thread. We have one implementation based on epoll and
-// file-descriptors (reactor_backend_epoll) and one implementation based on
+// file-descriptors (reactor_backend_epoll), one based on io_uring
+// (reactor_backend_uring), and one implementation based on
 // OSv-specific file-descriptor-less mechanisms (reactor_backend_osv).
 class reactor_backend {
 public:
@@ -446,6 +613,16 @@ class reactor_backend {
     virtual future<> readable(pollable_fd_state& fd) = 0;
     virtual future<> writeable(pollable_fd_state& fd) = 0;
     virtual void forget(pollable_fd_state& fd) = 0;
+    virtual void abort_reader(pollable_fd_state& fd, std::exception_ptr ex) { abort(); }
+    virtual void abort_writer(pollable_fd_state& fd, std::exception_ptr ex) { abort(); }
+    // Disk I/O. By default the reactor submits linux-aio requests itself;
+    // a backend that returns true from handles_disk_io() takes over both
+    // submission (submit_disk_io() returns the number of iocbs consumed) and
+    // completion (reap_disk_io()), so that the reactor waits on a single
+    // kernel interface.
+    virtual bool handles_disk_io() const { return false; }
+    virtual size_t submit_disk_io(::iocb** iocbs, size_t nr) { abort(); }
+    virtual bool reap_disk_io() { abort(); }
     // Methods that allow polling on a reactor_notifier. This is currently
     // used only for reactor_backend_osv, but in the future it should really
     // replace the above functions.
@@ -467,6 +644,8 @@ class reactor_backend_epoll : public reactor_backend {
             promise<> pollable_fd_state::* pr, int events, int event);
     void abort_fd(pollable_fd_state& fd, std::exception_ptr ex,
             promise<> pollable_fd_state::* pr, int event);
+    // Installs fd.events_epoll, counting the call
+    int epoll_ctl(int op, pollable_fd_state& fd);
 public:
     reactor_backend_epoll();
     virtual ~reactor_backend_epoll() override { }
@@ -476,9 +655,71 @@ class reactor_backend_epoll : public reactor_backend {
     virtual void forget(pollable_fd_state& fd) override;
     virtual future<> notified(reactor_notifier *n) override;
     virtual std::unique_ptr<reactor_notifier> make_reactor_notifier() override;
-    void abort_reader(pollable_fd_state& fd, std::exception_ptr ex);
-    void abort_writer(pollable_fd_state& fd, std::exception_ptr ex);
+    virtual void abort_reader(pollable_fd_state& fd, std::exception_ptr ex) override;
+    virtual void abort_writer(pollable_fd_state& fd, std::exception_ptr ex) override;
+};
+
+#ifdef HAVE_IO_URING
+struct io_uring_params;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// reactor backend using io_uring (Linux 5.1 and later). File descriptor
+// readiness is waited for with one-shot IORING_OP_POLL_ADD requests, and disk
+// I/O is submitted to the same ring instead of to a linux-aio context, so one
+// io_uring_enter() call submits, reaps and sleeps for all event sources.
+class reactor_backend_uring : public reactor_backend {
+    struct fd_state;
+    static constexpr unsigned ring_entries = 256;
+    file_desc _ring_fd;
+    mmap_area _sq_ring;
+    mmap_area _cq_ring;   // empty if the kernel maps both rings together
+    mmap_area _sqe_area;
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_array;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned _cq_mask;
+    ::io_uring_sqe* _sqes;
+    ::io_uring_cqe* _cqes;
+    unsigned _sq_local_tail = 0; // sqes filled in but not yet published
+    unsigned _unsubmitted = 0;   // published but not yet passed to io_uring_enter()
+private:
+    explicit reactor_backend_uring(::io_uring_params p);
+    ::io_uring_sqe* get_sqe();
+    void publish_sqes();
+    int enter(unsigned min_complete, const sigset_t* active_sigmask);
+    unsigned reap_completions();
+    fd_state& state_of(pollable_fd_state& fd);
+    void put_state(fd_state* st);
+    void poll_add(pollable_fd_state& fd, int event);
+    void poll_remove(pollable_fd_state& fd, int event);
+    void complete_poll(fd_state* st, int event, int res);
+    future<> get_poll_future(pollable_fd_state& fd,
+            promise<> pollable_fd_state::* pr, int event);
+    void abort_fd(pollable_fd_state& fd, std::exception_ptr ex,
+            promise<> pollable_fd_state::* pr, int event);
+public:
+    reactor_backend_uring();
+    virtual ~reactor_backend_uring() override { }
+    // Returns true if the running kernel supports the features we need.
+    static bool available();
+    virtual bool wait_and_process(int timeout, const sigset_t* active_sigmask) override;
+    virtual future<> readable(pollable_fd_state& fd) override;
+    virtual future<> writeable(pollable_fd_state& fd) override;
+    virtual void forget(pollable_fd_state& fd) override;
+    virtual void abort_reader(pollable_fd_state& fd, std::exception_ptr ex) override;
+    virtual void abort_writer(pollable_fd_state& fd, std::exception_ptr ex) override;
+    virtual bool handles_disk_io() const override { return true; }
+    virtual size_t submit_disk_io(::iocb** iocbs, size_t nr) override;
+    virtual bool reap_disk_io() override;
+    virtual future<> notified(reactor_notifier *n) override;
+    virtual std::unique_ptr<reactor_notifier> make_reactor_notifier() override;
 };
+#endif /* HAVE_IO_URING */
 
 #ifdef HAVE_OSV
 // reactor_backend using OSv-specific features, without any file descriptors.
@@ -512,17 +753,68 @@ enum class open_flags {
     create = O_CREAT,
     truncate = O_TRUNC,
     exclusive = O_EXCL,
+    dsync = O_DSYNC,
 };
 
 inline open_flags operator|(open_flags a, open_flags b) {
     return open_flags(static_cast<unsigned int>(a) | static_cast<unsigned int>(b));
 }
 
+/// Optional limits on an I/O priority class, on top of its shares.
+struct io_priority_class_limits {
+    /// Hard cap on the bytes per second the class may read and write on each
+    /// I/O queue, even when no other class is using the disk; 0 means none.
+    double max_bytes_per_second = 0;
+    /// Requests of the class that have been queued for longer than this are
+    /// served before those of other classes, regardless of shares; 0 disables.
+    std::chrono::microseconds latency_goal = std::chrono::microseconds(0);
+};
+
 class io_queue {
+public:
+    enum class request_type { read, write, discard };
+
+    /// Throughput of the device behind a queue, as measured by iotune.  A
+    /// request's weight in the fair queue is the time it is expected to
+    /// keep the device busy, 1/ops_rate + len/bytes_rate, so that a large
+    /// sequential read is not charged the same as a small random one.  A
+    /// rate of 0 means unknown; requests in that direction are then
+    /// weighted by length alone.
+    struct cost_model {
+        double read_bytes_rate = 0;
+        double read_ops_rate = 0;
+        double write_bytes_rate = 0;
+        double write_ops_rate = 0;
+    };
 private:
     shard_id _coordinator;
     size_t _capacity;
     std::vector<shard_id> _io_topology;
+    cost_model _cost_model;
+
+    // With --io-dispatch=local, every shard has its own queues and
+    // dispatches without a coordinator; the shards' queues for a device
+    // share its request budget here.
+    struct shared_budget {
+        alignas(64) std::atomic<int64_t> available;
+        int64_t total;
+        explicit shared_budget(int64_t capacity) : available(capacity), total(capacity) {}
+    };
+    static std::vector<std::unique_ptr<shared_budget>> _shared_budgets;
+    shared_budget* _budget = nullptr;
+    circular_buffer<promise<>> _budget_waiters;
+
+    bool try_take_budget() {
+        if (_budget->available.fetch_sub(1, std::memory_order_acquire) > 0) {
+            return true;
+        }
+        _budget->available.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    future<> take_budget();
+    void return_budget();
+    // Hands budget given back by any shard to local waiters.
+    bool poll_budget();
 
     struct priority_class_data {
         priority_class_ptr ptr;
@@ -541,23 +833,56 @@ class io_queue {
     static std::array<std::atomic<uint32_t>, _max_classes> _registered_shares;
     static std::array<sstring, _max_classes> _registered_names;
 
-    static io_priority_class register_one_priority_class(sstring name, uint32_t shares);
+    // Devices given with --io-device, by st_dev, mapped to their id.  Each
+    // has its own queues; other files use the device 0 queues.
+    static std::unordered_map<dev_t, unsigned> _devices;
+
+    static std::array<io_priority_class_limits, _max_classes> _registered_limits;
+
+    static io_priority_class register_one_priority_class(sstring name, uint32_t shares, io_priority_class_limits limits = {});
 
     priority_class_data& find_or_create_class(const io_priority_class& pc, shard_id owner);
     static void fill_shares_array();
+    // Queues a request on the device's queue at coordinator, and once the
+    // fair queue lets it through, issues it with run(queue)
+    template <typename Run>
+    static futurize_t<std::result_of_t<Run(io_queue&)>>
+    queue_and_run(shard_id coordinator, unsigned device, const io_priority_class& pc, request_type type, size_t len, Run run);
     friend smp;
 public:
 
-    io_queue(shard_id coordinator, size_t capacity, std::vector<shard_id> topology);
+    io_queue(shard_id coordinator, size_t capacity, std::vector<shard_id> topology, cost_model costs);
     ~io_queue();
 
     template <typename Func>
     static future<io_event>
-    queue_request(shard_id coordinator, const io_priority_class& pc, size_t len, Func do_io);
+    queue_request(shard_id coordinator, unsigned device, const io_priority_class& pc, request_type type, size_t len, Func do_io);
+    /// Discards length bytes of the file or block device open at fd,
+    /// through the fair queue like other requests, so that the class' shares
+    /// and bandwidth cap apply to it.
+    static future<>
+    queue_discard(shard_id coordinator, unsigned device, const io_priority_class& pc, int fd, bool blockdev, uint64_t offset, uint64_t length);
+
+    /// The fair queue weight of a request, see cost_model.
+    float request_weight(request_type type, size_t len) const;
+    const cost_model& costs() const {
+        return _cost_model;
+    }
+
+    /// Returns the id of the I/O device backing \c dev, or 0 if it has no
+    /// queues of its own.
+    static unsigned device_of(dev_t dev);
+    /// Like device_of(), for the file open at \c fd.
+    static unsigned device_of_fd(int fd);
 
     size_t capacity() const {
         return _capacity;
     }
+    void set_capacity(size_t capacity);
+    /// Requests waiting for the device's shared request budget.
+    size_t budget_waiters() const {
+        return _budget_waiters.size();
+    }
 
     size_t queued_requests() const {
         return _fq.waiters();
@@ -572,6 +897,17 @@ class io_queue {
     friend class reactor;
 };
 
+/// A sample of the CPU profile of a shard, see reactor::set_cpu_profiling().
+struct cpu_profile_sample {
+    /// The type of the task that was running, or null if the reactor was
+    /// not running a task (polling, running timers, and so on)
+    const std::type_info* task_type;
+    /// Return addresses, innermost first
+    std::vector<uintptr_t> backtrace;
+};
+
+class discard_queue;
+
 class reactor {
 private:
     struct pollfn {
@@ -596,12 +932,17 @@ class reactor {
     class signal_pollfn;
     class aio_batch_submit_pollfn;
     class batch_flush_pollfn;
+    class foreign_destruction_pollfn;
     class smp_pollfn;
     class drain_cross_cpu_freelist_pollfn;
+    class memory_rebalance_pollfn;
     class lowres_timer_pollfn;
     class manual_timer_pollfn;
     class epoll_pollfn;
     class syscall_pollfn;
+    class steal_pollfn;
+    class io_budget_pollfn;
+    class alien_pollfn;
     friend io_pollfn;
     friend signal_pollfn;
     friend aio_batch_submit_pollfn;
@@ -612,6 +953,10 @@ class reactor {
     friend class manual_clock;
     friend class epoll_pollfn;
     friend class syscall_pollfn;
+    friend class steal_pollfn;
+    friend class io_budget_pollfn;
+    friend class alien_pollfn;
+    friend class preempt_timer_thread;
     friend class file_data_source_impl; // for fstream statistics
 public:
     class poller {
@@ -642,7 +987,6 @@ class reactor {
     using idle_cpu_handler = std::function<idle_cpu_handler_result(work_waiting_on_reactor)>;
 
 private:
-    // FIXME: make _backend a unique_ptr<reactor_backend>, not a compile-time #ifdef.
 #ifdef HAVE_OSV
     reactor_backend_osv _backend;
     sched::thread _timer_thread;
@@ -651,23 +995,40 @@ class reactor {
     condvar _timer_cond;
     s64 _timer_due = 0;
 #else
-    reactor_backend_epoll _backend;
+    // reactor_backend_epoll by default; see --reactor-backend.
+    std::unique_ptr<reactor_backend> _backend;
 #endif
     sigset_t _active_sigmask; // holds sigmask while sleeping with sig disabled
+#ifdef HAVE_OSV
+    reactor_backend& backend() { return _backend; }
+#else
+    reactor_backend& backend() { return *_backend; }
+    void select_backend(const sstring& name);
+#endif
     std::vector<pollfn*> _pollers;
 
     static constexpr size_t max_aio = 128;
     // Not all reactors have IO queues. If the number of IO queues is less than the number of shards,
-    // some reactors will talk to foreign io_queues. If this reactor holds a valid IO queue, it will
-    // be stored here.
-    std::unique_ptr<io_queue> my_io_queue = {};
+    // some reactors will talk to foreign io_queues. If this reactor holds valid IO queues, they will
+    // be stored here, one per I/O device.
+    std::vector<std::unique_ptr<io_queue>> my_io_queues;
 
 
     // For submiting the actual IO, all we need is the coordinator id. So storing it
     // separately saves us the pointer access.
     shard_id _io_coordinator;
     io_queue* _io_queue;
+    // The queue serving this shard for each I/O device; _io_queues[0] is _io_queue.
+    std::vector<io_queue*> _io_queues;
     friend io_queue;
+    // Discards waiting to be issued, for each I/O device, see submit_discard()
+    std::vector<std::unique_ptr<discard_queue>> _discard_queues;
+    std::experimental::optional<io_priority_class> _discard_class;
+    // Bytes per second this shard may discard on each device, 0 for no limit
+    double _discard_rate = 0;
+    friend discard_queue;
+    template <typename T>
+    uint64_t sum_discard_queues(T (discard_queue::*stat)() const) const;
 
     std::vector<std::function<future<> ()>> _exit_funcs;
     unsigned _id = 0;
@@ -683,29 +1044,71 @@ class reactor {
     semaphore _cpu_started;
     uint64_t _tasks_processed = 0;
     unsigned _max_task_backlog = 1000;
+    // Whether this shard lends and borrows memory (--elastic-memory)
+    bool _rebalance_memory = false;
     seastar::timer_set<timer<>, &timer<>::_link> _timers;
     seastar::timer_set<timer<>, &timer<>::_link>::timer_list_t _expired_timers;
-    seastar::timer_set<timer<lowres_clock>, &timer<lowres_clock>::_link> _lowres_timers;
-    seastar::timer_set<timer<lowres_clock>, &timer<lowres_clock>::_link>::timer_list_t _expired_lowres_timers;
+    seastar::timer_wheel<timer<lowres_clock>, &timer<lowres_clock>::_link> _lowres_timers;
+    seastar::timer_wheel<timer<lowres_clock>, &timer<lowres_clock>::_link>::timer_list_t _expired_lowres_timers;
     seastar::timer_set<timer<manual_clock>, &timer<manual_clock>::_link> _manual_timers;
     seastar::timer_set<timer<manual_clock>, &timer<manual_clock>::_link>::timer_list_t _expired_manual_timers;
     io_context_t _io_context;
     std::vector<struct ::iocb> _pending_aio;
     semaphore _io_context_available;
+    // Completions are read from the context's ring in userspace, instead
+    // of with an io_getevents() call per poll
+    bool _aio_ring_reaping = false;
     uint64_t _aio_reads = 0;
     uint64_t _aio_read_bytes = 0;
     uint64_t _aio_writes = 0;
     uint64_t _aio_write_bytes = 0;
+    // Reads coalesced into a neighbour by merge_pending_aio().
+    uint64_t _aio_merged = 0;
+    bool _aio_merge = true;
+    bool _epoll_edge_triggered = true;
+    uint64_t _epoll_ctl_calls = 0;
     uint64_t _fsyncs = 0;
     uint64_t _cxx_exceptions = 0;
-    uint64_t _fstream_reads = 0;
-    uint64_t _fstream_read_bytes = 0;
-    uint64_t _fstream_reads_blocked = 0;
-    uint64_t _fstream_read_bytes_blocked = 0;
-    uint64_t _fstream_read_aheads_discarded = 0;
-    uint64_t _fstream_read_ahead_discarded_bytes = 0;
-    circular_buffer<std::unique_ptr<task>> _pending_tasks;
-    circular_buffer<std::unique_ptr<task>> _at_destroy_tasks;
+    // Bumped for every read of a file stream, so kept off the reactor's
+    // cache lines
+    seastar::metrics::counter _fstream_reads;
+    seastar::metrics::counter _fstream_read_bytes;
+    seastar::metrics::counter _fstream_reads_blocked;
+    seastar::metrics::counter _fstream_read_bytes_blocked;
+    seastar::metrics::counter _fstream_read_aheads_discarded;
+    seastar::metrics::counter _fstream_read_ahead_discarded_bytes;
+    // nanosecond samples, first bucket ~1us, last ~8s
+    using latency_histogram = seastar::log_histogram<24, 10>;
+    struct task_queue {
+        explicit task_queue(unsigned id, sstring name, float shares);
+        double _vruntime = 0;
+        double _reciprocal_shares;
+        unsigned _id;
+        bool _active = false;
+        uint64_t _tasks_processed = 0;
+        std::chrono::nanoseconds _runtime{0};
+        circular_buffer<task_ptr> _q;
+        sstring _name;
+        // time since the queue became runnable; recorded when it is picked
+        std::chrono::steady_clock::time_point _waiting_since;
+        latency_histogram _delay_hist;
+        std::vector<scollectd::registration> _collectd_regs;
+        seastar::metrics::metric_groups _metrics;
+        void account_runtime(std::chrono::nanoseconds runtime);
+    };
+    std::array<std::unique_ptr<task_queue>, scheduling_group::max_groups> _task_queues;
+    // Non-empty task queues; scanned for the lowest vruntime.
+    std::vector<task_queue*> _active_task_queues;
+    // vruntime of the queue that ran last; newly activated queues start
+    // from here so that a queue cannot bank credit while it is idle.
+    double _last_vruntime = 0;
+    // only every task_runtime_sample_period'th task is timed, to keep
+    // clock reads off the fast path
+    static constexpr unsigned task_runtime_sample_period = 64;
+    unsigned _task_runtime_sample_counter = 0;
+    latency_histogram _task_runtime_hist;
+    latency_histogram _poll_iteration_hist;
+    circular_buffer<task_ptr> _at_destroy_tasks;
     std::chrono::duration<double> _task_quota;
     /// Handler that will be called when there is no task to execute on cpu.
     /// It represents a low priority work.
@@ -722,22 +1125,83 @@ class reactor {
     lowres_clock::time_point _lowres_next_timeout;
     std::experimental::optional<poller> _epoll_poller;
     std::experimental::optional<pollable_fd> _aio_eventfd;
-    const bool _reuseport;
+    bool _reuseport = false;
+    // Listeners steer connections to the shard on their receiving CPU
+    bool _reuseport_cpu_steering = false;
     circular_buffer<double> _loads;
     double _load = 0;
     steady_clock_type::duration _total_idle;
     steady_clock_type::time_point _start_time = steady_clock_type::now();
     std::chrono::nanoseconds _max_poll_time = calculate_poll_time();
+    // What the run loop does when there is no work (see idle_state_for()).
+    enum class idle_state { spin, backoff, sleep, count };
+    static constexpr unsigned max_idle_backoff_pauses = 64;
+    bool _adaptive_idle_poll = false;
+    std::chrono::nanoseconds _learned_poll_time{0};
+    double _idle_gap_ewma_ns = 0;   // typical length of idle periods that were worth polling through
+    double _idle_hit_rate = 1;      // fraction of idle periods shorter than _max_poll_time
+    unsigned _idle_backoff_pauses = 1;
+    std::array<std::chrono::nanoseconds, unsigned(idle_state::count)> _idle_state_time = {};
     circular_buffer<output_stream<char>* > _flush_batching;
+    // Objects released by foreign_ptrs on this shard, by owner shard;
+    // each shard's are sent to it in one message per poll
+    std::vector<std::vector<std::unique_ptr<foreign_destructible>>> _foreign_destructions;
+    bool _foreign_destructions_pending = false;
+    bool _foreign_destruction_batching = false;
+    uint64_t _foreign_destructions_queued = 0;
+    uint64_t _foreign_destruction_batches = 0;
     std::atomic<bool> _sleeping alignas(64);
+    // Shards that pushed smp requests or responses to this one since it
+    // last polled their queues; see smp::poll_queues().
+    shard_set _smp_ready;
+    // Shards whose queues to or from this one hold batches not yet pushed
+    std::vector<uint64_t> _smp_unflushed;
+    // Work submitted by non-seastar threads; see core/alien.hh.
+    std::unique_ptr<seastar::alien::message_queue> _alien_queue;
     pthread_t _thread_id alignas(64) = pthread_self();
     bool _strict_o_direct = true;
+    // Stall detection; all of these are touched from the task quota signal
+    // handler, on this reactor's thread.
+    unsigned _stall_ticks = 0;          // consecutive quotas without reaching the poll loop
+    unsigned _stall_report_ticks = 0;   // report after this many; 0 disables
+    uint64_t _stalls = 0;
+    uint64_t _stall_reports_suppressed = 0;
+    bool _preempt_from_thread = false;  // --preempt-source=thread
+    std::atomic<bool> _preempt_paused = { false }; // sleeping; preemption thread leaves us alone
+    std::chrono::steady_clock::time_point _last_stall_report;
+    // CPU profiling; the latest samples are kept in a ring, written by the
+    // profiling signal handler on this reactor's thread
+    struct cpu_profile_slot {
+        static constexpr unsigned max_frames = 32;
+        const std::type_info* task_type;
+        unsigned nr_frames;
+        uintptr_t frames[max_frames];
+    };
+    timer_t _cpu_profile_timer = {};
+    bool _cpu_profile_timer_created = false;
+    std::unique_ptr<cpu_profile_slot[]> _cpu_profile;
+    size_t _cpu_profile_capacity = 0;
+    uint64_t _cpu_profile_samples = 0;
+    // Set while the ring is read or replaced, so the handler leaves it be
+    volatile sig_atomic_t _cpu_profile_busy = 0;
+    // The type of the task being run, for the profiler
+    const std::type_info* _running_task_type = nullptr;
 private:
     static std::chrono::nanoseconds calculate_poll_time();
+    static void take_cpu_profile_sample(int);
     static void clear_task_quota(int);
+    // Task quota signal handler with --preempt-source=thread, where the
+    // signal is only sent when the preemption thread detects a stall.
+    static void report_stall_on_signal(int);
+    idle_state idle_state_for(std::chrono::nanoseconds idle_time) const;
+    void learn_idle_period(std::chrono::nanoseconds idle_time);
+    void check_for_stall() noexcept;
+    void report_stall() noexcept;
     void wakeup();
+    void merge_pending_aio();
     bool flush_pending_aio();
     bool flush_tcp_batches();
+    bool flush_foreign_destructions();
     bool do_expire_lowres_timers();
     bool do_check_lowres_timers() const;
     void expire_manual_timers();
@@ -780,10 +1244,28 @@ class reactor {
 
     signals _signals;
     thread_pool _thread_pool;
+    steal_queue _steal_queue;
+    bool _work_stealing = false;
     friend class thread_pool;
 
-    void run_tasks(circular_buffer<std::unique_ptr<task>>& tasks);
+    void run_tasks(circular_buffer<task_ptr>& tasks);
+    void run_some_tasks();
+    task_queue& queue_for(scheduling_group sg) {
+        auto& tq = _task_queues[sg._id];
+        if (__builtin_expect(!tq, false)) {
+            create_task_queue(sg);
+        }
+        return *tq;
+    }
+    void create_task_queue(scheduling_group sg);
+    void activate(task_queue& tq);
+    bool have_more_tasks() const { return !_active_task_queues.empty(); }
+    size_t pending_task_count() const;
+
+    static std::array<std::atomic<float>, scheduling_group::max_groups> _registered_sg_shares;
+    static std::array<sstring, scheduling_group::max_groups> _registered_sg_names;
     bool posix_reuseport_detect();
+    bool posix_reuseport_cpu_steering_detect();
 public:
     static boost::program_options::options_description get_options_description();
     reactor();
@@ -799,6 +1281,14 @@ class reactor {
         return io_queue::register_one_priority_class(std::move(name), shares);
     }
 
+    /// Like register_one_priority_class(sstring, uint32_t), with a bandwidth
+    /// cap and/or a latency goal for the class.
+    io_priority_class register_one_priority_class(sstring name, uint32_t shares, io_priority_class_limits limits) {
+        return io_queue::register_one_priority_class(std::move(name), shares, limits);
+    }
+
+    static scheduling_group register_scheduling_group(sstring name, float shares);
+
     void configure(boost::program_options::variables_map config);
 
     server_socket listen(socket_address sa, listen_options opts = {});
@@ -809,6 +1299,9 @@ class reactor {
     pollable_fd posix_listen(socket_address sa, listen_options opts = {});
 
     bool posix_reuseport_available() const { return _reuseport; }
+    // Closes a listener from posix_listen(), first taking it out of the
+    // reuseport group's CPU steering
+    void posix_reuseport_close(socket_address sa, pollable_fd& lfd);
 
     lw_shared_ptr<pollable_fd> make_pollable_fd(socket_address sa, seastar::transport proto = seastar::transport::TCP);
     future<> posix_connect(lw_shared_ptr<pollable_fd> pfd, socket_address sa, socket_address local);
@@ -817,12 +1310,14 @@ class reactor {
 
     future<size_t> read_some(pollable_fd_state& fd, void* buffer, size_t size);
     future<size_t> read_some(pollable_fd_state& fd, const std::vector<iovec>& iov);
+    future<temporary_buffer<char>> read_some(pollable_fd_state& fd, size_t max_size);
 
     future<size_t> write_some(pollable_fd_state& fd, const void* buffer, size_t size);
 
     future<> write_all(pollable_fd_state& fd, const void* buffer, size_t size);
 
     future<file> open_file_dma(sstring name, open_flags flags, file_open_options options = {});
+    future<std::vector<file>> open_files_dma(std::vector<sstring> names, open_flags flags, file_open_options options = {});
     future<file> open_directory(sstring name);
     future<> make_directory(sstring name);
     future<> touch_directory(sstring name);
@@ -834,15 +1329,38 @@ class reactor {
     future<> rename_file(sstring old_pathname, sstring new_pathname);
     future<> link_file(sstring oldpath, sstring newpath);
 
+    // Runs func on one of this shard's syscall threads (see --syscall-threads),
+    // for CPU-heavy work that must not stall the reactor. func must not touch
+    // reactor state or anything the reactor may use meanwhile.
+    template <typename T, typename Func>
+    future<T> submit_to_syscall_thread(Func func) {
+        return _thread_pool.submit<T>(std::move(func));
+    }
+
     // In the following three methods, prepare_io is not guaranteed to execute in the same processor
     // in which it was generated. Therefore, care must be taken to avoid the use of objects that could
     // be destroyed within or at exit of prepare_io.
     template <typename Func>
     future<io_event> submit_io(Func prepare_io);
     template <typename Func>
-    future<io_event> submit_io_read(const io_priority_class& priority_class, size_t len, Func prepare_io);
+    future<io_event> submit_io(const io_queue& queue, Func prepare_io);
+    // device is the id of the I/O device whose queue the request goes through
+    // (see io_queue::device_of()).
+    template <typename Func>
+    future<io_event> submit_io_read(const io_priority_class& priority_class, size_t len, Func prepare_io, unsigned device = 0);
     template <typename Func>
-    future<io_event> submit_io_write(const io_priority_class& priority_class, size_t len, Func prepare_io);
+    future<io_event> submit_io_write(const io_priority_class& priority_class, size_t len, Func prepare_io, unsigned device = 0);
+    // Discards a range of the file or block device open at fd in the
+    // background, merged with other pending discards of the file and
+    // limited by --discard-rate; resolves once the range is discarded.
+    future<> submit_discard(int fd, bool blockdev, uint64_t offset, uint64_t length, unsigned device = 0);
+
+    /// Returns the id of the I/O device whose queue serves files at \c path;
+    /// devices get their own queue with --io-device, everything else is 0.
+    future<unsigned> io_device_of(sstring path);
+    /// Changes the number of concurrent requests the queues of I/O device
+    /// \c device allow, e.g. after measuring the device again.
+    future<> set_io_device_capacity(unsigned device, unsigned max_io_requests);
 
     int run();
     void exit(int ret);
@@ -861,8 +1379,20 @@ class reactor {
         _at_destroy_tasks.push_back(make_task(std::forward<Func>(func)));
     }
 
-    void add_task(std::unique_ptr<task>&& t) { _pending_tasks.push_back(std::move(t)); }
-    void add_urgent_task(std::unique_ptr<task>&& t) { _pending_tasks.push_front(std::move(t)); }
+    void add_task(task_ptr&& t) {
+        auto& tq = queue_for(t->group());
+        tq._q.push_back(std::move(t));
+        if (!tq._active) {
+            activate(tq);
+        }
+    }
+    void add_urgent_task(task_ptr&& t) {
+        auto& tq = queue_for(t->group());
+        tq._q.push_front(std::move(t));
+        if (!tq._active) {
+            activate(tq);
+        }
+    }
 
     /// Set a handler that will be called when there is no task to execute on cpu.
     /// Handler should do a low priority work.
@@ -877,7 +1407,13 @@ class reactor {
     }
     void force_poll();
 
-    void add_high_priority_task(std::unique_ptr<task>&&);
+    void add_high_priority_task(task_ptr&&);
+
+    /// \cond internal
+    // Destroys obj on cpu, batched with the other objects sent there
+    // before the next poll
+    void destroy_on(unsigned cpu, std::unique_ptr<foreign_destructible> obj);
+    /// \endcond
 
     network_stack& net() { return *_network_stack; }
     shard_id cpu_id() const { return _id; }
@@ -924,13 +1460,19 @@ class reactor {
     friend class pollable_fd;
     friend class pollable_fd_state;
     friend class posix_file_impl;
+    friend class reactor_backend_epoll;
+#ifdef HAVE_IO_URING
+    friend class reactor_backend_uring;
+#endif
     friend class blockdev_file_impl;
+    friend class mapped_file;
     friend class readable_eventfd;
     friend class timer<>;
     friend class timer<lowres_clock>;
     friend class timer<manual_clock>;
     friend class smp;
     friend class smp_message_queue;
+    friend class seastar::alien::message_queue;
     friend class poller;
     friend void add_to_flush_poller(output_stream<char>* os);
     friend int _Unwind_RaiseException(void *h);
@@ -938,30 +1480,30 @@ class reactor {
     seastar::metrics::metric_groups _metric_groups;
 public:
     bool wait_and_process(int timeout = 0, const sigset_t* active_sigmask = nullptr) {
-        return _backend.wait_and_process(timeout, active_sigmask);
+        return backend().wait_and_process(timeout, active_sigmask);
     }
 
     future<> readable(pollable_fd_state& fd) {
-        return _backend.readable(fd);
+        return backend().readable(fd);
     }
     future<> writeable(pollable_fd_state& fd) {
-        return _backend.writeable(fd);
+        return backend().writeable(fd);
     }
     void forget(pollable_fd_state& fd) {
-        _backend.forget(fd);
+        backend().forget(fd);
     }
     future<> notified(reactor_notifier *n) {
-        return _backend.notified(n);
+        return backend().notified(n);
     }
     void abort_reader(pollable_fd_state& fd, std::exception_ptr ex) {
-        return _backend.abort_reader(fd, std::move(ex));
+        return backend().abort_reader(fd, std::move(ex));
     }
     void abort_writer(pollable_fd_state& fd, std::exception_ptr ex) {
-        return _backend.abort_writer(fd, std::move(ex));
+        return backend().abort_writer(fd, std::move(ex));
     }
     void enable_timer(steady_clock_type::time_point when);
     std::unique_ptr<reactor_notifier> make_reactor_notifier() {
-        return _backend.make_reactor_notifier();
+        return backend().make_reactor_notifier();
     }
     /// Sets the "Strict DMA" flag.
     ///
@@ -975,6 +1517,14 @@ class reactor {
     void set_strict_dma(bool value) {
         _strict_o_direct = value;
     }
+
+    /// Samples what this shard runs every \c period of the CPU time it
+    /// uses: the type of the running task, if any, and the backtrace. The
+    /// latest \c max_samples samples are kept. A period of 0 stops
+    /// sampling, keeping the samples taken so far.
+    void set_cpu_profiling(std::chrono::microseconds period, size_t max_samples = 4096);
+    /// Copies the samples of this shard's CPU profile, oldest first.
+    std::vector<cpu_profile_sample> get_cpu_profile();
 };
 
 template <typename Func> // signature: bool ()
@@ -1001,6 +1551,33 @@ inline reactor& engine() {
     return *local_engine;
 }
 
+/// Creates a new scheduling group, usable on all shards.
+///
+/// \param name name of the group, used in metrics
+/// \param shares CPU shares of the group; the default group has 1000
+/// \throws std::runtime_error if all \ref scheduling_group::max_groups
+///         groups are taken
+inline
+scheduling_group create_scheduling_group(sstring name, float shares) {
+    return reactor::register_scheduling_group(std::move(name), shares);
+}
+
+/// Runs \c func with \c sg as the current scheduling group.
+///
+/// Continuations attached by \c func (and everything they schedule in
+/// turn) run in \c sg; \c func itself runs immediately, in the caller's
+/// group.
+template <typename Func>
+inline
+futurize_t<std::result_of_t<Func()>>
+with_scheduling_group(scheduling_group sg, Func&& func) {
+    auto prev = g_current_scheduling_group;
+    g_current_scheduling_group = sg.id();
+    auto ret = futurize<std::result_of_t<Func()>>::apply(std::forward<Func>(func));
+    g_current_scheduling_group = prev;
+    return ret;
+}
+
 class smp {
     static std::vector<posix_thread> _threads;
     static std::vector<std::function<void ()>> _thread_loops; // for dpdk
@@ -1009,11 +1586,20 @@ class smp {
     static smp_message_queue** _qs;
     static std::thread::id _tmain;
     static bool _using_dpdk;
+    // NUMA node index of each shard, and the shards of each node.
+    static std::vector<unsigned> _shard_node;
+    static std::vector<std::vector<unsigned>> _node_shards;
+    // Placement of the smp queues; with none, each shard's incoming queues
+    // come from its own memory.
+    static memory::numa_policy _queue_numa_policy;
 
     template <typename Func>
     using returns_future = is_future<std::result_of_t<Func()>>;
     template <typename Func>
     using returns_void = std::is_same<std::result_of_t<Func()>, void>;
+    template <typename Func>
+    using map_result_t = std::tuple_element_t<0, typename futurize_t<std::result_of_t<Func()>>::value_type>;
+    friend class seastar::alien::message_queue;
 public:
     static boost::program_options::options_description get_options_description();
     static void configure(boost::program_options::variables_map vm);
@@ -1056,24 +1642,121 @@ class smp {
             return _qs[t][engine().cpu_id()].submit(std::forward<Func>(func));
         }
     }
+    /// Runs a CPU-bound function on this shard, or on another shard that
+    /// is idle and runs with --work-stealing, whichever gets to it first.
+    ///
+    /// Meant for batch work such as compression or checksumming, which
+    /// would otherwise keep a hot shard busy while its neighbours idle.
+    /// Normal continuations keep running where they were scheduled; only
+    /// \c func itself may move.
+    ///
+    /// \param func a callable that does not return a future.  It may run
+    ///             on any shard, so it must not touch shard-local state; its
+    ///             result is delivered back to this shard.
+    /// \return whatever \c func returns, as a future<>.
+    template <typename Func>
+    static futurize_t<std::result_of_t<Func()>> submit_stealable(Func func);
+    /// Runs a batch of functions on a remote core, using a single cross-core
+    /// message for all of them.
+    ///
+    /// Cheaper than calling submit_to() for each element when fanning out
+    /// many small calls to the same shard.  The functions run concurrently
+    /// on core \c t.
+    ///
+    /// \param t designates the core to run the functions on
+    /// \param funcs a range of callables of the same type, each returning
+    ///              \c void, a value, or a future; they are copied.
+    /// \return a future holding a vector of the results, in the order of
+    ///         \c funcs (or \c future<> if the callables return void); it
+    ///         fails with the first exception if any call fails.
+    template <typename Range>
+    static auto submit_batch_to(unsigned t, Range&& funcs);
+    /// Sets the in-flight limit and batch size (see
+    /// smp_message_queue::set_limits()) of the queue carrying requests from
+    /// core \c from to core \c to.
+    static void set_queue_limits(unsigned from, unsigned to, size_t max_in_flight, size_t batch_size);
     static bool poll_queues();
     static bool pure_poll_queues();
+    // Notes that this shard has a batch for peer not yet pushed to it
+    static void mark_unflushed(unsigned peer);
+    // Runs work from this shard's steal queue, or with --work-stealing and
+    // nothing else to do, work stolen from another shard's.
+    static bool poll_steal_queues();
+    static bool pure_poll_steal_queues();
     static boost::integer_range<unsigned> all_cpus() {
         return boost::irange(0u, count);
     }
+    /// Number of NUMA nodes the shards are spread over.
+    static unsigned numa_nodes() {
+        return _node_shards.size();
+    }
+    /// NUMA node index (0 to numa_nodes() - 1) of core \c shard.
+    static unsigned numa_node_of(unsigned shard) {
+        return _shard_node[shard];
+    }
     // Invokes func on all shards.
     // The returned future resolves when all async invocations finish.
     // The func may return void or future<>.
     // Each async invocation will work with a separate copy of func.
+    //
+    // The caller sends a single message to each other NUMA node, and the
+    // shard that receives it forwards func to the rest of its node, so only
+    // one queue per node is written across the interconnect.
     template<typename Func>
     static future<> invoke_on_all(Func&& func) {
         static_assert(std::is_same<future<>, typename futurize<std::result_of_t<Func()>>::type>::value, "bad Func signature");
-        return parallel_for_each(all_cpus(), [&func] (unsigned id) {
-            return smp::submit_to(id, Func(func));
+        using func_type = std::decay_t<Func>;
+        return parallel_for_each(boost::irange(0u, numa_nodes()), [&func] (unsigned node) {
+            return smp::submit_to(node_leader(node), [node, func = func_type(func)] () mutable {
+                return parallel_for_each(node_shards(node), [&func] (unsigned id) {
+                    return smp::submit_to(id, func_type(func));
+                });
+            });
+        });
+    }
+    // Invokes func on all shards and collects the results, indexed by
+    // shard, fanning out through one shard per NUMA node like
+    // invoke_on_all().  func must return a single value or a future of
+    // one, and the value type must be default constructible.
+    template<typename Func>
+    static future<std::vector<map_result_t<Func>>> map_all(Func func) {
+        using value_type = map_result_t<Func>;
+        return do_with(std::vector<value_type>(count), [func = std::move(func)] (std::vector<value_type>& results) mutable {
+            return parallel_for_each(boost::irange(0u, numa_nodes()), [&results, &func] (unsigned node) {
+                return smp::submit_to(node_leader(node), [node, func] () mutable {
+                    return map_node(node, func);
+                }).then([&results, node] (std::vector<value_type> node_results) {
+                    auto&& shards = node_shards(node);
+                    for (unsigned i = 0; i < shards.size(); ++i) {
+                        results[shards[i]] = std::move(node_results[i]);
+                    }
+                });
+            }).then([&results] {
+                return std::move(results);
+            });
         });
     }
 private:
+    // The shard that forwards broadcasts to the shards of a node: the
+    // calling shard for its own node, otherwise the node's first shard.
+    static unsigned node_leader(unsigned node) {
+        auto me = engine().cpu_id();
+        return numa_node_of(me) == node ? me : node_shards(node).front();
+    }
+    static const std::vector<unsigned>& node_shards(unsigned node) {
+        return _node_shards[node];
+    }
+    template <typename Func>
+    static future<std::vector<map_result_t<Func>>> map_node(unsigned node, Func& func);
+    static void record_numa_nodes(const std::vector<resource::cpu>& allocations);
     static void start_all_queues();
+    static void construct_queues(unsigned to, size_t max_in_flight, size_t batch_size);
+    // Runs a batch received by submit_batch_to(); the bool selects between
+    // void and value-returning functions.
+    template <typename Func>
+    static future<> do_for_batch(std::vector<Func> batch, std::true_type);
+    template <typename Func>
+    static auto do_for_batch(std::vector<Func> batch, std::false_type);
     static void pin(unsigned cpu_id);
     static void allocate_reactor();
     static void create_thread(std::function<void ()> thread_loop);
@@ -1081,6 +1764,112 @@ class smp {
     static unsigned count;
 };
 
+template <typename Func>
+inline
+future<std::vector<smp::map_result_t<Func>>>
+smp::map_node(unsigned node, Func& func) {
+    using value_type = map_result_t<Func>;
+    auto&& shards = node_shards(node);
+    return do_with(std::vector<value_type>(shards.size()), [&shards, &func] (std::vector<value_type>& results) {
+        return parallel_for_each(boost::irange<unsigned>(0, shards.size()), [&shards, &func, &results] (unsigned i) {
+            return smp::submit_to(shards[i], Func(func)).then([&results, i] (value_type v) {
+                results[i] = std::move(v);
+            });
+        }).then([&results] {
+            return std::move(results);
+        });
+    });
+}
+
+template <typename Range>
+inline
+auto
+smp::submit_batch_to(unsigned t, Range&& funcs) {
+    using func_type = std::decay_t<decltype(*std::begin(funcs))>;
+    using futurator = futurize<std::result_of_t<func_type()>>;
+    using value_type = typename futurator::type::value_type;
+    std::vector<func_type> batch(std::begin(funcs), std::end(funcs));
+    return submit_to(t, [batch = std::move(batch)] () mutable {
+        return do_for_batch(std::move(batch), std::integral_constant<bool, std::tuple_size<value_type>::value == 0>());
+    });
+}
+
+template <typename Func>
+inline
+future<>
+smp::do_for_batch(std::vector<Func> batch, std::true_type) {
+    return do_with(std::move(batch), [] (std::vector<Func>& batch) {
+        return parallel_for_each(batch, [] (Func& func) {
+            return futurize<std::result_of_t<Func()>>::apply(func);
+        });
+    });
+}
+
+template <typename Func>
+inline
+auto
+smp::do_for_batch(std::vector<Func> batch, std::false_type) {
+    using futurator = futurize<std::result_of_t<Func()>>;
+    static_assert(std::tuple_size<typename futurator::type::value_type>::value == 1,
+            "submit_batch_to() functions must return a single value");
+    using value_type = std::tuple_element_t<0, typename futurator::type::value_type>;
+    struct state {
+        std::vector<Func> batch;
+        std::vector<std::experimental::optional<value_type>> results;
+    };
+    return do_with(state{std::move(batch), {}}, [] (state& s) {
+        s.results.resize(s.batch.size());
+        return parallel_for_each(boost::irange<size_t>(0, s.batch.size()), [&s] (size_t i) {
+            return futurator::apply(s.batch[i]).then([&s, i] (value_type v) {
+                s.results[i] = std::move(v);
+            });
+        }).then([&s] {
+            std::vector<value_type> ret;
+            ret.reserve(s.results.size());
+            for (auto& r : s.results) {
+                ret.push_back(std::move(*r));
+            }
+            return ret;
+        });
+    });
+}
+
+template <typename Func>
+inline
+futurize_t<std::result_of_t<Func()>>
+smp::submit_stealable(Func func) {
+    using ret_type = std::result_of_t<Func()>;
+    static_assert(!is_future<ret_type>::value, "stealable work must not return a future");
+    using futurator = futurize<ret_type>;
+    struct work_item final : steal_queue::work_item {
+        Func _func;
+        unsigned _origin;
+        typename futurator::promise_type _promise;
+        work_item(Func&& func) : _func(std::move(func)), _origin(engine().cpu_id()) {}
+        void complete(typename futurator::type result) {
+            auto& q = engine()._steal_queue;
+            result.forward_to(std::move(_promise));
+            q.release();
+            delete this;
+        }
+        virtual void process() override {
+            auto result = futurator::apply(_func);
+            if (engine().cpu_id() == _origin) {
+                complete(std::move(result));
+                return;
+            }
+            smp::_reactors[_origin]->_steal_queue.count_stolen();
+            smp::submit_to(_origin, [this, result = std::move(result)] () mutable {
+                complete(std::move(result));
+            });
+        }
+    };
+    auto wi = new work_item(std::move(func));
+    auto fut = wi->_promise.get_future();
+    engine()._steal_queue.submit_item(wi);
+    return fut;
+}
+
 inline
 pollable_fd_state::~pollable_fd_state() {
     engine().forget(*this);
@@ -1102,9 +1891,17 @@ future<pollable_fd, socket_address>
 reactor::accept(pollable_fd_state& listenfd) {
     return readable(listenfd).then([this, &listenfd] () mutable {
         socket_address sa;
-        socklen_t sl = sizeof(&sa.u.sas);
-        file_desc fd = listenfd.fd.accept(sa.u.sa, sl, SOCK_NONBLOCK | SOCK_CLOEXEC);
-        pollable_fd pfd(std::move(fd), pollable_fd::speculation(EPOLLOUT));
+        socklen_t sl = sizeof(sa.u.sas);
+        auto fd = listenfd.fd.try_accept(sa.u.sa, sl, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        sa.addr_length = sl;
+        if (!fd) {
+            listenfd.not_ready(EPOLLIN);
+            return accept(listenfd);
+        }
+        pollable_fd pfd(std::move(*fd), pollable_fd::speculation(EPOLLOUT));
+        if (listenfd.edge_triggered) {
+            pfd.enable_edge_triggered();
+        }
         return make_ready_future<pollable_fd, socket_address>(std::move(pfd), std::move(sa));
     });
 }
@@ -1115,6 +1912,7 @@ reactor::read_some(pollable_fd_state& fd, void* buffer, size_t len) {
     return readable(fd).then([this, &fd, buffer, len] () mutable {
         auto r = fd.fd.read(buffer, len);
         if (!r) {
+            fd.not_ready(EPOLLIN);
             return read_some(fd, buffer, len);
         }
         if (size_t(*r) == len) {
@@ -1124,6 +1922,30 @@ reactor::read_some(pollable_fd_state& fd, void* buffer, size_t len) {
     });
 }
 
+inline
+future<temporary_buffer<char>>
+reactor::read_some(pollable_fd_state& fd, size_t max_size) {
+    return readable(fd).then([this, &fd, max_size] {
+        temporary_buffer<char> buf(max_size);
+        auto r = fd.fd.read(buf.get_write(), max_size);
+        if (!r) {
+            // The readiness was stale; wait for it again without the buffer
+            fd.not_ready(EPOLLIN);
+            return read_some(fd, max_size);
+        }
+        if (size_t(*r) == max_size) {
+            fd.speculate_epoll(EPOLLIN);
+        } else if (size_t(*r) <= max_size / 8) {
+            // A small read, such as a whole request or a part of one, is
+            // copied out, so that buffering it while the rest arrives costs
+            // its size rather than the full buffer's
+            return make_ready_future<temporary_buffer<char>>(*r ? temporary_buffer<char>(buf.get(), *r) : temporary_buffer<char>());
+        }
+        buf.trim(*r);
+        return make_ready_future<temporary_buffer<char>>(std::move(buf));
+    });
+}
+
 inline
 future<size_t>
 reactor::read_some(pollable_fd_state& fd, const std::vector<iovec>& iov) {
@@ -1133,6 +1955,7 @@ reactor::read_some(pollable_fd_state& fd, const std::vector<iovec>& iov) {
         mh.msg_iovlen = iov.size();
         auto r = fd.fd.recvmsg(&mh, 0);
         if (!r) {
+            fd.not_ready(EPOLLIN);
             return read_some(fd, iov);
         }
         if (size_t(*r) == iovec_len(iov)) {
@@ -1148,6 +1971,7 @@ reactor::write_some(pollable_fd_state& fd, const void* buffer, size_t len) {
     return writeable(fd).then([this, &fd, buffer, len] () mutable {
         auto r = fd.fd.send(buffer, len, MSG_NOSIGNAL);
         if (!r) {
+            fd.not_ready(EPOLLOUT);
             return write_some(fd, buffer, len);
         }
         if (size_t(*r) == len) {
@@ -1192,6 +2016,11 @@ future<size_t> pollable_fd::read_some(const std::vector<iovec>& iov) {
     return engine().read_some(*_s, iov);
 }
 
+inline
+future<temporary_buffer<char>> pollable_fd::read_some(size_t max_size) {
+    return engine().read_some(*_s, max_size);
+}
+
 inline
 future<> pollable_fd::write_all(const char* buffer, size_t size) {
     return engine().write_all(*_s, buffer, size);
@@ -1216,9 +2045,11 @@ future<size_t> pollable_fd::write_some(net::packet& p) {
         iovec* iov = reinterpret_cast<iovec*>(p.fragment_array());
         msghdr mh = {};
         mh.msg_iov = iov;
-        mh.msg_iovlen = p.nr_frags();
+        // Anything beyond IOV_MAX fragments goes out in the next call.
+        mh.msg_iovlen = std::min<size_t>(p.nr_frags(), IOV_MAX);
         auto r = get_file_desc().sendmsg(&mh, MSG_NOSIGNAL);
         if (!r) {
+            _s->not_ready(EPOLLOUT);
             return write_some(p);
         }
         if (size_t(*r) == p.len()) {
@@ -1239,6 +2070,31 @@ future<> pollable_fd::write_all(net::packet& p) {
     });
 }
 
+inline
+future<size_t> pollable_fd::sendfile(int in_fd, uint64_t offset, size_t len) {
+    return engine().writeable(*_s).then([this, in_fd, offset, len] {
+        // Reading the file may block on the disk, so a syscall thread
+        // makes the call
+        return engine().submit_to_syscall_thread<std::pair<ssize_t, int>>([out_fd = get_fd(), in_fd, offset, len] {
+            off_t off = offset;
+            auto r = ::sendfile(out_fd, in_fd, &off, len);
+            return std::make_pair(r, r == -1 ? errno : 0);
+        }).then([this, in_fd, offset, len] (std::pair<ssize_t, int> r) {
+            if (r.first == -1) {
+                if (r.second != EAGAIN) {
+                    throw std::system_error(r.second, std::system_category());
+                }
+                _s->not_ready(EPOLLOUT);
+                return sendfile(in_fd, offset, len);
+            }
+            if (size_t(r.first) == len) {
+                _s->speculate_epoll(EPOLLOUT);
+            }
+            return make_ready_future<size_t>(r.first);
+        });
+    });
+}
+
 inline
 future<> pollable_fd::readable() {
     return engine().readable(*_s);
@@ -1261,17 +2117,23 @@ pollable_fd::abort_writer(std::exception_ptr ex) {
     engine().abort_writer(*_s, std::move(ex));
 }
 
+inline
+void pollable_fd::enable_edge_triggered() {
+    _s->edge_triggered = engine()._epoll_edge_triggered;
+}
+
 inline
 future<pollable_fd, socket_address> pollable_fd::accept() {
     return engine().accept(*_s);
 }
 
 inline
-future<size_t> pollable_fd::recvmsg(struct msghdr *msg) {
-    return engine().readable(*_s).then([this, msg] {
-        auto r = get_file_desc().recvmsg(msg, 0);
+future<size_t> pollable_fd::recvmsg(struct msghdr *msg, int flags) {
+    return engine().readable(*_s).then([this, msg, flags] {
+        auto r = get_file_desc().recvmsg(msg, flags);
         if (!r) {
-            return recvmsg(msg);
+            _s->not_ready(EPOLLIN);
+            return recvmsg(msg, flags);
         }
         // We always speculate here to optimize for throughput in a workload
         // with multiple outstanding requests. This way the caller can consume
@@ -1286,11 +2148,12 @@ future<size_t> pollable_fd::recvmsg(struct msghdr *msg) {
 };
 
 inline
-future<size_t> pollable_fd::sendmsg(struct msghdr* msg) {
-    return engine().writeable(*_s).then([this, msg] () mutable {
-        auto r = get_file_desc().sendmsg(msg, 0);
+future<size_t> pollable_fd::sendmsg(struct msghdr* msg, int flags) {
+    return engine().writeable(*_s).then([this, msg, flags] () mutable {
+        auto r = get_file_desc().sendmsg(msg, flags);
         if (!r) {
-            return sendmsg(msg);
+            _s->not_ready(EPOLLOUT);
+            return sendmsg(msg, flags);
         }
         // For UDP this will always speculate. We can't know if there's room
         // or not, but most of the time there should be so the cost of mis-
@@ -1302,11 +2165,45 @@ future<size_t> pollable_fd::sendmsg(struct msghdr* msg) {
     });
 }
 
+inline
+future<size_t> pollable_fd::recvmmsg(struct mmsghdr *msgs, unsigned vlen) {
+    return engine().readable(*_s).then([this, msgs, vlen] {
+        auto r = get_file_desc().recvmmsg(msgs, vlen, 0);
+        if (!r) {
+            _s->not_ready(EPOLLIN);
+            return recvmmsg(msgs, vlen);
+        }
+        // A full batch suggests more are queued, a partial one that the
+        // queue was drained
+        if (*r == vlen) {
+            _s->speculate_epoll(EPOLLIN);
+        }
+        return make_ready_future<size_t>(*r);
+    });
+}
+
+inline
+future<size_t> pollable_fd::sendmmsg(struct mmsghdr *msgs, unsigned vlen) {
+    return engine().writeable(*_s).then([this, msgs, vlen] {
+        auto r = get_file_desc().sendmmsg(msgs, vlen, 0);
+        if (!r) {
+            _s->not_ready(EPOLLOUT);
+            return sendmmsg(msgs, vlen);
+        }
+        // See the comment about speculation in sendmsg().
+        if (*r == vlen) {
+            _s->speculate_epoll(EPOLLOUT);
+        }
+        return make_ready_future<size_t>(*r);
+    });
+}
+
 inline
 future<size_t> pollable_fd::sendto(socket_address addr, const void* buf, size_t len) {
     return engine().writeable(*_s).then([this, buf, len, addr] () mutable {
         auto r = get_file_desc().sendto(addr, buf, len, 0);
         if (!r) {
+            _s->not_ready(EPOLLOUT);
             return sendto(std::move(addr), buf, len);
         }
         // See the comment about speculation in sendmsg().
@@ -0,0 +1,142 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "reactor.hh"
+#include "shared_ptr.hh"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace seastar {
+
+/// \addtogroup smp-module
+/// @{
+
+/// Read-mostly data shared by all shards.
+///
+/// A writer, on any shard, builds a new immutable version of the data and
+/// \ref publish()es it; each shard then switches to the new version.  A
+/// version is destroyed, on the shard that published it, once no shard
+/// uses it any more.
+///
+/// Readers call \ref local(), which returns a shard-local snapshot of the
+/// current version: taking and dropping one touches only a non-atomic
+/// reference count owned by the reader's shard.  Only publishing, and a
+/// shard releasing a version, use atomic operations.
+///
+/// Like \ref sharded, a replicated object is shared by all shards and must
+/// be \ref stop()ped before it is destroyed; it must not be moved.
+///
+/// \tparam T type of the data.  Must be safe to read from several shards
+///           at once, which an immutable object is.
+template <typename T>
+class replicated {
+    class deleter {
+        unsigned _owner;
+    public:
+        explicit deleter(unsigned owner) : _owner(owner) {}
+        void operator()(const T* p) const;
+    };
+    // A shard's handle to a version; shards share the version itself
+    // through the atomic std::shared_ptr.
+    struct version {
+        std::shared_ptr<const T> value;
+        uint64_t epoch;
+    };
+    std::vector<lw_shared_ptr<version>> _shards;
+    std::atomic<uint64_t> _next_epoch = { 1 };
+public:
+    /// A reference to one version of the data, valid on the shard that
+    /// obtained it.  Keeps that version alive.
+    class snapshot {
+        lw_shared_ptr<version> _v;
+    public:
+        snapshot() = default;
+        explicit snapshot(lw_shared_ptr<version> v) : _v(std::move(v)) {}
+        const T& operator*() const { return *_v->value; }
+        const T* operator->() const { return _v->value.get(); }
+        const T* get() const { return _v ? _v->value.get() : nullptr; }
+        explicit operator bool() const { return _v && _v->value; }
+        /// Identifies the version; later publications have greater epochs.
+        uint64_t epoch() const { return _v ? _v->epoch : 0; }
+    };
+
+    replicated() : _shards(smp::count) {}
+    replicated(const replicated&) = delete;
+    replicated(replicated&&) = delete;
+    ~replicated() {
+        for (auto&& s : _shards) {
+            assert(!s);
+        }
+    }
+
+    /// Publishes \c value to all shards.
+    ///
+    /// \return a future that resolves once every shard has switched to
+    ///         \c value, or to a version published after it.
+    future<> publish(T value) {
+        return publish(std::shared_ptr<const T>(new T(std::move(value)), deleter(engine().cpu_id())));
+    }
+
+    /// Returns the current version on this shard; its operator bool is false
+    /// if nothing was published yet.
+    snapshot local() const {
+        return snapshot(_shards[engine().cpu_id()]);
+    }
+
+    /// Drops every shard's reference to the data.  Outstanding snapshots
+    /// keep their versions alive.
+    future<> stop() {
+        return smp::invoke_on_all([this] {
+            _shards[engine().cpu_id()] = {};
+        });
+    }
+private:
+    future<> publish(std::shared_ptr<const T> value) {
+        auto epoch = _next_epoch.fetch_add(1, std::memory_order_relaxed);
+        return smp::invoke_on_all([this, value, epoch] {
+            auto& cur = _shards[engine().cpu_id()];
+            // Publications from several shards may arrive out of order.
+            if (!cur || cur->epoch < epoch) {
+                cur = make_lw_shared<version>(version{value, epoch});
+            }
+        });
+    }
+};
+
+template <typename T>
+void replicated<T>::deleter::operator()(const T* p) const {
+    if (engine().cpu_id() == _owner) {
+        delete p;
+        return;
+    }
+    // The last reference was dropped elsewhere; destroy the version where
+    // it was built, so that its memory returns to that shard's allocator.
+    smp::submit_to(_owner, [p] {
+        delete p;
+    });
+}
+
+/// @}
+
+}
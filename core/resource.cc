@@ -21,50 +21,117 @@
 
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <fstream>
 #include <regex>
 #include "resource.hh"
 #include "core/align.hh"
+#include "core/print.hh"
 
 // Overload for boost program options parsing/validation
 void validate(boost::any& v,
               const std::vector<std::string>& values,
               cpuset_bpo_wrapper* target_type, int) {
     using namespace boost::program_options;
-    static std::regex r("(\\d+-)?(\\d+)(,(\\d+-)?(\\d+))*");
     validators::check_first_occurrence(v);
     // Extract the first string from 'values'. If there is more than
     // one string, it's an error, and exception will be thrown.
     auto&& s = validators::get_single_string(values);
-    std::smatch match;
-    if (std::regex_match(s, match, r)) {
-        std::vector<std::string> ranges;
-        boost::split(ranges, s, boost::is_any_of(","));
-        cpuset_bpo_wrapper ret;
-        for (auto&& range: ranges) {
-            std::string beg = range;
-            std::string end = range;
-            auto dash = range.find('-');
-            if (dash != range.npos) {
-                beg = range.substr(0, dash);
-                end = range.substr(dash + 1);
-            }
-            auto b = boost::lexical_cast<unsigned>(beg);
-            auto e = boost::lexical_cast<unsigned>(end);
-            if (b > e) {
-                throw validation_error(validation_error::invalid_option_value);
-            }
-            for (auto i = b; i <= e; ++i) {
-                ret.value.insert(i);
-            }
-        }
-        v = std::move(ret);
-    } else {
+    auto cpus = resource::parse_cpuset(s);
+    if (!cpus) {
         throw validation_error(validation_error::invalid_option_value);
     }
+    cpuset_bpo_wrapper ret;
+    ret.value = std::move(*cpus);
+    v = std::move(ret);
 }
 
 namespace resource {
 
+optional<cpuset> parse_cpuset(const std::string& s) {
+    static std::regex r("(\\d+-)?(\\d+)(,(\\d+-)?(\\d+))*");
+    if (!std::regex_match(s, r)) {
+        return {};
+    }
+    std::vector<std::string> ranges;
+    boost::split(ranges, s, boost::is_any_of(","));
+    cpuset ret;
+    for (auto&& range: ranges) {
+        std::string beg = range;
+        std::string end = range;
+        auto dash = range.find('-');
+        if (dash != range.npos) {
+            beg = range.substr(0, dash);
+            end = range.substr(dash + 1);
+        }
+        auto b = boost::lexical_cast<unsigned>(beg);
+        auto e = boost::lexical_cast<unsigned>(end);
+        if (b > e) {
+            return {};
+        }
+        for (auto i = b; i <= e; ++i) {
+            ret.insert(i);
+        }
+    }
+    return ret;
+}
+
+static optional<std::string> read_first_line(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    if (!std::getline(in, line)) {
+        return {};
+    }
+    return line;
+}
+
+static cpuset read_cpulist(const std::string& path) {
+    auto line = read_first_line(path);
+    if (!line) {
+        return {};
+    }
+    return parse_cpuset(*line).value_or(cpuset());
+}
+
+cpuset nic_irq_cpus() {
+    namespace fs = boost::filesystem;
+    cpuset ret;
+    boost::system::error_code ec;
+    // Only interfaces backed by a device have msi_irqs; lo, bridges and
+    // the like are skipped.
+    for (fs::directory_iterator nic("/sys/class/net", ec), end; !ec && nic != end; nic.increment(ec)) {
+        boost::system::error_code irq_ec;
+        for (fs::directory_iterator irq(nic->path() / "device" / "msi_irqs", irq_ec); !irq_ec && irq != end; irq.increment(irq_ec)) {
+            auto cpus = read_cpulist("/proc/irq/" + irq->path().filename().string() + "/smp_affinity_list");
+            ret.insert(cpus.begin(), cpus.end());
+        }
+    }
+    // Interrupts allowed everywhere were never pinned, and leave nothing to reserve
+    if (ret == read_cpulist("/sys/devices/system/cpu/online")) {
+        ret.clear();
+    }
+    return ret;
+}
+
+cpuset device_cpus(const std::string& device) {
+    // For an NVMe namespace, the PCI device is the controller above it
+    for (auto&& path : { "/sys/class/net/" + device + "/device/numa_node",
+                         "/sys/block/" + device + "/device/numa_node",
+                         "/sys/block/" + device + "/device/device/numa_node" }) {
+        auto node = read_first_line(path);
+        if (node) {
+            auto n = boost::lexical_cast<int>(*node);
+            // -1 on machines without NUMA, or when firmware doesn't say
+            if (n < 0) {
+                return {};
+            }
+            return read_cpulist(sprint("/sys/devices/system/node/node%d/cpulist", n));
+        }
+    }
+    throw std::runtime_error(sprint("no NUMA information for device %s", device));
+}
+
 size_t calculate_memory(configuration c, size_t available_memory, float panic_factor = 1) {
     size_t default_reserve_memory = std::max<size_t>(1 << 30, 0.05 * available_memory) * panic_factor;
     auto reserve = c.reserve_memory.value_or(default_reserve_memory);
@@ -87,7 +154,6 @@ size_t calculate_memory(configuration c, size_t available_memory, float panic_fa
 #ifdef HAVE_HWLOC
 
 #include "util/defer.hh"
-#include "core/print.hh"
 #include <hwloc.h>
 #include <unordered_map>
 #include <boost/range/irange.hpp>
@@ -149,6 +215,47 @@ struct distribute_objects {
     }
 };
 
+// The first procs PUs when every core gets one before any gets a second,
+// so that SMT siblings, which share a core's execution units, are only
+// used once the cores run out. Consecutive cores alternate between NUMA
+// nodes, so that each node gets its share when only some cores are used.
+static std::vector<unsigned> cores_first(hwloc_topology_t& topology, unsigned procs) {
+    unsigned depth = find_memory_depth(topology);
+    std::vector<std::vector<hwloc_obj_t>> node_cores;
+    std::unordered_map<hwloc_obj_t, size_t> node_index;
+    int nr_cores = hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_CORE);
+    for (int i = 0; i < nr_cores; ++i) {
+        auto core = hwloc_get_obj_by_type(topology, HWLOC_OBJ_CORE, i);
+        auto node = hwloc_get_ancestor_obj_by_depth(topology, depth, core);
+        auto idx = node_index.emplace(node, node_cores.size()).first->second;
+        if (idx == node_cores.size()) {
+            node_cores.emplace_back();
+        }
+        node_cores[idx].push_back(core);
+    }
+    std::vector<hwloc_obj_t> cores;
+    for (size_t i = 0; cores.size() < size_t(std::max(nr_cores, 0)); ++i) {
+        for (auto&& nc : node_cores) {
+            if (i < nc.size()) {
+                cores.push_back(nc[i]);
+            }
+        }
+    }
+    std::vector<unsigned> ret;
+    bool found = true;
+    for (unsigned sibling = 0; found && ret.size() < procs; ++sibling) {
+        found = false;
+        for (auto core : cores) {
+            auto pu = hwloc_get_obj_inside_cpuset_by_type(topology, core->cpuset, HWLOC_OBJ_PU, sibling);
+            if (pu && ret.size() < procs) {
+                ret.push_back(pu->os_index);
+                found = true;
+            }
+        }
+    }
+    return ret;
+}
+
 static io_queue_topology
 allocate_io_queues(hwloc_topology_t& topology, configuration c, std::vector<cpu> cpus) {
     unsigned num_io_queues = c.io_queues.value_or(cpus.size());
@@ -280,16 +387,29 @@ resources allocate(configuration c) {
     size_t remain;
     unsigned depth = find_memory_depth(topology);
 
-    auto cpu_sets = distribute_objects(topology, procs);
+    std::vector<unsigned> cpu_ids;
+    if (c.cpu_placement == placement::cores) {
+        cpu_ids = cores_first(topology, procs);
+    }
+    // Also when hwloc doesn't know about cores
+    if (cpu_ids.size() < procs) {
+        cpu_ids.clear();
+        auto cpu_sets = distribute_objects(topology, procs);
+        for (auto&& cs : cpu_sets()) {
+            auto cpu_id = hwloc_bitmap_first(cs);
+            assert(cpu_id != -1);
+            cpu_ids.push_back(cpu_id);
+        }
+    }
 
     // Divide local memory to cpus
-    for (auto&& cs : cpu_sets()) {
-        auto cpu_id = hwloc_bitmap_first(cs);
-        assert(cpu_id != -1);
+    for (auto cpu_id : cpu_ids) {
         auto pu = hwloc_get_pu_obj_by_os_index(topology, cpu_id);
         auto node = hwloc_get_ancestor_obj_by_depth(topology, depth, pu);
+        auto core = hwloc_get_ancestor_obj_by_type(topology, HWLOC_OBJ_CORE, pu);
         cpu this_cpu;
         this_cpu.cpu_id = cpu_id;
+        this_cpu.core_id = core ? core->logical_index : cpu_id;
         remain = mem_per_proc - alloc_from_node(this_cpu, node, topo_used_mem, mem_per_proc);
 
         remains.emplace_back(std::move(this_cpu), remain);
@@ -364,9 +484,16 @@ resources allocate(configuration c) {
     auto mem = calculate_memory(c, available_memory);
     auto cpuset_procs = c.cpu_set ? c.cpu_set->size() : nr_processing_units();
     auto procs = c.cpus.value_or(cpuset_procs);
+    // Without hwloc there are no cores to tell apart, and cpu_placement
+    // has no effect; the cpu set is still honoured.
+    auto next_cpu = c.cpu_set ? c.cpu_set->begin() : cpuset::const_iterator();
     ret.cpus.reserve(procs);
     for (unsigned i = 0; i < procs; ++i) {
-        ret.cpus.push_back(cpu{i, {{mem / procs, 0}}});
+        unsigned cpu_id = i;
+        if (c.cpu_set && next_cpu != c.cpu_set->end()) {
+            cpu_id = *next_cpu++;
+        }
+        ret.cpus.push_back(cpu{cpu_id, {{mem / procs, 0}}, cpu_id});
     }
 
     ret.io_queues = allocate_io_queues(c, ret.cpus);
@@ -38,6 +38,12 @@ using std::experimental::optional;
 
 using cpuset = std::set<unsigned>;
 
+// How shards are placed on the processing units of cpu_set
+enum class placement {
+    spread,     // as hwloc distributes them across the topology
+    cores,      // one per physical core before any core gets an SMT sibling
+};
+
 struct configuration {
     optional<size_t> total_memory;
     optional<size_t> reserve_memory;  // if total_memory not specified
@@ -45,6 +51,7 @@ struct configuration {
     optional<cpuset> cpu_set;
     optional<unsigned> max_io_requests;
     optional<unsigned> io_queues;
+    placement cpu_placement = placement::spread;
 };
 
 struct memory {
@@ -69,6 +76,7 @@ struct io_queue_topology {
 struct cpu {
     unsigned cpu_id;
     std::vector<memory> mem;
+    unsigned core_id;
 };
 
 struct resources {
@@ -77,6 +85,16 @@ struct resources {
 };
 
 resources allocate(configuration c);
+
+// Parses a cpuset(7) list, such as 0-3,8
+optional<cpuset> parse_cpuset(const std::string& s);
+// The CPUs the interrupts of the network interfaces are pinned to, or
+// none when they are allowed on every CPU
+cpuset nic_irq_cpus();
+// The CPUs of the NUMA node of a network interface or block device, or
+// none when it has no NUMA affinity
+cpuset device_cpus(const std::string& device);
+
 unsigned nr_processing_units();
 }
 
@@ -39,6 +39,7 @@ class scattered_message {
     packet _p;
 public:
     scattered_message() {}
+    explicit scattered_message(packet p) : _p(std::move(p)) {}
     scattered_message(scattered_message&&) = default;
     scattered_message(const scattered_message&) = delete;
 
@@ -0,0 +1,70 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB.
+ */
+
+#pragma once
+
+/// \file
+
+class reactor;
+class scheduling_group;
+
+/// \cond internal
+extern __thread unsigned g_current_scheduling_group;
+/// \endcond
+
+/// \brief Identifies a group of tasks that share CPU time.
+///
+/// Every reactor keeps a separate task queue for each scheduling group, and
+/// divides CPU time between the non-empty queues in proportion to their
+/// shares, the same way \ref fair_queue divides disk bandwidth between
+/// I/O priority classes. A task belongs to the group that was current when
+/// it was created, so continuations attached inside a group stay in it.
+///
+/// Groups are created with \ref create_scheduling_group() and entered with
+/// \ref with_scheduling_group().
+class scheduling_group {
+    unsigned _id;
+private:
+    explicit scheduling_group(unsigned id) : _id(id) {}
+public:
+    /// Maximum number of scheduling groups, including the default one.
+    static constexpr unsigned max_groups = 16;
+    /// Creates a handle to the default scheduling group.
+    scheduling_group() : _id(0) {}
+    unsigned id() const { return _id; }
+    bool operator==(scheduling_group x) const { return _id == x._id; }
+    bool operator!=(scheduling_group x) const { return _id != x._id; }
+    friend class reactor;
+    friend scheduling_group current_scheduling_group();
+};
+
+/// Returns the scheduling group of the currently running task.
+inline
+scheduling_group current_scheduling_group() {
+    return scheduling_group(g_current_scheduling_group);
+}
+
+/// Returns the default scheduling group, which runs everything that was
+/// not explicitly placed elsewhere.
+inline
+scheduling_group default_scheduling_group() {
+    return scheduling_group();
+}
@@ -41,6 +41,7 @@ class impl {
     ipv4_addr _addr = default_addr;
     std::chrono::milliseconds _period = default_period;
     uint64_t _num_packets = 0;
+    uint64_t _send_failures = 0;
     uint64_t _millis = 0;
     uint64_t _bytes = 0;
     double _avg = 0;
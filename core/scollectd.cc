@@ -33,6 +33,9 @@
 #include "scollectd_api.hh"
 #include "core/metrics_api.hh"
 #include "core/byteorder.hh"
+#include "core/sleep.hh"
+#include <boost/iterator/counting_iterator.hpp>
+#include <boost/range/irange.hpp>
 
 bool scollectd::type_instance_id::operator<(
         const scollectd::type_instance_id& id2) const {
@@ -75,7 +78,11 @@ seastar::metrics::impl::metric_id to_metrics_id(const type_instance_id & id) {
 
 const plugin_instance_id per_cpu_plugin_instance("#cpu");
 
-static const size_t payload_size = 1024;
+// The most collectd receives in a packet by default, which fits an
+// ethernet MTU
+static const size_t payload_size = 1452;
+// Packets sent back to back, when the values of a period are spread over it
+static const size_t packets_per_burst = 16;
 
 enum class part_type : uint16_t {
     Host = 0x0000, // The name of the host to associate with subsequent data values
@@ -109,9 +116,14 @@ struct cpwriter {
     bool _overflow = false;
 
     std::unordered_map<uint16_t, sstring> _cache;
+    // The time of the values written, which is put once per packet
+    uint64_t _time;
+    bool _time_written = false;
 
     cpwriter()
-            : _pos(_buf.begin()) {
+            : _pos(_buf.begin())
+            , _time(std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count()) {
     }
     mark_type mark() const {
         return _pos;
@@ -132,6 +144,7 @@ struct cpwriter {
     void clear() {
         reset(_buf.begin());
         _cache.clear();
+        _time_written = false;
         _overflow = false;
     }
     const char * data() const {
@@ -242,12 +255,11 @@ struct cpwriter {
         return *this;
     }
     cpwriter & put(const sstring & host, const seastar::metrics::impl::metric_id & id) {
-        const auto ts = std::chrono::system_clock::now().time_since_epoch();
-        const auto lrts =
-                std::chrono::duration_cast<std::chrono::seconds>(ts).count();
-
         put_cached(part_type::Host, host);
-        put(part_type::Time, uint64_t(lrts));
+        if (!_time_written) {
+            put(part_type::Time, _time);
+            _time_written = true;
+        }
         // Seems hi-res timestamp does not work very well with
         // at the very least my default collectd in fedora (or I did it wrong?)
         // Use lo-res ts for now, it is probably quite sufficient.
@@ -339,6 +351,12 @@ void impl::start(const sstring & host, const ipv4_addr & addr, const duration pe
                         "total_requests"),
                 make_typed(data_type::DERIVE, _num_packets)
         ),
+        // total_requests:failed      value:DERIVE:0:U
+        add_polled_metric(
+                type_instance_id("scollectd", per_cpu_plugin_instance,
+                        "total_requests", "failed"),
+                make_typed(data_type::DERIVE, _send_failures)
+        ),
         // latency          value:GAUGE:0:U
         add_polled_metric(
                 type_instance_id("scollectd", per_cpu_plugin_instance,
@@ -382,61 +400,68 @@ void impl::arm() {
 }
 
 void impl::run() {
-    typedef seastar::metrics::impl::values_copy::iterator iterator;
-    typedef std::tuple<iterator, cpwriter> context;
-
-    auto ctxt = make_lw_shared<context>();
-    auto vals =  make_lw_shared<seastar::metrics::impl::values_copy>(seastar::metrics::impl::get_values());
-
-    // note we're doing this unsynced since we assume
-    // all registrations to this instance will be done on the
-    // same cpu, and without interuptions (no wait-states)
-    std::get<iterator>(*ctxt) = vals->begin();
-
-    auto stop_when = [this, ctxt, vals]() {
-        auto done = std::get<iterator>(*ctxt) == vals->end();
-        return done;
-    };
-    // append as many values as we can fit into a packet (1024 bytes)
-    auto send_packet = [this, ctxt, vals]() {
-        auto start = steady_clock_type::now();
-        auto & i = std::get<iterator>(*ctxt);
-        auto & out = std::get<cpwriter>(*ctxt);
-
+    auto start = steady_clock_type::now();
+    // Pack the values into as few packets as they fit in, in one pass
+    auto packets = make_lw_shared<std::vector<net::packet>>();
+    cpwriter out;
+    auto flush = [&] {
+        if (!out.empty()) {
+            packets->emplace_back(out.data(), out.size());
+        }
         out.clear();
-
-        while (i != vals->end()) {
-            auto m = out.mark();
-            out.put(_host, _period, i->first, i->second);
+    };
+    for (auto& v : seastar::metrics::impl::get_values()) {
+        if (v.second.type() == data_type::HISTOGRAM) {
+            // the collectd protocol has no histogram type
+            continue;
+        }
+        auto m = out.mark();
+        out.put(_host, _period, v.first, v.second);
+        if (!out) {
+            out.reset(m);
+            flush();
+            out.put(_host, _period, v.first, v.second);
             if (!out) {
-                out.reset(m);
-                break;
+                // Does not fit a packet of its own
+                out.clear();
             }
-            ++i;
         }
-        if (out.empty()) {
-            return make_ready_future();
-        }
-        return _chan.send(_addr, net::packet(out.data(), out.size())).then([start, ctxt, this]() {
-                    auto & out = std::get<cpwriter>(*ctxt);
-                    auto now = steady_clock_type::now();
-                    // dogfood stats
-                    ++_num_packets;
-                    _millis += std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
-                    _bytes += out.size();
-                    _avg = double(_millis) / _num_packets;
-                }).then_wrapped([] (auto&& f) {
+    }
+    flush();
+
+    // Send the packets in bursts spread over half the period, rather than
+    // all at once, which can overrun the receiver's socket buffer
+    auto bursts = (packets->size() + packets_per_burst - 1) / packets_per_burst;
+    auto gap = bursts > 1 ? _period / 2 / int64_t(bursts - 1) : duration();
+    do_for_each(boost::counting_iterator<size_t>(0), boost::counting_iterator<size_t>(bursts), [this, packets, gap] (size_t b) {
+        auto f = b ? sleep(gap) : make_ready_future();
+        return f.then([this, packets, b] {
+            auto first = b * packets_per_burst;
+            auto last = std::min(first + packets_per_burst, packets->size());
+            return parallel_for_each(boost::irange(first, last), [this, packets] (size_t i) {
+                auto& p = (*packets)[i];
+                auto size = p.len();
+                auto sent = steady_clock_type::now();
+                return _chan.send(_addr, std::move(p)).then_wrapped([this, size, sent] (auto&& f) {
                     try {
                         f.get();
-                    } catch (std::exception & ex) {
-                        std::cout << "send failed: " << ex.what() << std::endl;
+                        // dogfood stats
+                        ++_num_packets;
+                        _millis += std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock_type::now() - sent).count();
+                        _bytes += size;
+                        _avg = double(_millis) / _num_packets;
                     } catch (...) {
-                        std::cout << "send failed: - unknown exception" << std::endl;
+                        ++_send_failures;
+                        static thread_local seastar::logger::rate_limit rl(std::chrono::seconds(10));
+                        logger.warn(rl, "send failed: {}", std::current_exception());
                     }
                 });
-    };
-    do_until(stop_when, send_packet).finally([this]() {
-        arm();
+            });
+        });
+    }).finally([this, start] {
+        if (_period != duration()) {
+            _timer.arm(start + _period);
+        }
     });
 }
 
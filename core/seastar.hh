@@ -43,6 +43,7 @@
 
 #include "sstring.hh"
 #include "future.hh"
+#include <vector>
 
 // iostream.hh
 template <class CharType> class input_stream;
@@ -170,6 +171,27 @@ future<file> open_file_dma(sstring name, open_flags flags);
 /// \relates file
 future<file> open_file_dma(sstring name, open_flags flags, file_open_options options);
 
+/// Opens or creates many files at once.
+///
+/// Equivalent to calling \ref open_file_dma() for each name, but the files
+/// are opened in batches on the syscall threads, so opening many files
+/// costs a few round trips instead of one per file.
+///
+/// \param names  the names of the files to open or create
+/// \param flags various flags controlling the open process
+/// \param options options for opening the files
+/// \return the \ref file objects, in the order of \c names.  If any file
+///         fails to open the future fails with that error, and the files
+///         that did open are closed.
+///
+/// \relates file
+future<std::vector<file>> open_files_dma(std::vector<sstring> names, open_flags flags, file_open_options options);
+
+/// Opens or creates many files at once, with default options.
+///
+/// \relates file
+future<std::vector<file>> open_files_dma(std::vector<sstring> names, open_flags flags);
+
 /// Checks if a given directory supports direct io
 ///
 /// Seastar bypasses the Operating System caches and issues direct io to the
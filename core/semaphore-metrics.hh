@@ -0,0 +1,53 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "semaphore.hh"
+#include "metrics_registration.hh"
+#include "metrics.hh"
+
+/// Registers the counters of \c sem (see \ref basic_semaphore::stats()) in
+/// \c group, as metrics whose names start with \c prefix, along with the
+/// current number of waiters and available units.  \c sem must outlive
+/// \c mg.
+template <typename ExceptionFactory>
+void add_semaphore_metrics(seastar::metrics::metric_groups& mg, const seastar::metrics::group_name_type& group,
+        const sstring& prefix, const basic_semaphore<ExceptionFactory>& sem) {
+    namespace sm = seastar::metrics;
+    mg.add_group(group, {
+        sm::make_derive(prefix + "_waits", [&sem] { return sem.stats().waits; },
+                sm::description("Counts waits on the semaphore")),
+        sm::make_derive(prefix + "_blocked_waits", [&sem] { return sem.stats().blocked_waits; },
+                sm::description("Counts waits on the semaphore that had to queue")),
+        sm::make_derive(prefix + "_timeouts", [&sem] { return sem.stats().timeouts; },
+                sm::description("Counts queued waits on the semaphore that timed out")),
+        sm::make_derive(prefix + "_wait_time_us", [&sem] {
+                    return std::chrono::duration_cast<std::chrono::microseconds>(sem.stats().time_waited).count();
+                }, sm::description("Total time spent queued on the semaphore, in microseconds")),
+        sm::make_gauge(prefix + "_max_waiters", [&sem] { return sem.stats().max_waiters; },
+                sm::description("Longest the semaphore's queue has been")),
+        sm::make_queue_length(prefix + "_waiters", [&sem] { return sem.waiters(); },
+                sm::description("Waits currently queued on the semaphore")),
+        sm::make_gauge(prefix + "_available", [&sem] { return sem.available_units(); },
+                sm::description("Units currently available in the semaphore")),
+    });
+}
@@ -26,6 +26,8 @@
 #include "chunked_fifo.hh"
 #include <stdexcept>
 #include <exception>
+#include <vector>
+#include <algorithm>
 #include "timer.hh"
 #include "expiring_fifo.hh"
 
@@ -67,6 +69,38 @@ struct semaphore_default_exception_factory {
     }
 };
 
+/// \brief Allocation-free semaphore waiter.
+///
+/// For internal paths that wait on a semaphore often, such as bounded
+/// queues, the object that waits can implement this interface and be passed
+/// to \ref basic_semaphore::wait(semaphore_waiter&, size_t) instead of
+/// chaining a continuation to a future.  It is resumed by a direct call
+/// rather than by a task.
+class semaphore_waiter {
+public:
+    virtual ~semaphore_waiter() {}
+    /// Called when the units were taken.  Runs inside
+    /// \ref basic_semaphore::wait() or \ref basic_semaphore::signal(),
+    /// so it should be short; it may wait on or signal the semaphore again.
+    virtual void wake() noexcept = 0;
+    /// Called instead of \ref wake() if the semaphore was broken.
+    virtual void fail(std::exception_ptr ex) noexcept = 0;
+};
+
+/// Counters kept by every \ref basic_semaphore; see \ref basic_semaphore::stats().
+struct semaphore_stats {
+    /// Calls to wait(), including those that did not have to wait.
+    uint64_t waits = 0;
+    /// Calls to wait() that had to queue.
+    uint64_t blocked_waits = 0;
+    /// Queued waits that timed out.
+    uint64_t timeouts = 0;
+    /// Total time spent in the queue by waits that left it.
+    std::chrono::steady_clock::duration time_waited = {};
+    /// Longest the queue has been.
+    size_t max_waiters = 0;
+};
+
 /// \brief Counted resource guard.
 ///
 /// This is a standard computer science semaphore, adapted
@@ -94,17 +128,40 @@ class basic_semaphore {
 private:
     ssize_t _count;
     std::exception_ptr _ex;
+    semaphore_stats _stats;
+    bool _batched_wakeups = false;
+    // Promises released by one signal() in batched mode; kept to reuse
+    // its storage.
+    std::vector<promise<>> _released;
     struct entry {
         promise<> pr;
         size_t nr;
-        entry(promise<>&& pr_, size_t nr_) : pr(std::move(pr_)), nr(nr_) {}
+        semaphore_waiter* waiter = nullptr;
+        clock::time_point enqueued;
+        semaphore_stats* stats;
+        entry(promise<>&& pr_, size_t nr_, semaphore_stats* s)
+            : pr(std::move(pr_)), nr(nr_), enqueued(clock::now()), stats(s) {}
+        entry(semaphore_waiter* w, size_t nr_, semaphore_stats* s)
+            : nr(nr_), waiter(w), enqueued(clock::now()), stats(s) {}
     };
     struct expiry_handler {
         void operator()(entry& e) noexcept {
-            e.pr.set_exception(ExceptionFactory::timeout());
+            ++e.stats->timeouts;
+            e.stats->time_waited += clock::now() - e.enqueued;
+            if (e.waiter) {
+                e.waiter->fail(std::make_exception_ptr(ExceptionFactory::timeout()));
+            } else {
+                e.pr.set_exception(ExceptionFactory::timeout());
+            }
         }
     };
-    expiring_fifo<entry, expiry_handler, clock> _wait_list;
+    // Waits usually share one timeout, so one timer serves all of them
+    expiring_fifo<entry, expiry_handler, clock, expiry_timers::shared> _wait_list;
+    void note_blocked() {
+        ++_stats.blocked_waits;
+        _stats.max_waiters = std::max(_stats.max_waiters, _wait_list.size());
+    }
+    void wake_batch();
     bool has_available_units(size_t nr) const {
         return _count >= 0 && (static_cast<size_t>(_count) >= nr);
     }
@@ -150,6 +207,7 @@ class basic_semaphore {
     ///         \ref semaphore_timed_out exception.  If the semaphore was
     ///         \ref broken(), may contain an exception.
     future<> wait(time_point timeout, size_t nr = 1) {
+        ++_stats.waits;
         if (may_proceed(nr)) {
             _count -= nr;
             return make_ready_future<>();
@@ -159,7 +217,8 @@ class basic_semaphore {
         }
         promise<> pr;
         auto fut = pr.get_future();
-        _wait_list.push_back(entry(std::move(pr), nr), timeout);
+        _wait_list.push_back(entry(std::move(pr), nr, &_stats), timeout);
+        note_blocked();
         return fut;
     }
 
@@ -179,6 +238,31 @@ class basic_semaphore {
     future<> wait(duration timeout, size_t nr = 1) {
         return wait(clock::now() + timeout, nr);
     }
+    /// Waits until at least a specific number of units are available in the
+    /// counter, and reduces the counter by that amount of units, without
+    /// allocating a promise, future or continuation.
+    ///
+    /// \ref semaphore_waiter::wake() is called when the units are taken:
+    /// immediately, from within this call, if they are available, and
+    /// otherwise from within the \ref signal() that makes them available.
+    /// Waiters queue in FIFO order together with \ref wait() callers.
+    ///
+    /// \param w waiter to notify; must stay alive until notified.
+    /// \param nr Amount of units to wait for (default 1).
+    void wait(semaphore_waiter& w, size_t nr = 1) {
+        ++_stats.waits;
+        if (may_proceed(nr)) {
+            _count -= nr;
+            w.wake();
+            return;
+        }
+        if (_ex) {
+            w.fail(_ex);
+            return;
+        }
+        _wait_list.push_back(entry(&w, nr, &_stats));
+        note_blocked();
+    }
     /// Deposits a specified number of units into the counter.
     ///
     /// The counter is incremented by the specified number of units.
@@ -193,9 +277,20 @@ class basic_semaphore {
             return;
         }
         _count += nr;
+        if (_batched_wakeups) {
+            wake_batch();
+            return;
+        }
         while (!_wait_list.empty() && has_available_units(_wait_list.front().nr)) {
             auto& x = _wait_list.front();
             _count -= x.nr;
+            _stats.time_waited += clock::now() - x.enqueued;
+            if (auto w = x.waiter) {
+                // Dequeue first; wake() may wait on this semaphore again.
+                _wait_list.pop_front();
+                w->wake();
+                continue;
+            }
             x.pr.set_value();
             _wait_list.pop_front();
         }
@@ -265,20 +360,65 @@ class basic_semaphore {
     /// The future is made available immediately.
     void broken(std::exception_ptr ex);
 
+    /// Counters of waits on this semaphore.
+    const semaphore_stats& stats() const { return _stats; }
+
+    /// Controls how \ref signal() wakes several waiters at once.
+    ///
+    /// By default each released waiter's continuation is queued behind the
+    /// tasks that are already runnable.  With batched wakeups, the waiters
+    /// released by one signal() run back to back, in FIFO order, right after
+    /// the task that signalled, while the state they share is still in
+    /// cache.  Useful for admission-control semaphores that release many
+    /// waiters at once.
+    void set_batched_wakeups(bool enable) { _batched_wakeups = enable; }
+
     /// Reserve memory for waiters so that wait() will not throw.
     void ensure_space_for_waiters(size_t n) {
         _wait_list.reserve(n);
     }
 };
 
+template<typename ExceptionFactory>
+inline
+void
+basic_semaphore<ExceptionFactory>::wake_batch() {
+    auto now = clock::now();
+    while (!_wait_list.empty() && has_available_units(_wait_list.front().nr)) {
+        auto& x = _wait_list.front();
+        _count -= x.nr;
+        _stats.time_waited += now - x.enqueued;
+        if (auto w = x.waiter) {
+            _wait_list.pop_front();
+            w->wake();
+            continue;
+        }
+        _released.push_back(std::move(x.pr));
+        _wait_list.pop_front();
+    }
+    // Urgent tasks go to the front of the queue, so release the last
+    // waiter first.
+    for (auto i = _released.rbegin(); i != _released.rend(); ++i) {
+        i->set_urgent_value(std::tuple<>());
+    }
+    _released.clear();
+}
+
 template<typename ExceptionFactory>
 inline
 void
 basic_semaphore<ExceptionFactory>::broken(std::exception_ptr xp) {
     _ex = xp;
     _count = 0;
+    auto now = clock::now();
     while (!_wait_list.empty()) {
         auto& x = _wait_list.front();
+        _stats.time_waited += now - x.enqueued;
+        if (auto w = x.waiter) {
+            _wait_list.pop_front();
+            w->fail(xp);
+            continue;
+        }
         x.pr.set_exception(xp);
         _wait_list.pop_front();
     }
@@ -0,0 +1,180 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "reactor.hh"
+#include "semaphore.hh"
+#include "circular_buffer.hh"
+#include <experimental/optional>
+#include <vector>
+
+namespace seastar {
+
+/// \addtogroup smp-module
+/// @{
+
+/// A bounded stream of items from one shard to another.
+///
+/// The producer shard calls \ref push_eventually() and finally \ref close();
+/// the consumer shard, on which the channel is created and destroyed, calls
+/// \ref pop_eventually() until it returns a disengaged optional.  Each side
+/// only touches its own half of the object, so the two shards never share
+/// a cache line on the fast path.
+///
+/// Items are moved, never copied, and travel in batches: while one batch
+/// is on its way to the consumer, pushed items accumulate into the next,
+/// so a busy stream costs a cross-shard message per batch rather than per
+/// item.  Flow control is credit based: the producer may have at most
+/// \c capacity items that the consumer has not popped, and the consumer
+/// returns credits in bulk.  Buffers such as \ref temporary_buffer can be
+/// sent as is; memory freed on the consumer shard is returned to the
+/// producer's allocator.
+///
+/// The channel may be destroyed once \ref close() resolved and
+/// \ref pop_eventually() returned end of stream.
+template <typename T>
+class shard_channel {
+    static_assert(std::is_nothrow_move_constructible<T>::value, "items must be nothrow move constructible");
+    const unsigned _producer_shard;
+    const unsigned _consumer_shard;
+    const size_t _capacity;
+    // Producer side.
+    semaphore _credits;
+    std::vector<T> _batch;
+    bool _sending = false;
+    bool _closing = false;
+    promise<> _closed;
+    // Consumer side.
+    circular_buffer<T> _items;
+    std::experimental::optional<promise<>> _not_empty;
+    size_t _unreturned = 0;
+    bool _eof = false;
+    future<> _credits_returned = make_ready_future<>();
+private:
+    void maybe_send();
+    void deliver(std::vector<T> batch, bool eof);
+    void return_credits();
+public:
+    /// Creates a channel, on the consumer's shard, for items pushed from
+    /// \c producer_shard.
+    ///
+    /// \param capacity items that may be in flight or waiting to be popped
+    shard_channel(unsigned producer_shard, size_t capacity)
+        : _producer_shard(producer_shard)
+        , _consumer_shard(engine().cpu_id())
+        , _capacity(capacity)
+        , _credits(capacity) {
+        assert(capacity > 0);
+    }
+    shard_channel(const shard_channel&) = delete;
+    shard_channel(shard_channel&&) = delete;
+
+    /// Pushes \c item, waiting for credit if \c capacity items are
+    /// outstanding.  Call on the producer shard; pushes must not overlap
+    /// with \ref close().
+    future<> push_eventually(T&& item) {
+        return _credits.wait().then([this, item = std::move(item)] () mutable {
+            _batch.push_back(std::move(item));
+            maybe_send();
+        });
+    }
+
+    /// Ends the stream once the items pushed so far are delivered.  Call on
+    /// the producer shard, after the last push resolved.
+    future<> close() {
+        _closing = true;
+        auto f = _closed.get_future();
+        maybe_send();
+        return f;
+    }
+
+    /// Pops the next item, waiting for one if needed.  Call on the consumer
+    /// shard.
+    ///
+    /// \return the next item, or a disengaged optional at end of stream.
+    future<std::experimental::optional<T>> pop_eventually() {
+        if (!_items.empty()) {
+            auto item = std::move(_items.front());
+            _items.pop_front();
+            ++_unreturned;
+            // Return credits in bulk, but before the producer can run dry.
+            if (_items.empty() || _unreturned >= (_capacity + 1) / 2) {
+                return_credits();
+            }
+            return make_ready_future<std::experimental::optional<T>>(std::move(item));
+        }
+        if (_eof) {
+            // Nothing may be in flight to the producer once the stream ended.
+            return std::exchange(_credits_returned, make_ready_future<>()).then([] {
+                return std::experimental::optional<T>();
+            });
+        }
+        _not_empty = promise<>();
+        return _not_empty->get_future().then([this] {
+            return pop_eventually();
+        });
+    }
+};
+
+template <typename T>
+void shard_channel<T>::maybe_send() {
+    if (_sending || (_batch.empty() && !_closing)) {
+        return;
+    }
+    _sending = true;
+    bool eof = _closing;
+    smp::submit_to(_consumer_shard, [this, batch = std::exchange(_batch, {}), eof] () mutable {
+        deliver(std::move(batch), eof);
+    }).then([this, eof] {
+        _sending = false;
+        if (eof) {
+            _closed.set_value();
+        } else {
+            maybe_send();
+        }
+    });
+}
+
+template <typename T>
+void shard_channel<T>::deliver(std::vector<T> batch, bool eof) {
+    for (auto&& item : batch) {
+        _items.push_back(std::move(item));
+    }
+    _eof = eof;
+    if (_not_empty) {
+        _not_empty->set_value();
+        _not_empty = {};
+    }
+}
+
+template <typename T>
+void shard_channel<T>::return_credits() {
+    auto n = std::exchange(_unreturned, 0);
+    auto f = smp::submit_to(_producer_shard, [this, n] {
+        _credits.signal(n);
+    });
+    _credits_returned = when_all(std::move(_credits_returned), std::move(f)).discard_result();
+}
+
+/// @}
+
+}
@@ -163,20 +163,16 @@ class sharded {
     map_reduce(Reducer&& r, Ret (Service::*func)(FuncArgs...), Args&&... args)
         -> typename reducer_traits<Reducer>::future_type
     {
-        return ::map_reduce(boost::make_counting_iterator<unsigned>(0),
-                            boost::make_counting_iterator<unsigned>(_instances.size()),
-            [this, func, args = std::make_tuple(std::forward<Args>(args)...)] (unsigned c) mutable {
-                return smp::submit_to(c, [this, func, args] () mutable {
-                    return apply([this, func] (Args&&... args) mutable {
-                        auto inst = _instances[engine().cpu_id()].service;
-                        if (inst) {
-                            return ((*inst).*func)(std::forward<Args>(args)...);
-                        } else {
-                            throw no_sharded_instance_exception();
-                        }
-                    }, std::move(args));
-                });
-            }, std::forward<Reducer>(r));
+        return reduce_instances(map_instances([this, func, args = std::make_tuple(std::forward<Args>(args)...)] () mutable {
+                return apply([this, func] (Args&&... args) mutable {
+                    auto inst = _instances[engine().cpu_id()].service;
+                    if (inst) {
+                        return ((*inst).*func)(std::forward<Args>(args)...);
+                    } else {
+                        throw no_sharded_instance_exception();
+                    }
+                }, std::move(args));
+            }), std::forward<Reducer>(r));
     }
 
     /// Invoke a callable on all instances of `Service` and reduce the results using
@@ -187,14 +183,10 @@ class sharded {
     inline
     auto map_reduce(Reducer&& r, Func&& func) -> typename reducer_traits<Reducer>::future_type
     {
-        return ::map_reduce(boost::make_counting_iterator<unsigned>(0),
-                            boost::make_counting_iterator<unsigned>(_instances.size()),
-            [this, &func] (unsigned c) mutable {
-                return smp::submit_to(c, [this, func] () mutable {
-                    auto inst = get_local_service();
-                    return func(*inst);
-                });
-            }, std::forward<Reducer>(r));
+        return reduce_instances(map_instances([this, func] () mutable {
+                auto inst = get_local_service();
+                return func(*inst);
+            }), std::forward<Reducer>(r));
     }
 
     /// Applies a map function to all shards, then reduces the output by calling a reducer function.
@@ -217,16 +209,62 @@ class sharded {
     inline
     future<Initial>
     map_reduce0(Mapper map, Initial initial, Reduce reduce) {
-        auto wrapped_map = [this, map] (unsigned c) {
+        return map_instances([this, map] {
+            auto inst = get_local_service();
+            return map(*inst);
+        }).then([initial = std::move(initial), reduce = std::move(reduce)] (auto results) mutable {
+            for (auto&& result : results) {
+                initial = reduce(std::move(initial), std::move(result));
+            }
+            return std::move(initial);
+        });
+    }
+
+    /// Applies a map function to all shards, reducing the results as they
+    /// arrive rather than once all of them are in.
+    ///
+    /// Like \ref map_reduce0(), but \c reduce is applied to each result as
+    /// soon as it reaches the calling shard, in the order the shards finish,
+    /// so a large aggregate is built up in steps interleaved with other work
+    /// instead of in one pass at the end.  \c reduce must therefore be
+    /// commutative.
+    template <typename Mapper, typename Initial, typename Reduce>
+    inline
+    future<Initial>
+    map_reduce_streaming(Mapper map, Initial initial, Reduce reduce) {
+        return ::map_reduce(boost::irange<unsigned>(0, _instances.size()), [this, map] (unsigned c) {
             return smp::submit_to(c, [this, map] {
                 auto inst = get_local_service();
                 return map(*inst);
             });
-        };
-        return ::map_reduce(smp::all_cpus().begin(), smp::all_cpus().end(),
-                            std::move(wrapped_map),
-                            std::move(initial),
-                            std::move(reduce));
+        }, std::move(initial), std::move(reduce));
+    }
+
+    /// Applies a map function to all shards, then reduces the results
+    /// pairwise in a tree spanning the shards.
+    ///
+    /// Each shard reduces its own result with the result of half of the
+    /// shards above it, so the reduction work is spread over the shards
+    /// and takes log2(shards) steps; the calling shard only receives the
+    /// final value.  Useful when results are large, such as histograms to
+    /// merge.
+    ///
+    /// \param map callable with the signature `Value (Service&)` or
+    ///            `future<Value> (Service&)`; runs on every shard.
+    /// \param reduce binary function taking two `Value`s and returning a
+    ///               `Value`; copied to, and called on, any shard.  It must be
+    ///               associative; the left argument always comes from lower
+    ///               shards than the right one.
+    /// \return the reduction of the values of all shards.  `Value` must be
+    ///         safe to move between shards.
+    template <typename Mapper, typename Reduce,
+              typename Value = std::tuple_element_t<0, typename futurize_t<std::result_of_t<Mapper(Service&)>>::value_type>>
+    inline
+    future<Value>
+    map_reduce_tree(Mapper map, Reduce reduce) {
+        return smp::submit_to(0, [this, map = std::move(map), reduce = std::move(reduce)] () mutable {
+            return reduce_tree<Value>(0, _instances.size(), std::move(map), std::move(reduce));
+        });
     }
 
     /// Applies a map function to all shards, and return a vector of the result.
@@ -240,19 +278,9 @@ class sharded {
     /// \return  Result vector of applying `map` to each instance in parallel
     template <typename Mapper, typename return_type = std::result_of_t<Mapper(Service&)>>
     inline future<std::vector<return_type>> map(Mapper mapper) {
-        return do_with(std::vector<return_type>(),
-                [&mapper, this] (std::vector<return_type>& vec) mutable {
-            vec.resize(smp::count);
-            return parallel_for_each(boost::irange<unsigned>(0, _instances.size()), [this, &vec, mapper] (unsigned c) {
-                return smp::submit_to(c, [this, mapper] {
-                    auto inst = get_local_service();
-                    return mapper(*inst);
-                }).then([&vec, c] (auto res) {
-                    vec[c] = res;
-                });
-            }).then([&vec] {
-                return make_ready_future<std::vector<return_type>>(std::move(vec));
-            });
+        return map_instances([this, mapper] {
+            auto inst = get_local_service();
+            return mapper(*inst);
         });
     }
 
@@ -320,6 +348,78 @@ class sharded {
         }
         return inst;
     }
+
+    // Runs func on the shard of every instance.  A service started on all
+    // shards goes through smp::invoke_on_all(), which fans out one NUMA
+    // node at a time.
+    template <typename Func>
+    future<> invoke_on_instances(Func func) {
+        if (_instances.size() == smp::count) {
+            return smp::invoke_on_all(std::move(func));
+        }
+        return parallel_for_each(boost::irange<unsigned>(0, _instances.size()), [&func] (unsigned c) {
+            return smp::submit_to(c, Func(func));
+        });
+    }
+
+    // Like invoke_on_instances(), collecting the results by shard.
+    template <typename Func, typename Ret = std::tuple_element_t<0, typename futurize_t<std::result_of_t<Func()>>::value_type>>
+    future<std::vector<Ret>> map_instances(Func func) {
+        if (_instances.size() == smp::count) {
+            return smp::map_all(std::move(func));
+        }
+        return do_with(std::vector<Ret>(_instances.size()), [func = std::move(func)] (std::vector<Ret>& results) {
+            return parallel_for_each(boost::irange<unsigned>(0, results.size()), [&func, &results] (unsigned c) {
+                return smp::submit_to(c, Func(func)).then([&results, c] (Ret v) {
+                    results[c] = std::move(v);
+                });
+            }).then([&results] {
+                return std::move(results);
+            });
+        });
+    }
+
+    // Runs on shard lo; returns the reduction of the values of shards
+    // [lo, hi).  The upper half is reduced on shard mid while this shard
+    // reduces the lower half.
+    template <typename Value, typename Mapper, typename Reduce>
+    future<Value> reduce_tree(unsigned lo, unsigned hi, Mapper map, Reduce reduce) {
+        if (hi - lo == 1) {
+            using futurator = futurize<std::result_of_t<Mapper(Service&)>>;
+            return futurator::apply([this, &map] {
+                auto inst = get_local_service();
+                return map(*inst);
+            });
+        }
+        auto mid = lo + (hi - lo) / 2;
+        auto upper = smp::submit_to(mid, [this, mid, hi, map, reduce] () mutable {
+            return reduce_tree<Value>(mid, hi, std::move(map), std::move(reduce));
+        });
+        auto lower = reduce_tree<Value>(lo, mid, map, reduce);
+        return when_all(std::move(lower), std::move(upper)).then([reduce = std::move(reduce)] (std::tuple<future<Value>, future<Value>> results) mutable {
+            auto& lower = std::get<0>(results);
+            auto& upper = std::get<1>(results);
+            if (lower.failed()) {
+                upper.ignore_ready_future();
+                return make_exception_future<Value>(lower.get_exception());
+            }
+            if (upper.failed()) {
+                return make_exception_future<Value>(upper.get_exception());
+            }
+            return futurize<Value>::apply(reduce, lower.get0(), upper.get0());
+        });
+    }
+
+    template <typename Ret, typename Reducer>
+    static auto reduce_instances(future<std::vector<Ret>> results, Reducer&& r) -> typename reducer_traits<Reducer>::future_type {
+        return results.then([r = std::forward<Reducer>(r)] (std::vector<Ret> results) mutable {
+            return do_with(std::move(results), [r = std::move(r)] (std::vector<Ret>& results) mutable {
+                return ::map_reduce(results.begin(), results.end(), [] (Ret& v) {
+                    return make_ready_future<Ret>(std::move(v));
+                }, std::move(r));
+            });
+        });
+    }
 };
 
 template <typename Service>
@@ -398,11 +498,9 @@ template <typename... Args>
 inline
 future<>
 sharded<Service>::invoke_on_all(future<> (Service::*func)(Args...), Args... args) {
-    return parallel_for_each(boost::irange<unsigned>(0, _instances.size()), [this, func, args...] (unsigned c) {
-        return smp::submit_to(c, [this, func, args...] {
-            auto inst = get_local_service();
-            return ((*inst).*func)(args...);
-        });
+    return invoke_on_instances([this, func, args...] {
+        auto inst = get_local_service();
+        return ((*inst).*func)(args...);
     });
 }
 
@@ -411,11 +509,9 @@ template <typename... Args>
 inline
 future<>
 sharded<Service>::invoke_on_all(void (Service::*func)(Args...), Args... args) {
-    return parallel_for_each(boost::irange<unsigned>(0, _instances.size()), [this, func, args...] (unsigned c) {
-        return smp::submit_to(c, [this, func, args...] {
-            auto inst = get_local_service();
-            ((*inst).*func)(args...);
-        });
+    return invoke_on_instances([this, func, args...] {
+        auto inst = get_local_service();
+        ((*inst).*func)(args...);
     });
 }
 
@@ -426,11 +522,9 @@ future<>
 sharded<Service>::invoke_on_all(Func&& func) {
     static_assert(std::is_same<futurize_t<std::result_of_t<Func(Service&)>>, future<>>::value,
                   "invoke_on_all()'s func must return void or future<>");
-    return parallel_for_each(boost::irange<unsigned>(0, _instances.size()), [this, &func] (unsigned c) {
-        return smp::submit_to(c, [this, func] {
-            auto inst = get_local_service();
-            return func(*inst);
-        });
+    return invoke_on_instances([this, func] {
+        auto inst = get_local_service();
+        return func(*inst);
     });
 }
 
@@ -482,6 +576,10 @@ class foreign_ptr {
 private:
     PtrType _value;
     unsigned _cpu;
+    struct foreign_pointee final : foreign_destructible {
+        PtrType ptr;
+        explicit foreign_pointee(PtrType p) : ptr(std::move(p)) {}
+    };
 private:
     bool on_origin() {
         return engine().cpu_id() == _cpu;
@@ -507,11 +605,12 @@ class foreign_ptr {
     /// Moves a \c foreign_ptr<> to another object.
     foreign_ptr(foreign_ptr&& other) = default;
     /// Destroys the wrapped object on its original cpu.
+    ///
+    /// The objects released on one shard during a poll are sent to each
+    /// original cpu in one message.
     ~foreign_ptr() {
         if (_value && !on_origin()) {
-            smp::submit_to(_cpu, [v = std::move(_value)] () mutable {
-                auto local(std::move(v));
-            });
+            engine().destroy_on(_cpu, std::make_unique<foreign_pointee>(std::move(_value)));
         }
     }
     /// Accesses the wrapped object.
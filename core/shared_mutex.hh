@@ -22,7 +22,7 @@
 #pragma once
 
 #include "future.hh"
-#include "circular_buffer.hh"
+#include "small_circular_buffer.hh"
 
 namespace seastar {
 
@@ -54,7 +54,7 @@ class shared_mutex {
         promise<> pr;
         bool for_write;
     };
-    circular_buffer<waiter> _waiters;
+    small_circular_buffer<waiter, 4> _waiters;
 public:
     shared_mutex() = default;
     shared_mutex(shared_mutex&&) = default;
@@ -38,6 +38,21 @@ static constexpr uint16_t SLAB_MAGIC_NUMBER = 0x51AB; // meant to be 'SLAB' :-)
 
 namespace bi = boost::intrusive;
 
+/*
+ * How items, and with the reclaimer, slab pages, are chosen for eviction.
+ * - lru: items are moved to the front of their slab class' LRU list
+ *   whenever they are referenced.
+ * - clock: a reference only sets a bit on the item, and lists are only
+ *   relinked when looking for a victim: the oldest item is evicted unless
+ *   referenced since it was last looked at, or in use, in which case its
+ *   bit is cleared and it goes to the front. This keeps the hit path from
+ *   dirtying list links on read-heavy workloads.
+ */
+enum class slab_eviction_policy {
+    lru,
+    clock,
+};
+
 /*
  * Item requirements
  * - Extend it to slab_item_base.
@@ -127,6 +142,8 @@ struct slab_page_desc {
 
 class slab_item_base {
     bi::list_member_hook<> _lru_link;
+    // Referenced since the clock hand last passed; used by the clock policy.
+    bool _referenced = false;
 
     template<typename Item>
     friend class slab_class;
@@ -143,6 +160,11 @@ class slab_class {
         &slab_item_base::_lru_link>> _lru;
     size_t _size; // size of objects
     uint8_t _slab_class_id;
+    slab_eviction_policy _policy;
+    struct stats {
+        uint64_t references = 0;
+        uint64_t evictions = 0;
+    } _stats;
 private:
     template<typename... Args>
     inline
@@ -152,25 +174,46 @@ class slab_class {
         return new_item;
     }
 
+    // Under the clock policy, items in use stay in the list, so the hand
+    // passes them over too. Two turns clear every bit, so give up then.
+    slab_item_base* clock_sweep() {
+        for (auto n = 2 * _lru.size(); n; n--) {
+            auto& candidate = _lru.back();
+            if (!candidate._referenced && reinterpret_cast<Item&>(candidate).is_unlocked()) {
+                return &candidate;
+            }
+            candidate._referenced = false;
+            _lru.pop_back();
+            _lru.push_front(candidate);
+        }
+        return nullptr;
+    }
+
     inline
     std::pair<void *, uint32_t> evict_lru_item(std::function<void (Item& item_ref)>& erase_func) {
         if (_lru.empty()) {
             return { nullptr, 0U };
         }
 
-        Item& victim = reinterpret_cast<Item&>(_lru.back());
+        auto victim_base = _policy == slab_eviction_policy::clock ? clock_sweep() : &_lru.back();
+        if (!victim_base) {
+            return { nullptr, 0U };
+        }
+        Item& victim = reinterpret_cast<Item&>(*victim_base);
         uint32_t index = victim.get_slab_page_index();
         assert(victim.is_unlocked());
-        _lru.erase(_lru.iterator_to(reinterpret_cast<slab_item_base&>(victim)));
+        _lru.erase(_lru.iterator_to(*victim_base));
+        _stats.evictions++;
         // WARNING: You need to make sure that erase_func will not release victim back to slab.
         erase_func(victim);
 
         return { reinterpret_cast<void*>(&victim), index };
     }
 public:
-    slab_class(size_t size, uint8_t slab_class_id)
+    slab_class(size_t size, uint8_t slab_class_id, slab_eviction_policy policy)
         : _size(size)
         , _slab_class_id(slab_class_id)
+        , _policy(policy)
     {
     }
     slab_class(slab_class&&) = default;
@@ -191,6 +234,18 @@ class slab_class {
         return _lru.empty();
     }
 
+    uint8_t slab_class_id() const {
+        return _slab_class_id;
+    }
+
+    uint64_t references() const {
+        return _stats.references;
+    }
+
+    uint64_t evictions() const {
+        return _stats.evictions;
+    }
+
     template<typename... Args>
     Item *create(Args&&... args) {
         assert(!_free_slab_pages.empty());
@@ -225,7 +280,10 @@ class slab_class {
             throw std::bad_alloc{};
         }
 
-        _free_slab_pages.push_front(*desc);
+        // A page holding a single object has none left once this returns.
+        if (!desc->empty()) {
+            _free_slab_pages.push_front(*desc);
+        }
         insert_slab_page_desc(*desc);
 
         // first object from the allocated slab page is returned.
@@ -253,20 +311,44 @@ class slab_class {
 
     void touch_item(Item *item) {
         auto& item_ref = reinterpret_cast<slab_item_base&>(*item);
+        if (_policy == slab_eviction_policy::clock) {
+            item_ref._referenced = true;
+            return;
+        }
         _lru.erase(_lru.iterator_to(item_ref));
         _lru.push_front(item_ref);
     }
 
-    void remove_item_from_lru(Item *item) {
+    // An item in use can't be evicted. The LRU policy takes it off the
+    // list until it is unlocked; the clock policy only marks it referenced
+    // and has the hand skip it while it is locked.
+    void lock_item(Item *item) {
+        _stats.references++;
         auto& item_ref = reinterpret_cast<slab_item_base&>(*item);
+        if (_policy == slab_eviction_policy::clock) {
+            item_ref._referenced = true;
+            return;
+        }
         _lru.erase(_lru.iterator_to(item_ref));
     }
 
-    void insert_item_into_lru(Item *item) {
+    void unlock_item(Item *item) {
+        if (_policy == slab_eviction_policy::clock) {
+            return;
+        }
         auto& item_ref = reinterpret_cast<slab_item_base&>(*item);
         _lru.push_front(item_ref);
     }
 
+    void note_eviction() {
+        _stats.evictions++;
+    }
+
+    void remove_item_from_lru(Item *item) {
+        auto& item_ref = reinterpret_cast<slab_item_base&>(*item);
+        _lru.erase(_lru.iterator_to(item_ref));
+    }
+
     void remove_desc_from_free_list(slab_page_desc& desc) {
         assert(desc.slab_class_id() == _slab_class_id);
         _free_slab_pages.erase(_free_slab_pages.iterator_to(desc));
@@ -287,6 +369,7 @@ class slab_allocator {
         &slab_page_desc::_lru_link>> _slab_page_desc_lru;
     uint64_t _max_object_size;
     uint64_t _available_slab_pages;
+    slab_eviction_policy _policy;
     struct collectd_stats {
         uint64_t allocs;
         uint64_t frees;
@@ -294,15 +377,31 @@ class slab_allocator {
     memory::reclaimer *_reclaimer = nullptr;
     bool _reclaimed = false;
 private:
+    // Under the clock policy, slab pages with items in use stay in the list;
+    // they are moved to the front as the oldest unused page is looked for.
+    slab_page_desc* find_unused_slab_page() {
+        for (auto n = _slab_page_desc_lru.size(); n; n--) {
+            auto& desc = _slab_page_desc_lru.back();
+            if (desc.refcnt() == 0) {
+                return &desc;
+            }
+            _slab_page_desc_lru.pop_back();
+            _slab_page_desc_lru.push_front(desc);
+        }
+        return nullptr;
+    }
+
     memory::reclaiming_result evict_lru_slab_page() {
-        if (_slab_page_desc_lru.empty()) {
+        auto descp = _policy == slab_eviction_policy::clock ? find_unused_slab_page()
+                : (_slab_page_desc_lru.empty() ? nullptr : &_slab_page_desc_lru.back());
+        if (!descp) {
             // NOTE: Nothing to evict. If this happens, it implies that all
             // slab pages in the slab are being used at the same time.
             // That being said, this event is very unlikely to happen.
             return memory::reclaiming_result::reclaimed_nothing;
         }
         // get descriptor of the least-recently-used slab page and related info.
-        auto& desc = _slab_page_desc_lru.back();
+        auto& desc = *descp;
         assert(desc.refcnt() == 0);
         uint8_t slab_class_id = desc.slab_class_id();
         auto slab_class = get_slab_class(slab_class_id);
@@ -336,6 +435,7 @@ class slab_allocator {
             Item* item = reinterpret_cast<Item*>(object);
             assert(item->is_unlocked());
             slab_class->remove_item_from_lru(item);
+            slab_class->note_eviction();
             _erase_func(*item);
             _stats.frees++;
         }
@@ -367,17 +467,18 @@ class slab_allocator {
         while (_max_object_size / size > 1) {
             size = align_up(size, alignment);
             _slab_class_sizes.push_back(size);
-            _slab_classes.emplace_back(size, slab_class_id);
+            _slab_classes.emplace_back(size, slab_class_id, _policy);
             size *= growth_factor;
             assert(slab_class_id < std::numeric_limits<uint8_t>::max());
             slab_class_id++;
         }
         _slab_class_sizes.push_back(_max_object_size);
-        _slab_classes.emplace_back(_max_object_size, slab_class_id);
+        _slab_classes.emplace_back(_max_object_size, slab_class_id, _policy);
 
         // If slab limit is zero, enable reclaimer.
         if (!limit) {
-            _reclaimer = new memory::reclaimer([this] { return reclaim(); });
+            // Items are worth more than the other caches, so give them up last.
+            _reclaimer = new memory::reclaimer([this] { return reclaim(); }, memory::reclaimer_scope::async, 1);
         } else {
             _slab_pages_vector.reserve(_available_slab_pages);
         }
@@ -410,6 +511,14 @@ class slab_allocator {
         add("total_operations", "malloc", scollectd::data_type::DERIVE, [&] { return _stats.allocs; });
         add("total_operations", "free", scollectd::data_type::DERIVE, [&] { return _stats.frees; });
         add("objects", "malloc", scollectd::data_type::GAUGE, [&] { return _stats.allocs - _stats.frees; });
+        // Per slab class, to tune the eviction policy and growth factor
+        for (auto& sc : _slab_classes) {
+            auto id = to_sstring(unsigned(sc.slab_class_id()));
+            add("total_operations", "references-class" + id, scollectd::data_type::DERIVE,
+                    [&sc] { return sc.references(); });
+            add("total_operations", "evictions-class" + id, scollectd::data_type::DERIVE,
+                    [&sc] { return sc.evictions(); });
+        }
     }
 
     inline slab_page_desc& get_slab_page_desc(Item *item)
@@ -425,19 +534,23 @@ class slab_allocator {
             (_available_slab_pages > 0 || sc.has_no_slab_pages());
     }
 public:
-    slab_allocator(double growth_factor, uint64_t limit, uint64_t max_object_size)
+    slab_allocator(double growth_factor, uint64_t limit, uint64_t max_object_size,
+                   slab_eviction_policy policy = slab_eviction_policy::lru)
         : _max_object_size(max_object_size)
         , _available_slab_pages(limit / max_object_size)
+        , _policy(policy)
     {
         initialize_slab_allocator(growth_factor, limit);
         register_collectd_metrics();
     }
 
     slab_allocator(double growth_factor, uint64_t limit, uint64_t max_object_size,
-                   std::function<void (Item& item_ref)> erase_func)
+                   std::function<void (Item& item_ref)> erase_func,
+                   slab_eviction_policy policy = slab_eviction_policy::lru)
         : _erase_func(std::move(erase_func))
         , _max_object_size(max_object_size)
         , _available_slab_pages(limit / max_object_size)
+        , _policy(policy)
     {
         initialize_slab_allocator(growth_factor, limit);
         register_collectd_metrics();
@@ -445,7 +558,11 @@ class slab_allocator {
 
     ~slab_allocator()
     {
+        _registrations.clear();
         _slab_page_desc_lru.clear();
+        // The slab classes link items and descriptors; unlink them while
+        // the slab pages are still around.
+        _slab_classes.clear();
         for (auto desc : _slab_pages_vector) {
             if (!desc) {
                 continue;
@@ -453,10 +570,19 @@ class slab_allocator {
             ::free(desc->slab_page());
             delete desc;
         }
-        _registrations.clear();
         delete _reclaimer;
     }
 
+    /**
+     * Size of the objects of the largest slab class that holds more than
+     * one object per slab page. Larger items are better split into objects
+     * of this size, as the largest class wastes what they leave of a page.
+     */
+    size_t max_shared_object_size() const {
+        auto n = _slab_class_sizes.size();
+        return n > 1 ? _slab_class_sizes[n - 2] : _slab_class_sizes.back();
+    }
+
     /**
      * Create an item from a given slab class based on requested size.
      */
@@ -500,14 +626,13 @@ class slab_allocator {
         if (_reclaimer) {
             auto& refcnt = desc.refcnt();
 
-            if (++refcnt == 1) {
+            if (++refcnt == 1 && _policy == slab_eviction_policy::lru) {
                 // remove slab page descriptor from list of slab page descriptors.
                 _slab_page_desc_lru.erase(_slab_page_desc_lru.iterator_to(desc));
             }
         }
-        // remove item from the lru of its slab class.
         auto slab_class = get_slab_class(desc.slab_class_id());
-        slab_class->remove_item_from_lru(item);
+        slab_class->lock_item(item);
     }
 
     void unlock_item(Item *item) {
@@ -515,14 +640,13 @@ class slab_allocator {
         if (_reclaimer) {
             auto& refcnt = desc.refcnt();
 
-            if (--refcnt == 0) {
+            if (--refcnt == 0 && _policy == slab_eviction_policy::lru) {
                 // insert slab page descriptor back into list of slab page descriptors.
                 _slab_page_desc_lru.push_front(desc);
             }
         }
-        // insert item into the lru of its slab class.
         auto slab_class = get_slab_class(desc.slab_class_id());
-        slab_class->insert_item_into_lru(item);
+        slab_class->unlock_item(item);
     }
 
     /**
@@ -0,0 +1,292 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+// A circular_buffer that keeps its first N elements inside the object.
+//
+// Most wait queues (of a mutex, of an I/O priority class, ...) hold no more
+// than a handful of elements at a time, yet circular_buffer<> allocates
+// its storage on the first push, and every access goes to that separate
+// allocation. small_circular_buffer<T, N> stores up to N elements inline,
+// and moves them to heap storage, growing by doubling, only once more are
+// pushed. It doesn't shrink back.
+//
+// The price is the size of the object, and a move that moves the elements
+// one by one while they are inline. Elements must be nothrow movable, and
+// N a power of two.
+
+#include "bitops.hh"
+#include <memory>
+#include <iterator>
+#include <type_traits>
+#include <algorithm>
+
+template <typename T, size_t N>
+class small_circular_buffer {
+    static_assert(N && !(N & (N - 1)), "small_circular_buffer: the inline capacity must be a power of two");
+    static_assert(std::is_nothrow_move_constructible<T>::value, "small_circular_buffer: elements must be nothrow movable");
+    using inline_storage = std::aligned_storage_t<sizeof(T), alignof(T)>;
+    T* _storage;
+    // begin, end interpreted (mod capacity)
+    size_t _begin = 0;
+    size_t _end = 0;
+    size_t _capacity = N;
+    inline_storage _inline[N];
+public:
+    using value_type = T;
+    using size_type = size_t;
+    using reference = T&;
+    using pointer = T*;
+    using const_reference = const T&;
+    using const_pointer = const T*;
+public:
+    small_circular_buffer() noexcept : _storage(inline_elements()) {}
+    small_circular_buffer(small_circular_buffer&& x) noexcept;
+    small_circular_buffer(const small_circular_buffer&) = delete;
+    ~small_circular_buffer();
+    small_circular_buffer& operator=(const small_circular_buffer&) = delete;
+    small_circular_buffer& operator=(small_circular_buffer&& x) noexcept {
+        if (this != &x) {
+            this->~small_circular_buffer();
+            new (this) small_circular_buffer(std::move(x));
+        }
+        return *this;
+    }
+    void push_front(const T& data) {
+        emplace_front(data);
+    }
+    void push_front(T&& data) {
+        emplace_front(std::move(data));
+    }
+    template <typename... A>
+    void emplace_front(A&&... args) {
+        maybe_expand();
+        new (&_storage[mask(_begin - 1)]) T(std::forward<A>(args)...);
+        --_begin;
+    }
+    void push_back(const T& data) {
+        emplace_back(data);
+    }
+    void push_back(T&& data) {
+        emplace_back(std::move(data));
+    }
+    template <typename... A>
+    void emplace_back(A&&... args) {
+        maybe_expand();
+        new (&_storage[mask(_end)]) T(std::forward<A>(args)...);
+        ++_end;
+    }
+    T& front() {
+        return _storage[mask(_begin)];
+    }
+    const T& front() const {
+        return _storage[mask(_begin)];
+    }
+    T& back() {
+        return _storage[mask(_end - 1)];
+    }
+    const T& back() const {
+        return _storage[mask(_end - 1)];
+    }
+    void pop_front() {
+        front().~T();
+        ++_begin;
+    }
+    void pop_back() {
+        back().~T();
+        --_end;
+    }
+    bool empty() const {
+        return _begin == _end;
+    }
+    size_t size() const {
+        return _end - _begin;
+    }
+    size_t capacity() const {
+        return _capacity;
+    }
+    /// Whether the elements are stored in the object
+    bool is_inline() const {
+        return _storage == reinterpret_cast<const T*>(_inline);
+    }
+    void reserve(size_t size) {
+        if (_capacity < size) {
+            expand(size_t(1) << log2ceil(size));
+        }
+    }
+    T& operator[](size_t idx) {
+        return _storage[mask(_begin + idx)];
+    }
+    const T& operator[](size_t idx) const {
+        return _storage[mask(_begin + idx)];
+    }
+    template <typename Func>
+    void for_each(Func func) {
+        for (auto i = _begin; i != _end; ++i) {
+            func(_storage[mask(i)]);
+        }
+    }
+private:
+    T* inline_elements() {
+        return reinterpret_cast<T*>(_inline);
+    }
+    size_t mask(size_t idx) const {
+        return idx & (_capacity - 1);
+    }
+    void maybe_expand() {
+        if (_end - _begin == _capacity) {
+            expand(_capacity * 2);
+        }
+    }
+    void expand(size_t new_cap);
+
+    template <typename CB, typename ValueType>
+    class cbiterator : public std::iterator<std::random_access_iterator_tag, ValueType> {
+        using super_t = std::iterator<std::random_access_iterator_tag, ValueType>;
+        CB* _cb;
+        size_t _idx;
+        cbiterator(CB* cb, size_t idx) : _cb(cb), _idx(idx) {}
+        friend class small_circular_buffer;
+    public:
+        ValueType& operator*() const { return _cb->_storage[_cb->mask(_idx)]; }
+        ValueType* operator->() const { return &_cb->_storage[_cb->mask(_idx)]; }
+        cbiterator& operator++() {
+            ++_idx;
+            return *this;
+        }
+        cbiterator operator++(int) {
+            auto v = *this;
+            ++_idx;
+            return v;
+        }
+        cbiterator& operator--() {
+            --_idx;
+            return *this;
+        }
+        cbiterator operator--(int) {
+            auto v = *this;
+            --_idx;
+            return v;
+        }
+        cbiterator operator+(typename super_t::difference_type n) const {
+            return cbiterator(_cb, _idx + n);
+        }
+        cbiterator operator-(typename super_t::difference_type n) const {
+            return cbiterator(_cb, _idx - n);
+        }
+        cbiterator& operator+=(typename super_t::difference_type n) {
+            _idx += n;
+            return *this;
+        }
+        cbiterator& operator-=(typename super_t::difference_type n) {
+            _idx -= n;
+            return *this;
+        }
+        typename super_t::difference_type operator-(const cbiterator& rhs) const {
+            return _idx - rhs._idx;
+        }
+        bool operator==(const cbiterator& rhs) const {
+            return _idx == rhs._idx;
+        }
+        bool operator!=(const cbiterator& rhs) const {
+            return _idx != rhs._idx;
+        }
+        bool operator<(const cbiterator& rhs) const {
+            return _idx < rhs._idx;
+        }
+        bool operator>(const cbiterator& rhs) const {
+            return _idx > rhs._idx;
+        }
+        bool operator<=(const cbiterator& rhs) const {
+            return _idx <= rhs._idx;
+        }
+        bool operator>=(const cbiterator& rhs) const {
+            return _idx >= rhs._idx;
+        }
+    };
+public:
+    using iterator = cbiterator<small_circular_buffer, T>;
+    using const_iterator = cbiterator<const small_circular_buffer, const T>;
+
+    iterator begin() {
+        return iterator(this, _begin);
+    }
+    const_iterator begin() const {
+        return const_iterator(this, _begin);
+    }
+    iterator end() {
+        return iterator(this, _end);
+    }
+    const_iterator end() const {
+        return const_iterator(this, _end);
+    }
+};
+
+template <typename T, size_t N>
+inline
+small_circular_buffer<T, N>::small_circular_buffer(small_circular_buffer&& x) noexcept {
+    if (!x.is_inline()) {
+        _storage = x._storage;
+        _begin = x._begin;
+        _end = x._end;
+        _capacity = x._capacity;
+    } else {
+        // Inline elements can't be stolen, only moved over
+        _storage = inline_elements();
+        x.for_each([this] (T& obj) {
+            new (&_storage[_end++]) T(std::move(obj));
+            obj.~T();
+        });
+    }
+    x._storage = x.inline_elements();
+    x._begin = x._end = 0;
+    x._capacity = N;
+}
+
+template <typename T, size_t N>
+inline
+small_circular_buffer<T, N>::~small_circular_buffer() {
+    for_each([] (T& obj) {
+        obj.~T();
+    });
+    if (!is_inline()) {
+        std::allocator<T>().deallocate(_storage, _capacity);
+    }
+}
+
+template <typename T, size_t N>
+void
+small_circular_buffer<T, N>::expand(size_t new_cap) {
+    auto new_storage = std::allocator<T>().allocate(new_cap);
+    auto p = new_storage;
+    for_each([&p] (T& obj) {
+        new (p++) T(std::move(obj));
+        obj.~T();
+    });
+    if (!is_inline()) {
+        std::allocator<T>().deallocate(_storage, _capacity);
+    }
+    _storage = new_storage;
+    _capacity = new_cap;
+    _end = p - new_storage;
+    _begin = 0;
+}
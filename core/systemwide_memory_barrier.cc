@@ -21,13 +21,51 @@
 
 #include "systemwide_memory_barrier.hh"
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <cassert>
+#include <cerrno>
+
+// Commands of membarrier(2); spelled out, since older kernel headers don't
+// have the expedited ones.
+enum {
+    membarrier_cmd_query = 0,
+    membarrier_cmd_private_expedited = 1 << 3,
+    membarrier_cmd_register_private_expedited = 1 << 4,
+};
+
+static int membarrier(int cmd) {
+#ifdef __NR_membarrier
+    return syscall(__NR_membarrier, cmd, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Whether membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED) is available
+// (Linux 4.14), registering the process for it on first use. It only
+// interrupts the cpus running threads of this process, where the mprotect()
+// fallback below makes the kernel shoot down TLBs on them.
+static bool has_private_expedited_membarrier() {
+    static bool has = [] {
+        auto cmds = membarrier(membarrier_cmd_query);
+        return cmds >= 0
+                && (cmds & membarrier_cmd_private_expedited)
+                && (cmds & membarrier_cmd_register_private_expedited)
+                && membarrier(membarrier_cmd_register_private_expedited) == 0;
+    }();
+    return has;
+}
 
 // cause all threads to invoke a full memory barrier
 void
 systemwide_memory_barrier() {
-    // FIXME: use sys_membarrier() when available
+    if (has_private_expedited_membarrier()) {
+        int r = membarrier(membarrier_cmd_private_expedited);
+        assert(r == 0);
+        return;
+    }
     static thread_local char* mem = [] {
        void* mem = mmap(nullptr, getpagesize(),
                PROT_READ | PROT_WRITE,
@@ -21,10 +21,26 @@
 
 #pragma once
 
+#include <atomic>
+
 /// \cond internal
 
 // cause all threads to invoke a full memory barrier
 void systemwide_memory_barrier();
 
+// An asymmetric fence pair orders a frequent fast path against a rare slow
+// path (in the smp queues: a shard pushing a message, and another going to
+// sleep). Each side writes, fences, then reads what the other writes. The
+// fast side's fence is only a compiler barrier, and the slow side pays for
+// both with a systemwide_memory_barrier(), which runs a full fence on every
+// thread of the process. Both sides must run in this process.
+inline void asymmetric_fence_light() {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+inline void asymmetric_fence_heavy() {
+    systemwide_memory_barrier();
+}
+
 
 /// \endcond
@@ -22,15 +22,119 @@
 #pragma once
 
 #include <memory>
+#include <new>
+#include <cstdint>
+#include "scheduling.hh"
+
+// Per-shard cache of freed task objects, one free list per 16-byte size
+// class.  Nearly every then() on an unavailable future allocates a
+// continuation that is freed as soon as it runs, so recycling them keeps
+// the common case off the general-purpose allocator.
+struct task_arena {
+    static constexpr size_t granularity = 16;
+    static constexpr size_t nr_classes = 16;
+    static constexpr unsigned max_cached = 256;
+    struct free_object {
+        free_object* next;
+    };
+    // Zero-initialized (as a __thread object), so no constructor.
+    free_object* free_list[nr_classes];
+    unsigned nr_free[nr_classes];
+    uint64_t allocations;
+    uint64_t recycled;
+
+    static size_t class_of(size_t size) { return (size - 1) / granularity; }
+    void* allocate(size_t size) {
+        ++allocations;
+        auto c = class_of(size);
+        if (c >= nr_classes) {
+            return ::operator new(size);
+        }
+        if (auto obj = free_list[c]) {
+            ++recycled;
+            free_list[c] = obj->next;
+            --nr_free[c];
+            return obj;
+        }
+        return ::operator new((c + 1) * granularity);
+    }
+    void free(void* p, size_t size) noexcept {
+        auto c = class_of(size);
+        if (c >= nr_classes || nr_free[c] >= max_cached) {
+            ::operator delete(p);
+            return;
+        }
+        auto obj = static_cast<free_object*>(p);
+        obj->next = free_list[c];
+        free_list[c] = obj;
+        ++nr_free[c];
+    }
+};
+
+extern __thread task_arena g_task_arena;
+
+namespace seastar {
+namespace tracing {
+namespace impl {
+struct span_data;
+// The span of the running task, see tracing.hh
+extern __thread span_data* g_current_span;
+void retain(span_data* s) noexcept;
+void release(span_data* s) noexcept;
+}
+}
+}
 
 class task {
+    scheduling_group _sg;
+    // The tracing span current when the task was created, made current
+    // again while it runs; null unless the request is sampled
+    seastar::tracing::impl::span_data* _span;
 public:
-    virtual ~task() noexcept {}
+    explicit task(scheduling_group sg = current_scheduling_group())
+            : _sg(sg), _span(seastar::tracing::impl::g_current_span) {
+        if (__builtin_expect(_span != nullptr, false)) {
+            seastar::tracing::impl::retain(_span);
+        }
+    }
+    virtual ~task() noexcept {
+        if (__builtin_expect(_span != nullptr, false)) {
+            seastar::tracing::impl::release(_span);
+        }
+    }
     virtual void run() noexcept = 0;
+    // Runs the task and releases it; the reactor calls this rather than
+    // run() followed by delete, so that tasks which do not own their
+    // storage (coroutine frames) can manage their own lifetime.
+    virtual void run_and_dispose() noexcept {
+        run();
+        delete this;
+    }
+    // Releases a task that will not be run.
+    virtual void dispose() noexcept {
+        delete this;
+    }
+    scheduling_group group() const { return _sg; }
+    seastar::tracing::impl::span_data* trace_span() const { return _span; }
+    static void* operator new(size_t size) {
+        return g_task_arena.allocate(size);
+    }
+    static void operator delete(void* p, size_t size) noexcept {
+        g_task_arena.free(p, size);
+    }
 };
 
-void schedule(std::unique_ptr<task> t);
-void schedule_urgent(std::unique_ptr<task> t);
+struct task_deleter {
+    task_deleter() = default;
+    template <typename T>
+    task_deleter(const std::default_delete<T>&) noexcept {}
+    void operator()(task* t) const noexcept { t->dispose(); }
+};
+
+using task_ptr = std::unique_ptr<task, task_deleter>;
+
+void schedule(task_ptr t);
+void schedule_urgent(task_ptr t);
 
 template <typename Func>
 class lambda_task final : public task {
@@ -43,7 +147,7 @@ class lambda_task final : public task {
 
 template <typename Func>
 inline
-std::unique_ptr<task>
+task_ptr
 make_task(Func&& func) {
     return std::make_unique<lambda_task<Func>>(std::forward<Func>(func));
 }
@@ -24,6 +24,9 @@
 #include "posix.hh"
 #include <ucontext.h>
 #include <algorithm>
+#include <map>
+#include <vector>
+#include <sys/mman.h>
 
 /// \cond internal
 
@@ -32,41 +35,94 @@ namespace seastar {
 thread_local jmp_buf_link g_unthreaded_context;
 thread_local jmp_buf_link* g_current_context;
 
+// Per-shard cache of thread stacks.  Threads are often short-lived, and
+// allocating a fresh stack for each one means allocator churn and page
+// faults as it is first touched; pooled stacks are already faulted in
+// (and keep their guard page, if any, while pooled).
+class stack_pool {
+    using key = std::pair<size_t, bool>;
+    static constexpr size_t max_cached_per_key = 64;
+    std::map<key, std::vector<char*>> _free;
+public:
+    ~stack_pool() {
+        for (auto&& e : _free) {
+            for (auto p : e.second) {
+                release(p, e.first.first, e.first.second);
+            }
+        }
+    }
+    char* get(size_t size, bool guarded) {
+        auto i = _free.find(key(size, guarded));
+        if (i == _free.end() || i->second.empty()) {
+            return allocate(size, guarded);
+        }
+        auto p = i->second.back();
+        i->second.pop_back();
+#ifdef ASAN_ENABLED
+        std::fill_n(p + (guarded ? getpagesize() : 0), size - (guarded ? getpagesize() : 0), 0);
+#endif
+        return p;
+    }
+    void put(char* p, size_t size, bool guarded) noexcept {
+        try {
+            auto& v = _free[key(size, guarded)];
+            if (v.size() < max_cached_per_key) {
+                v.push_back(p);
+                return;
+            }
+        } catch (...) {
+        }
+        release(p, size, guarded);
+    }
+private:
+    static char* allocate(size_t size, bool guarded) {
+        auto page_size = getpagesize();
+        auto p = static_cast<char*>(::operator new(size, with_alignment(page_size)));
+        // Fault the stack in now; it will be reused by later threads.
+        std::fill_n(p, size, 0);
+        if (guarded) {
+            assert(size > page_size * 4 && "Stack guard would take too much portion of the stack");
+            auto mp_status = mprotect(p, page_size, PROT_READ);
+            if (mp_status != 0) {
+                auto err = errno;
+                ::operator delete(p, with_alignment(page_size));
+                throw std::system_error(err, std::system_category(), "mprotect");
+            }
+        }
+        return p;
+    }
+    static void release(char* p, size_t size, bool guarded) noexcept {
+        auto page_size = getpagesize();
+        if (guarded) {
+            auto mp_result = mprotect(p, page_size, PROT_READ | PROT_WRITE);
+            assert(mp_result == 0);
+        }
+        ::operator delete(p, with_alignment(page_size));
+    }
+};
+
+static thread_local stack_pool g_stack_pool;
+
 thread_context::thread_context(thread_attributes attr, std::function<void ()> func)
         : _attr(std::move(attr))
+        , _stack_size(align_up(_attr.stack_size, size_t(getpagesize())))
+        , _stack(make_stack(_stack_size, _attr.stack_guard))
         , _func(std::move(func)) {
     setup();
     _all_threads.push_front(*this);
 }
 
 thread_context::~thread_context() {
-#ifdef SEASTAR_THREAD_STACK_GUARDS
-    auto mp_result = mprotect(_stack.get(), getpagesize(), PROT_READ | PROT_WRITE);
-    assert(mp_result == 0);
-#endif
     _all_threads.erase(_all_threads.iterator_to(*this));
 }
 
 thread_context::stack_holder
-thread_context::make_stack() {
-#ifdef SEASTAR_THREAD_STACK_GUARDS
-    auto stack = stack_holder(new (with_alignment(getpagesize())) char[_stack_size]);
-#else
-    auto stack = stack_holder(new char[_stack_size]);
-#endif
-#ifdef ASAN_ENABLED
-    // Avoid ASAN false positive due to garbage on stack
-    std::fill_n(stack.get(), _stack_size, 0);
-#endif
-    return stack;
+thread_context::make_stack(size_t size, bool guarded) {
+    return stack_holder(g_stack_pool.get(size, guarded), stack_deleter{size, guarded});
 }
 
 void thread_context::stack_deleter::operator()(char* ptr) const noexcept {
-#ifdef SEASTAR_THREAD_STACK_GUARDS
-    operator delete[] (ptr, with_alignment(getpagesize()));
-#else
-    delete[] ptr;
-#endif
+    g_stack_pool.put(ptr, size, guarded);
 }
 
 void
@@ -79,13 +135,6 @@ thread_context::setup() {
     auto main = reinterpret_cast<void (*)()>(&thread_context::s_main);
     auto r = getcontext(&initial_context);
     throw_system_error_on(r == -1);
-#ifdef SEASTAR_THREAD_STACK_GUARDS
-    size_t page_size = getpagesize();
-    assert(align_up(_stack.get(), page_size) == _stack.get());
-    assert(_stack_size > page_size * 4 && "Stack guard would take too much portion of the stack");
-    auto mp_status = mprotect(_stack.get(), page_size, PROT_READ);
-    throw_system_error_on(mp_status != 0, "mprotect");
-#endif
     initial_context.uc_stack.ss_sp = _stack.get();
     initial_context.uc_stack.ss_size = _stack_size;
     initial_context.uc_link = nullptr;
@@ -83,6 +83,15 @@ class thread_scheduling_group;
 class thread_attributes {
 public:
     thread_scheduling_group* scheduling_group = nullptr;
+    /// Size of the thread's stack, in bytes; rounded up to a page.
+    size_t stack_size = 128*1024;
+    /// Whether to protect the lowest page of the stack, so that a
+    /// stack overflow faults instead of corrupting memory.
+#ifdef SEASTAR_THREAD_STACK_GUARDS
+    bool stack_guard = true;
+#else
+    bool stack_guard = false;
+#endif
 };
 
 
@@ -93,13 +102,16 @@ extern thread_local jmp_buf_link g_unthreaded_context;
 // \c thread itself because \c thread is movable, and we want pointers
 // to this state to be captured.
 class thread_context {
+    // Returns the stack to the per-shard stack pool.
     struct stack_deleter {
+        size_t size;
+        bool guarded;
         void operator()(char *ptr) const noexcept;
     };
     using stack_holder = std::unique_ptr<char[], stack_deleter>;
     thread_attributes _attr;
-    static constexpr size_t _stack_size = 128*1024;
-    stack_holder _stack{make_stack()};
+    size_t _stack_size;
+    stack_holder _stack;
     std::function<void ()> _func;
     jmp_buf_link _context;
     promise<> _done;
@@ -125,7 +137,7 @@ class thread_context {
     static void s_main(unsigned int lo, unsigned int hi);
     void setup();
     void main();
-    static stack_holder make_stack();
+    static stack_holder make_stack(size_t size, bool guarded);
 public:
     thread_context(thread_attributes attr, std::function<void ()> func);
     ~thread_context();
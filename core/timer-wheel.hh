@@ -0,0 +1,324 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#ifndef __TIMER_WHEEL_HH
+#define __TIMER_WHEEL_HH
+
+#include <array>
+#include <limits>
+#include <cstdint>
+#include <cassert>
+#include <boost/intrusive/list.hpp>
+
+namespace bi = boost::intrusive;
+
+namespace seastar {
+
+/**
+ * A hierarchical timing wheel with the same interface as timer_set.
+ *
+ * Timestamps are split into 6-bit digits; a timer is filed in the level of
+ * the highest digit in which its timeout differs from the current time, at
+ * the slot given by that digit.  Insertion and removal are O(1), and each
+ * timer is moved to a lower level at most once per level before it expires,
+ * so expiry is amortized O(1) per timer.  This avoids timer_set's rescan of
+ * its lowest bucket, which gets expensive when it holds many timers.
+ *
+ * get_next_timeout() may return a point earlier than the earliest timer
+ * (the start of its slot).  Calling expire() at that point is harmless: it
+ * only cascades the slot down a level.
+ *
+ * The template type "Timer" should have a method named
+ * get_timeout() which returns Timer::time_point which denotes
+ * timer's expiration.
+ */
+template<typename Timer, bi::list_member_hook<> Timer::*link>
+class timer_wheel {
+public:
+    using time_point = typename Timer::time_point;
+    using timer_list_t = bi::list<Timer, bi::member_hook<Timer, bi::list_member_hook<>, link>>;
+private:
+    using duration = typename Timer::duration;
+    using timestamp_t = typename Timer::duration::rep;
+    // Timestamps biased so that unsigned order matches signed order.
+    using key_t = uint64_t;
+
+    static constexpr int bits_per_level = 6;
+    static constexpr int slots_per_level = 1 << bits_per_level;
+    static constexpr int n_levels = (64 + bits_per_level - 1) / bits_per_level;
+    static constexpr key_t slot_mask = slots_per_level - 1;
+    static constexpr key_t sign_bias = key_t(1) << 63;
+    static constexpr key_t max_key = std::numeric_limits<key_t>::max();
+
+    struct level {
+        std::array<timer_list_t, slots_per_level> slots;
+        uint64_t non_empty = 0;
+    };
+
+    std::array<level, n_levels> _levels;
+    // Active timers with timeout <= _current.
+    timer_list_t _overdue;
+    uint32_t _non_empty_levels = 0;
+    key_t _current;
+    key_t _next;
+private:
+    static key_t to_key(timestamp_t ts) {
+        return key_t(ts) ^ sign_bias;
+    }
+
+    static timestamp_t from_key(key_t k) {
+        return timestamp_t(k ^ sign_bias);
+    }
+
+    static key_t get_key(Timer& timer) {
+        return to_key(timer.get_timeout().time_since_epoch().count());
+    }
+
+    static int level_of(key_t k, key_t current) {
+        return (63 - __builtin_clzll(k ^ current)) / bits_per_level;
+    }
+
+    static int slot_of(key_t k, int lvl) {
+        return (k >> (lvl * bits_per_level)) & slot_mask;
+    }
+
+    void file(Timer& timer, key_t k) {
+        if (k <= _current) {
+            _overdue.push_back(timer);
+            return;
+        }
+        auto lvl = level_of(k, _current);
+        auto slot = slot_of(k, lvl);
+        auto& l = _levels[lvl];
+        l.slots[slot].push_back(timer);
+        l.non_empty |= uint64_t(1) << slot;
+        _non_empty_levels |= 1u << lvl;
+    }
+
+    void unfile(timer_list_t& list, int lvl, int slot) {
+        if (list.empty()) {
+            auto& l = _levels[lvl];
+            l.non_empty &= ~(uint64_t(1) << slot);
+            if (!l.non_empty) {
+                _non_empty_levels &= ~(1u << lvl);
+            }
+        }
+    }
+
+    void splice_slot(timer_list_t& exp, int lvl, int slot) {
+        exp.splice(exp.end(), _levels[lvl].slots[slot]);
+        unfile(_levels[lvl].slots[slot], lvl, slot);
+    }
+
+    // Lower bound on the earliest active timer, max_key if there is none.
+    key_t compute_next() const {
+        if (!_overdue.empty()) {
+            return _current;
+        }
+        if (!_non_empty_levels) {
+            return max_key;
+        }
+        auto lvl = __builtin_ctz(_non_empty_levels);
+        auto slot = __builtin_ctzll(_levels[lvl].non_empty);
+        auto shift = lvl * bits_per_level;
+        auto high_shift = shift + bits_per_level;
+        key_t high = high_shift >= 64 ? 0 : (_current >> high_shift) << high_shift;
+        return high | (key_t(slot) << shift);
+    }
+public:
+    timer_wheel()
+        : _current(to_key(0))
+        , _next(max_key)
+    {
+    }
+
+    ~timer_wheel() {
+        while (!_overdue.empty()) {
+            _overdue.begin()->cancel();
+        }
+        for (auto&& l : _levels) {
+            for (auto&& list : l.slots) {
+                while (!list.empty()) {
+                    auto& timer = *list.begin();
+                    timer.cancel();
+                }
+            }
+        }
+    }
+
+    /**
+     * Adds timer to the active set.
+     *
+     * The value returned by timer.get_timeout() is used as timer's expiry. The result
+     * of timer.get_timeout() must not change while the timer is in the active set.
+     *
+     * Returns true if and only if this timer's timeout is less than get_next_timeout().
+     * When this function returns true the caller should reschedule expire() to be
+     * called at timer.get_timeout() to ensure timers are expired in a timely manner.
+     */
+    bool insert(Timer& timer)
+    {
+        auto k = get_key(timer);
+        file(timer, k);
+        if (k < _next) {
+            _next = k;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Removes timer from the active set.
+     *
+     * Preconditions:
+     *  - timer must be currently in the active set. Note: it must not be in
+     *    the expired set.
+     */
+    void remove(Timer& timer)
+    {
+        auto k = get_key(timer);
+        if (k <= _current) {
+            _overdue.erase(_overdue.iterator_to(timer));
+            return;
+        }
+        auto lvl = level_of(k, _current);
+        auto slot = slot_of(k, lvl);
+        auto& list = _levels[lvl].slots[slot];
+        list.erase(list.iterator_to(timer));
+        unfile(list, lvl, slot);
+    }
+
+    /**
+     * Expires active timers.
+     *
+     * The time points passed to this function must be monotonically increasing.
+     *
+     * Postconditons:
+     *  - all timers from the active set with Timer::get_timeout() <= now are moved
+     *    to the expired set.
+     */
+    timer_list_t expire(time_point now)
+    {
+        timer_list_t exp;
+        auto k = to_key(now.time_since_epoch().count());
+
+        if (k < _current) {
+            abort();
+        }
+
+        exp.splice(exp.end(), _overdue);
+
+        if (k != _current) {
+            auto top = level_of(k, _current);
+            // Every timer filed below the level where now and _current
+            // differ has a timeout < now.
+            for (int lvl = 0; lvl < top; ++lvl) {
+                auto mask = _levels[lvl].non_empty;
+                while (mask) {
+                    auto slot = __builtin_ctzll(mask);
+                    mask &= mask - 1;
+                    splice_slot(exp, lvl, slot);
+                }
+            }
+            // In the top level, slots before now's digit have fully
+            // expired; the slot equal to it has to be cascaded.
+            auto digit = slot_of(k, top);
+            auto mask = _levels[top].non_empty & ((uint64_t(1) << digit) - 1);
+            while (mask) {
+                auto slot = __builtin_ctzll(mask);
+                mask &= mask - 1;
+                splice_slot(exp, top, slot);
+            }
+            timer_list_t cascade;
+            splice_slot(cascade, top, digit);
+            _current = k;
+            while (!cascade.empty()) {
+                auto& timer = *cascade.begin();
+                cascade.pop_front();
+                auto tk = get_key(timer);
+                if (tk <= k) {
+                    exp.push_back(timer);
+                } else {
+                    file(timer, tk);
+                }
+            }
+        }
+
+        _next = compute_next();
+        return exp;
+    }
+
+    /**
+     * Returns a time point at which expire() should be called
+     * in order to ensure timers are expired in a timely manner.
+     *
+     * Returned values are monotonically increasing.
+     */
+    time_point get_next_timeout() const
+    {
+        return time_point(duration(from_key(std::max(_current, _next))));
+    }
+
+    /**
+     * Clears both active and expired timer sets.
+     */
+    void clear()
+    {
+        _overdue.clear();
+        for (auto&& l : _levels) {
+            for (auto&& list : l.slots) {
+                list.clear();
+            }
+            l.non_empty = 0;
+        }
+        _non_empty_levels = 0;
+    }
+
+    size_t size() const
+    {
+        size_t res = _overdue.size();
+        for (auto&& l : _levels) {
+            auto mask = l.non_empty;
+            while (mask) {
+                auto slot = __builtin_ctzll(mask);
+                mask &= mask - 1;
+                res += l.slots[slot].size();
+            }
+        }
+        return res;
+    }
+
+    /**
+     * Returns true if and only if there are no timers in the active set.
+     */
+    bool empty() const
+    {
+        return _overdue.empty() && !_non_empty_levels;
+    }
+
+    time_point now() {
+        return Timer::clock::now();
+    }
+};
+
+}
+
+#endif
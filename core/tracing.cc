@@ -0,0 +1,113 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "tracing.hh"
+#include "reactor.hh"
+#include "util/log.hh"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace seastar {
+namespace tracing {
+
+static logger tracing_logger("tracing");
+
+namespace impl {
+
+__thread span_data* g_current_span;
+__thread uint64_t g_sample_interval;
+__thread uint64_t g_sample_countdown;
+
+static thread_local std::unique_ptr<sink> local_sink;
+
+static uint64_t new_id() {
+    static thread_local std::mt19937_64 rng(std::random_device{}());
+    uint64_t id;
+    do {
+        id = rng();
+    } while (id == 0);
+    return id;
+}
+
+void retain(span_data* s) noexcept {
+    ++s->refs;
+}
+
+void release(span_data* s) noexcept {
+    if (--s->refs == 0) {
+        delete s;
+    }
+}
+
+span_data* start_span(const char* name, span_data* parent) {
+    auto s = new span_data;
+    s->span_id = new_id();
+    if (parent) {
+        s->trace_id = parent->trace_id;
+        s->parent_id = parent->span_id;
+    } else {
+        s->trace_id = new_id();
+        s->parent_id = 0;
+    }
+    s->name = name;
+    s->start = std::chrono::steady_clock::now();
+    return s;
+}
+
+void finish_span(span_data* s) noexcept {
+    if (local_sink) {
+        span_record r{s->trace_id, s->span_id, s->parent_id, s->name, std::move(s->detail),
+                s->start, std::chrono::steady_clock::now() - s->start, engine().cpu_id()};
+        try {
+            local_sink->record(r);
+        } catch (...) {
+            tracing_logger.warn("Failed to record span: {}", std::current_exception());
+        }
+    }
+    release(s);
+}
+
+}
+
+void set_sink(std::unique_ptr<sink> s) {
+    impl::local_sink = std::move(s);
+}
+
+void set_sample_rate(double rate) {
+    if (rate <= 0) {
+        impl::g_sample_interval = 0;
+    } else {
+        impl::g_sample_interval = std::max<uint64_t>(1, std::llround(1 / std::min(rate, 1.0)));
+    }
+    impl::g_sample_countdown = impl::g_sample_interval;
+}
+
+void log_sink::record(const span_record& s) {
+    if (s.duration >= _threshold) {
+        tracing_logger.info("trace {:016x} span {:016x} parent {:016x}: {} {} took {} us",
+                s.trace_id, s.span_id, s.parent_id, s.name, s.detail,
+                std::chrono::duration_cast<std::chrono::microseconds>(s.duration).count());
+    }
+}
+
+}
+}
@@ -0,0 +1,212 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+/// \file
+
+#include "future.hh"
+#include "sstring.hh"
+#include "task.hh"
+#include <chrono>
+#include <memory>
+
+namespace seastar {
+
+/// \brief Lightweight tracing of requests.
+///
+/// A span times one operation of a request, such as handling an RPC verb
+/// or an HTTP request, or an I/O it issued. The span current when a task
+/// is created, i.e. when a continuation is attached, is made current
+/// again when the task runs, so spans started later in the request's
+/// chain of continuations become its children, and all of them share the
+/// request's trace id. Context is carried within a shard; work submitted
+/// to another shard starts without one.
+///
+/// Requests are sampled: a span started with no current span is the root
+/// of a new trace only once every 1/rate such spans, per shard, and is
+/// otherwise a no-op, as are its would-be children. With the rate at 0
+/// (the default) starting a span costs a couple of thread-local loads.
+///
+/// Finished spans of sampled traces go to the shard's \ref sink.
+///
+/// The reactor traces I/O requests (as children only), the RPC server
+/// traces verb handlers, and the HTTP server traces its handlers.
+namespace tracing {
+
+/// A finished span.
+struct span_record {
+    uint64_t trace_id;
+    uint64_t span_id;
+    /// The span that was current when this one started; 0 for a root
+    uint64_t parent_id;
+    /// A static string naming the kind of operation, e.g. "rpc"
+    const char* name;
+    /// What the operation was on, e.g. the verb or URL
+    sstring detail;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration duration;
+    unsigned shard;
+};
+
+/// Receives the finished spans of a shard. record() is called on that
+/// shard as each span finishes, and must not block; sinks that ship spans
+/// elsewhere should buffer them.
+class sink {
+public:
+    virtual ~sink() {}
+    virtual void record(const span_record& s) = 0;
+};
+
+/// Logs spans that took at least a threshold, to the "tracing" logger.
+class log_sink : public sink {
+    std::chrono::steady_clock::duration _threshold;
+public:
+    explicit log_sink(std::chrono::steady_clock::duration threshold = {}) : _threshold(threshold) {}
+    virtual void record(const span_record& s) override;
+};
+
+/// Sets the sink of the calling shard's spans; null drops them.
+void set_sink(std::unique_ptr<sink> s);
+
+/// Sets the fraction of traces the calling shard samples, from 0 (none,
+/// the default) to 1 (all).
+void set_sample_rate(double rate);
+
+/// \cond internal
+namespace impl {
+
+struct span_data {
+    unsigned refs = 1;
+    uint64_t trace_id;
+    uint64_t span_id;
+    uint64_t parent_id;
+    const char* name;
+    sstring detail;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Roots are sampled when the countdown reaches zero; an interval of 0
+// samples nothing
+extern __thread uint64_t g_sample_interval;
+extern __thread uint64_t g_sample_countdown;
+
+span_data* start_span(const char* name, span_data* parent);
+void finish_span(span_data* s) noexcept;
+
+inline bool sample_root() {
+    if (!g_sample_interval || --g_sample_countdown) {
+        return false;
+    }
+    g_sample_countdown = g_sample_interval;
+    return true;
+}
+
+}
+/// \endcond
+
+/// A span of a sampled trace, or nothing. Finished by finish(), or when
+/// destroyed; it may be moved into a continuation to time an
+/// asynchronous operation.
+class span {
+    impl::span_data* _data = nullptr;
+private:
+    explicit span(impl::span_data* data) : _data(data) {}
+public:
+    /// Creates a span of nothing.
+    span() = default;
+    /// Starts a child of the current span, or, if there is none, a
+    /// sampled root.
+    explicit span(const char* name) {
+        if (auto parent = impl::g_current_span) {
+            _data = impl::start_span(name, parent);
+        } else if (__builtin_expect(impl::sample_root(), false)) {
+            _data = impl::start_span(name, nullptr);
+        }
+    }
+    /// Starts a child of the current span, if there is one; operations
+    /// that only matter as part of a request use this.
+    static span child(const char* name) {
+        auto parent = impl::g_current_span;
+        return span(parent ? impl::start_span(name, parent) : nullptr);
+    }
+    span(span&& s) noexcept : _data(s._data) {
+        s._data = nullptr;
+    }
+    span& operator=(span&& s) noexcept {
+        if (this != &s) {
+            finish();
+            _data = s._data;
+            s._data = nullptr;
+        }
+        return *this;
+    }
+    ~span() {
+        finish();
+    }
+    /// Whether the span is part of a sampled trace; when it is not, the
+    /// caller may skip computing details.
+    bool sampled() const {
+        return _data;
+    }
+    void set_detail(sstring detail) {
+        if (_data) {
+            _data->detail = std::move(detail);
+        }
+    }
+    void finish() noexcept {
+        if (_data) {
+            impl::finish_span(_data);
+            _data = nullptr;
+        }
+    }
+
+    /// Makes a span current for the guard's lifetime, so continuations
+    /// attached meanwhile carry it.
+    class current_guard {
+        impl::span_data* _prev;
+    public:
+        explicit current_guard(const span& s) : _prev(impl::g_current_span) {
+            impl::g_current_span = s._data;
+        }
+        current_guard(const current_guard&) = delete;
+        ~current_guard() {
+            impl::g_current_span = _prev;
+        }
+    };
+};
+
+/// Calls func with s current, and finishes s once the future func
+/// returned resolves. Costs nothing beyond the call when s is not
+/// sampled.
+template <typename Func>
+futurize_t<std::result_of_t<Func()>> with_span(span s, Func&& func) {
+    using futurator = futurize<std::result_of_t<Func()>>;
+    if (!s.sampled()) {
+        return futurator::apply(std::forward<Func>(func));
+    }
+    span::current_guard g(s);
+    return futurator::apply(std::forward<Func>(func)).finally([s = std::move(s)] {});
+}
+
+}
+
+}
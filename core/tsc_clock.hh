@@ -0,0 +1,92 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+/// \brief A nanosecond clock read from the CPU's time stamp counter.
+///
+/// lowres_clock is free to read but only moves every 10ms, and
+/// steady_clock costs a vDSO call; this clock costs an \c rdtsc and a
+/// multiplication, for timestamping requests, I/O and tasks on hot paths.
+///
+/// Each shard calibrates its own scale against the steady clock when its
+/// reactor starts, and refines it as the run goes on. Its time points
+/// count from the steady clock's epoch, so they stay within a few
+/// microseconds of steady_clock::now() and of other shards' readings, but
+/// they are meant for measuring intervals, not for arming timers.
+///
+/// Where the TSC is missing or not invariant (it may stop or change rate
+/// with the CPU's power state), and on threads that never calibrated, the
+/// clock reads the steady clock instead.
+class tsc_clock {
+public:
+    using rep = int64_t;
+    using period = std::nano;
+    using duration = std::chrono::duration<rep, period>;
+    using time_point = std::chrono::time_point<tsc_clock, duration>;
+    static constexpr bool is_steady = true;
+
+    static time_point now() {
+#ifdef __x86_64__
+        auto& s = _scale;
+        if (__builtin_expect(s.mult != 0, true)) {
+            int64_t ticks = __rdtsc() - s.base_tsc;
+            return time_point(duration(s.base_ns + rep((__int128(ticks) * s.mult) >> scale_shift)));
+        }
+#endif
+        return steady_now();
+    }
+    /// Whether this thread reads the TSC, rather than the steady clock
+    static bool using_tsc() {
+        return _scale.mult != 0;
+    }
+    /// Measures this thread's TSC rate, if the TSC is invariant; spins
+    /// for about a millisecond
+    static void calibrate();
+    /// Remeasures the rate over the time since calibrate(), which makes it
+    /// more accurate as the run goes on; cheap, called every second or so
+    static void refine();
+private:
+    // nanoseconds = base_ns + ((tsc - base_tsc) * mult) >> scale_shift
+    static constexpr unsigned scale_shift = 32;
+    struct scale {
+        uint64_t base_tsc = 0;
+        rep base_ns = 0;
+        uint64_t mult = 0;
+        // Where calibration started, to measure the rate over a long span
+        uint64_t first_tsc = 0;
+        rep first_ns = 0;
+    };
+    static thread_local scale _scale;
+
+    static rep steady_now_ns() {
+        return std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    static time_point steady_now() {
+        return time_point(duration(steady_now_ns()));
+    }
+};
@@ -32,11 +32,13 @@ gntref invalid_ref;
 // FIXME: Most of the destructors are yet to be coded
 //
 
-class userspace_grant_head : public grant_head {
-    std::atomic<int> _ref_head = { 0 };
+// A pool of pages granted to the other end once, when the head is
+// created, and never revoked: data is copied into them, and taking one or
+// giving it back costs no grant table operation.
+class persistent_grant_head : public grant_head {
     std::vector<gntref> _refs;
 public:
-    userspace_grant_head(std::vector<gntref> v) : _refs(v) {}
+    persistent_grant_head(std::vector<gntref> v) : _refs(v) {}
     virtual gntref new_ref() override;
     virtual gntref new_ref(void *addr, size_t size) override;
     virtual void free_ref(gntref& ref);
@@ -88,7 +90,7 @@ grant_head *userspace_gntalloc::alloc_ref(unsigned nr_ents) {
     }
 
     free(gref);
-    return new userspace_grant_head(v);
+    return new persistent_grant_head(v);
 }
 
 gntref userspace_gntalloc::alloc_ref() {
@@ -102,36 +104,25 @@ gntref userspace_gntalloc::alloc_ref() {
     return p;
 }
 
-gntref userspace_grant_head::new_ref() {
+gntref persistent_grant_head::new_ref() {
     auto r = _refs.back();
     _refs.pop_back();
     return r;
 }
 
-gntref userspace_grant_head::new_ref(void *addr, size_t size) {
+gntref persistent_grant_head::new_ref(void *addr, size_t size) {
     auto ref = _refs.back();
     memcpy(ref.page, addr, size);
     _refs.pop_back();
     return ref;
 }
 
-void userspace_grant_head::free_ref(gntref& ref) {
+void persistent_grant_head::free_ref(gntref& ref) {
     _refs.push_back(ref);
     ref = invalid_ref;
 }
 
 #ifdef HAVE_OSV
-class kernel_gntalloc;
-
-class kernel_grant_head : public grant_head {
-    uint32_t _head;
-public:
-    kernel_grant_head(uint32_t head) : _head(head) {}
-    virtual gntref new_ref() override;
-    virtual gntref new_ref(void *addr, size_t size) override;
-    virtual void free_ref(gntref& ref);
-};
-
 class kernel_gntalloc : public gntalloc {
     static constexpr int _tx_grants = 256;
     static constexpr int _rx_grants = 256;
@@ -144,7 +135,6 @@ class kernel_gntalloc : public gntalloc {
 
     virtual gntref alloc_ref() override;
     virtual grant_head *alloc_ref(unsigned refs) override;
-    friend class kernel_grant_head;
 };
 
 // FIXME: It is not actually that far-fetched to run seastar ontop of raw pv,
@@ -154,30 +144,6 @@ virt_to_mfn(void *virt) {
     return virt_to_phys(virt) >> 12;
 }
 
-gntref kernel_grant_head::new_ref() {
-    auto gnt = dynamic_cast<kernel_gntalloc *>(gntalloc::instance());
-
-    auto ref = gnttab_claim_grant_reference(&_head);
-    auto page = gnt->new_frame();
-    gnttab_grant_foreign_access_ref(ref, gnt->_otherend, virt_to_mfn(page), 0);
-    return gntref(ref, page);
-}
-
-gntref kernel_grant_head::new_ref(void *addr, size_t size) {
-
-    auto gnt = dynamic_cast<kernel_gntalloc *>(gntalloc::instance());
-
-    // FIXME: if we can guarantee that the packet allocation came from malloc, not
-    // mmap, we can grant it directly, without copying. We would also have to propagate
-    // the offset information, but that is easier
-    auto page = gnt->new_frame();
-    memcpy(page, addr, size);
-
-    auto ref = gnttab_claim_grant_reference(&_head);
-    gnttab_grant_foreign_access_ref(ref, gnt->_otherend, virt_to_mfn(page), 0);
-    return gntref(ref, page);
-}
-
 void *kernel_gntalloc::new_frame() {
     return aligned_alloc(4096, 4096);
 }
@@ -194,6 +160,8 @@ gntref kernel_gntalloc::alloc_ref() {
     return gntref(int(ref), page);
 }
 
+// Grants all the pages up front, rather than granting and revoking one
+// per packet: the grant table updates would otherwise bound the packet rate.
 grant_head *kernel_gntalloc::alloc_ref(unsigned nr_ents) {
 
     std::vector<gntref> v;
@@ -203,14 +171,14 @@ grant_head *kernel_gntalloc::alloc_ref(unsigned nr_ents) {
         throw std::runtime_error("Failed to initialize allocate grant\n");
     }
 
-    return new kernel_grant_head(head);
-}
+    for (unsigned i = 0; i < nr_ents; ++i) {
+        auto ref = gnttab_claim_grant_reference(&head);
+        auto page = new_frame();
+        gnttab_grant_foreign_access_ref(ref, _otherend, virt_to_mfn(page), 0);
+        v.push_back(gntref(ref, page));
+    }
 
-void kernel_grant_head::free_ref(gntref& ref) {
-    gnttab_end_foreign_access_ref(ref.xen_id);
-    gnttab_release_grant_reference(&_head, ref.xen_id);
-    free(ref.page);
-    ref = invalid_ref;
+    return new persistent_grant_head(v);
 }
 #endif
 
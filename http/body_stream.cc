@@ -0,0 +1,257 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#include "body_stream.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include "net/packet.hh"
+#include <vector>
+
+namespace httpd {
+
+class body_error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class content_length_source_impl final : public data_source_impl {
+    input_stream<char>& _in;
+    size_t _remaining;
+public:
+    content_length_source_impl(input_stream<char>& in, size_t length) : _in(in), _remaining(length) {}
+    virtual future<temporary_buffer<char>> get() override {
+        if (!_remaining) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        return _in.read_up_to(_remaining).then([this] (temporary_buffer<char> buf) {
+            if (buf.empty()) {
+                throw body_error("connection closed within the request body");
+            }
+            _remaining -= buf.size();
+            return buf;
+        });
+    }
+};
+
+class chunked_source_impl final : public data_source_impl {
+    using tmp_buf = temporary_buffer<char>;
+    using unconsumed_remainder = std::experimental::optional<tmp_buf>;
+    enum class state {
+        size, extension, size_lf, data, data_cr, data_lf, trailer_start, trailer, final_lf, done,
+    };
+    input_stream<char>& _in;
+    state _state = state::size;
+    size_t _remaining = 0;
+    unsigned _size_digits = 0;
+    bool _eof = false;
+private:
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+    void advance(char c) {
+        switch (_state) {
+        case state::size: {
+            auto v = hex_value(c);
+            if (v >= 0 && _size_digits < 15) {
+                _remaining = _remaining * 16 + v;
+                ++_size_digits;
+                return;
+            } else if (_size_digits && (c == ';' || c == ' ' || c == '\t')) {
+                _state = state::extension;
+                return;
+            } else if (_size_digits && c == '\r') {
+                _state = state::size_lf;
+                return;
+            }
+            break;
+        }
+        case state::extension:
+            if (c == '\r') {
+                _state = state::size_lf;
+            }
+            return;
+        case state::size_lf:
+            if (c == '\n') {
+                _state = _remaining ? state::data : state::trailer_start;
+                return;
+            }
+            break;
+        case state::data_cr:
+            if (c == '\r') {
+                _state = state::data_lf;
+                return;
+            }
+            break;
+        case state::data_lf:
+            if (c == '\n') {
+                _state = state::size;
+                _size_digits = 0;
+                return;
+            }
+            break;
+        case state::trailer_start:
+            _state = c == '\r' ? state::final_lf : state::trailer;
+            return;
+        case state::trailer:
+            if (c == '\n') {
+                _state = state::trailer_start;
+            }
+            return;
+        case state::final_lf:
+            if (c == '\n') {
+                _state = state::done;
+                return;
+            }
+            break;
+        case state::data:
+        case state::done:
+            break;
+        }
+        throw body_error("malformed chunked request body");
+    }
+public:
+    explicit chunked_source_impl(input_stream<char>& in) : _in(in) {}
+    // Consumes chunk framing until chunk data or the end of the body
+    future<unconsumed_remainder> operator()(tmp_buf buf) {
+        if (buf.empty()) {
+            _eof = true;
+            return make_ready_future<unconsumed_remainder>();
+        }
+        auto p = buf.get();
+        auto end = p + buf.size();
+        while (p != end && _state != state::data && _state != state::done) {
+            advance(*p++);
+        }
+        if (_state == state::data || _state == state::done) {
+            buf.trim_front(p - buf.get());
+            return make_ready_future<unconsumed_remainder>(std::move(buf));
+        }
+        return make_ready_future<unconsumed_remainder>();
+    }
+    virtual future<tmp_buf> get() override {
+        return repeat_until_value([this] () -> future<std::experimental::optional<tmp_buf>> {
+            if (_state == state::done) {
+                return make_ready_future<std::experimental::optional<tmp_buf>>(tmp_buf());
+            }
+            if (_state == state::data) {
+                return _in.read_up_to(_remaining).then([this] (tmp_buf buf) {
+                    if (buf.empty()) {
+                        throw body_error("connection closed within the request body");
+                    }
+                    _remaining -= buf.size();
+                    if (!_remaining) {
+                        _state = state::data_cr;
+                    }
+                    return std::experimental::optional<tmp_buf>(std::move(buf));
+                });
+            }
+            return _in.consume(*this).then([this] {
+                if (_eof && _state != state::data && _state != state::done) {
+                    throw body_error("connection closed within the request body");
+                }
+                return std::experimental::optional<tmp_buf>();
+            });
+        });
+    }
+};
+
+class chunked_sink_impl final : public data_sink_impl {
+    output_stream<char>& _out;
+    bool _chunked;
+public:
+    chunked_sink_impl(output_stream<char>& out, bool chunked) : _out(out), _chunked(chunked) {}
+    virtual future<> put(net::packet data) override {
+        if (!data.len()) {
+            return make_ready_future<>();
+        }
+        if (!_chunked) {
+            return _out.write(std::move(data));
+        }
+        auto size = sprint("%x\r\n", data.len());
+        return _out.write(size).then([this, data = std::move(data)] () mutable {
+            return _out.write(std::move(data));
+        }).then([this] {
+            return _out.write("\r\n", 2);
+        });
+    }
+    virtual future<> flush() override {
+        return _out.flush();
+    }
+    virtual future<> close() override {
+        if (!_chunked) {
+            return _out.flush();
+        }
+        return _out.write("0\r\n\r\n", 5).then([this] {
+            return _out.flush();
+        });
+    }
+};
+
+input_stream<char> make_content_length_body(input_stream<char>& in, size_t length) {
+    return input_stream<char>(data_source(std::make_unique<content_length_source_impl>(in, length)));
+}
+
+input_stream<char> make_chunked_body(input_stream<char>& in) {
+    return input_stream<char>(data_source(std::make_unique<chunked_source_impl>(in)));
+}
+
+output_stream<char> make_chunked_output(output_stream<char>& out, bool chunked) {
+    return output_stream<char>(data_sink(std::make_unique<chunked_sink_impl>(out, chunked)), 32768);
+}
+
+future<sstring> read_entire_body(input_stream<char>& in) {
+    return do_with(std::vector<temporary_buffer<char>>(), size_t(0), [&in] (auto& bufs, size_t& size) {
+        return repeat([&in, &bufs, &size] {
+            return in.read().then([&bufs, &size] (temporary_buffer<char> buf) {
+                if (buf.empty()) {
+                    return stop_iteration::yes;
+                }
+                size += buf.size();
+                bufs.push_back(std::move(buf));
+                return stop_iteration::no;
+            });
+        }).then([&bufs, &size] {
+            sstring ret(sstring::initialized_later(), size);
+            auto p = ret.begin();
+            for (auto& buf : bufs) {
+                p = std::copy(buf.begin(), buf.end(), p);
+            }
+            return ret;
+        });
+    });
+}
+
+future<> skip_entire_body(input_stream<char>& in) {
+    return repeat([&in] {
+        return in.read().then([] (temporary_buffer<char> buf) {
+            return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+        });
+    });
+}
+
+}
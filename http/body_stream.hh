@@ -0,0 +1,62 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/iostream.hh"
+#include "core/sstring.hh"
+
+namespace httpd {
+
+/**
+ * Streams over a connection that carry one message body and end with it.
+ * They refer to the connection's stream, which must outlive them, and
+ * never close it.
+ */
+
+/**
+ * The next length bytes of in; ends early with an error if in does.
+ */
+input_stream<char> make_content_length_body(input_stream<char>& in, size_t length);
+
+/**
+ * Decodes a chunked transfer coding from in, up to and including the
+ * last chunk and the trailer, which is skipped.
+ */
+input_stream<char> make_chunked_body(input_stream<char>& in);
+
+/**
+ * Sends what is written to it over out as chunks, and the last chunk
+ * when closed; with chunked false, sends it as is.
+ */
+output_stream<char> make_chunked_output(output_stream<char>& out, bool chunked = true);
+
+/**
+ * Reads in to its end.
+ */
+future<sstring> read_entire_body(input_stream<char>& in);
+
+/**
+ * Reads and discards in to its end.
+ */
+future<> skip_entire_body(input_stream<char>& in);
+
+}
@@ -0,0 +1,429 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#include "client.hh"
+#include "body_stream.hh"
+#include "core/future-util.hh"
+#include "core/metrics.hh"
+#include "core/reactor.hh"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <experimental/optional>
+
+namespace httpd {
+
+namespace {
+
+using tmp_buf = temporary_buffer<char>;
+
+class connection_closed : public std::runtime_error {
+public:
+    connection_closed() : std::runtime_error("connection closed before the response") {}
+};
+
+// A request that failed on a reused connection before any of its response
+// arrived; the server most likely closed the connection while it was idle
+class stale_connection : public std::runtime_error {
+public:
+    std::exception_ptr cause;
+    explicit stale_connection(std::exception_ptr cause)
+        : std::runtime_error("stale connection"), cause(std::move(cause)) {}
+};
+
+bool is_stale(std::exception_ptr ex) {
+    try {
+        std::rethrow_exception(ex);
+    } catch (connection_closed&) {
+        return true;
+    } catch (std::system_error&) {
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// The rest of a connection, for responses delimited by its closing
+class until_close_source final : public data_source_impl {
+    input_stream<char>& _in;
+public:
+    explicit until_close_source(input_stream<char>& in) : _in(in) {}
+    virtual future<tmp_buf> get() override {
+        return _in.read();
+    }
+};
+
+// Reads a response head, skipping interim 1xx responses
+future<std::unique_ptr<http_response>> read_head(client_connection& conn) {
+    using opt = std::experimental::optional<std::unique_ptr<http_response>>;
+    return repeat_until_value([&conn] {
+        conn.parser.init();
+        return conn.in.consume(conn.parser).then([&conn] {
+            if (conn.parser.eof()) {
+                throw connection_closed();
+            }
+            if (conn.parser._state != http_response_parser::state::done) {
+                throw std::runtime_error("malformed HTTP response");
+            }
+            auto rsp = conn.parser.get_parsed_response();
+            if (rsp->_status >= 100 && rsp->_status < 200 && rsp->_status != 101) {
+                return opt();
+            }
+            return opt(std::move(rsp));
+        });
+    });
+}
+
+}
+
+class client_response::body_source final : public data_source_impl {
+    client_response& _resp;
+    // Keeps the connection body reads from, after it is released
+    lw_shared_ptr<client_connection> _conn;
+    input_stream<char> _body;
+    bool _done = false;
+public:
+    body_source(client_response& resp, lw_shared_ptr<client_connection> conn, input_stream<char> body)
+        : _resp(resp), _conn(std::move(conn)), _body(std::move(body)) {}
+    virtual future<tmp_buf> get() override {
+        if (_done) {
+            return make_ready_future<tmp_buf>();
+        }
+        return _body.read().then_wrapped([this] (future<tmp_buf> f) {
+            try {
+                auto buf = f.get0();
+                if (buf.empty()) {
+                    _done = true;
+                    _resp.end_body(_resp._keep_alive);
+                }
+                return buf;
+            } catch (...) {
+                _done = true;
+                _resp.end_body(false);
+                throw;
+            }
+        });
+    }
+};
+
+client_response::client_response(client& c, lw_shared_ptr<client_connection> conn, promise<> turn,
+        http_response&& rsp, bool head_request)
+    : _client(&c), _conn(std::move(conn)), _turn(std::move(turn)), _status(rsp._status)
+    , _version(std::move(rsp._version)), _headers(std::move(rsp._headers)) {
+    auto connection = get_header("Connection");
+    if (_version == "1.1") {
+        _keep_alive = !strcasestr(connection.c_str(), "close");
+    } else {
+        _keep_alive = strcasestr(connection.c_str(), "keep-alive");
+    }
+    // RFC 7230, 3.3.3
+    auto& in = _conn->in;
+    input_stream<char> body;
+    bool empty = false;
+    auto length = _headers.find("Content-Length");
+    if (head_request || (_status >= 100 && _status < 200) || _status == 204 || _status == 304) {
+        // The connection is another protocol's after a 101
+        _keep_alive = _keep_alive && _status != 101;
+        empty = true;
+    } else if (strcasestr(get_header("Transfer-Encoding").c_str(), "chunked")) {
+        body = make_chunked_body(in);
+    } else if (length != _headers.end()) {
+        char* end;
+        auto n = std::strtoull(length->second.c_str(), &end, 10);
+        if (*end || length->second.empty()) {
+            // Where the body ends is unknown, so the connection is lost
+            end_body(false);
+            throw std::runtime_error("invalid Content-Length in HTTP response");
+        }
+        body = make_content_length_body(in, n);
+        empty = !n;
+    } else {
+        body = input_stream<char>(data_source(std::make_unique<until_close_source>(in)));
+        _keep_alive = false;
+    }
+    if (empty) {
+        body = make_content_length_body(in, 0);
+    }
+    _body = input_stream<char>(data_source(std::make_unique<body_source>(*this, _conn, std::move(body))));
+    if (empty) {
+        end_body(_keep_alive);
+    }
+}
+
+client_response::~client_response() {
+    end_body(false);
+}
+
+void client_response::end_body(bool reusable) {
+    if (_conn) {
+        _client->release(std::move(_conn), reusable);
+        _turn.set_value();
+    }
+}
+
+future<sstring> client_response::read_body() {
+    return read_entire_body(_body);
+}
+
+client::client(socket_address server, sstring host, client_options opts)
+    : client(std::move(server), std::move(host), nullptr, std::move(opts)) {
+}
+
+client::client(socket_address server, sstring host, ::shared_ptr<seastar::tls::certificate_credentials> creds,
+        client_options opts)
+    : _server(std::move(server)), _host(std::move(host)), _creds(std::move(creds)), _opts(std::move(opts)) {
+    _opts.pipeline_depth = std::max(_opts.pipeline_depth, 1u);
+    setup_metrics();
+}
+
+client::~client() {
+}
+
+void client::setup_metrics() {
+    namespace sm = seastar::metrics;
+    auto& name = _opts.metrics_name;
+    _metrics.add_group("http_client", {
+        sm::make_derive(name + "_connects", _connects,
+                sm::description("Counts connections opened to the server")),
+        sm::make_derive(name + "_pool_hits", _pool_hits,
+                sm::description("Counts requests sent on an idle pooled connection")),
+        sm::make_derive(name + "_pipelined", _pipelined,
+                sm::description("Counts requests sent behind others on a busy connection")),
+        sm::make_derive(name + "_requests", _requests_sent,
+                sm::description("Counts requests sent")),
+        sm::make_derive(name + "_errors", _errors,
+                sm::description("Counts failed connects, and requests that got no response")),
+        sm::make_gauge(name + "_connections", [this] { return _connections.size(); },
+                sm::description("Connections open to the server")),
+        sm::make_gauge(name + "_idle_connections", [this] { return idle_connections(); },
+                sm::description("Pooled connections waiting for a request")),
+        sm::make_histogram(name + "_request_latency_us", [this] { return _latency.to_metrics_histogram(1e-3); },
+                sm::description("Time from sending a request until its response headers were read, in microseconds")),
+    });
+}
+
+size_t client::idle_connections() const {
+    return std::count_if(_connections.begin(), _connections.end(), [] (auto& c) {
+        return !c->in_flight && !c->broken;
+    });
+}
+
+future<lw_shared_ptr<client_connection>> client::connect() {
+    ++_connecting;
+    auto f = _creds ? seastar::tls::connect(_creds, _server, _host) : engine().net().connect(_server);
+    return with_timeout(steady_clock_type::now() + _opts.connect_timeout, std::move(f)).then_wrapped(
+            [this] (future<connected_socket> f) {
+        --_connecting;
+        try {
+            auto conn = make_lw_shared<client_connection>(f.get0());
+            // Taken by the request it was opened for
+            conn->in_flight = 1;
+            ++_connects;
+            _connections.push_back(conn);
+            return conn;
+        } catch (...) {
+            ++_errors;
+            // A waiting request may connect in its place
+            _released.signal();
+            throw;
+        }
+    });
+}
+
+future<lw_shared_ptr<client_connection>> client::get_connection(bool pipelined) {
+    using opt = std::experimental::optional<lw_shared_ptr<client_connection>>;
+    return repeat_until_value([this, pipelined] {
+        if (_closing) {
+            throw std::runtime_error("HTTP client is closed");
+        }
+        auto take = [pipelined] (lw_shared_ptr<client_connection> c) {
+            c->exclusive = c->exclusive || !pipelined;
+            ++c->in_flight;
+            return opt(std::move(c));
+        };
+        // The most recently used idle connection is the least likely to
+        // have been closed by the server
+        for (auto i = _connections.rbegin(); i != _connections.rend(); ++i) {
+            if (!(*i)->in_flight && !(*i)->broken) {
+                ++_pool_hits;
+                return make_ready_future<opt>(take(*i));
+            }
+        }
+        if (_connections.size() + _connecting < _opts.max_connections) {
+            return connect().then([pipelined] (lw_shared_ptr<client_connection> c) {
+                c->exclusive = !pipelined;
+                return opt(std::move(c));
+            });
+        }
+        if (pipelined) {
+            for (auto& c : _connections) {
+                if (!c->broken && !c->exclusive && c->in_flight < _opts.pipeline_depth) {
+                    ++_pipelined;
+                    return make_ready_future<opt>(take(c));
+                }
+            }
+        }
+        return _released.wait().then([] {
+            return opt();
+        });
+    });
+}
+
+void client::release(lw_shared_ptr<client_connection> conn, bool reusable) {
+    if (!reusable) {
+        conn->abort();
+    }
+    if (--conn->in_flight) {
+        return;
+    }
+    conn->exclusive = false;
+    if (conn->broken || _closing || idle_connections() > _opts.max_idle_connections) {
+        close_connection(conn);
+    }
+    _released.signal();
+}
+
+void client::close_connection(lw_shared_ptr<client_connection> conn) {
+    auto i = std::find(_connections.begin(), _connections.end(), conn);
+    if (i == _connections.end()) {
+        return;
+    }
+    _connections.erase(i);
+    conn->broken = true;
+    // Waits out a write that an aborted request may have left running
+    seastar::with_gate(_closing_connections, [conn] {
+        return with_semaphore(conn->write_sem, 1, [conn] {
+            return conn->out.close();
+        }).handle_exception([conn] (std::exception_ptr) {});
+    });
+}
+
+future<> client::write_request(client_connection& conn, const client_request& req) {
+    sstring head = req.method + " " + req.url + " HTTP/1.1\r\n";
+    if (!req.headers.count("Host")) {
+        head += "Host: " + _host + "\r\n";
+    }
+    for (auto& h : req.headers) {
+        head += h.first + ": " + h.second + "\r\n";
+    }
+    if (req.body_writer) {
+        head += "Transfer-Encoding: chunked\r\n";
+    } else if (!req.content.empty() || req.method == "POST" || req.method == "PUT") {
+        head += "Content-Length: " + to_sstring(req.content.size()) + "\r\n";
+    }
+    head += "\r\n";
+    auto f = conn.out.write(head);
+    if (req.body_writer) {
+        f = f.then([&conn, &req] {
+            return do_with(make_chunked_output(conn.out), [&req] (output_stream<char>& body) {
+                return req.body_writer(body).then([&body] {
+                    return body.close();
+                });
+            });
+        });
+    } else if (!req.content.empty()) {
+        f = f.then([&conn, &req] {
+            return conn.out.write(req.content);
+        });
+    }
+    return f.then([&conn] {
+        return conn.out.flush();
+    });
+}
+
+future<std::unique_ptr<client_response>> client::send(lw_shared_ptr<client_request> req) {
+    bool head = req->method == "HEAD";
+    // Only idempotent requests are pipelined, as a connection the server
+    // closes fails the requests behind the one it answered
+    bool pipelined = (req->method == "GET" || head) && !req->body_writer;
+    return get_connection(pipelined).then([this, req, head] (lw_shared_ptr<client_connection> conn) {
+        auto start = steady_clock_type::now();
+        bool reused = std::exchange(conn->reused, true);
+        promise<> turn;
+        auto prev = std::exchange(conn->read_turn, turn.get_future());
+        ++_requests_sent;
+        auto written = with_semaphore(conn->write_sem, 1, [this, conn, req] {
+            return write_request(*conn, *req);
+        });
+        auto rsp = written.then([prev = std::move(prev)] () mutable {
+            return std::move(prev);
+        }).then([conn] {
+            // A response ahead of this one failed
+            if (conn->broken) {
+                throw connection_closed();
+            }
+            return read_head(*conn);
+        });
+        return with_timeout(start + _opts.response_timeout, std::move(rsp)).then_wrapped(
+                [this, conn, head, reused, start, turn = std::move(turn)] (future<std::unique_ptr<http_response>> f) mutable {
+            std::unique_ptr<http_response> rsp;
+            try {
+                rsp = f.get0();
+            } catch (...) {
+                auto ex = std::current_exception();
+                release(conn, false);
+                turn.set_value();
+                if (reused && is_stale(ex)) {
+                    throw stale_connection(ex);
+                }
+                ++_errors;
+                throw;
+            }
+            _latency.add(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock_type::now() - start).count());
+            return std::make_unique<client_response>(*this, conn, std::move(turn), std::move(*rsp), head);
+        });
+    });
+}
+
+future<std::unique_ptr<client_response>> client::make_request(client_request req) {
+    using opt = std::experimental::optional<std::unique_ptr<client_response>>;
+    auto r = make_lw_shared<client_request>(std::move(req));
+    return seastar::with_gate(_requests, [this, r] {
+        return repeat_until_value([this, r] {
+            return send(r).then_wrapped([r] (future<std::unique_ptr<client_response>> f) {
+                try {
+                    return opt(f.get0());
+                } catch (stale_connection& e) {
+                    if (r->method != "GET" && r->method != "HEAD") {
+                        std::rethrow_exception(e.cause);
+                    }
+                    return opt();
+                }
+            });
+        });
+    });
+}
+
+future<> client::close() {
+    _closing = true;
+    _released.broadcast();
+    return _requests.close().then([this] {
+        auto connections = _connections;
+        for (auto& c : connections) {
+            if (!c->in_flight) {
+                close_connection(c);
+            }
+        }
+        return _closing_connections.close();
+    });
+}
+
+}
@@ -0,0 +1,222 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "header_map.hh"
+#include "http/http_response_parser.hh"
+#include "core/condition-variable.hh"
+#include "core/gate.hh"
+#include "core/iostream.hh"
+#include "core/log_histogram.hh"
+#include "core/metrics_registration.hh"
+#include "core/semaphore.hh"
+#include "core/shared_ptr.hh"
+#include "net/api.hh"
+#include "net/tls.hh"
+#include <chrono>
+#include <functional>
+#include <vector>
+
+namespace httpd {
+
+struct client_options {
+    // Connections open at once, busy or idle; requests beyond them wait
+    // for one to be released
+    size_t max_connections = 64;
+    // Idle connections kept open for reuse
+    size_t max_idle_connections = 16;
+    // GET and HEAD requests sent on a busy connection, once no more can
+    // be opened, before the responses ahead of them are read; 1 disables
+    // pipelining
+    unsigned pipeline_depth = 1;
+    std::chrono::milliseconds connect_timeout = std::chrono::seconds(10);
+    // From sending a request until its response headers are read
+    std::chrono::milliseconds response_timeout = std::chrono::seconds(30);
+    // Prefixes the names of the client's metrics, which must differ
+    // between clients of a shard
+    sstring metrics_name = "client";
+};
+
+struct client_request {
+    sstring method = "GET";
+    // The path and query of the request line
+    sstring url = "/";
+    // Host, and Content-Length or Transfer-Encoding, are added
+    header_map headers;
+    sstring content;
+    // When set, writes the body, which is sent chunked, instead of content
+    std::function<future<> (output_stream<char>&)> body_writer;
+
+    client_request() = default;
+    client_request(sstring method, sstring url)
+        : method(std::move(method)), url(std::move(url)) {}
+};
+
+class client;
+
+// A connection of a client, with the state of the requests on it
+class client_connection {
+public:
+    connected_socket fd;
+    input_stream<char> in;
+    output_stream<char> out;
+    http_response_parser parser;
+    // Keeps requests whole on the wire
+    semaphore write_sem { 1 };
+    // Resolves once the responses to the requests sent so far are read,
+    // and the next response may be
+    future<> read_turn = make_ready_future<>();
+    // Requests assigned to the connection whose responses are not read
+    unsigned in_flight = 0;
+    // A request in flight that nothing may be pipelined behind
+    bool exclusive = false;
+    // Has been used before, so the server may have closed it meanwhile
+    bool reused = false;
+    // Failed, or closed by either side
+    bool broken = false;
+public:
+    explicit client_connection(connected_socket s)
+        : fd(std::move(s)), in(fd.input()), out(fd.output()) {}
+    void abort() {
+        if (!broken) {
+            broken = true;
+            fd.shutdown_input();
+            fd.shutdown_output();
+        }
+    }
+};
+
+/**
+ * A response whose headers have been read. Its body streams from the
+ * connection, which goes back to the client's pool once the body has
+ * been read to its end; destroying the response before that closes the
+ * connection instead.
+ */
+class client_response {
+    class body_source;
+
+    client* _client;
+    lw_shared_ptr<client_connection> _conn;
+    promise<> _turn;
+    bool _keep_alive = false;
+    int _status;
+    sstring _version;
+    header_map _headers;
+    input_stream<char> _body;
+private:
+    void end_body(bool reusable);
+public:
+    // Takes over conn until the body is read, and then resolves turn,
+    // letting the response after it on conn be read
+    client_response(client& c, lw_shared_ptr<client_connection> conn, promise<> turn,
+            http_response&& rsp, bool head_request);
+    client_response(const client_response&) = delete;
+    ~client_response();
+    int status() const {
+        return _status;
+    }
+    const sstring& version() const {
+        return _version;
+    }
+    const header_map& headers() const {
+        return _headers;
+    }
+    /**
+     * The value of a header, or an empty string
+     */
+    sstring get_header(const sstring& name) const {
+        auto it = _headers.find(name);
+        return it == _headers.end() ? sstring() : it->second;
+    }
+    input_stream<char>& body() {
+        return _body;
+    }
+    /**
+     * Reads the whole body
+     */
+    future<sstring> read_body();
+};
+
+/**
+ * An HTTP/1.1 client for one server, keeping a pool of keep-alive
+ * connections to it. A client belongs to the shard that created it, and
+ * its limits are the shard's; to talk to a server from every shard, give
+ * each shard its own client, e.g. with distributed<client>.
+ */
+class client {
+    friend class client_response;
+
+    socket_address _server;
+    sstring _host;
+    ::shared_ptr<seastar::tls::certificate_credentials> _creds;
+    client_options _opts;
+    std::vector<lw_shared_ptr<client_connection>> _connections;
+    size_t _connecting = 0;
+    condition_variable _released;
+    seastar::gate _requests;
+    seastar::gate _closing_connections;
+    bool _closing = false;
+    uint64_t _connects = 0;
+    uint64_t _pool_hits = 0;
+    uint64_t _pipelined = 0;
+    uint64_t _requests_sent = 0;
+    uint64_t _errors = 0;
+    seastar::log_histogram<24, 10> _latency;
+    seastar::metrics::metric_groups _metrics;
+private:
+    future<lw_shared_ptr<client_connection>> get_connection(bool pipelined);
+    future<lw_shared_ptr<client_connection>> connect();
+    future<std::unique_ptr<client_response>> send(lw_shared_ptr<client_request> req);
+    future<> write_request(client_connection& conn, const client_request& req);
+    void release(lw_shared_ptr<client_connection> conn, bool reusable);
+    void close_connection(lw_shared_ptr<client_connection> conn);
+    size_t idle_connections() const;
+    void setup_metrics();
+public:
+    /**
+     * @param server the address to connect to
+     * @param host the Host header of requests, and the name TLS checks the
+     * server's certificate against
+     */
+    client(socket_address server, sstring host, client_options opts = client_options());
+    client(socket_address server, sstring host, ::shared_ptr<seastar::tls::certificate_credentials> creds,
+            client_options opts = client_options());
+    client(const client&) = delete;
+    ~client();
+
+    /**
+     * Sends req on a pooled or new connection, and returns its response
+     * once the headers are read. Requests that find every connection busy
+     * wait for one, or are pipelined if that is enabled. A GET or HEAD
+     * sent on an idle connection that the server had closed is retried on
+     * another one.
+     */
+    future<std::unique_ptr<client_response>> make_request(client_request req);
+
+    /**
+     * Waits for requests in progress and closes the connections; call it
+     * once every response has been destroyed.
+     */
+    future<> close();
+};
+
+}
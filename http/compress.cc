@@ -0,0 +1,203 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#include "compress.hh"
+#include "core/future-util.hh"
+#include "net/packet.hh"
+#include <zlib.h>
+#include <cstdlib>
+#include <strings.h>
+
+namespace httpd {
+
+namespace {
+
+class zlib_error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Both encodings are deflate streams; gzip and zlib differ in framing,
+// which zlib picks by window bits
+struct deflater {
+    z_stream zs = {};
+
+    deflater(content_encoding e, int level) {
+        auto bits = e == content_encoding::gzip ? 15 + 16 : 15;
+        if (deflateInit2(&zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw zlib_error("deflateInit2 failed");
+        }
+    }
+    deflater(const deflater&) = delete;
+    ~deflater() {
+        deflateEnd(&zs);
+    }
+    // Deflates [data, data + size) with the given flush mode, handing each
+    // filled output buffer to emit
+    template <typename Emit>
+    void run(const char* data, size_t size, int flush, size_t buf_size, Emit&& emit) {
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs.avail_in = size;
+        do {
+            temporary_buffer<char> out(buf_size);
+            zs.next_out = reinterpret_cast<Bytef*>(out.get_write());
+            zs.avail_out = out.size();
+            auto r = deflate(&zs, flush);
+            if (r == Z_STREAM_ERROR) {
+                throw zlib_error("deflate failed");
+            }
+            out.trim(out.size() - zs.avail_out);
+            if (out.size()) {
+                emit(std::move(out));
+            }
+        } while (!zs.avail_out);
+    }
+};
+
+class compressing_sink_impl final : public data_sink_impl {
+    static constexpr size_t buf_size = 16384;
+    output_stream<char> _out;
+    deflater _z;
+private:
+    future<> deflate_and_write(const char* data, size_t size, int flush) {
+        net::packet p;
+        _z.run(data, size, flush, buf_size, [&p] (temporary_buffer<char> buf) {
+            p = net::packet(std::move(p), std::move(buf));
+        });
+        return p.len() ? _out.write(std::move(p)) : make_ready_future<>();
+    }
+public:
+    compressing_sink_impl(output_stream<char>&& out, content_encoding e, int level)
+        : _out(std::move(out)), _z(e, level) {}
+    virtual future<> put(net::packet data) override {
+        return do_with(std::move(data), [this] (net::packet& data) {
+            return do_for_each(data.fragments().begin(), data.fragments().end(), [this] (net::fragment f) {
+                return deflate_and_write(f.base, f.size, Z_NO_FLUSH);
+            });
+        });
+    }
+    virtual future<> flush() override {
+        return deflate_and_write(nullptr, 0, Z_SYNC_FLUSH).then([this] {
+            return _out.flush();
+        });
+    }
+    virtual future<> close() override {
+        return deflate_and_write(nullptr, 0, Z_FINISH).then([this] {
+            return _out.close();
+        });
+    }
+};
+
+}
+
+const char* content_encoding_name(content_encoding e) {
+    switch (e) {
+    case content_encoding::gzip:
+        return "gzip";
+    case content_encoding::deflate:
+        return "deflate";
+    case content_encoding::identity:
+        break;
+    }
+    return "identity";
+}
+
+content_encoding negotiate_encoding(const sstring& accept_encoding) {
+    auto best = content_encoding::identity;
+    float best_q = 0;
+    size_t pos = 0;
+    while (pos < accept_encoding.size()) {
+        auto end = accept_encoding.find(',', pos);
+        if (end == sstring::npos) {
+            end = accept_encoding.size();
+        }
+        auto item = accept_encoding.substr(pos, end - pos);
+        pos = end + 1;
+        float q = 1;
+        auto semi = item.find(';');
+        if (semi != sstring::npos) {
+            auto qpos = item.find("q=", semi);
+            if (qpos != sstring::npos) {
+                q = std::strtof(item.c_str() + qpos + 2, nullptr);
+            }
+            item = item.substr(0, semi);
+        }
+        auto is_space = [] (char c) { return c == ' ' || c == '\t'; };
+        size_t b = 0, e = item.size();
+        while (b < e && is_space(item[b])) {
+            ++b;
+        }
+        while (e > b && is_space(item[e - 1])) {
+            --e;
+        }
+        item = item.substr(b, e - b);
+        content_encoding enc;
+        if (!strcasecmp(item.c_str(), "gzip") || !strcasecmp(item.c_str(), "x-gzip") || item == "*") {
+            enc = content_encoding::gzip;
+        } else if (!strcasecmp(item.c_str(), "deflate")) {
+            enc = content_encoding::deflate;
+        } else {
+            continue;
+        }
+        // gzip wins ties, as some clients mishandle raw deflate
+        if (q > best_q || (q == best_q && q > 0 && enc == content_encoding::gzip)) {
+            best = enc;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+sstring compress_content(const sstring& data, content_encoding e, int level) {
+    deflater z(e, level);
+    sstring ret;
+    z.run(data.c_str(), data.size(), Z_FINISH, std::max<size_t>(deflateBound(&z.zs, data.size()), 64),
+            [&ret] (temporary_buffer<char> buf) {
+        ret.append(buf.get(), buf.size());
+    });
+    return ret;
+}
+
+output_stream<char> make_compressing_output(output_stream<char>&& out, content_encoding e, int level) {
+    return output_stream<char>(data_sink(std::make_unique<compressing_sink_impl>(std::move(out), e, level)), 32768);
+}
+
+void compress_reply(const sstring& accept_encoding, reply& rep, size_t min_size) {
+    if (rep._headers.count("Content-Encoding") || rep._body_writer
+            || (!rep._body_stream_writer && rep._content.size() < min_size)) {
+        return;
+    }
+    auto e = negotiate_encoding(accept_encoding);
+    rep._headers["Vary"] = "Accept-Encoding";
+    if (e == content_encoding::identity) {
+        return;
+    }
+    rep._headers["Content-Encoding"] = content_encoding_name(e);
+    if (rep._body_stream_writer) {
+        rep._body_stream_writer = [writer = std::move(rep._body_stream_writer), e] (output_stream<char>&& out) {
+            return writer(make_compressing_output(std::move(out), e));
+        };
+    } else {
+        rep._content = compress_content(rep._content, e);
+    }
+}
+
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/iostream.hh"
+#include "core/sstring.hh"
+#include "reply.hh"
+
+namespace httpd {
+
+enum class content_encoding {
+    identity, gzip, deflate,
+};
+
+/**
+ * The Content-Encoding header value of an encoding
+ */
+const char* content_encoding_name(content_encoding e);
+
+/**
+ * Picks the encoding an Accept-Encoding header value prefers, among the
+ * ones we produce; identity unless it accepts gzip or deflate.
+ */
+content_encoding negotiate_encoding(const sstring& accept_encoding);
+
+/**
+ * Compresses all of data at once
+ */
+sstring compress_content(const sstring& data, content_encoding e, int level = 6);
+
+/**
+ * Compresses what is written to it into out, which it takes over and
+ * closes when it is closed itself
+ */
+output_stream<char> make_compressing_output(output_stream<char>&& out, content_encoding e, int level = 6);
+
+/**
+ * Compresses rep for a client that sent the given Accept-Encoding header
+ * value, if it accepts an encoding and rep is not encoded yet: a body in
+ * _content of at least min_size bytes, or a body produced by
+ * reply::write_body(). Bodies written by _body_writer come with their
+ * length and are left alone.
+ */
+void compress_reply(const sstring& accept_encoding, reply& rep, size_t min_size);
+
+}
@@ -0,0 +1,137 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "cpu_profile.hh"
+#include "function_handlers.hh"
+#include "core/reactor.hh"
+#include <boost/range/irange.hpp>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+namespace httpd {
+
+namespace {
+
+// Stacks, outermost frame (the task type) first, and their sample counts
+using profile = std::map<std::vector<uintptr_t>, size_t>;
+
+future<> configure_profiling(const request& req) {
+    auto period = req.get_query_param("period_us");
+    if (period.empty()) {
+        return make_ready_future<>();
+    }
+    auto us = std::chrono::microseconds(std::stoul(period));
+    return smp::invoke_on_all([us] {
+        engine().set_cpu_profiling(us);
+    });
+}
+
+sstring demangle(const char* name) {
+    int status;
+    std::unique_ptr<char, decltype(&free)> demangled(abi::__cxa_demangle(name, nullptr, nullptr, &status), &free);
+    return status == 0 ? sstring(demangled.get()) : sstring(name);
+}
+
+class symbolizer {
+    std::unordered_map<uintptr_t, sstring> _types;
+    std::unordered_map<uintptr_t, sstring> _names;
+public:
+    const sstring& task_name(uintptr_t type) {
+        auto i = _types.find(type);
+        if (i == _types.end()) {
+            auto ti = reinterpret_cast<const std::type_info*>(type);
+            i = _types.emplace(type, ti ? demangle(ti->name()) : sstring("[reactor]")).first;
+        }
+        return i->second;
+    }
+    const sstring& frame_name(uintptr_t addr) {
+        auto i = _names.find(addr);
+        if (i == _names.end()) {
+            Dl_info info;
+            // Return addresses point past the call
+            if (dladdr(reinterpret_cast<void*>(addr - 1), &info) && info.dli_sname) {
+                i = _names.emplace(addr, demangle(info.dli_sname)).first;
+            } else {
+                i = _names.emplace(addr, sprint("0x%x", addr)).first;
+            }
+        }
+        return i->second;
+    }
+};
+
+// Semicolons separate frames
+void put_frame(std::ostream& os, const sstring& name) {
+    for (auto c : name) {
+        os << (c == ';' ? ':' : c);
+    }
+}
+
+sstring format_profile(const profile& p) {
+    symbolizer sym;
+    std::ostringstream os;
+    for (auto&& e : p) {
+        auto& stack = e.first;
+        put_frame(os, sym.task_name(stack[0]));
+        for (auto i = stack.size(); i > 1; --i) {
+            os << ';';
+            put_frame(os, sym.frame_name(stack[i - 1]));
+        }
+        os << ' ' << e.second << '\n';
+    }
+    return os.str();
+}
+
+}
+
+void set_cpu_profile_routes(routes& r, const sstring& path) {
+    future_handler_function f = [] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+        auto& rq = *req;
+        return configure_profiling(rq).then([] {
+            return do_with(profile(), [] (profile& merged) {
+                return parallel_for_each(boost::irange(0u, smp::count), [&merged] (unsigned cpu) {
+                    return smp::submit_to(cpu, [] {
+                        return engine().get_cpu_profile();
+                    }).then([&merged] (std::vector<cpu_profile_sample> samples) {
+                        for (auto&& s : samples) {
+                            // The task type, and then the frames innermost first
+                            std::vector<uintptr_t> stack;
+                            stack.reserve(s.backtrace.size() + 1);
+                            stack.push_back(reinterpret_cast<uintptr_t>(s.task_type));
+                            stack.insert(stack.end(), s.backtrace.begin(), s.backtrace.end());
+                            ++merged[std::move(stack)];
+                        }
+                    });
+                }).then([&merged] {
+                    return format_profile(merged);
+                });
+            });
+        }).then([req = std::move(req), rep = std::move(rep)] (sstring content) mutable {
+            rep->_content = std::move(content);
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        });
+    };
+    r.put(GET, path, new function_handler(f, "txt"));
+}
+
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "routes.hh"
+
+namespace httpd {
+
+/**
+ * Serves the CPU profile of all shards at \c path, as folded stacks: one
+ * line per distinct stack, its frames from the outermost on separated by
+ * semicolons, followed by the number of samples. The outermost frame is
+ * the type of the task that was running. flamegraph.pl draws it as is.
+ *
+ * The query parameter period_us=N first starts sampling on all shards,
+ * once every N microseconds of CPU time; period_us=0 stops it. Frames are
+ * named by the dynamic symbol table, so builds linked with -rdynamic get
+ * the most names; the others are shown as addresses.
+ */
+void set_cpu_profile_routes(routes& r, const sstring& path = "/debug/cpu_profile");
+
+}
@@ -110,6 +110,13 @@ class server_error_exception : public base_exception {
     }
 };
 
+class service_unavailable_exception : public base_exception {
+public:
+    service_unavailable_exception(const std::string& msg)
+            : base_exception(msg, reply::status_type::service_unavailable) {
+    }
+};
+
 class json_exception : public json::json_base {
 public:
     json::json_element<std::string> _msg;
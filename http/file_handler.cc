@@ -22,14 +22,117 @@
 #include "file_handler.hh"
 #include <algorithm>
 #include <iostream>
+#include <fcntl.h>
+#include <time.h>
 #include "core/reactor.hh"
 #include "core/fstream.hh"
 #include "core/shared_ptr.hh"
 #include "core/app-template.hh"
+#include "core/metrics.hh"
 #include "exception.hh"
+#include "compress.hh"
 
 namespace httpd {
 
+file_cache::file_cache()
+        : _capacity(memory::stats().total_memory() / 64)
+        , _reclaimer([this] { return reclaim(); }, memory::reclaimer_scope::async, 0) {
+    namespace sm = seastar::metrics;
+    _metrics.add_group("httpd_file_cache", {
+        sm::make_derive("hits", _hits,
+                sm::description("Counts files served from the cache")),
+        sm::make_derive("misses", _misses,
+                sm::description("Counts small files read from disk")),
+        sm::make_derive("evictions", _evictions,
+                sm::description("Counts files evicted to make room or to free memory")),
+        sm::make_derive("not_modified", _not_modified,
+                sm::description("Counts conditional requests answered with 304 Not Modified")),
+        sm::make_gauge("bytes", [this] { return _used; },
+                sm::description("Bytes of file content held by the cache")),
+    });
+}
+
+file_cache::~file_cache() {
+    _lru.clear();
+}
+
+file_cache& file_cache::local() {
+    static thread_local file_cache cache;
+    return cache;
+}
+
+void file_cache::set_capacity(size_t bytes) {
+    _capacity = bytes;
+    shrink(_capacity);
+}
+
+file_cache::entry* file_cache::find(const sstring& path) {
+    auto i = _entries.find(path);
+    if (i == _entries.end()) {
+        return nullptr;
+    }
+    auto& e = *i->second;
+    _lru.erase(_lru.iterator_to(e));
+    _lru.push_back(e);
+    return &e;
+}
+
+file_cache::entry* file_cache::find_fresh(const sstring& path) {
+    auto e = find(path);
+    if (!e || std::chrono::steady_clock::now() - e->_validated >= _revalidate_interval) {
+        return nullptr;
+    }
+    ++_hits;
+    return e;
+}
+
+void file_cache::revalidated(entry& e) {
+    ++_hits;
+    e._validated = std::chrono::steady_clock::now();
+}
+
+void file_cache::insert(const sstring& path, temporary_buffer<char> content, sstring etag, time_t mtime) {
+    auto i = _entries.find(path);
+    if (i != _entries.end()) {
+        erase(*i->second);
+    }
+    auto e = std::make_unique<entry>();
+    e->_path = path;
+    e->_content = std::move(content);
+    e->_etag = std::move(etag);
+    e->_mtime = mtime;
+    e->_validated = std::chrono::steady_clock::now();
+    _used += e->_content.size();
+    _lru.push_back(*e);
+    _entries.emplace(path, std::move(e));
+    shrink(_capacity);
+}
+
+void file_cache::erase(entry& e) {
+    _lru.erase(_lru.iterator_to(e));
+    _used -= e._content.size();
+    _entries.erase(e._path);
+}
+
+void file_cache::shrink(size_t target) {
+    while (_used > target && !_lru.empty()) {
+        ++_evictions;
+        erase(_lru.front());
+    }
+}
+
+memory::reclaiming_result file_cache::reclaim() {
+    if (_lru.empty()) {
+        return memory::reclaiming_result::reclaimed_nothing;
+    }
+    // Give back half the cache, but at least one file
+    auto target = _used / 2;
+    ++_evictions;
+    erase(_lru.front());
+    shrink(target);
+    return memory::reclaiming_result::reclaimed_something;
+}
+
 directory_handler::directory_handler(const sstring& doc_root,
         file_transformer* transformer)
         : file_interaction_handler(transformer), doc_root(doc_root) {
@@ -93,23 +196,233 @@ struct reader {
     }
 };
 
+// Identifies a version of a file by its inode, size and modification time
+static sstring make_etag(const struct stat& st) {
+    return sprint("\"%x-%x-%x\"", st.st_ino, st.st_size,
+            uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec);
+}
+
+static sstring format_http_date(time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char tmp[64];
+    strftime(tmp, sizeof(tmp), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return tmp;
+}
+
+// Whether a comma separated list of entity tags, or "*", has etag;
+// If-None-Match compares weakly, so W/ prefixes are ignored
+static bool etag_matches(const sstring& list, const sstring& etag) {
+    auto is_space = [] (char c) { return c == ' ' || c == '\t'; };
+    size_t pos = 0;
+    while (pos < list.size()) {
+        auto end = std::min(list.find(',', pos), list.size());
+        auto b = pos;
+        auto e = end;
+        while (b < e && is_space(list[b])) {
+            ++b;
+        }
+        while (e > b && is_space(list[e - 1])) {
+            --e;
+        }
+        if (e - b > 2 && list[b] == 'W' && list[b + 1] == '/') {
+            b += 2;
+        }
+        auto n = e - b;
+        if ((n == 1 && list[b] == '*')
+                || (n == etag.size() && !memcmp(list.c_str() + b, etag.c_str(), n))) {
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+// Whether the client's copy is current, by the request's validators
+// (RFC 7232, section 6)
+static bool not_modified(const request& req, const sstring& etag, time_t mtime) {
+    if (req._method != "GET" && req._method != "HEAD") {
+        return false;
+    }
+    auto if_none_match = req.get_header("If-None-Match");
+    if (!if_none_match.empty()) {
+        return etag_matches(if_none_match, etag);
+    }
+    auto if_modified_since = req.get_header("If-Modified-Since");
+    if (!if_modified_since.empty()) {
+        struct tm tm = {};
+        auto end = strptime(if_modified_since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return end && !*end && mtime <= timegm(&tm);
+    }
+    return false;
+}
+
+static std::unique_ptr<reply> reply_not_modified(std::unique_ptr<reply> rep) {
+    rep->set_status(reply::status_type::not_modified).done();
+    return rep;
+}
+
+// Reads a small file whole, into a buffer of its size rather than the
+// aligned one the read needs
+static future<temporary_buffer<char>> read_whole(file f, uint64_t size) {
+    if (!size) {
+        return make_ready_future<temporary_buffer<char>>();
+    }
+    return f.dma_read_exactly<char>(0, size).then([] (temporary_buffer<char> buf) {
+        return temporary_buffer<char>(buf.get(), buf.size());
+    });
+}
+
+// sendfile() goes through the page cache, which the O_DIRECT file
+// bypasses, so the file is opened again for it
+static future<> send_with_sendfile(output_stream<char>& out, sstring file_name, uint64_t size) {
+    return engine().submit_to_syscall_thread<std::pair<int, int>>([file_name] {
+        auto fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+        return std::make_pair(fd, fd == -1 ? errno : 0);
+    }).then([&out, size] (std::pair<int, int> r) {
+        if (r.first == -1) {
+            throw std::system_error(r.second, std::system_category());
+        }
+        auto fd = r.first;
+        return out.sendfile(fd, 0, size).finally([fd] {
+            ::close(fd);
+        });
+    });
+}
+
+// Nothing to transform: send the file as it is, without collecting it
+// into _content, by sendfile() or else as the file's DMA buffers
+static std::unique_ptr<reply> send_file(sstring file_name, file f, uint64_t size, std::unique_ptr<reply> rep) {
+    rep->_headers["Content-Length"] = to_sstring(size);
+    rep->_body_writer = [file_name, f, size] (output_stream<char>& out) mutable {
+        if (out.can_sendfile()) {
+            return f.close().then([&out, file_name, size] {
+                return send_with_sendfile(out, file_name, size);
+            });
+        }
+        return transmit_file(f, out, 0, size).finally([f] () mutable {
+            return f.close();
+        });
+    };
+    rep->done();
+    return rep;
+}
+
+std::unique_ptr<reply> file_interaction_handler::reply_with(const sstring& file_name,
+        temporary_buffer<char> content, const sstring& etag, time_t mtime,
+        const request& req, std::unique_ptr<reply> rep) {
+    if (transformer != nullptr) {
+        rep->_content = sstring(content.get(), content.size());
+        transformer->transform(rep->_content, req, get_extension(file_name));
+        rep->done();
+        return rep;
+    }
+    rep->_headers["ETag"] = etag;
+    rep->_headers["Last-Modified"] = format_http_date(mtime);
+    if (not_modified(req, etag, mtime)) {
+        ++file_cache::local()._not_modified;
+        return reply_not_modified(std::move(rep));
+    }
+    rep->_headers["Content-Length"] = to_sstring(content.size());
+    auto shared = make_lw_shared<temporary_buffer<char>>(std::move(content));
+    rep->_body_writer = [shared] (output_stream<char>& out) {
+        return out.write(shared->share());
+    };
+    rep->done();
+    return rep;
+}
+
 future<std::unique_ptr<reply>> file_interaction_handler::read(
         const sstring& file_name, std::unique_ptr<request> req,
         std::unique_ptr<reply> rep) {
     sstring extension = get_extension(file_name);
     rep->set_content_type(extension);
+    if (transformer == nullptr && _precompressed) {
+        rep->_headers["Vary"] = "Accept-Encoding";
+        if (negotiate_encoding(req->get_header("Accept-Encoding")) == content_encoding::gzip) {
+            auto gz_name = file_name + ".gz";
+            if (auto e = file_cache::local().find_fresh(gz_name)) {
+                rep->_headers["Content-Encoding"] = "gzip";
+                return make_ready_future<std::unique_ptr<reply>>(reply_with(gz_name,
+                        e->_content.share(), e->_etag, e->_mtime, *req, std::move(rep)));
+            }
+            return open_file_dma(gz_name, open_flags::ro).then_wrapped(
+                    [this, file_name, gz_name, req = std::move(req), rep = std::move(rep)] (future<file> f) mutable {
+                file gz;
+                try {
+                    gz = f.get0();
+                } catch (...) {
+                    // No compressed copy, send the file itself
+                    return read_plain(file_name, std::move(req), std::move(rep));
+                }
+                rep->_headers["Content-Encoding"] = "gzip";
+                return respond(gz_name, std::move(gz), std::move(req), std::move(rep));
+            });
+        }
+    }
+    return read_plain(file_name, std::move(req), std::move(rep));
+}
+
+future<std::unique_ptr<reply>> file_interaction_handler::read_plain(
+        const sstring& file_name, std::unique_ptr<request> req,
+        std::unique_ptr<reply> rep) {
+    if (auto e = file_cache::local().find_fresh(file_name)) {
+        return make_ready_future<std::unique_ptr<reply>>(reply_with(file_name,
+                e->_content.share(), e->_etag, e->_mtime, *req, std::move(rep)));
+    }
     return open_file_dma(file_name, open_flags::ro).then(
-            [rep = std::move(rep), extension, this, req = std::move(req)](file f) mutable {
-                std::shared_ptr<reader> r = std::make_shared<reader>(std::move(f), std::move(rep));
-
-                return r->is.consume(*r).then([r, extension, this, req = std::move(req)]() {
-                            if (transformer != nullptr) {
-                                transformer->transform(r->_rep->_content, *req, extension);
-                            }
-                            r->_rep->done();
-                            return make_ready_future<std::unique_ptr<reply>>(std::move(r->_rep));
-                        });
+            [this, file_name, req = std::move(req), rep = std::move(rep)] (file f) mutable {
+        return respond(file_name, std::move(f), std::move(req), std::move(rep));
+    });
+}
+
+// Serves an open file: from the cache if it is unchanged since it was
+// cached, and otherwise from disk, caching it if it is small
+future<std::unique_ptr<reply>> file_interaction_handler::respond(
+        const sstring& file_name, file f, std::unique_ptr<request> req,
+        std::unique_ptr<reply> rep) {
+    return f.stat().then([this, file_name, f, req = std::move(req), rep = std::move(rep)] (struct stat st) mutable {
+        auto& cache = file_cache::local();
+        auto etag = make_etag(st);
+        auto e = cache.find(file_name);
+        if (e && e->_etag == etag) {
+            cache.revalidated(*e);
+            rep = reply_with(file_name, e->_content.share(), etag, st.st_mtime, *req, std::move(rep));
+            return f.close().then([rep = std::move(rep)] () mutable {
+                return std::move(rep);
             });
+        }
+        uint64_t size = st.st_size;
+        if (size <= cache._max_file_size) {
+            ++cache._misses;
+            return read_whole(f, size).finally([f] () mutable {
+                return f.close();
+            }).then([this, file_name, etag, mtime = st.st_mtime, req = std::move(req), rep = std::move(rep)] (temporary_buffer<char> content) mutable {
+                // The reply shares the content, which eviction cannot free
+                rep = reply_with(file_name, content.share(), etag, mtime, *req, std::move(rep));
+                file_cache::local().insert(file_name, std::move(content), std::move(etag), mtime);
+                return std::move(rep);
+            });
+        }
+        if (transformer == nullptr) {
+            rep->_headers["ETag"] = etag;
+            rep->_headers["Last-Modified"] = format_http_date(st.st_mtime);
+            if (not_modified(*req, etag, st.st_mtime)) {
+                ++cache._not_modified;
+                rep = reply_not_modified(std::move(rep));
+                return f.close().then([rep = std::move(rep)] () mutable {
+                    return std::move(rep);
+                });
+            }
+            return make_ready_future<std::unique_ptr<reply>>(send_file(file_name, std::move(f), size, std::move(rep)));
+        }
+        std::shared_ptr<reader> r = std::make_shared<reader>(std::move(f), std::move(rep));
+        return r->is.consume(*r).then([r, file_name, this, req = std::move(req)]() {
+            transformer->transform(r->_rep->_content, *req, get_extension(file_name));
+            r->_rep->done();
+            return make_ready_future<std::unique_ptr<reply>>(std::move(r->_rep));
+        });
+    });
 }
 
 bool file_interaction_handler::redirect_if_needed(const request& req,
@@ -23,8 +23,89 @@
 #define HTTP_FILE_HANDLER_HH_
 
 #include "handlers.hh"
+#include "core/file.hh"
+#include "core/memory.hh"
+#include "core/metrics_registration.hh"
+#include "core/temporary_buffer.hh"
+#include <boost/intrusive/list.hpp>
+#include <chrono>
+#include <unordered_map>
 
 namespace httpd {
+
+/**
+ * The shard-local cache of small files served by file handlers, shared by
+ * all of them.
+ *
+ * A cached file is served without I/O. Its content is shared with the
+ * reply, not copied, and a conditional request whose If-None-Match or
+ * If-Modified-Since matches it gets 304 Not Modified. A cached file is
+ * checked for changes at most once per revalidation interval, by its
+ * inode, size and modification time, so a change within an interval is
+ * only seen once the interval ends. Files are evicted in LRU order when
+ * the cache exceeds its capacity, and also when the memory allocator asks
+ * for memory back.
+ */
+class file_cache {
+    struct entry {
+        boost::intrusive::list_member_hook<> _lru_link;
+        sstring _path;
+        temporary_buffer<char> _content;
+        sstring _etag;
+        time_t _mtime;
+        std::chrono::steady_clock::time_point _validated;
+    };
+    using lru_list = boost::intrusive::list<entry,
+            boost::intrusive::member_hook<entry, boost::intrusive::list_member_hook<>, &entry::_lru_link>>;
+    lru_list _lru;
+    std::unordered_map<sstring, std::unique_ptr<entry>> _entries;
+    size_t _capacity;
+    size_t _max_file_size = 256 * 1024;
+    std::chrono::milliseconds _revalidate_interval = std::chrono::seconds(1);
+    size_t _used = 0;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _evictions = 0;
+    uint64_t _not_modified = 0;
+    memory::reclaimer _reclaimer;
+    seastar::metrics::metric_groups _metrics;
+private:
+    file_cache();
+    // The entry of path, however old
+    entry* find(const sstring& path);
+    // The entry of path, if it was checked for changes within the
+    // revalidation interval
+    entry* find_fresh(const sstring& path);
+    void revalidated(entry& e);
+    void insert(const sstring& path, temporary_buffer<char> content, sstring etag, time_t mtime);
+    void erase(entry& e);
+    void shrink(size_t target);
+    memory::reclaiming_result reclaim();
+public:
+    file_cache(const file_cache&) = delete;
+    ~file_cache();
+    /// The cache of the current shard.
+    static file_cache& local();
+    /// Sets the number of bytes the cache may hold; defaults to 1/64th of
+    /// the shard's memory.
+    void set_capacity(size_t bytes);
+    /// Sets the size of the largest file cached; larger files are sent
+    /// from disk on every request.
+    void set_max_file_size(size_t bytes) {
+        _max_file_size = bytes;
+    }
+    void set_revalidate_interval(std::chrono::milliseconds interval) {
+        _revalidate_interval = interval;
+    }
+    size_t capacity() const { return _capacity; }
+    size_t used_bytes() const { return _used; }
+    uint64_t hits() const { return _hits; }
+    uint64_t misses() const { return _misses; }
+    uint64_t evictions() const { return _evictions; }
+    uint64_t not_modified() const { return _not_modified; }
+
+    friend class file_interaction_handler;
+};
 /**
  * This is a base class for file transformer.
  *
@@ -54,6 +135,12 @@ class file_transformer {
  * with regards to file handling.
  * they both needs to read a file from the disk, optionally transform it,
  * and return the result or page not found on error
+ *
+ * Small files are kept in the shard's file_cache. Replies carry an ETag
+ * and Last-Modified, and conditional requests are answered with 304 Not
+ * Modified, unless a transformer is set, since its output may differ
+ * between requests. Larger files are sent with sendfile() when the
+ * connection is a plain socket of the posix stack.
  */
 class file_interaction_handler : public handler_base {
 public:
@@ -74,6 +161,18 @@ class file_interaction_handler : public handler_base {
         return this;
     }
 
+    /**
+     * Serve a file's gzip compressed copy, the file name followed by .gz,
+     * to clients that accept gzip, when it exists. Files are not
+     * compressed on the fly, and not at all when a transformer is set.
+     * @param precompressed whether to look for compressed copies
+     * @return this
+     */
+    file_interaction_handler* set_precompressed(bool precompressed = true) {
+        _precompressed = precompressed;
+        return this;
+    }
+
     /**
      * if the url ends without a slash redirect
      * @param req the request
@@ -100,6 +199,15 @@ class file_interaction_handler : public handler_base {
     future<std::unique_ptr<reply> > read(const sstring& file,
             std::unique_ptr<request> req, std::unique_ptr<reply> rep);
     file_transformer* transformer;
+    bool _precompressed = false;
+private:
+    future<std::unique_ptr<reply> > read_plain(const sstring& file,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+    future<std::unique_ptr<reply>> respond(const sstring& file_name, file f,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+    std::unique_ptr<reply> reply_with(const sstring& file_name,
+            temporary_buffer<char> content, const sstring& etag, time_t mtime,
+            const request& req, std::unique_ptr<reply> rep);
 };
 
 /**
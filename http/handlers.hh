@@ -26,13 +26,78 @@
 #include "common.hh"
 #include "reply.hh"
 #include "core/future-util.hh"
+#include "core/semaphore.hh"
+#include "core/scollectd.hh"
 
 #include <unordered_map>
+#include <experimental/optional>
+#include <chrono>
 
 namespace httpd {
 
 typedef const httpd::request& const_req;
 
+/**
+ * Caps the requests a handler works on at once, on each shard.
+ * A request over the cap waits for one to finish, for up to a queue
+ * timeout, and is then answered 503 Service Unavailable with a
+ * Retry-After header without being handled. An expensive handler under
+ * overload thus sheds its own requests instead of starving the shard's
+ * other handlers.
+ */
+class concurrency_limit {
+    semaphore _sem;
+    std::chrono::milliseconds _queue_timeout;
+    std::chrono::seconds _retry_after;
+    uint64_t _in_flight = 0;
+    uint64_t _queued = 0;
+    uint64_t _shed = 0;
+    scollectd::registrations _regs;
+public:
+    /**
+     * @param name names the handler's metrics
+     * @param max_in_flight requests handled at once
+     * @param queue_timeout how long a request waits for its turn; with
+     * zero, requests over the cap are shed right away
+     * @param retry_after what shed requests are told to wait
+     */
+    concurrency_limit(const sstring& name, size_t max_in_flight,
+            std::chrono::milliseconds queue_timeout, std::chrono::seconds retry_after);
+
+    /**
+     * Calls func, which returns the reply future, once the request is
+     * admitted, or returns a 503 reply without calling it
+     */
+    template <typename Func>
+    future<std::unique_ptr<reply>> run(Func&& func) {
+        if (_sem.try_wait()) {
+            return admitted(std::forward<Func>(func));
+        }
+        if (_queue_timeout.count() == 0) {
+            return make_ready_future<std::unique_ptr<reply>>(shed());
+        }
+        _queued++;
+        return _sem.wait(_queue_timeout).then_wrapped([this, func = std::forward<Func>(func)] (future<> f) mutable {
+            _queued--;
+            if (f.failed()) {
+                f.ignore_ready_future();
+                return make_ready_future<std::unique_ptr<reply>>(shed());
+            }
+            return admitted(std::move(func));
+        });
+    }
+private:
+    template <typename Func>
+    future<std::unique_ptr<reply>> admitted(Func&& func) {
+        _in_flight++;
+        return futurize<future<std::unique_ptr<reply>>>::apply(std::forward<Func>(func)).finally([this] {
+            _in_flight--;
+            _sem.signal();
+        });
+    }
+    std::unique_ptr<reply> shed();
+};
+
 /**
  * handlers holds the logic for serving an incoming request.
  * All handlers inherit from the base httpserver_handler and
@@ -54,6 +119,16 @@ class handler_base {
 
     virtual ~handler_base() = default;
 
+    /**
+     * A handler returning true is handed the request body as it arrives,
+     * in request::content_stream, instead of in request::content once it
+     * is all in memory. It must have read what it needs of it by the time
+     * the future it returns resolves; the rest is skipped.
+     */
+    virtual bool streams_request_body() const {
+        return false;
+    }
+
     /**
      * Add a mandatory parameter
      * @param param a parameter name
@@ -64,7 +139,36 @@ class handler_base {
         return *this;
     }
 
+    /**
+     * Compress replies of this handler for clients that accept gzip or
+     * deflate, when the body is at least min_size bytes long. Bodies
+     * written through reply::write_body() are always compressed.
+     * @param min_size the smallest body worth compressing
+     * @return a reference to the handler
+     */
+    handler_base& compress_replies(size_t min_size = 1024) {
+        _compress_min_size = min_size;
+        return *this;
+    }
+
+    /**
+     * Cap the requests this handler works on at once, on each shard;
+     * see concurrency_limit. Metrics are registered, per shard, under
+     * the given name.
+     * @return a reference to the handler
+     */
+    handler_base& limit_concurrency(const sstring& name, size_t max_in_flight,
+            std::chrono::milliseconds queue_timeout = std::chrono::milliseconds(100),
+            std::chrono::seconds retry_after = std::chrono::seconds(1)) {
+        _limit = std::make_unique<concurrency_limit>(name, max_in_flight, queue_timeout, retry_after);
+        return *this;
+    }
+
     std::vector<sstring> _mandatory_param;
+    // Replies are left alone unless set
+    std::experimental::optional<size_t> _compress_min_size;
+    // Requests are not limited unless set
+    std::unique_ptr<concurrency_limit> _limit;
 
 };
 
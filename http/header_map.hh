@@ -0,0 +1,131 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+#include <cstring>
+#include <stdexcept>
+#include <strings.h>
+#include <utility>
+#include <vector>
+
+namespace httpd {
+
+/**
+ * A map of the few fields a request carries, such as its headers or query
+ * parameters, stored as a flat vector in insertion order next to a
+ * precomputed hash of each key.
+ *
+ * Parsing a request adds a dozen fields, which cost a hash node each in
+ * an unordered_map but here share one allocation, and short names and
+ * values fit in sstring's inline storage. Lookups compare hashes over
+ * consecutive memory, and keys only when a hash matches.
+ *
+ * With CaseInsensitive, keys that differ only in ASCII case are the same
+ * key, as HTTP header names are; the first spelling added is kept.
+ */
+template <bool CaseInsensitive>
+class basic_field_map {
+public:
+    using value_type = std::pair<sstring, sstring>;
+    using iterator = typename std::vector<value_type>::iterator;
+    using const_iterator = typename std::vector<value_type>::const_iterator;
+private:
+    static constexpr size_t initial_capacity = 16;
+    std::vector<value_type> _fields;
+    std::vector<uint32_t> _hashes;
+private:
+    static uint32_t hash_of(const char* p, size_t n) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; ++i) {
+            // Folds letters; other bytes may collide, which only costs a compare
+            h = (h ^ uint8_t(CaseInsensitive ? p[i] | 0x20 : p[i])) * 16777619u;
+        }
+        return h;
+    }
+    static bool equal(const sstring& a, const char* p, size_t n) {
+        return a.size() == n && (CaseInsensitive ? !strncasecmp(a.c_str(), p, n) : !memcmp(a.c_str(), p, n));
+    }
+    size_t index_of(const char* p, size_t n) const {
+        auto h = hash_of(p, n);
+        for (size_t i = 0; i < _hashes.size(); ++i) {
+            if (_hashes[i] == h && equal(_fields[i].first, p, n)) {
+                return i;
+            }
+        }
+        return _fields.size();
+    }
+public:
+    iterator begin() { return _fields.begin(); }
+    iterator end() { return _fields.end(); }
+    const_iterator begin() const { return _fields.begin(); }
+    const_iterator end() const { return _fields.end(); }
+    size_t size() const { return _fields.size(); }
+    bool empty() const { return _fields.empty(); }
+
+    iterator find(const sstring& key) {
+        return _fields.begin() + index_of(key.c_str(), key.size());
+    }
+    const_iterator find(const sstring& key) const {
+        return _fields.begin() + index_of(key.c_str(), key.size());
+    }
+    size_t count(const sstring& key) const {
+        return find(key) != end();
+    }
+    sstring& operator[](const sstring& key) {
+        auto i = index_of(key.c_str(), key.size());
+        if (i == _fields.size()) {
+            if (_fields.empty()) {
+                _fields.reserve(initial_capacity);
+                _hashes.reserve(initial_capacity);
+            }
+            _fields.emplace_back(key, sstring());
+            _hashes.push_back(hash_of(key.c_str(), key.size()));
+        }
+        return _fields[i].second;
+    }
+    const sstring& at(const sstring& key) const {
+        auto it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("no such field");
+        }
+        return it->second;
+    }
+    size_t erase(const sstring& key) {
+        auto i = index_of(key.c_str(), key.size());
+        if (i == _fields.size()) {
+            return 0;
+        }
+        _fields.erase(_fields.begin() + i);
+        _hashes.erase(_hashes.begin() + i);
+        return 1;
+    }
+    void clear() {
+        _fields.clear();
+        _hashes.clear();
+    }
+};
+
+using header_map = basic_field_map<true>;
+using query_parameter_map = basic_field_map<false>;
+
+}
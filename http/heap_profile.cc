@@ -0,0 +1,123 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "heap_profile.hh"
+#include "function_handlers.hh"
+#include "core/memory.hh"
+#include "core/reactor.hh"
+#include "core/print.hh"
+#include <boost/range/irange.hpp>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+namespace httpd {
+
+namespace {
+
+struct site_totals {
+    size_t live_count = 0;
+    size_t live_size = 0;
+    size_t total_count = 0;
+    size_t total_size = 0;
+
+    void add(size_t lc, size_t ls, size_t tc, size_t ts) {
+        live_count += lc;
+        live_size += ls;
+        total_count += tc;
+        total_size += ts;
+    }
+};
+
+using profile = std::map<std::vector<uintptr_t>, site_totals>;
+
+future<> configure_profiling(const request& req) {
+    auto interval = req.get_query_param("sample_interval");
+    auto disable = req.get_query_param("disable") == "1";
+    if (interval.empty() && !disable) {
+        return make_ready_future<>();
+    }
+    auto bytes = interval.empty() ? memory::heap_profiling_sample_interval() : std::stoul(interval);
+    return smp::invoke_on_all([bytes, disable] {
+        memory::set_heap_profiling_sample_interval(bytes);
+        memory::set_heap_profiling_enabled(!disable);
+    });
+}
+
+sstring format_profile(const profile& p, size_t sample_interval) {
+    site_totals all;
+    for (auto&& e : p) {
+        all.add(e.second.live_count, e.second.live_size, e.second.total_count, e.second.total_size);
+    }
+    std::ostringstream os;
+    // pprof scales sampled counts back up by itself when told the rate.
+    os << sprint("heap profile: %d: %d [%d: %d] @ ", all.live_count, all.live_size, all.total_count, all.total_size);
+    if (sample_interval) {
+        os << "heap_v2/" << sample_interval << "\n";
+    } else {
+        os << "heap\n";
+    }
+    for (auto&& e : p) {
+        auto& t = e.second;
+        os << sprint("%d: %d [%d: %d] @", t.live_count, t.live_size, t.total_count, t.total_size);
+        for (auto addr : e.first) {
+            os << sprint(" 0x%x", addr);
+        }
+        os << "\n";
+    }
+    // pprof needs the mappings to symbolize addresses in shared objects.
+    // /proc reads don't touch the disk, so reading it here is cheap.
+    os << "\nMAPPED_LIBRARIES:\n";
+    std::ifstream maps("/proc/self/maps");
+    os << maps.rdbuf();
+    return os.str();
+}
+
+}
+
+void set_heap_profile_routes(routes& r, const sstring& path) {
+    future_handler_function f = [] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+        auto& rq = *req;
+        return configure_profiling(rq).then([] {
+            return do_with(profile(), [] (profile& merged) {
+                return parallel_for_each(boost::irange(0u, smp::count), [&merged] (unsigned cpu) {
+                    return smp::submit_to(cpu, [] {
+                        return memory::get_heap_profile();
+                    }).then([&merged] (std::vector<memory::heap_profile_site> sites) {
+                        for (auto&& s : sites) {
+                            if (s.total_count) {
+                                merged[s.backtrace].add(s.live_count, s.live_size, s.total_count, s.total_size);
+                            }
+                        }
+                    });
+                }).then([&merged] {
+                    return format_profile(merged, memory::heap_profiling_sample_interval());
+                });
+            });
+        }).then([req = std::move(req), rep = std::move(rep)] (sstring content) mutable {
+            rep->_content = std::move(content);
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        });
+    };
+    r.put(GET, path, new function_handler(f, "txt"));
+}
+
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "routes.hh"
+
+namespace httpd {
+
+/**
+ * Serves the heap profile of all shards, merged by call site, at \c path
+ * in the legacy pprof heap format, so that it can be read with
+ * `pprof <binary> http://host:port<path>`.
+ *
+ * The query parameter sample_interval=N (in bytes) first switches sampling
+ * on all shards to one allocation per N bytes and enables profiling;
+ * sample_interval=0 records every allocation and disable=1 disables it.
+ * Allocation sites are only recorded in SEASTAR_HEAPPROF builds; other
+ * builds serve an empty profile.
+ */
+void set_heap_profile_routes(routes& r, const sstring& path = "/debug/pprof/heap");
+
+}
@@ -0,0 +1,426 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#include "hpack.hh"
+#include <unordered_map>
+
+namespace httpd {
+
+namespace {
+
+struct static_entry {
+    const char* name;
+    const char* value;
+};
+
+// RFC 7541, Appendix A; index 1 is the first entry
+const static_entry static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+constexpr size_t static_table_size = sizeof(static_table) / sizeof(static_table[0]);
+
+struct huffman_code {
+    uint32_t code;
+    uint8_t bits;
+};
+
+// RFC 7541, Appendix B, by symbol; the last one is EOS
+const huffman_code huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28},
+    {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24},
+    {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28},
+    {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28}, {0xffffff4, 28},
+    {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8},
+    {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7},
+    {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7},
+    {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7},
+    {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15},
+    {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5},
+    {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7}, {0x79, 7}, {0x7a, 7},
+    {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22},
+    {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24}, {0xffffed, 24},
+    {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23},
+    {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23}, {0x3fffdd, 22},
+    {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22},
+    {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22},
+    {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19},
+    {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26},
+    {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26},
+    {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21},
+    {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25},
+    {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27},
+    {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28},
+    {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27},
+    {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// Each symbol is a path from the root, a 0 bit taking left
+class huffman_tree {
+public:
+    struct node {
+        int16_t child[2] = { -1, -1 };
+        int16_t symbol = -1;
+    };
+    std::vector<node> nodes;
+    huffman_tree() : nodes(1) {
+        for (int16_t sym = 0; sym < 257; ++sym) {
+            auto& c = huffman_codes[sym];
+            size_t n = 0;
+            for (int b = c.bits - 1; b >= 0; --b) {
+                auto bit = (c.code >> b) & 1;
+                if (nodes[n].child[bit] < 0) {
+                    nodes[n].child[bit] = nodes.size();
+                    nodes.emplace_back();
+                }
+                n = nodes[n].child[bit];
+            }
+            nodes[n].symbol = sym;
+        }
+    }
+};
+
+const huffman_tree& get_huffman_tree() {
+    static thread_local huffman_tree tree;
+    return tree;
+}
+
+sstring huffman_decode(const uint8_t* p, size_t n) {
+    auto& tree = get_huffman_tree().nodes;
+    // Codes take at least 5 bits
+    sstring out(sstring::initialized_later(), n * 8 / 5);
+    size_t len = 0;
+    size_t node = 0;
+    unsigned depth = 0;
+    bool all_ones = true;
+    for (size_t i = 0; i < n; ++i) {
+        for (int b = 7; b >= 0; --b) {
+            auto bit = (p[i] >> b) & 1;
+            node = tree[node].child[bit];
+            ++depth;
+            all_ones &= bit;
+            auto sym = tree[node].symbol;
+            if (sym == 256) {
+                throw hpack_error("EOS in a Huffman coded string");
+            }
+            if (sym >= 0) {
+                out[len++] = char(sym);
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    // What follows the last symbol is at most 7 bits of an EOS prefix
+    if (depth > 7 || !all_ones) {
+        throw hpack_error("invalid Huffman padding");
+    }
+    return out.substr(0, len);
+}
+
+size_t huffman_length(const sstring& s) {
+    size_t bits = 0;
+    for (auto c : s) {
+        bits += huffman_codes[uint8_t(c)].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(std::vector<char>& out, const sstring& s) {
+    uint64_t acc = 0;
+    unsigned nbits = 0;
+    for (auto c : s) {
+        auto& code = huffman_codes[uint8_t(c)];
+        acc = (acc << code.bits) | code.code;
+        nbits += code.bits;
+        while (nbits >= 8) {
+            nbits -= 8;
+            out.push_back(char(acc >> nbits));
+        }
+    }
+    if (nbits) {
+        // Pad with the most significant bits of EOS, which are all ones
+        out.push_back(char((acc << (8 - nbits)) | (0xff >> nbits)));
+    }
+}
+
+uint64_t decode_int(const uint8_t*& p, const uint8_t* end, unsigned prefix_bits) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    uint64_t v = *p++ & max_prefix;
+    if (v < max_prefix) {
+        return v;
+    }
+    for (unsigned shift = 0; ; shift += 7) {
+        if (p == end) {
+            throw hpack_error("truncated integer");
+        }
+        if (shift > 28) {
+            throw hpack_error("integer overflow");
+        }
+        auto b = *p++;
+        v += uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+}
+
+void encode_int(std::vector<char>& out, uint8_t first, unsigned prefix_bits, uint64_t v) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (v < max_prefix) {
+        out.push_back(char(first | v));
+        return;
+    }
+    out.push_back(char(first | max_prefix));
+    v -= max_prefix;
+    while (v >= 0x80) {
+        out.push_back(char((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
+
+sstring decode_string(const uint8_t*& p, const uint8_t* end) {
+    if (p == end) {
+        throw hpack_error("truncated string");
+    }
+    bool huffman = *p & 0x80;
+    auto len = decode_int(p, end, 7);
+    if (len > size_t(end - p)) {
+        throw hpack_error("truncated string");
+    }
+    auto s = p;
+    p += len;
+    return huffman ? huffman_decode(s, len) : sstring(reinterpret_cast<const char*>(s), len);
+}
+
+void encode_string(std::vector<char>& out, const sstring& s) {
+    auto hlen = huffman_length(s);
+    if (hlen < s.size()) {
+        encode_int(out, 0x80, 7, hlen);
+        huffman_encode(out, s);
+    } else {
+        encode_int(out, 0, 7, s.size());
+        out.insert(out.end(), s.begin(), s.end());
+    }
+}
+
+size_t entry_size(const sstring& name, const sstring& value) {
+    return name.size() + value.size() + 32;
+}
+
+// The first index of each name, and of each name and value
+struct static_index {
+    std::unordered_map<sstring, size_t> by_name;
+    std::unordered_map<sstring, std::unordered_map<sstring, size_t>> by_field;
+    static_index() {
+        for (size_t i = static_table_size; i > 0; --i) {
+            auto& e = static_table[i - 1];
+            by_name[e.name] = i;
+            if (*e.value) {
+                by_field[e.name][e.value] = i;
+            }
+        }
+    }
+};
+
+}
+
+hpack_decoder::hpack_decoder(size_t table_size_limit, size_t max_list_size)
+    : _max_table_size(table_size_limit), _table_size_limit(table_size_limit), _max_list_size(max_list_size) {
+}
+
+const std::pair<sstring, sstring>& hpack_decoder::lookup(uint64_t index) const {
+    static thread_local std::vector<std::pair<sstring, sstring>> statics = [] {
+        std::vector<std::pair<sstring, sstring>> v;
+        for (auto& e : static_table) {
+            v.emplace_back(e.name, e.value);
+        }
+        return v;
+    }();
+    if (index == 0) {
+        throw hpack_error("index 0");
+    }
+    if (index <= static_table_size) {
+        return statics[index - 1];
+    }
+    index -= static_table_size + 1;
+    if (index >= _table.size()) {
+        throw hpack_error("index past the dynamic table");
+    }
+    return _table[index];
+}
+
+void hpack_decoder::evict_to(size_t size) {
+    while (_table_size > size) {
+        _table_size -= entry_size(_table.back().first, _table.back().second);
+        _table.pop_back();
+    }
+}
+
+void hpack_decoder::insert(sstring name, sstring value) {
+    auto size = entry_size(name, value);
+    if (size > _max_table_size) {
+        // Too large an entry empties the table
+        evict_to(0);
+        return;
+    }
+    evict_to(_max_table_size - size);
+    _table.emplace_front(std::move(name), std::move(value));
+    _table_size += size;
+}
+
+header_list hpack_decoder::decode(const char* data, size_t n) {
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    auto end = p + n;
+    header_list fields;
+    size_t list_size = 0;
+    while (p != end) {
+        auto b = *p;
+        if (b & 0x80) {
+            fields.push_back(lookup(decode_int(p, end, 7)));
+        } else if ((b & 0xe0) == 0x20) {
+            // A table size update, only allowed before the first field
+            auto size = decode_int(p, end, 5);
+            if (size > _table_size_limit || !fields.empty()) {
+                throw hpack_error("invalid table size update");
+            }
+            _max_table_size = size;
+            evict_to(size);
+            continue;
+        } else {
+            bool indexing = b & 0x40;
+            auto index = decode_int(p, end, indexing ? 6 : 4);
+            auto name = index ? lookup(index).first : decode_string(p, end);
+            auto value = decode_string(p, end);
+            if (indexing) {
+                insert(name, value);
+            }
+            fields.emplace_back(std::move(name), std::move(value));
+        }
+        list_size += entry_size(fields.back().first, fields.back().second);
+        if (list_size > _max_list_size) {
+            throw hpack_error("header list too large");
+        }
+    }
+    return fields;
+}
+
+void hpack_encode(std::vector<char>& out, const sstring& name, const sstring& value) {
+    static thread_local static_index index;
+    auto values = index.by_field.find(name);
+    if (values != index.by_field.end()) {
+        auto i = values->second.find(value);
+        if (i != values->second.end()) {
+            encode_int(out, 0x80, 7, i->second);
+            return;
+        }
+    }
+    // Literal without indexing
+    auto n = index.by_name.find(name);
+    if (n != index.by_name.end()) {
+        encode_int(out, 0, 4, n->second);
+    } else {
+        out.push_back(0);
+        encode_string(out, name);
+    }
+    encode_string(out, value);
+}
+
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+#include <deque>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace httpd {
+
+/**
+ * HPACK, the header compression of HTTP/2 (RFC 7541)
+ */
+
+class hpack_error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+using header_list = std::vector<std::pair<sstring, sstring>>;
+
+/**
+ * Decodes the header blocks one peer sends on a connection, keeping the
+ * dynamic table they share in between.
+ */
+class hpack_decoder {
+    // Newest first, as the table is indexed
+    std::deque<std::pair<sstring, sstring>> _table;
+    size_t _table_size = 0;
+    // The size the encoder chose, up to the limit we advertised
+    size_t _max_table_size;
+    size_t _table_size_limit;
+    size_t _max_list_size;
+private:
+    const std::pair<sstring, sstring>& lookup(uint64_t index) const;
+    void insert(sstring name, sstring value);
+    void evict_to(size_t size);
+public:
+    /**
+     * @param table_size_limit the SETTINGS_HEADER_TABLE_SIZE advertised
+     * @param max_list_size the largest decoded block accepted, counted as
+     * in SETTINGS_MAX_HEADER_LIST_SIZE
+     */
+    explicit hpack_decoder(size_t table_size_limit = 4096, size_t max_list_size = 65536);
+
+    /**
+     * Decodes a complete header block
+     * @throws hpack_error if it is malformed, which leaves the table
+     * unusable, so that the connection must end
+     */
+    header_list decode(const char* p, size_t n);
+};
+
+/**
+ * Encodes header fields without using a dynamic table, so it needs no
+ * state: fields in the static table are sent as an index, others as
+ * literals, Huffman coded when that is shorter. Names must be in lower
+ * case.
+ */
+void hpack_encode(std::vector<char>& out, const sstring& name, const sstring& value);
+
+}
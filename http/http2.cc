@@ -0,0 +1,777 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#include "http2.hh"
+#include "httpd.hh"
+#include "core/future-util.hh"
+#include "net/packet.hh"
+#include <cctype>
+#include <cstring>
+
+namespace httpd {
+
+constexpr const char* http2_connection::preface;
+constexpr size_t http2_connection::preface_size;
+constexpr size_t http2_connection::preface_request_size;
+
+namespace {
+
+enum class frame_type : uint8_t {
+    data, headers, priority, rst_stream, settings, push_promise, ping, goaway, window_update, continuation,
+};
+
+namespace flag {
+constexpr uint8_t end_stream = 0x1;
+constexpr uint8_t ack = 0x1;
+constexpr uint8_t end_headers = 0x4;
+constexpr uint8_t padded = 0x8;
+constexpr uint8_t priority = 0x20;
+}
+
+enum error_code : uint32_t {
+    no_error = 0,
+    protocol_error = 1,
+    internal_error = 2,
+    flow_control_error = 3,
+    stream_closed = 5,
+    frame_size_error = 6,
+    refused_stream = 7,
+    compression_error = 9,
+};
+
+enum setting : uint16_t {
+    header_table_size = 1,
+    enable_push = 2,
+    max_concurrent_streams = 3,
+    initial_window_size = 4,
+    max_frame_size = 5,
+    max_header_list_size = 6,
+};
+
+constexpr int64_t max_window = (int64_t(1) << 31) - 1;
+constexpr uint32_t default_max_frame_size = 16384;
+
+// An error that ends the connection, with GOAWAY
+class connection_error : public std::runtime_error {
+public:
+    uint32_t code;
+    connection_error(uint32_t code, const char* what) : std::runtime_error(what), code(code) {}
+};
+
+// Thrown to a stream's body writer once nothing more can be sent on it
+class stream_gone : public std::runtime_error {
+public:
+    stream_gone() : std::runtime_error("HTTP/2 stream reset") {}
+};
+
+uint32_t read_u32(const char* p) {
+    return (uint32_t(uint8_t(p[0])) << 24) | (uint32_t(uint8_t(p[1])) << 16)
+            | (uint32_t(uint8_t(p[2])) << 8) | uint8_t(p[3]);
+}
+
+void put_u32(char* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void put_frame_header(char* p, size_t size, frame_type type, uint8_t flags, uint32_t stream_id) {
+    p[0] = size >> 16;
+    p[1] = size >> 8;
+    p[2] = size;
+    p[3] = char(type);
+    p[4] = flags;
+    put_u32(p + 5, stream_id);
+}
+
+void strip_padding(uint8_t flags, temporary_buffer<char>& payload) {
+    if (!(flags & flag::padded)) {
+        return;
+    }
+    if (payload.empty() || uint8_t(payload[0]) >= payload.size()) {
+        throw connection_error(protocol_error, "invalid padding");
+    }
+    size_t pad = uint8_t(payload[0]);
+    payload.trim_front(1);
+    payload.trim(payload.size() - pad);
+}
+
+sstring base64url_decode(const sstring& in) {
+    sstring out;
+    uint32_t acc = 0;
+    unsigned bits = 0;
+    for (auto c : in) {
+        int v;
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        } else if (c == '-' || c == '+') {
+            v = 62;
+        } else if (c == '_' || c == '/') {
+            v = 63;
+        } else {
+            break;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            char b = acc >> bits;
+            out.append(&b, 1);
+        }
+    }
+    return out;
+}
+
+// Headers that only mean something to an HTTP/1 connection
+bool connection_specific(const sstring& name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+            || name == "transfer-encoding" || name == "upgrade";
+}
+
+sstring to_lower(const sstring& s) {
+    sstring ret = s;
+    for (auto& c : ret) {
+        c = std::tolower(c);
+    }
+    return ret;
+}
+
+}
+
+class http2_connection::stream_sink final : public data_sink_impl {
+    http2_connection& _conn;
+    lw_shared_ptr<stream> _s;
+public:
+    stream_sink(http2_connection& conn, lw_shared_ptr<stream> s) : _conn(conn), _s(std::move(s)) {}
+    virtual future<> put(net::packet data) override {
+        return do_with(data.release(), [this] (std::vector<tmp_buf>& bufs) {
+            return do_for_each(bufs, [this] (tmp_buf& buf) {
+                return _conn.send_data(_s, std::move(buf), false);
+            });
+        });
+    }
+    virtual future<> flush() override {
+        return make_ready_future<>();
+    }
+    virtual future<> close() override {
+        return _conn.send_data(_s, tmp_buf(), true);
+    }
+};
+
+http2_connection::http2_connection(http_server& server, input_stream<char>& in, output_stream<char>& out,
+        const http2_options& opts)
+    : _server(server), _in(in), _out(out), _opts(opts), _decoder(4096, opts.max_header_list_size) {
+    _opts.initial_window_size = std::min<int64_t>(std::max<uint32_t>(_opts.initial_window_size, 65535), max_window);
+}
+
+temporary_buffer<char> http2_connection::frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+        const char* payload, size_t size) {
+    tmp_buf buf(9 + size);
+    put_frame_header(buf.get_write(), size, frame_type(type), flags, stream_id);
+    std::copy_n(payload, size, buf.get_write() + 9);
+    return buf;
+}
+
+future<> http2_connection::send(std::vector<tmp_buf> bufs) {
+    return with_semaphore(_write_sem, 1, [this, bufs = std::move(bufs)] () mutable {
+        net::packet p;
+        for (auto& buf : bufs) {
+            if (!buf.empty()) {
+                p = net::packet(std::move(p), std::move(buf));
+            }
+        }
+        return _out.write(std::move(p)).then([this] {
+            // Frames queued behind these go out in the same flush
+            return _write_sem.waiters() ? make_ready_future<>() : _out.flush();
+        });
+    });
+}
+
+future<> http2_connection::send(tmp_buf frames) {
+    std::vector<tmp_buf> bufs;
+    bufs.push_back(std::move(frames));
+    return send(std::move(bufs));
+}
+
+future<> http2_connection::send_rst_stream(uint32_t stream_id, uint32_t error) {
+    char payload[4];
+    put_u32(payload, error);
+    return send(frame(uint8_t(frame_type::rst_stream), 0, stream_id, payload, sizeof(payload)));
+}
+
+future<> http2_connection::send_goaway(uint32_t error) {
+    char payload[8];
+    put_u32(payload, _last_stream_id);
+    put_u32(payload + 4, error);
+    return send(frame(uint8_t(frame_type::goaway), 0, 0, payload, sizeof(payload)));
+}
+
+future<> http2_connection::process(size_t preface_read, std::unique_ptr<request> upgraded) {
+    auto rest = preface_size - preface_read;
+    return _in.read_exactly(rest).then([this, rest, preface_read, upgraded = std::move(upgraded)] (tmp_buf buf) mutable {
+        if (buf.size() != rest || std::memcmp(buf.get(), preface + preface_read, rest)) {
+            throw connection_error(protocol_error, "invalid connection preface");
+        }
+        char settings[18];
+        auto put_setting = [] (char* p, uint16_t id, uint32_t value) {
+            p[0] = id >> 8;
+            p[1] = id;
+            put_u32(p + 2, value);
+        };
+        put_setting(settings, max_concurrent_streams, _opts.max_concurrent_streams);
+        put_setting(settings + 6, initial_window_size, _opts.initial_window_size);
+        put_setting(settings + 12, max_header_list_size, _opts.max_header_list_size);
+        std::vector<tmp_buf> bufs;
+        bufs.push_back(frame(uint8_t(frame_type::settings), 0, 0, settings, sizeof(settings)));
+        // The connection window is not covered by the setting
+        if (_opts.initial_window_size > 65535) {
+            char increment[4];
+            put_u32(increment, _opts.initial_window_size - 65535);
+            bufs.push_back(frame(uint8_t(frame_type::window_update), 0, 0, increment, sizeof(increment)));
+        }
+        _recv_window = _opts.initial_window_size;
+        auto f = send(std::move(bufs));
+        if (upgraded) {
+            auto client_settings = base64url_decode(upgraded->get_header("HTTP2-Settings"));
+            if (client_settings.size() % 6) {
+                throw connection_error(protocol_error, "invalid HTTP2-Settings");
+            }
+            apply_settings(client_settings.c_str(), client_settings.size());
+            auto s = make_lw_shared<stream>();
+            s->id = _last_stream_id = 1;
+            s->req = std::move(upgraded);
+            s->send_window = _peer_initial_window;
+            s->recv_window = _opts.initial_window_size;
+            s->remote_closed = true;
+            _streams.emplace(s->id, s);
+            dispatch(s);
+        }
+        return f.then([this] {
+            return read_frames();
+        });
+    }).then_wrapped([this] (future<> f) {
+        auto goaway = make_ready_future<>();
+        try {
+            f.get();
+        } catch (connection_error& e) {
+            goaway = send_goaway(e.code);
+            _closing = true;
+        } catch (...) {
+            // The connection broke
+            _closing = true;
+        }
+        return goaway.then_wrapped([this] (future<> f) {
+            f.ignore_ready_future();
+            // Nothing will update flow control windows any more; replies
+            // still within them are completed
+            _input_done = true;
+            _window_available.broadcast();
+            return _handlers.close();
+        });
+    }).then([this] {
+        return _out.flush().handle_exception([] (std::exception_ptr) {});
+    });
+}
+
+future<> http2_connection::read_frames() {
+    return repeat([this] {
+        return _in.read_exactly(9).then([this] (tmp_buf hdr) {
+            if (hdr.size() < 9) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto p = hdr.get();
+            size_t size = (size_t(uint8_t(p[0])) << 16) | (size_t(uint8_t(p[1])) << 8) | uint8_t(p[2]);
+            uint8_t type = p[3];
+            uint8_t flags = p[4];
+            uint32_t stream_id = read_u32(p + 5) & 0x7fffffff;
+            // We leave SETTINGS_MAX_FRAME_SIZE at its default
+            if (size > default_max_frame_size) {
+                throw connection_error(frame_size_error, "frame too large");
+            }
+            auto payload = size ? _in.read_exactly(size) : make_ready_future<tmp_buf>();
+            return payload.then([this, size, type, flags, stream_id] (tmp_buf payload) {
+                if (payload.size() < size) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return handle_frame(type, flags, stream_id, std::move(payload)).then([] {
+                    return stop_iteration::no;
+                });
+            });
+        });
+    });
+}
+
+future<> http2_connection::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, tmp_buf payload) {
+    if (_continued_stream && (frame_type(type) != frame_type::continuation || stream_id != _continued_stream)) {
+        throw connection_error(protocol_error, "expected CONTINUATION");
+    }
+    switch (frame_type(type)) {
+    case frame_type::data:
+        return handle_data(flags, stream_id, std::move(payload));
+    case frame_type::headers:
+        return handle_headers(flags, stream_id, std::move(payload));
+    case frame_type::continuation:
+        if (!_continued_stream) {
+            throw connection_error(protocol_error, "unexpected CONTINUATION");
+        }
+        return handle_continuation(flags, stream_id, std::move(payload));
+    case frame_type::settings:
+        if (stream_id) {
+            throw connection_error(protocol_error, "SETTINGS on a stream");
+        }
+        return handle_settings(flags, std::move(payload));
+    case frame_type::ping:
+        if (stream_id) {
+            throw connection_error(protocol_error, "PING on a stream");
+        }
+        if (payload.size() != 8) {
+            throw connection_error(frame_size_error, "invalid PING");
+        }
+        if (flags & flag::ack) {
+            return make_ready_future<>();
+        }
+        return send(frame(type, flag::ack, 0, payload.get(), payload.size()));
+    case frame_type::window_update:
+        handle_window_update(stream_id, std::move(payload));
+        return make_ready_future<>();
+    case frame_type::rst_stream:
+        if (!stream_id) {
+            throw connection_error(protocol_error, "RST_STREAM on the connection");
+        }
+        if (payload.size() != 4) {
+            throw connection_error(frame_size_error, "invalid RST_STREAM");
+        }
+        handle_rst_stream(stream_id);
+        return make_ready_future<>();
+    case frame_type::goaway:
+        // Streams already started go on, but no new ones will come
+        _goaway_received = true;
+        return make_ready_future<>();
+    case frame_type::push_promise:
+        throw connection_error(protocol_error, "PUSH_PROMISE from a client");
+    case frame_type::priority:
+        break;
+    }
+    // Unknown frame types are ignored
+    return make_ready_future<>();
+}
+
+future<> http2_connection::handle_settings(uint8_t flags, tmp_buf payload) {
+    if (flags & flag::ack) {
+        if (!payload.empty()) {
+            throw connection_error(frame_size_error, "SETTINGS ack with a payload");
+        }
+        return make_ready_future<>();
+    }
+    if (payload.size() % 6) {
+        throw connection_error(frame_size_error, "invalid SETTINGS");
+    }
+    apply_settings(payload.get(), payload.size());
+    return send(frame(uint8_t(frame_type::settings), flag::ack, 0, nullptr, 0));
+}
+
+void http2_connection::apply_settings(const char* p, size_t n) {
+    for (size_t i = 0; i + 6 <= n; i += 6) {
+        uint16_t id = (uint8_t(p[i]) << 8) | uint8_t(p[i + 1]);
+        uint32_t value = read_u32(p + i + 2);
+        switch (id) {
+        case enable_push:
+            if (value > 1) {
+                throw connection_error(protocol_error, "invalid SETTINGS_ENABLE_PUSH");
+            }
+            break;
+        case initial_window_size: {
+            if (value > max_window) {
+                throw connection_error(flow_control_error, "invalid SETTINGS_INITIAL_WINDOW_SIZE");
+            }
+            // Applies to the windows of open streams, too
+            auto delta = int64_t(value) - _peer_initial_window;
+            for (auto& s : _streams) {
+                s.second->send_window += delta;
+                if (s.second->send_window > max_window) {
+                    throw connection_error(flow_control_error, "stream window too large");
+                }
+            }
+            _peer_initial_window = value;
+            _window_available.broadcast();
+            break;
+        }
+        case max_frame_size:
+            if (value < default_max_frame_size || value > (1u << 24) - 1) {
+                throw connection_error(protocol_error, "invalid SETTINGS_MAX_FRAME_SIZE");
+            }
+            _peer_max_frame_size = value;
+            break;
+        default:
+            // Our encoder uses no dynamic table, so the client's table size
+            // does not matter; other settings only concern the client
+            break;
+        }
+    }
+}
+
+void http2_connection::handle_window_update(uint32_t stream_id, tmp_buf payload) {
+    if (payload.size() != 4) {
+        throw connection_error(frame_size_error, "invalid WINDOW_UPDATE");
+    }
+    auto increment = read_u32(payload.get()) & 0x7fffffff;
+    if (!increment) {
+        throw connection_error(protocol_error, "WINDOW_UPDATE of 0");
+    }
+    if (!stream_id) {
+        _send_window += increment;
+        if (_send_window > max_window) {
+            throw connection_error(flow_control_error, "connection window too large");
+        }
+    } else {
+        auto i = _streams.find(stream_id);
+        if (i == _streams.end()) {
+            return;
+        }
+        i->second->send_window += increment;
+        if (i->second->send_window > max_window) {
+            throw connection_error(flow_control_error, "stream window too large");
+        }
+    }
+    _window_available.broadcast();
+}
+
+void http2_connection::handle_rst_stream(uint32_t stream_id) {
+    if (stream_id > _last_stream_id) {
+        throw connection_error(protocol_error, "RST_STREAM on an idle stream");
+    }
+    auto i = _streams.find(stream_id);
+    if (i != _streams.end()) {
+        i->second->reset = true;
+        _streams.erase(i);
+        _window_available.broadcast();
+    }
+}
+
+future<> http2_connection::handle_headers(uint8_t flags, uint32_t stream_id, tmp_buf payload) {
+    if (!stream_id || !(stream_id & 1)) {
+        throw connection_error(protocol_error, "HEADERS on a stream a client cannot open");
+    }
+    strip_padding(flags, payload);
+    if (flags & flag::priority) {
+        if (payload.size() < 5) {
+            throw connection_error(frame_size_error, "invalid HEADERS priority");
+        }
+        payload.trim_front(5);
+    }
+    _header_block.assign(payload.begin(), payload.end());
+    _header_block_ends_stream = flags & flag::end_stream;
+    if (!(flags & flag::end_headers)) {
+        _continued_stream = stream_id;
+        return make_ready_future<>();
+    }
+    return end_header_block(stream_id);
+}
+
+future<> http2_connection::handle_continuation(uint8_t flags, uint32_t stream_id, tmp_buf payload) {
+    _header_block.insert(_header_block.end(), payload.begin(), payload.end());
+    if (_header_block.size() > 2 * _opts.max_header_list_size) {
+        throw connection_error(protocol_error, "header block too large");
+    }
+    if (!(flags & flag::end_headers)) {
+        return make_ready_future<>();
+    }
+    _continued_stream = 0;
+    return end_header_block(stream_id);
+}
+
+future<> http2_connection::end_header_block(uint32_t stream_id) {
+    header_list fields;
+    try {
+        fields = _decoder.decode(_header_block.data(), _header_block.size());
+    } catch (hpack_error&) {
+        throw connection_error(compression_error, "invalid header block");
+    }
+    _header_block.clear();
+    auto i = _streams.find(stream_id);
+    if (i != _streams.end()) {
+        // Trailers, which handlers have no use for
+        auto s = i->second;
+        if (s->remote_closed || !_header_block_ends_stream) {
+            throw connection_error(protocol_error, "HEADERS within a stream");
+        }
+        s->remote_closed = true;
+        dispatch(s);
+        return make_ready_future<>();
+    }
+    if (stream_id <= _last_stream_id) {
+        throw connection_error(stream_closed, "HEADERS on a closed stream");
+    }
+    _last_stream_id = stream_id;
+    if (_goaway_received || _streams.size() >= _opts.max_concurrent_streams) {
+        return send_rst_stream(stream_id, refused_stream);
+    }
+    return start_stream(stream_id, std::move(fields), _header_block_ends_stream);
+}
+
+future<> http2_connection::start_stream(uint32_t stream_id, header_list fields, bool end_stream) {
+    auto req = std::make_unique<request>();
+    sstring authority;
+    bool malformed = false;
+    bool regular_seen = false;
+    for (auto& f : fields) {
+        auto& name = f.first;
+        if (!name.empty() && name[0] == ':') {
+            malformed |= regular_seen;
+            if (name == ":method") {
+                req->_method = std::move(f.second);
+            } else if (name == ":path") {
+                req->_url = std::move(f.second);
+            } else if (name == ":authority") {
+                authority = std::move(f.second);
+            } else if (name != ":scheme") {
+                malformed = true;
+            }
+            continue;
+        }
+        regular_seen = true;
+        if (name.empty() || connection_specific(name) || to_lower(name) != name) {
+            malformed = true;
+            continue;
+        }
+        auto h = req->_headers.find(name);
+        if (h == req->_headers.end()) {
+            req->_headers[name] = std::move(f.second);
+        } else {
+            h->second += (name == "cookie" ? sstring("; ") : sstring(", ")) + f.second;
+        }
+    }
+    if (malformed || req->_method.empty() || req->_url.empty()) {
+        return send_rst_stream(stream_id, protocol_error);
+    }
+    if (!authority.empty() && !req->_headers.count("host")) {
+        req->_headers["host"] = authority;
+    }
+    req->_version = "2.0";
+    auto cl = req->_headers.find("content-length");
+    if (cl != req->_headers.end()) {
+        req->content_length = std::strtoull(cl->second.c_str(), nullptr, 10);
+    }
+    auto s = make_lw_shared<stream>();
+    s->id = stream_id;
+    s->req = std::move(req);
+    s->send_window = _peer_initial_window;
+    s->recv_window = _opts.initial_window_size;
+    s->remote_closed = end_stream;
+    _streams.emplace(stream_id, s);
+    if (end_stream) {
+        dispatch(s);
+    }
+    return make_ready_future<>();
+}
+
+future<> http2_connection::handle_data(uint8_t flags, uint32_t stream_id, tmp_buf payload) {
+    if (!stream_id) {
+        throw connection_error(protocol_error, "DATA on the connection");
+    }
+    // Padding counts against the windows too
+    int64_t size = payload.size();
+    _recv_window -= size;
+    if (_recv_window < 0) {
+        throw connection_error(flow_control_error, "connection window exceeded");
+    }
+    std::vector<tmp_buf> frames;
+    auto update = [&frames] (uint32_t id, uint32_t increment) {
+        char p[4];
+        put_u32(p, increment);
+        frames.push_back(frame(uint8_t(frame_type::window_update), 0, id, p, sizeof(p)));
+    };
+    int64_t initial = _opts.initial_window_size;
+    if (_recv_window <= initial / 2) {
+        update(0, initial - _recv_window);
+        _recv_window = initial;
+    }
+    strip_padding(flags, payload);
+    auto i = _streams.find(stream_id);
+    if (i == _streams.end()) {
+        if (stream_id > _last_stream_id) {
+            throw connection_error(protocol_error, "DATA on an idle stream");
+        }
+        // A stream we reset or refused, whose frames were already on
+        // their way
+    } else if (i->second->remote_closed) {
+        i->second->reset = true;
+        _streams.erase(i);
+        _window_available.broadcast();
+        char p[4];
+        put_u32(p, stream_closed);
+        frames.push_back(frame(uint8_t(frame_type::rst_stream), 0, stream_id, p, sizeof(p)));
+    } else {
+        auto s = i->second;
+        s->recv_window -= size;
+        if (s->recv_window < 0) {
+            throw connection_error(flow_control_error, "stream window exceeded");
+        }
+        if (!payload.empty()) {
+            s->body.push_back(std::move(payload));
+        }
+        if (flags & flag::end_stream) {
+            s->remote_closed = true;
+            dispatch(s);
+        } else if (s->recv_window <= initial / 2) {
+            update(stream_id, initial - s->recv_window);
+            s->recv_window = initial;
+        }
+    }
+    return frames.empty() ? make_ready_future<>() : send(std::move(frames));
+}
+
+void http2_connection::dispatch(lw_shared_ptr<stream> s) {
+    auto req = std::move(s->req);
+    if (!s->body.empty()) {
+        size_t size = 0;
+        for (auto& buf : s->body) {
+            size += buf.size();
+        }
+        sstring content(sstring::initialized_later(), size);
+        auto p = content.begin();
+        for (auto& buf : s->body) {
+            p = std::copy(buf.begin(), buf.end(), p);
+        }
+        req->content = std::move(content);
+        s->body.clear();
+    }
+    ++_server._requests_served;
+    auto url = http_server::connection::set_query_param(*req);
+    seastar::with_gate(_handlers, [this, s, url = std::move(url), req = std::move(req)] () mutable {
+        return _server._routes.handle(url, std::move(req), std::make_unique<reply>()).then([this, s] (std::unique_ptr<reply> rep) {
+            return send_reply(s, std::move(rep));
+        }).handle_exception([this, s] (std::exception_ptr) {
+            // A reply that failed part way cannot be completed
+            if (s->reset || _closing) {
+                return make_ready_future<>();
+            }
+            s->reset = true;
+            return send_rst_stream(s->id, internal_error);
+        }).finally([this, s] {
+            auto i = _streams.find(s->id);
+            if (i != _streams.end() && i->second == s) {
+                _streams.erase(i);
+            }
+        });
+    });
+}
+
+future<> http2_connection::send_reply(lw_shared_ptr<stream> s, std::unique_ptr<reply> rep) {
+    if (s->reset || _closing) {
+        return make_ready_future<>();
+    }
+    rep->_headers["Server"] = "Seastar httpd";
+    rep->_headers["Date"] = _server._date;
+    bool writer = rep->_body_writer || rep->_body_stream_writer;
+    if (!writer && rep->_status != reply::status_type::not_modified) {
+        rep->_headers["Content-Length"] = to_sstring(rep->_content.size());
+    }
+    bool has_body = writer || !rep->_content.empty();
+    std::vector<char> block;
+    hpack_encode(block, ":status", to_sstring(int(rep->_status)));
+    for (auto& h : rep->_headers) {
+        auto name = to_lower(h.first);
+        if (!connection_specific(name)) {
+            hpack_encode(block, name, h.second);
+        }
+    }
+    // HEADERS, then as many CONTINUATION frames as the block needs
+    std::vector<tmp_buf> frames;
+    size_t pos = 0;
+    do {
+        auto size = std::min<size_t>(block.size() - pos, _peer_max_frame_size);
+        auto type = pos ? frame_type::continuation : frame_type::headers;
+        uint8_t flags = pos + size == block.size() ? flag::end_headers : 0;
+        if (!pos && !has_body) {
+            flags |= flag::end_stream;
+        }
+        frames.push_back(frame(uint8_t(type), flags, s->id, block.data() + pos, size));
+        pos += size;
+    } while (pos < block.size());
+    auto f = send(std::move(frames));
+    if (!has_body) {
+        return f;
+    }
+    return f.then([this, s, rep = std::move(rep)] () mutable {
+        auto make_output = [this, s] {
+            return output_stream<char>(data_sink(std::make_unique<stream_sink>(*this, s)), default_max_frame_size);
+        };
+        if (rep->_body_stream_writer) {
+            auto& writer = rep->_body_stream_writer;
+            return writer(make_output()).finally([rep = std::move(rep)] {});
+        }
+        if (rep->_body_writer) {
+            return do_with(make_output(), std::move(rep), [] (output_stream<char>& out, std::unique_ptr<reply>& rep) {
+                return rep->_body_writer(out).then([&out] {
+                    return out.close();
+                });
+            });
+        }
+        auto& content = rep->_content;
+        tmp_buf body(content.begin(), content.size(), make_object_deleter(std::move(rep)));
+        return send_data(s, std::move(body), true);
+    });
+}
+
+future<> http2_connection::send_data(lw_shared_ptr<stream> s, tmp_buf data, bool end_stream) {
+    return do_with(std::move(data), [this, s, end_stream] (tmp_buf& data) {
+        return repeat([this, s, end_stream, &data] {
+            return _window_available.wait([this, s, &data] {
+                return _closing || _input_done || s->reset || data.empty() || (_send_window > 0 && s->send_window > 0);
+            }).then([this, s, end_stream, &data] {
+                if (_closing || s->reset) {
+                    throw stream_gone();
+                }
+                if (!data.empty() && (_send_window <= 0 || s->send_window <= 0)) {
+                    throw stream_gone();
+                }
+                if (data.empty() && !end_stream) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                size_t size = 0;
+                if (!data.empty()) {
+                    size = std::min<int64_t>({int64_t(data.size()), _peer_max_frame_size, _send_window, s->send_window});
+                }
+                auto chunk = data.share(0, size);
+                data.trim_front(size);
+                _send_window -= size;
+                s->send_window -= size;
+                auto last = data.empty();
+                tmp_buf header(9);
+                put_frame_header(header.get_write(), size, frame_type::data, last && end_stream ? flag::end_stream : 0, s->id);
+                std::vector<tmp_buf> bufs;
+                bufs.push_back(std::move(header));
+                bufs.push_back(std::move(chunk));
+                return send(std::move(bufs)).then([last] {
+                    return last ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        });
+    });
+}
+
+}
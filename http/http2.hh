@@ -0,0 +1,142 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "hpack.hh"
+#include "request.hh"
+#include "reply.hh"
+#include "core/condition-variable.hh"
+#include "core/gate.hh"
+#include "core/iostream.hh"
+#include "core/semaphore.hh"
+#include "core/shared_ptr.hh"
+#include <unordered_map>
+#include <vector>
+
+namespace httpd {
+
+class http_server;
+
+struct http2_options {
+    // Streams a client may have open at once; more are refused
+    uint32_t max_concurrent_streams = 100;
+    // How much request body a client may send ahead, per stream and per
+    // connection; at least 65535
+    uint32_t initial_window_size = 1 << 20;
+    // The largest header block accepted, as counted by HPACK
+    uint32_t max_header_list_size = 65536;
+};
+
+/**
+ * Serves HTTP/2 (RFC 7540) in clear text (h2c) on a connection of an
+ * http_server, after the client either started it with the HTTP/2
+ * preface or asked to upgrade an HTTP/1.1 request.
+ *
+ * Each stream carries one request, handled by the server's routes as
+ * requests over HTTP/1.1 are, and many are handled at once. Request
+ * bodies are read into request::content before the handler is called.
+ * Replies are sent subject to the client's flow control, which body
+ * writers wait on as on a slow socket. Server push and priorities are
+ * not supported.
+ */
+class http2_connection {
+public:
+    static constexpr const char* preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    static constexpr size_t preface_size = 24;
+    // The part of the preface an HTTP/1 parser reads as a request
+    static constexpr size_t preface_request_size = 18;
+private:
+    using tmp_buf = temporary_buffer<char>;
+    struct stream {
+        uint32_t id;
+        std::unique_ptr<request> req;
+        std::vector<tmp_buf> body;
+        int64_t send_window;
+        int64_t recv_window;
+        // The client sent END_STREAM
+        bool remote_closed = false;
+        // Either side reset the stream
+        bool reset = false;
+    };
+    class stream_sink;
+
+    http_server& _server;
+    input_stream<char>& _in;
+    output_stream<char>& _out;
+    http2_options _opts;
+    hpack_decoder _decoder;
+    std::unordered_map<uint32_t, lw_shared_ptr<stream>> _streams;
+    uint32_t _last_stream_id = 0;
+    // A header block being continued in CONTINUATION frames
+    uint32_t _continued_stream = 0;
+    std::vector<char> _header_block;
+    bool _header_block_ends_stream = false;
+    // Flow control of what we send, by the client's settings and updates
+    int64_t _send_window = 65535;
+    int64_t _peer_initial_window = 65535;
+    uint32_t _peer_max_frame_size = 16384;
+    condition_variable _window_available;
+    // Flow control of what the client sends
+    int64_t _recv_window = 65535;
+    // Keeps frames whole on the wire
+    semaphore _write_sem { 1 };
+    seastar::gate _handlers;
+    bool _goaway_received = false;
+    // The connection is ending, and cannot be sent more
+    bool _closing = false;
+    // The client sends no more frames, so windows will not grow
+    bool _input_done = false;
+private:
+    future<> read_frames();
+    future<> handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, tmp_buf payload);
+    future<> handle_headers(uint8_t flags, uint32_t stream_id, tmp_buf payload);
+    future<> handle_continuation(uint8_t flags, uint32_t stream_id, tmp_buf payload);
+    future<> end_header_block(uint32_t stream_id);
+    future<> handle_data(uint8_t flags, uint32_t stream_id, tmp_buf payload);
+    future<> handle_settings(uint8_t flags, tmp_buf payload);
+    void apply_settings(const char* p, size_t n);
+    void handle_window_update(uint32_t stream_id, tmp_buf payload);
+    void handle_rst_stream(uint32_t stream_id);
+    future<> start_stream(uint32_t stream_id, header_list fields, bool end_stream);
+    void dispatch(lw_shared_ptr<stream> s);
+    future<> send_reply(lw_shared_ptr<stream> s, std::unique_ptr<reply> rep);
+    future<> send_data(lw_shared_ptr<stream> s, tmp_buf data, bool end_stream);
+    future<> send_rst_stream(uint32_t stream_id, uint32_t error);
+    future<> send_goaway(uint32_t error);
+    future<> send(std::vector<tmp_buf> bufs);
+    future<> send(tmp_buf frames);
+    static tmp_buf frame(uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, size_t size);
+public:
+    http2_connection(http_server& server, input_stream<char>& in, output_stream<char>& out,
+            const http2_options& opts);
+    /**
+     * Serves the connection until the client closes it or breaks the
+     * protocol, and all streams are done; does not close the streams.
+     * @param preface_read how much of the client preface has been read
+     * @param upgraded an HTTP/1.1 request the client asked to upgrade,
+     * once the 101 reply is sent; it becomes stream 1, and its
+     * HTTP2-Settings header the client's initial settings
+     */
+    future<> process(size_t preface_read, std::unique_ptr<request> upgraded = nullptr);
+};
+
+}
@@ -20,12 +20,14 @@
  */
 
 #include "core/ragel.hh"
+#include "http/header_map.hh"
+#include <cstdlib>
 #include <memory>
-#include <unordered_map>
 
 struct http_response {
     sstring _version;
-    std::unordered_map<sstring, sstring> _headers;
+    int _status = 0;
+    httpd::header_map _headers;
 };
 
 %% machine http_response;
@@ -42,6 +44,10 @@ action store_version {
     _rsp->_version = str();
 }
 
+action store_status {
+    _rsp->_status = std::atoi(str().c_str());
+}
+
 action store_field_name {
     _field_name = str();
 }
@@ -78,7 +84,8 @@ http_version = 'HTTP/' (digit '.' digit) >mark %store_version;
 
 field = tchar+ >mark %store_field_name;
 value = any* >mark %store_value;
-start_line = http_version space digit digit digit space (any - cr - lf)* crlf;
+status = (digit digit digit) >mark %store_status;
+start_line = http_version space status space (any - cr - lf)* crlf;
 header_1st = (field sp_ht* ':' value :> crlf) %assign_field;
 header_cont = (sp_ht+ value sp_ht* crlf) %extend_field;
 header = header_1st header_cont*;
@@ -57,6 +57,23 @@ http_stats::http_stats(http_server& server)
                     "http_requests", "served"),
             scollectd::make_typed(scollectd::data_type::DERIVE,
                     [&server] { return server.requests_served(); })),
+        scollectd::add_polled_metric(
+            scollectd::type_instance_id("httpd", scollectd::per_cpu_plugin_instance,
+                    "current_connections", "idle"),
+            scollectd::make_typed(scollectd::data_type::GAUGE,
+                    [&server] { return server.idle_connections(); })),
+        scollectd::add_polled_metric(
+            scollectd::type_instance_id("httpd", scollectd::per_cpu_plugin_instance,
+                    "bytes", "connection-memory"),
+            scollectd::make_typed(scollectd::data_type::GAUGE,
+                    [&server] { return server.connection_memory(); })),
     } {
 }
+
+uint64_t http_server::connection_memory() const {
+    // The posix stack's receive buffer; a busy connection may hold less
+    static constexpr uint64_t read_buffer_size = 8192;
+    return _current_connections * sizeof(connection)
+            + (_current_connections - _idle_connections) * read_buffer_size;
+}
 }
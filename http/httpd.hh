@@ -44,6 +44,8 @@
 #include <boost/intrusive/list.hpp>
 #include "reply.hh"
 #include "http/routes.hh"
+#include "http/body_stream.hh"
+#include "http/http2.hh"
 
 namespace httpd {
 
@@ -63,13 +65,18 @@ class http_server {
     http_stats _stats { *this };
     uint64_t _total_connections = 0;
     uint64_t _current_connections = 0;
+    // Connections waiting for the first bytes of their next request
+    uint64_t _idle_connections = 0;
     uint64_t _requests_served = 0;
     uint64_t _connections_being_accepted = 0;
+    size_t _pipeline_depth = 10;
+    http2_options _http2_options;
     sstring _date = http_date();
     timer<> _date_format_timer { [this] {_date = http_date();} };
     bool _stopping = false;
     promise<> _all_connections_stopped;
     future<> _stopped = _all_connections_stopped.get_future();
+    friend class http2_connection;
 private:
     void maybe_idle() {
         if (_stopping && !_connections_being_accepted && !_current_connections) {
@@ -89,6 +96,19 @@ class http_server {
         _stopped = when_all(std::move(_stopped), do_accepts(_listeners.size() - 1)).discard_result();
         return make_ready_future<>();
     }
+    /**
+     * Sets how many requests of a connection may be handled ahead of the
+     * one whose reply is being sent, for connections accepted afterwards
+     */
+    void set_pipeline_depth(size_t depth) {
+        _pipeline_depth = std::max<size_t>(depth, 1);
+    }
+    /**
+     * Sets the limits of HTTP/2 connections accepted afterwards
+     */
+    void set_http2_options(const http2_options& opts) {
+        _http2_options = opts;
+    }
     future<> stop() {
         _stopping = true;
         for (auto&& l : _listeners) {
@@ -137,18 +157,37 @@ class http_server {
         http_request_parser _parser;
         std::unique_ptr<request> _req;
         std::unique_ptr<reply> _resp;
-        // null element marks eof
-        queue<std::unique_ptr<reply>> _replies { 10 };bool _done = false;
+        // The body of the request being handled
+        input_stream<char> _body;
+        // A reply in the making; a queue element cannot be a future itself
+        struct pending_reply {
+            future<std::unique_ptr<reply>> rep;
+        };
+        // Replies in request order; a null reply marks eof
+        queue<pending_reply> _replies;
+        bool _done = false;
+        bool _first_request = true;
+        bool _idle = false;
+        // Feeds the parser, the first bytes of a request ending idleness
+        struct request_reader {
+            connection& _c;
+            future<input_stream<char>::unconsumed_remainder> operator()(tmp_buf buf) {
+                _c.set_idle(false);
+                return _c._parser(std::move(buf));
+            }
+        };
+        request_reader _reader{*this};
     public:
         connection(http_server& server, connected_socket&& fd,
                 socket_address addr)
                 : _server(server), _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(
-                        _fd.output()) {
+                        _fd.output()), _replies(server._pipeline_depth) {
             ++_server._total_connections;
             ++_server._current_connections;
             _server._connections.push_back(*this);
         }
         ~connection() {
+            set_idle(false);
             --_server._current_connections;
             _server._connections.erase(_server._connections.iterator_to(*this));
             _server.maybe_idle();
@@ -171,36 +210,103 @@ class http_server {
             }).then_wrapped([this] (future<> f) {
                 // swallow error
                 // FIXME: count it?
-                    return _replies.push_eventually( {});
+                    return _replies.push_eventually({make_ready_future<std::unique_ptr<reply>>()});
             }).finally([this] {
                 return _read_buf.close();
             });
         }
+        // An idle connection holds no read buffer: the stream lets go of it
+        // once a request is consumed, and the data source allocates the
+        // next one only when data arrives
+        void set_idle(bool idle) {
+            if (_idle != idle) {
+                _idle = idle;
+                if (idle) {
+                    ++_server._idle_connections;
+                } else {
+                    --_server._idle_connections;
+                }
+            }
+        }
         future<> read_one() {
             _parser.init();
-            return _read_buf.consume(_parser).then([this] () mutable {
+            set_idle(true);
+            return _read_buf.consume(_reader).then([this] () mutable {
                 if (_parser.eof()) {
                     _done = true;
                     return make_ready_future<>();
                 }
-                ++_server._requests_served;
                 std::unique_ptr<httpd::request> req = _parser.get_parsed_request();
+                // A client may only switch to HTTP/2 before anything else
+                auto first = std::exchange(_first_request, false);
+                if (first && req->_method == "PRI" && req->_url == "*" && req->_version == "2.0") {
+                    return serve_http2(http2_connection::preface_request_size, nullptr);
+                }
+                ++_server._requests_served;
+                set_body(*req);
+                if (first && wants_h2c_upgrade(*req)) {
+                    static const sstring switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                            "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+                    return _write_buf.write(switching).then([this] {
+                        return _write_buf.flush();
+                    }).then([this, req = std::move(req)] () mutable {
+                        return serve_http2(0, std::move(req));
+                    });
+                }
 
                 return _replies.not_full().then([req = std::move(req), this] () mutable {
                     return generate_reply(std::move(req));
                 }).then([this](bool done) {
                     _done = done;
+                    // Whatever the handler left of the body precedes the
+                    // next request
+                    return done ? make_ready_future<>() : skip_entire_body(_body);
                 });
             });
         }
+        static bool wants_h2c_upgrade(const request& req) {
+            // Requests with a body keep HTTP/1.1, which is allowed
+            return !req.content_stream && req._headers.count("HTTP2-Settings")
+                    && req.get_header("Upgrade").find("h2c") != sstring::npos;
+        }
+        // Hands the connection over to HTTP/2 for good; the reply loop is
+        // idle, as this is the first request
+        future<> serve_http2(size_t preface_read, std::unique_ptr<request> upgraded) {
+            _done = true;
+            auto h2 = std::make_unique<http2_connection>(_server, _read_buf, _write_buf, _server._http2_options);
+            auto& c = *h2;
+            return c.process(preface_read, std::move(upgraded)).finally([h2 = std::move(h2)] {});
+        }
+        void set_body(request& req) {
+            _body = input_stream<char>();
+            auto te = req._headers.find("Transfer-Encoding");
+            if (te != req._headers.end() && te->second != "identity") {
+                _body = make_chunked_body(_read_buf);
+                req.content_stream = &_body;
+                return;
+            }
+            auto cl = req._headers.find("Content-Length");
+            if (cl != req._headers.end()) {
+                char* end;
+                req.content_length = std::strtoull(cl->second.c_str(), &end, 10);
+                if (cl->second.empty() || *end) {
+                    throw std::runtime_error("invalid Content-Length");
+                }
+            }
+            _body = make_content_length_body(_read_buf, req.content_length);
+            if (req.content_length) {
+                req.content_stream = &_body;
+            }
+        }
         future<> respond() {
             return do_response_loop().finally([this] {
                 return _write_buf.close();
             });
         }
         future<> do_response_loop() {
-            return _replies.pop_eventually().then(
-                    [this] (std::unique_ptr<reply> resp) {
+            return _replies.pop_eventually().then([] (pending_reply p) {
+                return std::move(p.rep);
+            }).then([this] (std::unique_ptr<reply> resp) {
                         if (!resp) {
                             // eof
                             return make_ready_future<>();
@@ -214,8 +320,16 @@ class http_server {
         future<> start_response() {
             _resp->_headers["Server"] = "Seastar httpd";
             _resp->_headers["Date"] = _server._date;
-            _resp->_headers["Content-Length"] = to_sstring(
-                    _resp->_content.size());
+            if (_resp->_body_stream_writer) {
+                if (_resp->_version == "1.1") {
+                    _resp->_headers["Transfer-Encoding"] = "chunked";
+                }
+            } else if (!_resp->_body_writer && _resp->_status != reply::status_type::not_modified) {
+                // A 304 has no body, and a length would be the one the
+                // full reply would have had
+                _resp->_headers["Content-Length"] = to_sstring(
+                        _resp->_content.size());
+            }
             return _write_buf.write(_resp->_response_line.begin(),
                     _resp->_response_line.size()).then([this] {
                 return write_reply_headers(_resp->_headers.begin());
@@ -224,9 +338,13 @@ class http_server {
             }).then([this] {
                 return write_body();
             }).then([this] {
-                return _write_buf.flush();
-            }).then([this] {
+                // Replies to pipelined requests go out together, flushed
+                // by the last one that is ready
                 _resp.reset();
+                if (_replies.empty() || !_replies.front().rep.available()) {
+                    return _write_buf.flush();
+                }
+                return make_ready_future<>();
             });
         }
         future<> write_reply_headers(
@@ -330,6 +448,13 @@ class http_server {
             return req._url.substr(0, pos);
         }
 
+        /**
+         * Starts handling req and queues its reply. Resolves to whether the
+         * connection should close once the next request may be read: at
+         * once if req has no body and the connection stays open whatever
+         * the reply, so that the requests a client pipelines are handled
+         * together, and otherwise when the reply is ready.
+         */
         future<bool> generate_reply(std::unique_ptr<request> req) {
             auto resp = std::make_unique<reply>();
             bool conn_keep_alive = false;
@@ -359,15 +484,36 @@ class http_server {
             }
             sstring url = set_query_param(*req.get());
             sstring version = req->_version;
-            return _server._routes.handle(url, std::move(req), std::move(resp)).
-            // Caller guarantees enough room
-            then([this, should_close, version = std::move(version)](std::unique_ptr<reply> rep) {
+            // A streamed reply closes the connection unless it is chunked
+            bool parse_ahead = !should_close && !req->content_stream && version == "1.1";
+            auto f = _server._routes.handle(url, std::move(req), std::move(resp)).then(
+                    [version] (std::unique_ptr<reply> rep) {
                 rep->set_version(version).done();
-                this->_replies.push(std::move(rep));
+                return rep;
+            });
+            // Caller guarantees enough room
+            if (parse_ahead) {
+                _replies.push({std::move(f)});
+                return make_ready_future<bool>(false);
+            }
+            return f.then([this, should_close, version = std::move(version)](std::unique_ptr<reply> rep) mutable {
+                if (rep->_body_stream_writer && version != "1.1") {
+                    // Without chunked encoding the end of the body is the
+                    // end of the connection
+                    rep->_headers.erase("Connection");
+                    should_close = true;
+                }
+                this->_replies.push({make_ready_future<std::unique_ptr<reply>>(std::move(rep))});
                 return make_ready_future<bool>(should_close);
             });
         }
         future<> write_body() {
+            if (_resp->_body_stream_writer) {
+                return _resp->_body_stream_writer(make_chunked_output(_write_buf, _resp->_version == "1.1"));
+            }
+            if (_resp->_body_writer) {
+                return _resp->_body_writer(_write_buf);
+            }
             return _write_buf.write(_resp->_content.begin(),
                     _resp->_content.size());
         }
@@ -381,6 +527,12 @@ class http_server {
     uint64_t requests_served() const {
         return _requests_served;
     }
+    uint64_t idle_connections() const {
+        return _idle_connections;
+    }
+    /// Estimated memory held by connections: each one's own state, plus
+    /// a read buffer for each that is not idle
+    uint64_t connection_memory() const;
     static sstring http_date() {
         auto t = ::time(nullptr);
         struct tm tm;
@@ -430,6 +582,18 @@ class http_server_control {
         return _server_dist->invoke_on_all(&http_server::listen, addr);
     }
 
+    future<> set_http2_options(http2_options opts) {
+        return _server_dist->invoke_on_all([opts] (http_server& server) {
+            server.set_http2_options(opts);
+        });
+    }
+
+    future<> set_pipeline_depth(size_t depth) {
+        return _server_dist->invoke_on_all([depth] (http_server& server) {
+            server.set_pipeline_depth(depth);
+        });
+    }
+
     distributed<http_server>& server() {
         return *_server_dist;
     }
@@ -108,6 +108,10 @@ class match_rule {
         return *this;
     }
 
+    const std::vector<matcher*>& matchers() const {
+        return _match_list;
+    }
+
 private:
     std::vector<matcher*> _match_list;
     handler_base* _handler;
@@ -32,14 +32,18 @@
 #pragma once
 
 #include "core/sstring.hh"
+#include "core/iostream.hh"
+#include <functional>
 #include <unordered_map>
 #include "http/mime_types.hh"
+#include "core/object_pool.hh"
 
 namespace httpd {
 /**
  * A reply to be sent to a client.
  */
-struct reply {
+struct reply : public seastar::pooled<reply> {
+    static const char* object_pool_name() { return "http_reply"; }
     /**
      * The status of the reply.
      */
@@ -72,6 +76,15 @@ struct reply {
      * The content to be sent in the reply.
      */
     sstring _content;
+    /**
+     * If set, writes the body in place of _content; whoever sets it must
+     * also set the Content-Length header.
+     */
+    std::function<future<> (output_stream<char>&)> _body_writer;
+    /**
+     * Set by write_body()
+     */
+    std::function<future<> (output_stream<char>&&)> _body_stream_writer;
 
     sstring _response_line;
     reply()
@@ -115,6 +128,18 @@ struct reply {
         return *this;
     }
 
+    /**
+     * Produce the body by writing to a stream instead of setting _content,
+     * without knowing its length up front. body_writer owns the stream and
+     * must close it. The body is sent with chunked transfer encoding, or,
+     * to an HTTP/1.0 client, as is, followed by closing the connection.
+     */
+    reply& write_body(const sstring& content_type, std::function<future<> (output_stream<char>&&)>&& body_writer) {
+        set_content_type(content_type);
+        _body_stream_writer = std::move(body_writer);
+        return *this;
+    }
+
     reply& done(const sstring& content_type) {
         return set_content_type(content_type).done();
     }
@@ -32,10 +32,13 @@
 #define HTTP_REQUEST_HPP
 
 #include "core/sstring.hh"
+#include "core/iostream.hh"
 #include <string>
 #include <vector>
 #include <strings.h>
 #include "common.hh"
+#include "header_map.hh"
+#include "core/object_pool.hh"
 
 namespace httpd {
 class connection;
@@ -43,7 +46,8 @@ class connection;
 /**
  * A request received from a client.
  */
-struct request {
+struct request : public seastar::pooled<request> {
+    static const char* object_pool_name() { return "http_request"; }
     enum class ctclass
         : char {
             other, multipart, app_x_www_urlencoded,
@@ -56,11 +60,18 @@ struct request {
     int http_version_minor;
     ctclass content_type_class;
     size_t content_length = 0;
-    std::unordered_map<sstring, sstring> _headers;
-    std::unordered_map<sstring, sstring> query_parameters;
+    // Header names are looked up regardless of case
+    header_map _headers;
+    query_parameter_map query_parameters;
     connection* connection_ptr;
     parameters param;
     sstring content;
+    /**
+     * The body as it arrives, for handlers that stream it; see
+     * handler_base::streams_request_body(), or nullptr if there is none.
+     * Others find it in content.
+     */
+    input_stream<char>* content_stream = nullptr;
     sstring protocol_name;
 
     /**
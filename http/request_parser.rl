@@ -66,6 +66,21 @@ action extend_field  {
     _req->_headers[_field_name] += sstring(" ") + std::move(_value);
 }
 
+# Entered on an ordinary byte of a run that can only end at the given
+# delimiters; skips to just before the next delimiter (or the end of the
+# buffer), staying in the same state.
+action skip_uri {
+    if (*p != '\r') {
+        p = find_either(p + 1, pe, ' ', '\r') - 1;
+    }
+}
+
+action skip_value {
+    if (*p != ' ' && *p != '\t' && *p != '\r') {
+        p = find_either(p + 1, pe, '\r', '\r') - 1;
+    }
+}
+
 action done {
     done = true;
     fbreak;
@@ -83,13 +98,13 @@ sp_ht = sp | ht;
 op_char = upper;
 
 operation = op_char+ >mark %store_method;
-uri = (any - sp)+ >mark %store_uri;
+uri = (any - sp)+ >mark $skip_uri %store_uri;
 http_version = 'HTTP/' (digit '.' digit) >mark %store_version;
 
 field = tchar+ >mark %store_field_name;
 value = any* >mark %store_value;
 start_line = ((operation sp uri sp http_version) -- crlf) crlf;
-header_1st = (field sp_ht* ':' sp_ht* value :> crlf) %assign_field;
+header_1st = (field sp_ht* ':' sp_ht* (value $skip_value) :> crlf) %assign_field;
 header_cont = (sp_ht+ value sp_ht* crlf) %extend_field;
 header = header_1st header_cont*;
 main := start_line header* :> (crlf @done);
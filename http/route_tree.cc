@@ -0,0 +1,141 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#include "route_tree.hh"
+#include <algorithm>
+#include <vector>
+
+namespace httpd {
+
+namespace {
+
+struct step {
+    enum class kind { literal, param, remainder };
+    kind k;
+    sstring segment;
+};
+
+// Splits a rule into segments, as long as it consists of str_matchers
+// holding whole segments and param_matchers, a whole-path one last
+bool compile(const match_rule& rule, std::vector<step>& steps) {
+    auto& matchers = rule.matchers();
+    for (size_t i = 0; i < matchers.size(); ++i) {
+        if (auto s = dynamic_cast<const str_matcher*>(matchers[i])) {
+            auto& str = s->str();
+            if (str.empty() || str[0] != '/') {
+                return false;
+            }
+            size_t pos = 1;
+            while (true) {
+                auto end = std::min(str.find('/', pos), str.size());
+                if (end == pos) {
+                    return false;
+                }
+                steps.push_back({step::kind::literal, str.substr(pos, end - pos)});
+                if (end == str.size()) {
+                    break;
+                }
+                pos = end + 1;
+            }
+        } else if (auto p = dynamic_cast<const param_matcher*>(matchers[i])) {
+            if (p->entire_path()) {
+                if (i + 1 != matchers.size()) {
+                    return false;
+                }
+                steps.push_back({step::kind::remainder, sstring()});
+            } else {
+                steps.push_back({step::kind::param, sstring()});
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+constexpr size_t route_tree::npos;
+
+bool route_tree::add(const match_rule& rule, size_t index) {
+    std::vector<step> steps;
+    if (!compile(rule, steps)) {
+        return false;
+    }
+    node* n = &_root;
+    for (auto& s : steps) {
+        n->min_index = std::min(n->min_index, index);
+        switch (s.k) {
+        case step::kind::literal: {
+            auto& child = n->literals[s.segment];
+            if (!child) {
+                child = std::make_unique<node>();
+            }
+            n = child.get();
+            break;
+        }
+        case step::kind::param:
+            if (!n->param) {
+                n->param = std::make_unique<node>();
+            }
+            n = n->param.get();
+            break;
+        case step::kind::remainder:
+            n->remainder = std::min(n->remainder, index);
+            return true;
+        }
+    }
+    n->min_index = std::min(n->min_index, index);
+    n->terminal = std::min(n->terminal, index);
+    return true;
+}
+
+size_t route_tree::find(const sstring& url) const {
+    size_t best = npos;
+    find(_root, url, 0, best);
+    return best;
+}
+
+void route_tree::find(const node& n, const sstring& url, size_t ind, size_t& best) const {
+    if (n.min_index >= best) {
+        return;
+    }
+    best = std::min(best, n.remainder);
+    // match_rule accepts a url with a trailing slash left over
+    if (ind + 1 >= url.size()) {
+        best = std::min(best, n.terminal);
+    }
+    if (ind >= url.size()) {
+        return;
+    }
+    auto end = std::min(url.find('/', ind + 1), url.size());
+    if (!n.literals.empty()) {
+        auto i = n.literals.find(url.substr(ind + 1, end - ind - 1));
+        if (i != n.literals.end()) {
+            find(*i->second, url, end, best);
+        }
+    }
+    if (n.param) {
+        find(*n.param, url, end, best);
+    }
+}
+
+}
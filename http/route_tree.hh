@@ -0,0 +1,81 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "matchrules.hh"
+#include "core/fast_hash.hh"
+#include "core/sstring.hh"
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+namespace httpd {
+
+/**
+ * An index of match rules by path segment, so that finding the rule a url
+ * matches walks the url once instead of trying every rule in turn.
+ *
+ * Each node stands for a position between segments; it has a child per
+ * literal segment that may follow, one for a parameter segment, and the
+ * rules that end there. Rules are known by their insertion index and the
+ * lowest matching index wins, so the order in which rules are tried is
+ * kept. Where a literal and a parameter both match a segment, both are
+ * followed, skipping subtrees whose rules all come after the best match
+ * found so far.
+ *
+ * The tree only tells which rule matches; the rule itself then fills in
+ * the parameters.
+ */
+class route_tree {
+public:
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    /**
+     * Indexes rule under the given insertion index
+     * @return false, leaving the tree unchanged, if the rule has matchers
+     * the tree cannot express, which must then be tried on their own
+     */
+    bool add(const match_rule& rule, size_t index);
+
+    /**
+     * The lowest index of a rule added to the tree that matches url, or
+     * npos if none does
+     * @param url a path, which is empty or starts with a slash
+     */
+    size_t find(const sstring& url) const;
+private:
+    struct node {
+        std::unordered_map<sstring, std::unique_ptr<node>, sstring_fast_hash, sstring_fast_equal> literals;
+        std::unique_ptr<node> param;
+        // a rule that ends here
+        size_t terminal = npos;
+        // a rule whose last parameter takes the rest of the url from here
+        size_t remainder = npos;
+        // the lowest index in this subtree
+        size_t min_index = npos;
+    };
+    node _root;
+private:
+    void find(const node& n, const sstring& url, size_t ind, size_t& best) const;
+};
+
+}
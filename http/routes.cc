@@ -22,6 +22,9 @@
 #include "routes.hh"
 #include "reply.hh"
 #include "exception.hh"
+#include "body_stream.hh"
+#include "compress.hh"
+#include "core/tracing.hh"
 
 namespace httpd {
 
@@ -81,13 +84,54 @@ std::unique_ptr<reply> routes::exception_reply(std::exception_ptr eptr) {
 }
 
 future<std::unique_ptr<reply> > routes::handle(const sstring& path, std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
-    handler_base* handler = get_handler(str2type(req->_method),
-            normalize_url(path), req->param);
+    seastar::tracing::span span("http");
+    if (span.sampled()) {
+        span.set_detail(req->_method + " " + path);
+    }
+    // The span ends once the reply is ready, before its body is written
+    return seastar::tracing::with_span(std::move(span), [&] {
+        handler_base* handler = get_handler(str2type(req->_method),
+                normalize_url(path), req->param);
+        if (handler != nullptr && handler->_limit) {
+            // A shed request's body is not read; the connection skips it
+            return handler->_limit->run([this, handler, path, req = std::move(req), rep = std::move(rep)] () mutable {
+                return read_body_and_call(handler, path, std::move(req), std::move(rep));
+            });
+        }
+        return read_body_and_call(handler, path, std::move(req), std::move(rep));
+    });
+}
+
+future<std::unique_ptr<reply> > routes::read_body_and_call(handler_base* handler, const sstring& path,
+        std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+    if (handler != nullptr && req->content_stream && !handler->streams_request_body()) {
+        auto& in = *req->content_stream;
+        return read_entire_body(in).then([this, handler, path, req = std::move(req), rep = std::move(rep)] (sstring content) mutable {
+            req->content = std::move(content);
+            req->content_stream = nullptr;
+            return call_handler(handler, path, std::move(req), std::move(rep));
+        });
+    }
+    return call_handler(handler, path, std::move(req), std::move(rep));
+}
+
+future<std::unique_ptr<reply> > routes::call_handler(handler_base* handler, const sstring& path,
+        std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
     if (handler != nullptr) {
         try {
             for (auto& i : handler->_mandatory_param) {
                 verify_param(*req.get(), i);
             }
+            if (handler->_compress_min_size) {
+                // The handler consumes the request, keep what we need of it
+                auto accepts = req->get_header("Accept-Encoding");
+                auto min_size = *handler->_compress_min_size;
+                auto r = handler->handle(path, std::move(req), std::move(rep));
+                return r.then([accepts = std::move(accepts), min_size] (std::unique_ptr<reply> rep) {
+                    compress_reply(accepts, *rep, min_size);
+                    return rep;
+                }).handle_exception(_general_handler);
+            }
             auto r =  handler->handle(path, std::move(req), std::move(rep));
             return r.handle_exception(_general_handler);
         } catch (const redirect_exception& _e) {
@@ -120,15 +164,42 @@ handler_base* routes::get_handler(operation_type type, const sstring& url,
         return handler;
     }
 
-    for (auto rule = _rules[type].cbegin(); rule != _rules[type].cend();
-            ++rule) {
-        handler = (*rule)->get(url, params);
-        if (handler != nullptr) {
+    auto& rules = _rules[type];
+    auto match = [&] (size_t i) {
+        handler = rules[i]->get(url, params);
+        if (handler == nullptr) {
+            params.clear();
+        }
+        return handler;
+    };
+    if (!url.empty() && url[0] != '/') {
+        // Not a path, which the tree cannot look up
+        for (size_t i = 0; i < rules.size(); i++) {
+            if (match(i)) {
+                return handler;
+            }
+        }
+        return nullptr;
+    }
+    auto best = _trees[type].find(url);
+    for (auto i : _unindexed_rules[type]) {
+        if (i > best) {
+            break;
+        }
+        if (match(i)) {
             return handler;
         }
-        params.clear();
     }
-    return nullptr;
+    return best != route_tree::npos ? match(best) : nullptr;
+}
+
+routes& routes::add(match_rule* rule, operation_type type) {
+    auto index = _rules[type].size();
+    _rules[type].push_back(rule);
+    if (!_trees[type].add(*rule, index)) {
+        _unindexed_rules[type].push_back(index);
+    }
+    return *this;
 }
 
 routes& routes::add(operation_type type, const url& url,
@@ -141,4 +212,34 @@ routes& routes::add(operation_type type, const url& url,
     return add(rule, type);
 }
 
+concurrency_limit::concurrency_limit(const sstring& name, size_t max_in_flight,
+        std::chrono::milliseconds queue_timeout, std::chrono::seconds retry_after)
+    : _sem(max_in_flight)
+    , _queue_timeout(queue_timeout)
+    , _retry_after(retry_after)
+    , _regs{
+        scollectd::add_polled_metric(
+            scollectd::type_instance_id("httpd", scollectd::per_cpu_plugin_instance,
+                    "current_requests", name + "-in-flight"),
+            scollectd::make_typed(scollectd::data_type::GAUGE, _in_flight)),
+        scollectd::add_polled_metric(
+            scollectd::type_instance_id("httpd", scollectd::per_cpu_plugin_instance,
+                    "current_requests", name + "-queued"),
+            scollectd::make_typed(scollectd::data_type::GAUGE, _queued)),
+        scollectd::add_polled_metric(
+            scollectd::type_instance_id("httpd", scollectd::per_cpu_plugin_instance,
+                    "http_requests", name + "-shed"),
+            scollectd::make_typed(scollectd::data_type::DERIVE, _shed)),
+    } {
+}
+
+std::unique_ptr<reply> concurrency_limit::shed() {
+    _shed++;
+    auto rep = std::make_unique<reply>();
+    json_exception ex(service_unavailable_exception("Too many requests in progress"));
+    rep->add_header("Retry-After", to_sstring(_retry_after.count()));
+    rep->set_status(reply::status_type::service_unavailable, ex.to_json()).done("json");
+    return rep;
+}
+
 }
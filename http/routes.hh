@@ -23,6 +23,7 @@
 #define ROUTES_HH_
 
 #include "matchrules.hh"
+#include "route_tree.hh"
 #include "handlers.hh"
 #include "common.hh"
 #include "reply.hh"
@@ -31,6 +32,7 @@
 #include <unordered_map>
 #include <vector>
 #include "core/future-util.hh"
+#include "core/fast_hash.hh"
 
 namespace httpd {
 
@@ -71,7 +73,8 @@ class url {
  * It uses two decision mechanism exact match, if a url matches exactly
  * (an optional leading slash is permitted) it is choosen
  * If not, the matching rules are used.
- * matching rules are evaluated by their insertion order
+ * matching rules are evaluated by their insertion order, though rules
+ * made of path strings and parameters are looked up in a route_tree
  */
 class routes {
 public:
@@ -103,10 +106,7 @@ class routes {
      * @param type the operation type
      * @return it self
      */
-    routes& add(match_rule* rule, operation_type type = GET) {
-        _rules[type].push_back(rule);
-        return *this;
-    }
+    routes& add(match_rule* rule, operation_type type = GET);
 
     /**
      * Add a url match to a handler:
@@ -152,6 +152,19 @@ class routes {
     handler_base* get_handler(operation_type type, const sstring& url,
             parameters& params);
 
+    /**
+     * Read the whole request body, unless the handler streams it, and
+     * call the handler
+     */
+    future<std::unique_ptr<reply> > read_body_and_call(handler_base* handler, const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+
+    /**
+     * Call the handler found by handle(), or reply not found if there is none
+     */
+    future<std::unique_ptr<reply> > call_handler(handler_base* handler, const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+
     /**
      * Normalize the url to remove the last / if exists
      * and get the parameter part
@@ -161,8 +174,11 @@ class routes {
      */
     sstring normalize_url(const sstring& url);
 
-    std::unordered_map<sstring, handler_base*> _map[NUM_OPERATION];
+    std::unordered_map<sstring, handler_base*, sstring_fast_hash, sstring_fast_equal> _map[NUM_OPERATION];
     std::vector<match_rule*> _rules[NUM_OPERATION];
+    route_tree _trees[NUM_OPERATION];
+    // Indexes in _rules of the rules _trees cannot hold, in order
+    std::vector<size_t> _unindexed_rules[NUM_OPERATION];
 public:
     using exception_handler_fun = std::function<std::unique_ptr<reply>(std::exception_ptr eptr)>;
     using exception_handler_id = size_t;
@@ -22,11 +22,426 @@
 #include "formatter.hh"
 #include "json_elements.hh"
 #include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 namespace json {
 
+namespace {
+
+const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+// Writes the decimal digits of n so that they end at end, two at a time,
+// and returns where they start
+char* write_digits(uint64_t n, char* end) {
+    while (n >= 100) {
+        auto i = (n % 100) * 2;
+        n /= 100;
+        end -= 2;
+        end[0] = digit_pairs[i];
+        end[1] = digit_pairs[i + 1];
+    }
+    if (n >= 10) {
+        end -= 2;
+        end[0] = digit_pairs[n * 2];
+        end[1] = digit_pairs[n * 2 + 1];
+    } else {
+        *--end = '0' + n;
+    }
+    return end;
+}
+
+sstring format_integer(uint64_t n, bool negative) {
+    char buf[21];
+    auto end = buf + sizeof(buf);
+    auto p = write_digits(n, end);
+    if (negative) {
+        *--p = '-';
+    }
+    return sstring(p, end - p);
+}
+
+sstring format_integer(long n) {
+    return format_integer(n < 0 ? 0 - uint64_t(n) : uint64_t(n), n < 0);
+}
+
+// Shortest decimal formatting of floating point numbers, by Grisu2
+// (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+// Integers", 2010), in the formulation of Milo Yip's dtoa. The digits
+// always read back as the same number, and are the shortest that do for
+// all but a fraction of a percent of values, which get one more.
+
+struct diy_fp {
+    uint64_t f;
+    int e;
+};
+
+diy_fp multiply(diy_fp a, diy_fp b) {
+    auto p = static_cast<unsigned __int128>(a.f) * b.f;
+    uint64_t h = p >> 64;
+    uint64_t l = p;
+    // Rounds the dropped half
+    h += l >> 63;
+    return { h, a.e + b.e + 64 };
+}
+
+diy_fp normalize(diy_fp x) {
+    auto shift = __builtin_clzll(x.f);
+    return { x.f << shift, x.e - shift };
+}
+
+// 10^k for k = -348, -340, ..., 340, as normalized 64 bit significands
+// and binary exponents
+const diy_fp cached_powers[] = {
+    { 0xfa8fd5a0081c0288ull, -1220 }, // 1e-348
+    { 0xbaaee17fa23ebf76ull, -1193 }, // 1e-340
+    { 0x8b16fb203055ac76ull, -1166 }, // 1e-332
+    { 0xcf42894a5dce35eaull, -1140 }, // 1e-324
+    { 0x9a6bb0aa55653b2dull, -1113 }, // 1e-316
+    { 0xe61acf033d1a45dfull, -1087 }, // 1e-308
+    { 0xab70fe17c79ac6caull, -1060 }, // 1e-300
+    { 0xff77b1fcbebcdc4full, -1034 }, // 1e-292
+    { 0xbe5691ef416bd60cull, -1007 }, // 1e-284
+    { 0x8dd01fad907ffc3cull, -980 }, // 1e-276
+    { 0xd3515c2831559a83ull, -954 }, // 1e-268
+    { 0x9d71ac8fada6c9b5ull, -927 }, // 1e-260
+    { 0xea9c227723ee8bcbull, -901 }, // 1e-252
+    { 0xaecc49914078536dull, -874 }, // 1e-244
+    { 0x823c12795db6ce57ull, -847 }, // 1e-236
+    { 0xc21094364dfb5637ull, -821 }, // 1e-228
+    { 0x9096ea6f3848984full, -794 }, // 1e-220
+    { 0xd77485cb25823ac7ull, -768 }, // 1e-212
+    { 0xa086cfcd97bf97f4ull, -741 }, // 1e-204
+    { 0xef340a98172aace5ull, -715 }, // 1e-196
+    { 0xb23867fb2a35b28eull, -688 }, // 1e-188
+    { 0x84c8d4dfd2c63f3bull, -661 }, // 1e-180
+    { 0xc5dd44271ad3cdbaull, -635 }, // 1e-172
+    { 0x936b9fcebb25c996ull, -608 }, // 1e-164
+    { 0xdbac6c247d62a584ull, -582 }, // 1e-156
+    { 0xa3ab66580d5fdaf6ull, -555 }, // 1e-148
+    { 0xf3e2f893dec3f126ull, -529 }, // 1e-140
+    { 0xb5b5ada8aaff80b8ull, -502 }, // 1e-132
+    { 0x87625f056c7c4a8bull, -475 }, // 1e-124
+    { 0xc9bcff6034c13053ull, -449 }, // 1e-116
+    { 0x964e858c91ba2655ull, -422 }, // 1e-108
+    { 0xdff9772470297ebdull, -396 }, // 1e-100
+    { 0xa6dfbd9fb8e5b88full, -369 }, // 1e-92
+    { 0xf8a95fcf88747d94ull, -343 }, // 1e-84
+    { 0xb94470938fa89bcfull, -316 }, // 1e-76
+    { 0x8a08f0f8bf0f156bull, -289 }, // 1e-68
+    { 0xcdb02555653131b6ull, -263 }, // 1e-60
+    { 0x993fe2c6d07b7facull, -236 }, // 1e-52
+    { 0xe45c10c42a2b3b06ull, -210 }, // 1e-44
+    { 0xaa242499697392d3ull, -183 }, // 1e-36
+    { 0xfd87b5f28300ca0eull, -157 }, // 1e-28
+    { 0xbce5086492111aebull, -130 }, // 1e-20
+    { 0x8cbccc096f5088ccull, -103 }, // 1e-12
+    { 0xd1b71758e219652cull, -77 }, // 1e-4
+    { 0x9c40000000000000ull, -50 }, // 1e4
+    { 0xe8d4a51000000000ull, -24 }, // 1e12
+    { 0xad78ebc5ac620000ull, 3 }, // 1e20
+    { 0x813f3978f8940984ull, 30 }, // 1e28
+    { 0xc097ce7bc90715b3ull, 56 }, // 1e36
+    { 0x8f7e32ce7bea5c70ull, 83 }, // 1e44
+    { 0xd5d238a4abe98068ull, 109 }, // 1e52
+    { 0x9f4f2726179a2245ull, 136 }, // 1e60
+    { 0xed63a231d4c4fb27ull, 162 }, // 1e68
+    { 0xb0de65388cc8ada8ull, 189 }, // 1e76
+    { 0x83c7088e1aab65dbull, 216 }, // 1e84
+    { 0xc45d1df942711d9aull, 242 }, // 1e92
+    { 0x924d692ca61be758ull, 269 }, // 1e100
+    { 0xda01ee641a708deaull, 295 }, // 1e108
+    { 0xa26da3999aef774aull, 322 }, // 1e116
+    { 0xf209787bb47d6b85ull, 348 }, // 1e124
+    { 0xb454e4a179dd1877ull, 375 }, // 1e132
+    { 0x865b86925b9bc5c2ull, 402 }, // 1e140
+    { 0xc83553c5c8965d3dull, 428 }, // 1e148
+    { 0x952ab45cfa97a0b3ull, 455 }, // 1e156
+    { 0xde469fbd99a05fe3ull, 481 }, // 1e164
+    { 0xa59bc234db398c25ull, 508 }, // 1e172
+    { 0xf6c69a72a3989f5cull, 534 }, // 1e180
+    { 0xb7dcbf5354e9beceull, 561 }, // 1e188
+    { 0x88fcf317f22241e2ull, 588 }, // 1e196
+    { 0xcc20ce9bd35c78a5ull, 614 }, // 1e204
+    { 0x98165af37b2153dfull, 641 }, // 1e212
+    { 0xe2a0b5dc971f303aull, 667 }, // 1e220
+    { 0xa8d9d1535ce3b396ull, 694 }, // 1e228
+    { 0xfb9b7cd9a4a7443cull, 720 }, // 1e236
+    { 0xbb764c4ca7a44410ull, 747 }, // 1e244
+    { 0x8bab8eefb6409c1aull, 774 }, // 1e252
+    { 0xd01fef10a657842cull, 800 }, // 1e260
+    { 0x9b10a4e5e9913129ull, 827 }, // 1e268
+    { 0xe7109bfba19c0c9dull, 853 }, // 1e276
+    { 0xac2820d9623bf429ull, 880 }, // 1e284
+    { 0x80444b5e7aa7cf85ull, 907 }, // 1e292
+    { 0xbf21e44003acdd2dull, 933 }, // 1e300
+    { 0x8e679c2f5e44ff8full, 960 }, // 1e308
+    { 0xd433179d9c8cb841ull, 986 }, // 1e316
+    { 0x9e19db92b4e31ba9ull, 1013 }, // 1e324
+    { 0xeb96bf6ebadf77d9ull, 1039 }, // 1e332
+    { 0xaf87023b9bf0ee6bull, 1066 }, // 1e340
+};
+
+const uint64_t pow10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+    1000000000000000000ull, 10000000000000000000ull,
+};
+
+// A cached power of ten that brings a number of binary exponent e to an
+// exponent in [-60, -32], and the negated decimal exponent of it
+diy_fp get_cached_power(int e, int& k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ki = static_cast<int>(dk);
+    if (dk - ki > 0.0) {
+        ++ki;
+    }
+    unsigned index = (ki >> 3) + 1;
+    k = -(-348 + static_cast<int>(index << 3));
+    return cached_powers[index];
+}
+
+int count_decimal_digits(uint32_t n) {
+    int digits = 1;
+    while (digits < 10 && n >= pow10[digits]) {
+        ++digits;
+    }
+    return digits;
+}
+
+// Moves the last digit closer to w while that stays within the interval
+void grisu_round(char* buffer, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa
+            && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+void digit_gen(diy_fp w, diy_fp mp, uint64_t delta, char* buffer, int& len, int& k) {
+    diy_fp one = { uint64_t(1) << -mp.e, mp.e };
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = mp.f >> -one.e;
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = count_decimal_digits(p1);
+    len = 0;
+    while (kappa > 0) {
+        uint32_t d = p1 / pow10[kappa - 1];
+        p1 %= pow10[kappa - 1];
+        if (d || len) {
+            buffer[len++] = '0' + d;
+        }
+        kappa--;
+        uint64_t rest = (uint64_t(p1) << -one.e) + p2;
+        if (rest <= delta) {
+            k += kappa;
+            grisu_round(buffer, len, delta, rest, pow10[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = p2 >> -one.e;
+        if (d || len) {
+            buffer[len++] = '0' + d;
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            k += kappa;
+            int index = -kappa;
+            grisu_round(buffer, len, delta, p2, one.f, wp_w * (index < 20 ? pow10[index] : 0));
+            return;
+        }
+    }
+}
+
+// The digits of a positive finite value, and the decimal exponent of the
+// last one
+template <typename Float>
+void grisu2(Float value, char* buffer, int& len, int& k) {
+    using bits_type = std::conditional_t<sizeof(Float) == 8, uint64_t, uint32_t>;
+    constexpr int significand_bits = std::numeric_limits<Float>::digits - 1;
+    constexpr int exponent_bias = std::numeric_limits<Float>::max_exponent - 1 + significand_bits;
+    constexpr bits_type significand_mask = (bits_type(1) << significand_bits) - 1;
+    bits_type bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint64_t significand = bits & significand_mask;
+    int biased_e = bits >> significand_bits;
+    diy_fp v;
+    if (biased_e) {
+        v = { significand + (uint64_t(1) << significand_bits), biased_e - exponent_bias };
+    } else {
+        v = { significand, 1 - exponent_bias };
+    }
+    // The boundaries halfway to the neighbouring values; the lower one is
+    // closer at powers of two
+    auto plus = normalize({ (v.f << 1) + 1, v.e - 1 });
+    auto minus = significand == 0 && biased_e > 1 ? diy_fp{ (v.f << 2) - 1, v.e - 2 } : diy_fp{ (v.f << 1) - 1, v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    auto c_mk = get_cached_power(plus.e, k);
+    auto w = multiply(normalize(v), c_mk);
+    auto wp = multiply(plus, c_mk);
+    auto wm = multiply(minus, c_mk);
+    wm.f++;
+    wp.f--;
+    digit_gen(w, wp, wp.f - wm.f, buffer, len, k);
+}
+
+// Lays out the digits of a value of digits * 10^k: as an integer or a
+// fraction for moderate exponents, and in scientific notation otherwise
+char* prettify(char* buffer, int len, int k) {
+    int kk = len + k;
+    if (k >= 0 && kk <= 21) {
+        std::memset(buffer + len, '0', k);
+        return buffer + kk;
+    } else if (kk > 0 && kk <= 21) {
+        std::memmove(buffer + kk + 1, buffer + kk, len - kk);
+        buffer[kk] = '.';
+        return buffer + len + 1;
+    } else if (kk > -6 && kk <= 0) {
+        int offset = 2 - kk;
+        std::memmove(buffer + offset, buffer, len);
+        buffer[0] = '0';
+        buffer[1] = '.';
+        std::memset(buffer + 2, '0', offset - 2);
+        return buffer + len + offset;
+    }
+    auto p = buffer + 1;
+    if (len > 1) {
+        std::memmove(buffer + 2, buffer + 1, len - 1);
+        buffer[1] = '.';
+        p = buffer + len + 1;
+    }
+    *p++ = 'e';
+    int exp = kk - 1;
+    if (exp < 0) {
+        *p++ = '-';
+        exp = -exp;
+    } else {
+        *p++ = '+';
+    }
+    char digits[4];
+    auto start = write_digits(exp, digits + sizeof(digits));
+    auto n = digits + sizeof(digits) - start;
+    std::memcpy(p, start, n);
+    return p + n;
+}
+
+template <typename Float>
+sstring format_float(Float value) {
+    char buf[40];
+    auto p = buf;
+    if (std::signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (value == 0) {
+        *p++ = '0';
+        return sstring(buf, p - buf);
+    }
+    int len, k;
+    grisu2(value, p, len, k);
+    auto end = prettify(p, len, k);
+    return sstring(buf, end - buf);
+}
+
+bool needs_escape(char c) {
+    return c == '"' || c == '\\' || uint8_t(c) < 0x20;
+}
+
+// The first character from p that a json string cannot hold as it is
+const char* find_escape(const char* p, const char* pe) {
+#ifdef __SSE2__
+    auto quote = _mm_set1_epi8('"');
+    auto backslash = _mm_set1_epi8('\\');
+    auto last_control = _mm_set1_epi8(0x1f);
+    while (pe - p >= 16) {
+        auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        auto special = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash));
+        // Unsigned x <= 0x1f
+        auto control = _mm_cmpeq_epi8(_mm_min_epu8(x, last_control), x);
+        auto m = _mm_movemask_epi8(_mm_or_si128(special, control));
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+        p += 16;
+    }
+#endif
+    while (p != pe && !needs_escape(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// The escape sequence of c, which is at most 6 bytes; returns its length
+size_t escape(char c, char* out) {
+    switch (c) {
+    case '"': out[1] = '"'; break;
+    case '\\': out[1] = '\\'; break;
+    case '\b': out[1] = 'b'; break;
+    case '\f': out[1] = 'f'; break;
+    case '\n': out[1] = 'n'; break;
+    case '\r': out[1] = 'r'; break;
+    case '\t': out[1] = 't'; break;
+    default:
+        out[0] = '\\';
+        out[1] = 'u';
+        out[2] = '0';
+        out[3] = '0';
+        out[4] = "0123456789abcdef"[uint8_t(c) >> 4];
+        out[5] = "0123456789abcdef"[c & 15];
+        return 6;
+    }
+    out[0] = '\\';
+    return 2;
+}
+
+sstring quote(const char* s, size_t n) {
+    auto pe = s + n;
+    // Sizes the result first, so that it is allocated once
+    size_t size = n + 2;
+    char seq[6];
+    for (auto e = find_escape(s, pe); e != pe; e = find_escape(e + 1, pe)) {
+        size += escape(*e, seq) - 1;
+    }
+    sstring ret(sstring::initialized_later(), size);
+    auto out = ret.begin();
+    *out++ = '"';
+    while (true) {
+        auto e = find_escape(s, pe);
+        out = std::copy(s, e, out);
+        if (e == pe) {
+            break;
+        }
+        out += escape(*e, out);
+        s = e + 1;
+    }
+    *out = '"';
+    return ret;
+}
+
+}
+
 sstring formatter::begin(state s) {
     switch (s) {
     case state::array: return "[";
@@ -45,22 +460,19 @@ sstring formatter::end(state s) {
 
 
 sstring formatter::to_json(const sstring& str) {
-    return to_json(str.c_str());
+    return quote(str.c_str(), str.size());
 }
 
 sstring formatter::to_json(const char* str) {
-    sstring res = "\"";
-    res += str;
-    res += "\"";
-    return res;
+    return quote(str, strlen(str));
 }
 
 sstring formatter::to_json(int n) {
-    return to_string(n);
+    return format_integer(n);
 }
 
 sstring formatter::to_json(long n) {
-    return to_string(n);
+    return format_integer(n);
 }
 
 sstring formatter::to_json(float f) {
@@ -69,7 +481,7 @@ sstring formatter::to_json(float f) {
     } else if (std::isnan(f)) {
         throw invalid_argument("Invalid float value");
     }
-    return to_sstring(f);
+    return format_float(f);
 }
 
 sstring formatter::to_json(double d) {
@@ -78,7 +490,7 @@ sstring formatter::to_json(double d) {
     } else if (std::isnan(d)) {
         throw invalid_argument("Invalid double value");
     }
-    return to_sstring(d);
+    return format_float(d);
 }
 
 sstring formatter::to_json(bool b) {
@@ -98,7 +510,11 @@ sstring formatter::to_json(const jsonable& obj) {
 }
 
 sstring formatter::to_json(unsigned long l) {
-    return to_string(l);
+    return format_integer(l, false);
+}
+
+future<> formatter::write_jsonable(output_stream<char>& s, const jsonable& obj) {
+    return obj.write(s);
 }
 
 }
@@ -28,11 +28,15 @@
 #include <map>
 #include <time.h>
 #include <sstream>
+#include <type_traits>
 #include "core/sstring.hh"
+#include "core/iostream.hh"
+#include "core/future-util.hh"
 
 namespace json {
 
 struct jsonable;
+class json_reader;
 
 typedef struct tm date_time;
 
@@ -75,6 +79,48 @@ class formatter {
     static sstring to_json(state, const T& t) {
         return to_json(t);
     }
+
+    template<typename K, typename V>
+    static future<> write(output_stream<char>& s, state st, const std::pair<K, V>& p) {
+        if (st == state::array) {
+            return s.write("{").then([&s, &p] {
+                return write(s, state::none, p);
+            }).then([&s] {
+                return s.write("}");
+            });
+        }
+        return s.write(to_json(p.first) + ":").then([&s, &p] {
+            return write(s, p.second);
+        });
+    }
+
+    // Writes the elements one at a time, yielding to the reactor between
+    // them when it needs to; the range must outlive the returned future
+    template<typename Iter>
+    static future<> write(output_stream<char>& s, state st, Iter i, Iter e) {
+        return s.write(begin(st)).then([&s, st, i, e] {
+            return repeat([&s, st, i, e, first = true] () mutable {
+                if (i == e) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                auto& v = *i++;
+                auto f = first ? make_ready_future<>() : s.write(",");
+                first = false;
+                return f.then([&s, st, &v] {
+                    return write(s, st, v);
+                }).then([] {
+                    return stop_iteration::no;
+                });
+            });
+        }).then([&s, st] {
+            return s.write(end(st));
+        });
+    }
+
+    template<typename T>
+    static future<> write(output_stream<char>& s, state, const T& t) {
+        return write(s, t);
+    }
 public:
 
     /**
@@ -167,8 +213,47 @@ class formatter {
      */
     static sstring to_json(unsigned long l);
 
+    /**
+     * Writes a value to a stream in a json format, as to_json formats it.
+     * Containers and json objects are written an element at a time, so a
+     * large one is neither built in memory nor stalls the reactor; the
+     * value must outlive the returned future.
+     * @param s the stream to write to
+     * @param t the value to write
+     * @return a future that resolves once the value is written
+     */
+    template<typename T>
+    static std::enable_if_t<!std::is_base_of<jsonable, T>::value, future<>>
+    write(output_stream<char>& s, const T& t) {
+        return s.write(to_json(t));
+    }
+
+    template<typename T>
+    static std::enable_if_t<std::is_base_of<jsonable, T>::value, future<>>
+    write(output_stream<char>& s, const T& obj) {
+        return write_jsonable(s, obj);
+    }
+
+    template<typename... Args>
+    static future<> write(output_stream<char>& s, const std::vector<Args...>& vec) {
+        return write(s, state::array, vec.begin(), vec.end());
+    }
+
+    template<typename... Args>
+    static future<> write(output_stream<char>& s, const std::map<Args...>& map) {
+        return write(s, state::map, map.begin(), map.end());
+    }
+
+    template<typename... Args>
+    static future<> write(output_stream<char>& s, const std::unordered_map<Args...>& map) {
+        return write(s, state::map, map.begin(), map.end());
+    }
+
 private:
+    static future<> write_jsonable(output_stream<char>& s, const jsonable& obj);
 
+    // Dates are read back in the format they are written in
+    friend void parse_json(json_reader& r, date_time& v);
     static constexpr const char* TIME_FORMAT = "%a %b %d %I:%M:%S %Z %Y";
 
 };
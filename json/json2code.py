@@ -238,6 +238,14 @@ def create_enum_wrapper(model_name, name, values):
         res = res + "      case " + enum_name + "::" + enum_entry + ": return \"\\\"" + enum_entry + "\\\"\";\n"
     res = res + Template("""      default: return \"\\\"Unknown\\\"\";
         }
+     }
+        const char* name() const {
+            switch(v) {
+        """).substitute({'wrapper' : wrapper})
+    for enum_entry in values:
+        res = res + "      case " + enum_name + "::" + enum_entry + ": return \"" + enum_entry + "\";\n"
+    res = res + Template("""      default: return \"\";
+        }
      }
     template<class T>
     $wrapper (const T& _v) {
@@ -258,6 +266,16 @@ def create_enum_wrapper(model_name, name, values):
           }
         }
         typedef typename std::underlying_type<$enum_name>::type pos_type;
+        void parse(json::json_reader& r) {
+            auto s = r.read_string();
+            v = $enum_name::NUM_ITEMS;
+            for (auto i = begin(); i != end(); ++i) {
+                if (s == i.name()) {
+                    v = i.v;
+                    return;
+                }
+            }
+        }
         $wrapper& operator++() {
         v = static_cast<$enum_name>(static_cast<pos_type>(v) + 1);
             return *this;
@@ -294,7 +312,8 @@ def create_h_file(data, hfile_name, api_name, init_method, base_api):
         hfile = open(config.outdir + "/" + hfile_name, "w")
     print_h_file_headers(hfile, api_name)
     add_include(hfile, ['"core/sstring.hh"', '"' + config.jsoninc +
-                       'json_elements.hh"', '"http/json_path.hh"'])
+                       'json_elements.hh"', '"' + config.jsoninc +
+                       'json_parser.hh"', '"http/json_path.hh"'])
 
     add_include(hfile, ['<iostream>', '<boost/range/irange.hpp>'])
     open_namespace(hfile, "httpd")
@@ -328,6 +347,18 @@ def create_h_file(data, hfile_name, api_name, init_method, base_api):
                 member_init += member_name + '");\n'
                 member_assignment += "  " + member_name + " = " + "e." + member_name + ";\n"
                 member_copy += "  e." + member_name + " = " + member_name + ";\n"
+            fprintln(hfile, "void parse(", config.jsonns, "::json_reader& r) {")
+            fprintln(hfile, "  r.begin_object();")
+            fprintln(hfile, "  ", config.jsonns, "::json_reader::string_view json_member;")
+            fprintln(hfile, "  while (r.next_member(json_member)) {")
+            for member_name in model["properties"]:
+                fprintln(hfile, '    if (json_member == "', member_name, '") {')
+                fprintln(hfile, "      ", config.jsonns, "::parse_json(r, ", member_name, ");")
+                fprintln(hfile, "      continue;")
+                fprintln(hfile, "    }")
+            fprintln(hfile, "    r.skip();")
+            fprintln(hfile, "  }")
+            fprintln(hfile, "}")
             fprintln(hfile, "void register_params() {")
             fprintln(hfile, member_init)
             fprintln(hfile, '}')
@@ -101,6 +101,31 @@ string json_base::to_json() const {
     return res.as_json();
 }
 
+future<> json_base::write(output_stream<char>& s) const {
+    return s.write("{").then([this, &s] {
+        return repeat([this, &s, i = _elements.begin(), first = true] () mutable {
+            while (i != _elements.end() && (*i == nullptr || !(*i)->_set)) {
+                ++i;
+            }
+            if (i == _elements.end()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto element = *i++;
+            sstring name = first ? "\"" : ", \"";
+            first = false;
+            name += element->_name;
+            name += "\": ";
+            return s.write(name).then([&s, element] {
+                return element->write(s);
+            }).then([] {
+                return stop_iteration::no;
+            });
+        });
+    }).then([&s] {
+        return s.write("}");
+    });
+}
+
 bool json_base::is_verify() const {
     for (auto i : _elements) {
         if (!i->is_verify()) {
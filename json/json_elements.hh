@@ -26,8 +26,11 @@
 #include <vector>
 #include <time.h>
 #include <sstream>
+#include <functional>
 #include "formatter.hh"
 #include "core/sstring.hh"
+#include "core/iostream.hh"
+#include "core/do_with.hh"
 
 namespace json {
 
@@ -73,6 +76,13 @@ class json_base_element {
      */
     virtual std::string to_string() = 0;
 
+    /**
+     * writes the internal value in a json format to a stream
+     * @param s the stream to write to
+     * @return a future that resolves once it is written
+     */
+    virtual future<> write(output_stream<char>& s) const = 0;
+
     std::string _name;
     bool _mandatory;
     bool _set;
@@ -129,6 +139,10 @@ class json_element : public json_base_element {
         return formatter::to_json(_value);
     }
 
+    virtual future<> write(output_stream<char>& s) const override {
+        return formatter::write(s, _value);
+    }
+
 private:
     T _value;
 };
@@ -157,6 +171,10 @@ class json_list : public json_base_element {
         return formatter::to_json(_elements);
     }
 
+    virtual future<> write(output_stream<char>& s) const override {
+        return formatter::write(s, _elements);
+    }
+
     /**
      * Assignment can be done from any object that support const range
      * iteration and that it's elements can be assigned to the list elements
@@ -181,6 +199,16 @@ class jsonable {
      * @return the object formated.
      */
     virtual std::string to_json() const = 0;
+
+    /**
+     * write the object formatted to a stream; by default, what
+     * to_json() returns
+     * @param s the stream to write to
+     * @return a future that resolves once it is written
+     */
+    virtual future<> write(output_stream<char>& s) const {
+        return s.write(to_json());
+    }
 };
 
 /**
@@ -209,6 +237,13 @@ struct json_base : public jsonable {
      */
     virtual std::string to_json() const;
 
+    /**
+     * write the object to a stream, one element at a time
+     * @param s the stream to write to
+     * @return a future that resolves once it is written
+     */
+    virtual future<> write(output_stream<char>& s) const override;
+
     /**
      * Check that all mandatory elements are set
      * @return true if all mandatory parameters are set
@@ -254,6 +289,11 @@ struct json_void : public jsonable{
  */
 struct json_return_type {
     sstring _res;
+    // When set, writes the reply instead of _res, and closes the stream
+    std::function<future<>(output_stream<char>&&)> _body_writer;
+    json_return_type(std::function<future<>(output_stream<char>&&)>&& body_writer)
+            : _body_writer(std::move(body_writer)) {
+    }
     template<class T>
     json_return_type(const T& res) {
         _res = formatter::to_json(res);
@@ -262,6 +302,63 @@ struct json_return_type {
     json_return_type& operator=(json_return_type&&) = default;
 };
 
+/**
+ * Returns a body writer for a json_return_type that streams val as a
+ * json array, mapping each element with fun, which returns anything
+ * formatter::write() accepts. The elements are written as they are
+ * mapped, so a large container is never formatted into one string.
+ *
+ * json_return_type foo() {
+ *     return stream_range_as_array(get_items(), [] (const item& i) {
+ *         return i.name;
+ *     });
+ * }
+ */
+template<typename Container, typename Func>
+std::function<future<>(output_stream<char>&&)> stream_range_as_array(Container val, Func fun) {
+    return [val = std::move(val), fun = std::move(fun)] (output_stream<char>&& s) mutable {
+        return do_with(output_stream<char>(std::move(s)), std::move(val), std::move(fun), true,
+                [] (output_stream<char>& s, const Container& val, const Func& f, bool& first) {
+            return s.write("[").then([&s, &val, &f, &first] {
+                return repeat([&s, &f, &first, i = std::begin(val), e = std::end(val)] () mutable {
+                    if (i == e) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    auto fut = first ? make_ready_future<>() : s.write(", ");
+                    first = false;
+                    auto& v = *i++;
+                    return fut.then([&s, &f, &v] {
+                        return do_with(f(v), [&s] (const auto& mapped) {
+                            return formatter::write(s, mapped);
+                        });
+                    }).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).then([&s] {
+                return s.write("]");
+            }).finally([&s] {
+                return s.close();
+            });
+        });
+    };
+}
+
+/**
+ * Returns a body writer for a json_return_type that streams val with
+ * formatter::write(), such as a json object with large lists.
+ */
+template<class T>
+std::function<future<>(output_stream<char>&&)> stream_object(T val) {
+    return [val = std::move(val)] (output_stream<char>&& s) mutable {
+        return do_with(output_stream<char>(std::move(s)), std::move(val), [] (output_stream<char>& s, const T& val) {
+            return formatter::write(s, val).finally([&s] {
+                return s.close();
+            });
+        });
+    };
+}
+
 }
 
 #endif /* JSON_ELEMENTS_HH_ */
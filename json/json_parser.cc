@@ -0,0 +1,425 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "json_parser.hh"
+#include "core/ragel.hh"
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <time.h>
+
+namespace json {
+
+void json_reader::skip_whitespace() {
+    while (_p != _end && (*_p == ' ' || *_p == '\n' || *_p == '\r' || *_p == '\t')) {
+        ++_p;
+    }
+}
+
+void json_reader::expect(char c) {
+    skip_whitespace();
+    if (_p == _end || *_p != c) {
+        throw error(std::string("expected '") + c + "'");
+    }
+    ++_p;
+}
+
+bool json_reader::consume_literal(const char* literal) {
+    skip_whitespace();
+    auto n = strlen(literal);
+    if (size_t(_end - _p) < n || memcmp(_p, literal, n) != 0) {
+        return false;
+    }
+    _p += n;
+    return true;
+}
+
+void json_reader::enter() {
+    if (++_depth > max_depth) {
+        throw error("nested too deeply");
+    }
+    _first = true;
+}
+
+void json_reader::leave() {
+    --_depth;
+    _first = false;
+}
+
+json_reader::value_type json_reader::peek() {
+    skip_whitespace();
+    if (_p == _end) {
+        throw error("unexpected end of document");
+    }
+    switch (*_p) {
+    case '{': return value_type::object;
+    case '[': return value_type::array;
+    case '"': return value_type::string;
+    case 't':
+    case 'f': return value_type::boolean;
+    case 'n': return value_type::null;
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        return value_type::number;
+    default:
+        throw error("unexpected character");
+    }
+}
+
+void json_reader::begin_object() {
+    if (peek() != value_type::object) {
+        throw error("expected an object");
+    }
+    ++_p;
+    enter();
+}
+
+bool json_reader::next_member(string_view& name) {
+    skip_whitespace();
+    if (_p != _end && *_p == '}') {
+        ++_p;
+        leave();
+        return false;
+    }
+    if (!_first) {
+        expect(',');
+    }
+    _first = false;
+    name = read_string();
+    expect(':');
+    return true;
+}
+
+void json_reader::begin_array() {
+    if (peek() != value_type::array) {
+        throw error("expected an array");
+    }
+    ++_p;
+    enter();
+}
+
+bool json_reader::next_element() {
+    skip_whitespace();
+    if (_p != _end && *_p == ']') {
+        ++_p;
+        leave();
+        return false;
+    }
+    if (!_first) {
+        expect(',');
+    }
+    _first = false;
+    return true;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static char* put_utf8(char* w, uint32_t cp) {
+    if (cp < 0x80) {
+        *w++ = cp;
+    } else if (cp < 0x800) {
+        *w++ = 0xc0 | (cp >> 6);
+        *w++ = 0x80 | (cp & 0x3f);
+    } else if (cp < 0x10000) {
+        *w++ = 0xe0 | (cp >> 12);
+        *w++ = 0x80 | ((cp >> 6) & 0x3f);
+        *w++ = 0x80 | (cp & 0x3f);
+    } else {
+        *w++ = 0xf0 | (cp >> 18);
+        *w++ = 0x80 | ((cp >> 12) & 0x3f);
+        *w++ = 0x80 | ((cp >> 6) & 0x3f);
+        *w++ = 0x80 | (cp & 0x3f);
+    }
+    return w;
+}
+
+// Decodes the rest of a string from its first backslash, at p, moving
+// the text down over the escapes; no escape decodes to more bytes than
+// it takes. Returns the end of the decoded string, and leaves _p past
+// the closing quote.
+char* json_reader::decode_escapes(char* p) {
+    auto w = p;
+    auto read_u = [this, &p] {
+        if (_end - p < 4) {
+            _p = p;
+            throw error("bad \\u escape");
+        }
+        uint32_t cp = 0;
+        for (int i = 0; i < 4; ++i) {
+            auto d = hex_digit(p[i]);
+            if (d < 0) {
+                _p = p;
+                throw error("bad \\u escape");
+            }
+            cp = cp << 4 | d;
+        }
+        p += 4;
+        return cp;
+    };
+    while (*p != '"') {
+        if (_end - p < 2) {
+            _p = p;
+            throw error("unterminated string");
+        }
+        auto c = p[1];
+        p += 2;
+        switch (c) {
+        case '"': case '\\': case '/': *w++ = c; break;
+        case 'b': *w++ = '\b'; break;
+        case 'f': *w++ = '\f'; break;
+        case 'n': *w++ = '\n'; break;
+        case 'r': *w++ = '\r'; break;
+        case 't': *w++ = '\t'; break;
+        case 'u': {
+            auto cp = read_u();
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                if (_end - p < 2 || p[0] != '\\' || p[1] != 'u') {
+                    _p = p;
+                    throw error("unpaired surrogate");
+                }
+                p += 2;
+                auto lo = read_u();
+                if (lo < 0xdc00 || lo >= 0xe000) {
+                    _p = p;
+                    throw error("unpaired surrogate");
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                _p = p;
+                throw error("unpaired surrogate");
+            }
+            w = put_utf8(w, cp);
+            break;
+        }
+        default:
+            _p = p;
+            throw error("bad escape");
+        }
+        auto q = find_either(p, _end, '"', '\\');
+        if (q == _end) {
+            _p = q;
+            throw error("unterminated string");
+        }
+        memmove(w, p, q - p);
+        w += q - p;
+        p = q;
+    }
+    _p = p + 1;
+    return w;
+}
+
+json_reader::string_view json_reader::read_string() {
+    if (peek() != value_type::string) {
+        throw error("expected a string");
+    }
+    auto start = ++_p;
+    // Most strings have no escapes, and are taken as they are
+    auto q = find_either(start, _end, '"', '\\');
+    if (q == _end) {
+        _p = q;
+        throw error("unterminated string");
+    }
+    if (*q == '"') {
+        _p = q + 1;
+        return string_view(start, q - start);
+    }
+    auto e = decode_escapes(q);
+    return string_view(start, e - start);
+}
+
+char* json_reader::number_end() {
+    auto p = _p;
+    while (p != _end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E')) {
+        ++p;
+    }
+    return p;
+}
+
+int64_t json_reader::read_int() {
+    if (peek() != value_type::number) {
+        throw error("expected a number");
+    }
+    auto p = _p;
+    bool neg = *p == '-';
+    if (neg) {
+        ++p;
+    }
+    auto digits = p;
+    uint64_t limit = uint64_t(std::numeric_limits<int64_t>::max()) + neg;
+    uint64_t v = 0;
+    while (p != _end && *p >= '0' && *p <= '9') {
+        unsigned d = *p - '0';
+        if (v > (limit - d) / 10) {
+            throw error("integer out of range");
+        }
+        v = v * 10 + d;
+        ++p;
+    }
+    if (p == digits || p != number_end()) {
+        throw error("expected an integer");
+    }
+    _p = p;
+    return neg ? int64_t(-v) : int64_t(v);
+}
+
+double json_reader::read_double() {
+    if (peek() != value_type::number) {
+        throw error("expected a number");
+    }
+    // strtod wants a terminated string, and the document isn't
+    auto e = number_end();
+    size_t len = e - _p;
+    char buf[64];
+    std::string long_number;
+    const char* s = buf;
+    if (len < sizeof(buf)) {
+        memcpy(buf, _p, len);
+        buf[len] = 0;
+    } else {
+        long_number.assign(_p, len);
+        s = long_number.c_str();
+    }
+    char* parsed;
+    auto v = strtod(s, &parsed);
+    if (parsed != s + len) {
+        throw error("bad number");
+    }
+    _p = e;
+    return v;
+}
+
+bool json_reader::read_bool() {
+    if (consume_literal("true")) {
+        return true;
+    }
+    if (consume_literal("false")) {
+        return false;
+    }
+    throw error("expected a boolean");
+}
+
+bool json_reader::read_null() {
+    return consume_literal("null");
+}
+
+void json_reader::skip() {
+    switch (peek()) {
+    case value_type::object: {
+        string_view name;
+        begin_object();
+        while (next_member(name)) {
+            skip();
+        }
+        break;
+    }
+    case value_type::array:
+        begin_array();
+        while (next_element()) {
+            skip();
+        }
+        break;
+    case value_type::string: {
+        // Only the end is needed, not the decoded text
+        auto p = _p + 1;
+        for (;;) {
+            auto q = find_either(p, _end, '"', '\\');
+            if (q == _end || (*q == '\\' && _end - q < 2)) {
+                _p = q;
+                throw error("unterminated string");
+            }
+            if (*q == '"') {
+                _p = q + 1;
+                break;
+            }
+            p = q + 2;
+        }
+        break;
+    }
+    case value_type::number:
+        read_double();
+        break;
+    case value_type::boolean:
+        read_bool();
+        break;
+    case value_type::null:
+        if (!read_null()) {
+            throw error("expected null");
+        }
+        break;
+    }
+}
+
+void json_reader::expect_end() {
+    skip_whitespace();
+    if (_p != _end) {
+        throw error("trailing characters after the document");
+    }
+}
+
+void parse_json(json_reader& r, int& v) {
+    auto n = r.read_int();
+    if (n < std::numeric_limits<int>::min() || n > std::numeric_limits<int>::max()) {
+        throw r.error("integer out of range");
+    }
+    v = n;
+}
+
+void parse_json(json_reader& r, long& v) {
+    v = r.read_int();
+}
+
+void parse_json(json_reader& r, unsigned long& v) {
+    auto n = r.read_int();
+    if (n < 0) {
+        throw r.error("integer out of range");
+    }
+    v = n;
+}
+
+void parse_json(json_reader& r, char& v) {
+    auto s = r.read_string();
+    if (s.size() != 1) {
+        throw r.error("expected a single character");
+    }
+    v = s[0];
+}
+
+void parse_json(json_reader& r, date_time& v) {
+    auto s = r.read_string();
+    // strptime wants a terminated string
+    std::string str(s.data(), s.size());
+    v = date_time();
+    if (!strptime(str.c_str(), formatter::TIME_FORMAT, &v)) {
+        throw r.error("bad date");
+    }
+}
+
+}
@@ -0,0 +1,204 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include <stdexcept>
+#include <experimental/string_view>
+#include "json_elements.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+
+namespace json {
+
+/**
+ * Thrown when a document is not well formed, or holds a value of the
+ * wrong type for where it is
+ */
+class json_parse_error : public std::runtime_error {
+    size_t _offset;
+public:
+    json_parse_error(const std::string& what, size_t offset)
+        : std::runtime_error(what + " at offset " + std::to_string(offset)), _offset(offset) {}
+    size_t offset() const {
+        return _offset;
+    }
+};
+
+/**
+ * A pull parser over a JSON document held in memory.
+ *
+ * The caller walks the document in order, asking for what it expects
+ * next, so that code generated from a schema reads straight into typed
+ * members and skips what it doesn't know. Strings are returned as views
+ * into the document; those with escapes are decoded in place, so the
+ * buffer must be writable and outlive the views. The reader itself
+ * allocates nothing.
+ */
+class json_reader {
+public:
+    using string_view = std::experimental::string_view;
+    enum class value_type {
+        object, array, string, number, boolean, null,
+    };
+private:
+    char* _begin;
+    char* _p;
+    char* _end;
+    // Whether the object or array just entered has no element yet
+    bool _first = true;
+    unsigned _depth = 0;
+    static constexpr unsigned max_depth = 512;
+public:
+    json_reader(char* begin, char* end) : _begin(begin), _p(begin), _end(end) {}
+    explicit json_reader(temporary_buffer<char>& buf)
+        : json_reader(buf.get_write(), buf.get_write() + buf.size()) {}
+
+    /**
+     * The type of the next value, without consuming it
+     */
+    value_type peek();
+
+    void begin_object();
+    /**
+     * Moves to the next member of the object being read
+     * @param name set to the member's name
+     * @return false, having consumed the end of the object, if there are no
+     * more members
+     */
+    bool next_member(string_view& name);
+
+    void begin_array();
+    /**
+     * Moves to the next element of the array being read
+     * @return false, having consumed the end of the array, if there are no
+     * more elements
+     */
+    bool next_element();
+
+    string_view read_string();
+    int64_t read_int();
+    double read_double();
+    bool read_bool();
+    /**
+     * Consumes the next value if it is null
+     * @return whether it was
+     */
+    bool read_null();
+    /**
+     * Consumes the next value, whatever it is
+     */
+    void skip();
+    /**
+     * Checks that nothing but whitespace follows the value read
+     */
+    void expect_end();
+
+    json_parse_error error(const std::string& what) const {
+        return json_parse_error(what, _p - _begin);
+    }
+private:
+    void skip_whitespace();
+    void expect(char c);
+    bool consume_literal(const char* literal);
+    void enter();
+    void leave();
+    char* decode_escapes(char* p);
+    char* number_end();
+};
+
+/**
+ * Read the next value into v. Generated models read themselves with a
+ * parse(json_reader&) member; the overloads here cover the types their
+ * members are made of.
+ */
+inline void parse_json(json_reader& r, sstring& v) {
+    auto s = r.read_string();
+    v = sstring(s.data(), s.size());
+}
+
+inline void parse_json(json_reader& r, std::string& v) {
+    auto s = r.read_string();
+    v.assign(s.data(), s.size());
+}
+
+inline void parse_json(json_reader& r, bool& v) {
+    v = r.read_bool();
+}
+
+inline void parse_json(json_reader& r, double& v) {
+    v = r.read_double();
+}
+
+inline void parse_json(json_reader& r, float& v) {
+    v = r.read_double();
+}
+
+void parse_json(json_reader& r, int& v);
+void parse_json(json_reader& r, long& v);
+void parse_json(json_reader& r, unsigned long& v);
+void parse_json(json_reader& r, char& v);
+void parse_json(json_reader& r, date_time& v);
+
+template <typename T>
+inline auto parse_json(json_reader& r, T& v) -> decltype(v.parse(r), void()) {
+    v.parse(r);
+}
+
+/**
+ * A null leaves the element unset
+ */
+template <typename T>
+inline void parse_json(json_reader& r, json_element<T>& e) {
+    if (r.read_null()) {
+        return;
+    }
+    T v;
+    parse_json(r, v);
+    e = v;
+}
+
+template <typename T>
+inline void parse_json(json_reader& r, json_list<T>& l) {
+    if (r.read_null()) {
+        return;
+    }
+    l._elements.clear();
+    l._set = true;
+    r.begin_array();
+    while (r.next_element()) {
+        T v;
+        parse_json(r, v);
+        l.push(v);
+    }
+}
+
+/**
+ * Parse a whole document into v
+ */
+template <typename T>
+inline void parse_document(temporary_buffer<char>& buf, T& v) {
+    json_reader r(buf);
+    parse_json(r, v);
+    r.expect_end();
+}
+
+}
@@ -30,8 +30,10 @@
 #include "net/socket_defs.hh"
 #include "net/packet.hh"
 #include "core/print.hh"
+#include "core/sstring.hh"
 #include "core/temporary_buffer.hh"
 #include "core/iostream.hh"
+#include "core/posix.hh"
 #include <sys/types.h>
 #include <boost/variant.hpp>
 
@@ -90,6 +92,38 @@ struct sctp_keepalive_params {
 
 using keepalive_params = boost::variant<tcp_keepalive_params, sctp_keepalive_params>;
 
+// Congestion control state of a TCP connection
+struct tcp_congestion_info {
+    sstring algorithm;
+    // Congestion window and slow start threshold, in bytes
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    // Smoothed and minimum round trip times; zero when unknown
+    std::chrono::microseconds srtt;
+    std::chrono::microseconds min_rtt;
+    // Bytes per second the connection is paced at; zero when not paced
+    uint64_t pacing_rate;
+};
+
+// Per-connection tuning, for instance latency-sensitive against bulk
+// transfers. Fields left unset are not changed; those a stack cannot
+// honour make setting the options fail with ENOPROTOOPT.
+struct socket_options {
+    // Receive and send buffer sizes, in bytes (SO_RCVBUF, SO_SNDBUF)
+    std::experimental::optional<size_t> receive_buffer_size;
+    std::experimental::optional<size_t> send_buffer_size;
+    // How long a blocking read may busy-poll the device queue (SO_BUSY_POLL)
+    std::experimental::optional<std::chrono::microseconds> busy_poll;
+    // Acknowledge received data at once instead of delaying ACKs
+    // (TCP_QUICKACK; Linux clears it again on its own, so set it per burst)
+    std::experimental::optional<bool> quickack;
+    // Writes wait while more than this many bytes are queued but not yet
+    // sent (TCP_NOTSENT_LOWAT)
+    std::experimental::optional<size_t> notsent_lowat;
+    // Congestion control algorithm (TCP_CONGESTION)
+    std::experimental::optional<sstring> congestion_control;
+};
+
 /// \cond internal
 class connected_socket_impl;
 class socket_impl;
@@ -130,8 +164,17 @@ class udp_channel {
     udp_channel& operator=(udp_channel&&);
 
     future<udp_datagram> receive();
+    /// Receives at least one datagram, and with it up to \c max_datagrams
+    /// in all of those that arrived in the same poll, so that they can be
+    /// processed together.  \c max_datagrams must not be 0.
+    future<std::vector<udp_datagram>> receive_batch(size_t max_datagrams);
     future<> send(ipv4_addr dst, const char* msg);
     future<> send(ipv4_addr dst, packet p);
+    /// Sends several datagrams, to one or more destinations, in a single
+    /// pass through the stack.  The native stack hands runs of equally
+    /// sized datagrams to the same destination to the device as one
+    /// packet when it supports UDP segmentation offload.
+    future<> send(std::vector<std::pair<ipv4_addr, packet>> datagrams);
     bool is_closed() const;
     void close();
 };
@@ -186,6 +229,35 @@ class connected_socket {
     void set_keepalive_parameters(const net::keepalive_params& p);
     /// Get TCP keepalive parameters
     net::keepalive_params get_keepalive_parameters() const;
+    /// Selects the TCP congestion control algorithm (TCP_CONGESTION)
+    ///
+    /// The native stack implements "reno", "cubic" and "bbr"; the posix
+    /// stack accepts whatever the kernel provides.
+    void set_congestion_control(const sstring& algorithm);
+    /// Gets the congestion control state of the connection
+    net::tcp_congestion_info get_congestion_info() const;
+    /// Applies the options that are set in \c opts
+    ///
+    /// The posix stack maps them to the socket options named in
+    /// \ref net::socket_options. The native stack sizes its send queue and
+    /// receive window from the buffer sizes, and honours quickack and
+    /// notsent_lowat. It accepts busy_poll and ignores it, since it always
+    /// polls.
+    void set_socket_options(const net::socket_options& opts);
+    /// Gets the current values of all options the stack supports
+    net::socket_options get_socket_options() const;
+    /// Passes file descriptors to the peer (SCM_RIGHTS)
+    ///
+    /// Only Unix domain sockets of the posix stack support this. The
+    /// descriptors ride on a single byte, which the peer consumes with
+    /// \ref receive_file_descriptors(); flush the output stream first, and
+    /// make sure the peer is not reading its input stream at the time, or
+    /// the descriptors are lost.
+    ///
+    /// \param fds descriptors to pass; the caller keeps its own copies
+    future<> send_file_descriptors(std::vector<int> fds);
+    /// Receives file descriptors sent with \ref send_file_descriptors()
+    future<std::vector<file_desc>> receive_file_descriptors();
 
     /// Disables output to the socket.
     ///
@@ -28,6 +28,8 @@
 #include "core/byteorder.hh"
 #include "ethernet.hh"
 #include "core/print.hh"
+#include "core/lowres_clock.hh"
+#include <experimental/optional>
 #include <unordered_map>
 
 namespace net {
@@ -87,6 +89,9 @@ class arp_for : public arp_for_protocol {
     using l3addr = typename L3::address_type;
 private:
     static constexpr auto max_waiters = 512;
+    // A resolved entry older than this is re-queried in the background
+    // the next time it is used; it keeps being used meanwhile
+    static constexpr std::chrono::seconds refresh_interval{60};
     enum oper {
         op_request = 1,
         op_reply = 2,
@@ -134,9 +139,16 @@ class arp_for : public arp_for_protocol {
         std::vector<promise<l2addr>> _waiters;
         timer<> _timeout_timer;
     };
+    struct entry {
+        l2addr mac;
+        lowres_clock::time_point learned;
+        lowres_clock::time_point queried;
+        // Broadcast and our own address are never refreshed
+        bool permanent = false;
+    };
 private:
     l3addr _l3self = L3::broadcast_address();
-    std::unordered_map<l3addr, l2addr> _table;
+    std::unordered_map<l3addr, entry> _table;
     std::unordered_map<l3addr, resolution> _in_progress;
 private:
     packet make_query_packet(l3addr paddr);
@@ -144,17 +156,26 @@ class arp_for : public arp_for_protocol {
     future<> handle_request(arp_hdr* ah);
     l2addr l2self() { return _arp.l2self(); }
     void send(l2addr to, packet p);
+    void refresh(const l3addr& paddr, entry& e);
+    void set_permanent(l3addr paddr, l2addr hwaddr) {
+        auto& e = _table[paddr];
+        e.mac = hwaddr;
+        e.permanent = true;
+    }
 public:
     future<> send_query(const l3addr& paddr);
     explicit arp_for(arp& a) : arp_for_protocol(a, L3::arp_protocol_type()) {
-        _table[L3::broadcast_address()] = ethernet::broadcast_address();
+        set_permanent(L3::broadcast_address(), ethernet::broadcast_address());
     }
+    // Resolves addr without a future when it is in the table, which is the
+    // case for every packet after the first to a destination
+    std::experimental::optional<ethernet_address> try_lookup(const l3addr& addr);
     future<ethernet_address> lookup(const l3addr& addr);
     void learn(l2addr l2, l3addr l3);
     void run();
     void set_self_addr(l3addr addr) {
         _table.erase(_l3self);
-        _table[addr] = l2self();
+        set_permanent(addr, l2self());
         _l3self = addr;
     }
     friend class arp;
@@ -206,12 +227,37 @@ class arp_queue_full_error : public arp_error {
     arp_queue_full_error() : arp_error("ARP waiter's queue is full") {}
 };
 
+template <typename L3>
+constexpr std::chrono::seconds arp_for<L3>::refresh_interval;
+
+template <typename L3>
+void arp_for<L3>::refresh(const l3addr& paddr, entry& e) {
+    auto now = lowres_clock::now();
+    if (e.permanent || now - e.learned < refresh_interval
+            || now - e.queried < std::chrono::seconds(1)) {
+        return;
+    }
+    e.queried = now;
+    // Unicast, like a kernel probing a neighbor it already knows
+    send(e.mac, make_query_packet(paddr));
+}
+
+template <typename L3>
+std::experimental::optional<ethernet_address>
+arp_for<L3>::try_lookup(const l3addr& paddr) {
+    auto i = _table.find(paddr);
+    if (i == _table.end()) {
+        return {};
+    }
+    refresh(paddr, i->second);
+    return i->second.mac;
+}
+
 template <typename L3>
 future<ethernet_address>
 arp_for<L3>::lookup(const l3addr& paddr) {
-    auto i = _table.find(paddr);
-    if (i != _table.end()) {
-        return make_ready_future<ethernet_address>(i->second);
+    if (auto mac = try_lookup(paddr)) {
+        return make_ready_future<ethernet_address>(*mac);
     }
     auto j = _in_progress.find(paddr);
     auto first_request = j == _in_progress.end();
@@ -240,7 +286,12 @@ arp_for<L3>::lookup(const l3addr& paddr) {
 template <typename L3>
 void
 arp_for<L3>::learn(l2addr hwaddr, l3addr paddr) {
-    _table[paddr] = hwaddr;
+    auto& e = _table[paddr];
+    if (e.permanent) {
+        return;
+    }
+    e.mac = hwaddr;
+    e.learned = lowres_clock::now();
     auto i = _in_progress.find(paddr);
     if (i != _in_progress.end()) {
         auto& res = i->second;
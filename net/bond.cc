@@ -0,0 +1,246 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/scollectd.hh"
+#include "bond.hh"
+#include "ethernet.hh"
+#include "ip.hh"
+#include "ipv6.hh"
+#include <cstring>
+
+namespace net {
+
+class bond_device;
+
+class bond_qp : public qp {
+    static constexpr size_t max_pending = 128;
+    bond_device& _bond;
+    std::vector<qp*> _ports;
+    // Packets picked for a port that it has not taken yet
+    std::vector<circular_buffer<packet>> _pending;
+    std::vector<uint64_t> _port_tx_packets;
+    std::vector<subscription<packet>> _rx;
+    reactor::poller _flush_poller;
+    scollectd::registrations _port_regs;
+public:
+    bond_qp(bond_device& bond, boost::program_options::variables_map opts, uint16_t qid);
+    virtual future<> send(packet p) override {
+        auto i = pick_port(p);
+        _pending[i].push_back(std::move(p));
+        flush();
+        return make_ready_future<>();
+    }
+    virtual uint32_t send(circular_buffer<packet>& p) override;
+    virtual void rx_start() override;
+private:
+    unsigned pick_port(packet& p);
+    bool flush();
+};
+
+class bond_device : public device {
+    std::vector<std::unique_ptr<device>> _ports;
+    net::hw_features _hw_features;
+public:
+    explicit bond_device(std::vector<std::unique_ptr<device>> ports);
+    virtual ethernet_address hw_address() override {
+        return _ports[0]->hw_address();
+    }
+    virtual net::hw_features hw_features() override {
+        return _hw_features;
+    }
+    virtual const rss_key_type& rss_key() const override {
+        return _ports[0]->rss_key();
+    }
+    virtual uint16_t hw_queues_count() override {
+        return _ports[0]->hw_queues_count();
+    }
+    virtual unsigned hash2qid(uint32_t hash) override {
+        return _ports[0]->hash2qid(hash);
+    }
+    virtual future<> link_ready() override {
+        return parallel_for_each(_ports, [] (auto& port) {
+            return port->link_ready();
+        });
+    }
+    virtual std::unique_ptr<qp> init_local_queue(boost::program_options::variables_map opts, uint16_t qid) override {
+        return std::make_unique<bond_qp>(*this, std::move(opts), qid);
+    }
+    const std::vector<std::unique_ptr<device>>& ports() const {
+        return _ports;
+    }
+};
+
+bond_device::bond_device(std::vector<std::unique_ptr<device>> ports)
+        : _ports(std::move(ports)) {
+    assert(!_ports.empty());
+    // Only what every port offloads
+    _hw_features = _ports[0]->hw_features();
+    for (auto& port : _ports) {
+        auto f = port->hw_features();
+        _hw_features.tx_csum_ip_offload &= f.tx_csum_ip_offload;
+        _hw_features.tx_csum_l4_offload &= f.tx_csum_l4_offload;
+        _hw_features.rx_csum_offload &= f.rx_csum_offload;
+        _hw_features.rx_lro &= f.rx_lro;
+        _hw_features.tx_tso &= f.tx_tso;
+        _hw_features.tx_ufo &= f.tx_ufo;
+        _hw_features.tx_udp_seg &= f.tx_udp_seg;
+        _hw_features.mtu = std::min(_hw_features.mtu, f.mtu);
+        _hw_features.max_packet_len = std::min(_hw_features.max_packet_len, f.max_packet_len);
+        // A flow's packets must reach the same shard through any port
+        if (port->hw_queues_count() != _ports[0]->hw_queues_count() || port->rss_key() != _ports[0]->rss_key()) {
+            throw std::runtime_error("bonded ports must have the same number of queues and RSS key");
+        }
+        for (uint32_t hash = 0; hash < 4096; ++hash) {
+            if (port->hash2qid(hash) != _ports[0]->hash2qid(hash)) {
+                throw std::runtime_error("bonded ports must spread flows over their queues identically");
+            }
+        }
+    }
+}
+
+bond_qp::bond_qp(bond_device& bond, boost::program_options::variables_map opts, uint16_t qid)
+        : qp(false, "network-bond", qid)
+        , _bond(bond)
+        , _pending(bond.ports().size())
+        , _port_tx_packets(bond.ports().size())
+        , _flush_poller(reactor::poller::simple([this] { return flush(); })) {
+    for (unsigned i = 0; i < bond.ports().size(); ++i) {
+        auto& port = bond.ports()[i];
+        auto q = port->init_local_queue(opts, qid);
+        _ports.push_back(q.get());
+        port->set_local_queue(std::move(q));
+        _port_regs.push_back(scollectd::add_polled_metric(scollectd::type_instance_id(
+                _stats_plugin_name
+                , scollectd::per_cpu_plugin_instance
+                , "if_packets_tx", "member" + std::to_string(i))
+                , scollectd::make_typed(scollectd::data_type::DERIVE
+                , _port_tx_packets[i])
+        ));
+    }
+}
+
+void bond_qp::rx_start() {
+    // Whatever a port receives, the bond does
+    for (auto& port : _bond.ports()) {
+        port->receive_burst([this] (std::vector<packet>& burst) {
+            _bond.l2receive(burst);
+        });
+        _rx.push_back(port->receive([this] (packet p) {
+            _bond.l2receive(std::move(p));
+            return make_ready_future<>();
+        }));
+    }
+}
+
+// Hashes the flow a frame belongs to: its addresses and, for TCP and UDP,
+// ports, except in IPv4 fragments, which may not carry them
+static uint64_t flow_hash(packet& p) {
+    auto mix = [] (uint64_t h, uint64_t v) { return (h ^ v) * 0x100000001b3ULL; };
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto eh = p.get_header<eth_hdr>(0);
+    if (!eh) {
+        return h;
+    }
+    auto proto = eth_protocol_num(uint16_t(ntoh(*eh).eth_proto));
+    size_t off = sizeof(eth_hdr);
+    uint8_t l4;
+    if (proto == eth_protocol_num::ipv4) {
+        auto iph = p.get_header<ip_hdr>(off);
+        if (!iph) {
+            return h;
+        }
+        auto ip = ntoh(*iph);
+        h = mix(h, ip.src_ip.ip);
+        h = mix(h, ip.dst_ip.ip);
+        if (ip.mf() || ip.offset()) {
+            return h;
+        }
+        l4 = ip.ip_proto;
+        off += ip.ihl * 4;
+    } else if (proto == eth_protocol_num::ipv6) {
+        auto ip = p.get_header<ip6_hdr>(off);
+        if (!ip) {
+            return h;
+        }
+        for (auto* a : {&ip->src_ip, &ip->dst_ip}) {
+            uint64_t w[2];
+            std::memcpy(w, a->ip.data(), sizeof(w));
+            h = mix(mix(h, w[0]), w[1]);
+        }
+        l4 = ip->next_header;
+        off += sizeof(ip6_hdr);
+    } else {
+        return h;
+    }
+    if (l4 == uint8_t(ip_protocol_num::tcp) || l4 == uint8_t(ip_protocol_num::udp)) {
+        if (auto ports = p.get_header(off, 4)) {
+            uint32_t v;
+            std::memcpy(&v, ports, sizeof(v));
+            h = mix(h, v);
+        }
+    }
+    return h;
+}
+
+unsigned bond_qp::pick_port(packet& p) {
+    if (_ports.size() == 1) {
+        return 0;
+    }
+    auto h = flow_hash(p);
+    return (h ^ (h >> 32)) % _ports.size();
+}
+
+uint32_t bond_qp::send(circular_buffer<packet>& p) {
+    uint32_t taken = 0;
+    // Stops at the first packet whose port is backed up, rather than
+    // letting later packets of its flow overtake it
+    while (!p.empty()) {
+        auto i = pick_port(p.front());
+        if (_pending[i].size() >= max_pending) {
+            break;
+        }
+        _pending[i].push_back(std::move(p.front()));
+        p.pop_front();
+        ++taken;
+    }
+    flush();
+    return taken;
+}
+
+bool bond_qp::flush() {
+    bool work = false;
+    for (unsigned i = 0; i < _ports.size(); ++i) {
+        if (!_pending[i].empty()) {
+            auto sent = _ports[i]->send(_pending[i]);
+            _port_tx_packets[i] += sent;
+            work |= sent != 0;
+        }
+    }
+    return work;
+}
+
+std::unique_ptr<device> create_bond_net_device(std::vector<std::unique_ptr<device>> ports) {
+    return std::make_unique<bond_device>(std::move(ports));
+}
+
+}
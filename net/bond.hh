@@ -0,0 +1,43 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#ifndef BOND_HH_
+#define BOND_HH_
+
+#include <memory>
+#include <vector>
+#include "net.hh"
+
+namespace net {
+
+// Joins several ports into one link, with the first port's MAC address,
+// as a static link aggregation (no LACP) on the switch side expects.
+// Every shard with a hardware queue gets that queue on each port, so
+// received packets are taken from all ports everywhere; sent packets go
+// out of a port picked by hashing their flow, which keeps each flow's
+// packets in order. The ports must accept frames sent to the first port's
+// address, and spread flows over their queues identically (same queue
+// count, RSS key and redirection table), so that a flow lands on the same
+// shard whichever port it arrives on.
+std::unique_ptr<device> create_bond_net_device(std::vector<std::unique_ptr<device>> ports);
+
+}
+#endif
@@ -0,0 +1,205 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace net {
+
+/*
+ * Open-addressing hash table for the per-shard connection tables.
+ *
+ * Slots are stored inline next to their 32-bit hash, so a lookup walks
+ * consecutive memory and compares keys only when the hash matches, instead
+ * of chasing a node pointer per bucket entry.
+ *
+ * Growing never rehashes the whole table at once: a larger array is
+ * allocated and every later insert or erase moves a few slots of the old
+ * one over, while lookups consult both. The old array is freed once it is
+ * drained, well before the new one can fill up.
+ *
+ * Key and T must be default constructible and movable.
+ */
+template <typename Key, typename T, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class connection_table {
+    // Slot hashes below 2 mark empty and erased slots
+    static constexpr uint32_t empty_slot = 0;
+    static constexpr uint32_t erased_slot = 1;
+    static constexpr size_t min_capacity = 16;
+    // Old slots moved per insert or erase while growing
+    static constexpr size_t migrate_batch = 16;
+
+    struct slot {
+        uint32_t hash = empty_slot;
+        Key key;
+        T value;
+    };
+    struct slots {
+        std::unique_ptr<slot[]> s;
+        size_t mask = 0;
+        size_t used = 0;
+        size_t erased = 0;
+
+        slots() = default;
+        explicit slots(size_t capacity) : s(new slot[capacity]), mask(capacity - 1) {}
+        size_t capacity() const { return s ? mask + 1 : 0; }
+        slot* find(uint32_t h, const Key& k, const KeyEqual& eq) {
+            if (!s) {
+                return nullptr;
+            }
+            for (auto i = h & mask;; i = (i + 1) & mask) {
+                auto& x = s[i];
+                if (x.hash == empty_slot) {
+                    return nullptr;
+                }
+                if (x.hash == h && eq(x.key, k)) {
+                    return &x;
+                }
+            }
+        }
+        void place(uint32_t h, Key&& k, T&& v) {
+            for (auto i = h & mask;; i = (i + 1) & mask) {
+                auto& x = s[i];
+                if (x.hash == erased_slot) {
+                    --erased;
+                } else if (x.hash != empty_slot) {
+                    continue;
+                }
+                x.hash = h;
+                x.key = std::move(k);
+                x.value = std::move(v);
+                ++used;
+                return;
+            }
+        }
+        void remove(slot& x) {
+            x.value = T();
+            --used;
+            // A slot followed by an empty one ends no probe sequence
+            if (s[(&x - s.get() + 1) & mask].hash == empty_slot) {
+                x.hash = empty_slot;
+            } else {
+                x.hash = erased_slot;
+                ++erased;
+            }
+        }
+    };
+
+    slots _cur;
+    slots _old;
+    size_t _migrate_pos = 0;
+    Hash _hash;
+    KeyEqual _eq;
+private:
+    uint32_t hash_of(const Key& k) const {
+        uint64_t h = _hash(k);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        auto r = uint32_t(h);
+        return r < 2 ? r + 2 : r;
+    }
+    void migrate(size_t n) {
+        if (!_old.s) {
+            return;
+        }
+        auto end = std::min(_migrate_pos + n, _old.capacity());
+        for (; _migrate_pos < end; ++_migrate_pos) {
+            auto& x = _old.s[_migrate_pos];
+            if (x.hash > erased_slot) {
+                _cur.place(x.hash, std::move(x.key), std::move(x.value));
+                // Keep probe sequences through this slot intact
+                x.hash = erased_slot;
+                --_old.used;
+            }
+        }
+        if (_migrate_pos == _old.capacity()) {
+            _old = slots();
+        }
+    }
+    void maybe_grow() {
+        if ((_cur.used + _cur.erased + 1) * 4 <= _cur.capacity() * 3) {
+            return;
+        }
+        // Cannot happen at the migration rate above, but stay correct
+        migrate(_old.capacity());
+        size_t capacity = _cur.capacity() ? _cur.capacity() : min_capacity;
+        while (size() * 2 >= capacity) {
+            capacity *= 2;
+        }
+        // Same capacity when it is mostly erased slots we are shedding
+        _old = std::move(_cur);
+        _cur = slots(capacity);
+        _migrate_pos = 0;
+    }
+public:
+    // Returns the value stored for k, or nullptr
+    T* find(const Key& k) {
+        auto h = hash_of(k);
+        if (auto x = _cur.find(h, k, _eq)) {
+            return &x->value;
+        }
+        if (auto x = _old.find(h, k, _eq)) {
+            return &x->value;
+        }
+        return nullptr;
+    }
+    // Returns false, leaving the table unchanged, if k is present
+    bool insert(Key k, T v) {
+        auto h = hash_of(k);
+        if (_cur.find(h, k, _eq) || _old.find(h, k, _eq)) {
+            return false;
+        }
+        migrate(migrate_batch);
+        maybe_grow();
+        _cur.place(h, std::move(k), std::move(v));
+        return true;
+    }
+    bool erase(const Key& k) {
+        auto h = hash_of(k);
+        auto found = false;
+        if (auto x = _cur.find(h, k, _eq)) {
+            _cur.remove(*x);
+            found = true;
+        } else if (auto x = _old.find(h, k, _eq)) {
+            _old.remove(*x);
+            found = true;
+        }
+        migrate(migrate_batch);
+        return found;
+    }
+    size_t size() const {
+        return _cur.used + _old.used;
+    }
+    bool empty() const {
+        return !size();
+    }
+    // Slots allocated, counting an array still being drained
+    size_t capacity() const {
+        return _cur.capacity() + _old.capacity();
+    }
+};
+
+}
@@ -40,6 +40,7 @@
 #include "const.hh"
 #include "core/dpdk_rte.hh"
 #include "dpdk.hh"
+#include "bond.hh"
 #include "toeplitz.hh"
 
 #include <getopt.h>
@@ -118,6 +119,12 @@ static constexpr size_t   inline_mbuf_data_size  = 2048;
 //
 static constexpr size_t   mbuf_data_size         = 2048;
 
+//
+// Leading bytes of a packet's first fragment that hold the headers and must
+// not be split across physically discontiguous pages.
+//
+static constexpr size_t   frag0_hdr_size         = 128;
+
 // (INLINE_MBUF_DATA_SIZE(2K)*32 = 64K = Max TSO/LRO size) + 1 mbuf for headers
 static constexpr uint8_t  max_frags              = 32 + 1;
 
@@ -192,6 +199,7 @@ struct port_stats {
             uint64_t dropped;      // missed packets (e.g. full FIFO)
             uint64_t crc;          // packets with CRC error
             uint64_t len;          // packets with a bad length
+            uint64_t no_mbuf;      // packets dropped for lack of an rx mbuf
             uint64_t total;        // total number of erroneous received packets
         } bad;
     } rx;
@@ -303,6 +311,7 @@ class dpdk_device : public device {
             _stats.rx.bad.crc         = rte_stats.ibadcrc;
             _stats.rx.bad.dropped     = rte_stats.imissed;
             _stats.rx.bad.len         = rte_stats.ibadlen;
+            _stats.rx.bad.no_mbuf     = rte_stats.rx_nombuf;
             _stats.rx.bad.total       = rte_stats.ierrors;
 
             _stats.tx.good.pause_xon  = rte_stats.tx_pause_xon;
@@ -347,6 +356,14 @@ class dpdk_device : public device {
                         , scollectd::make_typed(scollectd::data_type::DERIVE
                         , _stats.rx.bad.len)
         ));
+        _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                          _stats_plugin_name
+                        , _stats_plugin_inst
+                        , "if_rx_errors", "No Mbuf")
+                        , scollectd::make_typed(scollectd::data_type::DERIVE
+                        , _stats.rx.bad.no_mbuf)
+        ));
 
         // Coupled counters:
         // Good
@@ -563,6 +580,14 @@ class dpdk_qp : public net::qp {
                     // TODO: Take a VLAN header into an account here
                     head->l2_len = sizeof(struct ether_hdr);
                     head->l3_len = oi.ip_hdr_len;
+#ifdef PKT_TX_UDP_SEG
+                    if (oi.tso_seg_size) {
+                        assert(oi.needs_ip_csum);
+                        head->ol_flags |= PKT_TX_UDP_SEG;
+                        head->l4_len = oi.udp_hdr_len;
+                        head->tso_segsz = oi.tso_seg_size;
+                    }
+#endif
                 }
             }
         }
@@ -590,19 +615,35 @@ class dpdk_qp : public net::qp {
             unsigned nsegs = 0;
 
             //
-            // Create a HEAD of the fragmented packet: check if frag0 has to be
-            // copied and if yes - send it in a copy way
+            // Create a HEAD of the fragmented packet: check if the headers in
+            // frag0 have to be copied and if yes - copy them and send the rest
+            // of frag0 in a zero-copy way
             //
+            unsigned total_nsegs;
             if (!check_frag0(p)) {
-                if (!copy_one_frag(qp, p.frag(0), head, last_seg, nsegs)) {
+                auto& frag0 = p.frag(0);
+                fragment hdr{frag0.base, std::min(frag0.size, frag0_hdr_size)};
+                if (!copy_one_frag(qp, hdr, head, last_seg, nsegs)) {
                     return nullptr;
                 }
+                total_nsegs = nsegs;
+                if (hdr.size < frag0.size) {
+                    fragment rest{frag0.base + hdr.size, frag0.size - hdr.size};
+                    rte_mbuf *h = nullptr, *new_last_seg = nullptr;
+                    if (!translate_one_frag(qp, rest, h, new_last_seg, nsegs)) {
+                        me(head)->recycle();
+                        return nullptr;
+                    }
+                    total_nsegs += nsegs;
+                    last_seg->next = h;
+                    last_seg = new_last_seg;
+                }
             } else if (!translate_one_frag(qp, p.frag(0), head, last_seg, nsegs)) {
                 return nullptr;
+            } else {
+                total_nsegs = nsegs;
             }
 
-            unsigned total_nsegs = nsegs;
-
             for (unsigned i = 1; i < p.nr_frags(); i++) {
                 rte_mbuf *h = nullptr, *new_last_seg = nullptr;
                 if (!translate_one_frag(qp, p.frag(i), h, new_last_seg, nsegs)) {
@@ -894,6 +935,8 @@ class dpdk_qp : public net::qp {
             buf->set_zc_info(va, pa, len);
             m = buf->rte_mbuf_p();
 
+            qp._stats.tx.good.update_zc_stats(1, len);
+
             return len;
         }
 
@@ -956,7 +999,7 @@ class dpdk_qp : public net::qp {
             void* base = p.frag(0).base;
             translation tr = translate(base, frag0_size);
 
-            if (tr.size < frag0_size && tr.size < 128) {
+            if (tr.size < frag0_size && tr.size < frag0_hdr_size) {
                 return false;
             }
 
@@ -1371,6 +1414,8 @@ class dpdk_qp : public net::qp {
     rte_mempool *_pktmbuf_pool_rx;
     std::vector<rte_mbuf*> _rx_free_pkts;
     std::vector<rte_mbuf*> _rx_free_bufs;
+    // Packets of the rx burst being processed, handed up together
+    std::vector<packet> _rx_burst;
     std::vector<fragment> _frags;
     std::vector<char*> _bufs;
     size_t _num_rx_free_segs = 0;
@@ -1561,11 +1606,12 @@ int dpdk_device::init_port_start()
         _hw_features.tx_tso = 1;
     }
 
-    // There is no UFO support in the PMDs yet.
-#if 0
+    // There is no UFO support in the PMDs yet, but the PMDs that offer
+    // DEV_TX_OFFLOAD_UDP_TSO segment UDP like TSO segments TCP
+#ifdef PKT_TX_UDP_SEG
     if (_dev_info.tx_offload_capa & DEV_TX_OFFLOAD_UDP_TSO) {
-        printf("UFO is supported\n");
-        _hw_features.tx_ufo = 1;
+        printf("UDP segmentation offload is supported\n");
+        _hw_features.tx_udp_seg = 1;
     }
 #endif
 
@@ -1650,6 +1696,10 @@ void dpdk_device::init_port_fini()
         rte_exit(EXIT_FAILURE, "Cannot start port %d\n", _port_idx);
     }
 
+    // IPv6 neighbor solicitations are sent to solicited-node multicast
+    // addresses
+    rte_eth_allmulticast_enable(_port_idx);
+
     if (_num_queues > 1) {
         if (!rte_eth_dev_filter_supported(_port_idx, RTE_ETH_FILTER_HASH)) {
             printf("Port %d: HASH FILTER configuration is supported\n", _port_idx);
@@ -2063,11 +2113,19 @@ void dpdk_qp<HugetlbfsMemBackend>::process_packets(
     struct rte_mbuf **bufs, uint16_t count)
 {
     uint64_t nr_frags = 0, bytes = 0;
+    // The whole burst shares one timestamp: what it measures is the time
+    // spent in the stack after the NIC, not the NIC's own queueing
+    uint64_t rx_timestamp = tsc_clock::now().time_since_epoch().count();
 
+    _rx_burst.reserve(count);
     for (uint16_t i = 0; i < count; i++) {
         struct rte_mbuf *m = bufs[i];
         offload_info oi;
 
+        if (i + 1 < count) {
+            rte_prefetch0(rte_pktmbuf_mtod(bufs[i + 1], void*));
+        }
+
         std::experimental::optional<packet> p = from_mbuf(m);
 
         // Drop the packet if translation above has failed
@@ -2097,14 +2155,17 @@ void dpdk_qp<HugetlbfsMemBackend>::process_packets(
             // the checksum again, because we did this here.
         }
 
+        oi.rx_timestamp = rx_timestamp;
         (*p).set_offload_info(oi);
         if (m->ol_flags & PKT_RX_RSS_HASH) {
             (*p).set_rss_hash(m->hash.rss);
         }
 
-        _dev->l2receive(std::move(*p));
+        _rx_burst.push_back(std::move(*p));
     }
 
+    _dev->l2receive(_rx_burst);
+
     _stats.rx.good.update_pkts_bunch(count);
     _stats.rx.good.update_frags_stats(nr_frags, bytes);
 
@@ -2187,11 +2248,21 @@ std::unique_ptr<net::device> create_dpdk_net_device(
                                     uint8_t num_queues,
                                     bool use_lro,
                                     bool enable_fc)
+{
+    return create_dpdk_net_device(std::vector<uint8_t>{port_idx}, num_queues, use_lro, enable_fc);
+}
+
+std::unique_ptr<net::device> create_dpdk_net_device(
+                                    const std::vector<uint8_t>& port_indexes,
+                                    uint8_t num_queues,
+                                    bool use_lro,
+                                    bool enable_fc)
 {
     static bool called = false;
 
     assert(!called);
     assert(dpdk::eal::initialized);
+    assert(!port_indexes.empty());
 
     called = true;
 
@@ -2201,9 +2272,34 @@ std::unique_ptr<net::device> create_dpdk_net_device(
     } else {
         printf("ports number: %d\n", rte_eth_dev_count());
     }
+    for (auto port_idx : port_indexes) {
+        if (port_idx >= rte_eth_dev_count()) {
+            rte_exit(EXIT_FAILURE, "No DPDK port %u\n", port_idx);
+        }
+    }
 
-    return std::make_unique<dpdk::dpdk_device>(port_idx, num_queues, use_lro,
-                                               enable_fc);
+    if (port_indexes.size() == 1) {
+        return std::make_unique<dpdk::dpdk_device>(port_indexes[0], num_queues, use_lro,
+                                                   enable_fc);
+    }
+
+    std::vector<std::unique_ptr<net::device>> ports;
+    for (auto port_idx : port_indexes) {
+        ports.push_back(std::make_unique<dpdk::dpdk_device>(port_idx, num_queues, use_lro,
+                                                            enable_fc));
+    }
+    // The bond goes by the first port's address; the others must accept
+    // frames sent to it too
+    struct ether_addr mac;
+    rte_eth_macaddr_get(port_indexes[0], &mac);
+    for (auto port_idx : port_indexes) {
+        if (port_idx != port_indexes[0] && rte_eth_dev_mac_addr_add(port_idx, &mac, 0) < 0) {
+            printf("Port %u: cannot add the bond's MAC address, going promiscuous\n", port_idx);
+            rte_eth_promiscuous_enable(port_idx);
+        }
+    }
+    printf("Bonding %zu ports\n", port_indexes.size());
+    return net::create_bond_net_device(std::move(ports));
 }
 
 boost::program_options::options_description
@@ -2215,7 +2311,11 @@ get_dpdk_net_options_description()
     opts.add_options()
         ("hw-fc",
                 boost::program_options::value<std::string>()->default_value("on"),
-                "Enable HW Flow Control (on / off)");
+                "Enable HW Flow Control (on / off)")
+        ("dpdk-ports",
+                boost::program_options::value<std::string>()->default_value("0"),
+                "Comma-separated DPDK port indexes to use; several are bonded into "
+                "one link (the switch ports must form a static link aggregation group)");
 #if 0
     opts.add_options()
         ("csum-offload",
@@ -25,6 +25,7 @@
 #define _SEASTAR_DPDK_DEV_H
 
 #include <memory>
+#include <vector>
 #include "net.hh"
 #include "core/sstring.hh"
 
@@ -34,6 +35,14 @@ std::unique_ptr<net::device> create_dpdk_net_device(
                                     bool use_lro = true,
                                     bool enable_fc = true);
 
+// Drives several ports as one link, bonded by create_bond_net_device(), or
+// a single port as above
+std::unique_ptr<net::device> create_dpdk_net_device(
+                                    const std::vector<uint8_t>& port_indexes,
+                                    uint8_t num_queues,
+                                    bool use_lro,
+                                    bool enable_fc);
+
 boost::program_options::options_description get_dpdk_net_options_description();
 
 namespace dpdk {
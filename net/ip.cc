@@ -21,6 +21,7 @@
  */
 
 #include "ip.hh"
+#include "tcp.hh"
 #include "core/print.hh"
 #include "core/future-util.hh"
 #include "core/shared_ptr.hh"
@@ -40,6 +41,7 @@ std::ostream& operator<<(std::ostream& os, ipv4_address a) {
 constexpr std::chrono::seconds ipv4::_frag_timeout;
 constexpr uint32_t ipv4::_frag_low_thresh;
 constexpr uint32_t ipv4::_frag_high_thresh;
+constexpr unsigned ipv4::_gro_max_flows;
 
 ipv4::ipv4(interface* netif)
     : _netif(netif)
@@ -68,8 +70,63 @@ ipv4::ipv4(interface* netif)
             , scollectd::make_typed(scollectd::data_type::DERIVE
             , [] { return ipv4_packet_merger::linearizations(); })
         ),
+        //
+        // TCP segments merged by software GRO: DERIVE:0:u
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "gro-merged")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _gro_merged)
+        ),
+        //
+        // Fragment reassembly: DERIVE:0:u
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "frag-reassembled")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _frag_stats.reassembled)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "frag-steered")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _frag_stats.steered)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "frag-appended")
+            , scollectd::make_typed(scollectd::data_type::DERIVE
+            , [] { return ipv4_packet_merger::appends(); })
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "frag-timed-out")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _frag_stats.timed_out)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "frag-evicted")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _frag_stats.evicted)
+        ),
+        //
+        // Memory held by fragments waiting for reassembly: GAUGE:0:U
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "bytes", "frag-memory")
+            , scollectd::make_typed(scollectd::data_type::GAUGE, _frag_mem)
+        ),
     }) {
     _frag_timer.set_callback([this] { frag_timeout(); });
+    _l3.receive_burst([this] (std::vector<l3_protocol::rx_packet>& burst) {
+        handle_received_burst(burst);
+    });
 }
 
 bool ipv4::forward(forward_hash& out_hash_data, packet& p, size_t off)
@@ -101,7 +158,8 @@ bool ipv4::needs_frag(packet& p, ip_protocol_num prot_num, net::hw_features hw_f
     }
 
     if ((prot_num == ip_protocol_num::tcp && hw_features.tx_tso) ||
-        (prot_num == ip_protocol_num::udp && hw_features.tx_ufo)) {
+        (prot_num == ip_protocol_num::udp && hw_features.tx_ufo) ||
+        (prot_num == ip_protocol_num::udp && hw_features.tx_udp_seg && p.offload_info().tso_seg_size)) {
         return false;
     }
 
@@ -162,22 +220,28 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
     // Does this IP datagram need reassembly
     auto mf = h.mf();
     if (mf == true || offset != 0) {
+        if (frag_steer(p, h, from)) {
+            return make_ready_future<>();
+        }
         frag_limit_mem();
         auto frag_id = ipv4_frag_id{h.src_ip, h.dst_ip, h.id, h.ip_proto};
-        auto& frag = _frags[frag_id];
+        auto frag_it = _frags.find(frag_id);
+        if (frag_it == _frags.end()) {
+            frag_it = _frags.emplace(frag_id, frag()).first;
+            frag_it->second.age = _frags_age.insert(_frags_age.end(), frag_id);
+        } else {
+            _frags_age.splice(_frags_age.end(), _frags_age, frag_it->second.age);
+        }
+        auto& frag = frag_it->second;
         if (mf == false) {
             frag.last_frag_received = true;
         }
-        // This is a newly created frag_id
-        if (frag.mem_size == 0) {
-            _frags_age.push_back(frag_id);
-            frag.rx_time = clock_type::now();
-        }
+        frag.rx_time = clock_type::now();
         auto added_size = frag.merge(h, offset, std::move(p));
         _frag_mem += added_size;
         if (frag.is_complete()) {
+            _frag_stats.reassembled++;
             // All the fragments are received
-            auto dropped_size = frag.mem_size;
             auto& ip_data = frag.data.map.begin()->second;
             // Choose a cpu to forward this packet
             auto cpu_id = engine().cpu_id();
@@ -200,9 +264,7 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
                 _netif->forward(cpu_id, std::move(pkt));
             }
 
-            // Delete this frag from _frags and _frags_age
-            frag_drop(frag_id, dropped_size);
-            _frags_age.remove(frag_id);
+            frag_drop(frag_it);
         } else {
             // Some of the fragments are missing
             if (!_frag_timer.armed()) {
@@ -216,22 +278,103 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
     if (l4) {
         // Trim IP header and pass to upper layer
         p.trim_front(ip_hdr_len);
-        l4->received(std::move(p), h.src_ip, h.dst_ip);
+        if (_gro_poller && h.ip_proto == uint8_t(ip_protocol_num::tcp)) {
+            gro_receive(std::move(p), h.src_ip, h.dst_ip);
+        } else {
+            l4->received(std::move(p), h.src_ip, h.dst_ip);
+        }
     }
     return make_ready_future<>();
 }
 
-future<ethernet_address> ipv4::get_l2_dst_address(ipv4_address to) {
-    // Figure out where to send the packet to. If it is a directly connected
-    // host, send to it directly, otherwise send to the default gateway.
-    ipv4_address dst;
-    if (in_my_netmask(to)) {
-        dst = to;
+void ipv4::set_gro(bool enable) {
+    if (enable && !hw_features().rx_lro) {
+        _gro_poller = reactor::poller::simple([this] { return gro_flush(); });
     } else {
-        dst = _gw_address;
+        gro_flush();
+        _gro_poller = {};
+    }
+}
+
+void ipv4::gro_receive(packet p, ipv4_address from, ipv4_address to) {
+    auto th = p.get_header(0, tcp_hdr::len);
+    if (!th) {
+        return _tcp.received(std::move(p), from, to);
+    }
+    auto h = tcp_hdr::read(th);
+    size_t hdr_len = h.data_offset * 4;
+    th = p.get_header(0, hdr_len);
+    if (hdr_len < tcp_hdr::len || !th) {
+        return _tcp.received(std::move(p), from, to);
+    }
+    auto data_len = p.len() - hdr_len;
+    // Only plain data segments are merged, anything that changes the
+    // connection state goes up on its own
+    bool mergeable = data_len && !h.f_syn && !h.f_fin && !h.f_rst && !h.f_urg;
+    if (mergeable && !hw_features().rx_csum_offload) {
+        // The merged segment cannot be checked as a whole, check each
+        checksummer csum;
+        ipv4_traits::tcp_pseudo_header_checksum(csum, from, to, p.len());
+        csum.sum(p);
+        mergeable = csum.get() == 0;
+    }
+
+    auto flow = std::find_if(_gro_flows.begin(), _gro_flows.end(), [&] (const gro_flow& f) {
+        return f.from == from && f.to == to && f.src_port == h.src_port && f.dst_port == h.dst_port;
+    });
+    if (flow != _gro_flows.end()) {
+        // The held segment's header was linearized when it was first seen
+        auto fth = flow->p.get_header(0, tcp_hdr::len);
+        if (mergeable
+                && h.seq.raw == flow->next_seq && h.ack.raw == flow->ack && h.window == flow->window
+                && flow->p.len() + data_len <= size_t(net::ip_packet_len_max - net::ipv4_hdr_len_min)
+                && size_t(uint8_t(fth[12]) >> 4) * 4 == hdr_len
+                // Options, timestamps included, must be the same
+                && std::equal(th + tcp_hdr::len, th + hdr_len, flow->p.get_header(0, hdr_len) + tcp_hdr::len)) {
+            p.trim_front(hdr_len);
+            flow->p.append(std::move(p));
+            flow->next_seq += data_len;
+            _gro_merged++;
+            if (h.f_psh) {
+                // The sender has no more for now
+                _tcp.received(std::move(flow->p), from, to);
+                _gro_flows.erase(flow);
+            }
+            return;
+        }
+        // Whatever is held goes up first, to keep the order
+        _tcp.received(std::move(flow->p), from, to);
+        _gro_flows.erase(flow);
+    }
+    if (!mergeable || h.f_psh || _gro_flows.size() == _gro_max_flows) {
+        return _tcp.received(std::move(p), from, to);
+    }
+    p.offload_info_ref().l4_csum_verified = true;
+    _gro_flows.push_back(gro_flow{from, to, h.src_port, h.dst_port,
+            h.seq.raw + uint32_t(data_len), h.ack.raw, h.window, std::move(p)});
+}
+
+bool ipv4::gro_flush() {
+    if (_gro_flows.empty()) {
+        return false;
+    }
+    for (auto&& f : _gro_flows) {
+        _tcp.received(std::move(f.p), f.from, f.to);
+    }
+    _gro_flows.clear();
+    return true;
+}
+
+void ipv4::handle_received_burst(std::vector<l3_protocol::rx_packet>& burst) {
+    for (auto&& x : burst) {
+        // The result is only pending while a packet filter is installed,
+        // and is not waited for here
+        handle_received_packet(std::move(x.p), x.from);
     }
+}
 
-    return _arp.lookup(dst);
+future<ethernet_address> ipv4::get_l2_dst_address(ipv4_address to) {
+    return _arp.lookup(next_hop(to));
 }
 
 void ipv4::send(ipv4_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst) {
@@ -353,21 +496,11 @@ void ipv4::frag_limit_mem() {
     if (_frag_mem <= _frag_high_thresh) {
         return;
     }
-    auto drop = _frag_mem - _frag_low_thresh;
-    while (drop) {
-        if (_frags_age.empty()) {
-            return;
-        }
-        // Drop the oldest frag (first element) from _frags_age
-        auto frag_id = _frags_age.front();
-        _frags_age.pop_front();
-
-        // Drop from _frags as well
-        auto& frag = _frags[frag_id];
-        auto dropped_size = frag.mem_size;
-        frag_drop(frag_id, dropped_size);
-
-        drop -= std::min(drop, dropped_size);
+    // Drop the least recently updated datagrams until the memory is
+    // down to the low threshold
+    while (_frag_mem > _frag_low_thresh && !_frags_age.empty()) {
+        frag_drop(_frags.find(_frags_age.front()));
+        _frag_stats.evicted++;
     }
 }
 
@@ -376,19 +509,14 @@ void ipv4::frag_timeout() {
         return;
     }
     auto now = clock_type::now();
-    for (auto it = _frags_age.begin(); it != _frags_age.end();) {
-        auto frag_id = *it;
-        auto& frag = _frags[frag_id];
-        if (now > frag.rx_time + _frag_timeout) {
-            auto dropped_size = frag.mem_size;
-            // Drop from _frags
-            frag_drop(frag_id, dropped_size);
-            // Drop from _frags_age
-            it = _frags_age.erase(it);
-        } else {
+    while (!_frags_age.empty()) {
+        auto it = _frags.find(_frags_age.front());
+        if (now <= it->second.rx_time + _frag_timeout) {
             // The further items can only be younger
             break;
         }
+        frag_drop(it);
+        _frag_stats.timed_out++;
     }
     if (_frags.size() != 0) {
         frag_arm(now);
@@ -397,9 +525,47 @@ void ipv4::frag_timeout() {
     }
 }
 
-void ipv4::frag_drop(ipv4_frag_id frag_id, uint32_t dropped_size) {
-    _frags.erase(frag_id);
-    _frag_mem -= dropped_size;
+void ipv4::frag_drop(frag_map::iterator it) {
+    _frag_mem -= it->second.mem_size;
+    _frags_age.erase(it->second.age);
+    _frags.erase(it);
+}
+
+// The fragments of a datagram must all meet on one shard. A NIC hashes
+// fragments on their addresses only, except that some hash the first one,
+// which carries the TCP or UDP header, on its ports too and so may send it
+// to another queue than the rest. Fragments are therefore reassembled on
+// the shard their address hash, computed the way the NIC computes it,
+// points to, where most of them already arrive; the others are sent there.
+bool ipv4::frag_steer(packet& p, ip_hdr& h, ethernet_address from) {
+    auto hwrss = p.rss_hash();
+    if (!hwrss || smp::count == 1) {
+        // Without a hardware hash, the packet was dispatched in software
+        // by ipv4::forward(), on the addresses
+        return false;
+    }
+    forward_hash hash_data;
+    hash_data.push_back(hton(h.src_ip.ip));
+    hash_data.push_back(hton(h.dst_ip.ip));
+    auto hash = toeplitz_hash(_netif->rss_key(), hash_data);
+    // A fragment sent here carries the address hash, and is not sent on
+    // again even if the queue mapping disagrees
+    if (*hwrss == hash) {
+        return false;
+    }
+    auto cpu_id = _netif->hash2cpu(hash);
+    if (cpu_id == engine().cpu_id()) {
+        return false;
+    }
+    auto eh = p.prepend_header<eth_hdr>();
+    eh->src_mac = from;
+    eh->dst_mac = _netif->hw_address();
+    eh->eth_proto = uint16_t(eth_protocol_num::ipv4);
+    *eh = hton(*eh);
+    p.set_rss_hash(hash);
+    _netif->forward(cpu_id, std::move(p));
+    _frag_stats.steered++;
+    return true;
 }
 
 int32_t ipv4::frag::merge(ip_hdr &h, uint16_t offset, packet p) {
@@ -411,6 +577,13 @@ int32_t ipv4::frag::merge(ip_hdr &h, uint16_t offset, packet p) {
     }
     // Sotre IP payload
     p.trim_front(ip_hdr_len);
+    // Fragments arriving in order are appended to what came before them;
+    // only out of order ones need the full merge
+    auto p_mem = p.memory();
+    if (offset != 0 && data.append(offset, p)) {
+        mem_size += p_mem;
+        return mem_size - old;
+    }
     data.merge(offset, std::move(p));
     // Update mem size
     mem_size = header.memory();
@@ -450,6 +623,7 @@ packet ipv4::frag::get_assembled_packet(ethernet_address from, ethernet_address
     // again for the assembled datagram
     offload_info oi;
     oi.reassembled = true;
+    oi.rx_timestamp = pkt.offload_info().rx_timestamp;
     pkt.set_offload_info(oi);
     return pkt;
 }
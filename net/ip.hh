@@ -105,6 +105,10 @@ static inline bool is_unspecified(ipv4_address addr) { return addr.ip == 0; }
 
 std::ostream& operator<<(std::ostream& os, ipv4_address a);
 
+inline socket_address make_socket_address(ipv4_address a, uint16_t port) {
+    return make_ipv4_address(a.ip, port);
+}
+
 }
 
 namespace std {
@@ -134,7 +138,12 @@ struct ipv4_traits {
     static void udp_pseudo_header_checksum(checksummer& csum, ipv4_address src, ipv4_address dst, uint16_t len) {
         csum.sum_many(src.ip.raw, dst.ip.raw, uint8_t(0), uint8_t(ip_protocol_num::udp), len);
     }
+    // Feeds an address to the RSS hash the way the NIC reads it off the wire
+    static void forward_hash_address(forward_hash& out_hash_data, ipv4_address a) {
+        out_hash_data.push_back(hton(a.ip));
+    }
     static constexpr uint8_t ip_hdr_len_min = net::ipv4_hdr_len_min;
+    static constexpr sa_family_t address_family = AF_INET;
 };
 
 template <ip_protocol_num ProtoNum>
@@ -145,6 +154,7 @@ class ipv4_l4 {
     ipv4_l4(ipv4& inet) : _inet(inet) {}
     void register_packet_provider(ipv4_traits::packet_provider_type func);
     future<ethernet_address> get_l2_dst_address(ipv4_address to);
+    std::experimental::optional<ethernet_address> try_get_l2_dst_address(ipv4_address to);
 };
 
 class ip_protocol {
@@ -174,8 +184,8 @@ struct l4connid {
 
     uint32_t hash(const rss_key_type& rss_key) {
         forward_hash hash_data;
-        hash_data.push_back(hton(foreign_ip.ip));
-        hash_data.push_back(hton(local_ip.ip));
+        InetTraits::forward_hash_address(hash_data, foreign_ip);
+        InetTraits::forward_hash_address(hash_data, local_ip);
         hash_data.push_back(hton(foreign_port));
         hash_data.push_back(hton(local_port));
         return toeplitz_hash(rss_key, hash_data);
@@ -255,8 +265,14 @@ class ipv4_udp : public ip_protocol {
     int _queue_size = default_queue_size;
     uint16_t _next_anonymous_port = min_anonymous_port;
     circular_buffer<ipv4_traits::l4packet> _packetq;
+    // Segments the device may cut a single send into, as Linux allows
+    static constexpr unsigned max_gso_segments = 64;
 private:
     uint16_t next_port(uint16_t port);
+    // With seg_size set, p holds datagrams of seg_size bytes, the last one
+    // maybe shorter, for the device to segment
+    void send(uint16_t src_port, ipv4_addr dst, packet &&p, uint16_t seg_size);
+    void queue_packet(ipv4_addr dst, packet p);
 public:
     class registration {
     private:
@@ -278,6 +294,7 @@ class ipv4_udp : public ip_protocol {
     udp_channel make_channel(ipv4_addr addr);
     virtual void received(packet p, ipv4_address from, ipv4_address to) override;
     void send(uint16_t src_port, ipv4_addr dst, packet &&p);
+    void send(uint16_t src_port, std::vector<std::pair<ipv4_addr, packet>>& datagrams);
     bool forward(forward_hash& out_hash_data, packet& p, size_t off) override;
     void set_queue_size(int size) { _queue_size = size; }
 };
@@ -344,33 +361,74 @@ class ipv4 {
     struct frag {
         packet header;
         ipv4_packet_merger data;
+        // When the last fragment arrived
         clock_type::time_point rx_time;
         uint32_t mem_size = 0;
         // fragment with MF == 0 inidates it is the last fragment
         bool last_frag_received = false;
+        // This datagram's place in _frags_age
+        std::list<ipv4_frag_id>::iterator age;
 
         packet get_assembled_packet(ethernet_address from, ethernet_address to);
         int32_t merge(ip_hdr &h, uint16_t offset, packet p);
         bool is_complete();
     };
-    std::unordered_map<ipv4_frag_id, frag, ipv4_frag_id::hash> _frags;
+    using frag_map = std::unordered_map<ipv4_frag_id, frag, ipv4_frag_id::hash>;
+    frag_map _frags;
+    // Least recently updated first; datagrams are dropped from the front
+    // when they time out or the shard holds too much fragment memory
     std::list<ipv4_frag_id> _frags_age;
     static constexpr std::chrono::seconds _frag_timeout{30};
     static constexpr uint32_t _frag_low_thresh{3 * 1024 * 1024};
     static constexpr uint32_t _frag_high_thresh{4 * 1024 * 1024};
     uint32_t _frag_mem{0};
     timer<lowres_clock> _frag_timer;
+    struct frag_stats {
+        uint64_t reassembled = 0;
+        // fragments sent to the shard reassembling their datagram
+        uint64_t steered = 0;
+        // datagrams given up on
+        uint64_t timed_out = 0;
+        uint64_t evicted = 0;
+    } _frag_stats;
     circular_buffer<l3_protocol::l3packet> _packetq;
     unsigned _pkt_provider_idx = 0;
+    // Software GRO, for NICs without LRO: in-order TCP segments of a flow
+    // arriving within one poll are merged into one before tcp::received
+    // sees them, and the poller hands them up once the poll is over.
+    struct gro_flow {
+        ipv4_address from;
+        ipv4_address to;
+        uint16_t src_port;
+        uint16_t dst_port;
+        // Sequence number the next segment must start at, and the ACK and
+        // window it must repeat to be merged
+        uint32_t next_seq;
+        uint32_t ack;
+        uint16_t window;
+        packet p;
+    };
+    static constexpr unsigned _gro_max_flows = 8;
+    std::vector<gro_flow> _gro_flows;
+    std::experimental::optional<reactor::poller> _gro_poller;
+    uint64_t _gro_merged = 0;
     scollectd::registrations _collectd_regs;
 private:
     future<> handle_received_packet(packet p, ethernet_address from);
+    void handle_received_burst(std::vector<l3_protocol::rx_packet>& burst);
+    void gro_receive(packet p, ipv4_address from, ipv4_address to);
+    bool gro_flush();
     bool forward(forward_hash& out_hash_data, packet& p, size_t off);
     std::experimental::optional<l3_protocol::l3packet> get_packet();
     bool in_my_netmask(ipv4_address a) const;
+    // The directly connected host, or else the default gateway
+    ipv4_address next_hop(ipv4_address to) const {
+        return in_my_netmask(to) ? to : _gw_address;
+    }
     void frag_limit_mem();
     void frag_timeout();
-    void frag_drop(ipv4_frag_id frag_id, uint32_t dropped_size);
+    void frag_drop(frag_map::iterator it);
+    bool frag_steer(packet& p, ip_hdr& h, ethernet_address from);
     void frag_arm(clock_type::time_point now) {
         auto tp = now + _frag_timeout;
         _frag_timer.arm(tp);
@@ -395,6 +453,8 @@ class ipv4 {
     // But for now, a simple single raw pointer suffices
     void set_packet_filter(ip_packet_filter *);
     ip_packet_filter * packet_filter() const;
+    // Has no effect when the device does LRO itself
+    void set_gro(bool enable);
     void send(ipv4_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst);
     tcp<ipv4_traits>& get_tcp() { return *_tcp._tcp; }
     ipv4_udp& get_udp() { return _udp; }
@@ -408,6 +468,10 @@ class ipv4 {
         _pkt_providers.push_back(std::move(func));
     }
     future<ethernet_address> get_l2_dst_address(ipv4_address to);
+    // The destination MAC when it is already resolved; no future involved
+    std::experimental::optional<ethernet_address> try_get_l2_dst_address(ipv4_address to) {
+        return _arp.try_lookup(next_hop(to));
+    }
 };
 
 template <ip_protocol_num ProtoNum>
@@ -428,6 +492,12 @@ future<ethernet_address> ipv4_l4<ProtoNum>::get_l2_dst_address(ipv4_address to)
     return _inet.get_l2_dst_address(to);
 }
 
+template <ip_protocol_num ProtoNum>
+inline
+std::experimental::optional<ethernet_address> ipv4_l4<ProtoNum>::try_get_l2_dst_address(ipv4_address to) {
+    return _inet.try_get_l2_dst_address(to);
+}
+
 struct ip_hdr {
     uint8_t ihl : 4;
     uint8_t ver : 4;
@@ -457,10 +527,14 @@ struct l4connid<InetTraits>::connid_hash : private std::hash<ipaddr>, private st
     size_t operator()(const l4connid<InetTraits>& id) const noexcept {
         using h1 = std::hash<ipaddr>;
         using h2 = std::hash<uint16_t>;
-        return h1::operator()(id.local_ip)
-            ^ h1::operator()(id.foreign_ip)
-            ^ h2::operator()(id.local_port)
-            ^ h2::operator()(id.foreign_port);
+        // Order-dependent, so that swapped addresses or ports (or an address
+        // and port that cancel out under xor) do not collide
+        auto mix = [] (size_t h, size_t v) { return (h ^ v) * 0x100000001b3ULL; };
+        size_t h = 0xcbf29ce484222325ULL;
+        h = mix(h, h1::operator()(id.local_ip));
+        h = mix(h, h1::operator()(id.foreign_ip));
+        h = mix(h, h2::operator()(id.local_port));
+        return mix(h, h2::operator()(id.foreign_port));
     }
 };
 
@@ -0,0 +1,682 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "ipv6.hh"
+#include "tcp.hh"
+#include "core/print.hh"
+#include <boost/asio/ip/address_v6.hpp>
+
+namespace net {
+
+ipv6_address::ipv6_address(const std::string& addr) {
+    boost::system::error_code ec;
+    auto ipv6 = boost::asio::ip::address_v6::from_string(addr, ec);
+    if (ec) {
+        throw std::runtime_error(sprint("Wrong format for IPv6 address %s", addr));
+    }
+    auto bytes = ipv6.to_bytes();
+    std::copy(bytes.begin(), bytes.end(), ip.begin());
+}
+
+ipv6_address::ipv6_address(const socket_address& sa) {
+    auto& a = sa.as_posix_sockaddr_in6().sin6_addr.s6_addr;
+    std::copy(std::begin(a), std::end(a), ip.begin());
+}
+
+ipv6_address ipv6_address::link_local(ethernet_address ea) {
+    ipv6_address a;
+    a.ip[0] = 0xfe;
+    a.ip[1] = 0x80;
+    // The universal/local bit is inverted
+    a.ip[8] = ea.mac[0] ^ 0x02;
+    a.ip[9] = ea.mac[1];
+    a.ip[10] = ea.mac[2];
+    a.ip[11] = 0xff;
+    a.ip[12] = 0xfe;
+    a.ip[13] = ea.mac[3];
+    a.ip[14] = ea.mac[4];
+    a.ip[15] = ea.mac[5];
+    return a;
+}
+
+ipv6_address ipv6_address::solicited_node(const ipv6_address& a) {
+    ipv6_address s;
+    s.ip[0] = 0xff;
+    s.ip[1] = 0x02;
+    s.ip[11] = 0x01;
+    s.ip[12] = 0xff;
+    std::copy(a.ip.begin() + 13, a.ip.end(), s.ip.begin() + 13);
+    return s;
+}
+
+ipv6_address ipv6_address::all_nodes() {
+    ipv6_address a;
+    a.ip[0] = 0xff;
+    a.ip[1] = 0x02;
+    a.ip[15] = 0x01;
+    return a;
+}
+
+ethernet_address ipv6_address::multicast_mac() const {
+    return ethernet_address{0x33, 0x33, ip[12], ip[13], ip[14], ip[15]};
+}
+
+std::ostream& operator<<(std::ostream& os, const ipv6_address& a) {
+    boost::asio::ip::address_v6::bytes_type bytes;
+    std::copy(a.ip.begin(), a.ip.end(), bytes.begin());
+    return os << boost::asio::ip::address_v6(bytes).to_string();
+}
+
+socket_address make_socket_address(const ipv6_address& a, uint16_t port) {
+    ::sockaddr_in6 sa = {};
+    sa.sin6_family = AF_INET6;
+    sa.sin6_port = htons(port);
+    std::copy(a.ip.begin(), a.ip.end(), std::begin(sa.sin6_addr.s6_addr));
+    return socket_address(sa);
+}
+
+ipv6::ipv6(interface* netif)
+    : _netif(netif)
+    , _hw_features(netif->hw_features())
+    , _link_local_address(ipv6_address::link_local(netif->hw_address()))
+    , _l3(netif, eth_protocol_num::ipv6, [this] { return get_packet(); })
+    , _rx_packets(_l3.receive([this] (packet p, ethernet_address ea) {
+        return handle_received_packet(std::move(p), ea); },
+      [this] (forward_hash& out_hash_data, packet& p, size_t off) {
+        return forward(out_hash_data, p, off);}))
+    , _tcp(*this)
+    , _icmp(*this)
+    , _udp(*this)
+    , _ndp(_icmp)
+    , _l4({ { uint8_t(ip_protocol_num::tcp), &_tcp }, { uint8_t(ip_protocol_num::icmpv6), &_icmp }, { uint8_t(ip_protocol_num::udp), &_udp }}) {
+    // The drivers set up checksum and segmentation offloads for IPv4
+    // headers only
+    _hw_features.tx_csum_ip_offload = false;
+    _hw_features.tx_csum_l4_offload = false;
+    _hw_features.tx_tso = false;
+    _hw_features.tx_ufo = false;
+    _l3.receive_burst([this] (std::vector<l3_protocol::rx_packet>& burst) {
+        handle_received_burst(burst);
+    });
+}
+
+bool ipv6::forward(forward_hash& out_hash_data, packet& p, size_t off) {
+    auto iph = p.get_header<ip6_hdr>(off);
+    if (!iph) {
+        return false;
+    }
+    ipv6_traits::forward_hash_address(out_hash_data, iph->src_ip);
+    ipv6_traits::forward_hash_address(out_hash_data, iph->dst_ip);
+
+    // Extension headers are not walked here, such packets are steered by
+    // the addresses only
+    auto l4 = _l4[iph->next_header];
+    if (l4) {
+        l4->forward(out_hash_data, p, off + sizeof(ip6_hdr));
+    }
+    return true;
+}
+
+bool ipv6::is_on_link(const ipv6_address& a) const {
+    if (a.is_link_local()) {
+        return true;
+    }
+    if (is_unspecified(_host_address)) {
+        return false;
+    }
+    auto bytes = _prefix_len / 8;
+    if (!std::equal(a.ip.begin(), a.ip.begin() + bytes, _host_address.ip.begin())) {
+        return false;
+    }
+    auto bits = _prefix_len % 8;
+    if (bits) {
+        uint8_t mask = 0xff << (8 - bits);
+        return !((a.ip[bytes] ^ _host_address.ip[bytes]) & mask);
+    }
+    return true;
+}
+
+bool ipv6::is_local_address(const ipv6_address& a) const {
+    return a == _link_local_address || (a == _host_address && !is_unspecified(a));
+}
+
+bool ipv6::accepts(const ipv6_address& dst) const {
+    if (!dst.is_multicast()) {
+        return is_local_address(dst);
+    }
+    return dst == ipv6_address::all_nodes()
+            || dst == ipv6_address::solicited_node(_link_local_address)
+            || (!is_unspecified(_host_address) && dst == ipv6_address::solicited_node(_host_address));
+}
+
+future<>
+ipv6::handle_received_packet(packet p, ethernet_address from) {
+    auto iph = p.get_header<ip6_hdr>(0);
+    if (!iph) {
+        return make_ready_future<>();
+    }
+    auto h = ntoh(*iph);
+    if (h.version() != 6) {
+        return make_ready_future<>();
+    }
+    unsigned ip_len = sizeof(ip6_hdr) + h.payload_len;
+    unsigned pkt_len = p.len();
+    if (pkt_len > ip_len) {
+        // Trim the ethernet padding
+        p.trim_back(pkt_len - ip_len);
+    } else if (pkt_len < ip_len) {
+        return make_ready_future<>();
+    }
+
+    if (is_on_link(h.src_ip) && !is_local_address(h.src_ip)) {
+        _ndp.learn(from, h.src_ip);
+    }
+
+    if (!accepts(h.dst_ip)) {
+        // FIXME: forward
+        return make_ready_future<>();
+    }
+
+    // Skip the extension headers that carry nothing for us
+    auto next_header = h.next_header;
+    size_t off = sizeof(ip6_hdr);
+    for (;;) {
+        enum : uint8_t { hop_by_hop = 0, routing = 43, fragment = 44, destination_options = 60 };
+        if (next_header == fragment) {
+            // FIXME: reassembly
+            return make_ready_future<>();
+        }
+        if (next_header != hop_by_hop && next_header != routing && next_header != destination_options) {
+            break;
+        }
+        auto eh = p.get_header(off, 2);
+        if (!eh) {
+            return make_ready_future<>();
+        }
+        next_header = uint8_t(eh[0]);
+        off += (uint8_t(eh[1]) + 1) * 8;
+        if (off > p.len()) {
+            return make_ready_future<>();
+        }
+    }
+
+    auto l4 = _l4[next_header];
+    if (l4) {
+        // Trim IP header and pass to upper layer
+        p.trim_front(off);
+        l4->received(std::move(p), h.src_ip, h.dst_ip);
+    }
+    return make_ready_future<>();
+}
+
+void ipv6::handle_received_burst(std::vector<l3_protocol::rx_packet>& burst) {
+    for (auto&& x : burst) {
+        // The result is only pending while a packet filter is installed,
+        // and is not waited for here
+        handle_received_packet(std::move(x.p), x.from);
+    }
+}
+
+future<ethernet_address> ipv6::get_l2_dst_address(ipv6_address to) {
+    if (to.is_multicast()) {
+        return make_ready_future<ethernet_address>(to.multicast_mac());
+    }
+    // Figure out where to send the packet to. If it is a directly connected
+    // host, send to it directly, otherwise send to the default gateway.
+    if (is_on_link(to)) {
+        return _ndp.lookup(to);
+    }
+    if (is_unspecified(_gw_address)) {
+        return make_exception_future<ethernet_address>(std::runtime_error("No IPv6 gateway"));
+    }
+    return _ndp.lookup(_gw_address);
+}
+
+std::experimental::optional<ethernet_address> ipv6::try_get_l2_dst_address(ipv6_address to) {
+    if (to.is_multicast()) {
+        return to.multicast_mac();
+    }
+    if (is_on_link(to)) {
+        return _ndp.try_lookup(to);
+    }
+    if (is_unspecified(_gw_address)) {
+        return {};
+    }
+    return _ndp.try_lookup(_gw_address);
+}
+
+void ipv6::send(ipv6_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst) {
+    auto payload_len = p.len();
+    auto iph = p.prepend_header<ip6_hdr>();
+    iph->ver_tc_flow = 6u << 28;
+    iph->payload_len = payload_len;
+    iph->next_header = uint8_t(proto_num);
+    // Neighbor discovery messages are only accepted with the maximum hop
+    // limit, proving they were not forwarded
+    iph->hop_limit = proto_num == ip_protocol_num::icmpv6 ? 255 : 64;
+    iph->src_ip = source_address(to);
+    iph->dst_ip = to;
+    *iph = hton(*iph);
+
+    auto& oi = p.offload_info_ref();
+    oi.ip_hdr_len = sizeof(ip6_hdr);
+    oi.needs_ip_csum = false;
+    _packetq.push_back(l3_protocol::l3packet{eth_protocol_num::ipv6, e_dst, std::move(p)});
+}
+
+std::experimental::optional<l3_protocol::l3packet> ipv6::get_packet() {
+    if (_packetq.empty()) {
+        for (size_t i = 0; i < _pkt_providers.size(); i++) {
+            auto l4p = _pkt_providers[_pkt_provider_idx++]();
+            if (_pkt_provider_idx == _pkt_providers.size()) {
+                _pkt_provider_idx = 0;
+            }
+            if (l4p) {
+                auto l4pv = std::move(l4p.value());
+                send(l4pv.to, l4pv.proto_num, std::move(l4pv.p), l4pv.e_dst);
+                break;
+            }
+        }
+    }
+
+    std::experimental::optional<l3_protocol::l3packet> p;
+    if (!_packetq.empty()) {
+        p = std::move(_packetq.front());
+        _packetq.pop_front();
+    }
+    return p;
+}
+
+void ipv6::set_host_address(ipv6_address ip) {
+    _host_address = ip;
+}
+
+ipv6_address ipv6::host_address() const {
+    return is_unspecified(_host_address) ? _link_local_address : _host_address;
+}
+
+ipv6_address ipv6::source_address(const ipv6_address& dst) const {
+    return dst.is_link_local() ? _link_local_address : host_address();
+}
+
+void ipv6::set_gw_address(ipv6_address ip) {
+    _gw_address = ip;
+}
+
+ipv6_address ipv6::gw_address() const {
+    return _gw_address;
+}
+
+void ipv6::set_prefix_length(unsigned len) {
+    _prefix_len = std::min(len, 128u);
+}
+
+unsigned ipv6::prefix_length() const {
+    return _prefix_len;
+}
+
+constexpr std::chrono::seconds ndp::refresh_interval;
+
+void ndp::refresh(const ipv6_address& paddr, entry& e) {
+    auto now = lowres_clock::now();
+    if (now - e.learned < refresh_interval || now - e.queried < std::chrono::seconds(1)) {
+        return;
+    }
+    e.queried = now;
+    _icmp.send_solicitation(paddr, e.mac);
+}
+
+std::experimental::optional<ethernet_address>
+ndp::try_lookup(const ipv6_address& paddr) {
+    auto i = _table.find(paddr);
+    if (i == _table.end()) {
+        return {};
+    }
+    refresh(paddr, i->second);
+    return i->second.mac;
+}
+
+future<ethernet_address>
+ndp::lookup(const ipv6_address& paddr) {
+    if (auto mac = try_lookup(paddr)) {
+        return make_ready_future<ethernet_address>(*mac);
+    }
+    auto j = _in_progress.find(paddr);
+    auto first_request = j == _in_progress.end();
+    auto& res = first_request ? _in_progress[paddr] : j->second;
+
+    if (first_request) {
+        res._timeout_timer.set_callback([paddr, this, &res] {
+            _icmp.send_solicitation(paddr);
+            for (auto& w : res._waiters) {
+                w.set_exception(ndp_timeout_error());
+            }
+            res._waiters.clear();
+        });
+        res._timeout_timer.arm_periodic(std::chrono::seconds(1));
+        _icmp.send_solicitation(paddr);
+    }
+
+    if (res._waiters.size() >= max_waiters) {
+        return make_exception_future<ethernet_address>(ndp_queue_full_error());
+    }
+
+    res._waiters.emplace_back();
+    return res._waiters.back().get_future();
+}
+
+void
+ndp::learn(ethernet_address hwaddr, ipv6_address paddr) {
+    auto& e = _table[paddr];
+    e.mac = hwaddr;
+    e.learned = lowres_clock::now();
+    auto i = _in_progress.find(paddr);
+    if (i != _in_progress.end()) {
+        auto& res = i->second;
+        res._timeout_timer.cancel();
+        for (auto &&pr : res._waiters) {
+            pr.set_value(hwaddr);
+        }
+        _in_progress.erase(i);
+    }
+}
+
+constexpr uint32_t ipv6_icmp::na_solicited;
+constexpr uint32_t ipv6_icmp::na_override;
+constexpr size_t ipv6_icmp::ndp_msg_len;
+constexpr size_t ipv6_icmp::ndp_option_len;
+
+ipv6_icmp::ipv6_icmp(ipv6& inet) : _inet(inet) {
+    _inet.register_packet_provider([this] {
+        std::experimental::optional<ipv6_traits::l4packet> l4p;
+        if (!_packetq.empty()) {
+            l4p = std::move(_packetq.front());
+            _packetq.pop_front();
+            _queue_space.signal(l4p.value().p.len());
+        }
+        return l4p;
+    });
+}
+
+void ipv6_icmp::queue(ipv6_address to, ethernet_address e_dst, packet p) {
+    if (_queue_space.try_wait(p.len())) { // drop packets that do not fit the queue
+        _packetq.emplace_back(ipv6_traits::l4packet{to, std::move(p), e_dst, ip_protocol_num::icmpv6});
+    }
+}
+
+void ipv6_icmp::received(packet p, ipv6_address from, ipv6_address to) {
+    auto hdr = p.get_header<icmpv6_hdr>(0);
+    if (!hdr) {
+        return;
+    }
+    // Unlike ICMP for IPv4, the checksum covers a pseudo-header, which
+    // NICs do not verify
+    checksummer csum;
+    ipv6_traits::pseudo_header_checksum(csum, from, to, p.len(), ip_protocol_num::icmpv6);
+    csum.sum(p);
+    if (csum.get() != 0) {
+        return;
+    }
+    switch (hdr->type) {
+    case icmpv6_hdr::msg_type::echo_request:
+        return handle_echo(std::move(p), from, to);
+    case icmpv6_hdr::msg_type::neighbor_solicitation:
+        return handle_solicitation(std::move(p), from);
+    case icmpv6_hdr::msg_type::neighbor_advertisement:
+        return handle_advertisement(std::move(p));
+    default:
+        return;
+    }
+}
+
+void ipv6_icmp::handle_echo(packet p, ipv6_address from, ipv6_address to) {
+    if (to.is_multicast()) {
+        return;
+    }
+    auto hdr = p.get_header<icmpv6_hdr>(0);
+    hdr->type = icmpv6_hdr::msg_type::echo_reply;
+    hdr->code = 0;
+    hdr->csum = 0;
+    checksummer csum;
+    ipv6_traits::pseudo_header_checksum(csum, _inet.source_address(from), from, p.len(), ip_protocol_num::icmpv6);
+    csum.sum(p);
+    hdr->csum = csum.get();
+
+    _inet.get_l2_dst_address(from).then([this, from, p = std::move(p)] (ethernet_address e_dst) mutable {
+        queue(from, e_dst, std::move(p));
+    });
+}
+
+std::experimental::optional<ethernet_address>
+ipv6_icmp::find_link_layer_address(packet& p, ndp_option_type opt) {
+    size_t off = ndp_msg_len;
+    while (auto o = p.get_header(off, 2)) {
+        size_t len = uint8_t(o[1]) * 8;
+        if (!len || off + len > p.len()) {
+            break;
+        }
+        if (uint8_t(o[0]) == opt && len == ndp_option_len) {
+            return ethernet_address::read(p.get_header(off, len) + 2);
+        }
+        off += len;
+    }
+    return {};
+}
+
+void ipv6_icmp::handle_solicitation(packet p, ipv6_address from) {
+    auto m = p.get_header(0, ndp_msg_len);
+    if (!m) {
+        return;
+    }
+    auto target = ipv6_address::read(m + sizeof(icmpv6_hdr) + 4);
+    if (!_inet.is_local_address(target)) {
+        return;
+    }
+    auto l2 = find_link_layer_address(p, source_link_layer_address);
+    if (is_unspecified(from)) {
+        // Duplicate address detection by a neighbor; defend the address
+        auto reply = make_ndp_packet(icmpv6_hdr::msg_type::neighbor_advertisement, na_override,
+                target, target_link_layer_address, ipv6_address::all_nodes());
+        return queue(ipv6_address::all_nodes(), ipv6_address::all_nodes().multicast_mac(), std::move(reply));
+    }
+    if (l2) {
+        _inet.learn(*l2, from);
+    }
+    auto reply = make_ndp_packet(icmpv6_hdr::msg_type::neighbor_advertisement, na_solicited | na_override,
+            target, target_link_layer_address, from);
+    _inet.get_l2_dst_address(from).then([this, from, reply = std::move(reply)] (ethernet_address e_dst) mutable {
+        queue(from, e_dst, std::move(reply));
+    });
+}
+
+void ipv6_icmp::handle_advertisement(packet p) {
+    auto m = p.get_header(0, ndp_msg_len);
+    if (!m) {
+        return;
+    }
+    auto target = ipv6_address::read(m + sizeof(icmpv6_hdr) + 4);
+    auto l2 = find_link_layer_address(p, target_link_layer_address);
+    if (l2) {
+        ndp_learn(*l2, target);
+    }
+}
+
+packet ipv6_icmp::make_ndp_packet(icmpv6_hdr::msg_type type, uint32_t flags, ipv6_address target,
+        ndp_option_type opt, ipv6_address dst) {
+    auto p = packet();
+    auto m = p.prepend_uninitialized_header(ndp_msg_len + ndp_option_len);
+    auto hdr = reinterpret_cast<icmpv6_hdr*>(m);
+    hdr->type = type;
+    hdr->code = 0;
+    hdr->csum = 0;
+    m += sizeof(icmpv6_hdr);
+    produce_be<uint32_t>(m, flags);
+    target.produce(m);
+    produce_be<uint8_t>(m, opt);
+    produce_be<uint8_t>(m, ndp_option_len / 8);
+    _inet.netif()->hw_address().produce(m);
+
+    checksummer csum;
+    ipv6_traits::pseudo_header_checksum(csum, _inet.source_address(dst), dst, p.len(), ip_protocol_num::icmpv6);
+    csum.sum(p);
+    hdr->csum = csum.get();
+    return p;
+}
+
+void ipv6_icmp::send_solicitation(ipv6_address target) {
+    auto dst = ipv6_address::solicited_node(target);
+    queue(dst, dst.multicast_mac(), make_ndp_packet(icmpv6_hdr::msg_type::neighbor_solicitation, 0,
+            target, source_link_layer_address, dst));
+}
+
+void ipv6_icmp::send_solicitation(ipv6_address target, ethernet_address known) {
+    queue(target, known, make_ndp_packet(icmpv6_hdr::msg_type::neighbor_solicitation, 0,
+            target, source_link_layer_address, target));
+}
+
+ipv6_udp::ipv6_udp(ipv6& inet)
+    : _inet(inet)
+{
+    _inet.register_packet_provider([this] {
+        std::experimental::optional<ipv6_traits::l4packet> l4p;
+        if (!_packetq.empty()) {
+            l4p = std::move(_packetq.front());
+            _packetq.pop_front();
+        }
+        return l4p;
+    });
+}
+
+bool ipv6_udp::forward(forward_hash& out_hash_data, packet& p, size_t off) {
+    auto uh = p.get_header<udp_hdr>(off);
+    if (uh) {
+        out_hash_data.push_back(uh->src_port);
+        out_hash_data.push_back(uh->dst_port);
+    }
+    return true;
+}
+
+void ipv6_udp::received(packet p, ipv6_address from, ipv6_address to) {
+    auto uh = p.get_header<udp_hdr>(0);
+    if (!uh) {
+        return;
+    }
+    auto h = ntoh(*uh);
+    // The checksum is mandatory over IPv6
+    if (!_inet.hw_features().rx_csum_offload) {
+        checksummer csum;
+        ipv6_traits::udp_pseudo_header_checksum(csum, from, to, p.len());
+        csum.sum(p);
+        if (h.cksum == 0 || csum.get() != 0) {
+            return;
+        }
+    }
+    auto chan_it = _channels.find(h.dst_port);
+    if (chan_it != _channels.end()) {
+        p.trim_front(sizeof(udp_hdr));
+        chan_it->second->_queue.push(datagram{from, h.src_port, h.dst_port, std::move(p)});
+    }
+}
+
+void ipv6_udp::send(uint16_t src_port, ipv6_address dst, uint16_t dst_port, packet p) {
+    auto src = _inet.source_address(dst);
+    auto hdr = p.prepend_header<udp_hdr>();
+    hdr->src_port = src_port;
+    hdr->dst_port = dst_port;
+    hdr->len = p.len();
+    hdr->cksum = 0;
+    *hdr = hton(*hdr);
+
+    checksummer csum;
+    ipv6_traits::udp_pseudo_header_checksum(csum, src, dst, p.len());
+    csum.sum(p);
+    auto cksum = csum.get();
+    // Zero means "no checksum", which IPv6 does not allow
+    hdr->cksum = cksum ? cksum : 0xffff;
+    offload_info oi;
+    oi.protocol = ip_protocol_num::udp;
+    p.set_offload_info(oi);
+
+    if (auto e_dst = _inet.try_get_l2_dst_address(dst)) {
+        _packetq.emplace_back(ipv6_traits::l4packet{dst, std::move(p), *e_dst, ip_protocol_num::udp});
+        return;
+    }
+    _inet.get_l2_dst_address(dst).then([this, dst, p = std::move(p)] (ethernet_address e_dst) mutable {
+        _packetq.emplace_back(ipv6_traits::l4packet{dst, std::move(p), e_dst, ip_protocol_num::udp});
+    });
+}
+
+uint16_t ipv6_udp::next_port(uint16_t port) {
+    return (port + 1) == 0 ? min_anonymous_port : port + 1;
+}
+
+ipv6_udp::channel
+ipv6_udp::make_channel(uint16_t port) {
+    uint16_t bind_port;
+
+    if (port) {
+        if (_channels.count(port)) {
+            throw std::runtime_error("Address already in use");
+        }
+        bind_port = port;
+    } else {
+        auto starting_port = _next_anonymous_port;
+        while (_channels.count(_next_anonymous_port)) {
+            _next_anonymous_port = next_port(_next_anonymous_port);
+            if (starting_port == _next_anonymous_port) {
+                throw std::runtime_error("No free port");
+            }
+        }
+
+        bind_port = _next_anonymous_port;
+        _next_anonymous_port = next_port(_next_anonymous_port);
+    }
+
+    auto chan_state = make_lw_shared<channel_state>(_queue_size);
+    _channels[bind_port] = chan_state;
+    return channel(*this, bind_port, std::move(chan_state));
+}
+
+future<ipv6_udp::datagram> ipv6_udp::channel::receive() {
+    return _state->_queue.pop_eventually();
+}
+
+future<> ipv6_udp::channel::send(ipv6_address dst, uint16_t dst_port, packet p) {
+    auto len = p.len();
+    if (len + sizeof(udp_hdr) + sizeof(ip6_hdr) > _proto->_inet.hw_features().mtu) {
+        return make_exception_future<>(std::system_error(EMSGSIZE, std::system_category()));
+    }
+    return _state->_user_queue_space.wait(len).then([this, dst, dst_port, p = std::move(p), len] () mutable {
+        p = packet(std::move(p), make_deleter([s = _state, len] { s->_user_queue_space.signal(len); }));
+        _proto->send(_port, dst, dst_port, std::move(p));
+    });
+}
+
+void ipv6_udp::channel::close() {
+    if (!_proto) {
+        return;
+    }
+    _proto->_channels.erase(_port);
+    _state->_queue.abort(std::make_exception_ptr(std::system_error(EPIPE, std::system_category())));
+    _proto = nullptr;
+}
+
+}
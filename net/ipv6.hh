@@ -0,0 +1,423 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// IPv6 for the native stack: the l3 protocol, neighbor discovery (RFC4861)
+// in place of ARP, and the TCP and UDP instances that run over it.
+
+#pragma once
+
+#include "ip.hh"
+#include <array>
+#include <string>
+
+namespace net {
+
+class ipv6;
+class ipv6_icmp;
+template <ip_protocol_num ProtoNum>
+class ipv6_l4;
+
+struct ipv6_address {
+    ipv6_address() : ip{} {}
+    explicit ipv6_address(const std::array<uint8_t, 16>& ip) : ip(ip) {}
+    explicit ipv6_address(const std::string& addr);
+    explicit ipv6_address(const socket_address& sa);
+
+    // Network byte order
+    std::array<uint8_t, 16> ip;
+
+    template <typename Adjuster>
+    void adjust_endianness(Adjuster a) {}
+
+    friend bool operator==(const ipv6_address& x, const ipv6_address& y) {
+        return x.ip == y.ip;
+    }
+    friend bool operator!=(const ipv6_address& x, const ipv6_address& y) {
+        return x.ip != y.ip;
+    }
+
+    static ipv6_address read(const char* p) {
+        ipv6_address ia;
+        std::copy_n(p, size(), reinterpret_cast<char*>(ia.ip.data()));
+        return ia;
+    }
+    static ipv6_address consume(const char*& p) {
+        auto ia = read(p);
+        p += size();
+        return ia;
+    }
+    void write(char* p) const {
+        std::copy_n(reinterpret_cast<const char*>(ip.data()), size(), p);
+    }
+    void produce(char*& p) const {
+        write(p);
+        p += size();
+    }
+    static constexpr size_t size() {
+        return 16;
+    }
+
+    bool is_multicast() const { return ip[0] == 0xff; }
+    bool is_link_local() const { return ip[0] == 0xfe && (ip[1] & 0xc0) == 0x80; }
+    // fe80::/64 with the interface identifier derived from the MAC (EUI-64)
+    static ipv6_address link_local(ethernet_address ea);
+    // ff02::1:ffXX:XXXX, where neighbor solicitations for a are sent
+    static ipv6_address solicited_node(const ipv6_address& a);
+    // ff02::1
+    static ipv6_address all_nodes();
+    // 33:33 followed by the low 32 bits of a multicast address
+    ethernet_address multicast_mac() const;
+} __attribute__((packed));
+
+static inline bool is_unspecified(const ipv6_address& addr) { return addr == ipv6_address(); }
+
+std::ostream& operator<<(std::ostream& os, const ipv6_address& a);
+
+socket_address make_socket_address(const ipv6_address& a, uint16_t port);
+
+}
+
+namespace std {
+
+template <>
+struct hash<net::ipv6_address> {
+    size_t operator()(const net::ipv6_address& a) const {
+        uint32_t w[4];
+        std::copy_n(a.ip.data(), sizeof(w), reinterpret_cast<uint8_t*>(w));
+        return w[0] ^ w[1] ^ w[2] ^ w[3];
+    }
+};
+
+}
+
+namespace net {
+
+struct ipv6_traits {
+    using address_type = ipv6_address;
+    using inet_type = ipv6_l4<ip_protocol_num::tcp>;
+    struct l4packet {
+        ipv6_address to;
+        packet p;
+        ethernet_address e_dst;
+        ip_protocol_num proto_num;
+    };
+    using packet_provider_type = std::function<std::experimental::optional<l4packet> ()>;
+    static void pseudo_header_checksum(checksummer& csum, const ipv6_address& src, const ipv6_address& dst,
+            uint16_t len, ip_protocol_num proto_num) {
+        csum.sum(reinterpret_cast<const char*>(src.ip.data()), src.size());
+        csum.sum(reinterpret_cast<const char*>(dst.ip.data()), dst.size());
+        // 32-bit upper-layer length, 24 zero bits, next header
+        csum.sum_many(uint16_t(0), len, uint16_t(0), uint8_t(0), uint8_t(proto_num));
+    }
+    static void tcp_pseudo_header_checksum(checksummer& csum, const ipv6_address& src, const ipv6_address& dst, uint16_t len) {
+        pseudo_header_checksum(csum, src, dst, len, ip_protocol_num::tcp);
+    }
+    static void udp_pseudo_header_checksum(checksummer& csum, const ipv6_address& src, const ipv6_address& dst, uint16_t len) {
+        pseudo_header_checksum(csum, src, dst, len, ip_protocol_num::udp);
+    }
+    // Same order as the Toeplitz input of NICs doing RSS on IPv6
+    static void forward_hash_address(forward_hash& out_hash_data, const ipv6_address& a) {
+        for (auto b : a.ip) {
+            out_hash_data.push_back(b);
+        }
+    }
+    static constexpr uint8_t ip_hdr_len_min = net::ipv6_hdr_len_min;
+    static constexpr sa_family_t address_family = AF_INET6;
+};
+
+template <ip_protocol_num ProtoNum>
+class ipv6_l4 {
+public:
+    ipv6& _inet;
+public:
+    ipv6_l4(ipv6& inet) : _inet(inet) {}
+    void register_packet_provider(ipv6_traits::packet_provider_type func);
+    future<ethernet_address> get_l2_dst_address(ipv6_address to);
+    std::experimental::optional<ethernet_address> try_get_l2_dst_address(ipv6_address to);
+};
+
+class ipv6_protocol {
+public:
+    virtual ~ipv6_protocol() {}
+    virtual void received(packet p, ipv6_address from, ipv6_address to) = 0;
+    virtual bool forward(forward_hash& out_hash_data, packet& p, size_t off) { return true; }
+};
+
+class ipv6_tcp final : public ipv6_protocol {
+    ipv6_l4<ip_protocol_num::tcp> _inet_l4;
+    std::unique_ptr<tcp<ipv6_traits>> _tcp;
+public:
+    ipv6_tcp(ipv6& inet);
+    ~ipv6_tcp();
+    virtual void received(packet p, ipv6_address from, ipv6_address to) override;
+    virtual bool forward(forward_hash& out_hash_data, packet& p, size_t off) override;
+    friend class ipv6;
+};
+
+class ipv6_udp final : public ipv6_protocol {
+public:
+    struct datagram {
+        ipv6_address src;
+        uint16_t src_port;
+        uint16_t dst_port;
+        packet p;
+    };
+private:
+    struct channel_state {
+        queue<datagram> _queue;
+        // Limit number of data queued into send queue
+        semaphore _user_queue_space = {212992};
+        channel_state(size_t queue_size) : _queue(queue_size) {}
+    };
+    static const uint16_t min_anonymous_port = 32768;
+    ipv6& _inet;
+    std::unordered_map<uint16_t, lw_shared_ptr<channel_state>> _channels;
+    int _queue_size = ipv4_udp::default_queue_size;
+    uint16_t _next_anonymous_port = min_anonymous_port;
+    circular_buffer<ipv6_traits::l4packet> _packetq;
+private:
+    uint16_t next_port(uint16_t port);
+public:
+    // A bound port.  The udp_channel API speaks ipv4_addr, so IPv6 datagrams
+    // are exchanged through this instead.
+    class channel {
+        ipv6_udp* _proto;
+        uint16_t _port;
+        lw_shared_ptr<channel_state> _state;
+    public:
+        channel(ipv6_udp& proto, uint16_t port, lw_shared_ptr<channel_state> state)
+            : _proto(&proto), _port(port), _state(std::move(state)) {}
+        channel(channel&& x) noexcept
+            : _proto(std::exchange(x._proto, nullptr)), _port(x._port), _state(std::move(x._state)) {}
+        ~channel() { close(); }
+        uint16_t port() const { return _port; }
+        future<datagram> receive();
+        // Datagrams that do not fit the MTU fail with EMSGSIZE, the stack
+        // does not fragment
+        future<> send(ipv6_address dst, uint16_t dst_port, packet p);
+        void close();
+    };
+
+    ipv6_udp(ipv6& inet);
+    // Binds port, or an anonymous port when it is 0
+    channel make_channel(uint16_t port);
+    virtual void received(packet p, ipv6_address from, ipv6_address to) override;
+    void send(uint16_t src_port, ipv6_address dst, uint16_t dst_port, packet p);
+    bool forward(forward_hash& out_hash_data, packet& p, size_t off) override;
+    void set_queue_size(int size) { _queue_size = size; }
+};
+
+struct icmpv6_hdr {
+    enum class msg_type : uint8_t {
+        echo_request = 128,
+        echo_reply = 129,
+        neighbor_solicitation = 135,
+        neighbor_advertisement = 136,
+    };
+    msg_type type;
+    uint8_t code;
+    packed<uint16_t> csum;
+    template <typename Adjuster>
+    auto adjust_endianness(Adjuster a) {
+        return a(csum);
+    }
+} __attribute__((packed));
+
+class ndp_error : public std::runtime_error {
+public:
+    ndp_error(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+class ndp_timeout_error : public ndp_error {
+public:
+    ndp_timeout_error() : ndp_error("NDP timeout") {}
+};
+
+class ndp_queue_full_error : public ndp_error {
+public:
+    ndp_queue_full_error() : ndp_error("NDP waiter's queue is full") {}
+};
+
+// Neighbor cache; the IPv6 counterpart of arp_for
+class ndp {
+    static constexpr auto max_waiters = 512;
+    // A resolved entry older than this is re-solicited in the background
+    // the next time it is used; it keeps being used meanwhile
+    static constexpr std::chrono::seconds refresh_interval{60};
+    struct resolution {
+        std::vector<promise<ethernet_address>> _waiters;
+        timer<> _timeout_timer;
+    };
+    struct entry {
+        ethernet_address mac;
+        lowres_clock::time_point learned;
+        lowres_clock::time_point queried;
+    };
+    ipv6_icmp& _icmp;
+    std::unordered_map<ipv6_address, entry> _table;
+    std::unordered_map<ipv6_address, resolution> _in_progress;
+private:
+    void refresh(const ipv6_address& paddr, entry& e);
+public:
+    explicit ndp(ipv6_icmp& icmp) : _icmp(icmp) {}
+    // Resolves addr without a future when it is in the neighbor cache
+    std::experimental::optional<ethernet_address> try_lookup(const ipv6_address& addr);
+    future<ethernet_address> lookup(const ipv6_address& addr);
+    void learn(ethernet_address l2, ipv6_address l3);
+};
+
+// Echo, and the neighbor solicitations and advertisements of NDP
+class ipv6_icmp final : public ipv6_protocol {
+    ipv6& _inet;
+    circular_buffer<ipv6_traits::l4packet> _packetq;
+    semaphore _queue_space = {212992};
+    enum ndp_option_type : uint8_t {
+        source_link_layer_address = 1,
+        target_link_layer_address = 2,
+    };
+    // Router, solicited and override flags of an advertisement
+    static constexpr uint32_t na_solicited = 1u << 30;
+    static constexpr uint32_t na_override = 1u << 29;
+    // Header, reserved or flags word, target address
+    static constexpr size_t ndp_msg_len = sizeof(icmpv6_hdr) + 4 + ipv6_address::size();
+    // A link-layer address option for ethernet is a single 8 byte unit
+    static constexpr size_t ndp_option_len = 8;
+private:
+    void handle_echo(packet p, ipv6_address from, ipv6_address to);
+    void handle_solicitation(packet p, ipv6_address from);
+    void handle_advertisement(packet p);
+    packet make_ndp_packet(icmpv6_hdr::msg_type type, uint32_t flags, ipv6_address target,
+            ndp_option_type opt, ipv6_address dst);
+    static std::experimental::optional<ethernet_address> find_link_layer_address(packet& p, ndp_option_type opt);
+    void queue(ipv6_address to, ethernet_address e_dst, packet p);
+public:
+    explicit ipv6_icmp(ipv6& inet);
+    virtual void received(packet p, ipv6_address from, ipv6_address to) override;
+    void send_solicitation(ipv6_address target);
+    // Unicast probe of a neighbor whose address we already know
+    void send_solicitation(ipv6_address target, ethernet_address known);
+};
+
+struct ip6_hdr {
+    // Version, traffic class and flow label
+    packed<uint32_t> ver_tc_flow;
+    packed<uint16_t> payload_len;
+    uint8_t next_header;
+    uint8_t hop_limit;
+    ipv6_address src_ip;
+    ipv6_address dst_ip;
+    template <typename Adjuster>
+    auto adjust_endianness(Adjuster a) {
+        return a(ver_tc_flow, payload_len);
+    }
+    unsigned version() const { return uint32_t(ver_tc_flow) >> 28; }
+} __attribute__((packed));
+
+class ipv6 {
+public:
+    using address_type = ipv6_address;
+private:
+    interface* _netif;
+    // What the l4 protocols see: the device's, minus the offloads the
+    // drivers only do for IPv4 frames
+    net::hw_features _hw_features;
+    std::vector<ipv6_traits::packet_provider_type> _pkt_providers;
+    ipv6_address _link_local_address;
+    ipv6_address _host_address;
+    ipv6_address _gw_address;
+    unsigned _prefix_len = 64;
+    l3_protocol _l3;
+    subscription<packet, ethernet_address> _rx_packets;
+    ipv6_tcp _tcp;
+    ipv6_icmp _icmp;
+    ipv6_udp _udp;
+    ndp _ndp;
+    array_map<ipv6_protocol*, 256> _l4;
+    circular_buffer<l3_protocol::l3packet> _packetq;
+    unsigned _pkt_provider_idx = 0;
+private:
+    future<> handle_received_packet(packet p, ethernet_address from);
+    void handle_received_burst(std::vector<l3_protocol::rx_packet>& burst);
+    bool forward(forward_hash& out_hash_data, packet& p, size_t off);
+    std::experimental::optional<l3_protocol::l3packet> get_packet();
+    bool is_on_link(const ipv6_address& a) const;
+    bool accepts(const ipv6_address& dst) const;
+public:
+    explicit ipv6(interface* netif);
+    void set_host_address(ipv6_address ip);
+    // The configured address, or the link-local one until there is one
+    ipv6_address host_address() const;
+    ipv6_address link_local_address() const { return _link_local_address; }
+    bool is_local_address(const ipv6_address& a) const;
+    // Source address for datagrams sent to dst: link-local destinations
+    // are answered from the link-local address
+    ipv6_address source_address(const ipv6_address& dst) const;
+    void set_gw_address(ipv6_address ip);
+    ipv6_address gw_address() const;
+    void set_prefix_length(unsigned len);
+    unsigned prefix_length() const;
+    interface * netif() const {
+        return _netif;
+    }
+    void send(ipv6_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst);
+    tcp<ipv6_traits>& get_tcp() { return *_tcp._tcp; }
+    ipv6_udp& get_udp() { return _udp; }
+    const net::hw_features& hw_features() const { return _hw_features; }
+    void learn(ethernet_address l2, ipv6_address l3) {
+        _ndp.learn(l2, l3);
+    }
+    void register_packet_provider(ipv6_traits::packet_provider_type&& func) {
+        _pkt_providers.push_back(std::move(func));
+    }
+    future<ethernet_address> get_l2_dst_address(ipv6_address to);
+    // The destination MAC when it is already resolved; no future involved
+    std::experimental::optional<ethernet_address> try_get_l2_dst_address(ipv6_address to);
+};
+
+template <ip_protocol_num ProtoNum>
+inline
+void ipv6_l4<ProtoNum>::register_packet_provider(ipv6_traits::packet_provider_type func) {
+    _inet.register_packet_provider([func = std::move(func)] {
+        auto l4p = func();
+        if (l4p) {
+            l4p.value().proto_num = ProtoNum;
+        }
+        return l4p;
+    });
+}
+
+template <ip_protocol_num ProtoNum>
+inline
+future<ethernet_address> ipv6_l4<ProtoNum>::get_l2_dst_address(ipv6_address to) {
+    return _inet.get_l2_dst_address(to);
+}
+
+template <ip_protocol_num ProtoNum>
+inline
+std::experimental::optional<ethernet_address> ipv6_l4<ProtoNum>::try_get_l2_dst_address(ipv6_address to) {
+    return _inet.try_get_l2_dst_address(to);
+}
+
+// Neighbor advertisements arrive on whichever shard RSS picks; the
+// resolution is shared with all of them
+void ndp_learn(ethernet_address l2, ipv6_address l3);
+
+}
@@ -0,0 +1,407 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "loopback-stack.hh"
+#include "stack.hh"
+#include "packet.hh"
+#include "core/reactor.hh"
+#include "core/queue.hh"
+#include "core/future-util.hh"
+#include "core/circular_buffer.hh"
+#include <atomic>
+#include <unordered_map>
+
+namespace net {
+
+using namespace seastar;
+
+namespace {
+
+// One direction of a connection. The writer's shard only touches the
+// writer's half and the reader's shard the reader's; they tell each other
+// things by smp message, in order. Both halves and every message in
+// flight hold a reference, and the last one to go frees the pipe.
+struct loopback_pipe {
+    std::atomic<unsigned> refs{0};
+    const unsigned writer_shard;
+    const unsigned reader_shard;
+    const size_t window;
+    // Writer's half
+    size_t in_flight = 0;
+    std::experimental::optional<promise<>> window_open;
+    bool output_shut = false;
+    bool reader_gone = false;
+    // Reader's half
+    circular_buffer<temporary_buffer<char>> received;
+    std::experimental::optional<promise<>> data_available;
+    size_t unacknowledged = 0;
+    bool eof = false;
+    bool input_shut = false;
+
+    loopback_pipe(unsigned writer, unsigned reader, size_t window)
+        : writer_shard(writer), reader_shard(reader), window(window) {}
+};
+
+class pipe_ptr {
+    loopback_pipe* _p;
+public:
+    explicit pipe_ptr(loopback_pipe* p) : _p(p) {
+        _p->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    pipe_ptr(const pipe_ptr& o) : pipe_ptr(o._p) {}
+    pipe_ptr(pipe_ptr&& o) noexcept : _p(o._p) {
+        o._p = nullptr;
+    }
+    pipe_ptr& operator=(const pipe_ptr&) = delete;
+    ~pipe_ptr() {
+        if (_p && _p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete _p;
+        }
+    }
+    loopback_pipe* operator->() const {
+        return _p;
+    }
+};
+
+void wake(std::experimental::optional<promise<>>& pr) {
+    if (pr) {
+        pr->set_value();
+        pr = std::experimental::nullopt;
+    }
+}
+
+// Runs func(p) on shard, after what was sent there before. Both ends of
+// a pipe on one shard talk directly.
+template <typename Func>
+void send_to(unsigned shard, const pipe_ptr& p, Func func) {
+    if (shard == engine().cpu_id()) {
+        func(p);
+        return;
+    }
+    smp::submit_to(shard, [p, func = std::move(func)] () mutable {
+        func(p);
+    });
+}
+
+// Buffers from other shards that this one is done with. Their deleters
+// belong to the shard that wrote them, so they go back there to be
+// destroyed, a batch per shard each task quota.
+thread_local std::vector<std::vector<temporary_buffer<char>>> returning_buffers;
+
+void return_buffer(unsigned owner, temporary_buffer<char> buf) {
+    if (owner == engine().cpu_id()) {
+        return;
+    }
+    if (returning_buffers.size() < smp::count) {
+        returning_buffers.resize(smp::count);
+    }
+    auto& batch = returning_buffers[owner];
+    batch.push_back(std::move(buf));
+    if (batch.size() == 1) {
+        later().then([owner] {
+            auto bufs = std::move(returning_buffers[owner]);
+            returning_buffers[owner].clear();
+            return smp::submit_to(owner, [bufs = std::move(bufs)] () mutable {
+                bufs.clear();
+            });
+        });
+    }
+}
+
+// A buffer over the same data, whose deleter sends the original home
+temporary_buffer<char> adopt(temporary_buffer<char> buf, unsigned owner) {
+    auto data = buf.get_write();
+    auto size = buf.size();
+    return temporary_buffer<char>(data, size, make_deleter([buf = std::move(buf), owner] () mutable {
+        return_buffer(owner, std::move(buf));
+    }));
+}
+
+// On the reader's shard
+void deliver(const pipe_ptr& p, std::vector<temporary_buffer<char>> bufs, unsigned from) {
+    for (auto&& b : bufs) {
+        auto mine = from == engine().cpu_id() ? std::move(b) : adopt(std::move(b), from);
+        if (!p->input_shut) {
+            p->received.push_back(std::move(mine));
+        }
+    }
+    wake(p->data_available);
+}
+
+// Stops reading, and tells the writer, whose writes fail from then on
+void shut_input(const pipe_ptr& p) {
+    if (p->input_shut) {
+        return;
+    }
+    p->input_shut = true;
+    p->received = {};
+    wake(p->data_available);
+    send_to(p->writer_shard, p, [] (const pipe_ptr& p) {
+        p->reader_gone = true;
+        wake(p->window_open);
+    });
+}
+
+void shut_output(const pipe_ptr& p) {
+    if (p->output_shut) {
+        return;
+    }
+    p->output_shut = true;
+    send_to(p->reader_shard, p, [] (const pipe_ptr& p) {
+        p->eof = true;
+        wake(p->data_available);
+    });
+}
+
+class loopback_data_source_impl final : public data_source_impl {
+    pipe_ptr _pipe;
+public:
+    explicit loopback_data_source_impl(pipe_ptr p) : _pipe(std::move(p)) {}
+    virtual future<temporary_buffer<char>> get() override {
+        auto& p = _pipe;
+        if (!p->received.empty()) {
+            auto b = std::move(p->received.front());
+            p->received.pop_front();
+            p->unacknowledged += b.size();
+            // Reopen the window by halves, or at once when the writer may
+            // be waiting for it
+            if (p->unacknowledged >= p->window / 2 || p->received.empty()) {
+                send_to(p->writer_shard, p, [n = p->unacknowledged] (const pipe_ptr& p) {
+                    p->in_flight -= n;
+                    wake(p->window_open);
+                });
+                p->unacknowledged = 0;
+            }
+            return make_ready_future<temporary_buffer<char>>(std::move(b));
+        }
+        if (p->eof || p->input_shut) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        p->data_available = promise<>();
+        return p->data_available->get_future().then([this] {
+            return get();
+        });
+    }
+    virtual future<> close() override {
+        shut_input(_pipe);
+        return make_ready_future<>();
+    }
+};
+
+class loopback_data_sink_impl final : public data_sink_impl {
+    pipe_ptr _pipe;
+private:
+    future<> wait_for_window() {
+        if (_pipe->reader_gone || _pipe->output_shut) {
+            return make_exception_future<>(std::system_error(EPIPE, std::system_category()));
+        }
+        if (_pipe->in_flight < _pipe->window) {
+            return make_ready_future<>();
+        }
+        _pipe->window_open = promise<>();
+        return _pipe->window_open->get_future().then([this] {
+            return wait_for_window();
+        });
+    }
+public:
+    explicit loopback_data_sink_impl(pipe_ptr p) : _pipe(std::move(p)) {}
+    virtual future<> put(packet data) override {
+        return wait_for_window().then([this, data = std::move(data)] () mutable {
+            _pipe->in_flight += data.len();
+            send_to(_pipe->reader_shard, _pipe, [bufs = data.release(), from = engine().cpu_id()] (const pipe_ptr& p) mutable {
+                deliver(p, std::move(bufs), from);
+            });
+        });
+    }
+    virtual future<> close() override {
+        shut_output(_pipe);
+        return make_ready_future<>();
+    }
+};
+
+class loopback_connected_socket_impl final : public connected_socket_impl {
+    pipe_ptr _tx;
+    pipe_ptr _rx;
+    bool _nodelay = true;
+    bool _keepalive = false;
+    keepalive_params _keepalive_parameters = tcp_keepalive_params{std::chrono::seconds(0), std::chrono::seconds(0), 0};
+public:
+    loopback_connected_socket_impl(pipe_ptr tx, pipe_ptr rx) : _tx(std::move(tx)), _rx(std::move(rx)) {}
+    ~loopback_connected_socket_impl() {
+        shut_output(_tx);
+        shut_input(_rx);
+    }
+    virtual data_source source() override {
+        return data_source(std::make_unique<loopback_data_source_impl>(_rx));
+    }
+    virtual data_sink sink() override {
+        return data_sink(std::make_unique<loopback_data_sink_impl>(_tx));
+    }
+    virtual future<> shutdown_input() override {
+        shut_input(_rx);
+        return make_ready_future<>();
+    }
+    virtual future<> shutdown_output() override {
+        shut_output(_tx);
+        return make_ready_future<>();
+    }
+    // Nothing is batched and the peer can't silently go away, so these
+    // only keep what they are told
+    virtual void set_nodelay(bool nodelay) override {
+        _nodelay = nodelay;
+    }
+    virtual bool get_nodelay() const override {
+        return _nodelay;
+    }
+    virtual void set_keepalive(bool keepalive) override {
+        _keepalive = keepalive;
+    }
+    virtual bool get_keepalive() const override {
+        return _keepalive;
+    }
+    virtual void set_keepalive_parameters(const keepalive_params& p) override {
+        _keepalive_parameters = p;
+    }
+    virtual keepalive_params get_keepalive_parameters() const override {
+        return _keepalive_parameters;
+    }
+};
+
+using pending_connection = std::pair<connected_socket, socket_address>;
+using accept_queue = queue<pending_connection>;
+
+// The addresses listened on on this shard
+thread_local std::unordered_map<socket_address, lw_shared_ptr<accept_queue>> listeners;
+
+class loopback_server_socket_impl final : public server_socket_impl {
+    socket_address _sa;
+    lw_shared_ptr<accept_queue> _pending = make_lw_shared<accept_queue>(128);
+public:
+    explicit loopback_server_socket_impl(socket_address sa) : _sa(sa) {
+        if (!listeners.emplace(sa, _pending).second) {
+            throw std::system_error(EADDRINUSE, std::system_category());
+        }
+    }
+    ~loopback_server_socket_impl() {
+        auto i = listeners.find(_sa);
+        if (i != listeners.end() && i->second == _pending) {
+            listeners.erase(i);
+        }
+    }
+    virtual future<connected_socket, socket_address> accept() override {
+        return _pending->pop_eventually().then([] (pending_connection c) {
+            return make_ready_future<connected_socket, socket_address>(std::move(c.first), std::move(c.second));
+        });
+    }
+    virtual void abort_accept() override {
+        listeners.erase(_sa);
+        _pending->abort(std::make_exception_ptr(std::system_error(ECONNABORTED, std::system_category())));
+    }
+};
+
+// The shard listening on sa: this one if it does, or else the next one
+// that does
+future<unsigned> find_listener(socket_address sa) {
+    if (listeners.count(sa)) {
+        return make_ready_future<unsigned>(engine().cpu_id());
+    }
+    return do_with(unsigned(1), [sa] (unsigned& i) {
+        return repeat_until_value([sa, &i] () -> future<std::experimental::optional<unsigned>> {
+            if (i == smp::count) {
+                return make_exception_future<std::experimental::optional<unsigned>>(
+                        std::system_error(ECONNREFUSED, std::system_category()));
+            }
+            auto shard = (engine().cpu_id() + i++) % smp::count;
+            return smp::submit_to(shard, [sa] {
+                return bool(listeners.count(sa));
+            }).then([shard] (bool found) {
+                return found ? std::experimental::optional<unsigned>(shard) : std::experimental::nullopt;
+            });
+        });
+    });
+}
+
+class loopback_socket_impl final : public socket_impl {
+    loopback_options _opts;
+public:
+    explicit loopback_socket_impl(loopback_options opts) : _opts(opts) {}
+    virtual future<connected_socket> connect(socket_address sa, socket_address local, seastar::transport) override {
+        return find_listener(sa).then([sa, local, window = _opts.window] (unsigned shard) {
+            auto me = engine().cpu_id();
+            pipe_ptr out(new loopback_pipe(me, shard, window));
+            pipe_ptr in(new loopback_pipe(shard, me, window));
+            return smp::submit_to(shard, [sa, local, out, in] {
+                auto i = listeners.find(sa);
+                if (i == listeners.end()) {
+                    return make_exception_future<>(std::system_error(ECONNREFUSED, std::system_category()));
+                }
+                auto cs = connected_socket(std::make_unique<loopback_connected_socket_impl>(in, out));
+                return i->second->push_eventually(pending_connection(std::move(cs), local));
+            }).then([out, in] {
+                return connected_socket(std::make_unique<loopback_connected_socket_impl>(out, in));
+            });
+        });
+    }
+    virtual void shutdown() override {}
+};
+
+}
+
+server_socket loopback_listen(socket_address sa) {
+    return server_socket(std::make_unique<loopback_server_socket_impl>(sa));
+}
+
+::seastar::socket loopback_socket(loopback_options opts) {
+    return ::seastar::socket(std::make_unique<loopback_socket_impl>(opts));
+}
+
+server_socket loopback_network_stack::listen(socket_address sa, listen_options) {
+    return loopback_listen(sa);
+}
+
+::seastar::socket loopback_network_stack::socket() {
+    return loopback_socket(_opts);
+}
+
+udp_channel loopback_network_stack::make_udp_channel(ipv4_addr) {
+    throw std::system_error(EOPNOTSUPP, std::system_category());
+}
+
+future<std::unique_ptr<network_stack>> loopback_network_stack::create(boost::program_options::variables_map opts) {
+    loopback_options lo;
+    lo.window = opts["loopback-window"].as<size_t>();
+    return make_ready_future<std::unique_ptr<network_stack>>(std::make_unique<loopback_network_stack>(lo));
+}
+
+boost::program_options::options_description loopback_stack_options() {
+    boost::program_options::options_description opts("Loopback net options");
+    opts.add_options()
+        ("loopback-window", boost::program_options::value<size_t>()->default_value(loopback_options().window),
+                "bytes each direction of a loopback connection lets be written and not yet read")
+        ;
+    return opts;
+}
+
+network_stack_registrator nlb_registrator{
+    "loopback", loopback_stack_options(), loopback_network_stack::create
+};
+
+}
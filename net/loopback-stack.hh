@@ -0,0 +1,65 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "api.hh"
+#include <boost/program_options.hpp>
+
+namespace net {
+
+/*
+ * Stream connections within the process, for components that talk over
+ * connected_socket but happen to run in the same seastar application.
+ *
+ * Addresses are only names here: listening on one claims it on the
+ * calling shard, and connecting to it reaches the listener on the
+ * connecting shard if there is one, or else on the first other shard that
+ * has one. Written buffers are handed to the reader as they are, without
+ * copying or system calls; across shards, a buffer goes back to the shard
+ * it was written on to be destroyed, where its deleter belongs. Each
+ * direction lets at most window bytes be written and not yet read.
+ */
+
+struct loopback_options {
+    size_t window = 1 << 20;
+};
+
+server_socket loopback_listen(socket_address sa);
+
+::seastar::socket loopback_socket(loopback_options opts = loopback_options());
+
+// The same, as the engine's network stack (--network-stack loopback), so
+// that a whole application can be run against itself
+class loopback_network_stack : public network_stack {
+    loopback_options _opts;
+public:
+    explicit loopback_network_stack(loopback_options opts) : _opts(opts) {}
+    virtual server_socket listen(socket_address sa, listen_options opts) override;
+    virtual ::seastar::socket socket() override;
+    virtual udp_channel make_udp_channel(ipv4_addr addr) override;
+    virtual bool has_per_core_namespace() override {
+        return true;
+    }
+    static future<std::unique_ptr<network_stack>> create(boost::program_options::variables_map opts);
+};
+
+}
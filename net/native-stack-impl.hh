@@ -58,7 +58,7 @@ native_server_socket_impl<Protocol>::accept() {
     return _listener.accept().then([this] (typename Protocol::connection conn) {
         return make_ready_future<connected_socket, socket_address>(
                 connected_socket(std::make_unique<native_connected_socket_impl<Protocol>>(make_lw_shared(std::move(conn)))),
-                make_ipv4_address(conn.foreign_ip().ip, conn.foreign_port()));
+                make_socket_address(conn.foreign_ip(), conn.foreign_port()));
     });
 }
 
@@ -87,6 +87,10 @@ class native_connected_socket_impl : public connected_socket_impl {
     bool get_keepalive() const override;
     void set_keepalive_parameters(const keepalive_params&) override;
     keepalive_params get_keepalive_parameters() const override;
+    void set_congestion_control(const sstring& algorithm) override;
+    tcp_congestion_info get_congestion_info() const override;
+    void set_socket_options(const socket_options& opts) override;
+    socket_options get_socket_options() const override;
 };
 
 template <typename Protocol>
@@ -102,8 +106,6 @@ class native_socket_impl final : public socket_impl {
         assert(proto == transport::TCP);
 
         // FIXME: local is ignored since native stack does not support multiple IPs yet
-        assert(sa.as_posix_sockaddr().sa_family == AF_INET);
-
         _conn = make_lw_shared<typename Protocol::connection>(_proto.connect(sa));
         return _conn->connected().then([conn = _conn]() mutable {
             auto csi = std::make_unique<native_connected_socket_impl<Protocol>>(std::move(conn));
@@ -122,26 +124,37 @@ template <typename Protocol>
 class native_connected_socket_impl<Protocol>::native_data_source_impl final
     : public data_source_impl {
     typename Protocol::connection& _conn;
-    size_t _cur_frag = 0;
     bool _eof = false;
-    packet _buf;
+    // Segments taken from the connection in one go, and their fragments
+    // as buffers still pointing into the receive buffers they arrived in.
+    // Both keep their capacity from one batch to the next.
+    std::deque<packet> _batch;
+    std::vector<temporary_buffer<char>> _bufs;
+    size_t _cur_buf = 0;
 public:
     explicit native_data_source_impl(typename Protocol::connection& conn)
         : _conn(conn) {}
     virtual future<temporary_buffer<char>> get() override {
+        if (_cur_buf != _bufs.size()) {
+            return make_ready_future<temporary_buffer<char>>(std::move(_bufs[_cur_buf++]));
+        }
         if (_eof) {
             return make_ready_future<temporary_buffer<char>>(temporary_buffer<char>(0));
         }
-        if (_cur_frag != _buf.nr_frags()) {
-            auto& f = _buf.fragments()[_cur_frag++];
-            return make_ready_future<temporary_buffer<char>>(
-                    temporary_buffer<char>(f.base, f.size,
-                            make_deleter(deleter(), [p = _buf.share()] () mutable {})));
-        }
         return _conn.wait_for_data().then([this] {
-            _buf = _conn.read();
-            _cur_frag = 0;
-            _eof = !_buf.len();
+            _bufs.clear();
+            _cur_buf = 0;
+            _conn.read_batch(_batch);
+            for (auto&& p : _batch) {
+                p.release_into([this] (temporary_buffer<char>&& buf) {
+                    // An empty buffer would read as end of stream
+                    if (buf.size()) {
+                        _bufs.push_back(std::move(buf));
+                    }
+                });
+            }
+            _batch.clear();
+            _eof = _bufs.empty();
             return get();
         });
     }
@@ -223,6 +236,26 @@ keepalive_params native_connected_socket_impl<Protocol>::get_keepalive_parameter
     return tcp_keepalive_params {std::chrono::seconds(0), std::chrono::seconds(0), 0};
 }
 
+template <typename Protocol>
+void native_connected_socket_impl<Protocol>::set_congestion_control(const sstring& algorithm) {
+    _conn->set_congestion_control(algorithm);
+}
+
+template <typename Protocol>
+tcp_congestion_info native_connected_socket_impl<Protocol>::get_congestion_info() const {
+    return _conn->congestion_info();
+}
+
+template <typename Protocol>
+void native_connected_socket_impl<Protocol>::set_socket_options(const socket_options& opts) {
+    _conn->set_socket_options(opts);
+}
+
+template <typename Protocol>
+socket_options native_connected_socket_impl<Protocol>::get_socket_options() const {
+    return _conn->get_socket_options();
+}
+
 }
 
 
@@ -23,16 +23,20 @@
 #include "native-stack-impl.hh"
 #include "net.hh"
 #include "ip.hh"
+#include "ipv6.hh"
 #include "tcp-stack.hh"
 #include "tcp.hh"
 #include "udp.hh"
 #include "virtio.hh"
 #include "dpdk.hh"
+#include "xdp.hh"
 #include "xenfront.hh"
 #include "proxy.hh"
 #include "dhcp.hh"
 #include <memory>
 #include <queue>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
 #ifdef HAVE_OSV
 #include <osv/firmware.hh>
 #include <gnu/libc-version.h>
@@ -86,12 +90,21 @@ void create_native_net_device(boost::program_options::variables_map opts) {
 
 #ifdef HAVE_DPDK
     if (opts.count("dpdk-pmd")) {
-        // Hardcoded port index 0.
-        // TODO: Inherit it from the opts
-        dev = create_dpdk_net_device(0, smp::count,
+        std::vector<std::string> indexes;
+        boost::split(indexes, opts["dpdk-ports"].as<std::string>(), boost::is_any_of(","));
+        std::vector<uint8_t> ports;
+        for (auto& i : indexes) {
+            ports.push_back(boost::lexical_cast<unsigned>(i));
+        }
+        dev = create_dpdk_net_device(ports, smp::count,
             !(opts.count("lro") && opts["lro"].as<std::string>() == "off"),
             !(opts.count("hw-fc") && opts["hw-fc"].as<std::string>() == "off"));
     } else
+#endif
+#ifdef HAVE_AF_XDP
+    if (opts.count("xdp-device")) {
+        dev = create_xdp_net_device(opts);
+    } else
 #endif
     dev = create_virtio_net_device(opts);
 
@@ -135,6 +148,7 @@ class native_network_stack : public network_stack {
 private:
     interface _netif;
     ipv4 _inet;
+    ipv6 _inet6;
     bool _dhcp = false;
     promise<> _config;
     timer<> _timer;
@@ -161,6 +175,10 @@ class native_network_stack : public network_stack {
     void arp_learn(ethernet_address l2, ipv4_address l3) {
         _inet.learn(l2, l3);
     }
+    void ndp_learn(ethernet_address l2, ipv6_address l3) {
+        _inet6.learn(l2, l3);
+    }
+    ipv6& get_ipv6() { return _inet6; }
     friend class native_server_socket_impl<tcp4>;
 };
 
@@ -185,12 +203,35 @@ add_native_net_options_description(boost::program_options::options_description &
 #ifdef HAVE_DPDK
     opts.add(get_dpdk_net_options_description());
 #endif
+#ifdef HAVE_AF_XDP
+    opts.add(get_xdp_net_options_description());
+#endif
 }
 
 native_network_stack::native_network_stack(boost::program_options::variables_map opts, std::shared_ptr<device> dev)
     : _netif(std::move(dev))
-    , _inet(&_netif) {
+    , _inet(&_netif)
+    , _inet6(&_netif) {
     _inet.get_udp().set_queue_size(opts["udpv4-queue-size"].as<int>());
+    _inet6.get_udp().set_queue_size(opts["udpv4-queue-size"].as<int>());
+    _inet.get_tcp().set_congestion_control(opts["tcp-congestion-control"].as<std::string>());
+    _inet.get_tcp().set_pacing(opts["tcp-pacing"].as<bool>());
+    _inet.get_tcp().set_rto_min(std::chrono::milliseconds(opts["tcp-rto-min"].as<unsigned>()));
+    _inet6.get_tcp().set_congestion_control(opts["tcp-congestion-control"].as<std::string>());
+    _inet6.get_tcp().set_pacing(opts["tcp-pacing"].as<bool>());
+    _inet6.get_tcp().set_rto_min(std::chrono::milliseconds(opts["tcp-rto-min"].as<unsigned>()));
+    _inet.get_tcp().set_syn_backlog(opts["tcp-syn-backlog"].as<unsigned>());
+    _inet.get_tcp().set_syncookies(opts["tcp-syncookies"].as<bool>());
+    _inet6.get_tcp().set_syn_backlog(opts["tcp-syn-backlog"].as<unsigned>());
+    _inet6.get_tcp().set_syncookies(opts["tcp-syncookies"].as<bool>());
+    if (!opts["host-ipv6-addr"].as<std::string>().empty()) {
+        _inet6.set_host_address(ipv6_address(opts["host-ipv6-addr"].as<std::string>()));
+        _inet6.set_prefix_length(opts["ipv6-prefix-length"].as<unsigned>());
+    }
+    if (!opts["gw-ipv6-addr"].as<std::string>().empty()) {
+        _inet6.set_gw_address(ipv6_address(opts["gw-ipv6-addr"].as<std::string>()));
+    }
+    _inet.set_gro(opts["gro"].as<bool>());
     _dhcp = opts["host-ipv4-addr"].defaulted()
             && opts["gw-ipv4-addr"].defaulted()
             && opts["netmask-ipv4-addr"].defaulted() && opts["dhcp"].as<bool>();
@@ -203,12 +244,35 @@ native_network_stack::native_network_stack(boost::program_options::variables_map
 
 server_socket
 native_network_stack::listen(socket_address sa, listen_options opts) {
+    if (sa.as_posix_sockaddr().sa_family == AF_INET6) {
+        return tcpv6_listen(_inet6.get_tcp(), ntohs(sa.as_posix_sockaddr_in6().sin6_port), opts);
+    }
     assert(sa.as_posix_sockaddr().sa_family == AF_INET);
     return tcpv4_listen(_inet.get_tcp(), ntohs(sa.as_posix_sockaddr_in().sin_port), opts);
 }
 
+// Connects over the TCP instance of the family of the address it is given
+class native_dual_stack_socket_impl final : public socket_impl {
+    seastar::socket _v4;
+    seastar::socket _v6;
+public:
+    native_dual_stack_socket_impl(seastar::socket v4, seastar::socket v6)
+        : _v4(std::move(v4)), _v6(std::move(v6)) {}
+    virtual future<connected_socket> connect(socket_address sa, socket_address local, transport proto = transport::TCP) override {
+        if (sa.as_posix_sockaddr().sa_family == AF_INET6) {
+            return _v6.connect(sa, local, proto);
+        }
+        return _v4.connect(sa, local, proto);
+    }
+    virtual void shutdown() override {
+        _v4.shutdown();
+        _v6.shutdown();
+    }
+};
+
 seastar::socket native_network_stack::socket() {
-    return tcpv4_socket(_inet.get_tcp());
+    return seastar::socket(std::make_unique<native_dual_stack_socket_impl>(
+            tcpv4_socket(_inet.get_tcp()), tcpv6_socket(_inet6.get_tcp())));
 }
 
 using namespace std::chrono_literals;
@@ -290,6 +354,20 @@ void arp_learn(ethernet_address l2, ipv4_address l3)
     }
 }
 
+void ndp_learn(ethernet_address l2, ipv6_address l3)
+{
+    for (unsigned i = 0; i < smp::count; i++) {
+        smp::submit_to(i, [l2, l3] {
+            auto & ns = static_cast<native_network_stack&>(engine().net());
+            ns.ndp_learn(l2, l3);
+        });
+    }
+}
+
+ipv6_udp& native_ipv6_udp() {
+    return static_cast<native_network_stack&>(engine().net()).get_ipv6().get_udp();
+}
+
 void create_native_stack(boost::program_options::variables_map opts, std::shared_ptr<device> dev) {
     native_network_stack::ready_promise.set_value(std::unique_ptr<network_stack>(std::make_unique<native_network_stack>(opts, std::move(dev))));
 }
@@ -310,18 +388,45 @@ boost::program_options::options_description nns_options() {
         ("netmask-ipv4-addr",
                 boost::program_options::value<std::string>()->default_value("255.255.255.0"),
                 "static IPv4 netmask to use")
+        ("host-ipv6-addr",
+                boost::program_options::value<std::string>()->default_value(""),
+                "static IPv6 address to use (the link-local address is always configured)")
+        ("gw-ipv6-addr",
+                boost::program_options::value<std::string>()->default_value(""),
+                "static IPv6 gateway to use")
+        ("ipv6-prefix-length",
+                boost::program_options::value<unsigned>()->default_value(64),
+                "length of the on-link prefix of host-ipv6-addr")
         ("udpv4-queue-size",
                 boost::program_options::value<int>()->default_value(ipv4_udp::default_queue_size),
                 "Default size of the UDPv4 per-channel packet queue")
         ("dhcp",
                 boost::program_options::value<bool>()->default_value(true),
                         "Use DHCP discovery")
+        ("tcp-congestion-control",
+                boost::program_options::value<std::string>()->default_value("reno"),
+                "TCP congestion control algorithm (reno, cubic, bbr)")
+        ("tcp-pacing",
+                boost::program_options::value<bool>()->default_value(false),
+                "Pace TCP transmission at a rate derived from cwnd and srtt (bbr always paces)")
+        ("tcp-rto-min",
+                boost::program_options::value<unsigned>()->default_value(1000),
+                "Minimum TCP retransmission timeout in milliseconds (a few suffice inside a datacenter)")
+        ("tcp-syn-backlog",
+                boost::program_options::value<unsigned>()->default_value(256),
+                "Half-open TCP connections kept per listening port and shard")
+        ("tcp-syncookies",
+                boost::program_options::value<bool>()->default_value(true),
+                "Answer SYNs with cookies rather than dropping them once the SYN backlog is full")
         ("hw-queue-weight",
                 boost::program_options::value<float>()->default_value(1.0f),
                 "Weighing of a hardware network queue relative to a software queue (0=no work, 1=equal share)")
 #ifdef HAVE_DPDK
         ("dpdk-pmd", "Use DPDK PMD drivers")
 #endif
+        ("gro",
+                boost::program_options::value<bool>()->default_value(true),
+                "Merge in-order TCP segments in software when the NIC does no LRO")
         ("lro",
                 boost::program_options::value<std::string>()->default_value("on"),
                 "Enable LRO")
@@ -29,6 +29,12 @@ namespace net {
 
 void create_native_stack(boost::program_options::variables_map opts, std::shared_ptr<device> dev);
 
+class ipv6_udp;
+
+// UDP over IPv6 of this shard's native stack, which must be the one in use;
+// udp_channel only carries IPv4 addresses.
+ipv6_udp& native_ipv6_udp();
+
 }
 
 #endif /* STACK_HH_ */
@@ -67,6 +67,9 @@ bool qp::poll_tx() {
     }
     if (!_tx_packetq.empty()) {
         _stats.tx.good.update_pkts_bunch(send(_tx_packetq));
+        if (!_tx_packetq.empty()) {
+            ++_stats.tx.ring_full;
+        }
         return true;
     }
 
@@ -178,8 +181,59 @@ qp::qp(bool register_copy_stats,
                     , scollectd::make_typed(scollectd::data_type::DERIVE
                     , _stats.rx.good.nr_frags)
             ),
+            //
+            // Tx ring full events: DERIVE:0:U
+            //
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "tx-ring-full")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.tx.ring_full)
+            ),
+
+            //
+            // Rx drops: DERIVE:0:U
+            //
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "if_rx_errors", _queue_name + " No Memory")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.rx.bad.no_mem)
+            ),
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "if_rx_errors", _queue_name + " Bad Checksum")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.rx.bad.csum)
+            ),
     })
 {
+    //
+    // Bunch size histogram: DERIVE:0:U
+    //
+    static const char* bunch_buckets[] = { "1", "2-7", "8-31", "32+" };
+    for (unsigned i = 0; i < _stats.rx.good.bunch_sizes.size(); ++i) {
+        _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", std::string("rx-bunch-") + bunch_buckets[i])
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.rx.good.bunch_sizes[i])
+            ));
+        _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", std::string("tx-bunch-") + bunch_buckets[i])
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.tx.good.bunch_sizes[i])
+            ));
+    }
+
     if (register_copy_stats) {
         //
         // Non-zero-copy data bytes rate: DERIVE:0:u
@@ -200,6 +254,17 @@ qp::qp(bool register_copy_stats,
                     , scollectd::make_typed(scollectd::data_type::DERIVE
                     , _stats.tx.good.copy_bytes)
             ));
+        //
+        // Zero-copy data bytes rate: DERIVE:0:u
+        //
+        _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "if_octets_tx", _queue_name + " Zero-Copy Bytes")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.tx.good.zc_bytes)
+            ));
 
         //
         // Non-zero-copy data fragments rate: DERIVE:0:u
@@ -213,6 +278,14 @@ qp::qp(bool register_copy_stats,
                     , scollectd::make_typed(scollectd::data_type::DERIVE
                     , _stats.tx.good.copy_frags)
             ));
+        _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "tx-frags-zc")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.tx.good.zc_frags)
+            ));
         // Rx
         _collectd_regs.push_back(
             scollectd::add_polled_metric(scollectd::type_instance_id(
@@ -271,6 +344,22 @@ device::receive(std::function<future<> (packet)> next_packet) {
     return std::move(sub);
 }
 
+void device::l2receive(std::vector<packet>& burst) {
+    auto& q = *_queues[engine().cpu_id()];
+    if (q._rx_burst) {
+        q._rx_burst(burst);
+    } else {
+        for (auto&& p : burst) {
+            q._rx_stream.produce(std::move(p));
+        }
+    }
+    burst.clear();
+}
+
+void device::receive_burst(std::function<void (std::vector<packet>&)> next_burst) {
+    _queues[engine().cpu_id()]->_rx_burst = std::move(next_burst);
+}
+
 void device::set_local_queue(std::unique_ptr<qp> dev) {
     assert(!_queues[engine().cpu_id()]);
     _queues[engine().cpu_id()] = dev.get();
@@ -289,11 +378,35 @@ subscription<packet, ethernet_address> l3_protocol::receive(
     return _netif->register_l3(_proto_num, std::move(rx_fn), std::move(forward));
 };
 
+void l3_protocol::receive_burst(rx_burst_fn fn) {
+    _netif->register_l3_burst(_proto_num, std::move(fn));
+}
+
 interface::interface(std::shared_ptr<device> dev)
     : _dev(dev)
     , _rx(_dev->receive([this] (packet p) { return dispatch_packet(std::move(p)); }))
     , _hw_address(_dev->hw_address())
-    , _hw_features(_dev->hw_features()) {
+    , _hw_features(_dev->hw_features())
+    , _collectd_regs({
+            //
+            // Cross-cpu forwarding: DERIVE:0:U
+            //
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    "network"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "forwarded")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.forwarded)
+            ),
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    "network"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "forward-dropped")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.forward_dropped)
+            ),
+    }) {
+    _dev->receive_burst([this] (std::vector<packet>& burst) { dispatch_burst(burst); });
     dev->local_queue().register_packet_provider([this, idx = 0u] () mutable {
             std::experimental::optional<packet> p;
             for (size_t i = 0; i < _pkt_providers.size(); i++) {
@@ -325,6 +438,12 @@ interface::register_l3(eth_protocol_num proto_num,
     return l3_rx.packet_stream.listen(std::move(next));
 }
 
+void interface::register_l3_burst(eth_protocol_num proto_num, l3_protocol::rx_burst_fn fn) {
+    auto i = _proto_map.find(uint16_t(proto_num));
+    assert(i != _proto_map.end());
+    i->second.burst = std::move(fn);
+}
+
 unsigned interface::hash2cpu(uint32_t hash) {
     return _dev->hash2cpu(hash);
 }
@@ -348,6 +467,35 @@ void interface::forward(unsigned cpuid, packet p) {
         }).then([] {
             queue_depth--;
         });
+        ++_stats.forwarded;
+    } else {
+        ++_stats.forward_dropped;
+    }
+}
+
+unsigned interface::packet_cpu(l3_rx_stream& l3, packet& p) {
+    return _dev->forward_dst(engine().cpu_id(), [&p, &l3, this] () {
+        auto hwrss = p.rss_hash();
+        if (hwrss) {
+            return hwrss.value();
+        } else {
+            forward_hash data;
+            if (l3.forward(data, p, sizeof(eth_hdr))) {
+                return toeplitz_hash(rss_key(), data);
+            }
+            return 0u;
+        }
+    });
+}
+
+void interface::deliver(l3_rx_stream& l3, packet p) {
+    auto h = ntoh(*p.get_header<eth_hdr>());
+    auto from = h.src_mac;
+    p.trim_front(sizeof(eth_hdr));
+    // avoid chaining, since queue lenth is unlimited
+    // drop instead.
+    if (l3.ready.available()) {
+        l3.ready = l3.packet_stream.produce(std::move(p), from);
     }
 }
 
@@ -357,33 +505,59 @@ future<> interface::dispatch_packet(packet p) {
         auto i = _proto_map.find(ntoh(eh->eth_proto));
         if (i != _proto_map.end()) {
             l3_rx_stream& l3 = i->second;
-            auto fw = _dev->forward_dst(engine().cpu_id(), [&p, &l3, this] () {
-                auto hwrss = p.rss_hash();
-                if (hwrss) {
-                    return hwrss.value();
-                } else {
-                    forward_hash data;
-                    if (l3.forward(data, p, sizeof(eth_hdr))) {
-                        return toeplitz_hash(rss_key(), data);
-                    }
-                    return 0u;
-                }
-            });
+            auto fw = packet_cpu(l3, p);
             if (fw != engine().cpu_id()) {
                 forward(fw, std::move(p));
             } else {
-                auto h = ntoh(*eh);
-                auto from = h.src_mac;
-                p.trim_front(sizeof(*eh));
-                // avoid chaining, since queue lenth is unlimited
-                // drop instead.
-                if (l3.ready.available()) {
-                    l3.ready = l3.packet_stream.produce(std::move(p), from);
-                }
+                deliver(l3, std::move(p));
             }
         }
     }
     return make_ready_future<>();
 }
 
+void interface::dispatch_burst(std::vector<packet>& burst) {
+    // A burst is mostly one protocol, so the last lookup is kept
+    l3_rx_stream* l3 = nullptr;
+    uint16_t l3_proto = 0;
+    for (size_t i = 0; i < burst.size(); ++i) {
+        if (i + 1 < burst.size()) {
+            // Headers of the next packet are loaded while this one is
+            // dispatched
+            __builtin_prefetch(burst[i + 1].frag(0).base);
+        }
+        auto& p = burst[i];
+        auto eh = p.get_header<eth_hdr>();
+        if (!eh) {
+            continue;
+        }
+        auto proto = ntoh(eh->eth_proto);
+        if (!l3 || proto != l3_proto) {
+            auto j = _proto_map.find(proto);
+            if (j == _proto_map.end()) {
+                continue;
+            }
+            l3 = &j->second;
+            l3_proto = proto;
+        }
+        auto fw = packet_cpu(*l3, p);
+        if (fw != engine().cpu_id()) {
+            forward(fw, std::move(p));
+        } else if (!l3->burst) {
+            deliver(*l3, std::move(p));
+        } else {
+            auto from = ntoh(*eh).src_mac;
+            p.trim_front(sizeof(eth_hdr));
+            l3->pending.push_back(l3_protocol::rx_packet{std::move(p), from});
+        }
+    }
+    for (auto&& x : _proto_map) {
+        auto& s = x.second;
+        if (!s.pending.empty()) {
+            s.burst(s.pending);
+            s.pending.clear();
+        }
+    }
+}
+
 }
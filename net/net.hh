@@ -32,6 +32,7 @@
 #include "packet.hh"
 #include "const.hh"
 #include <unordered_map>
+#include <vector>
 
 namespace net {
 
@@ -78,6 +79,9 @@ struct hw_features {
     bool tx_tso = false;
     // Enable tx UDP fragmentation offload
     bool tx_ufo = false;
+    // Enable tx UDP segmentation offload: one datagram, with its own UDP
+    // header, per segment
+    bool tx_udp_seg = false;
     // Maximum Transmission Unit
     uint16_t mtu = 1500;
     // Maximun packet len when TCP/UDP offload is enabled
@@ -92,6 +96,12 @@ class l3_protocol {
         packet p;
     };
     using packet_provider_type = std::function<std::experimental::optional<l3packet> ()>;
+    // A received packet, ethernet header stripped
+    struct rx_packet {
+        packet p;
+        ethernet_address from;
+    };
+    using rx_burst_fn = std::function<void (std::vector<rx_packet>&)>;
 private:
     interface* _netif;
     eth_protocol_num _proto_num;
@@ -100,6 +110,10 @@ class l3_protocol {
     subscription<packet, ethernet_address> receive(
             std::function<future<> (packet, ethernet_address)> rx_fn,
             std::function<bool (forward_hash&, packet&, size_t)> forward);
+    // Packets that arrive in a burst from the device are handed to fn
+    // together, instead of one by one through the receive() stream; the
+    // protocol must have called receive() first
+    void receive_burst(rx_burst_fn fn);
 private:
     friend class interface;
 };
@@ -109,6 +123,9 @@ class interface {
         stream<packet, ethernet_address> packet_stream;
         future<> ready;
         std::function<bool (forward_hash&, packet&, size_t)> forward;
+        l3_protocol::rx_burst_fn burst;
+        // This shard's packets of the burst being dispatched
+        std::vector<l3_protocol::rx_packet> pending;
         l3_rx_stream(std::function<bool (forward_hash&, packet&, size_t)>&& fw) : ready(packet_stream.started()), forward(fw) {}
     };
     std::unordered_map<uint16_t, l3_rx_stream> _proto_map;
@@ -117,8 +134,17 @@ class interface {
     ethernet_address _hw_address;
     net::hw_features _hw_features;
     std::vector<l3_protocol::packet_provider_type> _pkt_providers;
+    struct {
+        uint64_t forwarded;       // packets handed to the cpu owning their flow
+        uint64_t forward_dropped; // packets dropped for too many in flight
+    } _stats = {};
+    scollectd::registrations _collectd_regs;
 private:
     future<> dispatch_packet(packet p);
+    void dispatch_burst(std::vector<packet>& burst);
+    // The cpu that owns p, per the device's redirection table
+    unsigned packet_cpu(l3_rx_stream& l3, packet& p);
+    void deliver(l3_rx_stream& l3, packet p);
 public:
     explicit interface(std::shared_ptr<device> dev);
     ethernet_address hw_address() { return _hw_address; }
@@ -126,6 +152,7 @@ class interface {
     subscription<packet, ethernet_address> register_l3(eth_protocol_num proto_num,
             std::function<future<> (packet p, ethernet_address from)> next,
             std::function<bool (forward_hash&, packet&, size_t)> forward);
+    void register_l3_burst(eth_protocol_num proto_num, l3_protocol::rx_burst_fn fn);
     void forward(unsigned cpuid, packet p);
     unsigned hash2cpu(uint32_t hash);
     void register_packet_provider(l3_protocol::packet_provider_type func) {
@@ -147,6 +174,16 @@ struct qp_stats_good {
     void update_pkts_bunch(uint64_t count) {
         last_bunch = count;
         packets   += count;
+        if (count) {
+            ++bunch_sizes[bunch_bucket(count)];
+        }
+    }
+
+    /**
+     * Histogram bucket of a packets bunch size: 1, 2-7, 8-31 and 32+.
+     */
+    static unsigned bunch_bucket(uint64_t count) {
+        return (count > 1) + (count >= 8) + (count >= 32);
     }
 
     /**
@@ -161,6 +198,18 @@ struct qp_stats_good {
         copy_bytes += bytes;
     }
 
+    /**
+     * Increment the appropriate counters when a few fragments have been
+     * handed to the NIC in a zero-copy way.
+     *
+     * @param nr_frags Number of zero-copied fragments
+     * @param bytes    Number of zero-copied bytes
+     */
+    void update_zc_stats(uint64_t nr_frags, uint64_t bytes) {
+        zc_frags += nr_frags;
+        zc_bytes += bytes;
+    }
+
     /**
      * Increment total fragments and bytes statistics
      *
@@ -176,8 +225,11 @@ struct qp_stats_good {
     uint64_t nr_frags;   // total number of fragments
     uint64_t copy_frags; // fragments that were copied on L2 level
     uint64_t copy_bytes; // bytes that were copied on L2 level
+    uint64_t zc_frags;   // fragments that were sent zero-copy
+    uint64_t zc_bytes;   // bytes that were sent zero-copy
     uint64_t packets;    // total number of packets
     uint64_t last_bunch; // number of packets in the last sent/received bunch
+    std::array<uint64_t, 4> bunch_sizes; // bunches per bunch_bucket()
 };
 
 struct qp_stats {
@@ -206,6 +258,7 @@ struct qp_stats {
     struct {
         struct qp_stats_good good;
         uint64_t linearized;       // number of packets that were linearized
+        uint64_t ring_full;        // sends that left packets behind for a full ring
     } tx;
 };
 
@@ -215,6 +268,7 @@ class qp {
     std::experimental::optional<std::array<uint8_t, 128>> _sw_reta;
     circular_buffer<packet> _proxy_packetq;
     stream<packet> _rx_stream;
+    std::function<void (std::vector<packet>&)> _rx_burst;
     reactor::poller _tx_poller;
     circular_buffer<packet> _tx_packetq;
 
@@ -265,7 +319,12 @@ class device {
     qp& queue_for_cpu(unsigned cpu) { return *_queues[cpu]; }
     qp& local_queue() { return queue_for_cpu(engine().cpu_id()); }
     void l2receive(packet p) { _queues[engine().cpu_id()]->_rx_stream.produce(std::move(p)); }
+    // Hands a whole rx burst up at once; empties burst
+    void l2receive(std::vector<packet>& burst);
     subscription<packet> receive(std::function<future<> (packet)> next_packet);
+    // Receives the bursts of l2receive(std::vector<packet>&) of this
+    // shard's queue; without it they are fed to receive() packet by packet
+    void receive_burst(std::function<void (std::vector<packet>&)> next_burst);
     virtual ethernet_address hw_address() = 0;
     virtual net::hw_features hw_features() = 0;
     virtual const rss_key_type& rss_key() const { return default_rsskey_40bytes; }
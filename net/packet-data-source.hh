@@ -25,18 +25,17 @@ namespace net {
 
 class packet_data_source final : public data_source_impl {
     size_t _cur_frag = 0;
-    packet _p;
+    // The packet's fragments, sharing its deleter rather than each holding
+    // a share() of the whole packet
+    std::vector<temporary_buffer<char>> _frags;
 public:
     explicit packet_data_source(net::packet&& p)
-        : _p(std::move(p))
+        : _frags(p.release())
     {}
 
     virtual future<temporary_buffer<char>> get() override {
-        if (_cur_frag != _p.nr_frags()) {
-            auto& f = _p.fragments()[_cur_frag++];
-            return make_ready_future<temporary_buffer<char>>(
-                    temporary_buffer<char>(f.base, f.size,
-                            make_deleter(deleter(), [p = _p.share()] () mutable {})));
+        if (_cur_frag != _frags.size()) {
+            return make_ready_future<temporary_buffer<char>>(std::move(_frags[_cur_frag++]));
         }
         return make_ready_future<temporary_buffer<char>>(temporary_buffer<char>());
     }
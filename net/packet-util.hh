@@ -35,12 +35,36 @@ class packet_merger {
         static thread_local uint64_t linearization_count;
         return linearization_count;
     }
+    static uint64_t& appends_ref() {
+        static thread_local uint64_t append_count;
+        return append_count;
+    }
 public:
     std::map<Offset, packet> map;
 
     static uint64_t linearizations() {
         return linearizations_ref();
     }
+    static uint64_t appends() {
+        return appends_ref();
+    }
+
+    /// Appends p to the last segment if it starts where that one ends,
+    /// which is where data arriving in order goes; returns false, leaving
+    /// p alone, if it doesn't. Segments aren't linearized, so that
+    /// in-order data is never copied.
+    bool append(Offset offset, packet& p) {
+        if (map.empty()) {
+            return false;
+        }
+        auto& last = *map.rbegin();
+        if (last.first + last.second.len() != offset) {
+            return false;
+        }
+        last.second.append(std::move(p));
+        ++appends_ref();
+        return true;
+    }
 
     void merge(Offset offset, packet p) {
         bool insert = true;
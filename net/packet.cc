@@ -29,6 +29,7 @@ namespace net {
 
 constexpr size_t packet::internal_data_size;
 constexpr size_t packet::default_nr_frags;
+constexpr size_t packet::inline_headroom;
 
 void packet::linearize(size_t at_frag, size_t desired_size) {
     _impl->unuse_internal_data();
@@ -28,6 +28,9 @@
 #include <vector>
 #include <cassert>
 #include <algorithm>
+#include <memory>
+#include <new>
+#include <utility>
 #include <iosfwd>
 #include <experimental/optional>
 
@@ -46,9 +49,15 @@ struct offload_info {
     uint8_t udp_hdr_len = 8;
     bool needs_ip_csum = false;
     bool reassembled = false;
+    // The TCP checksum was already verified in software
+    bool l4_csum_verified = false;
+    // Segment size for TCP (TSO) or UDP (tx_udp_seg) segmentation offload
     uint16_t tso_seg_size = 0;
     // HW stripped VLAN header (CPU order)
     std::experimental::optional<uint16_t> vlan_tci;
+    // When the driver received the packet, in tsc_clock nanoseconds;
+    // zero if it does not record it
+    uint64_t rx_timestamp = 0;
 };
 
 // Zero-copy friendly packet class
@@ -74,10 +83,17 @@ struct offload_info {
 // extra space, so prepending to the packet does not require extra
 // allocations.  This is useful when adding headers.
 //
+// The impl blocks of the common sizes are recycled through a per-shard
+// freelist, so building, sharing and dropping packets does not go to the
+// allocator in the steady state.
+//
 class packet final {
     // enough for lots of headers, not quite two cache lines:
     static constexpr size_t internal_data_size = 128 - 16;
     static constexpr size_t default_nr_frags = 4;
+    // small payloads are copied inline only if this much room is left for
+    // the ethernet, IPv4 and TCP (with timestamps) headers
+    static constexpr size_t inline_headroom = 14 + 20 + 32;
 
     struct pseudo_vector {
         fragment* _start;
@@ -89,6 +105,71 @@ class packet final {
         fragment& operator[](size_t idx) { return _start[idx]; }
     };
 
+    // Cached impl blocks of default_nr_frags, and twice and four times as
+    // many fragments
+    class block_pool {
+        static constexpr unsigned nr_classes = 3;
+        static constexpr unsigned max_cached = 256;
+        struct free_block {
+            free_block* next;
+        };
+        free_block* _free[nr_classes] = {};
+        unsigned _cached[nr_classes] = {};
+    private:
+        static int class_of(size_t nr_frags) {
+            switch (nr_frags) {
+            case default_nr_frags: return 0;
+            case 2 * default_nr_frags: return 1;
+            case 4 * default_nr_frags: return 2;
+            default: return -1;
+            }
+        }
+    public:
+        ~block_pool() {
+            for (auto& f : _free) {
+                while (f) {
+                    ::operator delete(std::exchange(f, f->next));
+                }
+            }
+        }
+        static block_pool& local() {
+            static thread_local block_pool pool;
+            return pool;
+        }
+        // The number of fragments a block for nr_frags is allocated with
+        static size_t round_up(size_t nr_frags) {
+            for (auto n = default_nr_frags; n <= 4 * default_nr_frags; n *= 2) {
+                if (nr_frags <= n) {
+                    return n;
+                }
+            }
+            return nr_frags;
+        }
+        void* get(size_t nr_frags) {
+            auto c = class_of(nr_frags);
+            if (c < 0 || !_free[c]) {
+                return nullptr;
+            }
+            --_cached[c];
+            return std::exchange(_free[c], _free[c]->next);
+        }
+        bool put(void* block, size_t nr_frags) {
+            auto c = class_of(nr_frags);
+            if (c < 0 || _cached[c] == max_cached) {
+                return false;
+            }
+            ++_cached[c];
+            _free[c] = new (block) free_block{_free[c]};
+            return true;
+        }
+    };
+
+    struct impl;
+    struct impl_disposer {
+        void operator()(impl* p) const noexcept;
+    };
+    using impl_ptr = std::unique_ptr<impl, impl_disposer>;
+
     struct impl {
         // when destroyed, virtual destructor will reclaim resources
         deleter _deleter;
@@ -109,12 +190,36 @@ class packet final {
 
         pseudo_vector fragments() { return { _frags, _nr_frags }; }
 
-        static std::unique_ptr<impl> allocate(size_t nr_frags) {
-            nr_frags = std::max(nr_frags, default_nr_frags);
-            return std::unique_ptr<impl>(new (nr_frags) impl(nr_frags));
+        static void* allocate_block(size_t nr_frags) {
+            assert(nr_frags == uint16_t(nr_frags));
+            if (auto block = block_pool::local().get(nr_frags)) {
+                return block;
+            }
+            return ::operator new(sizeof(impl) + nr_frags * sizeof(fragment));
+        }
+        static void free_block(void* block, size_t nr_frags) noexcept {
+            if (!block_pool::local().put(block, nr_frags)) {
+                ::operator delete(block);
+            }
+        }
+        // Constructs an impl with room for at least nr_frags fragments
+        template <typename... Args>
+        static impl_ptr make(size_t nr_frags, Args&&... args) {
+            nr_frags = block_pool::round_up(nr_frags);
+            auto block = allocate_block(nr_frags);
+            try {
+                return impl_ptr(new (block) impl(std::forward<Args>(args)..., nr_frags));
+            } catch (...) {
+                free_block(block, nr_frags);
+                throw;
+            }
+        }
+
+        static impl_ptr allocate(size_t nr_frags) {
+            return make(nr_frags);
         }
 
-        static std::unique_ptr<impl> copy(impl* old, size_t nr) {
+        static impl_ptr copy(impl* old, size_t nr) {
             auto n = allocate(nr);
             n->_deleter = std::move(old->_deleter);
             n->_len = old->_len;
@@ -127,29 +232,16 @@ class packet final {
             return std::move(n);
         }
 
-        static std::unique_ptr<impl> copy(impl* old) {
+        static impl_ptr copy(impl* old) {
             return copy(old, old->_nr_frags);
         }
 
-        static std::unique_ptr<impl> allocate_if_needed(std::unique_ptr<impl> old, size_t extra_frags) {
+        static impl_ptr allocate_if_needed(impl_ptr old, size_t extra_frags) {
             if (old->_allocated_frags >= old->_nr_frags + extra_frags) {
                 return std::move(old);
             }
             return copy(old.get(), std::max<size_t>(old->_nr_frags + extra_frags, 2 * old->_nr_frags));
         }
-        void* operator new(size_t size, size_t nr_frags = default_nr_frags) {
-            assert(nr_frags == uint16_t(nr_frags));
-            return ::operator new(size + nr_frags * sizeof(fragment));
-        }
-        // Matching the operator new above
-        void operator delete(void* ptr, size_t nr_frags) {
-            return ::operator delete(ptr);
-        }
-        // Since the above "placement delete" hides the global one, expose it
-        void operator delete(void* ptr) {
-            return ::operator delete(ptr);
-        }
-
         bool using_internal_data() const {
             return _nr_frags
                     && _frags[0].base >= _data
@@ -179,8 +271,8 @@ class packet final {
                     to->_frags[0].base);
         }
     };
-    packet(std::unique_ptr<impl>&& impl) : _impl(std::move(impl)) {}
-    std::unique_ptr<impl> _impl;
+    packet(impl_ptr&& impl) : _impl(std::move(impl)) {}
+    impl_ptr _impl;
 public:
     static packet from_static_data(const char* data, size_t len) {
         return {fragment{const_cast<char*>(data), len}, deleter()};
@@ -321,6 +413,13 @@ packet::packet(packet&& x) noexcept
     : _impl(std::move(x._impl)) {
 }
 
+inline
+void packet::impl_disposer::operator()(impl* p) const noexcept {
+    auto nr_frags = p->_allocated_frags;
+    p->~impl();
+    impl::free_block(p, nr_frags);
+}
+
 inline
 packet::impl::impl(size_t nr_frags)
     : _len(0), _allocated_frags(nr_frags) {
@@ -330,7 +429,7 @@ inline
 packet::impl::impl(fragment frag, size_t nr_frags)
     : _len(frag.size), _allocated_frags(nr_frags) {
     assert(_allocated_frags > _nr_frags);
-    if (frag.size <= internal_data_size) {
+    if (frag.size + inline_headroom <= internal_data_size) {
         _headroom -= frag.size;
         _frags[0] = { _data + _headroom, frag.size };
     } else {
@@ -357,7 +456,7 @@ packet::packet(size_t nr_frags)
 }
 
 inline
-packet::packet(fragment frag) : _impl(new impl(frag)) {
+packet::packet(fragment frag) : _impl(impl::make(1, frag)) {
 }
 
 inline
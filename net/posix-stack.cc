@@ -24,7 +24,27 @@
 #include "packet.hh"
 #include "api.hh"
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <netinet/sctp.h>
+#include <sys/uio.h>
+#include <array>
+#include <deque>
+#ifdef HAVE_KTLS
+#include <linux/tls.h>
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
 
 namespace net {
 
@@ -33,9 +53,43 @@ using namespace seastar;
 template <transport Transport>
 class posix_connected_socket_operations;
 
+// The socket level options, which every socket type understands
+static void set_socket_level_options(file_desc& fd, const socket_options& opts) {
+    if (opts.receive_buffer_size) {
+        fd.setsockopt(SOL_SOCKET, SO_RCVBUF, int(*opts.receive_buffer_size));
+    }
+    if (opts.send_buffer_size) {
+        fd.setsockopt(SOL_SOCKET, SO_SNDBUF, int(*opts.send_buffer_size));
+    }
+    if (opts.busy_poll) {
+        fd.setsockopt(SOL_SOCKET, SO_BUSY_POLL, int(opts.busy_poll->count()));
+    }
+}
+
+static socket_options get_socket_level_options(file_desc& fd) {
+    socket_options opts;
+    // Linux reports twice what was set, the rest being its bookkeeping
+    opts.receive_buffer_size = fd.getsockopt<int>(SOL_SOCKET, SO_RCVBUF) / 2;
+    opts.send_buffer_size = fd.getsockopt<int>(SOL_SOCKET, SO_SNDBUF) / 2;
+    int busy_poll;
+    socklen_t len = sizeof(busy_poll);
+    // Kernels built without busy polling do not know the option
+    if (::getsockopt(fd.get(), SOL_SOCKET, SO_BUSY_POLL, &busy_poll, &len) == 0) {
+        opts.busy_poll = std::chrono::microseconds(busy_poll);
+    }
+    return opts;
+}
+
+static void reject_tcp_level_options(const socket_options& opts) {
+    if (opts.quickack || opts.notsent_lowat || opts.congestion_control) {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+}
+
 template <>
 class posix_connected_socket_operations<transport::TCP> {
 public:
+    static constexpr bool passes_file_descriptors = false;
     void set_nodelay(file_desc& _fd, bool nodelay) {
         _fd.setsockopt(IPPROTO_TCP, TCP_NODELAY, int(nodelay));
     }
@@ -61,11 +115,60 @@ class posix_connected_socket_operations<transport::TCP> {
             _fd.getsockopt<unsigned>(IPPROTO_TCP, TCP_KEEPCNT)
         };
     }
+    void set_congestion_control(file_desc& _fd, const sstring& algorithm) {
+        _fd.setsockopt(IPPROTO_TCP, TCP_CONGESTION, algorithm.c_str());
+    }
+    tcp_congestion_info get_congestion_info(file_desc& _fd) const {
+        char algorithm[16] = {}; // TCP_CA_NAME_MAX
+        _fd.getsockopt(IPPROTO_TCP, TCP_CONGESTION, algorithm, sizeof(algorithm) - 1);
+        auto info = _fd.getsockopt<::tcp_info>(IPPROTO_TCP, TCP_INFO);
+        return tcp_congestion_info {
+            sstring(algorithm),
+            info.tcpi_snd_cwnd * info.tcpi_snd_mss,
+            info.tcpi_snd_ssthresh * info.tcpi_snd_mss,
+            std::chrono::microseconds(info.tcpi_rtt),
+            // Not reported by the struct tcp_info glibc knows about
+            std::chrono::microseconds(0),
+            0
+        };
+    }
+    void set_socket_options(file_desc& _fd, const socket_options& opts) {
+        set_socket_level_options(_fd, opts);
+        if (opts.quickack) {
+            _fd.setsockopt(IPPROTO_TCP, TCP_QUICKACK, int(*opts.quickack));
+        }
+        if (opts.notsent_lowat) {
+            _fd.setsockopt(IPPROTO_TCP, TCP_NOTSENT_LOWAT, unsigned(*opts.notsent_lowat));
+        }
+        if (opts.congestion_control) {
+            set_congestion_control(_fd, *opts.congestion_control);
+        }
+    }
+    socket_options get_socket_options(file_desc& _fd) const {
+        auto opts = get_socket_level_options(_fd);
+        opts.quickack = bool(_fd.getsockopt<int>(IPPROTO_TCP, TCP_QUICKACK));
+        opts.notsent_lowat = _fd.getsockopt<unsigned>(IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+        opts.congestion_control = get_congestion_info(_fd).algorithm;
+        return opts;
+    }
+    bool enable_kernel_tls_tx(file_desc& _fd, const void* crypto_info, size_t size) {
+#ifdef HAVE_KTLS
+        // Attaching the ULP fails if the tls module is unavailable; until
+        // keys are installed the socket keeps working as before.
+        if (::setsockopt(_fd.get(), SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+            return false;
+        }
+        return ::setsockopt(_fd.get(), SOL_TLS, TLS_TX, crypto_info, size) == 0;
+#else
+        return false;
+#endif
+    }
 };
 
 template <>
 class posix_connected_socket_operations<transport::SCTP> {
 public:
+    static constexpr bool passes_file_descriptors = false;
     void set_nodelay(file_desc& _fd, bool nodelay) {
         _fd.setsockopt(SOL_SCTP, SCTP_NODELAY, int(nodelay));
     }
@@ -98,8 +201,109 @@ class posix_connected_socket_operations<transport::SCTP> {
             params.spp_pathmaxrxt
         };
     }
+    void set_congestion_control(file_desc& _fd, const sstring& algorithm) {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    tcp_congestion_info get_congestion_info(file_desc& _fd) const {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    void set_socket_options(file_desc& _fd, const socket_options& opts) {
+        reject_tcp_level_options(opts);
+        set_socket_level_options(_fd, opts);
+    }
+    socket_options get_socket_options(file_desc& _fd) const {
+        return get_socket_level_options(_fd);
+    }
+    bool enable_kernel_tls_tx(file_desc& _fd, const void* crypto_info, size_t size) {
+        return false;
+    }
+};
+
+template <>
+class posix_connected_socket_operations<unix_stream_transport> {
+public:
+    static constexpr bool passes_file_descriptors = true;
+    // Local sockets neither delay small writes nor probe an idle peer
+    void set_nodelay(file_desc& _fd, bool nodelay) {
+    }
+    bool get_nodelay(file_desc& _fd) const {
+        return true;
+    }
+    void set_keepalive(file_desc& _fd, bool keepalive) {
+    }
+    bool get_keepalive(file_desc& _fd) const {
+        return false;
+    }
+    void set_keepalive_parameters(file_desc& _fd, const keepalive_params& params) {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    keepalive_params get_keepalive_parameters(file_desc& _fd) const {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    void set_congestion_control(file_desc& _fd, const sstring& algorithm) {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    tcp_congestion_info get_congestion_info(file_desc& _fd) const {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    void set_socket_options(file_desc& _fd, const socket_options& opts) {
+        reject_tcp_level_options(opts);
+        set_socket_level_options(_fd, opts);
+    }
+    socket_options get_socket_options(file_desc& _fd) const {
+        return get_socket_level_options(_fd);
+    }
+    bool enable_kernel_tls_tx(file_desc& _fd, const void* crypto_info, size_t size) {
+        return false;
+    }
+};
+
+// A single byte of data carrying an SCM_RIGHTS control message; the kernel
+// accepts at most SCM_MAX_FD descriptors in one
+struct fd_passing_message {
+    static constexpr size_t max_fds = 253;
+    char byte = 0;
+    iovec iov;
+    msghdr hdr = {};
+    std::vector<char> control;
+
+    explicit fd_passing_message(size_t nr_fds) : control(CMSG_SPACE(nr_fds * sizeof(int))) {
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control.data();
+        hdr.msg_controllen = control.size();
+    }
 };
 
+#ifdef HAVE_KTLS
+// A record whose content type travels in a TLS_SET_RECORD_TYPE cmsg
+struct kernel_tls_record {
+    std::vector<char> data;
+    iovec iov;
+    msghdr hdr = {};
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(uint8_t))];
+    } control;
+
+    kernel_tls_record(uint8_t content_type, const char* p, size_t size) : data(p, p + size) {
+        iov.iov_base = data.data();
+        iov.iov_len = data.size();
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control.buf;
+        hdr.msg_controllen = sizeof(control.buf);
+        auto cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_TLS;
+        cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint8_t));
+        *CMSG_DATA(cmsg) = content_type;
+    }
+};
+#endif
+
 template <transport Transport>
 class posix_connected_socket_impl final : public connected_socket_impl, posix_connected_socket_operations<Transport> {
     lw_shared_ptr<pollable_fd> _fd;
@@ -135,6 +339,69 @@ class posix_connected_socket_impl final : public connected_socket_impl, posix_co
     keepalive_params get_keepalive_parameters() const override {
         return _ops::get_keepalive_parameters(_fd->get_file_desc());
     }
+    void set_congestion_control(const sstring& algorithm) override {
+        return _ops::set_congestion_control(_fd->get_file_desc(), algorithm);
+    }
+    tcp_congestion_info get_congestion_info() const override {
+        return _ops::get_congestion_info(_fd->get_file_desc());
+    }
+    void set_socket_options(const socket_options& opts) override {
+        return _ops::set_socket_options(_fd->get_file_desc(), opts);
+    }
+    socket_options get_socket_options() const override {
+        return _ops::get_socket_options(_fd->get_file_desc());
+    }
+    bool enable_kernel_tls_tx(const void* crypto_info, size_t size) override {
+        return _ops::enable_kernel_tls_tx(_fd->get_file_desc(), crypto_info, size);
+    }
+#ifdef HAVE_KTLS
+    future<> send_kernel_tls_record(uint8_t content_type, const char* data, size_t size) override {
+        auto rec = std::make_unique<kernel_tls_record>(content_type, data, size);
+        auto f = _fd->sendmsg(&rec->hdr);
+        return f.then([rec = std::move(rec)] (size_t) {});
+    }
+#endif
+    future<> send_file_descriptors(std::vector<int> fds) override {
+        if (!_ops::passes_file_descriptors || fds.empty() || fds.size() > fd_passing_message::max_fds) {
+            return make_exception_future<>(std::system_error(
+                    _ops::passes_file_descriptors ? EINVAL : ENOPROTOOPT, std::system_category()));
+        }
+        auto msg = std::make_unique<fd_passing_message>(fds.size());
+        auto cmsg = CMSG_FIRSTHDR(&msg->hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        std::copy(fds.begin(), fds.end(), reinterpret_cast<int*>(CMSG_DATA(cmsg)));
+        auto f = _fd->sendmsg(&msg->hdr, MSG_NOSIGNAL);
+        return f.then([msg = std::move(msg)] (size_t) {});
+    }
+    future<std::vector<file_desc>> receive_file_descriptors() override {
+        if (!_ops::passes_file_descriptors) {
+            return make_exception_future<std::vector<file_desc>>(std::system_error(ENOPROTOOPT, std::system_category()));
+        }
+        auto msg = std::make_unique<fd_passing_message>(fd_passing_message::max_fds);
+        auto f = _fd->recvmsg(&msg->hdr, MSG_CMSG_CLOEXEC);
+        return f.then([msg = std::move(msg)] (size_t size) {
+            std::vector<file_desc> fds;
+            for (auto cmsg = CMSG_FIRSTHDR(&msg->hdr); cmsg; cmsg = CMSG_NXTHDR(&msg->hdr, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                    continue;
+                }
+                auto data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+                auto n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < n; ++i) {
+                    fds.push_back(file_desc::from_fd(data[i]));
+                }
+            }
+            if (!size) {
+                throw std::system_error(ECONNRESET, std::system_category());
+            }
+            if (msg->hdr.msg_flags & MSG_CTRUNC) {
+                throw std::system_error(EMSGSIZE, std::system_category());
+            }
+            return fds;
+        });
+    }
     friend class posix_server_socket_impl<Transport>;
     friend class posix_ap_server_socket_impl<Transport>;
     friend class posix_reuseport_server_socket_impl<Transport>;
@@ -144,6 +411,7 @@ class posix_connected_socket_impl final : public connected_socket_impl, posix_co
 };
 using posix_connected_tcp_socket_impl = posix_connected_socket_impl<transport::TCP>;
 using posix_connected_sctp_socket_impl = posix_connected_socket_impl<transport::SCTP>;
+using posix_connected_unix_socket_impl = posix_connected_socket_impl<unix_stream_transport>;
 
 class posix_socket_impl final : public socket_impl {
     lw_shared_ptr<pollable_fd> _fd;
@@ -152,9 +420,11 @@ class posix_socket_impl final : public socket_impl {
 
     virtual future<connected_socket> connect(socket_address sa, socket_address local, transport proto = transport::TCP) override {
         _fd = engine().make_pollable_fd(sa, proto);
-        return engine().posix_connect(_fd, sa, local).then([fd = _fd, proto]() mutable {
+        return engine().posix_connect(_fd, sa, local).then([fd = _fd, proto, unix_domain = sa.is_unix_domain()]() mutable {
             std::unique_ptr<connected_socket_impl> csi;
-            if (proto == transport::TCP) {
+            if (unix_domain) {
+                csi.reset(new posix_connected_unix_socket_impl(std::move(fd)));
+            } else if (proto == transport::TCP) {
                 csi.reset(new posix_connected_tcp_socket_impl(std::move(fd)));
             } else {
                 csi.reset(new posix_connected_sctp_socket_impl(std::move(fd)));
@@ -181,7 +451,13 @@ future<connected_socket, socket_address>
 posix_server_socket_impl<Transport>::accept() {
     return _lfd.accept().then([this] (pollable_fd fd, socket_address sa) {
         static unsigned balance = 0;
-        auto cpu = balance++ % smp::count;
+        unsigned cpu;
+        if (_lba == listen_options::load_balancing_algorithm::port) {
+            // sin6_port is at the same offset
+            cpu = ntohs(sa.u.in.sin_port) % smp::count;
+        } else {
+            cpu = balance++ % smp::count;
+        }
 
         if (cpu == engine().cpu_id()) {
             std::unique_ptr<connected_socket_impl> csi(
@@ -190,7 +466,9 @@ posix_server_socket_impl<Transport>::accept() {
                     connected_socket(std::move(csi)), sa);
         } else {
             smp::submit_to(cpu, [this, fd = std::move(fd.get_file_desc()), sa] () mutable {
-                posix_ap_server_socket_impl<Transport>::move_connected_socket(_sa, pollable_fd(std::move(fd)), sa);
+                pollable_fd pfd(std::move(fd));
+                pfd.enable_edge_triggered();
+                posix_ap_server_socket_impl<Transport>::move_connected_socket(_sa, std::move(pfd), sa);
             });
             return accept();
         }
@@ -205,7 +483,7 @@ posix_server_socket_impl<Transport>::abort_accept() {
 
 template <transport Transport>
 future<connected_socket, socket_address> posix_ap_server_socket_impl<Transport>::accept() {
-    auto conni = conn_q.find(_sa.as_posix_sockaddr_in());
+    auto conni = conn_q.find(_sa);
     if (conni != conn_q.end()) {
         connection c = std::move(conni->second);
         conn_q.erase(conni);
@@ -218,7 +496,7 @@ future<connected_socket, socket_address> posix_ap_server_socket_impl<Transport>:
         }
     } else {
         try {
-            auto i = sockets.emplace(std::piecewise_construct, std::make_tuple(_sa.as_posix_sockaddr_in()), std::make_tuple());
+            auto i = sockets.emplace(std::piecewise_construct, std::make_tuple(_sa), std::make_tuple());
             assert(i.second);
             return i.first->second.get_future();
         } catch (...) {
@@ -230,8 +508,8 @@ future<connected_socket, socket_address> posix_ap_server_socket_impl<Transport>:
 template <transport Transport>
 void
 posix_ap_server_socket_impl<Transport>::abort_accept() {
-    conn_q.erase(_sa.as_posix_sockaddr_in());
-    auto i = sockets.find(_sa.as_posix_sockaddr_in());
+    conn_q.erase(_sa);
+    auto i = sockets.find(_sa);
     if (i != sockets.end()) {
         i->second.set_exception(std::system_error(ECONNABORTED, std::system_category()));
         sockets.erase(i);
@@ -257,7 +535,7 @@ posix_reuseport_server_socket_impl<Transport>::abort_accept() {
 
 template <transport Transport>
 void  posix_ap_server_socket_impl<Transport>::move_connected_socket(socket_address sa, pollable_fd fd, socket_address addr) {
-    auto i = sockets.find(sa.as_posix_sockaddr_in());
+    auto i = sockets.find(sa);
     if (i != sockets.end()) {
         try {
             std::unique_ptr<connected_socket_impl> csi(new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(fd))));
@@ -267,7 +545,7 @@ void  posix_ap_server_socket_impl<Transport>::move_connected_socket(socket_addre
         }
         sockets.erase(i);
     } else {
-        conn_q.emplace(std::piecewise_construct, std::make_tuple(sa.as_posix_sockaddr_in()), std::make_tuple(std::move(fd), std::move(addr)));
+        conn_q.emplace(std::piecewise_construct, std::make_tuple(sa), std::make_tuple(std::move(fd), std::move(addr)));
     }
 }
 
@@ -277,12 +555,7 @@ data_source posix_data_source(pollable_fd& fd) {
 
 future<temporary_buffer<char>>
 posix_data_source_impl::get() {
-    return _fd.read_some(_buf.get_write(), _buf_size).then([this] (size_t size) {
-        _buf.trim(size);
-        auto ret = std::move(_buf);
-        _buf = temporary_buffer<char>(_buf_size);
-        return make_ready_future<temporary_buffer<char>>(std::move(ret));
-    });
+    return _fd.read_some(_buf_size);
 }
 
 data_sink posix_data_sink(pollable_fd& fd) {
@@ -318,18 +591,44 @@ posix_data_sink_impl::put(packet p) {
     return _fd.write_all(_p).then([this] { _p.reset(); });
 }
 
+future<>
+posix_data_sink_impl::sendfile(int fd, uint64_t offset, uint64_t len) {
+    struct state {
+        uint64_t offset;
+        uint64_t len;
+    };
+    return do_with(state{offset, len}, [this, fd] (state& st) {
+        return repeat([this, fd, &st] {
+            if (!st.len) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return _fd.sendfile(fd, st.offset, std::min(st.len, max_sendfile_size)).then([&st] (size_t n) {
+                if (!n) {
+                    throw std::runtime_error("sendfile: file ended before the requested length");
+                }
+                st.offset += n;
+                st.len -= n;
+                return stop_iteration::no;
+            });
+        });
+    });
+}
+
 server_socket
 posix_network_stack::listen(socket_address sa, listen_options opt) {
-    if (opt.proto == transport::TCP) {
+    if (sa.is_unix_domain()) {
+        // A name binds once per host, so there is no reuseport variant
+        return server_socket(std::make_unique<posix_server_unix_socket_impl>(sa, engine().posix_listen(sa, opt)));
+    } else if (opt.proto == transport::TCP) {
         return _reuseport ?
             server_socket(std::make_unique<posix_reuseport_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt)))
             :
-            server_socket(std::make_unique<posix_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt)));
+            server_socket(std::make_unique<posix_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt), opt.lba));
     } else {
         return _reuseport ?
             server_socket(std::make_unique<posix_reuseport_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt)))
             :
-            server_socket(std::make_unique<posix_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt)));
+            server_socket(std::make_unique<posix_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt), opt.lba));
     }
 }
 
@@ -338,13 +637,15 @@ ::seastar::socket posix_network_stack::socket() {
 }
 
 template<transport Transport>
-thread_local std::unordered_map<::sockaddr_in, promise<connected_socket, socket_address>> posix_ap_server_socket_impl<Transport>::sockets;
+thread_local std::unordered_map<socket_address, promise<connected_socket, socket_address>> posix_ap_server_socket_impl<Transport>::sockets;
 template<transport Transport>
-thread_local std::unordered_multimap<::sockaddr_in, typename posix_ap_server_socket_impl<Transport>::connection> posix_ap_server_socket_impl<Transport>::conn_q;
+thread_local std::unordered_multimap<socket_address, typename posix_ap_server_socket_impl<Transport>::connection> posix_ap_server_socket_impl<Transport>::conn_q;
 
 server_socket
 posix_ap_network_stack::listen(socket_address sa, listen_options opt) {
-    if (opt.proto == transport::TCP) {
+    if (sa.is_unix_domain()) {
+        return server_socket(std::make_unique<posix_unix_ap_server_socket_impl>(sa));
+    } else if (opt.proto == transport::TCP) {
         return _reuseport ?
             server_socket(std::make_unique<posix_reuseport_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt)))
             :
@@ -357,36 +658,50 @@ posix_ap_network_stack::listen(socket_address sa, listen_options opt) {
     }
 }
 
-struct cmsg_with_pktinfo {
-    struct cmsghdrcmh;
-    struct in_pktinfo pktinfo;
-};
-
 class posix_udp_channel : public udp_channel_impl {
 private:
     static constexpr int MAX_DATAGRAM_SIZE = 65507;
+    // Datagrams received, or sent, per system call
+    static constexpr unsigned batch_size = 16;
+    // Received datagrams up to this size are copied out of the slot, larger
+    // ones (or GRO trains) take its buffer along and a new one is allocated
+    static constexpr size_t copy_threshold = 16384;
+    // Segments the kernel accepts in one UDP_SEGMENT send
+    static constexpr unsigned max_gso_segments = 64;
+    static constexpr size_t control_size = CMSG_SPACE(sizeof(in_pktinfo)) + CMSG_SPACE(sizeof(int));
+    struct recv_slot {
+        socket_address src_addr;
+        iovec iov;
+        temporary_buffer<char> buffer;
+        union {
+            char buf[control_size];
+            cmsghdr align;
+        } control;
+    };
+    // A ring of preallocated buffers filled by one recvmmsg() each time
+    // the previous batch was handed out
     struct recv_ctx {
-        struct msghdr _hdr;
-        struct iovec _iov;
-        socket_address _src_addr;
-        char* _buffer;
-        cmsg_with_pktinfo _cmsg;
-
-        recv_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_iov = &_iov;
-            _hdr.msg_iovlen = 1;
-            _hdr.msg_name = &_src_addr.u.sa;
-            _hdr.msg_namelen = sizeof(_src_addr.u.sas);
-            memset(&_cmsg, 0, sizeof(_cmsg));
-            _hdr.msg_control = &_cmsg;
-            _hdr.msg_controllen = sizeof(_cmsg);
-        }
+        std::array<recv_slot, batch_size> slots;
+        std::array<mmsghdr, batch_size> msgs;
+        std::deque<udp_datagram> ready;
 
         void prepare() {
-            _buffer = new char[MAX_DATAGRAM_SIZE];
-            _iov.iov_base = _buffer;
-            _iov.iov_len = MAX_DATAGRAM_SIZE;
+            for (unsigned i = 0; i < batch_size; ++i) {
+                auto& s = slots[i];
+                if (!s.buffer) {
+                    s.buffer = temporary_buffer<char>(MAX_DATAGRAM_SIZE);
+                }
+                s.iov.iov_base = s.buffer.get_write();
+                s.iov.iov_len = s.buffer.size();
+                auto& hdr = msgs[i].msg_hdr;
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_iov = &s.iov;
+                hdr.msg_iovlen = 1;
+                hdr.msg_name = &s.src_addr.u.sa;
+                hdr.msg_namelen = sizeof(s.src_addr.u.sas);
+                hdr.msg_control = s.control.buf;
+                hdr.msg_controllen = sizeof(s.control.buf);
+            }
         }
     };
     struct send_ctx {
@@ -409,11 +724,30 @@ class posix_udp_channel : public udp_channel_impl {
             _hdr.msg_iovlen = _iovecs.size();
         }
     };
+    // One message of a batched send: a datagram, or with UDP_SEGMENT a run
+    // of them the kernel splits
+    struct send_msg {
+        socket_address dst;
+        size_t first_iov;
+        uint16_t seg_size;
+        union {
+            char buf[CMSG_SPACE(sizeof(uint16_t))];
+            cmsghdr align;
+        } control;
+    };
+    struct send_batch_ctx {
+        std::vector<std::pair<ipv4_addr, packet>> datagrams;
+        std::vector<iovec> iovecs;
+        std::vector<send_msg> msgs;
+        std::vector<mmsghdr> hdrs;
+        size_t sent = 0;
+    };
     std::unique_ptr<pollable_fd> _fd;
     ipv4_addr _address;
     recv_ctx _recv;
     send_ctx _send;
     bool _closed;
+    bool _udp_segment = false;
 public:
     posix_udp_channel(ipv4_addr bind_address)
             : _closed(false) {
@@ -423,14 +757,21 @@ class posix_udp_channel : public udp_channel_impl {
         if (engine().posix_reuseport_available()) {
             fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
         }
+        // Both need Linux 4.18 or later (5.0 for GRO), do without otherwise
+        int zero = 0, one = 1;
+        _udp_segment = ::setsockopt(fd.get(), SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+        ::setsockopt(fd.get(), SOL_UDP, UDP_GRO, &one, sizeof(one));
         fd.bind(sa.u.sa, sizeof(sa.u.sas));
         _address = ipv4_addr(fd.get_address());
         _fd = std::make_unique<pollable_fd>(std::move(fd));
+        _fd->enable_edge_triggered();
     }
     virtual ~posix_udp_channel() { if (!_closed) close(); };
     virtual future<udp_datagram> receive() override;
+    virtual future<std::vector<udp_datagram>> receive_batch(size_t max_datagrams) override;
     virtual future<> send(ipv4_addr dst, const char *msg);
     virtual future<> send(ipv4_addr dst, packet p);
+    virtual future<> send(std::vector<std::pair<ipv4_addr, packet>> datagrams) override;
     virtual void close() override {
         _closed = true;
         _fd->abort_reader(std::make_exception_ptr(std::system_error(EPIPE, std::system_category())));
@@ -438,6 +779,10 @@ class posix_udp_channel : public udp_channel_impl {
         _fd.reset();
     }
     virtual bool is_closed() const override { return _closed; }
+private:
+    void add_received(recv_slot& slot, msghdr& hdr, size_t size);
+    future<> receive_more();
+    future<> send_batch(lw_shared_ptr<send_batch_ctx> ctx);
 };
 
 future<> posix_udp_channel::send(ipv4_addr dst, const char *message) {
@@ -453,6 +798,81 @@ future<> posix_udp_channel::send(ipv4_addr dst, packet p) {
             .then([len] (size_t size) { assert(size == len); });
 }
 
+future<> posix_udp_channel::send(std::vector<std::pair<ipv4_addr, packet>> datagrams) {
+    auto ctx = make_lw_shared<send_batch_ctx>();
+    ctx->datagrams = std::move(datagrams);
+    auto& dgrams = ctx->datagrams;
+    ctx->msgs.reserve(dgrams.size());
+    auto same_dst = [] (const ipv4_addr& a, const ipv4_addr& b) {
+        return a.ip == b.ip && a.port == b.port;
+    };
+    for (size_t i = 0; i < dgrams.size();) {
+        auto seg = dgrams[i].second.len();
+        size_t n = 1;
+        if (_udp_segment && seg) {
+            // As in the native stack: equally sized datagrams to the same
+            // destination, the last one may be shorter
+            auto total = seg;
+            while (i + n < dgrams.size() && n < max_gso_segments) {
+                auto len = dgrams[i + n].second.len();
+                if (!same_dst(dgrams[i + n].first, dgrams[i].first) || !len || len > seg
+                        || total + len > size_t(MAX_DATAGRAM_SIZE)) {
+                    break;
+                }
+                total += len;
+                ++n;
+                if (len < seg) {
+                    break;
+                }
+            }
+        }
+        ctx->msgs.emplace_back();
+        auto& m = ctx->msgs.back();
+        m.dst = make_ipv4_address(dgrams[i].first);
+        m.first_iov = ctx->iovecs.size();
+        for (size_t j = i; j < i + n; ++j) {
+            for (auto&& f : dgrams[j].second.fragments()) {
+                ctx->iovecs.push_back({f.base, f.size});
+            }
+        }
+        i += n;
+        m.seg_size = n > 1 ? seg : 0;
+    }
+    // Only now are the iovecs stable in memory
+    ctx->hdrs.resize(ctx->msgs.size());
+    for (size_t i = 0; i < ctx->msgs.size(); ++i) {
+        auto& m = ctx->msgs[i];
+        auto& hdr = ctx->hdrs[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &m.dst.u.sa;
+        hdr.msg_namelen = sizeof(m.dst.u.sas);
+        auto end_iov = i + 1 < ctx->msgs.size() ? ctx->msgs[i + 1].first_iov : ctx->iovecs.size();
+        hdr.msg_iov = ctx->iovecs.data() + m.first_iov;
+        hdr.msg_iovlen = end_iov - m.first_iov;
+        if (m.seg_size) {
+            hdr.msg_control = m.control.buf;
+            hdr.msg_controllen = sizeof(m.control.buf);
+            auto cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cm), &m.seg_size, sizeof(m.seg_size));
+        }
+    }
+    return send_batch(std::move(ctx));
+}
+
+future<> posix_udp_channel::send_batch(lw_shared_ptr<send_batch_ctx> ctx) {
+    if (ctx->sent == ctx->hdrs.size()) {
+        return make_ready_future<>();
+    }
+    auto left = std::min<size_t>(ctx->hdrs.size() - ctx->sent, UIO_MAXIOV);
+    return _fd->sendmmsg(ctx->hdrs.data() + ctx->sent, left).then([this, ctx] (size_t n) mutable {
+        ctx->sent += n;
+        return send_batch(std::move(ctx));
+    });
+}
+
 udp_channel
 posix_network_stack::make_udp_channel(ipv4_addr addr) {
     return udp_channel(std::make_unique<posix_udp_channel>(addr));
@@ -471,14 +891,80 @@ class posix_datagram : public udp_datagram_impl {
     virtual packet& get_data() override { return _p; }
 };
 
-future<udp_datagram>
-posix_udp_channel::receive() {
+void posix_udp_channel::add_received(recv_slot& slot, msghdr& hdr, size_t size) {
+    ipv4_addr dst(0, _address.port);
+    size_t seg = size;
+    for (auto cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+        if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_PKTINFO) {
+            in_pktinfo pi;
+            memcpy(&pi, CMSG_DATA(cm), sizeof(pi));
+            dst.ip = net::ntoh(pi.ipi_addr.s_addr);
+        } else if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            // The kernel coalesced datagrams of this size, the last one
+            // may be shorter
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            if (gso_size > 0) {
+                seg = gso_size;
+            }
+        }
+    }
+    ipv4_addr src(slot.src_addr);
+    auto deliver = [&] (temporary_buffer<char> buf) {
+        _recv.ready.emplace_back(std::make_unique<posix_datagram>(src, dst, packet(std::move(buf))));
+    };
+    if (size <= copy_threshold) {
+        size_t off = 0;
+        do {
+            auto len = std::min(seg, size - off);
+            deliver(temporary_buffer<char>(slot.buffer.get() + off, len));
+            off += len;
+        } while (off < size);
+        return;
+    }
+    auto buf = std::move(slot.buffer);
+    for (size_t off = 0; off < size; off += seg) {
+        deliver(buf.share(off, std::min(seg, size - off)));
+    }
+}
+
+future<> posix_udp_channel::receive_more() {
     _recv.prepare();
-    return _fd->recvmsg(&_recv._hdr).then([this] (size_t size) {
-        auto dst = ipv4_addr(_recv._cmsg.pktinfo.ipi_addr.s_addr, _address.port);
-        return make_ready_future<udp_datagram>(udp_datagram(std::make_unique<posix_datagram>(
-            _recv._src_addr, dst, packet(fragment{_recv._buffer, size}, make_deleter([buf = _recv._buffer] { delete[] buf; })))));
+    return _fd->recvmmsg(_recv.msgs.data(), batch_size).then([this] (size_t n) {
+        for (unsigned i = 0; i < n; ++i) {
+            add_received(_recv.slots[i], _recv.msgs[i].msg_hdr, _recv.msgs[i].msg_len);
+        }
     });
 }
 
+future<udp_datagram>
+posix_udp_channel::receive() {
+    auto take = [this] {
+        auto d = std::move(_recv.ready.front());
+        _recv.ready.pop_front();
+        return make_ready_future<udp_datagram>(std::move(d));
+    };
+    if (!_recv.ready.empty()) {
+        return take();
+    }
+    return receive_more().then(take);
+}
+
+future<std::vector<udp_datagram>>
+posix_udp_channel::receive_batch(size_t max_datagrams) {
+    auto take = [this, max_datagrams] {
+        std::vector<udp_datagram> batch;
+        batch.reserve(std::min(max_datagrams, _recv.ready.size()));
+        while (batch.size() < max_datagrams && !_recv.ready.empty()) {
+            batch.push_back(std::move(_recv.ready.front()));
+            _recv.ready.pop_front();
+        }
+        return batch;
+    };
+    if (!_recv.ready.empty()) {
+        return make_ready_future<std::vector<udp_datagram>>(take());
+    }
+    return receive_more().then(take);
+}
+
 }
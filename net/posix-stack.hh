@@ -35,15 +35,19 @@ data_sink posix_data_sink(pollable_fd& fd);
 
 class posix_data_source_impl final : public data_source_impl {
     pollable_fd& _fd;
-    temporary_buffer<char> _buf;
+    // Allocated for each read once data is ready, not kept in between,
+    // so that idle connections don't hold a buffer each
     size_t _buf_size;
 public:
     explicit posix_data_source_impl(pollable_fd& fd, size_t buf_size = 8192)
-        : _fd(fd), _buf(buf_size), _buf_size(buf_size) {}
+        : _fd(fd), _buf_size(buf_size) {}
     virtual future<temporary_buffer<char>> get() override;
 };
 
 class posix_data_sink_impl : public data_sink_impl {
+    // Bytes a single sendfile() call is asked for, bounding how long it
+    // holds a syscall thread
+    static constexpr uint64_t max_sendfile_size = 1 << 20;
     pollable_fd& _fd;
     packet _p;
 public:
@@ -54,8 +58,16 @@ class posix_data_sink_impl : public data_sink_impl {
         _fd.close();
         return make_ready_future<>();
     }
+    bool can_sendfile() const override {
+        return true;
+    }
+    future<> sendfile(int fd, uint64_t offset, uint64_t len) override;
 };
 
+// Unix domain stream sockets go through the same transport-parameterized
+// classes; protocol 0 is what socket(AF_UNIX, SOCK_STREAM, ...) takes
+constexpr transport unix_stream_transport = transport(0);
+
 template <transport Transport>
 class posix_ap_server_socket_impl : public server_socket_impl {
     struct connection {
@@ -63,8 +75,8 @@ class posix_ap_server_socket_impl : public server_socket_impl {
         socket_address addr;
         connection(pollable_fd xfd, socket_address xaddr) : fd(std::move(xfd)), addr(xaddr) {}
     };
-    static thread_local std::unordered_map<::sockaddr_in, promise<connected_socket, socket_address>> sockets;
-    static thread_local std::unordered_multimap<::sockaddr_in, connection> conn_q;
+    static thread_local std::unordered_map<socket_address, promise<connected_socket, socket_address>> sockets;
+    static thread_local std::unordered_multimap<socket_address, connection> conn_q;
     socket_address _sa;
 public:
     explicit posix_ap_server_socket_impl(socket_address sa) : _sa(sa) {}
@@ -74,18 +86,23 @@ class posix_ap_server_socket_impl : public server_socket_impl {
 };
 using posix_tcp_ap_server_socket_impl = posix_ap_server_socket_impl<transport::TCP>;
 using posix_sctp_ap_server_socket_impl = posix_ap_server_socket_impl<transport::SCTP>;
+using posix_unix_ap_server_socket_impl = posix_ap_server_socket_impl<unix_stream_transport>;
 
 template <transport Transport>
 class posix_server_socket_impl : public server_socket_impl {
     socket_address _sa;
     pollable_fd _lfd;
+    listen_options::load_balancing_algorithm _lba;
 public:
-    explicit posix_server_socket_impl(socket_address sa, pollable_fd lfd) : _sa(sa), _lfd(std::move(lfd)) {}
+    explicit posix_server_socket_impl(socket_address sa, pollable_fd lfd,
+            listen_options::load_balancing_algorithm lba = listen_options::load_balancing_algorithm::connection_distribution)
+        : _sa(sa), _lfd(std::move(lfd)), _lba(lba) {}
     virtual future<connected_socket, socket_address> accept();
     virtual void abort_accept() override;
 };
 using posix_server_tcp_socket_impl = posix_server_socket_impl<transport::TCP>;
 using posix_server_sctp_socket_impl = posix_server_socket_impl<transport::SCTP>;
+using posix_server_unix_socket_impl = posix_server_socket_impl<unix_stream_transport>;
 
 template <transport Transport>
 class posix_reuseport_server_socket_impl : public server_socket_impl {
@@ -93,6 +110,9 @@ class posix_reuseport_server_socket_impl : public server_socket_impl {
     pollable_fd _lfd;
 public:
     explicit posix_reuseport_server_socket_impl(socket_address sa, pollable_fd lfd) : _sa(sa), _lfd(std::move(lfd)) {}
+    ~posix_reuseport_server_socket_impl() {
+        engine().posix_reuseport_close(_sa, _lfd);
+    }
     virtual future<connected_socket, socket_address> accept();
     virtual void abort_accept() override;
 };
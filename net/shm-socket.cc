@@ -0,0 +1,424 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "shm-socket.hh"
+#include "stack.hh"
+#include "packet.hh"
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/posix.hh"
+#include <atomic>
+#include <cstring>
+#include <sys/eventfd.h>
+
+namespace net {
+
+using namespace seastar;
+
+namespace {
+
+constexpr uint32_t shm_magic = 0x53484d52; // "SHMR"
+constexpr uint32_t shm_version = 1;
+constexpr size_t shm_header_size = 4096;
+constexpr size_t cache_line_size = 64;
+
+// Counters are byte offsets that never wrap in practice; the ring
+// position is the counter modulo the ring size.
+struct shm_ring_header {
+    alignas(cache_line_size) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> closed;
+    alignas(cache_line_size) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> writer_waiting;
+};
+
+struct shm_segment_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ring_size;
+    // [0] carries data from the connecting side, [1] towards it
+    shm_ring_header rings[2];
+};
+
+static_assert(sizeof(shm_segment_header) <= shm_header_size, "shm header does not fit");
+
+// Descriptor order on the rendezvous socket: the segment, then the data
+// and space eventfds of ring 0 and of ring 1
+enum shm_fd { segment_fd, data0_fd, space0_fd, data1_fd, space1_fd, nr_shm_fds };
+
+// One side's view of one ring. The reader waits on data and signals
+// space; the writer the other way round.
+struct shm_ring {
+    shm_ring_header* h;
+    char* data;
+    uint64_t size;
+    // Our own end of the eventfd we sleep on, to unblock ourselves
+    file_desc self;
+    pollable_fd wake;
+    file_desc notify;
+    uint64_t counter;
+
+    shm_ring(shm_ring_header* h, char* data, uint64_t size, file_desc wake_fd, file_desc notify_fd)
+        : h(h), data(data), size(size), self(wake_fd.dup()), wake(std::move(wake_fd)), notify(std::move(notify_fd)) {}
+    void copy_out(uint64_t pos, char* to, size_t n) const {
+        auto off = pos & (size - 1);
+        auto first = std::min<size_t>(n, size - off);
+        std::memcpy(to, data + off, first);
+        std::memcpy(to + first, data, n - first);
+    }
+    void copy_in(uint64_t pos, const char* from, size_t n) {
+        auto off = pos & (size - 1);
+        auto first = std::min<size_t>(n, size - off);
+        std::memcpy(data + off, from, first);
+        std::memcpy(data, from + first, n - first);
+    }
+    // Wakes the other side if it announced it is going to sleep
+    void signal(std::atomic<uint32_t>& waiting) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) && waiting.exchange(0)) {
+            ::eventfd_write(notify.get(), 1);
+        }
+    }
+    future<> wait() {
+        return wake.read_some(reinterpret_cast<uint8_t*>(&counter), sizeof(counter)).discard_result();
+    }
+    // Unblocks our own wait(), for local events such as a shutdown
+    void kick() {
+        ::eventfd_write(self.get(), 1);
+    }
+};
+
+class shm_connection {
+    connected_socket _control;
+    input_stream<char> _control_in;
+    mmap_area _segment;
+public:
+    shm_ring in;
+    shm_ring out;
+    bool peer_gone = false;
+    bool input_shut = false;
+    bool output_shut = false;
+    bool keepalive = false;
+    keepalive_params keepalive_parameters = tcp_keepalive_params{};
+public:
+    shm_connection(connected_socket control, mmap_area segment, std::vector<file_desc> fds, bool connecting);
+    // The peer closing the rendezvous socket means it is gone, cleanly or not
+    void watch_peer(lw_shared_ptr<shm_connection> self) {
+        _control_in.read().then_wrapped([self] (future<temporary_buffer<char>> f) {
+            f.ignore_ready_future();
+            self->peer_gone = true;
+            self->in.kick();
+            self->out.kick();
+        });
+    }
+    void close_output() {
+        if (!output_shut) {
+            output_shut = true;
+            out.h->closed.store(1, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            ::eventfd_write(out.notify.get(), 1);
+            // A writer waiting for room fails instead
+            out.kick();
+        }
+    }
+    void shutdown() {
+        input_shut = true;
+        in.kick();
+        close_output();
+        _control.shutdown_input();
+        _control.shutdown_output();
+    }
+};
+
+shm_connection::shm_connection(connected_socket control, mmap_area segment, std::vector<file_desc> fds, bool connecting)
+    : _control(std::move(control))
+    , _control_in(_control.input())
+    , _segment(std::move(segment))
+    , in(nullptr, nullptr, 0, std::move(fds[connecting ? data1_fd : data0_fd]), std::move(fds[connecting ? space1_fd : space0_fd]))
+    , out(nullptr, nullptr, 0, std::move(fds[connecting ? space0_fd : space1_fd]), std::move(fds[connecting ? data0_fd : data1_fd])) {
+    auto hdr = reinterpret_cast<shm_segment_header*>(_segment.get());
+    auto ring_size = hdr->ring_size;
+    auto data = _segment.get() + shm_header_size;
+    out.h = &hdr->rings[connecting ? 0 : 1];
+    out.data = data + (connecting ? 0 : ring_size);
+    out.size = ring_size;
+    in.h = &hdr->rings[connecting ? 1 : 0];
+    in.data = data + (connecting ? ring_size : 0);
+    in.size = ring_size;
+}
+
+class shm_data_source_impl final : public data_source_impl {
+    lw_shared_ptr<shm_connection> _conn;
+public:
+    explicit shm_data_source_impl(lw_shared_ptr<shm_connection> conn) : _conn(std::move(conn)) {}
+    virtual future<temporary_buffer<char>> get() override {
+        using ret = std::experimental::optional<temporary_buffer<char>>;
+        return repeat_until_value([this] {
+            auto& r = _conn->in;
+            auto tail = r.h->tail.load(std::memory_order_relaxed);
+            auto available = [&] {
+                return r.h->head.load(std::memory_order_acquire) - tail;
+            };
+            auto closed = [&] {
+                return _conn->input_shut || _conn->peer_gone || r.h->closed.load(std::memory_order_acquire);
+            };
+            auto n = available();
+            if (!n) {
+                // Announce the sleep, then look once more: the writer
+                // checks the flag only after publishing its data. The
+                // head is read after the close flag so nothing the writer
+                // published before closing gets lost.
+                r.h->reader_waiting.store(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                auto eof = closed();
+                n = available();
+                if (!n && !eof) {
+                    return r.wait().then([] { return ret(); });
+                }
+                r.h->reader_waiting.store(0, std::memory_order_relaxed);
+            }
+            if (!n || _conn->input_shut) {
+                return make_ready_future<ret>(temporary_buffer<char>());
+            }
+            temporary_buffer<char> buf(n);
+            r.copy_out(tail, buf.get_write(), n);
+            r.h->tail.store(tail + n, std::memory_order_release);
+            r.signal(r.h->writer_waiting);
+            return make_ready_future<ret>(std::move(buf));
+        });
+    }
+};
+
+class shm_data_sink_impl final : public data_sink_impl {
+    lw_shared_ptr<shm_connection> _conn;
+    packet _p;
+    size_t _frag = 0;
+    size_t _off = 0;
+private:
+    // Copies as much of _p as fits, returns true once all of it has
+    bool push() {
+        auto& r = _conn->out;
+        auto head = r.h->head.load(std::memory_order_relaxed);
+        auto room = r.size - (head - r.h->tail.load(std::memory_order_acquire));
+        auto pos = head;
+        while (_frag < _p.nr_frags() && room) {
+            auto& f = _p.frag(_frag);
+            auto n = std::min<size_t>(f.size - _off, room);
+            r.copy_in(pos, f.base + _off, n);
+            pos += n;
+            room -= n;
+            _off += n;
+            if (_off == f.size) {
+                ++_frag;
+                _off = 0;
+            }
+        }
+        if (pos != head) {
+            r.h->head.store(pos, std::memory_order_release);
+            r.signal(r.h->reader_waiting);
+        }
+        return _frag == _p.nr_frags();
+    }
+    bool full() const {
+        auto& r = _conn->out;
+        return r.h->head.load(std::memory_order_relaxed) - r.h->tail.load(std::memory_order_acquire) == r.size;
+    }
+public:
+    explicit shm_data_sink_impl(lw_shared_ptr<shm_connection> conn) : _conn(std::move(conn)) {}
+    future<> put(packet p) override {
+        _p = std::move(p);
+        _frag = 0;
+        _off = 0;
+        return repeat([this] {
+            if (_conn->peer_gone || _conn->output_shut) {
+                return make_exception_future<stop_iteration>(std::system_error(EPIPE, std::system_category()));
+            }
+            if (push()) {
+                _p = packet();
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto& r = _conn->out;
+            r.h->writer_waiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!full()) {
+                r.h->writer_waiting.store(0, std::memory_order_relaxed);
+                return make_ready_future<stop_iteration>(stop_iteration::no);
+            }
+            return r.wait().then([] { return stop_iteration::no; });
+        });
+    }
+    future<> close() override {
+        _conn->close_output();
+        return make_ready_future<>();
+    }
+};
+
+class shm_connected_socket_impl final : public connected_socket_impl {
+    lw_shared_ptr<shm_connection> _conn;
+public:
+    explicit shm_connected_socket_impl(lw_shared_ptr<shm_connection> conn) : _conn(std::move(conn)) {}
+    ~shm_connected_socket_impl() {
+        _conn->shutdown();
+    }
+    virtual data_source source() override {
+        return data_source(std::make_unique<shm_data_source_impl>(_conn));
+    }
+    virtual data_sink sink() override {
+        return data_sink(std::make_unique<shm_data_sink_impl>(_conn));
+    }
+    virtual future<> shutdown_input() override {
+        _conn->input_shut = true;
+        _conn->in.kick();
+        return make_ready_future<>();
+    }
+    virtual future<> shutdown_output() override {
+        _conn->close_output();
+        return make_ready_future<>();
+    }
+    // Nothing is batched and the peer is watched through the rendezvous
+    // socket, so these only keep what they are told
+    virtual void set_nodelay(bool nodelay) override {}
+    virtual bool get_nodelay() const override {
+        return true;
+    }
+    virtual void set_keepalive(bool keepalive) override {
+        _conn->keepalive = keepalive;
+    }
+    virtual bool get_keepalive() const override {
+        return _conn->keepalive;
+    }
+    virtual void set_keepalive_parameters(const keepalive_params& p) override {
+        _conn->keepalive_parameters = p;
+    }
+    virtual keepalive_params get_keepalive_parameters() const override {
+        return _conn->keepalive_parameters;
+    }
+};
+
+connected_socket make_shm_connected_socket(connected_socket control, mmap_area segment, std::vector<file_desc> fds, bool connecting) {
+    auto conn = make_lw_shared<shm_connection>(std::move(control), std::move(segment), std::move(fds), connecting);
+    conn->watch_peer(conn);
+    return connected_socket(std::make_unique<shm_connected_socket_impl>(std::move(conn)));
+}
+
+// Maps what the connecting side sent, or throws if it is not a segment
+// we understand
+connected_socket accept_shm(connected_socket control, std::vector<file_desc> fds, const shm_options& opts) {
+    if (fds.size() != nr_shm_fds) {
+        throw std::system_error(EPROTO, std::system_category());
+    }
+    auto size = fds[segment_fd].size();
+    if (size < shm_header_size) {
+        throw std::system_error(EPROTO, std::system_category());
+    }
+    auto hdr = fds[segment_fd].map_shared_ro(shm_header_size, 0);
+    auto h = reinterpret_cast<const shm_segment_header*>(hdr.get());
+    auto ring_size = h->ring_size;
+    if (h->magic != shm_magic || h->version != shm_version
+            || !ring_size || (ring_size & (ring_size - 1)) || ring_size > opts.max_ring_size
+            || size != shm_header_size + 2 * ring_size) {
+        throw std::system_error(EPROTO, std::system_category());
+    }
+    auto segment = fds[segment_fd].map_shared_rw(size, 0);
+    return make_shm_connected_socket(std::move(control), std::move(segment), std::move(fds), false);
+}
+
+class shm_server_socket_impl final : public server_socket_impl {
+    server_socket _listener;
+    shm_options _opts;
+public:
+    shm_server_socket_impl(server_socket listener, shm_options opts)
+        : _listener(std::move(listener)), _opts(opts) {}
+    virtual future<connected_socket, socket_address> accept() override {
+        using conn = std::pair<connected_socket, socket_address>;
+        return repeat_until_value([this] {
+            return _listener.accept().then([this] (connected_socket s, socket_address sa) {
+                auto f = s.receive_file_descriptors();
+                return f.then_wrapped([this, s = std::move(s), sa] (future<std::vector<file_desc>> f) mutable {
+                    // A peer that fails the handshake is dropped, not
+                    // reported: the listener itself is fine
+                    try {
+                        return std::experimental::optional<conn>(conn(accept_shm(std::move(s), f.get0(), _opts), sa));
+                    } catch (...) {
+                        return std::experimental::optional<conn>();
+                    }
+                });
+            });
+        }).then([] (conn c) {
+            return make_ready_future<connected_socket, socket_address>(std::move(c.first), std::move(c.second));
+        });
+    }
+    virtual void abort_accept() override {
+        _listener.abort_accept();
+    }
+};
+
+class shm_socket_impl final : public socket_impl {
+    socket_address _rendezvous;
+    shm_options _opts;
+    ::seastar::socket _control;
+public:
+    shm_socket_impl(socket_address rendezvous, shm_options opts)
+        : _rendezvous(rendezvous), _opts(opts), _control(engine().net().socket()) {}
+    virtual future<connected_socket> connect(socket_address, socket_address, seastar::transport) override {
+        auto ring_size = _opts.ring_size;
+        if (!ring_size || (ring_size & (ring_size - 1))) {
+            return make_exception_future<connected_socket>(std::system_error(EINVAL, std::system_category()));
+        }
+        return _control.connect(_rendezvous).then([ring_size] (connected_socket s) {
+            std::vector<file_desc> fds;
+            fds.push_back(file_desc::temporary("/dev/shm"));
+            auto size = shm_header_size + 2 * ring_size;
+            fds[segment_fd].truncate(size);
+            auto segment = fds[segment_fd].map_shared_rw(size, 0);
+            auto hdr = new (segment.get()) shm_segment_header{};
+            hdr->magic = shm_magic;
+            hdr->version = shm_version;
+            hdr->ring_size = ring_size;
+            for (unsigned i = data0_fd; i < nr_shm_fds; ++i) {
+                fds.push_back(file_desc::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+            }
+            std::vector<int> raw;
+            for (auto& fd : fds) {
+                raw.push_back(fd.get());
+            }
+            auto f = s.send_file_descriptors(std::move(raw));
+            return f.then([s = std::move(s), segment = std::move(segment), fds = std::move(fds)] () mutable {
+                return make_shm_connected_socket(std::move(s), std::move(segment), std::move(fds), true);
+            });
+        });
+    }
+    virtual void shutdown() override {
+        _control.shutdown();
+    }
+};
+
+}
+
+server_socket shm_listen(socket_address sa, listen_options lo, shm_options opts) {
+    return server_socket(std::make_unique<shm_server_socket_impl>(engine().net().listen(sa, lo), opts));
+}
+
+::seastar::socket shm_socket(socket_address rendezvous, shm_options opts) {
+    return ::seastar::socket(std::make_unique<shm_socket_impl>(rendezvous, opts));
+}
+
+}
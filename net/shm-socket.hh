@@ -0,0 +1,59 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "api.hh"
+
+namespace net {
+
+/*
+ * Stream connections between processes on the same host that move data
+ * through a pair of single-producer single-consumer rings in shared memory
+ * instead of through the kernel.
+ *
+ * The connecting side creates the segment and four eventfds (data and
+ * space for each direction) and passes them over a Unix domain socket to
+ * the listener; that socket then only serves to notice the peer going
+ * away. An eventfd is written only when the other side has announced it
+ * is about to sleep, so a busy connection makes no system calls at all.
+ *
+ * A connection lives between the connecting shard and the shard the
+ * listener hands it to, like any accepted socket; give each shard its own
+ * rendezvous name to pin shard pairs.
+ */
+
+struct shm_options {
+    // Bytes buffered in each direction; a power of two. The connecting
+    // side picks it, the listener accepts anything up to max_ring_size.
+    size_t ring_size = 1 << 20;
+    size_t max_ring_size = 64 << 20;
+};
+
+// Accepts connections made with shm_socket() to the Unix domain address sa
+server_socket shm_listen(socket_address sa, listen_options lo = listen_options(), shm_options opts = shm_options());
+
+// A socket whose connect() rendezvouses at the Unix domain address given
+// here and ignores the one it is called with, so it can be handed to code
+// that only deals in IP addresses, such as rpc::protocol::client.
+::seastar::socket shm_socket(socket_address rendezvous, shm_options opts = shm_options());
+
+}
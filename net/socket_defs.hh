@@ -20,29 +20,64 @@
  */
 #pragma once
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/ip.h>
+#include <string>
 #include "net/byteorder.hh"
 
 struct ipv4_addr;
 
+// A Unix domain socket name: a filesystem path, or, with a leading '\0',
+// a name in the abstract namespace
+struct unix_domain_addr {
+    std::string path;
+    explicit unix_domain_addr(std::string p) : path(std::move(p)) {}
+};
+
 class socket_address {
 public:
     union {
         ::sockaddr_storage sas;
         ::sockaddr sa;
         ::sockaddr_in in;
+        ::sockaddr_in6 in6;
+        ::sockaddr_un un;
     } u;
+    // How much of u bind() and connect() look at; Unix domain names need
+    // the exact length
+    socklen_t addr_length = sizeof(::sockaddr_storage);
     socket_address(sockaddr_in sa) {
         u.in = sa;
     }
+    socket_address(sockaddr_in6 sa) {
+        u.in6 = sa;
+    }
     socket_address(ipv4_addr);
+    socket_address(const unix_domain_addr&);
     socket_address() = default;
     ::sockaddr& as_posix_sockaddr() { return u.sa; }
     ::sockaddr_in& as_posix_sockaddr_in() { return u.in; }
     const ::sockaddr& as_posix_sockaddr() const { return u.sa; }
     const ::sockaddr_in& as_posix_sockaddr_in() const { return u.in; }
+    ::sockaddr_in6& as_posix_sockaddr_in6() { return u.in6; }
+    const ::sockaddr_in6& as_posix_sockaddr_in6() const { return u.in6; }
+    socklen_t length() const { return addr_length; }
+    bool is_unix_domain() const { return u.sa.sa_family == AF_UNIX; }
 };
 
+// Compares the family and the address proper (IP address and port, or
+// Unix domain name)
+bool operator==(const socket_address& a, const socket_address& b);
+
+namespace std {
+
+template <>
+struct hash<socket_address> {
+    size_t operator()(const socket_address& a) const;
+};
+
+}
+
 namespace seastar {
 
 enum class transport {
@@ -53,8 +88,14 @@ enum class transport {
 }
 
 struct listen_options {
+    /// How the posix stack spreads accepted connections over shards
+    enum class load_balancing_algorithm {
+        connection_distribution, ///< round robin
+        port,                    ///< the peer's port modulo the number of shards, so a client picks the shard
+    };
     seastar::transport proto = seastar::transport::TCP;
     bool reuse_address = false;
+    load_balancing_algorithm lba = load_balancing_algorithm::connection_distribution;
     listen_options(bool rua = false)
         : reuse_address(rua)
     {}
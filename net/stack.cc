@@ -21,6 +21,8 @@
 
 #include "stack.hh"
 #include "core/reactor.hh"
+#include "core/future-util.hh"
+#include <cstddef>
 
 net::udp_channel::udp_channel()
 {}
@@ -38,6 +40,10 @@ future<net::udp_datagram> net::udp_channel::receive() {
     return _impl->receive();
 }
 
+future<std::vector<net::udp_datagram>> net::udp_channel::receive_batch(size_t max_datagrams) {
+    return _impl->receive_batch(max_datagrams);
+}
+
 future<> net::udp_channel::send(ipv4_addr dst, const char* msg) {
     return _impl->send(std::move(dst), msg);
 }
@@ -46,6 +52,26 @@ future<> net::udp_channel::send(ipv4_addr dst, packet p) {
     return _impl->send(std::move(dst), std::move(p));
 }
 
+future<> net::udp_channel::send(std::vector<std::pair<ipv4_addr, packet>> datagrams) {
+    return _impl->send(std::move(datagrams));
+}
+
+future<std::vector<net::udp_datagram>> net::udp_channel_impl::receive_batch(size_t max_datagrams) {
+    return receive().then([] (udp_datagram d) {
+        std::vector<udp_datagram> batch;
+        batch.push_back(std::move(d));
+        return batch;
+    });
+}
+
+future<> net::udp_channel_impl::send(std::vector<std::pair<ipv4_addr, packet>> datagrams) {
+    return do_with(std::move(datagrams), [this] (auto& datagrams) {
+        return do_for_each(datagrams, [this] (auto& d) {
+            return this->send(d.first, std::move(d.second));
+        });
+    });
+}
+
 bool net::udp_channel::is_closed() const {
     return _impl->is_closed();
 }
@@ -96,6 +122,24 @@ void connected_socket::set_keepalive_parameters(const net::keepalive_params& p)
 net::keepalive_params connected_socket::get_keepalive_parameters() const {
     return _csi->get_keepalive_parameters();
 }
+void connected_socket::set_congestion_control(const sstring& algorithm) {
+    _csi->set_congestion_control(algorithm);
+}
+net::tcp_congestion_info connected_socket::get_congestion_info() const {
+    return _csi->get_congestion_info();
+}
+void connected_socket::set_socket_options(const net::socket_options& opts) {
+    _csi->set_socket_options(opts);
+}
+net::socket_options connected_socket::get_socket_options() const {
+    return _csi->get_socket_options();
+}
+future<> connected_socket::send_file_descriptors(std::vector<int> fds) {
+    return _csi->send_file_descriptors(std::move(fds));
+}
+future<std::vector<file_desc>> connected_socket::receive_file_descriptors() {
+    return _csi->receive_file_descriptors();
+}
 
 future<> connected_socket::shutdown_output() {
     return _csi->shutdown_output();
@@ -148,3 +192,52 @@ socket_address::socket_address(ipv4_addr addr)
     : socket_address(make_ipv4_address(addr))
 {}
 
+socket_address::socket_address(const unix_domain_addr& addr) {
+    if (addr.path.size() >= sizeof(u.un.sun_path)) {
+        throw std::system_error(ENAMETOOLONG, std::system_category());
+    }
+    std::memset(&u.un, 0, sizeof(u.un));
+    u.un.sun_family = AF_UNIX;
+    std::copy(addr.path.begin(), addr.path.end(), u.un.sun_path);
+    // Abstract names are exactly as long as given, paths end with the '\0'
+    bool abstract = !addr.path.empty() && addr.path[0] == '\0';
+    addr_length = offsetof(::sockaddr_un, sun_path) + addr.path.size() + !abstract;
+}
+
+static size_t unix_name_length(const socket_address& a) {
+    auto len = std::min<size_t>(a.addr_length, sizeof(::sockaddr_un));
+    return len - std::min(len, offsetof(::sockaddr_un, sun_path));
+}
+
+bool operator==(const socket_address& a, const socket_address& b) {
+    if (a.u.sa.sa_family != b.u.sa.sa_family) {
+        return false;
+    }
+    switch (a.u.sa.sa_family) {
+    case AF_UNIX:
+        return unix_name_length(a) == unix_name_length(b)
+                && !std::memcmp(a.u.un.sun_path, b.u.un.sun_path, unix_name_length(a));
+    case AF_INET6:
+        return a.u.in6.sin6_port == b.u.in6.sin6_port
+                && !std::memcmp(&a.u.in6.sin6_addr, &b.u.in6.sin6_addr, sizeof(a.u.in6.sin6_addr));
+    default:
+        return a.u.in.sin_port == b.u.in.sin_port && a.u.in.sin_addr.s_addr == b.u.in.sin_addr.s_addr;
+    }
+}
+
+size_t std::hash<socket_address>::operator()(const socket_address& a) const {
+    switch (a.u.sa.sa_family) {
+    case AF_UNIX:
+        return std::hash<std::string>()(std::string(a.u.un.sun_path, unix_name_length(a)));
+    case AF_INET6: {
+        size_t h = a.u.in6.sin6_port;
+        for (auto b : a.u.in6.sin6_addr.s6_addr) {
+            h = h * 31 + b;
+        }
+        return h;
+    }
+    default:
+        return a.u.in.sin_port ^ a.u.in.sin_addr.s_addr;
+    }
+}
+
@@ -21,6 +21,7 @@
 #pragma once
 
 #include <chrono>
+#include <system_error>
 #include "api.hh"
 
 namespace net {
@@ -39,6 +40,35 @@ class connected_socket_impl {
     virtual bool get_keepalive() const = 0;
     virtual void set_keepalive_parameters(const keepalive_params&) = 0;
     virtual keepalive_params get_keepalive_parameters() const = 0;
+    virtual void set_congestion_control(const sstring& algorithm) {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    virtual tcp_congestion_info get_congestion_info() const {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    virtual void set_socket_options(const socket_options& opts) {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    virtual socket_options get_socket_options() const {
+        throw std::system_error(ENOPROTOOPT, std::system_category());
+    }
+    // Hands record encryption of everything sent from now on to the kernel
+    // (Linux kTLS), given a struct tls12_crypto_info_*. Returns false if the
+    // stack or the kernel cannot, and the caller keeps encrypting itself.
+    virtual bool enable_kernel_tls_tx(const void* crypto_info, size_t size) {
+        return false;
+    }
+    // Sends a non-application-data record (such as an alert) on a socket
+    // that enable_kernel_tls_tx() succeeded on.
+    virtual future<> send_kernel_tls_record(uint8_t content_type, const char* data, size_t size) {
+        return make_exception_future<>(std::system_error(ENOPROTOOPT, std::system_category()));
+    }
+    virtual future<> send_file_descriptors(std::vector<int> fds) {
+        return make_exception_future<>(std::system_error(ENOPROTOOPT, std::system_category()));
+    }
+    virtual future<std::vector<file_desc>> receive_file_descriptors() {
+        return make_exception_future<std::vector<file_desc>>(std::system_error(ENOPROTOOPT, std::system_category()));
+    }
 };
 
 class socket_impl {
@@ -59,8 +89,12 @@ class udp_channel_impl {
 public:
     virtual ~udp_channel_impl() {};
     virtual future<udp_datagram> receive() = 0;
+    // Receives one datagram at a time unless overridden
+    virtual future<std::vector<udp_datagram>> receive_batch(size_t max_datagrams);
     virtual future<> send(ipv4_addr dst, const char* msg) = 0;
     virtual future<> send(ipv4_addr dst, packet p) = 0;
+    // Sends one datagram after the other unless overridden
+    virtual future<> send(std::vector<std::pair<ipv4_addr, packet>> datagrams);
     virtual bool is_closed() const = 0;
     virtual void close() = 0;
 };
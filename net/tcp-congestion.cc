@@ -0,0 +1,318 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "tcp-congestion.hh"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+
+namespace net {
+
+using namespace std::chrono_literals;
+
+class tcp_reno final : public tcp_congestion_control {
+public:
+    virtual const char* name() const override {
+        return "reno";
+    }
+    virtual void on_ack(tcp_congestion_window w, const tcp_ack_sample& s) override {
+        uint32_t smss = w.mss;
+        if (w.cwnd < w.ssthresh) {
+            // In slow start phase
+            w.cwnd += std::min(s.acked_bytes, smss);
+        } else {
+            // In congestion avoidance phase
+            uint32_t round_up = 1;
+            w.cwnd += std::max(round_up, smss * smss / w.cwnd);
+        }
+    }
+    virtual void on_loss(tcp_congestion_window w, uint32_t flight_size) override {
+        // RFC5681: ssthresh = max (FlightSize / 2, 2*SMSS)
+        w.ssthresh = std::max(flight_size / 2, 2 * uint32_t(w.mss));
+    }
+};
+
+// RFC8312
+class tcp_cubic final : public tcp_congestion_control {
+    static constexpr double c = 0.4;
+    static constexpr double beta = 0.7;
+    // Window before the last reduction, in segments
+    double _w_max = 0;
+    // Reno-friendly window estimate, in segments
+    double _w_est = 0;
+    // Time for the cubic function to climb back to _w_max, in seconds
+    double _k = 0;
+    double _origin = 0;
+    bool _in_epoch = false;
+    steady_clock_type::time_point _epoch_start;
+    std::chrono::microseconds _min_rtt{0};
+private:
+    void reduce(tcp_congestion_window& w) {
+        double cwnd = double(w.cwnd) / w.mss;
+        // Fast convergence: release bandwidth to newer flows if the window
+        // did not reach its previous maximum
+        _w_max = cwnd < _w_max ? cwnd * (1 + beta) / 2 : cwnd;
+        w.ssthresh = std::max(uint32_t(w.cwnd * beta), 2 * uint32_t(w.mss));
+        _in_epoch = false;
+    }
+public:
+    virtual const char* name() const override {
+        return "cubic";
+    }
+    virtual void on_ack(tcp_congestion_window w, const tcp_ack_sample& s) override {
+        if (s.rtt.count() && (!_min_rtt.count() || s.rtt < _min_rtt)) {
+            _min_rtt = s.rtt;
+        }
+        if (w.cwnd < w.ssthresh) {
+            w.cwnd += std::min(s.acked_bytes, uint32_t(w.mss));
+            return;
+        }
+        double cwnd = double(w.cwnd) / w.mss;
+        if (!_in_epoch) {
+            _in_epoch = true;
+            _epoch_start = s.now;
+            if (cwnd < _w_max) {
+                _k = std::cbrt((_w_max - cwnd) / c);
+                _origin = _w_max;
+            } else {
+                _k = 0;
+                _origin = cwnd;
+            }
+            _w_est = cwnd;
+        }
+        // W_cubic(t + RTT) is where the window should be one RTT from now
+        auto t = std::chrono::duration<double>(s.now - _epoch_start + _min_rtt).count();
+        double target = _origin + c * std::pow(t - _k, 3);
+        // Stay at least as aggressive as Reno would be
+        _w_est += 3 * (1 - beta) / (1 + beta) * (double(s.acked_bytes) / w.mss) / cwnd;
+        target = std::max(target, _w_est);
+        target = std::min(target, cwnd * 1.5);
+        if (target > cwnd) {
+            uint32_t round_up = 1;
+            w.cwnd += std::max(round_up, uint32_t((target - cwnd) * s.acked_bytes / cwnd));
+        }
+    }
+    virtual void on_loss(tcp_congestion_window w, uint32_t flight_size) override {
+        reduce(w);
+    }
+    virtual void on_timeout(tcp_congestion_window w, uint32_t flight_size) override {
+        reduce(w);
+        _w_est = 0;
+    }
+    virtual std::chrono::microseconds min_rtt() const override {
+        return _min_rtt;
+    }
+};
+
+// BBR, after draft-cardwell-iccrg-bbr-congestion-control: model the
+// bottleneck bandwidth and the round trip propagation time, pace at the
+// former and keep cwnd near their product instead of reacting to loss.
+class tcp_bbr final : public tcp_congestion_control {
+    enum class mode { startup, drain, probe_bw, probe_rtt };
+    static constexpr double high_gain = 2.885;
+    static constexpr double cwnd_gain = 2;
+    static constexpr unsigned bw_window_rounds = 10;
+    static constexpr unsigned min_cwnd_segments = 4;
+    static constexpr std::chrono::seconds min_rtt_window{10};
+    static constexpr std::chrono::milliseconds probe_rtt_duration{200};
+    static const std::array<double, 8> pacing_gain_cycle;
+    mode _mode = mode::startup;
+    double _pacing_gain = high_gain;
+    double _cwnd_gain = high_gain;
+    // Per round maxima of the delivery rate, the bandwidth estimate is the
+    // largest of them
+    std::array<uint64_t, bw_window_rounds> _bw_samples = {};
+    uint64_t _round = 0;
+    uint64_t _next_round_delivered = 0;
+    bool _round_start = false;
+    // Startup ends once three rounds did not grow bandwidth by a quarter
+    uint64_t _full_bw = 0;
+    unsigned _full_bw_rounds = 0;
+    bool _filled_pipe = false;
+    std::chrono::microseconds _min_rtt{0};
+    steady_clock_type::time_point _min_rtt_stamp;
+    steady_clock_type::time_point _probe_rtt_done;
+    bool _probe_rtt_round_done = false;
+    unsigned _cycle_index = 0;
+    steady_clock_type::time_point _cycle_stamp;
+    uint32_t _prior_cwnd = 0;
+private:
+    uint64_t bw() const {
+        return *std::max_element(_bw_samples.begin(), _bw_samples.end());
+    }
+    // Bandwidth-delay product scaled by gain, in bytes
+    uint32_t target_cwnd(const tcp_congestion_window& w, double gain) const {
+        if (!_min_rtt.count() || !bw()) {
+            return min_cwnd_segments * w.mss;
+        }
+        auto bdp = double(bw()) * std::chrono::duration<double>(_min_rtt).count();
+        // Leave room for the segments stretched ACKs and TSO hold back
+        return std::max(uint32_t(gain * bdp) + 3 * w.mss, min_cwnd_segments * uint32_t(w.mss));
+    }
+    void update_round(const tcp_ack_sample& s) {
+        _round_start = false;
+        if (s.prior_delivered >= _next_round_delivered) {
+            _next_round_delivered = s.delivered;
+            _round++;
+            _round_start = true;
+            _bw_samples[_round % bw_window_rounds] = 0;
+        }
+    }
+    void update_bw(const tcp_ack_sample& s) {
+        auto& slot = _bw_samples[_round % bw_window_rounds];
+        slot = std::max(slot, s.delivery_rate);
+    }
+    void check_full_pipe() {
+        if (_filled_pipe || !_round_start) {
+            return;
+        }
+        if (bw() >= _full_bw * 5 / 4) {
+            _full_bw = bw();
+            _full_bw_rounds = 0;
+            return;
+        }
+        if (++_full_bw_rounds >= 3) {
+            _filled_pipe = true;
+        }
+    }
+    void enter_probe_bw(const tcp_ack_sample& s) {
+        _mode = mode::probe_bw;
+        _cwnd_gain = cwnd_gain;
+        // Start anywhere but the draining phase of the cycle
+        _cycle_index = (_round % (pacing_gain_cycle.size() - 1) + 2) % pacing_gain_cycle.size();
+        _pacing_gain = pacing_gain_cycle[_cycle_index];
+        _cycle_stamp = s.now;
+    }
+    void advance_cycle(tcp_congestion_window& w, const tcp_ack_sample& s) {
+        bool next = s.now - _cycle_stamp > _min_rtt;
+        // Probing up lasts until inflight reached the probed level,
+        // draining until it is back at the estimated BDP
+        if (_pacing_gain > 1) {
+            next = next && s.in_flight >= target_cwnd(w, _pacing_gain);
+        } else if (_pacing_gain < 1) {
+            next = next || s.in_flight <= target_cwnd(w, 1);
+        }
+        if (next) {
+            _cycle_index = (_cycle_index + 1) % pacing_gain_cycle.size();
+            _pacing_gain = pacing_gain_cycle[_cycle_index];
+            _cycle_stamp = s.now;
+        }
+    }
+    void update_min_rtt(tcp_congestion_window& w, const tcp_ack_sample& s) {
+        bool expired = s.now > _min_rtt_stamp + min_rtt_window;
+        if (s.rtt.count() && (s.rtt <= _min_rtt || !_min_rtt.count() || expired)) {
+            _min_rtt = s.rtt;
+            _min_rtt_stamp = s.now;
+        }
+        if (expired && _mode != mode::probe_rtt && _min_rtt.count()) {
+            // Drain the queue for a while so the real propagation delay shows
+            _mode = mode::probe_rtt;
+            _pacing_gain = 1;
+            _prior_cwnd = w.cwnd;
+            _probe_rtt_done = steady_clock_type::time_point();
+            _probe_rtt_round_done = false;
+        }
+        if (_mode == mode::probe_rtt) {
+            if (_probe_rtt_done == steady_clock_type::time_point()
+                    && s.in_flight <= min_cwnd_segments * uint32_t(w.mss)) {
+                _probe_rtt_done = s.now + probe_rtt_duration;
+                _next_round_delivered = s.delivered;
+            } else if (_probe_rtt_done != steady_clock_type::time_point()) {
+                _probe_rtt_round_done |= _round_start;
+                if (_probe_rtt_round_done && s.now > _probe_rtt_done) {
+                    _min_rtt_stamp = s.now;
+                    w.cwnd = std::max(w.cwnd, _prior_cwnd);
+                    if (_filled_pipe) {
+                        enter_probe_bw(s);
+                    } else {
+                        _mode = mode::startup;
+                        _pacing_gain = _cwnd_gain = high_gain;
+                    }
+                }
+            }
+        }
+    }
+    void set_cwnd(tcp_congestion_window& w, const tcp_ack_sample& s) {
+        if (_mode == mode::probe_rtt) {
+            w.cwnd = std::min(w.cwnd, min_cwnd_segments * uint32_t(w.mss));
+            return;
+        }
+        auto target = target_cwnd(w, _cwnd_gain);
+        if (_filled_pipe) {
+            w.cwnd = std::min(w.cwnd + s.acked_bytes, target);
+        } else if (w.cwnd < target || s.delivered < 10 * w.mss) {
+            w.cwnd += s.acked_bytes;
+        }
+        w.cwnd = std::max(w.cwnd, min_cwnd_segments * uint32_t(w.mss));
+    }
+public:
+    virtual const char* name() const override {
+        return "bbr";
+    }
+    virtual void on_ack(tcp_congestion_window w, const tcp_ack_sample& s) override {
+        update_round(s);
+        update_bw(s);
+        check_full_pipe();
+        if (_mode == mode::startup && _filled_pipe) {
+            _mode = mode::drain;
+            _pacing_gain = 1 / high_gain;
+            _cwnd_gain = high_gain;
+        }
+        if (_mode == mode::drain && s.in_flight <= target_cwnd(w, 1)) {
+            enter_probe_bw(s);
+        }
+        if (_mode == mode::probe_bw) {
+            advance_cycle(w, s);
+        }
+        update_min_rtt(w, s);
+        set_cwnd(w, s);
+        // The tcb's loss recovery steers by ssthresh, keep it at the model
+        w.ssthresh = std::max(w.cwnd, target_cwnd(w, 1));
+    }
+    virtual void on_loss(tcp_congestion_window w, uint32_t flight_size) override {
+        // Loss is not a congestion signal for BBR, recover back to the model
+        w.ssthresh = std::max(target_cwnd(w, 1), 2 * uint32_t(w.mss));
+    }
+    virtual uint64_t pacing_rate() const override {
+        return uint64_t(_pacing_gain * bw());
+    }
+    virtual std::chrono::microseconds min_rtt() const override {
+        return _min_rtt;
+    }
+};
+
+const std::array<double, 8> tcp_bbr::pacing_gain_cycle = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+constexpr std::chrono::seconds tcp_bbr::min_rtt_window;
+constexpr std::chrono::milliseconds tcp_bbr::probe_rtt_duration;
+
+std::unique_ptr<tcp_congestion_control> make_tcp_congestion_control(const sstring& name) {
+    if (name == "reno") {
+        return std::make_unique<tcp_reno>();
+    } else if (name == "cubic") {
+        return std::make_unique<tcp_cubic>();
+    } else if (name == "bbr") {
+        return std::make_unique<tcp_bbr>();
+    }
+    throw std::invalid_argument("unknown TCP congestion control algorithm: " + std::string(name.c_str()));
+}
+
+}
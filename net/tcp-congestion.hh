@@ -0,0 +1,88 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Congestion control algorithms of the native TCP stack
+
+#pragma once
+
+#include "core/sstring.hh"
+#include "core/timer.hh"
+#include <chrono>
+#include <memory>
+#include <cstdint>
+
+namespace net {
+
+// The part of a tcb's send state a congestion controller owns; a view, so
+// it is passed around by value
+struct tcp_congestion_window {
+    uint32_t& cwnd;
+    uint32_t& ssthresh;
+    uint16_t mss;
+};
+
+// What the tcb learned from a segment being acknowledged
+struct tcp_ack_sample {
+    steady_clock_type::time_point now;
+    uint32_t acked_bytes;
+    // Bytes still outstanding
+    uint32_t in_flight;
+    // Round trip time of the acknowledged segment; zero when it was
+    // retransmitted and the sample is ambiguous
+    std::chrono::microseconds rtt;
+    // Total bytes delivered to the remote, and the same counter when the
+    // acknowledged segment was sent
+    uint64_t delivered;
+    uint64_t prior_delivered;
+    // Delivery rate over the flight of the acknowledged segment, in bytes
+    // per second; zero when no sample could be taken
+    uint64_t delivery_rate;
+};
+
+class tcp_congestion_control {
+public:
+    virtual ~tcp_congestion_control() {}
+    virtual const char* name() const = 0;
+    // New data was acknowledged
+    virtual void on_ack(tcp_congestion_window w, const tcp_ack_sample& s) = 0;
+    // Loss detected by duplicate ACKs or SACK; sets ssthresh.  The tcb then
+    // drives fast recovery from it.
+    virtual void on_loss(tcp_congestion_window w, uint32_t flight_size) = 0;
+    // Retransmission timeout; sets ssthresh, the tcb collapses cwnd to one
+    // segment afterwards
+    virtual void on_timeout(tcp_congestion_window w, uint32_t flight_size) {
+        on_loss(w, flight_size);
+    }
+    // Rate, in bytes per second, the output path must pace segments at;
+    // zero when the algorithm does not pace.
+    virtual uint64_t pacing_rate() const {
+        return 0;
+    }
+    virtual std::chrono::microseconds min_rtt() const {
+        return std::chrono::microseconds(0);
+    }
+};
+
+// Creates the algorithm called name: "reno", "cubic" or "bbr".  Throws
+// std::invalid_argument for anything else.
+std::unique_ptr<tcp_congestion_control> make_tcp_congestion_control(const sstring& name);
+
+}
@@ -22,12 +22,31 @@
 #include "tcp.hh"
 #include "tcp-stack.hh"
 #include "ip.hh"
+#include "ipv6.hh"
 #include "core/align.hh"
 #include "core/future.hh"
 #include "native-stack-impl.hh"
 
 namespace net {
 
+rx_latency_sampler::rx_latency_sampler() {
+    namespace sm = seastar::metrics;
+    _metrics.add_group("tcp", {
+        sm::make_histogram("rx_to_read_latency_us", [this] { return _hist.to_metrics_histogram(1e-3); },
+                sm::description("Time from the driver receiving a segment until the application read it, in microseconds")),
+    });
+}
+
+rx_latency_sampler& rx_latency_sampler::local() {
+    static thread_local rx_latency_sampler sampler;
+    return sampler;
+}
+
+void rx_latency_sampler::sample(uint64_t rx_timestamp) {
+    uint64_t now = tsc_clock::now().time_since_epoch().count();
+    _hist.add(now > rx_timestamp ? now - rx_timestamp : 0);
+}
+
 void tcp_option::parse(uint8_t* beg1, uint8_t* end1) {
     const char* beg = reinterpret_cast<const char*>(beg1);
     const char* end = reinterpret_cast<const char*>(end1);
@@ -54,9 +73,16 @@ void tcp_option::parse(uint8_t* beg1, uint8_t* end1) {
             beg += option_len::win_scale;
             break;
         case option_kind::sack:
+            // SACK-permitted; the SACK blocks themselves only appear after
+            // the handshake, see parse_sack_blocks()
             _sack_received = true;
             beg += option_len::sack;
             break;
+        case option_kind::timestamps:
+            _timestamps_received = true;
+            _ts_recent = timestamps::read(beg).t1;
+            beg += option_len::timestamps;
+            break;
         case option_kind::nop:
             beg += option_len::nop;
             break;
@@ -75,6 +101,47 @@ void tcp_option::parse(uint8_t* beg1, uint8_t* end1) {
     }
 }
 
+const char* tcp_option::find(uint8_t* beg1, uint8_t* end1, option_kind wanted) {
+    const char* beg = reinterpret_cast<const char*>(beg1);
+    const char* end = reinterpret_cast<const char*>(end1);
+    while (beg < end) {
+        auto kind = option_kind(*beg);
+        if (kind == option_kind::eol) {
+            break;
+        }
+        if (kind == option_kind::nop) {
+            beg += option_len::nop;
+            continue;
+        }
+        if (beg + 1 >= end) {
+            break;
+        }
+        auto len = uint8_t(beg[1]);
+        // Prevent infinite loop and make sure the option fits
+        if (len == 0 || beg + len > end) {
+            break;
+        }
+        if (kind == wanted) {
+            return beg;
+        }
+        beg += len;
+    }
+    return nullptr;
+}
+
+tcp_option::sack_blocks tcp_option::parse_sack_blocks(uint8_t* beg, uint8_t* end) {
+    auto p = find(beg, end, option_kind::sack_blocks);
+    return p ? sack_blocks::read(p) : sack_blocks();
+}
+
+std::experimental::optional<tcp_option::timestamps> tcp_option::parse_timestamps(uint8_t* beg, uint8_t* end) {
+    auto p = find(beg, end, option_kind::timestamps);
+    if (!p || uint8_t(p[1]) != uint8_t(option_len::timestamps)) {
+        return {};
+    }
+    return timestamps::read(p);
+}
+
 uint8_t tcp_option::fill(void* h, const tcp_hdr* th, uint8_t options_size) {
     auto hdr = reinterpret_cast<char*>(h);
     auto off = hdr + tcp_hdr::len;
@@ -97,6 +164,25 @@ uint8_t tcp_option::fill(void* h, const tcp_hdr* th, uint8_t options_size) {
             off += win_scale.len;
             size += win_scale.len;
         }
+        if (_sack_received || !ack_on) {
+            auto sack = tcp_option::sack();
+            sack.write(off);
+            off += sack.len;
+            size += sack.len;
+        }
+    } else if (ack_on && _local_sack_blocks.nr_blocks) {
+        _local_sack_blocks.write(off);
+        off += _local_sack_blocks.len();
+        size += _local_sack_blocks.len();
+    }
+    if (_timestamps_received || (syn_on && !ack_on)) {
+        auto ts = tcp_option::timestamps();
+        ts.t1 = _ts_val;
+        // TSecr is only meaningful with the ACK bit set
+        ts.t2 = ack_on ? _ts_recent : 0;
+        ts.write(off);
+        off += ts.len;
+        size += ts.len;
     }
     if (size > 0) {
         // Insert NOP option
@@ -125,6 +211,14 @@ uint8_t tcp_option::get_size(bool syn_on, bool ack_on) {
         if (_win_scale_received || !ack_on) {
             size += option_len::win_scale;
         }
+        if (_sack_received || !ack_on) {
+            size += option_len::sack;
+        }
+    } else if (ack_on && _local_sack_blocks.nr_blocks) {
+        size += _local_sack_blocks.len();
+    }
+    if (_timestamps_received || (syn_on && !ack_on)) {
+        size += option_len::timestamps;
     }
     if (size > 0) {
         size += option_len::eol;
@@ -162,5 +256,32 @@ tcpv4_socket(tcp<ipv4_traits>& tcpv4) {
             tcpv4));
 }
 
+ipv6_tcp::ipv6_tcp(ipv6& inet)
+    : _inet_l4(inet), _tcp(std::make_unique<tcp<ipv6_traits>>(_inet_l4)) {
+}
+
+ipv6_tcp::~ipv6_tcp() {
+}
+
+void ipv6_tcp::received(packet p, ipv6_address from, ipv6_address to) {
+    _tcp->received(std::move(p), from, to);
+}
+
+bool ipv6_tcp::forward(forward_hash& out_hash_data, packet& p, size_t off) {
+    return _tcp->forward(out_hash_data, p, off);
+}
+
+server_socket
+tcpv6_listen(tcp<ipv6_traits>& tcpv6, uint16_t port, listen_options opts) {
+    return server_socket(std::make_unique<native_server_socket_impl<tcp<ipv6_traits>>>(
+            tcpv6, port, opts));
+}
+
+::seastar::socket
+tcpv6_socket(tcp<ipv6_traits>& tcpv6) {
+    return ::seastar::socket(std::make_unique<native_socket_impl<tcp<ipv6_traits>>>(
+            tcpv6));
+}
+
 }
 
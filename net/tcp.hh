@@ -27,18 +27,27 @@
 #include "core/semaphore.hh"
 #include "core/print.hh"
 #include "core/byteorder.hh"
+#include "core/object_pool.hh"
 #include "net.hh"
 #include "ip_checksum.hh"
 #include "ip.hh"
 #include "const.hh"
 #include "packet-util.hh"
+#include "tcp-congestion.hh"
+#include "connection_table.hh"
+#include "core/timer-wheel.hh"
+#include "core/metrics.hh"
+#include "core/log_histogram.hh"
 #include <unordered_map>
 #include <map>
+#include <array>
 #include <functional>
+#include <utility>
 #include <deque>
 #include <chrono>
 #include <experimental/optional>
 #include <random>
+#include <limits>
 #include <stdexcept>
 #include <system_error>
 
@@ -92,10 +101,40 @@ void tcp_debug(const char* fmt, Args&&... args) {
 #endif
 }
 
+struct tcp_seq {
+    uint32_t raw;
+};
+
+inline tcp_seq ntoh(tcp_seq s) {
+    return tcp_seq { ntoh(s.raw) };
+}
+
+inline tcp_seq hton(tcp_seq s) {
+    return tcp_seq { hton(s.raw) };
+}
+
+inline
+std::ostream& operator<<(std::ostream& os, tcp_seq s) {
+    return os << s.raw;
+}
+
+inline tcp_seq make_seq(uint32_t raw) { return tcp_seq{raw}; }
+inline tcp_seq& operator+=(tcp_seq& s, int32_t n) { s.raw += n; return s; }
+inline tcp_seq& operator-=(tcp_seq& s, int32_t n) { s.raw -= n; return s; }
+inline tcp_seq operator+(tcp_seq s, int32_t n) { return s += n; }
+inline tcp_seq operator-(tcp_seq s, int32_t n) { return s -= n; }
+inline int32_t operator-(tcp_seq s, tcp_seq q) { return s.raw - q.raw; }
+inline bool operator==(tcp_seq s, tcp_seq q)  { return s.raw == q.raw; }
+inline bool operator!=(tcp_seq s, tcp_seq q) { return !(s == q); }
+inline bool operator<(tcp_seq s, tcp_seq q) { return s - q < 0; }
+inline bool operator>(tcp_seq s, tcp_seq q) { return q < s; }
+inline bool operator<=(tcp_seq s, tcp_seq q) { return !(s > q); }
+inline bool operator>=(tcp_seq s, tcp_seq q) { return !(s < q); }
+
 struct tcp_option {
     // The kind and len field are fixed and defined in TCP protocol
-    enum class option_kind: uint8_t { mss = 2, win_scale = 3, sack = 4, timestamps = 8,  nop = 1, eol = 0 };
-    enum class option_len:  uint8_t { mss = 4, win_scale = 3, sack = 2, timestamps = 10, nop = 1, eol = 1 };
+    enum class option_kind: uint8_t { mss = 2, win_scale = 3, sack = 4, sack_blocks = 5, timestamps = 8,  nop = 1, eol = 0 };
+    enum class option_len:  uint8_t { mss = 4, win_scale = 3, sack = 2, sack_blocks = 2, timestamps = 10, nop = 1, eol = 1 };
     static void write(char* p, option_kind kind, option_len len) {
         p[0] = static_cast<uint8_t>(kind);
         if (static_cast<uint8_t>(len) > 1) {
@@ -140,9 +179,52 @@ struct tcp_option {
             tcp_option::write(p, kind, len);
         }
     };
+    // The SACK option proper (RFC2018): a variable number of blocks, each
+    // describing a range of data the receiver holds above its cumulative ACK.
+    struct sack_blocks {
+        static constexpr option_kind kind = option_kind::sack_blocks;
+        // Header plus 4 blocks is the most the 40 bytes of option space hold
+        static constexpr unsigned max_blocks = 4;
+        static constexpr uint8_t block_len = 8;
+        struct block {
+            tcp_seq left;
+            tcp_seq right;
+        };
+        std::array<block, max_blocks> blocks;
+        uint8_t nr_blocks = 0;
+        uint8_t len() const {
+            return uint8_t(option_len::sack_blocks) + nr_blocks * block_len;
+        }
+        static tcp_option::sack_blocks read(const char* p) {
+            tcp_option::sack_blocks x;
+            auto len = uint8_t(p[1]);
+            if (len > uint8_t(option_len::sack_blocks)) {
+                unsigned n = (len - uint8_t(option_len::sack_blocks)) / block_len;
+                x.nr_blocks = n < max_blocks ? n : max_blocks;
+            }
+            for (unsigned i = 0; i < x.nr_blocks; ++i) {
+                auto b = p + uint8_t(option_len::sack_blocks) + i * block_len;
+                x.blocks[i].left = tcp_seq{read_be<uint32_t>(b)};
+                x.blocks[i].right = tcp_seq{read_be<uint32_t>(b + 4)};
+            }
+            return x;
+        }
+        void write(char* p) const {
+            p[0] = static_cast<uint8_t>(kind);
+            p[1] = len();
+            for (unsigned i = 0; i < nr_blocks; ++i) {
+                auto b = p + uint8_t(option_len::sack_blocks) + i * block_len;
+                write_be<uint32_t>(b, blocks[i].left.raw);
+                write_be<uint32_t>(b + 4, blocks[i].right.raw);
+            }
+        }
+    };
     struct timestamps {
         static constexpr option_kind kind = option_kind::timestamps;
         static constexpr option_len len = option_len::timestamps;
+        // With the padding that aligns it, what the option takes out of
+        // every segment
+        static constexpr uint8_t aligned_len = 12;
         uint32_t t1;
         uint32_t t2;
         static tcp_option::timestamps read(const char* p) {
@@ -174,6 +256,10 @@ struct tcp_option {
     static const uint8_t align = 4;
 
     void parse(uint8_t* beg, uint8_t* end);
+    // Extract the SACK blocks of a non-SYN segment
+    static sack_blocks parse_sack_blocks(uint8_t* beg, uint8_t* end);
+    // Extract TSval and TSecr of a non-SYN segment
+    static std::experimental::optional<timestamps> parse_timestamps(uint8_t* beg, uint8_t* end);
     uint8_t fill(void* h, const tcp_hdr* th, uint8_t option_size);
     uint8_t get_size(bool syn_on, bool ack_on);
 
@@ -181,48 +267,29 @@ struct tcp_option {
     bool _mss_received = false;
     bool _win_scale_received = false;
     bool _timestamps_received = false;
+    // Remote sent SACK-permitted, so both sides may exchange SACK blocks
     bool _sack_received = false;
 
+    // SACK blocks to attach to the next outgoing ACK
+    sack_blocks _local_sack_blocks;
+    // RFC7323 timestamps: TSval of the next outgoing segment, and the
+    // remote's TSval we echo back (TS.Recent)
+    uint32_t _ts_val = 0;
+    uint32_t _ts_recent = 0;
+
     // Option data
     uint16_t _remote_mss = 536;
     uint16_t _local_mss;
     uint8_t _remote_win_scale = 0;
     uint8_t _local_win_scale = 0;
+private:
+    // Start of the first option of the given kind, nullptr if there is none
+    static const char* find(uint8_t* beg, uint8_t* end, option_kind kind);
 };
 inline char*& operator+=(char*& x, tcp_option::option_len len) { x += uint8_t(len); return x; }
 inline const char*& operator+=(const char*& x, tcp_option::option_len len) { x += uint8_t(len); return x; }
 inline uint8_t& operator+=(uint8_t& x, tcp_option::option_len len) { x += uint8_t(len); return x; }
 
-struct tcp_seq {
-    uint32_t raw;
-};
-
-inline tcp_seq ntoh(tcp_seq s) {
-    return tcp_seq { ntoh(s.raw) };
-}
-
-inline tcp_seq hton(tcp_seq s) {
-    return tcp_seq { hton(s.raw) };
-}
-
-inline
-std::ostream& operator<<(std::ostream& os, tcp_seq s) {
-    return os << s.raw;
-}
-
-inline tcp_seq make_seq(uint32_t raw) { return tcp_seq{raw}; }
-inline tcp_seq& operator+=(tcp_seq& s, int32_t n) { s.raw += n; return s; }
-inline tcp_seq& operator-=(tcp_seq& s, int32_t n) { s.raw -= n; return s; }
-inline tcp_seq operator+(tcp_seq s, int32_t n) { return s += n; }
-inline tcp_seq operator-(tcp_seq s, int32_t n) { return s -= n; }
-inline int32_t operator-(tcp_seq s, tcp_seq q) { return s.raw - q.raw; }
-inline bool operator==(tcp_seq s, tcp_seq q)  { return s.raw == q.raw; }
-inline bool operator!=(tcp_seq s, tcp_seq q) { return !(s == q); }
-inline bool operator<(tcp_seq s, tcp_seq q) { return s - q < 0; }
-inline bool operator>(tcp_seq s, tcp_seq q) { return q < s; }
-inline bool operator<=(tcp_seq s, tcp_seq q) { return !(s > q); }
-inline bool operator>=(tcp_seq s, tcp_seq q) { return !(s < q); }
-
 struct tcp_hdr {
     static constexpr size_t len = 20;
     uint16_t src_port;
@@ -286,6 +353,19 @@ struct tcp_hdr {
 struct tcp_tag {};
 using tcp_packet_merger = packet_merger<tcp_seq, tcp_tag>;
 
+// Per shard distribution of how long received data waits between the
+// driver picking it up (offload_info::rx_timestamp) and the application
+// reading it; shared by the IPv4 and IPv6 instances
+class rx_latency_sampler {
+    // nanosecond samples, first bucket ~1us, last ~8s
+    seastar::log_histogram<24, 10> _hist;
+    seastar::metrics::metric_groups _metrics;
+public:
+    rx_latency_sampler();
+    static rx_latency_sampler& local();
+    void sample(uint64_t rx_timestamp);
+};
+
 template <typename InetTraits>
 class tcp {
 public:
@@ -298,7 +378,10 @@ class tcp {
 private:
     class tcb;
 
-    class tcb : public enable_lw_shared_from_this<tcb> {
+    class tcb : public enable_lw_shared_from_this<tcb>, public seastar::pooled<tcb> {
+    public:
+        static const char* object_pool_name() { return "tcp_tcb"; }
+    private:
         using clock_type = lowres_clock;
         static constexpr tcp_state CLOSED         = tcp_state::CLOSED;
         static constexpr tcp_state LISTEN         = tcp_state::LISTEN;
@@ -323,7 +406,16 @@ class tcp {
             packet p;
             uint16_t data_len;
             unsigned nr_transmits;
-            clock_type::time_point tx_time;
+            tcp_seq seq;
+            // Covered by a SACK block, the remote holds this data
+            bool sacked;
+            // Deemed lost by RACK
+            bool lost;
+            // For delivery rate samples: when the segment was last sent,
+            // and the delivery counters at that time
+            steady_clock_type::time_point sent_time;
+            uint64_t delivered;
+            steady_clock_type::time_point delivered_time;
         };
         struct send {
             tcp_seq unacknowledged;
@@ -345,6 +437,8 @@ class tcp {
             // Limit number of data queued into send queue
             size_t max_queue_space = 212992;
             size_t current_queue_space = 0;
+            // Writers also wait while more than this is queued but unsent
+            size_t notsent_lowat = std::numeric_limits<size_t>::max();
             // wait for there is at least one byte available in the queue
             std::experimental::optional<promise<>> _send_available_promise;
             // Round-trip time variation
@@ -352,11 +446,19 @@ class tcp {
             // Smoothed round-trip time
             std::chrono::milliseconds srtt;
             bool first_rto_sample = true;
-            clock_type::time_point syn_tx_time;
+            steady_clock_type::time_point syn_tx_time;
             // Congestion window
             uint32_t cwnd;
             // Slow start threshold
             uint32_t ssthresh;
+            // Bytes acknowledged so far, and when the last of them were
+            uint64_t delivered = 0;
+            steady_clock_type::time_point delivered_time;
+            // Earliest time the pacer lets the next segment out
+            steady_clock_type::time_point next_send_time;
+            // Smoothed round-trip time on the finer clock, pacing derives
+            // its rate from it
+            std::chrono::microseconds fine_srtt{0};
             // Duplicated ACKs
             uint16_t dupacks = 0;
             unsigned syn_retransmit = 0;
@@ -364,7 +466,12 @@ class tcp {
             uint32_t limited_transfer = 0;
             uint32_t partial_ack = 0;
             tcp_seq recover;
+            // Highest sequence number retransmitted during the current loss
+            // recovery (RFC6675 HighRxt)
+            tcp_seq high_rxt;
             bool window_probe = false;
+            // Next segment is a tail loss probe carrying new data
+            bool loss_probe = false;
         } _snd;
         struct receive {
             tcp_seq next;
@@ -375,6 +482,9 @@ class tcp {
             tcp_seq initial;
             std::deque<packet> data;
             tcp_packet_merger out_of_order;
+            // Start of the most recent out of order segment, reported first
+            // in the SACK blocks we send
+            tcp_seq last_out_of_order;
             std::experimental::optional<promise<>> _data_received_promise;
         } _rcv;
         tcp_option _option;
@@ -382,14 +492,40 @@ class tcp {
         // Retransmission timeout
         std::chrono::milliseconds _rto{1000};
         std::chrono::milliseconds _persist_time_out{1000};
-        static constexpr std::chrono::milliseconds _rto_min{1000};
         static constexpr std::chrono::milliseconds _rto_max{60000};
+        // Worst case delayed ACK of the remote, a lone tail segment may wait
+        // that long for its ACK
+        static constexpr std::chrono::milliseconds _tlp_max_ack_delay{200};
         // Clock granularity
         static constexpr std::chrono::milliseconds _rto_clk_granularity{1};
         static constexpr uint16_t _max_nr_retransmit{5};
-        timer<lowres_clock> _retransmit;
+        // Duplicate ACKs (or SACKed segments above a hole) that signal a loss
+        static constexpr uint16_t _dupthresh{3};
+        // Retransmission timeout, tail loss probe and RACK reordering timer
+        // share one timer (RFC8985 8); what it is armed for:
+        enum class rxt_timer { rto, probe, reorder };
+        rxt_timer _rxt_mode = rxt_timer::rto;
+        timer<> _retransmit;
         timer<lowres_clock> _persist;
+        // RACK-TLP (RFC8985) state
+        struct rack {
+            // Send time and end of the most recently sent segment known to
+            // be delivered, and the round trip it took
+            steady_clock_type::time_point xmit_ts;
+            tcp_seq end_seq;
+            std::chrono::microseconds rtt{0};
+            std::chrono::microseconds min_rtt{0};
+            // A tail loss probe is in flight, up to probe_end
+            bool probe_outstanding = false;
+            bool probe_retransmitted = false;
+            tcp_seq probe_end;
+        } _rack;
+        // TSval clock offset, so that it does not leak our uptime
+        uint32_t _ts_offset;
+        std::unique_ptr<tcp_congestion_control> _cc;
         uint16_t _nr_full_seg_received = 0;
+        // Acknowledge every segment instead of delaying ACKs
+        bool _quickack = false;
         struct isn_secret {
             // 512 bits secretkey for ISN generating
             uint32_t key[16];
@@ -404,14 +540,33 @@ class tcp {
         };
         static isn_secret _isn_secret;
         tcp_seq get_isn();
+        // MSS values a cookie can encode, the peer gets the largest it allows
+        static constexpr uint16_t syncookie_mss[] = { 536, 1300, 1440, 1460 };
+        static constexpr uint32_t syncookie_data_mask = 0xffffff;
+        static std::array<uint32_t, 4> syncookie_hash(const connid& id, uint32_t count);
+        static uint32_t syncookie_count();
         circular_buffer<typename InetTraits::l4packet> _packetq;
         bool _poll_active = false;
     public:
+        // Entry of this tcb in the shard's pacing wheel, while it waits for
+        // its next send time
+        struct pacing_slot {
+            using clock = steady_clock_type;
+            using time_point = clock::time_point;
+            using duration = clock::duration;
+            bi::list_member_hook<> link;
+            time_point timeout;
+            tcb* owner = nullptr;
+            time_point get_timeout() { return timeout; }
+            bool cancel() { return false; }  // needed by timer_wheel
+        } _pacing_slot;
         tcb(tcp& t, connid id);
         void input_handle_listen_state(tcp_hdr* th, packet p);
+        // The handshake-completing ACK of a SYN answered with a cookie
+        void input_handle_syncookie(tcp_hdr* th, uint16_t mss, packet p);
         void input_handle_syn_sent_state(tcp_hdr* th, packet p);
         void input_handle_other_state(tcp_hdr* th, packet p);
-        void output_one(bool data_retransmit = false);
+        void output_one(unacked_segment* retransmit_seg = nullptr);
         future<> wait_for_data();
         void abort_reader();
         future<> wait_for_all_data_acked();
@@ -419,6 +574,15 @@ class tcp {
         future<> send(packet p);
         void connect();
         packet read();
+        void read_batch(std::deque<packet>& batch);
+        // One sample per read, from the segment that waited the longest
+        void sample_rx_latency() {
+            if (!_rcv.data.empty()) {
+                if (auto ts = _rcv.data.front().offload_info().rx_timestamp) {
+                    rx_latency_sampler::local().sample(ts);
+                }
+            }
+        }
         void close();
         void remove_from_tcbs() {
             auto id = connid{_local_ip, _foreign_ip, _local_port, _foreign_port};
@@ -451,6 +615,17 @@ class tcp {
         tcp_state& state() {
             return _state;
         }
+        // SYN cookies (RFC4987 3.6): the ISN of a <SYN,ACK> sent without a
+        // tcb encodes the connection, a coarse timestamp and the peer's MSS,
+        // so that the ACK alone can set the connection up.  Window scaling,
+        // SACK and timestamps are not negotiated on such connections.
+        static tcp_seq make_syncookie(const connid& id, tcp_seq client_isn, uint16_t mss);
+        // Cookies are accepted for one to two periods after they were sent
+        static constexpr std::chrono::seconds syncookie_period{64};
+        // The MSS a cookie encodes, unless it is forged or too old
+        static std::experimental::optional<uint16_t> check_syncookie(const connid& id, tcp_seq client_isn, tcp_seq cookie);
+        // Counted in its listener's SYN backlog until established or gone
+        bool _half_open = false;
     private:
         void respond_with_reset(tcp_hdr* th);
         bool merge_out_of_order();
@@ -460,19 +635,28 @@ class tcp {
         void clear_delayed_ack();
         packet get_transmit_packet();
         void retransmit_one() {
-            bool data_retransmit = true;
-            output_one(data_retransmit);
+            retransmit_one(_snd.data.front());
+        }
+        void retransmit_one(unacked_segment& seg) {
+            if (_snd.high_rxt < seg.seq + seg.p.len()) {
+                _snd.high_rxt = seg.seq + seg.p.len();
+            }
+            _tcp._stats.retransmits++;
+            output_one(&seg);
         }
         void start_retransmit_timer() {
-            auto now = clock_type::now();
-            start_retransmit_timer(now);
-        };
-        void start_retransmit_timer(clock_type::time_point now) {
-            auto tp = now + _rto;
-            _retransmit.rearm(tp);
+            auto timeout = std::chrono::duration_cast<steady_clock_type::duration>(_rto);
+            auto pto = loss_probe_timeout();
+            _rxt_mode = rxt_timer::rto;
+            if (pto.count() && pto < timeout) {
+                timeout = pto;
+                _rxt_mode = rxt_timer::probe;
+            }
+            _retransmit.rearm(steady_clock_type::now() + timeout);
         };
         void stop_retransmit_timer() {
             _retransmit.cancel();
+            _rxt_mode = rxt_timer::rto;
         };
         void start_persist_timer() {
             auto now = clock_type::now();
@@ -488,13 +672,76 @@ class tcp {
         void persist();
         void retransmit();
         void fast_retransmit();
-        void update_rto(clock_type::time_point tx_time);
-        void update_cwnd(uint32_t acked_bytes);
+        void sack_retransmit();
+        uint32_t update_scoreboard(const tcp_option::sack_blocks& sack);
+        void fill_sack_blocks();
+        void update_rto(std::chrono::milliseconds R);
+        void send_loss_probe();
+        void rack_update(unacked_segment& seg, steady_clock_type::time_point now);
+        void rack_detect_loss();
+        // RFC8985 7.2: time until the tail loss probe, zero when none is
+        // to be sent
+        std::chrono::microseconds loss_probe_timeout() {
+            if (!sack_enabled() || _snd.dupacks || _rack.probe_outstanding || _snd.data.empty()
+                    || _snd.data.front().nr_transmits || !_snd.fine_srtt.count()
+                    || !in_state(ESTABLISHED | CLOSE_WAIT)) {
+                return std::chrono::microseconds(0);
+            }
+            auto pto = 2 * _snd.fine_srtt;
+            if (_snd.data.size() == 1) {
+                pto += _tlp_max_ack_delay;
+            }
+            return pto;
+        }
+        // RACK_sent_after(RACK.xmit_ts, RACK.end_seq, seg), RFC8985 6.2
+        bool rack_sent_before(const unacked_segment& seg) {
+            return seg.sent_time < _rack.xmit_ts
+                || (seg.sent_time == _rack.xmit_ts && seg.seq + seg.p.len() < _rack.end_seq);
+        }
+        // RFC7323 TSval clock, one tick per millisecond
+        uint32_t ts_now() {
+            using namespace std::chrono;
+            return duration_cast<milliseconds>(steady_clock_type::now().time_since_epoch()).count() + _ts_offset;
+        }
+        void update_cwnd(uint32_t acked_bytes, const unacked_segment* seg = nullptr);
+        tcp_congestion_window cc_window() {
+            return tcp_congestion_window{_snd.cwnd, _snd.ssthresh, _snd.mss};
+        }
+        // Bytes per second segments leave at, zero when not paced
+        uint64_t pacing_rate() {
+            if (auto rate = _cc->pacing_rate()) {
+                return rate;
+            }
+            if (!_tcp._pacing || !_snd.fine_srtt.count()) {
+                return 0;
+            }
+            // As Linux does: twice cwnd per srtt in slow start so that the
+            // window keeps growing, 1.2 times in congestion avoidance
+            auto rate = uint64_t(_snd.cwnd) * 1000000 / _snd.fine_srtt.count();
+            return _snd.cwnd < _snd.ssthresh ? rate * 2 : rate * 6 / 5;
+        }
         void cleanup();
         uint32_t can_send() {
             if (_snd.window_probe) {
                 return 1;
             }
+            if (_snd.loss_probe) {
+                // One segment, whatever cwnd and the pacer say
+                auto rwnd = uint32_t(_snd.unacknowledged + _snd.window - _snd.next);
+                return std::min(uint32_t(_snd.mss), std::min(rwnd, _snd.unsent_len));
+            }
+            if (_snd.unsent_len && pacing_rate()) {
+                auto now = steady_clock_type::now();
+                if (now < _snd.next_send_time) {
+                    // Not our turn yet, the pacer puts us back into the
+                    // polling set when it is
+                    if (!_pacing_slot.link.is_linked()) {
+                        _pacing_slot.timeout = _snd.next_send_time;
+                        _tcp.pace(_pacing_slot);
+                    }
+                    return 0;
+                }
+            }
             // Can not send more than advertised window allows
             auto x = std::min(uint32_t(_snd.unacknowledged + _snd.window - _snd.next), _snd.unsent_len);
             // Can not send more than congestion window allows
@@ -507,9 +754,15 @@ class tcp {
                 x = flight <= max ? std::min(x, max - flight) : 0;
                 _snd.limited_transfer += x;
             } else if (_snd.dupacks >= 3) {
-                // RFC5681 Step 3.5
-                // Sent 1 full-sized segment at most
-                x = std::min(uint32_t(_snd.mss), x);
+                if (sack_enabled()) {
+                    // RFC6675 Step C: send while cwnd - pipe >= 1 SMSS
+                    auto pipe = this->pipe();
+                    x = _snd.cwnd >= pipe + _snd.mss ? std::min(x, _snd.cwnd - pipe) : 0;
+                } else {
+                    // RFC5681 Step 3.5
+                    // Sent 1 full-sized segment at most
+                    x = std::min(uint32_t(_snd.mss), x);
+                }
             }
             return x;
         }
@@ -518,6 +771,65 @@ class tcp {
             std::for_each(_snd.data.begin(), _snd.data.end(), [&] (unacked_segment& seg) { size += seg.p.len(); });
             return size;
         }
+        bool sack_enabled() {
+            return _option._sack_received;
+        }
+        // RFC6675 IsLost(): a segment is deemed lost once DupThresh segments,
+        // or more than (DupThresh - 1) * SMSS bytes, above it were SACKed.
+        bool is_lost(uint32_t sacked_bytes_above, unsigned sacked_segs_above) {
+            return sacked_segs_above >= _dupthresh || sacked_bytes_above > (_dupthresh - 1) * uint32_t(_snd.mss);
+        }
+        // Call func(seg, lost) on each segment not yet SACKed, in sequence
+        // order, until it returns false.
+        template <typename Func>
+        void for_each_unsacked_segment(Func func) {
+            uint32_t sacked_bytes = 0;
+            unsigned sacked_segs = 0;
+            for (auto& seg : _snd.data) {
+                if (seg.sacked) {
+                    sacked_bytes += seg.p.len();
+                    sacked_segs++;
+                }
+            }
+            for (auto& seg : _snd.data) {
+                if (seg.sacked) {
+                    sacked_bytes -= seg.p.len();
+                    sacked_segs--;
+                } else if (!func(seg, seg.lost || is_lost(sacked_bytes, sacked_segs))) {
+                    return;
+                }
+            }
+        }
+        // RFC6675 SetPipe(): bytes believed to be in flight
+        uint32_t pipe() {
+            uint32_t size = 0;
+            for_each_unsacked_segment([&] (unacked_segment& seg, bool lost) {
+                if (!lost) {
+                    size += seg.p.len();
+                }
+                if (seg.seq < _snd.high_rxt) {
+                    size += seg.p.len();
+                }
+                return true;
+            });
+            return size;
+        }
+        bool first_segment_lost() {
+            bool lost = false;
+            for_each_unsacked_segment([&] (unacked_segment& seg, bool seg_lost) {
+                lost = seg_lost && seg.seq == _snd.unacknowledged;
+                return false;
+            });
+            return lost;
+        }
+        void clear_scoreboard() {
+            for (auto& seg : _snd.data) {
+                seg.sacked = false;
+                seg.lost = false;
+            }
+            _snd.high_rxt = _snd.unacknowledged;
+            _rack.probe_outstanding = false;
+        }
         uint16_t local_mss() {
             return _tcp.hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min;
         }
@@ -536,27 +848,33 @@ class tcp {
                 _snd._all_data_acked_promise = {};
             }
         }
+        bool send_available() const {
+            return _snd.max_queue_space > _snd.current_queue_space && _snd.unsent_len <= _snd.notsent_lowat;
+        }
         void signal_send_available() {
-            if (_snd._send_available_promise && _snd.max_queue_space > _snd.current_queue_space) {
+            if (_snd._send_available_promise && send_available()) {
                 _snd._send_available_promise->set_value();
                 _snd._send_available_promise = {};
             }
         }
         void do_syn_sent() {
             _state = SYN_SENT;
-            _snd.syn_tx_time = clock_type::now();
+            _snd.syn_tx_time = steady_clock_type::now();
             // Send <SYN> to remote
             output();
         }
         void do_syn_received() {
             _state = SYN_RECEIVED;
-            _snd.syn_tx_time = clock_type::now();
+            _snd.syn_tx_time = steady_clock_type::now();
             // Send <SYN,ACK> to remote
             output();
         }
         void do_established() {
             _state = ESTABLISHED;
-            update_rto(_snd.syn_tx_time);
+            // No RTT sample when a cookie stood in for our <SYN,ACK>
+            if (_snd.syn_tx_time != steady_clock_type::time_point()) {
+                update_rto(std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock_type::now() - _snd.syn_tx_time));
+            }
             _connect_done.set_value();
         }
         void do_reset() {
@@ -589,6 +907,7 @@ class tcp {
             _snd.unacknowledged = _snd.initial;
             _snd.next = _snd.initial + 1;
             _snd.recover = _snd.initial;
+            _snd.high_rxt = _snd.initial;
         }
         void do_local_fin_acked() {
             _snd.unacknowledged += 1;
@@ -614,23 +933,74 @@ class tcp {
             _snd.dupacks = 0;
             _snd.limited_transfer = 0;
             _snd.partial_ack = 0;
+            _snd.high_rxt = _snd.unacknowledged;
         }
-        uint32_t data_segment_acked(tcp_seq seg_ack);
+        uint32_t data_segment_acked(tcp_seq seg_ack, uint32_t ts_ecr);
         bool segment_acceptable(tcp_seq seg_seq, unsigned seg_len);
         void init_from_options(tcp_hdr* th, uint8_t* opt_start, uint8_t* opt_end);
+        void set_congestion_control(const sstring& algorithm) {
+            _cc = make_tcp_congestion_control(algorithm);
+        }
+        void set_socket_options(const socket_options& opts);
+        socket_options get_socket_options() const;
+        tcp_congestion_info congestion_info() {
+            using namespace std::chrono;
+            return tcp_congestion_info {
+                _cc->name(),
+                _snd.cwnd,
+                _snd.ssthresh,
+                _snd.first_rto_sample ? microseconds(0) : duration_cast<microseconds>(_snd.srtt),
+                _cc->min_rtt(),
+                pacing_rate(),
+            };
+        }
         friend class connection;
     };
     inet_type& _inet;
-    std::unordered_map<connid, lw_shared_ptr<tcb>, connid_hash> _tcbs;
+    connection_table<connid, lw_shared_ptr<tcb>, connid_hash> _tcbs;
     std::unordered_map<uint16_t, listener*> _listening;
     std::random_device _rd;
     std::default_random_engine _e;
     std::uniform_int_distribution<uint16_t> _port_dist{41952, 65535};
     circular_buffer<std::pair<lw_shared_ptr<tcb>, ethernet_address>> _poll_tcbs;
+    // tcbs held back by pacing, due at their next send time.  One wheel and
+    // one timer for the whole shard instead of a timer per connection.
+    struct pacing_wheel : seastar::timer_wheel<typename tcb::pacing_slot, &tcb::pacing_slot::link> {
+        ~pacing_wheel() { this->clear(); }
+    } _paced;
+    timer<> _pacing_timer;
+    // Pace connections whose congestion control does not, from cwnd / srtt
+    bool _pacing = false;
+    // Lower bound of the retransmission timeout
+    std::chrono::milliseconds _rto_min{1000};
+    // Half-open connections a listener keeps before it answers SYNs with
+    // cookies, or drops them when those are disabled
+    size_t _syn_backlog = 256;
+    bool _syncookies = true;
     // queue for packets that do not belong to any tcb
-    circular_buffer<ipv4_traits::l4packet> _packetq;
+    circular_buffer<typename InetTraits::l4packet> _packetq;
     semaphore _queue_space = {212992};
+    struct stats {
+        // Data segments sent again, for any of the reasons below
+        uint64_t retransmits = 0;
+        uint64_t timeout_retransmits = 0;
+        uint64_t fast_retransmits = 0;
+        // Holes repaired from the SACK scoreboard during loss recovery
+        uint64_t sack_retransmits = 0;
+        // Tail loss probes, new data or a retransmission
+        uint64_t loss_probes = 0;
+        // SYNs and handshake-completing ACKs dropped on a full accept queue
+        uint64_t listen_overflows = 0;
+        // SYNs dropped on a full SYN backlog, with cookies disabled
+        uint64_t syn_backlog_drops = 0;
+        uint64_t syncookies_sent = 0;
+        // Connections set up from a cookie, and ACKs carrying a bad one
+        uint64_t syncookies_received = 0;
+        uint64_t syncookies_failed = 0;
+    } _stats;
     scollectd::registrations _collectd_regs;
+    // Algorithm new connections start with
+    sstring _congestion_control = "reno";
 public:
     class connection {
         lw_shared_ptr<tcb> _tcb;
@@ -661,12 +1031,30 @@ class tcp {
         packet read() {
             return _tcb->read();
         }
+        // Moves all received segments into batch, which must be empty.
+        // Unlike read() nothing is merged, and no allocation is made since
+        // the two queues are swapped.
+        void read_batch(std::deque<packet>& batch) {
+            _tcb->read_batch(batch);
+        }
         ipaddr foreign_ip() {
             return _tcb->_foreign_ip;
         }
         uint16_t foreign_port() {
             return _tcb->_foreign_port;
         }
+        void set_congestion_control(const sstring& algorithm) {
+            _tcb->set_congestion_control(algorithm);
+        }
+        tcp_congestion_info congestion_info() {
+            return _tcb->congestion_info();
+        }
+        void set_socket_options(const socket_options& opts) {
+            _tcb->set_socket_options(opts);
+        }
+        socket_options get_socket_options() const {
+            return _tcb->get_socket_options();
+        }
         void shutdown_connect();
         void close_read();
         void close_write();
@@ -675,7 +1063,10 @@ class tcp {
         tcp& _tcp;
         uint16_t _port;
         queue<connection> _q;
+        // Half-open connections, bounded by tcp::_syn_backlog
         size_t _pending = 0;
+        // Cookies are only checked while some may be outstanding
+        lowres_clock::time_point _syncookie_sent;
     private:
         listener(tcp& t, uint16_t port, size_t queue_length)
             : _tcp(t), _port(port), _q(queue_length) {
@@ -700,9 +1091,15 @@ class tcp {
         void abort_accept() {
             _q.abort(std::make_exception_ptr(std::system_error(ECONNABORTED, std::system_category())));
         }
-        bool full() { return _pending + _q.size() >= _q.max_size(); }
+        bool full() { return _q.full(); }
+        bool syn_backlog_full() { return _pending >= _tcp._syn_backlog; }
         void inc_pending() { _pending++; }
-        void dec_pending() { _pending--; }
+        void dec_pending() {
+            // The listener may have been replaced since the SYN arrived
+            if (_pending) {
+                _pending--;
+            }
+        }
         friend class tcp;
     };
 public:
@@ -712,17 +1109,61 @@ class tcp {
     listener listen(uint16_t port, size_t queue_length = 100);
     connection connect(socket_address sa);
     const net::hw_features& hw_features() const { return _inet._inet.hw_features(); }
+    // Throws std::invalid_argument for an unknown algorithm
+    void set_congestion_control(sstring algorithm) {
+        make_tcp_congestion_control(algorithm);
+        _congestion_control = std::move(algorithm);
+    }
+    void set_pacing(bool enable) {
+        _pacing = enable;
+    }
+    // RFC6298 asks for at least a second, which is far too long inside a
+    // datacenter where round trips take microseconds
+    void set_rto_min(std::chrono::milliseconds rto_min) {
+        _rto_min = rto_min;
+    }
+    void set_syn_backlog(size_t syn_backlog) {
+        _syn_backlog = syn_backlog;
+    }
+    void set_syncookies(bool enable) {
+        _syncookies = enable;
+    }
     future<> poll_tcb(ipaddr to, lw_shared_ptr<tcb> tcb);
     void add_connected_tcb(lw_shared_ptr<tcb> tcbp, uint16_t local_port) {
         auto it = _listening.find(local_port);
         if (it != _listening.end()) {
+            if (tcbp->_half_open) {
+                it->second->dec_pending();
+            }
             it->second->_q.push(connection(tcbp));
+        }
+        tcbp->_half_open = false;
+    }
+    // Whether a connection completing its handshake on local_port fits
+    // the accept queue; if not, its ACK is dropped like Linux does, and
+    // the peer retries
+    bool can_accept(uint16_t local_port) {
+        auto it = _listening.find(local_port);
+        if (it == _listening.end() || !it->second->full()) {
+            return true;
+        }
+        _stats.listen_overflows++;
+        return false;
+    }
+    void half_open_closed(uint16_t local_port) {
+        auto it = _listening.find(local_port);
+        if (it != _listening.end()) {
             it->second->dec_pending();
         }
     }
 private:
+    void pace(typename tcb::pacing_slot& slot);
+    void unpace(typename tcb::pacing_slot& slot);
+    void release_paced();
     void send_packet_without_tcb(ipaddr from, ipaddr to, packet p);
     void respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr foreign_ip);
+    void respond_with_syncookie(tcp_hdr* rth, const connid& id, packet p);
+    void send_control_packet(packet p, uint8_t hdr_len, ipaddr local_ip, ipaddr foreign_ip);
     friend class listener;
 };
 
@@ -730,6 +1171,7 @@ template <typename InetTraits>
 tcp<InetTraits>::tcp(inet_type& inet)
     : _inet(inet)
     , _e(_rd())
+    , _pacing_timer([this] { release_paced(); })
     , _collectd_regs({
         //
         // Linearized events: DERIVE:0:u
@@ -741,7 +1183,69 @@ tcp<InetTraits>::tcp(inet_type& inet)
             , scollectd::make_typed(scollectd::data_type::DERIVE
             , [] { return tcp_packet_merger::linearizations(); })
         ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "retransmits")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.retransmits)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "timeout-retransmits")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.timeout_retransmits)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "fast-retransmits")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.fast_retransmits)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "sack-retransmits")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.sack_retransmits)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "loss-probes")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.loss_probes)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "listen-overflows")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.listen_overflows)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "syn-backlog-drops")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.syn_backlog_drops)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "syncookies-sent")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.syncookies_sent)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "syncookies-received")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.syncookies_received)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "tcp"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "syncookies-failed")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.syncookies_failed)
+        ),
     }) {
+    // Registers the shard's latency metrics before the first sample
+    rx_latency_sampler::local();
     _inet.register_packet_provider([this, tcb_polled = 0u] () mutable {
         std::experimental::optional<typename InetTraits::l4packet> l4p;
         auto c = _poll_tcbs.size();
@@ -769,11 +1273,43 @@ tcp<InetTraits>::tcp(inet_type& inet)
 
 template <typename InetTraits>
 future<> tcp<InetTraits>::poll_tcb(ipaddr to, lw_shared_ptr<tcb> tcb) {
+    if (auto dst = _inet.try_get_l2_dst_address(to)) {
+        _poll_tcbs.emplace_back(std::move(tcb), *dst);
+        return make_ready_future<>();
+    }
     return  _inet.get_l2_dst_address(to).then([this, tcb = std::move(tcb)] (ethernet_address dst) {
             _poll_tcbs.emplace_back(std::move(tcb), dst);
     });
 }
 
+template <typename InetTraits>
+void tcp<InetTraits>::pace(typename tcb::pacing_slot& slot) {
+    if (_paced.insert(slot)) {
+        _pacing_timer.rearm(slot.timeout);
+    }
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::unpace(typename tcb::pacing_slot& slot) {
+    if (slot.link.is_linked()) {
+        _paced.remove(slot);
+    }
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::release_paced() {
+    auto due = _paced.expire(steady_clock_type::now());
+    while (!due.empty()) {
+        auto& slot = *due.begin();
+        due.pop_front();
+        // Back into the polling set, the interface pulls its segments
+        slot.owner->output();
+    }
+    if (!_paced.empty()) {
+        _pacing_timer.arm(_paced.get_next_timeout());
+    }
+}
+
 template <typename InetTraits>
 auto tcp<InetTraits>::listen(uint16_t port, size_t queue_length) -> listener {
     return listener(*this, port, queue_length);
@@ -783,19 +1319,34 @@ template <typename InetTraits>
 auto tcp<InetTraits>::connect(socket_address sa) -> connection {
     uint16_t src_port;
     connid id;
+    assert(sa.as_posix_sockaddr().sa_family == InetTraits::address_family);
     auto src_ip = _inet._inet.host_address();
-    auto dst_ip = ipv4_address(sa);
+    auto dst_ip = ipaddr(sa);
+    // sin6_port sits where sin_port does
     auto dst_port = net::ntoh(sa.u.in.sin_port);
 
-    do {
-        src_port = _port_dist(_e);
+    // Pick a source port whose RSS hash, through the NIC's redirection
+    // table and the software one of proxied shards alike, lands the
+    // replies on this shard, so none of them are forwarded.  Scanning
+    // from a random start rather than drawing ports until one fits bounds
+    // the search when the range is exhausted.
+    auto netif = _inet._inet.netif();
+    auto first = _port_dist(_e);
+    unsigned nr_ports = _port_dist.max() - _port_dist.min() + 1;
+    for (unsigned i = 0;; ++i) {
+        if (i == nr_ports) {
+            throw std::system_error(EADDRNOTAVAIL, std::system_category());
+        }
+        src_port = _port_dist.min() + (first - _port_dist.min() + i) % nr_ports;
         id = connid{src_ip, dst_ip, src_port, dst_port};
-    } while (_inet._inet.netif()->hw_queues_count() > 1 &&
-             (_inet._inet.netif()->hash2cpu(id.hash(_inet._inet.netif()->rss_key())) != engine().cpu_id()
-              || _tcbs.find(id) != _tcbs.end()));
+        if ((smp::count == 1 || netif->hash2cpu(id.hash(netif->rss_key())) == engine().cpu_id())
+                && !_tcbs.find(id)) {
+            break;
+        }
+    }
 
     auto tcbp = make_lw_shared<tcb>(*this, id);
-    _tcbs.insert({id, tcbp});
+    _tcbs.insert(id, tcbp);
     tcbp->connect();
     return connection(tcbp);
 }
@@ -825,7 +1376,7 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
         return;
     }
 
-    if (!hw_features().rx_csum_offload) {
+    if (!hw_features().rx_csum_offload && !p.offload_info_ref().l4_csum_verified) {
         checksummer csum;
         InetTraits::tcp_pseudo_header_checksum(csum, from, to, p.len());
         csum.sum(p);
@@ -837,9 +1388,9 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
     auto id = connid{to, from, h.dst_port, h.src_port};
     auto tcbi = _tcbs.find(id);
     lw_shared_ptr<tcb> tcbp;
-    if (tcbi == _tcbs.end()) {
+    if (!tcbi) {
         auto listener = _listening.find(id.local_port);
-        if (listener == _listening.end() || listener->second->full()) {
+        if (listener == _listening.end()) {
             // 1) In CLOSE state
             // 1.1 all data in the incoming segment is discarded.  An incoming
             // segment containing a RST is discarded. An incoming segment not
@@ -857,6 +1408,20 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             }
             // 2.2 second check for an ACK
             if (h.f_ack) {
+                // Unless it completes a handshake we answered with a cookie
+                auto& l = *listener->second;
+                if (!h.f_syn && l._syncookie_sent + 2 * tcb::syncookie_period > lowres_clock::now()) {
+                    if (auto mss = tcb::check_syncookie(id, h.seq - 1, h.ack - 1)) {
+                        if (!can_accept(id.local_port)) {
+                            return;
+                        }
+                        _stats.syncookies_received++;
+                        tcbp = make_lw_shared<tcb>(*this, id);
+                        _tcbs.insert(id, tcbp);
+                        return tcbp->input_handle_syncookie(&h, *mss, std::move(p));
+                    }
+                    _stats.syncookies_failed++;
+                }
                 // Any acknowledgment is bad if it arrives on a connection
                 // still in the LISTEN state.
                 // <SEQ=SEG.ACK><CTL=RST>
@@ -866,11 +1431,25 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             if (h.f_syn) {
                 // check the security
                 // NOTE: Ignored for now
+                auto& l = *listener->second;
+                // Dropped SYNs are retransmitted; a reset would fail the
+                // connection instead
+                if (l.full()) {
+                    _stats.listen_overflows++;
+                    return;
+                }
+                if (l.syn_backlog_full()) {
+                    if (!_syncookies) {
+                        _stats.syn_backlog_drops++;
+                        return;
+                    }
+                    l._syncookie_sent = lowres_clock::now();
+                    return respond_with_syncookie(&h, id, std::move(p));
+                }
                 tcbp = make_lw_shared<tcb>(*this, id);
-                _tcbs.insert({id, tcbp});
-                // TODO: we need to remove the tcb and decrease the pending if
-                // it stays SYN_RECEIVED state forever.
-                listener->second->inc_pending();
+                _tcbs.insert(id, tcbp);
+                tcbp->_half_open = true;
+                l.inc_pending();
 
                 return tcbp->input_handle_listen_state(&h, std::move(p));
             }
@@ -880,7 +1459,7 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             return;
         }
     } else {
-        tcbp = tcbi->second;
+        tcbp = *tcbi;
         if (tcbp->state() == tcp_state::SYN_SENT) {
             // 3) In SYN_SENT State
             return tcbp->input_handle_syn_sent_state(&h, std::move(p));
@@ -897,8 +1476,12 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
 template <typename InetTraits>
 void tcp<InetTraits>::send_packet_without_tcb(ipaddr from, ipaddr to, packet p) {
     if (_queue_space.try_wait(p.len())) { // drop packets that do not fit the queue
+        if (auto e_dst = _inet.try_get_l2_dst_address(to)) {
+            _packetq.emplace_back(typename InetTraits::l4packet{to, std::move(p), *e_dst, ip_protocol_num::tcp});
+            return;
+        }
         _inet.get_l2_dst_address(to).then([this, to, p = std::move(p)] (ethernet_address e_dst) mutable {
-                _packetq.emplace_back(ipv4_traits::l4packet{to, std::move(p), e_dst, ip_protocol_num::tcp});
+                _packetq.emplace_back(typename InetTraits::l4packet{to, std::move(p), e_dst, ip_protocol_num::tcp});
         });
     }
 }
@@ -921,7 +1504,10 @@ tcp<InetTraits>::tcb::tcb(tcp& t, connid id)
     , _foreign_port(id.foreign_port)
     , _delayed_ack([this] { _nr_full_seg_received = 0; output(); })
     , _retransmit([this] { retransmit(); })
-    , _persist([this] { persist(); }) {
+    , _persist([this] { persist(); })
+    , _cc(make_tcp_congestion_control(t._congestion_control)) {
+    _pacing_slot.owner = this;
+    _ts_offset = std::uniform_int_distribution<uint32_t>()(t._e);
 }
 
 template <typename InetTraits>
@@ -952,9 +1538,50 @@ void tcp<InetTraits>::respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr f
     h.checksum = 0;
     h.write(th);
 
+    send_control_packet(std::move(p), tcp_hdr::len, local_ip, foreign_ip);
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::respond_with_syncookie(tcp_hdr* rth, const connid& id, packet p) {
+    auto opt_start = reinterpret_cast<uint8_t*>(p.get_header(0, rth->data_offset * 4));
+    if (!opt_start) {
+        return;
+    }
+    opt_start += tcp_hdr::len;
+    tcp_option syn_options;
+    syn_options.parse(opt_start, opt_start + rth->data_offset * 4 - tcp_hdr::len);
+
+    // Only the MSS option, the cookie cannot remember the others
+    tcp_option options;
+    options._mss_received = true;
+    options._local_mss = hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min;
+    auto options_size = options.get_size(true, true);
+
+    packet reply;
+    auto th = reply.prepend_uninitialized_header(tcp_hdr::len + options_size);
+    auto h = tcp_hdr{};
+    h.src_port = rth->dst_port;
+    h.dst_port = rth->src_port;
+    h.seq = tcb::make_syncookie(id, rth->seq, syn_options._remote_mss);
+    h.ack = rth->seq + 1;
+    h.f_syn = true;
+    h.f_ack = true;
+    h.data_offset = (tcp_hdr::len + options_size) / 4;
+    // Linux's default window size, unscaled in a SYN
+    h.window = 29200;
+    h.checksum = 0;
+    options.fill(th, &h, options_size);
+    h.write(th);
+
+    _stats.syncookies_sent++;
+    send_control_packet(std::move(reply), tcp_hdr::len + options_size, id.local_ip, id.foreign_ip);
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::send_control_packet(packet p, uint8_t hdr_len, ipaddr local_ip, ipaddr foreign_ip) {
     checksummer csum;
     offload_info oi;
-    InetTraits::tcp_pseudo_header_checksum(csum, local_ip, foreign_ip, tcp_hdr::len);
+    InetTraits::tcp_pseudo_header_checksum(csum, local_ip, foreign_ip, hdr_len);
     uint16_t checksum;
     if (hw_features().tx_csum_l4_offload) {
         checksum = ~csum.get();
@@ -964,18 +1591,21 @@ void tcp<InetTraits>::respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr f
         checksum = csum.get();
         oi.needs_csum = false;
     }
-    tcp_hdr::write_nbo_checksum(th, checksum);
+    tcp_hdr::write_nbo_checksum(p.get_header(0, hdr_len), checksum);
 
     oi.protocol = ip_protocol_num::tcp;
-    oi.tcp_hdr_len = tcp_hdr::len;
+    oi.tcp_hdr_len = hdr_len;
     p.set_offload_info(oi);
 
     send_packet_without_tcb(local_ip, foreign_ip, std::move(p));
 }
 
 template <typename InetTraits>
-uint32_t tcp<InetTraits>::tcb::data_segment_acked(tcp_seq seg_ack) {
+uint32_t tcp<InetTraits>::tcb::data_segment_acked(tcp_seq seg_ack, uint32_t ts_ecr) {
+    using namespace std::chrono;
     uint32_t total_acked_bytes = 0;
+    auto now = steady_clock_type::now();
+    bool rtt_sampled = false;
     // Full ACK of segment
     while (!_snd.data.empty()
             && (_snd.unacknowledged + _snd.data.front().p.len() <= seg_ack)) {
@@ -983,20 +1613,33 @@ uint32_t tcp<InetTraits>::tcb::data_segment_acked(tcp_seq seg_ack) {
         _snd.unacknowledged += acked_bytes;
         // Ignore retransmitted segments when setting the RTO
         if (_snd.data.front().nr_transmits == 0) {
-            update_rto(_snd.data.front().tx_time);
+            update_rto(duration_cast<milliseconds>(now - _snd.data.front().sent_time));
+            rtt_sampled = true;
         }
-        update_cwnd(acked_bytes);
+        if (sack_enabled()) {
+            rack_update(_snd.data.front(), now);
+        }
+        update_cwnd(acked_bytes, &_snd.data.front());
         total_acked_bytes += acked_bytes;
         _snd.current_queue_space -= _snd.data.front().data_len;
         signal_send_available();
         _snd.data.pop_front();
     }
+    // The echoed timestamp tells which transmission is acknowledged, so it
+    // still gives a sample where Karn's algorithm does not (RFC7323 4.1)
+    if (!rtt_sampled && ts_ecr) {
+        auto R = int32_t(ts_now() - ts_ecr);
+        if (R >= 0) {
+            update_rto(milliseconds(R));
+        }
+    }
     // Partial ACK of segment
     if (_snd.unacknowledged < seg_ack) {
         auto acked_bytes = seg_ack - _snd.unacknowledged;
         if (!_snd.data.empty()) {
             auto& unacked_seg = _snd.data.front();
             unacked_seg.p.trim_front(acked_bytes);
+            unacked_seg.seq += acked_bytes;
         }
         _snd.unacknowledged = seg_ack;
         update_cwnd(acked_bytes);
@@ -1038,6 +1681,10 @@ void tcp<InetTraits>::tcb::init_from_options(tcp_hdr* th, uint8_t* opt_start, ui
 
     // Maximum segment size remote can receive
     _snd.mss = _option._remote_mss;
+    if (_option._timestamps_received) {
+        // The MSS does not account for options, every segment carries them
+        _snd.mss -= tcp_option::timestamps::aligned_len;
+    }
     // Maximum segment size local can receive
     _rcv.mss = _option._local_mss = local_mss();
 
@@ -1092,6 +1739,26 @@ void tcp<InetTraits>::tcb::input_handle_listen_state(tcp_hdr* th, packet p) {
     do_syn_received();
 }
 
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::input_handle_syncookie(tcp_hdr* th, uint16_t mss, packet p) {
+    // Recreate what input_handle_listen_state() set up for the SYN the
+    // cookie answered, then let the ACK complete the handshake
+    _rcv.initial = th->seq - 1;
+    _rcv.next = th->seq;
+    _rcv.urgent = _rcv.next;
+    _snd.initial = th->ack - 1;
+    _snd.unacknowledged = _snd.initial;
+    _snd.next = th->ack;
+    _snd.recover = _snd.initial;
+    _snd.high_rxt = _snd.initial;
+
+    _option._remote_mss = mss;
+    init_from_options(th, nullptr, nullptr);
+    _state = SYN_RECEIVED;
+    tcp_debug("syncookie: LISTEN -> SYN_RECEIVED\n");
+    input_handle_other_state(th, std::move(p));
+}
+
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::input_handle_syn_sent_state(tcp_hdr* th, packet p) {
     auto opt_len = th->data_offset * 4 - tcp_hdr::len;
@@ -1164,6 +1831,21 @@ void tcp<InetTraits>::tcb::input_handle_syn_sent_state(tcp_hdr* th, packet p) {
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
+    tcp_option::sack_blocks sack;
+    std::experimental::optional<tcp_option::timestamps> ts;
+    auto opt_len = th->data_offset * 4 - tcp_hdr::len;
+    if (opt_len && (sack_enabled() || _option._timestamps_received)) {
+        auto opt_start = reinterpret_cast<uint8_t*>(p.get_header(0, th->data_offset * 4));
+        if (opt_start) {
+            opt_start += tcp_hdr::len;
+            if (sack_enabled()) {
+                sack = tcp_option::parse_sack_blocks(opt_start, opt_start + opt_len);
+            }
+            if (_option._timestamps_received) {
+                ts = tcp_option::parse_timestamps(opt_start, opt_start + opt_len);
+            }
+        }
+    }
     p.trim_front(th->data_offset * 4);
     bool do_output = false;
     bool do_output_data = false;
@@ -1177,6 +1859,12 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
         return output();
     }
 
+    // RFC7323 4.3: echo the timestamp of the segment at the left edge of
+    // the window, not of one that arrived out of order
+    if (ts && seg_seq <= _rcv.next) {
+        _option._ts_recent = ts->t1;
+    }
+
     // In the following it is assumed that the segment is the idealized
     // segment that begins at RCV.NXT and does not exceed the window.
     if (seg_seq < _rcv.next) {
@@ -1256,6 +1944,9 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
             // If SND.UNA =< SEG.ACK =< SND.NXT then enter ESTABLISHED state
             // and continue processing.
             if (_snd.unacknowledged <= seg_ack && seg_ack <= _snd.next) {
+                if (!_tcp.can_accept(_local_port)) {
+                    return;
+                }
                 tcp_debug("SYN_RECEIVED -> ESTABLISHED\n");
                 do_established();
                 _tcp.add_connected_tcb(this->shared_from_this(), _local_port);
@@ -1280,10 +1971,24 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
         // ESTABLISHED STATE or
         // CLOSE_WAIT STATE: Do the same processing as for the ESTABLISHED state.
         if (in_state(ESTABLISHED | CLOSE_WAIT)){
+            // Record what the remote holds above SEG.ACK before the
+            // cumulative ACK drops segments from the retransmission queue
+            auto newly_sacked = update_scoreboard(sack);
+            if (_rack.probe_outstanding && _rack.probe_end <= seg_ack) {
+                // RFC8985 7.4: the probe was answered.  Unless a D-SACK
+                // shows the original made it too, a retransmitted probe
+                // repaired a loss on its own and cwnd must still react.
+                _rack.probe_outstanding = false;
+                bool dsack = sack.nr_blocks && sack.blocks[0].right <= seg_ack;
+                if (_rack.probe_retransmitted && !dsack) {
+                    _cc->on_loss(cc_window(), flight_size());
+                    _snd.cwnd = _snd.ssthresh;
+                }
+            }
             // If SND.UNA < SEG.ACK =< SND.NXT then, set SND.UNA <- SEG.ACK.
             if (_snd.unacknowledged < seg_ack && seg_ack <= _snd.next) {
                 // Remote ACKed data we sent
-                auto acked_bytes = data_segment_acked(seg_ack);
+                auto acked_bytes = data_segment_acked(seg_ack, ts ? ts->t2 : 0);
 
                 // If SND.UNA < SEG.ACK =< SND.NXT, the send window should be updated.
                 if (_snd.wl1 < seg_seq || (_snd.wl1 == seg_seq && _snd.wl2 <= seg_ack)) {
@@ -1315,6 +2020,16 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                         // Exit the fast recovery procedure
                         exit_fast_recovery();
                         set_retransmit_timer();
+                    } else if (sack_enabled()) {
+                        tcp_debug("ack: partial_ack\n");
+                        // RFC6675 Step C: the scoreboard tells which holes
+                        // are left, repair them as pipe allows.  cwnd is not
+                        // deflated since pipe already accounts for what left
+                        // the network.
+                        sack_retransmit();
+                        if (++_snd.partial_ack == 1) {
+                            start_retransmit_timer();
+                        }
                     } else {
                         tcp_debug("ack: partial_ack\n");
                         // Retransmit the first unacknowledged segment
@@ -1346,19 +2061,26 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                     exit_fast_recovery();
                     set_retransmit_timer();
                 }
-            } else if (!_snd.data.empty() && seg_len == 0 &&
+            } else if (!_snd.data.empty() &&
                 th->f_fin == 0 && th->f_syn == 0 &&
                 th->ack == _snd.unacknowledged &&
-                uint32_t(th->window << _snd.window_scale) == _snd.window) {
+                ((seg_len == 0 && uint32_t(th->window << _snd.window_scale) == _snd.window) ||
+                 newly_sacked)) {
                 // Note:
                 // RFC793 states:
                 // If the ACK is a duplicate (SEG.ACK < SND.UNA), it can be ignored
                 // RFC5681 states:
                 // The TCP sender SHOULD use the "fast retransmit" algorithm to detect
                 // and repair loss, based on incoming duplicate ACKs.
-                // Here, We follow RFC5681.
+                // Here, We follow RFC5681.  RFC6675 also counts any ACK
+                // that SACKs new data as a duplicate.
                 _snd.dupacks++;
                 uint32_t smss = _snd.mss;
+                if (_snd.dupacks < 3 && sack_enabled() && first_segment_lost()) {
+                    // RFC6675 Step 4: the scoreboard already shows the
+                    // first segment lost, do not wait for more duplicates
+                    _snd.dupacks = 3;
+                }
                 // 3 duplicated ACKs trigger a fast retransmit
                 if (_snd.dupacks == 1 || _snd.dupacks == 2) {
                     // RFC5681 Step 3.1
@@ -1366,19 +2088,38 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                     do_output_data = true;
                 } else if (_snd.dupacks == 3) {
                     // RFC6582 Step 3.2
-                    if (seg_ack - 1 > _snd.recover) {
+                    bool enter_recovery = seg_ack - 1 > _snd.recover;
+                    if (enter_recovery) {
                         _snd.recover = _snd.next - 1;
                         // RFC5681 Step 3.2
-                        _snd.ssthresh = std::max((flight_size() - _snd.limited_transfer) / 2, 2 * smss);
-                        fast_retransmit();
+                        _cc->on_loss(cc_window(), flight_size() - _snd.limited_transfer);
                     } else {
                         // Do not enter fast retransmit and do not reset ssthresh
                     }
-                    // RFC5681 Step 3.3
-                    _snd.cwnd = _snd.ssthresh + 3 * smss;
+                    if (sack_enabled()) {
+                        // RFC6675 Step 4.2: cwnd is not inflated by the
+                        // duplicates, pipe tracks what is still in flight
+                        _snd.cwnd = _snd.ssthresh;
+                        if (enter_recovery) {
+                            _snd.high_rxt = _snd.unacknowledged;
+                            fast_retransmit();
+                            sack_retransmit();
+                        }
+                    } else {
+                        if (enter_recovery) {
+                            fast_retransmit();
+                        }
+                        // RFC5681 Step 3.3
+                        _snd.cwnd = _snd.ssthresh + 3 * smss;
+                    }
                 } else if (_snd.dupacks > 3) {
-                    // RFC5681 Step 3.4
-                    _snd.cwnd += smss;
+                    if (sack_enabled()) {
+                        // RFC6675 Step C
+                        sack_retransmit();
+                    } else {
+                        // RFC5681 Step 3.4
+                        _snd.cwnd += smss;
+                    }
                     // RFC5681 Step 3.5
                     do_output_data = true;
                 }
@@ -1390,6 +2131,9 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                 update_window();
                 do_output_data = true;
             }
+            if (sack_enabled() && !_snd.data.empty()) {
+                rack_detect_loss();
+            }
         }
         // FIN_WAIT_1 STATE
         if (in_state(FIN_WAIT_1)) {
@@ -1531,6 +2275,11 @@ packet tcp<InetTraits>::tcb::get_transmit_packet() {
     } else {
         len = std::min(uint16_t(_tcp.hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min), _snd.mss);
     }
+    if (auto rate = pacing_rate()) {
+        // A TSO burst leaves the NIC at line rate whatever the pacing, so
+        // keep each to about a millisecond worth of it
+        len = std::min<uint64_t>(len, std::max<uint64_t>(rate / 1000, 2 * _snd.mss));
+    }
     can_send = std::min(can_send, len);
     // easy case: one small packet
     if (_snd.unsent.size() == 1 && _snd.unsent.front().len() <= can_send) {
@@ -1566,16 +2315,29 @@ packet tcp<InetTraits>::tcb::get_transmit_packet() {
 }
 
 template <typename InetTraits>
-void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
+void tcp<InetTraits>::tcb::output_one(unacked_segment* retransmit_seg) {
     if (in_state(CLOSED)) {
         return;
     }
 
-    packet p = data_retransmit ? _snd.data.front().p.share() : get_transmit_packet();
+    packet p = retransmit_seg ? retransmit_seg->p.share() : get_transmit_packet();
+    if (!retransmit_seg && _snd.notsent_lowat != std::numeric_limits<size_t>::max()) {
+        signal_send_available();
+    }
     packet clone = p.share();  // early clone to prevent share() from calling packet::unuse_internal_data() on header.
     uint16_t len = p.len();
     bool syn_on = syn_needs_on();
     bool ack_on = ack_needs_on();
+    if (_option._timestamps_received || (syn_on && !ack_on)) {
+        _option._ts_val = ts_now();
+    }
+
+    // SACK blocks only go on pure ACKs, segments carrying data are already
+    // sized to the MSS and have no room left for them.
+    _option._local_sack_blocks.nr_blocks = 0;
+    if (sack_enabled() && ack_on && !syn_on && len == 0) {
+        fill_sack_blocks();
+    }
 
     auto options_size = _option.get_size(syn_on, ack_on);
     auto th = p.prepend_uninitialized_header(tcp_hdr::len + options_size);
@@ -1593,8 +2355,8 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
     h.f_psh = false;
 
     tcp_seq seq;
-    if (data_retransmit) {
-        seq = _snd.unacknowledged;
+    if (retransmit_seg) {
+        seq = retransmit_seg->seq;
     } else {
         seq = syn_on ? _snd.initial : _snd.next;
         _snd.next += len;
@@ -1657,15 +2419,37 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
 
     p.set_offload_info(oi);
 
-    if (!data_retransmit && (len || syn_on || fin_on)) {
-        auto now = clock_type::now();
+    // Delivery rate and pacing bookkeeping, on the finer clock
+    steady_clock_type::time_point sent_time;
+    if (len) {
+        sent_time = steady_clock_type::now();
+        if (_snd.data.empty()) {
+            // Nothing in flight, delivery rate is measured from here on
+            _snd.delivered_time = sent_time;
+        }
+        if (auto rate = pacing_rate()) {
+            auto gap = std::chrono::duration_cast<steady_clock_type::duration>(std::chrono::duration<double>(double(len) / rate));
+            _snd.next_send_time = std::max(sent_time, _snd.next_send_time) + gap;
+        }
+        if (retransmit_seg) {
+            retransmit_seg->sent_time = sent_time;
+            retransmit_seg->delivered = _snd.delivered;
+            retransmit_seg->delivered_time = _snd.delivered_time;
+        }
+    }
+
+    if (!retransmit_seg && (len || syn_on || fin_on)) {
         if (len) {
             unsigned nr_transmits = 0;
+            bool sacked = false;
+            bool lost = false;
             _snd.data.emplace_back(unacked_segment{std::move(clone),
-                                   len, nr_transmits, now});
+                                   len, nr_transmits, seq, sacked, lost,
+                                   sent_time, _snd.delivered, _snd.delivered_time});
         }
-        if (!_retransmit.armed()) {
-            start_retransmit_timer(now);
+        // New data pushes a pending loss probe out (RFC8985 7.2)
+        if (!_retransmit.armed() || (len && _rxt_mode == rxt_timer::probe)) {
+            start_retransmit_timer();
         }
     }
 
@@ -1719,6 +2503,7 @@ void tcp<InetTraits>::tcb::connect() {
 
 template <typename InetTraits>
 packet tcp<InetTraits>::tcb::read() {
+    sample_rx_latency();
     packet p;
     for (auto&& q : _rcv.data) {
         p.append(std::move(q));
@@ -1727,9 +2512,17 @@ packet tcp<InetTraits>::tcb::read() {
     return p;
 }
 
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::read_batch(std::deque<packet>& batch) {
+    sample_rx_latency();
+    // Whatever arrived since the reader last ran, usually a whole poll's
+    // worth of segments
+    std::swap(batch, _rcv.data);
+}
+
 template <typename InetTraits>
 future<> tcp<InetTraits>::tcb::wait_send_available() {
-    if (_snd.max_queue_space > _snd.current_queue_space) {
+    if (send_available()) {
         return make_ready_future<>();
     }
     _snd._send_available_promise = promise<>();
@@ -1783,7 +2576,7 @@ void tcp<InetTraits>::tcb::close() {
 template <typename InetTraits>
 bool tcp<InetTraits>::tcb::should_send_ack(uint16_t seg_len) {
     // We've received a TSO packet, do ack immediately
-    if (seg_len > _rcv.mss) {
+    if (seg_len > _rcv.mss || _quickack) {
         _nr_full_seg_received = 0;
         _delayed_ack.cancel();
         return true;
@@ -1810,6 +2603,45 @@ bool tcp<InetTraits>::tcb::should_send_ack(uint16_t seg_len) {
     return false;
 }
 
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::set_socket_options(const socket_options& opts) {
+    if (opts.receive_buffer_size) {
+        // Advertised from the next segment on; the scale is fixed by now
+        // unless the handshake is still to come
+        _rcv.window = std::min<size_t>(*opts.receive_buffer_size, uint32_t(0xffff) << _rcv.window_scale);
+    }
+    if (opts.send_buffer_size) {
+        _snd.max_queue_space = *opts.send_buffer_size;
+    }
+    // There is no device queue to busy-poll, the stack always polls
+    if (opts.quickack) {
+        _quickack = *opts.quickack;
+        if (_quickack && _delayed_ack.armed()) {
+            _delayed_ack.cancel();
+            output();
+        }
+    }
+    if (opts.notsent_lowat) {
+        _snd.notsent_lowat = *opts.notsent_lowat;
+    }
+    if (opts.congestion_control) {
+        set_congestion_control(*opts.congestion_control);
+    }
+    signal_send_available();
+}
+
+template <typename InetTraits>
+socket_options tcp<InetTraits>::tcb::get_socket_options() const {
+    socket_options opts;
+    opts.receive_buffer_size = _rcv.window;
+    opts.send_buffer_size = _snd.max_queue_space;
+    opts.busy_poll = std::chrono::microseconds(0);
+    opts.quickack = _quickack;
+    opts.notsent_lowat = _snd.notsent_lowat;
+    opts.congestion_control = _cc->name();
+    return opts;
+}
+
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::clear_delayed_ack() {
     _delayed_ack.cancel();
@@ -1854,9 +2686,38 @@ bool tcp<InetTraits>::tcb::merge_out_of_order() {
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::insert_out_of_order(tcp_seq seg, packet p) {
+    _rcv.last_out_of_order = seg;
     _rcv.out_of_order.merge(seg, std::move(p));
 }
 
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::fill_sack_blocks() {
+    // The out of order map keeps adjacent data merged, so every entry is one
+    // SACK block.  RFC2018 requires the first block to hold the most recently
+    // received segment; the rest follow in sequence order.
+    auto& sack = _option._local_sack_blocks;
+    // Timestamps leave room for three blocks only
+    unsigned max_blocks = _option._timestamps_received ? sack.max_blocks - 1 : sack.max_blocks;
+    auto add_block = [&sack] (tcp_seq left, tcp_seq right) {
+        sack.blocks[sack.nr_blocks++] = {left, right};
+    };
+    auto& map = _rcv.out_of_order.map;
+    auto recent = map.end();
+    for (auto it = map.begin(); it != map.end(); ++it) {
+        auto seg_end = it->first + it->second.len();
+        if (it->first <= _rcv.last_out_of_order && _rcv.last_out_of_order < seg_end) {
+            recent = it;
+            add_block(it->first, seg_end);
+            break;
+        }
+    }
+    for (auto it = map.begin(); it != map.end() && sack.nr_blocks < max_blocks; ++it) {
+        if (it != recent) {
+            add_block(it->first, it->first + it->second.len());
+        }
+    }
+}
+
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::trim_receive_data_after_window() {
     abort();
@@ -1878,6 +2739,19 @@ void tcp<InetTraits>::tcb::persist() {
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::retransmit() {
+    switch (std::exchange(_rxt_mode, rxt_timer::rto)) {
+    case rxt_timer::probe:
+        return send_loss_probe();
+    case rxt_timer::reorder:
+        rack_detect_loss();
+        if (_rxt_mode == rxt_timer::rto && !_snd.data.empty()) {
+            start_retransmit_timer();
+        }
+        return;
+    case rxt_timer::rto:
+        break;
+    }
+
     auto output_update_rto = [this] {
         output();
         // According to RFC6298, Update RTO <- RTO * 2 to perform binary exponential back-off
@@ -1911,6 +2785,10 @@ void tcp<InetTraits>::tcb::retransmit() {
         return;
     }
 
+    // RFC2018: after a retransmit timeout the SACK information is no longer
+    // trusted, the receiver may have reneged on the data it reported.
+    clear_scoreboard();
+
     // If there are unacked data, retransmit the earliest segment
     auto& unacked_seg = _snd.data.front();
 
@@ -1918,7 +2796,7 @@ void tcp<InetTraits>::tcb::retransmit() {
     // Update ssthresh only for the first retransmit
     uint32_t smss = _snd.mss;
     if (unacked_seg.nr_transmits == 0) {
-        _snd.ssthresh = std::max(flight_size() / 2, 2 * smss);
+        _cc->on_timeout(cc_window(), flight_size());
     }
     // RFC6582 Step 4
     _snd.recover = _snd.next - 1;
@@ -1934,6 +2812,7 @@ void tcp<InetTraits>::tcb::retransmit() {
         cleanup();
         return;
     }
+    _tcp._stats.timeout_retransmits++;
     retransmit_one();
 
     output_update_rto();
@@ -1944,15 +2823,68 @@ void tcp<InetTraits>::tcb::fast_retransmit() {
     if (!_snd.data.empty()) {
         auto& unacked_seg = _snd.data.front();
         unacked_seg.nr_transmits++;
+        _tcp._stats.fast_retransmits++;
         retransmit_one();
         output();
     }
 }
 
 template <typename InetTraits>
-void tcp<InetTraits>::tcb::update_rto(clock_type::time_point tx_time) {
+void tcp<InetTraits>::tcb::sack_retransmit() {
+    // RFC6675 NextSeg() rule 1: while cwnd - pipe >= 1 SMSS, resend the
+    // first segment above HighRxt that the scoreboard considers lost.  New
+    // data, NextSeg() rule 2, goes out through can_send() as usual.
+    auto pipe = this->pipe();
+    bool retransmitted = false;
+    for_each_unsacked_segment([&] (unacked_segment& seg, bool lost) {
+        if (_snd.cwnd < pipe + _snd.mss) {
+            return false;
+        }
+        if (lost && _snd.high_rxt <= seg.seq) {
+            seg.nr_transmits++;
+            _tcp._stats.sack_retransmits++;
+            retransmit_one(seg);
+            // A lost segment was not part of pipe, now it is
+            pipe += seg.p.len();
+            retransmitted = true;
+        }
+        return true;
+    });
+    if (retransmitted) {
+        output();
+    }
+}
+
+template <typename InetTraits>
+uint32_t tcp<InetTraits>::tcb::update_scoreboard(const tcp_option::sack_blocks& sack) {
+    uint32_t newly_sacked = 0;
+    auto now = sack.nr_blocks ? steady_clock_type::now() : steady_clock_type::time_point();
+    for (unsigned i = 0; i < sack.nr_blocks; ++i) {
+        auto& b = sack.blocks[i];
+        // Ignore D-SACK (RFC2883) and bogus blocks outside of what is in flight
+        if (b.right <= b.left || b.left < _snd.unacknowledged || _snd.next < b.right) {
+            continue;
+        }
+        // Only segments covered entirely are marked, a partially SACKed one
+        // still has to be resent as a whole.
+        for (auto& seg : _snd.data) {
+            auto seg_end = seg.seq + seg.p.len();
+            if (b.right < seg_end) {
+                break;
+            }
+            if (!seg.sacked && b.left <= seg.seq) {
+                seg.sacked = true;
+                newly_sacked += seg.p.len();
+                rack_update(seg, now);
+            }
+        }
+    }
+    return newly_sacked;
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::update_rto(std::chrono::milliseconds R) {
     // Update RTO according to RFC6298
-    auto R = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - tx_time);
     if (_snd.first_rto_sample) {
         _snd.first_rto_sample = false;
         // RTTVAR <- R/2
@@ -1970,24 +2902,129 @@ void tcp<InetTraits>::tcb::update_rto(clock_type::time_point tx_time) {
     // RTO <- SRTT + max(G, K * RTTVAR)
     _rto =  _snd.srtt + std::max(_rto_clk_granularity, 4 * _snd.rttvar);
 
-    // Make sure 1 sec << _rto << 60 sec
-    _rto = std::max(_rto, _rto_min);
+    // Make sure rto_min << _rto << 60 sec
+    _rto = std::max(_rto, _tcp._rto_min);
     _rto = std::min(_rto, _rto_max);
 }
 
 template <typename InetTraits>
-void tcp<InetTraits>::tcb::update_cwnd(uint32_t acked_bytes) {
-    uint32_t smss = _snd.mss;
-    if (_snd.cwnd < _snd.ssthresh) {
-        // In slow start phase
-        _snd.cwnd += std::min(acked_bytes, smss);
+void tcp<InetTraits>::tcb::send_loss_probe() {
+    // RFC8985 7.3: new data if the receive window allows, otherwise the
+    // last segment again.  Either way the tail elicits an ACK, and with it
+    // the SACK information RACK needs to repair the loss.
+    if (_snd.data.empty()) {
+        return;
+    }
+    _rack.probe_outstanding = true;
+    _rack.probe_retransmitted = !_snd.unsent_len || _snd.unacknowledged + _snd.window <= _snd.next;
+    if (!_rack.probe_retransmitted) {
+        _snd.loss_probe = true;
+        output_one();
+        _snd.loss_probe = false;
     } else {
-        // In congestion avoidance phase
-        uint32_t round_up = 1;
-        _snd.cwnd += std::max(round_up, smss * smss / _snd.cwnd);
+        auto& seg = _snd.data.back();
+        seg.nr_transmits++;
+        _tcp._stats.retransmits++;
+        output_one(&seg);
+    }
+    _rack.probe_end = _snd.next;
+    _tcp._stats.loss_probes++;
+    output();
+    start_retransmit_timer();
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::rack_update(unacked_segment& seg, steady_clock_type::time_point now) {
+    using namespace std::chrono;
+    // RFC8985 6.2 steps 1 and 2
+    auto rtt = duration_cast<microseconds>(now - seg.sent_time);
+    if (seg.nr_transmits) {
+        // Faster than possible for the retransmission, so it is the
+        // original being acknowledged
+        if (rtt < _rack.min_rtt) {
+            return;
+        }
+    } else if (!_rack.min_rtt.count() || rtt < _rack.min_rtt) {
+        _rack.min_rtt = rtt;
+    }
+    if (!rack_sent_before(seg)) {
+        _rack.xmit_ts = seg.sent_time;
+        _rack.end_seq = seg.seq + seg.p.len();
+        _rack.rtt = rtt;
     }
 }
 
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::rack_detect_loss() {
+    // RFC8985 6.2 step 5: a segment sent before the most recently delivered
+    // one is lost once it is older than that one's RTT plus the reordering
+    // window.  Those not yet that old are checked again when they are.
+    auto now = steady_clock_type::now();
+    auto reo_wnd = std::min(_rack.min_rtt / 4, _snd.fine_srtt);
+    bool lost = false;
+    steady_clock_type::duration timeout{0};
+    for (auto& seg : _snd.data) {
+        if (seg.sacked || seg.lost || !rack_sent_before(seg)) {
+            continue;
+        }
+        auto deadline = seg.sent_time + _rack.rtt + reo_wnd;
+        if (deadline <= now) {
+            seg.lost = true;
+            lost = true;
+        } else {
+            timeout = std::max(timeout, deadline - now);
+        }
+    }
+    if (lost) {
+        if (_snd.dupacks < 3) {
+            // Recovery starts as on the third duplicate ACK, RFC6675 Step 4
+            _snd.dupacks = 3;
+            if (_snd.unacknowledged - 1 > _snd.recover) {
+                _snd.recover = _snd.next - 1;
+                _cc->on_loss(cc_window(), flight_size() - _snd.limited_transfer);
+                _snd.high_rxt = _snd.unacknowledged;
+            }
+            _snd.cwnd = _snd.ssthresh;
+        }
+        sack_retransmit();
+    }
+    if (timeout.count()) {
+        _rxt_mode = rxt_timer::reorder;
+        _retransmit.rearm(now + timeout);
+    }
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::update_cwnd(uint32_t acked_bytes, const unacked_segment* seg) {
+    using namespace std::chrono;
+    auto now = steady_clock_type::now();
+    _snd.delivered += acked_bytes;
+    _snd.delivered_time = now;
+
+    tcp_ack_sample s;
+    s.now = now;
+    s.acked_bytes = acked_bytes;
+    s.in_flight = _snd.next - _snd.unacknowledged;
+    s.rtt = microseconds(0);
+    s.delivered = _snd.delivered;
+    s.prior_delivered = 0;
+    s.delivery_rate = 0;
+    if (seg) {
+        // Karn's algorithm: a retransmitted segment gives no RTT sample
+        if (seg->nr_transmits == 0) {
+            s.rtt = duration_cast<microseconds>(now - seg->sent_time);
+            auto& srtt = _snd.fine_srtt;
+            srtt = srtt.count() ? (srtt * 7 + s.rtt) / 8 : s.rtt;
+        }
+        s.prior_delivered = seg->delivered;
+        auto interval = duration_cast<microseconds>(now - seg->delivered_time).count();
+        if (interval > 0) {
+            s.delivery_rate = (_snd.delivered - seg->delivered) * 1000000 / interval;
+        }
+    }
+    _cc->on_ack(cc_window(), s);
+}
+
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::cleanup() {
     _snd.unsent.clear();
@@ -1995,8 +3032,13 @@ void tcp<InetTraits>::tcb::cleanup() {
     _rcv.out_of_order.map.clear();
     _rcv.data.clear();
     stop_retransmit_timer();
+    _tcp.unpace(_pacing_slot);
     clear_delayed_ack();
     remove_from_tcbs();
+    if (_half_open) {
+        _half_open = false;
+        _tcp.half_open_closed(_local_port);
+    }
 }
 
 template <typename InetTraits>
@@ -2007,8 +3049,8 @@ tcp_seq tcp<InetTraits>::tcb::get_isn() {
     //   M is the 4 microsecond timer
     using namespace std::chrono;
     uint32_t hash[4];
-    hash[0] = _local_ip.ip;
-    hash[1] = _foreign_ip.ip;
+    hash[0] = std::hash<ipaddr>()(_local_ip);
+    hash[1] = std::hash<ipaddr>()(_foreign_ip);
     hash[2] = (_local_port << 16) + _foreign_port;
     hash[3] = _isn_secret.key[15];
     CryptoPP::Weak::MD5::Transform(hash, _isn_secret.key);
@@ -2018,6 +3060,54 @@ tcp_seq tcp<InetTraits>::tcb::get_isn() {
     return make_seq(seq);
 }
 
+template <typename InetTraits>
+std::array<uint32_t, 4> tcp<InetTraits>::tcb::syncookie_hash(const connid& id, uint32_t count) {
+    std::array<uint32_t, 4> hash;
+    hash[0] = std::hash<ipaddr>()(id.local_ip);
+    hash[1] = std::hash<ipaddr>()(id.foreign_ip);
+    hash[2] = (id.local_port << 16) + id.foreign_port;
+    hash[3] = count;
+    CryptoPP::Weak::MD5::Transform(hash.data(), _isn_secret.key);
+    return hash;
+}
+
+template <typename InetTraits>
+uint32_t tcp<InetTraits>::tcb::syncookie_count() {
+    return clock_type::now().time_since_epoch() / syncookie_period;
+}
+
+template <typename InetTraits>
+tcp_seq tcp<InetTraits>::tcb::make_syncookie(const connid& id, tcp_seq client_isn, uint16_t mss) {
+    // As in Linux:
+    //   cookie = H1(conn) + client ISN + (count << 24)
+    //          + (H2(conn, count) + MSS index) % 2^24
+    // where count ticks every syncookie_period
+    uint32_t idx = 0;
+    while (idx + 1 < std::extent<decltype(syncookie_mss)>::value && syncookie_mss[idx + 1] <= mss) {
+        ++idx;
+    }
+    auto count = syncookie_count();
+    auto cookie = syncookie_hash(id, 0)[0] + client_isn.raw + (count << 24)
+            + ((syncookie_hash(id, count)[1] + idx) & syncookie_data_mask);
+    return make_seq(cookie);
+}
+
+template <typename InetTraits>
+std::experimental::optional<uint16_t>
+tcp<InetTraits>::tcb::check_syncookie(const connid& id, tcp_seq client_isn, tcp_seq cookie) {
+    auto c = cookie.raw - syncookie_hash(id, 0)[0] - client_isn.raw;
+    auto now = syncookie_count();
+    auto age = (now - (c >> 24)) & 0xff;
+    if (age > 1) {
+        return {};
+    }
+    auto idx = (c - syncookie_hash(id, now - age)[1]) & syncookie_data_mask;
+    if (idx >= std::extent<decltype(syncookie_mss)>::value) {
+        return {};
+    }
+    return syncookie_mss[idx];
+}
+
 template <typename InetTraits>
 std::experimental::optional<typename InetTraits::l4packet> tcp<InetTraits>::tcb::get_packet() {
     _poll_active = false;
@@ -2033,10 +3123,11 @@ std::experimental::optional<typename InetTraits::l4packet> tcp<InetTraits>::tcb:
 
     auto p = std::move(_packetq.front());
     _packetq.pop_front();
-    if (!_packetq.empty() || (_snd.dupacks < 3 && can_send() > 0)) {
+    if (!_packetq.empty() || ((_snd.dupacks < 3 || sack_enabled()) && can_send() > 0)) {
         // If there are packets to send in the queue or tcb is allowed to send
         // more add tcp back to polling set to keep sending. In addition, dupacks >= 3
-        // is an indication that an segment is lost, stop sending more in this case.
+        // is an indication that an segment is lost, stop sending more in this case
+        // unless SACK tells us, through pipe, how much we may still send.
         output();
     }
     return std::move(p);
@@ -2067,7 +3158,16 @@ template <typename InetTraits>
 constexpr uint16_t tcp<InetTraits>::tcb::_max_nr_retransmit;
 
 template <typename InetTraits>
-constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_min;
+constexpr std::chrono::seconds tcp<InetTraits>::tcb::syncookie_period;
+
+template <typename InetTraits>
+constexpr uint16_t tcp<InetTraits>::tcb::syncookie_mss[];
+
+template <typename InetTraits>
+constexpr uint16_t tcp<InetTraits>::tcb::_dupthresh;
+
+template <typename InetTraits>
+constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_tlp_max_ack_delay;
 
 template <typename InetTraits>
 constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_max;
@@ -21,13 +21,22 @@
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#include <gnutls/crypto.h>
 
 #include <experimental/optional>
 #include <system_error>
+#include <unordered_map>
+#include <array>
+#include <cstring>
+
+#ifdef HAVE_KTLS
+#include <linux/tls.h>
+#endif
 
 #include "core/reactor.hh"
 #include "core/thread.hh"
 #include "core/sstring.hh"
+#include "core/metrics.hh"
 #include "tls.hh"
 #include "stack.hh"
 
@@ -309,6 +318,60 @@ class seastar::tls::certificate_credentials::impl: public gnutlsobj {
     gnutls_priority_t get_priority() const {
         return _priority.get();
     }
+    void enable_session_tickets(const sstring& secret, std::chrono::seconds rotation) {
+        if (secret.empty() || rotation.count() <= 0) {
+            throw std::invalid_argument("Session tickets need a secret and a rotation period");
+        }
+        _ticket_secret = secret;
+        _ticket_rotation = rotation;
+        _ticket_epoch = -1;
+    }
+    // The key of the current rotation period, or nullptr without tickets.
+    // Derived from the secret and the wall clock alone, so all shards (and
+    // processes sharing the secret) agree on it.
+    const gnutls_datum_t* session_ticket_key() {
+        if (_ticket_secret.empty()) {
+            return nullptr;
+        }
+        int64_t epoch = std::chrono::system_clock::now().time_since_epoch() / _ticket_rotation;
+        if (epoch != _ticket_epoch) {
+            for (uint8_t part = 0; part < 2; ++part) {
+                std::array<uint8_t, 9> msg;
+                for (int i = 0; i < 8; ++i) {
+                    msg[i] = uint64_t(epoch) >> (56 - 8 * i);
+                }
+                msg[8] = part;
+                gtls_chk(gnutls_hmac_fast(GNUTLS_MAC_SHA256, _ticket_secret.data(), _ticket_secret.size(),
+                        msg.data(), msg.size(), _ticket_key_data.data() + part * 32));
+            }
+            _ticket_key.data = _ticket_key_data.data();
+            _ticket_key.size = _ticket_key_data.size();
+            _ticket_epoch = epoch;
+        }
+        return &_ticket_key;
+    }
+    unsigned session_ticket_lifetime() const {
+        return _ticket_rotation.count();
+    }
+    void set_session_cache_size(size_t n) {
+        _session_cache_size = n;
+        while (_session_cache.size() > n) {
+            _session_cache.erase(_session_cache.begin());
+        }
+    }
+    const sstring* cached_session(const sstring& name) const {
+        auto i = _session_cache.find(name);
+        return i != _session_cache.end() ? &i->second : nullptr;
+    }
+    void cache_session(const sstring& name, sstring data) {
+        if (!_session_cache_size) {
+            return;
+        }
+        if (!_session_cache.count(name) && _session_cache.size() >= _session_cache_size) {
+            _session_cache.erase(_session_cache.begin());
+        }
+        _session_cache[name] = std::move(data);
+    }
 private:
     friend class credentials_builder;
     friend class session;
@@ -331,6 +394,13 @@ class seastar::tls::certificate_credentials::impl: public gnutlsobj {
     client_auth _client_auth = client_auth::NONE;
     bool _load_system_trust = false;
     semaphore _system_trust_sem {1};
+    sstring _ticket_secret;
+    std::chrono::seconds _ticket_rotation{0};
+    int64_t _ticket_epoch = -1;
+    std::array<uint8_t, 64> _ticket_key_data;
+    gnutls_datum_t _ticket_key;
+    size_t _session_cache_size = 256;
+    std::unordered_map<sstring, sstring> _session_cache; // by server name
 };
 
 seastar::tls::certificate_credentials::certificate_credentials()
@@ -404,6 +474,10 @@ void seastar::tls::certificate_credentials::set_priority_string(const sstring& p
     _impl->set_priority_string(prio);
 }
 
+void seastar::tls::certificate_credentials::set_session_cache_size(size_t n) {
+    _impl->set_session_cache_size(n);
+}
+
 seastar::tls::server_credentials::server_credentials(::shared_ptr<dh_params> dh)
     : server_credentials(*dh)
 {}
@@ -420,12 +494,24 @@ void seastar::tls::server_credentials::set_client_auth(client_auth ca) {
     _impl->set_client_auth(ca);
 }
 
+void seastar::tls::server_credentials::enable_session_tickets(const sstring& secret, std::chrono::seconds rotation) {
+    _impl->enable_session_tickets(secret, rotation);
+}
+
+sstring seastar::tls::generate_session_ticket_secret() {
+    sstring secret(sstring::initialized_later(), 32);
+    gtls_chk(gnutls_rnd(GNUTLS_RND_KEY, secret.begin(), secret.size()));
+    return secret;
+}
+
 static const sstring dh_level_key = "dh_level";
 static const sstring x509_trust_key = "x509_trust";
 static const sstring x509_crl_key = "x509_crl";
 static const sstring x509_key_key = "x509_key";
 static const sstring pkcs12_key = "pkcs12";
 static const sstring system_trust = "system_trust";
+static const sstring session_cache_size_key = "session_cache_size";
+static const sstring session_tickets_key = "session_tickets";
 
 typedef std::basic_string<seastar::tls::blob::value_type, seastar::tls::blob::traits_type, std::allocator<seastar::tls::blob::value_type>> buffer_type;
 
@@ -467,6 +553,16 @@ void seastar::tls::credentials_builder::set_priority_string(const sstring& prio)
     _priority = prio;
 }
 
+void seastar::tls::credentials_builder::set_session_cache_size(size_t n) {
+    _blobs.erase(session_cache_size_key);
+    _blobs.emplace(session_cache_size_key, n);
+}
+
+void seastar::tls::credentials_builder::enable_session_tickets(std::chrono::seconds rotation) {
+    _blobs.erase(session_tickets_key);
+    _blobs.emplace(session_tickets_key, std::make_pair(generate_session_ticket_secret(), rotation));
+}
+
 void seastar::tls::credentials_builder::apply_to(certificate_credentials& creds) const {
     // Could potentially be templated down, but why bother...
     {
@@ -510,6 +606,21 @@ void seastar::tls::credentials_builder::apply_to(certificate_credentials& creds)
     if (!_priority.empty()) {
         creds.set_priority_string(_priority);
     }
+
+    {
+        auto i = _blobs.find(session_cache_size_key);
+        if (i != _blobs.end()) {
+            creds.set_session_cache_size(boost::any_cast<size_t>(i->second));
+        }
+    }
+    {
+        // Only servers issue tickets, but the setting lives in the common impl
+        auto i = _blobs.find(session_tickets_key);
+        if (i != _blobs.end()) {
+            auto v = boost::any_cast<std::pair<sstring, std::chrono::seconds>>(i->second);
+            creds._impl->enable_session_tickets(v.first, v.second);
+        }
+    }
 }
 
 ::shared_ptr<seastar::tls::certificate_credentials> seastar::tls::credentials_builder::build_certificate_credentials() const {
@@ -531,6 +642,55 @@ ::shared_ptr<seastar::tls::server_credentials> seastar::tls::credentials_builder
 namespace seastar {
 namespace tls {
 
+// Per-shard handshake counters and offload limit, registered with the
+// first session
+struct shard_handshakes {
+    uint64_t client_full = 0;
+    uint64_t client_resumed = 0;
+    uint64_t server_full = 0;
+    uint64_t server_resumed = 0;
+    unsigned offload_limit = 0;
+    semaphore offload_sem{0};
+    uint64_t offloaded_steps = 0;
+    std::chrono::steady_clock::duration offload_queue_time{0};
+    seastar::metrics::metric_groups metrics;
+
+    shard_handshakes() {
+        namespace sm = seastar::metrics;
+        metrics.add_group("tls", {
+            sm::make_derive("client_full_handshakes", client_full,
+                    sm::description("Counts client handshakes that negotiated a new session")),
+            sm::make_derive("client_resumed_handshakes", client_resumed,
+                    sm::description("Counts client handshakes that resumed a cached session")),
+            sm::make_derive("server_full_handshakes", server_full,
+                    sm::description("Counts server handshakes that negotiated a new session")),
+            sm::make_derive("server_resumed_handshakes", server_resumed,
+                    sm::description("Counts server handshakes that resumed a session from a ticket")),
+            sm::make_derive("offloaded_handshake_steps", offloaded_steps,
+                    sm::description("Counts gnutls_handshake() calls run on a syscall thread")),
+            sm::make_gauge("queued_handshake_steps", [this] { return offload_sem.waiters(); },
+                    sm::description("Handshake steps waiting for the offload concurrency limit")),
+            sm::make_derive("handshake_queue_time_us", [this] {
+                        return std::chrono::duration_cast<std::chrono::microseconds>(offload_queue_time).count();
+                    },
+                    sm::description("Total time handshake steps waited for the offload concurrency limit, in microseconds")),
+        });
+    }
+    void set_offload_limit(unsigned limit) {
+        if (limit > offload_limit) {
+            offload_sem.signal(limit - offload_limit);
+        } else {
+            offload_sem.consume(offload_limit - limit);
+        }
+        offload_limit = limit;
+    }
+};
+
+static shard_handshakes& local_handshakes() {
+    static thread_local shard_handshakes handshakes;
+    return handshakes;
+}
+
 /**
  * Session wraps gnutls session, and is the
  * actual conduit for an TLS/SSL data flow.
@@ -573,6 +733,19 @@ class session: public net::connected_socket_impl {
                     gnutls_certificate_server_set_request(*this, GNUTLS_CERT_REQUIRE);
                     break;
             }
+            if (auto key = _creds->_impl->session_ticket_key()) {
+                gtls_chk(gnutls_session_ticket_enable_server(*this, key));
+                gnutls_db_set_cache_expiration(*this, _creds->_impl->session_ticket_lifetime());
+            }
+        }
+        if (_type == type::CLIENT && !_hostname.empty()) {
+            if (auto data = _creds->_impl->cached_session(_hostname)) {
+                // A stale or unusable session just means a full handshake
+                gnutls_session_set_data(*this, data->data(), data->size());
+            }
+            // TLS 1.3 tickets arrive after the handshake
+            gnutls_handshake_set_hook_function(*this, GNUTLS_HANDSHAKE_NEW_SESSION_TICKET,
+                    GNUTLS_HOOK_POST, &session_ticket_wrapper);
         }
 
         auto prio = _creds->_impl->get_priority();
@@ -616,6 +789,10 @@ class session: public net::connected_socket_impl {
         if (_type == type::CLIENT) {
             return make_ready_future<>(); // can ignore
         }
+        if (_ktls_tx) {
+            // gnutls no longer knows our write state
+            return make_exception_future<>(std::system_error(GNUTLS_E_UNSAFE_RENEGOTIATION_DENIED, glts_errorc));
+        }
         return handshake();
     }
 
@@ -627,7 +804,49 @@ class session: public net::connected_socket_impl {
                return handshake();
             });
         }
-        auto res = gnutls_handshake(*this);
+        return handshake_step().then([this] (int res) {
+            return handshake_done(res);
+        });
+    }
+
+    // One gnutls_handshake() call. With offloading enabled it runs on a
+    // syscall thread, where vec_push() only collects the outgoing flight;
+    // we send it once back on the reactor.
+    future<int> handshake_step() {
+        auto& handshakes = local_handshakes();
+        if (!handshakes.offload_limit) {
+            return make_ready_future<int>(gnutls_handshake(*this));
+        }
+        auto queued = std::chrono::steady_clock::now();
+        return with_semaphore(handshakes.offload_sem, 1, [this, &handshakes, queued] {
+            handshakes.offload_queue_time += std::chrono::steady_clock::now() - queued;
+            ++handshakes.offloaded_steps;
+            _offloaded = true;
+            return engine().submit_to_syscall_thread<int>([this] {
+                return gnutls_handshake(*this);
+            }).finally([this] {
+                _offloaded = false;
+            });
+        }).then([this] (int res) {
+            return flush_deferred_output().then([res] {
+                return res;
+            });
+        });
+    }
+
+    future<> flush_deferred_output() {
+        if (_deferred_output.empty()) {
+            return make_ready_future<>();
+        }
+        scattered_message<char> msg;
+        for (auto&& b : _deferred_output) {
+            msg.append(std::move(b));
+        }
+        _deferred_output.clear();
+        return _out.put(std::move(msg).release());
+    }
+
+    future<> handshake_done(int res) {
         if (res < 0) {
             switch (res) {
             case GNUTLS_E_AGAIN:
@@ -652,12 +871,99 @@ class session: public net::connected_socket_impl {
                 return make_exception_future<>(std::system_error(res, glts_errorc));
             }
         }
+        auto& stats = local_handshakes();
+        auto resumed = gnutls_session_is_resumed(*this);
         if (_type == type::CLIENT) {
+            ++(resumed ? stats.client_resumed : stats.client_full);
             verify();
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+            if (gnutls_protocol_get_version(*this) != GNUTLS_TLS1_3) {
+                cache_session();
+            }
+#else
+            cache_session();
+#endif
+        } else {
+            ++(resumed ? stats.server_resumed : stats.server_full);
         }
+        maybe_enable_kernel_tls();
         return make_ready_future<>();
     }
 
+    // Client side: remember the session for the next connection to this server
+    void cache_session() {
+        if (_hostname.empty()) {
+            return;
+        }
+        gnutls_datum_t data;
+        if (gnutls_session_get_data2(*this, &data) < 0) {
+            return;
+        }
+        sstring s(reinterpret_cast<const char*>(data.data), data.size);
+        gnutls_free(data.data);
+        _creds->_impl->cache_session(_hostname, std::move(s));
+    }
+
+#ifdef HAVE_KTLS
+    template <typename CryptoInfo>
+    bool enable_kernel_tls_tx(uint16_t cipher, const gnutls_datum_t& iv, const gnutls_datum_t& key,
+            const unsigned char* seq) {
+        CryptoInfo info = {};
+        info.info.version = TLS_1_2_VERSION;
+        info.info.cipher_type = cipher;
+        if (key.size != sizeof(info.key) || iv.size != sizeof(info.salt) + (sizeof(info.salt) ? 0 : sizeof(info.iv))) {
+            return false;
+        }
+        std::memcpy(info.key, key.data, sizeof(info.key));
+        if (sizeof(info.salt)) {
+            // AES-GCM: the implicit nonce part, then the explicit part,
+            // which we (like gnutls) take from the sequence number
+            std::memcpy(info.salt, iv.data, sizeof(info.salt));
+            std::memcpy(info.iv, seq, sizeof(info.iv));
+        } else {
+            std::memcpy(info.iv, iv.data, sizeof(info.iv));
+        }
+        std::memcpy(info.rec_seq, seq, sizeof(info.rec_seq));
+        return _sock->enable_kernel_tls_tx(&info, sizeof(info));
+    }
+#endif
+
+    // Once the handshake is done, let the kernel (or the NIC) encrypt what
+    // we send, if the stack, kernel and negotiated cipher allow it; records
+    // we receive are still decrypted by gnutls. Only for TLS 1.2: a TLS 1.3
+    // peer may request a key update, which gnutls would answer with the
+    // write state it no longer owns.
+    void maybe_enable_kernel_tls() {
+#ifdef HAVE_KTLS
+        if (_ktls_tx || gnutls_protocol_get_version(*this) != GNUTLS_TLS1_2) {
+            return;
+        }
+        gnutls_datum_t mac_key, iv, key;
+        unsigned char seq[8];
+        if (gnutls_record_get_state(*this, 0, &mac_key, &iv, &key, seq) < 0) {
+            return;
+        }
+        switch (gnutls_cipher_get(*this)) {
+        case GNUTLS_CIPHER_AES_128_GCM:
+            _ktls_tx = enable_kernel_tls_tx<tls12_crypto_info_aes_gcm_128>(TLS_CIPHER_AES_GCM_128, iv, key, seq);
+            break;
+        case GNUTLS_CIPHER_AES_256_GCM:
+            _ktls_tx = enable_kernel_tls_tx<tls12_crypto_info_aes_gcm_256>(TLS_CIPHER_AES_GCM_256, iv, key, seq);
+            break;
+#if defined(TLS_CIPHER_CHACHA20_POLY1305) && GNUTLS_VERSION_NUMBER >= 0x030408
+        case GNUTLS_CIPHER_CHACHA20_POLY1305:
+            _ktls_tx = enable_kernel_tls_tx<tls12_crypto_info_chacha20_poly1305>(TLS_CIPHER_CHACHA20_POLY1305, iv, key, seq);
+            break;
+#endif
+        default:
+            break;
+        }
+#endif
+    }
+    bool kernel_tls_tx() const {
+        return _ktls_tx;
+    }
+
     size_t in_avail() const {
         return _input.size();
     }
@@ -695,6 +1001,20 @@ class session: public net::connected_socket_impl {
         }
     }
 #endif
+    static int session_ticket_wrapper(gnutls_session_t gs, unsigned htype, unsigned when,
+            unsigned incoming, const gnutls_datum_t* msg) {
+        // The cache belongs to the reactor; an offloaded TLS 1.2 handshake
+        // caches its session when it completes instead
+        auto s = from_transport_ptr(gnutls_transport_get_ptr(gs));
+        if (incoming && !s->_offloaded) {
+            try {
+                s->cache_session();
+            } catch (...) {
+                // only loses the chance to resume
+            }
+        }
+        return 0;
+    }
     static ssize_t vec_push_wrapper(gnutls_transport_ptr_t ptr, const giovec_t * iov, int iovcnt) {
         return from_transport_ptr(ptr)->vec_push(iov, iovcnt);
     }
@@ -758,17 +1078,27 @@ class session: public net::connected_socket_impl {
         for (int i = 0; i < iovcnt; ++i) {
             n += iov[i].iov_len;
         }
+        if (_offloaded) {
+            // Not on the reactor; handshake_step() sends this later
+            for (int i = 0; i < iovcnt; ++i) {
+                _deferred_output.emplace_back(reinterpret_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+            }
+            return n;
+        }
         // See above. If we have a pending send
         // the next time we reach this point, it
         // must be the re-send, otherwise we
         // have broken our state machine.
         if (_out_expect == 0) {
-            scattered_message<char> msg;
+            // gnutls reuses its record buffer, so one copy is unavoidable;
+            // make it a single allocation for the whole push
+            temporary_buffer<char> buf(n);
+            auto dst = buf.get_write();
             for (int i = 0; i < iovcnt; ++i) {
-                msg.append(sstring(reinterpret_cast<const char *>(iov[i].iov_base), iov[i].iov_len));
+                dst = std::copy_n(reinterpret_cast<const char *>(iov[i].iov_base), iov[i].iov_len, dst);
             }
             _output_exception = {};
-            _output_pending = _out.put(std::move(msg).release());
+            _output_pending = _out.put(net::packet(std::move(buf)));
             // Did we complete already?
             if (_output_pending->available() && !_output_pending->failed()) {
                 return n;
@@ -846,6 +1176,14 @@ class session: public net::connected_socket_impl {
     }
 
     future<> shutdown(gnutls_close_request_t how) {
+        if (_ktls_tx) {
+            // Send close_notify ourselves; we don't wait for the peer's
+            if (std::exchange(_close_notify_sent, true)) {
+                return make_ready_future<>();
+            }
+            static const char close_notify[] = { GNUTLS_AL_WARNING, GNUTLS_A_CLOSE_NOTIFY };
+            return _sock->send_kernel_tls_record(alert_content_type, close_notify, sizeof(close_notify));
+        }
         return finish_handshake_op(gnutls_bye(*this, how),
                 std::bind(&session::shutdown, this, how));
     }
@@ -873,16 +1211,39 @@ class session: public net::connected_socket_impl {
     net::keepalive_params get_keepalive_parameters() const override {
         return _sock->get_keepalive_parameters();
     }
+    void set_congestion_control(const sstring& algorithm) override {
+        _sock->set_congestion_control(algorithm);
+    }
+    void set_socket_options(const net::socket_options& opts) override {
+        _sock->set_socket_options(opts);
+    }
+    net::socket_options get_socket_options() const override {
+        return _sock->get_socket_options();
+    }
+    net::tcp_congestion_info get_congestion_info() const override {
+        return _sock->get_congestion_info();
+    }
 
     // helper for sink
     future<> flush() {
         return _out.flush();
     }
+    // With kernel TLS the plaintext goes straight to the socket
+    future<> put_plaintext(net::packet p) {
+        return _out.put(std::move(p));
+    }
 private:
     class source_impl;
     class sink_impl;
 
+    static constexpr uint8_t alert_content_type = 21;
+
     type _type;
+    // gnutls_handshake() is running on a syscall thread
+    bool _offloaded = false;
+    std::vector<sstring> _deferred_output;
+    bool _ktls_tx = false;
+    bool _close_notify_sent = false;
 
     std::unique_ptr<net::connected_socket_impl> _sock;
     ::shared_ptr<certificate_credentials> _creds;
@@ -968,14 +1329,19 @@ class session::sink_impl: public ::data_sink_impl {
 private:
     typedef net::fragment* frag_iter;
 
+    // Sends the fragments in full-size records: a record's worth of a large
+    // fragment goes straight to gnutls_record_send(), smaller pieces are
+    // corked together until they fill a record or the packet ends.
     future<> put(net::packet p, frag_iter i, frag_iter e, size_t off = 0) {
+        const size_t max_record = gnutls_record_get_max_size(_session);
         while (i != e) {
-            auto ptr = i->base;
-            auto size = i->size;
-            while (off < size) {
-                // gnutls does not have a sendv. Why?...
-                auto res = gnutls_record_send(_session, ptr + off, size - off);
-
+            if (off == i->size) {
+                off = 0;
+                ++i;
+                continue;
+            }
+            if (i->size - off >= max_record) {
+                auto res = gnutls_record_send(_session, i->base + off, max_record);
                 if (res < 0) {
                     switch (res) {
                     case GNUTLS_E_AGAIN:
@@ -983,7 +1349,7 @@ class session::sink_impl: public ::data_sink_impl {
                         // If underlying says EAGAIN, we've actually issued
                         // a send, but must wait for completion.
                         return _session.wait_for_output().then(
-                                [this, p = std::move(p), size, i, e, off]() mutable {
+                                [this, p = std::move(p), i, e, off]() mutable {
                                     // re-send same buffers (gnutls internal)
                                     auto check = gnutls_record_send(_session, nullptr, 0);
                                     return this->put(std::move(p), i, e, off + check);
@@ -993,17 +1359,58 @@ class session::sink_impl: public ::data_sink_impl {
                     }
                 }
                 off += res;
+                continue;
+            }
+            gnutls_record_cork(_session);
+            for (size_t corked = 0; i != e && corked < max_record; ) {
+                auto n = std::min(i->size - off, max_record - corked);
+                // Only buffers while corked
+                auto res = gnutls_record_send(_session, i->base + off, n);
+                if (res < 0) {
+                    return _session.handle_output_error(res);
+                }
+                corked += res;
+                off += res;
+                if (off == i->size) {
+                    off = 0;
+                    ++i;
+                }
+            }
+            auto res = gnutls_record_uncork(_session, 0);
+            if (res < 0) {
+                if (res != GNUTLS_E_AGAIN) {
+                    return _session.handle_output_error(res);
+                }
+                return uncork().then([this, p = std::move(p), i, e, off]() mutable {
+                    return this->put(std::move(p), i, e, off);
+                });
             }
-            off = 0;
-            ++i;
         }
         return make_ready_future<>();
     }
 
+    // Waits for the pending send, then lets gnutls go on with the corked
+    // records (it resends the last one, which vec_push() acknowledges)
+    future<> uncork() {
+        return _session.wait_for_output().then([this] {
+            auto res = gnutls_record_uncork(_session, 0);
+            if (res == GNUTLS_E_AGAIN) {
+                return uncork();
+            }
+            if (res < 0) {
+                return _session.handle_output_error(res);
+            }
+            return make_ready_future<>();
+        });
+    }
+
     future<> flush() override {
         return _session.flush();
     }
     future<> put(net::packet p) override {
+        if (_session.kernel_tls_tx()) {
+            return _session.put_plaintext(std::move(p));
+        }
         auto i = p.fragments().begin();
         auto e = p.fragments().end();
         return put(std::move(p), i, e);
@@ -1062,6 +1469,10 @@ class tls_socket_impl : public net::socket_impl {
 }
 }
 
+void seastar::tls::set_handshake_offload(unsigned max_concurrent) {
+    local_handshakes().set_offload_limit(max_concurrent);
+}
+
 data_source seastar::tls::session::source() {
     return data_source(std::make_unique<source_impl>(*this));
 }
@@ -21,7 +21,10 @@
 #pragma once
 
 #include <experimental/string_view>
+#include <chrono>
+#include <map>
 #include <vector>
+#include <boost/any.hpp>
 
 #include "core/future.hh"
 #include "core/sstring.hh"
@@ -153,6 +156,14 @@ namespace tls {
          * Allows specifying order and allowance for handshake alg.
          */
         void set_priority_string(const sstring&);
+
+        /**
+         * Client side: how many sessions (one per server name) to remember
+         * for resumption, so reconnecting skips the full handshake.
+         * 0 disables the cache. Connections made without a server name are
+         * never resumed.
+         */
+        void set_session_cache_size(size_t);
     private:
         class impl;
         friend class session;
@@ -188,8 +199,30 @@ namespace tls {
         server_credentials& operator=(const server_credentials&) = delete;
 
         void set_client_auth(client_auth);
+
+        /**
+         * Issues session tickets, letting clients resume sessions without
+         * a full handshake. The ticket key is derived from the secret and
+         * replaced every rotation period; tickets expire with it. Give the
+         * credentials of every shard the same secret (see
+         * generate_session_ticket_secret()) so that any shard can resume a
+         * session another one issued.
+         */
+        void enable_session_tickets(const sstring& secret,
+                std::chrono::seconds rotation = std::chrono::hours(1));
     };
 
+    /** Returns a new random secret for server_credentials::enable_session_tickets() */
+    sstring generate_session_ticket_secret();
+
+    /**
+     * Runs the CPU-heavy gnutls handshake steps of sessions on this shard
+     * on its syscall threads (see --syscall-threads) instead of the
+     * reactor, at most max_concurrent at a time; further steps queue.
+     * 0, the default, runs them inline. Applies to the calling shard only.
+     */
+    void set_handshake_offload(unsigned max_concurrent);
+
     /**
      * Intentionally "primitive", and more importantly, copyable
      * container for certificate credentials options.
@@ -212,6 +245,10 @@ namespace tls {
         future<> set_system_trust();
         void set_client_auth(client_auth);
         void set_priority_string(const sstring&);
+        void set_session_cache_size(size_t);
+        // Generates the secret now, so every credentials object built
+        // from this builder or its copies shares it
+        void enable_session_tickets(std::chrono::seconds rotation = std::chrono::hours(1));
 
         void apply_to(certificate_credentials&) const;
 
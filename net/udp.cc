@@ -91,6 +91,17 @@ class native_channel : public udp_channel_impl {
         return _state->_queue.pop_eventually();
     }
 
+    virtual future<std::vector<udp_datagram>> receive_batch(size_t max_datagrams) override {
+        return _state->_queue.pop_eventually().then([this, max_datagrams] (udp_datagram d) {
+            std::vector<udp_datagram> batch;
+            batch.push_back(std::move(d));
+            while (batch.size() < max_datagrams && !_state->_queue.empty()) {
+                batch.push_back(_state->_queue.pop());
+            }
+            return batch;
+        });
+    }
+
     virtual future<> send(ipv4_addr dst, const char* msg) override {
         return send(dst, packet::from_static_data(msg, strlen(msg)));
     }
@@ -103,6 +114,23 @@ class native_channel : public udp_channel_impl {
         });
     }
 
+    virtual future<> send(std::vector<std::pair<ipv4_addr, packet>> datagrams) override {
+        size_t len = 0;
+        for (auto&& d : datagrams) {
+            len += d.second.len();
+        }
+        // A batch larger than the whole buffer still goes out, alone
+        len = std::min(len, udp_channel_state::send_buffer_size);
+        return _state->wait_for_send_buffer(len).then([this, datagrams = std::move(datagrams), len] () mutable {
+            // The space is returned once the last datagram is sent
+            auto d = make_deleter([s = _state, len] { s->complete_send(len); });
+            for (auto&& dgram : datagrams) {
+                dgram.second = packet(std::move(dgram.second), d.share());
+            }
+            _proto.send(_reg.port(), datagrams);
+        });
+    }
+
     virtual bool is_closed() const {
         return _closed;
     }
@@ -119,6 +147,8 @@ class native_channel : public udp_channel_impl {
 using namespace net::ipv4_udp_impl;
 
 const int ipv4_udp::default_queue_size = 1024;
+constexpr unsigned ipv4_udp::max_gso_segments;
+constexpr size_t udp_channel_state::send_buffer_size;
 
 ipv4_udp::ipv4_udp(ipv4& inet)
     : _inet(inet)
@@ -156,16 +186,76 @@ void ipv4_udp::received(packet p, ipv4_address from, ipv4_address to)
 }
 
 void ipv4_udp::send(uint16_t src_port, ipv4_addr dst, packet &&p)
+{
+    send(src_port, dst, std::move(p), 0);
+}
+
+void ipv4_udp::send(uint16_t src_port, std::vector<std::pair<ipv4_addr, packet>>& datagrams)
+{
+    auto& hw = _inet.hw_features();
+    auto gso = hw.tx_udp_seg && hw.tx_csum_l4_offload;
+    auto max_seg = hw.mtu - net::ipv4_hdr_len_min - sizeof(udp_hdr);
+    auto max_len = net::ip_packet_len_max - net::ipv4_hdr_len_min - sizeof(udp_hdr);
+    auto same_dst = [] (const ipv4_addr& a, const ipv4_addr& b) {
+        return a.ip == b.ip && a.port == b.port;
+    };
+    for (size_t i = 0; i < datagrams.size();) {
+        auto dst = datagrams[i].first;
+        auto seg = datagrams[i].second.len();
+        size_t n = 1;
+        if (gso && seg && seg <= max_seg) {
+            // Extend the run with datagrams of the same size to the same
+            // destination, the last one may be shorter
+            auto total = seg;
+            while (i + n < datagrams.size() && n < max_gso_segments) {
+                auto& next = datagrams[i + n];
+                auto len = next.second.len();
+                if (!same_dst(next.first, dst) || !len || len > seg || total + len > max_len) {
+                    break;
+                }
+                total += len;
+                ++n;
+                if (len < seg) {
+                    break;
+                }
+            }
+        }
+        if (n == 1) {
+            send(src_port, dst, std::move(datagrams[i].second), 0);
+        } else {
+            packet p;
+            p.reserve(n);
+            for (size_t j = i; j < i + n; ++j) {
+                p.append(std::move(datagrams[j].second));
+            }
+            send(src_port, dst, std::move(p), seg);
+        }
+        i += n;
+    }
+}
+
+void ipv4_udp::send(uint16_t src_port, ipv4_addr dst, packet &&p, uint16_t seg_size)
 {
     auto src = _inet.host_address();
     auto hdr = p.prepend_header<udp_hdr>();
     hdr->src_port = src_port;
     hdr->dst_port = dst.port;
-    hdr->len = p.len();
+    // The device fixes the length of the last segment up
+    hdr->len = seg_size ? seg_size + sizeof(udp_hdr) : p.len();
     *hdr = hton(*hdr);
 
     offload_info oi;
     checksummer csum;
+    if (seg_size) {
+        // As for TSO, the pseudo header is summed with a zero length
+        ipv4_traits::udp_pseudo_header_checksum(csum, src, dst, 0);
+        hdr->cksum = ~csum.get();
+        oi.needs_csum = true;
+        oi.tso_seg_size = seg_size;
+        oi.protocol = ip_protocol_num::udp;
+        p.set_offload_info(oi);
+        return queue_packet(dst, std::move(p));
+    }
     ipv4_traits::udp_pseudo_header_checksum(csum, src, dst, p.len());
     bool needs_frag = ipv4::needs_frag(p, ip_protocol_num::udp, _inet.hw_features());
     if (_inet.hw_features().tx_csum_l4_offload && !needs_frag) {
@@ -178,7 +268,15 @@ void ipv4_udp::send(uint16_t src_port, ipv4_addr dst, packet &&p)
     }
     oi.protocol = ip_protocol_num::udp;
     p.set_offload_info(oi);
+    queue_packet(dst, std::move(p));
+}
 
+void ipv4_udp::queue_packet(ipv4_addr dst, packet p)
+{
+    if (auto e_dst = _inet.try_get_l2_dst_address(dst)) {
+        _packetq.emplace_back(ipv4_traits::l4packet{dst, std::move(p), *e_dst, ip_protocol_num::udp});
+        return;
+    }
     _inet.get_l2_dst_address(dst).then([this, dst, p = std::move(p)] (ethernet_address e_dst) mutable {
         _packetq.emplace_back(ipv4_traits::l4packet{dst, std::move(p), e_dst, ip_protocol_num::udp});
     });
@@ -46,9 +46,10 @@ struct udp_hdr {
 } __attribute__((packed));
 
 struct udp_channel_state {
+    static constexpr size_t send_buffer_size = 212992;
     queue<udp_datagram> _queue;
     // Limit number of data queued into send queue
-    semaphore _user_queue_space = {212992};
+    semaphore _user_queue_space = {send_buffer_size};
     udp_channel_state(size_t queue_size) : _queue(queue_size) {}
     future<> wait_for_send_buffer(size_t len) { return _user_queue_space.wait(len); }
     void complete_send(size_t len) { _user_queue_space.signal(len); }
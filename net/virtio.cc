@@ -33,9 +33,15 @@
 #include <atomic>
 #include <vector>
 #include <queue>
+#include <mutex>
+#include <limits>
+#include <cstddef>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <linux/vhost.h>
 #include <linux/if_tun.h>
+#include "core/memory.hh"
 #include "ip.hh"
 #include "const.hh"
 #include "net/native-stack.hh"
@@ -64,11 +70,236 @@ phys virt_to_phys(void* p) {
 
 #endif
 
+// vhost-user is the vhost protocol spoken over a unix socket to a backend
+// in userspace, a switch such as OVS-DPDK or VPP, rather than through
+// ioctl()s to the kernel's vhost-net; the host kernel is then out of the
+// data path.
+//
+// The backend maps the memory holding the rings and the packet buffers,
+// so it must be shareable: each shard passes the hugetlbfs file its memory
+// is allocated from, which takes --hugepages. A shard shares only its own
+// memory, so transmitted fragments lying elsewhere are copied into it.
+//
+// Queue pairs, one per shard, share the connection (the multiqueue
+// protocol feature). The backend takes a single memory table for all of
+// them, so the rings are set up once the last queue pair has registered.
+class vhost_user {
+public:
+    // The feature bit announcing protocol features, and the one of those
+    // allowing multiple queue pairs
+    static constexpr uint64_t f_protocol_features = uint64_t(1) << 30;
+    static constexpr uint64_t protocol_f_mq = uint64_t(1) << 0;
+    // Backends take no more memory regions
+    static constexpr unsigned max_regions = 8;
+    struct ring {
+        unsigned index;
+        unsigned size;
+        uint64_t descs;
+        uint64_t avail;
+        uint64_t used;
+        int kick_fd;
+    };
+    struct queue_pair {
+        ring rx;
+        ring tx;
+        uintptr_t memory_start;
+        uintptr_t memory_end;
+        int memory_fd;
+    };
+private:
+    enum class request : uint32_t {
+        get_features = 1,
+        set_features = 2,
+        set_owner = 3,
+        set_mem_table = 5,
+        set_vring_num = 8,
+        set_vring_addr = 9,
+        set_vring_base = 10,
+        set_vring_kick = 12,
+        set_vring_call = 13,
+        get_protocol_features = 15,
+        set_protocol_features = 16,
+        get_queue_num = 17,
+        set_vring_enable = 18,
+    };
+    struct header {
+        request req;
+        uint32_t flags;
+        uint32_t size;
+    };
+    static constexpr uint32_t version = 0x1;
+    static constexpr uint32_t reply_flag = 0x4;
+    // Marks a set_vring_call or set_vring_kick that passes no descriptor
+    static constexpr uint64_t vring_nofd = 0x100;
+    struct memory_region {
+        uint64_t guest_phys_addr;
+        uint64_t memory_size;
+        uint64_t userspace_addr;
+        uint64_t mmap_offset;
+    };
+    struct memory_table {
+        uint32_t nregions;
+        uint32_t padding;
+        memory_region regions[max_regions];
+    };
+    file_desc _socket;
+    // Queue pairs register from their own shards
+    std::mutex _mutex;
+    std::vector<queue_pair> _queue_pairs;
+    unsigned _expected_queue_pairs = 1;
+    bool _protocol_features = false;
+public:
+    explicit vhost_user(const std::string& path);
+    // Agrees on the features, of those in \c features, and on the number
+    // of queue pairs, at most \c queue_pairs; returns the features
+    uint64_t negotiate(uint64_t features, unsigned& queue_pairs);
+    // Called by each queue pair on its shard; the last one sets up the
+    // rings of all
+    void add_queue_pair(queue_pair qp);
+private:
+    void send(request req, const void* payload = nullptr, size_t size = 0, std::vector<int> fds = {});
+    uint64_t get_u64(request req);
+    void read_exactly(void* buf, size_t size);
+    void setup_rings();
+    void setup_ring(const ring& r);
+};
+
+vhost_user::vhost_user(const std::string& path)
+    : _socket(file_desc::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC)) {
+    sockaddr_un sa = {};
+    sa.sun_family = AF_UNIX;
+    if (path.size() + 1 > sizeof(sa.sun_path)) {
+        throw std::runtime_error(sprint("vhost-user: socket path %s is too long", path));
+    }
+    strcpy(sa.sun_path, path.c_str());
+    _socket.connect(reinterpret_cast<sockaddr&>(sa), sizeof(sa));
+}
+
+uint64_t vhost_user::negotiate(uint64_t features, unsigned& queue_pairs) {
+    auto offered = get_u64(request::get_features);
+    features &= offered;
+    unsigned backend_queue_pairs = 1;
+    if (offered & f_protocol_features) {
+        _protocol_features = true;
+        auto protocol = get_u64(request::get_protocol_features) & protocol_f_mq;
+        send(request::set_protocol_features, &protocol, sizeof(protocol));
+        if (protocol & protocol_f_mq) {
+            backend_queue_pairs = get_u64(request::get_queue_num);
+        }
+    }
+    queue_pairs = std::max(1u, std::min({queue_pairs, backend_queue_pairs, max_regions}));
+    _expected_queue_pairs = queue_pairs;
+    send(request::set_owner);
+    auto accepted = features | (offered & f_protocol_features);
+    send(request::set_features, &accepted, sizeof(accepted));
+    return features;
+}
+
+void vhost_user::add_queue_pair(queue_pair qp) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queue_pairs.push_back(qp);
+    if (_queue_pairs.size() == _expected_queue_pairs) {
+        setup_rings();
+    }
+}
+
+void vhost_user::send(request req, const void* payload, size_t size, std::vector<int> fds) {
+    header h = { req, version, uint32_t(size) };
+    iovec iov[2] = { { &h, sizeof(h) }, { const_cast<void*>(payload), size } };
+    msghdr mh = {};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = size ? 2 : 1;
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * max_regions)];
+    } control;
+    if (!fds.empty()) {
+        assert(fds.size() <= max_regions);
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        auto cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::copy(fds.begin(), fds.end(), reinterpret_cast<int*>(CMSG_DATA(cmsg)));
+    }
+    // Messages are small and the socket blocking, so they go in one piece
+    auto r = _socket.sendmsg(&mh, MSG_NOSIGNAL);
+    if (!r || *r != sizeof(h) + size) {
+        throw std::runtime_error("vhost-user: short write to the backend");
+    }
+}
+
+void vhost_user::read_exactly(void* buf, size_t size) {
+    auto p = static_cast<char*>(buf);
+    while (size) {
+        auto r = _socket.read(p, size);
+        if (!r || !*r) {
+            throw std::runtime_error("vhost-user: the backend closed the connection");
+        }
+        p += *r;
+        size -= *r;
+    }
+}
+
+uint64_t vhost_user::get_u64(request req) {
+    send(req);
+    header h;
+    read_exactly(&h, sizeof(h));
+    if (h.req != req || !(h.flags & reply_flag) || h.size != sizeof(uint64_t)) {
+        throw std::runtime_error(sprint("vhost-user: bad reply to request %d", uint32_t(req)));
+    }
+    uint64_t v;
+    read_exactly(&v, sizeof(v));
+    return v;
+}
+
+void vhost_user::setup_rings() {
+    memory_table mt = {};
+    std::vector<int> fds;
+    for (auto& qp : _queue_pairs) {
+        // virt_to_phys() is the identity, so descriptors carry addresses
+        // in our address space
+        auto& r = mt.regions[mt.nregions++];
+        r.guest_phys_addr = qp.memory_start;
+        r.memory_size = qp.memory_end - qp.memory_start;
+        r.userspace_addr = qp.memory_start;
+        r.mmap_offset = 0;
+        fds.push_back(qp.memory_fd);
+    }
+    send(request::set_mem_table, &mt, offsetof(memory_table, regions) + mt.nregions * sizeof(memory_region), std::move(fds));
+    for (auto& qp : _queue_pairs) {
+        setup_ring(qp.rx);
+        setup_ring(qp.tx);
+    }
+}
+
+void vhost_user::setup_ring(const ring& r) {
+    vhost_vring_state num = { r.index, r.size };
+    send(request::set_vring_num, &num, sizeof(num));
+    vhost_vring_state base = { r.index, 0 };
+    send(request::set_vring_base, &base, sizeof(base));
+    vhost_vring_addr addr = { r.index, 0, r.descs, r.used, r.avail, 0 };
+    send(request::set_vring_addr, &addr, sizeof(addr));
+    uint64_t kick = r.index;
+    send(request::set_vring_kick, &kick, sizeof(kick), { r.kick_fd });
+    // The used rings are polled; the backend needn't signal anything
+    uint64_t call = r.index | vring_nofd;
+    send(request::set_vring_call, &call, sizeof(call));
+    if (_protocol_features) {
+        // Rings start disabled once protocol features are agreed on
+        vhost_vring_state enable = { r.index, 1 };
+        send(request::set_vring_enable, &enable, sizeof(enable));
+    }
+}
+
 class device : public net::device {
 private:
     boost::program_options::variables_map _opts;
     net::hw_features _hw_features;
     uint64_t _features;
+    uint16_t _num_queues;
+    std::unique_ptr<vhost_user> _vhost_user;
 
 private:
     uint64_t setup_features() {
@@ -111,10 +342,66 @@ class device : public net::device {
         return seastar_supported_features;
     }
 
+    // vhost-net serves one queue pair per vhost instance, so multiqueue
+    // (the VIRTIO_NET_F_MQ model) means one vhost instance and one tap
+    // queue per shard. The tap device must allow it: a persistent tap
+    // created without multi_queue doesn't, in which case we use one queue.
+    uint16_t setup_queues() {
+        if (smp::count == 1 || (_opts.count("multi-queue") && _opts["multi-queue"].as<std::string>() == "off")) {
+            return 1;
+        }
+        if (_opts.count("vhost-user-socket")) {
+            // The backend may take fewer, see setup_vhost_user()
+            return std::min(smp::count, unsigned(std::numeric_limits<uint16_t>::max()));
+        }
+#ifdef HAVE_OSV
+        if (osv::assigned_virtio::get && osv::assigned_virtio::get()) {
+            return 1;
+        }
+#endif
+        if (!_opts.count("tap-device")) {
+            return 1;
+        }
+        auto tap_device = _opts["tap-device"].as<std::string>();
+        try {
+            file_desc tap_fd(file_desc::open("/dev/net/tun", O_RDWR | O_NONBLOCK));
+            assert(tap_device.size() + 1 <= IFNAMSIZ);
+            ifreq ifr = {};
+            ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR | IFF_MULTI_QUEUE;
+            strcpy(ifr.ifr_ifrn.ifrn_name, tap_device.c_str());
+            tap_fd.ioctl(TUNSETIFF, ifr);
+        } catch (std::system_error& e) {
+            print("virtio: %s does not support multiple queues (%s), using one\n", tap_device, e.what());
+            return 1;
+        }
+        // The kernel allows at most 256 queues per tap device
+        return std::min(smp::count, 256u);
+    }
+
+    void setup_vhost_user() {
+        _vhost_user = std::make_unique<vhost_user>(_opts["vhost-user-socket"].as<std::string>());
+        unsigned queue_pairs = _num_queues;
+        _features = _vhost_user->negotiate(_features, queue_pairs);
+        _num_queues = queue_pairs;
+        if (!(_features & VIRTIO_NET_F_MRG_RXBUF)) {
+            throw std::runtime_error("vhost-user: the backend does not support mergeable receive buffers");
+        }
+        // Offloads the backend doesn't do are done by the stack
+        _hw_features.tx_csum_l4_offload = _features & VIRTIO_NET_F_CSUM;
+        _hw_features.rx_csum_offload = _features & VIRTIO_NET_F_GUEST_CSUM;
+        _hw_features.tx_tso = _features & VIRTIO_NET_F_HOST_TSO4;
+        _hw_features.rx_lro = _features & VIRTIO_NET_F_GUEST_TSO4;
+        _hw_features.tx_ufo = _features & VIRTIO_NET_F_HOST_UFO;
+    }
+
 public:
     device(boost::program_options::variables_map opts)
-       : _opts(opts), _features(setup_features())
-       {}
+       : _opts(opts), _features(setup_features()), _num_queues(setup_queues())
+       {
+        if (_opts.count("vhost-user-socket")) {
+            setup_vhost_user();
+        }
+       }
     ethernet_address hw_address() override {
         return { 0x12, 0x23, 0x34, 0x56, 0x67, 0x78 };
     }
@@ -127,6 +414,10 @@ class device : public net::device {
         return _features;
     }
 
+    virtual uint16_t hw_queues_count() override {
+        return _num_queues;
+    }
+
     virtual std::unique_ptr<net::qp> init_local_queue(boost::program_options::variables_map opts, uint16_t qid) override;
 };
 
@@ -348,6 +639,17 @@ class vring {
         }
     }
 
+    // We poll the used ring, so the host never needs to interrupt us
+    void disable_interrupts() {
+        _avail._shared->_flags.store(VRING_AVAIL_F_NO_INTERRUPT, std::memory_order_relaxed);
+        if (_config.event_index) {
+            // The host ignores the flag then, and interrupts when the used
+            // index passes used_event; keep it a full ring ahead of what we
+            // have consumed, which the host can never reach.
+            _used_event->store(_used._tail + _config.size, std::memory_order_relaxed);
+        }
+    }
+
     bool do_complete();
     size_t mask() { return size() - 1; }
     size_t masked(size_t idx) { return idx & mask(); }
@@ -405,6 +707,7 @@ void vring<BufferChain, Completion>::setup() {
     _free_head = 0;
     _free_last = _config.size - 1;
     _available_descriptors.signal(_config.size);
+    disable_interrupts();
 }
 
 // Iterator: points at a buffer_chain
@@ -439,7 +742,10 @@ void vring<BufferChain, Completion>::post(Iterator begin, Iterator end) {
 template <typename BufferChain, typename Completion>
 bool vring<BufferChain, Completion>::do_complete() {
     auto used_head = _used._shared->_idx.load(std::memory_order_acquire);
-    auto count = _used._tail - used_head;
+    uint16_t count = used_head - _used._tail;
+    if (!count) {
+        return false;
+    }
     _complete.bunch(count);
     while (used_head != _used._tail) {
         auto ue = _used._shared->_used_elements[masked(_used._tail++)];
@@ -459,7 +765,10 @@ bool vring<BufferChain, Completion>::do_complete() {
         }
         _free_last = id;
     }
-    return count;
+    if (_config.event_index) {
+        _used_event->store(_used._tail + _config.size, std::memory_order_relaxed);
+    }
+    return true;
 }
 
 class qp : public net::qp {
@@ -506,6 +815,17 @@ class qp : public net::qp {
         qp& _dev;
         vring<packet_as_buffer_chain, complete> _ring;
         std::vector<packet_as_buffer_chain> _packets;
+        // Copies the packet into one buffer of this shard's memory
+        static packet bounce(packet p) {
+            temporary_buffer<char> buf(p.len());
+            auto dst = buf.get_write();
+            for (auto&& f : p.fragments()) {
+                dst = std::copy_n(f.base, f.size, dst);
+            }
+            packet q(std::move(buf));
+            q.set_offload_info(p.offload_info());
+            return q;
+        }
     public:
         txq(qp& dev, ring_config config);
         void set_notifier(std::unique_ptr<notifier> notifier) {
@@ -535,6 +855,9 @@ class qp : public net::qp {
         };
         qp& _dev;
         vring<single_buffer, complete> _ring;
+        // Free descriptors to wait for before refilling, so that buffers
+        // are posted, and the host kicked, in batches
+        unsigned _refill_batch;
         unsigned _remaining_buffers = 0;
         std::vector<fragment> _fragments;
         std::vector<std::unique_ptr<char[], free_deleter>> _buffers;
@@ -563,6 +886,9 @@ class qp : public net::qp {
 protected:
     device* _dev;
     size_t _header_len;
+    // Where transmitted fragments must lie for the host to reach them, if
+    // it can't reach all of our memory
+    std::experimental::optional<memory::memory_layout> _tx_memory;
     std::unique_ptr<char[], free_deleter> _txq_storage;
     std::unique_ptr<char[], free_deleter> _rxq_storage;
     txq _txq;
@@ -572,8 +898,17 @@ class qp : public net::qp {
     ring_config rxq_config(size_t rxq_ring_size);
     void common_config(ring_config& r);
     size_t vring_storage_size(size_t ring_size);
+    bool reachable(packet& p) const {
+        for (auto&& f : p.fragments()) {
+            auto addr = reinterpret_cast<uintptr_t>(f.base);
+            if (addr < _tx_memory->start || addr + f.size > _tx_memory->end) {
+                return false;
+            }
+        }
+        return true;
+    }
 public:
-    explicit qp(device* dev, size_t rx_ring_size, size_t tx_ring_size);
+    explicit qp(device* dev, size_t rx_ring_size, size_t tx_ring_size, uint16_t qid = 0);
     virtual future<> send(packet p) override {
         abort();
     }
@@ -637,6 +972,9 @@ qp::txq::post(circular_buffer<packet>& pb) {
                 }
             }
         }
+        if (_dev._tx_memory && !_dev.reachable(p)) {
+            p = bounce(std::move(p));
+        }
         // prepend virtio-net header
         packet q = packet(fragment{reinterpret_cast<char*>(&vhdr), _dev._header_len},
                 std::move(p));
@@ -652,14 +990,14 @@ qp::txq::post(circular_buffer<packet>& pb) {
 }
 
 qp::rxq::rxq(qp& dev, ring_config config)
-    : _dev(dev), _ring(config, complete{*this}) {
+    : _dev(dev), _ring(config, complete{*this}), _refill_batch(std::max(1u, config.size / 16)) {
 }
 
 future<>
 qp::rxq::prepare_buffers() {
     auto& available = _ring.available_descriptors();
-    return available.wait(1).then([this, &available] {
-        unsigned count = 1;
+    return available.wait(_refill_batch).then([this, &available] {
+        unsigned count = _refill_batch;
         auto opportunistic = available.current();
         if (available.try_wait(opportunistic)) {
             count += opportunistic;
@@ -749,8 +1087,9 @@ static std::unique_ptr<char[], free_deleter> virtio_buffer(size_t size) {
     return std::unique_ptr<char[], free_deleter>(reinterpret_cast<char*>(ret));
 }
 
-qp::qp(device* dev, size_t rx_ring_size, size_t tx_ring_size)
-    : _dev(dev)
+qp::qp(device* dev, size_t rx_ring_size, size_t tx_ring_size, uint16_t qid)
+    : net::qp(false, "network", qid)
+    , _dev(dev)
     , _txq_storage(virtio_buffer(vring_storage_size(tx_ring_size)))
     , _rxq_storage(virtio_buffer(vring_storage_size(rx_ring_size)))
     , _txq(*this, txq_config(tx_ring_size))
@@ -803,7 +1142,7 @@ class qp_vhost : public qp {
     // this driver, as as soon as we close it, vhost stops servicing us.
     file_desc _vhost_fd;
 public:
-    qp_vhost(device* dev, boost::program_options::variables_map opts);
+    qp_vhost(device* dev, boost::program_options::variables_map opts, uint16_t qid);
 };
 
 static size_t config_ring_size(boost::program_options::variables_map &opts) {
@@ -814,8 +1153,8 @@ static size_t config_ring_size(boost::program_options::variables_map &opts) {
     }
 }
 
-qp_vhost::qp_vhost(device *dev, boost::program_options::variables_map opts)
-    : qp(dev, config_ring_size(opts), config_ring_size(opts))
+qp_vhost::qp_vhost(device *dev, boost::program_options::variables_map opts, uint16_t qid)
+    : qp(dev, config_ring_size(opts), config_ring_size(opts), qid)
     , _vhost_fd(file_desc::open("/dev/vhost-net", O_RDWR))
 {
     auto tap_device = opts["tap-device"].as<std::string>();
@@ -838,6 +1177,12 @@ qp_vhost::qp_vhost(device *dev, boost::program_options::variables_map opts)
     assert(tap_device.size() + 1 <= IFNAMSIZ);
     ifreq ifr = {};
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_ONE_QUEUE | IFF_VNET_HDR;
+    if (_dev->hw_queues_count() > 1) {
+        // Each queue pair opens its own queue of the tap device. Received
+        // flows are steered to the queue that last transmitted on them,
+        // which is the shard that owns them.
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
     strcpy(ifr.ifr_ifrn.ifrn_name, tap_device.c_str());
     tap_fd.ioctl(TUNSETIFF, ifr);
     unsigned int offload = 0;
@@ -894,6 +1239,38 @@ qp_vhost::qp_vhost(device *dev, boost::program_options::variables_map opts)
     _vhost_fd.ioctl(VHOST_NET_SET_BACKEND, vhost_vring_file{1, tap_fd.get()});
 }
 
+class qp_vhost_user : public qp {
+public:
+    qp_vhost_user(device* dev, vhost_user& backend, boost::program_options::variables_map opts, uint16_t qid);
+};
+
+qp_vhost_user::qp_vhost_user(device* dev, vhost_user& backend, boost::program_options::variables_map opts, uint16_t qid)
+    : qp(dev, config_ring_size(opts), config_ring_size(opts), qid)
+{
+    auto memory_fd = memory::memory_backing_fd();
+    if (!memory_fd) {
+        throw std::runtime_error("vhost-user: the backend maps the network buffers, which must be on hugetlbfs (--hugepages)");
+    }
+    auto layout = memory::get_memory_layout();
+    _tx_memory = layout;
+    _header_len = sizeof(net_hdr_mrg);
+
+    writeable_eventfd rxq_kick;
+    writeable_eventfd txq_kick;
+    auto tov = [](char* x) { return reinterpret_cast<uintptr_t>(x); };
+    auto& rxc = _rxq.getconfig();
+    auto& txc = _txq.getconfig();
+    vhost_user::queue_pair vqp;
+    vqp.rx = { 2u * qid, rxc.size, tov(rxc.descs), tov(rxc.avail), tov(rxc.used), rxq_kick.get_read_fd() };
+    vqp.tx = { 2u * qid + 1, txc.size, tov(txc.descs), tov(txc.avail), tov(txc.used), txq_kick.get_read_fd() };
+    vqp.memory_start = layout.start;
+    vqp.memory_end = layout.end;
+    vqp.memory_fd = *memory_fd;
+    _rxq.set_notifier(std::make_unique<notifier_vhost>(std::move(rxq_kick)));
+    _txq.set_notifier(std::make_unique<notifier_vhost>(std::move(txq_kick)));
+    backend.add_queue_pair(vqp);
+}
+
 #ifdef HAVE_OSV
 class qp_osv : public qp {
 private:
@@ -971,10 +1348,7 @@ qp_osv::qp_osv(device *dev, osv::assigned_virtio &virtio,
 #endif
 
 std::unique_ptr<net::qp> device::init_local_queue(boost::program_options::variables_map opts, uint16_t qid) {
-    static bool called = false;
-    assert(!qid);
-    assert(!called);
-    called = true;
+    assert(qid < _num_queues);
 
 #ifdef HAVE_OSV
     if (osv::assigned_virtio::get && osv::assigned_virtio::get()) {
@@ -982,7 +1356,10 @@ std::unique_ptr<net::qp> device::init_local_queue(boost::program_options::variab
         return std::make_unique<qp_osv>(this, *osv::assigned_virtio::get(), opts);
     }
 #endif
-    return std::make_unique<qp_vhost>(this, opts);
+    if (_vhost_user) {
+        return std::make_unique<qp_vhost_user>(this, *_vhost_user, opts, qid);
+    }
+    return std::make_unique<qp_vhost>(this, opts, qid);
 }
 
 }
@@ -1005,6 +1382,12 @@ get_virtio_net_options_description()
         ("ufo",
                 boost::program_options::value<std::string>()->default_value("on"),
                 "Enable UDP fragmentation offload feature (on / off)")
+        ("multi-queue",
+                boost::program_options::value<std::string>()->default_value("on"),
+                "Use a queue pair per shard, if the tap device allows (on / off)")
+        ("vhost-user-socket",
+                boost::program_options::value<std::string>(),
+                "Connect to a vhost-user backend (a userspace switch) at this unix socket, instead of a tap device through vhost-net; needs --hugepages")
         ("virtio-ring-size",
                 boost::program_options::value<unsigned>()->default_value(256),
                 "Virtio ring size (must be power-of-two)")
@@ -0,0 +1,612 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#ifdef HAVE_AF_XDP
+
+#include "core/posix.hh"
+#include "core/reactor.hh"
+#include "core/aligned_buffer.hh"
+#include "core/print.hh"
+#include "xdp.hh"
+#include "const.hh"
+#include <experimental/optional>
+#include <algorithm>
+#include <vector>
+#include <net/if.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sockios.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+namespace xdp {
+
+using namespace net;
+
+// Every UMEM frame holds one packet. The kernel puts XDP_PACKET_HEADROOM
+// in front of received data, which bounds the MTU we can offer.
+static constexpr uint32_t frame_size = 4096;
+static constexpr uint32_t xdp_packet_headroom = 256;
+static constexpr uint32_t frame_capacity = frame_size - xdp_packet_headroom;
+static constexpr uint16_t packet_read_size = 32;
+// ethtool_rxfh::hfunc bit of the Toeplitz hash; not exported to userspace
+static constexpr uint8_t rss_hash_toeplitz = 1 << 0;
+
+static int bpf(int cmd, bpf_attr& attr) {
+    return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+/*
+ * One of the four single-producer/single-consumer rings an AF_XDP socket
+ * shares with the kernel: we produce into the fill and tx rings and consume
+ * the rx and completion rings. Indices run freely and are masked on access.
+ */
+template <typename Entry>
+class ring {
+    mmap_area _area;
+    uint32_t* _producer;
+    uint32_t* _consumer;
+    uint32_t* _flags;
+    Entry* _entries;
+    uint32_t _size;
+    uint32_t _cached_prod;
+    uint32_t _cached_cons;
+public:
+    ring(file_desc& fd, const xdp_ring_offset& off, uint64_t pgoff, uint32_t size)
+        : _area(fd.map(off.desc + size * sizeof(Entry), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, pgoff))
+        , _producer(reinterpret_cast<uint32_t*>(_area.get() + off.producer))
+        , _consumer(reinterpret_cast<uint32_t*>(_area.get() + off.consumer))
+        , _flags(reinterpret_cast<uint32_t*>(_area.get() + off.flags))
+        , _entries(reinterpret_cast<Entry*>(_area.get() + off.desc))
+        , _size(size)
+        , _cached_prod(__atomic_load_n(_producer, __ATOMIC_ACQUIRE))
+        , _cached_cons(__atomic_load_n(_consumer, __ATOMIC_ACQUIRE)) {
+    }
+    Entry& operator[](uint32_t idx) {
+        return _entries[idx & (_size - 1)];
+    }
+    // Producer side: claims up to n slots starting at idx
+    uint32_t reserve(uint32_t n, uint32_t& idx) {
+        auto free = _size - (_cached_prod - _cached_cons);
+        if (free < n) {
+            _cached_cons = __atomic_load_n(_consumer, __ATOMIC_ACQUIRE);
+            free = _size - (_cached_prod - _cached_cons);
+        }
+        n = std::min(n, free);
+        idx = _cached_prod;
+        _cached_prod += n;
+        return n;
+    }
+    void submit() {
+        __atomic_store_n(_producer, _cached_prod, __ATOMIC_RELEASE);
+    }
+    // Consumer side: up to n filled slots starting at idx
+    uint32_t peek(uint32_t n, uint32_t& idx) {
+        auto avail = _cached_prod - _cached_cons;
+        if (avail == 0) {
+            _cached_prod = __atomic_load_n(_producer, __ATOMIC_ACQUIRE);
+            avail = _cached_prod - _cached_cons;
+        }
+        idx = _cached_cons;
+        return std::min(n, avail);
+    }
+    void release(uint32_t n) {
+        _cached_cons += n;
+        __atomic_store_n(_consumer, _cached_cons, __ATOMIC_RELEASE);
+    }
+    bool needs_wakeup() const {
+        return __atomic_load_n(_flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP;
+    }
+};
+
+class xdp_device;
+
+class xdp_qp : public net::qp {
+    xdp_device* _dev;
+    uint16_t _qid;
+    unsigned _ring_size;
+    file_desc _fd;
+    // Allocated on the shard owning the queue, so frames are NUMA-local
+    std::unique_ptr<char[], free_deleter> _umem;
+    std::experimental::optional<ring<uint64_t>> _fill;
+    std::experimental::optional<ring<uint64_t>> _comp;
+    std::experimental::optional<ring<xdp_desc>> _rx;
+    std::experimental::optional<ring<xdp_desc>> _tx;
+    std::vector<uint64_t> _rx_free;
+    std::vector<uint64_t> _tx_free;
+    // Received frames still referenced by packets up the stack
+    unsigned _rx_frames_in_stack = 0;
+    std::vector<packet> _rx_burst;
+    std::experimental::optional<reactor::poller> _rx_poller;
+public:
+    xdp_qp(xdp_device* dev, uint16_t qid, unsigned ring_size, uint32_t bind_flags);
+    virtual void rx_start() override {
+        _rx_poller = reactor::poller::simple([this] { return poll_rx_once(); });
+    }
+    virtual future<> send(packet p) override {
+        abort();
+    }
+    virtual uint32_t send(circular_buffer<packet>& pb) override;
+private:
+    // Twice the ring size receives, so the fill ring stays full while
+    // up to a ring's worth of frames is held zero-copy by the stack
+    unsigned nr_rx_frames() const { return 2 * _ring_size; }
+    unsigned nr_frames() const { return nr_rx_frames() + _ring_size; }
+    bool poll_rx_once();
+    void refill();
+    void reclaim_tx();
+};
+
+class xdp_device : public net::device {
+    sstring _ifname;
+    unsigned _ifindex;
+    ethernet_address _mac;
+    net::hw_features _hw_features;
+    uint16_t _num_queues = 1;
+    unsigned _ring_size;
+    uint32_t _xdp_flags = 0;
+    uint32_t _bind_flags = 0;
+    rss_key_type _rss_key = default_rsskey_40bytes;
+    std::vector<uint32_t> _redir_table;
+    file_desc _xsks_map;
+    file_desc _prog;
+public:
+    explicit xdp_device(boost::program_options::variables_map opts);
+    virtual ~xdp_device();
+    virtual ethernet_address hw_address() override { return _mac; }
+    virtual net::hw_features hw_features() override { return _hw_features; }
+    virtual const rss_key_type& rss_key() const override { return _rss_key; }
+    virtual uint16_t hw_queues_count() override { return _num_queues; }
+    virtual unsigned hash2qid(uint32_t hash) override {
+        if (_redir_table.empty()) {
+            return hash % hw_queues_count();
+        }
+        return _redir_table[hash % _redir_table.size()];
+    }
+    virtual std::unique_ptr<net::qp> init_local_queue(boost::program_options::variables_map opts, uint16_t qid) override {
+        return std::make_unique<xdp_qp>(this, qid, _ring_size, _bind_flags);
+    }
+    unsigned ifindex() const { return _ifindex; }
+    // Steers traffic of hardware queue qid to the socket fd
+    void register_socket(uint16_t qid, int fd);
+private:
+    ifreq make_ifreq() const;
+    void setup_rss(file_desc& ctl);
+    static file_desc create_xsks_map(unsigned entries);
+    static file_desc load_program(file_desc& xsks_map);
+    void attach(int prog_fd, uint32_t flags);
+};
+
+xdp_qp::xdp_qp(xdp_device* dev, uint16_t qid, unsigned ring_size, uint32_t bind_flags)
+    : qp(true, "network", qid)
+    , _dev(dev)
+    , _qid(qid)
+    , _ring_size(ring_size)
+    , _fd(file_desc::socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC))
+    , _umem(allocate_aligned_buffer<char>(size_t(nr_frames()) * frame_size, frame_size)) {
+    xdp_umem_reg reg = {};
+    reg.addr = reinterpret_cast<uint64_t>(_umem.get());
+    reg.len = uint64_t(nr_frames()) * frame_size;
+    reg.chunk_size = frame_size;
+    reg.headroom = 0;
+    _fd.setsockopt(SOL_XDP, XDP_UMEM_REG, reg);
+
+    int size = ring_size;
+    _fd.setsockopt(SOL_XDP, XDP_UMEM_FILL_RING, size);
+    _fd.setsockopt(SOL_XDP, XDP_UMEM_COMPLETION_RING, size);
+    _fd.setsockopt(SOL_XDP, XDP_RX_RING, size);
+    _fd.setsockopt(SOL_XDP, XDP_TX_RING, size);
+
+    auto off = _fd.getsockopt<xdp_mmap_offsets>(SOL_XDP, XDP_MMAP_OFFSETS);
+    _fill.emplace(_fd, off.fr, XDP_UMEM_PGOFF_FILL_RING, ring_size);
+    _comp.emplace(_fd, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, ring_size);
+    _rx.emplace(_fd, off.rx, XDP_PGOFF_RX_RING, ring_size);
+    _tx.emplace(_fd, off.tx, XDP_PGOFF_TX_RING, ring_size);
+
+    for (unsigned i = 0; i < nr_frames(); i++) {
+        auto& free = i < nr_rx_frames() ? _rx_free : _tx_free;
+        free.push_back(uint64_t(i) * frame_size);
+    }
+    _rx_burst.reserve(packet_read_size);
+
+    sockaddr_xdp sxdp = {};
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_flags = bind_flags | XDP_USE_NEED_WAKEUP;
+    sxdp.sxdp_ifindex = dev->ifindex();
+    sxdp.sxdp_queue_id = qid;
+    _fd.bind(reinterpret_cast<sockaddr&>(sxdp), sizeof(sxdp));
+
+    refill();
+    dev->register_socket(qid, _fd.get());
+}
+
+void xdp_qp::refill() {
+    uint32_t idx;
+    auto n = _fill->reserve(_rx_free.size(), idx);
+    if (!n) {
+        return;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        (*_fill)[idx + i] = _rx_free.back();
+        _rx_free.pop_back();
+    }
+    _fill->submit();
+    if (_fill->needs_wakeup()) {
+        ::recvfrom(_fd.get(), nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+    }
+}
+
+bool xdp_qp::poll_rx_once() {
+    uint32_t idx;
+    auto count = _rx->peek(packet_read_size, idx);
+    uint64_t bytes = 0;
+    uint64_t rx_timestamp = count ? tsc_clock::now().time_since_epoch().count() : 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        auto& desc = (*_rx)[idx + i];
+        auto frame = desc.addr & ~uint64_t(frame_size - 1);
+        auto data = _umem.get() + desc.addr;
+        bytes += desc.len;
+
+        if (i + 1 < count) {
+            __builtin_prefetch(_umem.get() + (*_rx)[idx + i + 1].addr);
+        }
+
+        if (_rx_frames_in_stack < _ring_size) {
+            ++_rx_frames_in_stack;
+            _rx_burst.emplace_back(fragment{data, desc.len}, make_deleter(deleter(), [this, frame] {
+                --_rx_frames_in_stack;
+                _rx_free.push_back(frame);
+            }));
+        } else {
+            // The stack holds too many frames already: copy, so that the
+            // fill ring never runs dry and the NIC never drops for lack of it
+            _rx_burst.emplace_back(fragment{data, desc.len});
+            _rx_free.push_back(frame);
+            _stats.rx.good.update_copy_stats(1, desc.len);
+        }
+        _rx_burst.back().offload_info_ref().rx_timestamp = rx_timestamp;
+    }
+
+    if (count) {
+        _rx->release(count);
+        _dev->l2receive(_rx_burst);
+        _stats.rx.good.update_pkts_bunch(count);
+        _stats.rx.good.update_frags_stats(count, bytes);
+    }
+
+    refill();
+    return count;
+}
+
+void xdp_qp::reclaim_tx() {
+    uint32_t idx;
+    auto n = _comp->peek(_ring_size, idx);
+    for (uint32_t i = 0; i < n; i++) {
+        _tx_free.push_back((*_comp)[idx + i]);
+    }
+    if (n) {
+        _comp->release(n);
+    }
+}
+
+uint32_t xdp_qp::send(circular_buffer<packet>& pb) {
+    reclaim_tx();
+
+    uint32_t idx;
+    auto n = _tx->reserve(std::min<size_t>(pb.size(), _tx_free.size()), idx);
+    uint64_t nr_frags = 0, bytes = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        auto& p = pb.front();
+        // The MTU we advertise keeps every packet within one frame
+        assert(p.len() <= frame_size);
+
+        auto frame = _tx_free.back();
+        _tx_free.pop_back();
+        auto dst = _umem.get() + frame;
+        for (auto&& f : p.fragments()) {
+            dst = std::copy_n(f.base, f.size, dst);
+        }
+
+        auto& desc = (*_tx)[idx + i];
+        desc.addr = frame;
+        desc.len = p.len();
+        desc.options = 0;
+
+        nr_frags += p.nr_frags();
+        bytes += p.len();
+        pb.pop_front();
+    }
+
+    if (n) {
+        _tx->submit();
+        _stats.tx.good.update_frags_stats(nr_frags, bytes);
+        _stats.tx.good.update_copy_stats(nr_frags, bytes);
+    }
+    if (_tx->needs_wakeup()) {
+        // EAGAIN, EBUSY and ENOBUFS only mean the kernel is still busy
+        // with what we gave it; completions tell us when it is done
+        ::sendto(_fd.get(), nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+    }
+    return n;
+}
+
+xdp_device::xdp_device(boost::program_options::variables_map opts)
+    : _ifname(opts["xdp-device"].as<std::string>())
+    , _ifindex(if_nametoindex(_ifname.c_str()))
+    , _ring_size(opts["xdp-ring-size"].as<unsigned>())
+    , _xsks_map(create_xsks_map(smp::count))
+    , _prog(load_program(_xsks_map)) {
+    throw_system_error_on(_ifindex == 0, "if_nametoindex");
+    if (!_ring_size || (_ring_size & (_ring_size - 1))) {
+        throw std::runtime_error(sprint("xdp-ring-size %d is not a power of two", _ring_size));
+    }
+
+    auto ctl = file_desc::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC);
+    auto ifr = make_ifreq();
+    ctl.ioctl(SIOCGIFHWADDR, ifr);
+    _mac = ethernet_address(reinterpret_cast<const uint8_t*>(ifr.ifr_hwaddr.sa_data));
+    ifr = make_ifreq();
+    ctl.ioctl(SIOCGIFMTU, ifr);
+    _hw_features.mtu = std::min<unsigned>(ifr.ifr_mtu, frame_capacity - eth_hdr_len);
+
+    setup_rss(ctl);
+
+    auto mode = opts["xdp-mode"].as<std::string>();
+    if (mode == "native") {
+        _xdp_flags = XDP_FLAGS_DRV_MODE;
+    } else if (mode == "generic") {
+        _xdp_flags = XDP_FLAGS_SKB_MODE;
+    } else if (mode != "auto") {
+        throw std::runtime_error(sprint("unknown xdp-mode %s", mode));
+    }
+    auto zc = opts["xdp-zero-copy"].as<std::string>();
+    if (zc == "on") {
+        _bind_flags = XDP_ZEROCOPY;
+    } else if (zc == "off") {
+        _bind_flags = XDP_COPY;
+    } else if (zc != "auto") {
+        throw std::runtime_error(sprint("unknown xdp-zero-copy %s", zc));
+    }
+
+    // Refuse to replace a program someone else attached
+    attach(_prog.get(), _xdp_flags | XDP_FLAGS_UPDATE_IF_NOEXIST);
+    printf("xdp: %s: %d queues, %s mode\n", _ifname.c_str(), _num_queues, mode.c_str());
+}
+
+xdp_device::~xdp_device() {
+    try {
+        attach(-1, _xdp_flags);
+    } catch (...) {
+        // The link may be gone already; nothing to restore then
+    }
+}
+
+ifreq xdp_device::make_ifreq() const {
+    ifreq ifr = {};
+    strncpy(ifr.ifr_name, _ifname.c_str(), IFNAMSIZ - 1);
+    return ifr;
+}
+
+/*
+ * Bind one queue per shard, up to what the NIC has, and make the NIC spread
+ * flows over exactly those queues. The stack computes the same Toeplitz
+ * hash in software to place connections, so it needs the NIC's key and
+ * indirection table; without them we fall back to a single queue.
+ */
+void xdp_device::setup_rss(file_desc& ctl) {
+    auto ifr = make_ifreq();
+    ethtool_channels channels = {};
+    channels.cmd = ETHTOOL_GCHANNELS;
+    ifr.ifr_data = reinterpret_cast<char*>(&channels);
+    unsigned nr_channels = 1;
+    if (::ioctl(ctl.get(), SIOCETHTOOL, &ifr) == 0) {
+        nr_channels = std::max(channels.combined_count, channels.rx_count);
+    }
+    _num_queues = std::max(1u, std::min(nr_channels, smp::count));
+    if (_num_queues == 1) {
+        return;
+    }
+
+    auto rxfh_ioctl = [&] (std::vector<char>& buf) {
+        ifr.ifr_data = buf.data();
+        return ::ioctl(ctl.get(), SIOCETHTOOL, &ifr) == 0;
+    };
+    std::vector<char> buf(sizeof(ethtool_rxfh));
+    auto rxfh = reinterpret_cast<ethtool_rxfh*>(buf.data());
+    rxfh->cmd = ETHTOOL_GRSSH;
+    if (!rxfh_ioctl(buf) || !rxfh->indir_size || !rxfh->key_size || !(rxfh->hfunc & rss_hash_toeplitz)) {
+        print("xdp: %s: no Toeplitz RSS to steer flows, using a single queue\n", _ifname);
+        _num_queues = 1;
+        return;
+    }
+    auto indir_size = rxfh->indir_size;
+    auto key_size = rxfh->key_size;
+
+    // Spread the indirection table over our queues only; queues past them
+    // would hand our flows to the kernel
+    buf.assign(sizeof(ethtool_rxfh) + indir_size * sizeof(uint32_t), 0);
+    rxfh = reinterpret_cast<ethtool_rxfh*>(buf.data());
+    rxfh->cmd = ETHTOOL_SRSSH;
+    rxfh->indir_size = indir_size;
+    for (unsigned i = 0; i < indir_size; i++) {
+        rxfh->rss_config[i] = i % _num_queues;
+    }
+    if (!rxfh_ioctl(buf)) {
+        print("xdp: %s: cannot update the RSS indirection table: %s\n", _ifname, strerror(errno));
+    }
+
+    buf.assign(sizeof(ethtool_rxfh) + indir_size * sizeof(uint32_t) + key_size, 0);
+    rxfh = reinterpret_cast<ethtool_rxfh*>(buf.data());
+    rxfh->cmd = ETHTOOL_GRSSH;
+    rxfh->indir_size = indir_size;
+    rxfh->key_size = key_size;
+    if (!rxfh_ioctl(buf)) {
+        print("xdp: %s: cannot read back RSS configuration, using a single queue\n", _ifname);
+        _num_queues = 1;
+        return;
+    }
+    _redir_table.assign(rxfh->rss_config, rxfh->rss_config + indir_size);
+    auto key = reinterpret_cast<const uint8_t*>(rxfh->rss_config + indir_size);
+    _rss_key.assign(key, key + key_size);
+    for (auto q : _redir_table) {
+        if (q >= _num_queues) {
+            print("xdp: %s: RSS sends flows to queue %d which has no socket\n", _ifname, q);
+            break;
+        }
+    }
+}
+
+void xdp_device::register_socket(uint16_t qid, int fd) {
+    uint32_t key = qid;
+    uint32_t value = fd;
+    bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = _xsks_map.get();
+    attr.key = reinterpret_cast<uint64_t>(&key);
+    attr.value = reinterpret_cast<uint64_t>(&value);
+    attr.flags = BPF_ANY;
+    throw_system_error_on(bpf(BPF_MAP_UPDATE_ELEM, attr) == -1, "bpf(BPF_MAP_UPDATE_ELEM)");
+}
+
+file_desc xdp_device::create_xsks_map(unsigned entries) {
+    bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = entries;
+    auto fd = bpf(BPF_MAP_CREATE, attr);
+    throw_system_error_on(fd == -1, "bpf(BPF_MAP_CREATE)");
+    return file_desc::from_fd(fd);
+}
+
+// return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+// Queues without a socket fall through to the kernel stack.
+file_desc xdp_device::load_program(file_desc& xsks_map) {
+    bpf_insn insns[] = {
+        { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(xdp_md, rx_queue_index), 0 },
+        { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xsks_map.get() },
+        { 0, 0, 0, 0, 0 },
+        { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+        { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+        { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+    };
+    static const char license[] = "Dual BSD/GPL";
+    bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = reinterpret_cast<uint64_t>(insns);
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = reinterpret_cast<uint64_t>(license);
+    auto fd = bpf(BPF_PROG_LOAD, attr);
+    throw_system_error_on(fd == -1, "bpf(BPF_PROG_LOAD)");
+    return file_desc::from_fd(fd);
+}
+
+// Attaches (or with prog_fd == -1, detaches) the program via rtnetlink
+void xdp_device::attach(int prog_fd, uint32_t flags) {
+    auto nl = file_desc::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    struct {
+        nlmsghdr nh;
+        ifinfomsg ifi;
+        char attrs[64];
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(ifinfomsg));
+    req.nh.nlmsg_type = RTM_SETLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = _ifindex;
+
+    auto nest = reinterpret_cast<rtattr*>(reinterpret_cast<char*>(&req) + NLMSG_ALIGN(req.nh.nlmsg_len));
+    nest->rta_type = NLA_F_NESTED | IFLA_XDP;
+    nest->rta_len = RTA_LENGTH(0);
+    auto put = [nest] (unsigned short type, uint32_t value) {
+        auto a = reinterpret_cast<rtattr*>(reinterpret_cast<char*>(nest) + RTA_ALIGN(nest->rta_len));
+        a->rta_type = type;
+        a->rta_len = RTA_LENGTH(sizeof(value));
+        memcpy(RTA_DATA(a), &value, sizeof(value));
+        nest->rta_len = RTA_ALIGN(nest->rta_len) + RTA_ALIGN(a->rta_len);
+    };
+    put(IFLA_XDP_FD, uint32_t(prog_fd));
+    if (flags) {
+        put(IFLA_XDP_FLAGS, flags);
+    }
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + nest->rta_len;
+
+    nl.send(&req, req.nh.nlmsg_len, 0);
+    char reply[4096];
+    auto len = nl.recv(reply, sizeof(reply), 0);
+    auto nh = reinterpret_cast<nlmsghdr*>(reply);
+    if (len && *len >= ssize_t(NLMSG_LENGTH(sizeof(nlmsgerr))) && nh->nlmsg_type == NLMSG_ERROR) {
+        auto err = reinterpret_cast<nlmsgerr*>(NLMSG_DATA(nh));
+        if (err->error) {
+            throw std::system_error(-err->error, std::system_category(),
+                                    sprint("attaching XDP program to %s", _ifname));
+        }
+    }
+}
+
+} // namespace xdp
+
+/******************************** Interface functions *************************/
+
+std::unique_ptr<net::device> create_xdp_net_device(boost::program_options::variables_map opts) {
+    return std::make_unique<xdp::xdp_device>(opts);
+}
+
+boost::program_options::options_description
+get_xdp_net_options_description()
+{
+    boost::program_options::options_description opts(
+            "AF_XDP net options");
+    opts.add_options()
+        ("xdp-device",
+                boost::program_options::value<std::string>(),
+                "Drive this kernel network interface through AF_XDP sockets")
+        ("xdp-mode",
+                boost::program_options::value<std::string>()->default_value("auto"),
+                "How to attach the XDP program (native / generic / auto)")
+        ("xdp-zero-copy",
+                boost::program_options::value<std::string>()->default_value("auto"),
+                "Let the driver DMA into the UMEM directly (on / off / auto)")
+        ("xdp-ring-size",
+                boost::program_options::value<unsigned>()->default_value(1024),
+                "Entries of each AF_XDP ring (must be power-of-two)")
+        ;
+    return opts;
+}
+
+#endif // HAVE_AF_XDP
@@ -0,0 +1,41 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#ifdef HAVE_AF_XDP
+
+#ifndef _SEASTAR_XDP_DEV_H
+#define _SEASTAR_XDP_DEV_H
+
+#include <memory>
+#include "net.hh"
+#include "core/sstring.hh"
+
+// A net::device driving a kernel network interface through AF_XDP sockets,
+// one per hardware queue. Unlike DPDK the NIC stays bound to its kernel
+// driver and needs no hugepages; traffic of the queues we bind is steered
+// to us by a small XDP program, everything else still reaches the kernel.
+std::unique_ptr<net::device> create_xdp_net_device(boost::program_options::variables_map opts);
+
+boost::program_options::options_description get_xdp_net_options_description();
+
+#endif // _SEASTAR_XDP_DEV_H
+
+#endif // HAVE_AF_XDP
@@ -108,6 +108,7 @@ class xenfront_qp : public net::qp {
     port bind_rx_evtchn(bool split);
 
     future<> alloc_rx_references();
+    void post_tx(packet p);
     future<> handle_tx_completions();
     future<> queue_rx_packet();
 
@@ -119,6 +120,7 @@ class xenfront_qp : public net::qp {
     ~xenfront_qp();
     virtual void rx_start() override;
     virtual future<> send(packet p) override;
+    virtual uint32_t send(circular_buffer<packet>& p) override;
     void inc_rx_error_count() { ++_stats.rx.bad.total; }
 };
 
@@ -137,77 +139,87 @@ xenfront_qp::rx_start() {
     });
 }
 
-future<>
-xenfront_qp::send(packet _p) {
-
-    uint32_t frag = 0;
-    // There doesn't seem to be a way to tell xen, when using the userspace
-    // drivers, to map a particular page. Therefore, the only alternative
-    // here is to copy. All pages shared must come from the gntalloc mmap.
-    //
-    // A better solution could be to change the packet allocation path to
-    // use a pre-determined page for data.
-    //
-    // In-kernel should be fine
-
-    if (_p.nr_frags() > 1) {
-        _stats.tx.good.update_copy_stats(_p.nr_frags(), _p.len());
+// There doesn't seem to be a way to tell xen, when using the userspace
+// drivers, to map a particular page. Therefore, the only alternative
+// here is to copy into one of the pages granted up front. All pages shared
+// must come from the gntalloc mmap.
+void
+xenfront_qp::post_tx(packet p) {
+    if (p.nr_frags() > 1) {
+        _stats.tx.good.update_copy_stats(p.nr_frags(), p.len());
     }
 
     // FIXME: negotiate and use scatter/gather
-    _p.linearize();
+    p.linearize();
     ++_stats.tx.linearized;
 
-    return _tx_ring.entries.has_room().then([this, p = std::move(_p), frag] () mutable {
-
-        auto req_prod = _tx_ring._sring->req_prod;
+    auto f = p.frag(0);
 
-        auto f = p.frag(frag);
+    auto ref = _tx_refs->new_ref(f.base, f.size);
 
-        auto ref = _tx_refs->new_ref(f.base, f.size);
+    unsigned idx = _tx_ring.entries.get_index();
+    assert(!_tx_ring.entries[idx]);
 
-        unsigned idx = _tx_ring.entries.get_index();
-        assert(!_tx_ring.entries[idx]);
+    _tx_ring.entries[idx] = ref;
 
-        _tx_ring.entries[idx] = ref;
+    auto req = &_tx_ring._sring->_ring[idx].req;
+    req->gref = ref.xen_id;
+    req->offset = 0;
+    req->flags = {};
+    if (p.offload_info().protocol != ip_protocol_num::unused) {
+        req->flags.csum_blank = true;
+        req->flags.data_validated = true;
+    } else {
+        req->flags.data_validated = true;
+    }
+    req->id = idx;
+    req->size = f.size;
 
-        auto req = &_tx_ring._sring->_ring[idx].req;
-        req->gref = ref.xen_id;
-        req->offset = 0;
-        req->flags = {};
-        if (p.offload_info().protocol != ip_protocol_num::unused) {
-            req->flags.csum_blank = true;
-            req->flags.data_validated = true;
-        } else {
-            req->flags.data_validated = true;
-        }
-        req->id = idx;
-        req->size = f.size;
+    ++_tx_ring.req_prod_pvt;
 
-        _tx_ring.req_prod_pvt = idx;
-        _tx_ring._sring->req_prod = req_prod + 1;
-        _tx_ring._sring->req_event++;
+    _stats.tx.good.update_frags_stats(1, f.size);
+}
 
-        if ((frag + 1) == p.nr_frags()) {
+future<>
+xenfront_qp::send(packet p) {
+    return _tx_ring.entries.has_room().then([this, p = std::move(p)] () mutable {
+        post_tx(std::move(p));
+        if (_tx_ring.push_requests()) {
             _tx_evtchn.notify();
         }
-
-        _stats.tx.good.update_frags_stats(1, f.size);
-
-        return make_ready_future<>();
     });
+}
 
-    // FIXME: Don't forget to clear all grant refs when frontend closes. Or is it automatic?
+// Posts as many packets as there are free slots, and notifies the backend
+// at most once for all of them.
+uint32_t
+xenfront_qp::send(circular_buffer<packet>& pb) {
+    uint32_t sent = 0;
+    while (!pb.empty() && _tx_ring.entries.try_room()) {
+        post_tx(std::move(pb.front()));
+        pb.pop_front();
+        ++sent;
+    }
+    if (sent && _tx_ring.push_requests()) {
+        _tx_evtchn.notify();
+    }
+    return sent;
 }
 
 #define rmb() asm volatile("lfence":::"memory");
 #define wmb() asm volatile("":::"memory");
+#define mb() asm volatile("mfence":::"memory");
 
 template <typename T>
 future<> front_ring<T>::entries::has_room() {
     return _available.wait();
 }
 
+template <typename T>
+bool front_ring<T>::entries::try_room() {
+    return _available.try_wait();
+}
+
 template <typename T>
 void front_ring<T>::entries::free_index(unsigned id) {
     _available.signal();
@@ -218,6 +230,18 @@ unsigned front_ring<T>::entries::get_index() {
     return front_ring<T>::idx(_next_idx++);
 }
 
+// As RING_PUSH_REQUESTS_AND_CHECK_NOTIFY: notify only if the backend's
+// req_event falls within the requests just pushed.
+template <typename T>
+bool front_ring<T>::push_requests() {
+    auto old = _sring->req_prod;
+    auto new_prod = req_prod_pvt;
+    wmb();
+    _sring->req_prod = new_prod;
+    mb();
+    return uint32_t(new_prod - _sring->req_event) < uint32_t(new_prod - old);
+}
+
 template <typename T>
 void front_ring<T>::process_ring(std::function<bool (gntref &entry, T& el)> func, grant_head *refs)
 {
@@ -286,18 +310,20 @@ void xenfront_qp::alloc_one_rx_reference(unsigned index) {
     req->gref = _rx_ring.entries[index].xen_id;
 }
 
+// Refills every free slot at once, and notifies the backend at most once
+// for them.
 future<> xenfront_qp::alloc_rx_references() {
     return _rx_ring.entries.has_room().then([this] () {
-        unsigned i = _rx_ring.entries.get_index();
-
-        auto req_prod = _rx_ring.req_prod_pvt;
-        alloc_one_rx_reference(i);
-        ++req_prod;
-        _rx_ring.req_prod_pvt = req_prod;
-        wmb();
-        _rx_ring._sring->req_prod = req_prod;
+        do {
+            unsigned i = _rx_ring.entries.get_index();
+            alloc_one_rx_reference(i);
+            ++_rx_ring.req_prod_pvt;
+        } while (_rx_ring.entries.try_room());
+
         /* ready */
-        _rx_evtchn.notify();
+        if (_rx_ring.push_requests()) {
+            _rx_evtchn.notify();
+        }
     });
 }
 
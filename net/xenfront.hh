@@ -109,6 +109,7 @@ class front_ring {
         gntref& operator[](std::size_t i) { return _entries[_ring->idx(i)]; }
         friend front_ring;
         future<> has_room();
+        bool try_room();
         unsigned get_index();
         void free_index(unsigned index);
     };
@@ -127,6 +128,9 @@ class front_ring {
     entries entries;
 
     void process_ring(std::function<bool (gntref &entry, T& el)> func, grant_head *refs);
+    // Publishes the requests produced since the last push; returns whether
+    // the other end asked (through req_event) to be notified of them.
+    bool push_requests();
 
     void dump() {
         _sring->dump();
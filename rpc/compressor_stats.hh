@@ -0,0 +1,50 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 Scylladb, Ltd.
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+#include "core/metrics_registration.hh"
+#include <chrono>
+
+namespace rpc {
+
+// Per-shard totals of one compression algorithm, exported in the
+// "rpc_compression" metrics group with the algorithm as instance.
+struct compressor_stats {
+    using clock = std::chrono::steady_clock;
+    // Messages compressed, and messages sent as they were because they
+    // were too small or did not compress
+    uint64_t compressed = 0;
+    uint64_t skipped = 0;
+    // Sizes of the compressed messages before and after compression
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    clock::duration compress_time{0};
+    clock::duration decompress_time{0};
+    seastar::metrics::metric_groups metrics;
+
+    explicit compressor_stats(const sstring& algorithm);
+    // The stats of algorithm on this shard
+    static compressor_stats& local(const sstring& algorithm);
+};
+
+}
@@ -21,6 +21,7 @@
 
 #include "lz4_compressor.hh"
 #include "core/byteorder.hh"
+#include "core/align.hh"
 
 namespace rpc {
 
@@ -43,6 +44,7 @@ static temporary_buffer<char> linearize(boost::variant<std::vector<temporary_buf
 }
 
 snd_buf lz4_compressor::compress(size_t head_space, snd_buf data) {
+    auto start = compressor_stats::clock::now();
     head_space += 4;
     temporary_buffer<char> dst(head_space + LZ4_compressBound(data.size));
     temporary_buffer<char> src = linearize(data.bufs, data.size);
@@ -57,6 +59,10 @@ snd_buf lz4_compressor::compress(size_t head_space, snd_buf data) {
     }
     dst.trim(size + head_space);
     write_le<uint32_t>(dst.get_write() + (head_space - 4), data.size);
+    _stats.compressed++;
+    _stats.bytes_in += data.size;
+    _stats.bytes_out += size;
+    _stats.compress_time += compressor_stats::clock::now() - start;
     return snd_buf(std::move(dst));
 }
 
@@ -69,6 +75,7 @@ rcv_buf lz4_compressor::decompress(rcv_buf data) {
         in.read(reinterpret_cast<char*>(&v32), 4);
         auto size = le_to_cpu(v32);
         if (size) {
+            auto start = compressor_stats::clock::now();
             temporary_buffer<char> src = linearize(data.bufs, data.size);
             src.trim_front(4);
             rcv_buf rb(size);
@@ -77,6 +84,7 @@ rcv_buf lz4_compressor::decompress(rcv_buf data) {
             if (LZ4_decompress_fast(src.begin(), dst.get_write(), dst.size()) < 0) {
                 throw std::runtime_error("RPC frame LZ4 decompression failure");
             }
+            _stats.decompress_time += compressor_stats::clock::now() - start;
             return std::move(rb);
         } else {
             // special case: if uncompressed size is zero it means that data was not compressed
@@ -86,4 +94,118 @@ rcv_buf lz4_compressor::decompress(rcv_buf data) {
     }
 }
 
+#ifdef HAVE_LZ4_COMPRESS_DEFAULT
+
+const sstring lz4_stream_compressor::factory::_name = "LZ4-STREAM";
+
+constexpr size_t lz4_stream_compressor::block_size;
+constexpr size_t lz4_stream_compressor::ring_size;
+
+lz4_stream_compressor::lz4_stream_compressor()
+        : _stream(LZ4_createStream())
+        , _decode(LZ4_createStreamDecode())
+        , _in_ring(new char[ring_size])
+        , _out_ring(new char[ring_size]) {
+    if (!_stream || !_decode) {
+        throw std::bad_alloc();
+    }
+}
+
+// The frame is the uncompressed size, then blocks of at most block_size
+// bytes uncompressed, each preceded by its compressed size.
+snd_buf lz4_stream_compressor::compress(size_t head_space, snd_buf data) {
+    auto start = compressor_stats::clock::now();
+    head_space += 4;
+    auto blocks = align_up(size_t(data.size), block_size) / block_size;
+    temporary_buffer<char> dst(head_space + blocks * (4 + LZ4_COMPRESSBOUND(block_size)));
+    auto out = dst.get_write() + head_space;
+    size_t len = 0;
+    auto compress_block = [&] {
+        auto size = LZ4_compress_fast_continue(_stream.get(), _in_ring.get() + _in_pos, out + 4, len, LZ4_COMPRESSBOUND(block_size), 1);
+        if (size <= 0) {
+            throw std::runtime_error("RPC frame LZ4 compression failure");
+        }
+        write_le<uint32_t>(out, size);
+        out += 4 + size;
+        _in_pos += len;
+        len = 0;
+    };
+    auto add = [&] (const temporary_buffer<char>& b) {
+        auto p = b.get();
+        auto n = b.size();
+        while (n) {
+            if (!len && _in_pos + block_size > ring_size) {
+                _in_pos = 0;
+            }
+            auto now = std::min(n, block_size - len);
+            std::copy_n(p, now, _in_ring.get() + _in_pos + len);
+            len += now;
+            p += now;
+            n -= now;
+            if (len == block_size) {
+                compress_block();
+            }
+        }
+    };
+    if (auto* one = boost::get<temporary_buffer<char>>(&data.bufs)) {
+        add(*one);
+    } else {
+        for (auto&& b : boost::get<std::vector<temporary_buffer<char>>>(data.bufs)) {
+            add(b);
+        }
+    }
+    if (len) {
+        compress_block();
+    }
+    auto size = out - dst.get_write();
+    dst.trim(size);
+    write_le<uint32_t>(dst.get_write() + (head_space - 4), data.size);
+    _stats.compressed++;
+    _stats.bytes_in += data.size;
+    _stats.bytes_out += size - head_space;
+    _stats.compress_time += compressor_stats::clock::now() - start;
+    return snd_buf(std::move(dst));
+}
+
+rcv_buf lz4_stream_compressor::decompress(rcv_buf data) {
+    if (data.size < 4) {
+        return rcv_buf();
+    }
+    auto start = compressor_stats::clock::now();
+    temporary_buffer<char> src = linearize(data.bufs, data.size);
+    auto p = src.get();
+    auto end = src.end();
+    auto size = read_le<uint32_t>(p);
+    p += 4;
+    rcv_buf rb(size);
+    rb.bufs = temporary_buffer<char>(size);
+    auto& dst = boost::get<temporary_buffer<char>>(rb.bufs);
+    size_t done = 0;
+    while (done < size) {
+        if (end - p < 4) {
+            throw std::runtime_error("RPC frame LZ4 decompression failure");
+        }
+        auto csize = read_le<uint32_t>(p);
+        p += 4;
+        if (csize > size_t(end - p)) {
+            throw std::runtime_error("RPC frame LZ4 decompression failure");
+        }
+        if (_out_pos + block_size > ring_size) {
+            _out_pos = 0;
+        }
+        auto n = LZ4_decompress_safe_continue(_decode.get(), p, _out_ring.get() + _out_pos, csize, block_size);
+        if (n <= 0 || size_t(n) > size - done) {
+            throw std::runtime_error("RPC frame LZ4 decompression failure");
+        }
+        std::copy_n(_out_ring.get() + _out_pos, n, dst.get_write() + done);
+        _out_pos += n;
+        done += n;
+        p += csize;
+    }
+    _stats.decompress_time += compressor_stats::clock::now() - start;
+    return std::move(rb);
+}
+
+#endif
+
 }
@@ -23,7 +23,9 @@
 
 #include "core/sstring.hh"
 #include "rpc/rpc_types.hh"
+#include "rpc/compressor_stats.hh"
 #include <lz4.h>
+#include <memory>
 
 namespace rpc {
     class lz4_compressor : public compressor {
@@ -38,6 +40,8 @@ namespace rpc {
                 return feature == _name ? std::make_unique<rpc::lz4_compressor>() : nullptr;
             }
         };
+    private:
+        compressor_stats& _stats = compressor_stats::local("LZ4");
     public:
         ~lz4_compressor() {}
         // compress data, leaving head_space empty in returned buffer
@@ -45,4 +49,54 @@ namespace rpc {
         // decompress data
         rcv_buf decompress(rcv_buf data) override;
     };
+
+#ifdef HAVE_LZ4_COMPRESS_DEFAULT
+    // LZ4 with one stream per connection direction: each message may refer
+    // back to the last 64k of earlier ones, which lets many small, similar
+    // messages compress well. Input is copied block by block into a ring
+    // the stream keeps its history in, instead of being linearized first.
+    //
+    // Negotiated as "LZ4-STREAM"; list lz4_compressor's factory after it
+    // for peers without it.
+    class lz4_stream_compressor : public compressor {
+    public:
+        class factory: public rpc::compressor::factory {
+            static const sstring _name;
+        public:
+            virtual const sstring& supported() const override {
+                return _name;
+            }
+            virtual std::unique_ptr<rpc::compressor> negotiate(sstring feature, bool is_server) const override {
+                return feature == _name ? std::make_unique<rpc::lz4_stream_compressor>() : nullptr;
+            }
+        };
+    private:
+        static constexpr size_t block_size = 16 * 1024;
+        // The 64k of history, the block being added and the room wasted
+        // at the end when a block does not fit there
+        static constexpr size_t ring_size = 64 * 1024 + 2 * block_size;
+        struct stream_deleter {
+            void operator()(LZ4_stream_t* s) const {
+                LZ4_freeStream(s);
+            }
+            void operator()(LZ4_streamDecode_t* s) const {
+                LZ4_freeStreamDecode(s);
+            }
+        };
+        std::unique_ptr<LZ4_stream_t, stream_deleter> _stream;
+        std::unique_ptr<LZ4_streamDecode_t, stream_deleter> _decode;
+        // Both ends place each block at the same offset in their rings
+        std::unique_ptr<char[]> _in_ring;
+        std::unique_ptr<char[]> _out_ring;
+        size_t _in_pos = 0;
+        size_t _out_pos = 0;
+        compressor_stats& _stats = compressor_stats::local("LZ4-STREAM");
+    public:
+        lz4_stream_compressor();
+        // compress data, leaving head_space empty in returned buffer
+        snd_buf compress(size_t head_space, snd_buf data) override;
+        // decompress data
+        rcv_buf decompress(rcv_buf data) override;
+    };
+#endif
 }
@@ -1,4 +1,6 @@
 #include "rpc.hh"
+#include "compressor_stats.hh"
+#include "core/metrics.hh"
 
 namespace rpc {
   no_wait_type no_wait;
@@ -27,4 +29,336 @@ namespace rpc {
           return boost::get<std::vector<temporary_buffer<char>>>(bufs).front();
       }
   }
+
+  constexpr size_t snd_buf_output::min_splice_size;
+
+  snd_buf_output::snd_buf_output(size_t head_space, size_t size_hint) {
+      auto first = std::min(head_space + std::max(size_hint, size_t(64)), std::max(head_space, snd_buf::chunk_size));
+      _bufs.emplace_back(first);
+      _pos = _bufs.back().get_write() + head_space;
+      _end = _bufs.back().get_write() + first;
+      _size = head_space;
+  }
+
+  void snd_buf_output::trim_last() {
+      if (_pos) {
+          _bufs.back().trim(_pos - _bufs.back().get_write());
+          _pos = _end = nullptr;
+      }
+  }
+
+  void snd_buf_output::write_slow(const char* p, size_t n) {
+      while (n) {
+          auto now = std::min(n, size_t(_end - _pos));
+          std::copy_n(p, now, _pos);
+          _pos += now;
+          _size += now;
+          p += now;
+          n -= now;
+          if (n) {
+              // Grow geometrically, but keep fragments within a chunk
+              auto next = std::min(snd_buf::chunk_size, std::max(n, _size));
+              trim_last();
+              _bufs.emplace_back(next);
+              _pos = _bufs.back().get_write();
+              _end = _pos + next;
+          }
+      }
+  }
+
+  void snd_buf_output::splice(const temporary_buffer<char>& buf) {
+      if (buf.size() < min_splice_size) {
+          write(buf.get(), buf.size());
+          return;
+      }
+      trim_last();
+      // Sharing only takes another reference to the buffer
+      _bufs.push_back(const_cast<temporary_buffer<char>&>(buf).share());
+      _size += buf.size();
+  }
+
+  snd_buf snd_buf_output::release() {
+      trim_last();
+      _bufs.erase(std::remove_if(_bufs.begin(), _bufs.end(), [] (const temporary_buffer<char>& b) { return b.empty(); }), _bufs.end());
+      if (_bufs.size() == 1) {
+          return snd_buf(std::move(_bufs.front()));
+      }
+      snd_buf ret;
+      ret.size = _size;
+      ret.bufs = std::move(_bufs);
+      return ret;
+  }
+
+  compressor_stats::compressor_stats(const sstring& algorithm) {
+      namespace sm = seastar::metrics;
+      auto instance = sprint("%s-%d", algorithm, engine().cpu_id());
+      auto us = [] (const clock::duration& d) {
+          return [&d] { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+      };
+      metrics.add_group("rpc_compression", {
+          sm::make_derive("compressed_messages", compressed,
+                  sm::description("Counts messages sent compressed"), true, instance),
+          sm::make_derive("skipped_messages", skipped,
+                  sm::description("Counts messages sent uncompressed, being too small or incompressible"), true, instance),
+          sm::make_derive("bytes_in", bytes_in,
+                  sm::description("Counts bytes of messages before compression"), true, instance),
+          sm::make_derive("bytes_out", bytes_out,
+                  sm::description("Counts bytes of messages after compression"), true, instance),
+          sm::make_gauge("ratio", [this] { return bytes_in ? double(bytes_out) / bytes_in : 1.0; },
+                  sm::description("Compressed to uncompressed size of all compressed messages"), true, instance),
+          sm::make_derive("compress_time_us", us(compress_time),
+                  sm::description("Total CPU time spent compressing, in microseconds"), true, instance),
+          sm::make_derive("decompress_time_us", us(decompress_time),
+                  sm::description("Total CPU time spent decompressing, in microseconds"), true, instance),
+      });
+  }
+
+  void verb_stats::register_metrics(const sstring& instance) {
+      namespace sm = seastar::metrics;
+      metrics.add_group("rpc", {
+          sm::make_histogram("handler_latency_us", [this] { return handler_latency.to_metrics_histogram(1e-3); },
+                  sm::description("Time from a request's arrival to its reply being queued"), true, instance),
+          sm::make_histogram("round_trip_us", [this] { return round_trip.to_metrics_histogram(1e-3); },
+                  sm::description("Time from a call to its reply"), true, instance),
+          sm::make_histogram("sent_bytes", [this] { return sent_bytes.to_metrics_histogram(); },
+                  sm::description("Sizes of requests sent by clients and replies sent by servers"), true, instance),
+          sm::make_histogram("received_bytes", [this] { return received_bytes.to_metrics_histogram(); },
+                  sm::description("Sizes of requests received by servers and replies received by clients"), true, instance),
+          sm::make_gauge("handlers_in_flight", handlers_in_flight,
+                  sm::description("Requests being handled"), true, instance),
+          sm::make_gauge("calls_in_flight", calls_in_flight,
+                  sm::description("Calls waiting for their reply"), true, instance),
+          sm::make_derive("expired_requests", expired_requests,
+                  sm::description("Counts requests dropped for expiring before their handler ran"), true, instance),
+          sm::make_derive("rejected_requests", rejected_requests,
+                  sm::description("Counts requests refused with an overloaded reply"), true, instance),
+      });
+  }
+
+  compressor_stats& compressor_stats::local(const sstring& algorithm) {
+      static thread_local std::unordered_map<sstring, std::unique_ptr<compressor_stats>> stats;
+      auto& s = stats[algorithm];
+      if (!s) {
+          s = std::make_unique<compressor_stats>(algorithm);
+      }
+      return *s;
+  }
+
+  constexpr size_t stream_connection::stream_header_size;
+  constexpr size_t stream_connection::stream_frame_headroom;
+
+  future<> stream_state::send(snd_buf data) {
+      auto size = data.size - (stream_connection::stream_frame_headroom - stream_connection::stream_header_size);
+      return credit.wait(frame_cost(size)).then([s = shared_from_this(), data = std::move(data)] () mutable {
+          if (!s->conn) {
+              return make_exception_future<>(closed_error());
+          }
+          return s->conn->send_stream_frame(*s, stream_frame_type::data, std::move(data));
+      });
+  }
+
+  future<> stream_state::close() {
+      if (local_closed) {
+          return make_ready_future<>();
+      }
+      local_closed = true;
+      // Waiting for a unit of credit queues the close behind data still waiting for it
+      return credit.wait(1).then([s = shared_from_this()] {
+          s->credit.signal(1);
+          if (!s->conn) {
+              return make_exception_future<>(closed_error());
+          }
+          s->close_sent = true;
+          auto f = s->conn->send_stream_frame(*s, stream_frame_type::close, snd_buf(stream_connection::stream_frame_headroom));
+          s->conn->maybe_remove_stream(*s);
+          return f;
+      });
+  }
+
+  future<std::experimental::optional<rcv_buf>> stream_state::receive() {
+      if (!queue.empty()) {
+          auto buf = std::move(queue.front());
+          queue.pop_front();
+          consumed(buf.size);
+          return make_ready_future<std::experimental::optional<rcv_buf>>(std::move(buf));
+      }
+      if (remote_closed) {
+          return make_ready_future<std::experimental::optional<rcv_buf>>();
+      }
+      if (error) {
+          return make_exception_future<std::experimental::optional<rcv_buf>>(error);
+      }
+      readable = promise<>();
+      return readable->get_future().then([s = shared_from_this()] {
+          return s->receive();
+      });
+  }
+
+  void stream_state::consumed(size_t size) {
+      if (!conn) {
+          return;
+      }
+      conn->release_stream_memory(size);
+      if (remote_closed) {
+          return;
+      }
+      // Returning credit in batches keeps the window open: once the reader
+      // catches up less than a quarter of it is held back, which leaves the
+      // sender more than the largest cost of a single message
+      credit_to_return += frame_cost(size);
+      if (credit_to_return >= conn->stream_window() / 4) {
+          conn->send_stream_credit(*this, credit_to_return);
+          credit_to_return = 0;
+      }
+  }
+
+  void stream_state::wake_reader() {
+      if (readable) {
+          auto p = std::move(*readable);
+          readable = std::experimental::nullopt;
+          p.set_value();
+      }
+  }
+
+  void stream_state::remove_user() {
+      if (--users) {
+          return;
+      }
+      // Nobody reads any more: drop what arrived, and discard what follows
+      while (!queue.empty()) {
+          consumed(queue.front().size);
+          queue.pop_front();
+      }
+      if (!local_closed) {
+          close().handle_exception([] (std::exception_ptr) {});
+      } else if (conn) {
+          conn->maybe_remove_stream(*this);
+      }
+  }
+
+  stream_connection::~stream_connection() {
+      fail_streams(std::make_exception_ptr(closed_error()));
+  }
+
+  lw_shared_ptr<stream_state> stream_connection::open_stream() {
+      return attach_stream(_next_stream_id++);
+  }
+
+  lw_shared_ptr<stream_state> stream_connection::attach_stream(uint64_t id) {
+      auto it = _streams.find(id);
+      if (it != _streams.end()) {
+          return it->second;
+      }
+      auto s = make_lw_shared<stream_state>(id, this, _stream_serializer);
+      if (_streams_error) {
+          s->conn = nullptr;
+          s->error = _streams_error;
+          s->credit.broken(_streams_error);
+          return s;
+      }
+      if (_streams_negotiated) {
+          s->credit.signal(_peer_stream_window);
+      }
+      _streams.emplace(id, s);
+      return s;
+  }
+
+  void stream_connection::start_streams(uint32_t peer_window) {
+      _streams_negotiated = true;
+      _peer_stream_window = std::max(peer_window, stream_min_window);
+      for (auto&& e : _streams) {
+          e.second->credit.signal(_peer_stream_window);
+      }
+  }
+
+  void stream_connection::fail_streams(std::exception_ptr ex) {
+      _streams_error = ex;
+      auto streams = std::move(_streams);
+      _streams.clear();
+      for (auto&& e : streams) {
+          auto& s = *e.second;
+          // Frames already received stay readable, but no longer hold connection memory
+          for (auto&& buf : s.queue) {
+              release_stream_memory(buf.size);
+          }
+          s.conn = nullptr;
+          s.error = ex;
+          s.credit.broken(ex);
+          s.wake_reader();
+      }
+  }
+
+  future<> stream_connection::handle_stream_frame(rcv_buf data) {
+      if (data.size < stream_header_size) {
+          return make_exception_future<>(rpc_protocol_error());
+      }
+      char header[stream_header_size + 4];
+      auto in = make_deserializer_stream(data);
+      in.read(header, stream_header_size);
+      auto id = read_le<uint64_t>(header);
+      auto type = stream_frame_type(read_le<uint32_t>(header + 8));
+      lw_shared_ptr<stream_state> s;
+      auto it = _streams.find(id);
+      if (it != _streams.end()) {
+          s = it->second;
+      } else if (_streams_opened_by_peer && type != stream_frame_type::credit) {
+          // The request carrying the stream may not have been handled yet
+          s = attach_stream(id);
+      } else {
+          // A stream we have already finished with
+          return make_ready_future<>();
+      }
+      switch (type) {
+      case stream_frame_type::data:
+          if (!s->users && s->local_closed) {
+              // Nobody reads this stream any more; let the sender carry on
+              send_stream_credit(*s, stream_state::frame_cost(data.size));
+              return make_ready_future<>();
+          }
+          return wait_for_stream_memory(data.size).then([s, data = std::move(data)] () mutable {
+              if (!s->users && s->local_closed) {
+                  s->consumed(data.size);
+                  return;
+              }
+              s->queue.push_back(std::move(data));
+              s->wake_reader();
+          });
+      case stream_frame_type::credit:
+          if (data.size < stream_header_size + 4) {
+              return make_exception_future<>(rpc_protocol_error());
+          }
+          in.read(header + stream_header_size, 4);
+          s->credit.signal(read_le<uint32_t>(header + stream_header_size));
+          return make_ready_future<>();
+      case stream_frame_type::close:
+          s->remote_closed = true;
+          s->wake_reader();
+          maybe_remove_stream(*s);
+          return make_ready_future<>();
+      default:
+          return make_exception_future<>(rpc_protocol_error());
+      }
+  }
+
+  future<> stream_connection::send_stream_frame(stream_state& s, stream_frame_type type, snd_buf buf) {
+      static_assert(snd_buf::chunk_size >= stream_frame_headroom + 4, "send buffer chunk size is too small");
+      auto p = buf.front().get_write() + stream_frame_headroom - stream_header_size;
+      write_le<uint64_t>(p, s.id);
+      write_le<uint32_t>(p + 8, uint32_t(type));
+      return queue_stream_frame(std::move(buf));
+  }
+
+  void stream_connection::send_stream_credit(stream_state& s, uint32_t credit) {
+      snd_buf buf(stream_frame_headroom + 4);
+      write_le<uint32_t>(buf.front().get_write() + stream_frame_headroom, credit);
+      send_stream_frame(s, stream_frame_type::credit, std::move(buf)).handle_exception([] (std::exception_ptr) {
+          // the connection is going away, and the stream with it
+      });
+  }
+
+  void stream_connection::maybe_remove_stream(stream_state& s) {
+      if (s.close_sent && s.remote_closed && !s.users) {
+          _streams.erase(s.id);
+      }
+  }
 }
@@ -31,8 +31,13 @@
 #include "core/shared_ptr.hh"
 #include "core/condition-variable.hh"
 #include "core/gate.hh"
+#include "core/semaphore.hh"
+#include "core/circular_buffer.hh"
+#include "core/fair_queue.hh"
 #include "rpc/rpc_types.hh"
 #include "core/byteorder.hh"
+#include "core/log_histogram.hh"
+#include "core/metrics_registration.hh"
 
 namespace rpc {
 
@@ -66,16 +71,70 @@ struct resource_limits {
     size_t basic_request_size = 0; ///< Minimum request footprint in memory
     unsigned bloat_factor = 1;     ///< Serialized size multiplied by this to estimate memory used by request
     size_t max_memory = semaphore::max_counter(); ///< Maximum amount of memory that may be consumed by all requests
+    /// Handlers run at once; further requests queue and are admitted by
+    /// priority class (see server::set_priority_class()). 0 is unlimited.
+    unsigned max_concurrent_requests = 0;
+    /// Requests queued for admission beyond which new ones are refused
+    /// with an overloaded_error reply. 0 is unlimited.
+    size_t max_queued_requests = 0;
 };
 
+/// Smallest receive window a stream end may advertise. A message costs
+/// its size in credit, but never more than half of this, so a single large
+/// message cannot need more credit than the receiver is able to return.
+static constexpr uint32_t stream_min_window = 64 * 1024;
+static constexpr uint32_t stream_default_window = 1024 * 1024;
+
 struct client_options {
     std::experimental::optional<net::tcp_keepalive_params> keepalive;
     compressor::factory* compressor_factory = nullptr;
     bool send_timeout_data = true;
+    uint32_t stream_window = stream_default_window; ///< Unread bytes accepted per stream
+};
+
+/// Options for protocol::multi_client
+struct multi_client_options {
+    client_options client;
+    /// Connections kept to the server. The first one only carries small and
+    /// urgent messages, the others share the rest.
+    unsigned connections = 3;
+    /// Serialized size up to which a message counts as small
+    size_t small_message_size = 4096;
+    /// Number of shards of the server. When set, connections made from shard
+    /// n come from local ports that a server listening with
+    /// listen_options::load_balancing_algorithm::port hands to its shard
+    /// n % server_shards.
+    std::experimental::optional<unsigned> server_shards;
 };
 
 struct server_options {
     compressor::factory* compressor_factory = nullptr;
+    uint32_t stream_window = stream_default_window; ///< Unread bytes accepted per stream, also capped by resource_limits::max_memory
+    listen_options::load_balancing_algorithm load_balancing_algorithm = listen_options::load_balancing_algorithm::connection_distribution;
+};
+
+// What a protocol saw of one verb on this shard, as a server handling it
+// and as a client calling it. Latencies are in nanoseconds, sizes are of
+// the serialized payload.
+struct verb_stats {
+    using latency_histogram = seastar::log_histogram<24, 10>;
+    using size_histogram = seastar::log_histogram<24, 6>;
+    // server: from a request's arrival to its reply being queued
+    latency_histogram handler_latency;
+    // client: from a call to its reply, or to its sending if it has none
+    latency_histogram round_trip;
+    // requests sent and replies received as a client, the reverse as a server
+    size_histogram sent_bytes;
+    size_histogram received_bytes;
+    uint64_t handlers_in_flight = 0;
+    uint64_t calls_in_flight = 0;
+    // server: requests dropped for having expired before their handler
+    // ran, and refused for overload
+    uint64_t expired_requests = 0;
+    uint64_t rejected_requests = 0;
+    seastar::metrics::metric_groups metrics;
+
+    void register_metrics(const sstring& instance);
 };
 
 inline
@@ -92,11 +151,175 @@ struct negotiation_frame {
 enum class protocol_features : uint32_t {
     COMPRESS = 0,
     TIMEOUT = 1,
+    STREAM = 2,
 };
 
 // internal representation of feature data
 using feature_map = std::map<protocol_features, sstring>;
 
+enum class stream_frame_type : uint32_t {
+    data = 0,
+    credit = 1,
+    close = 2,
+};
+
+class stream_connection;
+
+// One end of a stream multiplexed over an rpc connection. A stream is
+// opened by the client and has the same id on both ends; each end sends
+// through a sink and receives through a source.
+struct stream_state : public enable_lw_shared_from_this<stream_state> {
+    uint64_t id;
+    stream_connection* conn; // null once the connection is gone
+    void* serializer;
+    // Credit, in bytes, the peer has granted to our sink
+    semaphore credit{0};
+    bool local_closed = false;
+    bool close_sent = false;
+    // Received frames not yet read from the source, stream header included
+    circular_buffer<rcv_buf> queue;
+    std::experimental::optional<promise<>> readable;
+    uint32_t credit_to_return = 0;
+    bool remote_closed = false;
+    // Sinks and sources using this end; when the last goes away our
+    // direction is closed and further incoming data discarded
+    unsigned users = 0;
+    std::exception_ptr error;
+
+    stream_state(uint64_t id_, stream_connection* conn_, void* serializer_) : id(id_), conn(conn_), serializer(serializer_) {}
+    static uint32_t frame_cost(size_t size) {
+        return std::min<size_t>(size, stream_min_window / 2);
+    }
+    future<> send(snd_buf data);
+    future<> close();
+    future<std::experimental::optional<rcv_buf>> receive();
+    void consumed(size_t size);
+    void wake_reader();
+    void add_user() {
+        ++users;
+    }
+    void remove_user();
+};
+
+// Streams multiplexed over a connection. Stream frames are rpc frames with
+// message id 0, which no request or reply uses, and are only sent once both
+// ends negotiated protocol_features::STREAM.
+class stream_connection {
+public:
+    // Stream id and stream_frame_type
+    static constexpr size_t stream_header_size = 12;
+    // Room a sink leaves for the largest rpc frame header and the stream header
+    static constexpr size_t stream_frame_headroom = 28 + stream_header_size;
+protected:
+    std::unordered_map<uint64_t, lw_shared_ptr<stream_state>> _streams;
+    void* _stream_serializer;
+    uint64_t _next_stream_id = 1;
+    bool _streams_opened_by_peer = false;
+    // Unread bytes we accept per stream, and what the peer accepts
+    uint32_t _stream_window = stream_default_window;
+    uint32_t _peer_stream_window = 0;
+    bool _streams_negotiated = false;
+    std::exception_ptr _streams_error;
+protected:
+    void start_streams(uint32_t peer_window);
+    void fail_streams(std::exception_ptr ex);
+    future<> handle_stream_frame(rcv_buf data);
+public:
+    explicit stream_connection(void* serializer) : _stream_serializer(serializer) {}
+    virtual ~stream_connection();
+    // Fills in the rpc frame header in front of a stream frame and queues it
+    virtual future<> queue_stream_frame(snd_buf buf) = 0;
+    // Accounts for memory held by received stream data until it is read
+    virtual future<> wait_for_stream_memory(size_t size) {
+        return make_ready_future<>();
+    }
+    virtual void release_stream_memory(size_t size) {}
+    lw_shared_ptr<stream_state> open_stream();
+    lw_shared_ptr<stream_state> attach_stream(uint64_t id);
+    future<> send_stream_frame(stream_state& s, stream_frame_type type, snd_buf buf);
+    void send_stream_credit(stream_state& s, uint32_t credit);
+    void maybe_remove_stream(stream_state& s);
+    uint32_t stream_window() const {
+        return _stream_window;
+    }
+};
+
+template <typename... In>
+class source;
+
+/// Sending end of a stream. Values are delivered in order; a call waits
+/// for flow control credit but not for the peer to read the value.
+///
+/// The client creates a sink with client::make_stream_sink() and passes it
+/// to a verb, whose handler receives the matching source.
+template <typename... Out>
+class sink {
+public:
+    class impl {
+    protected:
+        lw_shared_ptr<stream_state> _state;
+    public:
+        explicit impl(lw_shared_ptr<stream_state> state) : _state(std::move(state)) {
+            _state->add_user();
+        }
+        virtual ~impl() {
+            _state->remove_user();
+        }
+        virtual future<> operator()(const Out&... args) = 0;
+        const lw_shared_ptr<stream_state>& state() const { return _state; }
+    };
+private:
+    shared_ptr<impl> _impl;
+public:
+    explicit sink(shared_ptr<impl> impl) : _impl(std::move(impl)) {}
+    future<> operator()(const Out&... args) {
+        return (*_impl)(args...);
+    }
+    // Tells the other end no more values follow, once the queued ones are sent
+    future<> close() {
+        return _impl->state()->close();
+    }
+    uint64_t stream_id() const {
+        return _impl->state()->id;
+    }
+    // Returns the source receiving what the other end sends on this stream
+    template <typename Serializer, typename... In>
+    source<In...> make_source();
+};
+
+/// Receiving end of a stream. Returns values in the order they were sent,
+/// and a disengaged optional once the other end closed its sink.
+template <typename... In>
+class source {
+public:
+    class impl {
+    protected:
+        lw_shared_ptr<stream_state> _state;
+    public:
+        explicit impl(lw_shared_ptr<stream_state> state) : _state(std::move(state)) {
+            _state->add_user();
+        }
+        virtual ~impl() {
+            _state->remove_user();
+        }
+        virtual future<std::experimental::optional<std::tuple<In...>>> operator()() = 0;
+        const lw_shared_ptr<stream_state>& state() const { return _state; }
+    };
+private:
+    shared_ptr<impl> _impl;
+public:
+    explicit source(shared_ptr<impl> impl) : _impl(std::move(impl)) {}
+    future<std::experimental::optional<std::tuple<In...>>> operator()() {
+        return (*_impl)();
+    }
+    uint64_t stream_id() const {
+        return _impl->state()->id;
+    }
+    // Returns the sink sending to the other end of this stream
+    template <typename Serializer, typename... Out>
+    sink<Out...> make_sink();
+};
+
 // An rpc signature, in the form signature<Ret (In0, In1, In2)>.
 template <typename Function>
 struct signature;
@@ -106,7 +329,7 @@ struct signature;
 // do not forget to provide hash function for it
 template<typename Serializer, typename MsgType = uint32_t>
 class protocol {
-    class connection {
+    class connection : public stream_connection {
     protected:
         connected_socket _fd;
         input_stream<char> _read_buf;
@@ -122,8 +345,9 @@ class protocol {
             snd_buf buf;
             std::experimental::optional<promise<>> p = promise<>();
             cancellable* pcancel = nullptr;
+            tsc_clock::time_point queued = tsc_clock::now();
             outgoing_entry(snd_buf b) : buf(std::move(b)) {}
-            outgoing_entry(outgoing_entry&& o) : t(std::move(o.t)), buf(std::move(o.buf)), p(std::move(o.p)), pcancel(o.pcancel) {
+            outgoing_entry(outgoing_entry&& o) : t(std::move(o.t)), buf(std::move(o.buf)), p(std::move(o.p)), pcancel(o.pcancel), queued(o.queued) {
                 o.p = std::experimental::nullopt;
             }
             ~outgoing_entry() {
@@ -173,6 +397,10 @@ class protocol {
             request,
             response
         };
+        // Messages queued while the previous batch was written go out
+        // together, in one write and with one flush, up to this many bytes
+        static constexpr size_t max_send_batch_bytes = 1 << 20;
+
         template<outgoing_queue_type QueueType>
         void send_loop() {
             _send_loop_stopped = do_until([this] { return _error; }, [this] {
@@ -183,32 +411,53 @@ class protocol {
                     if (_outgoing_queue.empty()) {
                         return make_ready_future();
                     }
-                    auto d = std::move(_outgoing_queue.front());
-                    _outgoing_queue.pop_front();
-                    d.t.cancel(); // cancel timeout timer
-                    if (d.pcancel) {
-                        d.pcancel->cancel_send = std::function<void()>(); // request is no longer cancellable
-                    }
-                    if (QueueType == outgoing_queue_type::request) {
-                        static_assert(snd_buf::chunk_size >= 8, "send buffer chunk size is too small");
-                        if (_timeout_negotiated) {
-                            auto expire = d.t.get_timeout();
-                            uint64_t left = 0;
-                            if (expire != typename timer<>::time_point()) {
-                                left = std::chrono::duration_cast<std::chrono::milliseconds>(expire - timer<>::clock::now()).count();
+                    std::vector<outgoing_entry> batch;
+                    size_t batch_bytes = 0;
+                    while (!_outgoing_queue.empty() && batch_bytes < max_send_batch_bytes) {
+                        auto d = std::move(_outgoing_queue.front());
+                        _outgoing_queue.pop_front();
+                        d.t.cancel(); // cancel timeout timer
+                        _proto._send_queue_time.add((tsc_clock::now() - d.queued).count());
+                        if (d.pcancel) {
+                            d.pcancel->cancel_send = std::function<void()>(); // request is no longer cancellable
+                        }
+                        if (QueueType == outgoing_queue_type::request) {
+                            static_assert(snd_buf::chunk_size >= 8, "send buffer chunk size is too small");
+                            if (_timeout_negotiated) {
+                                auto expire = d.t.get_timeout();
+                                uint64_t left = 0;
+                                if (expire != typename timer<>::time_point()) {
+                                    // 0 would mean no timeout; an expired request is for the server to drop
+                                    left = std::max<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(expire - timer<>::clock::now()).count(), 1);
+                                }
+                                write_le<uint64_t>(d.buf.front().get_write(), left);
+                            } else {
+                                d.buf.front().trim_front(8);
+                                d.buf.size -= 8;
                             }
-                            write_le<uint64_t>(d.buf.front().get_write(), left);
-                        } else {
-                            d.buf.front().trim_front(8);
-                            d.buf.size -= 8;
                         }
+                        d.buf = compress(std::move(d.buf));
+                        batch_bytes += d.buf.size;
+                        batch.push_back(std::move(d));
                     }
-                    d.buf = compress(std::move(d.buf));
-                    auto f = send_buffer(std::move(d.buf)).then([this] {
-                        _stats.sent_messages++;
-                        return _write_buf.flush();
+                    // corked, the batch reaches the socket as a single packet
+                    _write_buf.cork();
+                    auto start = std::chrono::steady_clock::now();
+                    return do_with(std::move(batch), [this, start, batch_bytes] (std::vector<outgoing_entry>& batch) {
+                        return do_for_each(batch, [this] (outgoing_entry& d) {
+                            return send_buffer(std::move(d.buf)).then([this] {
+                                _stats.sent_messages++;
+                            });
+                        }).then([this] {
+                            return _write_buf.flush();
+                        }).then([this, start, batch_bytes] {
+                            if (_compressor) {
+                                _compressor->on_sent(batch_bytes, std::chrono::steady_clock::now() - start);
+                            }
+                        }).finally([this] {
+                            return _write_buf.uncork();
+                        });
                     });
-                    return f.finally([d = std::move(d)] {});
                 });
             }).handle_exception([this] (std::exception_ptr eptr) {
                 _error = true;
@@ -231,8 +480,8 @@ class protocol {
         }
 
     public:
-        connection(connected_socket&& fd, protocol& proto) : _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(_fd.output()), _proto(proto), _connected(true) {}
-        connection(protocol& proto) : _proto(proto) {}
+        connection(connected_socket&& fd, protocol& proto) : stream_connection(&proto._serializer), _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(_fd.output()), _proto(proto), _connected(true) {}
+        connection(protocol& proto) : stream_connection(&proto._serializer), _proto(proto) {}
         void set_socket(connected_socket&& fd) {
             if (_connected) {
                 throw std::runtime_error("already connected");
@@ -336,6 +585,27 @@ class protocol {
             server& get_server() {
                 return _server;
             }
+            // Runs func, which handles the request and releases
+            // memory_consumed, once the request is admitted. Requests that
+            // expire first are dropped, and ones that would queue beyond
+            // max_queued_requests get an overloaded reply. The returned
+            // future resolves when the connection may read on.
+            template <typename Func>
+            future<> admit(MsgType t, int64_t msg_id, size_t memory_consumed, std::experimental::optional<steady_clock_type::time_point> timeout,
+                    verb_stats& vs, Func func);
+            void reply_overloaded(int64_t msg_id, std::experimental::optional<steady_clock_type::time_point> timeout, verb_stats& vs);
+            virtual future<> queue_stream_frame(snd_buf buf) override {
+                // Leave room for a 12 byte response header instead of a request header
+                buf.front().trim_front(16);
+                buf.size -= 16;
+                return respond(0, std::move(buf), {});
+            }
+            virtual future<> wait_for_stream_memory(size_t size) override {
+                return wait_for_resources(estimate_request_size(size), {});
+            }
+            virtual void release_stream_memory(size_t size) override {
+                release_resources(estimate_request_size(size));
+            }
         };
     private:
         protocol& _proto;
@@ -346,12 +616,35 @@ class protocol {
         promise<> _ss_stopped;
         seastar::gate _reply_gate;
         server_options _options;
+        // Set with resource_limits::max_concurrent_requests
+        std::unique_ptr<fair_queue> _admission;
+        priority_class_ptr _default_class;
+        std::unordered_map<MsgType, priority_class_ptr> _verb_classes;
+        size_t _admission_queued = 0;
+        seastar::gate _admission_gate;
+    private:
+        priority_class_ptr priority_class_for(MsgType t) {
+            auto i = _verb_classes.find(t);
+            return i != _verb_classes.end() ? i->second : _default_class;
+        }
     public:
         server(protocol& proto, ipv4_addr addr, resource_limits memory_limit = resource_limits());
         server(protocol& proto, server_options opts, ipv4_addr addr, resource_limits memory_limit = resource_limits());
         server(protocol& proto, server_socket, resource_limits memory_limit = resource_limits(), server_options opts = server_options{});
         server(protocol& proto, server_options opts, server_socket, resource_limits memory_limit = resource_limits());
         void accept();
+        /// Makes a class of verbs that, once max_concurrent_requests
+        /// handlers run, are admitted in proportion to its shares. Verbs
+        /// without a class share one of 100 shares.
+        priority_class_ptr register_priority_class(uint32_t shares) {
+            if (!_admission) {
+                throw std::logic_error("rpc priority classes need resource_limits::max_concurrent_requests");
+            }
+            return _admission->register_priority_class(shares);
+        }
+        void set_priority_class(MsgType t, priority_class_ptr pc) {
+            _verb_classes[t] = std::move(pc);
+        }
         future<> stop() {
             _ss.abort_accept();
             _ss = server_socket();
@@ -360,7 +653,8 @@ class protocol {
                 parallel_for_each(_conns, [] (lw_shared_ptr<connection> conn) {
                     return conn->stop();
                 }),
-                _reply_gate.close()
+                _reply_gate.close(),
+                _admission_gate.close()
             ).discard_result();
         }
         template<typename Func>
@@ -456,6 +750,17 @@ class protocol {
             return this->_stats;
         }
         auto next_message_id() { return _message_id++; }
+        virtual future<> queue_stream_frame(snd_buf buf) override {
+            auto p = buf.front().get_write() + 8; // 8 extra bytes for expiration timer
+            write_le<uint64_t>(p, 0); // message type, unused
+            write_le<int64_t>(p + 8, 0);
+            write_le<uint32_t>(p + 16, buf.size - 28);
+            return this->send(std::move(buf));
+        }
+        /// Opens a stream to the server. Pass the sink to a verb taking a
+        /// source<Out...>; the verb's handler reads what is sent here.
+        template <typename... Out>
+        sink<Out...> make_stream_sink();
         void wait_for_reply(id_type id, std::unique_ptr<reply_handler_base>&& h, std::experimental::optional<steady_clock_type::time_point> timeout, cancellable* cancel) {
             if (timeout) {
                 h->t.set_callback(std::bind(std::mem_fn(&client::wait_timed_out), this, id));
@@ -488,13 +793,77 @@ class protocol {
             return _server_addr;
         }
     };
+
+    /// Client keeping several connections to one server, so that large
+    /// messages queued for sending do not hold up small ones. Verbs are
+    /// called on it the same way as on a client.
+    class multi_client {
+        protocol& _proto;
+        multi_client_options _options;
+        std::function<::seastar::socket ()> _make_socket;
+        ipv4_addr _addr;
+        ipv4_addr _local;
+        std::vector<std::unique_ptr<client>> _clients;
+        std::unordered_set<MsgType> _urgent;
+        future<> _retired = make_ready_future<>();
+    private:
+        std::unique_ptr<client> connect();
+        void reconnect(unsigned i);
+        static size_t load(const client& c) {
+            auto s = c.get_stats();
+            return s.pending + s.wait_reply;
+        }
+    public:
+        multi_client(protocol& proto, multi_client_options options, ipv4_addr addr, ipv4_addr local = ipv4_addr());
+        /// Connects with sockets from make_socket rather than the engine's network stack
+        multi_client(protocol& proto, multi_client_options options, std::function<::seastar::socket ()> make_socket,
+                ipv4_addr addr, ipv4_addr local = ipv4_addr());
+        /// Sends verb t on the connection for small messages whatever the size
+        void set_urgent(MsgType t) {
+            _urgent.insert(t);
+        }
+        /// Returns the connection a message of verb t is sent on, replacing
+        /// it first if it failed
+        client& route(MsgType t, size_t serialized_size);
+        auto& serializer() { return _proto._serializer; }
+        stats get_stats() const;
+        future<> stop();
+        ipv4_addr peer_address() const {
+            return _addr;
+        }
+    };
     friend server;
 private:
-    using rpc_handler = std::function<future<> (lw_shared_ptr<typename server::connection>, std::experimental::optional<steady_clock_type::time_point> timeout, int64_t msgid,
-                                                rcv_buf data)>;
-    std::unordered_map<MsgType, rpc_handler> _handlers;
+    // A handler is called through a single virtual call on the object
+    // recv_helper() built for it, instead of through std::function
+    struct rpc_handler {
+        virtual ~rpc_handler() {}
+        virtual future<> operator()(lw_shared_ptr<typename server::connection> client, std::experimental::optional<steady_clock_type::time_point> timeout,
+                int64_t msgid, rcv_buf data) = 0;
+    };
+    template <typename Func>
+    struct rpc_handler_impl final : rpc_handler {
+        Func func;
+        explicit rpc_handler_impl(Func&& f) : func(std::move(f)) {}
+        virtual future<> operator()(lw_shared_ptr<typename server::connection> client, std::experimental::optional<steady_clock_type::time_point> timeout,
+                int64_t msgid, rcv_buf data) override {
+            return func(std::move(client), timeout, msgid, std::move(data));
+        }
+    };
+    // Verbs numbered below this are found by indexing a table, others
+    // through a hash lookup
+    static constexpr uint64_t max_dense_verb = 1024;
+    static constexpr bool has_dense_verbs = std::is_integral<MsgType>::value || std::is_enum<MsgType>::value;
+    std::vector<std::unique_ptr<rpc_handler>> _dense_handlers;
+    std::unordered_map<MsgType, std::unique_ptr<rpc_handler>> _handlers;
     Serializer _serializer;
     std::function<void(const sstring&)> _logger;
+    std::unordered_map<MsgType, std::unique_ptr<verb_stats>> _verb_stats;
+    // Time messages of all connections waited in their outgoing queues
+    verb_stats::latency_histogram _send_queue_time;
+    std::experimental::optional<sstring> _metrics_name;
+    std::function<sstring (MsgType)> _verb_name;
+    seastar::metrics::metric_groups _metrics;
 public:
     protocol(Serializer&& serializer) : _serializer(std::forward<Serializer>(serializer)) {}
     template<typename Func>
@@ -507,9 +876,22 @@ class protocol {
     auto register_handler(MsgType t, Func&& func);
 
     void unregister_handler(MsgType t) {
-        _handlers.erase(t);
+        if (dense_index(t) < _dense_handlers.size()) {
+            _dense_handlers[dense_index(t)].reset();
+        } else {
+            _handlers.erase(t);
+        }
     }
 
+    verb_stats& get_verb_stats(MsgType t);
+
+    // Exports the time messages wait to be sent, and the statistics of
+    // each verb, including verbs used only later, as metrics of the "rpc"
+    // group. Instances are named after name and, for verbs, verb_name(t).
+    void register_metrics(sstring name, std::function<sstring (MsgType)> verb_name = [] (MsgType t) {
+        return to_sstring(uint64_t(t));
+    });
+
     void set_logger(std::function<void(const sstring&)> logger) {
         _logger = logger;
     }
@@ -534,8 +916,39 @@ class protocol {
     template<typename Ret, typename... In>
     auto make_client(signature<Ret(In...)> sig, MsgType t);
 
-    void register_receiver(MsgType t, rpc_handler&& handler) {
-        _handlers.emplace(t, std::move(handler));
+    static uint64_t dense_index(MsgType t) {
+        return dense_index(t, std::integral_constant<bool, has_dense_verbs>());
+    }
+    static uint64_t dense_index(MsgType t, std::true_type) {
+        return uint64_t(t);
+    }
+    static uint64_t dense_index(MsgType t, std::false_type) {
+        return max_dense_verb;
+    }
+
+    template <typename Func>
+    void register_receiver(MsgType t, Func&& handler) {
+        auto h = std::make_unique<rpc_handler_impl<std::decay_t<Func>>>(std::forward<Func>(handler));
+        auto i = dense_index(t);
+        if (i < max_dense_verb) {
+            if (i >= _dense_handlers.size()) {
+                _dense_handlers.resize(i + 1);
+            }
+            if (!_dense_handlers[i]) {
+                _dense_handlers[i] = std::move(h);
+            }
+        } else {
+            _handlers.emplace(t, std::move(h));
+        }
+    }
+
+    rpc_handler* find_handler(MsgType t) {
+        auto i = dense_index(t);
+        if (i < _dense_handlers.size()) {
+            return _dense_handlers[i].get();
+        }
+        auto it = _handlers.find(t);
+        return it != _handlers.end() ? it->second.get() : nullptr;
     }
 
     template <typename FrameType, typename Info>
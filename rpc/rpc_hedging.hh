@@ -0,0 +1,253 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include <unordered_map>
+#include <tuple>
+#include "rpc/rpc.hh"
+#include "core/timer.hh"
+#include "core/apply.hh"
+
+namespace rpc {
+
+/// \brief When a \ref hedged_caller sends a call to its second peer
+struct hedging_options {
+    /// A call is hedged once the first peer has taken longer than this
+    /// percentile of the verb's recent latencies
+    double percentile = 0.95;
+    /// Lower bound on the delay, so that fast verbs aren't hedged on noise
+    steady_clock_type::duration min_delay = std::chrono::microseconds(500);
+    /// Latencies are collected in windows of this many calls, and the
+    /// delay taken from the last full one, so that it follows the peers
+    unsigned window = 1000;
+    /// Latencies needed before anything is hedged on delay
+    unsigned min_samples = 100;
+    /// Second requests allowed per call, on average, and how many may be
+    /// saved up; retries after a failure come out of the same budget
+    double budget_ratio = 0.05;
+    double budget_burst = 10;
+};
+
+/// What a \ref hedged_caller did for one verb
+struct hedging_stats {
+    uint64_t calls = 0;
+    // second requests sent after the delay, and after the first failed
+    uint64_t hedges = 0;
+    uint64_t retries = 0;
+    // calls answered by the second request
+    uint64_t hedges_won = 0;
+    // second requests not sent for lack of budget
+    uint64_t denied = 0;
+};
+
+/// \brief Calls a verb on two peers to cut its tail latency.
+///
+/// A call goes to the first peer. If it has not replied after a percentile
+/// of the verb's recent latency, or has failed with anything but a timeout,
+/// the call is also sent to the second peer. The first reply is returned
+/// and the other request is cancelled. A token bucket per verb caps the
+/// second requests, so that peers slowed by overload aren't sent even more.
+///
+/// Only verbs whose handlers can safely run twice should be hedged. The
+/// caller must outlive the calls made through it.
+template <typename MsgType = uint32_t>
+class hedged_caller {
+    using latency_histogram = verb_stats::latency_histogram;
+    struct verb_state {
+        latency_histogram current;
+        latency_histogram previous;
+        double budget;
+        hedging_stats stats;
+    };
+    template <typename Future, typename Verb, typename Client, typename... Args>
+    struct call_state : enable_lw_shared_from_this<call_state<Future, Verb, Client, Args...>> {
+        hedged_caller& caller;
+        verb_state& vs;
+        Verb verb;
+        Client* peers[2];
+        std::experimental::optional<steady_clock_type::time_point> timeout;
+        std::tuple<Args...> args;
+        typename Future::promise_type pr;
+        cancellable cancel[2];
+        steady_clock_type::time_point sent[2];
+        timer<> hedge_timer;
+        unsigned outstanding = 0;
+        bool second_sent = false;
+        bool done = false;
+
+        call_state(hedged_caller& caller, verb_state& vs, Verb verb, Client& first, Client& second,
+                std::experimental::optional<steady_clock_type::time_point> timeout, const Args&... args)
+            : caller(caller), vs(vs), verb(std::move(verb)), peers{&first, &second}, timeout(timeout), args(args...) {}
+        void send(unsigned i);
+        void send_second(bool retry);
+        void complete(unsigned i, Future f);
+    };
+    hedging_options _options;
+    std::unordered_map<MsgType, verb_state> _verbs;
+public:
+    explicit hedged_caller(hedging_options options = hedging_options()) : _options(options) {}
+
+    /// Calls verb, as returned by protocol::make_client() or
+    /// protocol::register_handler(), on first and, if hedged, on second.
+    /// The peers are both clients or both multi_clients.
+    template <typename Verb, typename Client, typename... Args>
+    auto call(Verb verb, Client& first, Client& second, const Args&... args) {
+        return do_call(std::move(verb), {}, first, second, args...);
+    }
+    /// As above, failing with timeout_error if no reply came by timeout
+    template <typename Verb, typename Client, typename... Args>
+    auto call(Verb verb, steady_clock_type::time_point timeout, Client& first, Client& second, const Args&... args) {
+        return do_call(std::move(verb), timeout, first, second, args...);
+    }
+    const hedging_stats& get_stats(MsgType t) {
+        return get_verb_state(t).stats;
+    }
+private:
+    verb_state& get_verb_state(MsgType t) {
+        auto i = _verbs.find(t);
+        if (i == _verbs.end()) {
+            i = _verbs.emplace(t, verb_state{{}, {}, _options.budget_burst, {}}).first;
+        }
+        return i->second;
+    }
+    std::experimental::optional<steady_clock_type::duration> hedge_delay(const verb_state& vs) const {
+        auto& h = vs.previous.sample_count() ? vs.previous : vs.current;
+        if (h.sample_count() < _options.min_samples) {
+            return std::experimental::nullopt;
+        }
+        steady_clock_type::duration d = std::chrono::nanoseconds(h.quantile(_options.percentile));
+        return std::max(d, _options.min_delay);
+    }
+    void record(verb_state& vs, steady_clock_type::duration latency) {
+        vs.current.add(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+        if (vs.current.sample_count() >= _options.window) {
+            vs.previous = vs.current;
+            vs.current = latency_histogram();
+        }
+    }
+    bool take_budget(verb_state& vs) {
+        if (vs.budget < 1) {
+            vs.stats.denied++;
+            return false;
+        }
+        vs.budget -= 1;
+        return true;
+    }
+    template <typename Verb, typename Client, typename... Args>
+    auto do_call(Verb verb, std::experimental::optional<steady_clock_type::time_point> timeout, Client& first, Client& second, const Args&... args) {
+        using future_type = decltype(verb.send(first, timeout, nullptr, args...));
+        auto& vs = get_verb_state(verb.t);
+        vs.stats.calls++;
+        vs.budget = std::min(vs.budget + _options.budget_ratio, _options.budget_burst);
+        auto st = make_lw_shared<call_state<future_type, Verb, Client, Args...>>(*this, vs, std::move(verb), first, second, timeout, args...);
+        auto f = st->pr.get_future();
+        st->send(0);
+        auto delay = hedge_delay(vs);
+        if (delay && !st->done && !st->second_sent) {
+            // The timer is only armed while the first request is
+            // outstanding, and that keeps the state alive
+            st->hedge_timer.set_callback([s = st.get()] {
+                s->send_second(false);
+            });
+            st->hedge_timer.arm(*delay);
+        }
+        return f;
+    }
+};
+
+template <typename MsgType>
+template <typename Future, typename Verb, typename Client, typename... Args>
+void hedged_caller<MsgType>::call_state<Future, Verb, Client, Args...>::send(unsigned i) {
+    outstanding++;
+    sent[i] = steady_clock_type::now();
+    auto f = ::apply([this, i] (const Args&... a) {
+        return verb.send(*peers[i], timeout, &cancel[i], a...);
+    }, args);
+    f.then_wrapped([s = this->shared_from_this(), i] (Future f) {
+        s->complete(i, std::move(f));
+    });
+}
+
+template <typename MsgType>
+template <typename Future, typename Verb, typename Client, typename... Args>
+void hedged_caller<MsgType>::call_state<Future, Verb, Client, Args...>::send_second(bool retry) {
+    if (done || second_sent || !caller.take_budget(vs)) {
+        return;
+    }
+    second_sent = true;
+    hedge_timer.cancel();
+    if (retry) {
+        vs.stats.retries++;
+    } else {
+        vs.stats.hedges++;
+    }
+    send(1);
+}
+
+template <typename MsgType>
+template <typename Future, typename Verb, typename Client, typename... Args>
+void hedged_caller<MsgType>::call_state<Future, Verb, Client, Args...>::complete(unsigned i, Future f) {
+    outstanding--;
+    auto now = steady_clock_type::now();
+    if (done) {
+        // the request that lost, cancelled or not
+        f.ignore_ready_future();
+        return;
+    }
+    if (f.failed()) {
+        auto ep = f.get_exception();
+        bool timed_out = false;
+        try {
+            std::rethrow_exception(ep);
+        } catch (timeout_error&) {
+            timed_out = true;
+        } catch (...) {
+        }
+        if (i == 0 && !timed_out) {
+            send_second(true);
+        }
+        if (outstanding) {
+            return;
+        }
+        done = true;
+        hedge_timer.cancel();
+        pr.set_exception(std::move(ep));
+        return;
+    }
+    done = true;
+    hedge_timer.cancel();
+    caller.record(vs, now - sent[i]);
+    if (i == 1) {
+        vs.stats.hedges_won++;
+    }
+    if (outstanding) {
+        if (i == 1) {
+            // What the first took until now is less than it would have,
+            // but is above the delay, so percentiles up to it come out right
+            caller.record(vs, now - sent[0]);
+        }
+        cancel[1 - i].cancel();
+    }
+    f.forward_to(std::move(pr));
+}
+
+}
@@ -21,11 +21,13 @@
 #pragma once
 
 #include <iostream>
+#include <random>
 #include "core/function_traits.hh"
 #include "core/apply.hh"
 #include "core/shared_ptr.hh"
 #include "core/sstring.hh"
 #include "core/future-util.hh"
+#include "core/tracing.hh"
 #include "util/is_smart_ptr.hh"
 #include "core/simple-stream.hh"
 #include <boost/range/numeric.hpp>
@@ -37,6 +39,7 @@ namespace rpc {
 enum class exception_type : uint32_t {
     USER = 0,
     UNKNOWN_VERB = 1,
+    OVERLOADED = 2,
 };
 
 template<typename T>
@@ -197,6 +200,13 @@ inline void marshall_one(Serializer& serializer, Output& out, const T& arg) {
     serialize_helper_type::serialize(serializer, out, arg);
 }
 
+// A sink travels as the id of its stream; the handler gets the matching source
+template <typename Serializer, typename Output, typename... T>
+inline void marshall_one(Serializer& serializer, Output& out, const sink<T...>& arg) {
+    uint64_t id = cpu_to_le(arg.stream_id());
+    out.write(reinterpret_cast<const char*>(&id), sizeof(id));
+}
+
 template <typename Serializer, typename Output, typename... T>
 inline void do_marshall(Serializer& serializer, Output& out, const T&... args) {
     // C++ guarantees that brace-initialization expressions are evaluted in order
@@ -213,8 +223,34 @@ static inline seastar::memory_output_stream<snd_buf::iterator> make_serializer_s
     }
 }
 
+// A serializer opts into single-pass marshalling by declaring
+//
+//     using single_pass = std::true_type;
+//
+// Its write() functions are then handed a snd_buf_output, which grows as it
+// is written and can splice temporary_buffers in by reference, instead of
+// running once over a measuring stream and once more to copy.
+template <typename Serializer, typename = void>
+struct is_single_pass : std::false_type {};
+
+template <typename Serializer>
+struct is_single_pass<Serializer, std::enable_if_t<Serializer::single_pass::value>> : std::true_type {};
+
+// Sizes the first fragment for single-pass serializers. They may provide
+// size_hint(serializer, const T&) for their types; a wrong guess only costs
+// an extra fragment or some slack.
+template <typename Serializer, typename T>
+inline auto size_hint_one(Serializer& serializer, const T& arg, int) -> decltype(size_t(size_hint(serializer, arg))) {
+    return size_hint(serializer, arg);
+}
+
+template <typename Serializer, typename T>
+inline size_t size_hint_one(Serializer& serializer, const T& arg, long) {
+    return sizeof(T);
+}
+
 template <typename Serializer, typename... T>
-inline snd_buf marshall(Serializer& serializer, size_t head_space, const T&... args) {
+inline snd_buf marshall_passes(std::false_type single_pass, Serializer& serializer, size_t head_space, const T&... args) {
     seastar::measuring_output_stream measure;
     do_marshall(serializer, measure, args...);
     snd_buf ret(measure.size() + head_space);
@@ -224,21 +260,38 @@ inline snd_buf marshall(Serializer& serializer, size_t head_space, const T&... a
     return ret;
 }
 
+template <typename Serializer, typename... T>
+inline snd_buf marshall_passes(std::true_type single_pass, Serializer& serializer, size_t head_space, const T&... args) {
+    size_t hint = 0;
+    (void)std::initializer_list<int>{(hint += size_hint_one(serializer, args, 0), 1)...};
+    snd_buf_output out(head_space, hint);
+    do_marshall(serializer, out, args...);
+    return out.release();
+}
+
+template <typename Serializer, typename... T>
+inline snd_buf marshall(Serializer& serializer, size_t head_space, const T&... args) {
+    return marshall_passes(is_single_pass<Serializer>(), serializer, head_space, args...);
+}
+
+template <typename Serializer, typename... In>
+class stream_source_impl;
+
 template <typename Serializer, typename Input>
-inline std::tuple<> do_unmarshall(Serializer& serializer, Input& in) {
+inline std::tuple<> do_unmarshall(Serializer& serializer, Input& in, stream_connection* sc) {
     return std::make_tuple();
 }
 
 template<typename Serializer, typename Input, typename T>
 struct unmarshal_one {
-    static T doit(Serializer& serializer, Input& in) {
+    static T doit(Serializer& serializer, Input& in, stream_connection* sc) {
         return read(serializer, in, type<T>());
     }
 };
 
 template<typename Serializer, typename Input, typename T>
 struct unmarshal_one<Serializer, Input, optional<T>> {
-    static optional<T> doit(Serializer& serializer, Input& in) {
+    static optional<T> doit(Serializer& serializer, Input& in, stream_connection* sc) {
         if (in.size()) {
             return optional<T>(read(serializer, in, type<typename remove_optional<T>::type>()));
         } else {
@@ -247,18 +300,77 @@ struct unmarshal_one<Serializer, Input, optional<T>> {
     }
 };
 
+template<typename Serializer, typename Input, typename... T>
+struct unmarshal_one<Serializer, Input, source<T...>> {
+    static source<T...> doit(Serializer& serializer, Input& in, stream_connection* sc) {
+        uint64_t id;
+        in.read(reinterpret_cast<char*>(&id), sizeof(id));
+        if (!sc) {
+            throw rpc_protocol_error();
+        }
+        return source<T...>(make_shared<stream_source_impl<Serializer, T...>>(serializer, sc->attach_stream(le_to_cpu(id))));
+    }
+};
+
 template <typename Serializer, typename Input, typename T0, typename... Trest>
-inline std::tuple<T0, Trest...> do_unmarshall(Serializer& serializer, Input& in) {
+inline std::tuple<T0, Trest...> do_unmarshall(Serializer& serializer, Input& in, stream_connection* sc) {
     // FIXME: something less recursive
-    auto first = std::make_tuple(unmarshal_one<Serializer, Input, T0>::doit(serializer, in));
-    auto rest = do_unmarshall<Serializer, Input, Trest...>(serializer, in);
+    auto first = std::make_tuple(unmarshal_one<Serializer, Input, T0>::doit(serializer, in, sc));
+    auto rest = do_unmarshall<Serializer, Input, Trest...>(serializer, in, sc);
     return std::tuple_cat(std::move(first), std::move(rest));
 }
 
+// sc is the connection streams passed as arguments are attached to
 template <typename Serializer, typename... T>
-inline std::tuple<T...> unmarshall(Serializer& serializer, rcv_buf input) {
+inline std::tuple<T...> unmarshall(Serializer& serializer, rcv_buf input, stream_connection* sc = nullptr) {
     auto in = make_deserializer_stream(input);
-    return do_unmarshall<Serializer, decltype(in), T...>(serializer, in);
+    return do_unmarshall<Serializer, decltype(in), T...>(serializer, in, sc);
+}
+
+template <typename Serializer, typename... Out>
+class stream_sink_impl final : public sink<Out...>::impl {
+    Serializer& _serializer;
+public:
+    stream_sink_impl(Serializer& serializer, lw_shared_ptr<stream_state> state)
+        : sink<Out...>::impl(std::move(state)), _serializer(serializer) {}
+    virtual future<> operator()(const Out&... args) override {
+        if (this->_state->local_closed) {
+            return make_exception_future<>(stream_closed());
+        }
+        return this->_state->send(marshall(_serializer, stream_connection::stream_frame_headroom, args...));
+    }
+};
+
+template <typename Serializer, typename... In>
+class stream_source_impl final : public source<In...>::impl {
+    Serializer& _serializer;
+public:
+    stream_source_impl(Serializer& serializer, lw_shared_ptr<stream_state> state)
+        : source<In...>::impl(std::move(state)), _serializer(serializer) {}
+    virtual future<std::experimental::optional<std::tuple<In...>>> operator()() override {
+        return this->_state->receive().then([&serializer = _serializer] (std::experimental::optional<rcv_buf> data) {
+            if (!data) {
+                return std::experimental::optional<std::tuple<In...>>();
+            }
+            auto in = make_deserializer_stream(*data);
+            in.skip(stream_connection::stream_header_size);
+            return std::experimental::optional<std::tuple<In...>>(do_unmarshall<Serializer, decltype(in), In...>(serializer, in, nullptr));
+        });
+    }
+};
+
+template <typename... Out>
+template <typename Serializer, typename... In>
+source<In...> sink<Out...>::make_source() {
+    auto& state = _impl->state();
+    return source<In...>(make_shared<stream_source_impl<Serializer, In...>>(*static_cast<Serializer*>(state->serializer), state));
+}
+
+template <typename... In>
+template <typename Serializer, typename... Out>
+sink<Out...> source<In...>::make_sink() {
+    auto& state = _impl->state();
+    return sink<Out...>(make_shared<stream_sink_impl<Serializer, Out...>>(*static_cast<Serializer*>(state->serializer), state));
 }
 
 static std::exception_ptr unmarshal_exception(rcv_buf& d) {
@@ -284,6 +396,11 @@ static std::exception_ptr unmarshal_exception(rcv_buf& d) {
         ex = std::make_exception_ptr(unknown_verb_error(le_to_cpu(v64)));
         break;
     }
+    case exception_type::OVERLOADED: {
+        data.read(reinterpret_cast<char*>(&v32), 4);
+        ex = std::make_exception_ptr(overloaded_error(std::chrono::milliseconds(le_to_cpu(v32))));
+        break;
+    }
     default:
         ex = std::make_exception_ptr(unknown_exception_error());
         break;
@@ -333,9 +450,10 @@ struct rcv_reply<Serializer, MsgType, future<>> : rcv_reply<Serializer, MsgType,
 
 template <typename Serializer, typename MsgType, typename Ret, typename... InArgs>
 inline auto wait_for_reply(wait_type, std::experimental::optional<steady_clock_type::time_point> timeout, cancellable* cancel, typename protocol<Serializer, MsgType>::client& dst, id_type msg_id,
-        signature<Ret (InArgs...)> sig) {
+        signature<Ret (InArgs...)> sig, verb_stats& vs) {
     using reply_type = rcv_reply<Serializer, MsgType, Ret>;
-    auto lambda = [] (reply_type& r, typename protocol<Serializer, MsgType>::client& dst, id_type msg_id, rcv_buf data) mutable {
+    auto lambda = [&vs] (reply_type& r, typename protocol<Serializer, MsgType>::client& dst, id_type msg_id, rcv_buf data) mutable {
+        vs.received_bytes.add(data.size);
         if (msg_id >= 0) {
             dst.get_stats_internal().replied++;
             return r.get_reply(dst, std::move(data));
@@ -354,13 +472,13 @@ inline auto wait_for_reply(wait_type, std::experimental::optional<steady_clock_t
 
 template<typename Serializer, typename MsgType, typename... InArgs>
 inline auto wait_for_reply(no_wait_type, std::experimental::optional<steady_clock_type::time_point>, cancellable* cancel, typename protocol<Serializer, MsgType>::client& dst, id_type msg_id,
-        signature<no_wait_type (InArgs...)> sig) {  // no_wait overload
+        signature<no_wait_type (InArgs...)> sig, verb_stats& vs) {  // no_wait overload
     return make_ready_future<>();
 }
 
 template<typename Serializer, typename MsgType, typename... InArgs>
 inline auto wait_for_reply(no_wait_type, std::experimental::optional<steady_clock_type::time_point>, cancellable* cancel, typename protocol<Serializer, MsgType>::client& dst, id_type msg_id,
-        signature<future<no_wait_type> (InArgs...)> sig) {  // future<no_wait> overload
+        signature<future<no_wait_type> (InArgs...)> sig, verb_stats& vs) {  // future<no_wait> overload
     return make_ready_future<>();
 }
 
@@ -369,19 +487,31 @@ inline auto wait_for_reply(no_wait_type, std::experimental::optional<steady_cloc
 // to a server and waits for a reply. After receiving reply it unmarshalls it and signal completion
 // to a caller.
 template<typename Serializer, typename MsgType, typename Ret, typename... InArgs>
-auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
+auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig, verb_stats& vs) {
     struct shelper {
         MsgType t;
         signature<Ret (InArgs...)> sig;
+        verb_stats& vs;
         auto send(typename protocol<Serializer, MsgType>::client& dst, std::experimental::optional<steady_clock_type::time_point> timeout, cancellable* cancel, const InArgs&... args) {
             if (dst.error()) {
                 using cleaned_ret_type = typename wait_signature<Ret>::cleaned_type;
                 return futurize<cleaned_ret_type>::make_exception_future(closed_error());
             }
-
+            return send_marshalled(dst, timeout, cancel, marshall(dst.serializer(), 28, args...));
+        }
+        auto send(typename protocol<Serializer, MsgType>::multi_client& dst, std::experimental::optional<steady_clock_type::time_point> timeout, cancellable* cancel, const InArgs&... args) {
+            // the connection depends on the serialized size
+            snd_buf data = marshall(dst.serializer(), 28, args...);
+            auto& c = dst.route(t, data.size - 28);
+            if (c.error()) {
+                using cleaned_ret_type = typename wait_signature<Ret>::cleaned_type;
+                return futurize<cleaned_ret_type>::make_exception_future(closed_error());
+            }
+            return send_marshalled(c, timeout, cancel, std::move(data));
+        }
+        auto send_marshalled(typename protocol<Serializer, MsgType>::client& dst, std::experimental::optional<steady_clock_type::time_point> timeout, cancellable* cancel, snd_buf data) {
             // send message
             auto msg_id = dst.next_message_id();
-            snd_buf data = marshall(dst.serializer(), 28, args...);
             static_assert(snd_buf::chunk_size >= 28, "send buffer chunk size is too small");
             auto p = data.front().get_write() + 8; // 8 extra bytes for expiration timer
             write_le<uint64_t>(p, uint64_t(t));
@@ -390,8 +520,14 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
 
             // prepare reply handler, if return type is now_wait_type this does nothing, since no reply will be sent
             using wait = wait_signature_t<Ret>;
-            return when_all(dst.send(std::move(data), timeout, cancel), wait_for_reply<Serializer, MsgType>(wait(), timeout, cancel, dst, msg_id, sig)).then([] (auto r) {
+            auto start = tsc_clock::now();
+            vs.sent_bytes.add(data.size - 28);
+            vs.calls_in_flight++;
+            return when_all(dst.send(std::move(data), timeout, cancel), wait_for_reply<Serializer, MsgType>(wait(), timeout, cancel, dst, msg_id, sig, vs)).then([] (auto r) {
                     return std::move(std::get<1>(r)); // return future of wait_for_reply
+            }).finally([&vs = vs, start] {
+                vs.calls_in_flight--;
+                vs.round_trip.add((tsc_clock::now() - start).count());
             });
         }
         auto operator()(typename protocol<Serializer, MsgType>::client& dst, const InArgs&... args) {
@@ -406,9 +542,91 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
         auto operator()(typename protocol<Serializer, MsgType>::client& dst, cancellable& cancel, const InArgs&... args) {
             return send(dst, {}, &cancel, args...);
         }
+        auto operator()(typename protocol<Serializer, MsgType>::multi_client& dst, const InArgs&... args) {
+            return send(dst, {}, nullptr, args...);
+        }
+        auto operator()(typename protocol<Serializer, MsgType>::multi_client& dst, steady_clock_type::time_point timeout, const InArgs&... args) {
+            return send(dst, timeout, nullptr, args...);
+        }
+        auto operator()(typename protocol<Serializer, MsgType>::multi_client& dst, steady_clock_type::duration timeout, const InArgs&... args) {
+            return send(dst, steady_clock_type::now() + timeout, nullptr, args...);
+        }
+        auto operator()(typename protocol<Serializer, MsgType>::multi_client& dst, cancellable& cancel, const InArgs&... args) {
+            return send(dst, {}, &cancel, args...);
+        }
 
     };
-    return shelper{xt, xsig};
+    return shelper{xt, xsig, vs};
+}
+
+template <typename Serializer, typename MsgType>
+template <typename Func>
+future<>
+protocol<Serializer, MsgType>::server::connection::admit(MsgType t, int64_t msg_id, size_t memory_consumed,
+        std::experimental::optional<steady_clock_type::time_point> timeout, verb_stats& vs, Func func) {
+    auto& s = _server;
+    if (timeout && *timeout <= steady_clock_type::now()) {
+        vs.expired_requests++;
+        return make_ready_future<>();
+    }
+    if (s._limits.max_queued_requests && s._admission_queued >= s._limits.max_queued_requests) {
+        vs.rejected_requests++;
+        reply_overloaded(msg_id, timeout, vs);
+        return make_ready_future<>();
+    }
+    auto run = make_lw_shared([c = this->shared_from_this(), memory_consumed, timeout, &vs, func = std::move(func)] () mutable {
+        // the caller may have given up while the request waited
+        if (timeout && *timeout <= steady_clock_type::now()) {
+            vs.expired_requests++;
+            c->release_resources(memory_consumed);
+            return make_ready_future<>();
+        }
+        return func();
+    });
+    auto f = wait_for_resources(memory_consumed, timeout).then([&s, t, run] {
+        if (!s._admission) {
+            (*run)();
+            return;
+        }
+        s._admission_queued++;
+        try {
+            seastar::with_gate(s._admission_gate, [&s, t, run] {
+                return s._admission->queue(s.priority_class_for(t), 1, [&s, run] {
+                    s._admission_queued--;
+                    return (*run)();
+                });
+            });
+        } catch (seastar::gate_closed_exception&) {
+            s._admission_queued--;
+        }
+    });
+    if (timeout) {
+        f = f.handle_exception_type([&vs] (semaphore_timed_out&) {
+            vs.expired_requests++;
+        });
+    }
+    return f;
+}
+
+template <typename Serializer, typename MsgType>
+void
+protocol<Serializer, MsgType>::server::connection::reply_overloaded(int64_t msg_id, std::experimental::optional<steady_clock_type::time_point> timeout, verb_stats& vs) {
+    auto& s = _server;
+    // Suggest retrying once the queue ahead has drained, going by how
+    // long this verb's handlers take
+    auto& h = vs.handler_latency;
+    uint64_t latency_ns = h.sample_count() ? h.sample_sum() / h.sample_count() : 0;
+    uint64_t retry_after_ms = latency_ns * s._admission_queued / std::max(1u, s._limits.max_concurrent_requests) / 1000000;
+    snd_buf data(24);
+    auto p = data.front().get_write() + 12;
+    write_le<uint32_t>(p, uint32_t(exception_type::OVERLOADED));
+    write_le<uint32_t>(p + 4, uint32_t(4));
+    write_le<uint32_t>(p + 8, uint32_t(std::min<uint64_t>(std::max<uint64_t>(retry_after_ms, 1), std::numeric_limits<uint32_t>::max())));
+    try {
+        seastar::with_gate(s._reply_gate, [this, msg_id, timeout, data = std::move(data)] () mutable {
+            return this->respond(-msg_id, std::move(data), timeout).finally([c = this->shared_from_this()] {});
+        });
+    } catch (seastar::gate_closed_exception&) {/* ignore */}
 }
 
 template <typename Serializer, typename MsgType>
@@ -424,7 +642,7 @@ protocol<Serializer, MsgType>::server::connection::respond(int64_t msg_id, snd_b
 
 template<typename Serializer, typename MsgType, typename... RetTypes>
 inline future<> reply(wait_type, future<RetTypes...>&& ret, int64_t msg_id, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
-        std::experimental::optional<steady_clock_type::time_point> timeout) {
+        std::experimental::optional<steady_clock_type::time_point> timeout, verb_stats& vs) {
     if (!client->error()) {
         snd_buf data;
         try {
@@ -443,6 +661,7 @@ inline future<> reply(wait_type, future<RetTypes...>&& ret, int64_t msg_id, lw_s
             msg_id = -msg_id;
         }
 
+        vs.sent_bytes.add(data.size - 12);
         return client->respond(msg_id, std::move(data), timeout);
     } else {
         ret.ignore_ready_future();
@@ -452,7 +671,8 @@ inline future<> reply(wait_type, future<RetTypes...>&& ret, int64_t msg_id, lw_s
 
 // specialization for no_wait_type which does not send a reply
 template<typename Serializer, typename MsgType>
-inline future<> reply(no_wait_type, future<no_wait_type>&& r, int64_t msgid, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client, std::experimental::optional<steady_clock_type::time_point> timeout) {
+inline future<> reply(no_wait_type, future<no_wait_type>&& r, int64_t msgid, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client, std::experimental::optional<steady_clock_type::time_point> timeout,
+        verb_stats& vs) {
     try {
         r.get();
     } catch (std::exception& ex) {
@@ -485,33 +705,42 @@ auto lref_to_cref(T& x) {
 // Creates lambda to handle RPC message on a server.
 // The lambda unmarshalls all parameters, calls a handler, marshall return values and sends them back to a client
 template <typename Serializer, typename MsgType, typename Func, typename Ret, typename... InArgs, typename WantClientInfo, typename WantTimePoint>
-auto recv_helper(signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci, WantTimePoint wtp) {
+auto recv_helper(MsgType t, signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci, WantTimePoint wtp, verb_stats& vs) {
     using signature = decltype(sig);
     using wait_style = wait_signature_t<Ret>;
-    return [func = lref_to_cref(std::forward<Func>(func))](lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
+    return [func = lref_to_cref(std::forward<Func>(func)), t, &vs](lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
                                                            std::experimental::optional<steady_clock_type::time_point> timeout,
                                                            int64_t msg_id,
                                                            rcv_buf data) mutable {
+        auto start = tsc_clock::now();
+        vs.received_bytes.add(data.size);
         auto memory_consumed = client->estimate_request_size(data.size);
         // note: apply is executed asynchronously with regards to networking so we cannot chain futures here by doing "return apply()"
-        auto f = client->wait_for_resources(memory_consumed, timeout).then([client, timeout, msg_id, memory_consumed, data = std::move(data), &func] () mutable {
+        return client->admit(t, msg_id, memory_consumed, timeout, vs, [client, timeout, msg_id, memory_consumed, data = std::move(data), &func, &vs, start, t] () mutable {
             try {
-                seastar::with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, memory_consumed, data = std::move(data), &func] () mutable {
-                    auto args = unmarshall<Serializer, InArgs...>(client->serializer(), std::move(data));
-                    return apply(func, client->info(), timeout, WantClientInfo(), WantTimePoint(), signature(), std::move(args)).then_wrapped([client, timeout, msg_id, memory_consumed] (futurize_t<Ret> ret) mutable {
-                        return reply<Serializer, MsgType>(wait_style(), std::move(ret), msg_id, client, timeout).finally([client, memory_consumed] {
-                            client->release_resources(memory_consumed);
+                return seastar::with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, memory_consumed, data = std::move(data), &func, &vs, start, t] () mutable {
+                    seastar::tracing::span span("rpc");
+                    if (span.sampled()) {
+                        span.set_detail(sprint("verb %d", uint64_t(t)));
+                    }
+                    // The span covers the handler and sending its reply
+                    return seastar::tracing::with_span(std::move(span), [&] {
+                        auto args = unmarshall<Serializer, InArgs...>(client->serializer(), std::move(data), client.get());
+                        auto f = apply(func, client->info(), timeout, WantClientInfo(), WantTimePoint(), signature(), std::move(args));
+                        vs.handlers_in_flight++;
+                        return f.then_wrapped([client, timeout, msg_id, memory_consumed, &vs, start] (futurize_t<Ret> ret) mutable {
+                            return reply<Serializer, MsgType>(wait_style(), std::move(ret), msg_id, client, timeout, vs).finally([client, memory_consumed, &vs, start] {
+                                vs.handlers_in_flight--;
+                                vs.handler_latency.add((tsc_clock::now() - start).count());
+                                client->release_resources(memory_consumed);
+                            });
                         });
                     });
                 });
-            } catch (seastar::gate_closed_exception&) {/* ignore */ }
+            } catch (seastar::gate_closed_exception&) {
+                return make_ready_future<>();
+            }
         });
-
-        if (timeout) {
-            f = f.handle_exception_type([] (semaphore_timed_out&) { /* ignore */ });
-        }
-
-        return std::move(f);
     };
 }
 
@@ -530,12 +759,22 @@ auto make_copyable_function(Func&& func, std::enable_if_t<std::is_copy_construct
 // This class is used to calculate client side rpc function signature.
 // Return type is converted from a smart pointer to a type it points to.
 // rpc::optional are converted to non optional type.
+// A handler's rpc::source is passed by the client as the matching rpc::sink.
 //
 // Examples:
 // std::unique_ptr<int>(int, rpc::optional<long>) -> int(int, long)
 // double(float) -> double(float)
+// future<>(rpc::source<int>) -> future<>(rpc::sink<int>)
 template<typename Ret, typename... In>
 class client_function_type {
+    template<typename T>
+    struct source_to_sink {
+        using type = T;
+    };
+    template<typename... T>
+    struct source_to_sink<source<T...>> {
+        using type = sink<T...>;
+    };
     template<typename T, bool IsSmartPtr>
     struct drop_smart_ptr_impl;
     template<typename T>
@@ -552,14 +791,14 @@ class client_function_type {
     // if return type is smart ptr take a type it points to instead
     using return_type = typename drop_smart_ptr<Ret>::type;
 public:
-    using type = return_type(typename remove_optional<In>::type...);
+    using type = return_type(typename source_to_sink<typename remove_optional<In>::type>::type...);
 };
 
 template<typename Serializer, typename MsgType>
 template<typename Ret, typename... In>
 auto protocol<Serializer, MsgType>::make_client(signature<Ret(In...)> clear_sig, MsgType t) {
     using sig_type = signature<typename client_function_type<Ret, In...>::type>;
-    return send_helper<Serializer>(t, sig_type());
+    return send_helper<Serializer>(t, sig_type(), get_verb_stats(t));
 }
 
 template<typename Serializer, typename MsgType>
@@ -568,6 +807,12 @@ auto protocol<Serializer, MsgType>::make_client(MsgType t) {
     return make_client(typename signature<typename function_traits<Func>::signature>::clean(), t);
 }
 
+template<typename Serializer, typename MsgType>
+template<typename... Out>
+sink<Out...> protocol<Serializer, MsgType>::client::make_stream_sink() {
+    return sink<Out...>(make_shared<stream_sink_impl<Serializer, Out...>>(this->serializer(), this->open_stream()));
+}
+
 template<typename Serializer, typename MsgType>
 template<typename Func>
 auto protocol<Serializer, MsgType>::register_handler(MsgType t, Func&& func) {
@@ -575,26 +820,62 @@ auto protocol<Serializer, MsgType>::register_handler(MsgType t, Func&& func) {
     using clean_sig_type = typename sig_type::clean;
     using want_client_info = typename sig_type::want_client_info;
     using want_time_point = typename sig_type::want_time_point;
-    auto recv = recv_helper<Serializer, MsgType>(clean_sig_type(), std::forward<Func>(func),
-            want_client_info(), want_time_point());
-    register_receiver(t, make_copyable_function(std::move(recv)));
+    auto recv = recv_helper<Serializer, MsgType>(t, clean_sig_type(), std::forward<Func>(func),
+            want_client_info(), want_time_point(), get_verb_stats(t));
+    register_receiver(t, std::move(recv));
     return make_client(clean_sig_type(), t);
 }
 
+template<typename Serializer, typename MsgType>
+verb_stats& protocol<Serializer, MsgType>::get_verb_stats(MsgType t) {
+    auto& vs = _verb_stats[t];
+    if (!vs) {
+        vs = std::make_unique<verb_stats>();
+        if (_metrics_name) {
+            vs->register_metrics(sprint("%s-%s-%d", *_metrics_name, _verb_name(t), engine().cpu_id()));
+        }
+    }
+    return *vs;
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::register_metrics(sstring name, std::function<sstring (MsgType)> verb_name) {
+    namespace sm = seastar::metrics;
+    _metrics_name = name;
+    _verb_name = std::move(verb_name);
+    _metrics.add_group("rpc", {
+        sm::make_histogram("send_queue_time_us", [this] { return _send_queue_time.to_metrics_histogram(1e-3); },
+                sm::description("Time messages waited in connections' outgoing queues"), true, sprint("%s-%d", name, engine().cpu_id())),
+    });
+    for (auto&& vs : _verb_stats) {
+        vs.second->register_metrics(sprint("%s-%s-%d", name, _verb_name(vs.first), engine().cpu_id()));
+    }
+}
+
 template<typename Serializer, typename MsgType>
 protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, ipv4_addr addr, resource_limits limits)
     : server(proto, engine().listen(addr, listen_options(true)), limits, server_options{})
 {}
 
+inline listen_options make_listen_options(const server_options& opts) {
+    listen_options lo(true);
+    lo.lba = opts.load_balancing_algorithm;
+    return lo;
+}
+
 template<typename Serializer, typename MsgType>
 protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, server_options opts, ipv4_addr addr, resource_limits limits)
-    : server(proto, engine().listen(addr, listen_options(true)), limits, opts)
+    : server(proto, engine().listen(addr, make_listen_options(opts)), limits, opts)
 {}
 
 template<typename Serializer, typename MsgType>
 protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, server_socket ss, resource_limits limits, server_options opts)
         : _proto(proto), _ss(std::move(ss)), _limits(limits), _resources_available(limits.max_memory), _options(opts)
 {
+    if (_limits.max_concurrent_requests) {
+        _admission = std::make_unique<fair_queue>(_limits.max_concurrent_requests);
+        _default_class = _admission->register_priority_class(100);
+    }
     accept();
 }
 
@@ -626,6 +907,19 @@ template<typename Serializer, typename MsgType>
 protocol<Serializer, MsgType>::server::connection::connection(protocol<Serializer, MsgType>::server& s, connected_socket&& fd, socket_address&& addr, protocol<Serializer, MsgType>& proto)
     : protocol<Serializer, MsgType>::connection(std::move(fd), proto), _server(s) {
     _info.addr = std::move(addr);
+    this->_streams_opened_by_peer = true;
+    // Unread stream data is charged to the server's memory, so no stream may want more than all of it
+    this->_stream_window = std::max(stream_min_window, uint32_t(std::min<size_t>(s._options.stream_window, s._limits.max_memory)));
+}
+
+inline sstring encode_stream_window(uint32_t window) {
+    sstring ret(sstring::initialized_later(), 4);
+    write_le<uint32_t>(ret.begin(), window);
+    return ret;
+}
+
+inline uint32_t decode_stream_window(const sstring& data) {
+    return data.size() == 4 ? read_le<uint32_t>(data.begin()) : stream_min_window;
 }
 
 
@@ -721,37 +1015,31 @@ receive_negotiation_frame(Connection& c, input_stream<char>& in) {
     });
 }
 
+// Frames up to this size are read into one buffer: straight from the
+// stream's buffer when they sit in it, which is the common case when many
+// small frames arrive together, and with a small copy when they straddle two
+static constexpr uint32_t max_contiguous_frame_size = 16 * 1024;
+
 inline future<rcv_buf>
 read_rcv_buf(input_stream<char>& in, uint32_t size) {
-    return in.read_up_to(size).then([&, size] (temporary_buffer<char> data) mutable {
-        rcv_buf rb(size);
-        if (data.size() == 0) {
-            return make_ready_future<rcv_buf>(rcv_buf());
-        } else if (data.size() == size) {
+    if (size <= max_contiguous_frame_size) {
+        return in.read_exactly(size).then([] (temporary_buffer<char> data) {
+            rcv_buf rb(data.size());
             rb.bufs = std::move(data);
-            return make_ready_future<rcv_buf>(std::move(rb));
+            return rb;
+        });
+    }
+    return in.read_exactly_scattered(size).then([] (std::vector<temporary_buffer<char>> data) {
+        rcv_buf rb;
+        for (auto&& b : data) {
+            rb.size += b.size();
+        }
+        if (data.size() == 1) {
+            rb.bufs = std::move(data.front());
         } else {
-            size -= data.size();
-            std::vector<temporary_buffer<char>> v;
-            v.push_back(std::move(data));
-            rb.bufs = std::move(v);
-            return do_with(std::move(rb), std::move(size), [&in] (rcv_buf& rb, uint32_t& left) {
-                return repeat([&] () {
-                    return in.read_up_to(left).then([&] (temporary_buffer<char> data) {
-                        if (!data.size()) {
-                            rb.size -= left;
-                            return stop_iteration::yes;
-                        } else {
-                            left -= data.size();
-                            boost::get<std::vector<temporary_buffer<char>>>(rb.bufs).push_back(std::move(data));
-                            return left ? stop_iteration::no : stop_iteration::yes;
-                        }
-                    });
-                }).then([&rb] {
-                    return std::move(rb);
-                });
-            });
+            rb.bufs = std::move(data);
         }
+        return rb;
     });
 }
 
@@ -842,6 +1130,10 @@ protocol<Serializer, MsgType>::server::connection::negotiate(feature_map request
             this->_timeout_negotiated = true;
             ret[protocol_features::TIMEOUT] = "";
             break;
+        case protocol_features::STREAM:
+            this->start_streams(decode_stream_window(e.second));
+            ret[protocol_features::STREAM] = encode_stream_window(this->_stream_window);
+            break;
         default:
             // nothing to do
             ;
@@ -936,11 +1228,18 @@ protocol<Serializer, MsgType>::client::negotiate(feature_map provided) {
         case protocol_features::TIMEOUT:
             this->_timeout_negotiated = true;
             break;
+        case protocol_features::STREAM:
+            this->start_streams(decode_stream_window(e.second));
+            break;
         default:
             // nothing to do
             ;
         }
     }
+    if (!this->_streams_negotiated) {
+        // an older server; streams opened so far cannot be used
+        this->fail_streams(std::make_exception_ptr(rpc_protocol_error()));
+    }
 }
 
 template<typename Serializer, typename MsgType>
@@ -952,14 +1251,15 @@ future<> protocol<Serializer, MsgType>::server::connection::process() {
                 if (!data) {
                     this->_error = true;
                     return make_ready_future<>();
+                } else if (msg_id == 0 && this->_streams_negotiated) {
+                    return this->handle_stream_frame(std::move(data.value()));
                 } else {
                     std::experimental::optional<steady_clock_type::time_point> timeout;
                     if (expire && *expire) {
                         timeout = steady_clock_type::now() + std::chrono::milliseconds(*expire);
                     }
-                    auto it = _server._proto._handlers.find(type);
-                    if (it != _server._proto._handlers.end()) {
-                        return it->second(this->shared_from_this(), timeout, msg_id, std::move(data.value()));
+                    if (auto h = _server._proto.find_handler(type)) {
+                        return (*h)(this->shared_from_this(), timeout, msg_id, std::move(data.value()));
                     } else {
                         return this->wait_for_resources(28, timeout).then([this, timeout, msg_id, type] {
                             // send unknown_verb exception back
@@ -986,6 +1286,7 @@ future<> protocol<Serializer, MsgType>::server::connection::process() {
             log_exception(*this, "server connection dropped", f.get_exception());
         }
         this->_error = true;
+        this->fail_streams(std::make_exception_ptr(closed_error()));
         return this->stop_send_loop().then_wrapped([this] (future<> f) {
             f.ignore_ready_future();
             this->_server._conns.erase(this->shared_from_this());
@@ -1048,6 +1349,7 @@ protocol<Serializer, MsgType>::client::read_response_frame_compressed(input_stre
 template<typename Serializer, typename MsgType>
 protocol<Serializer, MsgType>::client::client(protocol& proto, client_options ops, seastar::socket socket, ipv4_addr addr, ipv4_addr local)
         : protocol<Serializer, MsgType>::connection(proto), _socket(std::move(socket)), _server_addr(addr), _options(ops) {
+    this->_stream_window = std::max(ops.stream_window, stream_min_window);
     _socket.connect(addr, local).then([this, ops = std::move(ops)] (connected_socket fd) {
         fd.set_nodelay(true);
         if (ops.keepalive) {
@@ -1063,6 +1365,7 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, client_options op
         if (_options.send_timeout_data) {
             features[protocol_features::TIMEOUT] = "";
         }
+        features[protocol_features::STREAM] = encode_stream_window(this->_stream_window);
         send_negotiation_frame(*this, std::move(features));
 
         return this->negotiate_protocol(this->_read_buf).then([this] () {
@@ -1072,6 +1375,8 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, client_options op
                     auto it = _outstanding.find(std::abs(msg_id));
                     if (!data) {
                         this->_error = true;
+                    } else if (msg_id == 0 && this->_streams_negotiated) {
+                        return this->handle_stream_frame(std::move(data.value()));
                     } else if (it != _outstanding.end()) {
                         auto handler = std::move(it->second);
                         _outstanding.erase(it);
@@ -1092,6 +1397,7 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, client_options op
                         // this can happened if the message id is timed out already
                         // FIXME: log it but with low level, currently log levels are not supported
                     }
+                    return make_ready_future<>();
                 });
             });
         });
@@ -1100,6 +1406,7 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, client_options op
             log_exception(*this, this->_connected ? "client connection dropped" : "fail to connect", f.get_exception());
         }
         this->_error = true;
+        this->fail_streams(std::make_exception_ptr(closed_error()));
         this->stop_send_loop().then_wrapped([this] (future<> f) {
             f.ignore_ready_future();
             this->_stopped.set_value();
@@ -1123,4 +1430,100 @@ protocol<Serializer, MsgType>::client::client(protocol<Serializer, MsgType>& pro
     : client(proto, client_options{}, std::move(socket), addr, local)
 {}
 
+template<typename Serializer, typename MsgType>
+protocol<Serializer, MsgType>::multi_client::multi_client(protocol<Serializer, MsgType>& proto, multi_client_options options, ipv4_addr addr, ipv4_addr local)
+    : multi_client(proto, std::move(options), [] { return engine().net().socket(); }, addr, local)
+{}
+
+template<typename Serializer, typename MsgType>
+protocol<Serializer, MsgType>::multi_client::multi_client(protocol<Serializer, MsgType>& proto, multi_client_options options,
+        std::function<::seastar::socket ()> make_socket, ipv4_addr addr, ipv4_addr local)
+        : _proto(proto), _options(std::move(options)), _make_socket(std::move(make_socket)), _addr(addr), _local(local) {
+    for (unsigned i = 0; i < std::max(_options.connections, 1u); ++i) {
+        _clients.push_back(connect());
+    }
+}
+
+template<typename Serializer, typename MsgType>
+std::unique_ptr<typename protocol<Serializer, MsgType>::client>
+protocol<Serializer, MsgType>::multi_client::connect() {
+    if (!_options.server_shards) {
+        return std::make_unique<client>(_proto, _options.client, _make_socket(), _addr, _local);
+    }
+    // Walk the ephemeral ports the server maps to the shard matching ours;
+    // the next one is tried when one is in use
+    static constexpr unsigned first_port = 32768, last_port = 61000;
+    static thread_local unsigned next = std::random_device()();
+    auto shards = *_options.server_shards;
+    auto base = first_port + (engine().cpu_id() % shards + shards - first_port % shards) % shards;
+    auto ports = (last_port - base) / shards;
+    for (unsigned attempt = 0;; ++attempt) {
+        auto local = _local;
+        local.port = base + next++ % ports * shards;
+        try {
+            return std::make_unique<client>(_proto, _options.client, _make_socket(), _addr, local);
+        } catch (std::system_error& e) {
+            if (e.code().value() != EADDRINUSE || attempt == 16) {
+                throw;
+            }
+        }
+    }
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::multi_client::reconnect(unsigned i) {
+    std::unique_ptr<client> c;
+    try {
+        c = connect();
+    } catch (...) {
+        // keep the failed one, callers get closed_error until a later attempt works
+        return;
+    }
+    std::swap(c, _clients[i]);
+    auto p = c.get();
+    _retired = when_all(std::move(_retired), p->stop().finally([c = std::move(c)] {})).discard_result();
+}
+
+template<typename Serializer, typename MsgType>
+typename protocol<Serializer, MsgType>::client&
+protocol<Serializer, MsgType>::multi_client::route(MsgType t, size_t serialized_size) {
+    unsigned i = 0;
+    if (_clients.size() > 1 && serialized_size > _options.small_message_size && !_urgent.count(t)) {
+        i = 1;
+        for (unsigned j = 2; j < _clients.size(); ++j) {
+            if (load(*_clients[j]) < load(*_clients[i])) {
+                i = j;
+            }
+        }
+    }
+    if (_clients[i]->error()) {
+        reconnect(i);
+    }
+    return *_clients[i];
+}
+
+template<typename Serializer, typename MsgType>
+stats protocol<Serializer, MsgType>::multi_client::get_stats() const {
+    stats res;
+    for (auto&& c : _clients) {
+        auto s = c->get_stats();
+        res.replied += s.replied;
+        res.pending += s.pending;
+        res.exception_received += s.exception_received;
+        res.sent_messages += s.sent_messages;
+        res.wait_reply += s.wait_reply;
+        res.timeout += s.timeout;
+    }
+    return res;
+}
+
+template<typename Serializer, typename MsgType>
+future<> protocol<Serializer, MsgType>::multi_client::stop() {
+    return parallel_for_each(_clients, [] (std::unique_ptr<client>& c) {
+        return c->stop();
+    }).then([this] {
+        return std::move(_retired);
+    });
+}
+
 }
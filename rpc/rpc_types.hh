@@ -103,6 +103,18 @@ class canceled_error : public error {
     canceled_error() : error("rpc call was canceled") {}
 };
 
+class overloaded_error : public error {
+public:
+    /// The server's estimate of how long its queue takes to drain
+    std::chrono::milliseconds retry_after;
+    overloaded_error(std::chrono::milliseconds retry_after_) : error("rpc server is overloaded"), retry_after(retry_after_) {}
+};
+
+class stream_closed : public error {
+public:
+    stream_closed() : error("rpc stream is closed") {}
+};
+
 struct no_wait_type {};
 
 // return this from a callback if client does not want to waiting for a reply
@@ -177,6 +189,42 @@ struct snd_buf {
     temporary_buffer<char>& front();
 };
 
+/// Output given to the write() functions of single-pass serializers (see
+/// marshall()). Writes into the fragments of a snd_buf, adding them as it
+/// goes, and can splice existing buffers into the message without copying.
+class snd_buf_output {
+    std::vector<temporary_buffer<char>> _bufs;
+    // Room left in _bufs.back(), unless that is a spliced buffer
+    char* _pos = nullptr;
+    char* _end = nullptr;
+    size_t _size = 0;
+private:
+    void write_slow(const char* p, size_t n);
+    void trim_last();
+public:
+    /// Smaller buffers are copied rather than spliced; a fragment costs more
+    static constexpr size_t min_splice_size = 512;
+    /// Leaves head_space bytes for the frame header; size_hint is the
+    /// expected size of the rest, used for the first fragment
+    snd_buf_output(size_t head_space, size_t size_hint);
+    void write(const char* p, size_t n) {
+        if (size_t(_end - _pos) >= n) {
+            std::copy_n(p, n, _pos);
+            _pos += n;
+            _size += n;
+        } else {
+            write_slow(p, n);
+        }
+    }
+    /// Appends buf to the message by reference; the message keeps it alive
+    /// until it is sent
+    void splice(const temporary_buffer<char>& buf);
+    size_t size() const {
+        return _size;
+    }
+    snd_buf release();
+};
+
 static inline seastar::memory_input_stream<rcv_buf::iterator> make_deserializer_stream(rcv_buf& input) {
     auto* b = boost::get<temporary_buffer<char>>(&input.bufs);
     if (b) {
@@ -194,6 +242,9 @@ class compressor {
     virtual snd_buf compress(size_t head_space, snd_buf data) = 0;
     // decompress data
     virtual rcv_buf decompress(rcv_buf data) = 0;
+    // called after a batch of compressed messages, bytes long, took this
+    // long to write, for compressors that adapt to the link's throughput
+    virtual void on_sent(size_t bytes, std::chrono::steady_clock::duration took) {}
 
     // factory to create compressor for a connection
     class factory {
@@ -0,0 +1,219 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 Scylladb, Ltd.
+ */
+
+#ifdef HAVE_ZSTD
+
+#include "zstd_compressor.hh"
+#include "core/byteorder.hh"
+#include "core/print.hh"
+
+namespace rpc {
+
+// Compressed frames start with the uncompressed size, as with LZ4; zero
+// means the message follows uncompressed.
+
+static temporary_buffer<char> linearize(boost::variant<std::vector<temporary_buffer<char>>, temporary_buffer<char>>& v, uint32_t size) {
+    auto* one = boost::get<temporary_buffer<char>>(&v);
+    if (one) {
+        // no need to linearize
+        return std::move(*one);
+    } else {
+        temporary_buffer<char> src(size);
+        auto p = src.get_write();
+        for (auto&& b : boost::get<std::vector<temporary_buffer<char>>>(v)) {
+            p = std::copy_n(b.begin(), b.size(), p);
+        }
+        return src;
+    }
+}
+
+// Sends data as it is, behind head_space bytes ending in a zero size
+static snd_buf uncompressed(size_t head_space, snd_buf data) {
+    std::vector<temporary_buffer<char>> bufs;
+    bufs.emplace_back(head_space);
+    write_le<uint32_t>(bufs.back().get_write() + head_space - 4, 0);
+    if (auto* one = boost::get<temporary_buffer<char>>(&data.bufs)) {
+        bufs.push_back(std::move(*one));
+    } else {
+        auto& v = boost::get<std::vector<temporary_buffer<char>>>(data.bufs);
+        std::move(v.begin(), v.end(), std::back_inserter(bufs));
+    }
+    snd_buf ret;
+    ret.size = head_space + data.size;
+    ret.bufs = std::move(bufs);
+    return ret;
+}
+
+static rcv_buf drop_front(rcv_buf data, size_t n) {
+    data.size -= n;
+    if (auto* one = boost::get<temporary_buffer<char>>(&data.bufs)) {
+        one->trim_front(n);
+        return data;
+    }
+    auto& v = boost::get<std::vector<temporary_buffer<char>>>(data.bufs);
+    auto i = v.begin();
+    while (n) {
+        auto now = std::min(n, i->size());
+        i->trim_front(now);
+        n -= now;
+        if (i->empty()) {
+            ++i;
+        }
+    }
+    v.erase(v.begin(), i);
+    return data;
+}
+
+// FNV-1a, so that both ends name the same dictionary alike
+static uint32_t dictionary_hash(const sstring& dict) {
+    uint32_t h = 2166136261;
+    for (auto c : dict) {
+        h = (h ^ uint8_t(c)) * 16777619;
+    }
+    return h;
+}
+
+zstd_compressor::factory::factory(options opts)
+        : _name(opts.dictionary.empty() ? sstring("ZSTD") : sstring(sprint("ZSTD-%08x", dictionary_hash(opts.dictionary))))
+        , _options(std::move(opts)) {
+}
+
+zstd_compressor::zstd_compressor(options opts)
+        : _options(std::move(opts))
+        , _cctx(ZSTD_createCCtx())
+        , _dctx(ZSTD_createDCtx())
+        , _level(std::min(std::max(_options.initial_level, _options.min_level), _options.max_level)) {
+    if (!_cctx || !_dctx) {
+        throw std::bad_alloc();
+    }
+    if (!_options.dictionary.empty()) {
+        _ddict.reset(ZSTD_createDDict(_options.dictionary.data(), _options.dictionary.size()));
+        if (!_ddict) {
+            throw std::runtime_error("zstd dictionary is not usable");
+        }
+    }
+}
+
+ZSTD_CDict* zstd_compressor::cdict() {
+    auto& d = _cdicts[_level];
+    if (!d) {
+        d.reset(ZSTD_createCDict(_options.dictionary.data(), _options.dictionary.size(), _level));
+        if (!d) {
+            throw std::runtime_error("zstd dictionary is not usable");
+        }
+    }
+    return d.get();
+}
+
+snd_buf zstd_compressor::compress(size_t head_space, snd_buf data) {
+    head_space += 4;
+    if (data.size && data.size >= _options.min_compress_size) {
+        auto start = clock::now();
+        temporary_buffer<char> src = linearize(data.bufs, data.size);
+        auto bound = ZSTD_compressBound(src.size());
+        temporary_buffer<char> dst(head_space + bound);
+        auto size = _ddict
+                ? ZSTD_compress_usingCDict(_cctx.get(), dst.get_write() + head_space, bound, src.get(), src.size(), cdict())
+                : ZSTD_compressCCtx(_cctx.get(), dst.get_write() + head_space, bound, src.get(), src.size(), _level);
+        if (ZSTD_isError(size)) {
+            throw std::runtime_error(sprint("RPC frame zstd compression failure: %s", ZSTD_getErrorName(size)));
+        }
+        auto took = clock::now() - start;
+        _stats.compress_time += took;
+        auto ratio = double(size) / src.size();
+        auto rate = src.size() / std::max(std::chrono::duration<double>(took).count(), 1e-7);
+        _compress_rate = _samples ? 0.9 * _compress_rate + 0.1 * rate : rate;
+        _ratio = _samples ? 0.9 * _ratio + 0.1 * ratio : ratio;
+        ++_samples;
+        if (ratio <= _options.max_ratio) {
+            dst.trim(head_space + size);
+            write_le<uint32_t>(dst.get_write() + (head_space - 4), src.size());
+            _stats.compressed++;
+            _stats.bytes_in += src.size();
+            _stats.bytes_out += size;
+            return snd_buf(std::move(dst));
+        }
+        data = snd_buf(std::move(src));
+    }
+    _stats.skipped++;
+    return uncompressed(head_space, std::move(data));
+}
+
+rcv_buf zstd_compressor::decompress(rcv_buf data) {
+    if (data.size < 4) {
+        return rcv_buf();
+    }
+    auto in = make_deserializer_stream(data);
+    uint32_t v32;
+    in.read(reinterpret_cast<char*>(&v32), 4);
+    auto size = le_to_cpu(v32);
+    if (!size) {
+        return drop_front(std::move(data), 4);
+    }
+    auto start = clock::now();
+    temporary_buffer<char> src = linearize(data.bufs, data.size);
+    src.trim_front(4);
+    rcv_buf rb(size);
+    rb.bufs = temporary_buffer<char>(size);
+    auto& dst = boost::get<temporary_buffer<char>>(rb.bufs);
+    auto r = _ddict
+            ? ZSTD_decompress_usingDDict(_dctx.get(), dst.get_write(), size, src.get(), src.size(), _ddict.get())
+            : ZSTD_decompressDCtx(_dctx.get(), dst.get_write(), size, src.get(), src.size());
+    if (ZSTD_isError(r) || r != size) {
+        throw std::runtime_error("RPC frame zstd decompression failure");
+    }
+    _stats.decompress_time += clock::now() - start;
+    return rb;
+}
+
+void zstd_compressor::on_sent(size_t bytes, std::chrono::steady_clock::duration took) {
+    // A batch written at once only went into the socket buffer, and says
+    // nothing about the link
+    if (took < std::chrono::milliseconds(1)) {
+        return;
+    }
+    auto rate = bytes / std::chrono::duration<double>(took).count();
+    _link_rate = _link_rate ? 0.8 * _link_rate + 0.2 * rate : rate;
+    adapt();
+}
+
+void zstd_compressor::adapt() {
+    if (_samples < 16 || !_link_rate) {
+        return;
+    }
+    // Compressed bytes this produces per second of CPU, against what the
+    // link carries; the gap between the thresholds keeps it from flapping
+    auto output_rate = _compress_rate * _ratio;
+    auto level = _level;
+    if (output_rate > 4 * _link_rate) {
+        level = std::min(_level + 1, _options.max_level);
+    } else if (output_rate < 2 * _link_rate) {
+        level = std::max(_level - 1, _options.min_level);
+    }
+    if (level != _level) {
+        _level = level;
+        _samples = 0;
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 Scylladb, Ltd.
+ */
+
+#pragma once
+
+#ifdef HAVE_ZSTD
+
+#include "core/sstring.hh"
+#include "rpc/rpc_types.hh"
+#include "rpc/compressor_stats.hh"
+#include <zstd.h>
+#include <map>
+
+namespace rpc {
+    struct zstd_compressor_options {
+        // Raw content or made with `zstd --train`; the peer must use
+        // the same one, which negotiation checks
+        sstring dictionary;
+        // Smaller messages are not compressed
+        size_t min_compress_size = 256;
+        // Messages that do not compress below this fraction of their
+        // size are sent uncompressed
+        double max_ratio = 0.95;
+        int min_level = 1;
+        int max_level = 9;
+        // The level stays here if min_level == max_level
+        int initial_level = 3;
+    };
+
+    // zstd compression, optionally with a dictionary both ends share, which
+    // pays off on the small messages RPC mostly carries.
+    //
+    // Messages that are small or do not shrink enough are sent as they are.
+    // The level adapts to the link: while compressing at the current level
+    // produces output much faster than the connection writes it out, a
+    // higher level is affordable; once compression holds the connection
+    // back, the level goes down.
+    class zstd_compressor : public compressor {
+    public:
+        using options = zstd_compressor_options;
+        class factory: public rpc::compressor::factory {
+            sstring _name;
+            options _options;
+        public:
+            explicit factory(options opts = options());
+            virtual const sstring& supported() const override {
+                return _name;
+            }
+            virtual std::unique_ptr<rpc::compressor> negotiate(sstring feature, bool is_server) const override {
+                return feature == _name ? std::make_unique<rpc::zstd_compressor>(_options) : nullptr;
+            }
+        };
+    private:
+        template <typename T, size_t (*Free)(T*)>
+        struct deleter {
+            void operator()(T* p) const {
+                Free(p);
+            }
+        };
+        using clock = compressor_stats::clock;
+        options _options;
+        std::unique_ptr<ZSTD_CCtx, deleter<ZSTD_CCtx, ZSTD_freeCCtx>> _cctx;
+        std::unique_ptr<ZSTD_DCtx, deleter<ZSTD_DCtx, ZSTD_freeDCtx>> _dctx;
+        // Dictionaries digested for each level used so far
+        std::map<int, std::unique_ptr<ZSTD_CDict, deleter<ZSTD_CDict, ZSTD_freeCDict>>> _cdicts;
+        std::unique_ptr<ZSTD_DDict, deleter<ZSTD_DDict, ZSTD_freeDDict>> _ddict;
+        int _level;
+        // Estimates at _level of the input compressed per second of CPU,
+        // and of the compressed to uncompressed size; and of the bytes per
+        // second the connection writes
+        double _compress_rate = 0;
+        double _ratio = 1;
+        unsigned _samples = 0;
+        double _link_rate = 0;
+        compressor_stats& _stats = compressor_stats::local("ZSTD");
+    private:
+        ZSTD_CDict* cdict();
+        void adapt();
+    public:
+        explicit zstd_compressor(options opts = options());
+        // compress data, leaving head_space empty in returned buffer
+        snd_buf compress(size_t head_space, snd_buf data) override;
+        // decompress data
+        rcv_buf decompress(rcv_buf data) override;
+        void on_sent(size_t bytes, std::chrono::steady_clock::duration took) override;
+        int level() const {
+            return _level;
+        }
+    };
+}
+
+#endif
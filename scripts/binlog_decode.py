@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#
+# This file is open source software, licensed to you under the terms
+# of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+# distributed with this work for additional information regarding copyright
+# ownership.  You may not use this file except in compliance with the License.
+#
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+# Copyright (C) 2017 ScyllaDB
+#
+# Formats the records of a binary log dump (see --binary-log), in the
+# format of the text log, ordered by time.
+#
+# Usage: binlog_decode.py [dump file, seastar.binlog by default]
+
+import datetime
+import struct
+import sys
+
+MAGIC = b'SSBLOG01'
+WRAP_MARKER = 0xffffffff
+HEADER = struct.Struct('=IIIBBHQ')
+LEVELS = ['ERROR', 'WARN ', 'INFO ', 'DEBUG', 'TRACE']
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def at_end(self):
+        return self.pos >= len(self.data)
+
+    def take(self, n):
+        if self.pos + n > len(self.data):
+            raise EOFError('truncated dump')
+        b = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return b
+
+    def unpack(self, fmt):
+        s = struct.Struct(fmt)
+        return s.unpack(self.take(s.size))
+
+
+def decode_args(r, nargs):
+    args = []
+    for _ in range(nargs):
+        tag = r.take(1)
+        if tag == b'i':
+            args.append(str(r.unpack('=q')[0]))
+        elif tag == b'u':
+            args.append(str(r.unpack('=Q')[0]))
+        elif tag == b'f':
+            args.append('{:g}'.format(r.unpack('=d')[0]))
+        elif tag == b's':
+            n, = r.unpack('=I')
+            args.append(r.take(n).decode('utf-8', 'replace'))
+        else:
+            raise ValueError('unknown argument tag {!r}'.format(tag))
+    return args
+
+
+def format_message(fmt, args):
+    out = []
+    parts = fmt.split('{}')
+    for i, part in enumerate(parts):
+        out.append(part)
+        if i < len(parts) - 1:
+            out.append(args[i] if i < len(args) else '???')
+    return ''.join(out)
+
+
+def decode_chunk(chunk, shard, strings):
+    r = Reader(chunk)
+    while not r.at_end():
+        # A wrap marker may leave less room than a header
+        if struct.unpack_from('=I', chunk, r.pos)[0] == WRAP_MARKER:
+            return
+        size, fmt, logger, level, nargs, _, timestamp = HEADER.unpack(r.take(HEADER.size))
+        args = decode_args(Reader(r.take(size)), nargs)
+        r.take(-(HEADER.size + size) % 8)
+        yield timestamp, shard, level, strings[logger], format_message(strings[fmt], args)
+
+
+def decode(data):
+    r = Reader(data)
+    if r.take(len(MAGIC)) != MAGIC:
+        raise ValueError('not a binary log dump')
+    while not r.at_end():
+        shard, nstrings = r.unpack('=iI')
+        strings = []
+        for _ in range(nstrings):
+            n, = r.unpack('=I')
+            strings.append(r.take(n).decode('utf-8', 'replace'))
+        for _ in range(2):
+            n, = r.unpack('=Q')
+            yield from decode_chunk(r.take(n), shard, strings)
+
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else 'seastar.binlog'
+    with open(path, 'rb') as f:
+        records = sorted(decode(f.read()), key=lambda rec: rec[0])
+    for timestamp, shard, level, logger, msg in records:
+        t = datetime.datetime.fromtimestamp(timestamp / 1e9)
+        where = ' [shard {}]'.format(shard) if shard >= 0 else ''
+        print('{} {},{:03d}{} {} - {}'.format(LEVELS[level], t.strftime('%Y-%m-%d %H:%M:%S'),
+                                              t.microsecond // 1000, where, logger, msg))
+
+
+if __name__ == '__main__':
+    main()
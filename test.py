@@ -27,11 +27,16 @@ boost_tests = [
     'alloc_test',
     'futures_test',
     'thread_test',
+    'alien_test',
+    'replicated_test',
+    'shard_channel_test',
+    'object_pool_test',
     'memcached/test_ascii_parser',
     'sstring_test',
     'unwind_test',
     'defer_test',
     'output_stream_test',
+    'input_stream_test',
     'httpd',
     'fstream_test',
     'foreign_ptr_test',
@@ -41,10 +46,15 @@ boost_tests = [
     'weak_ptr_test',
     'fileiotest',
     'packet_test',
+    'tcp_option_test',
+    'tcp_congestion_test',
+    'connection_table_test',
+    'small_circular_buffer_test',
     'tls_test',
     'rpc_test',
     'connect_test',
     'json_formatter_test',
+    'log_region_test',
 ]
 
 other_tests = [
@@ -0,0 +1,74 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/alien.hh"
+#include "core/do_with.hh"
+#include "core/sleep.hh"
+#include "tests/test-utils.hh"
+#include <thread>
+
+using namespace seastar;
+using namespace std::chrono_literals;
+
+SEASTAR_TEST_CASE(test_submit_from_foreign_thread) {
+    return do_with(promise<long>(), std::thread(), [] (promise<long>& done, std::thread& t) {
+        auto shard = engine().cpu_id();
+        t = std::thread([&done, shard] {
+            // More than the queue holds, so that pushes have to wait.
+            std::vector<std::future<int>> results;
+            for (int i = 0; i < 3000; ++i) {
+                results.push_back(alien::submit_to(shard, [i] { return i; }));
+            }
+            long sum = 0;
+            for (auto&& f : results) {
+                sum += f.get();
+            }
+            alien::submit_to(shard, [] { return sleep(1ms); }).get();
+            alien::run_on(shard, [&done, sum] { done.set_value(sum); });
+        });
+        return done.get_future().then([&t] (long sum) {
+            t.join();
+            BOOST_REQUIRE_EQUAL(sum, 3000L * 2999 / 2);
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_foreign_thread_sees_exceptions) {
+    return do_with(promise<bool>(), std::thread(), [] (promise<bool>& done, std::thread& t) {
+        auto shard = engine().cpu_id();
+        t = std::thread([&done, shard] {
+            auto f = alien::submit_to(shard, [] {
+                return make_exception_future<int>(std::runtime_error("expected"));
+            });
+            bool thrown = false;
+            try {
+                f.get();
+            } catch (std::runtime_error&) {
+                thrown = true;
+            }
+            alien::run_on(shard, [&done, thrown] { done.set_value(thrown); });
+        });
+        return done.get_future().then([&t] (bool thrown) {
+            t.join();
+            BOOST_REQUIRE(thrown);
+        });
+    });
+}
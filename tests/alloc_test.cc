@@ -23,6 +23,7 @@
 #include "core/memory.hh"
 #include "core/reactor.hh"
 #include <vector>
+#include <sstream>
 
 
 
@@ -61,3 +62,104 @@ SEASTAR_TEST_CASE(test_live_objects_counter_with_cross_cpu_free) {
         BOOST_REQUIRE(memory::stats().live_objects() < std::numeric_limits<size_t>::max() / 2);
     });
 }
+
+SEASTAR_TEST_CASE(test_small_pool_stats) {
+#ifndef DEFAULT_ALLOCATOR
+    unsigned idx = 0;
+    while (memory::small_pool_stats(idx).object_size < 1000) {
+        ++idx;
+    }
+    auto before = memory::small_pool_stats(idx).use_count;
+    auto objs = std::vector<std::unique_ptr<char[]>>(1000);
+    for (auto& o : objs) {
+        o.reset(new char[memory::small_pool_stats(idx).object_size - 16]);
+    }
+    auto s = memory::small_pool_stats(idx);
+    BOOST_REQUIRE_GE(s.use_count, before + objs.size());
+    BOOST_REQUIRE_GE(s.memory(), objs.size() * s.object_size);
+    objs.clear();
+    BOOST_REQUIRE_LE(memory::small_pool_stats(idx).use_count, before);
+    std::ostringstream os;
+    memory::dump_statistics(os);
+    BOOST_REQUIRE(os.str().find("free spans") != std::string::npos);
+#endif
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_sampled_heap_profile) {
+    memory::set_heap_profiling_sample_interval(64 * 1024);
+    BOOST_REQUIRE_EQUAL(memory::heap_profiling_sample_interval(), 64 * 1024);
+    memory::set_heap_profiling_enabled(true);
+    auto objs = std::vector<std::unique_ptr<char[]>>(10000);
+    for (auto& o : objs) {
+        o.reset(new char[1000]);
+    }
+    memory::set_heap_profiling_enabled(false);
+    auto profile = memory::get_heap_profile();
+#ifdef SEASTAR_HEAPPROF
+    // ~10MB allocated: about 150 samples expected, all of them live.
+    size_t live = 0;
+    for (auto&& s : profile) {
+        live += s.live_count;
+    }
+    BOOST_REQUIRE_GT(live, 50u);
+    BOOST_REQUIRE_LT(live, 500u);
+#endif
+    memory::set_heap_profiling_sample_interval(0);
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_cross_cpu_frees_are_batched) {
+    return smp::submit_to(1, [] {
+        auto ret = std::vector<std::unique_ptr<int>>(10000);
+        for (auto& o : ret) {
+            o = std::make_unique<int>(0);
+        }
+        return ret;
+    }).then([] (auto&& vec) {
+        auto before = memory::stats();
+        vec.clear();
+        memory::flush_cross_cpu_frees();
+        auto after = memory::stats();
+        auto frees = after.cross_cpu_frees() - before.cross_cpu_frees();
+        auto flushes = after.cross_cpu_free_flushes() - before.cross_cpu_free_flushes();
+#ifndef DEFAULT_ALLOCATOR
+        BOOST_REQUIRE_GE(frees, 10000u);
+        BOOST_REQUIRE_LT(flushes, frees / 10);
+#endif
+    });
+}
+
+SEASTAR_TEST_CASE(test_reclaimer_priorities) {
+#ifndef DEFAULT_ALLOCATOR
+    std::vector<std::unique_ptr<char[]>> ballast;
+    for (int i = 0; i < 64; ++i) {
+        ballast.emplace_back(new char[1 << 20]);
+    }
+    memory::reclaimer first([&] {
+        if (ballast.empty()) {
+            return memory::reclaiming_result::reclaimed_nothing;
+        }
+        ballast.clear();
+        return memory::reclaiming_result::reclaimed_something;
+    }, memory::reclaimer_scope::sync, 0);
+    memory::reclaimer last([] {
+        return memory::reclaiming_result::reclaimed_nothing;
+    }, memory::reclaimer_scope::sync, 1);
+    std::vector<std::unique_ptr<char[]>> hog;
+    while (!first.calls()) {
+        hog.emplace_back(new char[1 << 20]);
+    }
+    BOOST_REQUIRE_EQUAL(first.successes(), 1u);
+    BOOST_REQUIRE_EQUAL(last.calls(), 0u);
+    // Once the low priority reclaimer has nothing left, the next one is asked.
+    try {
+        while (!last.calls()) {
+            hog.emplace_back(new char[1 << 20]);
+        }
+    } catch (std::bad_alloc&) {
+    }
+    BOOST_REQUIRE_GT(last.calls(), 0u);
+#endif
+    return make_ready_future<>();
+}
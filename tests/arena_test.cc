@@ -0,0 +1,91 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "core/arena.hh"
+#include "core/circular_buffer.hh"
+#include <vector>
+#include <map>
+#include <string>
+
+BOOST_AUTO_TEST_CASE(test_arena_allocate) {
+    arena a(64);
+    std::vector<char*> ptrs;
+    for (size_t i = 1; i < 1000; ++i) {
+        auto p = static_cast<char*>(a.allocate(i, 16));
+        BOOST_REQUIRE_EQUAL(reinterpret_cast<uintptr_t>(p) % 16, 0u);
+        std::fill(p, p + i, char(i));
+        ptrs.push_back(p);
+    }
+    for (size_t i = 1; i < 1000; ++i) {
+        BOOST_REQUIRE(std::all_of(ptrs[i - 1], ptrs[i - 1] + i, [i] (char c) { return c == char(i); }));
+    }
+    BOOST_REQUIRE_EQUAL(a.allocated_bytes(), 999u * 1000 / 2);
+    a.reset();
+    BOOST_REQUIRE_EQUAL(a.allocated_bytes(), 0u);
+    a.allocate(1 << 21);
+}
+
+BOOST_AUTO_TEST_CASE(test_arena_make_runs_destructors) {
+    int destroyed = 0;
+    struct counted {
+        int& n;
+        explicit counted(int& n) : n(n) {}
+        ~counted() { ++n; }
+    };
+    {
+        arena a;
+        for (int i = 0; i < 10; ++i) {
+            a.make<counted>(destroyed);
+        }
+        auto s = a.make<std::string>(100, 'x');
+        BOOST_REQUIRE_EQUAL(*s, std::string(100, 'x'));
+        a.reset();
+        BOOST_REQUIRE_EQUAL(destroyed, 10);
+        a.make<counted>(destroyed);
+    }
+    BOOST_REQUIRE_EQUAL(destroyed, 11);
+}
+
+BOOST_AUTO_TEST_CASE(test_arena_allocator_containers) {
+    arena a;
+    std::vector<int, arena_allocator<int>> v{arena_allocator<int>(a)};
+    for (int i = 0; i < 1000; ++i) {
+        v.push_back(i);
+    }
+    BOOST_REQUIRE_EQUAL(v[999], 999);
+    using map_alloc = arena_allocator<std::pair<const int, int>>;
+    std::map<int, int, std::less<int>, map_alloc> m{std::less<int>(), map_alloc(a)};
+    for (int i = 0; i < 100; ++i) {
+        m[i] = i * i;
+    }
+    BOOST_REQUIRE_EQUAL(m[9], 81);
+    circular_buffer<int, arena_allocator<int>> cb{arena_allocator<int>(a)};
+    for (int i = 0; i < 100; ++i) {
+        cb.push_back(i);
+        cb.pop_front();
+        cb.push_back(i);
+    }
+    BOOST_REQUIRE_EQUAL(cb.size(), 100u);
+    BOOST_REQUIRE_EQUAL(cb.front(), 50);
+}
@@ -1,6 +1,9 @@
 #include "tests/test-utils.hh"
 
 #include "net/ip.hh"
+#include "core/distributed.hh"
+#include "core/gate.hh"
+#include <unistd.h>
 
 using namespace net;
 
@@ -40,3 +43,81 @@ SEASTAR_TEST_CASE(test_unconnected_socket_shutsdown_established_connection) {
         });
     });
 }
+
+// Every shard listens, since accepted connections are spread over them;
+// whichever gets the connection sends back what it reads from the
+// descriptor passed to it
+class fd_reader_server {
+    server_socket _socket;
+    seastar::gate _gate;
+public:
+    future<> listen(socket_address sa) {
+        _socket = engine().listen(sa, listen_options());
+        with_gate(_gate, [this] {
+            return _socket.accept().then([] (connected_socket s, socket_address) {
+                return do_with(std::move(s), [] (auto& s) {
+                    return s.receive_file_descriptors().then([&s] (std::vector<file_desc> fds) {
+                        BOOST_REQUIRE_EQUAL(fds.size(), 1);
+                        char buf[16];
+                        auto n = fds[0].read(buf, sizeof(buf));
+                        return do_with(s.output(), sstring(buf, n ? *n : 0), [] (auto& out, auto& data) {
+                            return out.write(data).then([&out] {
+                                return out.close();
+                            });
+                        });
+                    });
+                });
+            }).handle_exception([] (auto ep) {});
+        });
+        return make_ready_future<>();
+    }
+    future<> stop() {
+        _socket.abort_accept();
+        return _gate.close();
+    }
+};
+
+SEASTAR_TEST_CASE(test_unix_domain_socket_passes_descriptors) {
+    auto sa = socket_address(unix_domain_addr(std::string("\0seastar-connect-test-", 22) + std::to_string(::getpid())));
+    auto server = make_lw_shared<distributed<fd_reader_server>>();
+    return server->start().then([server, sa] {
+        return server->invoke_on_all(&fd_reader_server::listen, sa);
+    }).then([sa] {
+        return engine().net().connect(sa);
+    }).then([] (connected_socket s) {
+        int p[2];
+        BOOST_REQUIRE_EQUAL(::pipe(p), 0);
+        auto rd = file_desc::from_fd(p[0]);
+        auto wr = file_desc::from_fd(p[1]);
+        wr.write("pong", 4);
+        return do_with(std::move(s), std::move(rd), [] (auto& s, auto& rd) {
+            return s.send_file_descriptors({rd.get()}).then([&s] {
+                return do_with(s.input(), [] (auto& in) {
+                    return in.read_exactly(4).then([] (temporary_buffer<char> buf) {
+                        BOOST_REQUIRE_EQUAL(sstring(buf.get(), buf.size()), "pong");
+                    });
+                });
+            });
+        });
+    }).finally([server] {
+        return server->stop();
+    });
+}
+
+SEASTAR_TEST_CASE(test_socket_options_round_trip) {
+    auto sa = make_ipv4_address({"127.0.0.1", 10002});
+    return do_with(engine().net().listen(sa, listen_options(true)), [sa] (auto& listener) {
+        return engine().net().connect(sa).then([] (connected_socket s) {
+            net::socket_options opts;
+            opts.send_buffer_size = 65536;
+            opts.receive_buffer_size = 65536;
+            opts.notsent_lowat = 16384;
+            s.set_socket_options(opts);
+            auto got = s.get_socket_options();
+            BOOST_REQUIRE_EQUAL(*got.send_buffer_size, 65536);
+            BOOST_REQUIRE_EQUAL(*got.receive_buffer_size, 65536);
+            BOOST_REQUIRE_EQUAL(*got.notsent_lowat, 16384);
+            BOOST_REQUIRE(got.congestion_control);
+        });
+    });
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/connection_table.hh"
+#include <memory>
+#include <random>
+#include <unordered_map>
+
+using namespace net;
+
+BOOST_AUTO_TEST_CASE(test_insert_find_erase) {
+    connection_table<int, int> t;
+    BOOST_REQUIRE(t.empty());
+    BOOST_REQUIRE(t.insert(1, 10));
+    BOOST_REQUIRE(!t.insert(1, 11));
+    BOOST_REQUIRE_EQUAL(*t.find(1), 10);
+    BOOST_REQUIRE(!t.find(2));
+    BOOST_REQUIRE(t.erase(1));
+    BOOST_REQUIRE(!t.erase(1));
+    BOOST_REQUIRE(!t.find(1));
+    BOOST_REQUIRE(t.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_grows_incrementally) {
+    connection_table<unsigned, unsigned> t;
+    for (unsigned i = 0; i < 100000; ++i) {
+        BOOST_REQUIRE(t.insert(i, i * 3));
+        // Both the drained and the new array are searched meanwhile
+        BOOST_REQUIRE_EQUAL(*t.find(i / 2), i / 2 * 3);
+    }
+    BOOST_REQUIRE_EQUAL(t.size(), 100000);
+    for (unsigned i = 0; i < 100000; ++i) {
+        BOOST_REQUIRE_EQUAL(*t.find(i), i * 3);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_matches_unordered_map_under_churn) {
+    connection_table<unsigned, unsigned> t;
+    std::unordered_map<unsigned, unsigned> ref;
+    std::default_random_engine e;
+    std::uniform_int_distribution<unsigned> key(0, 20000);
+    for (unsigned i = 0; i < 500000; ++i) {
+        auto k = key(e);
+        if (e() % 2) {
+            BOOST_REQUIRE_EQUAL(t.insert(k, i), ref.emplace(k, i).second);
+        } else {
+            BOOST_REQUIRE_EQUAL(t.erase(k), bool(ref.erase(k)));
+        }
+        BOOST_REQUIRE_EQUAL(t.size(), ref.size());
+    }
+    for (auto&& x : ref) {
+        BOOST_REQUIRE_EQUAL(*t.find(x.first), x.second);
+    }
+    // Erased slots are shed by rebuilding, not accumulated forever
+    BOOST_REQUIRE(t.capacity() <= 4 * 32768);
+}
+
+BOOST_AUTO_TEST_CASE(test_erase_releases_value) {
+    connection_table<int, std::shared_ptr<int>> t;
+    auto v = std::make_shared<int>(1);
+    t.insert(1, v);
+    BOOST_REQUIRE_EQUAL(v.use_count(), 2);
+    t.erase(1);
+    BOOST_REQUIRE_EQUAL(v.use_count(), 1);
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include "tests/test-utils.hh"
+#include <chrono>
+
+using namespace seastar;
+using namespace std::chrono_literals;
+
+static void spin(std::chrono::milliseconds d) {
+    auto end = std::chrono::steady_clock::now() + d;
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+SEASTAR_TEST_CASE(test_cpu_profile) {
+    engine().set_cpu_profiling(500us);
+    return later().then([] {
+        spin(100ms);
+    }).then([] {
+        engine().set_cpu_profiling(0us);
+        auto profile = engine().get_cpu_profile();
+        // ~200 expected
+        BOOST_REQUIRE_GT(profile.size(), 50u);
+        size_t in_tasks = 0;
+        for (auto&& s : profile) {
+            BOOST_REQUIRE(!s.backtrace.empty());
+            in_tasks += bool(s.task_type);
+        }
+        BOOST_REQUIRE_GT(in_tasks, profile.size() / 2);
+    });
+}
+
+SEASTAR_TEST_CASE(test_cpu_profile_keeps_latest) {
+    engine().set_cpu_profiling(500us, 16);
+    spin(50ms);
+    engine().set_cpu_profiling(0us);
+    BOOST_REQUIRE_EQUAL(engine().get_cpu_profile().size(), 16u);
+    return make_ready_future<>();
+}
@@ -24,6 +24,7 @@
 #include "core/distributed.hh"
 #include "core/future-util.hh"
 #include "core/sleep.hh"
+#include <boost/range/irange.hpp>
 
 struct async : public seastar::async_sharded_service<async> {
     thread_local static bool deleted;
@@ -120,6 +121,39 @@ future<> test_map_reduce() {
     });
 }
 
+future<> test_map_reduce_tree() {
+    return do_with_distributed<X>([] (distributed<X>& x) {
+        return x.start().then([&x] {
+            return x.map_reduce_tree([] (X&) {
+                return std::vector<unsigned>({engine().cpu_id()});
+            }, [] (std::vector<unsigned> a, std::vector<unsigned> b) {
+                a.insert(a.end(), b.begin(), b.end());
+                return a;
+            }).then([] (std::vector<unsigned> result) {
+                // The left operand always comes from the lower shards.
+                if (result != boost::copy_range<std::vector<unsigned>>(boost::irange(0u, smp::count))) {
+                    throw std::runtime_error("map_reduce_tree failed");
+                }
+            });
+        });
+    });
+}
+
+future<> test_map_reduce_streaming() {
+    return do_with_distributed<X>([] (distributed<X>& x) {
+        return x.start().then([&x] {
+            return x.map_reduce_streaming(std::mem_fn(&X::cpu_id_squared),
+                                          0,
+                                          std::plus<int>()).then([] (int result) {
+                int n = smp::count - 1;
+                if (result != (n * (n + 1) * (2*n + 1)) / 6) {
+                    throw std::runtime_error("map_reduce_streaming failed");
+                }
+            });
+        });
+    });
+}
+
 future<> test_async() {
     return do_with_distributed<async>([] (distributed<async>& x) {
         return x.start().then([&x] {
@@ -139,6 +173,10 @@ int main(int argc, char** argv) {
             return test_constructor_argument_is_passed_to_each_core();
         }).then([] {
             return test_map_reduce();
+        }).then([] {
+            return test_map_reduce_tree();
+        }).then([] {
+            return test_map_reduce_streaming();
         }).then([] {
             return test_async();
         });
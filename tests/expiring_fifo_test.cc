@@ -74,116 +74,177 @@ SEASTAR_TEST_CASE(test_no_expiry_operations) {
     return make_ready_future<>();
 }
 
-SEASTAR_TEST_CASE(test_expiry_operations) {
-    return seastar::async([] {
-        std::vector<int> expired;
-        struct my_expiry {
-            std::vector<int>& e;
-            void operator()(int& v) { e.push_back(v); }
-        };
+struct my_expiry {
+    std::vector<int>& e;
+    void operator()(int& v) { e.push_back(v); }
+};
 
-        expiring_fifo<int, my_expiry, manual_clock> fifo(my_expiry{expired});
+template <expiry_timers Timers>
+static void test_expiry_operations() {
+    std::vector<int> expired;
+    expiring_fifo<int, my_expiry, manual_clock, Timers> fifo(my_expiry{expired});
 
-        fifo.push_back(1, manual_clock::now() + 1s);
+    fifo.push_back(1, manual_clock::now() + 1s);
 
-        BOOST_REQUIRE(!fifo.empty());
-        BOOST_REQUIRE_EQUAL(fifo.size(), 1);
-        BOOST_REQUIRE(bool(fifo));
-        BOOST_REQUIRE_EQUAL(fifo.front(), 1);
+    BOOST_REQUIRE(!fifo.empty());
+    BOOST_REQUIRE_EQUAL(fifo.size(), 1);
+    BOOST_REQUIRE(bool(fifo));
+    BOOST_REQUIRE_EQUAL(fifo.front(), 1);
 
-        manual_clock::advance(1s);
-        later().get();
+    manual_clock::advance(1s);
+    later().get();
 
-        BOOST_REQUIRE(fifo.empty());
-        BOOST_REQUIRE_EQUAL(fifo.size(), 0);
-        BOOST_REQUIRE(!bool(fifo));
-        BOOST_REQUIRE_EQUAL(expired.size(), 1);
-        BOOST_REQUIRE_EQUAL(expired[0], 1);
+    BOOST_REQUIRE(fifo.empty());
+    BOOST_REQUIRE_EQUAL(fifo.size(), 0);
+    BOOST_REQUIRE(!bool(fifo));
+    BOOST_REQUIRE_EQUAL(expired.size(), 1);
+    BOOST_REQUIRE_EQUAL(expired[0], 1);
 
-        expired.clear();
+    expired.clear();
+
+    fifo.push_back(1);
+    fifo.push_back(2, manual_clock::now() + 1s);
+    fifo.push_back(3);
+
+    manual_clock::advance(1s);
+    later().get();
+
+    BOOST_REQUIRE(!fifo.empty());
+    BOOST_REQUIRE_EQUAL(fifo.size(), 2);
+    BOOST_REQUIRE(bool(fifo));
+    BOOST_REQUIRE_EQUAL(expired.size(), 1);
+    BOOST_REQUIRE_EQUAL(expired[0], 2);
+    BOOST_REQUIRE_EQUAL(fifo.front(), 1);
+    fifo.pop_front();
+    BOOST_REQUIRE_EQUAL(fifo.size(), 1);
+    BOOST_REQUIRE_EQUAL(fifo.front(), 3);
+    fifo.pop_front();
+    BOOST_REQUIRE_EQUAL(fifo.size(), 0);
+
+    expired.clear();
+
+    fifo.push_back(1, manual_clock::now() + 1s);
+    fifo.push_back(2, manual_clock::now() + 1s);
+    fifo.push_back(3);
+    fifo.push_back(4, manual_clock::now() + 2s);
+
+    manual_clock::advance(1s);
+    later().get();
+
+    BOOST_REQUIRE(!fifo.empty());
+    BOOST_REQUIRE_EQUAL(fifo.size(), 2);
+    BOOST_REQUIRE(bool(fifo));
+    BOOST_REQUIRE_EQUAL(expired.size(), 2);
+    std::sort(expired.begin(), expired.end());
+    BOOST_REQUIRE_EQUAL(expired[0], 1);
+    BOOST_REQUIRE_EQUAL(expired[1], 2);
+    BOOST_REQUIRE_EQUAL(fifo.front(), 3);
+    fifo.pop_front();
+    BOOST_REQUIRE_EQUAL(fifo.size(), 1);
+    BOOST_REQUIRE_EQUAL(fifo.front(), 4);
+    fifo.pop_front();
+    BOOST_REQUIRE_EQUAL(fifo.size(), 0);
+
+    expired.clear();
+
+    fifo.push_back(1);
+    fifo.push_back(2, manual_clock::now() + 1s);
+    fifo.push_back(3, manual_clock::now() + 1s);
+    fifo.push_back(4, manual_clock::now() + 1s);
+
+    manual_clock::advance(1s);
+    later().get();
+
+    BOOST_REQUIRE(!fifo.empty());
+    BOOST_REQUIRE_EQUAL(fifo.size(), 1);
+    BOOST_REQUIRE(bool(fifo));
+    BOOST_REQUIRE_EQUAL(expired.size(), 3);
+    std::sort(expired.begin(), expired.end());
+    BOOST_REQUIRE_EQUAL(expired[0], 2);
+    BOOST_REQUIRE_EQUAL(expired[1], 3);
+    BOOST_REQUIRE_EQUAL(expired[2], 4);
+    BOOST_REQUIRE_EQUAL(fifo.front(), 1);
+    fifo.pop_front();
+    BOOST_REQUIRE_EQUAL(fifo.size(), 0);
+
+    expired.clear();
+
+    fifo.push_back(1);
+    fifo.push_back(2, manual_clock::now() + 1s);
+    fifo.push_back(3, manual_clock::now() + 1s);
+    fifo.push_back(4, manual_clock::now() + 1s);
+    fifo.push_back(5);
+
+    manual_clock::advance(1s);
+    later().get();
+
+    BOOST_REQUIRE_EQUAL(fifo.size(), 2);
+    BOOST_REQUIRE_EQUAL(fifo.front(), 1);
+    fifo.pop_front();
+    BOOST_REQUIRE_EQUAL(fifo.size(), 1);
+    BOOST_REQUIRE_EQUAL(fifo.front(), 5);
+    fifo.pop_front();
+    BOOST_REQUIRE_EQUAL(fifo.size(), 0);
+}
+
+SEASTAR_TEST_CASE(test_expiry_operations_per_element) {
+    return seastar::async([] {
+        test_expiry_operations<expiry_timers::per_element>();
+    });
+}
 
-        fifo.push_back(1);
+SEASTAR_TEST_CASE(test_expiry_operations_shared) {
+    return seastar::async([] {
+        test_expiry_operations<expiry_timers::shared>();
+    });
+}
+
+SEASTAR_TEST_CASE(test_shared_timer_out_of_order) {
+    return seastar::async([] {
+        std::vector<int> expired;
+        expiring_fifo<int, my_expiry, manual_clock, expiry_timers::shared> fifo(my_expiry{expired});
+
+        // A later deadline in front of an earlier one
+        fifo.push_back(1, manual_clock::now() + 3s);
         fifo.push_back(2, manual_clock::now() + 1s);
-        fifo.push_back(3);
+        fifo.push_back(3, manual_clock::now() + 2s);
+        fifo.push_back(4);
 
         manual_clock::advance(1s);
         later().get();
-
-        BOOST_REQUIRE(!fifo.empty());
-        BOOST_REQUIRE_EQUAL(fifo.size(), 2);
-        BOOST_REQUIRE(bool(fifo));
         BOOST_REQUIRE_EQUAL(expired.size(), 1);
         BOOST_REQUIRE_EQUAL(expired[0], 2);
+        BOOST_REQUIRE_EQUAL(fifo.size(), 3);
         BOOST_REQUIRE_EQUAL(fifo.front(), 1);
-        fifo.pop_front();
-        BOOST_REQUIRE_EQUAL(fifo.size(), 1);
-        BOOST_REQUIRE_EQUAL(fifo.front(), 3);
-        fifo.pop_front();
-        BOOST_REQUIRE_EQUAL(fifo.size(), 0);
-
-        expired.clear();
-
-        fifo.push_back(1, manual_clock::now() + 1s);
-        fifo.push_back(2, manual_clock::now() + 1s);
-        fifo.push_back(3);
-        fifo.push_back(4, manual_clock::now() + 2s);
 
         manual_clock::advance(1s);
         later().get();
-
-        BOOST_REQUIRE(!fifo.empty());
-        BOOST_REQUIRE_EQUAL(fifo.size(), 2);
-        BOOST_REQUIRE(bool(fifo));
         BOOST_REQUIRE_EQUAL(expired.size(), 2);
-        std::sort(expired.begin(), expired.end());
-        BOOST_REQUIRE_EQUAL(expired[0], 1);
-        BOOST_REQUIRE_EQUAL(expired[1], 2);
-        BOOST_REQUIRE_EQUAL(fifo.front(), 3);
+        BOOST_REQUIRE_EQUAL(expired[1], 3);
+
+        // Popped before its deadline; the timer finds nothing to expire
         fifo.pop_front();
-        BOOST_REQUIRE_EQUAL(fifo.size(), 1);
         BOOST_REQUIRE_EQUAL(fifo.front(), 4);
-        fifo.pop_front();
-        BOOST_REQUIRE_EQUAL(fifo.size(), 0);
-
-        expired.clear();
-
-        fifo.push_back(1);
-        fifo.push_back(2, manual_clock::now() + 1s);
-        fifo.push_back(3, manual_clock::now() + 1s);
-        fifo.push_back(4, manual_clock::now() + 1s);
-
         manual_clock::advance(1s);
         later().get();
-
-        BOOST_REQUIRE(!fifo.empty());
+        BOOST_REQUIRE_EQUAL(expired.size(), 2);
         BOOST_REQUIRE_EQUAL(fifo.size(), 1);
-        BOOST_REQUIRE(bool(fifo));
-        BOOST_REQUIRE_EQUAL(expired.size(), 3);
-        std::sort(expired.begin(), expired.end());
-        BOOST_REQUIRE_EQUAL(expired[0], 2);
-        BOOST_REQUIRE_EQUAL(expired[1], 3);
-        BOOST_REQUIRE_EQUAL(expired[2], 4);
-        BOOST_REQUIRE_EQUAL(fifo.front(), 1);
         fifo.pop_front();
-        BOOST_REQUIRE_EQUAL(fifo.size(), 0);
+        BOOST_REQUIRE(fifo.empty());
 
+        // Once empty, deadlines pushed in order are again expired from
+        // the front, a run at a time
         expired.clear();
-
-        fifo.push_back(1);
-        fifo.push_back(2, manual_clock::now() + 1s);
-        fifo.push_back(3, manual_clock::now() + 1s);
-        fifo.push_back(4, manual_clock::now() + 1s);
-        fifo.push_back(5);
-
+        for (int i = 0; i < 10; ++i) {
+            fifo.push_back(i, manual_clock::now() + std::chrono::seconds(1 + i / 5));
+        }
         manual_clock::advance(1s);
         later().get();
-
-        BOOST_REQUIRE_EQUAL(fifo.size(), 2);
-        BOOST_REQUIRE_EQUAL(fifo.front(), 1);
-        fifo.pop_front();
-        BOOST_REQUIRE_EQUAL(fifo.size(), 1);
+        BOOST_REQUIRE_EQUAL(expired.size(), 5);
         BOOST_REQUIRE_EQUAL(fifo.front(), 5);
-        fifo.pop_front();
-        BOOST_REQUIRE_EQUAL(fifo.size(), 0);
+        manual_clock::advance(1s);
+        later().get();
+        BOOST_REQUIRE_EQUAL(expired.size(), 10);
+        BOOST_REQUIRE(fifo.empty());
     });
 }
@@ -48,7 +48,7 @@ struct test_env {
         classes.push_back(fq.register_priority_class(shares));
         return classes.size() - 1;
     }
-    void do_op(unsigned index, unsigned weight)  {
+    void do_op(unsigned index, float weight)  {
         auto cl = classes[index];
         auto f = fq.queue(cl, weight, [this, index] {
             results[index]++;
@@ -328,3 +328,80 @@ SEASTAR_TEST_CASE(test_fair_queue_random_run) {
        return env->verify(sprint("random_run (%d msec)", reqs / 10), {1, 1}, expected_error);
     }).then([env] {});
 }
+
+// Requests of class b are charged half the device time of class a's.
+// Expected class b to have 2 x more requests.
+SEASTAR_TEST_CASE(test_fair_queue_fractional_weights) {
+    auto env = make_lw_shared<test_env>(1);
+
+    auto a = env->register_priority_class(10);
+    auto b = env->register_priority_class(10);
+
+    for (int i = 0; i < 100; ++i) {
+        env->do_op(a, 1);
+        env->do_op(b, 0.5);
+        env->do_op(b, 0.5);
+    }
+    return sleep(10ms).then([env] {
+        return env->verify("fractional_weights", {1, 2});
+    }).then([env] {});
+}
+
+// Raising and lowering the capacity changes how many requests run at once.
+SEASTAR_TEST_CASE(test_fair_queue_set_capacity) {
+    struct state {
+        fair_queue fq{1};
+        priority_class_ptr pc = fq.register_priority_class(1);
+        unsigned running = 0;
+        unsigned max_running = 0;
+        future<> run(unsigned nr) {
+            max_running = 0;
+            return parallel_for_each(boost::irange(0u, nr), [this] (unsigned) {
+                return fq.queue(pc, 1, [this] {
+                    max_running = std::max(max_running, ++running);
+                    return sleep(1ms).then([this] {
+                        --running;
+                    });
+                });
+            });
+        }
+    };
+    auto s = make_lw_shared<state>();
+    s->fq.set_capacity(4);
+    return s->run(16).then([s] {
+        BOOST_REQUIRE_EQUAL(s->max_running, 4u);
+        s->fq.set_capacity(2);
+        return s->run(16);
+    }).then([s] {
+        BOOST_REQUIRE_EQUAL(s->max_running, 2u);
+        s->fq.unregister_priority_class(s->pc);
+    });
+}
+
+// A capped class does not exceed its bandwidth even when the queue is idle.
+SEASTAR_TEST_CASE(test_fair_queue_bandwidth_cap) {
+    struct state {
+        fair_queue fq{4};
+        priority_class_ptr pc = fq.register_priority_class(1);
+        unsigned done = 0;
+        std::vector<future<>> inflight;
+    };
+    auto s = make_lw_shared<state>();
+    // 1MB/s, 10kB per request: about 10 requests per 100ms.
+    s->fq.set_limits(s->pc, 1000000, std::chrono::microseconds(0));
+    for (int i = 0; i < 100; ++i) {
+        s->inflight.push_back(s->fq.queue(s->pc, 1, 10000, [s] {
+            s->done++;
+        }));
+    }
+    return sleep(100ms).then([s] {
+        std::cout << "bandwidth_cap: " << s->done << " requests in 100ms" << std::endl;
+        BOOST_REQUIRE(s->done >= 5);
+        BOOST_REQUIRE(s->done <= 20);
+        s->fq.set_limits(s->pc, 0, std::chrono::microseconds(0));
+        return when_all(s->inflight.begin(), s->inflight.end()).discard_result();
+    }).then([s] {
+        BOOST_REQUIRE_EQUAL(s->done, 100u);
+        s->fq.unregister_priority_class(s->pc);
+    });
+}
@@ -23,7 +23,14 @@
 
 #include "core/semaphore.hh"
 #include "core/file.hh"
+#include "core/cached-file.hh"
+#include "core/append-file.hh"
+#include "core/mapped-file.hh"
 #include "core/reactor.hh"
+#include "core/seastar.hh"
+#include "core/thread.hh"
+#include "core/print.hh"
+#include <map>
 
 struct file_test {
     file_test(file&& f) : f(std::move(f)) {}
@@ -69,3 +76,165 @@ SEASTAR_TEST_CASE(test1) {
 }
 
 
+
+SEASTAR_TEST_CASE(test_dma_read_bulk_ranges) {
+    // Writes 16 pages, each filled with its index, then reads unaligned,
+    // overlapping and out-of-order ranges, plus one past EOF.
+    static constexpr size_t pages = 16;
+    return open_file_dma("testfile_ranges.tmp", open_flags::rw | open_flags::create | open_flags::truncate).then([] (file f) {
+        auto wbuf = allocate_aligned_buffer<unsigned char>(4096 * pages, 4096);
+        for (size_t i = 0; i < pages; ++i) {
+            std::fill(wbuf.get() + i * 4096, wbuf.get() + (i + 1) * 4096, i);
+        }
+        auto wb = wbuf.get();
+        return f.dma_write(0, wb, 4096 * pages).then([f, wbuf = std::move(wbuf)] (size_t ret) mutable {
+            BOOST_REQUIRE_EQUAL(ret, 4096 * pages);
+            std::vector<file::read_range> ranges = {
+                { 5 * 4096 + 100, 200 },
+                { 1 * 4096 + 4000, 200 },
+                { 5 * 4096 + 4000, 4096 + 200 },
+                { 12 * 4096, 4096 },
+                { pages * 4096 + 10, 100 },
+            };
+            return f.dma_read_bulk_ranges<unsigned char>(ranges).then([ranges] (std::vector<temporary_buffer<unsigned char>> bufs) {
+                BOOST_REQUIRE_EQUAL(bufs.size(), ranges.size());
+                for (size_t r = 0; r < ranges.size() - 1; ++r) {
+                    BOOST_REQUIRE_EQUAL(bufs[r].size(), ranges[r].size);
+                    for (size_t i = 0; i < bufs[r].size(); ++i) {
+                        BOOST_REQUIRE_EQUAL(bufs[r][i], (ranges[r].offset + i) / 4096);
+                    }
+                }
+                BOOST_REQUIRE_EQUAL(bufs.back().size(), 0u);
+            }).finally([f] () mutable {
+                return f.close();
+            });
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_cached_file) {
+    static constexpr size_t pages = 4;
+    return open_file_dma("testfile_cached.tmp", open_flags::rw | open_flags::create | open_flags::truncate).then([] (file uf) {
+        auto f = make_cached_file(uf);
+        auto wbuf = allocate_aligned_buffer<unsigned char>(4096 * pages, 4096);
+        for (size_t i = 0; i < pages; ++i) {
+            std::fill(wbuf.get() + i * 4096, wbuf.get() + (i + 1) * 4096, i);
+        }
+        auto wb = wbuf.get();
+        return f.dma_write(0, wb, 4096 * pages).then([f, wbuf = std::move(wbuf)] (size_t ret) mutable {
+            BOOST_REQUIRE_EQUAL(ret, 4096 * pages);
+            auto& cache = block_cache::local();
+            auto hits = cache.hits();
+            auto misses = cache.misses();
+            return f.dma_read<unsigned char>(4096, 4096).then([f, &cache, hits, misses] (temporary_buffer<unsigned char> buf) mutable {
+                BOOST_REQUIRE_EQUAL(buf.size(), 4096u);
+                BOOST_REQUIRE(std::all_of(buf.begin(), buf.end(), [] (unsigned char c) { return c == 1; }));
+                BOOST_REQUIRE_EQUAL(cache.misses(), misses + 1);
+                return f.dma_read<unsigned char>(4096 + 512, 512);
+            }).then([f, &cache, hits] (temporary_buffer<unsigned char> buf) mutable {
+                BOOST_REQUIRE_EQUAL(buf.size(), 512u);
+                BOOST_REQUIRE(std::all_of(buf.begin(), buf.end(), [] (unsigned char c) { return c == 1; }));
+                BOOST_REQUIRE_EQUAL(cache.hits(), hits + 1);
+                // A write through the cached file must not leave stale blocks.
+                auto wbuf = allocate_aligned_buffer<unsigned char>(4096, 4096);
+                std::fill(wbuf.get(), wbuf.get() + 4096, 7);
+                auto wb = wbuf.get();
+                return f.dma_write(4096, wb, 4096).then([f, wbuf = std::move(wbuf)] (size_t ret) mutable {
+                    BOOST_REQUIRE_EQUAL(ret, 4096u);
+                    return f.dma_read<unsigned char>(4096, 4096);
+                });
+            }).then([] (temporary_buffer<unsigned char> buf) {
+                BOOST_REQUIRE_EQUAL(buf.size(), 4096u);
+                BOOST_REQUIRE(std::all_of(buf.begin(), buf.end(), [] (unsigned char c) { return c == 7; }));
+            }).finally([f] () mutable {
+                return f.close();
+            });
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_open_files_and_list_directory_stat) {
+    return seastar::async([] {
+        touch_directory("testdir_stat.tmp").get();
+        std::vector<sstring> names;
+        for (int i = 0; i < 100; ++i) {
+            names.push_back(sprint("testdir_stat.tmp/f%d", i));
+        }
+        auto files = open_files_dma(names, open_flags::rw | open_flags::create | open_flags::truncate).get0();
+        BOOST_REQUIRE_EQUAL(files.size(), names.size());
+        auto buf = allocate_aligned_buffer<unsigned char>(4096, 4096);
+        files[7].dma_write(0, buf.get(), 4096).get();
+        for (auto&& f : files) {
+            f.close().get();
+        }
+
+        auto dir = open_directory("testdir_stat.tmp").get0();
+        std::map<sstring, directory_entry_stat> seen;
+        dir.list_directory_stat([&seen] (directory_entry_stat de) {
+            seen.emplace(de.name, de);
+            return make_ready_future<>();
+        }).done().get();
+        dir.close().get();
+        BOOST_REQUIRE_GE(seen.size(), names.size());
+        auto& e = seen.at("f7");
+        BOOST_REQUIRE_EQUAL(e.stat_error, 0);
+        BOOST_REQUIRE_EQUAL(e.st.st_size, 4096);
+        for (auto&& name : names) {
+            remove_file(name).get();
+        }
+
+        BOOST_REQUIRE_THROW(open_files_dma({"testdir_stat.tmp/missing"}, open_flags::ro).get(), std::system_error);
+    });
+}
+
+SEASTAR_TEST_CASE(test_append_file) {
+    return seastar::async([] {
+        auto f = open_file_dma("testfile_append.tmp", open_flags::rw | open_flags::create | open_flags::truncate).get0();
+        append_file_options opts;
+        opts.buffer_size = 8192;
+        opts.write_behind = 3;
+        opts.preallocation_size = 64 * 1024;
+        auto af = std::make_unique<append_file>(f, opts);
+        std::vector<char> expected;
+        for (int i = 0; i < 1000; ++i) {
+            auto chunk = sprint("record %d;", i);
+            af->append(chunk.c_str(), chunk.size()).get();
+            expected.insert(expected.end(), chunk.begin(), chunk.end());
+            if (i % 300 == 0) {
+                af->flush().get();
+            }
+        }
+        BOOST_REQUIRE_EQUAL(af->size(), expected.size());
+        af->close().get();
+
+        auto rf = open_file_dma("testfile_append.tmp", open_flags::ro).get0();
+        BOOST_REQUIRE_EQUAL(rf.size().get0(), expected.size());
+        auto buf = rf.dma_read<char>(0, expected.size()).get0();
+        BOOST_REQUIRE(std::equal(expected.begin(), expected.end(), buf.get()));
+        rf.close().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_mapped_file) {
+    return seastar::async([] {
+        static constexpr size_t pages = 8;
+        auto f = open_file_dma("testfile_mapped.tmp", open_flags::rw | open_flags::create | open_flags::truncate).get0();
+        auto wbuf = allocate_aligned_buffer<unsigned char>(4096 * pages, 4096);
+        for (size_t i = 0; i < pages; ++i) {
+            std::fill(wbuf.get() + i * 4096, wbuf.get() + (i + 1) * 4096, i);
+        }
+        f.dma_write(0, wbuf.get(), 4096 * pages).get();
+        f.close().get();
+
+        auto m = mapped_file::open("testfile_mapped.tmp").get0();
+        BOOST_REQUIRE_EQUAL(m.size(), 4096 * pages);
+        m.prefetch(4096, 3 * 4096).get();
+        temporary_buffer<char> buf = m.share(3 * 4096 + 10, 100);
+        // The buffer keeps the mapping alive on its own.
+        m = mapped_file();
+        BOOST_REQUIRE_EQUAL(buf.size(), 100u);
+        BOOST_REQUIRE(std::all_of(buf.begin(), buf.end(), [] (char c) { return c == 3; }));
+
+        BOOST_REQUIRE_THROW(mapped_file::open("testfile_mapped_missing.tmp").get(), std::system_error);
+    });
+}
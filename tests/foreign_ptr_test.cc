@@ -23,6 +23,7 @@
 
 #include "core/distributed.hh"
 #include "core/shared_ptr.hh"
+#include "core/future-util.hh"
 
 SEASTAR_TEST_CASE(make_foreign_ptr_from_lw_shared_ptr) {
     auto p = make_foreign(make_lw_shared<sstring>("foo"));
@@ -35,3 +36,35 @@ SEASTAR_TEST_CASE(make_foreign_ptr_from_shared_ptr) {
     BOOST_REQUIRE(p->size() == 3);
     return make_ready_future<>();
 }
+
+// Counts the objects destroyed on the shard that made them
+struct owned {
+    static thread_local unsigned destroyed_at_home;
+    unsigned home = engine().cpu_id();
+    ~owned() {
+        if (engine().cpu_id() == home) {
+            ++destroyed_at_home;
+        }
+    }
+};
+
+thread_local unsigned owned::destroyed_at_home;
+
+SEASTAR_TEST_CASE(foreign_ptrs_are_destroyed_on_their_shard) {
+    if (smp::count < 2) {
+        return make_ready_future<>();
+    }
+    std::vector<foreign_ptr<std::unique_ptr<owned>>> ptrs;
+    for (int i = 0; i < 1000; ++i) {
+        ptrs.push_back(make_foreign(std::make_unique<owned>()));
+    }
+    // Released on shard 1 in one go, they go back in a batch
+    return smp::submit_to(1, [ptrs = std::move(ptrs)] () mutable {
+        ptrs.clear();
+    }).then([] {
+        // Shard 1 sends them once it polls
+        return do_until([] { return owned::destroyed_at_home == 1000; }, [] {
+            return later();
+        });
+    });
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "core/fragmented_ostream.hh"
+#include "core/simple-stream.hh"
+
+BOOST_AUTO_TEST_CASE(test_appends_span_chunks) {
+    fragmented_ostream out(8);
+    out << "hello, " << sstring("world") << ' ' << 42 << std::string("!");
+    out.write("0123456789abcdef", 16);
+    std::string expected = "hello, world 42!0123456789abcdef";
+    BOOST_REQUIRE_EQUAL(out.size(), expected.size());
+    BOOST_REQUIRE_EQUAL(std::string(out.linearize()), expected);
+    size_t fragments = 0;
+    out.for_each_fragment([&fragments] (std::experimental::string_view f) {
+        BOOST_REQUIRE_LE(f.size(), 8u);
+        ++fragments;
+    });
+    BOOST_REQUIRE_EQUAL(fragments, (expected.size() + 7) / 8);
+}
+
+BOOST_AUTO_TEST_CASE(test_release_packet_does_not_copy) {
+    fragmented_ostream out(4);
+    out.write("abcdefghij", 10);
+    std::vector<const char*> chunk_data;
+    out.for_each_fragment([&chunk_data] (std::experimental::string_view f) {
+        chunk_data.push_back(f.data());
+    });
+    auto p = std::move(out).release_packet();
+    BOOST_REQUIRE_EQUAL(p.len(), 10u);
+    BOOST_REQUIRE_EQUAL(p.nr_frags(), 3u);
+    for (unsigned i = 0; i < p.nr_frags(); ++i) {
+        BOOST_REQUIRE_EQUAL(p.fragments()[i].base, chunk_data[i]);
+    }
+    BOOST_REQUIRE_EQUAL(p.fragments()[2].size, 2u);
+    BOOST_REQUIRE(out.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_release_scattered_message) {
+    fragmented_ostream out(4);
+    out.print("%d-%s", 7, "x");
+    auto msg = std::move(out).release_scattered_message();
+    BOOST_REQUIRE_EQUAL(msg.size(), 3u);
+}
+
+BOOST_AUTO_TEST_CASE(test_serializer_output) {
+    // Anything that serializes into a simple_output_stream can write here
+    auto serialize = [] (auto& out, uint32_t v) {
+        out.write(reinterpret_cast<const char*>(&v), sizeof(v));
+    };
+    char buf[sizeof(uint32_t)];
+    seastar::simple_output_stream simple(buf, sizeof(buf));
+    serialize(simple, 0x01020304);
+    fragmented_ostream out(3);
+    serialize(out, 0x01020304);
+    BOOST_REQUIRE_EQUAL(std::string(out.linearize()), std::string(buf, sizeof(buf)));
+}
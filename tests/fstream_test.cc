@@ -251,3 +251,95 @@ SEASTAR_TEST_CASE(test_input_stream_esp_around_eof) {
         f.close().get();
     });
 }
+
+SEASTAR_TEST_CASE(test_access_tracker_sequential_and_random) {
+    return seastar::async([] {
+        auto size = uint64_t(1 << 20);
+        auto f = open_file_dma("file.tmp",
+                open_flags::rw | open_flags::create | open_flags::truncate).get0();
+        auto out = make_file_output_stream(f);
+        std::vector<char> data(size, 'x');
+        out.write(data.data(), data.size()).get();
+        out.flush().get();
+
+        auto tracker = make_lw_shared<file_access_tracker>(64 * 1024);
+        auto opt = file_input_stream_options();
+        opt.buffer_size = 4096;
+        opt.access_tracker = tracker;
+        auto in = make_file_input_stream(f, opt);
+        uint64_t read = 0;
+        while (true) {
+            auto buf = in.read().get0();
+            if (buf.empty()) {
+                break;
+            }
+            read += buf.size();
+        }
+        in.close().get();
+        BOOST_REQUIRE_EQUAL(read, size);
+        BOOST_REQUIRE(tracker->sequential());
+        BOOST_REQUIRE_LE(tracker->read_ahead_bytes(), 64 * 1024u);
+
+        // Short streams at scattered offsets make access look random and
+        // switch read-ahead off.
+        for (uint64_t pos = 0; pos < size; pos += 64 * 1024) {
+            auto in = make_file_input_stream(f, size - pos - 4096, 4096, opt);
+            in.read().get();
+            in.close().get();
+        }
+        BOOST_REQUIRE(!tracker->sequential());
+        BOOST_REQUIRE_EQUAL(tracker->read_ahead_bytes(), 0u);
+        f.close().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_flush_coalescer) {
+    return seastar::async([] {
+        auto f = open_file_dma("file.tmp",
+                open_flags::rw | open_flags::create | open_flags::truncate).get0();
+        auto coalescer = make_lw_shared<file_flush_coalescer>(f, std::chrono::microseconds(100));
+        std::vector<future<>> flushes;
+        for (int i = 0; i < 10; ++i) {
+            flushes.push_back(coalescer->flush());
+        }
+        when_all(flushes.begin(), flushes.end()).get();
+        BOOST_REQUIRE_EQUAL(coalescer->requests(), 10u);
+        BOOST_REQUIRE_EQUAL(coalescer->syncs(), 1u);
+
+        auto opt = file_output_stream_options();
+        opt.flush_coalescer = coalescer;
+        auto out = make_file_output_stream(f, opt);
+        out.write("hello").get();
+        out.flush().get();
+        BOOST_REQUIRE_EQUAL(coalescer->syncs(), 2u);
+        f.close().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_stream_checksums) {
+    return seastar::async([] {
+        auto f = open_file_dma("file.tmp",
+                open_flags::rw | open_flags::create | open_flags::truncate).get0();
+        sstring data(sstring::initialized_later(), 100000);
+        std::iota(data.begin(), data.end(), 0);
+        auto expected = seastar::crc32c(0, data.data(), data.size());
+
+        auto wopt = file_output_stream_options();
+        wopt.checksum = make_lw_shared<seastar::crc32c_checksummer>();
+        auto out = make_file_output_stream(f, wopt);
+        out.write(data).get();
+        out.flush().get();
+        BOOST_REQUIRE_EQUAL(wopt.checksum->get(), expected);
+
+        auto ropt = file_input_stream_options();
+        ropt.buffer_size = 4096;
+        ropt.read_ahead = 2;
+        ropt.checksum = make_lw_shared<seastar::crc32c_checksummer>();
+        auto in = make_file_input_stream(f, ropt);
+        auto read = in.read_exactly(data.size()).get0();
+        BOOST_REQUIRE_EQUAL(read.size(), data.size());
+        BOOST_REQUIRE_EQUAL(ropt.checksum->get(), expected);
+        in.close().get();
+        f.close().get();
+    });
+}
@@ -308,6 +308,51 @@ SEASTAR_TEST_CASE(test_map_reduce) {
     });
 }
 
+SEASTAR_TEST_CASE(test_max_concurrent_for_each) {
+    struct counts {
+        size_t in_flight = 0;
+        size_t max_in_flight = 0;
+        size_t done = 0;
+    };
+    auto c = make_lw_shared<counts>();
+    return max_concurrent_for_each(boost::irange(0, 1000), 7, [c] (int i) {
+        c->max_in_flight = std::max(++c->in_flight, c->max_in_flight);
+        return later().then([c] {
+            --c->in_flight;
+            ++c->done;
+        });
+    }).then([c] {
+        BOOST_REQUIRE_EQUAL(c->done, 1000u);
+        BOOST_REQUIRE_EQUAL(c->max_in_flight, 7u);
+    });
+}
+
+SEASTAR_TEST_CASE(test_max_concurrent_for_each_failure) {
+    auto started = make_lw_shared<int>(0);
+    return max_concurrent_for_each(boost::irange(0, 1000), 4, [started] (int i) {
+        ++*started;
+        return later().then([i] {
+            if (i == 10) {
+                throw expected_exception();
+            }
+        });
+    }).then_wrapped([started] (future<> f) {
+        BOOST_REQUIRE_THROW(f.get(), expected_exception);
+        // Nothing is started after the failure but what was in flight
+        BOOST_REQUIRE_LT(*started, 20);
+    });
+}
+
+SEASTAR_TEST_CASE(test_max_concurrent_map_reduce) {
+    auto square = [] (long x) { return later().then([x] { return x * x; }); };
+    long n = 1000;
+    return max_concurrent_map_reduce(boost::make_counting_iterator<long>(0), boost::make_counting_iterator<long>(n),
+            16, square, long(0), std::plus<long>()).then([n] (auto result) {
+        auto m = n - 1;
+        BOOST_REQUIRE_EQUAL(result, (m * (m + 1) * (2*m + 1)) / 6);
+    });
+}
+
 // This test doesn't actually test anything - it just waits for the future
 // returned by sleep to complete. However, a bug we had in sleep() caused
 // this test to fail the sanitizer in the debug build, so this is a useful
@@ -483,6 +528,21 @@ SEASTAR_TEST_CASE(test_high_priority_task_runs_in_the_middle_of_loops) {
     });
 }
 
+SEASTAR_TEST_CASE(test_scheduling_group_is_inherited_by_continuations) {
+    static auto sg = create_scheduling_group("test", 100);
+    BOOST_REQUIRE(current_scheduling_group() == default_scheduling_group());
+    return with_scheduling_group(sg, [] {
+        return later().then([] {
+            BOOST_REQUIRE(current_scheduling_group() == sg);
+            return later();
+        }).then([] {
+            BOOST_REQUIRE(current_scheduling_group() == sg);
+        });
+    }).then([] {
+        BOOST_REQUIRE(current_scheduling_group() == default_scheduling_group());
+    });
+}
+
 SEASTAR_TEST_CASE(futurize_apply_val_exception) {
     return futurize<int>::apply([] (int arg) { throw expected_exception(); return arg; }, 1).then_wrapped([] (future<int> f) {
         try {
@@ -808,3 +868,23 @@ SEASTAR_TEST_CASE(test_shared_future_with_timeout) {
         BOOST_REQUIRE_EQUAL(42, f3.get0());
     });
 }
+
+SEASTAR_TEST_CASE(test_moving_trivially_relocatable_futures) {
+    static_assert(future_state<int, long>::trivially_relocatable, "int and long are trivially copyable");
+    static_assert(!future_state<sstring>::trivially_relocatable, "sstring is not trivially copyable");
+    auto f1 = make_ready_future<int, long>(1, 2);
+    auto f2 = std::move(f1);
+    BOOST_REQUIRE(f2.available());
+    BOOST_REQUIRE(std::get<1>(f2.get()) == 2);
+    auto f3 = make_exception_future<int>(expected_exception());
+    auto f4 = std::move(f3);
+    BOOST_REQUIRE(f4.failed());
+    BOOST_REQUIRE_THROW(f4.get(), expected_exception);
+    promise<int> p;
+    auto f5 = p.get_future();
+    auto f6 = std::move(f5);
+    p.set_value(3);
+    return f6.then([] (int x) {
+        BOOST_REQUIRE_EQUAL(x, 3);
+    });
+}
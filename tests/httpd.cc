@@ -6,12 +6,23 @@
 #include "http/handlers.hh"
 #include "http/matcher.hh"
 #include "http/matchrules.hh"
+#include "http/route_tree.hh"
 #include "json/formatter.hh"
 #include "http/routes.hh"
 #include "http/exception.hh"
 #include "http/transformers.hh"
+#include "http/body_stream.hh"
+#include "http/compress.hh"
+#include "http/client.hh"
+#include "http/function_handlers.hh"
+#include "http/hpack.hh"
+#include "http/http2.hh"
+#include "http/file_handler.hh"
 #include "core/future-util.hh"
 #include "tests/test-utils.hh"
+#include <zlib.h>
+#include <chrono>
+#include <fstream>
 
 using namespace httpd;
 
@@ -154,6 +165,90 @@ SEASTAR_TEST_CASE(test_routes) {
     });
 }
 
+SEASTAR_TEST_CASE(test_route_tree) {
+    std::vector<std::unique_ptr<match_rule>> rules;
+    auto rule = [&rules] {
+        rules.push_back(std::make_unique<match_rule>(new handl()));
+        return rules.back().get();
+    };
+    route_tree tree;
+    BOOST_REQUIRE(tree.add(rule()->add_str("/api/users").add_param("id"), 0));
+    BOOST_REQUIRE(tree.add(rule()->add_str("/api/users/me"), 1));
+    BOOST_REQUIRE(tree.add(rule()->add_str("/api").add_param("path", true), 2));
+    BOOST_REQUIRE(tree.add(rule()->add_str("/api/users").add_param("id").add_str("/posts"), 3));
+    BOOST_REQUIRE(!tree.add(rule()->add_str("/"), 4));
+
+    // Earlier rules win over more specific ones, as when tried in order
+    BOOST_REQUIRE_EQUAL(tree.find("/api/users/me"), 0);
+    BOOST_REQUIRE_EQUAL(tree.find("/api/users/7"), 0);
+    BOOST_REQUIRE_EQUAL(tree.find("/api/users/7/"), 0);
+    BOOST_REQUIRE_EQUAL(tree.find("/api/users/7/posts"), 2);
+    BOOST_REQUIRE_EQUAL(tree.find("/api"), 2);
+    BOOST_REQUIRE_EQUAL(tree.find("/apis"), route_tree::npos);
+    BOOST_REQUIRE_EQUAL(tree.find("/"), route_tree::npos);
+
+    route_tree users;
+    users.add(*rules[3], 3);
+    BOOST_REQUIRE_EQUAL(users.find("/api/users/7/posts"), 3);
+    BOOST_REQUIRE_EQUAL(users.find("/api/users/7"), route_tree::npos);
+    return make_ready_future<>();
+}
+
+// Not a check: compares looking up among many parameterized routes in a
+// route_tree with trying each rule in turn
+SEASTAR_TEST_CASE(test_route_lookup_speed) {
+    constexpr unsigned nr_routes = 500;
+    constexpr unsigned nr_lookups = 100000;
+    std::vector<std::unique_ptr<match_rule>> rules;
+    route_tree tree;
+    for (unsigned i = 0; i < nr_routes; i++) {
+        rules.push_back(std::make_unique<match_rule>(new handl()));
+        rules.back()->add_str(sprint("/api/v1/resource%d", i)).add_param("id").add_str("/items").add_param("item");
+        tree.add(*rules.back(), i);
+    }
+    std::vector<sstring> urls;
+    for (unsigned i = 0; i < 64; i++) {
+        urls.push_back(sprint("/api/v1/resource%d/%d/items/%d", i * 7 % nr_routes, i, i * 3));
+    }
+    urls.push_back("/api/v1/unknown/1/items/2");
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    size_t found = 0;
+    for (unsigned i = 0; i < nr_lookups; i++) {
+        auto& url = urls[i % urls.size()];
+        auto index = tree.find(url);
+        if (index != route_tree::npos) {
+            parameters params;
+            found += rules[index]->get(url, params) != nullptr;
+        }
+    }
+    auto tree_time = clock::now() - start;
+
+    start = clock::now();
+    size_t found_linear = 0;
+    for (unsigned i = 0; i < nr_lookups; i++) {
+        auto& url = urls[i % urls.size()];
+        parameters params;
+        for (auto& r : rules) {
+            if (r->get(url, params)) {
+                found_linear++;
+                break;
+            }
+            params.clear();
+        }
+    }
+    auto linear_time = clock::now() - start;
+
+    BOOST_REQUIRE_EQUAL(found, found_linear);
+    auto ns_per_lookup = [] (clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / nr_lookups;
+    };
+    print("route lookup among %d routes: tree %d ns, linear %d ns\n", nr_routes,
+            ns_per_lookup(tree_time), ns_per_lookup(linear_time));
+    return make_ready_future<>();
+}
+
 SEASTAR_TEST_CASE(test_transformer) {
     request req;
     content_replace cr("json");
@@ -165,3 +260,468 @@ SEASTAR_TEST_CASE(test_transformer) {
     BOOST_REQUIRE_EQUAL(content, "hello-http-xyz-localhost");
     return make_ready_future<>();
 }
+
+// Hands out its input a few bytes at a time, to split framing across reads
+class trickle_source : public data_source_impl {
+    sstring _data;
+    size_t _pos = 0;
+public:
+    explicit trickle_source(sstring data) : _data(std::move(data)) {}
+    virtual future<temporary_buffer<char>> get() override {
+        auto n = std::min<size_t>(3, _data.size() - _pos);
+        temporary_buffer<char> buf(_data.begin() + _pos, n);
+        _pos += n;
+        return make_ready_future<temporary_buffer<char>>(std::move(buf));
+    }
+};
+
+class string_sink : public data_sink_impl {
+    sstring& _out;
+public:
+    explicit string_sink(sstring& out) : _out(out) {}
+    virtual future<> put(net::packet data) override {
+        for (auto& f : data.fragments()) {
+            _out += sstring(f.base, f.size);
+        }
+        return make_ready_future<>();
+    }
+    virtual future<> close() override {
+        return make_ready_future<>();
+    }
+};
+
+SEASTAR_TEST_CASE(test_header_map) {
+    header_map headers;
+    headers["Content-Type"] = "text/plain";
+    headers["content-length"] = "5";
+    BOOST_REQUIRE_EQUAL(headers["CONTENT-TYPE"], "text/plain");
+    BOOST_REQUIRE_EQUAL(headers.at("Content-Length"), "5");
+    BOOST_REQUIRE_EQUAL(headers.size(), 2);
+    BOOST_REQUIRE(headers.find("Host") == headers.end());
+    BOOST_REQUIRE_EQUAL(headers.erase("CONTENT-type"), 1);
+    BOOST_REQUIRE_EQUAL(headers.count("Content-Type"), 0);
+    BOOST_REQUIRE_EQUAL(headers.begin()->first, "content-length");
+
+    query_parameter_map params;
+    params["a"] = "1";
+    BOOST_REQUIRE_EQUAL(params.count("A"), 0);
+    BOOST_REQUIRE_THROW(params.at("b"), std::out_of_range);
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_chunked_body) {
+    auto in = make_lw_shared<input_stream<char>>(data_source(std::make_unique<trickle_source>(
+            "5;ext=1\r\nhello\r\n7\r\n, world\r\n0\r\nX-Trailer: 1\r\n\r\nGET /next")));
+    auto body = make_lw_shared<input_stream<char>>(make_chunked_body(*in));
+    return read_entire_body(*body).then([in, body] (sstring content) {
+        BOOST_REQUIRE_EQUAL(content, "hello, world");
+        return in->read_exactly(9);
+    }).then([in] (temporary_buffer<char> rest) {
+        BOOST_REQUIRE_EQUAL(sstring(rest.get(), rest.size()), "GET /next");
+    });
+}
+
+SEASTAR_TEST_CASE(test_content_length_body) {
+    auto in = make_lw_shared<input_stream<char>>(data_source(std::make_unique<trickle_source>("0123456789")));
+    auto body = make_lw_shared<input_stream<char>>(make_content_length_body(*in, 4));
+    return read_entire_body(*body).then([in, body] (sstring content) {
+        BOOST_REQUIRE_EQUAL(content, "0123");
+    });
+}
+
+SEASTAR_TEST_CASE(test_chunked_output) {
+    auto sent = make_lw_shared<sstring>();
+    auto out = make_lw_shared<output_stream<char>>(data_sink(std::make_unique<string_sink>(*sent)), 1024);
+    auto body = make_lw_shared<output_stream<char>>(make_chunked_output(*out));
+    return body->write("hello").then([body] {
+        return body->flush();
+    }).then([body] {
+        return body->write(", world");
+    }).then([body] {
+        return body->close();
+    }).then([sent, out, body] {
+        BOOST_REQUIRE_EQUAL(*sent, "5\r\nhello\r\n7\r\n, world\r\n0\r\n\r\n");
+    });
+}
+
+SEASTAR_TEST_CASE(test_negotiate_encoding) {
+    BOOST_REQUIRE(negotiate_encoding("") == content_encoding::identity);
+    BOOST_REQUIRE(negotiate_encoding("br") == content_encoding::identity);
+    BOOST_REQUIRE(negotiate_encoding("gzip, deflate") == content_encoding::gzip);
+    BOOST_REQUIRE(negotiate_encoding("deflate, gzip;q=0.5") == content_encoding::deflate);
+    BOOST_REQUIRE(negotiate_encoding("gzip;q=0, deflate") == content_encoding::deflate);
+    BOOST_REQUIRE(negotiate_encoding(" GZIP ;q=0.8") == content_encoding::gzip);
+    return make_ready_future<>();
+}
+
+static sstring inflate_all(const sstring& data, content_encoding e) {
+    z_stream zs = {};
+    BOOST_REQUIRE_EQUAL(inflateInit2(&zs, e == content_encoding::gzip ? 15 + 16 : 15), Z_OK);
+    sstring out;
+    char buf[4096];
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.c_str()));
+    zs.avail_in = data.size();
+    int r;
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(buf);
+        zs.avail_out = sizeof(buf);
+        r = inflate(&zs, Z_NO_FLUSH);
+        BOOST_REQUIRE(r == Z_OK || r == Z_STREAM_END);
+        out.append(buf, sizeof(buf) - zs.avail_out);
+    } while (r != Z_STREAM_END);
+    inflateEnd(&zs);
+    return out;
+}
+
+SEASTAR_TEST_CASE(test_compress_reply) {
+    sstring json;
+    for (int i = 0; i < 1000; ++i) {
+        json += "{\"key\": \"value\"},";
+    }
+    reply small;
+    small._content = "{}";
+    compress_reply("gzip", small, 1024);
+    BOOST_REQUIRE(!small._headers.count("Content-Encoding"));
+
+    reply big;
+    big._content = json;
+    compress_reply("gzip", big, 1024);
+    BOOST_REQUIRE_EQUAL(big._headers["Content-Encoding"], "gzip");
+    BOOST_REQUIRE(big._content.size() < json.size() / 10);
+    BOOST_REQUIRE_EQUAL(inflate_all(big._content, content_encoding::gzip), json);
+
+    reply plain;
+    plain._content = json;
+    compress_reply("identity", plain, 1024);
+    BOOST_REQUIRE_EQUAL(plain._content, json);
+    BOOST_REQUIRE_EQUAL(plain._headers["Vary"], "Accept-Encoding");
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_compressing_output) {
+    auto sent = make_lw_shared<sstring>();
+    auto out = make_lw_shared<output_stream<char>>(make_compressing_output(
+            output_stream<char>(data_sink(std::make_unique<string_sink>(*sent)), 1024), content_encoding::deflate));
+    auto lines = boost::irange(0, 100);
+    return do_for_each(lines.begin(), lines.end(), [out] (int i) {
+        return out->write(sprint("line %d of a streamed body\n", i));
+    }).then([out] {
+        return out->close();
+    }).then([sent, out] {
+        auto body = inflate_all(*sent, content_encoding::deflate);
+        BOOST_REQUIRE_EQUAL(body.substr(0, 27), "line 0 of a streamed body\nl");
+        BOOST_REQUIRE(body.find("line 99 of a streamed body\n") != sstring::npos);
+    });
+}
+
+// Replies once release() is called, and right away after that
+class held_handler : public httpd::handler_base {
+    std::vector<promise<>> _held;
+    bool _released = false;
+public:
+    virtual future<std::unique_ptr<reply> > handle(const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+        if (_released) {
+            rep->done("html");
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        }
+        _held.emplace_back();
+        return _held.back().get_future().then([rep = std::move(rep)] () mutable {
+            rep->done("html");
+            return std::move(rep);
+        });
+    }
+    void release() {
+        _released = true;
+        for (auto& p : _held) {
+            p.set_value();
+        }
+        _held.clear();
+    }
+};
+
+SEASTAR_TEST_CASE(test_concurrency_limit) {
+    auto route = make_lw_shared<routes>();
+    auto shed = new held_handler();
+    auto queued = new held_handler();
+    shed->limit_concurrency("test-shed", 1, std::chrono::milliseconds(0), std::chrono::seconds(3));
+    queued->limit_concurrency("test-queued", 1, std::chrono::seconds(10));
+    route->add(operation_type::GET, url("/shed"), shed);
+    route->add(operation_type::GET, url("/queued"), queued);
+    auto get = [route] (sstring path) {
+        return route->handle(path, std::make_unique<request>(), std::make_unique<reply>());
+    };
+    auto f1 = get("/shed");
+    // Over the limit, and not allowed to wait
+    return get("/shed").then([=, f1 = std::move(f1)] (std::unique_ptr<reply> rep) mutable {
+        BOOST_REQUIRE_EQUAL((int )rep->_status, (int )reply::status_type::service_unavailable);
+        BOOST_REQUIRE_EQUAL(rep->_headers["Retry-After"], "3");
+        shed->release();
+        return std::move(f1);
+    }).then([=] (std::unique_ptr<reply> rep) {
+        BOOST_REQUIRE_EQUAL((int )rep->_status, (int )reply::status_type::ok);
+        // The second waits for the first, and is handled once it's done
+        auto f1 = get("/queued");
+        auto f2 = get("/queued");
+        return later().then([=, f1 = std::move(f1), f2 = std::move(f2)] () mutable {
+            BOOST_REQUIRE(!f2.available());
+            queued->release();
+            return std::move(f1);
+        }).then([f2 = std::move(f2)] (std::unique_ptr<reply> rep) mutable {
+            BOOST_REQUIRE_EQUAL((int )rep->_status, (int )reply::status_type::ok);
+            return std::move(f2);
+        }).then([] (std::unique_ptr<reply> rep) {
+            BOOST_REQUIRE_EQUAL((int )rep->_status, (int )reply::status_type::ok);
+        });
+    }).finally([route] {});
+}
+
+static sstring from_hex(const char* hex) {
+    sstring ret;
+    for (; hex[0] && hex[1]; hex += 2) {
+        char c = std::stoi(std::string(hex, 2), nullptr, 16);
+        ret += sstring(&c, 1);
+    }
+    return ret;
+}
+
+SEASTAR_TEST_CASE(test_hpack) {
+    // RFC 7541, C.4: requests with Huffman coding, sharing the dynamic table
+    hpack_decoder decoder;
+    auto first = from_hex("828684418cf1e3c2e5f23a6ba0ab90f4ff");
+    auto fields = decoder.decode(first.begin(), first.size());
+    BOOST_REQUIRE_EQUAL(fields.size(), 4);
+    BOOST_REQUIRE_EQUAL(fields[2].first, ":path");
+    BOOST_REQUIRE_EQUAL(fields[3].second, "www.example.com");
+    auto second = from_hex("828684be5886a8eb10649cbf");
+    fields = decoder.decode(second.begin(), second.size());
+    BOOST_REQUIRE_EQUAL(fields.size(), 5);
+    BOOST_REQUIRE_EQUAL(fields[3].second, "www.example.com");
+    BOOST_REQUIRE_EQUAL(fields[4].first, "cache-control");
+    BOOST_REQUIRE_EQUAL(fields[4].second, "no-cache");
+    auto truncated = second.substr(0, second.size() - 1);
+    BOOST_REQUIRE_THROW(decoder.decode(truncated.begin(), truncated.size()), hpack_error);
+
+    std::vector<char> block;
+    hpack_encode(block, ":status", "200");
+    hpack_encode(block, "content-type", "text/plain");
+    hpack_encode(block, "x-custom", sstring(300, 'z'));
+    fields = hpack_decoder().decode(block.data(), block.size());
+    BOOST_REQUIRE_EQUAL(fields.size(), 3);
+    BOOST_REQUIRE_EQUAL(fields[0].second, "200");
+    BOOST_REQUIRE_EQUAL(fields[1].second, "text/plain");
+    BOOST_REQUIRE_EQUAL(fields[2].second, sstring(300, 'z'));
+    return make_ready_future<>();
+}
+
+static sstring h2_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const sstring& payload) {
+    char header[9] = { char(payload.size() >> 16), char(payload.size() >> 8), char(payload.size()),
+            char(type), char(flags), char(stream_id >> 24), char(stream_id >> 16), char(stream_id >> 8), char(stream_id) };
+    return sstring(header, sizeof(header)) + payload;
+}
+
+static sstring h2_headers(std::initializer_list<std::pair<sstring, sstring>> fields) {
+    std::vector<char> block;
+    for (auto& f : fields) {
+        hpack_encode(block, f.first, f.second);
+    }
+    return sstring(block.data(), block.size());
+}
+
+SEASTAR_TEST_CASE(test_http2_connection) {
+    struct session {
+        http_server server;
+        sstring sent;
+        input_stream<char> in;
+        output_stream<char> out;
+        http2_connection conn;
+        session(sstring input)
+            : in(data_source(std::make_unique<trickle_source>(std::move(input))))
+            , out(data_sink(std::make_unique<string_sink>(sent)), 8192)
+            , conn(server, in, out, http2_options()) {}
+    };
+    auto input = sstring(http2_connection::preface, http2_connection::preface_size)
+            + h2_frame(4, 0, 0, "")
+            + h2_frame(1, 5, 1, h2_headers({{":method", "GET"}, {":scheme", "http"},
+                    {":path", "/echo?x=1"}, {":authority", "example.com"}}))
+            + h2_frame(1, 4, 3, h2_headers({{":method", "POST"}, {":scheme", "http"}, {":path", "/echo"}}))
+            + h2_frame(0, 0, 3, "ab")
+            + h2_frame(0, 1, 3, "c")
+            + h2_frame(1, 5, 5, h2_headers({{":method", "GET"}, {":scheme", "http"}, {":path", "/missing"}}))
+            + h2_frame(6, 0, 0, "12345678");
+    auto s = make_lw_shared<session>(std::move(input));
+    s->server._routes.put(GET, "/echo", new function_handler([] (const_req req) {
+        return "get " + req.get_query_param("x") + " " + req.get_header("Host");
+    }, "txt"));
+    s->server._routes.put(POST, "/echo", new function_handler([] (const_req req) {
+        return "post " + req.content;
+    }, "txt"));
+    return s->conn.process(0).then([s] {
+        std::map<uint32_t, sstring> status, body;
+        std::vector<uint8_t> connection_frames;
+        hpack_decoder decoder;
+        auto& out = s->sent;
+        for (size_t pos = 0; pos + 9 <= out.size();) {
+            auto p = reinterpret_cast<const uint8_t*>(out.begin() + pos);
+            size_t size = (p[0] << 16) | (p[1] << 8) | p[2];
+            uint32_t id = (p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+            auto payload = out.begin() + pos + 9;
+            if (p[3] == 1) {
+                for (auto& f : decoder.decode(payload, size)) {
+                    if (f.first == ":status") {
+                        status[id] = f.second;
+                    }
+                }
+            } else if (p[3] == 0) {
+                body[id] += sstring(payload, size);
+            } else if (!id) {
+                connection_frames.push_back(p[3]);
+            }
+            pos += 9 + size;
+        }
+        BOOST_REQUIRE_EQUAL(status[1], "200");
+        BOOST_REQUIRE_EQUAL(body[1], "get 1 example.com");
+        BOOST_REQUIRE_EQUAL(status[3], "200");
+        BOOST_REQUIRE_EQUAL(body[3], "post abc");
+        BOOST_REQUIRE_EQUAL(status[5], "404");
+        // Our SETTINGS and WINDOW_UPDATE, the SETTINGS ack and the PING ack
+        BOOST_REQUIRE_EQUAL(connection_frames.size(), 4);
+        BOOST_REQUIRE_EQUAL(connection_frames[3], 6);
+    });
+}
+
+SEASTAR_TEST_CASE(test_client) {
+    struct fixture {
+        http_server server;
+        client_options opts;
+        std::unique_ptr<client> cl;
+    };
+    auto f = make_lw_shared<fixture>();
+    ipv4_addr addr("127.0.0.1", 10091);
+    f->server._routes.put(GET, "/hello", new function_handler([] (const_req req) {
+        return "hello " + req.get_query_param("x");
+    }, "txt"));
+    f->server._routes.put(POST, "/echo", new function_handler([] (const_req req) {
+        return req.content;
+    }, "txt"));
+    f->server._routes.put(GET, "/stream", new function_handler([] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+        rep->write_body("txt", [] (output_stream<char>&& out) {
+            return do_with(std::move(out), [] (output_stream<char>& out) {
+                return out.write(sstring(100000, 'x')).then([&out] {
+                    return out.close();
+                });
+            });
+        });
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }, "txt"));
+    f->opts.max_connections = 1;
+    f->opts.pipeline_depth = 4;
+    f->opts.metrics_name = "test";
+    f->cl = std::make_unique<client>(make_ipv4_address(addr), "localhost", f->opts);
+    return f->server.listen(addr).then([f] {
+        return f->cl->make_request(client_request("GET", "/hello?x=1"));
+    }).then([f] (std::unique_ptr<client_response> rsp) {
+        BOOST_REQUIRE_EQUAL(rsp->status(), 200);
+        return do_with(std::move(rsp), [] (auto& rsp) {
+            return rsp->read_body();
+        });
+    }).then([f] (sstring body) {
+        BOOST_REQUIRE_EQUAL(body, "hello 1");
+        client_request req("POST", "/echo");
+        req.body_writer = [] (output_stream<char>& out) {
+            return out.write("streamed ").then([&out] {
+                return out.write("request");
+            });
+        };
+        return f->cl->make_request(std::move(req));
+    }).then([f] (std::unique_ptr<client_response> rsp) {
+        return do_with(std::move(rsp), [] (auto& rsp) {
+            return rsp->read_body();
+        });
+    }).then([f] (sstring body) {
+        BOOST_REQUIRE_EQUAL(body, "streamed request");
+        // The one connection carries all three, pipelined
+        auto paths = { "/stream", "/hello?x=2", "/hello?x=3" };
+        return map_reduce(paths.begin(), paths.end(), [f] (const char* path) {
+            return f->cl->make_request(client_request("GET", path)).then([] (std::unique_ptr<client_response> rsp) {
+                return do_with(std::move(rsp), [] (auto& rsp) {
+                    return rsp->read_body();
+                });
+            }).then([] (sstring body) {
+                return body.size();
+            });
+        }, size_t(0), std::plus<size_t>());
+    }).then([f] (size_t total) {
+        BOOST_REQUIRE_EQUAL(total, 100000 + 7 + 7);
+        return f->cl->close();
+    }).then([f] {
+        return f->server.stop();
+    });
+}
+
+SEASTAR_TEST_CASE(test_file_cache) {
+    struct fixture {
+        http_server server;
+        std::unique_ptr<client> cl;
+        sstring dir;
+        sstring etag;
+    };
+    auto f = make_lw_shared<fixture>();
+    char dir[] = "/tmp/httpd_test_XXXXXX";
+    BOOST_REQUIRE(mkdtemp(dir));
+    f->dir = dir;
+    std::ofstream(f->dir + "/small.txt") << "small file";
+    std::ofstream(f->dir + "/big.txt") << sstring(100000, 'b');
+    // big.txt is sent from disk, with sendfile()
+    file_cache::local().set_max_file_size(1024);
+    auto hits = file_cache::local().hits();
+    f->server._routes.put(GET, "/small", new file_handler(f->dir + "/small.txt", nullptr, false));
+    f->server._routes.put(GET, "/big", new file_handler(f->dir + "/big.txt", nullptr, false));
+    ipv4_addr addr("127.0.0.1", 10092);
+    f->cl = std::make_unique<client>(make_ipv4_address(addr), "localhost");
+    auto get = [f] (sstring path, sstring etag) {
+        client_request req("GET", path);
+        if (!etag.empty()) {
+            req.headers["If-None-Match"] = etag;
+        }
+        return f->cl->make_request(std::move(req)).then([] (std::unique_ptr<client_response> rsp) {
+            return do_with(std::move(rsp), [] (auto& rsp) {
+                return rsp->read_body().then([&rsp] (sstring body) {
+                    return make_ready_future<int, sstring, sstring>(rsp->status(), rsp->get_header("ETag"), std::move(body));
+                });
+            });
+        });
+    };
+    return f->server.listen(addr).then([get] {
+        return get("/small", "");
+    }).then([f, get] (int status, sstring etag, sstring body) {
+        BOOST_REQUIRE_EQUAL(status, 200);
+        BOOST_REQUIRE_EQUAL(body, "small file");
+        BOOST_REQUIRE(!etag.empty());
+        f->etag = etag;
+        return get("/small", "");
+    }).then([f, get, hits] (int status, sstring etag, sstring body) {
+        BOOST_REQUIRE_EQUAL(body, "small file");
+        BOOST_REQUIRE_EQUAL(etag, f->etag);
+        BOOST_REQUIRE_GT(file_cache::local().hits(), hits);
+        return get("/small", "\"other\", " + f->etag);
+    }).then([get] (int status, sstring etag, sstring body) {
+        BOOST_REQUIRE_EQUAL(status, 304);
+        BOOST_REQUIRE_EQUAL(body, "");
+        return get("/big", "");
+    }).then([get] (int status, sstring etag, sstring body) {
+        BOOST_REQUIRE_EQUAL(status, 200);
+        BOOST_REQUIRE_EQUAL(body, sstring(100000, 'b'));
+        return get("/big", etag);
+    }).then([] (int status, sstring etag, sstring body) {
+        BOOST_REQUIRE_EQUAL(status, 304);
+    }).finally([f] {
+        return f->cl->close().then([f] {
+            return f->server.stop();
+        }).then([f] {
+            ::unlink((f->dir + "/small.txt").c_str());
+            ::unlink((f->dir + "/big.txt").c_str());
+            ::rmdir(f->dir.c_str());
+        });
+    });
+}
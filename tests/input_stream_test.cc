@@ -0,0 +1,75 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/do_with.hh"
+#include "net/packet-data-source.hh"
+#include "test-utils.hh"
+
+using namespace net;
+
+static input_stream<char> make_stream(std::vector<sstring> fragments) {
+    packet p;
+    for (auto&& f : fragments) {
+        p = packet(std::move(p), temporary_buffer<char>(f.c_str(), f.size()));
+    }
+    return as_input_stream(std::move(p));
+}
+
+static sstring join(const std::vector<temporary_buffer<char>>& bufs) {
+    sstring s;
+    for (auto&& b : bufs) {
+        s += sstring(b.get(), b.size());
+    }
+    return s;
+}
+
+SEASTAR_TEST_CASE(test_read_exactly_scattered_shares_fragments) {
+    return do_with(make_stream({"abc", "defg", "hi"}), [] (input_stream<char>& in) {
+        return in.read_exactly_scattered(2).then([&in] (std::vector<temporary_buffer<char>> v) {
+            BOOST_REQUIRE_EQUAL(v.size(), 1u);
+            BOOST_REQUIRE_EQUAL(join(v), "ab");
+            return in.read_exactly_scattered(6);
+        }).then([&in] (std::vector<temporary_buffer<char>> v) {
+            // One fragment per buffer from the data source, not a copy.
+            BOOST_REQUIRE_EQUAL(v.size(), 3u);
+            BOOST_REQUIRE_EQUAL(join(v), "cdefgh");
+            return in.read_exactly_scattered(5);
+        }).then([] (std::vector<temporary_buffer<char>> v) {
+            // Short at end of stream.
+            BOOST_REQUIRE_EQUAL(join(v), "i");
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_consume_fragments) {
+    return do_with(make_stream({"0123", "4567", "89"}), sstring(), [] (input_stream<char>& in, sstring& seen) {
+        return in.consume_fragments(6, [&seen] (temporary_buffer<char> buf) {
+            seen += sstring(buf.get(), buf.size());
+            return make_ready_future<>();
+        }).then([&in, &seen] (size_t n) {
+            BOOST_REQUIRE_EQUAL(n, 6u);
+            BOOST_REQUIRE_EQUAL(seen, "012345");
+            return in.read_exactly(4);
+        }).then([] (temporary_buffer<char> rest) {
+            BOOST_REQUIRE_EQUAL(sstring(rest.get(), rest.size()), "6789");
+        });
+    });
+}
@@ -20,6 +20,10 @@
  * Copyright (C) 2016 ScyllaDB.
  */
 #include <vector>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
 
 #include "core/do_with.hh"
 #include "test-utils.hh"
@@ -28,6 +32,7 @@
 #include "core/do_with.hh"
 #include "core/future-util.hh"
 #include "json/formatter.hh"
+#include "json/json_elements.hh"
 
 using namespace seastar;
 using namespace json;
@@ -52,3 +57,133 @@ SEASTAR_TEST_CASE(test_collections) {
 
     return make_ready_future();
 }
+
+SEASTAR_TEST_CASE(test_numbers) {
+    BOOST_CHECK_EQUAL("0", formatter::to_json(0));
+    BOOST_CHECK_EQUAL("-2147483648", formatter::to_json(std::numeric_limits<int>::min()));
+    BOOST_CHECK_EQUAL("-9223372036854775808", formatter::to_json(std::numeric_limits<long>::min()));
+    BOOST_CHECK_EQUAL("18446744073709551615", formatter::to_json(std::numeric_limits<unsigned long>::max()));
+
+    // The shortest digits that read back as the same number
+    BOOST_CHECK_EQUAL("0.1", formatter::to_json(0.1));
+    BOOST_CHECK_EQUAL("0.1", formatter::to_json(0.1f));
+    BOOST_CHECK_EQUAL("0.30000000000000004", formatter::to_json(0.1 + 0.2));
+    BOOST_CHECK_EQUAL("123456789012345680", formatter::to_json(123456789012345678.0));
+    BOOST_CHECK_EQUAL("0.000001", formatter::to_json(1e-6));
+    BOOST_CHECK_EQUAL("1e-7", formatter::to_json(1e-7));
+    BOOST_CHECK_EQUAL("1e+22", formatter::to_json(1e22));
+    BOOST_CHECK_EQUAL("1.7976931348623157e+308", formatter::to_json(std::numeric_limits<double>::max()));
+    BOOST_CHECK_EQUAL("5e-324", formatter::to_json(std::numeric_limits<double>::denorm_min()));
+    BOOST_CHECK_EQUAL("-0", formatter::to_json(-0.0));
+
+    std::mt19937_64 rng(std::random_device{}());
+    for (int i = 0; i < 100000; ++i) {
+        auto bits = rng();
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        if (std::isfinite(d)) {
+            BOOST_REQUIRE_EQUAL(d, strtod(formatter::to_json(d).c_str(), nullptr));
+        }
+        uint32_t fbits = bits;
+        float f;
+        memcpy(&f, &fbits, sizeof(f));
+        if (std::isfinite(f)) {
+            BOOST_REQUIRE_EQUAL(f, strtof(formatter::to_json(f).c_str(), nullptr));
+        }
+    }
+
+    return make_ready_future();
+}
+
+SEASTAR_TEST_CASE(test_string_escapes) {
+    BOOST_CHECK_EQUAL("\"\"", formatter::to_json(""));
+    BOOST_CHECK_EQUAL("\"a\\\"b\\\\c\"", formatter::to_json("a\"b\\c"));
+    BOOST_CHECK_EQUAL("\"\\b\\f\\n\\r\\t\\u0001\\u001f\"", formatter::to_json("\b\f\n\r\t\x01\x1f"));
+    // Long enough to be scanned 16 bytes at a time, with escapes on both
+    // sides of a block boundary
+    BOOST_CHECK_EQUAL("\"0123456789abcde\\n\\\"0123456789abcdef0123456789\\t\"",
+            formatter::to_json(sstring("0123456789abcde\n\"0123456789abcdef0123456789\t")));
+    BOOST_CHECK_EQUAL("\"caf\xc3\xa9\"", formatter::to_json("caf\xc3\xa9"));
+
+    return make_ready_future();
+}
+
+class string_sink : public data_sink_impl {
+    sstring& _out;
+public:
+    explicit string_sink(sstring& out) : _out(out) {}
+    virtual future<> put(net::packet data) override {
+        for (auto& f : data.fragments()) {
+            _out += sstring(f.base, f.size);
+        }
+        return make_ready_future<>();
+    }
+    virtual future<> close() override {
+        return make_ready_future<>();
+    }
+};
+
+// Writes val with formatter::write(), and checks it matches to_json()
+template <typename T>
+future<> check_write(T val) {
+    auto out = make_lw_shared<sstring>();
+    auto s = make_lw_shared<output_stream<char>>(data_sink(std::make_unique<string_sink>(*out)), 8);
+    auto v = make_lw_shared<T>(std::move(val));
+    return formatter::write(*s, *v).then([s] {
+        return s->close();
+    }).then([out, s, v] {
+        BOOST_CHECK_EQUAL(formatter::to_json(*v), *out);
+    });
+}
+
+SEASTAR_TEST_CASE(test_write_collections) {
+    return check_write(3).then([] {
+        return check_write(sstring("apa"));
+    }).then([] {
+        return check_write(std::map<int,int>({{1,2},{3,4}}));
+    }).then([] {
+        return check_write(std::vector<std::pair<int,int>>({{1,2},{3,4}}));
+    }).then([] {
+        return check_write(std::vector<std::map<int,int>>({{{1,2}},{{3,4}}}));
+    }).then([] {
+        return check_write(std::vector<std::vector<int>>({{1,2},{3,4}}));
+    }).then([] {
+        return check_write(std::vector<int>(10000, 7));
+    });
+}
+
+struct test_object : public json_base {
+    json_element<int> count;
+    json_element<sstring> name;
+    json_list<long> values;
+    test_object() {
+        add(&count, "count");
+        add(&name, "name");
+        add(&values, "values");
+    }
+};
+
+SEASTAR_TEST_CASE(test_write_object) {
+    auto obj = make_lw_shared<test_object>();
+    obj->count = 3;
+    obj->values = std::vector<long>({1, 2, 3});
+    auto out = make_lw_shared<sstring>();
+    auto s = make_lw_shared<output_stream<char>>(data_sink(std::make_unique<string_sink>(*out)), 8);
+    return formatter::write(*s, *obj).then([s] {
+        return s->close();
+    }).then([obj, out, s] {
+        BOOST_CHECK_EQUAL(sstring(obj->to_json()), *out);
+        BOOST_CHECK_EQUAL("{\"count\": 3, \"values\": [1,2,3]}", *out);
+    });
+}
+
+SEASTAR_TEST_CASE(test_stream_range_as_array) {
+    auto out = make_lw_shared<sstring>();
+    json_return_type res = stream_range_as_array(std::vector<int>({1, 2, 3}), [] (int i) {
+        return std::vector<int>(i, i);
+    });
+    BOOST_REQUIRE(res._body_writer);
+    return res._body_writer(output_stream<char>(data_sink(std::make_unique<string_sink>(*out)), 8)).then([out] {
+        BOOST_CHECK_EQUAL("[[1], [2,2], [3,3,3]]", *out);
+    });
+}
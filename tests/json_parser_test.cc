@@ -0,0 +1,108 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#define BOOST_TEST_MODULE json_parser
+
+#include <boost/test/included/unit_test.hpp>
+#include "json/json_parser.hh"
+#include "tests/json_parser_test.json.hh"
+
+using namespace json;
+using namespace httpd::json_parser_test_json;
+
+static temporary_buffer<char> buffer(const char* s) {
+    return temporary_buffer<char>(s, strlen(s));
+}
+
+BOOST_AUTO_TEST_CASE(test_generated_parser) {
+    auto buf = buffer(R"({
+        "name": "a \"quoted\" name\u00e9",
+        "count": -9000000000,
+        "enabled": true,
+        "unknown": {"nested": [1, 2.5e3, null, "x\\y"]},
+        "tags": ["one", "two"],
+        "points": [{"x": 1, "y": 0.5}, {"y": -2, "x": 3}],
+        "origin": {"x": 7, "y": 7.25},
+        "color": "GREEN"
+    })");
+    document d;
+    parse_document(buf, d);
+    BOOST_REQUIRE_EQUAL(d.name(), sstring("a \"quoted\" name\xc3\xa9"));
+    BOOST_REQUIRE_EQUAL(d.count(), -9000000000L);
+    BOOST_REQUIRE(d.enabled());
+    BOOST_REQUIRE_EQUAL(d.tags._elements.size(), 2u);
+    BOOST_REQUIRE_EQUAL(d.tags._elements[1], sstring("two"));
+    BOOST_REQUIRE_EQUAL(d.points._elements.size(), 2u);
+    BOOST_REQUIRE_EQUAL(d.points._elements[1].x(), 3);
+    BOOST_REQUIRE_EQUAL(d.points._elements[1].y(), -2.0);
+    BOOST_REQUIRE_EQUAL(d.origin().y(), 7.25);
+    BOOST_REQUIRE(d.color().v == document::document_color::GREEN);
+    BOOST_REQUIRE(d.is_verify());
+}
+
+BOOST_AUTO_TEST_CASE(test_missing_and_null_members_stay_unset) {
+    auto buf = buffer(R"({"name": null, "points": null})");
+    document d;
+    parse_document(buf, d);
+    BOOST_REQUIRE(!d.name._set);
+    BOOST_REQUIRE(!d.points._set);
+    BOOST_REQUIRE(!d.count._set);
+}
+
+BOOST_AUTO_TEST_CASE(test_round_trip) {
+    document d;
+    d.name = "x\ty";
+    d.count = 5;
+    point p;
+    p.x = 1;
+    p.y = 2;
+    d.points.push(p);
+    auto json = d.to_json();
+    temporary_buffer<char> buf(json.data(), json.size());
+    document back;
+    parse_document(buf, back);
+    BOOST_REQUIRE_EQUAL(back.to_json(), json);
+}
+
+BOOST_AUTO_TEST_CASE(test_surrogate_pairs) {
+    auto buf = buffer(R"("\ud83d\ude00")");
+    json_reader r(buf);
+    auto s = r.read_string();
+    BOOST_REQUIRE_EQUAL(std::string(s.data(), s.size()), "\xf0\x9f\x98\x80");
+}
+
+BOOST_AUTO_TEST_CASE(test_errors) {
+    auto bad = [] (const char* doc) {
+        auto buf = buffer(doc);
+        document d;
+        BOOST_REQUIRE_THROW(parse_document(buf, d), json_parse_error);
+    };
+    bad("");
+    bad("{");
+    bad(R"({"name": "unterminated)");
+    bad(R"({"name": 1})");
+    bad(R"({"count": 1.5})");
+    bad(R"({"count": 99999999999999999999})");
+    bad(R"({"name": "x",})");
+    bad(R"({"name": "x"} trailing)");
+    bad(R"({"name": "\ud800"})");
+    bad(R"({"name": "\q"})");
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "test-utils.hh"
+#include "core/log-region.hh"
+#include "core/thread.hh"
+#include "core/sleep.hh"
+#include <vector>
+#include <cstring>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// Objects hold their index in a table of pointers, which the migrator
+// updates.
+struct table_migrator final : public log_region_migrator {
+    std::vector<char*>& table;
+    explicit table_migrator(std::vector<char*>& t) : table(t) {}
+    void migrate(void* src, void* dst, size_t size) const noexcept override {
+        std::memcpy(dst, src, size);
+        unsigned idx;
+        std::memcpy(&idx, dst, sizeof(idx));
+        table[idx] = static_cast<char*>(dst);
+    }
+};
+
+size_t object_size(unsigned i) {
+    return sizeof(unsigned) + 100 + (i * 37) % 1000;
+}
+
+void fill(log_region& r, const table_migrator& m, std::vector<char*>& table) {
+    for (unsigned i = 0; i < table.size(); ++i) {
+        auto p = static_cast<char*>(r.alloc(m, object_size(i)));
+        std::memcpy(p, &i, sizeof(i));
+        std::memset(p + sizeof(i), char(i), object_size(i) - sizeof(i));
+        table[i] = p;
+    }
+}
+
+void verify(const std::vector<char*>& table) {
+    for (unsigned i = 0; i < table.size(); ++i) {
+        if (!table[i]) {
+            continue;
+        }
+        unsigned idx;
+        std::memcpy(&idx, table[i], sizeof(idx));
+        BOOST_REQUIRE_EQUAL(idx, i);
+        auto p = table[i] + sizeof(i);
+        BOOST_REQUIRE(std::all_of(p, table[i] + object_size(i), [i] (char c) { return c == char(i); }));
+    }
+}
+
+}
+
+SEASTAR_TEST_CASE(test_log_region_compaction) {
+    return seastar::async([] {
+        log_region r;
+        std::vector<char*> table(10000);
+        table_migrator m(table);
+        fill(r, m, table);
+        verify(table);
+        auto full = r.occupancy();
+        BOOST_REQUIRE_GE(full, r.live_bytes());
+        for (unsigned i = 0; i < table.size(); i += 4) {
+            for (unsigned j = i; j < i + 3 && j < table.size(); ++j) {
+                r.free(table[j]);
+                table[j] = nullptr;
+            }
+        }
+        while (r.occupancy() > 2 * r.live_bytes() && r.compact_one()) {
+        }
+        BOOST_REQUIRE_GT(r.segments_compacted(), 0u);
+        BOOST_REQUIRE_LT(r.occupancy(), full / 2);
+        verify(table);
+        r.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_log_region_background_compaction) {
+    return seastar::async([] {
+        log_region r;
+        std::vector<char*> table(10000);
+        table_migrator m(table);
+        fill(r, m, table);
+        auto full = r.occupancy();
+        r.enable_background_compaction(0.25);
+        for (unsigned i = 0; i < table.size(); i += 2) {
+            r.free(table[i]);
+            table[i] = nullptr;
+        }
+        // Each compaction step runs in its own task.
+        for (int i = 0; i < 1000 && r.occupancy() - r.live_bytes() > r.occupancy() / 4; ++i) {
+            sleep(1ms).get();
+        }
+        BOOST_REQUIRE_LE(r.occupancy() - r.live_bytes(), r.occupancy() / 4 + log_region::segment_size);
+        BOOST_REQUIRE_LT(r.occupancy(), full);
+        verify(table);
+        r.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_log_region_make) {
+    log_region r;
+    auto s = r.make<sstring>("long enough to live outside the inline buffer");
+    BOOST_REQUIRE_EQUAL(*s, "long enough to live outside the inline buffer");
+    r.destroy(s);
+    BOOST_REQUIRE_EQUAL(r.live_bytes(), 0u);
+    return r.stop();
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "tests/test-utils.hh"
+#include "net/loopback-stack.hh"
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/do_with.hh"
+#include <string>
+
+using namespace net;
+
+static thread_local std::experimental::optional<server_socket> listener;
+
+// Accepts one connection on this shard's listener and sends back what it
+// reads, until the other side closes
+static future<> echo_one() {
+    return listener->accept().then([] (connected_socket s, socket_address) {
+        return do_with(std::move(s), [] (connected_socket& s) {
+            return do_with(s.input(), s.output(), [] (input_stream<char>& in, output_stream<char>& out) {
+                return repeat([&in, &out] {
+                    return in.read().then([&out] (temporary_buffer<char> buf) {
+                        if (buf.empty()) {
+                            return make_ready_future<stop_iteration>(stop_iteration::yes);
+                        }
+                        return out.write(std::move(buf)).then([] {
+                            return stop_iteration::no;
+                        });
+                    });
+                }).then([&out] {
+                    return out.close();
+                });
+            });
+        });
+    });
+}
+
+// Writes data while reading what comes back, since with a small window
+// the echo stalls unless the reply is drained
+static future<std::string> round_trip(socket_address sa, std::string data, loopback_options opts) {
+    return do_with(loopback_socket(opts), [sa] (::seastar::socket& s) {
+        return s.connect(sa);
+    }).then([data = std::move(data)] (connected_socket s) {
+        return do_with(std::move(s), std::move(data), std::string(), [] (connected_socket& s, std::string& data, std::string& got) {
+            return do_with(s.input(), s.output(), [&data, &got] (input_stream<char>& in, output_stream<char>& out) {
+                auto written = out.write(data.data(), data.size()).then([&out] {
+                    return out.close();
+                });
+                auto read = repeat([&in, &got] {
+                    return in.read().then([&got] (temporary_buffer<char> buf) {
+                        got.append(buf.get(), buf.size());
+                        return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+                    });
+                });
+                return when_all(std::move(written), std::move(read)).then([&got] (auto results) {
+                    std::get<0>(results).get();
+                    std::get<1>(results).get();
+                    return got;
+                });
+            });
+        });
+    });
+}
+
+static future<> test_echo(unsigned server_shard, std::string data, loopback_options opts) {
+    auto sa = make_ipv4_address({"10.0.0.1", 1234});
+    return smp::submit_to(server_shard, [sa] {
+        listener = loopback_listen(sa);
+    }).then([sa, server_shard, data = std::move(data), opts] {
+        auto served = smp::submit_to(server_shard, [] {
+            return echo_one();
+        });
+        return round_trip(sa, data, opts).then([data] (std::string got) {
+            BOOST_REQUIRE(got == data);
+        }).then([served = std::move(served)] () mutable {
+            return std::move(served);
+        });
+    }).finally([server_shard] {
+        return smp::submit_to(server_shard, [] {
+            listener = std::experimental::nullopt;
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_loopback_same_shard) {
+    return test_echo(engine().cpu_id(), "hello", loopback_options());
+}
+
+SEASTAR_TEST_CASE(test_loopback_other_shard) {
+    return test_echo((engine().cpu_id() + 1) % smp::count, "hello", loopback_options());
+}
+
+// Much more than the window, so the writer waits for the reader many times
+SEASTAR_TEST_CASE(test_loopback_window) {
+    std::string data;
+    for (unsigned i = 0; i < (1 << 20); ++i) {
+        data.push_back(char(i * 7));
+    }
+    loopback_options opts;
+    opts.window = 4096;
+    return test_echo((engine().cpu_id() + 1) % smp::count, std::move(data), opts);
+}
+
+SEASTAR_TEST_CASE(test_loopback_connection_refused) {
+    return loopback_socket().connect(make_ipv4_address({"10.0.0.2", 1234})).then_wrapped([] (future<connected_socket> f) {
+        BOOST_REQUIRE_EXCEPTION(f.get(), std::system_error, [] (const std::system_error& e) {
+            return e.code().value() == ECONNREFUSED;
+        });
+    });
+}
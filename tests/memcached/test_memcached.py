@@ -33,13 +33,16 @@ args = None
 class TimeoutError(Exception):
     pass
 
+def to_bytes(msg):
+    return msg if isinstance(msg, bytes) else msg.encode()
+
 @contextmanager
 def tcp_connection(timeout=1):
     s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     s.settimeout(timeout)
     s.connect(server_addr)
     def call(msg):
-        s.send(msg.encode())
+        s.send(to_bytes(msg))
         return s.recv(16*1024)
     yield call
     s.close()
@@ -64,7 +67,7 @@ def tcp_call(msg, timeout=1):
     s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     s.settimeout(timeout)
     s.connect(server_addr)
-    s.send(msg.encode())
+    s.send(to_bytes(msg))
     s.shutdown(socket.SHUT_WR)
     data = recv_all(s)
     s.close()
@@ -75,7 +78,7 @@ def udp_call_for_fragments(msg, timeout=1):
     sock.settimeout(timeout)
     this_req_id = random.randint(-32768, 32767)
 
-    datagram = struct.pack(">hhhh", this_req_id, 0, 1, 0) + msg.encode()
+    datagram = struct.pack(">hhhh", this_req_id, 0, 1, 0) + to_bytes(msg)
     sock.sendto(datagram, server_addr)
 
     messages = {}
@@ -219,6 +222,13 @@ class TcpSpecificTests(MemcacheTest):
             time.sleep(0.1)
             self.assertEquals(curr_connections, int(self.getStat('curr_connections', call_fn=conn)))
 
+    def test_value_larger_than_slab_page(self):
+        data = ''.join(random.choice('abcdefgh') for _ in range(256)) * (12*1024)
+        self.assertEqual(tcp_call('set key 0 0 %d\r\n%s\r\n' % (len(data), data), timeout=10), b'STORED\r\n')
+        self.assertEqual(tcp_call('get key\r\n', timeout=10),
+            ('VALUE key 0 %d\r\n%s\r\nEND\r\n' % (len(data), data)).encode())
+        self.delete('key')
+
 class UdpSpecificTests(MemcacheTest):
     def test_large_response_is_split_into_mtu_chunks(self):
         max_datagram_size = 1400
@@ -236,6 +246,26 @@ class UdpSpecificTests(MemcacheTest):
 
         self.delete('key')
 
+    def test_requests_sent_back_to_back(self):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.settimeout(1)
+        requests = ['get key\r\n', 'set key 0 0 1\r\na\r\n', 'get key\r\n', 'gets key nokey\r\n', 'get key\r\n']
+        for req_id, msg in enumerate(requests):
+            sock.sendto(struct.pack(">hhhh", req_id, 0, 1, 0) + to_bytes(msg), server_addr)
+        replies = {}
+        while len(replies) < len(requests):
+            data, addr = sock.recvfrom(1500)
+            req_id, seq, n, res = struct.unpack_from(">hhhh", data)
+            self.assertEqual((seq, n), (0, 1))
+            replies[req_id] = data[8:]
+        sock.close()
+        self.assertEqual(replies[0], b'END\r\n')
+        self.assertEqual(replies[1], b'STORED\r\n')
+        self.assertEqual(replies[2], b'VALUE key 0 1\r\na\r\nEND\r\n')
+        self.assertRegex(replies[3], b'^VALUE key 0 1 \\d+\r\na\r\nEND\r\n$')
+        self.assertEqual(replies[4], b'VALUE key 0 1\r\na\r\nEND\r\n')
+        self.delete('key')
+
 class TestCommands(MemcacheTest):
     def test_basic_commands(self):
         self.assertEqual(call('get key\r\n'), b'END\r\n')
@@ -381,6 +411,15 @@ class TestCommands(MemcacheTest):
 
         self.delete('key')
 
+    def test_writes_to_hot_key_are_visible(self):
+        self.set('hot', 'v1')
+        for i in range(20):
+            self.assertEqual(call('get %s\r\n' % ' '.join(['hot'] * 100)), b'VALUE hot 0 2\r\nv1\r\n' * 100 + b'END\r\n')
+        self.set('hot', 'v2', flags=3)
+        self.assertEqual(call('get hot\r\n'), b'VALUE hot 3 2\r\nv2\r\nEND\r\n')
+        self.delete('hot')
+        self.assertNoKey('hot')
+
     def test_curr_items_stat(self):
         self.assertEquals(0, int(self.getStat('curr_items')))
         self.setKey('key')
@@ -570,6 +609,89 @@ def wait_for_memcache_udp(timeout=4):
         except socket.timeout:
             pass
 
+BINARY_HEADER = struct.Struct('>BBHBBHIIQ')
+
+def binary_request(opcode, key=b'', extras=b'', value=b'', opaque=0, cas=0):
+    return BINARY_HEADER.pack(0x80, opcode, len(key), len(extras), 0, 0,
+                              len(extras) + len(key) + len(value), opaque, cas) + extras + key + value
+
+def parse_binary_responses(data):
+    responses = []
+    while data:
+        magic, opcode, key_len, extras_len, _, status, body_len, opaque, cas = BINARY_HEADER.unpack_from(data)
+        body = data[BINARY_HEADER.size:BINARY_HEADER.size + body_len]
+        data = data[BINARY_HEADER.size + body_len:]
+        responses.append({
+            'magic': magic, 'opcode': opcode, 'status': status, 'opaque': opaque, 'cas': cas,
+            'extras': body[:extras_len],
+            'key': body[extras_len:extras_len + key_len],
+            'value': body[extras_len + key_len:],
+        })
+    return responses
+
+class BinaryProtocolTests(MemcacheTest):
+    GET, SET, ADD, DELETE, INCREMENT, GETQ, NOOP, VERSION, GETK, GETKQ = \
+        0x00, 0x01, 0x02, 0x04, 0x05, 0x09, 0x0a, 0x0b, 0x0c, 0x0d
+
+    def binary_call(self, *requests):
+        return parse_binary_responses(call(b''.join(requests)))
+
+    def binary_set(self, key, value, flags=0, expiry=0):
+        r, = self.binary_call(binary_request(self.SET, key, struct.pack('>II', flags, expiry), value))
+        self.assertEqual(r['magic'], 0x81)
+        self.assertEqual(r['status'], 0)
+
+    def test_set_is_visible_to_ascii_get(self):
+        self.binary_set(b'key', b'value', flags=7)
+        self.assertEqual(call('get key\r\n'), b'VALUE key 7 5\r\nvalue\r\nEND\r\n')
+
+    def test_get(self):
+        self.set('key', 'value', flags=3)
+        r, = self.binary_call(binary_request(self.GETK, b'key', opaque=42))
+        self.assertEqual(r['status'], 0)
+        self.assertEqual(r['opaque'], 42)
+        self.assertEqual(struct.unpack('>I', r['extras'])[0], 3)
+        self.assertEqual(r['key'], b'key')
+        self.assertEqual(r['value'], b'value')
+        r, = self.binary_call(binary_request(self.GET, b'missing'))
+        self.assertEqual(r['status'], 1)
+
+    def test_quiet_gets_answer_hits_only(self):
+        self.binary_set(b'a', b'1')
+        self.binary_set(b'b', b'2')
+        responses = self.binary_call(
+            binary_request(self.GETKQ, b'a', opaque=1),
+            binary_request(self.GETKQ, b'missing', opaque=2),
+            binary_request(self.GETQ, b'b', opaque=3),
+            binary_request(self.NOOP, opaque=4))
+        self.assertEqual([(r['opcode'], r['opaque']) for r in responses],
+                         [(self.GETKQ, 1), (self.GETQ, 3), (self.NOOP, 4)])
+        self.assertEqual([r['key'] for r in responses], [b'a', b'', b''])
+        self.assertEqual([r['value'] for r in responses], [b'1', b'2', b''])
+
+    def test_add_and_delete(self):
+        r, = self.binary_call(binary_request(self.ADD, b'key', struct.pack('>II', 0, 0), b'v'))
+        self.assertEqual(r['status'], 0)
+        r, = self.binary_call(binary_request(self.ADD, b'key', struct.pack('>II', 0, 0), b'v'))
+        self.assertEqual(r['status'], 2)
+        r, = self.binary_call(binary_request(self.DELETE, b'key'))
+        self.assertEqual(r['status'], 0)
+        self.assertNoKey('key')
+
+    def test_incr(self):
+        extras = struct.pack('>QQI', 5, 10, 0)
+        r, = self.binary_call(binary_request(self.INCREMENT, b'counter', extras))
+        self.assertEqual(struct.unpack('>Q', r['value'])[0], 10)
+        r, = self.binary_call(binary_request(self.INCREMENT, b'counter', extras))
+        self.assertEqual(struct.unpack('>Q', r['value'])[0], 15)
+        r, = self.binary_call(binary_request(self.INCREMENT, b'missing', struct.pack('>QQI', 1, 0, 0xffffffff)))
+        self.assertEqual(r['status'], 1)
+
+    def test_version(self):
+        r, = self.binary_call(binary_request(self.VERSION))
+        self.assertEqual(r['status'], 0)
+        self.assertTrue(r['value'])
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description="memcache protocol tests")
     parser.add_argument('--server', '-s', action="store", help="server adddress in <host>:<port> format", default="localhost:11211")
@@ -591,6 +713,7 @@ if __name__ == '__main__':
     loader = unittest.TestLoader()
     suite = unittest.TestSuite()
     suite.addTest(loader.loadTestsFromTestCase(TestCommands))
+    suite.addTest(loader.loadTestsFromTestCase(BinaryProtocolTests))
     if args.udp:
         suite.addTest(loader.loadTestsFromTestCase(UdpSpecificTests))
     else:
@@ -0,0 +1,66 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/object_pool.hh"
+#include "tests/test-utils.hh"
+
+using namespace seastar;
+
+struct pooled_object : public pooled<pooled_object> {
+    static const char* object_pool_name() { return "test_object"; }
+    char data[100];
+};
+
+struct derived_object : public pooled_object {
+    char more[100];
+};
+
+SEASTAR_TEST_CASE(test_object_pool_reuse) {
+    auto& pool = pooled_object::local_pool();
+    auto p1 = std::make_unique<pooled_object>();
+    BOOST_REQUIRE_EQUAL(pool.misses(), 1u);
+    auto addr = p1.get();
+    p1.reset();
+    BOOST_REQUIRE_EQUAL(pool.cached(), 1u);
+    auto p2 = std::make_unique<pooled_object>();
+    BOOST_REQUIRE_EQUAL(pool.hits(), 1u);
+    BOOST_REQUIRE_EQUAL(p2.get(), addr);
+    // Objects of derived types do not fit the pool's storage.
+    auto d = std::make_unique<derived_object>();
+    d.reset();
+    BOOST_REQUIRE_EQUAL(pool.cached(), 0u);
+    BOOST_REQUIRE_EQUAL(pool.hits() + pool.misses(), 2u);
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_object_pool_cap) {
+    auto& pool = pooled_object::local_pool();
+    pool.clear();
+    std::vector<std::unique_ptr<pooled_object>> objects;
+    for (size_t i = 0; i < pooled_object::max_free + 10; ++i) {
+        objects.push_back(std::make_unique<pooled_object>());
+    }
+    objects.clear();
+    BOOST_REQUIRE_EQUAL(pool.cached(), size_t(pooled_object::max_free));
+    pool.clear();
+    BOOST_REQUIRE_EQUAL(pool.cached(), 0u);
+    return make_ready_future<>();
+}
@@ -28,6 +28,7 @@
 #include "net/packet.hh"
 #include "test-utils.hh"
 #include <vector>
+#include <boost/iterator/counting_iterator.hpp>
 
 using namespace net;
 
@@ -128,3 +129,70 @@ SEASTAR_TEST_CASE(test_flush_on_empty_buffer_does_not_push_empty_packet_down_str
         return out->close();
     }).finally([out]{});
 }
+
+SEASTAR_TEST_CASE(test_mixing_buffered_and_zero_copy_writes) {
+    auto v = make_shared<std::vector<packet>>();
+    auto out = make_shared<output_stream<char>>(
+        data_sink(std::make_unique<vector_data_sink>(*v)), 8);
+
+    return out->write("ab").then([out] {
+        return out->write(temporary_buffer<char>("cdefghij", 8));
+    }).then([out] {
+        return out->write("kl");
+    }).then([out] {
+        return out->close();
+    }).then([v, out] {
+        sstring all;
+        for (auto&& p : *v) {
+            all += to_sstring(p);
+        }
+        BOOST_REQUIRE_EQUAL(all, "abcdefghijkl");
+    });
+}
+
+SEASTAR_TEST_CASE(test_corked_writes_go_out_as_one_packet) {
+    auto v = make_shared<std::vector<packet>>();
+    auto out = make_shared<output_stream<char>>(
+        data_sink(std::make_unique<vector_data_sink>(*v)), 4);
+
+    out->cork();
+    return out->write("abc").then([out] {
+        return out->flush();
+    }).then([out] {
+        return out->write("defgh");
+    }).then([out] {
+        return out->flush();
+    }).then([out] {
+        return out->write("ij");
+    }).then([out] {
+        return out->flush();
+    }).then([v, out] {
+        BOOST_REQUIRE(v->empty());
+        return out->uncork();
+    }).then([v, out] {
+        BOOST_REQUIRE_EQUAL(v->size(), 1u);
+        BOOST_REQUIRE_EQUAL(to_sstring((*v)[0]), "abcdefghij");
+        return out->close();
+    }).finally([out]{});
+}
+
+SEASTAR_TEST_CASE(test_corked_packets_respect_iov_max) {
+    auto v = make_shared<std::vector<packet>>();
+    auto out = make_shared<output_stream<char>>(
+        data_sink(std::make_unique<vector_data_sink>(*v)), 4);
+
+    out->cork();
+    return do_for_each(boost::counting_iterator<int>(0), boost::counting_iterator<int>(3 * IOV_MAX), [out] (int) {
+        return out->write(temporary_buffer<char>("01234567", 8));
+    }).then([out] {
+        return out->close();
+    }).then([v, out] {
+        size_t len = 0;
+        for (auto&& p : *v) {
+            BOOST_REQUIRE_LE(p.nr_frags(), size_t(IOV_MAX));
+            len += p.len();
+        }
+        BOOST_REQUIRE_GT(v->size(), 1u);
+        BOOST_REQUIRE_EQUAL(len, 8u * 3 * IOV_MAX);
+    });
+}
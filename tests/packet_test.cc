@@ -64,3 +64,34 @@ BOOST_AUTO_TEST_CASE(test_headers_are_contiguous_even_with_many_fragments) {
     BOOST_REQUIRE_EQUAL(p.nr_frags(), 9);
 }
 
+
+BOOST_AUTO_TEST_CASE(test_small_payload_leaves_room_for_headers) {
+    using eth_header = std::array<char, 14>;
+    using tcp_header = std::array<char, 32>;
+    using ip_header = std::array<char, 20>;
+    char data[40] = {};
+    packet p(fragment{data, sizeof(data)});
+    p.prepend_header<tcp_header>();
+    p.prepend_header<ip_header>();
+    p.prepend_header<eth_header>();
+    BOOST_REQUIRE_EQUAL(p.nr_frags(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_packets_outlive_recycled_ones) {
+    char data[100] = {};
+    fragment f{data, sizeof(data)};
+    std::vector<packet> kept;
+    for (int i = 0; i < 1000; ++i) {
+        packet p(f);
+        for (int j = 0; j < i % 20; ++j) {
+            p.append(packet(f));
+        }
+        kept.push_back(p.share());
+        if (i % 3) {
+            kept.pop_back();
+        }
+    }
+    for (auto&& p : kept) {
+        BOOST_REQUIRE_EQUAL(p.len(), p.nr_frags() * sizeof(data));
+    }
+}
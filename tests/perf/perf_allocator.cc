@@ -0,0 +1,302 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+// Throughput and fragmentation of the seastar allocator, next to the
+// system's (glibc's, found behind seastar's malloc with dlsym(RTLD_NEXT)):
+//
+//  - malloc+free of a batch of objects, per size class, in ns per pair
+//  - the same for large spans
+//  - objects allocated on one shard and freed on another
+//  - realloc growing a buffer by doubling and by small appends
+//  - a cache churning objects at a fixed live size, first small ones, then
+//    larger ones, reporting how much memory the allocator holds (and the
+//    process' RSS) against the live bytes as it goes
+//
+// Build in release mode; a debug build uses the system allocator for both.
+// RSS is the whole process', so compare it across runs with --allocator
+// set to one of them.
+
+#include "../../core/reactor.hh"
+#include "../../core/app-template.hh"
+#include "../../core/thread.hh"
+#include "../../core/memory.hh"
+#include "../../core/print.hh"
+#include <dlfcn.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+
+namespace bpo = boost::program_options;
+
+struct allocator_ops {
+    const char* name;
+    void* (*malloc)(size_t);
+    void (*free)(void*);
+    void* (*realloc)(void*, size_t);
+    // Memory the allocator holds for this shard, live or not
+    size_t (*footprint)();
+};
+
+static allocator_ops seastar_allocator() {
+    return allocator_ops{"seastar", ::malloc, ::free, ::realloc, [] () -> size_t {
+        return memory::stats().allocated_memory();
+    }};
+}
+
+static allocator_ops system_allocator() {
+    auto sym = [] (const char* name) {
+        auto p = dlsym(RTLD_NEXT, name);
+        if (!p) {
+            throw std::runtime_error(sprint("cannot find the system's %s()", name));
+        }
+        return p;
+    };
+    return allocator_ops{"system",
+        reinterpret_cast<void* (*)(size_t)>(sym("malloc")),
+        reinterpret_cast<void (*)(void*)>(sym("free")),
+        reinterpret_cast<void* (*)(void*, size_t)>(sym("realloc")),
+        [] () -> size_t {
+            // seastar doesn't define mallinfo(), so this is glibc's; its
+            // fields are ints, good to 2GB
+            auto mi = mallinfo();
+            return size_t(unsigned(mi.arena)) - size_t(unsigned(mi.fordblks)) + size_t(unsigned(mi.hblkhd));
+        }};
+}
+
+static size_t rss() {
+    std::ifstream statm("/proc/self/statm");
+    size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+using clock_type = std::chrono::steady_clock;
+
+static double ns_since(clock_type::time_point start, uint64_t ops) {
+    return std::chrono::duration<double, std::nano>(clock_type::now() - start).count() / ops;
+}
+
+// Touches an object, as its user would, so that untouched memory doesn't
+// flatter the RSS figures
+static void touch(void* p, size_t size) {
+    auto c = static_cast<char*>(p);
+    for (size_t off = 0; off < size; off += 4096) {
+        c[off] = 1;
+    }
+    c[size - 1] = 1;
+}
+
+static void bench_size_classes(const allocator_ops& a, const std::vector<size_t>& sizes, unsigned batch, uint64_t total_bytes) {
+    std::vector<void*> objs(batch);
+    for (auto size : sizes) {
+        uint64_t rounds = std::max<uint64_t>(total_bytes / (size * batch), 10);
+        // Freed in allocation order
+        auto start = clock_type::now();
+        for (uint64_t r = 0; r < rounds; ++r) {
+            for (auto& p : objs) {
+                p = a.malloc(size);
+            }
+            for (auto p : objs) {
+                a.free(p);
+            }
+        }
+        auto fifo = ns_since(start, rounds * batch);
+        // Freed newest first, as a stack of temporaries is
+        start = clock_type::now();
+        for (uint64_t r = 0; r < rounds; ++r) {
+            for (auto& p : objs) {
+                p = a.malloc(size);
+            }
+            for (auto i = objs.rbegin(); i != objs.rend(); ++i) {
+                a.free(*i);
+            }
+        }
+        auto lifo = ns_since(start, rounds * batch);
+        print("%-8s %10d %12.1f %12.1f\n", a.name, size, lifo, fifo);
+    }
+}
+
+static void bench_realloc(const allocator_ops& a, unsigned rounds) {
+    auto start = clock_type::now();
+    uint64_t ops = 0;
+    for (unsigned r = 0; r < rounds; ++r) {
+        void* p = nullptr;
+        for (size_t size = 16; size <= (1 << 20); size *= 2) {
+            p = a.realloc(p, size);
+            static_cast<char*>(p)[size - 1] = 1;
+            ++ops;
+        }
+        a.free(p);
+    }
+    print("%-8s %-26s %12.1f\n", a.name, "doubling 16B to 1MB", ns_since(start, ops));
+    start = clock_type::now();
+    ops = 0;
+    for (unsigned r = 0; r < rounds; ++r) {
+        void* p = nullptr;
+        for (size_t size = 16; size <= (64 << 10); size += 16) {
+            p = a.realloc(p, size);
+            static_cast<char*>(p)[size - 1] = 1;
+            ++ops;
+        }
+        a.free(p);
+    }
+    print("%-8s %-26s %12.1f\n", a.name, "appending 16B up to 64KB", ns_since(start, ops));
+}
+
+// Objects are allocated here and freed on the next shard, batch by batch
+static void bench_cross_shard(const allocator_ops& a, size_t size, unsigned batch, unsigned rounds) {
+    auto to = (engine().cpu_id() + 1) % smp::count;
+    std::vector<void*> objs(batch);
+    auto start = clock_type::now();
+    for (unsigned r = 0; r < rounds; ++r) {
+        for (auto& p : objs) {
+            p = a.malloc(size);
+        }
+        smp::submit_to(to, [&a, &objs] {
+            for (auto p : objs) {
+                a.free(p);
+            }
+        }).get();
+    }
+    print("%-8s %10d %12.1f\n", a.name, size, ns_since(start, uint64_t(rounds) * batch));
+}
+
+// A cache of objects with sizes drawn log-uniformly from [min_size,
+// max_size], held at live_target bytes by replacing random objects
+class churn {
+    const allocator_ops& _a;
+    size_t _live_target;
+    std::vector<std::pair<void*, size_t>> _objs;
+    size_t _live = 0;
+    std::default_random_engine _random{1};
+public:
+    churn(const allocator_ops& a, size_t live_target) : _a(a), _live_target(live_target) {}
+    ~churn() {
+        for (auto& o : _objs) {
+            _a.free(o.first);
+        }
+    }
+    void run(const char* phase, size_t min_size, size_t max_size, uint64_t replacements, unsigned reports) {
+        std::uniform_real_distribution<double> log_size(std::log(min_size), std::log(max_size));
+        auto make = [&] {
+            size_t size = std::exp(log_size(_random));
+            auto p = _a.malloc(size);
+            touch(p, size);
+            _live += size;
+            return std::make_pair(p, size);
+        };
+        // A phase with larger objects needs fewer of them
+        while (_live < _live_target) {
+            _objs.push_back(make());
+        }
+        for (unsigned rep = 0; rep < reports; ++rep) {
+            auto start = clock_type::now();
+            auto n = replacements / reports;
+            for (uint64_t i = 0; i < n; ++i) {
+                auto& o = _objs[std::uniform_int_distribution<size_t>(0, _objs.size() - 1)(_random)];
+                _a.free(o.first);
+                _live -= o.second;
+                o = make();
+                // Keeps the live size at the target as the mix changes
+                while (_live > _live_target && _objs.size() > 1) {
+                    _a.free(_objs.back().first);
+                    _live -= _objs.back().second;
+                    _objs.pop_back();
+                }
+            }
+            auto footprint = _a.footprint();
+            print("%-8s %-6s %12d %10.1f %10.1f %10.1f %8.2f %10.1f\n", _a.name, phase, (rep + 1) * n,
+                    _live / 1e6, footprint / 1e6, rss() / 1e6, double(footprint) / _live, ns_since(start, n));
+        }
+    }
+};
+
+int main(int ac, char** av) {
+    app_template at;
+    at.add_options()
+            ("allocator", bpo::value<std::string>()->default_value("both"), "seastar, system, or both")
+            ("batch", bpo::value<unsigned>()->default_value(1000), "Objects allocated before they are freed")
+            ("bytes-per-size", bpo::value<uint64_t>()->default_value(1 << 30), "Bytes allocated for each size class measured")
+            ("churn-live-mb", bpo::value<size_t>()->default_value(256), "Live size of the churning cache, in MB")
+            ("churn-replacements", bpo::value<uint64_t>()->default_value(10000000), "Objects replaced in each churn phase")
+            ;
+    return at.run(ac, av, [&at] {
+        return seastar::async([&at] {
+            auto& cfg = at.configuration();
+            std::vector<allocator_ops> allocators;
+            auto which = cfg["allocator"].as<std::string>();
+            if (which == "seastar" || which == "both") {
+                allocators.push_back(seastar_allocator());
+            }
+            if (which == "system" || which == "both") {
+                allocators.push_back(system_allocator());
+            }
+            auto batch = cfg["batch"].as<unsigned>();
+
+            print("%-8s %10s %12s %12s\n", "alloc", "size", "ns/op lifo", "ns/op fifo");
+            std::vector<size_t> small_sizes;
+            for (size_t s = 8; s <= 16384; s *= 2) {
+                small_sizes.push_back(s);
+                if (s >= 16 && s < 16384) {
+                    small_sizes.push_back(s + s / 2);
+                }
+            }
+            for (auto& a : allocators) {
+                bench_size_classes(a, small_sizes, batch, cfg["bytes-per-size"].as<uint64_t>());
+            }
+            print("\n");
+            print("%-8s %10s %12s %12s\n", "alloc", "large", "ns/op lifo", "ns/op fifo");
+            for (auto& a : allocators) {
+                bench_size_classes(a, {64 << 10, 256 << 10, 1 << 20, 8 << 20}, 16, cfg["bytes-per-size"].as<uint64_t>());
+            }
+            print("\n");
+            print("%-8s %-26s %12s\n", "alloc", "realloc", "ns/op");
+            for (auto& a : allocators) {
+                bench_realloc(a, 1000);
+            }
+            print("\n");
+            if (smp::count < 2) {
+                print("cross-shard frees: skipped, run with -c2 or more\n");
+            } else {
+                print("%-8s %10s %12s\n", "alloc", "x-shard", "ns/op");
+                for (auto& a : allocators) {
+                    for (size_t size : {64, 1024, 16384}) {
+                        bench_cross_shard(a, size, batch, 1000);
+                    }
+                }
+            }
+            print("\n");
+            print("%-8s %-6s %12s %10s %10s %10s %8s %10s\n", "alloc", "phase", "replaced", "live MB", "held MB", "RSS MB", "held/live", "ns/op");
+            auto live = cfg["churn-live-mb"].as<size_t>() << 20;
+            auto replacements = cfg["churn-replacements"].as<uint64_t>();
+            for (auto& a : allocators) {
+                churn c(a, live);
+                c.run("small", 16, 512, replacements, 10);
+                c.run("large", 1024, 32768, replacements, 10);
+            }
+        });
+    });
+}
@@ -0,0 +1,147 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Compares std::unordered_map and connection_table as the TCP connection
+// table: a server accepting many connections from random peers, then
+// looking one up per received segment while a fraction of them churn.
+// The longest single insert shows the stall a full rehash causes.
+
+#include "../../net/connection_table.hh"
+#include "../../core/print.hh"
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+#include <memory>
+
+// The IPv4 4-tuple, hashed the way l4connid::connid_hash does
+struct connid {
+    uint32_t local_ip;
+    uint32_t foreign_ip;
+    uint16_t local_port;
+    uint16_t foreign_port;
+    bool operator==(const connid& x) const {
+        return local_ip == x.local_ip && foreign_ip == x.foreign_ip
+                && local_port == x.local_port && foreign_port == x.foreign_port;
+    }
+};
+
+struct connid_hash {
+    size_t operator()(const connid& id) const noexcept {
+        auto mix = [] (size_t h, size_t v) { return (h ^ v) * 0x100000001b3ULL; };
+        size_t h = 0xcbf29ce484222325ULL;
+        h = mix(h, id.local_ip);
+        h = mix(h, id.foreign_ip);
+        h = mix(h, id.local_port);
+        return mix(h, id.foreign_port);
+    }
+};
+
+// Stands in for lw_shared_ptr<tcb>
+using value = std::unique_ptr<int>;
+
+struct std_map {
+    std::unordered_map<connid, value, connid_hash> m;
+    bool insert(const connid& id) { return m.emplace(id, value(new int(1))).second; }
+    bool find(const connid& id) { return m.find(id) != m.end(); }
+    bool erase(const connid& id) { return m.erase(id); }
+};
+
+struct open_table {
+    net::connection_table<connid, value, connid_hash> m;
+    bool insert(const connid& id) { return m.insert(id, value(new int(1))); }
+    bool find(const connid& id) { return m.find(id); }
+    bool erase(const connid& id) { return m.erase(id); }
+};
+
+using fseconds = std::chrono::duration<float, std::ratio<1, 1>>;
+using clk = std::chrono::steady_clock;
+
+template <typename Table>
+void run(const char* name, unsigned n_conns, unsigned n_lookups) {
+    std::default_random_engine rng;
+    auto random_conn = [&] {
+        return connid{0x0a000001, uint32_t(rng()), 80, uint16_t(rng())};
+    };
+    std::vector<connid> conns;
+    conns.reserve(n_conns);
+    Table table;
+
+    std::chrono::nanoseconds worst{0};
+    auto start = clk::now();
+    while (conns.size() < n_conns) {
+        auto id = random_conn();
+        auto t0 = clk::now();
+        auto inserted = table.insert(id);
+        worst = std::max(worst, std::chrono::nanoseconds(clk::now() - t0));
+        if (inserted) {
+            conns.push_back(id);
+        }
+    }
+    auto filled = clk::now();
+
+    std::uniform_int_distribution<unsigned> pick(0, n_conns - 1);
+    unsigned long found = 0;
+    for (unsigned i = 0; i < n_lookups; ++i) {
+        auto& id = conns[pick(rng)];
+        found += table.find(id);
+        // One in 64 segments closes a connection and a new one opens
+        if (!(i % 64)) {
+            table.erase(id);
+            do {
+                id = random_conn();
+            } while (!table.insert(id));
+        }
+    }
+    auto end = clk::now();
+
+    print("%-16s %10d %10d %12.3f %12.3f %14.3f %10d\n", name, n_conns, n_lookups,
+            std::chrono::duration_cast<fseconds>(filled - start).count(),
+            std::chrono::duration_cast<fseconds>(end - filled).count(),
+            std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(worst).count(),
+            found);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    bpo::options_description opts("perf_connection_table options");
+    opts.add_options()
+            ("help", "show help message")
+            ("connections", bpo::value<unsigned>()->default_value(1000000), "Number of open connections")
+            ("lookups", bpo::value<unsigned>()->default_value(20000000), "Number of segments looked up")
+            ;
+    bpo::variables_map vm;
+    bpo::store(bpo::parse_command_line(ac, av, opts), vm);
+    bpo::notify(vm);
+    if (vm.count("help")) {
+        std::cout << opts << "\n";
+        return 1;
+    }
+    auto n_conns = vm["connections"].as<unsigned>();
+    auto n_lookups = vm["lookups"].as<unsigned>();
+
+    print("%-16s %10s %10s %12s %12s %14s %10s\n", "impl", "conns", "lookups", "fill (s)", "lookup (s)", "max insert(ms)", "found");
+    run<std_map>("unordered_map", n_conns, n_lookups);
+    run<open_table>("connection_table", n_conns, n_lookups);
+    return 0;
+}
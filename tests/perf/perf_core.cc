@@ -0,0 +1,151 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+// The cost of the core primitives: futures and continuations, cross-cpu
+// calls, semaphores and the queues behind them.
+
+#include "perf_tests.hh"
+#include "../../core/reactor.hh"
+#include "../../core/semaphore.hh"
+#include "../../core/circular_buffer.hh"
+#include "../../core/chunked_fifo.hh"
+
+using namespace perf_tests;
+
+PERF_TEST(future, ready_then) {
+    return make_ready_future<>().then([] {});
+}
+
+PERF_TEST(future, ready_then_x4) {
+    return make_ready_future<int>(1).then([] (int x) {
+        return x + 1;
+    }).then([] (int x) {
+        return x + 1;
+    }).then([] (int x) {
+        return x + 1;
+    }).then([] (int x) {
+        do_not_optimize(x);
+    });
+}
+
+PERF_TEST(future, promise_set_value) {
+    promise<int> pr;
+    auto f = pr.get_future();
+    pr.set_value(1);
+    do_not_optimize(f.get0());
+}
+
+// A continuation attached before the value is set runs as a task
+PERF_TEST(future, promise_then) {
+    promise<> pr;
+    auto f = pr.get_future().then([] {});
+    pr.set_value();
+    return f;
+}
+
+PERF_TEST(future, later) {
+    return later();
+}
+
+// To the next cpu, or to this one when there is only one
+PERF_TEST(smp, submit_to) {
+    return smp::submit_to((engine().cpu_id() + 1) % smp::count, [] {});
+}
+
+// One poll of the smp queues with no traffic, as an idle reactor does in a
+// loop; run with different -c to see how it scales with the shard count.
+PERF_TEST(smp, poll_queues_idle) {
+    do_not_optimize(smp::poll_queues());
+}
+
+struct semaphore_fixture {
+    semaphore sem{1};
+};
+
+PERF_TEST_F(semaphore_fixture, try_wait_signal) {
+    do_not_optimize(sem.try_wait());
+    sem.signal();
+}
+
+PERF_TEST_F(semaphore_fixture, wait_signal) {
+    return sem.wait().then([this] {
+        sem.signal();
+    });
+}
+
+// Every wait but the first queues a waiter
+PERF_TEST_F(semaphore_fixture, contended_wait_signal) {
+    auto f1 = sem.wait();
+    auto f2 = sem.wait();
+    sem.signal();
+    return when_all(std::move(f1), std::move(f2)).then([this] (auto) {
+        sem.signal();
+    });
+}
+
+template <typename Queue>
+struct queue_fixture {
+    Queue q;
+    queue_fixture() {
+        // Grown once, so that steady-state runs don't allocate
+        for (int i = 0; i < 128; ++i) {
+            q.push_back(i);
+        }
+        while (!q.empty()) {
+            q.pop_front();
+        }
+    }
+};
+
+using circular_buffer_fixture = queue_fixture<circular_buffer<int>>;
+using chunked_fifo_fixture = queue_fixture<chunked_fifo<int>>;
+
+PERF_TEST_F(circular_buffer_fixture, push_pop) {
+    q.push_back(1);
+    do_not_optimize(q.front());
+    q.pop_front();
+}
+
+PERF_TEST_F(circular_buffer_fixture, fill_drain_128) {
+    for (int i = 0; i < 128; ++i) {
+        q.push_back(i);
+    }
+    while (!q.empty()) {
+        do_not_optimize(q.front());
+        q.pop_front();
+    }
+}
+
+PERF_TEST_F(chunked_fifo_fixture, push_pop) {
+    q.push_back(1);
+    do_not_optimize(q.front());
+    q.pop_front();
+}
+
+PERF_TEST_F(chunked_fifo_fixture, fill_drain_128) {
+    for (int i = 0; i < 128; ++i) {
+        q.push_back(i);
+    }
+    while (!q.empty()) {
+        do_not_optimize(q.front());
+        q.pop_front();
+    }
+}
@@ -0,0 +1,96 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Compares a coroutine loop with the equivalent repeat() loop, both on
+// futures that are ready and on futures that have to wait for the reactor.
+
+#include "../../core/reactor.hh"
+#include "../../core/app-template.hh"
+#include "../../core/future-util.hh"
+#include "../../core/print.hh"
+
+#ifdef SEASTAR_COROUTINES_ENABLED
+
+#include "../../core/coroutine.hh"
+
+using fseconds = std::chrono::duration<float, std::ratio<1, 1>>;
+
+static future<> step(bool yield) {
+    return yield ? later() : make_ready_future<>();
+}
+
+static future<> repeat_loop(unsigned iterations, bool yield) {
+    return do_with(unsigned(0), [=] (unsigned& i) {
+        return repeat([=, &i] {
+            if (i++ == iterations) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return step(yield).then([] {
+                return stop_iteration::no;
+            });
+        });
+    });
+}
+
+static future<> coroutine_loop(unsigned iterations, bool yield) {
+    for (unsigned i = 0; i != iterations; ++i) {
+        co_await step(yield);
+    }
+}
+
+template <typename Loop>
+static future<> measure(const char* name, Loop loop, unsigned iterations, bool yield) {
+    auto start = std::chrono::steady_clock::now();
+    auto allocated = g_task_arena.allocations;
+    return loop(iterations, yield).then([=] {
+        auto elapsed = std::chrono::duration_cast<fseconds>(std::chrono::steady_clock::now() - start).count();
+        print("%-10s %-6s %12.1f %14.2f\n", name, yield ? "yield" : "ready",
+                elapsed * 1e9 / iterations, double(g_task_arena.allocations - allocated) / iterations);
+    });
+}
+
+int main(int ac, char** av) {
+    app_template at;
+    namespace bpo = boost::program_options;
+    at.add_options()
+            ("iterations", bpo::value<unsigned>()->default_value(10000000), "Loop iterations per measurement")
+            ;
+    return at.run(ac, av, [&at] {
+        auto iterations = at.configuration()["iterations"].as<unsigned>();
+        print("%-10s %-6s %12s %14s\n", "loop", "future", "ns/iter", "tasks/iter");
+        return measure("repeat", repeat_loop, iterations, false).then([=] {
+            return measure("coroutine", coroutine_loop, iterations, false);
+        }).then([=] {
+            return measure("repeat", repeat_loop, iterations, true);
+        }).then([=] {
+            return measure("coroutine", coroutine_loop, iterations, true);
+        });
+    });
+}
+
+#else
+
+int main(int ac, char** av) {
+    print("perf_coroutine: coroutines not enabled; configure with --enable-coroutines\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Reports the size of futures of a few value types, and how fast chains
+// of continuations on ready futures run.
+
+#include "../../core/reactor.hh"
+#include "../../core/future-util.hh"
+#include "../../core/app-template.hh"
+#include "../../core/print.hh"
+#include <boost/iterator/counting_iterator.hpp>
+#include <chrono>
+
+using fseconds = std::chrono::duration<float, std::ratio<1, 1>>;
+
+struct big_value {
+    char data[64];
+};
+
+template <typename... T>
+void print_size(const char* name) {
+    print("%-24s %8d %8d %8s\n", name, sizeof(future<T...>), sizeof(promise<T...>),
+            future_state<T...>::trivially_relocatable ? "yes" : "no");
+}
+
+template <typename Func>
+future<> measure(const char* name, unsigned iterations, Func func) {
+    auto start = std::chrono::steady_clock::now();
+    return do_for_each(boost::counting_iterator<unsigned>(0), boost::counting_iterator<unsigned>(iterations), std::move(func)).then([=] {
+        auto end = std::chrono::steady_clock::now();
+        auto secs = std::chrono::duration_cast<fseconds>(end - start).count();
+        print("%-24s %14.1f\n", name, secs * 1e9 / iterations);
+    });
+}
+
+int main(int ac, char** av) {
+    app_template at;
+    namespace bpo = boost::program_options;
+    at.add_options()
+            ("iterations", bpo::value<unsigned>()->default_value(10000000), "Number of chains to run")
+            ;
+    return at.run(ac, av, [&at] {
+        auto iterations = at.configuration()["iterations"].as<unsigned>();
+        print("%-24s %8s %8s %8s\n", "type", "future", "promise", "memcpy");
+        print_size<>("future<>");
+        print_size<int>("future<int>");
+        print_size<int, long>("future<int, long>");
+        print_size<sstring>("future<sstring>");
+        print_size<big_value>("future<big_value>");
+        print("\n%-24s %14s\n", "chain", "ns/chain");
+        return measure("ready void x4", iterations, [] (unsigned) {
+            return make_ready_future<>().then([] {}).then([] {}).then([] {}).then([] {});
+        }).then([iterations] {
+            return measure("ready int x4", iterations, [] (unsigned i) {
+                return make_ready_future<int>(i).then([] (int x) {
+                    return x + 1;
+                }).then([] (int x) {
+                    return x + 1;
+                }).then([] (int x) {
+                    return x + 1;
+                }).then([] (int x) {
+                    return make_ready_future<>();
+                });
+            });
+        }).then([iterations] {
+            return measure("ready sstring x4", iterations, [] (unsigned i) {
+                return make_ready_future<sstring>("value").then([] (sstring s) {
+                    return s;
+                }).then([] (sstring s) {
+                    return s;
+                }).then([] (sstring s) {
+                    return s;
+                }).then([] (sstring s) {
+                    return make_ready_future<>();
+                });
+            });
+        });
+    });
+}
@@ -0,0 +1,112 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Measures how fast the json formatter renders numbers and strings, next
+// to the printf formatting it replaced.  Build with -mno-sse2 to compare
+// the string escape scan against the bytewise one.
+
+#include "json/formatter.hh"
+#include "../../core/print.hh"
+#include <boost/program_options.hpp>
+#include <x86intrin.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using fseconds = std::chrono::duration<float, std::ratio<1, 1>>;
+
+template <typename Func>
+void measure(const char* name, unsigned iterations, Func&& func) {
+    auto start = std::chrono::steady_clock::now();
+    auto start_tsc = __rdtsc();
+    for (unsigned i = 0; i < iterations; ++i) {
+        func(i);
+    }
+    auto cycles = __rdtsc() - start_tsc;
+    auto end = std::chrono::steady_clock::now();
+    auto secs = std::chrono::duration_cast<fseconds>(end - start).count();
+    print("%-24s %12.1f %12.1f\n", name, double(cycles) / iterations, secs * 1e9 / iterations);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    bpo::options_description opts("perf_json_formatter options");
+    opts.add_options()
+            ("help", "show help message")
+            ("iterations", bpo::value<unsigned>()->default_value(1000000), "Number of values to format")
+            ;
+    bpo::variables_map vm;
+    bpo::store(bpo::parse_command_line(ac, av, opts), vm);
+    bpo::notify(vm);
+    if (vm.count("help")) {
+        std::cout << opts << "\n";
+        return 1;
+    }
+    auto iterations = vm["iterations"].as<unsigned>();
+
+    // Latencies and rates as metrics carry them, and integers of all sizes
+    std::mt19937_64 rng(1);
+    std::vector<double> doubles(4096);
+    std::vector<long> longs(4096);
+    for (size_t i = 0; i < doubles.size(); ++i) {
+        doubles[i] = std::exp(std::uniform_real_distribution<double>(-10, 30)(rng));
+        longs[i] = long(rng() >> (rng() % 64));
+    }
+    auto mask = doubles.size() - 1;
+
+    print("%-24s %12s %12s\n", "test", "cycles/iter", "ns/iter");
+
+    volatile size_t sink = 0;
+    char buf[64];
+    measure("double (%g)", iterations, [&] (unsigned i) {
+        sink += snprintf(buf, sizeof(buf), "%g", doubles[i & mask]);
+    });
+    measure("double (%.17g)", iterations, [&] (unsigned i) {
+        sink += snprintf(buf, sizeof(buf), "%.17g", doubles[i & mask]);
+    });
+    measure("double", iterations, [&] (unsigned i) {
+        sink += json::formatter::to_json(doubles[i & mask]).size();
+    });
+    measure("long (std::to_string)", iterations, [&] (unsigned i) {
+        auto s = std::to_string(longs[i & mask]);
+        sink += sstring(s.data(), s.size()).size();
+    });
+    measure("long", iterations, [&] (unsigned i) {
+        sink += json::formatter::to_json(longs[i & mask]).size();
+    });
+
+    sstring plain(sstring::initialized_later(), 256);
+    std::fill(plain.begin(), plain.end(), 'x');
+    measure("string (256 bytes)", iterations, [&] (unsigned) {
+        sink += json::formatter::to_json(plain).size();
+    });
+    auto escaped = plain;
+    for (size_t i = 0; i < escaped.size(); i += 32) {
+        escaped[i] = '"';
+    }
+    measure("string (8 escapes)", iterations, [&] (unsigned) {
+        sink += json::formatter::to_json(escaped).size();
+    });
+    return 0;
+}
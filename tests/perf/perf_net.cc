@@ -0,0 +1,499 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+// Network stack benchmarks, run with the same code over the native or the
+// posix stack (--network-stack):
+//
+//   rr      request/response ping-pong of --size bytes on open connections
+//   stream  the client sends --chunk sized writes, the server discards them
+//   maerts  the server sends, the client discards
+//   crr     connect, one request/response, close
+//   scale   rr with 1, 2, 4 ... --conn connections per cpu
+//
+// --mode server and --mode client run the two sides in separate processes,
+// e.g. over a real NIC; --mode loopback runs both in one, which needs the
+// posix stack. Every cpu reports its rate and how much of its time the
+// reactor was busy, per byte or per transaction; the server reports once
+// it has had no connections for a second.
+
+#include "../../core/reactor.hh"
+#include "../../core/app-template.hh"
+#include "../../core/future-util.hh"
+#include "../../core/distributed.hh"
+#include "../../core/print.hh"
+#include "../../core/sleep.hh"
+#include "../../util/latency_histogram.hh"
+#include <boost/range/irange.hpp>
+#include <boost/iterator/counting_iterator.hpp>
+#include <chrono>
+#include <string>
+
+using namespace net;
+using namespace seastar;
+using clock_type = std::chrono::steady_clock;
+
+// Sent by the client when it connects: the test, then the size of the
+// requests (rr, crr) or of the writes (stream, maerts), big endian
+struct test_header {
+    char test;
+    uint32_t size;
+} __attribute__((packed));
+
+struct shard_stats {
+    uint64_t bytes = 0;
+    uint64_t transactions = 0;
+    uint64_t connections = 0;
+    clock_type::duration elapsed{};
+    // Reactor busy time, whether it polled or slept when idle
+    clock_type::duration busy{};
+    latency_histogram latency;
+
+    shard_stats& operator+=(const shard_stats& o) {
+        bytes += o.bytes;
+        transactions += o.transactions;
+        connections += o.connections;
+        elapsed = std::max(elapsed, o.elapsed);
+        busy += o.busy;
+        latency += o.latency;
+        return *this;
+    }
+};
+
+static double seconds(clock_type::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+static void report(const char* who, const std::string& test, const shard_stats& s) {
+    auto secs = seconds(s.elapsed);
+    auto busy_ns = std::chrono::duration<double, std::nano>(s.busy).count();
+    auto line = sprint("%-10s %8.1f MB/s %10.1f tps %8.1f conn/s  busy %5.1f%%", who,
+            s.bytes / secs / 1e6, s.transactions / secs, s.connections / secs,
+            100 * seconds(s.busy) / secs);
+    if (test == "stream" || test == "maerts") {
+        line += sprint("  %.3f busy ns/byte", s.bytes ? busy_ns / s.bytes : 0.);
+    } else if (s.transactions) {
+        line += sprint("  %.0f busy ns/transaction", busy_ns / s.transactions);
+    }
+    print("%s\n", line);
+}
+
+static void report_latency(const shard_stats& s) {
+    auto& h = s.latency;
+    if (h.count()) {
+        print("latency (us): p50 %u, p99 %u, p999 %u, max %u\n",
+                h.quantile(0.5), h.quantile(0.99), h.quantile(0.999), h.max());
+    }
+}
+
+struct connection {
+    connected_socket fd;
+    input_stream<char> in;
+    output_stream<char> out;
+
+    explicit connection(connected_socket s)
+        : fd(std::move(s)), in(fd.input()), out(fd.output()) {
+        fd.set_nodelay(true);
+    }
+};
+
+class bench_server {
+    uint16_t _port;
+    lw_shared_ptr<server_socket> _listener;
+    unsigned _active = 0;
+    shard_stats _stats;
+    clock_type::time_point _started;
+    clock_type::duration _busy_at_start;
+    std::string _test;
+    // Reports the burst of connections once none came for a while
+    timer<> _idle_timer;
+    bool _stopped = false;
+private:
+    future<> rr(connection& c, size_t size) {
+        return repeat([this, &c, size] {
+            return c.in.read_exactly(size).then([this, &c, size] (temporary_buffer<char> buf) {
+                if (buf.size() != size) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return c.out.write(std::move(buf)).then([&c] {
+                    return c.out.flush();
+                }).then([this, size] {
+                    _stats.transactions++;
+                    _stats.bytes += 2 * size;
+                    return stop_iteration::no;
+                });
+            });
+        });
+    }
+
+    future<> stream(connection& c) {
+        return repeat([this, &c] {
+            return c.in.read().then([this] (temporary_buffer<char> buf) {
+                _stats.bytes += buf.size();
+                return stop_iteration(buf.empty());
+            });
+        });
+    }
+
+    // Sends until the client shuts its side down
+    future<> maerts(connection& c, size_t size) {
+        return do_with(false, std::string(size, 'x'), [this, &c] (bool& done, std::string& chunk) {
+            auto reader = c.in.read().then([&done] (temporary_buffer<char>) {
+                done = true;
+            });
+            auto writer = do_until([&done] { return done; }, [this, &c, &chunk] {
+                return c.out.write(chunk.data(), chunk.size()).then([this, &chunk] {
+                    _stats.bytes += chunk.size();
+                });
+            }).then([&c] {
+                return c.out.flush();
+            });
+            return when_all(std::move(reader), std::move(writer)).then([] (std::tuple<future<>, future<>> done) {
+                // A write fails if the client resets rather than shuts down
+                std::get<0>(done).ignore_ready_future();
+                std::get<1>(done).ignore_ready_future();
+            });
+        });
+    }
+
+    future<> serve(connection& c) {
+        return c.in.read_exactly(sizeof(test_header)).then([this, &c] (temporary_buffer<char> buf) {
+            if (buf.size() != sizeof(test_header)) {
+                return make_ready_future<>();
+            }
+            auto hdr = *reinterpret_cast<const test_header*>(buf.get());
+            auto size = ntohl(hdr.size);
+            switch (hdr.test) {
+            case 'r':
+                _test = "rr";
+                return rr(c, size);
+            case 's':
+                _test = "stream";
+                return stream(c);
+            case 'm':
+                _test = "maerts";
+                return maerts(c, size);
+            default:
+                return make_ready_future<>();
+            }
+        }).finally([&c] {
+            return c.out.close();
+        });
+    }
+
+    void connected() {
+        if (!_active++ && !_idle_timer.cancel()) {
+            _stats = shard_stats();
+            _started = clock_type::now();
+            _busy_at_start = engine().total_busy_time();
+        }
+        _stats.connections++;
+    }
+
+    void disconnected() {
+        if (!--_active) {
+            _stats.elapsed = clock_type::now() - _started;
+            _stats.busy = engine().total_busy_time() - _busy_at_start;
+            _idle_timer.arm(std::chrono::seconds(1));
+        }
+    }
+public:
+    explicit bench_server(uint16_t port)
+        : _port(port)
+        , _idle_timer([this] {
+            report(sprint("server %u", engine().cpu_id()).c_str(), _test, _stats);
+        }) {
+    }
+
+    void start() {
+        listen_options lo;
+        lo.reuse_address = true;
+        _listener = engine().listen(make_ipv4_address({_port}), lo);
+        keep_doing([this] {
+            return _listener->accept().then([this] (connected_socket fd, socket_address) {
+                auto c = make_lw_shared<connection>(std::move(fd));
+                connected();
+                serve(*c).handle_exception([] (auto ep) {
+                    // The client went away
+                }).finally([this, c] {
+                    disconnected();
+                });
+            });
+        }).handle_exception([this] (std::exception_ptr ep) {
+            if (!_stopped) {
+                try {
+                    std::rethrow_exception(ep);
+                } catch (std::exception& e) {
+                    print("accept failed on cpu %u: %s\n", engine().cpu_id(), e.what());
+                }
+            }
+        });
+    }
+
+    future<> stop() {
+        _stopped = true;
+        _idle_timer.cancel();
+        if (_listener) {
+            _listener->abort_accept();
+        }
+        return make_ready_future<>();
+    }
+};
+
+struct client_config {
+    ipv4_addr server;
+    unsigned duration;
+    size_t size;
+    size_t chunk;
+};
+
+class bench_client {
+    client_config _config;
+    std::string _payload;
+    clock_type::time_point _end;
+    shard_stats _stats;
+private:
+    future<lw_shared_ptr<connection>> connect(char test, size_t size) {
+        return engine().net().connect(make_ipv4_address(_config.server)).then([test, size] (connected_socket fd) {
+            auto c = make_lw_shared<connection>(std::move(fd));
+            test_header hdr;
+            hdr.test = test;
+            hdr.size = htonl(size);
+            return c->out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr)).then([c] {
+                return c->out.flush();
+            }).then([c] {
+                return c;
+            });
+        });
+    }
+
+    future<> exchange(connection& c) {
+        auto sent = clock_type::now();
+        return c.out.write(_payload.data(), _config.size).then([&c] {
+            return c.out.flush();
+        }).then([this, &c] {
+            return c.in.read_exactly(_config.size);
+        }).then([this, sent] (temporary_buffer<char> buf) {
+            if (buf.size() != _config.size) {
+                throw std::runtime_error("connection closed by the server");
+            }
+            _stats.transactions++;
+            _stats.bytes += 2 * _config.size;
+            _stats.latency.add(clock_type::now() - sent);
+        });
+    }
+
+    future<> rr(connection& c) {
+        return do_until([this] { return clock_type::now() >= _end; }, [this, &c] {
+            return exchange(c);
+        });
+    }
+
+    future<> stream(connection& c) {
+        return do_until([this] { return clock_type::now() >= _end; }, [this, &c] {
+            return c.out.write(_payload.data(), _config.chunk).then([this] {
+                _stats.bytes += _config.chunk;
+            });
+        });
+    }
+
+    future<> maerts(connection& c) {
+        return do_with(false, [this, &c] (bool& eof) {
+            return do_until([this, &eof] { return eof || clock_type::now() >= _end; }, [this, &c, &eof] {
+                return c.in.read().then([this, &eof] (temporary_buffer<char> buf) {
+                    _stats.bytes += buf.size();
+                    eof = buf.empty();
+                });
+            }).then([&c] {
+                // Tells the server to stop, then drains what it sent meanwhile
+                return c.out.close();
+            }).then([&c] {
+                return repeat([&c] {
+                    return c.in.read().then([] (temporary_buffer<char> buf) {
+                        return stop_iteration(buf.empty());
+                    });
+                });
+            });
+        });
+    }
+
+    future<> crr() {
+        return do_until([this] { return clock_type::now() >= _end; }, [this] {
+            auto started = clock_type::now();
+            return connect('r', _config.size).then([this, started] (lw_shared_ptr<connection> c) {
+                return exchange(*c).then([c] {
+                    return c->out.close();
+                }).then([this, started] {
+                    // Counted from the connect
+                    _stats.connections++;
+                    _stats.latency.add(clock_type::now() - started);
+                });
+            });
+        });
+    }
+
+    future<> run_connections(char test, unsigned conns, std::function<future<> (connection&)> func) {
+        return parallel_for_each(boost::irange(0u, conns), [this, test, func] (unsigned) {
+            auto size = test == 'r' ? _config.size : _config.chunk;
+            return connect(test, size).then([this, func] (lw_shared_ptr<connection> c) {
+                _stats.connections++;
+                return func(*c).then([c] {
+                    return c->out.close();
+                }).finally([c] {});
+            });
+        });
+    }
+public:
+    explicit bench_client(client_config config)
+        : _config(config)
+        , _payload(std::max(config.size, config.chunk), 'x') {
+    }
+
+    future<> run(std::string test, unsigned conns) {
+        _stats = shard_stats();
+        auto started = clock_type::now();
+        auto busy = engine().total_busy_time();
+        _end = started + std::chrono::seconds(_config.duration);
+        future<> f = make_ready_future<>();
+        if (test == "rr") {
+            f = run_connections('r', conns, [this] (connection& c) { return rr(c); });
+        } else if (test == "stream") {
+            f = run_connections('s', conns, [this] (connection& c) { return stream(c); });
+        } else if (test == "maerts") {
+            f = run_connections('m', conns, [this] (connection& c) { return maerts(c); });
+        } else {
+            f = parallel_for_each(boost::irange(0u, conns), [this] (unsigned) {
+                return crr();
+            });
+        }
+        return f.then([this, started, busy] {
+            _stats.elapsed = clock_type::now() - started;
+            _stats.busy = engine().total_busy_time() - busy;
+        });
+    }
+
+    future<shard_stats> stats() {
+        return make_ready_future<shard_stats>(_stats);
+    }
+
+    future<> stop() {
+        return make_ready_future<>();
+    }
+};
+
+static future<> run_client(distributed<bench_client>& clients, std::string test, unsigned conns) {
+    return clients.invoke_on_all(&bench_client::run, test, conns).then([&clients, test, conns] {
+        print("========== %s, %u connections per cpu ==========\n", test, conns);
+        return do_for_each(boost::counting_iterator<unsigned>(0), boost::counting_iterator<unsigned>(smp::count), [&clients, test] (unsigned cpu) {
+            return clients.invoke_on(cpu, &bench_client::stats).then([test, cpu] (shard_stats s) {
+                report(sprint("client %u", cpu).c_str(), test, s);
+            });
+        }).then([&clients, test] {
+            return clients.map_reduce(adder<shard_stats>(), &bench_client::stats).then([test] (shard_stats total) {
+                report("total", test, total);
+                report_latency(total);
+            });
+        });
+    });
+}
+
+namespace bpo = boost::program_options;
+
+int main(int ac, char** av) {
+    app_template app;
+    app.add_options()
+        ("mode", bpo::value<std::string>()->default_value("loopback"), "server, client, or loopback for both in one process")
+        ("server", bpo::value<std::string>()->default_value("127.0.0.1:10002"), "server address, for the client")
+        ("port", bpo::value<uint16_t>()->default_value(10002), "port to listen on, for the server")
+        ("test", bpo::value<std::string>()->default_value("rr"), "rr, stream, maerts, crr or scale")
+        ("conn", bpo::value<unsigned>()->default_value(1), "connections per cpu (for crr, concurrent connects; "
+                "for scale, the most)")
+        ("duration", bpo::value<unsigned>()->default_value(10), "seconds each test runs")
+        ("size", bpo::value<size_t>()->default_value(1), "bytes in each request and response of rr and crr")
+        ("chunk", bpo::value<size_t>()->default_value(65536), "bytes in each write of stream and maerts")
+        ;
+
+    return app.run(ac, av, [&app] () -> future<int> {
+        auto& config = app.configuration();
+        auto mode = config["mode"].as<std::string>();
+        auto test = config["test"].as<std::string>();
+        auto conns = config["conn"].as<unsigned>();
+        client_config cc;
+        cc.server = ipv4_addr(config["server"].as<std::string>());
+        cc.duration = config["duration"].as<unsigned>();
+        cc.size = config["size"].as<size_t>();
+        cc.chunk = config["chunk"].as<size_t>();
+        auto port = config["port"].as<uint16_t>();
+
+        if (mode != "server" && mode != "client" && mode != "loopback") {
+            print("Error: --mode needs to be server, client or loopback\n");
+            return make_ready_future<int>(1);
+        }
+        if (test != "rr" && test != "stream" && test != "maerts" && test != "crr" && test != "scale") {
+            print("Error: --test needs to be rr, stream, maerts, crr or scale\n");
+            return make_ready_future<int>(1);
+        }
+        if (!cc.size || !cc.chunk || !conns) {
+            print("Error: --size, --chunk and --conn need to be at least 1\n");
+            return make_ready_future<int>(1);
+        }
+        if (mode == "loopback") {
+            cc.server = ipv4_addr("127.0.0.1", port);
+        }
+
+        auto servers = make_lw_shared<distributed<bench_server>>();
+        auto clients = make_lw_shared<distributed<bench_client>>();
+        future<> started = make_ready_future<>();
+        if (mode != "client") {
+            started = servers->start(port).then([servers] {
+                return servers->invoke_on_all(&bench_server::start);
+            });
+        }
+        if (mode == "server") {
+            print("Serving on port %u; interrupt to exit\n", port);
+            return started.then([servers] {
+                // Runs until interrupted
+                return do_with(promise<int>(), [] (promise<int>& pr) {
+                    return pr.get_future();
+                });
+            });
+        }
+        return started.then([clients, cc] {
+            return clients->start(cc);
+        }).then([clients, test, conns] {
+            if (test != "scale") {
+                return run_client(*clients, test, conns);
+            }
+            return do_with(1u, [clients, conns] (unsigned& n) {
+                return do_until([&n, conns] { return n > conns; }, [clients, &n] {
+                    return run_client(*clients, "rr", n).then([&n] {
+                        n *= 2;
+                    });
+                });
+            });
+        }).then([clients, servers] {
+            return clients->stop().then([servers] {
+                return servers->stop();
+            });
+        }).then([clients, servers] {
+            return 0;
+        });
+    });
+}
@@ -0,0 +1,113 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Measures the throughput of the http request and memcached ASCII parsers,
+// and of the delimiter scan they use to skip through URIs, header values
+// and keys.  Build with -DSEASTAR_RAGEL_NO_SIMD_SCAN to compare against the
+// bytewise scan.
+
+#include "http/request_parser.hh"
+#include "apps/memcached/ascii.hh"
+#include "../../core/print.hh"
+#include <boost/program_options.hpp>
+#include <x86intrin.h>
+#include <chrono>
+#include <iostream>
+
+using fseconds = std::chrono::duration<float, std::ratio<1, 1>>;
+
+static const char http_request[] =
+        "GET /api/v1/storage/keyspaces/system/column_families/local/metrics?window=60s HTTP/1.1\r\n"
+        "Host: storage-node-17.example.com:10000\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/53.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, sdch\r\n"
+        "Accept-Language: en-US,en;q=0.8\r\n"
+        "Cookie: session=6c8b8d4e0a5a4f7e9a1f0c2d3b4e5f60718293a4b5c6d7e8f90a1b2c3d4e5f6\r\n"
+        "\r\n";
+
+static const char memcache_request[] =
+        "get user:profile:000000000000000000000042 user:settings:000000000000000000000042"
+        " user:sessions:000000000000000000000042\r\n";
+
+template <typename Func>
+void measure(const char* name, size_t bytes_per_iteration, unsigned iterations, Func&& func) {
+    auto start = std::chrono::steady_clock::now();
+    auto start_tsc = __rdtsc();
+    for (unsigned i = 0; i < iterations; ++i) {
+        func();
+    }
+    auto cycles = __rdtsc() - start_tsc;
+    auto end = std::chrono::steady_clock::now();
+    auto bytes = double(bytes_per_iteration) * iterations;
+    auto secs = std::chrono::duration_cast<fseconds>(end - start).count();
+    print("%-20s %12.3f %12.3f %12.1f\n", name, bytes / cycles, bytes / secs / 1e6, secs * 1e9 / iterations);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    bpo::options_description opts("perf_parsers options");
+    opts.add_options()
+            ("help", "show help message")
+            ("iterations", bpo::value<unsigned>()->default_value(1000000), "Number of requests to parse")
+            ;
+    bpo::variables_map vm;
+    bpo::store(bpo::parse_command_line(ac, av, opts), vm);
+    bpo::notify(vm);
+    if (vm.count("help")) {
+        std::cout << opts << "\n";
+        return 1;
+    }
+    auto iterations = vm["iterations"].as<unsigned>();
+
+    print("%-20s %12s %12s %12s\n", "test", "bytes/cycle", "MB/s", "ns/iter");
+
+    std::vector<char> line(4096, 'x');
+    line.back() = '\r';
+    volatile size_t sink = 0;
+    measure("scan (bytewise)", line.size(), iterations / 16, [&] {
+        sink += find_either_bytewise(line.data(), line.data() + line.size(), '\r', '\n') - line.data();
+    });
+    measure("scan", line.size(), iterations / 16, [&] {
+        sink += find_either(line.data(), line.data() + line.size(), '\r', '\n') - line.data();
+    });
+
+    http_request_parser http;
+    auto http_len = sizeof(http_request) - 1;
+    measure("http request", http_len, iterations, [&] {
+        http.init();
+        auto r = http(temporary_buffer<char>(http_request, http_len)).get0();
+        if (!r || !http._req) {
+            throw std::runtime_error("failed to parse http request");
+        }
+    });
+
+    memcache_ascii_parser mc;
+    auto mc_len = sizeof(memcache_request) - 1;
+    measure("memcache get", mc_len, iterations, [&] {
+        mc.init();
+        mc(temporary_buffer<char>(memcache_request, mc_len)).get0();
+        if (mc._state != memcache_ascii_parser::state::cmd_get || mc._keys.size() != 3) {
+            throw std::runtime_error("failed to parse memcache request");
+        }
+    });
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Compares waking semaphore waiters through futures and continuations
+// with waking them through semaphore_waiter.
+
+#include "../../core/reactor.hh"
+#include "../../core/semaphore.hh"
+#include "../../core/future-util.hh"
+#include "../../core/app-template.hh"
+#include "../../core/print.hh"
+#include <boost/iterator/counting_iterator.hpp>
+#include <chrono>
+
+using fseconds = std::chrono::duration<float, std::ratio<1, 1>>;
+
+struct counting_waiter : semaphore_waiter {
+    unsigned& woken;
+    explicit counting_waiter(unsigned& w) : woken(w) {}
+    virtual void wake() noexcept override { ++woken; }
+    virtual void fail(std::exception_ptr) noexcept override { abort(); }
+};
+
+int main(int ac, char** av) {
+    app_template at;
+    namespace bpo = boost::program_options;
+    at.add_options()
+            ("waiters", bpo::value<unsigned>()->default_value(128), "Waiters queued before each signal")
+            ("rounds", bpo::value<unsigned>()->default_value(100000), "Number of rounds")
+            ;
+    return at.run(ac, av, [&at] {
+        auto n_waiters = at.configuration()["waiters"].as<unsigned>();
+        auto rounds = at.configuration()["rounds"].as<unsigned>();
+        return do_with(semaphore(0), unsigned(0), [=] (semaphore& sem, unsigned& woken) {
+            auto start = std::chrono::steady_clock::now();
+            return do_for_each(boost::counting_iterator<unsigned>(0), boost::counting_iterator<unsigned>(rounds), [&sem, &woken, n_waiters] (unsigned) {
+                for (unsigned i = 0; i < n_waiters; ++i) {
+                    sem.wait().then([&woken] { ++woken; });
+                }
+                sem.signal(n_waiters);
+                // Let the continuations run.
+                return later();
+            }).then([=, &sem, &woken] {
+                auto end = std::chrono::steady_clock::now();
+                auto secs = std::chrono::duration_cast<fseconds>(end - start).count();
+                print("%-12s %12d %14.1f\n", "future", woken, secs * 1e9 / woken);
+                woken = 0;
+                auto waiters = std::make_unique<std::vector<counting_waiter>>(n_waiters, counting_waiter(woken));
+                auto waiter_start = std::chrono::steady_clock::now();
+                return do_for_each(boost::counting_iterator<unsigned>(0), boost::counting_iterator<unsigned>(rounds), [&sem, &waiters = *waiters, n_waiters] (unsigned) {
+                    for (auto& w : waiters) {
+                        sem.wait(w);
+                    }
+                    sem.signal(n_waiters);
+                    return later();
+                }).then([=, &woken, waiters = std::move(waiters)] {
+                    auto end = std::chrono::steady_clock::now();
+                    auto secs = std::chrono::duration_cast<fseconds>(end - waiter_start).count();
+                    print("%-12s %12d %14.1f\n", "waiter", woken, secs * 1e9 / woken);
+                });
+            });
+        });
+    });
+}
@@ -0,0 +1,297 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "perf_tests.hh"
+#include "../../core/reactor.hh"
+#include "../../core/app-template.hh"
+#include "../../core/memory.hh"
+#include "../../core/print.hh"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <regex>
+#include <vector>
+
+namespace perf_tests {
+namespace internal {
+
+static std::vector<std::unique_ptr<performance_test>>& all_tests() {
+    static std::vector<std::unique_ptr<performance_test>> tests;
+    return tests;
+}
+
+void register_test(std::unique_ptr<performance_test> test) {
+    all_tests().push_back(std::move(test));
+}
+
+// Instructions retired by the calling thread, in user space. Unavailable
+// when the kernel doesn't allow it (perf_event_paranoid) or in VMs without
+// a virtual PMU.
+class instructions_counter {
+    int _fd = -1;
+public:
+    instructions_counter() {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (_fd >= 0) {
+            ::ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    instructions_counter(instructions_counter&& o) noexcept : _fd(o._fd) {
+        o._fd = -1;
+    }
+    ~instructions_counter() {
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+    bool available() const {
+        return _fd >= 0;
+    }
+    uint64_t read() const {
+        uint64_t count = 0;
+        if (_fd < 0 || ::read(_fd, &count, sizeof(count)) != sizeof(count)) {
+            return 0;
+        }
+        return count;
+    }
+};
+
+struct run_result {
+    double ns_per_op;
+    double allocs_per_op;
+    double instructions_per_op;
+};
+
+struct test_result {
+    std::string group;
+    std::string name;
+    uint64_t iterations;
+    unsigned runs;
+    double median;
+    double mean;
+    // Half-width of the 95% confidence interval of the mean
+    double ci;
+    double min;
+    double allocs_per_op;
+    double instructions_per_op;
+};
+
+struct config {
+    std::chrono::steady_clock::duration run_time;
+    unsigned min_runs;
+    unsigned max_runs;
+    double precision;
+};
+
+// Student's t for a two-sided 95% interval, by degrees of freedom
+static double t_95(unsigned df) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (df == 0) {
+        return INFINITY;
+    }
+    return df <= 30 ? table[df - 1] : 1.96;
+}
+
+static future<run_result> run_once(performance_test& test, uint64_t iterations, instructions_counter& instructions) {
+    auto mallocs = memory::stats().mallocs();
+    auto insns = instructions.read();
+    auto start = std::chrono::steady_clock::now();
+    return test.run(iterations).then([iterations, mallocs, insns, start, &instructions] {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        run_result r;
+        r.ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+        r.allocs_per_op = double(memory::stats().mallocs() - mallocs) / iterations;
+        r.instructions_per_op = double(instructions.read() - insns) / iterations;
+        return r;
+    });
+}
+
+// Doubles the iterations until a run lasts the configured run time
+static future<uint64_t> calibrate(performance_test& test, const config& cfg, instructions_counter& instructions) {
+    return do_with(uint64_t(1), false, [&test, &cfg, &instructions] (uint64_t& iterations, bool& done) {
+        return do_until([&done] { return done; }, [&test, &cfg, &instructions, &iterations, &done] {
+            auto start = std::chrono::steady_clock::now();
+            return run_once(test, iterations, instructions).then([&cfg, &iterations, &done, start] (run_result) {
+                if (std::chrono::steady_clock::now() - start >= cfg.run_time) {
+                    done = true;
+                } else {
+                    iterations *= 2;
+                }
+            });
+        }).then([&iterations] {
+            return iterations;
+        });
+    });
+}
+
+static test_result summarize(performance_test& test, uint64_t iterations, const std::vector<run_result>& runs) {
+    test_result res;
+    res.group = test.group();
+    res.name = test.name();
+    res.iterations = iterations;
+    res.runs = runs.size();
+    std::vector<double> ns;
+    double allocs = 0, insns = 0;
+    for (auto& r : runs) {
+        ns.push_back(r.ns_per_op);
+        allocs += r.allocs_per_op;
+        insns += r.instructions_per_op;
+    }
+    std::sort(ns.begin(), ns.end());
+    res.median = ns[ns.size() / 2];
+    res.min = ns.front();
+    res.mean = 0;
+    for (auto v : ns) {
+        res.mean += v;
+    }
+    res.mean /= ns.size();
+    double var = 0;
+    for (auto v : ns) {
+        var += (v - res.mean) * (v - res.mean);
+    }
+    var /= std::max<size_t>(ns.size() - 1, 1);
+    res.ci = t_95(ns.size() - 1) * std::sqrt(var / ns.size());
+    res.allocs_per_op = allocs / runs.size();
+    res.instructions_per_op = insns / runs.size();
+    return res;
+}
+
+static future<test_result> run_test(performance_test& test, const config& cfg, instructions_counter& instructions) {
+    test.set_up();
+    return calibrate(test, cfg, instructions).then([&test, &cfg, &instructions] (uint64_t iterations) {
+        return do_with(std::vector<run_result>(), [&test, &cfg, &instructions, iterations] (std::vector<run_result>& runs) {
+            return do_until([&test, &cfg, &runs, iterations] {
+                if (runs.size() < cfg.min_runs) {
+                    return false;
+                }
+                if (runs.size() >= cfg.max_runs) {
+                    return true;
+                }
+                auto res = summarize(test, iterations, runs);
+                return res.ci <= res.mean * cfg.precision;
+            }, [&test, &instructions, &runs, iterations] {
+                return run_once(test, iterations, instructions).then([&runs] (run_result r) {
+                    runs.push_back(r);
+                });
+            }).then([&test, &runs, iterations] {
+                return summarize(test, iterations, runs);
+            });
+        });
+    }).finally([&test] {
+        test.tear_down();
+    });
+}
+
+static void write_json(const std::string& path, const std::vector<test_result>& results, bool with_instructions) {
+    std::ofstream out(path);
+    out << "{\n  \"results\": [";
+    for (unsigned i = 0; i < results.size(); ++i) {
+        auto& r = results[i];
+        out << (i ? ",\n" : "\n");
+        out << sprint("    {\"group\": \"%s\", \"test\": \"%s\", \"iterations\": %u, \"runs\": %u, "
+                "\"ns_per_op\": {\"median\": %.3f, \"mean\": %.3f, \"ci95\": %.3f, \"min\": %.3f}, "
+                "\"allocs_per_op\": %.3f",
+                r.group, r.name, r.iterations, r.runs, r.median, r.mean, r.ci, r.min, r.allocs_per_op);
+        if (with_instructions) {
+            out << sprint(", \"instructions_per_op\": %.1f", r.instructions_per_op);
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    if (!out) {
+        throw std::runtime_error(sprint("failed to write %s", path));
+    }
+}
+
+}
+}
+
+int main(int ac, char** av) {
+    using namespace perf_tests::internal;
+    app_template at;
+    namespace bpo = boost::program_options;
+    at.add_options()
+            ("test", bpo::value<std::string>()->default_value(".*"), "Regular expression the \"group.name\" of the tests to run must match")
+            ("list", "List the tests and exit")
+            ("run-time", bpo::value<unsigned>()->default_value(20), "Milliseconds each run of a test lasts at least")
+            ("min-runs", bpo::value<unsigned>()->default_value(5), "Runs of each test at least")
+            ("max-runs", bpo::value<unsigned>()->default_value(100), "Runs of each test at most")
+            ("precision", bpo::value<double>()->default_value(0.01), "Runs stop once the 95% confidence interval of the mean is within this fraction of it")
+            ("json-output", bpo::value<std::string>(), "Also write the results to this file, as JSON")
+            ;
+    return at.run(ac, av, [&at] {
+        auto& opts = at.configuration();
+        std::regex filter(opts["test"].as<std::string>());
+        std::vector<performance_test*> tests;
+        for (auto& t : all_tests()) {
+            if (std::regex_match(t->group() + "." + t->name(), filter)) {
+                tests.push_back(t.get());
+            }
+        }
+        if (opts.count("list")) {
+            for (auto t : tests) {
+                print("%s.%s\n", t->group(), t->name());
+            }
+            return make_ready_future<>();
+        }
+        config cfg;
+        cfg.run_time = std::chrono::milliseconds(opts["run-time"].as<unsigned>());
+        cfg.min_runs = std::max(opts["min-runs"].as<unsigned>(), 2u);
+        cfg.max_runs = std::max(opts["max-runs"].as<unsigned>(), cfg.min_runs);
+        cfg.precision = opts["precision"].as<double>();
+        std::experimental::optional<std::string> json;
+        if (opts.count("json-output")) {
+            json = opts["json-output"].as<std::string>();
+        }
+        print("%-40s %12s %6s %12s %9s %10s %10s\n", "test", "iterations", "runs", "median ns", "+-", "allocs", "insns");
+        return do_with(std::move(tests), std::vector<test_result>(), std::move(cfg), instructions_counter(),
+                [json] (auto& tests, auto& results, auto& cfg, auto& instructions) {
+            return do_for_each(tests, [&results, &cfg, &instructions] (performance_test* t) {
+                return run_test(*t, cfg, instructions).then([&results, &instructions] (test_result r) {
+                    print("%-40s %12u %6u %12.3f %8.2f%% %10.3f %10s\n", r.group + "." + r.name, r.iterations, r.runs,
+                            r.median, r.ci / r.mean * 100, r.allocs_per_op,
+                            instructions.available() ? sprint("%.1f", r.instructions_per_op) : std::string("-"));
+                    results.push_back(std::move(r));
+                });
+            }).then([json, &results, &instructions] {
+                if (json) {
+                    write_json(*json, results, instructions.available());
+                }
+            });
+        });
+    });
+}
@@ -0,0 +1,139 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+// Microbenchmarks. A test is a body run once per iteration, either plain
+// code or returning a future that the next iteration waits for:
+//
+//   PERF_TEST(future, ready_then) {
+//       return make_ready_future<>().then([] {});
+//   }
+//
+// PERF_TEST_F(fixture, name) runs the body as a member of a class derived
+// from fixture, constructed once before the test's runs, so that state such
+// as a semaphore is kept across iterations.
+//
+// The runner (perf_tests.cc provides main()) calibrates the iterations of
+// a run to last --run-time, then repeats runs until the 95% confidence
+// interval of the time per iteration is within --precision of the mean.
+// It reports nanoseconds, allocations and instructions per iteration, and
+// can write them as JSON to track regressions. The loop calling the body
+// is measured along with it.
+
+#include "../../core/future.hh"
+#include "../../core/future-util.hh"
+#include <experimental/optional>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+namespace perf_tests {
+
+// Keeps the compiler from optimizing away a value the test computes
+template <typename T>
+inline void do_not_optimize(const T& v) {
+    asm volatile("" : : "r,m"(v) : "memory");
+}
+
+namespace internal {
+
+class performance_test {
+    std::string _group;
+    std::string _name;
+public:
+    performance_test(std::string group, std::string name)
+        : _group(std::move(group)), _name(std::move(name)) {}
+    virtual ~performance_test() {}
+
+    const std::string& group() const { return _group; }
+    const std::string& name() const { return _name; }
+
+    virtual void set_up() = 0;
+    virtual void tear_down() = 0;
+    virtual future<> run(uint64_t iterations) = 0;
+};
+
+void register_test(std::unique_ptr<performance_test> test);
+
+template <typename Test>
+class concrete_performance_test final : public performance_test {
+    std::experimental::optional<Test> _test;
+private:
+    future<> run(uint64_t iterations, std::true_type /* returns void */) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            _test->run();
+        }
+        return make_ready_future<>();
+    }
+
+    future<> run(uint64_t iterations, std::false_type /* returns a future */) {
+        return do_with(uint64_t(0), [this, iterations] (uint64_t& i) {
+            return do_until([&i, iterations] { return i == iterations; }, [this, &i] {
+                ++i;
+                return _test->run();
+            });
+        });
+    }
+public:
+    using performance_test::performance_test;
+
+    virtual void set_up() override {
+        _test.emplace();
+    }
+
+    virtual void tear_down() override {
+        _test = {};
+    }
+
+    virtual future<> run(uint64_t iterations) override {
+        return run(iterations, std::is_void<decltype(_test->run())>());
+    }
+};
+
+template <typename Test>
+struct test_registrar {
+    test_registrar(const char* group, const char* name) {
+        register_test(std::make_unique<concrete_performance_test<Test>>(group, name));
+    }
+};
+
+struct empty_fixture {};
+
+}
+
+}
+
+#define PERF_TEST_F(fixture, name) \
+    struct fixture##_##name : fixture { \
+        auto run(); \
+    }; \
+    static ::perf_tests::internal::test_registrar<fixture##_##name> \
+        fixture##_##name##_registrar(#fixture, #name); \
+    auto fixture##_##name::run()
+
+#define PERF_TEST(group, name) \
+    struct group##_##name : ::perf_tests::internal::empty_fixture { \
+        auto run(); \
+    }; \
+    static ::perf_tests::internal::test_registrar<group##_##name> \
+        group##_##name##_registrar(#group, #name); \
+    auto group##_##name::run()
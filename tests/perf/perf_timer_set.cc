@@ -0,0 +1,122 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Compares timer_set and timer_wheel on a workload of many timers where
+// most are cancelled and re-armed before they fire, like TCP retransmit
+// timers or memcached item expiry.
+
+#include "../../core/timer-set.hh"
+#include "../../core/timer-wheel.hh"
+#include "../../core/print.hh"
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+
+struct test_timer {
+    using clock = std::chrono::steady_clock;
+    using duration = std::chrono::milliseconds;
+    using time_point = std::chrono::time_point<clock, duration>;
+
+    bi::list_member_hook<> _link;
+    time_point _timeout;
+    bool _armed = false;
+
+    time_point get_timeout() { return _timeout; }
+    bool cancel() { _armed = false; return false; }
+};
+
+using fseconds = std::chrono::duration<float, std::ratio<1, 1>>;
+
+template <typename Set>
+void run(const char* name, unsigned n_timers, unsigned n_rounds, unsigned max_delay_ms) {
+    std::vector<test_timer> timers(n_timers);
+    std::default_random_engine rng;
+    std::uniform_int_distribution<unsigned> delay(1, max_delay_ms);
+    std::uniform_int_distribution<unsigned> pick(0, n_timers - 1);
+    Set set;
+    unsigned long now = 1;
+    auto arm = [&] (test_timer& t) {
+        t._timeout = test_timer::time_point(test_timer::duration(now + delay(rng)));
+        t._armed = true;
+        set.insert(t);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto& t : timers) {
+        arm(t);
+    }
+    auto armed = std::chrono::steady_clock::now();
+
+    unsigned long expired = 0;
+    for (unsigned round = 0; round < n_rounds; ++round) {
+        // Re-arm a fraction of the timers, as a busy connection would.
+        for (unsigned i = 0; i < n_timers / 16; ++i) {
+            auto& t = timers[pick(rng)];
+            if (t._armed) {
+                set.remove(t);
+            }
+            arm(t);
+        }
+        ++now;
+        auto exp = set.expire(test_timer::time_point(test_timer::duration(now)));
+        while (!exp.empty()) {
+            auto& t = *exp.begin();
+            exp.pop_front();
+            ++expired;
+            arm(t);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    print("%-12s %10d %10d %12.3f %12.3f %12d\n", name, n_timers, n_rounds,
+            std::chrono::duration_cast<fseconds>(armed - start).count(),
+            std::chrono::duration_cast<fseconds>(end - armed).count(),
+            expired);
+    set.clear();
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    bpo::options_description opts("perf_timer_set options");
+    opts.add_options()
+            ("help", "show help message")
+            ("timers", bpo::value<unsigned>()->default_value(1000000), "Number of armed timers")
+            ("rounds", bpo::value<unsigned>()->default_value(10000), "Number of 1ms clock ticks to simulate")
+            ("max-delay-ms", bpo::value<unsigned>()->default_value(30000), "Maximum timer delay")
+            ;
+    bpo::variables_map vm;
+    bpo::store(bpo::parse_command_line(ac, av, opts), vm);
+    bpo::notify(vm);
+    if (vm.count("help")) {
+        std::cout << opts << "\n";
+        return 1;
+    }
+    auto n_timers = vm["timers"].as<unsigned>();
+    auto n_rounds = vm["rounds"].as<unsigned>();
+    auto max_delay = vm["max-delay-ms"].as<unsigned>();
+
+    print("%-12s %10s %10s %12s %12s %12s\n", "impl", "timers", "rounds", "arm (s)", "run (s)", "expired");
+    run<seastar::timer_set<test_timer, &test_timer::_link>>("timer_set", n_timers, n_rounds, max_delay);
+    run<seastar::timer_wheel<test_timer, &test_timer::_link>>("timer_wheel", n_timers, n_rounds, max_delay);
+    return 0;
+}
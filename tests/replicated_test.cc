@@ -0,0 +1,96 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/replicated.hh"
+#include "core/do_with.hh"
+#include "tests/test-utils.hh"
+#include <boost/range/irange.hpp>
+
+using namespace seastar;
+
+struct routing_table {
+    std::vector<unsigned> routes;
+    static thread_local unsigned destroyed;
+    unsigned owner = engine().cpu_id();
+    ~routing_table() {
+        // Versions are destroyed on the shard that built them.
+        // Moved-from tables are empty; the published ones are not.
+        if (!routes.empty()) {
+            assert(engine().cpu_id() == owner);
+            ++destroyed;
+        }
+    }
+};
+
+thread_local unsigned routing_table::destroyed = 0;
+
+// The last shard to drop a version may not be its owner, in which case
+// the version is destroyed asynchronously.
+static future<> wait_for_destroyed(unsigned n) {
+    return do_until([n] { return routing_table::destroyed == n; }, [] { return later(); });
+}
+
+SEASTAR_TEST_CASE(test_replicated_publish) {
+    auto rp = make_shared<replicated<routing_table>>();
+    auto& r = *rp;
+    BOOST_REQUIRE(!r.local());
+    return r.publish(routing_table{{1, 2, 3}}).then([&r] {
+        return smp::invoke_on_all([&r] {
+            auto s = r.local();
+            BOOST_REQUIRE(s);
+            BOOST_REQUIRE(s->routes == std::vector<unsigned>({1, 2, 3}));
+        });
+    }).then([&r] {
+        auto old = r.local();
+        return r.publish(routing_table{{4}}).then([&r, old] {
+            // The old snapshot stays valid after the switch.
+            BOOST_REQUIRE_EQUAL(old->routes.size(), 3u);
+            BOOST_REQUIRE_EQUAL(r.local()->routes.size(), 1u);
+            BOOST_REQUIRE_GT(r.local().epoch(), old.epoch());
+            BOOST_REQUIRE_EQUAL(routing_table::destroyed, 0u);
+        });
+    }).then([] {
+        // The first version is gone now that its last snapshot is.
+        return wait_for_destroyed(1);
+    }).then([&r] {
+        return r.stop();
+    }).then([] {
+        return wait_for_destroyed(2);
+    }).finally([rp] {});
+}
+
+SEASTAR_TEST_CASE(test_replicated_publish_from_all_shards) {
+    auto rp = make_shared<replicated<routing_table>>();
+    auto& r = *rp;
+    return parallel_for_each(boost::irange(0u, smp::count), [&r] (unsigned c) {
+        return smp::submit_to(c, [&r, c] {
+            return r.publish(routing_table{{c}});
+        });
+    }).then([&r] {
+        // Every shard ends up on the same, latest, version.
+        return smp::invoke_on_all([&r, epoch = r.local().epoch(), route = r.local()->routes] {
+            BOOST_REQUIRE_EQUAL(r.local().epoch(), epoch);
+            BOOST_REQUIRE(r.local()->routes == route);
+        });
+    }).then([&r] {
+        return r.stop();
+    }).finally([rp] {});
+}
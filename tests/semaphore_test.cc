@@ -230,3 +230,76 @@ SEASTAR_TEST_CASE(test_with_semaphore) {
         });
     });
 }
+
+SEASTAR_TEST_CASE(test_semaphore_waiter) {
+    struct test_waiter : semaphore_waiter {
+        std::vector<int>& order;
+        int id;
+        bool failed = false;
+        test_waiter(std::vector<int>& o, int i) : order(o), id(i) {}
+        virtual void wake() noexcept override { order.push_back(id); }
+        virtual void fail(std::exception_ptr) noexcept override { failed = true; }
+    };
+    return do_with(semaphore(1), std::vector<int>(), [] (semaphore& sem, std::vector<int>& order) {
+        test_waiter w1(order, 1), w2(order, 2), w4(order, 4);
+        // Units are available: woken from within wait().
+        sem.wait(w1);
+        BOOST_REQUIRE(order == std::vector<int>({1}));
+        sem.wait(w2);
+        auto f = sem.wait().then([&order] { order.push_back(3); });
+        sem.wait(w4, 2);
+        BOOST_REQUIRE_EQUAL(sem.waiters(), 3u);
+        sem.signal();
+        BOOST_REQUIRE(order == std::vector<int>({1, 2}));
+        sem.signal(2);
+        BOOST_REQUIRE(!w4.failed);
+        sem.broken();
+        BOOST_REQUIRE(w4.failed);
+        return f.then([&order] {
+            BOOST_REQUIRE(order == std::vector<int>({1, 2, 3}));
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_semaphore_stats) {
+    return do_with(semaphore(1), [] (semaphore& sem) {
+        return sem.wait().then([&sem] {
+            auto f1 = sem.wait();
+            auto f2 = sem.wait(std::chrono::milliseconds(1));
+            BOOST_REQUIRE_EQUAL(sem.stats().waits, 3u);
+            BOOST_REQUIRE_EQUAL(sem.stats().blocked_waits, 2u);
+            BOOST_REQUIRE_EQUAL(sem.stats().max_waiters, 2u);
+            return f2.then_wrapped([&sem, f1 = std::move(f1)] (future<> f) mutable {
+                BOOST_REQUIRE_THROW(f.get(), semaphore_timed_out);
+                BOOST_REQUIRE_EQUAL(sem.stats().timeouts, 1u);
+                sem.signal();
+                return std::move(f1);
+            }).then([&sem] {
+                BOOST_REQUIRE_EQUAL(sem.waiters(), 0u);
+                BOOST_REQUIRE(sem.stats().time_waited >= std::chrono::milliseconds(1));
+            });
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_semaphore_batched_wakeups) {
+    return do_with(semaphore(0), std::vector<int>(), [] (semaphore& sem, std::vector<int>& order) {
+        sem.set_batched_wakeups(true);
+        std::vector<future<>> waits;
+        for (int i = 0; i < 4; ++i) {
+            waits.push_back(sem.wait().then([&order, i] { order.push_back(i); }));
+        }
+        // Queued before the signal, but runs after the released waiters.
+        auto other = later().then([&order] { order.push_back(-1); });
+        sem.signal(3);
+        BOOST_REQUIRE_EQUAL(sem.waiters(), 1u);
+        return other.then([&order, &sem] {
+            BOOST_REQUIRE(order == std::vector<int>({0, 1, 2, -1}));
+            sem.signal();
+        }).then([waits = std::move(waits)] () mutable {
+            return when_all(waits.begin(), waits.end()).discard_result();
+        }).then([&order] {
+            BOOST_REQUIRE(order == std::vector<int>({0, 1, 2, -1, 3}));
+        });
+    });
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/shard_channel.hh"
+#include "core/temporary_buffer.hh"
+#include "core/future-util.hh"
+#include "tests/test-utils.hh"
+#include <boost/iterator/counting_iterator.hpp>
+
+using namespace seastar;
+
+static unsigned other_shard() {
+    return (engine().cpu_id() + 1) % smp::count;
+}
+
+template <typename T, typename Consume>
+static future<> consume_all(shard_channel<T>& ch, Consume consume) {
+    return repeat([&ch, consume] () mutable {
+        return ch.pop_eventually().then([consume] (std::experimental::optional<T> item) mutable {
+            if (!item) {
+                return stop_iteration::yes;
+            }
+            consume(std::move(*item));
+            return stop_iteration::no;
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_shard_channel_order) {
+    static constexpr unsigned n = 10000;
+    auto ch = make_lw_shared<shard_channel<unsigned>>(other_shard(), 16);
+    auto producer = smp::submit_to(other_shard(), [&ch = *ch] {
+        return do_for_each(boost::counting_iterator<unsigned>(0), boost::counting_iterator<unsigned>(n), [&ch] (unsigned i) {
+            return ch.push_eventually(std::move(i));
+        }).then([&ch] {
+            return ch.close();
+        });
+    });
+    auto next = make_lw_shared<unsigned>(0);
+    return consume_all(*ch, [next] (unsigned i) {
+        BOOST_REQUIRE_EQUAL(i, (*next)++);
+    }).then([producer = std::move(producer)] () mutable {
+        return std::move(producer);
+    }).then([ch, next] {
+        BOOST_REQUIRE_EQUAL(*next, n);
+    });
+}
+
+SEASTAR_TEST_CASE(test_shard_channel_buffers) {
+    auto ch = make_lw_shared<shard_channel<temporary_buffer<char>>>(other_shard(), 4);
+    auto producer = smp::submit_to(other_shard(), [&ch = *ch] {
+        return do_for_each(boost::counting_iterator<unsigned>(0), boost::counting_iterator<unsigned>(100), [&ch] (unsigned i) {
+            temporary_buffer<char> buf(i + 1);
+            std::fill(buf.get_write(), buf.get_write() + buf.size(), char(i));
+            return ch.push_eventually(std::move(buf));
+        }).then([&ch] {
+            return ch.close();
+        });
+    });
+    auto next = make_lw_shared<unsigned>(0);
+    return consume_all(*ch, [next] (temporary_buffer<char> buf) {
+        auto i = (*next)++;
+        BOOST_REQUIRE_EQUAL(buf.size(), i + 1);
+        BOOST_REQUIRE(std::all_of(buf.begin(), buf.end(), [i] (char c) { return c == char(i); }));
+    }).then([producer = std::move(producer)] () mutable {
+        return std::move(producer);
+    }).then([ch, next] {
+        BOOST_REQUIRE_EQUAL(*next, 100u);
+    });
+}
@@ -0,0 +1,125 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+// Devices whose timing is driven by manual_clock, so that tests of the
+// scheduling built on top of them give the same results on every run and
+// machine. Call manual_clock::set_simulated(true) (or run with
+// --simulated-time) first, so that fair queues go by the same clock.
+
+#include "core/manual_clock.hh"
+#include "core/fair_queue.hh"
+#include "core/reactor.hh"
+#include "core/sleep.hh"
+#include "core/future-util.hh"
+#include <boost/iterator/counting_iterator.hpp>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+// How long an operation on size bytes takes: a fixed base, a cost per
+// byte, and up to jitter more, drawn from a seeded generator.
+class latency_model {
+    manual_clock::duration _base;
+    double _ns_per_byte;
+    manual_clock::duration _jitter;
+    std::mt19937 _rng;
+public:
+    latency_model(manual_clock::duration base, double ns_per_byte,
+            manual_clock::duration jitter = manual_clock::duration(0), unsigned seed = 0)
+        : _base(base), _ns_per_byte(ns_per_byte), _jitter(jitter), _rng(seed) {}
+    manual_clock::duration operator()(size_t size) {
+        auto d = _base + manual_clock::duration(manual_clock::rep(_ns_per_byte * size));
+        if (_jitter.count()) {
+            std::uniform_int_distribution<manual_clock::rep> dist(0, _jitter.count());
+            d += manual_clock::duration(dist(_rng));
+        }
+        return d;
+    }
+};
+
+// A disk serving up to capacity requests at once, through a fair_queue
+// weighted like the reactor's I/O queues.
+class simulated_disk {
+    fair_queue _fq;
+    latency_model _latency;
+public:
+    simulated_disk(unsigned capacity, latency_model latency)
+        : _fq(capacity), _latency(std::move(latency)) {}
+    priority_class_ptr register_priority_class(uint32_t shares) {
+        return _fq.register_priority_class(shares);
+    }
+    fair_queue& queue() {
+        return _fq;
+    }
+    future<> submit(priority_class_ptr pc, size_t size) {
+        return _fq.queue(pc, 1 + float(size) / (16 << 10), size, [this, size] {
+            return sleep<manual_clock>(_latency(size));
+        });
+    }
+};
+
+// A link of the given bandwidth and propagation delay, in front of which
+// at most queue_limit bytes wait to be sent; packets that don't fit are
+// dropped, as by a tail-drop router queue.
+class simulated_link {
+    double _bytes_per_ns;
+    manual_clock::duration _delay;
+    size_t _queue_limit;
+    manual_clock::time_point _busy_until;
+    uint64_t _dropped = 0;
+public:
+    simulated_link(double bytes_per_second, manual_clock::duration delay, size_t queue_limit)
+        : _bytes_per_ns(bytes_per_second / 1e9), _delay(delay), _queue_limit(queue_limit) {}
+    // Resolves to true when the packet arrives at the other end, or at once
+    // to false when it is dropped.
+    future<bool> send(size_t size) {
+        auto now = manual_clock::now();
+        auto start = std::max(now, _busy_until);
+        auto backlog = size_t((start - now).count() * _bytes_per_ns);
+        if (backlog + size > _queue_limit) {
+            ++_dropped;
+            return make_ready_future<bool>(false);
+        }
+        _busy_until = start + manual_clock::duration(manual_clock::rep(size / _bytes_per_ns));
+        return sleep<manual_clock>(_busy_until + _delay - now).then([] {
+            return true;
+        });
+    }
+    uint64_t dropped() const {
+        return _dropped;
+    }
+};
+
+// Advances manual_clock by total, step at a time, letting the
+// continuations each step wakes run before the next one.
+inline future<> run_simulation(manual_clock::duration total, manual_clock::duration step) {
+    return do_with(manual_clock::now() + total, [step] (manual_clock::time_point& end) {
+        return do_until([&end] { return manual_clock::now() >= end; }, [&end, step] {
+            manual_clock::advance(std::min(step, end - manual_clock::now()));
+            // Deep enough for a completion to wake the request queued behind it
+            return do_for_each(boost::counting_iterator<int>(0), boost::counting_iterator<int>(16), [] (int) {
+                return later();
+            });
+        });
+    });
+}
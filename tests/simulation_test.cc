@@ -0,0 +1,112 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "tests/simulation.hh"
+#include "tests/test-utils.hh"
+#include "core/lowres_clock.hh"
+#include <vector>
+
+using namespace std::chrono_literals;
+
+SEASTAR_TEST_CASE(test_lowres_clock_follows_manual_clock) {
+    manual_clock::set_simulated(true);
+    auto before = lowres_clock::now();
+    manual_clock::advance(1s);
+    BOOST_REQUIRE_EQUAL((lowres_clock::now() - before).count(), 1000);
+    return make_ready_future<>();
+}
+
+struct disk_run {
+    std::vector<unsigned> halfway;
+    std::vector<unsigned> total;
+};
+
+// Two classes with shares 1:2 each queue 300 requests on a disk serving
+// one at a time in 100us; halfway through, the second class should have
+// had about twice the service.
+static future<disk_run> run_shares_scenario() {
+    manual_clock::set_simulated(true);
+    auto disk = make_lw_shared<simulated_disk>(1, latency_model(100us, 0));
+    auto run = make_lw_shared<disk_run>();
+    run->total = { 0, 0 };
+    std::vector<priority_class_ptr> classes = { disk->register_priority_class(100), disk->register_priority_class(200) };
+    std::vector<future<>> done;
+    for (unsigned i = 0; i < 300; ++i) {
+        for (unsigned c = 0; c < classes.size(); ++c) {
+            done.push_back(disk->submit(classes[c], 4096).then([run, c] {
+                ++run->total[c];
+            }));
+        }
+    }
+    return run_simulation(30ms, 100us).then([run] {
+        run->halfway = run->total;
+        return run_simulation(40ms, 100us);
+    }).then([done = std::move(done)] () mutable {
+        return when_all(done.begin(), done.end()).discard_result();
+    }).then([disk, run] {
+        return *run;
+    });
+}
+
+SEASTAR_TEST_CASE(test_simulated_disk_shares) {
+    return run_shares_scenario().then([] (disk_run r) {
+        BOOST_TEST_MESSAGE(sprint("halfway: %u/%u", r.halfway[0], r.halfway[1]));
+        BOOST_REQUIRE_EQUAL(r.total[0], 300u);
+        BOOST_REQUIRE_EQUAL(r.total[1], 300u);
+        BOOST_REQUIRE(r.halfway[0] + r.halfway[1] >= 290);
+        BOOST_REQUIRE(r.halfway[1] >= 2 * r.halfway[0] - 10);
+        BOOST_REQUIRE(r.halfway[1] <= 2 * r.halfway[0] + 10);
+    });
+}
+
+SEASTAR_TEST_CASE(test_simulated_disk_is_deterministic) {
+    return run_shares_scenario().then([] (disk_run first) {
+        return run_shares_scenario().then([first] (disk_run second) {
+            BOOST_REQUIRE(first.halfway == second.halfway);
+        });
+    });
+}
+
+// 1 byte/us, 10ms away, 10000 bytes of queue: of five 4000 byte packets
+// sent at once, two fit and arrive 4ms apart.
+SEASTAR_TEST_CASE(test_simulated_link) {
+    manual_clock::set_simulated(true);
+    auto link = make_lw_shared<simulated_link>(1e6, 10ms, 10000);
+    auto arrived = make_lw_shared<std::vector<bool>>(5, false);
+    std::vector<future<>> done;
+    for (unsigned i = 0; i < 5; ++i) {
+        done.push_back(link->send(4000).then([arrived, i] (bool ok) {
+            (*arrived)[i] = ok;
+        }));
+    }
+    return run_simulation(13ms, 1ms).then([link, arrived] {
+        BOOST_REQUIRE_EQUAL(link->dropped(), 3u);
+        BOOST_REQUIRE(!(*arrived)[0]);
+        return run_simulation(2ms, 1ms);
+    }).then([arrived] {
+        BOOST_REQUIRE((*arrived)[0]);
+        BOOST_REQUIRE(!(*arrived)[1]);
+        return run_simulation(4ms, 1ms);
+    }).then([arrived, done = std::move(done)] () mutable {
+        BOOST_REQUIRE((*arrived)[1]);
+        return when_all(done.begin(), done.end()).discard_result();
+    });
+}
@@ -114,10 +114,53 @@ static void test_allocation_with_lru(const double growth_factor, const unsigned
     std::cout << __FUNCTION__ << " done!\n";
 }
 
+static void test_allocation_with_clock(const double growth_factor, const unsigned slab_limit_size) {
+    bi::list<item, bi::member_hook<item, bi::list_member_hook<>, &item::_cache_link>> _cache;
+    std::vector<item*> evicted;
+
+    slab_allocator<item> slab(growth_factor, slab_limit_size, max_object_size,
+        [&](item& item_ref) { _cache.erase(_cache.iterator_to(item_ref)); evicted.push_back(&item_ref); },
+        slab_eviction_policy::clock);
+    size_t size = 1024;
+
+    auto max = (max_object_size / slab.class_size(size)) * (slab_limit_size / max_object_size);
+    std::vector<item*> items;
+    for (auto i = 0u; i < max; i++) {
+        auto item = slab.create(size);
+        assert(item != nullptr);
+        _cache.push_front(*item);
+        items.push_back(item);
+    }
+    // A hit on the oldest item gives it a second chance
+    slab.lock_item(items[0]);
+    slab.unlock_item(items[0]);
+    auto added = slab.create(size);
+    assert(added != nullptr);
+    _cache.push_front(*added);
+    assert(evicted.size() == 1);
+    assert(evicted[0] == items[1]);
+    // The oldest item has now been passed over once, and goes next
+    added = slab.create(size);
+    assert(added != nullptr);
+    _cache.push_front(*added);
+    assert(evicted.size() == 2);
+    assert(evicted[1] == items[2]);
+
+    std::vector<item*> live;
+    for (auto& i : _cache) {
+        live.push_back(&i);
+    }
+    _cache.clear();
+    free_vector<item>(slab, live);
+
+    std::cout << __FUNCTION__ << " done!\n";
+}
+
 int main(int ac, char** av) {
     test_allocation_1(1.25, 5*1024*1024);
     test_allocation_2(1.07, 5*1024*1024); // 1.07 is the growth factor used by facebook.
     test_allocation_with_lru(1.25, 5*1024*1024);
+    test_allocation_with_clock(1.25, 5*1024*1024);
 
     return 0;
 }
@@ -0,0 +1,140 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "core/small_circular_buffer.hh"
+#include <deque>
+#include <memory>
+#include <random>
+
+BOOST_AUTO_TEST_CASE(small_circular_buffer_inline) {
+    small_circular_buffer<int, 4> buf;
+    BOOST_REQUIRE(buf.empty());
+    BOOST_REQUIRE(buf.is_inline());
+    BOOST_REQUIRE_EQUAL(buf.capacity(), 4);
+    buf.push_back(1);
+    buf.push_back(2);
+    buf.push_front(0);
+    buf.emplace_back(3);
+    BOOST_REQUIRE_EQUAL(buf.size(), 4);
+    BOOST_REQUIRE(buf.is_inline());
+    BOOST_REQUIRE_EQUAL(buf.front(), 0);
+    BOOST_REQUIRE_EQUAL(buf.back(), 3);
+    for (int i = 0; i < 4; ++i) {
+        BOOST_REQUIRE_EQUAL(buf[i], i);
+    }
+    // Wrapping around within the inline storage
+    for (int i = 4; i < 100; ++i) {
+        buf.pop_front();
+        buf.push_back(i);
+        BOOST_REQUIRE_EQUAL(buf.front(), i - 3);
+        BOOST_REQUIRE(buf.is_inline());
+    }
+    int expected = 96;
+    for (auto x : buf) {
+        BOOST_REQUIRE_EQUAL(x, expected++);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(small_circular_buffer_spill) {
+    small_circular_buffer<int, 2> buf;
+    buf.push_back(1);
+    buf.push_back(2);
+    buf.pop_front();
+    buf.push_back(3);
+    // The elements wrap around the inline storage when it spills
+    buf.push_back(4);
+    BOOST_REQUIRE(!buf.is_inline());
+    BOOST_REQUIRE_EQUAL(buf.capacity(), 4);
+    BOOST_REQUIRE_EQUAL(buf.size(), 3);
+    for (int i = 0; i < 3; ++i) {
+        BOOST_REQUIRE_EQUAL(buf[i], i + 2);
+    }
+    buf.reserve(100);
+    BOOST_REQUIRE_EQUAL(buf.capacity(), 128);
+    BOOST_REQUIRE_EQUAL(buf.front(), 2);
+    BOOST_REQUIRE_EQUAL(buf.back(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(small_circular_buffer_move) {
+    using ptr = std::unique_ptr<int>;
+    small_circular_buffer<ptr, 4> inl;
+    inl.push_back(std::make_unique<int>(1));
+    inl.push_back(std::make_unique<int>(2));
+    auto moved = std::move(inl);
+    BOOST_REQUIRE(inl.empty());
+    BOOST_REQUIRE(moved.is_inline());
+    BOOST_REQUIRE_EQUAL(moved.size(), 2);
+    BOOST_REQUIRE_EQUAL(*moved.front(), 1);
+    BOOST_REQUIRE_EQUAL(*moved.back(), 2);
+
+    small_circular_buffer<ptr, 4> heap;
+    for (int i = 0; i < 10; ++i) {
+        heap.push_back(std::make_unique<int>(i));
+    }
+    moved = std::move(heap);
+    BOOST_REQUIRE(heap.empty());
+    BOOST_REQUIRE(heap.is_inline());
+    BOOST_REQUIRE(!moved.is_inline());
+    BOOST_REQUIRE_EQUAL(moved.size(), 10);
+    BOOST_REQUIRE_EQUAL(*moved.back(), 9);
+    // A moved-from buffer is usable again
+    heap.push_back(std::make_unique<int>(42));
+    BOOST_REQUIRE_EQUAL(*heap.front(), 42);
+}
+
+BOOST_AUTO_TEST_CASE(small_circular_buffer_against_deque) {
+    small_circular_buffer<int, 4> buf;
+    std::deque<int> ref;
+    std::default_random_engine random;
+    for (int i = 0; i < 100000; ++i) {
+        switch (std::uniform_int_distribution<int>(0, 3)(random)) {
+        case 0:
+            buf.push_back(i);
+            ref.push_back(i);
+            break;
+        case 1:
+            buf.push_front(i);
+            ref.push_front(i);
+            break;
+        case 2:
+            if (!ref.empty()) {
+                buf.pop_front();
+                ref.pop_front();
+            }
+            break;
+        case 3:
+            if (!ref.empty()) {
+                buf.pop_back();
+                ref.pop_back();
+            }
+            break;
+        }
+        BOOST_REQUIRE_EQUAL(buf.size(), ref.size());
+        if (!ref.empty()) {
+            BOOST_REQUIRE_EQUAL(buf.front(), ref.front());
+            BOOST_REQUIRE_EQUAL(buf.back(), ref.back());
+        }
+    }
+    BOOST_REQUIRE(std::equal(buf.begin(), buf.end(), ref.begin(), ref.end()));
+}
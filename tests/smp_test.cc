@@ -55,6 +55,68 @@ future<bool> test_smp_exception() {
     });
 }
 
+future<bool> test_smp_stealable() {
+    // Submitted from shard 1, so that shard 0 may steal it if it runs
+    // with --work-stealing; the result comes back to shard 1 either way.
+    return smp::submit_to(1, [] {
+        auto origin = engine().cpu_id();
+        return smp::submit_stealable([] {
+            return 6 * 7;
+        }).then([origin] (int ret) {
+            return ret == 42 && engine().cpu_id() == origin;
+        });
+    });
+}
+
+future<bool> test_smp_batch() {
+    std::vector<std::function<int ()>> funcs;
+    for (int i = 0; i < 100; ++i) {
+        funcs.push_back([i] { return i * 2; });
+    }
+    return smp::submit_batch_to(1, funcs).then([] (std::vector<int> results) {
+        if (results.size() != 100) {
+            return false;
+        }
+        for (int i = 0; i < 100; ++i) {
+            if (results[i] != i * 2) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+future<bool> test_smp_batch_void() {
+    static std::atomic<unsigned> calls;
+    calls = 0;
+    std::vector<std::function<future<> ()>> funcs(10, [] {
+        calls.fetch_add(1, std::memory_order_relaxed);
+        return make_ready_future<>();
+    });
+    return smp::submit_batch_to(1, funcs).then([] {
+        return calls.load(std::memory_order_relaxed) == 10;
+    });
+}
+
+future<bool> test_smp_map_all() {
+    // Started from shard 1, so that the fan-out does not begin at shard 0.
+    return smp::submit_to(1, [] {
+        return smp::map_all([] {
+            return make_ready_future<unsigned>(engine().cpu_id());
+        }).then([] (std::vector<unsigned> results) {
+            if (results.size() != smp::count) {
+                return false;
+            }
+            for (unsigned c = 0; c < smp::count; ++c) {
+                if (results[c] != c || smp::numa_node_of(c) >= smp::numa_nodes()) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    });
+}
+
 int tests, fails;
 
 future<>
@@ -70,6 +132,14 @@ int main(int ac, char** av) {
     return app_template().run_deprecated(ac, av, [] {
        return report("smp call", test_smp_call()).then([] {
            return report("smp exception", test_smp_exception());
+       }).then([] {
+           return report("smp stealable", test_smp_stealable());
+       }).then([] {
+           return report("smp batch", test_smp_batch());
+       }).then([] {
+           return report("smp batch void", test_smp_batch_void());
+       }).then([] {
+           return report("smp map all", test_smp_map_all());
        }).then([] {
            print("\n%d tests / %d failures\n", tests, fails);
            engine().exit(fails ? 1 : 0);
@@ -23,6 +23,7 @@
 
 #include <boost/test/included/unit_test.hpp>
 #include "core/sstring.hh"
+#include "core/fast_hash.hh"
 #include <list>
 
 BOOST_AUTO_TEST_CASE(test_equality) {
@@ -127,3 +128,29 @@ BOOST_AUTO_TEST_CASE(test_ctor_iterator) {
     sstring s(data.begin(), data.end());
     BOOST_REQUIRE_EQUAL(s, "abc");
 }
+
+BOOST_AUTO_TEST_CASE(test_fast_hash) {
+    // Cover every tail length around the 8- and 16-byte strides.
+    sstring base("0123456789abcdefghijklmnopqrstuvwxyz0123456789");
+    for (size_t n = 0; n < base.size(); ++n) {
+        sstring a(base.begin(), base.begin() + n);
+        sstring b(base.begin(), base.begin() + n);
+        BOOST_REQUIRE_EQUAL(sstring_fast_hash()(a), sstring_fast_hash()(b));
+        BOOST_REQUIRE(sstring_fast_equal()(a, b));
+        if (n) {
+            b[n - 1] = '!';
+            BOOST_REQUIRE(!sstring_fast_equal()(a, b));
+            BOOST_REQUIRE(sstring_fast_hash()(a) != sstring_fast_hash()(b));
+        }
+    }
+    BOOST_REQUIRE(!sstring_fast_equal()(sstring("abc"), sstring("abcd")));
+}
+
+BOOST_AUTO_TEST_CASE(test_larger_inline_capacity) {
+    using key = basic_sstring<char, uint32_t, 47>;
+    static_assert(sizeof(key) == 48, "inline capacity should set the object size");
+    key k("a key that does not fit in fifteen bytes");
+    key copy = k;
+    BOOST_REQUIRE(copy == k);
+    BOOST_REQUIRE_EQUAL(sstring_fast_hash()(copy), sstring_fast_hash()(k));
+}
@@ -0,0 +1,132 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/tcp-congestion.hh"
+
+using namespace net;
+using namespace std::chrono_literals;
+
+static constexpr uint16_t mss = 1000;
+
+// Acknowledges one round trip worth of cwnd, segment by segment, over a
+// path of the given bandwidth (bytes per second) and round trip time.
+struct path {
+    tcp_congestion_control& cc;
+    uint32_t cwnd = 10 * mss;
+    uint32_t ssthresh = 1 << 30;
+    uint64_t delivered = 0;
+    steady_clock_type::time_point now = steady_clock_type::now();
+    uint64_t bandwidth;
+    std::chrono::microseconds rtt;
+
+    void round_trip() {
+        auto prior = delivered;
+        auto sent = std::min<uint64_t>(cwnd, bandwidth * rtt.count() / 1000000 * 2);
+        now += rtt;
+        for (uint64_t acked = 0; acked + mss <= sent; acked += mss) {
+            delivered += mss;
+            tcp_ack_sample s;
+            s.now = now;
+            s.acked_bytes = mss;
+            s.in_flight = sent - acked - mss;
+            s.rtt = rtt;
+            s.delivered = delivered;
+            s.prior_delivered = prior;
+            s.delivery_rate = std::min<uint64_t>(bandwidth, sent * 1000000 / rtt.count());
+            cc.on_ack(tcp_congestion_window{cwnd, ssthresh, mss}, s);
+        }
+    }
+    void loss() {
+        cc.on_loss(tcp_congestion_window{cwnd, ssthresh, mss}, cwnd);
+        cwnd = ssthresh;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_unknown_algorithm) {
+    BOOST_REQUIRE_THROW(make_tcp_congestion_control("vegas"), std::invalid_argument);
+    BOOST_REQUIRE_EQUAL(make_tcp_congestion_control("cubic")->name(), sstring("cubic"));
+}
+
+BOOST_AUTO_TEST_CASE(test_reno_halves_on_loss) {
+    auto cc = make_tcp_congestion_control("reno");
+    path p{*cc};
+    p.bandwidth = 100000000;
+    p.rtt = 10ms;
+    p.round_trip();
+    // Slow start doubles the window every round trip
+    BOOST_REQUIRE_EQUAL(p.cwnd, 20 * mss);
+    p.loss();
+    BOOST_REQUIRE_EQUAL(p.cwnd, 10 * mss);
+    // Congestion avoidance adds about one segment per round trip
+    p.round_trip();
+    BOOST_REQUIRE(p.cwnd > 10 * mss && p.cwnd <= 11 * mss);
+    BOOST_REQUIRE_EQUAL(cc->pacing_rate(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_cubic_recovers_faster_than_reno) {
+    auto reno = make_tcp_congestion_control("reno");
+    auto cubic = make_tcp_congestion_control("cubic");
+    path r{*reno};
+    path c{*cubic};
+    for (auto p : {&r, &c}) {
+        p->bandwidth = 1000000000;
+        p->rtt = 50ms;
+        p->cwnd = 1000 * mss;
+        p->ssthresh = p->cwnd;
+        p->loss();
+    }
+    // Backs off by 30%, not 50%
+    BOOST_REQUIRE_EQUAL(c.cwnd, 700 * mss);
+    // K = cbrt(300 / 0.4), about 9 seconds to regain the old maximum
+    for (int i = 0; i < 250; ++i) {
+        r.round_trip();
+        c.round_trip();
+    }
+    BOOST_REQUIRE(c.cwnd > r.cwnd);
+    BOOST_REQUIRE(c.cwnd >= 1000 * mss);
+    BOOST_REQUIRE(cubic->min_rtt() == 50ms);
+}
+
+BOOST_AUTO_TEST_CASE(test_bbr_paces_at_bottleneck) {
+    auto cc = make_tcp_congestion_control("bbr");
+    path p{*cc};
+    p.bandwidth = 10000000;
+    p.rtt = 20ms;
+    for (int i = 0; i < 50; ++i) {
+        p.round_trip();
+    }
+    // Pacing follows the bottleneck, scaled by the probing gain
+    BOOST_REQUIRE(cc->pacing_rate() >= p.bandwidth * 3 / 4);
+    BOOST_REQUIRE(cc->pacing_rate() <= p.bandwidth * 5 / 4);
+    // cwnd stays around twice the bandwidth-delay product
+    uint32_t bdp = p.bandwidth * p.rtt.count() / 1000000;
+    BOOST_REQUIRE(p.cwnd >= bdp);
+    BOOST_REQUIRE(p.cwnd <= 3 * bdp);
+    // Loss alone does not shrink the model
+    auto before = cc->pacing_rate();
+    p.loss();
+    BOOST_REQUIRE(p.cwnd >= bdp);
+    BOOST_REQUIRE_EQUAL(cc->pacing_rate(), before);
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/tcp.hh"
+#include <array>
+
+using namespace net;
+
+static uint8_t* options(std::array<char, 60>& hdr) {
+    return reinterpret_cast<uint8_t*>(hdr.data() + tcp_hdr::len);
+}
+
+BOOST_AUTO_TEST_CASE(test_syn_carries_sack_permitted) {
+    tcp_option opt;
+    opt._local_mss = 1460;
+    auto size = opt.get_size(true, false);
+    BOOST_REQUIRE_EQUAL(size % tcp_option::align, 0);
+
+    std::array<char, 60> hdr = {};
+    auto h = tcp_hdr{};
+    h.f_syn = true;
+    BOOST_REQUIRE_EQUAL(opt.fill(hdr.data(), &h, size), size);
+
+    tcp_option remote;
+    remote.parse(options(hdr), options(hdr) + size);
+    BOOST_REQUIRE(remote._sack_received);
+    BOOST_REQUIRE_EQUAL(remote._remote_mss, 1460);
+
+    // A SYN-ACK only echoes SACK-permitted when the SYN had it
+    tcp_option no_sack;
+    BOOST_REQUIRE_EQUAL(no_sack.get_size(true, true), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_sack_blocks_round_trip) {
+    tcp_option opt;
+    opt._sack_received = true;
+    auto& sack = opt._local_sack_blocks;
+    for (unsigned i = 0; i < tcp_option::sack_blocks::max_blocks; ++i) {
+        sack.blocks[i] = {make_seq(1000 * i), make_seq(1000 * i + 500)};
+    }
+    sack.nr_blocks = tcp_option::sack_blocks::max_blocks;
+    auto size = opt.get_size(false, true);
+    BOOST_REQUIRE_EQUAL(size % tcp_option::align, 0);
+    BOOST_REQUIRE(tcp_hdr::len + size <= 60);
+
+    std::array<char, 60> hdr = {};
+    auto h = tcp_hdr{};
+    h.f_ack = true;
+    BOOST_REQUIRE_EQUAL(opt.fill(hdr.data(), &h, size), size);
+
+    auto parsed = tcp_option::parse_sack_blocks(options(hdr), options(hdr) + size);
+    BOOST_REQUIRE_EQUAL(parsed.nr_blocks, sack.nr_blocks);
+    for (unsigned i = 0; i < parsed.nr_blocks; ++i) {
+        BOOST_REQUIRE(parsed.blocks[i].left == sack.blocks[i].left);
+        BOOST_REQUIRE(parsed.blocks[i].right == sack.blocks[i].right);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_sack_blocks_skip_other_options) {
+    // NOP, NOP, timestamps, then one SACK block
+    std::array<uint8_t, 22> opts = {
+        1, 1,
+        8, 10, 0, 0, 0, 1, 0, 0, 0, 2,
+        5, 10, 0, 0, 0x10, 0, 0, 0, 0x20, 0,
+    };
+    auto parsed = tcp_option::parse_sack_blocks(opts.data(), opts.data() + opts.size());
+    BOOST_REQUIRE_EQUAL(parsed.nr_blocks, 1);
+    BOOST_REQUIRE(parsed.blocks[0].left == make_seq(0x1000));
+    BOOST_REQUIRE(parsed.blocks[0].right == make_seq(0x2000));
+
+    // A truncated option must not be read past the end
+    auto truncated = tcp_option::parse_sack_blocks(opts.data(), opts.data() + opts.size() - 1);
+    BOOST_REQUIRE_EQUAL(truncated.nr_blocks, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_timestamps_negotiation) {
+    tcp_option opt;
+    opt._local_mss = 1460;
+    opt._ts_val = 1234;
+    auto size = opt.get_size(true, false);
+    std::array<char, 60> hdr = {};
+    auto h = tcp_hdr{};
+    h.f_syn = true;
+    BOOST_REQUIRE_EQUAL(opt.fill(hdr.data(), &h, size), size);
+
+    tcp_option remote;
+    remote.parse(options(hdr), options(hdr) + size);
+    BOOST_REQUIRE(remote._timestamps_received);
+    BOOST_REQUIRE_EQUAL(remote._ts_recent, 1234);
+
+    // Once negotiated, every segment carries them and TSecr echoes TS.Recent
+    remote._ts_val = 5678;
+    size = remote.get_size(false, true);
+    hdr = {};
+    h = tcp_hdr{};
+    h.f_ack = true;
+    BOOST_REQUIRE_EQUAL(remote.fill(hdr.data(), &h, size), size);
+    auto ts = tcp_option::parse_timestamps(options(hdr), options(hdr) + size);
+    BOOST_REQUIRE(ts);
+    BOOST_REQUIRE_EQUAL(ts->t1, 5678);
+    BOOST_REQUIRE_EQUAL(ts->t2, 1234);
+
+    // Three SACK blocks still fit next to them
+    remote._sack_received = true;
+    remote._local_sack_blocks.nr_blocks = 3;
+    BOOST_REQUIRE(tcp_hdr::len + remote.get_size(false, true) <= 60);
+}
@@ -72,8 +72,25 @@ class context_switch_tester {
     }
 };
 
+// Measures the cost of creating, running and joining a thread with an
+// empty body; after the first iteration the stack comes from the pool.
+static future<> measure_thread_creation(const char* name, thread_attributes attr, unsigned count) {
+    auto start = std::chrono::steady_clock::now();
+    return do_with(unsigned(0), [attr, count] (unsigned& i) {
+        return do_until([&i, count] { return i == count; }, [attr, &i] {
+            ++i;
+            return async(attr, [] {});
+        });
+    }).then([name, start, count] {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        print("thread creation (%s): %5.1f ns\n", name,
+              double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / count);
+    });
+}
+
 int main(int ac, char** av) {
     static const auto test_time = 5s;
+    static const unsigned creation_count = 100000;
     return app_template().run_deprecated(ac, av, [] {
         return do_with(distributed<context_switch_tester>(), [] (distributed<context_switch_tester>& dcst) {
             return dcst.start().then([&dcst] {
@@ -86,6 +103,16 @@ int main(int ac, char** av) {
                 switches /= smp::count;
                 print("context switch time: %5.1f ns\n",
                       double(std::chrono::duration_cast<std::chrono::nanoseconds>(test_time).count()) / switches);
+            }).then([] {
+                return measure_thread_creation("default stack", thread_attributes(), creation_count);
+            }).then([] {
+                thread_attributes attr;
+                attr.stack_size = 16*1024;
+                return measure_thread_creation("16KiB stack", attr, creation_count);
+            }).then([] {
+                thread_attributes attr;
+                attr.stack_guard = true;
+                return measure_thread_creation("guarded stack", attr, creation_count);
             }).then([&dcst] {
                 return dcst.stop();
             }).then([] {
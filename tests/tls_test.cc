@@ -28,6 +28,7 @@
 #include "core/future-util.hh"
 #include "core/sharded.hh"
 #include "core/gate.hh"
+#include "core/metrics_api.hh"
 #include "net/tls.hh"
 
 using namespace seastar;
@@ -159,23 +160,27 @@ class echoserver {
             _socket = tls::listen(_certs, addr, opts);
 
             with_gate(_gate, [this] {
-                return _socket.accept().then([this](::connected_socket s, socket_address) {
-                    auto strms = ::make_lw_shared<streams>(std::move(s));
-                    return repeat([strms, this]() {
-                        return strms->in.read_exactly(_size).then([strms](temporary_buffer<char> buf) {
-                            if (buf.empty()) {
-                                return make_ready_future<stop_iteration>(stop_iteration::yes);
-                            }
-                            sstring tmp(buf.begin(), buf.end());
-                            return strms->out.write(tmp).then([strms]() {
-                                return strms->out.flush();
-                            }).then([] {
-                                return make_ready_future<stop_iteration>(stop_iteration::no);
+                return repeat([this] {
+                    return _socket.accept().then([this](::connected_socket s, socket_address) {
+                        auto strms = ::make_lw_shared<streams>(std::move(s));
+                        return repeat([strms, this]() {
+                            return strms->in.read_exactly(_size).then([strms](temporary_buffer<char> buf) {
+                                if (buf.empty()) {
+                                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                                }
+                                sstring tmp(buf.begin(), buf.end());
+                                return strms->out.write(tmp).then([strms]() {
+                                    return strms->out.flush();
+                                }).then([] {
+                                    return make_ready_future<stop_iteration>(stop_iteration::no);
+                                });
                             });
-                        });
-                    }).then([strms]{
-                        return strms->out.close();
-                    }).finally([strms]{});
+                        }).then([strms]{
+                            return strms->out.close();
+                        }).finally([strms]{});
+                    }).then([] {
+                        return stop_iteration::no;
+                    });
                 }).handle_exception([this](auto ep) {
                     if (_stopped) {
                         return make_ready_future<>();
@@ -193,6 +198,10 @@ class echoserver {
         });
     }
 
+    void enable_session_tickets(sstring secret) {
+        _certs->enable_session_tickets(secret);
+    }
+
     future<> stop() {
         _stopped = true;
         _socket.abort_accept();
@@ -341,3 +350,67 @@ SEASTAR_TEST_CASE(test_simple_x509_client_server_client_auth) {
     // Server will require certificate auth. We supply one, so should succeed with connection
     return run_echo_test(message, 20, "tests/catest.pem", "test.scylladb.org", "tests/test.crt", "tests/test.key", tls::client_auth::REQUIRE, "tests/test.crt", "tests/test.key");
 }
+
+static int64_t tls_metric(const sstring& name) {
+    for (auto&& m : seastar::metrics::impl::get_value_map()) {
+        if (m.first.group_name() == "tls" && m.first.name() == name) {
+            return (*m.second)().i();
+        }
+    }
+    return 0;
+}
+
+SEASTAR_TEST_CASE(test_x509_client_server_session_resumption) {
+    // The server runs on all shards with one ticket secret, so the second
+    // connection resumes wherever it is accepted
+    static const auto port = 4712;
+
+    auto certs = ::make_shared<tls::certificate_credentials>();
+    auto server = ::make_shared<seastar::sharded<echoserver>>();
+    auto addr = ::make_ipv4_address( {0x7f000001, port});
+    auto secret = tls::generate_session_ticket_secret();
+
+    auto echo_once = [certs, addr] {
+        return tls::connect(certs, addr, "test.scylladb.org").then([](::connected_socket s) {
+            auto strms = ::make_lw_shared<streams>(std::move(s));
+            return strms->out.write(message).then([strms] {
+                return strms->out.flush();
+            }).then([strms] {
+                return strms->in.read_exactly(message.size());
+            }).then([strms](temporary_buffer<char> buf) {
+                BOOST_CHECK(sstring(buf.begin(), buf.end()) == message);
+                return strms->out.close();
+            }).finally([strms]{});
+        });
+    };
+
+    return certs->set_x509_trust_file("tests/catest.pem", tls::x509_crt_format::PEM).then([=] {
+        return server->start(message.size());
+    }).then([=] {
+        return server->invoke_on_all([=](echoserver& s) {
+            s.enable_session_tickets(secret);
+            return s.listen(addr, "tests/test.crt", "tests/test.key");
+        });
+    }).then([=] {
+        return echo_once();
+    }).then([=] {
+        auto resumed = tls_metric("client_resumed_handshakes");
+        return echo_once().then([resumed] {
+            BOOST_REQUIRE_EQUAL(tls_metric("client_resumed_handshakes"), resumed + 1);
+        });
+    }).finally([server] {
+        return server->stop().finally([server]{});
+    });
+}
+
+SEASTAR_TEST_CASE(test_x509_client_server_offloaded_handshake) {
+    return smp::invoke_on_all([] {
+        tls::set_handshake_offload(2);
+    }).then([] {
+        return run_echo_test(message, 20, "tests/catest.pem", "test.scylladb.org");
+    }).finally([] {
+        return smp::invoke_on_all([] {
+            tls::set_handshake_offload(0);
+        });
+    });
+}
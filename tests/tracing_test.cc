@@ -0,0 +1,88 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "core/tracing.hh"
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include "tests/test-utils.hh"
+#include <cstring>
+#include <vector>
+
+using namespace seastar;
+
+class collecting_sink : public tracing::sink {
+    std::vector<tracing::span_record>& _records;
+public:
+    explicit collecting_sink(std::vector<tracing::span_record>& records) : _records(records) {}
+    virtual void record(const tracing::span_record& s) override {
+        _records.push_back(s);
+    }
+};
+
+SEASTAR_TEST_CASE(test_unsampled) {
+    tracing::set_sample_rate(0);
+    tracing::span s("root");
+    BOOST_REQUIRE(!s.sampled());
+    BOOST_REQUIRE(!tracing::span::child("child").sampled());
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_propagation) {
+    auto records = make_lw_shared<std::vector<tracing::span_record>>();
+    tracing::set_sink(std::make_unique<collecting_sink>(*records));
+    tracing::set_sample_rate(1);
+    tracing::span root("root");
+    BOOST_REQUIRE(root.sampled());
+    root.set_detail("request");
+    return tracing::with_span(std::move(root), [] {
+        // Runs as a task, created while root was current
+        return later().then([] {
+            auto child = tracing::span::child("child");
+            BOOST_REQUIRE(child.sampled());
+        });
+    }).then([records] {
+        BOOST_REQUIRE(!tracing::span::child("child").sampled());
+        tracing::set_sample_rate(0);
+        tracing::set_sink(nullptr);
+        BOOST_REQUIRE_EQUAL(records->size(), 2u);
+        auto& child = (*records)[0];
+        auto& root = (*records)[1];
+        BOOST_REQUIRE_EQUAL(strcmp(child.name, "child"), 0);
+        BOOST_REQUIRE_EQUAL(strcmp(root.name, "root"), 0);
+        BOOST_REQUIRE_EQUAL(root.detail, "request");
+        BOOST_REQUIRE_EQUAL(root.parent_id, 0u);
+        BOOST_REQUIRE_EQUAL(child.parent_id, root.span_id);
+        BOOST_REQUIRE_EQUAL(child.trace_id, root.trace_id);
+        BOOST_REQUIRE(child.start >= root.start);
+        BOOST_REQUIRE_EQUAL(root.shard, engine().cpu_id());
+    });
+}
+
+SEASTAR_TEST_CASE(test_sample_rate) {
+    tracing::set_sample_rate(0.25);
+    unsigned sampled = 0;
+    for (int i = 0; i < 8; ++i) {
+        sampled += tracing::span("root").sampled();
+    }
+    tracing::set_sample_rate(0);
+    BOOST_REQUIRE_EQUAL(sampled, 2u);
+    return make_ready_future<>();
+}
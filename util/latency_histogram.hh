@@ -0,0 +1,99 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/bitops.hh"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Latencies, in microseconds, in HDR-style log-linear buckets: values
+// below 2^sub_bucket_bits are exact, and larger ones are kept to within
+// 1/2^sub_bucket_bits of their value, so percentiles are precise however
+// long the tail is.
+class latency_histogram {
+    static constexpr unsigned sub_bucket_bits = 7;
+    static constexpr unsigned sub_buckets = 1 << sub_bucket_bits;
+    static constexpr unsigned max_value_bits = 36;
+    std::vector<uint64_t> _counts;
+    uint64_t _total = 0;
+    uint64_t _max = 0;
+private:
+    static unsigned index(uint64_t v) {
+        if (v < sub_buckets) {
+            return v;
+        }
+        unsigned shift = log2floor(v) - sub_bucket_bits;
+        return (shift + 1) * sub_buckets + (v >> shift) - sub_buckets;
+    }
+    // The largest value recorded in the bucket
+    static uint64_t highest_value(unsigned idx) {
+        if (idx < sub_buckets) {
+            return idx;
+        }
+        unsigned shift = idx / sub_buckets - 1;
+        uint64_t sub = idx % sub_buckets + sub_buckets;
+        return ((sub + 1) << shift) - 1;
+    }
+public:
+    latency_histogram() : _counts(index((uint64_t(1) << max_value_bits) - 1) + 1) {}
+
+    void add(std::chrono::steady_clock::duration d) {
+        auto v = std::min<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count(),
+                (uint64_t(1) << max_value_bits) - 1);
+        ++_counts[index(v)];
+        ++_total;
+        _max = std::max(_max, v);
+    }
+
+    latency_histogram& operator+=(const latency_histogram& o) {
+        for (unsigned i = 0; i < _counts.size(); ++i) {
+            _counts[i] += o._counts[i];
+        }
+        _total += o._total;
+        _max = std::max(_max, o._max);
+        return *this;
+    }
+
+    uint64_t count() const {
+        return _total;
+    }
+
+    uint64_t max() const {
+        return _max;
+    }
+
+    // The value that the fraction @q of the samples are at or below
+    uint64_t quantile(double q) const {
+        auto target = std::max<uint64_t>(1, std::ceil(q * _total));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < _counts.size(); ++i) {
+            seen += _counts[i];
+            if (seen >= target) {
+                return std::min(highest_value(i), _max);
+            }
+        }
+        return _max;
+    }
+};
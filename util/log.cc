@@ -24,8 +24,18 @@
 #include <cxxabi.h>
 #include <system_error>
 #include <boost/range/adaptor/map.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <map>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <signal.h>
 #include <syslog.h>
+#include <unistd.h>
 
 namespace seastar {
 log_registry& logger_registry();
@@ -67,6 +77,442 @@ namespace seastar {
 
 std::atomic<bool> logger::_stdout = { true };
 std::atomic<bool> logger::_syslog = { false };
+std::atomic<bool> logger::_async = { false };
+std::atomic<bool> logger::_binary = { false };
+
+namespace {
+
+// Where a record goes
+enum log_destination : uint8_t {
+    to_stdout = 1,
+    to_syslog = 2,
+};
+
+/**
+ * A thread's records waiting for the writer thread: a ring of bytes with
+ * a single producer, the thread, and a single consumer, the writer.
+ * Records are a header followed by the message, padded to 8 bytes; one
+ * that does not fit before the end of the buffer starts over at its
+ * beginning, after a wrap marker.
+ */
+class log_ring {
+    struct header {
+        uint32_t size;
+        uint8_t syslog_level;
+        uint8_t destinations;
+        uint16_t syslog_offset;
+    };
+    static_assert(sizeof(header) == 8, "records must stay 8 byte aligned");
+    static constexpr uint32_t wrap_marker = uint32_t(-1);
+
+    std::unique_ptr<char[]> _buf;
+    size_t _capacity;
+    // Offsets since the ring was created, of the first byte not yet read
+    // and the first one not yet written
+    std::atomic<uint64_t> _head = { 0 };
+    std::atomic<uint64_t> _tail = { 0 };
+    std::atomic<uint64_t> _dropped = { 0 };
+private:
+    static size_t record_size(size_t msg_size) {
+        return (sizeof(header) + msg_size + 7) & ~size_t(7);
+    }
+public:
+    explicit log_ring(size_t capacity)
+        : _buf(new char[(capacity + 7) & ~size_t(7)]), _capacity((capacity + 7) & ~size_t(7)) {}
+
+    // Called by the owning thread; false, and counted, if it is full
+    bool push(int syslog_level, uint8_t destinations, size_t syslog_offset, const std::string& msg) {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        auto head = _head.load(std::memory_order_acquire);
+        auto pos = tail % _capacity;
+        auto size = record_size(msg.size());
+        auto pad = _capacity - pos < size ? _capacity - pos : 0;
+        if (_capacity - (tail - head) < pad + size) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (pad) {
+            header h{wrap_marker, 0, 0, 0};
+            memcpy(_buf.get() + pos, &h, sizeof(h));
+            pos = 0;
+        }
+        header h{uint32_t(msg.size()), uint8_t(syslog_level), destinations, uint16_t(syslog_offset)};
+        memcpy(_buf.get() + pos, &h, sizeof(h));
+        memcpy(_buf.get() + pos + sizeof(h), msg.data(), msg.size());
+        _tail.store(tail + pad + size, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return _head.load(std::memory_order_relaxed) == _tail.load(std::memory_order_acquire);
+    }
+
+    uint64_t dropped() const {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+    // Called by the writer; calls func(syslog_level, destinations,
+    // syslog_offset, msg, size) for the records written so far, and then
+    // frees their space. Returns whether there were any.
+    template <typename Func>
+    bool consume(Func&& func) {
+        auto head = _head.load(std::memory_order_relaxed);
+        auto tail = _tail.load(std::memory_order_acquire);
+        if (head == tail) {
+            return false;
+        }
+        while (head != tail) {
+            auto pos = head % _capacity;
+            header h;
+            memcpy(&h, _buf.get() + pos, sizeof(h));
+            if (h.size == wrap_marker) {
+                head += _capacity - pos;
+                continue;
+            }
+            func(h.syslog_level, h.destinations, h.syslog_offset, _buf.get() + pos + sizeof(h), h.size);
+            head += record_size(h.size);
+        }
+        _head.store(head, std::memory_order_release);
+        return true;
+    }
+};
+
+/**
+ * Writes the records of all threads' rings from a thread of its own,
+ * batching those to stdout and to the file into one write per pass.
+ * Created when the asynchronous mode is first enabled, and kept until the
+ * process exits.
+ */
+class async_log_writer {
+    // Guards _rings, the options, and sleeping
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::vector<std::shared_ptr<log_ring>> _rings;
+    async_log_options _opts;
+    std::atomic<bool> _sleeping = { false };
+    // Held while reading the rings, which have a single consumer
+    std::mutex _consume_mutex;
+    int _fd = -1;
+    // Drops counted by the rings of threads that exited
+    uint64_t _retired_dropped = 0;
+    uint64_t _reported_dropped = 0;
+    std::string _out;
+private:
+    void run();
+    bool drain();
+    void write_out();
+    bool report_dropped();
+public:
+    explicit async_log_writer(const async_log_options& opts) {
+        configure(opts);
+        std::thread([this] { run(); }).detach();
+    }
+    void configure(const async_log_options& opts);
+    void push(int syslog_level, uint8_t destinations, size_t syslog_offset, const std::string& msg);
+    // Writes everything queued so far
+    void flush() {
+        std::lock_guard<std::mutex> g(_consume_mutex);
+        while (drain()) {
+        }
+    }
+    uint64_t dropped();
+};
+
+static async_log_writer* log_writer;
+static thread_local std::shared_ptr<log_ring> local_log_ring;
+
+/**
+ * A thread's binary records, see logger::set_binary_enabled(): a flight
+ * recorder of the latest records that fit, which overwrites the oldest.
+ * Records are laid out as in log_ring, with the format strings and logger
+ * names they refer to kept in a table.
+ *
+ * Only the owning thread writes to it; dump() may read it from another
+ * thread, while the process crashes, and then makes do with what it
+ * finds.
+ */
+class binary_log_ring {
+    struct header {
+        // Of the arguments
+        uint32_t size;
+        // Indexes into _strings
+        uint32_t format;
+        uint32_t logger;
+        uint8_t level;
+        uint8_t nargs;
+        uint16_t reserved;
+        // Nanoseconds since the epoch
+        uint64_t timestamp;
+    };
+    static_assert(sizeof(header) == 24, "records must stay 8 byte aligned");
+    static constexpr uint32_t wrap_marker = uint32_t(-1);
+
+    std::unique_ptr<char[]> _buf;
+    size_t _capacity;
+    // Offsets since the ring was created, of the oldest record and of the
+    // first byte not yet written
+    std::atomic<uint64_t> _head = { 0 };
+    std::atomic<uint64_t> _tail = { 0 };
+    int32_t _shard;
+    std::unordered_map<const char*, uint32_t> _ids;
+    std::vector<sstring> _strings;
+private:
+    static size_t record_size(size_t args_size) {
+        return (sizeof(header) + args_size + 7) & ~size_t(7);
+    }
+    uint32_t intern(const char* s) {
+        auto i = _ids.find(s);
+        if (i != _ids.end()) {
+            return i->second;
+        }
+        _strings.emplace_back(s);
+        return _ids.emplace(s, _strings.size() - 1).first->second;
+    }
+    // Frees the oldest record
+    void evict() {
+        auto head = _head.load(std::memory_order_relaxed);
+        auto pos = head % _capacity;
+        uint32_t size;
+        memcpy(&size, _buf.get() + pos, sizeof(size));
+        _head.store(head + (size == wrap_marker ? _capacity - pos : record_size(size)), std::memory_order_relaxed);
+    }
+public:
+    explicit binary_log_ring(size_t capacity)
+        : _buf(new char[(capacity + 7) & ~size_t(7)]), _capacity((capacity + 7) & ~size_t(7))
+        , _shard(local_engine ? engine().cpu_id() : -1) {}
+
+    void push(log_level level, const char* fmt, const sstring& logger, size_t nargs, const std::vector<char>& args) {
+        auto size = record_size(args.size());
+        if (size > _capacity) {
+            return;
+        }
+        auto tail = _tail.load(std::memory_order_relaxed);
+        auto pos = tail % _capacity;
+        auto pad = _capacity - pos < size ? _capacity - pos : 0;
+        while (_capacity - (tail - _head.load(std::memory_order_relaxed)) < pad + size) {
+            evict();
+        }
+        if (pad) {
+            memcpy(_buf.get() + pos, &wrap_marker, sizeof(wrap_marker));
+            pos = 0;
+        }
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        header h{uint32_t(args.size()), intern(fmt), intern(logger.c_str()), uint8_t(level), uint8_t(nargs), 0,
+                uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count())};
+        memcpy(_buf.get() + pos, &h, sizeof(h));
+        memcpy(_buf.get() + pos + sizeof(h), args.data(), args.size());
+        _tail.store(tail + pad + size, std::memory_order_release);
+    }
+
+    // Writes the ring to fd: its shard (-1 for other threads), the number
+    // of strings and each one's length and bytes, and the records from
+    // the oldest on, as two chunks of a length and bytes; the first may
+    // end with a wrap marker, after which it is padding. Lengths are 32
+    // bit except those of the chunks.
+    bool dump(int fd) const noexcept;
+};
+
+static bool write_fully(int fd, const void* p, size_t n) noexcept {
+    auto c = static_cast<const char*>(p);
+    while (n) {
+        auto r = ::write(fd, c, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        c += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool binary_log_ring::dump(int fd) const noexcept {
+    uint32_t nstrings = _strings.size();
+    if (!write_fully(fd, &_shard, sizeof(_shard)) || !write_fully(fd, &nstrings, sizeof(nstrings))) {
+        return false;
+    }
+    for (uint32_t i = 0; i < nstrings; ++i) {
+        uint32_t len = _strings[i].size();
+        if (!write_fully(fd, &len, sizeof(len)) || !write_fully(fd, _strings[i].data(), len)) {
+            return false;
+        }
+    }
+    auto head = _head.load(std::memory_order_relaxed);
+    auto tail = _tail.load(std::memory_order_acquire);
+    auto pos = head % _capacity;
+    uint64_t first = std::min<uint64_t>(tail - head, _capacity - pos);
+    uint64_t second = tail - head - first;
+    return write_fully(fd, &first, sizeof(first)) && write_fully(fd, _buf.get() + pos, first)
+            && write_fully(fd, &second, sizeof(second)) && write_fully(fd, _buf.get(), second);
+}
+
+// The rings of live threads, which unregister theirs when they exit
+static std::mutex binary_rings_mutex;
+static std::vector<binary_log_ring*> binary_rings;
+static binary_log_options binary_opts;
+
+struct binary_log_ring_holder {
+    std::unique_ptr<binary_log_ring> ring;
+    ~binary_log_ring_holder() {
+        if (ring) {
+            std::lock_guard<std::mutex> g(binary_rings_mutex);
+            binary_rings.erase(std::find(binary_rings.begin(), binary_rings.end(), ring.get()));
+        }
+    }
+};
+
+static thread_local binary_log_ring_holder local_binary_ring;
+static thread_local std::vector<char> binary_scratch;
+
+void async_log_writer::configure(const async_log_options& opts) {
+    std::lock_guard<std::mutex> cg(_consume_mutex);
+    std::lock_guard<std::mutex> g(_mutex);
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    if (!opts.file.empty()) {
+        _fd = ::open(opts.file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (_fd == -1) {
+            throw std::system_error(errno, std::system_category(), "could not open log file " + opts.file);
+        }
+    }
+    _opts = opts;
+}
+
+void async_log_writer::push(int syslog_level, uint8_t destinations, size_t syslog_offset, const std::string& msg) {
+    if (!local_log_ring) {
+        std::lock_guard<std::mutex> g(_mutex);
+        local_log_ring = std::make_shared<log_ring>(_opts.ring_size);
+        _rings.push_back(local_log_ring);
+    }
+    local_log_ring->push(syslog_level, destinations, syslog_offset, msg);
+    // Pairs with the fence in run(): either the writer sees the record
+    // before it sleeps, or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> g(_mutex);
+        _wake.notify_one();
+    }
+}
+
+uint64_t async_log_writer::dropped() {
+    std::lock_guard<std::mutex> g(_mutex);
+    uint64_t n = _retired_dropped;
+    for (auto& r : _rings) {
+        n += r->dropped();
+    }
+    return n;
+}
+
+void async_log_writer::write_out() {
+    if (_out.empty()) {
+        return;
+    }
+    if (_fd != -1) {
+        auto p = _out.data();
+        auto n = _out.size();
+        while (n) {
+            auto r = ::write(_fd, p, n);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                ++logging_failures;
+                break;
+            }
+            p += r;
+            n -= r;
+        }
+    }
+    _out.clear();
+}
+
+// Tells of records dropped since the last pass, where stdout records go
+// and to the file
+bool async_log_writer::report_dropped() {
+    auto dropped = this->dropped();
+    if (dropped == _reported_dropped) {
+        return false;
+    }
+    auto msg = sprint("WARN  log - %d records dropped, the asynchronous log ring was full\n", dropped - _reported_dropped);
+    _reported_dropped = dropped;
+    fwrite(msg.data(), 1, msg.size(), stdout);
+    if (_fd != -1) {
+        _out.append(msg.data(), msg.size());
+    }
+    return true;
+}
+
+bool async_log_writer::drain() {
+    std::vector<std::shared_ptr<log_ring>> rings;
+    {
+        std::lock_guard<std::mutex> g(_mutex);
+        // Rings of threads that exited go once they are read
+        _rings.erase(std::remove_if(_rings.begin(), _rings.end(), [this] (const std::shared_ptr<log_ring>& r) {
+            if (r.use_count() == 1 && r->empty()) {
+                _retired_dropped += r->dropped();
+                return true;
+            }
+            return false;
+        }), _rings.end());
+        rings = _rings;
+    }
+    bool any = false;
+    bool stdout_written = false;
+    for (auto& r : rings) {
+        any |= r->consume([&] (int syslog_level, uint8_t destinations, size_t syslog_offset, const char* msg, size_t size) {
+            if (destinations & to_stdout) {
+                fwrite(msg, 1, size, stdout);
+                stdout_written = true;
+            }
+            if (destinations & to_syslog) {
+                syslog(syslog_level, "%.*s", int(size - syslog_offset), msg + syslog_offset);
+            }
+            if (_fd != -1) {
+                _out.append(msg, size);
+            }
+        });
+    }
+    stdout_written |= report_dropped();
+    if (stdout_written) {
+        fflush(stdout);
+    }
+    write_out();
+    return any;
+}
+
+void async_log_writer::run() {
+    // Signals are for the reactor threads to handle
+    sigset_t sigs;
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+    for (;;) {
+        bool any;
+        {
+            std::lock_guard<std::mutex> g(_consume_mutex);
+            any = drain();
+        }
+        if (any) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool empty = std::all_of(_rings.begin(), _rings.end(), [] (const std::shared_ptr<log_ring>& r) {
+            return r->empty();
+        });
+        if (empty) {
+            // Also wakes up now and then to report drops
+            _wake.wait_for(lock, std::chrono::seconds(1));
+        }
+        _sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+}
 
 logger::logger(sstring name) : _name(std::move(name)) {
     logger_registry().register_logger(this);
@@ -81,10 +527,12 @@ logger::~logger() {
 }
 
 void
-logger::really_do_log(log_level level, const char* fmt, stringer** s, size_t n) {
+logger::really_do_log(log_level level, uint64_t suppressed, const char* fmt, stringer** s, size_t n) {
     bool is_stdout_enabled = _stdout.load(std::memory_order_relaxed);
     bool is_syslog_enabled = _syslog.load(std::memory_order_relaxed);
-    if(!is_stdout_enabled && !is_syslog_enabled) {
+    // The asynchronous mode may also write to a file
+    bool is_async = _async.load(std::memory_order_acquire);
+    if(!is_stdout_enabled && !is_syslog_enabled && !is_async) {
       return;
     }
     int syslog_offset = 0;
@@ -98,7 +546,7 @@ logger::really_do_log(log_level level, const char* fmt, stringer** s, size_t n)
     };
     out << level_map[int(level)];
     syslog_offset += 5;
-    if (_stdout.load(std::memory_order_relaxed)) {
+    if (is_stdout_enabled || is_async) {
         auto now = std::chrono::system_clock::now();
         auto residual_millis =
                 std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
@@ -132,33 +580,75 @@ logger::really_do_log(log_level level, const char* fmt, stringer** s, size_t n)
             out << *p++;
         }
     }
+    if (suppressed) {
+        out << " (" << suppressed << " similar messages suppressed)";
+    }
     out << "\n";
     auto msg = out.str();
+    static array_map<int, 20> syslog_level_map = {
+            { int(log_level::debug), LOG_DEBUG },
+            { int(log_level::info), LOG_INFO },
+            { int(log_level::trace), LOG_DEBUG },  // no LOG_TRACE
+            { int(log_level::warn), LOG_WARNING },
+            { int(log_level::error), LOG_ERR },
+    };
+    if (is_async) {
+        uint8_t destinations = (is_stdout_enabled ? to_stdout : 0) | (is_syslog_enabled ? to_syslog : 0);
+        log_writer->push(syslog_level_map[int(level)], destinations, syslog_offset, msg);
+        return;
+    }
     if (is_stdout_enabled) {
         std::cout << msg;
     }
     if (is_syslog_enabled) {
-        static array_map<int, 20> level_map = {
-                { int(log_level::debug), LOG_DEBUG },
-                { int(log_level::info), LOG_INFO },
-                { int(log_level::trace), LOG_DEBUG },  // no LOG_TRACE
-                { int(log_level::warn), LOG_WARNING },
-                { int(log_level::error), LOG_ERR },
-        };
         // NOTE: syslog() can block, which will stall the reactor thread.
         //       this should be rare (will have to fill the pipe buffer
-        //       before syslogd can clear it) but can happen.  If it does,
-        //       we'll have to implement some internal buffering (which
-        //       still means the problem can happen, just less frequently).
+        //       before syslogd can clear it) but can happen; the
+        //       asynchronous mode avoids it.
         // syslog() interprets % characters, so send msg as a parameter
-        syslog(level_map[int(level)], "%s", msg.c_str() + syslog_offset);
+        syslog(syslog_level_map[int(level)], "%s", msg.c_str() + syslog_offset);
     }
 }
 
+logger::binary_encoder::binary_encoder() : _buf(binary_scratch) {
+    _buf.clear();
+}
+
+void
+logger::binary_encoder::put_text(const char* s, size_t n) {
+    _buf.push_back('s');
+    uint32_t len = n;
+    put_raw(&len, sizeof(len));
+    put_raw(s, n);
+}
+
+void
+logger::binary_encoder::put_formatted(stringer& s) {
+    std::ostringstream out;
+    try {
+        s.append(out);
+    } catch (...) {
+        out << '<' << std::current_exception() << '>';
+    }
+    auto text = out.str();
+    put_text(text.data(), text.size());
+}
+
+void
+logger::do_log_binary(log_level level, const char* fmt, size_t nargs, const binary_encoder& e) {
+    auto& ring = local_binary_ring.ring;
+    if (!ring) {
+        std::lock_guard<std::mutex> g(binary_rings_mutex);
+        ring = std::make_unique<binary_log_ring>(binary_opts.ring_size);
+        binary_rings.push_back(ring.get());
+    }
+    ring->push(level, fmt, _name, nargs, e.bytes());
+}
+
 void logger::failed_to_log(std::exception_ptr ex)
 {
     try {
-        do_log(log_level::error, "failed to log message: {}", ex);
+        do_log(log_level::error, 0, "failed to log message: {}", ex);
     } catch (...) {
         ++logging_failures;
     }
@@ -174,6 +664,60 @@ logger::set_syslog_enabled(bool enabled) {
     _syslog.store(enabled, std::memory_order_relaxed);
 }
 
+void
+logger::set_async_enabled(bool enabled, const async_log_options& opts) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> g(mutex);
+    if (enabled) {
+        if (!log_writer) {
+            log_writer = new async_log_writer(opts);
+            std::atexit([] {
+                log_writer->flush();
+            });
+        } else {
+            log_writer->configure(opts);
+        }
+        _async.store(true, std::memory_order_release);
+    } else if (log_writer) {
+        _async.store(false, std::memory_order_relaxed);
+        log_writer->flush();
+    }
+}
+
+uint64_t
+logger::async_dropped() {
+    return log_writer ? log_writer->dropped() : 0;
+}
+
+void
+logger::set_binary_enabled(bool enabled, const binary_log_options& opts) {
+    std::lock_guard<std::mutex> g(binary_rings_mutex);
+    if (enabled) {
+        binary_opts = opts;
+    }
+    _binary.store(enabled, std::memory_order_relaxed);
+}
+
+void
+logger::dump_binary_log() noexcept {
+    // Takes no locks, since the process may have crashed holding them
+    if (binary_opts.dump_file.empty()) {
+        return;
+    }
+    int fd = ::open(binary_opts.dump_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    if (write_fully(fd, "SSBLOG01", 8)) {
+        for (auto ring : binary_rings) {
+            if (!ring->dump(fd)) {
+                break;
+            }
+        }
+    }
+    ::close(fd);
+}
+
 void
 log_registry::set_all_loggers_level(log_level level) {
     std::lock_guard<std::mutex> g(_mutex);
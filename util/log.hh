@@ -26,7 +26,11 @@
 #include <exception>
 #include <iosfwd>
 #include <atomic>
+#include <chrono>
+#include <cstring>
 #include <mutex>
+#include <type_traits>
+#include <vector>
 #include <boost/lexical_cast.hpp>
 
 
@@ -66,6 +70,24 @@ namespace seastar {
 class logger;
 class log_registry;
 
+/// Options of the asynchronous log mode, see \ref logger::set_async_enabled()
+struct async_log_options {
+    /// Bytes of formatted records each thread may have waiting for the
+    /// writer thread; records that do not fit are dropped, and counted
+    size_t ring_size = 1 << 20;
+    /// A file to append records to as well, if not empty
+    sstring file;
+};
+
+/// Options of the binary log mode, see \ref logger::set_binary_enabled()
+struct binary_log_options {
+    /// Bytes of records each thread keeps; the oldest are overwritten
+    size_t ring_size = 1 << 20;
+    /// Where \ref logger::dump_binary_log() writes the records, if not
+    /// empty
+    sstring dump_file;
+};
+
 /// \brief Logger class for stdout or syslog.
 ///
 /// Java style api for logging.
@@ -81,6 +103,8 @@ class logger {
     std::atomic<log_level> _level = { log_level::info };
     static std::atomic<bool> _stdout;
     static std::atomic<bool> _syslog;
+    static std::atomic<bool> _async;
+    static std::atomic<bool> _binary;
 private:
     struct stringer {
         // no need for virtual dtor, since not dynamically destroyed
@@ -94,11 +118,118 @@ class logger {
             os << arg;
         }
     };
+    // Encodes the arguments of a binary record, into a buffer of the
+    // thread's: each is a tag byte followed by its value, integers and
+    // floating point numbers as 8 bytes, and anything else as the length
+    // and bytes of its text
+    class binary_encoder {
+        std::vector<char>& _buf;
+    private:
+        void put_raw(const void* p, size_t n) {
+            auto c = static_cast<const char*>(p);
+            _buf.insert(_buf.end(), c, c + n);
+        }
+        template <typename T>
+        void put_number(char tag, T v) {
+            _buf.push_back(tag);
+            put_raw(&v, sizeof(v));
+        }
+        void put_text(const char* s, size_t n);
+        void put_formatted(stringer& s);
+    public:
+        binary_encoder();
+        const std::vector<char>& bytes() const {
+            return _buf;
+        }
+        template <typename T>
+        std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value> put(T v) {
+            put_number('i', int64_t(v));
+        }
+        template <typename T>
+        std::enable_if_t<std::is_integral<T>::value && std::is_unsigned<T>::value> put(T v) {
+            put_number('u', uint64_t(v));
+        }
+        template <typename T>
+        std::enable_if_t<std::is_floating_point<T>::value> put(T v) {
+            put_number('f', double(v));
+        }
+        // Streams print these as characters
+        void put(char c) {
+            put_text(&c, 1);
+        }
+        void put(signed char c) {
+            put_text(reinterpret_cast<const char*>(&c), 1);
+        }
+        void put(unsigned char c) {
+            put_text(reinterpret_cast<const char*>(&c), 1);
+        }
+        void put(const char* s) {
+            put_text(s, strlen(s));
+        }
+        void put(const sstring& s) {
+            put_text(s.data(), s.size());
+        }
+        void put(const std::string& s) {
+            put_text(s.data(), s.size());
+        }
+        template <typename T>
+        std::enable_if_t<!std::is_arithmetic<T>::value> put(const T& v) {
+            stringer_for<T> s(v);
+            put_formatted(s);
+        }
+    };
     template <typename... Args>
-    void do_log(log_level level, const char* fmt, Args&&... args);
-    void really_do_log(log_level level, const char* fmt, stringer** stringers, size_t n);
+    void do_log(log_level level, uint64_t suppressed, const char* fmt, Args&&... args);
+    void really_do_log(log_level level, uint64_t suppressed, const char* fmt, stringer** stringers, size_t n);
+    void do_log_binary(log_level level, const char* fmt, size_t nargs, const binary_encoder& e);
     void failed_to_log(std::exception_ptr ex);
 public:
+    /// \brief Limits how often a call site logs.
+    ///
+    /// A token bucket holding up to \c burst messages, refilled at one
+    /// per \c interval. Messages logged through it while it is empty are
+    /// dropped before their arguments are formatted, and counted; the
+    /// next message logged tells how many were suppressed.
+    ///
+    /// Keep one per call site, thread_local, as in:
+    /// \code {.cpp}
+    /// static thread_local logger::rate_limit rl(std::chrono::seconds(1));
+    /// logger.warn(rl, "connection from {} reset", addr);
+    /// \endcode
+    class rate_limit {
+        using clock = std::chrono::steady_clock;
+        clock::duration _interval;
+        unsigned _burst;
+        unsigned _tokens;
+        clock::time_point _refilled;
+        uint64_t _suppressed = 0;
+    public:
+        explicit rate_limit(clock::duration interval, unsigned burst = 1)
+            : _interval(interval), _burst(burst), _tokens(burst), _refilled(clock::now()) {}
+    private:
+        // Takes a token, or counts a suppressed message
+        bool take() {
+            if (!_tokens) {
+                auto now = clock::now();
+                auto n = (now - _refilled) / _interval;
+                if (n >= _burst) {
+                    _tokens = _burst;
+                    _refilled = now;
+                } else if (n > 0) {
+                    _tokens = n;
+                    _refilled += n * _interval;
+                }
+            }
+            if (!_tokens) {
+                ++_suppressed;
+                return false;
+            }
+            --_tokens;
+            return true;
+        }
+        friend class logger;
+    };
+
     explicit logger(sstring name);
     logger(logger&& x);
     ~logger();
@@ -120,7 +251,27 @@ class logger {
     void log(log_level level, const char* fmt, Args&&... args) {
         if (is_enabled(level)) {
             try {
-                do_log(level, fmt, std::forward<Args>(args)...);
+                do_log(level, 0, fmt, std::forward<Args>(args)...);
+            } catch (...) {
+                failed_to_log(std::current_exception());
+            }
+        }
+    }
+
+    /// logs to desired level if enabled and rl allows it, otherwise we
+    /// ignore the log line without formatting it
+    ///
+    /// \param rl - the rate limit of the call site
+    /// \param fmt - printf style format
+    /// \param args - args to print string
+    ///
+    template <typename... Args>
+    void log(log_level level, rate_limit& rl, const char* fmt, Args&&... args) {
+        if (is_enabled(level) && rl.take()) {
+            auto suppressed = rl._suppressed;
+            rl._suppressed = 0;
+            try {
+                do_log(level, suppressed, fmt, std::forward<Args>(args)...);
             } catch (...) {
                 failed_to_log(std::current_exception());
             }
@@ -137,6 +288,11 @@ class logger {
     void error(const char* fmt, Args&&... args) {
         log(log_level::error, fmt, std::forward<Args>(args)...);
     }
+    /// Log with error tag, rate limited by rl
+    template <typename... Args>
+    void error(rate_limit& rl, const char* fmt, Args&&... args) {
+        log(log_level::error, rl, fmt, std::forward<Args>(args)...);
+    }
     /// Log with warning tag:
     /// WARN  %Y-%m-%d %T,%03d [shard 0] - "your msg" \n
     ///
@@ -147,6 +303,11 @@ class logger {
     void warn(const char* fmt, Args&&... args) {
         log(log_level::warn, fmt, std::forward<Args>(args)...);
     }
+    /// Log with warn tag, rate limited by rl
+    template <typename... Args>
+    void warn(rate_limit& rl, const char* fmt, Args&&... args) {
+        log(log_level::warn, rl, fmt, std::forward<Args>(args)...);
+    }
     /// Log with info tag:
     /// INFO  %Y-%m-%d %T,%03d [shard 0] - "your msg" \n
     ///
@@ -157,6 +318,11 @@ class logger {
     void info(const char* fmt, Args&&... args) {
         log(log_level::info, fmt, std::forward<Args>(args)...);
     }
+    /// Log with info tag, rate limited by rl
+    template <typename... Args>
+    void info(rate_limit& rl, const char* fmt, Args&&... args) {
+        log(log_level::info, rl, fmt, std::forward<Args>(args)...);
+    }
     /// Log with info tag:
     /// DEBUG  %Y-%m-%d %T,%03d [shard 0] - "your msg" \n
     ///
@@ -167,6 +333,11 @@ class logger {
     void debug(const char* fmt, Args&&... args) {
         log(log_level::debug, fmt, std::forward<Args>(args)...);
     }
+    /// Log with debug tag, rate limited by rl
+    template <typename... Args>
+    void debug(rate_limit& rl, const char* fmt, Args&&... args) {
+        log(log_level::debug, rl, fmt, std::forward<Args>(args)...);
+    }
     /// Log with trace tag:
     /// TRACE  %Y-%m-%d %T,%03d [shard 0] - "your msg" \n
     ///
@@ -177,6 +348,11 @@ class logger {
     void trace(const char* fmt, Args&&... args) {
         log(log_level::trace, fmt, std::forward<Args>(args)...);
     }
+    /// Log with trace tag, rate limited by rl
+    template <typename... Args>
+    void trace(rate_limit& rl, const char* fmt, Args&&... args) {
+        log(log_level::trace, rl, fmt, std::forward<Args>(args)...);
+    }
 
     /// \return name of the logger. Usually one logger per module
     ///
@@ -205,6 +381,39 @@ class logger {
     ///       this should be rare (will have to fill the pipe buffer
     ///       before syslogd can clear it) but can happen.
     static void set_syslog_enabled(bool enabled);
+
+    /// Hands formatted records to a writer thread, which writes them to
+    /// stdout, syslog and the file of opts in batches, instead of writing
+    /// them on the logging thread, where a blocking write would stall the
+    /// reactor. Each thread queues its records in a ring of its own,
+    /// without taking locks. Records are still written in order per
+    /// thread, but not across threads. Default is false.
+    ///
+    /// Disabling waits for the queued records to be written, as does
+    /// process exit.
+    static void set_async_enabled(bool enabled, const async_log_options& opts = async_log_options());
+
+    /// \return how many records were dropped because the ring of the
+    /// thread logging them was full
+    static uint64_t async_dropped();
+
+    /// Records debug and trace messages in binary instead of formatting
+    /// them: each is kept as the id of its format string and the values
+    /// of its arguments, in a ring of the logging thread's that keeps the
+    /// latest ones, for \ref dump_binary_log() to write out and
+    /// scripts/binlog_decode.py to format. Arguments other than numbers
+    /// and strings are still formatted when logged. Messages of other
+    /// levels are logged as usual. Default is false.
+    ///
+    /// Whether a message is logged still depends on its logger's level,
+    /// which needs to be debug or trace for these to be recorded.
+    static void set_binary_enabled(bool enabled, const binary_log_options& opts = binary_log_options());
+
+    /// Writes the binary records of all threads to the dump file of the
+    /// binary log options, replacing it, if binary logging was enabled.
+    /// Safe to call from a signal handler; the reactor calls it when the
+    /// process crashes.
+    static void dump_binary_log() noexcept;
 };
 
 /// \brief used to keep a static registry of loggers
@@ -276,10 +485,16 @@ class logger_for : public logger {
 
 template <typename... Args>
 void
-logger::do_log(log_level level, const char* fmt, Args&&... args) {
+logger::do_log(log_level level, uint64_t suppressed, const char* fmt, Args&&... args) {
+    if (level >= log_level::debug && _binary.load(std::memory_order_relaxed)) {
+        binary_encoder e;
+        (void)std::initializer_list<int>{(e.put(args), 0)...};
+        do_log_binary(level, fmt, sizeof...(Args), e);
+        return;
+    }
     [&](auto&&... stringers) {
         stringer* s[sizeof...(stringers)] = {&stringers...};
-        this->really_do_log(level, fmt, s, sizeof...(stringers));
+        this->really_do_log(level, suppressed, fmt, s, sizeof...(stringers));
     } (stringer_for<Args>(std::forward<Args>(args))...);
 }
 